@@ -12,6 +12,7 @@
 
 void print_cpuinfo(void);
 void show_mapping(pgdir_t pgdir, uintptr_t start, size_t size);
+bool arch_get_random_seed(uint64_t *val);
 void backtrace(void);
 
 static __inline void breakpoint(void)
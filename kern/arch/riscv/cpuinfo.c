@@ -24,6 +24,12 @@ print_cpuinfo(void)
 	cprintf("CPU Info: RISC-V %s\n", name);
 }
 
+/* No hardware RNG */
+bool arch_get_random_seed(uint64_t *val)
+{
+	return FALSE;
+}
+
 #warning "convert pgdir* to pgdir_t"
 void show_mapping(pgdir_t *pt, uintptr_t start, size_t size)
 {
@@ -88,6 +88,13 @@ void restore_fp_state(ancillary_state_t* silly)
 	mtpcr(PCR_SR, sr);
 }
 
+/* No cheap way to tell if the FP regs are in use, so we always save them. */
+size_t save_fp_state_lazy(ancillary_state_t *silly)
+{
+	save_fp_state(silly);
+	return sizeof(ancillary_state_t);
+}
+
 void init_fp_state(void)
 {
 	uintptr_t sr = enable_fp();
@@ -166,3 +173,9 @@ env_pagetable_free(env_t* e)
 	assert(user_mem_walk_recursive(e, 0, KERNBASE, NULL, NULL,
 	                               pt_free, NULL, e->env_pgdir, 0) == 0);
 }
+
+size_t
+env_pagetable_bytes(env_t* e)
+{
+	return 0;
+}
@@ -38,6 +38,11 @@ static inline bool pte_is_mapped(pte_t pte)
 	return !PAGE_UNMAPPED(*(kpte_t*)pte);
 }
 
+static inline bool pte_is_cow(pte_t pte)
+{
+	return *(kpte_t*)pte & PTE_COW ? TRUE : FALSE;
+}
+
 static inline bool pte_is_paged_out(pte_t pte)
 {
 	return PAGE_PAGED_OUT(*(kpte_t*)pte);
@@ -109,7 +114,7 @@ static inline bool pte_has_perm_urw(pte_t pte)
  * Other OSs (x86) may include others. */
 static inline int pte_get_settings(pte_t pte)
 {
-	return *(kpte_t*)pte & PTE_PERM;
+	return *(kpte_t*)pte & (PTE_PERM | PTE_COW);
 }
 
 static inline void pte_replace_perm(pte_t pte, int perm)
@@ -65,3 +65,11 @@ void __abandon_core(void)
 	proc_decref(pcpui->cur_proc);
 	pcpui->cur_proc = 0;
 }
+
+void __arch_proc_startcore(struct proc *p, uint32_t vcoreid)
+{
+}
+
+void __arch_proc_free(struct proc *p)
+{
+}
@@ -36,6 +36,13 @@ send_ipi(uint32_t who, uint8_t vector)
 	mtpcr(PCR_SEND_IPI, who);
 }
 
+static __inline void
+send_ipi_multi(uint32_t *os_coreids, uint32_t nr, uint8_t vector)
+{
+	for (int i = 0; i < nr; i++)
+		send_ipi(os_coreids[i], vector);
+}
+
 static __inline void
 send_broadcast_ipi(uint8_t vector)
 {
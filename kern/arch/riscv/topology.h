@@ -8,3 +8,6 @@
  * riscv. */
 static void topology_init(void) {}
 static void print_cpu_topology(void) {}
+#define num_numa_nodes 1
+static inline int numa_id(void) { return 0; }
+static inline int paddr_to_numa_id(uintptr_t paddr) { return 0; }
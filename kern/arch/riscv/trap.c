@@ -370,6 +370,20 @@ int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
 	return -1;
 }
 
+int register_irq_core(int irq, isr_t handler, void *irq_arg, uint32_t tbdf,
+                      int os_coreid)
+{
+	printk("%s not implemented\n", __FUNCTION);
+	return -1;
+}
+
+int register_irq_vector(int irq, isr_t handler, void *irq_arg, uint32_t tbdf,
+                        int os_coreid)
+{
+	printk("%s not implemented\n", __FUNCTION);
+	return -1;
+}
+
 int route_irqs(int cpu_vec, int coreid)
 {
 	printk("%s not implemented\n", __FUNCTION);
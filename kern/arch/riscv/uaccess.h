@@ -82,6 +82,15 @@ static inline int copy_from_user(void *dst, const void *src,
 	return err;
 }
 
+static inline int cmpxchg_user_u64(uint64_t *uaddr, uint64_t old, uint64_t new,
+                                   uint64_t *prev)
+{
+#warning "The cmpxchg_user_u64() API is a stub and should be re-implemented"
+
+	*prev = __sync_val_compare_and_swap(uaddr, old, new);
+	return 0;
+}
+
 static inline uintptr_t ex_insn_addr(const struct extable_ip_fixup *x)
 {
 	return (uintptr_t) &x->insn + x->insn;
@@ -6,6 +6,8 @@
 
 /* Arch Constants */
 #define ARCH_CL_SIZE				 64
+/* Max range, in pages, that tlb_flush_range() flushes with INVLPG */
+#define TLB_INVLPG_MAX_PGS			 32
 
 /* Used by arch/bitops.h.  Everyone else (so far) does it manually, but maybe
  * other Linux code will use this.  We need to say both inline and apply the
@@ -36,13 +38,16 @@ static inline void swap_gs(void);
 
 /* in trap.c */
 void send_ipi(uint32_t os_coreid, uint8_t vector);
+void send_ipi_multi(uint32_t *os_coreids, uint32_t nr, uint8_t vector);
 /* in cpuinfo.c */
 void print_cpuinfo(void);
 void show_mapping(pgdir_t pgdir, uintptr_t start, size_t size);
 int vendor_id(char *);
+bool arch_get_random_seed(uint64_t *val);
 /* pmap.c */
 void invlpg(void *addr);
 void tlbflush(void);
+void tlb_flush_range(uintptr_t start, uintptr_t end);
 void tlb_flush_global(void);
 
 static inline void breakpoint(void)
@@ -140,14 +140,28 @@ void print_cpuinfo(void)
 		printk("Invariant TSC not present\n");
 	cpuid(0x07, 0x0, &eax, &ebx, &ecx, &edx);
 	if (ebx & 0x00000001) {
+		#ifdef CONFIG_FSGSBASE
 		printk("FS/GS Base RD/W supported\n");
 		cpu_set_feat(CPU_FEAT_X86_FSGSBASE);
+		#else
+		printk("FS/GS Base RD/W supported, but disabled\n");
+		#endif
 	} else {
 		printk("FS/GS Base RD/W not supported\n");
 		#ifdef CONFIG_NOFASTCALL_FSBASE
 		panic("Can't write FS Base from userspace, and no FASTCALL support!");
 		#endif
 	}
+	/* ADCX/ADOX: two independent carry chains, used by ptclbsum */
+	if (ebx & (1 << 19))
+		cpu_set_feat(CPU_FEAT_X86_ADX);
+	/* Enhanced rep movsb/stosb: memcpy and memset use them */
+	if (ebx & (1 << 9)) {
+		printk("ERMS supported\n");
+		cpu_set_feat(CPU_FEAT_X86_ERMS);
+	}
+	if (ebx & (1 << 18))
+		cpu_set_feat(CPU_FEAT_X86_RDSEED);
 	cpuid(0x80000001, 0x0, &eax, &ebx, &ecx, &edx);
 	if (edx & (1 << 27)) {
 		printk("RDTSCP supported\n");
@@ -175,17 +189,51 @@ void print_cpuinfo(void)
 	#define CPUID_FXSR_SUPPORT          (1 << 24)
 	#define CPUID_XSAVE_SUPPORT         (1 << 26)
 	#define CPUID_XSAVEOPT_SUPPORT      (1 << 0)
+	#define CPUID_XINUSE_SUPPORT        (1 << 2)
+	#define CPUID_RDRAND_SUPPORT        (1 << 30)
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, &edx);
 	if (CPUID_FXSR_SUPPORT & edx)
 		cpu_set_feat(CPU_FEAT_X86_FXSR);
 	if (CPUID_XSAVE_SUPPORT & ecx)
 		cpu_set_feat(CPU_FEAT_X86_XSAVE);
+	if (CPUID_RDRAND_SUPPORT & ecx)
+		cpu_set_feat(CPU_FEAT_X86_RDRAND);
 
 	cpuid(0x0d, 0x01, &eax, 0, 0, 0);
 	if (CPUID_XSAVEOPT_SUPPORT & eax)
 		cpu_set_feat(CPU_FEAT_X86_XSAVEOPT);
+	if (CPUID_XINUSE_SUPPORT & eax)
+		cpu_set_feat(CPU_FEAT_X86_XINUSE);
+
+}
+
+/* Both instructions can fail transiently, when the hardware's entropy is
+ * drained.  Intel suggests retrying RDRAND 10 times. */
+#define RDRAND_RETRIES 10
 
+/* Gets 64 bits from the hardware RNG, preferring RDSEED, which comes straight
+ * from the entropy source, over RDRAND, which is a DRBG seeded from it. */
+bool arch_get_random_seed(uint64_t *val)
+{
+	uint8_t ok;
+
+	if (cpu_has_feat(CPU_FEAT_X86_RDSEED)) {
+		for (int i = 0; i < RDRAND_RETRIES; i++) {
+			asm volatile ("rdseed %0; setc %1" : "=r"(*val), "=qm"(ok));
+			if (ok)
+				return TRUE;
+			cpu_relax();
+		}
+	}
+	if (cpu_has_feat(CPU_FEAT_X86_RDRAND)) {
+		for (int i = 0; i < RDRAND_RETRIES; i++) {
+			asm volatile ("rdrand %0; setc %1" : "=r"(*val), "=qm"(ok));
+			if (ok)
+				return TRUE;
+		}
+	}
+	return FALSE;
 }
 
 #define BIT_SPACING "        "
@@ -408,7 +408,6 @@ static long arch_perf_write(struct perf_context *pc, const void *udata,
 			int i;
 			uint32_t ped;
 			uint8_t *rptr;
-			uint64_t *mvalues;
 			struct perfmon_status *pef;
 
 			error_assert(EBADMSG, (kptr + sizeof(uint32_t)) <= ktop);
@@ -416,12 +415,8 @@ static long arch_perf_write(struct perf_context *pc, const void *udata,
 
 			pef = perfmon_get_event_status(pc->ps, (int) ped);
 
-			mvalues = kzmalloc(num_cores * sizeof(mvalues), KMALLOC_WAIT);
-			for (i = 0; i < num_cores; i++)
-				mvalues[i] = pef->cores_values[i];
-
 			pc->resp_size = 3 * sizeof(uint64_t) + sizeof(uint32_t) +
-				num_cores * sizeof(uint64_t);
+				3 * num_cores * sizeof(uint64_t);
 			pc->resp = kmalloc(pc->resp_size, KMALLOC_WAIT);
 
 			rptr = put_le_u64(pc->resp, pef->ev.event);
@@ -429,8 +424,11 @@ static long arch_perf_write(struct perf_context *pc, const void *udata,
 			rptr = put_le_u64(rptr, pef->ev.trigger_count);
 			rptr = put_le_u32(rptr, num_cores);
 			for (i = 0; i < num_cores; i++)
-				rptr = put_le_u64(rptr, mvalues[i]);
-			kfree(mvalues);
+				rptr = put_le_u64(rptr, pef->cores_values[i].value);
+			for (i = 0; i < num_cores; i++)
+				rptr = put_le_u64(rptr, pef->cores_values[i].enabled_ns);
+			for (i = 0; i < num_cores; i++)
+				rptr = put_le_u64(rptr, pef->cores_values[i].running_ns);
 			perfmon_free_event_status(pef);
 			break;
 		}
@@ -4,8 +4,10 @@
 #include <smp.h>
 #include <arch/x86.h>
 #include <arch/pci.h>
+#include <arch/iommu.h>
 #include <arch/console.h>
 #include <arch/perfmon.h>
+#include <arch/rdt.h>
 #include <arch/init.h>
 #include <console.h>
 #include <monitor.h>
@@ -21,6 +23,7 @@
  *	per-cpu init.
  */
 uint64_t x86_default_xcr0;
+uint32_t x86_xstate_sizes[X86_NR_XSTATE];
 struct ancillary_state x86_default_fpu;
 uint32_t kerndate;
 
@@ -113,6 +116,13 @@ void ancillary_state_init(void)
 		lcr4(rcr4() | CR4_OSXSAVE);
 		lxcr0(x86_default_xcr0);
 
+		/* Sizes of the extended components, for counting bytes saved.  x87
+		 * and SSE are in the legacy region. */
+		for (int i = 2; i < X86_NR_XSTATE; i++) {
+			if (x86_default_xcr0 & (1ULL << i))
+				cpuid(0x0d, i, &x86_xstate_sizes[i], 0, 0, 0);
+		}
+
 		/*
 		 * Build a default set of extended state values that we can later use
 		 * to initialize extended state on other cores, or restore on this
@@ -212,8 +222,10 @@ void arch_init(void)
 {
 	ancillary_state_init();
 	pci_init();
+	iommu_init();
 	vmm_init();
 	perfmon_global_init();
+	rdt_init();
 	// this returns when all other cores are done and ready to receive IPIs
 	#ifdef CONFIG_SINGLE_CORE
 		smp_percpu_init();
@@ -0,0 +1,660 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Intel VT-d DMA remapping.  See iommu.h for the interface.
+ *
+ * Every remapping unit gets the same root and context tables, covering all of
+ * the PCI buses we found, so we don't need to work out which unit's scope a
+ * device is in: a device's context entry says the same thing in every unit.
+ * All units also share one page table format (3 or 4 levels, whatever they all
+ * support), so a domain's page table works for any of them.
+ *
+ * We use the register-based invalidation interface.  Invalidations are
+ * batched (see iommu_unmap()), so there are few enough of them that the queued
+ * interface wouldn't buy much. */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <kmalloc.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <mm.h>
+#include <smp.h>
+#include <acpi.h>
+#include <bitmask.h>
+#include <arch/arch.h>
+#include <arch/pci.h>
+#include <arch/iommu.h>
+
+/* Remapping unit registers */
+#define DMAR_CAP				0x08
+#define DMAR_ECAP				0x10
+#define DMAR_GCMD				0x18
+#define DMAR_GSTS				0x1c
+#define DMAR_RTADDR				0x20
+#define DMAR_CCMD				0x28
+/* IOTLB registers, at ECAP_IRO */
+#define DMAR_IVA				0x00
+#define DMAR_IOTLB				0x08
+
+#define CAP_ND(c)				((c) & 0x7)
+#define CAP_RWBF				(1ULL << 4)
+#define CAP_CM					(1ULL << 7)
+#define CAP_SAGAW(c)			(((c) >> 8) & 0x1f)
+#define CAP_SLLPS(c)			(((c) >> 34) & 0xf)
+#define CAP_PSI					(1ULL << 39)
+#define CAP_MAMV(c)				(((c) >> 48) & 0x3f)
+
+#define ECAP_C					(1ULL << 0)
+#define ECAP_PT					(1ULL << 6)
+#define ECAP_IRO(e)				(((e) >> 8) & 0x3ff)
+
+/* GSTS has a status bit in the same place as each GCMD bit */
+#define GCMD_TE					(1U << 31)
+#define GCMD_SRTP				(1U << 30)
+#define GCMD_WBF				(1U << 27)
+/* GSTS, less the one-shot commands, which must not be written back */
+#define GSTS_PERSIST			0x96ffffff
+
+#define CCMD_ICC				(1ULL << 63)
+#define CCMD_GLOBAL				(1ULL << 61)
+
+#define IOTLB_IVT				(1ULL << 63)
+#define IOTLB_GLOBAL			(1ULL << 60)
+#define IOTLB_DOMAIN			(2ULL << 60)
+#define IOTLB_PAGE				(3ULL << 60)
+#define IOTLB_DID(d)			((uint64_t)(d) << 32)
+
+#define ROOT_P					(1ULL << 0)
+#define CTX_P					(1ULL << 0)
+#define CTX_TT_PT				(2ULL << 2)
+#define CTX_DID(d)				((uint64_t)(d) << 8)
+
+#define PTE_R					(1ULL << 0)
+#define PTE_W					(1ULL << 1)
+#define PTE_PS					(1ULL << 7)
+#define PTE_ADDR				0x000ffffffffff000ULL
+
+#define IOMMU_NR_BUSES			256
+#define IOMMU_MAX_DIDS			1024
+#define IOMMU_IDENTITY_DID		1
+#define IOMMU_SPIN				10000000
+
+struct iommu_unit {
+	uintptr_t					regs;
+	uintptr_t					iotlb_regs;
+	uint64_t					cap;
+	uint64_t					ecap;
+	spinlock_t					lock;		/* command registers */
+	uint64_t					*root;
+	uint64_t					*ctx[IOMMU_NR_BUSES];
+};
+
+struct iommu_domain {
+	spinlock_t					lock;		/* page table and pending */
+	uint16_t					did;
+	uint64_t					*pgd;
+	int							nr_devs;
+	/* Unmaps not yet flushed from the IOTLBs, and the range they cover */
+	unsigned int				nr_pending;
+	uint64_t					pend_start;
+	uint64_t					pend_end;
+};
+
+static struct iommu_unit *units;
+static int nr_units;
+static bool iommu_on;
+static int pt_levels;			/* 3 or 4 */
+static int max_leaf_level;		/* 1 (4K), 2 (2M) or 3 (1G) */
+static bool coherent;			/* all units snoop our table writes */
+static bool pass_through;		/* all units can skip translation */
+static bool caching_mode;		/* some unit caches non-present entries */
+static unsigned int nr_dids;
+static int max_bus;
+static spinlock_t iommu_lock = SPINLOCK_INITIALIZER;	/* dids, contexts */
+static DECL_BITMASK(dids, IOMMU_MAX_DIDS);
+static struct iommu_domain identity_dom;
+
+static uint32_t unit_read32(struct iommu_unit *u, int reg)
+{
+	return *(volatile uint32_t*)(u->regs + reg);
+}
+
+static void unit_write32(struct iommu_unit *u, int reg, uint32_t val)
+{
+	*(volatile uint32_t*)(u->regs + reg) = val;
+}
+
+static uint64_t unit_read64(uintptr_t base, int reg)
+{
+	return *(volatile uint64_t*)(base + reg);
+}
+
+static void unit_write64(uintptr_t base, int reg, uint64_t val)
+{
+	*(volatile uint64_t*)(base + reg) = val;
+}
+
+/* Units that don't snoop read the tables from memory. */
+static void iommu_sync(void *p)
+{
+	if (!coherent)
+		clflush(p);
+	wmb();
+}
+
+static void iommu_sync_page(void *page)
+{
+	if (!coherent) {
+		for (int i = 0; i < PGSIZE; i += ARCH_CL_SIZE)
+			clflush(page + i);
+	}
+	wmb();
+}
+
+static bool unit_spin64(uintptr_t base, int reg, uint64_t bit)
+{
+	for (int i = 0; i < IOMMU_SPIN; i++) {
+		if (!(unit_read64(base, reg) & bit))
+			return TRUE;
+		cpu_relax();
+	}
+	printk("IOMMU: timed out waiting on reg 0x%x\n", reg);
+	return FALSE;
+}
+
+/* Sets a GCMD bit and waits for its GSTS bit.  Call with u->lock held or
+ * before anyone else can see the unit. */
+static void unit_gcmd(struct iommu_unit *u, uint32_t cmd)
+{
+	uint32_t sts = unit_read32(u, DMAR_GSTS) & GSTS_PERSIST;
+
+	unit_write32(u, DMAR_GCMD, sts | cmd);
+	for (int i = 0; i < IOMMU_SPIN; i++) {
+		if (unit_read32(u, DMAR_GSTS) & cmd)
+			return;
+		cpu_relax();
+	}
+	printk("IOMMU: timed out on GCMD 0x%08x\n", cmd);
+}
+
+/* Flushes the unit's write buffer, for units that buffer table writes. */
+static void unit_flush_writes(struct iommu_unit *u)
+{
+	uint32_t sts;
+
+	if (!(u->cap & CAP_RWBF))
+		return;
+	spin_lock_irqsave(&u->lock);
+	sts = unit_read32(u, DMAR_GSTS) & GSTS_PERSIST;
+	unit_write32(u, DMAR_GCMD, sts | GCMD_WBF);
+	for (int i = 0; i < IOMMU_SPIN; i++) {
+		if (!(unit_read32(u, DMAR_GSTS) & GCMD_WBF))
+			break;
+		cpu_relax();
+	}
+	spin_unlock_irqsave(&u->lock);
+}
+
+static void unit_flush_contexts(struct iommu_unit *u)
+{
+	spin_lock_irqsave(&u->lock);
+	unit_write64(u->regs, DMAR_CCMD, CCMD_ICC | CCMD_GLOBAL);
+	unit_spin64(u->regs, DMAR_CCMD, CCMD_ICC);
+	spin_unlock_irqsave(&u->lock);
+}
+
+/* Invalidates did's translations for [addr, addr + len), or all of them if
+ * len is 0.  Page-selective invalidation covers 2^am pages aligned to their
+ * size, so a range that would need too big an am flushes the whole domain. */
+static void unit_flush_iotlb(struct iommu_unit *u, uint16_t did,
+                             uint64_t addr, uint64_t len)
+{
+	uint64_t cmd = IOTLB_IVT | IOTLB_DOMAIN | IOTLB_DID(did);
+	uint64_t iva = 0;
+	unsigned int am = 0;
+	bool psi = FALSE;
+
+	if (len && (u->cap & CAP_PSI)) {
+		while (ROUNDDOWN(addr, PGSIZE << am) + (PGSIZE << am) < addr + len)
+			am++;
+		if (am <= CAP_MAMV(u->cap)) {
+			cmd = IOTLB_IVT | IOTLB_PAGE | IOTLB_DID(did);
+			iva = ROUNDDOWN(addr, PGSIZE << am) | am;
+			psi = TRUE;
+		}
+	}
+	spin_lock_irqsave(&u->lock);
+	if (psi)
+		unit_write64(u->iotlb_regs, DMAR_IVA, iva);
+	unit_write64(u->iotlb_regs, DMAR_IOTLB, cmd);
+	unit_spin64(u->iotlb_regs, DMAR_IOTLB, IOTLB_IVT);
+	spin_unlock_irqsave(&u->lock);
+}
+
+static void unit_flush_iotlb_all(struct iommu_unit *u)
+{
+	spin_lock_irqsave(&u->lock);
+	unit_write64(u->iotlb_regs, DMAR_IOTLB, IOTLB_IVT | IOTLB_GLOBAL);
+	unit_spin64(u->iotlb_regs, DMAR_IOTLB, IOTLB_IVT);
+	spin_unlock_irqsave(&u->lock);
+}
+
+static inline int level_shift(int level)
+{
+	return PGSHIFT + 9 * (level - 1);
+}
+
+static inline uint64_t *pte_table(uint64_t pte)
+{
+	return KADDR(pte & PTE_ADDR);
+}
+
+/* Maps the biggest page we can at iova, up to len.  Returns its size, or 0 if
+ * iova is already mapped or we're out of memory. */
+static size_t __iommu_map_one(struct iommu_domain *dom, uint64_t iova,
+                              physaddr_t pa, size_t len, uint64_t perm)
+{
+	uint64_t *table = dom->pgd;
+	uint64_t *pte, *next;
+	size_t pgsz;
+
+	for (int level = pt_levels; level >= 1; level--) {
+		pte = &table[(iova >> level_shift(level)) & 0x1ff];
+		pgsz = 1ULL << level_shift(level);
+		if (!*pte && level <= max_leaf_level && len >= pgsz &&
+		    ALIGNED(iova, pgsz) && ALIGNED(pa, pgsz)) {
+			*pte = pa | perm | (level > 1 ? PTE_PS : 0);
+			iommu_sync(pte);
+			return pgsz;
+		}
+		if (level == 1 || (*pte & PTE_PS))
+			return 0;
+		if (!*pte) {
+			next = kpage_zalloc_addr();
+			if (!next)
+				return 0;
+			iommu_sync_page(next);
+			*pte = PADDR(next) | PTE_R | PTE_W;
+			iommu_sync(pte);
+		}
+		table = pte_table(*pte);
+	}
+	return 0;
+}
+
+/* Unmaps the page at iova, or skips the hole there.  Returns how far to
+ * advance, or 0 if iova is inside a large page that [iova, iova + len) only
+ * partly covers.  We don't split large pages. */
+static size_t __iommu_unmap_one(struct iommu_domain *dom, uint64_t iova,
+                                size_t len)
+{
+	uint64_t *table = dom->pgd;
+	uint64_t *pte;
+	size_t pgsz;
+
+	for (int level = pt_levels; level >= 1; level--) {
+		pte = &table[(iova >> level_shift(level)) & 0x1ff];
+		pgsz = 1ULL << level_shift(level);
+		if (!*pte)
+			return pgsz - (iova & (pgsz - 1));
+		if (level == 1 || (*pte & PTE_PS)) {
+			if (!ALIGNED(iova, pgsz) || len < pgsz)
+				return 0;
+			*pte = 0;
+			iommu_sync(pte);
+			return pgsz;
+		}
+		table = pte_table(*pte);
+	}
+	return 0;
+}
+
+/* Call with dom->lock held. */
+static void __iommu_flush(struct iommu_domain *dom)
+{
+	if (!dom->nr_pending)
+		return;
+	for (int i = 0; i < nr_units; i++)
+		unit_flush_iotlb(&units[i], dom->did, dom->pend_start,
+		                 dom->pend_end - dom->pend_start);
+	dom->nr_pending = 0;
+	dom->pend_start = UINT64_MAX;
+	dom->pend_end = 0;
+}
+
+/* Maps [iova, iova + len) to [pa, pa + len) in dom, all page aligned.  Returns
+ * 0, or -1 if any of the range was already mapped or we ran out of memory, in
+ * which case some of it may be mapped. */
+int iommu_map(struct iommu_domain *dom, uint64_t iova, physaddr_t pa,
+              size_t len, int perm)
+{
+	uint64_t end = iova + len;
+	uint64_t pte_perm = 0;
+	size_t sz;
+	int ret = 0;
+
+	if (!len || PGOFF(iova) || PGOFF(pa) || PGOFF(len) ||
+	    end > 1ULL << level_shift(pt_levels + 1) || end < iova)
+		return -1;
+	if (perm & IOMMU_READ)
+		pte_perm |= PTE_R;
+	if (perm & IOMMU_WRITE)
+		pte_perm |= PTE_W;
+	if (!pte_perm)
+		return -1;
+	spin_lock_irqsave(&dom->lock);
+	for (uint64_t addr = iova; addr < end; addr += sz, pa += sz) {
+		sz = __iommu_map_one(dom, addr, pa, end - addr, pte_perm);
+		if (!sz) {
+			ret = -1;
+			break;
+		}
+	}
+	spin_unlock_irqsave(&dom->lock);
+	for (int i = 0; i < nr_units; i++) {
+		unit_flush_writes(&units[i]);
+		/* Only a unit in caching mode can have cached the old non-present
+		 * entries. */
+		if (units[i].cap & CAP_CM)
+			unit_flush_iotlb(&units[i], dom->did, iova, len);
+	}
+	return ret;
+}
+
+/* Unmaps [iova, iova + len) from dom.  Holes are skipped.  The IOTLB is
+ * flushed later; see iommu.h.  Returns -1 if the range splits a large
+ * page, which stays mapped. */
+int iommu_unmap(struct iommu_domain *dom, uint64_t iova, size_t len)
+{
+	uint64_t end = iova + len;
+	size_t sz;
+	int ret = 0;
+
+	if (PGOFF(iova) || PGOFF(len))
+		return -1;
+	spin_lock_irqsave(&dom->lock);
+	for (uint64_t addr = iova; addr < end; addr += sz) {
+		sz = __iommu_unmap_one(dom, addr, end - addr);
+		if (!sz) {
+			ret = -1;
+			end = addr;
+			break;
+		}
+	}
+	if (end > iova) {
+		dom->pend_start = MIN(dom->pend_start, iova);
+		dom->pend_end = MAX(dom->pend_end, end);
+		if (++dom->nr_pending >= IOMMU_FLUSH_BATCH)
+			__iommu_flush(dom);
+	}
+	spin_unlock_irqsave(&dom->lock);
+	return ret;
+}
+
+/* Flushes dom's pending unmaps from the IOTLBs.  Once this returns, the
+ * devices in dom can't reach anything that was unmapped. */
+void iommu_flush(struct iommu_domain *dom)
+{
+	spin_lock_irqsave(&dom->lock);
+	__iommu_flush(dom);
+	spin_unlock_irqsave(&dom->lock);
+}
+
+static int alloc_did(void)
+{
+	int did = -1;
+
+	spin_lock(&iommu_lock);
+	for (int i = IOMMU_IDENTITY_DID + 1; i < nr_dids; i++) {
+		if (!GET_BITMASK_BIT(dids, i)) {
+			SET_BITMASK_BIT(dids, i);
+			did = i;
+			break;
+		}
+	}
+	spin_unlock(&iommu_lock);
+	return did;
+}
+
+static void free_did(int did)
+{
+	spin_lock(&iommu_lock);
+	CLR_BITMASK_BIT(dids, did);
+	spin_unlock(&iommu_lock);
+}
+
+static void free_page_table(uint64_t *table, int level)
+{
+	if (level > 1) {
+		for (int i = 0; i < NPTENTRIES; i++) {
+			if (table[i] && !(table[i] & PTE_PS))
+				free_page_table(pte_table(table[i]), level - 1);
+		}
+	}
+	page_decref(kva2page(table));
+}
+
+/* Returns a domain with nothing mapped and no devices, or NULL. */
+struct iommu_domain *iommu_domain_alloc(void)
+{
+	struct iommu_domain *dom;
+	int did;
+
+	if (!iommu_on)
+		return NULL;
+	did = alloc_did();
+	if (did < 0)
+		return NULL;
+	dom = kzmalloc(sizeof(struct iommu_domain), KMALLOC_WAIT);
+	dom->pgd = kpage_zalloc_addr();
+	if (!dom->pgd) {
+		kfree(dom);
+		free_did(did);
+		return NULL;
+	}
+	iommu_sync_page(dom->pgd);
+	spinlock_init_irqsave(&dom->lock);
+	dom->did = did;
+	dom->pend_start = UINT64_MAX;
+	return dom;
+}
+
+/* The domain's devices must have been detached. */
+void iommu_domain_free(struct iommu_domain *dom)
+{
+	assert(!dom->nr_devs);
+	/* Detaching flushed the domain, but a later unmap could be pending */
+	iommu_flush(dom);
+	free_page_table(dom->pgd, pt_levels);
+	free_did(dom->did);
+	kfree(dom);
+}
+
+static void set_context(uint64_t *ce, struct iommu_domain *dom)
+{
+	ce[1] = (pt_levels - 2) | CTX_DID(dom->did);
+	if (dom == &identity_dom && pass_through)
+		ce[0] = CTX_TT_PT | CTX_P;
+	else
+		ce[0] = PADDR(dom->pgd) | CTX_P;
+}
+
+/* Points the device's context entries at dom.  Call with iommu_lock held. */
+static void __iommu_set_domain(struct pci_device *pcidev,
+                               struct iommu_domain *dom)
+{
+	struct iommu_domain *old = pcidev->iommu_dom ?: &identity_dom;
+	struct iommu_unit *u;
+	uint64_t *ce;
+
+	for (int i = 0; i < nr_units; i++) {
+		u = &units[i];
+		ce = &u->ctx[pcidev->bus][((pcidev->dev << 3) | pcidev->func) * 2];
+		/* A present entry has to be torn down and flushed before we can
+		 * change it. */
+		ce[0] = 0;
+		iommu_sync(ce);
+		unit_flush_contexts(u);
+		unit_flush_iotlb(u, old->did, 0, 0);
+		set_context(ce, dom);
+		iommu_sync(ce);
+		unit_flush_writes(u);
+		if (u->cap & CAP_CM)
+			unit_flush_contexts(u);
+	}
+	if (old != &identity_dom)
+		old->nr_devs--;
+	if (dom != &identity_dom)
+		dom->nr_devs++;
+	pcidev->iommu_dom = dom == &identity_dom ? NULL : dom;
+}
+
+/* Moves pcidev into dom.  Its DMA then only reaches what's mapped in dom.
+ * Quiesce the device first; in-flight DMA may fault. */
+int iommu_attach_device(struct iommu_domain *dom, struct pci_device *pcidev)
+{
+	if (!iommu_on || pcidev->bus > max_bus)
+		return -1;
+	spin_lock(&iommu_lock);
+	__iommu_set_domain(pcidev, dom);
+	spin_unlock(&iommu_lock);
+	return 0;
+}
+
+/* Puts pcidev back in the identity domain. */
+void iommu_detach_device(struct pci_device *pcidev)
+{
+	if (!iommu_on || !pcidev->iommu_dom)
+		return;
+	spin_lock(&iommu_lock);
+	__iommu_set_domain(pcidev, &identity_dom);
+	spin_unlock(&iommu_lock);
+}
+
+bool iommu_enabled(void)
+{
+	return iommu_on;
+}
+
+static bool unit_probe(struct iommu_unit *u, struct Drhd *drhd)
+{
+	size_t regs_sz;
+
+	u->regs = vmap_pmem_nocache(drhd->rba, PGSIZE);
+	if (!u->regs)
+		return FALSE;
+	u->cap = unit_read64(u->regs, DMAR_CAP);
+	u->ecap = unit_read64(u->regs, DMAR_ECAP);
+	regs_sz = ROUNDUP(ECAP_IRO(u->ecap) * 16 + 16, PGSIZE);
+	if (regs_sz > PGSIZE) {
+		vunmap_vmem(u->regs, PGSIZE);
+		u->regs = vmap_pmem_nocache(drhd->rba, regs_sz);
+		if (!u->regs)
+			return FALSE;
+	}
+	u->iotlb_regs = u->regs + ECAP_IRO(u->ecap) * 16;
+	spinlock_init_irqsave(&u->lock);
+	if (unit_read32(u, DMAR_GSTS) & GCMD_TE) {
+		printk("IOMMU: unit at %p already translating, skipping VT-d\n",
+		       drhd->rba);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool unit_enable(struct iommu_unit *u)
+{
+	u->root = kpage_zalloc_addr();
+	if (!u->root)
+		return FALSE;
+	for (int bus = 0; bus <= max_bus; bus++) {
+		u->ctx[bus] = kpage_zalloc_addr();
+		if (!u->ctx[bus])
+			return FALSE;
+		for (int devfn = 0; devfn < 256; devfn++)
+			set_context(&u->ctx[bus][devfn * 2], &identity_dom);
+		iommu_sync_page(u->ctx[bus]);
+		u->root[bus * 2] = PADDR(u->ctx[bus]) | ROOT_P;
+	}
+	iommu_sync_page(u->root);
+	unit_write64(u->regs, DMAR_RTADDR, PADDR(u->root));
+	unit_gcmd(u, GCMD_SRTP);
+	unit_flush_contexts(u);
+	unit_flush_iotlb_all(u);
+	unit_gcmd(u, GCMD_TE);
+	return TRUE;
+}
+
+void iommu_init(void)
+{
+	struct pci_device *pcidev;
+	uint32_t sagaw = 0x1f, sllps = 0xf;
+
+	if (!dmar || !dmar->nchildren) {
+		printk("IOMMU: no DMAR table, DMA is untranslated\n");
+		return;
+	}
+	nr_units = dmar->nchildren;
+	units = kzmalloc(sizeof(struct iommu_unit) * nr_units, KMALLOC_WAIT);
+	STAILQ_FOREACH(pcidev, &pci_devices, all_dev)
+		max_bus = MAX(max_bus, pcidev->bus);
+	coherent = TRUE;
+	pass_through = TRUE;
+	nr_dids = IOMMU_MAX_DIDS;
+	for (int i = 0; i < nr_units; i++) {
+		struct iommu_unit *u = &units[i];
+
+		if (!unit_probe(u, dmar->children[i]->tbl))
+			goto fail;
+		sagaw &= CAP_SAGAW(u->cap);
+		sllps &= CAP_SLLPS(u->cap);
+		nr_dids = MIN(nr_dids, 1U << (4 + 2 * CAP_ND(u->cap)));
+		coherent &= !!(u->ecap & ECAP_C);
+		pass_through &= !!(u->ecap & ECAP_PT);
+		caching_mode |= !!(u->cap & CAP_CM);
+	}
+	if (sagaw & (1 << 2)) {
+		pt_levels = 4;
+	} else if (sagaw & (1 << 1)) {
+		pt_levels = 3;
+	} else {
+		printk("IOMMU: no common page table format (SAGAW 0x%x)\n", sagaw);
+		goto fail;
+	}
+	max_leaf_level = 1;
+	if (sllps & 1)
+		max_leaf_level = sllps & 2 ? 3 : 2;
+
+	spinlock_init_irqsave(&identity_dom.lock);
+	identity_dom.did = IOMMU_IDENTITY_DID;
+	identity_dom.pend_start = UINT64_MAX;
+	if (!pass_through) {
+		identity_dom.pgd = kpage_zalloc_addr();
+		if (!identity_dom.pgd)
+			goto fail;
+		iommu_sync_page(identity_dom.pgd);
+		if (iommu_map(&identity_dom, 0, 0, ROUNDUP(max_paddr, PGSIZE),
+		              IOMMU_READ | IOMMU_WRITE)) {
+			printk("IOMMU: can't identity map %p bytes\n", max_paddr);
+			goto fail;
+		}
+	}
+	for (int i = 0; i < nr_units; i++) {
+		if (!unit_enable(&units[i])) {
+			/* Earlier units are already translating, through the identity
+			 * domain, so leave them be. */
+			panic("IOMMU: out of memory enabling unit %d", i);
+		}
+	}
+	iommu_on = TRUE;
+	printk("IOMMU: %d units, %d-level tables, %s pages, %s identity, %d domains\n",
+	       nr_units, pt_levels,
+	       max_leaf_level == 3 ? "1G" : max_leaf_level == 2 ? "2M" : "4K",
+	       pass_through ? "pass-through" : "mapped", nr_dids);
+	return;
+fail:
+	printk("IOMMU: not enabled, DMA is untranslated\n");
+	nr_units = 0;
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Intel VT-d DMA remapping.
+ *
+ * With CONFIG_IOMMU, every remapping unit in the ACPI DMAR table is turned on
+ * at boot, and every device starts out in the identity domain: pass-through if
+ * the hardware can, otherwise a page table mapping all of physical memory 1:1.
+ * So drivers that DMA to physical addresses keep working.
+ *
+ * A device can instead be attached to a domain of its own (e.g. one passed
+ * through to a guest, or driven from user space), which only sees what was
+ * iommu_map()ed into it.  Mappings use 2MB and 1GB pages when the addresses
+ * and the hardware allow.
+ *
+ * iommu_unmap() does not invalidate the IOTLB.  The stale translations are
+ * flushed in a batch by the next iommu_flush(), or once a domain has
+ * IOMMU_FLUSH_BATCH unmaps pending.  Until then the device may still reach the
+ * old pages, so callers must flush before reusing them or the IOVAs. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <arch/pci.h>
+
+#define IOMMU_READ					(1 << 0)
+#define IOMMU_WRITE					(1 << 1)
+
+#define IOMMU_FLUSH_BATCH			256
+
+struct iommu_domain;
+
+#ifdef CONFIG_IOMMU
+
+void iommu_init(void);
+bool iommu_enabled(void);
+struct iommu_domain *iommu_domain_alloc(void);
+void iommu_domain_free(struct iommu_domain *dom);
+int iommu_attach_device(struct iommu_domain *dom, struct pci_device *pcidev);
+void iommu_detach_device(struct pci_device *pcidev);
+int iommu_map(struct iommu_domain *dom, uint64_t iova, physaddr_t pa,
+              size_t len, int perm);
+int iommu_unmap(struct iommu_domain *dom, uint64_t iova, size_t len);
+void iommu_flush(struct iommu_domain *dom);
+
+#else
+
+static inline void iommu_init(void)
+{
+}
+
+static inline bool iommu_enabled(void)
+{
+	return FALSE;
+}
+
+static inline struct iommu_domain *iommu_domain_alloc(void)
+{
+	return NULL;
+}
+
+static inline void iommu_domain_free(struct iommu_domain *dom)
+{
+}
+
+static inline int iommu_attach_device(struct iommu_domain *dom,
+                                      struct pci_device *pcidev)
+{
+	return -1;
+}
+
+static inline void iommu_detach_device(struct pci_device *pcidev)
+{
+}
+
+static inline int iommu_map(struct iommu_domain *dom, uint64_t iova,
+                            physaddr_t pa, size_t len, int perm)
+{
+	return -1;
+}
+
+static inline int iommu_unmap(struct iommu_domain *dom, uint64_t iova,
+                              size_t len)
+{
+	return -1;
+}
+
+static inline void iommu_flush(struct iommu_domain *dom)
+{
+}
+
+#endif /* CONFIG_IOMMU */
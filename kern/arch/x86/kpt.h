@@ -81,6 +81,11 @@ static inline bool kpte_has_perm_urw(kpte_t *kpte)
 	return (*kpte & PTE_USER_RW) == PTE_USER_RW;
 }
 
+static inline bool kpte_is_cow(kpte_t *kpte)
+{
+	return *kpte & PTE_COW ? TRUE : FALSE;
+}
+
 static inline int kpte_get_settings(kpte_t *kpte)
 {
 	return *kpte & 0xfff;
@@ -194,6 +194,7 @@ struct pci_device {
 	uintptr_t					msix_pba_vaddr;
 	unsigned int				msix_nr_vec;
 	bool						msix_ready;
+	struct iommu_domain			*iommu_dom;	/* NULL: identity */
 };
 
 struct msix_entry {
@@ -21,15 +21,46 @@
 #include <err.h>
 #include <string.h>
 #include <profiler.h>
+#include <alarm.h>
+#include <time.h>
+#include <process.h>
+#include <kthread.h>
 #include <arch/perfmon.h>
 
 #define FIXCNTR_NBITS 4
 #define FIXCNTR_MASK (((uint64_t) 1 << FIXCNTR_NBITS) - 1)
 
+/* A variable counter event, which is on a HW counter when it's its turn. */
+struct perfmon_mux_event {
+	struct perfmon_event ev;		/* ev.event == 0 for a free slot */
+	int counter;					/* HW counter we're on, or -1 */
+	uint64_t value;					/* counts from our past turns on the HW */
+	uint64_t enabled_ns;
+	uint64_t running_ns;
+	uint64_t tstamp;				/* when the times were brought up to date */
+};
+
+/* Variable counter events live in mux; counters is what's on the HW right now,
+ * and counter_mux says which mux slot each counter is running.  When there are
+ * more events than counters, an alarm rotates them every
+ * PERFMON_MUX_PERIOD_US.  Fixed counter events are always on their own HW
+ * counter.
+ *
+ * While a process with its own counters runs here, proc_perf is set and its
+ * events sit on proc_counters, which are outside the mux (counter_mux is -1). */
 struct perfmon_cpu_context {
 	spinlock_t lock;
 	struct perfmon_event counters[MAX_VAR_COUNTERS];
+	int counter_mux[MAX_VAR_COUNTERS];
 	struct perfmon_event fixed_counters[MAX_FIX_COUNTERS];
+	uint64_t fixed_tstamps[MAX_FIX_COUNTERS];
+	struct perfmon_mux_event mux[MAX_MUX_EVENTS];
+	int mux_next;
+	struct alarm_waiter mux_alarm;
+	struct perfmon_proc *proc_perf;
+	uint32_t proc_vcoreid;
+	int proc_counters[MAX_PROC_PERF_EVENTS];
+	uint64_t proc_tstamp;
 };
 
 struct perfmon_status_env {
@@ -38,15 +69,23 @@ struct perfmon_status_env {
 };
 
 static struct perfmon_cpu_caps cpu_caps;
+/* Keeps readers of a process's counters from racing with their close */
+static qlock_t proc_perf_qlock = QLOCK_INITIALIZER(proc_perf_qlock);
 static DEFINE_PERCPU(struct perfmon_cpu_context, counters_env);
 DEFINE_PERCPU_INIT(perfmon_counters_env_init);
 
+static void perfmon_mux_alarm_handler(struct alarm_waiter *waiter,
+                                      struct hw_trapframe *hw_tf);
+
 static void perfmon_counters_env_init(void)
 {
 	for (int i = 0; i < num_cores; i++) {
 		struct perfmon_cpu_context *cctx = _PERCPU_VARPTR(counters_env, i);
 
 		spinlock_init_irqsave(&cctx->lock);
+		for (int j = 0; j < MAX_VAR_COUNTERS; j++)
+			cctx->counter_mux[j] = -1;
+		init_awaiter_irq(&cctx->mux_alarm, perfmon_mux_alarm_handler);
 	}
 }
 
@@ -109,12 +148,227 @@ static uint64_t perfmon_get_fixevent_mask(const struct perfmon_event *pev,
 	return m;
 }
 
+/* How much a counter that started at -trigger_count has counted */
+static uint64_t perfmon_counter_delta(const struct perfmon_event *pev,
+                                      uint64_t raw)
+{
+	uint64_t mask = ((uint64_t) 1 << cpu_caps.bits_x_counter) - 1;
+
+	return (raw + pev->trigger_count) & mask;
+}
+
+static void perfmon_mux_update_times(struct perfmon_cpu_context *cctx)
+{
+	uint64_t now = nsec();
+
+	for (int i = 0; i < MAX_MUX_EVENTS; i++) {
+		struct perfmon_mux_event *me = &cctx->mux[i];
+
+		if (!me->ev.event)
+			continue;
+		me->enabled_ns += now - me->tstamp;
+		if (me->counter >= 0)
+			me->running_ns += now - me->tstamp;
+		me->tstamp = now;
+	}
+}
+
+static void perfmon_mux_load(struct perfmon_cpu_context *cctx, int slot,
+                             int counter)
+{
+	struct perfmon_mux_event *me = &cctx->mux[slot];
+
+	me->counter = counter;
+	cctx->counter_mux[counter] = slot;
+	cctx->counters[counter] = me->ev;
+	PMEV_SET_EN(cctx->counters[counter].event, 1);
+
+	perfmon_enable_event(counter, TRUE);
+
+	write_msr(MSR_IA32_PERFCTR0 + counter, -(int64_t) me->ev.trigger_count);
+	write_msr(MSR_ARCH_PERFMON_EVENTSEL0 + counter,
+	          cctx->counters[counter].event);
+}
+
+static void perfmon_mux_unload(struct perfmon_cpu_context *cctx, int counter)
+{
+	struct perfmon_mux_event *me = &cctx->mux[cctx->counter_mux[counter]];
+
+	perfmon_enable_event(counter, FALSE);
+
+	me->value += perfmon_counter_delta(&me->ev,
+	                                   read_msr(MSR_IA32_PERFCTR0 + counter));
+	me->counter = -1;
+	cctx->counter_mux[counter] = -1;
+	perfmon_init_event(&cctx->counters[counter]);
+
+	write_msr(MSR_ARCH_PERFMON_EVENTSEL0 + counter, 0);
+	write_msr(MSR_IA32_PERFCTR0 + counter, 0);
+}
+
+/* Returns the next event waiting for a turn, round robin, or -1. */
+static int perfmon_mux_next_waiting(struct perfmon_cpu_context *cctx)
+{
+	for (int i = 0; i < MAX_MUX_EVENTS; i++) {
+		int slot = (cctx->mux_next + i) % MAX_MUX_EVENTS;
+
+		if (cctx->mux[slot].ev.event && cctx->mux[slot].counter < 0) {
+			cctx->mux_next = (slot + 1) % MAX_MUX_EVENTS;
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* Puts waiting events on any free HW counters.  Returns TRUE if some are still
+ * waiting, i.e. we need to rotate. */
+static bool perfmon_mux_schedule(struct perfmon_cpu_context *cctx)
+{
+	int slot;
+
+	for (int i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		if (cctx->counters[i].event)
+			continue;
+		if (!perfmon_event_available(i)) {
+			warn_once("Counter %d is free but not available", i);
+			continue;
+		}
+		slot = perfmon_mux_next_waiting(cctx);
+		if (slot < 0)
+			return FALSE;
+		perfmon_mux_load(cctx, slot, i);
+	}
+	for (int i = 0; i < MAX_MUX_EVENTS; i++) {
+		if (cctx->mux[i].ev.event && cctx->mux[i].counter < 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Call without the cctx lock: the alarm handler holds the tchain lock when it
+ * grabs ours. */
+static void perfmon_mux_set_alarm(struct perfmon_cpu_context *cctx,
+                                  bool rotate)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+
+	if (rotate)
+		reset_alarm_rel(tchain, &cctx->mux_alarm, PERFMON_MUX_PERIOD_US);
+	else
+		unset_alarm(tchain, &cctx->mux_alarm);
+}
+
+/* Takes everyone off the HW, and puts on the next ones in line. */
+static void perfmon_mux_alarm_handler(struct alarm_waiter *waiter,
+                                      struct hw_trapframe *hw_tf)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	bool rotate;
+
+	spin_lock_irqsave(&cctx->lock);
+	perfmon_mux_update_times(cctx);
+	for (int i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		if (cctx->counter_mux[i] >= 0)
+			perfmon_mux_unload(cctx, i);
+	}
+	rotate = perfmon_mux_schedule(cctx);
+	spin_unlock_irqsave(&cctx->lock);
+	if (rotate)
+		reset_alarm_rel(&per_cpu_info[core_id()].tchain, waiter,
+		                PERFMON_MUX_PERIOD_US);
+}
+
+/* Grabs a HW counter for a process's event, kicking a mux event off if need
+ * be: it goes back to waiting for its turn.  Returns -1 if there are none. */
+static int perfmon_proc_get_counter(struct perfmon_cpu_context *cctx)
+{
+	int i;
+
+	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		if (!cctx->counters[i].event && perfmon_event_available(i))
+			return i;
+	}
+	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		if (cctx->counter_mux[i] >= 0) {
+			perfmon_mux_unload(cctx, i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Adds what the process's counters counted since proc_tstamp to its vcore. */
+static void perfmon_proc_fold(struct perfmon_cpu_context *cctx)
+{
+	struct perfmon_proc *pp = cctx->proc_perf;
+	struct perfmon_proc_vcore *pv = &pp->vcores[cctx->proc_vcoreid];
+	uint64_t now = nsec();
+	int counter;
+
+	for (int i = 0; i < pp->nr_events; i++) {
+		counter = cctx->proc_counters[i];
+		if (counter < 0)
+			continue;
+		pv->values[i] += perfmon_counter_delta(
+		    &pp->events[i], read_msr(MSR_IA32_PERFCTR0 + counter));
+		write_msr(MSR_IA32_PERFCTR0 + counter, 0);
+		pv->running_ns[i] += now - cctx->proc_tstamp;
+	}
+	pv->enabled_ns += now - cctx->proc_tstamp;
+	cctx->proc_tstamp = now;
+}
+
+static void __perfmon_proc_unload(struct perfmon_cpu_context *cctx)
+{
+	struct perfmon_proc *pp = cctx->proc_perf;
+	int counter;
+
+	perfmon_proc_fold(cctx);
+	for (int i = 0; i < pp->nr_events; i++) {
+		counter = cctx->proc_counters[i];
+		if (counter < 0)
+			continue;
+		perfmon_enable_event(counter, FALSE);
+		perfmon_init_event(&cctx->counters[counter]);
+		write_msr(MSR_ARCH_PERFMON_EVENTSEL0 + counter, 0);
+		write_msr(MSR_IA32_PERFCTR0 + counter, 0);
+	}
+	cctx->proc_perf = NULL;
+}
+
+static void __perfmon_proc_load(struct perfmon_cpu_context *cctx,
+                                struct perfmon_proc *pp, uint32_t vcoreid)
+{
+	int counter;
+
+	cctx->proc_perf = pp;
+	cctx->proc_vcoreid = vcoreid;
+	cctx->proc_tstamp = nsec();
+	for (int i = 0; i < pp->nr_events; i++) {
+		counter = perfmon_proc_get_counter(cctx);
+		cctx->proc_counters[i] = counter;
+		if (counter < 0)
+			continue;
+		cctx->counters[counter] = pp->events[i];
+
+		perfmon_enable_event(counter, TRUE);
+
+		write_msr(MSR_IA32_PERFCTR0 + counter, 0);
+		write_msr(MSR_ARCH_PERFMON_EVENTSEL0 + counter, pp->events[i].event);
+	}
+}
+
 static void perfmon_do_cores_alloc(void *opaque)
 {
 	struct perfmon_alloc *pa = (struct perfmon_alloc *) opaque;
 	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	bool rotate = FALSE;
 	int i;
 
+	if (perfmon_is_socket_event(&pa->ev)) {
+		pa->cores_counters[core_id()] = perfmon_socket_alloc(&pa->ev);
+		return;
+	}
 	spin_lock_irqsave(&cctx->lock);
 	if (perfmon_is_fixed_event(&pa->ev)) {
 		uint64_t fxctrl_value = read_msr(MSR_CORE_PERF_FIXED_CTR_CTRL), tmp;
@@ -127,6 +381,7 @@ static void perfmon_do_cores_alloc(void *opaque)
 		} else {
 			cctx->fixed_counters[i] = pa->ev;
 			PMEV_SET_EN(cctx->fixed_counters[i].event, 1);
+			cctx->fixed_tstamps[i] = nsec();
 
 			tmp = perfmon_get_fixevent_mask(&pa->ev, i, fxctrl_value);
 
@@ -137,28 +392,31 @@ static void perfmon_do_cores_alloc(void *opaque)
 			write_msr(MSR_CORE_PERF_FIXED_CTR_CTRL, tmp);
 		}
 	} else {
-		for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
-			if (cctx->counters[i].event == 0) {
-				if (!perfmon_event_available(i))
-					warn_once("Counter %d is free but not available", i);
-				else
-					break;
-			}
+		for (i = 0; i < MAX_MUX_EVENTS; i++) {
+			if (cctx->mux[i].ev.event == 0)
+				break;
 		}
-		if (i < (int) cpu_caps.counters_x_proc) {
-			cctx->counters[i] = pa->ev;
-			PMEV_SET_EN(cctx->counters[i].event, 1);
-
-			perfmon_enable_event(i, TRUE);
-
-			write_msr(MSR_IA32_PERFCTR0 + i, -(int64_t) pa->ev.trigger_count);
-			write_msr(MSR_ARCH_PERFMON_EVENTSEL0 + i,
-			          cctx->counters[i].event);
+		if (i < MAX_MUX_EVENTS) {
+			struct perfmon_mux_event *me = &cctx->mux[i];
+
+			/* Loading others changes how their time counts */
+			perfmon_mux_update_times(cctx);
+			me->ev = pa->ev;
+			/* Never 0, even for an all-zero event, so the slot is in use */
+			PMEV_SET_EN(me->ev.event, 1);
+			me->counter = -1;
+			me->value = 0;
+			me->enabled_ns = 0;
+			me->running_ns = 0;
+			me->tstamp = nsec();
+			rotate = perfmon_mux_schedule(cctx);
 		} else {
 			i = -ENOSPC;
 		}
 	}
 	spin_unlock_irqsave(&cctx->lock);
+	if (!perfmon_is_fixed_event(&pa->ev) && i >= 0)
+		perfmon_mux_set_alarm(cctx, rotate);
 
 	pa->cores_counters[core_id()] = (counter_t) i;
 }
@@ -169,7 +427,12 @@ static void perfmon_do_cores_free(void *opaque)
 	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
 	int err = 0, coreno = core_id();
 	counter_t ccno = pa->cores_counters[coreno];
+	bool rotate = FALSE;
 
+	if (perfmon_is_socket_event(&pa->ev)) {
+		pa->cores_counters[coreno] = perfmon_socket_free(&pa->ev, ccno);
+		return;
+	}
 	spin_lock_irqsave(&cctx->lock);
 	if (perfmon_is_fixed_event(&pa->ev)) {
 		unsigned int ccbitsh = ccno * FIXCNTR_NBITS;
@@ -188,18 +451,19 @@ static void perfmon_do_cores_free(void *opaque)
 			write_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno, 0);
 		}
 	} else {
-		if (ccno < (int) cpu_caps.counters_x_proc) {
-			perfmon_init_event(&cctx->counters[ccno]);
-
-			perfmon_enable_event((int) ccno, FALSE);
-
-			write_msr(MSR_ARCH_PERFMON_EVENTSEL0 + ccno, 0);
-			write_msr(MSR_IA32_PERFCTR0 + ccno, 0);
+		if (ccno < MAX_MUX_EVENTS && cctx->mux[ccno].ev.event) {
+			perfmon_mux_update_times(cctx);
+			if (cctx->mux[ccno].counter >= 0)
+				perfmon_mux_unload(cctx, cctx->mux[ccno].counter);
+			perfmon_init_event(&cctx->mux[ccno].ev);
+			rotate = perfmon_mux_schedule(cctx);
 		} else {
 			err = -ENOENT;
 		}
 	}
 	spin_unlock_irqsave(&cctx->lock);
+	if (!perfmon_is_fixed_event(&pa->ev) && !err)
+		perfmon_mux_set_alarm(cctx, rotate);
 
 	pa->cores_counters[coreno] = (counter_t) err;
 }
@@ -210,14 +474,28 @@ static void perfmon_do_cores_status(void *opaque)
 	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
 	int coreno = core_id();
 	counter_t ccno = env->pa->cores_counters[coreno];
+	struct perfmon_core_value *cv = &env->pef->cores_values[coreno];
+	struct perfmon_mux_event *me;
 
+	if (perfmon_is_socket_event(&env->pa->ev)) {
+		perfmon_socket_status(&env->pa->ev, ccno, cv);
+		return;
+	}
 	spin_lock_irqsave(&cctx->lock);
-	if (perfmon_is_fixed_event(&env->pa->ev))
-		env->pef->cores_values[coreno] =
-		    read_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno);
-	else
-		env->pef->cores_values[coreno] =
-		    read_msr(MSR_IA32_PERFCTR0 + ccno);
+	if (perfmon_is_fixed_event(&env->pa->ev)) {
+		cv->value = read_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno);
+		cv->enabled_ns = nsec() - cctx->fixed_tstamps[ccno];
+		cv->running_ns = cv->enabled_ns;
+	} else {
+		me = &cctx->mux[ccno];
+		perfmon_mux_update_times(cctx);
+		cv->value = me->value;
+		if (me->counter >= 0)
+			cv->value += perfmon_counter_delta(
+			    &me->ev, read_msr(MSR_IA32_PERFCTR0 + me->counter));
+		cv->enabled_ns = me->enabled_ns;
+		cv->running_ns = me->running_ns;
+	}
 	spin_unlock_irqsave(&cctx->lock);
 }
 
@@ -278,9 +556,10 @@ static struct perfmon_alloc *perfmon_create_alloc(const struct perfmon_event *pe
 
 static struct perfmon_status *perfmon_alloc_status(void)
 {
-	struct perfmon_status *pef = kzmalloc(sizeof(struct perfmon_status) +
-	                                          num_cores * sizeof(uint64_t),
-	                                      KMALLOC_WAIT);
+	struct perfmon_status *pef =
+	    kzmalloc(sizeof(struct perfmon_status) +
+	                 num_cores * sizeof(struct perfmon_core_value),
+	             KMALLOC_WAIT);
 
 	return pef;
 }
@@ -298,6 +577,7 @@ bool perfmon_supported(void)
 void perfmon_global_init(void)
 {
 	perfmon_read_cpu_caps(&cpu_caps);
+	perfmon_uncore_init();
 }
 
 void perfmon_pcpu_init(void)
@@ -350,9 +630,13 @@ void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data)
 	write_msr(MSR_CORE_PERF_GLOBAL_CTRL, 0);
 	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
 		if (status & ((uint64_t) 1 << i)) {
-			if (cctx->counters[i].event) {
+			/* Process counters don't interrupt, but they still overflow */
+			if (cctx->counter_mux[i] >= 0) {
 				profiler_add_hw_sample(
 				    hw_tf, perfmon_make_sample_event(cctx->counters + i));
+				/* We're about to wind the counter back */
+				cctx->mux[cctx->counter_mux[i]].value +=
+				    cctx->counters[i].trigger_count;
 				write_msr(MSR_IA32_PERFCTR0 + i,
 				          -(int64_t) cctx->counters[i].trigger_count);
 			}
@@ -409,11 +693,17 @@ int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
 	ERRSTACK(1);
 	int i;
 	struct perfmon_alloc *pa = perfmon_create_alloc(pev);
+	struct core_set scset;
 
 	if (waserror()) {
 		perfmon_destroy_alloc(pa);
 		nexterror();
 	}
+	/* Socket events only go on one core of each socket */
+	if (perfmon_is_socket_event(pev)) {
+		perfmon_socket_core_set(pev, cset, &scset);
+		cset = &scset;
+	}
 	smp_do_in_cores(cset, perfmon_do_cores_alloc, pa);
 
 	for (i = 0; i < num_cores; i++) {
@@ -475,6 +765,7 @@ struct perfmon_status *perfmon_get_event_status(struct perfmon_session *ps,
 
 	perfmon_alloc_get(ps, ped, FALSE, &env.pa);
 	env.pef = perfmon_alloc_status();
+	env.pef->ev = env.pa->ev;
 	perfmon_setup_alloc_core_set(env.pa, &cset);
 
 	smp_do_in_cores(&cset, perfmon_do_cores_status, &env);
@@ -524,3 +815,150 @@ void perfmon_close_session(struct perfmon_session *ps)
 	if (likely(ps))
 		kref_put(&ps->ref);
 }
+
+/* Gives p counters of its own, one set per vcore, which only count while p
+ * runs.  events are raw PMEV values for variable counters. */
+void perfmon_proc_open(struct proc *p, const uint64_t *events, int nr_events)
+{
+	struct perfmon_proc *pp;
+	uint32_t nr_vcores = p->procinfo->max_vcores;
+
+	if (!perfmon_supported())
+		error(ENODEV, "perfmon is not supported");
+	if (nr_events <= 0 || nr_events > MAX_PROC_PERF_EVENTS ||
+	    nr_events > (int) cpu_caps.counters_x_proc)
+		error(EINVAL, "Need 1 to %d events",
+		      MIN(MAX_PROC_PERF_EVENTS, (int) cpu_caps.counters_x_proc));
+	pp = kzmalloc(sizeof(struct perfmon_proc) +
+	              nr_vcores * sizeof(struct perfmon_proc_vcore), KMALLOC_WAIT);
+	pp->nr_events = nr_events;
+	pp->nr_vcores = nr_vcores;
+	for (int i = 0; i < nr_events; i++) {
+		perfmon_init_event(&pp->events[i]);
+		pp->events[i].event = events[i];
+		/* We only count, and 0 is a free counter */
+		PMEV_SET_INTEN(pp->events[i].event, 0);
+		PMEV_SET_EN(pp->events[i].event, 1);
+	}
+	if (!atomic_cas_ptr((void**) &p->perf, NULL, pp)) {
+		kfree(pp);
+		error(EBUSY, "Process already has counters");
+	}
+}
+
+static void perfmon_do_proc_close(void *opaque)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	bool rotate;
+
+	spin_lock_irqsave(&cctx->lock);
+	if (cctx->proc_perf != opaque) {
+		spin_unlock_irqsave(&cctx->lock);
+		return;
+	}
+	perfmon_mux_update_times(cctx);
+	__perfmon_proc_unload(cctx);
+	rotate = perfmon_mux_schedule(cctx);
+	spin_unlock_irqsave(&cctx->lock);
+	perfmon_mux_set_alarm(cctx, rotate);
+}
+
+void perfmon_proc_close(struct proc *p)
+{
+	struct perfmon_proc *pp;
+	struct core_set cset;
+
+	qlock(&proc_perf_qlock);
+	pp = p->perf;
+	if (!pp) {
+		qunlock(&proc_perf_qlock);
+		error(ENOENT, "Process has no counters");
+	}
+	/* Only open races with us, and it only installs over NULL */
+	p->perf = NULL;
+	wmb();
+	/* Cores that loaded pp before we cleared it are still counting */
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	smp_do_in_cores(&cset, perfmon_do_proc_close, pp);
+	qunlock(&proc_perf_qlock);
+	kfree(pp);
+}
+
+static void perfmon_do_proc_sync(void *opaque)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+
+	spin_lock_irqsave(&cctx->lock);
+	if (cctx->proc_perf == opaque)
+		perfmon_proc_fold(cctx);
+	spin_unlock_irqsave(&cctx->lock);
+}
+
+/* Returns a copy of p's counters, including what its running vcores have
+ * counted so far.  Free it with perfmon_free_proc_status(). */
+struct perfmon_proc *perfmon_get_proc_status(struct proc *p)
+{
+	struct perfmon_proc *pp, *pps;
+	struct core_set cset;
+	size_t size;
+
+	qlock(&proc_perf_qlock);
+	pp = ACCESS_ONCE(p->perf);
+	if (!pp) {
+		qunlock(&proc_perf_qlock);
+		error(ENOENT, "Process has no counters");
+	}
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	smp_do_in_cores(&cset, perfmon_do_proc_sync, pp);
+	size = sizeof(struct perfmon_proc) +
+	       pp->nr_vcores * sizeof(struct perfmon_proc_vcore);
+	pps = kmalloc(size, KMALLOC_WAIT);
+	memcpy(pps, pp, size);
+	qunlock(&proc_perf_qlock);
+
+	return pps;
+}
+
+void perfmon_free_proc_status(struct perfmon_proc *pps)
+{
+	kfree(pps);
+}
+
+/* Called with IRQs off as p starts running vcoreid on this core.  Usually p is
+ * already loaded, e.g. returning from a syscall, and this is a no-op. */
+void perfmon_proc_load(struct proc *p, uint32_t vcoreid)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	struct perfmon_proc *pp = ACCESS_ONCE(p->perf);
+	bool rotate;
+
+	if (cctx->proc_perf == pp && (!pp || cctx->proc_vcoreid == vcoreid))
+		return;
+	spin_lock_irqsave(&cctx->lock);
+	perfmon_mux_update_times(cctx);
+	if (cctx->proc_perf)
+		__perfmon_proc_unload(cctx);
+	if (pp && vcoreid < pp->nr_vcores)
+		__perfmon_proc_load(cctx, pp, vcoreid);
+	rotate = perfmon_mux_schedule(cctx);
+	spin_unlock_irqsave(&cctx->lock);
+	perfmon_mux_set_alarm(cctx, rotate);
+}
+
+/* Called as the current process leaves this core. */
+void perfmon_proc_unload(void)
+{
+	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	bool rotate;
+
+	if (!cctx->proc_perf)
+		return;
+	spin_lock_irqsave(&cctx->lock);
+	perfmon_mux_update_times(cctx);
+	__perfmon_proc_unload(cctx);
+	rotate = perfmon_mux_schedule(cctx);
+	spin_unlock_irqsave(&cctx->lock);
+	perfmon_mux_set_alarm(cctx, rotate);
+}
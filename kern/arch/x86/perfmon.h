@@ -18,8 +18,14 @@
 #define MAX_FIX_COUNTERS 16
 #define MAX_PERFMON_COUNTERS (MAX_VAR_COUNTERS + MAX_FIX_COUNTERS)
 #define INVALID_COUNTER INT32_MIN
+/* Per core, variable counter events beyond the HW counters take turns */
+#define MAX_MUX_EVENTS 64
+#define PERFMON_MUX_PERIOD_US 4000
+/* Events a process can count on its own (#proc/PID/perf) */
+#define MAX_PROC_PERF_EVENTS 8
 
 struct hw_trapframe;
+struct proc;
 
 typedef int32_t counter_t;
 
@@ -44,9 +50,36 @@ struct perfmon_session {
 	struct perfmon_alloc *allocs[MAX_PERFMON_COUNTERS];
 };
 
+/* An event's count on one core, and for how long it was open (enabled) and
+ * actually on a HW counter (running).  When it had to share, value * enabled /
+ * running estimates what it would have counted on its own. */
+struct perfmon_core_value {
+	uint64_t value;
+	uint64_t enabled_ns;
+	uint64_t running_ns;
+};
+
 struct perfmon_status {
 	struct perfmon_event ev;
-	uint64_t cores_values[0];
+	struct perfmon_core_value cores_values[0];
+};
+
+/* What one of a process's vcores counted, while it was running (enabled) and
+ * while each event had a HW counter (running). */
+struct perfmon_proc_vcore {
+	uint64_t enabled_ns;
+	uint64_t values[MAX_PROC_PERF_EVENTS];
+	uint64_t running_ns[MAX_PROC_PERF_EVENTS];
+};
+
+/* Counters that only count while their process runs.  They go on the HW when
+ * the process starts on a core and come off when it leaves, ahead of the
+ * system-wide mux events. */
+struct perfmon_proc {
+	int nr_events;
+	struct perfmon_event events[MAX_PROC_PERF_EVENTS];
+	uint32_t nr_vcores;
+	struct perfmon_proc_vcore vcores[0];
 };
 
 bool perfmon_supported(void);
@@ -63,6 +96,22 @@ void perfmon_free_event_status(struct perfmon_status *pef);
 struct perfmon_session *perfmon_create_session(void);
 void perfmon_get_session(struct perfmon_session *ps);
 void perfmon_close_session(struct perfmon_session *ps);
+/* Uncore and RAPL events, in perfmon_uncore.c */
+void perfmon_uncore_init(void);
+void perfmon_socket_core_set(const struct perfmon_event *pev,
+                             const struct core_set *cset,
+                             struct core_set *scset);
+counter_t perfmon_socket_alloc(const struct perfmon_event *pev);
+counter_t perfmon_socket_free(const struct perfmon_event *pev, counter_t ccno);
+void perfmon_socket_status(const struct perfmon_event *pev, counter_t ccno,
+                           struct perfmon_core_value *cv);
+
+void perfmon_proc_open(struct proc *p, const uint64_t *events, int nr_events);
+void perfmon_proc_close(struct proc *p);
+struct perfmon_proc *perfmon_get_proc_status(struct proc *p);
+void perfmon_free_proc_status(struct perfmon_proc *pps);
+void perfmon_proc_load(struct proc *p, uint32_t vcoreid);
+void perfmon_proc_unload(void);
 
 static inline uint64_t read_pmc(uint32_t index)
 {
@@ -0,0 +1,510 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Socket-wide counters for perfmon: the SNB-EP and IVB-EP uncore CBo, IMC and
+ * QPI boxes, and the RAPL energy status MSRs.
+ *
+ * Each socket has its own boxes.  CBo counters are MSRs, only reachable from a
+ * core on their socket, which is why perfmon runs socket events on one core per
+ * socket.  IMC channels and QPI ports are PCI functions on the socket's uncore
+ * bus.  We never write the counters: we note what they hold when an event is
+ * opened, and report how far they got since.
+ *
+ * The RAPL energy counters are only 32 bits, and can wrap in a few minutes
+ * under load.  While any are open, a ktask folds them into 64 bit totals every
+ * RAPL_FOLD_PERIOD_US. */
+
+#include <sys/types.h>
+#include <arch/ros/msr-index.h>
+#include <arch/x86.h>
+#include <arch/msr.h>
+#include <arch/uaccess.h>
+#include <arch/pci.h>
+#include <arch/topology.h>
+#include <ros/errno.h>
+#include <assert.h>
+#include <smp.h>
+#include <core_set.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <atomic.h>
+#include <time.h>
+#include <arch/perfmon.h>
+
+#define UNC_NR_COUNTERS			4
+#define UNC_MAX_CBOS			15
+#define UNC_MAX_IMCS			8
+#define UNC_MAX_QPIS			3
+
+/* CBo n's MSRs are at a stride of 0x20 from CBo 0's */
+#define UNC_CBO_MSR_STRIDE		0x20
+#define UNC_C0_MSR_PMON_BOX_CTL	0xd04
+#define UNC_C0_MSR_PMON_CTL0	0xd10
+#define UNC_C0_MSR_PMON_CTR0	0xd16
+/* IMC and QPI boxes have the same layout in config space */
+#define UNC_PCI_PMON_CTR0		0xa0
+#define UNC_PCI_PMON_CTL0		0xd8
+#define UNC_PCI_PMON_BOX_CTL	0xf4
+
+#define UNC_PMON_BOX_CTL_FRZ	(1 << 8)
+#define UNC_PMON_CTL_EN			(1 << 22)
+
+#define RAPL_MAX_USERS			8
+#define RAPL_FOLD_PERIOD_US		(10 * 1000000)
+
+struct uncore_box {
+	uint32_t cbo_msr;			/* CBo only: offset of its MSRs */
+	struct pci_device *pcidev;	/* IMC and QPI only */
+	unsigned int bits;
+	uint8_t used;				/* bitmap of counters in use */
+	uint64_t start[UNC_NR_COUNTERS];
+	uint64_t tstamp[UNC_NR_COUNTERS];
+};
+
+struct rapl_domain {
+	uint32_t msr;				/* 0 if this CPU doesn't have the domain */
+	uint32_t last;
+	uint64_t total;
+	uint8_t used;				/* bitmap of start slots in use */
+	uint64_t start[RAPL_MAX_USERS];
+	uint64_t tstamp[RAPL_MAX_USERS];
+};
+
+struct uncore_socket {
+	spinlock_t lock;
+	struct uncore_box cbo[UNC_MAX_CBOS];
+	int nr_cbos;
+	struct uncore_box imc[UNC_MAX_IMCS];
+	int nr_imcs;
+	struct uncore_box qpi[UNC_MAX_QPIS];
+	int nr_qpis;
+	struct rapl_domain rapl[PERFMON_RAPL_DOMAINS];
+};
+
+struct uncore_pci_id {
+	uint16_t dev_id;
+	int pmu;
+};
+
+static const struct uncore_pci_id uncore_pci_ids[] = {
+	/* SNB-EP */
+	{ 0x3cb0, PERFMON_PMU_UNC_IMC },
+	{ 0x3cb1, PERFMON_PMU_UNC_IMC },
+	{ 0x3cb4, PERFMON_PMU_UNC_IMC },
+	{ 0x3cb5, PERFMON_PMU_UNC_IMC },
+	{ 0x3c41, PERFMON_PMU_UNC_QPI },
+	{ 0x3c42, PERFMON_PMU_UNC_QPI },
+	/* IVB-EP */
+	{ 0x0eb4, PERFMON_PMU_UNC_IMC },
+	{ 0x0eb5, PERFMON_PMU_UNC_IMC },
+	{ 0x0eb0, PERFMON_PMU_UNC_IMC },
+	{ 0x0eb1, PERFMON_PMU_UNC_IMC },
+	{ 0x0ef4, PERFMON_PMU_UNC_IMC },
+	{ 0x0ef5, PERFMON_PMU_UNC_IMC },
+	{ 0x0ef0, PERFMON_PMU_UNC_IMC },
+	{ 0x0ef1, PERFMON_PMU_UNC_IMC },
+	{ 0x0e32, PERFMON_PMU_UNC_QPI },
+	{ 0x0e33, PERFMON_PMU_UNC_QPI },
+	{ 0x0e3a, PERFMON_PMU_UNC_QPI },
+};
+
+static struct uncore_socket *uncore_sockets;
+static unsigned int rapl_energy_shift;
+static atomic_t rapl_users;
+
+static uint32_t cpu_model(void)
+{
+	uint32_t eax;
+
+	cpuid(0x1, 0x0, &eax, 0, 0, 0);
+	if (((eax >> 8) & 0xf) != 6)
+		return 0;
+	return ((eax >> 4) & 0xf) | ((eax >> 12) & 0xf0);
+}
+
+static struct uncore_socket *cur_uncore_socket(void)
+{
+	return &uncore_sockets[cpu_topology_info.core_list[core_id()].socket_id];
+}
+
+static void uncore_init_cbos(uint32_t model)
+{
+	int nr_cbos;
+
+	if (model != 0x2d && model != 0x3e)
+		return;
+	/* One CBo per physical core */
+	nr_cbos = MIN(cpu_topology_info.cpus_per_socket, UNC_MAX_CBOS);
+	for (int s = 0; s < cpu_topology_info.num_sockets; s++) {
+		struct uncore_socket *us = &uncore_sockets[s];
+
+		for (int i = 0; i < nr_cbos; i++) {
+			us->cbo[i].cbo_msr = i * UNC_CBO_MSR_STRIDE;
+			us->cbo[i].bits = 44;
+		}
+		us->nr_cbos = nr_cbos;
+	}
+}
+
+static int uncore_pci_pmu(struct pci_device *pcidev)
+{
+	if (pcidev->ven_id != 0x8086)
+		return -1;
+	for (int i = 0; i < ARRAY_SIZE(uncore_pci_ids); i++) {
+		if (uncore_pci_ids[i].dev_id == pcidev->dev_id)
+			return uncore_pci_ids[i].pmu;
+	}
+	return -1;
+}
+
+/* Each socket has its own uncore bus, and we take them to be numbered in socket
+ * order, which is how the firmware we've seen sets them up. */
+static void uncore_init_pci_boxes(void)
+{
+	struct pci_device *pcidev;
+	struct uncore_socket *us;
+	struct uncore_box *box;
+	int socket = -1, last_bus = -1, pmu;
+
+	STAILQ_FOREACH(pcidev, &pci_devices, all_dev) {
+		pmu = uncore_pci_pmu(pcidev);
+		if (pmu < 0)
+			continue;
+		if (pcidev->bus != last_bus) {
+			last_bus = pcidev->bus;
+			socket++;
+		}
+		if (socket >= cpu_topology_info.num_sockets)
+			break;
+		us = &uncore_sockets[socket];
+		if (pmu == PERFMON_PMU_UNC_IMC) {
+			if (us->nr_imcs == UNC_MAX_IMCS)
+				continue;
+			box = &us->imc[us->nr_imcs++];
+		} else {
+			if (us->nr_qpis == UNC_MAX_QPIS)
+				continue;
+			box = &us->qpi[us->nr_qpis++];
+		}
+		box->pcidev = pcidev;
+		box->bits = 48;
+		pcidev_write32(pcidev, UNC_PCI_PMON_BOX_CTL, 0);
+	}
+}
+
+static void rapl_init(uint32_t model)
+{
+	static const uint32_t msrs[PERFMON_RAPL_DOMAINS] = {
+		[PERFMON_RAPL_PKG] = MSR_PKG_ENERGY_STATUS,
+		[PERFMON_RAPL_PP0] = MSR_PP0_ENERGY_STATUS,
+		[PERFMON_RAPL_PP1] = MSR_PP1_ENERGY_STATUS,
+		[PERFMON_RAPL_DRAM] = MSR_DRAM_ENERGY_STATUS,
+	};
+	uint64_t units, value;
+
+	if (!model || safe_read_msr(MSR_RAPL_POWER_UNIT, &units))
+		return;
+	rapl_energy_shift = (units >> 8) & 0x1f;
+	for (int d = 0; d < PERFMON_RAPL_DOMAINS; d++) {
+		/* Only the server parts have DRAM, and only the clients have PP1 */
+		if (safe_read_msr(msrs[d], &value))
+			continue;
+		for (int s = 0; s < cpu_topology_info.num_sockets; s++)
+			uncore_sockets[s].rapl[d].msr = msrs[d];
+	}
+}
+
+void perfmon_uncore_init(void)
+{
+	uint32_t model = cpu_model();
+
+	uncore_sockets = kzmalloc(cpu_topology_info.num_sockets *
+	                          sizeof(struct uncore_socket), KMALLOC_WAIT);
+	for (int s = 0; s < cpu_topology_info.num_sockets; s++)
+		spinlock_init_irqsave(&uncore_sockets[s].lock);
+	uncore_init_cbos(model);
+	uncore_init_pci_boxes();
+	rapl_init(model);
+}
+
+static bool socket_in_core_set(const struct core_set *cset, int socket)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (core_set_getcpu(cset, i) &&
+		    cpu_topology_info.core_list[i].socket_id == socket)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Picks the first core of each socket in cset. */
+static void socket_first_cores(const struct core_set *cset,
+                               struct core_set *scset)
+{
+	int socket;
+
+	core_set_init(scset);
+	for (int i = 0; i < num_cores; i++) {
+		socket = cpu_topology_info.core_list[i].socket_id;
+		if (core_set_getcpu(cset, i) && !socket_in_core_set(scset, socket))
+			core_set_setcpu(scset, i);
+	}
+}
+
+static struct uncore_box *uncore_get_box(struct uncore_socket *us,
+                                         const struct perfmon_event *pev)
+{
+	int box = PERFMON_GET_BOX(pev->flags);
+
+	switch (PERFMON_GET_PMU(pev->flags)) {
+	case PERFMON_PMU_UNC_CBO:
+		return box < us->nr_cbos ? &us->cbo[box] : NULL;
+	case PERFMON_PMU_UNC_IMC:
+		return box < us->nr_imcs ? &us->imc[box] : NULL;
+	case PERFMON_PMU_UNC_QPI:
+		return box < us->nr_qpis ? &us->qpi[box] : NULL;
+	}
+	return NULL;
+}
+
+static uint64_t uncore_read_counter(struct uncore_box *box, int i)
+{
+	uint32_t hi, lo;
+
+	if (!box->pcidev)
+		return read_msr(UNC_C0_MSR_PMON_CTR0 + box->cbo_msr + i);
+	/* The two halves aren't read atomically; retry if we straddled a carry */
+	do {
+		hi = pcidev_read32(box->pcidev, UNC_PCI_PMON_CTR0 + 8 * i + 4);
+		lo = pcidev_read32(box->pcidev, UNC_PCI_PMON_CTR0 + 8 * i);
+	} while (hi != pcidev_read32(box->pcidev, UNC_PCI_PMON_CTR0 + 8 * i + 4));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+static void uncore_write_ctl(struct uncore_box *box, int i, uint32_t ctl)
+{
+	if (box->pcidev)
+		pcidev_write32(box->pcidev, UNC_PCI_PMON_CTL0 + 4 * i, ctl);
+	else
+		write_msr(UNC_C0_MSR_PMON_CTL0 + box->cbo_msr + i, ctl);
+}
+
+static uint32_t uncore_make_ctl(const struct perfmon_event *pev)
+{
+	uint64_t ctl = 0;
+
+	PMEV_SET_EVENT(ctl, PMEV_GET_EVENT(pev->event));
+	PMEV_SET_MASK(ctl, PMEV_GET_MASK(pev->event));
+	PMEV_SET_EDGE(ctl, PMEV_GET_EDGE(pev->event));
+	PMEV_SET_INVCMSK(ctl, PMEV_GET_INVCMSK(pev->event));
+	PMEV_SET_CMASK(ctl, PMEV_GET_CMASK(pev->event));
+	return ctl | UNC_PMON_CTL_EN;
+}
+
+static int uncore_alloc(struct uncore_socket *us,
+                        const struct perfmon_event *pev)
+{
+	struct uncore_box *box = uncore_get_box(us, pev);
+	int i;
+
+	if (!box)
+		return -ENODEV;
+	for (i = 0; i < UNC_NR_COUNTERS; i++) {
+		if (!(box->used & (1 << i)))
+			break;
+	}
+	if (i == UNC_NR_COUNTERS)
+		return -ENOSPC;
+	if (!box->used && !box->pcidev)
+		write_msr(UNC_C0_MSR_PMON_BOX_CTL + box->cbo_msr, 0);
+	box->used |= 1 << i;
+	uncore_write_ctl(box, i, uncore_make_ctl(pev));
+	box->start[i] = uncore_read_counter(box, i);
+	box->tstamp[i] = nsec();
+	return i;
+}
+
+static int uncore_free(struct uncore_socket *us,
+                       const struct perfmon_event *pev, counter_t ccno)
+{
+	struct uncore_box *box = uncore_get_box(us, pev);
+
+	if (!box || ccno >= UNC_NR_COUNTERS || !(box->used & (1 << ccno)))
+		return -ENOENT;
+	uncore_write_ctl(box, ccno, 0);
+	box->used &= ~(1 << ccno);
+	if (!box->used && !box->pcidev)
+		write_msr(UNC_C0_MSR_PMON_BOX_CTL + box->cbo_msr,
+		          UNC_PMON_BOX_CTL_FRZ);
+	return 0;
+}
+
+static void uncore_status(struct uncore_socket *us,
+                          const struct perfmon_event *pev, counter_t ccno,
+                          struct perfmon_core_value *cv)
+{
+	struct uncore_box *box = uncore_get_box(us, pev);
+	uint64_t mask = ((uint64_t) 1 << box->bits) - 1;
+
+	cv->value = (uncore_read_counter(box, ccno) - box->start[ccno]) & mask;
+	cv->enabled_ns = nsec() - box->tstamp[ccno];
+	cv->running_ns = cv->enabled_ns;
+}
+
+/* Adds what the energy counters counted since we last looked to their totals.
+ * Hold the socket lock, on one of its cores. */
+static void rapl_fold(struct uncore_socket *us)
+{
+	struct rapl_domain *rd;
+	uint32_t now;
+
+	for (int d = 0; d < PERFMON_RAPL_DOMAINS; d++) {
+		rd = &us->rapl[d];
+		if (!rd->used)
+			continue;
+		now = read_msr(rd->msr);
+		rd->total += (uint32_t) (now - rd->last);
+		rd->last = now;
+	}
+}
+
+static void rapl_do_fold(void *opaque)
+{
+	struct uncore_socket *us = cur_uncore_socket();
+
+	spin_lock_irqsave(&us->lock);
+	rapl_fold(us);
+	spin_unlock_irqsave(&us->lock);
+}
+
+static void rapl_fold_ktask(void *arg)
+{
+	struct core_set all, scset;
+
+	core_set_init(&all);
+	core_set_fill_available(&all);
+	socket_first_cores(&all, &scset);
+	while (1) {
+		kthread_usleep(RAPL_FOLD_PERIOD_US);
+		if (atomic_read(&rapl_users))
+			smp_do_in_cores(&scset, rapl_do_fold, NULL);
+	}
+}
+
+static uint64_t rapl_to_nsec_joules(uint64_t units)
+{
+	uint64_t frac = units & (((uint64_t) 1 << rapl_energy_shift) - 1);
+
+	return (units >> rapl_energy_shift) * 1000000000 +
+	       ((frac * 1000000000) >> rapl_energy_shift);
+}
+
+static int rapl_alloc(struct uncore_socket *us,
+                      const struct perfmon_event *pev)
+{
+	unsigned int d = PMEV_GET_EVENT(pev->event);
+	struct rapl_domain *rd;
+	int i;
+
+	if (d >= PERFMON_RAPL_DOMAINS || !us->rapl[d].msr)
+		return -ENODEV;
+	rd = &us->rapl[d];
+	for (i = 0; i < RAPL_MAX_USERS; i++) {
+		if (!(rd->used & (1 << i)))
+			break;
+	}
+	if (i == RAPL_MAX_USERS)
+		return -ENOSPC;
+	if (!rd->used)
+		rd->last = read_msr(rd->msr);
+	else
+		rapl_fold(us);
+	rd->used |= 1 << i;
+	rd->start[i] = rd->total;
+	rd->tstamp[i] = nsec();
+	atomic_inc(&rapl_users);
+	return d * RAPL_MAX_USERS + i;
+}
+
+static int rapl_free(struct uncore_socket *us, counter_t ccno)
+{
+	struct rapl_domain *rd;
+	int i = ccno % RAPL_MAX_USERS;
+
+	if (ccno >= PERFMON_RAPL_DOMAINS * RAPL_MAX_USERS)
+		return -ENOENT;
+	rd = &us->rapl[ccno / RAPL_MAX_USERS];
+	if (!(rd->used & (1 << i)))
+		return -ENOENT;
+	rd->used &= ~(1 << i);
+	atomic_dec(&rapl_users);
+	return 0;
+}
+
+static void rapl_status(struct uncore_socket *us, counter_t ccno,
+                        struct perfmon_core_value *cv)
+{
+	struct rapl_domain *rd = &us->rapl[ccno / RAPL_MAX_USERS];
+	int i = ccno % RAPL_MAX_USERS;
+
+	rapl_fold(us);
+	cv->value = rapl_to_nsec_joules(rd->total - rd->start[i]);
+	cv->enabled_ns = nsec() - rd->tstamp[i];
+	cv->running_ns = cv->enabled_ns;
+}
+
+/* Picks the cores to run pev on: the first core of each socket in cset. */
+void perfmon_socket_core_set(const struct perfmon_event *pev,
+                             const struct core_set *cset,
+                             struct core_set *scset)
+{
+	if (PERFMON_GET_PMU(pev->flags) == PERFMON_PMU_RAPL)
+		run_once(ktask("rapl_fold", rapl_fold_ktask, NULL));
+	socket_first_cores(cset, scset);
+}
+
+/* The socket event versions of perfmon_do_cores_{alloc,free,status}(), run on
+ * the cores from perfmon_socket_core_set(). */
+counter_t perfmon_socket_alloc(const struct perfmon_event *pev)
+{
+	struct uncore_socket *us = cur_uncore_socket();
+	int ret;
+
+	spin_lock_irqsave(&us->lock);
+	if (PERFMON_GET_PMU(pev->flags) == PERFMON_PMU_RAPL) {
+		ret = rapl_alloc(us, pev);
+	} else {
+		ret = uncore_alloc(us, pev);
+		if (ret >= 0)
+			ret += PERFMON_GET_BOX(pev->flags) * UNC_NR_COUNTERS;
+	}
+	spin_unlock_irqsave(&us->lock);
+	return (counter_t) ret;
+}
+
+counter_t perfmon_socket_free(const struct perfmon_event *pev, counter_t ccno)
+{
+	struct uncore_socket *us = cur_uncore_socket();
+	int ret;
+
+	spin_lock_irqsave(&us->lock);
+	if (PERFMON_GET_PMU(pev->flags) == PERFMON_PMU_RAPL)
+		ret = rapl_free(us, ccno);
+	else
+		ret = uncore_free(us, pev, ccno % UNC_NR_COUNTERS);
+	spin_unlock_irqsave(&us->lock);
+	return (counter_t) ret;
+}
+
+void perfmon_socket_status(const struct perfmon_event *pev, counter_t ccno,
+                           struct perfmon_core_value *cv)
+{
+	struct uncore_socket *us = cur_uncore_socket();
+
+	spin_lock_irqsave(&us->lock);
+	if (PERFMON_GET_PMU(pev->flags) == PERFMON_PMU_RAPL)
+		rapl_status(us, ccno, cv);
+	else
+		uncore_status(us, pev, ccno % UNC_NR_COUNTERS, cv);
+	spin_unlock_irqsave(&us->lock);
+}
@@ -160,6 +160,19 @@ void tlbflush(void)
 		ept_inval_context();
 }
 
+/* Flushes the TLB entries for [start, end) in the current address space.  Past
+ * TLB_INVLPG_MAX_PGS pages, a full flush is cheaper than the INVLPGs.  An empty
+ * range means flush everything. */
+void tlb_flush_range(uintptr_t start, uintptr_t end)
+{
+	if ((end <= start) || (((end - start) >> PGSHIFT) > TLB_INVLPG_MAX_PGS)) {
+		tlbflush();
+		return;
+	}
+	for (uintptr_t va = ROUNDDOWN(start, PGSIZE); va < end; va += PGSIZE)
+		invlpg((void*)va);
+}
+
 /* Flushes a TLB, including global pages.  We should always have the CR4_PGE
  * flag set, but just in case, we'll check.  Toggling this bit flushes the TLB.
  */
@@ -11,7 +11,8 @@
  * - mapping segments doesn't support having a PTE already present
  * - mtrrs break big machines
  * - jumbo pages are only supported at the VM layer, not PM (a jumbo is 2^9
- * little pages, for example)
+ * little pages, for example).  Userspace only gets PTSIZE jumbos, for anon
+ * memory.
  * - usermemwalk and freeing might need some help (in higher layers of the
  * kernel). */
 
@@ -31,6 +32,7 @@
 #include <kmalloc.h>
 #include <page_alloc.h>
 #include <umem.h>
+#include <kmem_acct.h>
 
 extern char boot_pml4[], gdt64[], gdt64desc[];
 pgdir_t boot_pgdir;
@@ -41,6 +43,9 @@ pseudodesc_t gdt_pd;
 #define PG_WALK_SHIFT_MASK		0x00ff 		/* first byte = target shift */
 #define PG_WALK_CREATE 			0x0100
 
+/* Every page table is a KPT page and its EPT page, for kmem accounting */
+#define PT_BYTES				(2 * PGSIZE)
+
 kpte_t *pml_walk(kpte_t *pml, uintptr_t va, int flags);
 void map_segment(pgdir_t pgdir, uintptr_t va, size_t size, physaddr_t pa,
                  int perm, int pml_shift);
@@ -103,10 +108,11 @@ static kpte_t *__pml_walk(kpte_t *pml, uintptr_t va, int flags, int pml_shift)
 		if (!(flags & PG_WALK_CREATE))
 			return NULL;
 		new_pml_kva = get_cont_pages(1, KMALLOC_WAIT);
-		memset(new_pml_kva, 0, PGSIZE * 2);
 		/* Might want better error handling (we're probably out of memory) */
 		if (!new_pml_kva)
 			return NULL;
+		memset(new_pml_kva, 0, PGSIZE * 2);
+		kmem_account(KMEM_PGTBL, PT_BYTES);
 		/* We insert the new PT into the PML with U and W perms.  Permissions on
 		 * page table walks are anded together (if any of them are !User, the
 		 * translation is !User).  We put the perms on the last entry, not the
@@ -372,6 +378,7 @@ int unmap_segment(pgdir_t pgdir, uintptr_t va, size_t size)
 			}
 		}
 		free_cont_pages(KADDR(PTE_ADDR(*kpte)), 1);
+		kmem_account(KMEM_PGTBL, -PT_BYTES);
 		*kpte = 0;
 		return 0;
 	}
@@ -394,6 +401,44 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Like pgdir_walk, but stops at the level of a PTSIZE jumbo.  The PTE returned
+ * might be a jumbo, unmapped, or point to a page table of little pages (mapped,
+ * but not a jumbo). */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* If va is mapped by a PTSIZE jumbo, replaces the jumbo with a page table of
+ * little pages that map the same memory with the same settings.  Since the
+ * translations don't change, there's no need for a TLB shootdown.  Returns 0
+ * on success (including when there was no jumbo), -ENOMEM otherwise. */
+int pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	kpte_t *kpte = pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, PML2_SHIFT);
+	kpte_t *new_pml;
+	physaddr_t pa;
+	int settings;
+
+	if (!kpte || !kpte_is_mapped(kpte) || !kpte_is_jumbo(kpte))
+		return 0;
+	new_pml = get_cont_pages(1, 0);
+	if (!new_pml)
+		return -ENOMEM;
+	pa = kpte_get_paddr(kpte);
+	settings = (kpte_get_settings(kpte) & ~PTE_PS) |
+	           (pte_is_dirty(kpte) ? PTE_D : 0);
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	/* Same as __pml_walk's intermediate PTEs */
+	*kpte_to_epte(kpte) = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X | EPTE_W;
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	return 0;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -444,6 +489,43 @@ static void check_syms_va(void)
 	check_sym_va(BRK_END,        0x0000400000000000);
 }
 
+static int count_kernbase_pte(kpte_t *kpte, uintptr_t kva, int shift,
+                              bool visited_subs, void *data)
+{
+	size_t *nr_ptes = data;
+
+	if (!kpte_is_present(kpte) || !walk_is_complete(kpte, shift, PML1_SHIFT))
+		return 0;
+	switch (shift) {
+	case PML3_SHIFT:
+		nr_ptes[0]++;
+		break;
+	case PML2_SHIFT:
+		nr_ptes[1]++;
+		break;
+	default:
+		nr_ptes[2]++;
+	}
+	return 0;
+}
+
+/* KERNBASE maps all of physical memory, and everything the kernel touches goes
+ * through it, so it had better be jumbo pages: 1GB if we have them, o/w 2MB.
+ * Only the end of memory, if it isn't 2MB aligned, can use 4K pages.  vmap
+ * segments (get_vmap_segment) are elsewhere and always use 4K pages. */
+static void check_kernbase_jumbo(void)
+{
+	size_t nr_ptes[3] = {0};
+
+	pml_for_each(boot_pgdir.kpte, KERNBASE, max_paddr, count_kernbase_pte,
+	             nr_ptes);
+	printk("KERNBASE mapped with %lu 1GB, %lu 2MB and %lu 4KB pages\n",
+	       nr_ptes[0], nr_ptes[1], nr_ptes[2]);
+	if (nr_ptes[2] >= PTSIZE / PGSIZE)
+		panic("KERNBASE has %lu 4KB pages, should only be the tail",
+		      nr_ptes[2]);
+}
+
 /* Initializes anything related to virtual memory.  Paging is already on, but we
  * have a slimmed down page table. */
 void vm_init(void)
@@ -466,6 +548,7 @@ void vm_init(void)
 		            max_paddr - PML3_REACH, 0x0 + PML3_REACH,
 		            PTE_W | PTE_G, max_jumbo_shift);
 	}
+	check_kernbase_jumbo();
 	/* For the LAPIC and IOAPIC, we use PAT (but not *the* PAT flag) to make
 	 * these type UC */
 	map_segment(boot_pgdir, IOAPIC_BASE, APIC_SIZE, IOAPIC_PBASE,
@@ -495,8 +578,8 @@ void x86_cleanup_bootmem(void)
 }
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
- * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * specific VA and whatever arg is passed in.  Jumbo PTEs are passed too, with
+ * the VA of the start of the jumbo, so callbacks need to check pte_is_jumbo().
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -513,8 +596,8 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos */
-		if (shift != PML1_SHIFT)
+		/* memwalk CBs don't know how to handle intermediates */
+		if ((shift != PML1_SHIFT) && !kpte_is_jumbo(kpte))
 			return 0;
 		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
 	}
@@ -534,9 +617,30 @@ void env_pagetable_free(struct proc *p)
 	unmap_segment(p->env_pgdir, 0, UVPT - 0);
 	/* the page directory is not a PTE, so it never was freed */
 	free_cont_pages(pgdir_get_kpt(p->env_pgdir), 1);
+	kmem_account(KMEM_PGTBL, -PT_BYTES);
 	tlbflush();
 }
 
+/* Bytes of page tables, including the page directory, for p's part of its
+ * address space.  They aren't charged as they are allocated, since whoever
+ * builds them might not be p, so we count them instead. */
+size_t env_pagetable_bytes(struct proc *p)
+{
+	size_t nr_pts = 1;
+
+	int pt_count_cb(kpte_t *kpte, uintptr_t kva, int shift, bool visited_subs,
+	                void *data)
+	{
+		if (kpte_is_present(kpte) && !pte_is_final(kpte, shift))
+			nr_pts++;
+		return 0;
+	}
+	spin_lock(&p->pte_lock);
+	pml_for_each(pgdir_get_kpt(p->env_pgdir), 0, UVPT, pt_count_cb, 0);
+	spin_unlock(&p->pte_lock);
+	return nr_pts * PT_BYTES;
+}
+
 /* Remove the inner page tables along va's walk.  The internals are more
  * powerful.  We'll eventually want better arch-indep VM functions. */
 error_t	pagetable_remove(pgdir_t pgdir, void *va)
@@ -624,6 +728,7 @@ uintptr_t gva2gpa(struct proc *p, uintptr_t cr3, uintptr_t gva)
 int arch_pgdir_setup(pgdir_t boot_copy, pgdir_t *new_pd)
 {
 	kpte_t *kpt = get_cont_pages(1, KMALLOC_WAIT);
+	kmem_account(KMEM_PGTBL, PT_BYTES);
 	memcpy(kpt, boot_copy.kpte, PGSIZE);
 	epte_t *ept = kpte_to_epte(kpt);
 	memset(ept, 0, PGSIZE);
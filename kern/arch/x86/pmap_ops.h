@@ -55,6 +55,11 @@ static inline bool pte_is_mapped(pte_t pte)
 	return kpte_is_mapped(pte);
 }
 
+static inline bool pte_is_cow(pte_t pte)
+{
+	return kpte_is_cow(pte);
+}
+
 static inline bool pte_is_paged_out(pte_t pte)
 {
 	return kpte_is_paged_out(pte);
@@ -4,6 +4,8 @@
 #include <pmap.h>
 #include <smp.h>
 #include <arch/fsgsbase.h>
+#include <arch/perfmon.h>
+#include <arch/rdt.h>
 
 #include <string.h>
 #include <assert.h>
@@ -108,6 +110,8 @@ static void __attribute__((noreturn)) proc_pop_vmtf(struct vm_trapframe *tf)
 			handle_bad_vm_tf(tf);
 		}
 	}
+	if (gpc->halt_start)
+		vmm_halt_done(gpc);
 	vmcs_write(GUEST_RSP, tf->tf_rsp);
 	vmcs_write(GUEST_CR3, tf->tf_cr3);
 	vmcs_write(GUEST_RIP, tf->tf_rip);
@@ -303,7 +307,23 @@ void proc_secure_ctx(struct user_context *ctx)
 void __abandon_core(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	perfmon_proc_unload();
+	rdt_proc_unload();
 	lcr3(boot_cr3);
 	proc_decref(pcpui->cur_proc);
 	pcpui->cur_proc = 0;
 }
+
+/* Puts p's own counters and cache/membw limits, if any, on this core's HW for
+ * vcoreid. */
+void __arch_proc_startcore(struct proc *p, uint32_t vcoreid)
+{
+	perfmon_proc_load(p, vcoreid);
+	rdt_proc_load(p);
+}
+
+/* Called once no core has p loaded anymore. */
+void __arch_proc_free(struct proc *p)
+{
+	rdt_proc_free(p);
+}
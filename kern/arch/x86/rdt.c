@@ -0,0 +1,264 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Intel RDT cache and memory bandwidth allocation.  See rdt.h.
+ *
+ * The mask and throttle MSRs are per socket, and PQR_ASSOC is per core.  We
+ * don't bother finding a core per socket: changing a COS writes its MSRs from
+ * every core, with immediate kmsgs, since cores running MCPs might not get to
+ * a routine one for a long time.  That only happens when a process changes its
+ * limits.
+ *
+ * A process holds a reference on its COS.  Changing limits finds or programs a
+ * COS for the new ones, then drops the old one.  The qlock serializes
+ * programming, and the spinlock protects the refcnts, since dying processes
+ * drop theirs from wherever their last reference goes. */
+
+#include <arch/rdt.h>
+#include <arch/x86.h>
+#include <ros/arch/msr-index.h>
+#include <process.h>
+#include <percpu.h>
+#include <atomic.h>
+#include <kthread.h>
+#include <smp.h>
+#include <trap.h>
+#include <error.h>
+#include <stdio.h>
+
+#define RDT_MAX_COS				16
+
+struct rdt_cos {
+	uint64_t					cbm;		/* L3 ways we can fill */
+	unsigned int				mba_delay;	/* MBA throttle, 0 for none */
+	unsigned int				refcnt;
+};
+
+static struct {
+	bool						cat;
+	bool						mba;
+	unsigned int				nr_cos;
+	uint64_t					full_cbm;
+	unsigned int				mba_max_delay;
+} rdt_caps;
+
+/* COS 0 is the default, and is never handed out or changed. */
+static struct rdt_cos rdt_cos[RDT_MAX_COS];
+static qlock_t rdt_qlock = QLOCK_INITIALIZER(rdt_qlock);
+static spinlock_t rdt_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static DEFINE_PERCPU(uint32_t, rdt_cur_cos);
+
+void rdt_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	unsigned int nr_cos = RDT_MAX_COS;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_VENDOR_INTEL))
+		return;
+	cpuid(0x07, 0x0, 0, &ebx, 0, 0);
+	/* PQE: allocation is enumerated in leaf 0x10 */
+	if (!(ebx & (1 << 15)))
+		return;
+	cpuid(0x10, 0x0, 0, &ebx, 0, 0);
+	if (ebx & (1 << 1)) {
+		cpuid(0x10, 0x1, &eax, 0, 0, &edx);
+		rdt_caps.cat = TRUE;
+		rdt_caps.full_cbm = (1ULL << ((eax & 0x1f) + 1)) - 1;
+		nr_cos = MIN(nr_cos, (edx & 0xffff) + 1);
+	}
+	if (ebx & (1 << 3)) {
+		cpuid(0x10, 0x3, &eax, 0, &ecx, &edx);
+		/* Nonlinear throttling values don't map to a percentage */
+		if (ecx & (1 << 2)) {
+			rdt_caps.mba = TRUE;
+			rdt_caps.mba_max_delay = (eax & 0xfff) + 1;
+			nr_cos = MIN(nr_cos, (edx & 0xffff) + 1);
+		}
+	}
+	if (!rdt_caps.cat && !rdt_caps.mba)
+		return;
+	rdt_caps.nr_cos = nr_cos;
+	rdt_cos[0].cbm = rdt_caps.full_cbm;
+	printk("RDT: %d classes of service, CAT %s (cbm 0x%llx), MBA %s\n", nr_cos,
+	       rdt_caps.cat ? "on" : "off", rdt_caps.full_cbm,
+	       rdt_caps.mba ? "on" : "off");
+}
+
+bool rdt_cat_supported(void)
+{
+	return rdt_caps.cat;
+}
+
+bool rdt_mba_supported(void)
+{
+	return rdt_caps.mba;
+}
+
+static void __rdt_write_cos(uint32_t srcid, long a0, long a1, long a2)
+{
+	unsigned int cosid = a0;
+	atomic_t *nr_left = (atomic_t*)a1;
+
+	if (rdt_caps.cat)
+		write_msr(MSR_IA32_L3_QOS_MASK_0 + cosid, rdt_cos[cosid].cbm);
+	if (rdt_caps.mba)
+		write_msr(MSR_IA32_MBA_THRTL_0 + cosid, rdt_cos[cosid].mba_delay);
+	atomic_dec(nr_left);
+}
+
+static void rdt_write_cos(unsigned int cosid)
+{
+	atomic_t nr_left;
+
+	atomic_init(&nr_left, num_cores);
+	for (int i = 0; i < num_cores; i++)
+		send_kernel_message(i, __rdt_write_cos, cosid, (long)&nr_left, 0,
+		                    KMSG_IMMEDIATE);
+	while (atomic_read(&nr_left))
+		cpu_relax();
+}
+
+/* Finds or programs a COS for the limits and takes a reference on it.  Returns
+ * 0 if they are the defaults, or -1 if we're out of COSs.  Hold the qlock. */
+static int rdt_get_cos(uint64_t cbm, unsigned int mba_delay)
+{
+	int free_cos = -1;
+
+	if (cbm == rdt_cos[0].cbm && mba_delay == rdt_cos[0].mba_delay)
+		return 0;
+	spin_lock_irqsave(&rdt_lock);
+	for (int i = 1; i < rdt_caps.nr_cos; i++) {
+		if (!rdt_cos[i].refcnt) {
+			if (free_cos < 0)
+				free_cos = i;
+			continue;
+		}
+		if (rdt_cos[i].cbm == cbm && rdt_cos[i].mba_delay == mba_delay) {
+			rdt_cos[i].refcnt++;
+			spin_unlock_irqsave(&rdt_lock);
+			return i;
+		}
+	}
+	if (free_cos < 0) {
+		spin_unlock_irqsave(&rdt_lock);
+		return -1;
+	}
+	rdt_cos[free_cos].cbm = cbm;
+	rdt_cos[free_cos].mba_delay = mba_delay;
+	rdt_cos[free_cos].refcnt = 1;
+	spin_unlock_irqsave(&rdt_lock);
+	/* No one else can find it until its MSRs are written; we have the qlock */
+	rdt_write_cos(free_cos);
+	return free_cos;
+}
+
+static void rdt_put_cos(int cosid)
+{
+	if (!cosid)
+		return;
+	spin_lock_irqsave(&rdt_lock);
+	rdt_cos[cosid].refcnt--;
+	spin_unlock_irqsave(&rdt_lock);
+}
+
+/* Runs on cores that might be running the process whose COS changed. */
+static void __rdt_reload(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+
+	if (current == p)
+		rdt_proc_load(p);
+}
+
+static void rdt_proc_set(struct proc *p, uint64_t cbm, unsigned int mba_delay)
+{
+	struct vcore *vc_i;
+	int old_cos, new_cos;
+	int8_t irq_state = 0;
+
+	qlock(&rdt_qlock);
+	new_cos = rdt_get_cos(cbm, mba_delay);
+	if (new_cos < 0) {
+		qunlock(&rdt_qlock);
+		error(ENOSPC, "out of RDT classes of service");
+	}
+	old_cos = p->rdt_cos;
+	p->rdt_cos = new_cos;
+	rdt_put_cos(old_cos);
+	qunlock(&rdt_qlock);
+	/* Cores running p switch now, instead of whenever they enter the kernel.
+	 * We'd miss a core that is just about to start p, but it will read the new
+	 * COS when it does. */
+	spin_lock(&p->proc_lock);
+	TAILQ_FOREACH(vc_i, &p->online_vcs, list)
+		send_kernel_message(vc_i->pcoreid, __rdt_reload, (long)p, 0, 0,
+		                    KMSG_IMMEDIATE);
+	spin_unlock(&p->proc_lock);
+	if (current == p) {
+		disable_irqsave(&irq_state);
+		rdt_proc_load(p);
+		enable_irqsave(&irq_state);
+	}
+}
+
+/* cbm is a mask of the L3 ways p can allocate into, which must be contiguous.
+ * 0 gives p the whole cache back. */
+void rdt_proc_set_cat(struct proc *p, uint64_t cbm)
+{
+	if (!rdt_caps.cat)
+		error(ENOTSUP, "no L3 cache allocation");
+	if (!cbm)
+		cbm = rdt_caps.full_cbm;
+	if ((cbm & ~rdt_caps.full_cbm) || ((cbm >> __builtin_ctzll(cbm)) &
+	                                   ((cbm >> __builtin_ctzll(cbm)) + 1)))
+		error(EINVAL, "cbm 0x%llx must be contiguous ways within 0x%llx", cbm,
+		      rdt_caps.full_cbm);
+	rdt_proc_set(p, cbm, rdt_cos[p->rdt_cos].mba_delay);
+}
+
+/* mba_pct is the rough percentage of the memory bandwidth p can use, in 1-100.
+ * The hardware rounds to its own granularity. */
+void rdt_proc_set_mba(struct proc *p, unsigned int mba_pct)
+{
+	if (!rdt_caps.mba)
+		error(ENOTSUP, "no memory bandwidth allocation");
+	if (!mba_pct || mba_pct > 100)
+		error(EINVAL, "mba percentage %d must be in 1-100", mba_pct);
+	rdt_proc_set(p, rdt_cos[p->rdt_cos].cbm,
+	             MIN(100 - mba_pct, rdt_caps.mba_max_delay));
+}
+
+/* Called once no core has p loaded anymore. */
+void rdt_proc_free(struct proc *p)
+{
+	rdt_put_cos(p->rdt_cos);
+	p->rdt_cos = 0;
+}
+
+static void rdt_set_pqr(uint32_t cosid)
+{
+	uint32_t *cur_cos = PERCPU_VARPTR(rdt_cur_cos);
+
+	if (*cur_cos == cosid)
+		return;
+	/* RMID 0, we don't do monitoring */
+	write_msr(MSR_IA32_PQR_ASSOC, (uint64_t)cosid << 32);
+	*cur_cos = cosid;
+}
+
+/* Called with IRQs off as p starts running on this core. */
+void rdt_proc_load(struct proc *p)
+{
+	if (!rdt_caps.nr_cos)
+		return;
+	rdt_set_pqr(ACCESS_ONCE(p->rdt_cos));
+}
+
+/* Called as the current process leaves this core, so the kernel and whoever
+ * runs next don't inherit its limits. */
+void rdt_proc_unload(void)
+{
+	if (!rdt_caps.nr_cos)
+		return;
+	rdt_set_pqr(0);
+}
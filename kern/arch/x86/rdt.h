@@ -0,0 +1,31 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Intel Resource Director Technology: L3 cache allocation (CAT) and memory
+ * bandwidth allocation (MBA).
+ *
+ * Each process can be limited to some of the L3's ways and some fraction of
+ * the memory bandwidth, with the "cat MASK" and "mba PERCENT" #proc ctl
+ * messages.  Processes with the same limits share a hardware class of service
+ * (COS), and everyone else runs in COS 0, which has the whole cache and no
+ * throttling.  A core switches to a process's COS when it starts running the
+ * process.
+ *
+ * This is the hardware version of page coloring (CONFIG_PAGE_COLORING): it
+ * splits the cache by ways instead of by sets, so it costs neither memory nor
+ * fragmentation, but there are only a handful of COSs. */
+
+#pragma once
+
+#include <ros/common.h>
+
+struct proc;
+
+void rdt_init(void);
+bool rdt_cat_supported(void);
+bool rdt_mba_supported(void);
+void rdt_proc_set_cat(struct proc *p, uint64_t cbm);
+void rdt_proc_set_mba(struct proc *p, unsigned int mba_pct);
+void rdt_proc_free(struct proc *p);
+void rdt_proc_load(struct proc *p);
+void rdt_proc_unload(void);
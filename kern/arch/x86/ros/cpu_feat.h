@@ -16,4 +16,9 @@
 #define CPU_FEAT_X86_XSAVE				(__CPU_FEAT_ARCH_START + 3)
 #define CPU_FEAT_X86_XSAVEOPT			(__CPU_FEAT_ARCH_START + 4)
 #define CPU_FEAT_X86_FSGSBASE			(__CPU_FEAT_ARCH_START + 5)
+#define CPU_FEAT_X86_ADX				(__CPU_FEAT_ARCH_START + 6)
+#define CPU_FEAT_X86_ERMS				(__CPU_FEAT_ARCH_START + 7)
+#define CPU_FEAT_X86_XINUSE				(__CPU_FEAT_ARCH_START + 8)
+#define CPU_FEAT_X86_RDRAND				(__CPU_FEAT_ARCH_START + 9)
+#define CPU_FEAT_X86_RDSEED				(__CPU_FEAT_ARCH_START + 10)
 #define __NR_CPU_FEAT					(__CPU_FEAT_ARCH_START + 64)
@@ -275,6 +275,7 @@ typedef struct x86_pgdir {
 #define PTE_PS			0x080	/* Page Size */
 #define __PTE_PAT		0x080	/* Page attribute table */
 #define PTE_G			0x100	/* Global Page */
+#define PTE_COW			0x200	/* Software: copy on write */
 #define __PTE_JPAT		0x800	/* Jumbo PAT */
 #define PTE_NOCACHE		(__PTE_PWT | __PTE_PCD)
 #define PTE_WRITECOMB	(__PTE_PCD)
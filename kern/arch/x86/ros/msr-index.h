@@ -457,6 +457,11 @@
 
 #define MSR_IA32_TSC_DEADLINE		0x000006E0
 
+/* Resource Director Technology: cache and memory bandwidth allocation */
+#define MSR_IA32_PQR_ASSOC		0x00000c8f
+#define MSR_IA32_L3_QOS_MASK_0		0x00000c90
+#define MSR_IA32_MBA_THRTL_0		0x00000d50
+
 /* P4/Xeon+ specific */
 #define MSR_IA32_MCG_EAX		0x00000180
 #define MSR_IA32_MCG_EBX		0x00000181
@@ -39,6 +39,16 @@
  *   U32 NUM_VALUES; (always num_cores)
  *   U64 VALUES[NUM_VALUES]; (one value per core - zero if the counter was not
  *                            active in that core)
+ *   U64 ENABLED_NS[NUM_VALUES]; (how long the event has been open)
+ *   U64 RUNNING_NS[NUM_VALUES]; (how long it was actually on a counter)
+ *
+ * There can be more variable counter events open than HW counters, in which
+ * case they take turns on the counters.  VALUES only covers while they were on
+ * them, so for an estimate of the full count, scale by ENABLED_NS/RUNNING_NS.
+ *
+ * Uncore and RAPL events (see PERFMON_PMU below) count for a whole socket.  They
+ * are only opened on the first core of each socket in CPUMASK, and the VALUES
+ * of the other cores are zero.
  *
  * PERFMON_CMD_COUNTER_CLOSE request
  *   U8 CMD; (= PERFMON_CMD_COUNTER_CLOSE)
@@ -64,6 +74,31 @@
 
 #define PERFMON_FIXED_EVENT (1 << 0)
 
+/* EVENT_FLAGS also say which PMU an event is for, and which of its boxes:
+ * a CBo (one per core), an IMC channel or a QPI port.  Uncore events use the
+ * EVENT, MASK, EDGE, INVCMSK and CMASK fields of the descriptor.  RAPL events
+ * are one of the PERFMON_RAPL_* energy domains in EVENT, and count nanojoules.
+ */
+#define PERFMON_PMU MKBITFIELD(8, 8)
+#define PERFMON_BOX MKBITFIELD(16, 8)
+
+#define PERFMON_PMU_CORE 0
+#define PERFMON_PMU_RAPL 1
+#define PERFMON_PMU_UNC_CBO 2
+#define PERFMON_PMU_UNC_IMC 3
+#define PERFMON_PMU_UNC_QPI 4
+
+#define PERFMON_RAPL_PKG 0
+#define PERFMON_RAPL_PP0 1
+#define PERFMON_RAPL_PP1 2
+#define PERFMON_RAPL_DRAM 3
+#define PERFMON_RAPL_DOMAINS 4
+
+#define PERFMON_GET_PMU(v) BF_GETFIELD(v, PERFMON_PMU)
+#define PERFMON_SET_PMU(v, x) BF_SETFIELD(v, x, PERFMON_PMU)
+#define PERFMON_GET_BOX(v) BF_GETFIELD(v, PERFMON_BOX)
+#define PERFMON_SET_BOX(v, x) BF_SETFIELD(v, x, PERFMON_BOX)
+
 #define PMEV_EVENT MKBITFIELD(0, 8)
 #define PMEV_MASK MKBITFIELD(8, 8)
 #define PMEV_USR MKBITFIELD(16, 1)
@@ -114,3 +149,9 @@ static inline bool perfmon_is_fixed_event(const struct perfmon_event *pev)
 {
 	return (pev->flags & PERFMON_FIXED_EVENT) != 0;
 }
+
+/* Counts for a whole socket, rather than for a core */
+static inline bool perfmon_is_socket_event(const struct perfmon_event *pev)
+{
+	return PERFMON_GET_PMU(pev->flags) != PERFMON_PMU_CORE;
+}
@@ -412,6 +412,7 @@ enum vmcs_field {
 #define INTR_TYPE_SOFT_EXCEPTION	(6 << 8) /* software exception */
 
 #define VMX_POSTED_OUTSTANDING_NOTIF		256
+#define VMX_POSTED_IRQ_DESC_SZ				64
 
 /* GUEST_INTERRUPTIBILITY_INFO flags. */
 #define GUEST_INTR_STATE_STI		0x00000001
@@ -29,7 +29,6 @@
 
 extern handler_wrapper_t handler_wrappers[NUM_HANDLER_WRAPPERS];
 int x86_num_cores_booted = 1;
-uintptr_t smp_stack_top;
 barrier_t generic_barrier;
 
 #define DECLARE_HANDLER_CHECKLISTS(vector)                          \
@@ -103,29 +102,71 @@ void smp_final_core_init(void)
 #define trampoline_pg 0x00001000UL
 extern char smp_entry[];
 extern char smp_entry_end[];
-extern char smp_boot_lock[];
+extern char smp_boot_gate[];
 extern char smp_semaphore[];
 
+/* How long we wait for the APs to check in before giving up on the rest. */
+#define SMP_BOOT_TIMEOUT_USEC		500000
+
+/* Stack tops for the APs, prepared by core 0 before the SIPI.  Each AP takes a
+ * ticket from x86_num_cores_booted in smp_entry and uses the stack in that
+ * slot, so they can all come up at once.  Slot 0 is core 0's, and is unused. */
+uintptr_t smp_stacks[MAX_NUM_CORES];
+
 static inline uint16_t *get_smp_semaphore()
 {
 	return (uint16_t *)(smp_semaphore - smp_entry + trampoline_pg);
 }
 
-static void __spin_bootlock_raw(void)
+/* Once the gate is closed, APs that haven't started yet will park in real mode
+ * instead of booting.  The xchg orders the store before our reads of the
+ * semaphore, which pairs with the AP's locked inc before it checks the gate:
+ * either the AP sees the gate closed, or we see its count on the semaphore. */
+static void __close_boot_gate(void)
 {
-	uint16_t *bootlock = (uint16_t*)(smp_boot_lock - smp_entry + trampoline_pg);
-	/* Same lock code as in smp_entry */
-	asm volatile ("movw $1, %%ax;   "
-				  "1:               "
-	              "xchgw %%ax, %0;  "
-	              "test %%ax, %%ax; "
-	              "jne 1b;" : : "m"(*bootlock) : "eax", "cc", "memory");
+	uint16_t *gate = (uint16_t*)(smp_boot_gate - smp_entry + trampoline_pg);
+	uint16_t closed = 1;
+
+	asm volatile ("xchgw %0, %1" : "+r"(closed), "+m"(*gate) : : "memory");
+}
+
+/* Sets up the kernel stack, GDT, and TSS for an AP ahead of time, so the APs
+ * do not need to allocate (or share a pcpui) while they boot in parallel. */
+static uintptr_t smp_prep_core(void)
+{
+	uintptr_t stack_top = get_kstack();
+	/* This blob is the GDT, the GDT PD, and the TSS. */
+	unsigned int blob_size = sizeof(segdesc_t) * SEG_COUNT +
+	                         sizeof(pseudodesc_t) + sizeof(taskstate_t);
+	/* TODO: don't use kmalloc - might have issues in the future */
+	void *gdt_etc = kmalloc(blob_size, KMALLOC_WAIT);	/* never freed */
+	taskstate_t *my_ts = gdt_etc;
+	pseudodesc_t *my_gdt_pd = (void*)my_ts + sizeof(taskstate_t);
+	segdesc_t *my_gdt = (void*)my_gdt_pd + sizeof(pseudodesc_t);
+	syssegdesc_t *ts_slot = (syssegdesc_t*)&my_gdt[GD_TSS >> 3];
+
+	/* This is a bit ghetto: we need to communicate our GDT and TSS's location
+	 * to smp_main() and smp_percpu_init(), but the AP can't trust its coreid
+	 * (since they haven't been remapped yet (so we can't write it directly to
+	 * per_cpu_info)).  So we use the bottom of the stack page... */
+	*kstack_bottom_addr(stack_top) = (uintptr_t)gdt_etc;
+	memcpy(my_gdt, gdt, sizeof(segdesc_t) * SEG_COUNT);
+	*my_gdt_pd = (pseudodesc_t) {
+		sizeof(segdesc_t) * SEG_COUNT - 1, (uintptr_t) my_gdt };
+	/* Set up the kernel stack for when changing rings */
+	x86_set_stacktop_tss(my_ts, stack_top);
+	x86_set_dfstacktop_tss(my_ts, (uintptr_t)kpage_alloc_addr() + PGSIZE);
+	*ts_slot = (syssegdesc_t)SEG_SYS_SMALL(STS_T32A, (uintptr_t)my_ts,
+	                                       sizeof(taskstate_t), 0);
+	return stack_top;
 }
 
 void smp_boot(void)
 {
 	struct per_cpu_info *pcpui0 = &per_cpu_info[0];
-	page_t *smp_stack;
+	uint64_t start = read_tsc();
+	uint64_t timeout = start + usec2tsc(SMP_BOOT_TIMEOUT_USEC);
+	int nr_prepped = MIN(num_cores, MAX_NUM_CORES);
 
 	// NEED TO GRAB A LOWMEM FREE PAGE FOR AP BOOTUP CODE
 	// page1 (2nd page) is reserved, hardcoded in pmap.c
@@ -136,16 +177,17 @@ void smp_boot(void)
 	/* Make sure the trampoline page is mapped.  64 bit already has the tramp pg
 	 * mapped (1 GB of lowmem), so this is a nop. */
 
-	// Allocate a stack for the cores starting up.  One for all, must share
-	if (kpage_alloc(&smp_stack))
-		panic("No memory for SMP boot stack!");
-	smp_stack_top = (uintptr_t)(page2kva(smp_stack) + PGSIZE);
+	/* Every AP we expect gets its own stack.  Any extras, beyond what ACPI
+	 * told us about, will find an empty slot and park. */
+	for (int i = 1; i < nr_prepped; i++)
+		smp_stacks[i] = smp_prep_core();
 
 	/* During SMP boot, core_id_early() returns 0, so all of the cores, which
 	 * grab locks concurrently, share the same pcpui and thus the same
 	 * lock_depth.  We need to disable checking until core_id works properly. */
 	pcpui0->__lock_checking_enabled = 0;
-	// Start the IPI process (INIT, wait, SIPI, wait, SIPI, wait)
+	/* Start the IPI process (INIT, wait, SIPI).  Both are broadcasts, so all of
+	 * the APs come up together. */
 	send_init_ipi();
 	// SDM 3A is a little wonky wrt the proper delays.  These are my best guess.
 	udelay(10000);
@@ -156,26 +198,23 @@ void smp_boot(void)
 	udelay(200);
 	send_startup_ipi(0x01);
 	*/
-	udelay(500000);
 
-	// Each core will also increment smp_semaphore, and decrement when it is done,
-	// all in smp_entry.  It's purpose is to keep Core0 from competing for the
-	// smp_boot_lock.  So long as one AP increments the sem before the final
-	// LAPIC timer goes off, all available cores will be initialized.
+	/* Rather than waiting a fixed time for the stragglers, we're done as soon
+	 * as everyone ACPI told us about has taken a ticket. */
+	while ((ACCESS_ONCE(x86_num_cores_booted) < num_cores) &&
+	       (read_tsc() < timeout))
+		cpu_relax();
+	/* From here on, no other cores are coming up.  If an AP got in before we
+	 * closed the gate, it's on the semaphore and we wait for it to finish
+	 * smp_main.  Any later ones spin on the trampoline (which we must be
+	 * careful to not deallocate).  Letting them proceed can crash the machine,
+	 * specifically when they turn on paging and have that temp mapping pulled
+	 * out from under them. */
+	__close_boot_gate();
 	while (*get_smp_semaphore())
 		cpu_relax();
-
-	// From here on, no other cores are coming up.  Grab the lock to ensure it.
-	// Another core could be in it's prelock phase and be trying to grab the lock
-	// forever....
-	// The lock exists on the trampoline, so it can be grabbed right away in
-	// real mode.  If core0 wins the race and blocks other CPUs from coming up
-	// it can crash the machine if the other cores are allowed to proceed with
-	// booting.  Specifically, it's when they turn on paging and have that temp
-	// mapping pulled out from under them.  Now, if a core loses, it will spin
-	// on the trampoline (which we must be careful to not deallocate)
-	__spin_bootlock_raw();
-	printk("Number of Cores Detected: %d\n", x86_num_cores_booted);
+	printk("Number of Cores Detected: %d, up in %llu usec\n",
+	       x86_num_cores_booted, tsc2usec(read_tsc() - start));
 #ifdef CONFIG_DISABLE_SMT
 	assert(!(num_cores % 2));
 	printk("Using only %d Idlecores (SMT Disabled)\n", num_cores >> 1);
@@ -188,12 +227,12 @@ void smp_boot(void)
 	if (x86_num_cores_booted == num_cores) {
 		page_decref(pa2page(trampoline_pg));
 	} else {
+		/* APs past the ones we prepped took a ticket, but are parked. */
 		warn("ACPI/MP found %d cores, smp_boot initialized %d, using %d\n",
-		     num_cores, x86_num_cores_booted, x86_num_cores_booted);
-		num_cores = x86_num_cores_booted;
+		     num_cores, x86_num_cores_booted,
+		     MIN(x86_num_cores_booted, nr_prepped));
+		num_cores = MIN(x86_num_cores_booted, nr_prepped);
 	}
-	// Dealloc the temp shared stack
-	page_decref(smp_stack);
 
 	// Set up the generic remote function call facility
 	init_smp_call_function();
@@ -206,13 +245,12 @@ void smp_boot(void)
 }
 
 /* This is called from smp_entry by each core to finish the core bootstrapping.
- * There is a spinlock around this entire function in smp_entry, for a few
- * reasons, the most important being that all cores use the same stack when
- * entering here.
+ * The APs run this concurrently, on the stacks smp_boot() prepared for them,
+ * so it must not allocate or grab locks.
  *
  * Do not use per_cpu_info in here.  Do whatever you need in smp_percpu_init().
  */
-uintptr_t smp_main(void)
+void smp_main(uintptr_t my_stack_top)
 {
 	/*
 	// Print some diagnostics.  Uncomment if there're issues.
@@ -226,45 +264,17 @@ uintptr_t smp_main(void)
 	cprintf("Num_Cores: %d\n\n", num_cores);
 	*/
 
-	// Get a per-core kernel stack
-	uintptr_t my_stack_top = get_kstack();
-
-	/* This blob is the GDT, the GDT PD, and the TSS. */
-	unsigned int blob_size = sizeof(segdesc_t) * SEG_COUNT +
-	                         sizeof(pseudodesc_t) + sizeof(taskstate_t);
-	/* TODO: don't use kmalloc - might have issues in the future */
-	void *gdt_etc = kmalloc(blob_size, 0);		/* we'll never free this btw */
+	void *gdt_etc = (void*)*kstack_bottom_addr(my_stack_top);
 	taskstate_t *my_ts = gdt_etc;
 	pseudodesc_t *my_gdt_pd = (void*)my_ts + sizeof(taskstate_t);
-	segdesc_t *my_gdt = (void*)my_gdt_pd + sizeof(pseudodesc_t);
-	/* This is a bit ghetto: we need to communicate our GDT and TSS's location
-	 * to smp_percpu_init(), but we can't trust our coreid (since they haven't
-	 * been remapped yet (so we can't write it directly to per_cpu_info)).  So
-	 * we use the bottom of the stack page... */
-	*kstack_bottom_addr(my_stack_top) = (uintptr_t)gdt_etc;
 
-	// Build and load the gdt / gdt_pd
-	memcpy(my_gdt, gdt, sizeof(segdesc_t)*SEG_COUNT);
-	*my_gdt_pd = (pseudodesc_t) {
-		sizeof(segdesc_t)*SEG_COUNT - 1, (uintptr_t) my_gdt };
 	asm volatile("lgdt %0" : : "m"(*my_gdt_pd));
-
-	/* Set up our kernel stack when changing rings */
-	x86_set_stacktop_tss(my_ts, my_stack_top);
-	// Initialize the TSS field of my_gdt.
-	syssegdesc_t *ts_slot = (syssegdesc_t*)&my_gdt[GD_TSS >> 3];
-	*ts_slot = (syssegdesc_t)SEG_SYS_SMALL(STS_T32A, (uintptr_t)my_ts,
-	                                       sizeof(taskstate_t), 0);
 	// Load the TSS
 	ltr(GD_TSS);
-
 	// Loads the same IDT used by the other cores
 	asm volatile("lidt %0" : : "m"(idt_pd));
 
 	apiconline();
-
-
-	return my_stack_top; // will be loaded in smp_entry.S
 }
 
 /* Perform any initialization needed by per_cpu_info.  Make sure every core
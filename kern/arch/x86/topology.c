@@ -15,6 +15,8 @@
 
 struct topology_info cpu_topology_info;
 int *os_coreid_lookup;
+static struct numa_mem_range *numa_mem_ranges;
+static int nr_numa_mem_ranges;
 
 #define num_cpus            (cpu_topology_info.num_cpus)
 #define num_sockets         (cpu_topology_info.num_sockets)
@@ -214,6 +216,7 @@ static void init_core_list(uint32_t core_bits, uint32_t cpu_bits)
 			core_id = apic_id & (max_cores_per_cpu - 1);
 
 			core_list[os_coreid].numa_id = find_numa_domain(apic_id);
+			core_list[os_coreid].raw_numa_id = core_list[os_coreid].numa_id;
 			core_list[os_coreid].raw_socket_id = raw_socket_id;
 			core_list[os_coreid].socket_id = -1;
 			core_list[os_coreid].cpu_id = cpu_id;
@@ -306,6 +309,59 @@ static void update_core_list_with_absolute_ids(void)
 	}
 }
 
+/* Converts a proximity domain from the SRAT to our numa_id.  Domains without
+ * any cores (memory-only nodes) are lumped in with node 0. */
+static int dom_to_numa_id(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (core_list[i].raw_numa_id == dom)
+			return core_list[i].numa_id;
+	}
+	return 0;
+}
+
+/* Builds the table of SRAT memory ranges.  Assumes the core_list is set. */
+static void init_numa_mem_ranges(void)
+{
+	int nr_ranges = 0;
+
+	if (srat == NULL)
+		return;
+	for (int i = 0; i < srat->nchildren; i++) {
+		struct Srat *temp = srat->children[i]->tbl;
+
+		if (temp != NULL && temp->type == SRmem && temp->mem.len)
+			nr_ranges++;
+	}
+	if (!nr_ranges)
+		return;
+	numa_mem_ranges = kzmalloc(nr_ranges * sizeof(struct numa_mem_range), 0);
+	for (int i = 0; i < srat->nchildren; i++) {
+		struct Srat *temp = srat->children[i]->tbl;
+
+		if (temp == NULL || temp->type != SRmem || !temp->mem.len)
+			continue;
+		numa_mem_ranges[nr_numa_mem_ranges].start = temp->mem.addr;
+		numa_mem_ranges[nr_numa_mem_ranges].end = temp->mem.addr +
+		                                          temp->mem.len;
+		numa_mem_ranges[nr_numa_mem_ranges].numa_id =
+		    dom_to_numa_id(temp->mem.dom);
+		nr_numa_mem_ranges++;
+	}
+}
+
+/* Returns the NUMA node of a physical address.  Addresses that aren't in any
+ * SRAT range (or machines without an SRAT) are on node 0. */
+int paddr_to_numa_id(uintptr_t paddr)
+{
+	for (int i = 0; i < nr_numa_mem_ranges; i++) {
+		if (numa_mem_ranges[i].start <= paddr &&
+		    paddr < numa_mem_ranges[i].end)
+			return numa_mem_ranges[i].numa_id;
+	}
+	return 0;
+}
+
 static void build_topology(uint32_t core_bits, uint32_t cpu_bits)
 {
 	set_num_cores();
@@ -315,6 +371,7 @@ static void build_topology(uint32_t core_bits, uint32_t cpu_bits)
 	init_core_list(core_bits, cpu_bits);
 	set_remaining_topology_info();
 	update_core_list_with_absolute_ids();
+	init_numa_mem_ranges();
 }
 
 static void build_flat_topology(void)
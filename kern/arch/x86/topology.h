@@ -10,6 +10,7 @@
 
 struct core_info {
 	int numa_id;
+	int raw_numa_id;
 	int socket_id;
 	int cpu_id;
 	int core_id;
@@ -32,12 +33,21 @@ struct topology_info {
 	struct core_info *core_list;
 };
 
+/* A range of physical memory, from the SRAT, and the NUMA node it belongs to */
+struct numa_mem_range {
+	uintptr_t start;
+	uintptr_t end;
+	int numa_id;
+};
+
 extern struct topology_info cpu_topology_info;
 extern int *os_coreid_lookup;
 #define num_cores (cpu_topology_info.num_cores)
+#define num_numa_nodes (cpu_topology_info.num_numa)
 
 void topology_init();
 void print_cpu_topology();
+int paddr_to_numa_id(uintptr_t paddr);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -54,6 +64,11 @@ static inline int get_os_coreid(int hw_coreid)
 	return os_coreid_lookup[hw_coreid];
 }
 
+static inline int core_numa_id(int os_coreid)
+{
+	return cpu_topology_info.core_list[os_coreid].numa_id;
+}
+
 static inline int numa_id(void)
 {
 	int os_coreid = os_coreid_lookup[lapic_get_id()];
@@ -21,6 +21,8 @@
 #include <arch/mptables.h>
 
 taskstate_t ts;
+/* Core 0's double fault stack.  The other cores get theirs in smp_boot. */
+static uint8_t boot_dfstack[PGSIZE] __attribute__((aligned(PGSIZE)));
 
 /* Interrupt descriptor table.  64 bit needs 16 byte alignment (i think). */
 gatedesc_t __attribute__((aligned (16))) idt[256] = { { 0 } };
@@ -147,10 +149,12 @@ void idt_init(void)
 	 * DPL 3 means this can be triggered by the int instruction */
 	idt[T_SYSCALL].gd_dpl = 3;
 	idt[T_BRKPT].gd_dpl = 3;
+	idt[T_DBLFLT].gd_ist = 1;
 
 	/* Set up our kernel stack when changing rings */
 	/* Note: we want 16 byte aligned kernel stack frames (AMD 2:8.9.3) */
 	x86_set_stacktop_tss(&ts, (uintptr_t)bootstacktop);
+	x86_set_dfstacktop_tss(&ts, (uintptr_t)boot_dfstack + PGSIZE);
 	x86_sysenter_init((uintptr_t)bootstacktop);
 
 #ifdef CONFIG_KTHREAD_POISON
@@ -388,6 +392,13 @@ static void trap_dispatch(struct hw_trapframe *hw_tf)
 		case T_PGFLT:
 			handled = __handle_page_fault(hw_tf, &aux);
 			break;
+		case T_DBLFLT:
+			/* We're on the IST stack; there's no going back. */
+			print_trapframe(hw_tf);
+			if (kstack_is_guard(rcr2()))
+				panic("Kernel stack overflow, hit guard at %p!", rcr2());
+			panic("Double fault, cr2 %p!", rcr2());
+			break;
 		case T_FPERR:
 			handled = try_handle_exception_fixup(hw_tf);
 			if (!handled)
@@ -569,8 +580,10 @@ void handle_irq(struct hw_trapframe *hw_tf)
 	assert(0);
 }
 
-/* The irq field may be ignored based on the type of Bus. */
-int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
+static int route_irq_h(struct irq_handler *irq_h, int os_coreid);
+
+static struct irq_handler *__register_irq(int irq, isr_t handler, void *irq_arg,
+                                          uint32_t tbdf)
 {
 	struct irq_handler *irq_h;
 	int vector;
@@ -581,7 +594,7 @@ int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
 	vector = bus_irq_setup(irq_h);
 	if (vector == -1) {
 		kfree(irq_h);
-		return -1;
+		return NULL;
 	}
 	printk("IRQ %d, vector %d (0x%x), type %s\n", irq, vector, vector,
 	       irq_h->type);
@@ -600,7 +613,44 @@ int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
 	 * The lapic IRQs need to be unmasked on a per-core basis */
 	if (irq_h->unmask && strcmp(irq_h->type, "lapic"))
 		irq_h->unmask(irq_h, vector);
-	return 0;
+	return irq_h;
+}
+
+/* The irq field may be ignored based on the type of Bus. */
+int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
+{
+	return __register_irq(irq, handler, irq_arg, tbdf) ? 0 : -1;
+}
+
+/* Like register_irq(), but routes the irq to os_coreid.  Multi-queue devices
+ * use this to give each queue's MSI-X vector its own core.  The handler stays
+ * registered even if the routing fails. */
+int register_irq_core(int irq, isr_t handler, void *irq_arg, uint32_t tbdf,
+                      int os_coreid)
+{
+	struct irq_handler *irq_h;
+
+	irq_h = __register_irq(irq, handler, irq_arg, tbdf);
+	if (!irq_h)
+		return -1;
+	return route_irq_h(irq_h, os_coreid);
+}
+
+/* Like register_irq_core(), but returns the apic vector, or -1 if the irq
+ * couldn't be registered.  Devices with an MSI-X vector per queue call this
+ * once per queue (each call takes the next table entry), and can hand the
+ * vector to route_irqs() later to move the queue to another core.  A failed
+ * route is reported, but the vector stays registered where it was. */
+int register_irq_vector(int irq, isr_t handler, void *irq_arg, uint32_t tbdf,
+                        int os_coreid)
+{
+	struct irq_handler *irq_h;
+
+	irq_h = __register_irq(irq, handler, irq_arg, tbdf);
+	if (!irq_h)
+		return -1;
+	route_irq_h(irq_h, os_coreid);
+	return irq_h->apic_vector;
 }
 
 /* These routing functions only allow the routing of an irq to a single core.
@@ -677,6 +727,36 @@ void send_ipi(uint32_t os_coreid, uint8_t vector)
 	__send_ipi(hw_coreid, vector);
 }
 
+/* Declared in x86/arch.h.  Sends vector to the nr cores in os_coreids, with one
+ * IPI per x2APIC cluster instead of one per core.  An x2APIC's logical ID is
+ * fixed by its APIC ID: bits 4 and up pick the cluster, and bits 0-3 pick one
+ * of 16 cores in it. */
+void send_ipi_multi(uint32_t *os_coreids, uint32_t nr, uint8_t vector)
+{
+	int hw_coreids[nr];
+	uint16_t cluster, mask;
+
+	for (int i = 0; i < nr; i++) {
+		hw_coreids[i] = get_hw_coreid(os_coreids[i]);
+		if (hw_coreids[i] == -1)
+			panic("Unmapped OS coreid (OS %d)!\n", os_coreids[i]);
+	}
+	for (int i = 0; i < nr; i++) {
+		if (hw_coreids[i] == -1)
+			continue;
+		cluster = hw_coreids[i] >> 4;
+		mask = 0;
+		/* Gather everyone else in the cluster, marking them as sent */
+		for (int j = i; j < nr; j++) {
+			if (hw_coreids[j] == -1 || hw_coreids[j] >> 4 != cluster)
+				continue;
+			mask |= 1 << (hw_coreids[j] & 0xf);
+			hw_coreids[j] = -1;
+		}
+		send_cluster_ipi(cluster, mask, vector);
+	}
+}
+
 /****************** VM exit handling ******************/
 
 static bool handle_vmexit_cpuid(struct vm_trapframe *tf)
@@ -727,9 +807,11 @@ static bool handle_vmexit_nmi(struct vm_trapframe *tf)
 
 bool handle_vmexit_msr(struct vm_trapframe *tf)
 {
+	struct guest_pcore *gpc = lookup_guest_pcore(current,
+	                                             tf->tf_guest_pcoreid);
 	bool ret;
 
-	ret = vmm_emulate_msr(&tf->tf_rcx, &tf->tf_rdx, &tf->tf_rax,
+	ret = vmm_emulate_msr(gpc, &tf->tf_rcx, &tf->tf_rdx, &tf->tf_rax,
 	                      (tf->tf_exit_reason == EXIT_REASON_MSR_READ
 						   ? VMM_MSR_EMU_READ : VMM_MSR_EMU_WRITE));
 	if (ret)
@@ -808,51 +890,77 @@ static bool handle_vmexit_xsetbv(struct vm_trapframe *tf)
 	return TRUE;
 }
 
+static bool handle_vmexit_vmcall(struct vm_trapframe *tf)
+{
+	if (!(current->vmm.flags & VMM_VMCALL_PRINTF))
+		return FALSE;
+	printk("%c", tf->tf_rdi);
+	tf->tf_rip += 3;
+	return TRUE;
+}
+
+/* A HLT only needs the VMM if nothing will wake the guest soon.  With IRQs off,
+ * the guest is halting for good, and that's the VMM's business too. */
+static bool handle_vmexit_halt(struct vm_trapframe *tf)
+{
+	struct guest_pcore *gpc = lookup_guest_pcore(current,
+	                                             tf->tf_guest_pcoreid);
+
+	if (!(current->vmm.flags & VMM_HALT_POLL))
+		return FALSE;
+	if (!(tf->tf_rflags & FL_IF))
+		return FALSE;
+	if (!vmm_halt_poll(gpc))
+		return FALSE;
+	/* The IRQ gets delivered when we resume, right after the HLT */
+	tf->tf_rip += 1;
+	return TRUE;
+}
+
+/* The exits we try to handle in the kernel, which are the frequent ones that
+ * the VMM doesn't need to see.  Anything without a handler, or whose handler
+ * returns FALSE, is reflected to the VMM.
+ *
+ * Do not block in any of these functions.
+ *
+ * If we block, we'll probably need to finalize the context.  If we do, then
+ * there's a chance the guest pcore can start somewhere else, and then we can't
+ * get the GPC loaded again.  Plus, they could be running a GPC with an
+ * unresolved vmexit.  It's just mess.
+ *
+ * If we want to enable IRQs, we can do so on a case-by-case basis.  Don't do it
+ * for external IRQs - the irq_dispatch code will handle it. */
+typedef bool (*vmexit_handler_t)(struct vm_trapframe *tf);
+
+static const vmexit_handler_t vmexit_handlers[VMM_VMEXIT_NR_TYPES] = {
+	[EXIT_REASON_VMCALL] = handle_vmexit_vmcall,
+	[EXIT_REASON_CPUID] = handle_vmexit_cpuid,
+	[EXIT_REASON_EPT_VIOLATION] = handle_vmexit_ept_fault,
+	[EXIT_REASON_EXCEPTION_NMI] = handle_vmexit_nmi,
+	[EXIT_REASON_MSR_READ] = handle_vmexit_msr,
+	[EXIT_REASON_MSR_WRITE] = handle_vmexit_msr,
+	[EXIT_REASON_EXTERNAL_INTERRUPT] = handle_vmexit_extirq,
+	[EXIT_REASON_XSETBV] = handle_vmexit_xsetbv,
+	[EXIT_REASON_HLT] = handle_vmexit_halt,
+};
+
 static void vmexit_dispatch(struct vm_trapframe *tf)
 {
+	struct guest_pcore *gpc = lookup_guest_pcore(current,
+	                                             tf->tf_guest_pcoreid);
+	uint32_t reason = tf->tf_exit_reason;
 	bool handled = FALSE;
 
-	/* Do not block in any of these functions.
-	 *
-	 * If we block, we'll probably need to finalize the context.  If we do, then
-	 * there's a chance the guest pcore can start somewhere else, and then we
-	 * can't get the GPC loaded again.  Plus, they could be running a GPC with
-	 * an unresolved vmexit.  It's just mess.
-	 *
-	 * If we want to enable IRQs, we can do so on a case-by-case basis.  Don't
-	 * do it for external IRQs - the irq_dispatch code will handle it. */
-	switch (tf->tf_exit_reason) {
-	case EXIT_REASON_VMCALL:
-		if (current->vmm.flags & VMM_VMCALL_PRINTF) {
-			printk("%c", tf->tf_rdi);
-			tf->tf_rip += 3;
-			handled = TRUE;
-		}
-		break;
-	case EXIT_REASON_CPUID:
-		handled = handle_vmexit_cpuid(tf);
-		break;
-	case EXIT_REASON_EPT_VIOLATION:
-		handled = handle_vmexit_ept_fault(tf);
-		break;
-	case EXIT_REASON_EXCEPTION_NMI:
-		handled = handle_vmexit_nmi(tf);
-		break;
-	case EXIT_REASON_MSR_READ:
-	case EXIT_REASON_MSR_WRITE:
-		handled = handle_vmexit_msr(tf);
-		break;
-	case EXIT_REASON_EXTERNAL_INTERRUPT:
-		handled = handle_vmexit_extirq(tf);
-		break;
-	case EXIT_REASON_XSETBV:
-		handled = handle_vmexit_xsetbv(tf);
-		break;
-	default:
-		printd("Unhandled vmexit: reason 0x%x, exit qualification 0x%x\n",
-		       tf->tf_exit_reason, tf->tf_exit_qual);
+	if (reason < VMM_VMEXIT_NR_TYPES) {
+		gpc->vmexits[reason]++;
+		if (vmexit_handlers[reason])
+			handled = vmexit_handlers[reason](tf);
 	}
 	if (!handled) {
+		printd("Unhandled vmexit: reason 0x%x, exit qualification 0x%x\n",
+		       tf->tf_exit_reason, tf->tf_exit_qual);
+		if (reason < VMM_VMEXIT_NR_TYPES)
+			gpc->vmexits_reflected[reason]++;
 		tf->tf_flags |= VMCTX_FL_HAS_FAULT;
 		if (reflect_current_context()) {
 			/* VM contexts shouldn't be in vcore context, so this should be
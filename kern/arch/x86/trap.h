@@ -121,6 +121,7 @@
 #include <arch/pci.h>
 #include <arch/pic.h>
 #include <arch/topology.h>
+#include <string.h>
 #include <cpu_feat.h>
 #include <arch/io.h>
 #include <stdio.h>
@@ -160,6 +161,9 @@ extern void sysenter_handler(void);
 /* Defined and set up in in arch/init.c, used for XMM initialization */
 extern struct ancillary_state x86_default_fpu;
 extern uint64_t x86_default_xcr0;
+/* Sizes of the extended state components, by XCR0 bit */
+#define X86_NR_XSTATE		10
+extern uint32_t x86_xstate_sizes[X86_NR_XSTATE];
 
 static inline void save_fp_state(struct ancillary_state *silly)
 {
@@ -208,6 +212,55 @@ static inline void save_fp_state(struct ancillary_state *silly)
 	}
 }
 
+/* Bytes of the XSAVE area that hold the components in xinuse: the legacy region
+ * and header, plus each extended component.  XSAVEOPT might write less, if some
+ * weren't modified since the last XRSTOR. */
+static inline size_t __fp_state_bytes(uint64_t xinuse)
+{
+	size_t bytes = 576;
+
+	xinuse &= ~0x3ULL;
+	while (xinuse) {
+		bytes += x86_xstate_sizes[__builtin_ctzll(xinuse)];
+		xinuse &= xinuse - 1;
+	}
+	return bytes;
+}
+
+/* Like save_fp_state(), but if the FPU and all of the extended state are in
+ * their initial configuration, just writes the default legacy region and XSAVE
+ * header into silly.  XRSTOR initializes any component whose xstate_bv bit is
+ * clear, so silly is still a valid save, including for userspace (which copies
+ * it out of VCPD).  Returns the bytes of state saved, 0 if we skipped it. */
+static inline size_t save_fp_state_lazy(struct ancillary_state *silly)
+{
+	uint64_t xinuse;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_XSAVE)) {
+		save_fp_state(silly);
+		return 512;
+	}
+	if (!cpu_has_feat(CPU_FEAT_X86_XINUSE)) {
+		save_fp_state(silly);
+		return __fp_state_bytes(x86_default_xcr0);
+	}
+	xinuse = rxinuse() & x86_default_xcr0;
+#ifdef CONFIG_LAZY_FPU
+	if (!xinuse) {
+		uint32_t mxcsr;
+
+		/* XINUSE doesn't track the MXCSR */
+		asm volatile("stmxcsr %0" : "=m"(mxcsr));
+		if (mxcsr == x86_default_fpu.fp_head_64d.mxcsr) {
+			memcpy(silly, &x86_default_fpu, 576);
+			return 0;
+		}
+	}
+#endif
+	save_fp_state(silly);
+	return __fp_state_bytes(xinuse);
+}
+
 static inline void init_fp_state(void);
 static inline void restore_fp_state(struct ancillary_state *silly)
 {
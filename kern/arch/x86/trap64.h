@@ -113,6 +113,13 @@ static inline void x86_set_stacktop_tss(struct taskstate *tss, uintptr_t top)
 	tss->ts_rsp0 = top;
 }
 
+/* Double faults run on their own stack (IST 1), so that overflowing a kernel
+ * stack doesn't turn into a triple fault. */
+static inline void x86_set_dfstacktop_tss(struct taskstate *tss, uintptr_t top)
+{
+	tss->ts_ist1 = top;
+}
+
 /* Keep tf_padding0 in sync with trapentry64.S */
 static inline bool x86_hwtf_is_partial(struct hw_trapframe *tf)
 {
@@ -199,6 +199,30 @@ static inline int safe_write_msr(uint32_t addr, uint64_t value)
 	return err;
 }
 
+/* Atomically sets *uaddr to new if it was old.  Returns 0 if we could access
+ * uaddr, with the value we saw in *prev (which is old if we succeeded). */
+static inline int cmpxchg_user_u64(uint64_t *uaddr, uint64_t old, uint64_t new,
+                                   uint64_t *prev)
+{
+	int err = 0;
+
+	if (unlikely(!is_user_rwaddr(uaddr, sizeof(uint64_t))))
+		return -EFAULT;
+	asm volatile(ASM_STAC "\n"
+	             "1:		lock cmpxchgq %3,%2\n"
+	             "2: " ASM_CLAC "\n"
+	             ".section .fixup,\"ax\"\n"
+	             "3:		mov %4,%0\n"
+	             "	jmp 2b\n"
+	             ".previous\n"
+	             _ASM_EXTABLE(1b, 3b)
+	             : "=r"(err), "+a"(old), "+m"(*uaddr)
+	             : "r"(new), "i"(-EFAULT), "0"(err)
+	             : "memory");
+	*prev = old;
+	return err;
+}
+
 static inline uintptr_t ex_insn_addr(const struct extable_ip_fixup *x)
 {
 	return (uintptr_t) &x->insn + x->insn;
@@ -1134,10 +1134,18 @@ struct guest_pcore *create_guest_pcore(struct proc *p,
 	gpc->xcr0 = x86_default_xcr0;
 
 	gpc->posted_irq_desc = gpci->posted_irq_desc;
-
-	if (!ret)
-		return gpc;
-
+	if (ret)
+		goto fail_setup;
+	/* vmx_setup_initial_guest_state() made sure these were mapped */
+	gpc->kposted_irq_desc = (void *)uva2kva(p, gpci->posted_irq_desc,
+	                                        VMX_POSTED_IRQ_DESC_SZ, PROT_WRITE);
+	gpc->kvapic = (void *)uva2kva(p, gpci->vapic_addr, PGSIZE, PROT_WRITE);
+	vmm_lapic_timer_init(gpc);
+	gpc->halt_poll_usec = VMM_HALT_POLL_START_USEC;
+	return gpc;
+
+fail_setup:
+	vmx_free_vmcs(gpc->vmcs);
 fail_vmcs:
 	kfree(gpc);
 	return NULL;
@@ -1149,6 +1157,7 @@ fail_vmcs:
  */
 void destroy_guest_pcore(struct guest_pcore *gpc)
 {
+	vmm_lapic_timer_cleanup(gpc);
 	vmx_free_vmcs(gpc->vmcs);
 	kfree(gpc);
 }
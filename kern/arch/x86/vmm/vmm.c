@@ -19,6 +19,9 @@
 #include "vmm.h"
 #include <trap.h>
 #include <umem.h>
+#include <alarm.h>
+#include <time.h>
+#include <bitops.h>
 
 #include <arch/x86.h>
 
@@ -80,6 +83,7 @@ int vmm_struct_init(struct proc *p, unsigned int nr_guest_pcores,
 		return 0;
 	}
 	vmm->flags = flags;
+	vmm->halt_poll_max_usec = VMM_HALT_POLL_MAX_USEC;
 	if (!x86_supports_vmx) {
 		set_errno(ENODEV);
 		return 0;
@@ -109,8 +113,6 @@ int vmm_struct_init(struct proc *p, unsigned int nr_guest_pcores,
 		}
 	}
 	vmm->nr_guest_pcores = i;
-	for (int i = 0; i < VMM_VMEXIT_NR_TYPES; i++)
-		vmm->vmexits[i] = 0;
 	qunlock(&vmm->qlock);
 	return i;
 }
@@ -282,22 +284,8 @@ struct emmsr emmsrs[] = {
 	{MSR_TSC_AUX, "MSR_TSC_AUX", emsr_fakewrite},
 	{MSR_RAPL_POWER_UNIT, "MSR_RAPL_POWER_UNIT", emsr_readzero},
 
-	// TBD
-	{MSR_IA32_TSC_DEADLINE, "MSR_IA32_TSC_DEADLINE", emsr_fakewrite},
-
-	// APIC Fakewrites. We should eventually transition this onto the vapic
-	// This will require userspace msr handling.
-	{MSR_LAPIC_INITIAL_COUNT, "MSR_LAPIC_INITIAL_COUNT", emsr_fakewrite},
-	{MSR_LAPIC_LVT_TIMER, "MSR_LAPIC_LVT_TIMER", emsr_fakewrite},
-	{MSR_LAPIC_LVT_PERFMON, "MSR_LAPIC_LVT_PERFMON", emsr_fakewrite},
-	{MSR_LAPIC_TPR, "MSR_LAPIC_TPR", emsr_fakewrite},
-	{MSR_LAPIC_SPURIOUS, "MSR_LAPIC_SPURIOUS", emsr_fakewrite},
-	{MSR_LAPIC_LVT_LINT0, "MSR_LAPIC_LVT_LINT0", emsr_fakewrite},
-	{MSR_LAPIC_LVT_LINT1, "MSR_LAPIC_LVT_LINT1", emsr_fakewrite},
-	{MSR_LAPIC_ESR, "MSR_LAPIC_ESR", emsr_fakewrite},
-	{MSR_LAPIC_LVT_ERROR_REG, "MSR_LAPIC_LVT_ERROR_REG", emsr_fakewrite},
-	{MSR_LAPIC_DIVIDE_CONFIG_REG, "MSR_LAPIC_DIVIDE_CONFIG_REG",
-	 emsr_fakewrite},
+	/* The TSC deadline and the LAPIC registers are per guest pcore; see
+	 * vmm_emulate_gpc_msr(). */
 };
 
 /* this may be the only register that needs special handling.
@@ -452,8 +440,266 @@ bool emsr_fake_apicbase(struct emmsr *msr, uint64_t *rcx, uint64_t *rdx,
 	return TRUE;
 }
 
-bool vmm_emulate_msr(uint64_t *rcx, uint64_t *rdx, uint64_t *rax, int op)
+/* The guest's LAPIC timer, in TSC-deadline mode.  We don't offset the guest's
+ * TSC, so its deadline is one of our TSC times: it goes straight onto an alarm
+ * on whichever core the guest was running on, and the alarm posts the LVT's
+ * vector.  With virtual interrupt delivery, the guest takes that IRQ and EOIs
+ * it without exiting, so a tick costs one exit (the deadline write) and never
+ * leaves the kernel. */
+struct vmm_lapic_timer {
+	struct alarm_waiter alarm;
+	struct timer_chain *tchain;		/* the alarm's tchain, once it's been set */
+	uint64_t deadline;
+	struct guest_pcore *gpc;
+};
+
+#define LAPIC_LVT_VECTOR(lvt)		((lvt) & 0xff)
+#define LAPIC_LVT_TIMER_MODE(lvt)	(((lvt) >> 17) & 3)
+#define LAPIC_TIMER_TSC_DEADLINE	2
+
+/* x2APIC MSRs map onto 16 byte slots in the virtual APIC page. */
+static volatile uint32_t *gpc_vapic_reg(struct guest_pcore *gpc, uint32_t msr)
+{
+	return (void *)gpc->kvapic + ((msr & 0xff) << 4);
+}
+
+/* Posts vector to gpc and pokes it.  Safe from any core and from IRQ context:
+ * if the gpc isn't running, it'll see the outstanding notification when it
+ * next enters the guest. */
+void vmm_post_irq(struct guest_pcore *gpc, uint8_t vector)
+{
+	int pcoreid;
+
+	set_bit(vector, gpc->kposted_irq_desc);
+	/* LOCKed instruction provides the mb() */
+	set_bit(VMX_POSTED_OUTSTANDING_NOTIF, gpc->kposted_irq_desc);
+	pcoreid = ACCESS_ONCE(gpc->cpu);
+	if (pcoreid != -1)
+		send_ipi(pcoreid, I_POKE_CORE);
+}
+
+static void lapic_timer_fire(struct alarm_waiter *waiter,
+                             struct hw_trapframe *hw_tf)
+{
+	struct vmm_lapic_timer *timer = waiter->data;
+	uint32_t lvt = *gpc_vapic_reg(timer->gpc, MSR_LAPIC_LVT_TIMER);
+
+	timer->deadline = 0;
+	if (lvt & LAPIC_LVT_MASK)
+		return;
+	if (LAPIC_LVT_TIMER_MODE(lvt) != LAPIC_TIMER_TSC_DEADLINE)
+		return;
+	vmm_post_irq(timer->gpc, LAPIC_LVT_VECTOR(lvt));
+}
+
+/* Arms the timer for deadline, or disarms it for 0.  Only called by the core
+ * running the gpc, so there's only one setter at a time. */
+static void lapic_timer_set(struct guest_pcore *gpc, uint64_t deadline)
+{
+	struct vmm_lapic_timer *timer = gpc->lapic_timer;
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+
+	/* Once this returns, the old alarm's handler is done, if it ran */
+	if (timer->tchain)
+		unset_alarm(timer->tchain, &timer->alarm);
+	timer->deadline = deadline;
+	if (!deadline)
+		return;
+	if (deadline <= read_tsc()) {
+		lapic_timer_fire(&timer->alarm, NULL);
+		return;
+	}
+	set_awaiter_abs(&timer->alarm, deadline);
+	set_alarm(tchain, &timer->alarm);
+	timer->tchain = tchain;
+}
+
+void vmm_lapic_timer_init(struct guest_pcore *gpc)
+{
+	struct vmm_lapic_timer *timer;
+
+	timer = kzmalloc(sizeof(struct vmm_lapic_timer), KMALLOC_WAIT);
+	init_awaiter_irq(&timer->alarm, lapic_timer_fire);
+	timer->alarm.data = timer;
+	timer->gpc = gpc;
+	gpc->lapic_timer = timer;
+}
+
+void vmm_lapic_timer_cleanup(struct guest_pcore *gpc)
+{
+	struct vmm_lapic_timer *timer = gpc->lapic_timer;
+
+	if (!timer)
+		return;
+	if (timer->tchain)
+		unset_alarm(timer->tchain, &timer->alarm);
+	kfree(timer);
+	gpc->lapic_timer = NULL;
+}
+
+static bool __halt_poll(struct guest_pcore *gpc, uint64_t start)
+{
+	uint64_t end = start + usec2tsc(gpc->halt_poll_usec);
+	uint64_t deadline, now;
+
+	do {
+		if (test_bit(VMX_POSTED_OUTSTANDING_NOTIF, gpc->kposted_irq_desc))
+			return TRUE;
+		now = read_tsc();
+		deadline = ACCESS_ONCE(gpc->lapic_timer->deadline);
+		if (deadline && deadline <= now) {
+			/* Past deadlines fire right away */
+			lapic_timer_set(gpc, deadline);
+			return TRUE;
+		}
+		cpu_relax();
+	} while (now < end);
+	return FALSE;
+}
+
+/* Spins for up to the gpc's halt poll window, waiting for an IRQ, which is
+ * cheaper than a round trip to the VMM (and maybe a yield) when it comes soon.
+ * Returns TRUE if one did.  Otherwise the HLT goes to the VMM, and when the gpc
+ * next runs, vmm_halt_done() sees how long the halt really was.
+ *
+ * We're handling an exit with IRQs off, so our own timer alarms can't fire; we
+ * check the guest's deadline ourselves. */
+bool vmm_halt_poll(struct guest_pcore *gpc)
+{
+	uint64_t start = read_tsc();
+
+	if (__halt_poll(gpc, start)) {
+		gpc->halt_poll_hits++;
+		return TRUE;
+	}
+	gpc->halt_poll_misses++;
+	gpc->halt_start = start;
+	return FALSE;
+}
+
+/* Called when a gpc resumes after a HLT that we didn't catch by polling.  A
+ * halt that ended not long after the window would have been a hit with a
+ * bigger window.  A halt longer than the max never will be, and polling for it
+ * just burns the core. */
+void vmm_halt_done(struct guest_pcore *gpc)
+{
+	uint64_t max = ACCESS_ONCE(gpc->proc->vmm.halt_poll_max_usec);
+	uint64_t halted = tsc2usec(read_tsc() - gpc->halt_start);
+	uint64_t window = gpc->halt_poll_usec;
+
+	gpc->halt_start = 0;
+	if (halted > max)
+		window /= 2;
+	else if (halted > window)
+		window = window ? window * 2 : VMM_HALT_POLL_START_USEC;
+	gpc->halt_poll_usec = MIN(window, max);
+}
+
+#define LAPIC_ICR_VECTOR(icr)		((icr) & 0xff)
+#define LAPIC_ICR_DELIVERY_MODE(icr)	(((icr) >> 8) & 7)
+#define LAPIC_ICR_DM_FIXED			0
+#define LAPIC_ICR_DEST_LOGICAL		(1 << 11)
+#define LAPIC_ICR_SHORTHAND(icr)	(((icr) >> 18) & 3)
+#define LAPIC_ICR_SH_SELF			1
+#define LAPIC_ICR_SH_ALL			2
+#define LAPIC_ICR_SH_ALL_BUT_SELF	3
+#define LAPIC_ICR_DEST(icr)			((uint32_t)((icr) >> 32))
+#define LAPIC_ICR_DEST_BROADCAST	0xffffffff
+
+/* Emulates an x2APIC ICR write.  Fixed IPIs go straight into the targets'
+ * posted IRQ descriptors, so guest pcores IPI each other without a trip to the
+ * VMM.  Guest APIC IDs are guest pcore ids.  Returns FALSE for anything else
+ * (INIT, SIPI, NMI, logical destinations), which the VMM handles. */
+static bool vmm_emulate_icr(struct guest_pcore *gpc, uint64_t icr)
+{
+	struct vmm *vmm = &gpc->proc->vmm;
+	uint8_t vector = LAPIC_ICR_VECTOR(icr);
+	int shorthand = LAPIC_ICR_SHORTHAND(icr);
+	struct guest_pcore *target;
+
+	if (LAPIC_ICR_DELIVERY_MODE(icr) != LAPIC_ICR_DM_FIXED)
+		return FALSE;
+	if (shorthand == LAPIC_ICR_SH_SELF) {
+		vmm_post_irq(gpc, vector);
+		return TRUE;
+	}
+	if (!shorthand && (icr & LAPIC_ICR_DEST_LOGICAL))
+		return FALSE;
+	if (!shorthand && LAPIC_ICR_DEST(icr) != LAPIC_ICR_DEST_BROADCAST) {
+		target = lookup_guest_pcore(gpc->proc, LAPIC_ICR_DEST(icr));
+		/* Like the hardware, IPIs to nobody just vanish */
+		if (target)
+			vmm_post_irq(target, vector);
+		return TRUE;
+	}
+	for (int i = 0; i < vmm->nr_guest_pcores; i++) {
+		target = vmm->guest_pcores[i];
+		if (target == gpc && shorthand == LAPIC_ICR_SH_ALL_BUT_SELF)
+			continue;
+		vmm_post_irq(target, vector);
+	}
+	return TRUE;
+}
+
+/* MSRs whose state belongs to the guest pcore.  The LAPIC registers live in
+ * the virtual APIC page, where the guest's (unintercepted) reads find them.
+ * Returns -1 if msr isn't one of ours. */
+static int vmm_emulate_gpc_msr(struct guest_pcore *gpc, uint64_t *rcx,
+                               uint64_t *rdx, uint64_t *rax, int op)
+{
+	uint64_t val = (uint64_t)*rdx << 32 | (uint32_t)*rax;
+
+	switch (*rcx) {
+	case MSR_IA32_TSC_DEADLINE:
+		if (op == VMM_MSR_EMU_READ) {
+			val = ACCESS_ONCE(gpc->lapic_timer->deadline);
+			*rax = (uint32_t)val;
+			*rdx = val >> 32;
+			return TRUE;
+		}
+		if (LAPIC_LVT_TIMER_MODE(*gpc_vapic_reg(gpc, MSR_LAPIC_LVT_TIMER)) ==
+		    LAPIC_TIMER_TSC_DEADLINE)
+			lapic_timer_set(gpc, val);
+		return TRUE;
+	case MSR_LAPIC_LVT_TIMER:
+	case MSR_LAPIC_INITIAL_COUNT:
+	case MSR_LAPIC_LVT_PERFMON:
+	case MSR_LAPIC_TPR:
+	case MSR_LAPIC_SPURIOUS:
+	case MSR_LAPIC_LVT_LINT0:
+	case MSR_LAPIC_LVT_LINT1:
+	case MSR_LAPIC_ESR:
+	case MSR_LAPIC_LVT_ERROR_REG:
+	case MSR_LAPIC_DIVIDE_CONFIG_REG:
+		if (op == VMM_MSR_EMU_READ) {
+			*rax = *gpc_vapic_reg(gpc, *rcx);
+			*rdx = 0;
+			return TRUE;
+		}
+		*gpc_vapic_reg(gpc, *rcx) = (uint32_t)val;
+		/* Leaving TSC-deadline mode disarms the timer */
+		if (*rcx == MSR_LAPIC_LVT_TIMER &&
+		    LAPIC_LVT_TIMER_MODE(val) != LAPIC_TIMER_TSC_DEADLINE)
+			lapic_timer_set(gpc, 0);
+		return TRUE;
+	case MSR_LAPIC_ICR:
+		if (op == VMM_MSR_EMU_WRITE && vmm_emulate_icr(gpc, val))
+			return TRUE;
+		return -1;
+	}
+	return -1;
+}
+
+bool vmm_emulate_msr(struct guest_pcore *gpc, uint64_t *rcx, uint64_t *rdx,
+                     uint64_t *rax, int op)
 {
+	int ret;
+
+	if (gpc) {
+		ret = vmm_emulate_gpc_msr(gpc, rcx, rdx, rax, op);
+		if (ret >= 0)
+			return ret;
+	}
 	for (int i = 0; i < ARRAY_SIZE(emmsrs); i++) {
 		if (emmsrs[i].reg != *rcx)
 			continue;
@@ -15,11 +15,30 @@ static inline int cpu_has_svm(const char **msg)
 }
 
 #define VMM_VMEXIT_NR_TYPES		65
+/* With VMM_HALT_POLL, a HLT waits in the kernel for an IRQ before going out to
+ * the VMM.  Each gpc's window adapts, like KVM's halt_poll_ns: it grows when
+ * the guest's halts end shortly after the window, and shrinks when they go on
+ * past the VMM's max (#proc/PID/ctl "haltpoll USEC"). */
+#define VMM_HALT_POLL_MAX_USEC		200
+#define VMM_HALT_POLL_START_USEC	10
 
 struct guest_pcore {
 	int cpu;
 	struct proc *proc;
 	unsigned long *posted_irq_desc;
+	/* Kernel mappings of the posted IRQ descriptor and virtual APIC page, so
+	 * we can post and emulate from any core */
+	unsigned long *kposted_irq_desc;
+	void *kvapic;
+	struct vmm_lapic_timer *lapic_timer;
+	/* Exits taken, and how many of those went out to the VMM */
+	unsigned long vmexits[VMM_VMEXIT_NR_TYPES];
+	unsigned long vmexits_reflected[VMM_VMEXIT_NR_TYPES];
+	/* Adaptive halt polling; see vmm_halt_poll() */
+	uint64_t halt_poll_usec;
+	uint64_t halt_start;		/* TSC of the HLT the VMM is handling, or 0 */
+	unsigned long halt_poll_hits;
+	unsigned long halt_poll_misses;
 	struct msr_autoload {
 		unsigned nr;
 		struct vmx_msr_entry guest[NR_AUTOLOAD_MSRS];
@@ -38,6 +57,7 @@ struct vmm {
 	bool vmmcp;
 
 	int flags;
+	unsigned int halt_poll_max_usec;
 
 	// Number of cores in this VMMCP.
 	int nr_guest_pcores;
@@ -54,7 +74,6 @@ struct vmm {
 		void *svm;
 		struct guest_pcore **guest_pcores;
 	};
-	unsigned long vmexits[VMM_VMEXIT_NR_TYPES];
 };
 
 void vmm_init(void);
@@ -80,4 +99,10 @@ void unload_guest_pcore(struct proc *p, int guest_pcoreid);
 
 #define VMM_MSR_EMU_READ		1
 #define VMM_MSR_EMU_WRITE		2
-bool vmm_emulate_msr(uint64_t *rcx, uint64_t *rdx, uint64_t *rax, int op);
+bool vmm_emulate_msr(struct guest_pcore *gpc, uint64_t *rcx, uint64_t *rdx,
+                     uint64_t *rax, int op);
+void vmm_post_irq(struct guest_pcore *gpc, uint8_t vector);
+void vmm_lapic_timer_init(struct guest_pcore *gpc);
+void vmm_lapic_timer_cleanup(struct guest_pcore *gpc);
+bool vmm_halt_poll(struct guest_pcore *gpc);
+void vmm_halt_done(struct guest_pcore *gpc);
@@ -172,6 +172,17 @@ static inline void lxcr0(uint64_t xcr0) __attribute__((always_inline));
 static inline int safe_lxcr0(uint64_t xcr0) __attribute__((always_inline));
 static inline uint64_t rxcr0(void) __attribute__((always_inline));
 
+/* Which state components are not in their initial configuration. */
+static inline uint64_t rxinuse(void)
+{
+	uint32_t eax, edx;
+
+	asm volatile("xgetbv"
+	             : "=a"(eax), "=d"(edx)
+	             : "c" (1));
+	return ((uint64_t)edx << 32) | eax;
+}
+
 static inline unsigned long read_flags(void) __attribute__((always_inline));
 static inline void write_eflags(unsigned long eflags)
               __attribute__((always_inline));
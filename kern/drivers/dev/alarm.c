@@ -15,6 +15,11 @@
  * the kernel the pointer of your ev_q) and "cancel", to stop an alarm.  timer
  * takes just the value (in absolute tsc time) to fire the alarm.
  *
+ * Processes juggling many timers can instead write "slots ADDR" to ctl, handing
+ * the alarm a page of deadlines that they rearm with plain stores.  The alarm
+ * then scans the page at its earliest deadline and sends an event per expired
+ * slot, and "kick" asks for a scan now.  See ros/alarm_slots.h.
+ *
  * While each process has a separate view of #alarm, it is possible to post a
  * chan to Qctl or Qtimer to #srv.  If another proc has your Qtimer, it can set
  * it in the past, thereby triggering an immediate event.  More clever than
@@ -86,10 +91,52 @@ static void alarm_release(struct kref *kref)
 	spin_unlock(&p->alarmset.lock);
 	/* When this returns, the alarm has either fired or it never will */
 	unset_alarm(p->alarmset.tchain, &a->a_waiter);
+	if (a->slots_page)
+		page_decref(a->slots_page);
 	proc_decref(p);
 	kfree(a);
 }
 
+/* Fires a's expired slots and rearms a_waiter for the earliest deadline left,
+ * if any.  next_scan stays 0 while we scan, so anyone arming a slot behind us
+ * will kick, and their kick's scan waits for ours on the lock. */
+static void proc_alarm_scan(struct proc_alarm *a, struct event_queue *ev_q)
+{
+	struct alarm_slots *slots = a->slots;
+	struct timer_chain *tchain = a->proc->alarmset.tchain;
+	struct event_msg msg;
+	uint64_t now, deadline, earliest = 0;
+
+	memset(&msg, 0, sizeof(struct event_msg));
+	msg.ev_type = EV_ALARM;
+	msg.ev_arg2 = a->id;
+	spin_lock(&a->slots_lock);
+	slots->next_scan = 0;
+	mb();
+	now = read_tsc();
+	for (int i = 0; i < ALARM_NR_SLOTS; i++) {
+		deadline = ACCESS_ONCE(slots->deadline[i]);
+		if (!deadline)
+			continue;
+		if (deadline > now) {
+			if (!earliest || deadline < earliest)
+				earliest = deadline;
+			continue;
+		}
+		if (!__sync_bool_compare_and_swap(&slots->deadline[i], deadline, 0))
+			continue;
+		msg.ev_arg4 = i;
+		send_event(a->proc, ev_q, &msg, 0);
+	}
+	if (earliest) {
+		slots->next_scan = earliest;
+		reset_alarm_abs(tchain, &a->a_waiter, earliest);
+	} else {
+		unset_alarm(tchain, &a->a_waiter);
+	}
+	spin_unlock(&a->slots_lock);
+}
+
 static void proc_alarm_handler(struct alarm_waiter *a_waiter)
 {
 	struct proc_alarm *a = container_of(a_waiter, struct proc_alarm, a_waiter);
@@ -99,6 +146,10 @@ static void proc_alarm_handler(struct alarm_waiter *a_waiter)
 		printk("[kernel] proc_alarm, bad ev_q %p or proc %p\n", ev_q, a->proc);
 		return;
 	}
+	if (a->slots) {
+		proc_alarm_scan(a, ev_q);
+		return;
+	}
 	memset(&msg, 0, sizeof(struct event_msg));
 	msg.ev_type = EV_ALARM;
 	msg.ev_arg2 = a->id;
@@ -254,6 +305,7 @@ static struct chan *alarmopen(struct chan *c, int omode)
 			a = kzmalloc(sizeof(struct proc_alarm), KMALLOC_WAIT);
 			kref_init(&a->kref, alarm_release, 1);
 			init_awaiter(&a->a_waiter, proc_alarm_handler);
+			spinlock_init(&a->slots_lock);
 			spin_lock(&p->alarmset.lock);
 			a->id = p->alarmset.id_counter++;
 			proc_incref(p, 1);
@@ -348,6 +400,44 @@ static long alarmread(struct chan *c, void *ubuf, long n, int64_t offset)
 	return 0;
 }
 
+/* Handles "slots ADDR": takes a reference on the current process's slot page
+ * and switches a to slot mode.  The deadlines are the process's, so we don't
+ * touch them; whatever is armed already gets picked up by the first kick. */
+static void proc_alarm_set_slots(struct proc_alarm *a, struct cmdbuf *cb)
+{
+	struct proc *p = current;
+	struct page *page;
+	pte_t pte;
+	uintptr_t uva;
+
+	if (cb->nf < 2)
+		error(EINVAL, "usage: slots ADDR");
+	if (p != a->proc)
+		error(EPERM, "slots must be in the alarm's own process");
+	uva = strtoul(cb->f[1], 0, 16);
+	if (PGOFF(uva) || !is_user_rwaddr((void*)uva, PGSIZE))
+		error(EFAULT, "bad slots address %p", (void*)uva);
+	spin_lock(&p->vmr_lock);
+	page = page_lookup(p->env_pgdir, (void*)uva, &pte);
+	if (page && pte_has_perm_urw(pte))
+		page_incref(page);
+	else
+		page = NULL;
+	spin_unlock(&p->vmr_lock);
+	if (!page)
+		error(EFAULT, "slots page must be writable and populated");
+	spin_lock(&a->slots_lock);
+	if (a->slots) {
+		spin_unlock(&a->slots_lock);
+		page_decref(page);
+		error(EBUSY, "alarm already has slots");
+	}
+	a->slots_page = page;
+	a->slots = page2kva(page);
+	a->slots->next_scan = 0;
+	spin_unlock(&a->slots_lock);
+}
+
 /* Note that in read and write we have an open chan, which means we have an
  * active kref on the p_alarm.  Also note that we make no assumptions about
  * current here - we find the proc (and the tchain) via the ref stored in the
@@ -385,6 +475,14 @@ static long alarmwrite(struct chan *c, void *ubuf, long n, int64_t unused)
 				p_alarm->ev_q = (struct event_queue *)hexval;
 			} else if (!strcmp(cb->f[0], "cancel")) {
 				unset_alarm(p_alarm->proc->alarmset.tchain, &p_alarm->a_waiter);
+			} else if (!strcmp(cb->f[0], "slots")) {
+				proc_alarm_set_slots(p_alarm, cb);
+			} else if (!strcmp(cb->f[0], "kick")) {
+				if (!p_alarm->slots)
+					error(EINVAL, "kick needs slots");
+				if (!p_alarm->ev_q)
+					error(EINVAL, "kick needs an evq");
+				proc_alarm_scan(p_alarm, p_alarm->ev_q);
 			} else {
 				error(EFAIL, "%s: not implemented", cb->f[0]);
 			}
@@ -403,6 +501,9 @@ static long alarmwrite(struct chan *c, void *ubuf, long n, int64_t unused)
 			num64[n] = 0;	/* enforce trailing 0 */
 			hexval = strtoul(num64, 0, 16);
 			p_alarm = QID2A(c->qid);
+			/* the slots own the waiter's time */
+			if (p_alarm->slots)
+				error(EBUSY, "alarm uses slots, kick instead");
 			/* if you don't know if it was running or not, resetting will turn
 			 * it on regardless. */
 			reset_alarm_abs(p_alarm->proc->alarmset.tchain, &p_alarm->a_waiter,
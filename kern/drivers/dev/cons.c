@@ -598,6 +598,7 @@ enum {
 	Qpgrpid,
 	Qpid,
 	Qppid,
+	Qprintk,
 	Qreboot,
 	Qswap,
 	Qsysctl,
@@ -631,6 +632,7 @@ static struct dirtab consdir[] = {
 	{"pgrpid", {Qpgrpid}, NUMSIZE, 0444},
 	{"pid", {Qpid}, NUMSIZE, 0444},
 	{"ppid", {Qppid}, NUMSIZE, 0444},
+	{"printk", {Qprintk}, 0, 0440},
 	{"reboot", {Qreboot}, 0, 0660},
 	{"swap", {Qswap}, 0, 0664},
 	{"sysctl", {Qsysctl}, 0, 0666},
@@ -855,6 +857,11 @@ static long consread(struct chan *c, void *buf, long n, int64_t off)
 		case Qkprint:
 			return qread(kprintoq, buf, n);
 
+		case Qprintk:
+			/* The offset is into everything ever printed, so readers can
+			 * poll for new output.  Older output may have been overwritten. */
+			return printk_hist_read(buf, n, off);
+
 		case Qpgrpid:
 			return consreadnum((uint32_t) offset, buf, n, current->pgrp->pgrpid,
 							   NUMSIZE);
@@ -1204,6 +1211,7 @@ struct dev consdevtab __devtab = {
 	.wstat = devwstat,
 	.power = devpower,
 	.chaninfo = devchaninfo,
+	.revalidate = devrevalidate,
 };
 
 static char *devname(void)
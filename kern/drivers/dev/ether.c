@@ -39,6 +39,10 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <umem.h>
+#include <event.h>
+#include <rcu.h>
+#include <ros/etherring.h>
 
 struct dev etherdevtab;
 
@@ -49,6 +53,15 @@ static char *devname(void)
 
 enum {
 	Type8021Q = 0x8100,			/* value of type field for 802.1[pQ] tags */
+	TypeIP4 = 0x0800,
+	GRO_MAX = 0xffff,			/* merged packets must fit the IP length */
+	POLL_BUDGET = 16,			/* packets per busy poll */
+	COAL_SAMPLE = 250000,		/* usec between adaptive coalescing samples */
+	COAL_USEC_LOW = 0,
+	COAL_USEC_HIGH = 128,
+	COAL_RATE_LOW = 20000,		/* pkts/sec */
+	COAL_RATE_HIGH = 400000,
+	COAL_USEC_MAX = 10000,
 };
 
 static struct ether *etherxx[MaxEther];	/* real controllers */
@@ -290,6 +303,69 @@ static void etherrtrace(struct netfile *f, struct etherpkt *pkt, int len)
 	qpass(f->in, bp);
 }
 
+/* A process's packet ring, attached to a netfile with the "ring" ctl message;
+ * the layout is in ros/etherring.h.  The kernel keeps private copies of the
+ * indexes it owns, so a process scribbling on the header only hurts itself. */
+struct etherring {
+	spinlock_t rxlock;			/* etheriq runs on every RX queue's core */
+	qlock_t txlock;
+	struct proc *proc;
+	struct event_queue *ev_q;	/* user pointer, may be 0 */
+	int ev_id;
+	struct ether_ring_hdr *hdr;
+	uint32_t nrx;
+	uint32_t ntx;
+	uint32_t rxprod;
+	uint32_t txcons;
+	size_t npages;
+	struct page *pages[];
+};
+
+static struct ether_ring_slot *etherringslot(struct etherring *r, uint32_t i)
+{
+	size_t off = (size_t)i * ETHER_RING_SLOTSZ;
+
+	return page2kva(r->pages[1 + off / PGSIZE]) + PGOFF(off);
+}
+
+/* Copies a packet into r's next RX slot, or drops it if the ring is full.  The
+ * process is only sent an event when it had caught up, i.e. when it may be
+ * about to block.  It must write rx.cons and then re-read rx.prod before
+ * blocking; we publish rx.prod and then read rx.cons, so one of us sees the
+ * other's write. */
+static void etherringput(struct ether *ether, struct etherring *r,
+                         struct etherpkt *pkt, int len)
+{
+	struct ether_ring_hdr *hdr = r->hdr;
+	struct ether_ring_slot *slot;
+	struct event_msg msg;
+	bool wake;
+
+	spin_lock_irqsave(&r->rxlock);
+	if (len > sizeof(slot->data) ||
+	    r->rxprod - ACCESS_ONCE(hdr->rx.cons) >= r->nrx) {
+		hdr->rx.drops++;
+		spin_unlock_irqsave(&r->rxlock);
+		ether->soverflows++;
+		return;
+	}
+	slot = etherringslot(r, r->rxprod & (r->nrx - 1));
+	memmove(slot->data, pkt, len);
+	slot->len = len;
+	slot->flags = 0;
+	r->rxprod++;
+	wmb();
+	hdr->rx.prod = r->rxprod;
+	mb();
+	wake = ACCESS_ONCE(hdr->rx.cons) == r->rxprod - 1;
+	spin_unlock_irqsave(&r->rxlock);
+	if (wake && r->ev_q) {
+		memset(&msg, 0, sizeof(msg));
+		msg.ev_type = r->ev_id;
+		send_event(r->proc, r->ev_q, &msg, 0);
+	}
+}
+
 #ifdef CONFIG_RISCV
 #warning "Potentially unaligned ethernet addrs!"
 #endif
@@ -302,6 +378,124 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
+/*
+ * Generic receive offload.  A TCP/IPv4 segment that continues the flow of the
+ * last packet still waiting in a connection's queue gets glued onto that
+ * packet, so IP and TCP handle one big segment instead of many.  The payload
+ * becomes an extra_data buf pointing into the segment's block.  We only merge
+ * while the reader is behind, so nothing is held back waiting for more.
+ *
+ * Merged packets have verified TCP checksums (Btcpck) and a fixed up IP length
+ * and checksum.  They are marked Btso with the original segment size, so that
+ * if we forward them, they get cut back up on the way out.
+ */
+
+/* Finds the headers of a segment we can merge: TCP over IPv4 without options
+ * or fragments, just ACK and maybe PSH, some payload, and no padding. */
+static bool gro_parse(struct block *bp, uint8_t **ipp, uint8_t **tcpp,
+                      int *paylen)
+{
+	uint8_t *ip = bp->rp + ETHERHDRSIZE;
+	uint8_t *tcp = ip + 20;
+	int iplen, tcphl;
+
+	if (BHLEN(bp) < ETHERHDRSIZE + 20 + 20)
+		return FALSE;
+	if (nhgets(bp->rp + 2 * Eaddrlen) != TypeIP4 || ip[0] != (IP_VER4 | 5) ||
+	    (nhgets(ip + 6) & 0x3fff) || ip[9] != 6)
+		return FALSE;
+	tcphl = (tcp[12] >> 4) * 4;
+	iplen = nhgets(ip + 2);
+	if (tcphl < 20 || BHLEN(bp) < ETHERHDRSIZE + 20 + tcphl ||
+	    BLEN(bp) != ETHERHDRSIZE + iplen)
+		return FALSE;
+	if ((tcp[13] & ~0x08) != 0x10)	/* ACK, maybe PSH */
+		return FALSE;
+	*paylen = iplen - 20 - tcphl;
+	*ipp = ip;
+	*tcpp = tcp;
+	return *paylen > 0;
+}
+
+/* Is bp worth offering to ether_gro_merge()?  Checks the TCP checksum if the
+ * NIC didn't, since the merged packet's checksum won't mean anything. */
+static bool ether_gro_ok(struct block *bp)
+{
+	uint8_t *ip, *tcp;
+	int paylen, tcplen;
+	uint32_t sum;
+
+	if (!gro_parse(bp, &ip, &tcp, &paylen))
+		return FALSE;
+	if (bp->flag & Btcpck)
+		return TRUE;
+	tcplen = nhgets(ip + 2) - 20;
+	sum = ptclbsum(ip + 12, 8) + ip[9] + tcplen +
+	      (uint16_t)~ptclcsum(bp, ETHERHDRSIZE + 20, tcplen);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	if (sum != 0xffff)
+		return FALSE;
+	bp->flag |= Btcpck;
+	return TRUE;
+}
+
+/* qpass_merge() callback: absorbs bp into last if it's the next segment of the
+ * same flow.  Called with the queue locked. */
+static bool ether_gro_merge(struct block *last, struct block *bp)
+{
+	uint8_t *lip, *ltcp, *ip, *tcp;
+	int lpaylen, paylen, hl, slot;
+	struct extra_bdata *ebd;
+
+	if (!(last->flag & Btcpck) || !(bp->flag & Btcpck))
+		return FALSE;
+	if (bp->free || bp->extra_len)
+		return FALSE;
+	if (!gro_parse(last, &lip, &ltcp, &lpaylen) ||
+	    !gro_parse(bp, &ip, &tcp, &paylen))
+		return FALSE;
+	/* a PSH ends the merged segment */
+	if (ltcp[13] & 0x08)
+		return FALSE;
+	/* same addresses, ports, ack, tos, ttl and options */
+	hl = (tcp[12] >> 4) * 4;
+	if (memcmp(lip + 12, ip + 12, 8) || lip[1] != ip[1] || lip[8] != ip[8] ||
+	    memcmp(ltcp, tcp, 4) || memcmp(ltcp + 8, tcp + 8, 4) ||
+	    ltcp[12] != tcp[12] || memcmp(ltcp + 20, tcp + 20, hl - 20))
+		return FALSE;
+	if (nhgetl(tcp + 4) != nhgetl(ltcp + 4) + lpaylen)
+		return FALSE;
+	if (nhgets(lip + 2) + paylen > GRO_MAX)
+		return FALSE;
+
+	for (slot = last->nr_extra_bufs; slot > 0; slot--) {
+		if (last->extra_data[slot - 1].base)
+			break;
+	}
+	if (slot == last->nr_extra_bufs &&
+	    block_add_extd(last, slot + 8, 0))
+		return FALSE;
+	/* the ebd holds a ref on bp's memory, which outlives freeb(bp) */
+	kmalloc_incref(bp);
+	ebd = &last->extra_data[slot];
+	ebd->base = (uintptr_t)bp;
+	ebd->off = (uint32_t)(tcp + hl - (uint8_t*)bp);
+	ebd->len = paylen;
+	last->extra_len += paylen;
+
+	if (!(last->flag & Btso)) {
+		last->flag |= Btso;
+		last->mss = lpaylen;
+	}
+	hnputs(lip + 2, nhgets(lip + 2) + paylen);
+	lip[10] = lip[11] = 0;
+	hnputs(lip + 10, ipcsum(lip));
+	ltcp[13] |= tcp[13] & 0x08;
+	memmove(ltcp + 14, tcp + 14, 2);	/* latest window */
+	return TRUE;
+}
+
 struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 {
 	struct etherpkt *pkt;
@@ -310,6 +504,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	struct netfile **ep, *f, **fp, *fx;
 	struct block *xbp;
 	struct ether *vlan;
+	struct etherring *ring;
 
 	ether->inpackets++;
 
@@ -357,6 +552,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	 * attempt to simply pass it into one of the connections, thereby
 	 * saving a copy of the data (usual case hopefully).
 	 */
+	rcu_read_lock();
 	for (fp = ether->f; fp < ep; fp++) {
 		if ((f = *fp) && (f->type == type || f->type < 0))
 			if (tome || multi || f->prom) {
@@ -367,6 +563,11 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					etherrtrace(f, pkt, len);
 					continue;
 				}
+				ring = rcu_dereference(f->ring);
+				if (ring) {
+					etherringput(ether, ring, pkt, len);
+					continue;
+				}
 				if (fromwire && fx == 0) {
 					fx = f;
 					continue;
@@ -382,9 +583,14 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					ether->soverflows++;
 			}
 	}
+	rcu_read_unlock();
 
 	if (fx) {
-		if (qpass(fx->in, bp) < 0)
+		if (tome && fx->type == type && ether_gro_ok(bp))
+			len = qpass_merge(fx->in, bp, ether_gro_merge);
+		else
+			len = qpass(fx->in, bp);
+		if (len < 0)
 			ether->soverflows++;
 		return 0;
 	}
@@ -396,12 +602,184 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	return bp;
 }
 
+static int etheroq(struct ether *ether, struct block *bp);
+
+/* Core that services queue qidx of a multi-queue NIC.  Drivers route the
+ * queue's interrupt there, so RX processing for its flows stays on one core. */
+int etherqcore(int qidx)
+{
+	return qidx % num_cores;
+}
+
+/* Registers queue qidx's interrupt on a vector of its own, routed to
+ * etherqcore(qidx), and remembers the vector for "irqcore".  Returns 0 or -1,
+ * like register_irq(). */
+int etherqirq(struct ether *ether, int qidx, int irq,
+              void (*handler)(struct hw_trapframe *, void *), void *arg,
+              uint32_t tbdf)
+{
+	int vec;
+
+	assert(qidx < Maxqueues);
+	vec = register_irq_vector(irq, handler, arg, tbdf, etherqcore(qidx));
+	if (vec < 0)
+		return -1;
+	ether->qvec[qidx] = vec;
+	ether->qcore[qidx] = etherqcore(qidx);
+	return 0;
+}
+
+/* TX queue for a packet sent from this core.  Each core sticks to one queue, so
+ * cores don't contend for a ring.  A flow can still be reordered if its sender
+ * migrates, which TCP tolerates. */
+static int ethertxq(struct ether *ether)
+{
+	if (ether->nr_txq <= 1)
+		return 0;
+	return core_id() % ether->nr_txq;
+}
+
+/* Splits a TSO super-segment into MSS-sized segments, for NICs that can't do
+ * it themselves.  Each segment gets a copy of the headers with the IP length,
+ * ID and checksum and the TCP sequence number fixed up.  FIN and PSH only go on
+ * the last one.  The TCP checksum is seeded with the pseudo-header sum, like
+ * tcpcksum() does, and left to ptclcsum_finalize().
+ *
+ * checksum_start points at the TCP header, which follows the IPv4 header. */
+static int etheroq_gso(struct ether *ether, struct block *bp)
+{
+	uint8_t hdr[ETHERHDRSIZE + 60 + 60];
+	int tcp_off = bp->checksum_start;
+	int mss = bp->mss;
+	int hdrlen, total, len, seg_len;
+	uint8_t *ip, *tcp;
+	uint16_t id;
+	uint32_t seq, sum;
+	struct block *seg;
+
+	bp = pullupblock(bp, tcp_off + 20);
+	if (bp == NULL)
+		return 0;
+	hdrlen = tcp_off + (bp->rp[tcp_off + 12] >> 4) * 4;
+	total = blocklen(bp);
+	if (hdrlen > sizeof(hdr) || total < hdrlen || mss <= 0) {
+		freeblist(bp);
+		return total;
+	}
+	bp = bl2mem(hdr, bp, hdrlen);
+	id = nhgets(hdr + ETHERHDRSIZE + 4);
+	seq = nhgetl(hdr + tcp_off + 4);
+	for (len = total - hdrlen; len > 0; len -= seg_len) {
+		seg_len = MIN(len, mss);
+		seg = allocb(hdrlen + seg_len);
+		memmove(seg->wp, hdr, hdrlen);
+		bp = bl2mem(seg->wp + hdrlen, bp, seg_len);
+		ip = seg->wp + ETHERHDRSIZE;
+		tcp = seg->wp + tcp_off;
+		seg->wp += hdrlen + seg_len;
+
+		hnputs(ip + 2, hdrlen - ETHERHDRSIZE + seg_len);
+		hnputs(ip + 4, id++);
+		ip[10] = ip[11] = 0;
+		hnputs(ip + 10, ipcsum(ip));
+
+		hnputl(tcp + 4, seq);
+		seq += seg_len;
+		if (len > seg_len)
+			tcp[13] &= ~0x09;	/* FIN | PSH */
+		sum = ptclbsum(ip + 12, 8) + ip[9] + hdrlen - tcp_off + seg_len;
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		hnputs(tcp + 16, sum);
+		seg->checksum_start = tcp_off;
+		seg->checksum_offset = 16;
+		seg->flag |= Btcpck;
+		if (len > seg_len)
+			seg->flag |= Bmore;
+
+		etheroq(ether, seg);
+	}
+	freeblist(bp);
+	return total;
+}
+
+/* Splits a UDP super-datagram (Buso) into datagrams of mss bytes of payload,
+ * the last maybe shorter.  Each gets a copy of the headers with the IP length,
+ * ID and checksum and the UDP length fixed up.  Like etheroq_gso(), the UDP
+ * checksum is seeded with the pseudo-header sum and left to
+ * ptclcsum_finalize().
+ *
+ * checksum_start points at the UDP header, which follows the IPv4 header. */
+static int etheroq_uso(struct ether *ether, struct block *bp)
+{
+	uint8_t hdr[ETHERHDRSIZE + 60 + 8];
+	int udp_off = bp->checksum_start;
+	int hdrlen = udp_off + 8;
+	int mss = bp->mss;
+	int total, len, seg_len;
+	uint8_t *ip, *udp;
+	uint16_t id;
+	uint32_t sum;
+	struct block *seg;
+
+	total = blocklen(bp);
+	if (hdrlen > sizeof(hdr) || total < hdrlen || mss <= 0) {
+		freeblist(bp);
+		return total;
+	}
+	bp = bl2mem(hdr, bp, hdrlen);
+	id = nhgets(hdr + ETHERHDRSIZE + 4);
+	for (len = total - hdrlen; len > 0; len -= seg_len) {
+		seg_len = MIN(len, mss);
+		seg = allocb(hdrlen + seg_len);
+		memmove(seg->wp, hdr, hdrlen);
+		bp = bl2mem(seg->wp + hdrlen, bp, seg_len);
+		ip = seg->wp + ETHERHDRSIZE;
+		udp = seg->wp + udp_off;
+		seg->wp += hdrlen + seg_len;
+
+		hnputs(ip + 2, hdrlen - ETHERHDRSIZE + seg_len);
+		hnputs(ip + 4, id++);
+		ip[10] = ip[11] = 0;
+		hnputs(ip + 10, ipcsum(ip));
+
+		hnputs(udp + 4, 8 + seg_len);
+		sum = ptclbsum(ip + 12, 8) + ip[9] + 8 + seg_len;
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		hnputs(udp + 6, sum);
+		seg->checksum_start = udp_off;
+		seg->checksum_offset = 6;
+		seg->flag |= Budpck;
+		if (len > seg_len)
+			seg->flag |= Bmore;
+
+		etheroq(ether, seg);
+	}
+	freeblist(bp);
+	return total;
+}
+
+static void etherkick(struct ether *ether, int txq)
+{
+	if (ether->transmit_queue != NULL)
+		ether->transmit_queue(ether, txq);
+	else if (ether->transmit != NULL)
+		ether->transmit(ether);
+}
+
 static int etheroq(struct ether *ether, struct block *bp)
 {
-	int len, loopback;
+	int len, loopback, txq, more;
+	struct queue *q;
 	struct etherpkt *pkt;
 	int8_t irq_state = 0;
 
+	if ((bp->flag & Btso) && !(ether->feat & NETF_TSO))
+		return etheroq_gso(ether, bp);
+	if ((bp->flag & Buso) && !(ether->feat & NETF_USO))
+		return etheroq_uso(ether, bp);
+
 	ether->outpackets++;
 
 	if (!(ether->feat & NETF_SG))
@@ -441,20 +819,352 @@ static int etheroq(struct ether *ether, struct block *bp)
 	if ((ether->feat & NETF_PADMIN) == 0 && BLEN(bp) < ether->minmtu)
 		bp = adjustblock(bp, ether->minmtu);
 
-	qbwrite(ether->oq, bp);
-	if (ether->transmit != NULL)
-		ether->transmit(ether);
+	/* A burst (e.g. the segments of a GSO send) only kicks the driver on its
+	 * last packet, so the driver drains it all and rings the NIC once.  If
+	 * this packet fills the queue, qbwrite will wait for the driver, so we
+	 * have to kick for the packets we held back first. */
+	more = bp->flag & Bmore;
+	bp->flag &= ~Bmore;
+	txq = ethertxq(ether);
+	q = ether->txq[txq];
+	if (BALLOC(bp) < qwindow(q)) {
+		qbwrite(q, bp);
+		if (more)
+			return len;
+	} else {
+		etherkick(ether, txq);
+		qbwrite(q, bp);
+	}
+	etherkick(ether, txq);
 
 	return len;
 }
 
+static void etherringrelease(struct etherring *r)
+{
+	for (size_t i = 0; i < r->npages; i++)
+		page_decref(r->pages[i]);
+	if (r->proc)
+		proc_decref(r->proc);
+	kfree(r);
+}
+
+/* Handles "ring ADDR NRX NTX [EVQ EVID]".  Takes references on the current
+ * process's ring pages and attaches the ring to f.  From then on etheriq copies
+ * f's packets into the ring instead of f->in. */
+static void etherringattach(struct netfile *f, struct cmdbuf *cb)
+{
+	struct proc *p = current;
+	struct etherring *r;
+	struct page *page;
+	pte_t pte;
+	uintptr_t uva;
+	unsigned long nrx, ntx;
+	size_t npages;
+
+	if (cb->nf != 4 && cb->nf != 6)
+		error(EINVAL, "usage: ring ADDR NRX NTX [EVQ EVID]");
+	uva = strtoul(cb->f[1], 0, 16);
+	nrx = strtoul(cb->f[2], 0, 0);
+	ntx = strtoul(cb->f[3], 0, 0);
+	if (!nrx || !ntx || (nrx & (nrx - 1)) || (ntx & (ntx - 1)) ||
+	    nrx > ETHER_RING_MAXSLOTS || ntx > ETHER_RING_MAXSLOTS)
+		error(EINVAL, "ring sizes must be powers of two up to %d",
+		      ETHER_RING_MAXSLOTS);
+	npages = ether_ring_pages(nrx, ntx);
+	if (PGOFF(uva) || !is_user_rwaddr((void*)uva, npages * PGSIZE))
+		error(EFAULT, "bad ring address %p", (void*)uva);
+	r = kzmalloc(sizeof(struct etherring) + npages * sizeof(struct page *),
+	             KMALLOC_WAIT);
+	spinlock_init_irqsave(&r->rxlock);
+	qlock_init(&r->txlock);
+	r->nrx = nrx;
+	r->ntx = ntx;
+	if (cb->nf == 6) {
+		r->ev_q = (struct event_queue *)strtoul(cb->f[4], 0, 16);
+		r->ev_id = strtol(cb->f[5], 0, 0);
+		if (!is_user_rwaddr(r->ev_q, sizeof(struct event_queue))) {
+			kfree(r);
+			error(EFAULT, "bad ring ev_q %p", r->ev_q);
+		}
+	}
+	spin_lock(&p->vmr_lock);
+	for (; r->npages < npages; r->npages++) {
+		page = page_lookup(p->env_pgdir,
+		                   (void*)uva + r->npages * PGSIZE, &pte);
+		if (!page || !pte_has_perm_urw(pte))
+			break;
+		page_incref(page);
+		r->pages[r->npages] = page;
+	}
+	spin_unlock(&p->vmr_lock);
+	if (r->npages != npages) {
+		etherringrelease(r);
+		error(EFAULT, "ring pages must be writable and populated");
+	}
+	r->hdr = page2kva(r->pages[0]);
+	memset(r->hdr, 0, sizeof(struct ether_ring_hdr));
+	r->hdr->rx.nslots = nrx;
+	r->hdr->tx.nslots = ntx;
+	proc_incref(p, 1);
+	r->proc = p;
+
+	qlock(&f->qlock);
+	if (f->ring) {
+		qunlock(&f->qlock);
+		etherringrelease(r);
+		error(EBUSY, "connection already has a ring");
+	}
+	rcu_assign_pointer(f->ring, r);
+	qunlock(&f->qlock);
+}
+
+/* Detaches f's ring and drops its page and proc references.  Called by
+ * netifclose, with f's qlock held, when the last chan for f goes away. */
+void etherringfree(struct netfile *f)
+{
+	struct etherring *r = f->ring;
+
+	RCU_INIT_POINTER(f->ring, NULL);
+	synchronize_rcu();
+	etherringrelease(r);
+}
+
+static struct ether_ring_slot *etherringtxslot(struct etherring *r, uint32_t i)
+{
+	return etherringslot(r, r->nrx + (i & (r->ntx - 1)));
+}
+
+/* Builds a block for the TX frame whose first slot is r->txcons, consuming its
+ * slots.  Returns 0 for garbage: bad lengths or offsets, or a frame that runs
+ * past prod. */
+static struct block *etherringtxframe(struct ether *ether, struct netfile *f,
+                                      struct etherring *r, uint32_t prod)
+{
+	struct ether_ring_slot *slot = etherringtxslot(r, r->txcons);
+	uint16_t flags = ACCESS_ONCE(slot->flags);
+	uint16_t csum_start = ACCESS_ONCE(slot->csum_start);
+	uint16_t csum_offset = ACCESS_ONCE(slot->csum_offset);
+	uint16_t mss = ACCESS_ONCE(slot->mss);
+	uint32_t first = r->txcons;
+	struct block *bp;
+	int len = 0, maxlen, slen;
+	bool more;
+
+	/* The process can change slots under us, so the lengths are clamped
+	 * again when copying. */
+	do {
+		slot = etherringtxslot(r, r->txcons++);
+		len += MIN(ACCESS_ONCE(slot->len), sizeof(slot->data));
+		more = ACCESS_ONCE(slot->flags) & ETHER_RING_F_MORE;
+	} while (more && r->txcons != prod);
+	if (flags & (ETHER_RING_F_TSO | ETHER_RING_F_USO))
+		maxlen = ETHER_RING_MAXGSO;
+	else
+		maxlen = ether->maxmtu + ETHERHDRSIZE;
+	if (more || len < ETHERHDRSIZE || len > maxlen)
+		return 0;
+	if ((flags & (ETHER_RING_F_TCPCK | ETHER_RING_F_UDPCK | ETHER_RING_F_TSO |
+	              ETHER_RING_F_USO)) &&
+	    (csum_start < ETHERHDRSIZE || csum_start + csum_offset + 2 > len))
+		return 0;
+	bp = allocb(len);
+	for (uint32_t i = first; i != r->txcons && BLEN(bp) < len; i++) {
+		slot = etherringtxslot(r, i);
+		slen = MIN(ACCESS_ONCE(slot->len), sizeof(slot->data));
+		slen = MIN(slen, len - BLEN(bp));
+		memmove(bp->wp, slot->data, slen);
+		bp->wp += slen;
+	}
+	if (!(flags & ETHER_RING_F_SRC) || !f->bridge)
+		memmove(bp->rp + Eaddrlen, ether->ea, Eaddrlen);
+	if (flags & ETHER_RING_F_TCPCK)
+		bp->flag |= Btcpck;
+	if (flags & ETHER_RING_F_UDPCK)
+		bp->flag |= Budpck;
+	if (flags & ETHER_RING_F_TSO)
+		bp->flag |= Btso;
+	if (flags & ETHER_RING_F_USO)
+		bp->flag |= Buso;
+	bp->checksum_start = csum_start;
+	bp->checksum_offset = csum_offset;
+	bp->mss = mss;
+	return bp;
+}
+
+/* Handles "kick": sends everything the process queued in f's TX ring.  Slots
+ * are consumed even if they hold garbage, so a bad slot can't wedge the ring. */
+static void etherringkick(struct ether *ether, struct netfile *f)
+{
+	ERRSTACK(1);
+	struct etherring *r = f->ring;
+	struct block *bp;
+	uint32_t prod;
+
+	if (!r)
+		error(EINVAL, "connection has no ring");
+	qlock(&r->txlock);
+	if (waserror()) {
+		qunlock(&r->txlock);
+		nexterror();
+	}
+	prod = ACCESS_ONCE(r->hdr->tx.prod);
+	rmb();
+	if (prod - r->txcons > r->ntx)
+		error(EINVAL, "TX ring prod %u is past cons %u", prod, r->txcons);
+	while (r->txcons != prod) {
+		bp = etherringtxframe(ether, f, r, prod);
+		if (!bp) {
+			ether->oerrs++;
+			continue;
+		}
+		etheroq(ether, bp);
+	}
+	/* Our reads of the slots must finish before the process can reuse them */
+	mb();
+	r->hdr->tx.cons = r->txcons;
+	poperror();
+	qunlock(&r->txlock);
+}
+
+/* Adaptive RX interrupt coalescing, like Linux's adaptive-rx: a quiet link
+ * gets an interrupt per packet for latency, a busy one gets batches. */
+static void ethercoalsample(struct alarm_waiter *waiter)
+{
+	struct ether *ether = container_of(waiter, struct ether, coal.alarm);
+	struct ethercoal *coal = &ether->coal;
+	uint64_t now, usec, rate;
+	int in, hold;
+
+	qlock(&coal->qlock);
+	if (!coal->adaptive) {
+		coal->armed = FALSE;
+		qunlock(&coal->qlock);
+		return;
+	}
+	now = read_tsc();
+	in = ether->inpackets;
+	usec = MAX(tsc2usec(now - coal->last_tsc), 1);
+	rate = (uint64_t)(unsigned int)(in - coal->last_in) * 1000000 / usec;
+	coal->last_in = in;
+	coal->last_tsc = now;
+	if (rate <= coal->rate_low)
+		hold = coal->usec_low;
+	else if (rate >= coal->rate_high)
+		hold = coal->usec_high;
+	else
+		hold = coal->usec_low + (rate - coal->rate_low) *
+		       (coal->usec_high - coal->usec_low) /
+		       (coal->rate_high - coal->rate_low);
+	if (hold != coal->usec) {
+		coal->usec = hold;
+		ether->coalesce(ether, hold);
+	}
+	set_awaiter_rel(waiter, COAL_SAMPLE);
+	set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+	qunlock(&coal->qlock);
+}
+
+static void ethercoalinit(struct ether *ether)
+{
+	struct ethercoal *coal = &ether->coal;
+
+	qlock_init(&coal->qlock);
+	coal->usec = -1;
+	coal->usec_low = COAL_USEC_LOW;
+	coal->usec_high = COAL_USEC_HIGH;
+	coal->rate_low = COAL_RATE_LOW;
+	coal->rate_high = COAL_RATE_HIGH;
+	init_awaiter(&coal->alarm, ethercoalsample);
+}
+
+/* Handles "irqcore QUEUE CORE", which steers a queue's interrupt to another
+ * core, e.g. away from cores given to an MCP. */
+static void etherirqctl(struct ether *ether, struct cmdbuf *cb)
+{
+	long qidx, coreid;
+
+	if (ether->vlanid)
+		ether = ether->ctlr;
+	if (cb->nf != 3)
+		error(EINVAL, "irqcore QUEUE CORE");
+	qidx = strtol(cb->f[1], 0, 0);
+	coreid = strtol(cb->f[2], 0, 0);
+	if (qidx < 0 || qidx >= Maxqueues || !ether->qvec[qidx])
+		error(EINVAL, "%s queue %ld has no IRQ of its own", ether->type,
+		      qidx);
+	if (coreid < 0 || coreid >= num_cores)
+		error(EINVAL, "no core %ld", coreid);
+	if (route_irqs(ether->qvec[qidx], coreid))
+		error(EFAIL, "can't route vector %d to core %ld",
+		      ether->qvec[qidx], coreid);
+	ether->qcore[qidx] = coreid;
+}
+
+/* Handles "coalesce USEC" and "coalesce adaptive [ULOW UHIGH RLOW RHIGH]". */
+static void ethercoalctl(struct ether *ether, struct cmdbuf *cb)
+{
+	ERRSTACK(1);
+	struct ethercoal *coal;
+	long v[4];
+
+	if (ether->vlanid)
+		ether = ether->ctlr;
+	if (ether->coalesce == NULL)
+		error(ENOTSUP, "%s can't coalesce interrupts", ether->type);
+	if (cb->nf < 2)
+		error(EINVAL, "coalesce USEC|adaptive [ULOW UHIGH RLOW RHIGH]");
+	coal = &ether->coal;
+	qlock(&coal->qlock);
+	if (waserror()) {
+		qunlock(&coal->qlock);
+		nexterror();
+	}
+	if (strcmp(cb->f[1], "adaptive") == 0) {
+		if (cb->nf != 2 && cb->nf != 6)
+			error(EINVAL, "coalesce adaptive [ULOW UHIGH RLOW RHIGH]");
+		if (cb->nf == 6) {
+			for (int i = 0; i < 4; i++)
+				v[i] = strtol(cb->f[2 + i], 0, 0);
+			if (v[0] < 0 || v[0] > v[1] || v[1] > COAL_USEC_MAX ||
+			    v[2] < 0 || v[2] >= v[3])
+				error(EINVAL, "need 0 <= ULOW <= UHIGH <= %d, 0 <= RLOW < RHIGH",
+				      COAL_USEC_MAX);
+			coal->usec_low = v[0];
+			coal->usec_high = v[1];
+			coal->rate_low = v[2];
+			coal->rate_high = v[3];
+		}
+		coal->adaptive = TRUE;
+		if (!coal->armed) {
+			coal->armed = TRUE;
+			coal->last_in = ether->inpackets;
+			coal->last_tsc = read_tsc();
+			set_awaiter_rel(&coal->alarm, COAL_SAMPLE);
+			set_alarm(&per_cpu_info[core_id()].tchain, &coal->alarm);
+		}
+	} else {
+		v[0] = strtol(cb->f[1], 0, 0);
+		if (v[0] < 0 || v[0] > COAL_USEC_MAX)
+			error(EINVAL, "coalesce %ld usec out of range [0, %d]", v[0],
+			      COAL_USEC_MAX);
+		/* A pending sample sees this and stops */
+		coal->adaptive = FALSE;
+		coal->usec = v[0];
+		ether->coalesce(ether, v[0]);
+	}
+	poperror();
+	qunlock(&coal->qlock);
+}
+
 static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 {
 	ERRSTACK(2);
 	struct ether *ether;
 	struct block *bp;
-	int onoff;
+	int onoff, i;
 	struct cmdbuf *cb;
+	struct netfile *f;
 	long l;
 
 	ether = chan->aux;
@@ -477,11 +1187,48 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 				onoff = 1;
 			else
 				onoff = atoi(cb->f[1]);
-			if (ether->oq != NULL)
-				qdropoverflow(ether->oq, onoff);
+			for (i = 0; i < ether->nr_txq; i++)
+				qdropoverflow(ether->txq[i], onoff);
 			kfree(cb);
 			goto out;
 		}
+		if (strcmp(cb->f[0], "coalesce") == 0) {
+			if (waserror()) {
+				kfree(cb);
+				nexterror();
+			}
+			ethercoalctl(ether, cb);
+			poperror();
+			kfree(cb);
+			l = n;
+			goto out;
+		}
+		if (strcmp(cb->f[0], "irqcore") == 0) {
+			if (waserror()) {
+				kfree(cb);
+				nexterror();
+			}
+			etherirqctl(ether, cb);
+			poperror();
+			kfree(cb);
+			l = n;
+			goto out;
+		}
+		if (strcmp(cb->f[0], "ring") == 0 || strcmp(cb->f[0], "kick") == 0) {
+			if (waserror()) {
+				kfree(cb);
+				nexterror();
+			}
+			f = ether->f[NETID(chan->qid.path)];
+			if (cb->f[0][0] == 'r')
+				etherringattach(f, cb);
+			else
+				etherringkick(ether, f);
+			poperror();
+			kfree(cb);
+			l = n;
+			goto out;
+		}
 		kfree(cb);
 		if (ether->ctl != NULL) {
 			l = ether->ctl(ether, buf, n);
@@ -532,7 +1279,8 @@ static long etherbwrite(struct chan *chan, struct block *bp, uint32_t unused)
 		runlock(&ether->rwlock);
 		nexterror();
 	}
-	if (n > ether->maxmtu + ETHERHDRSIZE && (bp->flag & Btso) == 0) {
+	if (n > ether->maxmtu + ETHERHDRSIZE &&
+	    (bp->flag & (Btso | Buso)) == 0) {
 		freeb(bp);
 		error(E2BIG, ERROR_FIXME);
 	}
@@ -542,6 +1290,40 @@ static long etherbwrite(struct chan *chan, struct block *bp, uint32_t unused)
 	return n;
 }
 
+/* Spins on the ether behind c, a medium's data chan, for up to usec or until
+ * done(arg), passing packets up as the NIC gets them.  Returns FALSE if c isn't
+ * an ether that can busy poll. */
+bool etherbusypoll(struct chan *c, uint64_t usec, bool (*done)(void *),
+                   void *arg)
+{
+	ERRSTACK(1);
+	struct ether *ether;
+	uint64_t end;
+
+	if (&devtab[c->type] != &etherdevtab)
+		return FALSE;
+	ether = c->aux;
+	if (ether->vlanid)
+		ether = ether->ctlr;
+	if (ether->poll == NULL || ether->busypoll == NULL)
+		return FALSE;
+	rlock(&ether->rwlock);
+	if (waserror()) {
+		runlock(&ether->rwlock);
+		nexterror();
+	}
+	end = read_tsc() + usec2tsc(usec);
+	ether->busypoll(ether, 1);
+	while (!done(arg) && read_tsc() < end) {
+		if (!ether->poll(ether, POLL_BUDGET))
+			cpu_relax();
+	}
+	ether->busypoll(ether, 0);
+	poperror();
+	runlock(&ether->rwlock);
+	return TRUE;
+}
+
 static void nop(struct ether *unused)
 {
 }
@@ -680,6 +1462,31 @@ int parseether(uint8_t * to, char *from)
 	return 0;
 }
 
+/* The Toeplitz key from Microsoft's RSS spec, which most NICs default to. */
+static const uint8_t rss_default_key[Rsskeylen] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* Opens the TX queues beyond oq and spreads the RSS redirection table over the
+ * RX queues the driver asked for. */
+static void etherqinit(struct ether *ether, int qsize)
+{
+	int i;
+
+	ether->txq[0] = ether->oq;
+	for (i = 1; i < ether->nr_txq; i++) {
+		ether->txq[i] = qopen(qsize, Qmsg, 0, 0);
+		if (ether->txq[i] == NULL)
+			panic("etherqinit %s", ether->name);
+	}
+	for (i = 0; i < Rssretalen; i++)
+		ether->rss_reta[i] = i % ether->nr_rxq;
+}
+
 static void etherreset(void)
 {
 	struct ether *ether;
@@ -692,10 +1499,14 @@ static void etherreset(void)
 		memset(ether, 0, sizeof(struct ether));
 		rwinit(&ether->rwlock);
 		qlock_init(&ether->vlq);
+		ethercoalinit(ether);
 		ether->ctlrno = ctlrno;
 		ether->mbps = 10;
 		ether->minmtu = ETHERMINTU;
 		ether->maxmtu = ETHERMAXTU;
+		ether->nr_txq = 1;
+		ether->nr_rxq = 1;
+		memmove(ether->rss_key, rss_default_key, Rsskeylen);
 		/* looked like irq type, we don't have these yet */
 		//ether->netif.itype = -1;
 
@@ -723,6 +1534,8 @@ static void etherreset(void)
 #endif
 			if (cards[n].reset(ether))
 				continue;
+			ether->nr_txq = MAX(1, MIN(ether->nr_txq, Maxqueues));
+			ether->nr_rxq = MAX(1, MIN(ether->nr_rxq, Maxqueues));
 			/* might be fucked a bit - reset() doesn't know the type.  might not
 			 * even matter, except for debugging. */
 			ether->type = cards[n].type;
@@ -746,6 +1559,9 @@ static void etherreset(void)
 						  ": %02.2x:%02.2x:%02.2x:%02.2x:%02.2x:%02.2x",
 						  ether->ea[0], ether->ea[1], ether->ea[2],
 						  ether->ea[3], ether->ea[4], ether->ea[5]);
+			if (ether->nr_txq > 1 || ether->nr_rxq > 1)
+				i += snprintf(buf + i, sizeof(buf) - i, " %d/%d queues",
+				              ether->nr_rxq, ether->nr_txq);
 			snprintf(buf + i, sizeof(buf) - i, "\n");
 			printk(buf);
 
@@ -768,6 +1584,7 @@ static void etherreset(void)
 				ether->oq = qopen(qsize, Qmsg, 0, 0);
 			if (ether->oq == 0)
 				panic("etherreset %s", name);
+			etherqinit(ether, qsize);
 			ether->alen = Eaddrlen;
 			memmove(ether->addr, ether->ea, Eaddrlen);
 			memset(ether->bcast, 0xFF, Eaddrlen);
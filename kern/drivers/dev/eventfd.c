@@ -6,7 +6,20 @@
  *
  * Unlike the Linux interface, which takes host-endian u64s, we read and write
  * strings.  It's a little slower, but it maintains the distributed-system
- * nature of Plan 9 devices. */
+ * nature of Plan 9 devices.
+ *
+ * Shared-memory mode: after writing "shm ADDR" to the ctl, the counter is the
+ * uint64_t at ADDR in the address space of the process that wrote it, and only
+ * that process can read or write the efd.  The low 63 bits are the count.  The
+ * top bit, EFD_SHM_WAITING, is set by whoever wants to hear about the next
+ * increment: a reader blocking in the kernel, or a reader about to wait on an FD
+ * tap (e.g. epoll), which must recheck the count after setting it.
+ *
+ * Producers add to the counter in user space, and only if they saw WAITING do
+ * they write to the efd (usually a 0).  That write adds its value, clears
+ * WAITING, wakes blocked readers, and fires the READABLE taps, so taps only fire
+ * on the edge where someone is waiting.  Consumers take counts with a CAS in
+ * user space, and only read the efd when they want to block. */
 
 #include <ns.h>
 #include <kmalloc.h>
@@ -19,6 +32,7 @@
 #include <sys/queue.h>
 #include <fdtap.h>
 #include <syscall.h>
+#include <umem.h>
 
 struct dev efd_devtab;
 
@@ -41,9 +55,13 @@ static struct dirtab efd_dir[] = {
 
 enum {
 	EFD_SEMAPHORE = 			1 << 0,
+	EFD_SHM =					1 << 1,
 	EFD_MAX_VAL =				(unsigned long)(-2), // i.e. 0xfffffffffffffffe
 };
 
+#define EFD_SHM_WAITING				(1ULL << 63)
+#define EFD_SHM_COUNT				(EFD_SHM_WAITING - 1)
+
 
 struct eventfd {
 	int 						flags;
@@ -53,6 +71,9 @@ struct eventfd {
 	struct rendez				rv_readers;
 	struct rendez				rv_writers;
 	struct kref					refcnt;
+	uint64_t					*shm_ctr;
+	pid_t						shm_pid;
+	atomic_t					shm_kicks;
 };
 
 
@@ -151,14 +172,19 @@ static void efd_fire_taps(struct eventfd *efd, int filter)
 static int has_counts(void *arg)
 {
 	struct eventfd *efd = arg;
-	return atomic_read(&efd->counter) != 0;
+	/* Readers who slept before we switched to shm mode need to retry */
+	return atomic_read(&efd->counter) != 0 || (efd->flags & EFD_SHM);
 }
 
+static unsigned long efd_shm_read(struct eventfd *efd, struct chan *c);
+
 /* The heart of reading an eventfd */
 static unsigned long efd_read_efd(struct eventfd *efd, struct chan *c)
 {
 	unsigned long old_count, new_count, ret;
 	while (1) {
+		if (efd->flags & EFD_SHM)
+			return efd_shm_read(efd, c);
 		old_count = atomic_read(&efd->counter);
 		if (!old_count) {
 			if (c->flag & O_NONBLOCK)
@@ -182,6 +208,133 @@ success:
 	return ret;
 }
 
+static void efd_shm_check(struct eventfd *efd)
+{
+	if (current->pid != efd->shm_pid)
+		error(EPERM, "#%s shm counter belongs to pid %d", devname(),
+		      efd->shm_pid);
+}
+
+static uint64_t efd_shm_get(struct eventfd *efd)
+{
+	uint64_t val;
+
+	if (copy_from_user(&val, efd->shm_ctr, sizeof(val)))
+		error(EFAULT, "Bad #%s shm counter %p", devname(), efd->shm_ctr);
+	return val;
+}
+
+static bool efd_shm_cas(struct eventfd *efd, uint64_t old, uint64_t new)
+{
+	uint64_t prev;
+
+	if (cmpxchg_user_u64(efd->shm_ctr, old, new, &prev))
+		error(EFAULT, "Bad #%s shm counter %p", devname(), efd->shm_ctr);
+	return prev == old;
+}
+
+struct efd_shm_waiter {
+	struct eventfd				*efd;
+	long						kicks;
+};
+
+static int efd_shm_kicked(void *arg)
+{
+	struct efd_shm_waiter *w = arg;
+
+	return atomic_read(&w->efd->shm_kicks) != w->kicks;
+}
+
+/* We can't sleep on the counter itself, since user space changes it without
+ * telling us.  Instead, we set WAITING and sleep until someone kicks us. */
+static unsigned long efd_shm_read(struct eventfd *efd, struct chan *c)
+{
+	struct efd_shm_waiter w = {.efd = efd};
+	uint64_t old, count, ret;
+
+	efd_shm_check(efd);
+	while (1) {
+		w.kicks = atomic_read(&efd->shm_kicks);
+		old = efd_shm_get(efd);
+		count = old & EFD_SHM_COUNT;
+		if (count) {
+			ret = efd->flags & EFD_SEMAPHORE ? 1 : count;
+			/* Leaves WAITING alone, for any other waiters */
+			if (efd_shm_cas(efd, old, old - ret))
+				return ret;
+			continue;
+		}
+		if (c->flag & O_NONBLOCK)
+			error(EAGAIN, "Would block on #%s read", devname());
+		if (!(old & EFD_SHM_WAITING) &&
+		    !efd_shm_cas(efd, old, old | EFD_SHM_WAITING))
+			continue;
+		rendez_sleep(&efd->rv_readers, efd_shm_kicked, &w);
+	}
+}
+
+/* A kick from a producer: adds to the count and tells everyone waiting. */
+static void efd_shm_write(struct eventfd *efd, unsigned long add_to)
+{
+	uint64_t old, new;
+
+	efd_shm_check(efd);
+	do {
+		old = efd_shm_get(efd);
+		new = (old & EFD_SHM_COUNT) + add_to;
+		if (new > EFD_SHM_COUNT)
+			error(EOVERFLOW, "#%s shm counter would overflow", devname());
+	} while (!efd_shm_cas(efd, old, new));
+	atomic_inc(&efd->shm_kicks);
+	rendez_wakeup(&efd->rv_readers);
+	efd_fire_taps(efd, FDTAP_FILT_READABLE);
+}
+
+static void efd_shm_attach(struct eventfd *efd, uint64_t *ctr)
+{
+	unsigned long old_count;
+
+	if (efd->flags & EFD_SHM)
+		error(EBUSY, "#%s already has a shm counter", devname());
+	if (!ALIGNED(ctr, sizeof(uint64_t)) ||
+	    !is_user_rwaddr(ctr, sizeof(uint64_t)))
+		error(EINVAL, "Bad #%s shm counter %p", devname(), ctr);
+	efd->shm_ctr = ctr;
+	efd->shm_pid = current->pid;
+	atomic_init(&efd->shm_kicks, 0);
+	/* Carry over any count we had, then let sleeping readers retry. */
+	old_count = atomic_swap(&efd->counter, 0);
+	wmb();
+	efd->flags |= EFD_SHM;
+	if (old_count)
+		efd_shm_write(efd, old_count);
+	rendez_wakeup(&efd->rv_readers);
+	rendez_wakeup(&efd->rv_writers);
+}
+
+static void efd_ctl(struct eventfd *efd, void *ubuf, long n)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+
+	cb = parsecmd(ubuf, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	if (cb->nf < 1)
+		error(EINVAL, "short #%s ctl", devname());
+	if (!strcmp(cb->f[0], "shm")) {
+		if (cb->nf < 2)
+			error(EINVAL, "shm needs a counter address");
+		efd_shm_attach(efd, (uint64_t*)strtoul(cb->f[1], 0, 0));
+	} else {
+		error(EINVAL, "Unknown #%s ctl %s", devname(), cb->f[0]);
+	}
+	kfree(cb);
+	poperror();
+}
+
 static long efd_read(struct chan *c, void *ubuf, long n, int64_t offset)
 {
 	struct eventfd *efd = c->aux;
@@ -205,7 +358,7 @@ static long efd_read(struct chan *c, void *ubuf, long n, int64_t offset)
 static int has_room(void *arg)
 {
 	struct eventfd *efd = arg;
-	return atomic_read(&efd->counter) != EFD_MAX_VAL;
+	return atomic_read(&efd->counter) != EFD_MAX_VAL || (efd->flags & EFD_SHM);
 }
 
 /* The heart of writing an eventfd */
@@ -214,6 +367,10 @@ static void efd_write_efd(struct eventfd *efd, unsigned long add_to,
 {
 	unsigned long old_count, new_count;
 	while (1) {
+		if (efd->flags & EFD_SHM) {
+			efd_shm_write(efd, add_to);
+			return;
+		}
 		old_count = atomic_read(&efd->counter);
 		new_count = old_count + add_to;
 		if (new_count > EFD_MAX_VAL) {
@@ -238,9 +395,7 @@ static long efd_write(struct chan *c, void *ubuf, long n, int64_t offset)
 
 	switch (c->qid.path) {
 		case Qctl:
-			/* If we want to allow runtime changing of settings, we can do it
-			 * here. */
-			error(EFAIL, "No #%s ctl commands supported", devname());
+			efd_ctl(efd, ubuf, n);
 			break;
 		case Qefd:
 			/* We want to give strtoul a null-terminated buf (can't handle
@@ -265,8 +420,14 @@ static char *efd_chaninfo(struct chan *c, char *ret, size_t ret_l)
 {
 	struct eventfd *efd = c->aux;
 
-	snprintf(ret, ret_l, "QID type %s, flags %p, counter %p",
-	         efd_dir[c->qid.path].name, efd->flags, atomic_read(&efd->counter));
+	if (efd->flags & EFD_SHM)
+		snprintf(ret, ret_l, "QID type %s, flags %p, shm counter %p pid %d",
+		         efd_dir[c->qid.path].name, efd->flags, efd->shm_ctr,
+		         efd->shm_pid);
+	else
+		snprintf(ret, ret_l, "QID type %s, flags %p, counter %p",
+		         efd_dir[c->qid.path].name, efd->flags,
+		         atomic_read(&efd->counter));
 	return ret;
 }
 
@@ -300,6 +461,10 @@ static int efd_tapfd(struct chan *c, struct fd_tap *tap, int cmd)
 					SLIST_REMOVE(&efd->fd_taps, tap, fd_tap, link);
 					ret = 0;
 					break;
+				case (FDTAP_CMD_MOD):
+					/* filter checked above; fdtap updates the tap */
+					ret = 0;
+					break;
 				default:
 					set_error(ENOSYS, "Unsupported #%s tap command %p",
 							  devname(), cmd);
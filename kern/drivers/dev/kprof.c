@@ -26,9 +26,21 @@
 #include <umem.h>
 #include <profiler.h>
 #include <kprof.h>
+#include <lockstat.h>
+#include <tracepoint.h>
+#include <syscall.h>
+#include <kdebug.h>
+#include <taskqueue.h>
+#include <trap.h>
+#include <dmapool.h>
+#include <kmem_acct.h>
+#include <reclaim.h>
+#include <zlib.h>
 
 #define KTRACE_BUFFER_SIZE (128 * 1024)
 #define TRACE_PRINTK_BUFFER_SIZE (8 * 1024)
+/* Smallest chunk of profile data we bother compressing on its own core */
+#define KPROF_ZCHUNK_MIN (256 * 1024)
 
 enum {
 	Kprofdirqid = 0,
@@ -38,6 +50,19 @@ enum {
 	Kprintxqid,
 	Kmpstatqid,
 	Kmpstatrawqid,
+	Kkmallocstatqid,
+	Knumastatqid,
+	Klockstatqid,
+	Kkmsgstatqid,
+	Kfpstatqid,
+	Kkstackstatqid,
+	Kwqstatqid,
+	Kdmapoolstatqid,
+	Kkmemstatqid,
+	Kreclaimstatqid,
+	Ktraceqid,
+	Ksystraceqid,
+	Ksysclatqid,
 };
 
 struct trace_printk_buffer {
@@ -50,10 +75,21 @@ struct kprof {
 	struct alarm_waiter *alarms;
 	bool mpstat_ipi;
 	bool profiling;
+	bool compress;
 	char *pdata;
 	size_t psize;
 };
 
+/* One core's share of compressing a fetch of profiler data */
+struct kprof_zwork {
+	const char *src;
+	size_t src_len;
+	char *dst;
+	size_t z_len;				/* 0 if it didn't shrink */
+	void *workspace;
+	struct semaphore *done;
+};
+
 struct dev kprofdevtab;
 struct dirtab kproftab[] = {
 	{".",			{Kprofdirqid,		0, QTDIR}, 0,	DMDIR|0550},
@@ -63,6 +99,19 @@ struct dirtab kproftab[] = {
 	{"kprintx",		{Kprintxqid},		0,	0600},
 	{"mpstat",		{Kmpstatqid},		0,	0600},
 	{"mpstat-raw",	{Kmpstatrawqid},	0,	0600},
+	{"kmallocstat",	{Kkmallocstatqid},	0,	0600},
+	{"numastat",	{Knumastatqid},	0,	0600},
+	{"lockstat",	{Klockstatqid},	0,	0600},
+	{"kmsgstat",	{Kkmsgstatqid},	0,	0600},
+	{"fpstat",		{Kfpstatqid},		0,	0600},
+	{"kstackstat",	{Kkstackstatqid},	0,	0600},
+	{"wqstat",		{Kwqstatqid},		0,	0600},
+	{"dmapoolstat",	{Kdmapoolstatqid},	0,	0600},
+	{"kmemstat",	{Kkmemstatqid},		0,	0600},
+	{"reclaimstat",	{Kreclaimstatqid},	0,	0600},
+	{"trace",		{Ktraceqid},		0,	0600},
+	{"systrace",	{Ksystraceqid},	0,	0600},
+	{"sysclat",	{Ksysclatqid},		0,	0600},
 };
 
 static struct kprof kprof;
@@ -88,6 +137,41 @@ static size_t mpstatraw_len(void)
 	return header_row + cpu_row * num_cores + 1;
 }
 
+static size_t kmallocstat_len(void)
+{
+	size_t each_row = 6 + 5 * 17 + 8;
+
+	return each_row * (KMALLOC_NR_STAT_CLASSES + 1) + 1;
+}
+
+static size_t numastat_len(void)
+{
+	size_t each_row = 5 + 6 * 17 + 1;
+
+	return each_row * (nr_page_nodes + 1) + 1;
+}
+
+static size_t kmsgstat_len(void)
+{
+	size_t each_row = 4 + 2 * 17 + 1;
+
+	return each_row * (num_cores + 1) + 1;
+}
+
+static size_t fpstat_len(void)
+{
+	size_t each_row = 4 + 3 * 17 + 1;
+
+	return each_row * (num_cores + 1) + 1;
+}
+
+static size_t kstackstat_len(void)
+{
+	size_t each_row = 4 + 3 * 17 + 7 + 1;
+
+	return each_row * (num_cores + 1) + 1;
+}
+
 static char *devname(void)
 {
 	return kprofdevtab.name;
@@ -162,22 +246,158 @@ static void kprof_start_profiler(void)
 	qunlock(&kprof.lock);
 }
 
+static size_t kprof_read_profiler_data(char *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		size_t csize = profiler_read(buf + done, size - done);
+
+		if (csize == 0)
+			break;
+		done += csize;
+	}
+	return done;
+}
+
+#ifdef CONFIG_ZLIB_DEFLATE
+
+/* Deflates one chunk, in a routine kmsg on the core it was sent to.  If the
+ * chunk doesn't fit in src_len bytes, we leave z_len at 0, and it gets stored
+ * raw. */
+static void kprof_zchunk(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kprof_zwork *w = (struct kprof_zwork*)a0;
+	z_stream strm;
+
+	memset(&strm, 0, sizeof(strm));
+	strm.workspace = w->workspace;
+	if (zlib_deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	                      -MAX_WBITS, DEF_MEM_LEVEL,
+	                      Z_DEFAULT_STRATEGY) == Z_OK) {
+		strm.next_in = (const uint8_t*)w->src;
+		strm.avail_in = w->src_len;
+		strm.next_out = (uint8_t*)w->dst;
+		strm.avail_out = w->src_len;
+		if (zlib_deflate(&strm, Z_FINISH) == Z_STREAM_END)
+			w->z_len = strm.total_out;
+		zlib_deflateEnd(&strm);
+	}
+	sem_up(w->done);
+}
+
+static void kprof_free_zwork(struct kprof_zwork *work, int nr_chunks)
+{
+	for (int i = 0; i < nr_chunks; i++) {
+		kfree(work[i].dst);
+		kfree(work[i].workspace);
+	}
+	kfree(work);
+}
+
+/* Fetches the profiler's data and appends it to pdata as prof_zchunks.  The
+ * data is split into a chunk per core (or fewer, for a small fetch), and each
+ * core deflates its own chunk in parallel. */
+static void kprof_fetch_compressed(size_t size)
+{
+	ERRSTACK(1);
+	struct kprof_zwork *work = NULL;
+	struct semaphore done;
+	struct prof_zchunk hdr;
+	char *raw = NULL, *ndata, *p;
+	size_t len, chunk_sz, zsize = 0;
+	int nr_chunks = 0;
+
+	if (!size)
+		return;
+	if (waserror()) {
+		kprof_free_zwork(work, nr_chunks);
+		kfree(raw);
+		nexterror();
+	}
+	raw = kmalloc(size, KMALLOC_WAIT);
+	len = kprof_read_profiler_data(raw, size);
+	if (!len) {
+		poperror();
+		kfree(raw);
+		return;
+	}
+	nr_chunks = MIN(num_cores, DIV_ROUND_UP(len, KPROF_ZCHUNK_MIN));
+	chunk_sz = DIV_ROUND_UP(len, nr_chunks);
+	work = kzmalloc(sizeof(struct kprof_zwork) * nr_chunks, KMALLOC_WAIT);
+	sem_init(&done, 0);
+	for (int i = 0; i < nr_chunks; i++) {
+		work[i].src = raw + i * chunk_sz;
+		work[i].src_len = MIN(chunk_sz, len - i * chunk_sz);
+		work[i].dst = kmalloc(work[i].src_len, KMALLOC_WAIT);
+		work[i].workspace =
+			kmalloc(zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL),
+			        KMALLOC_WAIT);
+		work[i].done = &done;
+	}
+	for (int i = 0; i < nr_chunks; i++)
+		send_kernel_message(i, kprof_zchunk, (long)&work[i], 0, 0,
+		                    KMSG_ROUTINE);
+	for (int i = 0; i < nr_chunks; i++)
+		sem_down(&done);
+
+	for (int i = 0; i < nr_chunks; i++)
+		zsize += sizeof(hdr) + (work[i].z_len ?: work[i].src_len);
+	ndata = krealloc(kprof.pdata, kprof.psize + zsize, KMALLOC_WAIT);
+	if (!ndata)
+		error(ENOMEM, ERROR_FIXME);
+	kprof.pdata = ndata;
+	p = kprof.pdata + kprof.psize;
+	for (int i = 0; i < nr_chunks; i++) {
+		hdr.magic = PROF_ZCHUNK_MAGIC;
+		hdr.raw_len = work[i].src_len;
+		hdr.z_len = work[i].z_len ?: work[i].src_len;
+		hdr.flags = work[i].z_len ? 0 : PROF_ZCHUNK_STORED;
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+		memcpy(p, work[i].z_len ? work[i].dst : work[i].src, hdr.z_len);
+		p += hdr.z_len;
+	}
+	kprof.psize += zsize;
+	poperror();
+	kprof_free_zwork(work, nr_chunks);
+	kfree(raw);
+}
+
+#endif /* CONFIG_ZLIB_DEFLATE */
+
 static void kprof_fetch_profiler_data(void)
 {
 	size_t psize = kprof.psize + profiler_size();
-	char *ndata = krealloc(kprof.pdata, psize, KMALLOC_WAIT);
+	char *ndata;
 
+#ifdef CONFIG_ZLIB_DEFLATE
+	if (kprof.compress) {
+		kprof_fetch_compressed(psize - kprof.psize);
+		return;
+	}
+#endif
+	ndata = krealloc(kprof.pdata, psize, KMALLOC_WAIT);
 	if (!ndata)
 		error(ENOMEM, ERROR_FIXME);
 	kprof.pdata = ndata;
-	while (kprof.psize < psize) {
-		size_t csize = profiler_read(kprof.pdata + kprof.psize,
-		                             psize - kprof.psize);
+	kprof.psize += kprof_read_profiler_data(kprof.pdata + kprof.psize,
+	                                        psize - kprof.psize);
+}
 
-		if (csize == 0)
-			break;
-		kprof.psize += csize;
+static void kprof_set_compress(bool on)
+{
+#ifndef CONFIG_ZLIB_DEFLATE
+	if (on)
+		error(ENOSYS, "Kernel built without CONFIG_ZLIB_DEFLATE");
+#endif
+	qlock(&kprof.lock);
+	if (kprof.profiling) {
+		qunlock(&kprof.lock);
+		error(EBUSY, "Can't change compression while profiling");
 	}
+	kprof.compress = on;
+	qunlock(&kprof.lock);
 }
 
 static void kprof_stop_profiler(void)
@@ -226,6 +446,7 @@ static void kprof_init(void)
 
 	qlock_init(&kprof.lock);
 	kprof.profiling = FALSE;
+	kprof.compress = FALSE;
 	kprof.pdata = NULL;
 	kprof.psize = 0;
 
@@ -248,7 +469,7 @@ static void kprof_init(void)
 	kproftab[Kmpstatqid].length = mpstat_len();
 	kproftab[Kmpstatrawqid].length = mpstatraw_len();
 
-	strlcpy(kprof_control_usage, "clear|start|stop|flush|timer",
+	strlcpy(kprof_control_usage, "clear|start|stop|flush|timer|compress",
 	        sizeof(kprof_control_usage));
 	profiler_append_configure_usage(kprof_control_usage,
 	                                sizeof(kprof_control_usage));
@@ -390,6 +611,326 @@ static long mpstatraw_read(void *va, long n, int64_t off)
 	return n;
 }
 
+/* One row per kmalloc size class.  'waste' is the internal fragmentation:
+ * bytes handed out (which includes the kmalloc tag) vs bytes requested. */
+static long kmallocstat_read(void *va, long n, int64_t off)
+{
+	size_t bufsz = kmallocstat_len();
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+	struct kmalloc_class_stats stats;
+
+	len += snprintf(buf + len, bufsz - len, "%5s %16s %16s %16s %16s %16s"
+	                " %7s\n", "class", "size", "allocs", "frees", "requested",
+	                "allocated", "waste");
+	for (int i = 0; i < KMALLOC_NR_STAT_CLASSES; i++) {
+		kmalloc_get_class_stats(i, &stats);
+		if (i == KMALLOC_PAGES_CLASS)
+			len += snprintf(buf + len, bufsz - len, "%5s %16s", "pages", "-");
+		else
+			len += snprintf(buf + len, bufsz - len, "%5d %16lu", i,
+			                kmalloc_class_size(i));
+		len += snprintf(buf + len, bufsz - len, " %16llu %16llu %16llu %16llu"
+		                " %6llu%%\n", stats.nr_allocs, stats.nr_frees,
+		                stats.bytes_requested, stats.bytes_allocated,
+		                stats.bytes_allocated ?
+		                100 - (stats.bytes_requested * 100) /
+		                      stats.bytes_allocated : 0);
+	}
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per NUMA node of the page allocator. */
+static long numastat_read(void *va, long n, int64_t off)
+{
+	size_t bufsz = numastat_len();
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+	struct page_node_stats stats;
+
+	len += snprintf(buf + len, bufsz - len,
+	                "%4s %16s %16s %16s %16s %16s %16s\n", "node",
+	                "free_pages", "local_allocs", "remote_allocs",
+	                "zero_pages", "zero_hits", "zero_misses");
+	for (int i = 0; i < nr_page_nodes; i++) {
+		page_alloc_get_node_stats(i, &stats);
+		len += snprintf(buf + len, bufsz - len,
+		                "%4d %16lu %16llu %16llu %16lu %16llu %16llu\n",
+		                i, stats.nr_free_pages, stats.nr_local_allocs,
+		                stats.nr_remote_allocs, stats.nr_zero_pages,
+		                stats.nr_zero_hits, stats.nr_zero_misses);
+	}
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per core, counting the kmsg IPIs it sent and the ones it didn't need
+ * to, since the destination already had one coming. */
+static long kmsgstat_read(void *va, long n, int64_t off)
+{
+	size_t bufsz = kmsgstat_len();
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+
+	len += snprintf(buf + len, bufsz - len, "%4s %16s %16s\n", "core",
+	                "ipis_sent", "ipis_avoided");
+	for (int i = 0; i < num_cores; i++)
+		len += snprintf(buf + len, bufsz - len, "%4d %16lu %16lu\n", i,
+		                per_cpu_info[i].nr_kmsg_ipis,
+		                per_cpu_info[i].nr_kmsg_ipis_avoided);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per core, counting the vcore and SCP FPU saves it did, the ones it
+ * skipped since the state was untouched, and the bytes of state it saved. */
+static long fpstat_read(void *va, long n, int64_t off)
+{
+	size_t bufsz = fpstat_len();
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+
+	len += snprintf(buf + len, bufsz - len, "%4s %16s %16s %16s\n", "core",
+	                "saves", "skipped", "bytes_saved");
+	for (int i = 0; i < num_cores; i++)
+		len += snprintf(buf + len, bufsz - len, "%4d %16lu %16lu %16llu\n", i,
+		                per_cpu_info[i].nr_fp_saves,
+		                per_cpu_info[i].nr_fp_saves_skipped,
+		                per_cpu_info[i].fp_bytes_saved);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per core.  Sample twice to get the stack alloc rate; allocs that
+ * weren't cache_hits went to the page allocator. */
+static long kstackstat_read(void *va, long n, int64_t off)
+{
+	size_t bufsz = kstackstat_len();
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+	struct kstack_stats stats;
+
+	len += snprintf(buf + len, bufsz - len, "%4s %16s %16s %16s %6s\n", "core",
+	                "allocs", "cache_hits", "frees", "cached");
+	for (int i = 0; i < num_cores; i++) {
+		kstack_get_stats(i, &stats);
+		len += snprintf(buf + len, bufsz - len, "%4d %16llu %16llu %16llu"
+		                " %6u\n", i, stats.nr_allocs, stats.nr_cache_hits,
+		                stats.nr_frees, stats.nr_cached);
+	}
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per workqueue.  Delays are from queue_work() until the work starts
+ * running, in usec.  coalesced counts queueing of already-pending work. */
+static long wqstat_read(void *va, long n, int64_t off)
+{
+	struct wq_stats *stats, *st;
+	size_t nr_wqs = workqueue_get_stats(&stats);
+	size_t bufsz = 128 * (nr_wqs + 1);
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+
+	len += snprintf(buf + len, bufsz - len, "%-16s %5s %12s %12s %12s %12s"
+	                " %12s\n", "name", "flags", "queued", "coalesced", "runs",
+	                "avg_delay", "max_delay");
+	for (int i = 0; i < nr_wqs; i++) {
+		st = &stats[i];
+		len += snprintf(buf + len, bufsz - len, "%-16.16s %5x %12llu %12llu"
+		                " %12llu %12llu %12llu\n", st->name, st->flags,
+		                st->nr_queued, st->nr_coalesced, st->nr_run,
+		                st->nr_run ? tsc2usec(st->total_delay / st->nr_run) : 0,
+		                tsc2usec(st->max_delay));
+	}
+	kfree(stats);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per DMA pool.  Allocs that weren't cache_hits went to the pool's
+ * pages; in_use counts the blocks in the core caches too. */
+static long dmapoolstat_read(void *va, long n, int64_t off)
+{
+	struct dma_pool_stats *stats, *st;
+	size_t nr_pools = dma_pool_get_stats(&stats);
+	size_t bufsz = 160 * (nr_pools + 1);
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+
+	len += snprintf(buf + len, bufsz - len, "%-16s %6s %6s %6s %8s %8s %12s"
+	                " %12s %12s\n", "name", "size", "pages", "remote", "in_use",
+	                "cached", "allocs", "cache_hits", "frees");
+	for (int i = 0; i < nr_pools; i++) {
+		st = &stats[i];
+		len += snprintf(buf + len, bufsz - len, "%-16.16s %6lu %6lu %6lu %8lu"
+		                " %8lu %12llu %12llu %12llu\n", st->name, st->size,
+		                st->nr_pages, st->nr_remote_pages, st->nr_in_use,
+		                st->nr_cached, st->nr_allocs, st->nr_cache_hits,
+		                st->nr_frees);
+	}
+	kfree(stats);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* Kernel memory by subsystem, then what each process has charged.  'charged'
+ * is the part of a subsystem's bytes that is charged to some process.  Page
+ * tables aren't charged; #proc/PID/kmem counts them. */
+static long kmemstat_read(void *va, long n, int64_t off)
+{
+	struct kmem_subsys_stats stats[KMEM_NR_SUBSYS];
+	long bytes[KMEM_NR_SUBSYS];
+	struct process_set pset;
+	struct proc *p;
+	size_t bufsz;
+	char *buf;
+	long total;
+	int len = 0;
+
+	kmem_get_subsys_stats(stats);
+	proc_get_set(&pset);
+	bufsz = 64 * (KMEM_NR_SUBSYS + 2) +
+	        (32 + 16 * KMEM_NR_SUBSYS) * (pset.num_processes + 1);
+	buf = kmalloc(bufsz, KMALLOC_WAIT);
+	len += snprintf(buf + len, bufsz - len, "%-8s %14s %14s\n", "subsys",
+	                "bytes", "charged");
+	for (int i = 0; i < KMEM_NR_SUBSYS; i++)
+		len += snprintf(buf + len, bufsz - len, "%-8s %14ld %14ld\n",
+		                kmem_subsys_names[i], stats[i].bytes,
+		                stats[i].charged);
+	len += snprintf(buf + len, bufsz - len, "\n%-6s %-16s", "pid", "name");
+	for (int i = 0; i < KMEM_NR_SUBSYS; i++)
+		len += snprintf(buf + len, bufsz - len, " %12s",
+		                kmem_subsys_names[i]);
+	len += snprintf(buf + len, bufsz - len, " %12s\n", "total");
+	for (int i = 0; i < pset.num_processes; i++) {
+		p = pset.procs[i];
+		kmem_acct_get_proc(p, bytes);
+		total = 0;
+		len += snprintf(buf + len, bufsz - len, "%-6d %-16.16s", p->pid,
+		                p->progname);
+		for (int j = 0; j < KMEM_NR_SUBSYS; j++) {
+			len += snprintf(buf + len, bufsz - len, " %12ld", bytes[j]);
+			total += bytes[j];
+		}
+		len += snprintf(buf + len, bufsz - len, " %12ld\n", total);
+	}
+	proc_free_set(&pset);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* Each node's free pages against its watermarks, what the reclaim ktask and
+ * failed allocations freed, and what each shrinker gave up.  'scanned' is in
+ * the shrinker's own units: pages for the page cache, none for slabs. */
+static long reclaimstat_read(void *va, long n, int64_t off)
+{
+	struct shrinker_stats *sstats;
+	struct reclaim_stats rstats;
+	struct page_node_stats nstats;
+	size_t nr_shrinkers = reclaim_get_shrinker_stats(&sstats);
+	size_t bufsz = 96 * (nr_page_nodes + nr_shrinkers + 8);
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	int len = 0;
+
+	len += snprintf(buf + len, bufsz - len, "%4s %12s %12s %12s %12s\n",
+	                "node", "pages", "free", "low", "high");
+	for (int i = 0; i < nr_page_nodes; i++) {
+		page_alloc_get_node_stats(i, &nstats);
+		len += snprintf(buf + len, bufsz - len, "%4d %12lu %12lu %12lu %12lu\n",
+		                i, nstats.nr_pages, nstats.nr_free_pages,
+		                nstats.wmark_low, nstats.wmark_high);
+	}
+	reclaim_get_stats(&rstats);
+	len += snprintf(buf + len, bufsz - len, "\n%-8s %12s %12s %12s\n", "",
+	                "wakeups", "passes", "freed");
+	len += snprintf(buf + len, bufsz - len, "%-8s %12llu %12llu %12llu\n",
+	                "ktask", rstats.nr_wakeups, rstats.nr_bg_passes,
+	                rstats.nr_bg_freed);
+	len += snprintf(buf + len, bufsz - len, "%-8s %12s %12llu %12llu\n",
+	                "direct", "-", rstats.nr_direct_passes,
+	                rstats.nr_direct_freed);
+	len += snprintf(buf + len, bufsz - len, "\n%-16s %12s %12s %12s\n",
+	                "shrinker", "calls", "scanned", "freed");
+	for (int i = 0; i < nr_shrinkers; i++)
+		len += snprintf(buf + len, bufsz - len,
+		                "%-16.16s %12llu %12llu %12llu\n", sstats[i].name,
+		                sstats[i].nr_calls, sstats[i].nr_scanned,
+		                sstats[i].nr_freed);
+	kfree(sstats);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+/* One row per lock call site, sorted by total wait time.  Times are in nsec.
+ * The wait histogram columns are contended acquisitions that waited fewer than
+ * that many cycles; the last one has the rest. */
+static long lockstat_read(void *va, long n, int64_t off)
+{
+#ifdef CONFIG_LOCK_STATS
+	struct lockstat_site *sites, *site;
+	size_t nr_sites = lockstat_snapshot(&sites);
+	size_t bufsz = 256 * (nr_sites + 2);
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+	char *func_name;
+	int len = 0;
+	uint64_t limit = LOCKSTAT_HIST_BASE;
+
+	len += snprintf(buf + len, bufsz - len, "lockstat is %s\n",
+	                lockstat_enabled ? "on" : "off");
+	len += snprintf(buf + len, bufsz - len, "%-32s %18s %12s %12s %14s %12s"
+	                " %14s %12s", "site", "lock", "acquires", "contended",
+	                "wait", "max_wait", "hold", "max_hold");
+	for (int i = 0; i < LOCKSTAT_NR_BUCKETS - 1; i++, limit <<= 2)
+		len += snprintf(buf + len, bufsz - len, " %9llu", limit);
+	len += snprintf(buf + len, bufsz - len, " %9s\n", "more");
+	for (int i = 0; i < nr_sites; i++) {
+		site = &sites[i];
+		func_name = get_fn_name(site->pc);
+		len += snprintf(buf + len, bufsz - len, "%-32.32s %18p %12llu %12llu"
+		                " %14llu %12llu %14llu %12llu",
+		                func_name ? func_name : "?", site->lock,
+		                site->nr_acquires, site->nr_contended,
+		                tsc2nsec(site->wait_tsc), tsc2nsec(site->max_wait_tsc),
+		                tsc2nsec(site->hold_tsc), tsc2nsec(site->max_hold_tsc));
+		kfree(func_name);
+		for (int j = 0; j < LOCKSTAT_NR_BUCKETS; j++)
+			len += snprintf(buf + len, bufsz - len, " %9llu",
+			                site->wait_hist[j]);
+		len += snprintf(buf + len, bufsz - len, "\n");
+	}
+	kfree(sites);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+#else
+	return readstr(off, va, n, "Kernel built without CONFIG_LOCK_STATS\n");
+#endif
+}
+
+/* One row per syscall that has run, with its latency percentiles. */
+static long sysclat_read(void *va, long n, int64_t off)
+{
+	size_t bufsz = (SYSC_LAT_MAX_SYSC + 1) * 96;
+	char *buf = kmalloc(bufsz, KMALLOC_WAIT);
+
+	sysc_lat_print(buf, bufsz);
+	n = readstr(off, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
 static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 {
 	uint64_t w, *bp;
@@ -415,6 +956,45 @@ static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 	case Kmpstatrawqid:
 		n = mpstatraw_read(va, n, offset);
 		break;
+	case Kkmallocstatqid:
+		n = kmallocstat_read(va, n, offset);
+		break;
+	case Knumastatqid:
+		n = numastat_read(va, n, offset);
+		break;
+	case Klockstatqid:
+		n = lockstat_read(va, n, offset);
+		break;
+	case Kkmsgstatqid:
+		n = kmsgstat_read(va, n, offset);
+		break;
+	case Kfpstatqid:
+		n = fpstat_read(va, n, offset);
+		break;
+	case Kkstackstatqid:
+		n = kstackstat_read(va, n, offset);
+		break;
+	case Kwqstatqid:
+		n = wqstat_read(va, n, offset);
+		break;
+	case Kdmapoolstatqid:
+		n = dmapoolstat_read(va, n, offset);
+		break;
+	case Kkmemstatqid:
+		n = kmemstat_read(va, n, offset);
+		break;
+	case Kreclaimstatqid:
+		n = reclaimstat_read(va, n, offset);
+		break;
+	case Ktraceqid:
+		n = tracepoint_read(va, n);
+		break;
+	case Ksystraceqid:
+		n = systrace_read(va, n);
+		break;
+	case Ksysclatqid:
+		n = sysclat_read(va, n, offset);
+		break;
 	default:
 		n = 0;
 		break;
@@ -433,6 +1013,14 @@ static void kprof_manage_timer(int coreid, struct cmdbuf *cb)
 	}
 }
 
+static void trace_usage_error(void)
+{
+	char buf[256];
+
+	tracepoint_status(buf, sizeof(buf));
+	error(EFAIL, "Bad trace option (on|off NAME|all, reset).  Have: %s", buf);
+}
+
 static long kprof_write(struct chan *c, void *a, long n, int64_t unused)
 {
 	ERRSTACK(1);
@@ -471,6 +1059,10 @@ static long kprof_write(struct chan *c, void *a, long n, int64_t unused)
 			kprof_flush_profiler();
 		} else if (!strcmp(cb->f[0], "stop")) {
 			kprof_stop_profiler();
+		} else if (!strcmp(cb->f[0], "compress")) {
+			if (cb->nf < 2)
+				error(EFAIL, "compress {on, off}");
+			kprof_set_compress(!strcmp(cb->f[1], "on"));
 		} else {
 			error(EFAIL, kprof_control_usage);
 		}
@@ -524,6 +1116,53 @@ static long kprof_write(struct chan *c, void *a, long n, int64_t unused)
 			error(EFAIL, "Bad mpstat option (reset|ipi|on|off)");
 		}
 		break;
+	case Kkmallocstatqid:
+		if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+			error(EFAIL, "Bad kmallocstat option (reset)");
+		kmalloc_reset_stats();
+		break;
+	case Kkstackstatqid:
+		if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+			error(EFAIL, "Bad kstackstat option (reset)");
+		kstack_reset_stats();
+		break;
+	case Klockstatqid:
+#ifdef CONFIG_LOCK_STATS
+		if (cb->nf < 1)
+			error(EFAIL, "Bad lockstat option (on|off|reset)");
+		if (!strcmp(cb->f[0], "on"))
+			lockstat_enable(TRUE);
+		else if (!strcmp(cb->f[0], "off"))
+			lockstat_enable(FALSE);
+		else if (!strcmp(cb->f[0], "reset"))
+			lockstat_reset();
+		else
+			error(EFAIL, "Bad lockstat option (on|off|reset)");
+#else
+		error(ENOSYS, "Kernel built without CONFIG_LOCK_STATS");
+#endif
+		break;
+	case Ksysclatqid:
+		if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+			error(EFAIL, "Bad sysclat option (reset)");
+		sysc_lat_reset();
+		break;
+	case Ksystraceqid:
+		if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+			error(EFAIL, "Bad systrace option (reset)");
+		systrace_clear_buffer();
+		break;
+	case Ktraceqid:
+		if (cb->nf == 1 && !strcmp(cb->f[0], "reset")) {
+			tracepoint_reset();
+		} else if (cb->nf == 2 && (!strcmp(cb->f[0], "on") ||
+		                           !strcmp(cb->f[0], "off"))) {
+			if (tracepoint_enable(cb->f[1], !strcmp(cb->f[0], "on")))
+				trace_usage_error();
+		} else {
+			trace_usage_error();
+		}
+		break;
 	default:
 		error(EBADFD, ERROR_FIXME);
 	}
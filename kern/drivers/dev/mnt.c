@@ -59,8 +59,14 @@ static char *devname(void)
  * connection.
  */
 
-#define MAXRPC (IOHDRSZ+8192)
+/* Largest msize we ask for; the server can negotiate it down.  RPC buffers
+ * start at MNT_RPC_BUFSZ and only grow for requests that carry more data, like
+ * big Twrites.  Replies are read into blocks, not the RPC buffer. */
+#define MAXRPC (1024 * 1024)
+#define MNT_RPC_BUFSZ (IOHDRSZ + 8192)
 #define MAXTAG MAX_U16_POOL_SZ
+/* Most Treads or Twrites mntrdwr() has outstanding for one plain file */
+#define MNT_MAX_INFLIGHT 8
 
 static __inline int isxdigit(int c)
 {
@@ -90,6 +96,18 @@ struct mntrpc {
 	struct mntrpc *flushed;		/* message this one flushes */
 };
 
+/* Read-ahead for a plain file opened for reading, hung off c->aux.  When a
+ * read starts where the previous one ended, we send a Tread for the next chunk
+ * before returning, and the next read picks up its reply. */
+struct mntra {
+	qlock_t qlock;
+	int64_t next_off;			/* where a sequential read would start */
+	struct mntrpc *r;			/* read-ahead rpc, or NULL */
+	int64_t r_off;				/* file offset of r's unread data */
+	uint32_t r_len;				/* unread bytes, once r is ready */
+	bool ready;					/* r's reply is in and checked */
+};
+
 /* Our TRUNC and remove on close differ from 9ps, so we'll need to translate.
  * I got these flags from http://man.cat-v.org/plan_9/5/open */
 #define MNT_9P_OPEN_OTRUNC		0x10
@@ -118,12 +136,25 @@ void mntqrm(struct mnt *, struct mntrpc *);
 struct mntrpc *mntralloc(struct chan *, uint32_t);
 long mntrdwr(int unused_int, struct chan *, void *, long, int64_t);
 int mntrpcread(struct mnt *, struct mntrpc *);
+void mntsend(struct mnt *, struct mntrpc *);
+void mntwait(struct mnt *, struct mntrpc *);
+void __mountio(struct mnt *, struct mntrpc *, bool);
 void mountio(struct mnt *, struct mntrpc *);
 void mountmux(struct mnt *, struct mntrpc *);
 void mountrpc(struct mnt *, struct mntrpc *);
+void mntrpcchk(struct mnt *, struct mntrpc *);
+void mntdiscard(struct mnt *, struct mntrpc **, int);
+static long mntrdra(struct chan *, uint8_t *, long, int64_t);
+static void mntra_reset(struct chan *, bool);
 int rpcattn(void *);
 struct chan *mntchan(void);
 
+/* Servers send 0 for plain files, not our QTFILE */
+static bool mnt_plain_file(struct chan *c)
+{
+	return !(c->qid.type & (QTDIR | QTAPPEND | QTEXCL | QTMOUNT | QTAUTH));
+}
+
 void (*mntstats) (int unused_int, struct chan *, uint64_t, uint32_t);
 
 static void mntinit(void)
@@ -458,6 +489,8 @@ static struct walkqid *mntwalk(struct chan *c, struct chan *nc, char **name,
 		 * Therefore set type to -1 for now.  inferno was setting this to 0,
 		 * assuming it was devroot.  lining up with chanrelease and newchan */
 		nc->type = -1;
+		/* devclone() copied c's read-ahead, which isn't nc's */
+		nc->aux = NULL;
 		alloc = 1;
 	}
 	wq->clone = nc;
@@ -492,10 +525,13 @@ static struct walkqid *mntwalk(struct chan *c, struct chan *nc, char **name,
 		if (wq->clone != c) {
 			wq->clone->type = c->type;
 			wq->clone->mchan = c->mchan;
+			wq->clone->flag |= c->flag & CCACHE;
 			chan_incref(c->mchan);
 		}
-		if (r->reply.nwqid > 0)
+		if (r->reply.nwqid > 0) {
 			wq->clone->qid = r->reply.wqid[r->reply.nwqid - 1];
+			cqid(wq->clone);
+		}
 	}
 	wq->nqid = r->reply.nwqid;
 	for (i = 0; i < wq->nqid; i++)
@@ -513,9 +549,13 @@ static int mntstat(struct chan *c, uint8_t * dp, int n)
 	ERRSTACK(1);
 	struct mnt *m;
 	struct mntrpc *r;
+	int nc;
 
 	if (n < BIT16SZ)
 		error(EINVAL, ERROR_FIXME);
+	nc = cstat(c, dp, n);
+	if (nc)
+		return nc;
 	m = mntchk(c);
 	r = mntralloc(c, m->msize);
 	if (waserror()) {
@@ -535,6 +575,7 @@ static int mntstat(struct chan *c, uint8_t * dp, int n)
 		memmove(dp, r->reply.stat, n);
 		validstat(dp, n, 0);
 		mntdirfix(dp, c);
+		cstatupdate(c, dp, n);
 	}
 	poperror();
 	mntfree(r);
@@ -547,6 +588,7 @@ static struct chan *mntopencreate(int type, struct chan *c, char *name,
 	ERRSTACK(1);
 	struct mnt *m;
 	struct mntrpc *r;
+	struct mntra *ra;
 
 	m = mntchk(c);
 	r = mntralloc(c, m->msize);
@@ -577,6 +619,11 @@ static struct chan *mntopencreate(int type, struct chan *c, char *name,
 	poperror();
 	mntfree(r);
 
+	if (mnt_plain_file(c) && (c->mode & O_READ)) {
+		ra = kzmalloc(sizeof(struct mntra), KMALLOC_WAIT);
+		qlock_init(&ra->qlock);
+		c->aux = ra;
+	}
 	if (c->flag & CCACHE)
 		copen(c);
 
@@ -599,6 +646,7 @@ static void mntclunk(struct chan *c, int t)
 	struct mnt *m;
 	struct mntrpc *r;
 
+	mntra_reset(c, TRUE);
 	m = mntchk(c);
 	r = mntralloc(c, m->msize);
 	if (waserror()) {
@@ -675,6 +723,7 @@ static int mntwstat(struct chan *c, uint8_t * dp, int n)
 	r->request.fid = c->fid;
 	r->request.nstat = n;
 	r->request.stat = dp;
+	cstatdrop(c);
 	mountrpc(m, r);
 	poperror();
 	mntfree(r);
@@ -710,12 +759,12 @@ static long mntread(struct chan *c, void *buf, long n, int64_t off)
 			p += nc;
 			off += nc;
 		}
-		n = mntrdwr(Tread, c, p, n, off);
+		n = mntrdra(c, p, n, off);
 		cupdate(c, p, n, off);
 		return n + nc;
 	}
 
-	n = mntrdwr(Tread, c, buf, n, off);
+	n = mntrdra(c, buf, n, off);
 
 	if (isdir) {
 		for (e = &p[n]; p + BIT16SZ < e; p += dirlen) {
@@ -740,16 +789,25 @@ static long mntread(struct chan *c, void *buf, long n, int64_t off)
 
 static long mntwrite(struct chan *c, void *buf, long n, int64_t off)
 {
+	mntra_reset(c, FALSE);
 	return mntrdwr(Twrite, c, buf, n, off);
 }
 
+/* Splits the I/O into msize chunks.  For plain files, once the first chunk
+ * comes back full, we keep up to MNT_MAX_INFLIGHT chunks outstanding and
+ * collect the replies in order.  Anything else (directories, streams) is one
+ * rpc at a time, since where the next read starts depends on the reply. */
 long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
 {
 	ERRSTACK(1);
 	struct mnt *m;
-	struct mntrpc *r;			/* TO DO: volatile struct { Mntrpc *r; } r; */
+	struct mntrpc *rs[MNT_MAX_INFLIGHT];
+	struct mntrpc *r;
+	volatile int nr_rs = 0;
+	volatile int nr_done = 0;
 	char *uba;
-	int cache;
+	int cache, window;
+	bool short_io = FALSE;
 	uint32_t cnt, nr, nreq;
 
 	m = mntchk(c);
@@ -758,54 +816,176 @@ long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
 	cache = c->flag & CCACHE;
 	if (c->qid.type & QTDIR)
 		cache = 0;
+	window = 1;
+	if (waserror()) {
+		mntdiscard(m, rs + nr_done, nr_rs - nr_done);
+		nexterror();
+	}
 	for (;;) {
-		r = mntralloc(c, m->msize);
-		if (waserror()) {
+		nr_rs = 0;
+		nr_done = 0;
+		while (nr_rs < window && n > 0) {
+			nr = MIN(n, m->msize - IOHDRSZ);
+			r = mntralloc(c, m->msize);
+			r->request.type = type;
+			r->request.fid = c->fid;
+			r->request.offset = off;
+			r->request.data = uba;
+			r->request.count = nr;
+			rs[nr_rs++] = r;
+			mntsend(m, r);
+			off += nr;
+			uba += nr;
+			n -= nr;
+		}
+		for (; nr_done < nr_rs; nr_done++) {
+			r = rs[nr_done];
+			__mountio(m, r, TRUE);
+			/* Past a short reply, we only wait for the rest */
+			if (!short_io) {
+				mntrpcchk(m, r);
+				nreq = r->request.count;
+				nr = MIN(r->reply.count, nreq);
+				if (type == Tread)
+					r->b = bl2mem((uint8_t *) r->request.data, r->b, nr);
+				else if (cache)
+					cwrite(c, (uint8_t *) r->request.data, nr,
+					       r->request.offset);
+				cnt += nr;
+				short_io = nr != nreq;
+			}
 			mntfree(r);
-			nexterror();
 		}
-		r->request.type = type;
-		r->request.fid = c->fid;
-		r->request.offset = off;
-		r->request.data = uba;
-		nr = n;
-		if (nr > m->msize - IOHDRSZ)
-			nr = m->msize - IOHDRSZ;
-		r->request.count = nr;
-		mountrpc(m, r);
-		nreq = r->request.count;
-		nr = r->reply.count;
-		if (nr > nreq)
-			nr = nreq;
-
-		if (type == Tread)
-			r->b = bl2mem((uint8_t *) uba, r->b, nr);
-		else if (cache)
-			cwrite(c, (uint8_t *) uba, nr, off);
-
-		poperror();
-		mntfree(r);
-		off += nr;
-		uba += nr;
-		cnt += nr;
-		n -= nr;
-		if (nr != nreq || n == 0 /*|| current->killed */ )
+		if (short_io || n == 0 /*|| current->killed */ )
 			break;
+		if (mnt_plain_file(c))
+			window = MNT_MAX_INFLIGHT;
 	}
+	poperror();
 	return cnt;
 }
 
+/* Waits for and frees ra's rpc, if any.  Call with ra's qlock held. */
+static void mntra_drop(struct mnt *m, struct mntra *ra)
+{
+	if (!ra->r)
+		return;
+	mntdiscard(m, &ra->r, 1);
+	ra->r = NULL;
+}
+
+/* Copies up to n bytes of read-ahead into buf, returning how much we copied.
+ * A short read-ahead reply is dropped once its data is used up, so the caller
+ * asks the server again instead of trusting a stale EOF. */
+static long mntra_take(struct mnt *m, struct mntra *ra, uint8_t *buf, long n)
+{
+	struct mntrpc *r = ra->r;
+	uint32_t amt;
+
+	if (!ra->ready) {
+		__mountio(m, r, TRUE);
+		mntrpcchk(m, r);
+		ra->r_len = MIN(r->reply.count, r->request.count);
+		ra->ready = TRUE;
+	}
+	amt = MIN(n, ra->r_len);
+	r->b = bl2mem(buf, r->b, amt);
+	ra->r_off += amt;
+	ra->r_len -= amt;
+	if (!ra->r_len) {
+		mntfree(r);
+		ra->r = NULL;
+	}
+	return amt;
+}
+
+/* Sends a Tread for n bytes at off.  If that fails, we just don't read ahead. */
+static void mntra_start(struct mnt *m, struct chan *c, struct mntra *ra,
+                        long n, int64_t off)
+{
+	ERRSTACK(1);
+	struct mntrpc *r;
+
+	r = mntralloc(c, m->msize);
+	r->request.type = Tread;
+	r->request.fid = c->fid;
+	r->request.offset = off;
+	r->request.data = NULL;
+	r->request.count = MIN(n, m->msize - IOHDRSZ);
+	ra->r = r;
+	ra->r_off = off;
+	ra->ready = FALSE;
+	if (waserror()) {
+		mntra_drop(m, ra);
+		poperror();
+		return;
+	}
+	mntsend(m, r);
+	poperror();
+}
+
+/* Reads through c's read-ahead, if it has one */
+static long mntrdra(struct chan *c, uint8_t *buf, long n, int64_t off)
+{
+	ERRSTACK(1);
+	struct mntra *ra = c->aux;
+	struct mnt *m;
+	long got = 0;
+
+	if (!ra)
+		return mntrdwr(Tread, c, buf, n, off);
+	m = mntchk(c);
+	qlock(&ra->qlock);
+	if (waserror()) {
+		mntra_drop(m, ra);
+		qunlock(&ra->qlock);
+		nexterror();
+	}
+	if (ra->r && ra->r_off != off)
+		mntra_drop(m, ra);
+	if (ra->r)
+		got = mntra_take(m, ra, buf, n);
+	if (got < n)
+		got += mntrdwr(Tread, c, buf + got, n - got, off + got);
+	if (off == ra->next_off && got == n && !ra->r)
+		mntra_start(m, c, ra, n, off + got);
+	ra->next_off = off + got;
+	poperror();
+	qunlock(&ra->qlock);
+	return got;
+}
+
+/* Drops the read-ahead, which writes could make stale, and frees it if
+ * release is set. */
+static void mntra_reset(struct chan *c, bool release)
+{
+	struct mntra *ra = c->aux;
+
+	if (!ra)
+		return;
+	qlock(&ra->qlock);
+	mntra_drop(mntchk(c), ra);
+	ra->next_off = -1;
+	qunlock(&ra->qlock);
+	if (release) {
+		c->aux = NULL;
+		kfree(ra);
+	}
+}
+
 void mountrpc(struct mnt *m, struct mntrpc *r)
+{
+	mountio(m, r);
+	mntrpcchk(m, r);
+}
+
+/* Throws if r's reply is an error or doesn't match its request */
+void mntrpcchk(struct mnt *m, struct mntrpc *r)
 {
 	char *sn, *cn;
 	int t;
 	char *e;
 
-	r->reply.tag = 0;
-	r->reply.type = Tmax;	/* can't ever be a valid message type */
-
-	mountio(m, r);
-
 	t = r->reply.type;
 	switch (t) {
 		case Rerror:
@@ -844,9 +1024,15 @@ void mountrpc(struct mnt *m, struct mntrpc *r)
 }
 
 void mountio(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, FALSE);
+}
+
+/* Sends r, unless the caller already did with mntsend(), and waits for its
+ * reply. */
+void __mountio(struct mnt *m, struct mntrpc *r, bool sent)
 {
 	ERRSTACK(1);
-	int n;
 
 	while (waserror()) {
 		if (m->rip == current)
@@ -861,9 +1047,26 @@ void mountio(struct mnt *m, struct mntrpc *r)
 			nexterror();
 		}
 		r = mntflushalloc(r, m->msize);
+		sent = FALSE;
 		/* need one for every waserror call (so this plus one outside) */
 		poperror();
 	}
+	if (!sent)
+		mntsend(m, r);
+	mntwait(m, r);
+	poperror();
+	mntflushfree(m, r);
+}
+
+/* Queues r on the mount and transmits its request.  The reply can come in any
+ * time after this; mntwait() collects it. */
+void mntsend(struct mnt *m, struct mntrpc *r)
+{
+	ERRSTACK(1);
+	int n;
+
+	r->reply.tag = 0;
+	r->reply.type = Tmax;	/* can't ever be a valid message type */
 
 	spin_lock(&m->lock);
 	r->m = m;
@@ -871,17 +1074,35 @@ void mountio(struct mnt *m, struct mntrpc *r)
 	m->queue = r;
 	spin_unlock(&m->lock);
 
+	if (waserror()) {
+		/* It never went out, so no reply is coming */
+		r->reply.type = Rflush;
+		mntqrm(m, r);
+		nexterror();
+	}
 	/* Transmit a file system rpc */
 	if (m->msize == 0)
 		panic("msize");
-	n = convS2M(&r->request, r->rpc, m->msize);
+	n = sizeS2M(&r->request);
+	if (n > r->rpclen && n <= m->msize) {
+		kfree(r->rpc);
+		r->rpc = kzmalloc(n, KMALLOC_WAIT);
+		r->rpclen = n;
+	}
+	n = convS2M(&r->request, r->rpc, r->rpclen);
 	if (n < 0)
-		panic("bad message type in mountio");
+		panic("bad message type in mntsend");
 	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n)
 		error(EIO, ERROR_FIXME);
 /*	r->stime = fastticks(NULL); */
 	r->reqlen = n;
+	poperror();
+}
 
+/* Waits until r is done.  Whoever gets through the gate reads replies off the
+ * connection and hands them to their rpcs, until its own comes in. */
+void mntwait(struct mnt *m, struct mntrpc *r)
+{
 	/* Gate readers onto the mount point one at a time */
 	for (;;) {
 		spin_lock(&m->lock);
@@ -889,11 +1110,8 @@ void mountio(struct mnt *m, struct mntrpc *r)
 			break;
 		spin_unlock(&m->lock);
 		rendez_sleep(&r->r, rpcattn, r);
-		if (r->done) {
-			poperror();
-			mntflushfree(m, r);
+		if (r->done)
 			return;
-		}
 	}
 	m->rip = current;
 	spin_unlock(&m->lock);
@@ -903,8 +1121,20 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		mountmux(m, r);
 	}
 	mntgate(m);
-	poperror();
-	mntflushfree(m, r);
+}
+
+/* Waits out and frees nr rpcs that were sent but whose replies we don't want,
+ * so their tags aren't reused while a reply could still come in. */
+void mntdiscard(struct mnt *m, struct mntrpc **rs, int nr)
+{
+	ERRSTACK(1);
+
+	for (int i = 0; i < nr; i++) {
+		if (!waserror())
+			__mountio(m, rs[i], TRUE);
+		poperror();
+		mntfree(rs[i]);
+	}
 }
 
 static int doread(struct mnt *m, int len)
@@ -1108,6 +1338,8 @@ struct mntrpc *mntralloc(struct chan *c, uint32_t msize)
 {
 	struct mntrpc *new;
 
+	/* mntsend() grows the buffer if a request needs more */
+	msize = MIN(msize, MNT_RPC_BUFSZ);
 	spin_lock(&mntalloc.l);
 	new = mntalloc.rpcfree;
 	if (new == NULL) {
@@ -55,6 +55,7 @@ struct Pipe {
 	uint32_t path;
 	struct queue *q[2];
 	int qref[2];
+	int qsize;					/* limit of each queue, set via ctl */
 	struct dirtab *pipedir;
 	char *user;
 	struct fdtap_slist data_taps[2];
@@ -71,13 +72,19 @@ enum {
 	Qdir,
 	Qdata0,
 	Qdata1,
+	Qctl,
 };
 
+/* Pipes can be resized up to this, e.g. by shell pipelines moving lots of data
+ * that want fewer context switches. */
+#define PIPE_MAX_QSIZE			(16 * 1024 * 1024)
+
 static
 struct dirtab pipedir[] = {
 	{".", {Qdir, 0, QTDIR}, 0, DMDIR | 0500},
 	{"data", {Qdata0}, 0, 0660},
 	{"data1", {Qdata1}, 0, 0660},
+	{"ctl", {Qctl}, 0, 0660},
 };
 
 static void freepipe(Pipe * p)
@@ -99,7 +106,7 @@ static void pipe_release(struct kref *kref)
 
 static void pipeinit(void)
 {
-	pipealloc.pipeqsize = 32 * 1024;
+	pipealloc.pipeqsize = 64 * 1024;
 }
 
 /*
@@ -127,10 +134,11 @@ static struct chan *pipeattach(char *spec)
 	kref_init(&p->ref, pipe_release, 1);
 	qlock_init(&p->qlock);
 
-	p->q[0] = qopen(pipealloc.pipeqsize, Qcoalesce, 0, 0);
+	p->qsize = pipealloc.pipeqsize;
+	p->q[0] = qopen(p->qsize, Qcoalesce, 0, 0);
 	if (p->q[0] == 0)
 		error(ENOMEM, ERROR_FIXME);
-	p->q[1] = qopen(pipealloc.pipeqsize, Qcoalesce, 0, 0);
+	p->q[1] = qopen(p->qsize, Qcoalesce, 0, 0);
 	if (p->q[1] == 0)
 		error(ENOMEM, ERROR_FIXME);
 	poperror();
@@ -235,6 +243,9 @@ static int pipestat(struct chan *c, uint8_t * db, int n)
 			devdir(c, c->qid, tab[2].name, qlen(p->q[1]), eve, tab[2].perm,
 				   &dir);
 			break;
+		case Qctl:
+			devdir(c, c->qid, tab[3].name, 0, eve, tab[3].perm, &dir);
+			break;
 		default:
 			panic("pipestat");
 	}
@@ -279,6 +290,9 @@ static struct chan *pipeopen(struct chan *c, int omode)
 			devpermcheck(p->user, p->pipedir[2].perm, omode);
 			p->qref[1]++;
 			break;
+		case Qctl:
+			devpermcheck(p->user, p->pipedir[3].perm, omode);
+			break;
 	}
 	poperror();
 	qunlock(&p->qlock);
@@ -334,9 +348,10 @@ static void pipeclose(struct chan *c)
 	kref_put(&p->ref);
 }
 
-static long piperead(struct chan *c, void *va, long n, int64_t ignored)
+static long piperead(struct chan *c, void *va, long n, int64_t offset)
 {
 	Pipe *p;
+	char buf[32];
 
 	p = c->aux;
 
@@ -348,6 +363,9 @@ static long piperead(struct chan *c, void *va, long n, int64_t ignored)
 			return qread(p->q[0], va, n);
 		case Qdata1:
 			return qread(p->q[1], va, n);
+		case Qctl:
+			snprintf(buf, sizeof(buf), "size %d\n", p->qsize);
+			return readstr(offset, va, n, buf);
 		default:
 			panic("piperead");
 	}
@@ -370,6 +388,79 @@ static struct block *pipebread(struct chan *c, long n, uint32_t offset)
 	return devbread(c, n, offset);
 }
 
+/* Resizes both of the pipe's queues.  Shrinking doesn't drop data; writers
+ * just block until the readers drain below the new size. */
+static void pipectl(Pipe *p, void *va, long n)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+	long size;
+
+	cb = parsecmd(va, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	if (cb->nf < 2 || strcmp(cb->f[0], "size"))
+		error(EINVAL, "usage: size BYTES");
+	size = strtol(cb->f[1], 0, 0);
+	if (size <= 0 || size > PIPE_MAX_QSIZE)
+		error(EINVAL, "pipe size must be between 1 and %d", PIPE_MAX_QSIZE);
+	size = ROUNDUP(size, PGSIZE);
+	qlock(&p->qlock);
+	p->qsize = size;
+	qsetlimit(p->q[0], size);
+	qsetlimit(p->q[1], size);
+	qunlock(&p->qlock);
+	poperror();
+	kfree(cb);
+}
+
+#ifdef CONFIG_BLOCK_EXTRAS
+/* Copies the writer's data into whole pages and queues blocks pointing at
+ * them, so the pipe holds page-granular buffers.  Readers that bread (e.g.
+ * sendfile to another pipe or a conversation) get the pages themselves, not a
+ * copy. */
+static long pipe_write_pages(struct queue *q, void *va, long n)
+{
+	struct block *b;
+	struct page *page;
+	long sofar = 0;
+	size_t amt;
+	int chunk;
+
+	do {
+		chunk = MIN(n - sofar, qiomaxatomic);
+		b = allocb(0);
+		block_add_extd(b, ROUNDUP(chunk, PGSIZE) / PGSIZE, KMALLOC_WAIT);
+		while (chunk) {
+			if (kpage_alloc(&page)) {
+				freeb(b);
+				error(ENOMEM, "out of pages for the pipe");
+			}
+			amt = MIN(chunk, PGSIZE);
+			memcpy(page2kva(page), va + sofar, amt);
+			block_append_page(b, page, 0, amt, page_decref, KMALLOC_WAIT);
+			chunk -= amt;
+			sofar += amt;
+		}
+		qbwrite(q, b);
+	} while (sofar < n);
+	return n;
+}
+#endif
+
+/* Writes that are at least a page get page-backed blocks, smaller ones get
+ * copied into the queue like always. */
+static long pipe_qwrite(struct queue *q, void *va, long n)
+{
+#ifdef CONFIG_BLOCK_EXTRAS
+	if (n >= PGSIZE)
+		return pipe_write_pages(q, va, n);
+#endif
+	return qwrite(q, va, n);
+}
+
 /*
  *  A write to a closed pipe causes an EPIPE error to be thrown.
  */
@@ -396,13 +487,19 @@ static long pipewrite(struct chan *c, void *va, long n, int64_t ignored)
 
 	switch (NETTYPE(c->qid.path)) {
 		case Qdata0:
-			n = qwrite(p->q[1], va, n);
+			n = pipe_qwrite(p->q[1], va, n);
 			break;
 
 		case Qdata1:
-			n = qwrite(p->q[0], va, n);
+			n = pipe_qwrite(p->q[0], va, n);
 			break;
 
+		case Qctl:
+			/* not a stream, so no EPIPE */
+			poperror();
+			pipectl(p, va, n);
+			return n;
+
 		default:
 			panic("pipewrite");
 	}
@@ -441,6 +538,10 @@ static long pipebwrite(struct chan *c, struct block *bp, uint32_t junk)
 			n = qbwrite(p->q[0], bp);
 			break;
 
+		case Qctl:
+			poperror();
+			return devbwrite(c, bp, junk);
+
 		default:
 			n = 0;
 			panic("pipebwrite");
@@ -457,7 +558,7 @@ static int pipewstat(struct chan *c, uint8_t *dp, int n)
 	Pipe *p;
 	int d1;
 
-	if (c->qid.type & QTDIR)
+	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) == Qctl)
 		error(EPERM, ERROR_FIXME);
 	p = c->aux;
 	if (strcmp(current->user, p->user) != 0)
@@ -540,6 +641,10 @@ static int pipetapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 				qio_set_wake_cb(p->q[which], 0, (void *)kludge);
 			ret = 0;
 			break;
+		case (FDTAP_CMD_MOD):
+			/* filter checked above; fdtap updates the tap */
+			ret = 0;
+			break;
 		default:
 			set_errno(ENOSYS);
 			set_errstr("Unsupported #%s data tap command %p", devname(), cmd);
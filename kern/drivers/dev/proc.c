@@ -30,6 +30,9 @@
 #include <pmap.h>
 #include <smp.h>
 #include <arch/vmm/vmm.h>
+#include <arch/perfmon.h>
+#include <arch/rdt.h>
+#include <kmem_acct.h>
 #include <ros/vmm.h>
 
 struct dev procdevtab;
@@ -59,6 +62,11 @@ enum {
 	Qstatus,
 	Qstrace,
 	Qvmstatus,
+	Qmmstat,
+	Qnsstat,
+	Qvcstat,
+	Qperf,
+	Qkmem,
 	Qtext,
 	Qwait,
 	Qprofile,
@@ -75,6 +83,8 @@ enum {
 	CMnohang,
 	CMnoswap,
 	CMpri,
+	CMshares,
+	CMdeadline,
 	CMprivate,
 	CMprofile,
 	CMstart,
@@ -88,9 +98,15 @@ enum {
 	CMvminit,
 	CMvmstart,
 	CMvmkill,
+	CMhaltpoll,
 	CMstraceme,
 	CMstraceall,
 	CMstraceoff,
+	CMstracefilter,
+	CMperfon,
+	CMperfoff,
+	CMcat,
+	CMmba,
 };
 
 enum {
@@ -122,6 +138,11 @@ struct dirtab procdir[] = {
 	{"status", {Qstatus}, STATSIZE, 0444},
 	{"strace", {Qstrace}, 0, 0666},
 	{"vmstatus", {Qvmstatus}, 0, 0444},
+	{"mmstat", {Qmmstat}, 0, 0444},
+	{"nsstat", {Qnsstat}, 0, 0444},
+	{"vcstat", {Qvcstat}, 0, 0444},
+	{"perf", {Qperf}, 0, 0444},
+	{"kmem", {Qkmem}, 0, 0444},
 	{"text", {Qtext}, 0, 0000},
 	{"wait", {Qwait}, 0, 0400},
 	{"profile", {Qprofile}, 0, 0400},
@@ -139,6 +160,8 @@ struct cmdtab proccmd[] = {
 	{CMnoswap, "noswap", 1},
 	{CMkill, "kill", 1},
 	{CMpri, "pri", 2},
+	{CMshares, "shares", 2},
+	{CMdeadline, "deadline", 2},
 	{CMprivate, "private", 1},
 	{CMprofile, "profile", 1},
 	{CMstart, "start", 1},
@@ -154,9 +177,15 @@ struct cmdtab proccmd[] = {
 	{CMvminit, "vminit", 0},
 	{CMvmstart, "vmstart", 0},
 	{CMvmkill, "vmkill", 0},
+	{CMhaltpoll, "haltpoll", 2},
 	{CMstraceme, "straceme", 0},
 	{CMstraceall, "straceall", 0},
 	{CMstraceoff, "straceoff", 0},
+	{CMstracefilter, "stracefilter", 0},
+	{CMperfon, "perfon", 0},
+	{CMperfoff, "perfoff", 1},
+	{CMcat, "cat", 2},
+	{CMmba, "mba", 2},
 };
 
 /*
@@ -539,6 +568,11 @@ static struct chan *procopen(struct chan *c, int omode)
 			break;
 		case Qstatus:
 		case Qvmstatus:
+		case Qmmstat:
+		case Qnsstat:
+		case Qvcstat:
+		case Qperf:
+		case Qkmem:
 		case Qctl:
 			break;
 
@@ -892,18 +926,36 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 
 		case Qvmstatus:
 			{
-				size_t buflen = 50 * 65 + 2;
+				/* Per guest pcore: each exit reason's count, and how many of
+				 * those went out to the VMM */
+				int nr_gpcs = p->vmm.nr_guest_pcores;
+				size_t buflen = (nr_gpcs + 1) * (80 * VMM_VMEXIT_NR_TYPES + 16);
 				char *buf = kmalloc(buflen, KMALLOC_WAIT);
+				struct guest_pcore *gpc;
 				int i, offset;
 				offset = 0;
 				offset += snprintf(buf + offset, buflen - offset, "{\n");
-				for (i = 0; i < 65; i++) {
-					if (p->vmm.vmexits[i] != 0) {
-						offset += snprintf(buf + offset, buflen - offset,
-						                   "\"%s\":\"%lld\",\n",
-						                   VMX_EXIT_REASON_NAMES[i],
-						                   p->vmm.vmexits[i]);
+				for (int g = 0; g < nr_gpcs; g++) {
+					gpc = lookup_guest_pcore(p, g);
+					if (!gpc)
+						continue;
+					offset += snprintf(buf + offset, buflen - offset,
+					                   "\"%d\":{\n", g);
+					for (i = 0; i < VMM_VMEXIT_NR_TYPES; i++) {
+						if (gpc->vmexits[i] != 0) {
+							offset += snprintf(buf + offset, buflen - offset,
+							                   "\"%s\":\"%lu/%lu\",\n",
+							                   VMX_EXIT_REASON_NAMES[i],
+							                   gpc->vmexits[i],
+							                   gpc->vmexits_reflected[i]);
+						}
 					}
+					offset += snprintf(buf + offset, buflen - offset,
+					                   "\"haltpoll\":\"%lu/%lu %lluus\",\n",
+					                   gpc->halt_poll_hits,
+					                   gpc->halt_poll_misses,
+					                   gpc->halt_poll_usec);
+					offset += snprintf(buf + offset, buflen - offset, "},\n");
 				}
 				offset += snprintf(buf + offset, buflen - offset, "}\n");
 				kref_put(&p->p_kref);
@@ -911,6 +963,151 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 				kfree(buf);
 				return n;
 			}
+		case Qmmstat:
+			{
+				char buf[256];
+
+				snprintf(buf, sizeof(buf),
+				         "tlb_shootdowns: %llu\ntlb_shootdown_ipis: %llu\n"
+				         "cow_shared: %llu\ncow_faults: %llu\n"
+				         "cow_copies: %llu\n",
+				         p->nr_tlb_shootdowns, p->nr_tlb_shootdown_ipis,
+				         p->nr_cow_shared, p->nr_cow_faults,
+				         p->nr_cow_copies);
+				kref_put(&p->p_kref);
+				return readstr(off, va, n, buf);
+			}
+		case Qkmem:
+			{
+				/* Bytes of kernel memory charged to p, by subsystem.  Page
+				 * tables are counted from p's page table, and kthread stacks
+				 * aren't anyone's. */
+				char buf[KMEM_NR_SUBSYS * 32 + 32];
+				long bytes[KMEM_NR_SUBSYS];
+				long total = 0;
+				int len = 0;
+
+				kmem_acct_get_proc(p, bytes);
+				bytes[KMEM_PGTBL] = env_pagetable_bytes(p);
+				kref_put(&p->p_kref);
+				for (int i = 0; i < KMEM_NR_SUBSYS; i++) {
+					if (i == KMEM_KSTACK)
+						continue;
+					len += snprintf(buf + len, sizeof(buf) - len, "%s: %ld\n",
+					                kmem_subsys_names[i], bytes[i]);
+					total += bytes[i];
+				}
+				snprintf(buf + len, sizeof(buf) - len, "total: %ld\n", total);
+				return readstr(off, va, n, buf);
+			}
+		case Qnsstat:
+			{
+				char buf[160];
+				struct pgrp *pg = p->pgrp;
+
+				if (!pg) {
+					kref_put(&p->p_kref);
+					error(ESRCH, ERROR_FIXME);
+				}
+				snprintf(buf, sizeof(buf),
+				         "walks: %lu\nmount_crossings: %lu\n"
+				         "max_walk_crossings: %lu\nmount_heads: %lu\n",
+				         atomic_read(&pg->nr_walks),
+				         atomic_read(&pg->nr_mnt_crossings),
+				         pg->max_walk_crossings, pg->mnt_ht.nr_items);
+				kref_put(&p->p_kref);
+				return readstr(off, va, n, buf);
+			}
+		case Qvcstat:
+			{
+				/* One line per vcore that has ever run.  Unlocked, so a vcore
+				 * changing state while we look might be off by a bit. */
+				size_t buflen = (p->procinfo->max_vcores + 1) * 96;
+				char *buf = kmalloc(buflen, KMALLOC_WAIT);
+				struct vcore *vc;
+				struct vcore_stats *vcs;
+				uint64_t ticks;
+				int offset;
+
+				offset = snprintf(buf, buflen,
+				                  "vcore pcore runtime_usec preempts syscalls "
+				                  "page_faults notifs\n");
+				for (int i = 0; i < p->procinfo->max_vcores; i++) {
+					vc = &p->procinfo->vcoremap[i];
+					vcs = &p->vc_stats[i];
+					ticks = vc->total_ticks;
+					if (vc->valid)
+						ticks += read_tsc() - vc->resume_ticks;
+					if (!ticks && !vc->valid)
+						continue;
+					offset += snprintf(buf + offset, buflen - offset,
+					                   "%d %d %llu %u %llu %llu %llu\n", i,
+					                   vc->valid ? vc->pcoreid : -1,
+					                   tsc2usec(ticks), vc->nr_preempts_sent,
+					                   vcs->nr_syscalls, vcs->nr_page_faults,
+					                   vcs->nr_notifs);
+				}
+				kref_put(&p->p_kref);
+				n = readstr(off, va, n, buf);
+				kfree(buf);
+				return n;
+			}
+		case Qperf:
+			{
+				/* A total line, then one per vcore that has counted.  Each
+				 * event has its count and how long it was on a HW counter. */
+				struct perfmon_proc *pps;
+				struct perfmon_proc_vcore *pv, tot;
+				size_t buflen;
+				char *buf;
+				int offset;
+
+				if (waserror()) {
+					kref_put(&p->p_kref);
+					nexterror();
+				}
+				pps = perfmon_get_proc_status(p);
+				poperror();
+				kref_put(&p->p_kref);
+				buflen = (pps->nr_vcores + 2) * (24 + pps->nr_events * 48);
+				buf = kmalloc(buflen, KMALLOC_WAIT);
+				offset = snprintf(buf, buflen, "vcore enabled_usec");
+				for (int e = 0; e < pps->nr_events; e++)
+					offset += snprintf(buf + offset, buflen - offset,
+					                   " %#llx running_usec",
+					                   pps->events[e].event);
+				memset(&tot, 0, sizeof(tot));
+				for (int v = 0; v < pps->nr_vcores; v++) {
+					pv = &pps->vcores[v];
+					tot.enabled_ns += pv->enabled_ns;
+					for (int e = 0; e < pps->nr_events; e++) {
+						tot.values[e] += pv->values[e];
+						tot.running_ns[e] += pv->running_ns[e];
+					}
+				}
+				for (int v = -1; v < (int) pps->nr_vcores; v++) {
+					pv = v < 0 ? &tot : &pps->vcores[v];
+					if (v >= 0 && !pv->enabled_ns)
+						continue;
+					if (v < 0)
+						offset += snprintf(buf + offset, buflen - offset,
+						                   "\ntotal");
+					else
+						offset += snprintf(buf + offset, buflen - offset,
+						                   "\n%d", v);
+					offset += snprintf(buf + offset, buflen - offset, " %llu",
+					                   pv->enabled_ns / 1000);
+					for (int e = 0; e < pps->nr_events; e++)
+						offset += snprintf(buf + offset, buflen - offset,
+						                   " %llu %llu", pv->values[e],
+						                   pv->running_ns[e] / 1000);
+				}
+				snprintf(buf + offset, buflen - offset, "\n");
+				perfmon_free_proc_status(pps);
+				n = readstr(off, va, n, buf);
+				kfree(buf);
+				return n;
+			}
 		case Qns:
 			//qlock(&p->debug);
 			if (waserror()) {
@@ -964,7 +1161,7 @@ static void mntscan(struct mntwalk *mw, struct proc *p)
 	int best, i, last, nxt;
 
 	pg = p->pgrp;
-	rlock(&pg->ns);
+	brlock(&pg->ns);
 
 	nxt = 0;
 	best = (int)(~0U >> 1);	/* largest 2's complement int */
@@ -988,7 +1185,7 @@ static void mntscan(struct mntwalk *mw, struct proc *p)
 	if (nxt == 0)
 		mw->mh = 0;
 
-	runlock(&pg->ns);
+	brunlock(&pg->ns);
 }
 
 static long procwrite(struct chan *c, void *va, long n, int64_t off)
@@ -1232,6 +1429,40 @@ static void strace_release(struct kref *a)
 	kfree(strace);
 }
 
+/* stracefilter sysc N [N...] | pid N | lat USEC | clear */
+static void strace_set_filter(struct proc *p, struct cmdbuf *cb)
+{
+	static const char usage[] =
+		"stracefilter sysc N [N...] | pid N | lat USEC | clear";
+	struct strace *strace = p->strace;
+	unsigned long sc_num;
+
+	if (!strace)
+		error(EFAIL, "Not stracing, use straceme or straceall first");
+	if (cb->nf < 2)
+		error(EFAIL, usage);
+	if (!strcmp(cb->f[1], "clear")) {
+		strace->filter_sysc_on = FALSE;
+		CLR_BITMASK(strace->filter_sysc, STRACE_MAX_SYSC);
+		strace->filter_pid = 0;
+		strace->filter_lat_nsec = 0;
+	} else if (!strcmp(cb->f[1], "sysc") && cb->nf > 2) {
+		for (int i = 2; i < cb->nf; i++) {
+			sc_num = strtoul(cb->f[i], 0, 0);
+			if (sc_num >= STRACE_MAX_SYSC)
+				error(EINVAL, "Can't filter on syscall %lu", sc_num);
+			SET_BITMASK_BIT(strace->filter_sysc, sc_num);
+		}
+		strace->filter_sysc_on = TRUE;
+	} else if (!strcmp(cb->f[1], "pid") && cb->nf == 3) {
+		strace->filter_pid = strtoul(cb->f[2], 0, 0);
+	} else if (!strcmp(cb->f[1], "lat") && cb->nf == 3) {
+		strace->filter_lat_nsec = strtoul(cb->f[2], 0, 0) * 1000;
+	} else {
+		error(EFAIL, usage);
+	}
+}
+
 static void procctlreq(struct proc *p, char *va, int n)
 {
 	ERRSTACK(1);
@@ -1242,6 +1473,7 @@ static void procctlreq(struct proc *p, char *va, int n)
 	int64_t time;
 	char *e;
 	struct strace *strace;
+	uint64_t perf_events[MAX_PROC_PERF_EVENTS];
 
 	cb = parsecmd(va, n);
 	if (waserror()) {
@@ -1289,6 +1521,19 @@ static void procctlreq(struct proc *p, char *va, int n)
 	case CMtrace:
 		systrace_trace_pid(p);
 		break;
+	case CMpri:
+		/* Only some core allocators look at this */
+		p->ksched_data.core_prio = atoi(cb->f[1]);
+		break;
+	case CMshares:
+		if (atoi(cb->f[1]) <= 0)
+			error(EINVAL, "shares must be positive");
+		p->ksched_data.core_shares = atoi(cb->f[1]);
+		break;
+	case CMdeadline:
+		/* usec the MCP will wait for a core it asked for.  0 turns it off. */
+		p->ksched_data.core_deadline = strtoul(cb->f[1], NULL, 0);
+		break;
 	case CMclose:
 		procctlclosefiles(p, 0, atoi(cb->f[1]));
 		break;
@@ -1315,6 +1560,13 @@ static void procctlreq(struct proc *p, char *va, int n)
 		break;
 	case CMvminit:
 		break;
+	case CMhaltpoll:
+		/* Max halt poll window, in usec.  0 turns polling off. */
+		time = strtol(cb->f[1], 0, 0);
+		if (time < 0)
+			error(EINVAL, "Bad halt poll time %lld", time);
+		p->vmm.halt_poll_max_usec = time;
+		break;
 	case CMstraceme:
 		p->strace_on = TRUE;
 		p->strace_inherit = FALSE;
@@ -1327,6 +1579,28 @@ static void procctlreq(struct proc *p, char *va, int n)
 		p->strace_on = FALSE;
 		p->strace_inherit = FALSE;
 		break;
+	case CMstracefilter:
+		strace_set_filter(p, cb);
+		break;
+	case CMperfon:
+		/* perfon EVENT..., raw PMEV values for variable counters */
+		if (cb->nf < 2 || cb->nf > MAX_PROC_PERF_EVENTS + 1)
+			error(EINVAL, "usage: perfon EVENT...");
+		for (int i = 1; i < cb->nf; i++)
+			perf_events[i - 1] = strtoul(cb->f[i], NULL, 0);
+		perfmon_proc_open(p, perf_events, cb->nf - 1);
+		break;
+	case CMperfoff:
+		perfmon_proc_close(p);
+		break;
+	case CMcat:
+		/* cat MASK, contiguous L3 ways; 0 for all of them */
+		rdt_proc_set_cat(p, strtoul(cb->f[1], NULL, 16));
+		break;
+	case CMmba:
+		/* mba PERCENT of the memory bandwidth; 100 for no limit */
+		rdt_proc_set_mba(p, strtoul(cb->f[1], NULL, 0));
+		break;
 	}
 	poperror();
 	kfree(cb);
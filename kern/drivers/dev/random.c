@@ -20,10 +20,40 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <percpu.h>
+#include <time.h>
 #include <random/fortuna.h>
+#include <random/rijndael.h>
+#include <random/sha2.h>
 
 static qlock_t rl;
 
+/* urandom is a per-core AES-256 generator in counter mode, so readers on
+ * different cores never share a lock or a cache line.  Each one is rekeyed from
+ * its own output after every read, and reseeded from the Fortuna state every
+ * second or so (and before it hands out too many bytes on one seed). */
+enum {
+	URANDOM_KEY_SZ = 32,
+	URANDOM_BLOCK_SZ = 16,
+	URANDOM_RESEED_BYTES = 1 << 20,
+	URANDOM_RESEED_USEC = 1000000,
+	/* 64 bit words of hardware entropy mixed into Fortuna per random_read */
+	RANDOM_ARCH_WORDS = 4,
+};
+
+struct urandom_pcpu {
+	rijndaelCtx ciph;
+	uint8_t key[URANDOM_KEY_SZ];
+	uint8_t counter[URANDOM_BLOCK_SZ];
+	uint64_t nr_bytes;
+	uint64_t seed_tsc;
+	bool seeded;
+	bool busy;
+};
+
+static DEFINE_PERCPU(struct urandom_pcpu, urandom_pcpu);
+static uint64_t urandom_reseed_tsc;
+
 /*
  * Add entropy. This is not currently used but we might want to hook it into a
  * hardware entropy source.
@@ -50,6 +80,11 @@ void random_add(void *xp)
 uint32_t random_read(void *xp, uint32_t n)
 {
 	ERRSTACK(1);
+	uint64_t hw[RANDOM_ARCH_WORDS];
+	unsigned int nr_hw = 0;
+
+	while (nr_hw < RANDOM_ARCH_WORDS && arch_get_random_seed(&hw[nr_hw]))
+		nr_hw++;
 
 	qlock(&rl);
 
@@ -58,39 +93,108 @@ uint32_t random_read(void *xp, uint32_t n)
 		nexterror();
 	}
 
+	if (nr_hw)
+		fortuna_add_entropy((uint8_t*)hw, nr_hw * sizeof(uint64_t));
 	fortuna_get_bytes(n, xp);
 	qunlock(&rl);
+	memset(hw, 0, sizeof(hw));
 
 	poperror();
 
 	return n;
 }
 
+static void urandom_inc_counter(struct urandom_pcpu *up)
+{
+	for (int i = 0; i < URANDOM_BLOCK_SZ; i++) {
+		if (++up->counter[i])
+			break;
+	}
+}
+
+static void urandom_gen(struct urandom_pcpu *up, uint8_t *p, uint32_t n)
+{
+	uint8_t block[URANDOM_BLOCK_SZ];
+	uint32_t amt;
+
+	while (n) {
+		rijndael_encrypt(&up->ciph, (uint32_t*)up->counter, (uint32_t*)block);
+		urandom_inc_counter(up);
+		amt = MIN(n, URANDOM_BLOCK_SZ);
+		memcpy(p, block, amt);
+		p += amt;
+		n -= amt;
+	}
+	memset(block, 0, sizeof(block));
+}
+
+static void urandom_set_key(struct urandom_pcpu *up)
+{
+	aes_set_key(&up->ciph, up->key, URANDOM_KEY_SZ * 8, 1);
+}
+
+/* The new key is a hash of the old key and the seed, so a bad seed can't make
+ * things worse. */
+static void urandom_reseed(struct urandom_pcpu *up, uint8_t *seed)
+{
+	SHA256Ctx md;
+
+	SHA256_Init(&md);
+	SHA256_Update(&md, up->key, URANDOM_KEY_SZ);
+	SHA256_Update(&md, seed, URANDOM_KEY_SZ);
+	SHA256_Final(up->key, &md);
+	memset(&md, 0, sizeof(md));
+	urandom_set_key(up);
+	up->nr_bytes = 0;
+	up->seed_tsc = read_tsc();
+	up->seeded = TRUE;
+}
+
+static bool urandom_needs_seed(struct urandom_pcpu *up)
+{
+	return !up->seeded || (up->nr_bytes >= URANDOM_RESEED_BYTES) ||
+	       (read_tsc() - up->seed_tsc >= urandom_reseed_tsc);
+}
+
 /**
  * Fast random generator
  **/
 uint32_t urandom_read(void *xp, uint32_t n)
 {
-	uint64_t seed[16];
-	uint8_t *e, *p;
-	uint32_t x = 0;
-	uint64_t s0;
-	uint64_t s1;
+	struct urandom_pcpu *up;
+	uint8_t seed[URANDOM_KEY_SZ];
+	bool have_seed = FALSE;
+	int8_t irq_state = 0;
 
-	if (n <= sizeof(seed))
+	/* Seeding blocks on the Fortuna qlock, so do it before we grab our core's
+	 * generator.  We might not be on the same core afterwards; that's fine,
+	 * since any generator can use the seed. */
+	if (urandom_needs_seed(PERCPU_VARPTR(urandom_pcpu))) {
+		random_read(seed, sizeof(seed));
+		have_seed = TRUE;
+	}
+	/* The generator is busy if we interrupted someone on this core who was
+	 * using it.  Since it's used without blocking, nothing else can. */
+	disable_irqsave(&irq_state);
+	up = PERCPU_VARPTR(urandom_pcpu);
+	if (up->busy || (!up->seeded && !have_seed)) {
+		enable_irqsave(&irq_state);
+		memset(seed, 0, sizeof(seed));
 		return random_read(xp, n);
-	// The initial seed is from a good random pool.
-	random_read(seed, sizeof(seed));
-	p = xp;
-	for (e = p + n; p < e;) {
-		s0 = seed[x];
-		s1 = seed[x = (x + 1) & 15];
-		s1 ^= s1 << 31;
-		s1 ^= s1 >> 11;
-		s0 ^= s0 >> 30;
-		*p++ = (seed[x] = s0 ^ s1) * 1181783497276652981LL;
 	}
+	up->busy = TRUE;
+	enable_irqsave(&irq_state);
 
+	if (have_seed)
+		urandom_reseed(up, seed);
+	urandom_gen(up, xp, n);
+	/* Rekey, so the output we just gave out can't be recovered later. */
+	urandom_gen(up, up->key, URANDOM_KEY_SZ);
+	urandom_set_key(up);
+	up->nr_bytes += n;
+	cmb();
+	up->busy = FALSE;
+	memset(seed, 0, sizeof(seed));
 	return n;
 }
 
@@ -117,6 +221,7 @@ struct dirtab randomdir[] = {
 static void randominit(void)
 {
 	qlock_init(&rl);
+	urandom_reseed_tsc = usec2tsc(URANDOM_RESEED_USEC);
 }
 
 /*
@@ -46,15 +46,17 @@ enum{
 	Monitordirqid = 0,
 	Monitordataqid,
 	Monitorctlqid,
+	Kbenchqid,
 };
 
 struct dirtab regresstab[]={
 	{".",		{Monitordirqid, 0, QTDIR},0,	DMDIR|0550},
 	{"mondata",	{Monitordataqid},		0,	0600},
 	{"monctl",	{Monitorctlqid},		0,	0600},
+	{"kbench",	{Kbenchqid},		0,	0400},
 };
 
-static char *ctlcommands = "ktest";
+static char *ctlcommands = "ktest [SUITE], kbench";
 
 static struct chan*
 regressattach(char *spec)
@@ -126,6 +128,15 @@ regressread(struct chan *c, void *va, long n, int64_t off)
 		n = readstr(off, va, n, ctlcommands);
 		break;
 
+	case Kbenchqid: {
+		char *buf = kmalloc(KBENCH_RESULTS_SZ, KMALLOC_WAIT);
+
+		kbench_results(buf, KBENCH_RESULTS_SZ);
+		n = readstr(offset, va, n, buf);
+		kfree(buf);
+		break;
+	}
+
 	case Monitordataqid:
 		if (regress.monitor) {
 			printd("monitordataqid: regress.monitor %p len %p\n", regress.monitor, qlen(kprof.monitor));
@@ -158,8 +169,15 @@ regresswrite(struct chan *c, void *a, long n, int64_t unused)
 
 	switch((int)(c->qid.path)){
 	case Monitorctlqid:
-		if(strncmp(a, "ktest", 5) == 0){
-			run_registered_ktest_suites();
+		if (cb->nf >= 1 && !strcmp(cb->f[0], "ktest")) {
+			if (cb->nf == 1)
+				run_registered_ktest_suites();
+			else if (!run_named_ktest_suite(cb->f[1]))
+				error(ENOENT, "No ktest suite %s", cb->f[1]);
+		} else if (cb->nf >= 1 && !strcmp(cb->f[0], "kbench")) {
+			kbench_clear_results();
+			if (!run_named_ktest_suite("KBENCH"))
+				error(ENOENT, "Kernel built without CONFIG_KBENCH_KTESTS");
 		} else {
 			error(EFAIL, "regresswrite: only commands are %s", ctlcommands);
 		}
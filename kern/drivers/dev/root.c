@@ -489,4 +489,5 @@ struct dev rootdevtab __devtab = {
 	.wstat = rootwstat,
 	.power = devpower,
 	.chaninfo = devchaninfo,
+	.revalidate = devrevalidate,
 };
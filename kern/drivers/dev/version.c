@@ -151,4 +151,5 @@ struct dev verdevtab __devtab = {
 	.bwrite = devbwrite,
 	.remove = devremove,
 	.wstat = devwstat,
+	.revalidate = devrevalidate,
 };
@@ -52,8 +52,9 @@ static void bnx2x_add_all_napi(struct bnx2x *bp)
 
 static int bnx2x_calc_num_queues(struct bnx2x *bp)
 {
-	/* default is min(8, num_cores) in Linux.  we'll set it elsewhere */
-	int nq = bnx2x_num_queues ? : 8;
+	/* default is min(8, num_cores) in Linux.  We also can't have more than
+	 * devether's TX queues, and each queue gets its own core's IRQ. */
+	int nq = bnx2x_num_queues ? : MIN(num_cores, Maxqueues);
 
 	/* Reduce memory usage in kdump environment by using only one queue */
 	if (is_kdump_kernel())
@@ -389,8 +390,6 @@ static void bnx2x_tpa_start(struct bnx2x_fastpath *fp, uint16_t queue,
 			    uint16_t cons, uint16_t prod,
 			    struct eth_fast_path_rx_cqe *cqe)
 {
-panic("Not implemented");
-#if 0 // AKAROS_PORT
 	struct bnx2x *bp = fp->bp;
 	struct sw_rx_bd *cons_rx_buf = &fp->rx_buf_ring[cons];
 	struct sw_rx_bd *prod_rx_buf = &fp->rx_buf_ring[prod];
@@ -437,7 +436,8 @@ panic("Not implemented");
 	tpa_info->tpa_state = BNX2X_TPA_START;
 	tpa_info->len_on_bd = le16_to_cpu(cqe->len_on_bd);
 	tpa_info->placement_offset = cqe->placement_offset;
-	tpa_info->rxhash = bnx2x_get_rxhash(bp, cqe, &tpa_info->rxhash_type);
+	/* AKAROS_PORT: blocks don't carry a hash */
+	tpa_info->rxhash = 0;
 	if (fp->mode == TPA_MODE_GRO) {
 		uint16_t gro_size = le16_to_cpu(cqe->pkt_len_or_gro_seg_len);
 		tpa_info->full_page = SGE_PAGES / gro_size * gro_size;
@@ -449,7 +449,6 @@ panic("Not implemented");
 	DP(NETIF_MSG_RX_STATUS, "fp->tpa_queue_used = 0x%llx\n",
 	   fp->tpa_queue_used);
 #endif
-#endif
 }
 
 /* Timestamp option length allowed for TPA aggregation:
@@ -538,36 +537,30 @@ static int bnx2x_alloc_rx_sge(struct bnx2x *bp, struct bnx2x_fastpath *fp,
 	return 0;
 }
 
-static int bnx2x_fill_frag_skb(struct bnx2x *bp, struct bnx2x_fastpath *fp,
-			       struct bnx2x_agg_info *tpa_info,
-			       uint16_t pages,
-			       struct sk_buff *skb,
-			       struct eth_end_agg_rx_cqe *cqe,
-			       uint16_t cqe_idx)
+/* AKAROS_PORT: the SGE pages are attached to the block as extra data, without
+ * copying.  Each one goes back to the page allocator when the block (and any
+ * block GRO merged it into) is freed. */
+static void bnx2x_sge_page_put(struct page *page)
+{
+	free_cont_pages(page2kva(page), PAGES_PER_SGE_SHIFT);
+}
+
+static int bnx2x_fill_frag_block(struct bnx2x *bp, struct bnx2x_fastpath *fp,
+				 struct bnx2x_agg_info *tpa_info,
+				 uint16_t pages,
+				 struct block *block,
+				 struct eth_end_agg_rx_cqe *cqe,
+				 uint16_t cqe_idx)
 {
-panic("Not implemented");
-#if 0 // AKAROS_PORT
 	struct sw_rx_page *rx_pg, old_rx_pg;
 	uint32_t i, frag_len, frag_size;
-	int err, j, frag_id = 0;
+	int err, j;
 	uint16_t len_on_bd = tpa_info->len_on_bd;
-	uint16_t full_page = 0, gro_size = 0;
 
 	frag_size = le16_to_cpu(cqe->pkt_len) - len_on_bd;
 
-	if (fp->mode == TPA_MODE_GRO) {
-		gro_size = tpa_info->gro_size;
-		full_page = tpa_info->full_page;
-	}
-
-	/* This is needed in order to enable forwarding support */
-	if (frag_size)
-		bnx2x_set_gro_params(skb, tpa_info->parsing_flags, len_on_bd,
-				     le16_to_cpu(cqe->pkt_len),
-				     le16_to_cpu(cqe->num_of_coalesced_segs));
-
 #ifdef BNX2X_STOP_ON_ERROR
-	if (pages > MIN_T(uint32_t, 8, MAX_SKB_FRAGS) * SGE_PAGES) {
+	if (pages > 8 * SGE_PAGES) {
 		BNX2X_ERR("SGL length is too long: %d. CQE index is %d\n",
 			  pages, cqe_idx);
 		BNX2X_ERR("cqe->pkt_len = %d\n", cqe->pkt_len);
@@ -576,18 +569,13 @@ panic("Not implemented");
 	}
 #endif
 
-	/* Run through the SGL and compose the fragmented skb */
+	/* Run through the SGL and compose the fragmented block */
 	for (i = 0, j = 0; i < pages; i += PAGES_PER_SGE, j++) {
 		uint16_t sge_idx = RX_SGE(le16_to_cpu(cqe->sgl_or_raw_data.sgl[j]));
 
 		/* FW gives the indices of the SGE as if the ring is an array
 		   (meaning that "next" element will consume 2 indices) */
-		if (fp->mode == TPA_MODE_GRO)
-			frag_len = MIN_T(uint32_t, frag_size,
-					 (uint32_t)full_page);
-		else /* LRO */
-			frag_len = MIN_T(uint32_t, frag_size,
-					 (uint32_t)SGE_PAGES);
+		frag_len = MIN_T(uint32_t, frag_size, (uint32_t)SGE_PAGES);
 
 		rx_pg = &fp->rx_page_ring[sge_idx];
 		old_rx_pg = *rx_pg;
@@ -604,31 +592,17 @@ panic("Not implemented");
 		dma_unmap_page(&bp->pdev->dev,
 			       dma_unmap_addr(&old_rx_pg, mapping),
 			       SGE_PAGES, DMA_FROM_DEVICE);
-		/* Add one frag and update the appropriate fields in the skb */
-		if (fp->mode == TPA_MODE_LRO)
-			skb_fill_page_desc(skb, j, old_rx_pg.page, 0, frag_len);
-		else { /* GRO */
-			int rem;
-			int offset = 0;
-			for (rem = frag_len; rem > 0; rem -= gro_size) {
-				int len = rem > gro_size ? gro_size : rem;
-				skb_fill_page_desc(skb, frag_id++,
-						   old_rx_pg.page, offset, len);
-				if (offset)
-					page_incref(old_rx_pg.page);
-				offset += len;
-			}
+		if (block_append_page(block, old_rx_pg.page, 0, frag_len,
+				      bnx2x_sge_page_put, 0)) {
+			bnx2x_sge_page_put(old_rx_pg.page);
+			bnx2x_fp_qstats(bp, fp)->rx_skb_alloc_failed++;
+			return -ENOMEM;
 		}
 
-		skb->data_len += frag_len;
-		skb->truesize += SGE_PAGES;
-		skb->len += frag_len;
-
 		frag_size -= frag_len;
 	}
 
 	return 0;
-#endif
 }
 
 static void bnx2x_frag_free(const struct bnx2x_fastpath *fp, void *data)
@@ -721,13 +695,11 @@ static void bnx2x_tpa_stop(struct bnx2x *bp, struct bnx2x_fastpath *fp,
 			   struct eth_end_agg_rx_cqe *cqe,
 			   uint16_t cqe_idx)
 {
-panic("Not implemented");
-#if 0 // AKAROS_PORT
 	struct sw_rx_bd *rx_buf = &tpa_info->first_buf;
 	uint8_t pad = tpa_info->placement_offset;
 	uint16_t len = tpa_info->len_on_bd;
-	struct sk_buff *skb = NULL;
-	uint8_t *new_data, *data = rx_buf->data;
+	struct block *block;
+	uint8_t *data = rx_buf->data;
 	uint8_t old_tpa_state = tpa_info->tpa_state;
 
 	tpa_info->tpa_state = BNX2X_TPA_STOP;
@@ -738,59 +710,43 @@ panic("Not implemented");
 	if (old_tpa_state == BNX2X_TPA_ERROR)
 		goto drop;
 
-	/* Try to allocate the new data */
-	new_data = bnx2x_frag_alloc(fp, 0);
-	/* Unmap skb in the pool anyway, as we are going to change
-	   pool entry status to BNX2X_TPA_STOP even if new skb allocation
-	   fails. */
+	/* AKAROS_PORT: Linux builds the skb around the bin's buffer and puts a
+	 * new one in the bin.  We copy the first BD's worth (the headers and the
+	 * start of the payload) into the block and keep the buffer in the bin
+	 * for the next TPA_START, which maps it again. */
 	dma_unmap_single(&bp->pdev->dev, dma_unmap_addr(rx_buf, mapping),
 			 fp->rx_buf_size, DMA_FROM_DEVICE);
-	if (likely(new_data))
-		skb = build_skb(data, fp->rx_frag_size);
-
-	if (likely(skb)) {
 #ifdef BNX2X_STOP_ON_ERROR
-		if (pad + len > fp->rx_buf_size) {
-			BNX2X_ERR("skb_put is about to fail...  pad %d  len %d  rx_buf_size %d\n",
-				  pad, len, fp->rx_buf_size);
-			bnx2x_panic();
-			return;
-		}
+	if (pad + len > fp->rx_buf_size) {
+		BNX2X_ERR("block copy is about to fail...  pad %d  len %d  rx_buf_size %d\n",
+			  pad, len, fp->rx_buf_size);
+		bnx2x_panic();
+		return;
+	}
 #endif
+	block = iallocb(len);
+	if (unlikely(!block))
+		goto drop;
+	memcpy(block->wp, data + NET_SKB_PAD + pad, len);
+	block->wp += len;
 
-		skb_reserve(skb, pad + NET_SKB_PAD);
-		skb_put(skb, len);
-		skb_set_hash(skb, tpa_info->rxhash, tpa_info->rxhash_type);
-
-		skb->protocol = eth_type_trans(skb, bp->dev);
-		skb->ip_summed = CHECKSUM_UNNECESSARY;
-
-		if (!bnx2x_fill_frag_skb(bp, fp, tpa_info, pages,
-					 skb, cqe, cqe_idx)) {
-			if (tpa_info->parsing_flags & PARSING_FLAGS_VLAN)
-				__vlan_hwaccel_put_tag(skb,
-						       cpu_to_be16(ETH_P_8021Q),
-						       tpa_info->vlan_tag);
-			bnx2x_gro_receive(bp, fp, skb);
-		} else {
-			DP(NETIF_MSG_RX_STATUS,
-			   "Failed to allocate new pages - dropping packet!\n");
-			dev_kfree_skb_any(skb);
-		}
-
-		/* put new data in bin */
-		rx_buf->data = new_data;
-
+	if (bnx2x_fill_frag_block(bp, fp, tpa_info, pages, block, cqe,
+				  cqe_idx)) {
+		DP(NETIF_MSG_RX_STATUS,
+		   "Failed to allocate new pages - dropping packet!\n");
+		freeb(block);
 		return;
 	}
-	if (new_data)
-		bnx2x_frag_free(fp, new_data);
+	/* In LRO mode, the FW rewrites the IP and TCP headers (lengths and
+	 * checksums) to describe the whole aggregation. */
+	block->flag |= Bipck | Btcpck;
+	etheriq(bp->edev, block, TRUE);
+	return;
 drop:
 	/* drop the packet and keep the buffer in the bin */
 	DP(NETIF_MSG_RX_STATUS,
-	   "Failed to allocate or map a new skb - dropping packet!\n");
+	   "Failed to allocate or map a new block - dropping packet!\n");
 	bnx2x_fp_stats(bp, fp)->eth_q_stats.rx_skb_alloc_failed++;
-#endif
 }
 
 static int bnx2x_alloc_rx_data(struct bnx2x *bp, struct bnx2x_fastpath *fp,
@@ -1771,8 +1727,8 @@ static int bnx2x_req_msix_irqs(struct bnx2x *bp)
 		snprintf(fp->name, sizeof(fp->name), "%s-fp-%d",
 			 bp->dev->name, i);
 
-		rc = register_irq(bp->msix_table[offset].vector,
-				  bnx2x_msix_fp_int, fp, pci_to_tbdf(bp->pdev));
+		rc = etherqirq(bp->edev, i, bp->msix_table[offset].vector,
+			       bnx2x_msix_fp_int, fp, pci_to_tbdf(bp->pdev));
 		if (rc) {
 			BNX2X_ERR("request fp #%d irq (%d) failed  rc %d\n", i,
 			      bp->msix_table[offset].vector, rc);
@@ -3380,7 +3336,14 @@ static uint32_t bnx2x_xmit_type(struct bnx2x *bp, struct block *block)
 	__u8 prot = 0;
 	__be16 protocol;
 
-	/* TODO: AKAROS_PORT ask for checksums */
+	/* AKAROS_PORT: we only offload TCP/IPv4 checksums, and only on E1x
+	 * (see bnx2x_set_pbd_csum()).  Anything else gets summed now. */
+	if (!(block->flag & BCKSUM_FLAGS))
+		return XMIT_PLAIN;
+	if ((block->flag & Btcpck) && CHIP_IS_E1x(bp) &&
+	    nhgets(block->rp + 2 * Eaddrlen) == 0x0800)
+		return XMIT_CSUM_V4 | XMIT_CSUM_TCP;
+	ptclcsum_finalize(block, 0);
 	return XMIT_PLAIN;
 
 #if 0 // AKAROS_PORT
@@ -3641,7 +3604,20 @@ static uint8_t bnx2x_set_pbd_csum(struct bnx2x *bp, struct block *block,
 			     struct eth_tx_parse_bd_e1x *pbd,
 			     uint32_t xmit_type)
 {
-panic("Not implemented");
+	/* AKAROS_PORT: untagged TCP/IPv4 only; checksum_start is the TCP
+	 * header, and tcpcksum() left the pseudo-header sum in its checksum. */
+	uint8_t *tcp = block->rp + block->checksum_start;
+	uint8_t hlen = ETHERHDRSIZE >> 1;
+
+	pbd->global_data = cpu_to_le16(hlen);
+	pbd->ip_hlen_w = (block->checksum_start - ETHERHDRSIZE) >> 1;
+	hlen += pbd->ip_hlen_w;
+	hlen += ((tcp[12] >> 4) * 4) / 2;
+	pbd->total_hlen_w = cpu_to_le16(hlen);
+	hlen = hlen * 2;
+	pbd->tcp_pseudo_csum = cpu_to_le16(nhgets(tcp + 16));
+	return hlen;
+
 #if 0 // AKAROS_PORT
 	uint8_t hlen = (skb_network_header(skb) - skb->data) >> 1;
 
@@ -3816,7 +3792,6 @@ netdev_tx_t bnx2x_start_xmit(struct block *block,
 #endif
 
 	txq_index = txdata->txq_index;
-	assert(txq_index == 0);	// AKAROS_PORT til we get multi-queue working
 	assert(txdata == &bp->bnx2x_txq[txq_index]);
 
 	assert(!(txq_index >= MAX_ETH_TXQ_IDX(bp) + (CNIC_LOADED(bp) ? 1 : 0)));
@@ -4059,12 +4034,8 @@ netdev_tx_t bnx2x_start_xmit(struct block *block,
 		pbd_e1x = &txdata->tx_desc_ring[bd_prod].parse_bd_e1x;
 		memset(pbd_e1x, 0, sizeof(struct eth_tx_parse_bd_e1x));
 		/* Set PBD in checksum offload case */
-		if (xmit_type & XMIT_CSUM) {
-			panic("Not implemented");
-			#if 0 // AKAROS_PORT (xsum offload)
+		if (xmit_type & XMIT_CSUM)
 			hlen = bnx2x_set_pbd_csum(bp, block, pbd_e1x, xmit_type);
-			#endif
-		}
 
 		SET_FLAG(global_data,
 			 ETH_TX_PARSE_BD_E1X_ETH_ADDR_TYPE, mac_type);
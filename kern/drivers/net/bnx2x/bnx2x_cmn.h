@@ -1125,8 +1125,10 @@ static inline void bnx2x_init_txdata(struct bnx2x *bp,
 	/* Poke function - ghetto extern from bnx2x_dev.c */
 	extern void __bnx2x_tx_queue(void *txdata_arg);
 	poke_init(&txdata->poker, __bnx2x_tx_queue);
-	/* TODO: AKAROS_PORT multi queue: assign proper oq */
-	txdata->oq = bp->edev->oq;
+	/* AKAROS_PORT: the ETH queues drain devether's TX queues, one each.  The
+	 * others (e.g. FCoE) have no oq. */
+	txdata->oq = txq_index < bp->edev->nr_txq ? bp->edev->txq[txq_index]
+	                                          : NULL;
 
 	DP(NETIF_MSG_IFUP, "created tx data cid %d, txq %d\n",
 	   txdata->cid, txdata->txq_index);
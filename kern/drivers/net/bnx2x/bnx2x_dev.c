@@ -185,10 +185,8 @@ void __bnx2x_tx_queue(void *txdata_arg)
 	struct block *block;
 	struct queue *oq = txdata->oq;
 
-	/* TODO: avoid bugs til multi-queue is working */
-	assert(oq);
-	assert(txdata->txq_index == 0);
-
+	if (!oq)
+		return;
 	while ((block = qget(oq))) {
 		if ((bnx2x_start_xmit(block, txdata) != NETDEV_TX_OK)) {
 			/* all queue readers are sync'd by the poke, so we can putback
@@ -208,17 +206,19 @@ void __bnx2x_tx_queue(void *txdata_arg)
 	}
 }
 
-static void bnx2x_transmit(struct ether *edev)
+static void bnx2x_transmit_queue(struct ether *edev, int qno)
 {
 	struct bnx2x *ctlr = edev->ctlr;
-	struct bnx2x_fp_txdata *txdata;
-	/* TODO: determine the tx queue we're supposed to work on */
-	int txq_index = 0;
+	struct bnx2x_fp_txdata *txdata = &ctlr->bnx2x_txq[qno];
 
-	txdata = &ctlr->bnx2x_txq[txq_index];
 	poke(&txdata->poker, txdata);
 }
 
+static void bnx2x_transmit(struct ether *edev)
+{
+	bnx2x_transmit_queue(edev, 0);
+}
+
 /* Not mandatory.  Called to make sure there are free blocks available for
  * incoming packets */
 static void bnx2x_replenish(struct bnx2x *ctlr)
@@ -472,6 +472,7 @@ static int bnx2x_pnp(struct ether *edev)
 	 */
 	edev->attach = bnx2x_attach;
 	edev->transmit = bnx2x_transmit;
+	edev->transmit_queue = bnx2x_transmit_queue;
 	edev->ifstat = bnx2x_ifstat;
 	edev->ctl = bnx2x_ctl;
 	edev->shutdown = bnx2x_shutdown;
@@ -481,6 +482,10 @@ static int bnx2x_pnp(struct ether *edev)
 	edev->multicast = bnx2x_multicast;
 
 	bnx2x_reset(ctlr);
+	/* One fastpath per ETH queue, each with a TX ring, an RX ring and an
+	 * MSI-X vector.  The FW's RSS spreads flows over the RX rings. */
+	edev->nr_txq = BNX2X_NUM_ETH_QUEUES(ctlr);
+	edev->nr_rxq = BNX2X_NUM_ETH_QUEUES(ctlr);
 
 	return 0;
 }
@@ -12206,15 +12206,16 @@ static int bnx2x_init_bp(struct bnx2x *bp)
 	/* Reduce memory usage in kdump environment by disabling TPA */
 	bp->disable_tpa |= is_kdump_kernel();
 
-	// AKAROS_PORT disable TPA (TODO extra data)
-	bp->disable_tpa |= TRUE;
-
 	/* Set TPA flags */
 	if (bp->disable_tpa) {
 		bp->flags &= ~(TPA_ENABLE_FLAG | GRO_ENABLE_FLAG);
 		bp->dev->feat &= ~NETIF_F_LRO;
 	} else {
-		bp->flags |= (TPA_ENABLE_FLAG | GRO_ENABLE_FLAG);
+		/* AKAROS_PORT: LRO mode only.  FW GRO mode needs the stack to fix
+		 * up the headers (tcp_gro_complete()); in LRO mode the FW does, and
+		 * etheriq()'s GRO merges the aggregations further. */
+		bp->flags |= TPA_ENABLE_FLAG;
+		bp->flags &= ~GRO_ENABLE_FLAG;
 		bp->dev->feat |= NETIF_F_LRO;
 	}
 
@@ -12944,6 +12945,9 @@ static int bnx2x_init_dev(struct bnx2x *bp, struct pci_device *pdev,
 	/* AKAROS_PORT XME turn off all unsupported features */
 	dev->feat &= ~(NETF_LRO | NETF_TSO | NETF_SG | NETF_IPCK | NETF_UDPCK |
 	               NETF_TCPCK);
+	/* TCP/IPv4 checksums work through the E1x parsing BD */
+	if (CHIP_IS_E1x(bp))
+		dev->feat |= NETF_TCPCK;
 
 	/* Add Loopback capability to the device */
 	dev->hw_features |= NETIF_F_LOOPBACK;
@@ -292,6 +292,7 @@ struct ctlr {
 	int	tcr;			/* transmit configuration register */
 	int	rcr;			/* receive configuration register */
 	int	imr;
+	int	coalesce;		/* RX timer, usec; 0: interrupt per packet */
 
 	qlock_t	slock;			/* statistics */
 	Dtcc*	dtcc;
@@ -767,7 +768,7 @@ rtl8169init(struct ether* edev)
 	 * Tdu means the NIC ran out of descriptors to send, so it
 	 * doesn't really need to ever be on.
 	 */
-	csr32w(ctlr, Timerint, 0);
+	csr32w(ctlr, Timerint, ctlr->coalesce*Timerclk);
 	ctlr->imr = Serr|Timeout|Fovw|Punlc|Rdu|Ter|Rer|Rok;
 	csr16w(ctlr, Imr, ctlr->imr);
 
@@ -1037,6 +1038,51 @@ rtl8169receive(struct ether* edev)
 	ctlr->rdh = rdh;
 }
 
+/*
+ * RX interrupt moderation, done the way the BSD re driver does it: after
+ * an Rok interrupt, mask Rok and let the one-shot timer interrupt come
+ * back for the ring.  A timer tick that finds nothing new unmasks Rok.
+ * Only PCIe parts, whose timer counts a 125MHz clock.
+ */
+enum {
+	Timerclk	= 125,		/* Timerint ticks per usec */
+	Timermax	= 65,		/* usec */
+};
+
+static void
+rtl8169coalesce(struct ether* edev, int usec)
+{
+	struct ctlr *ctlr;
+
+	ctlr = edev->ctlr;
+	ilock(&ctlr->ilock);
+	ctlr->coalesce = MIN(usec, Timermax);
+	csr32w(ctlr, Timerint, ctlr->coalesce*Timerclk);
+	if(ctlr->coalesce == 0 && !(ctlr->imr & Rok)){
+		ctlr->imr |= Rok;
+		csr16w(ctlr, Imr, ctlr->imr);
+	}
+	iunlock(&ctlr->ilock);
+}
+
+static void
+rtl8169rxmod(struct ctlr* ctlr, int busy)
+{
+	ilock(&ctlr->ilock);
+	if(ctlr->coalesce == 0){
+		iunlock(&ctlr->ilock);
+		return;
+	}
+	if(busy){
+		ctlr->imr &= ~Rok;
+		csr32w(ctlr, Tctr, 1);		/* restart the one-shot */
+	}
+	else
+		ctlr->imr |= Rok;
+	csr16w(ctlr, Imr, ctlr->imr);
+	iunlock(&ctlr->ilock);
+}
+
 static void
 rtl8169interrupt(struct hw_trapframe *hw_tf, void *arg)
 {
@@ -1051,6 +1097,14 @@ rtl8169interrupt(struct hw_trapframe *hw_tf, void *arg)
 		csr16w(ctlr, Isr, isr);
 		if((isr & ctlr->imr) == 0)
 			break;
+		if(isr & Timeout){
+			/* Rok may be masked: the ring is ours to check */
+			rtl8169receive(edev);
+			rtl8169rxmod(ctlr, isr & Rok);
+			isr &= ~Timeout;
+		}
+		else if(isr & Rok)
+			rtl8169rxmod(ctlr, 1);
 		if(isr & (Fovw|Punlc|Rdu|Rer|Rok)){
 			rtl8169receive(edev);
 			if(!(isr & (Punlc|Rok)))
@@ -1221,6 +1275,8 @@ rtl8169pnp(struct ether* edev)
 	edev->attach = rtl8169attach;
 	edev->transmit = rtl8169transmit;
 	edev->ifstat = rtl8169ifstat;
+	if(ctlr->pcie)
+		edev->coalesce = rtl8169coalesce;
 
 	edev->arg = edev;
 	edev->promiscuous = rtl8169promiscuous;
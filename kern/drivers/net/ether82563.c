@@ -123,6 +123,15 @@ enum {
 	Reta = 0x5c00,	/* Redirection Table */
 	Rssrk = 0x5c80,	/* RSS Random Key */
 
+	/* MSI-X (82576 and later) */
+	Gpie = 0x1514,	/* General Purpose Interrupt Enable */
+	Eims = 0x1524,	/* Extended Interrupt Mask Set/Read */
+	Eimc = 0x1528,	/* Extended Interrupt Mask Clear */
+	Eiac = 0x152c,	/* Extended Interrupt Auto Clear */
+	Eiam = 0x1530,	/* Extended Interrupt Auto Mask */
+	Ivar = 0x1700,	/* Interrupt Vector Allocation */
+	Ivarmisc = 0x1740,	/* Ivar for causes other than queues */
+
 	/* Transmit */
 	Tctl = 0x0400,	/* Transmit Control */
 	Tipg = 0x0410,	/* Transmit IPG */
@@ -290,6 +299,25 @@ enum {							/* Icr, Ics, Ims, Imc */
 	Ack = 0x00020000,	/* Receive ACK frame */
 };
 
+enum {							/* Gpie */
+	Nsicr = 0x00000001,			/* Non-Selective Interrupt Clear on Read */
+	Msixmode = 0x00000010,	/* one vector per Ivar entry */
+	Eiame = 0x40000000,	/* Extended Interrupt Auto Mask Enable */
+	Pbasupport = 0x80000000,	/* MSI-X PBA support */
+};
+
+enum {							/* Ivar, Ivarmisc */
+	Ivarvalid = 0x80,
+};
+
+enum {							/* Mrqc */
+	MrqcRss = 0x00000002,		/* RSS over multiple queues */
+	MrqcTcpipv4 = 0x00010000,	/* hash fields */
+	MrqcIpv4 = 0x00020000,
+	MrqcIpv6 = 0x00100000,
+	MrqcTcpipv6 = 0x00200000,
+};
+
 enum {							/* Txcw */
 	TxcwFd = 0x00000020,		/* Full Duplex */
 	TxcwHd = 0x00000040,	/* Half Duplex */
@@ -427,11 +455,13 @@ enum {							/* Tdesc control */
 	PtypeIP = 0x02000000,	/* IP Packet Type (CD) */
 	Ifcs = 0x02000000,	/* Insert FCS (DD) */
 	Tse = 0x04000000,	/* TCP Segmentation Enable */
+	Ic = 0x04000000,	/* Insert Checksum (legacy) */
 	Rs = 0x08000000,	/* Report Status */
 	Rps = 0x10000000,	/* Report Status Sent */
 	Dext = 0x20000000,	/* Descriptor Extension */
 	Vle = 0x40000000,	/* VLAN Packet Enable */
 	Ide = 0x80000000,	/* Interrupt Delay Enable */
+	CsoSHIFT = 16,	/* Checksum Offset (legacy) */
 };
 
 enum {							/* Tdesc status */
@@ -441,6 +471,14 @@ enum {							/* Tdesc status */
 	Tu = 0x0008,	/* Transmit Underrun */
 	CssMASK = 0xFF00,	/* Checksum Start Field */
 	CssSHIFT = 8,
+	PoptsIxsm = 0x0100,	/* Insert IP Checksum (DD) */
+	PoptsTxsm = 0x0200,	/* Insert TCP/UDP Checksum (DD) */
+	HdrlenSHIFT = 8,	/* Header Length (CD) */
+	MssSHIFT = 16,	/* Maximum Segment Size (CD) */
+};
+
+enum {
+	Tdmaxlen = 8192,	/* most we put in one data descriptor */
 };
 
 struct flash {
@@ -505,6 +543,7 @@ enum {
 	 * 16 bytes long, so Nrd and Ntd must be multiples of 8.
 	 */
 	Ntd = 32,					/* power of two >= 8 */
+	Ntdbatch = 8,	/* Tds queued in a burst before we write Tdt anyway */
 	Nrd = 128,	/* power of two >= 8 */
 	Rbalign = 16,
 	Slop = 32,	/* for vlan headers, crcs, etc. */
@@ -577,6 +616,38 @@ static struct ctlrtype ctlrtab[Nctlrtype] = {
 	{i350, 9728, 1, "i350", F75 | F79phy | Fnofct},
 };
 
+/*
+ * One RX/TX queue pair.  Parts without MSI-X (or with too few vectors) run a
+ * single pair off the legacy interrupt; otherwise pair n has its own vector,
+ * 1 + n, and its own receive and transmit ktasks.
+ */
+struct rxq {
+	struct ctlr *ctlr;
+	int qno;
+	uint32_t eims;				/* Eims bit of our vector, 0 if legacy */
+	struct rendez rendez;
+	qlock_t lock;				/* rproc vs. busy pollers */
+	int polling;				/* busy pollers; RX irq stays masked */
+	int rim;
+	int rdfree;					/* rx descriptors awaiting packets */
+	struct rd *rdba;			/* receive descriptor base address */
+	struct block **rb;			/* receive buffers */
+	unsigned int rdh;			/* receive descriptor head */
+	unsigned int rdt;			/* receive descriptor tail */
+};
+
+struct txq {
+	struct ctlr *ctlr;
+	int qno;
+	uint32_t eims;
+	struct rendez rendez;
+	qlock_t lock;
+	struct td *tdba;			/* transmit descriptor base address */
+	struct block **tb;			/* transmit buffers */
+	int tdh;					/* transmit descriptor head */
+	int tdt;					/* transmit descriptor tail */
+};
+
 struct ctlr {
 	uintptr_t mmio_paddr;
 	struct pci_device *pcidev;
@@ -606,6 +677,7 @@ struct ctlr {
 	unsigned int lintr;
 	unsigned int rsleep;
 	unsigned int rintr;
+	unsigned int rpolled;
 	unsigned int txdw;
 	unsigned int tintr;
 	unsigned int ixsm;
@@ -616,23 +688,12 @@ struct ctlr {
 	uint8_t ra[Eaddrlen];		/* receive address */
 	uint32_t mta[128];			/* multicast table array */
 
-	struct rendez rrendez;
-	int rim;
-	int rdfree;					/* rx descriptors awaiting packets */
-	struct rd *rdba;			/* receive descriptor base address */
-	struct block **rb;			/* receive buffers */
-	unsigned int rdh;			/* receive descriptor head */
-	unsigned int rdt;			/* receive descriptor tail */
+	int nq;						/* RX/TX queue pairs in use */
+	struct rxq rxq[Maxqueues];
+	struct txq txq[Maxqueues];
 	int rdtr;					/* receive delay timer ring value */
 	int radv;					/* receive interrupt absolute delay timer */
 
-	struct rendez trendez;
-	qlock_t tlock;
-	struct td *tdba;			/* transmit descriptor base address */
-	struct block **tb;			/* transmit buffers */
-	int tdh;					/* transmit descriptor head */
-	int tdt;					/* transmit descriptor tail */
-
 	int fcrtl;
 	int fcrth;
 
@@ -650,6 +711,24 @@ static inline void csr32w(struct ctlr *c, uintptr_t reg, uint32_t val)
 	write_mmreg32((uintptr_t)(c->nic + (reg / 4)), val);
 }
 
+/*
+ * Queue n's copy of a queue 0 register.  The first four queues are 0x100
+ * apart; the 82576 and later put the rest at 0xc000 (rx) and 0xe000 (tx).
+ */
+static uintptr_t rxqreg(uintptr_t reg, int n)
+{
+	if (n < 4)
+		return reg + n * 0x100;
+	return 0xc000 + (reg - Rdbal) + n * 0x40;
+}
+
+static uintptr_t txqreg(uintptr_t reg, int n)
+{
+	if (n < 4)
+		return reg + n * 0x100;
+	return 0xe000 + (reg - Tdbal) + n * 0x40;
+}
+
 static struct ctlr *i82563ctlrhead;
 static struct ctlr *i82563ctlrtail;
 
@@ -791,6 +870,7 @@ static long i82563ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 
 	p = seprintf(p, e, "lintr: %ud %ud\n", ctlr->lintr, ctlr->lsleep);
 	p = seprintf(p, e, "rintr: %ud %ud\n", ctlr->rintr, ctlr->rsleep);
+	p = seprintf(p, e, "rpolled: %ud\n", ctlr->rpolled);
 	p = seprintf(p, e, "tintr: %ud %ud\n", ctlr->tintr, ctlr->txdw);
 	p = seprintf(p, e, "ixcs: %ud %ud %ud\n", ctlr->ixsm, ctlr->ipcs,
 				 ctlr->tcpcs);
@@ -884,6 +964,19 @@ static long i82563ctl(struct ether *edev, void *buf, long n)
 	return n;
 }
 
+/* Rdtr and Radv count 1.024us.  Rdtr restarts with every packet, so Radv
+ * bounds the hold-off under a steady stream. */
+static void i82563coalesce(struct ether *edev, int usec)
+{
+	struct ctlr *ctlr = edev->ctlr;
+	uint32_t v = MIN(usec * 1000 / 1024, 0xffff);
+
+	ctlr->rdtr = v;
+	ctlr->radv = v;
+	csr32w(ctlr, Rdtr, v);
+	csr32w(ctlr, Radv, v);
+}
+
 static void i82563promiscuous(void *arg, int on)
 {
 	int rctl;
@@ -989,11 +1082,38 @@ static void i82563im(struct ctlr *ctlr, int im)
 	spin_unlock_irqsave(&ctlr->imlock);
 }
 
-static void i82563txinit(struct ctlr *ctlr)
+static void i82563txqinit(struct txq *txq)
 {
-	int i, r, tctl;
+	struct ctlr *ctlr = txq->ctlr;
+	int i, r, n = txq->qno;
 	struct block *bp;
 
+	for (i = 0; i < Ntd; i++) {
+		bp = txq->tb[i];
+		if (bp != NULL) {
+			txq->tb[i] = NULL;
+			freeb(bp);
+		}
+	}
+	memset(txq->tdba, 0, Ntd * sizeof(struct td));
+	csr32w(ctlr, txqreg(Tdbal, n), paddr_low32(txq->tdba));
+	csr32w(ctlr, txqreg(Tdbah, n), paddr_high32(txq->tdba));
+	csr32w(ctlr, txqreg(Tdlen, n), Ntd * sizeof(struct td));
+	txq->tdh = PREV_RING(0, Ntd);
+	csr32w(ctlr, txqreg(Tdh, n), 0);
+	txq->tdt = 0;
+	csr32w(ctlr, txqreg(Tdt, n), 0);
+	r = csr32r(ctlr, txqreg(Txdctl, n)) & ~(WthreshMASK | PthreshMASK);
+	r |= 4 << WthreshSHIFT | 4 << PthreshSHIFT;
+	if (ctlrtab[ctlr->type].flag & F75)
+		r |= Qenable;
+	csr32w(ctlr, txqreg(Txdctl, n), r);
+}
+
+static void i82563txinit(struct ctlr *ctlr)
+{
+	int i, tctl;
+
 	/*
 	 * TODO(dcross): Figure out how to integrate this table driven
 	 * code into the stanza below.
@@ -1016,110 +1136,199 @@ static void i82563txinit(struct ctlr *ctlr)
 	}
 	csr32w(ctlr, Tctl, tctl);
 	csr32w(ctlr, Tipg, 6 << 20 | 8 << 10 | 8);	/* yb sez: 0x702008 */
-	for (i = 0; i < Ntd; i++) {
-		bp = ctlr->tb[i];
-		if (bp != NULL) {
-			ctlr->tb[i] = NULL;
-			freeb(bp);
-		}
-	}
-	memset(ctlr->tdba, 0, Ntd * sizeof(struct td));
-	csr32w(ctlr, Tdbal, paddr_low32(ctlr->tdba));
-	csr32w(ctlr, Tdbah, paddr_high32(ctlr->tdba));
-	csr32w(ctlr, Tdlen, Ntd * sizeof(struct td));
-	ctlr->tdh = PREV_RING(0, Ntd);
-	csr32w(ctlr, Tdh, 0);
-	ctlr->tdt = 0;
-	csr32w(ctlr, Tdt, 0);
+	for (i = 0; i < ctlr->nq; i++)
+		i82563txqinit(&ctlr->txq[i]);
 	csr32w(ctlr, Tidv, 0);	/* don't coalesce interrupts */
 	csr32w(ctlr, Tadv, 0);
-	r = csr32r(ctlr, Txdctl) & ~(WthreshMASK | PthreshMASK);
-	r |= 4 << WthreshSHIFT | 4 << PthreshSHIFT;
-	if (ctlrtab[ctlr->type].flag & F75)
-		r |= Qenable;
-	csr32w(ctlr, Txdctl, r);
 	csr32w(ctlr, Tctl, csr32r(ctlr, Tctl) | Ten);
 }
 
-static int i82563cleanup(struct ctlr *ctlr)
+static int i82563cleanup(struct txq *txq)
 {
 	struct block *bp;
 	int tdh, n;
 
-	tdh = ctlr->tdh;
-	while (ctlr->tdba[n = NEXT_RING(tdh, Ntd)].status & Tdd) {
+	tdh = txq->tdh;
+	while (txq->tdba[n = NEXT_RING(tdh, Ntd)].status & Tdd) {
 		tdh = n;
-		bp = ctlr->tb[tdh];
+		/* only a packet's last descriptor has its block */
+		bp = txq->tb[tdh];
 		if (bp != NULL) {
-			ctlr->tb[tdh] = NULL;
+			txq->tb[tdh] = NULL;
 			freeb(bp);
-		} else
-			iprint("82563 tx underrun!\n");
-		ctlr->tdba[tdh].status = 0;
+		}
+		txq->tdba[tdh].status = 0;
 	}
-	return ctlr->tdh = tdh;
+	return txq->tdh = tdh;
 }
 
-static void i82563transmit(struct ether *edev)
+/* Number of descriptors we can fill before the ring is full */
+static int i82563txfree(int tdh, int tdt)
+{
+	return (tdh - tdt - 1 + Ntd) % Ntd;
+}
+
+/* Descriptors needed for a TSO block: one context, then the data */
+static int i82563tsondesc(struct block *bp)
+{
+	return 1 + DIV_ROUND_UP(BLEN(bp), Tdmaxlen);
+}
+
+/*
+ * Queue a TSO super-segment: a context descriptor saying where the IP and
+ * TCP headers are and how to cut the payload, then the data.  The NIC fixes
+ * up each segment's IP length and both checksums, so it wants the IP length
+ * and checksum zeroed and the TCP checksum seeded with the pseudo-header sum
+ * without the length.  The block is linear and untagged; checksum_start is
+ * the TCP header.
+ */
+static int i82563tso(struct txq *txq, struct block *bp, int tdt)
+{
+	struct td *td;
+	int ipoff = ETHERHDRSIZE;
+	int tcpoff = bp->checksum_start;
+	int hdrlen = tcpoff + (bp->rp[tcpoff + 12] >> 4) * 4;
+	uint8_t *ip = bp->rp + ipoff;
+	uint32_t sum;
+	int off, len;
+
+	ip[2] = ip[3] = 0;
+	ip[10] = ip[11] = 0;
+	sum = ptclbsum(ip + 12, 8) + ip[9];
+	sum = (sum & 0xffff) + (sum >> 16);
+	hnputs(bp->rp + tcpoff + 16, sum);
+
+	td = &txq->tdba[tdt];
+	td->addr[0] = (tcpoff - 1) << 16 | (ipoff + 10) << 8 | ipoff;
+	td->addr[1] = (tcpoff + 16) << 8 | tcpoff;
+	td->control = Ide | Rs | Dext | Tse | PtypeIP | PtypeTCP | DtypeCD |
+	              (BLEN(bp) - hdrlen);
+	td->status = bp->mss << MssSHIFT | hdrlen << HdrlenSHIFT;
+	txq->tb[tdt] = NULL;
+	tdt = NEXT_RING(tdt, Ntd);
+
+	for (off = 0; off < BLEN(bp); off += len) {
+		len = MIN(BLEN(bp) - off, Tdmaxlen);
+		td = &txq->tdba[tdt];
+		td->addr[0] = paddr_low32(bp->rp + off);
+		td->addr[1] = paddr_high32(bp->rp + off);
+		td->control = Ide | Rs | Dext | Tse | Ifcs | DtypeDD | len;
+		td->status = PoptsIxsm | PoptsTxsm;
+		txq->tb[tdt] = NULL;
+		if (off + len == BLEN(bp)) {
+			td->control |= Teop;
+			txq->tb[tdt] = bp;
+		}
+		tdt = NEXT_RING(tdt, Ntd);
+	}
+	return tdt;
+}
+
+/* Ask for an interrupt once the ring drains */
+static void i82563txarm(struct txq *txq)
+{
+	txq->ctlr->txdw++;
+	if (txq->eims)
+		csr32w(txq->ctlr, Eims, txq->eims);
+	else
+		i82563im(txq->ctlr, Txdw);
+}
+
+/* Hands the Tds up to tdt to the NIC.  The tail write is the MMIO we try to do
+ * once per burst. */
+static void i82563txpost(struct txq *txq, int tdt)
+{
+	txq->tdt = tdt;
+	wmb_f();
+	csr32w(txq->ctlr, txqreg(Tdt, txq->qno), tdt);
+}
+
+static void i82563transmitq(struct ether *edev, int qno)
 {
 	struct td *td;
 	struct block *bp;
 	struct ctlr *ctlr;
+	struct txq *txq;
+	struct queue *q;
 	int tdh, tdt;
 
 	ctlr = edev->ctlr;
-	qlock(&ctlr->tlock);
+	txq = &ctlr->txq[qno];
+	q = edev->txq[qno];
+	qlock(&txq->lock);
 
 	/*
 	 * Free any completed packets
 	 */
-	tdh = i82563cleanup(ctlr);
+	tdh = i82563cleanup(txq);
 
 	/* if link down on 218, don't try since we need k1fix to run first */
 	if (!edev->link && ctlr->type == i218 && !ctlr->didk1fix) {
-		qunlock(&ctlr->tlock);
+		qunlock(&txq->lock);
 		return;
 	}
 
 	/*
 	 * Try to fill the ring back up.
 	 */
-	tdt = ctlr->tdt;
+	tdt = txq->tdt;
 	for (;;) {
+		/* on a long burst, let the NIC start on what we have */
+		if (((tdt - txq->tdt) & (Ntd - 1)) >= Ntdbatch)
+			i82563txpost(txq, tdt);
 		if (NEXT_RING(tdt, Ntd) == tdh) {	/* ring full? */
-			ctlr->txdw++;
-			i82563im(ctlr, Txdw);
+			i82563txarm(txq);
 			break;
 		}
-		bp = qget(edev->oq);
+		bp = qget(q);
 		if (bp == NULL)
 			break;
-		td = &ctlr->tdba[tdt];
+		if (bp->flag & Btso) {
+			if (i82563txfree(tdh, tdt) < i82563tsondesc(bp)) {
+				qputback(q, bp);
+				i82563txarm(txq);
+				break;
+			}
+			tdt = i82563tso(txq, bp, tdt);
+			continue;
+		}
+		td = &txq->tdba[tdt];
 		td->addr[0] = paddr_low32(bp->rp);
 		td->addr[1] = paddr_high32(bp->rp);
 		td->control = Ide | Rs | Ifcs | Teop | BLEN(bp);
-		ctlr->tb[tdt] = bp;
+		td->status = 0;
+		/* legacy descriptors can insert one checksum: sum from css to the
+		 * end, on top of the pseudo-header sum tcpcksum() left at cso */
+		if (bp->flag & (Btcpck | Budpck)) {
+			td->control |= Ic |
+			    (bp->checksum_start + bp->checksum_offset) << CsoSHIFT;
+			td->status = bp->checksum_start << CssSHIFT;
+		}
+		txq->tb[tdt] = bp;
 		tdt = NEXT_RING(tdt, Ntd);
 	}
-	if (ctlr->tdt != tdt) {
-		ctlr->tdt = tdt;
-		wmb_f();
-		csr32w(ctlr, Tdt, tdt);
-	}
+	if (txq->tdt != tdt)
+		i82563txpost(txq, tdt);
 	/* else may not be any new ones, but could be some still in flight */
-	qunlock(&ctlr->tlock);
+	qunlock(&txq->lock);
+}
+
+static void i82563transmit(struct ether *edev)
+{
+	i82563transmitq(edev, 0);
 }
 
-static void i82563replenish(struct ctlr *ctlr)
+static void i82563replenish(struct rxq *rxq)
 {
+	struct ctlr *ctlr = rxq->ctlr;
 	struct rd *rd;
 	int rdt;
 	struct block *bp;
 
-	rdt = ctlr->rdt;
-	while (NEXT_RING(rdt, Nrd) != ctlr->rdh) {
-		rd = &ctlr->rdba[rdt];
-		if (ctlr->rb[rdt] != NULL) {
+	rdt = rxq->rdt;
+	while (NEXT_RING(rdt, Nrd) != rxq->rdh) {
+		rd = &rxq->rdba[rdt];
+		if (rxq->rb[rdt] != NULL) {
 			printd("#l%d: 82563: rx overrun\n", ctlr->edev->ctlrno);
 			break;
 		}
@@ -1128,24 +1337,78 @@ static void i82563replenish(struct ctlr *ctlr)
 			warn_once("OOM, trying to survive");
 			break;
 		}
-		ctlr->rb[rdt] = bp;
+		rxq->rb[rdt] = bp;
 		rd->addr[0] = paddr_low32(bp->rp);
 		rd->addr[1] = paddr_high32(bp->rp);
 		rd->status = 0;
-		ctlr->rdfree++;
+		rxq->rdfree++;
 		rdt = NEXT_RING(rdt, Nrd);
 	}
-	if (ctlr->rdt != rdt) {
-		ctlr->rdt = rdt;
+	if (rxq->rdt != rdt) {
+		rxq->rdt = rdt;
 		wmb_f();
-		csr32w(ctlr, Rdt, rdt);
+		csr32w(ctlr, rxqreg(Rdt, rxq->qno), rdt);
 	}
 }
 
-static void i82563rxinit(struct ctlr *ctlr)
+static void i82563rxqinit(struct rxq *rxq)
 {
+	struct ctlr *ctlr = rxq->ctlr;
 	struct block *bp;
-	int i, r, rctl, type;
+	int i, r, n = rxq->qno;
+
+	csr32w(ctlr, rxqreg(Rdbal, n), paddr_low32(rxq->rdba));
+	csr32w(ctlr, rxqreg(Rdbah, n), paddr_high32(rxq->rdba));
+	csr32w(ctlr, rxqreg(Rdlen, n), Nrd * sizeof(struct rd));
+	rxq->rdh = rxq->rdt = 0;
+	csr32w(ctlr, rxqreg(Rdh, n), 0);
+	csr32w(ctlr, rxqreg(Rdt, n), 0);
+
+	for (i = 0; i < Nrd; i++) {
+		bp = rxq->rb[i];
+		if (bp != NULL) {
+			rxq->rb[i] = NULL;
+			freeb(bp);
+		}
+	}
+	i82563replenish(rxq);
+
+	if (ctlr->type == i82575 || ctlr->type == i82576 || ctlr->type == i210) {
+		/*
+		 * See comment in i82563rxinit for Qenable.
+		 * Could shuffle the code?
+		 */
+		r = csr32r(ctlr, rxqreg(Rxdctl, n)) & ~(WthreshMASK | PthreshMASK);
+		csr32w(ctlr, rxqreg(Rxdctl, n),
+		       r | 2 << WthreshSHIFT | 2 << PthreshSHIFT);
+	}
+}
+
+/*
+ * Spread received flows over the queues: hash IPv4/IPv6 addresses and TCP
+ * ports with the ether's Toeplitz key and index its redirection table with
+ * the low bits.  Both are byte arrays; the chip takes them four bytes to a
+ * register, lowest byte first.
+ */
+static void i82563rssinit(struct ctlr *ctlr)
+{
+	struct ether *edev = ctlr->edev;
+	uint8_t *k = edev->rss_key, *r = edev->rss_reta;
+	int i;
+
+	for (i = 0; i < Rsskeylen / 4; i++, k += 4)
+		csr32w(ctlr, Rssrk + i * 4,
+		       k[0] | k[1] << 8 | k[2] << 16 | k[3] << 24);
+	for (i = 0; i < Rssretalen / 4; i++, r += 4)
+		csr32w(ctlr, Reta + i * 4,
+		       r[0] | r[1] << 8 | r[2] << 16 | r[3] << 24);
+	csr32w(ctlr, Mrqc, MrqcRss | MrqcTcpipv4 | MrqcIpv4 | MrqcTcpipv6 |
+	       MrqcIpv6);
+}
+
+static void i82563rxinit(struct ctlr *ctlr)
+{
+	int i, n, rctl, type;
 
 	type = ctlr->type;
 
@@ -1159,7 +1422,8 @@ static void i82563rxinit(struct ctlr *ctlr)
 			csr32w(ctlr, Rctl, Lpe | Dpf | Bsize2048 | Bam | RdtmsHALF | Secrc);
 			if (ctlr->type != i82575)
 				i |= (Nrd / 2 >> 4) << 20;	/* RdmsHalf */
-			csr32w(ctlr, Srrctl, i | Dropen);
+			for (n = 0; n < ctlr->nq; n++)
+				csr32w(ctlr, rxqreg(Srrctl, n), i | Dropen);
 			csr32w(ctlr, Rmpl, ctlr->rbsz);
 			// csr32w(ctlr, Drxmxod, 0x7ff);
 		} else
@@ -1186,34 +1450,14 @@ static void i82563rxinit(struct ctlr *ctlr)
 	if (ctlrtab[ctlr->type].flag & Fert)
 		csr32w(ctlr, Ert, 1024 / 8);	/* early rx threshold */
 
-	csr32w(ctlr, Rdbal, paddr_low32(ctlr->rdba));
-	csr32w(ctlr, Rdbah, paddr_high32(ctlr->rdba));
-	csr32w(ctlr, Rdlen, Nrd * sizeof(struct rd));
-	ctlr->rdh = ctlr->rdt = 0;
-	csr32w(ctlr, Rdh, 0);
-	csr32w(ctlr, Rdt, 0);
-
-	/* to hell with interrupt moderation, we want low latency */
-	csr32w(ctlr, Rdtr, 0);
-	csr32w(ctlr, Radv, 0);
-
-	for (i = 0; i < Nrd; i++) {
-		bp = ctlr->rb[i];
-		if (bp != NULL) {
-			ctlr->rb[i] = NULL;
-			freeb(bp);
-		}
-	}
-	i82563replenish(ctlr);
+	for (n = 0; n < ctlr->nq; n++)
+		i82563rxqinit(&ctlr->rxq[n]);
+	if (ctlr->nq > 1)
+		i82563rssinit(ctlr);
 
-	if (type == i82575 || type == i82576 || type == i210) {
-		/*
-		 * See comment above for Qenable.
-		 * Could shuffle the code?
-		 */
-		r = csr32r(ctlr, Rxdctl) & ~(WthreshMASK | PthreshMASK);
-		csr32w(ctlr, Rxdctl, r | 2 << WthreshSHIFT | 2 << PthreshSHIFT);
-	}
+	/* no interrupt moderation unless someone asked for it; we want latency */
+	csr32w(ctlr, Rdtr, ctlr->rdtr);
+	csr32w(ctlr, Radv, ctlr->radv);
 
 	/*
 	 * Don't enable checksum offload.  In practice, it interferes with
@@ -1222,9 +1466,18 @@ static void i82563rxinit(struct ctlr *ctlr)
 	csr32w(ctlr, Rxcsum, 0);
 }
 
-static int i82563rim(void *ctlr)
+static int i82563rim(void *rxq)
 {
-	return ((struct ctlr *)ctlr)->rim != 0;
+	return ((struct rxq *)rxq)->rim != 0;
+}
+
+/* Unmask receive interrupts before going to sleep */
+static void i82563rxarm(struct rxq *rxq)
+{
+	if (rxq->eims)
+		csr32w(rxq->ctlr, Eims, rxq->eims);
+	else
+		i82563im(rxq->ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
 }
 
 /*
@@ -1260,73 +1513,129 @@ static void ckcksums(struct ctlr *ctlr, struct rd *rd, struct block *bp)
 	}
 }
 
-static void i82563rproc(void *arg)
+/* Passes up to budget received packets upstream.  Caller holds rxq->lock. */
+static int i82563rxdrain(struct rxq *rxq, int budget)
 {
+	struct ctlr *ctlr = rxq->ctlr;
+	struct ether *edev = ctlr->edev;
 	struct rd *rd;
 	struct block *bp;
-	struct ctlr *ctlr;
 	int rdh, rim, passed;
-	struct ether *edev;
 
-	edev = arg;
-	ctlr = edev->ctlr;
-	i82563rxinit(ctlr);
-	csr32w(ctlr, Rctl, csr32r(ctlr, Rctl) | Ren);
+	rdh = rxq->rdh;
+	passed = 0;
+	while (passed < budget) {
+		rim = rxq->rim;
+		rxq->rim = 0;
+		rd = &rxq->rdba[rdh];
+		if (!(rd->status & Rdd))
+			break;
 
-	/*
-	 * TODO(dcross): Work references to ctlrtab into this code.
-	 */
-	if (ctlr->type == i210)
-		csr32w(ctlr, Rxdctl, csr32r(ctlr, Rxdctl) | Qenable);
+		/*
+		 * Accept eop packets with no errors.
+		 */
+		bp = rxq->rb[rdh];
+		if ((rd->status & Reop) && rd->errors == 0) {
+			bp->wp += rd->length;
+			bp->lim = bp->wp;	/* lie like a dog. */
+			if (0)
+				ckcksums(ctlr, rd, bp);
+			etheriq(edev, bp, 1);	/* pass pkt upstream */
+			passed++;
+		} else {
+			if (rd->status & Reop && rd->errors)
+				printd("%s: input packet error %#ux\n",
+					   tname[ctlr->type], rd->errors);
+			freeb(bp);
+		}
+		rxq->rb[rdh] = NULL;
+
+		/* rd needs to be replenished to accept another pkt */
+		rd->status = 0;
+		rxq->rdfree--;
+		rxq->rdh = rdh = NEXT_RING(rdh, Nrd);
+		/*
+		 * if number of rds ready for packets is too low,
+		 * set up the unready ones.
+		 */
+		if (rxq->rdfree <= Nrd - 32 || (rim & Rxdmt0))
+			i82563replenish(rxq);
+	}
+	return passed;
+}
+
+static void i82563rproc(void *arg)
+{
+	struct ctlr *ctlr;
+	struct rxq *rxq;
+
+	rxq = arg;
+	ctlr = rxq->ctlr;
 
 	for (;;) {
-		i82563replenish(ctlr);
-		i82563im(ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
+		qlock(&rxq->lock);
+		i82563replenish(rxq);
+		/* A busy poller re-arms when it gives up */
+		if (!rxq->polling)
+			i82563rxarm(rxq);
+		qunlock(&rxq->lock);
 		ctlr->rsleep++;
-		rendez_sleep(&ctlr->rrendez, i82563rim, ctlr);
-
-		rdh = ctlr->rdh;
-		passed = 0;
-		for (;;) {
-			rim = ctlr->rim;
-			ctlr->rim = 0;
-			rd = &ctlr->rdba[rdh];
-			if (!(rd->status & Rdd))
-				break;
+		rendez_sleep(&rxq->rendez, i82563rim, rxq);
 
-			/*
-			 * Accept eop packets with no errors.
-			 */
-			bp = ctlr->rb[rdh];
-			if ((rd->status & Reop) && rd->errors == 0) {
-				bp->wp += rd->length;
-				bp->lim = bp->wp;	/* lie like a dog. */
-				if (0)
-					ckcksums(ctlr, rd, bp);
-				etheriq(edev, bp, 1);	/* pass pkt upstream */
-				passed++;
-			} else {
-				if (rd->status & Reop && rd->errors)
-					printd("%s: input packet error %#ux\n",
-						   tname[ctlr->type], rd->errors);
-				freeb(bp);
-			}
-			ctlr->rb[rdh] = NULL;
+		qlock(&rxq->lock);
+		i82563rxdrain(rxq, INT32_MAX);
+		qunlock(&rxq->lock);
+	}
+}
 
-			/* rd needs to be replenished to accept another pkt */
-			rd->status = 0;
-			ctlr->rdfree--;
-			ctlr->rdh = rdh = NEXT_RING(rdh, Nrd);
-			/*
-			 * if number of rds ready for packets is too low,
-			 * set up the unready ones.
-			 */
-			if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
-				i82563replenish(ctlr);
+/* Busy polling: while anyone polls, RX interrupts stay masked and the pollers
+ * drain the rings; the last one to leave re-arms them. */
+static void i82563busypoll(struct ether *edev, int on)
+{
+	struct ctlr *ctlr = edev->ctlr;
+	struct rxq *rxq;
+
+	for (int i = 0; i < ctlr->nq; i++) {
+		rxq = &ctlr->rxq[i];
+		qlock(&rxq->lock);
+		if (on) {
+			if (rxq->polling++ == 0) {
+				if (rxq->eims) {
+					csr32w(ctlr, Eimc, rxq->eims);
+				} else {
+					spin_lock_irqsave(&ctlr->imlock);
+					ctlr->im &= ~(Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
+					csr32w(ctlr, Imc, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
+					spin_unlock_irqsave(&ctlr->imlock);
+				}
+			}
+		} else if (--rxq->polling == 0) {
+			i82563replenish(rxq);
+			i82563rxarm(rxq);
 		}
+		qunlock(&rxq->lock);
 	}
 }
 
+static int i82563poll(struct ether *edev, int budget)
+{
+	struct ctlr *ctlr = edev->ctlr;
+	struct rxq *rxq;
+	int passed = 0;
+
+	for (int i = 0; i < ctlr->nq && passed < budget; i++) {
+		rxq = &ctlr->rxq[i];
+		/* The rproc is draining it already */
+		if (!canqlock(&rxq->lock))
+			continue;
+		passed += i82563rxdrain(rxq, budget - passed);
+		i82563replenish(rxq);
+		qunlock(&rxq->lock);
+	}
+	ctlr->rpolled += passed;
+	return passed;
+}
+
 static int i82563lim(void *ctlr)
 {
 	return ((struct ctlr *)ctlr)->lim != 0;
@@ -1564,14 +1873,12 @@ static int return0(void *unused_void_p)
 
 static void i82563tproc(void *v)
 {
-	struct ether *edev;
-	struct ctlr *ctlr;
+	struct txq *txq;
 
-	edev = v;
-	ctlr = edev->ctlr;
+	txq = v;
 	for (;;) {
-		rendez_sleep(&ctlr->trendez, return0, 0);
-		i82563transmit(edev);
+		rendez_sleep(&txq->rendez, return0, 0);
+		i82563transmitq(txq->ctlr->edev, txq->qno);
 	}
 }
 
@@ -1583,7 +1890,7 @@ static void restart(struct ctlr *ctlr)
 	if (0) {
 		static spinlock_t rstlock;
 
-		qlock(&ctlr->tlock);
+		qlock(&ctlr->txq[0].lock);
 		spin_lock_irqsave(&rstlock);
 		iprint("#l%d: resetting...", ctlr->edev->ctlrno);
 		i82563reset(ctlr);
@@ -1592,21 +1899,58 @@ static void restart(struct ctlr *ctlr)
 		i82563rxinit(ctlr);
 		csr32w(ctlr, Rctl, csr32r(ctlr, Rctl) | Ren);
 		spin_unlock_irqsave(&rstlock);
-		qunlock(&ctlr->tlock);
+		qunlock(&ctlr->txq[0].lock);
 		iprint("reset\n");
 	}
 }
 
 static void freemem(struct ctlr *ctlr)
 {
-	kfree(ctlr->tb);
-	ctlr->tb = NULL;
-	kfree(ctlr->rb);
-	ctlr->rb = NULL;
-	kfree(ctlr->tdba);
-	ctlr->tdba = NULL;
-	kfree(ctlr->rdba);
-	ctlr->rdba = NULL;
+	int i;
+
+	for (i = 0; i < ctlr->nq; i++) {
+		kfree(ctlr->txq[i].tb);
+		ctlr->txq[i].tb = NULL;
+		ctlr->txq[i].tdba = NULL;
+		kfree(ctlr->rxq[i].rb);
+		ctlr->rxq[i].rb = NULL;
+		ctlr->rxq[i].rdba = NULL;
+	}
+	kfree(ctlr->alloc);
+	ctlr->alloc = NULL;
+}
+
+/*
+ * MSI-X: each queue pair's rx and tx causes go to vector 1 + n, link changes
+ * and the rest to vector 0.  Vectors auto-clear and auto-mask when they fire;
+ * whoever services one writes its bit back to Eims.
+ */
+static void i82563msixinit(struct ctlr *ctlr)
+{
+	int n, idx, rxoff, txoff;
+	uint32_t ivar, eims = 1;
+
+	csr32w(ctlr, Gpie, Nsicr | Msixmode | Eiame | Pbasupport);
+	csr32w(ctlr, Ivarmisc, Ivarvalid << 8);
+	for (n = 0; n < ctlr->nq; n++) {
+		if (ctlr->type == i82576) {
+			idx = n & 7;
+			rxoff = (n & 8) << 1;
+		} else {
+			idx = n >> 1;
+			rxoff = (n & 1) << 4;
+		}
+		txoff = rxoff + 8;
+		ivar = csr32r(ctlr, Ivar + idx * 4);
+		ivar &= ~(0xff << rxoff | 0xff << txoff);
+		ivar |= ((1 + n) | Ivarvalid) << rxoff;
+		ivar |= ((1 + n) | Ivarvalid) << txoff;
+		csr32w(ctlr, Ivar + idx * 4, ivar);
+		eims |= ctlr->rxq[n].eims;
+	}
+	csr32w(ctlr, Eiac, eims);
+	csr32w(ctlr, Eiam, eims);
+	csr32w(ctlr, Eims, eims);
 }
 
 static void i82563attach(struct ether *edev)
@@ -1631,38 +1975,59 @@ static void i82563attach(struct ether *edev)
 		nexterror();
 	}
 
-	ctlr->alloc = kzmalloc(Nrd * sizeof(struct rd) +
-	                           Ntd * sizeof(struct td) + 255,
+	/* ring sizes are multiples of 256, so every ring stays aligned */
+	ctlr->alloc = kzmalloc(ctlr->nq * (Nrd * sizeof(struct rd) +
+	                                   Ntd * sizeof(struct td)) + 255,
 	                       KMALLOC_WAIT);
 	if (ctlr->alloc == NULL) {
 		qunlock(&ctlr->alock);
 		error(ENOMEM, "i82563attach: error allocating rx/tx rings");
 	}
-	ctlr->rdba = (struct rd *)ROUNDUP((uintptr_t)ctlr->alloc, 256);
-	ctlr->tdba = (struct td *)(ctlr->rdba + Nrd);
-	ctlr->rb = kzmalloc(Nrd * sizeof(struct block *), 0);
-	ctlr->tb = kzmalloc(Ntd * sizeof(struct block *), 0);
-	if (ctlr->rb == NULL || ctlr->tb == NULL) {
-		qunlock(&ctlr->alock);
-		error(ENOMEM, "i82563attach: error allocating rx/tx buffers");
+	ctlr->rxq[0].rdba = (struct rd *)ROUNDUP((uintptr_t)ctlr->alloc, 256);
+	for (i = 0; i < ctlr->nq; i++) {
+		if (i)
+			ctlr->rxq[i].rdba =
+			    (struct rd *)(ctlr->txq[i - 1].tdba + Ntd);
+		ctlr->txq[i].tdba = (struct td *)(ctlr->rxq[i].rdba + Nrd);
+		ctlr->rxq[i].rb = kzmalloc(Nrd * sizeof(struct block *), 0);
+		ctlr->txq[i].tb = kzmalloc(Ntd * sizeof(struct block *), 0);
+		if (ctlr->rxq[i].rb == NULL || ctlr->txq[i].tb == NULL) {
+			qunlock(&ctlr->alock);
+			error(ENOMEM, "i82563attach: error allocating rx/tx buffers");
+		}
 	}
 
 	ctlr->edev = edev;	/* point back to Ether* */
 	ctlr->attached = 1;
 
+	if (ctlr->nq > 1)
+		i82563msixinit(ctlr);
+
 	lname = kzmalloc(KNAMELEN, KMALLOC_WAIT);
 	snprintf(lname, KNAMELEN, "#l%dl", edev->ctlrno);
 	ktask(lname, i82563lproc, edev);
 
-	rname = kzmalloc(KNAMELEN, KMALLOC_WAIT);
-	snprintf(rname, KNAMELEN, "#l%dr", edev->ctlrno);
-	ktask(rname, i82563rproc, edev);
+	i82563rxinit(ctlr);
+	csr32w(ctlr, Rctl, csr32r(ctlr, Rctl) | Ren);
+	/*
+	 * TODO(dcross): Work references to ctlrtab into this code.
+	 * Only queue 0 is enabled out of reset on the others.
+	 */
+	for (i = 0; i < ctlr->nq; i++)
+		if (ctlr->type == i210 || i > 0)
+			csr32w(ctlr, rxqreg(Rxdctl, i),
+			       csr32r(ctlr, rxqreg(Rxdctl, i)) | Qenable);
+	i82563txinit(ctlr);
 
-	tname = kzmalloc(KNAMELEN, KMALLOC_WAIT);
-	snprintf(tname, KNAMELEN, "#l%dt", edev->ctlrno);
-	ktask(tname, i82563tproc, edev);
+	for (i = 0; i < ctlr->nq; i++) {
+		rname = kzmalloc(KNAMELEN, KMALLOC_WAIT);
+		snprintf(rname, KNAMELEN, "#l%dr%d", edev->ctlrno, i);
+		ktask(rname, i82563rproc, &ctlr->rxq[i]);
 
-	i82563txinit(ctlr);
+		tname = kzmalloc(KNAMELEN, KMALLOC_WAIT);
+		snprintf(tname, KNAMELEN, "#l%dt%d", edev->ctlrno, i);
+		ktask(tname, i82563tproc, &ctlr->txq[i]);
+	}
 
 	qunlock(&ctlr->alock);
 	poperror();
@@ -1691,15 +2056,15 @@ static void i82563interrupt(struct hw_trapframe *unused_hw_trapframe, void *arg)
 			ctlr->lintr++;
 		}
 		if (icr & (Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack)) {
-			ctlr->rim = icr & (Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
+			ctlr->rxq[0].rim = icr & (Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
 			im &= ~(Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
-			rendez_wakeup(&ctlr->rrendez);
+			rendez_wakeup(&ctlr->rxq[0].rendez);
 			ctlr->rintr++;
 		}
 		if (icr & Txdw) {
 			im &= ~Txdw;
 			ctlr->tintr++;
-			rendez_wakeup(&ctlr->trendez);
+			rendez_wakeup(&ctlr->txq[0].rendez);
 		}
 	}
 	ctlr->im = im;
@@ -1707,6 +2072,31 @@ static void i82563interrupt(struct hw_trapframe *unused_hw_trapframe, void *arg)
 	spin_unlock_irqsave(&ctlr->imlock);
 }
 
+/* MSI-X vector 0: link changes and other non-queue causes */
+static void i82563otherinterrupt(struct hw_trapframe *hw_tf, void *arg)
+{
+	struct ether *edev = arg;
+
+	i82563interrupt(hw_tf, edev);
+	csr32w(edev->ctlr, Eims, 1);
+}
+
+/*
+ * MSI-X vector 1 + n: queue pair n.  The vector is masked now; the rproc
+ * unmasks it when it goes back to sleep.  The tproc just has a look.
+ */
+static void i82563qinterrupt(struct hw_trapframe *unused_hw_trapframe,
+                             void *arg)
+{
+	struct rxq *rxq = arg;
+	struct ctlr *ctlr = rxq->ctlr;
+
+	rxq->rim = Rxt0;
+	ctlr->rintr++;
+	rendez_wakeup(&rxq->rendez);
+	rendez_wakeup(&ctlr->txq[rxq->qno].rendez);
+}
+
 /* assume misrouted interrupts and check all controllers */
 static void i82575interrupt(struct hw_trapframe *unused_hw_trapframe,
                             void *unused_arg)
@@ -1728,6 +2118,8 @@ static int i82563detach0(struct ctlr *ctlr)
 	 * the defaults for some internal registers.
 	 */
 	csr32w(ctlr, Imc, ~0);
+	if (ctlr->nq > 1)
+		csr32w(ctlr, Eimc, ~0);
 	csr32w(ctlr, Rctl, 0);
 	csr32w(ctlr, Tctl, 0);
 
@@ -2012,7 +2404,7 @@ macset:
 
 static void i82563pci(void)
 {
-	int type;
+	int i, type;
 	uintptr_t io;
 	void *mem;
 	struct pci_device *p;
@@ -2161,9 +2553,17 @@ static void i82563pci(void)
 		spinlock_init_irqsave(&ctlr->imlock);
 		rendez_init(&ctlr->lrendez);
 		qlock_init(&ctlr->slock);
-		rendez_init(&ctlr->rrendez);
-		rendez_init(&ctlr->trendez);
-		qlock_init(&ctlr->tlock);
+		for (i = 0; i < Maxqueues; i++) {
+			ctlr->rxq[i].ctlr = ctlr;
+			ctlr->rxq[i].qno = i;
+			rendez_init(&ctlr->rxq[i].rendez);
+			qlock_init(&ctlr->rxq[i].lock);
+			ctlr->txq[i].ctlr = ctlr;
+			ctlr->txq[i].qno = i;
+			rendez_init(&ctlr->txq[i].rendez);
+			qlock_init(&ctlr->txq[i].lock);
+		}
+		ctlr->nq = 1;
 
 		pci_set_bus_master(p);
 		if (i82563reset(ctlr)) {
@@ -2180,10 +2580,26 @@ static void i82563pci(void)
 	}
 }
 
+/* RSS queues we will use, if MSI-X gives us a vector for each */
+static int i82563maxq(struct ctlr *ctlr)
+{
+	switch (ctlr->type) {
+		case i210:
+			return 4;
+		case i82576:
+		case i82580:
+		case i350:
+			return 8;
+	}
+	return 1;
+}
+
 static int pnp(struct ether *edev, int type)
 {
 	struct ctlr *ctlr;
+	struct pci_device *pcidev;
 	static int done;
+	int i, nq;
 
 	if (!done) {
 		i82563pci();
@@ -2214,6 +2630,7 @@ static int pnp(struct ether *edev, int type)
 	edev->tbdf = pci_to_tbdf(ctlr->pcidev);
 	edev->mbps = 1000;
 	edev->maxmtu = ctlr->rbsz - ETHERHDRSIZE;
+	edev->feat = NETF_TSO | NETF_TCPCK | NETF_UDPCK;
 	memmove(edev->ea, ctlr->ra, Eaddrlen);
 
 	/*
@@ -2223,12 +2640,34 @@ static int pnp(struct ether *edev, int type)
 	edev->transmit = i82563transmit;
 	edev->ifstat = i82563ifstat;
 	edev->ctl = i82563ctl;
+	edev->poll = i82563poll;
+	edev->busypoll = i82563busypoll;
+	edev->coalesce = i82563coalesce;
 
 	edev->arg = edev;
 	edev->promiscuous = i82563promiscuous;
 	edev->shutdown = i82563shutdown;
 	edev->multicast = i82563multicast;
 
+	/*
+	 * Multiple queues need a vector each plus one for link changes.
+	 * MSI-X table entries are handed out in registration order, so the
+	 * "other" vector goes first.
+	 */
+	pcidev = ctlr->pcidev;
+	nq = MIN(MIN(i82563maxq(ctlr), num_cores), Maxqueues);
+	if (nq > 1 && pci_msix_init(pcidev) == 0 && pcidev->msix_nr_vec > nq) {
+		ctlr->nq = nq;
+		edev->nr_rxq = edev->nr_txq = nq;
+		edev->transmit_queue = i82563transmitq;
+		register_irq(edev->irq, i82563otherinterrupt, edev, edev->tbdf);
+		for (i = 0; i < nq; i++) {
+			ctlr->rxq[i].eims = ctlr->txq[i].eims = 1 << (1 + i);
+			etherqirq(edev, i, edev->irq, i82563qinterrupt, &ctlr->rxq[i],
+			          edev->tbdf);
+		}
+		return 0;
+	}
 	register_irq(edev->irq,
 	             ctlr->type == i82575 ? i82575interrupt : i82563interrupt,
 	             edev, edev->tbdf);
@@ -519,6 +519,7 @@ struct ctlr {
 	int	rdh;			/* receive descriptor head */
 	int	rdt;			/* receive descriptor tail */
 	int	rdtr;			/* receive delay timer ring value */
+	int	radv;			/* receive interrupt absolute delay */
 
 	spinlock_t	tlock;
 	int	tbusy;
@@ -527,6 +528,8 @@ struct ctlr {
 	struct block**	tb;			/* transmit buffers */
 	int	tdh;			/* transmit descriptor head */
 	int	tdt;			/* transmit descriptor tail */
+	int	txcss;			/* checksum context the NIC has, or -1 */
+	int	txcso;
 
 	int	txcw;
 	int	fcrtl;
@@ -684,6 +687,7 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 	l += snprintf(p+l, READSTR-l, "ixcs: %ud %ud %ud\n",
 		ctlr->ixsm, ctlr->ipcs, ctlr->tcpcs);
 	l += snprintf(p+l, READSTR-l, "rdtr: %ud\n", ctlr->rdtr);
+	l += snprintf(p+l, READSTR-l, "radv: %ud\n", ctlr->radv);
 	l += snprintf(p+l, READSTR-l, "Ctrlext: %08x\n", csr32r(ctlr, Ctrlext));
 
 	l += snprintf(p+l, READSTR-l, "eeprom:");
@@ -754,6 +758,42 @@ igbectl(struct ether* edev, void* buf, long n)
 	return n;
 }
 
+/* Parts with an absolute RX delay timer (Radv) to bound Rdtr's hold-off */
+static int
+igbehasradv(struct ctlr* ctlr)
+{
+	switch(ctlr->id){
+	case i82540em:
+	case i82540eplp:
+	case i82541gi:
+	case i82541gi2:
+	case i82541pi:
+	case i82545em:
+	case i82545gmc:
+	case i82546gb:
+	case i82546eb:
+	case i82547gi:
+		return 1;
+	}
+	return 0;
+}
+
+/* Both timers count 1.024us.  Rdtr restarts with every packet; where there is
+ * no Radv, a steady stream can hold it off for longer than usec. */
+static void
+igbecoalesce(struct ether* edev, int usec)
+{
+	struct ctlr *ctlr = edev->ctlr;
+	int v = MIN(usec * 1000 / 1024, 0xFFFF);
+
+	ctlr->rdtr = v;
+	csr32w(ctlr, Rdtr, Fpd|v);
+	if(igbehasradv(ctlr)){
+		ctlr->radv = v;
+		csr32w(ctlr, Radv, v);
+	}
+}
+
 static void
 igbepromiscuous(void* arg, int on)
 {
@@ -956,6 +996,7 @@ igbetxinit(struct ctlr* ctlr)
 		memset(&ctlr->tdba[i], 0, sizeof(Td));
 	}
 	ctlr->tdfree = ctlr->ntd;
+	ctlr->txcss = ctlr->txcso = -1;
 
 	csr32w(ctlr, Tidv, 128);
 	r = (4<<WthreshSHIFT)|(4<<HthreshSHIFT)|(8<<PthreshSHIFT);
@@ -988,13 +1029,51 @@ igbetxinit(struct ctlr* ctlr)
 	csr32w(ctlr, Tctl, r);
 }
 
+/* Number of descriptors we can fill before the ring is full */
+static int
+igbetdfree(struct ctlr* ctlr, int tdh, int tdt)
+{
+	return (tdh - tdt - 1 + ctlr->ntd) % ctlr->ntd;
+}
+
+/*
+ * Checksum offload needs a context descriptor telling the NIC where to start
+ * summing (css) and where to put the result (cso).  The NIC keeps the last
+ * context, so we only send one when those change.  The IP header checksum is
+ * always done in software, so we leave that part of the context empty.
+ * Returns the new tdt.
+ */
+static int
+igbetxctx(struct ctlr* ctlr, struct block* bp, int tdt)
+{
+	Td *td;
+	int css, cso;
+
+	css = bp->checksum_start;
+	cso = bp->checksum_start + bp->checksum_offset;
+	if(css == ctlr->txcss && cso == ctlr->txcso)
+		return tdt;
+	td = &ctlr->tdba[tdt];
+	td->ipcss = td->ipcso = 0;
+	td->ipcse = 0;
+	td->tucss = css;
+	td->tucso = cso;
+	td->tucse = 0;
+	td->control = Dext|DtypeCD;
+	td->status = 0;
+	ctlr->tb[tdt] = NULL;
+	ctlr->txcss = css;
+	ctlr->txcso = cso;
+	return NEXT_RING(tdt, ctlr->ntd);
+}
+
 static void
 igbetransmit(struct ether* edev)
 {
 	Td *td;
 	struct block *bp;
 	struct ctlr *ctlr;
-	int tdh, tdt;
+	int tdh, tdt, csum;
 
 	ctlr = edev->ctlr;
 
@@ -1015,20 +1094,30 @@ igbetransmit(struct ether* edev)
 	ctlr->tdh = tdh;
 
 	/*
-	 * Try to fill the ring back up.
+	 * Try to fill the ring back up.  Leave room for a packet and its
+	 * checksum context.
 	 */
 	tdt = ctlr->tdt;
-	while(NEXT_RING(tdt, ctlr->ntd) != tdh){
+	while(igbetdfree(ctlr, tdh, tdt) >= 2){
 		if((bp = qget(edev->oq)) == NULL)
 			break;
+		/* the context's offsets are a byte each */
+		csum = bp->flag & (Btcpck|Budpck);
+		if(csum && bp->checksum_start + bp->checksum_offset > 0xff){
+			ptclcsum_finalize(bp, 0);
+			csum = 0;
+		}
+		if(csum)
+			tdt = igbetxctx(ctlr, bp, tdt);
 		td = &ctlr->tdba[tdt];
 		td->addr[0] = paddr_low32(bp->rp);
 		td->addr[1] = paddr_high32(bp->rp);
 		td->control = ((BLEN(bp) & LenMASK)<<LenSHIFT);
 		td->control |= Dext|Ifcs|Teop|DtypeDD;
+		td->status = csum ? Itxsm : 0;
 		ctlr->tb[tdt] = bp;
 		tdt = NEXT_RING(tdt, ctlr->ntd);
-		if(NEXT_RING(tdt, ctlr->ntd) == tdh){
+		if(igbetdfree(ctlr, tdh, tdt) < 2){
 			td->control |= Rs;
 			ctlr->txdw++;
 			ctlr->tdt = tdt;
@@ -1089,8 +1178,7 @@ igberxinit(struct ctlr* ctlr)
 	csr32w(ctlr, Rdh, 0);
 	ctlr->rdt = 0;
 	csr32w(ctlr, Rdt, 0);
-	ctlr->rdtr = 0;
-	csr32w(ctlr, Rdtr, Fpd|0);
+	csr32w(ctlr, Rdtr, Fpd|ctlr->rdtr);
 
 	for(i = 0; i < ctlr->nrd; i++){
 		if((bp = ctlr->rb[i]) != NULL){
@@ -1100,20 +1188,8 @@ igberxinit(struct ctlr* ctlr)
 	}
 	igbereplenish(ctlr);
 
-	switch(ctlr->id){
-	case i82540em:
-	case i82540eplp:
-	case i82541gi:
-	case i82541gi2:
-	case i82541pi:
-	case i82545em:
-	case i82545gmc:
-	case i82546gb:
-	case i82546eb:
-	case i82547gi:
-		csr32w(ctlr, Radv, 64);
-		break;
-	}
+	if(igbehasradv(ctlr))
+		csr32w(ctlr, Radv, ctlr->radv);
 	csr32w(ctlr, Rxdctl, (8<<WthreshSHIFT)|(8<<HthreshSHIFT)|4);
 
 	/*
@@ -2012,6 +2088,7 @@ igbepci(void)
 		ctlr->id = id;
 		ctlr->cls = cls * sizeof(long);
 		ctlr->nic = mem;
+		ctlr->radv = 64;
 
 		if(igbereset(ctlr)){
 			kfree(ctlr);
@@ -2055,6 +2132,7 @@ igbepnp(struct ether* edev)
 	edev->irq = ctlr->pci->irqline;
 	edev->tbdf = pci_to_tbdf(ctlr->pci);
 	edev->mbps = 1000;
+	edev->feat = NETF_TCPCK|NETF_UDPCK;
 	memmove(edev->ea, ctlr->ra, Eaddrlen);
 
 	/*
@@ -2064,6 +2142,7 @@ igbepnp(struct ether* edev)
 	edev->transmit = igbetransmit;
 	edev->ifstat = igbeifstat;
 	edev->ctl = igbectl;
+	edev->coalesce = igbecoalesce;
 	edev->shutdown = igbeshutdown;
 
 	edev->arg = edev;
@@ -1453,6 +1453,28 @@ static void mlx4_en_auto_moderation(struct mlx4_en_priv *priv)
 #endif
 }
 
+/* devether's coalesce hook.  The driver's own auto-moderation is not ported;
+ * devether does the sampling and hands us the RX moderation time. */
+void mlx4_en_coalesce(struct ether *dev, int usec)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_cq *cq;
+	int ring;
+
+	qlock(&priv->mdev->state_lock);
+	priv->rx_usecs = MIN(usec, 0xffff);
+	for (ring = 0; ring < priv->rx_ring_num; ring++) {
+		cq = priv->rx_cq[ring];
+		cq->moder_time = priv->rx_usecs;
+		cq->moder_cnt = priv->rx_frames;
+		priv->last_moder_time[ring] = priv->rx_usecs;
+		if (priv->port_up && mlx4_en_set_cq_moder(priv, cq))
+			en_err(priv, "Failed modifying moderation for cq:%d\n",
+			       ring);
+	}
+	qunlock(&priv->mdev->state_lock);
+}
+
 static void mlx4_en_do_get_stats(struct work_struct *work)
 {
 	panic("Disabled");
@@ -1592,6 +1614,8 @@ int mlx4_en_start_port(struct ether *dev)
 		cq = priv->rx_cq[i];
 
 		mlx4_en_cq_init_lock(cq);
+		spinlock_init(&cq->busy_lock);
+		cq->polling = 0;
 
 		err = mlx4_en_init_affinity_hint(priv, i);
 		if (err) {
@@ -2892,7 +2916,11 @@ int mlx4_en_init_netdev(struct mlx4_en_dev *mdev, int port,
 	priv->num_tx_rings_p_up = mdev->profile.num_tx_rings_p_up;
 	priv->tx_ring_num = prof->tx_ring_num;
 	priv->tx_work_limit = MLX4_EN_DEFAULT_TX_WORK;
+#if 0 // AKAROS_PORT
 	netdev_rss_key_fill(priv->rss_key, sizeof(priv->rss_key));
+#else
+	memcpy(priv->rss_key, dev->rss_key, sizeof(priv->rss_key));
+#endif
 
 	priv->tx_ring = kzmalloc(sizeof(struct mlx4_en_tx_ring *) * MAX_TX_RINGS,
 				 KMALLOC_WAIT);
@@ -2907,6 +2935,10 @@ int mlx4_en_init_netdev(struct mlx4_en_dev *mdev, int port,
 		goto out;
 	}
 	priv->rx_ring_num = prof->rx_ring_num;
+	/* The ether layer's TX queues map onto the first user priority's
+	 * rings; mlx4_en_xmit_queue() drains queue i into tx_ring[i]. */
+	dev->nr_txq = MIN(priv->num_tx_rings_p_up, Maxqueues);
+	dev->nr_rxq = MIN(priv->rx_ring_num, Maxqueues);
 	priv->cqe_factor = (mdev->dev->caps.cqe_size == 64) ? 1 : 0;
 	priv->cqe_size = mdev->dev->caps.cqe_size;
 	priv->mac_index = -1;
@@ -2996,6 +3028,8 @@ int mlx4_en_init_netdev(struct mlx4_en_dev *mdev, int port,
 			NETIF_F_HW_VLAN_CTAG_FILTER;
 #else
 	dev->feat = NETIF_F_SG | NETIF_F_IP_CSUM;
+	if (mdev->LSO_support)
+		dev->feat |= NETIF_F_TSO;
 #endif
 	dev->hw_features |= NETIF_F_LOOPBACK |
 			NETIF_F_HW_VLAN_CTAG_TX | NETIF_F_HW_VLAN_CTAG_RX;
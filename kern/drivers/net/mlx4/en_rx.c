@@ -36,7 +36,46 @@
 #include <linux/mlx4/qp.h>
 #include "mlx4_en.h"
 
+#if 1 /* AKAROS */
+/* Drops a ref on an RX page.  If it was the last one, the page goes back to
+ * its ring's recycle cache instead of the page allocator.  pg_private is set
+ * only on pages of the preferred order, so the cache holds one size.
+ *
+ * A holder of the only ref has the page to itself: every other ref is a frag
+ * handed out by mlx4_alloc_pages(), so no one can get a new one. */
+static void mlx4_en_rx_page_put(struct page *page)
+{
+	struct mlx4_en_rx_ring *ring = page->pg_private;
+
+	if (kref_refcnt(&page->pg_kref) == 1) {
+		if (ring) {
+			spin_lock_irqsave(&ring->recycle_lock);
+			if (ring->nr_recycle < MLX4_EN_RX_RECYCLE_PAGES) {
+				ring->recycle[ring->nr_recycle++] = page;
+				spin_unlock_irqsave(&ring->recycle_lock);
+				return;
+			}
+			spin_unlock_irqsave(&ring->recycle_lock);
+		}
+		page->pg_private = NULL;
+	}
+	page_decref(page);
+}
+
+static struct page *mlx4_en_rx_recycled_page(struct mlx4_en_rx_ring *ring)
+{
+	struct page *page = NULL;
+
+	spin_lock_irqsave(&ring->recycle_lock);
+	if (ring->nr_recycle)
+		page = ring->recycle[--ring->nr_recycle];
+	spin_unlock_irqsave(&ring->recycle_lock);
+	return page;
+}
+#endif
+
 static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
+			    struct mlx4_en_rx_ring *ring,
 			    struct mlx4_en_rx_alloc *page_alloc,
 			    const struct mlx4_en_frag_info *frag_info,
 			    gfp_t _gfp)
@@ -45,6 +84,15 @@ static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
 	struct page *page;
 	dma_addr_t dma;
 
+#if 1 /* AKAROS */
+	page = mlx4_en_rx_recycled_page(ring);
+	if (page) {
+		ring->recycle_hits++;
+		order = MLX4_EN_ALLOC_PREFER_ORDER;
+		goto map;
+	}
+	ring->recycle_misses++;
+#endif
 	for (order = MLX4_EN_ALLOC_PREFER_ORDER; ;) {
 		gfp_t gfp = _gfp;
 
@@ -57,9 +105,14 @@ static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
 		    ((PAGE_SIZE << order) < frag_info->frag_size))
 			return -ENOMEM;
 	}
+#if 1 /* AKAROS */
+	page->pg_private = order == MLX4_EN_ALLOC_PREFER_ORDER ? ring : NULL;
+map:
+#endif
 	dma = dma_map_page(priv->ddev, page, 0, PAGE_SIZE << order,
 			   PCI_DMA_FROMDEVICE);
 	if (dma_mapping_error(priv->ddev, dma)) {
+		page->pg_private = NULL;
 		page_decref(page);
 		return -ENOMEM;
 	}
@@ -76,11 +129,12 @@ static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
 }
 
 static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
+			       struct mlx4_en_rx_ring *ring,
 			       struct mlx4_en_rx_desc *rx_desc,
 			       struct mlx4_en_rx_alloc *frags,
-			       struct mlx4_en_rx_alloc *ring_alloc,
 			       gfp_t gfp)
 {
+	struct mlx4_en_rx_alloc *ring_alloc = ring->page_alloc;
 	struct mlx4_en_rx_alloc page_alloc[MLX4_EN_MAX_RX_FRAGS];
 	const struct mlx4_en_frag_info *frag_info;
 	struct page *page;
@@ -96,7 +150,7 @@ static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
 		    ring_alloc[i].page_size)
 			continue;
 
-		if (mlx4_alloc_pages(priv, &page_alloc[i], frag_info, gfp))
+		if (mlx4_alloc_pages(priv, ring, &page_alloc[i], frag_info, gfp))
 			goto out;
 	}
 
@@ -116,7 +170,7 @@ out:
 				page_alloc[i].page_size, PCI_DMA_FROMDEVICE);
 			page = page_alloc[i].page;
 			atomic_set(&page->pg_kref.refcount, 1);
-			page_decref(page);
+			mlx4_en_rx_page_put(page);
 		}
 	}
 	return -ENOMEM;
@@ -135,7 +189,7 @@ static void mlx4_en_free_frag(struct mlx4_en_priv *priv,
 			       PCI_DMA_FROMDEVICE);
 
 	if (frags[i].page)
-		page_decref(frags[i].page);
+		mlx4_en_rx_page_put(frags[i].page);
 }
 
 static int mlx4_en_init_allocator(struct mlx4_en_priv *priv,
@@ -147,7 +201,7 @@ static int mlx4_en_init_allocator(struct mlx4_en_priv *priv,
 	for (i = 0; i < priv->num_frags; i++) {
 		const struct mlx4_en_frag_info *frag_info = &priv->frag_info[i];
 
-		if (mlx4_alloc_pages(priv, &ring->page_alloc[i],
+		if (mlx4_alloc_pages(priv, ring, &ring->page_alloc[i],
 				     frag_info, KMALLOC_WAIT | __GFP_COLD))
 			goto out;
 
@@ -166,7 +220,7 @@ out:
 			       page_alloc->page_size, PCI_DMA_FROMDEVICE);
 		page = page_alloc->page;
 		atomic_set(&page->pg_kref.refcount, 1);
-		page_decref(page);
+		mlx4_en_rx_page_put(page);
 		page_alloc->page = NULL;
 	}
 	return -ENOMEM;
@@ -232,7 +286,7 @@ static int mlx4_en_prepare_rx_desc(struct mlx4_en_priv *priv,
 	struct mlx4_en_rx_alloc *frags = ring->rx_info +
 					(index << priv->log_rx_info);
 
-	return mlx4_en_alloc_frags(priv, rx_desc, frags, ring->page_alloc, gfp);
+	return mlx4_en_alloc_frags(priv, ring, rx_desc, frags, gfp);
 }
 
 static inline bool mlx4_en_is_ring_empty(struct mlx4_en_rx_ring *ring)
@@ -368,6 +422,7 @@ int mlx4_en_create_rx_ring(struct mlx4_en_priv *priv,
 	ring->stride = stride;
 	ring->log_stride = ffs(ring->stride) - 1;
 	ring->buf_size = ring->size * ring->stride + TXBB_SIZE;
+	spinlock_init_irqsave(&ring->recycle_lock);
 
 	tmp = size * ROUNDUPPWR2(MLX4_EN_MAX_RX_FRAGS * sizeof(struct mlx4_en_rx_alloc));
 	ring->rx_info = vmalloc_node(tmp, node);
@@ -599,30 +654,70 @@ static void dump_packet(struct mlx4_en_priv *priv,
 	}
 }
 
+/* Small frames are copied whole.  For the rest, we copy the headers into the
+ * block and hang the rest of the frag off it as extra data, holding a page ref
+ * until the block is freed.  The frag's own ref is dropped as usual, so the
+ * page comes back to the ring when both let go. */
 static void recv_packet(struct mlx4_en_priv *priv,
+			struct mlx4_en_rx_ring *ring,
 			struct mlx4_en_rx_desc *rx_desc,
 			struct mlx4_en_rx_alloc *frags,
 			unsigned int length)
 {
 	struct block *block;
+	struct page *page = frags[0].page;
+	unsigned int copy = length;
 	void *va;
 
 	assert(priv->num_frags == 1);
 
-	block = iallocb(length);
+	if (length > SMALL_PACKET_SIZE)
+		copy = HEADER_COPY_SIZE;
+	block = iallocb(copy);
 	if (!block) {
 		en_dbg(RX_ERR, priv, "Failed allocating block\n");
 		priv->stats.rx_dropped++;
 		return;
 	}
 
-	va = page_address(frags[0].page) + frags[0].page_offset;
-	memcpy(block->wp, va, length);
-	block->wp += length;
+	va = page_address(page) + frags[0].page_offset;
+	memcpy(block->wp, va, copy);
+	block->wp += copy;
+	if (copy < length) {
+		page_incref(page);
+		if (block_append_page(block, page, frags[0].page_offset + copy,
+		                      length - copy, mlx4_en_rx_page_put, 0)) {
+			mlx4_en_rx_page_put(page);
+			freeb(block);
+			priv->port_stats.rx_alloc_failed++;
+			priv->stats.rx_dropped++;
+			return;
+		}
+		ring->rx_zcopy++;
+	}
 
 	etheriq(priv->dev, block, 1 /* fromwire */);
 }
 
+/* Per-ring RX counters for the ether's ifstat. */
+int mlx4_en_rx_stats(struct ether *dev, char *buf, size_t len)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_rx_ring *ring;
+	int l = 0;
+
+	for (int i = 0; i < priv->rx_ring_num; i++) {
+		ring = priv->rx_ring[i];
+		l += snprintf(buf + l, len - l,
+		              "rx%d: packets %lu bytes %lu zcopy %lu "
+		              "recycle hits %lu misses %lu cached %u\n",
+		              i, ring->packets, ring->bytes, ring->rx_zcopy,
+		              ring->recycle_hits, ring->recycle_misses,
+		              ring->nr_recycle);
+	}
+	return l;
+}
+
 #if 0 // AKAROS_PORT
 static struct sk_buff *mlx4_en_rx_skb(struct mlx4_en_priv *priv,
 				      struct mlx4_en_rx_desc *rx_desc,
@@ -934,7 +1029,7 @@ int mlx4_en_process_rx_cq(struct ether *dev, struct mlx4_en_cq *cq,
 		printd("length %d ring %p bytes %d packets %d ip_summed %d\n",
 		       length, ring, ring->bytes, ring->packets, ip_summed);
 		//dump_packet(priv, rx_desc, frags, length);
-		recv_packet(priv, rx_desc, frags, length);
+		recv_packet(priv, ring, rx_desc, frags, length);
 		goto next;
 
 #if 0 // AKAROS_PORT
@@ -1105,7 +1200,15 @@ static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2)
 	if (!mlx4_en_cq_lock_napi(cq))
 		return;
 
+	spin_lock(&cq->busy_lock);
+	/* A busy poller owns the CQ and will arm it when it gives up */
+	if (cq->polling) {
+		spin_unlock(&cq->busy_lock);
+		mlx4_en_cq_unlock_napi(cq);
+		return;
+	}
 	done = mlx4_en_process_rx_cq(dev, cq, budget);
+	spin_unlock(&cq->busy_lock);
 
 	mlx4_en_cq_unlock_napi(cq);
 
@@ -1135,6 +1238,46 @@ static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2)
 	mlx4_en_arm_cq(priv, cq);
 }
 
+/* Busy polling for devether: drains up to budget packets from the RX CQs
+ * without waiting for their interrupts. */
+int mlx4_en_poll(struct ether *dev, int budget)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_cq *cq;
+	int done = 0;
+
+	if (!priv->port_up)
+		return 0;
+	for (int i = 0; i < priv->rx_ring_num && done < budget; i++) {
+		cq = priv->rx_cq[i];
+		if (!spin_trylock(&cq->busy_lock))
+			continue;
+		done += mlx4_en_process_rx_cq(dev, cq, budget - done);
+		spin_unlock(&cq->busy_lock);
+	}
+	return done;
+}
+
+/* While anyone busy polls, RX completions don't get the CQs re-armed; the
+ * last poller to leave catches up and arms them. */
+void mlx4_en_busy_poll(struct ether *dev, int on)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_cq *cq;
+
+	for (int i = 0; i < priv->rx_ring_num; i++) {
+		cq = priv->rx_cq[i];
+		spin_lock(&cq->busy_lock);
+		if (on) {
+			cq->polling++;
+		} else if (--cq->polling == 0 && priv->port_up) {
+			mlx4_en_process_rx_cq(dev, cq, INT32_MAX);
+			mlx4_en_arm_cq(priv, cq);
+		}
+		spin_unlock(&cq->busy_lock);
+	}
+}
+
 static const int frag_sizes[] = {
 	FRAG_SZ0,
 	FRAG_SZ1,
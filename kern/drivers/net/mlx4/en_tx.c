@@ -53,6 +53,7 @@ int mlx4_en_create_tx_ring(struct mlx4_en_priv *priv,
 		}
 	}
 
+	spinlock_init(&ring->xmit_lock);
 	ring->size = size;
 	ring->size_mask = size - 1;
 	ring->stride = stride;
@@ -116,12 +117,8 @@ int mlx4_en_create_tx_ring(struct mlx4_en_priv *priv,
 	}
 	ring->qp.event = mlx4_en_sqp_event;
 
-#if 0 // AKAROS_PORT
 	err = mlx4_bf_alloc(mdev->dev, &ring->bf, node);
 	if (err) {
-#else
-	if (true) {
-#endif
 		en_dbg(DRV, priv, "working without blueflame (%d)\n", err);
 		ring->bf.uar = &mdev->priv_uar;
 		ring->bf.uar->map = mdev->uar_map;
@@ -198,6 +195,7 @@ int mlx4_en_activate_tx_ring(struct mlx4_en_priv *priv,
 
 	ring->cqn = cq;
 	ring->prod = 0;
+	ring->doorbell_prod = 0;
 	ring->cons = 0xffffffff;
 	ring->last_nr_txbb = 1;
 	memset(ring->tx_info, 0, ring->size * sizeof(struct mlx4_en_tx_info));
@@ -710,37 +708,46 @@ uint16_t mlx4_en_select_queue(struct ether *dev, struct sk_buff *skb,
 #endif
 }
 
-#if 0 // AKAROS_PORT
 static void mlx4_bf_copy(void __iomem *dst, const void *src,
 			 unsigned int bytecnt)
 {
+#if 0 // AKAROS_PORT
 	__iowrite64_copy(dst, src, bytecnt / 8);
-}
+#else
+	const uint64_t *from = src;
+	uint64_t __iomem *to = dst;
+
+	for (int i = 0; i < bytecnt / 8; i++)
+		write64(from[i], &to[i]);
 #endif
+}
 
-netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
+/* If more is set, the caller has another packet for the ring right behind this
+ * one, so we can skip the doorbell.  We still ring every
+ * MLX4_EN_TX_DOORBELL_BATCH TXBBs, so the NIC starts on a long burst early. */
+static netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev,
+				    struct mlx4_en_tx_ring *ring, bool more)
 {
 	struct mlx4_en_priv *priv = netdev_priv(dev);
-	struct mlx4_en_tx_ring *ring;
 	struct mlx4_en_tx_desc *tx_desc;
 	struct mlx4_wqe_data_seg *data;
 	struct mlx4_en_tx_info *tx_info;
 	int nr_txbb;
 	int desc_size;
 	int real_size;
-	uint32_t index;
+	uint32_t index, bf_index;
 	__be32 op_own;
 	int i_frag;
 	int nr_frags = 0;
+	int lso_header_size = 0;
 	bool bounce = false;
+	bool send_doorbell;
 	dma_addr_t dma = 0;
 	uint32_t byte_count = 0;
 
 	if (!priv->port_up)
 		goto tx_drop;
 
-	ring = priv->tx_ring[0]; /* TODO multi-queue support */
-
 	for (i_frag = 0; i_frag < block->nr_extra_bufs; i_frag++) {
 		const struct extra_bdata *ebd;
 
@@ -749,7 +756,22 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
 			nr_frags++;
 	}
 
-	real_size = CTRL_SIZE + (nr_frags + 1) * DS_SIZE;
+	if (block->flag & Btso) {
+		/* checksum_start is the TCP header; the NIC wants everything up
+		 * to the payload inlined in the descriptor. */
+		lso_header_size = block->checksum_start +
+			(block->rp[block->checksum_start + 12] >> 4) * 4;
+		if (unlikely(lso_header_size > BHLEN(block))) {
+			en_warn(priv, "Non-linear headers\n");
+			goto tx_drop;
+		}
+		real_size = CTRL_SIZE + nr_frags * DS_SIZE +
+			ALIGN(lso_header_size + 4, DS_SIZE);
+		if (lso_header_size < BHLEN(block))
+			real_size += DS_SIZE;
+	} else {
+		real_size = CTRL_SIZE + (nr_frags + 1) * DS_SIZE;
+	}
 	if (unlikely(!real_size))
 		goto tx_drop;
 
@@ -762,6 +784,7 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
 	}
 
 	index = ring->prod & ring->size_mask;
+	bf_index = ring->prod;
 
 	/* See if we have enough space for whole descriptor TXBB for setting
 	 * SW ownership on next descriptor; if not, use a bounce buffer. */
@@ -778,12 +801,15 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
 	tx_info->nr_txbb = nr_txbb;
 
 	data = &tx_desc->data;
+	if (lso_header_size)
+		data = ((void *)&tx_desc->lso + ALIGN(lso_header_size + 4,
+						      DS_SIZE));
 
 	/* valid only for none inline segments */
 	tx_info->data_offset = (void *)data - (void *)tx_desc;
 	tx_info->inl = 0;
-	tx_info->linear = 1;
-	tx_info->nr_maps = nr_frags + 1;
+	tx_info->linear = lso_header_size < BHLEN(block) ? 1 : 0;
+	tx_info->nr_maps = nr_frags + tx_info->linear;
 	data += tx_info->nr_maps - 1;
 
 	/* Map fragments if any */
@@ -807,16 +833,20 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
 		--data;
 	}
 
-	byte_count = BHLEN(block);
+	/* Map the linear part, minus any LSO headers */
+	if (tx_info->linear) {
+		byte_count = BHLEN(block) - lso_header_size;
 
-	dma = dma_map_single(0, block->rp, byte_count, DMA_TO_DEVICE);
-	if (unlikely(dma_mapping_error(0, dma)))
-		goto tx_drop_unmap;
+		dma = dma_map_single(0, block->rp + lso_header_size, byte_count,
+				     DMA_TO_DEVICE);
+		if (unlikely(dma_mapping_error(0, dma)))
+			goto tx_drop_unmap;
 
-	data->addr = cpu_to_be64(dma);
-	data->lkey = ring->mr_key;
-	bus_wmb();
-	data->byte_count = cpu_to_be32(byte_count);
+		data->addr = cpu_to_be64(dma);
+		data->lkey = ring->mr_key;
+		bus_wmb();
+		data->byte_count = cpu_to_be32(byte_count);
+	}
 
 	/* tx completion can avoid cache line miss for common cases */
 	tx_info->map0_dma = dma;
@@ -848,12 +878,36 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
 		tx_desc->ctrl.imm = get_unaligned((__be32 *)(ethh->h_dest + 2));
 	}
 
-	/* Normal (Non LSO) packet */
-	op_own = cpu_to_be32(MLX4_OPCODE_SEND) |
-		((ring->prod & ring->size) ?
-		 cpu_to_be32(MLX4_EN_BIT_DESC_OWN) : 0);
-	tx_info->nr_bytes = MAX_T(unsigned int, BLEN(block), ETH_ZLEN);
-	ring->packets++;
+	/* Handle LSO (TSO) packets */
+	if (lso_header_size) {
+		int i;
+
+		/* Mark opcode as LSO */
+		op_own = cpu_to_be32(MLX4_OPCODE_LSO | (1 << 6)) |
+			((ring->prod & ring->size) ?
+				cpu_to_be32(MLX4_EN_BIT_DESC_OWN) : 0);
+
+		/* Fill in the LSO prefix */
+		tx_desc->lso.mss_hdr_size = cpu_to_be32(
+			block->mss << 16 | lso_header_size);
+
+		/* Copy headers; we already checked that they are linear */
+		memcpy(tx_desc->lso.header, block->rp, lso_header_size);
+
+		ring->tso_packets++;
+
+		i = ((BLEN(block) - lso_header_size) / block->mss) +
+			!!((BLEN(block) - lso_header_size) % block->mss);
+		tx_info->nr_bytes = BLEN(block) + (i - 1) * lso_header_size;
+		ring->packets += i;
+	} else {
+		/* Normal (Non LSO) packet */
+		op_own = cpu_to_be32(MLX4_OPCODE_SEND) |
+			((ring->prod & ring->size) ?
+			 cpu_to_be32(MLX4_EN_BIT_DESC_OWN) : 0);
+		tx_info->nr_bytes = MAX_T(unsigned int, BLEN(block), ETH_ZLEN);
+		ring->packets++;
+	}
 	ring->bytes += tx_info->nr_bytes;
 	AVG_PERF_COUNTER(priv->pstats.tx_pktsz_avg, BLEN(block));
 
@@ -865,27 +919,62 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev)
 
 	real_size = (real_size / 16) & 0x3f; /* Clear fence bit. */
 
-	tx_desc->ctrl.vlan_tag = 0;
-	tx_desc->ctrl.ins_vlan = 0;
-	tx_desc->ctrl.fence_size = real_size;
+	send_doorbell = !more ||
+		ring->prod - ring->doorbell_prod >= MLX4_EN_TX_DOORBELL_BATCH;
 
-	/* Ensure new descriptor hits memory
-	 * before setting ownership of this descriptor to HW
-	 */
-	bus_wmb();
-	tx_desc->ctrl.owner_opcode = op_own;
-	wmb();
-	/* Since there is no iowrite*_native() that writes the
-	 * value as is, without byteswapping - using the one
-	 * the doesn't do byteswapping in the relevant arch
-	 * endianness.
-	 */
+	if (ring->bf_enabled && desc_size <= MAX_BF && !bounce &&
+	    send_doorbell) {
+		/* BlueFlame: write the whole descriptor to the NIC, saving
+		 * it the DMA read.  This doubles as the doorbell. */
+		tx_desc->ctrl.bf_qpn = ring->doorbell_qpn |
+				       cpu_to_be32(real_size);
+
+		op_own |= cpu_to_be32((bf_index & 0xffff) << 8);
+		/* Ensure new descriptor hits memory
+		 * before setting ownership of this descriptor to HW
+		 */
+		bus_wmb();
+		tx_desc->ctrl.owner_opcode = op_own;
+
+		wmb();
+
+		mlx4_bf_copy(ring->bf.reg + ring->bf.offset, &tx_desc->ctrl,
+			     desc_size);
+
+		wmb();
+
+		ring->bf.offset ^= ring->bf.buf_size;
+		ring->doorbell_prod = ring->prod;
+		ring->tx_bf++;
+	} else {
+		tx_desc->ctrl.vlan_tag = 0;
+		tx_desc->ctrl.ins_vlan = 0;
+		tx_desc->ctrl.fence_size = real_size;
+
+		/* Ensure new descriptor hits memory
+		 * before setting ownership of this descriptor to HW
+		 */
+		bus_wmb();
+		tx_desc->ctrl.owner_opcode = op_own;
+		if (send_doorbell) {
+			wmb();
+			/* Since there is no iowrite*_native() that writes the
+			 * value as is, without byteswapping - using the one
+			 * the doesn't do byteswapping in the relevant arch
+			 * endianness.
+			 */
 #if defined(__LITTLE_ENDIAN)
-	write32(ring->doorbell_qpn, ring->bf.uar->map + MLX4_SEND_DOORBELL);
+			write32(ring->doorbell_qpn,
+				ring->bf.uar->map + MLX4_SEND_DOORBELL);
 #else
-	iowrite32be(ring->doorbell_qpn,
-		    ring->bf.uar->map + MLX4_SEND_DOORBELL);
+			iowrite32be(ring->doorbell_qpn,
+				    ring->bf.uar->map + MLX4_SEND_DOORBELL);
 #endif
+			ring->doorbell_prod = ring->prod;
+		} else {
+			ring->xmit_more++;
+		}
+	}
 
 	return NETDEV_TX_OK;
 
@@ -897,6 +986,45 @@ tx_drop:
 	return NETDEV_TX_OK;
 }
 
+/* Per-ring TX counters for the ether's ifstat. */
+int mlx4_en_tx_stats(struct ether *dev, char *buf, size_t len)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_tx_ring *ring;
+	int l = 0;
+
+	for (int i = 0; i < priv->tx_ring_num; i++) {
+		ring = priv->tx_ring[i];
+		l += snprintf(buf + l, len - l,
+		              "tx%d: packets %lu bytes %lu xmit_more %lu "
+		              "blueflame %lu\n",
+		              i, ring->packets, ring->bytes, ring->xmit_more,
+		              ring->tx_bf);
+	}
+	return l;
+}
+
+/* Drains the ether's transmit queue qno into TX ring qno.  Cores that hash to
+ * the same queue take turns on the ring lock, which keeps the queue's packets
+ * in order on the wire. */
+void mlx4_en_xmit_queue(struct ether *dev, int qno)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_tx_ring *ring = priv->tx_ring[qno];
+	struct block *block, *next;
+
+	/* We look one packet ahead, so we only ring the doorbell once the
+	 * queue is drained. */
+	spin_lock(&ring->xmit_lock);
+	block = qget(dev->txq[qno]);
+	while (block) {
+		next = qget(dev->txq[qno]);
+		mlx4_send_packet(block, dev, ring, next != NULL);
+		block = next;
+	}
+	spin_unlock(&ring->xmit_lock);
+}
+
 #if 0 // AKAROS_PORT
 netdev_tx_t mlx4_en_xmit(struct sk_buff *skb, struct ether *dev)
 {
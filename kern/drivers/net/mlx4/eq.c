@@ -1262,10 +1262,17 @@ int mlx4_init_eq_table(struct mlx4_dev *dev)
 					   priv->eq_table.eq + i,
 					   pci_to_tbdf(PCIDEV));
 #else
-			err = register_irq(priv->eq_table.eq[i].irq,
-					   mlx4_msi_x_interrupt_akaros,
-					   priv->eq_table.eq + i,
-					   pci_to_tbdf(dev->persist->pdev));
+			if (i < dev->caps.num_comp_vectors)
+				err = register_irq_core(priv->eq_table.eq[i].irq,
+							mlx4_msi_x_interrupt_akaros,
+							priv->eq_table.eq + i,
+							pci_to_tbdf(dev->persist->pdev),
+							etherqcore(i));
+			else
+				err = register_irq(priv->eq_table.eq[i].irq,
+						   mlx4_msi_x_interrupt_akaros,
+						   priv->eq_table.eq + i,
+						   pci_to_tbdf(dev->persist->pdev));
 #endif
 			if (err)
 				goto err_out_async;
@@ -1615,35 +1615,42 @@ static void mlx4_slave_exit(struct mlx4_dev *dev)
 
 static int map_bf_area(struct mlx4_dev *dev)
 {
-	panic("Disabled");
-#if 0 // AKAROS_PORT
 	struct mlx4_priv *priv = mlx4_priv(dev);
-	resource_size_t bf_start;
-	resource_size_t bf_len;
+	uintptr_t bf_start;
+	size_t bf_len;
 	int err = 0;
 
 	if (!dev->caps.bf_reg_size)
 		return -ENXIO;
 
-	bf_start = pci_resource_start(dev->persist->pdev, 2) +
+	bf_start = (uintptr_t)pci_resource_start(dev->persist->pdev, 2) +
 			(dev->caps.num_uars << PAGE_SHIFT);
 	bf_len = pci_resource_len(dev->persist->pdev, 2) -
 			(dev->caps.num_uars << PAGE_SHIFT);
+#if 0 // AKAROS_PORT
 	priv->bf_mapping = io_mapping_create_wc(bf_start, bf_len);
+#else
+	priv->bf_mapping = (void __iomem *)vmap_pmem_writecomb(bf_start, bf_len);
+	priv->bf_len = bf_len;
+#endif
 	if (!priv->bf_mapping)
 		err = -ENOMEM;
 
 	return err;
-#endif
 }
 
 static void unmap_bf_area(struct mlx4_dev *dev)
 {
-	panic("Disabled");
+	struct mlx4_priv *priv = mlx4_priv(dev);
+
+	if (priv->bf_mapping) {
 #if 0 // AKAROS_PORT
-	if (mlx4_priv(dev)->bf_mapping)
-		io_mapping_free(mlx4_priv(dev)->bf_mapping);
+		io_mapping_free(priv->bf_mapping);
+#else
+		vunmap_vmem((uintptr_t)priv->bf_mapping, priv->bf_len);
 #endif
+		priv->bf_mapping = NULL;
+	}
 }
 
 uint64_t mlx4_read_clock(struct mlx4_dev *dev)
@@ -2151,10 +2158,8 @@ static int mlx4_init_hca(struct mlx4_dev *dev)
 		}
 	}
 
-#if 0 // AKAROS_PORT
 	if (map_bf_area(dev))
 		mlx4_dbg(dev, "Failed to map blue flame area\n");
-#endif
 
 	/*Only the master set the ports, all the rest got it from it.*/
 	if (!mlx4_is_slave(dev))
@@ -2553,8 +2558,13 @@ no_msi:
 	if (pci_msix_init(dev->persist->pdev) == -1)
 		panic("pci_msix_init -1");
 
+	/* One completion EQ per core, as far as the MSI-X table and the EQs
+	 * go, plus the async EQ.  Comp EQ i's vector is routed to
+	 * etherqcore(i) in mlx4_init_eq_table(). */
 	dev->caps.comp_pool = 0;
-	dev->caps.num_comp_vectors = 1;
+	dev->caps.num_comp_vectors =
+		MAX(1, MIN(MIN(num_cores, dev->persist->pdev->msix_nr_vec - 1),
+			   dev->caps.num_eqs - dev->caps.reserved_eqs - 1));
 
 	dev->flags |= MLX4_FLAG_MSI_X;
 #endif
@@ -3854,7 +3864,9 @@ module_exit(mlx4_cleanup);
 
 extern int mlx4_en_init(void);
 extern int mlx4_en_open(struct ether *dev);
-extern netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev);
+extern void mlx4_en_xmit_queue(struct ether *dev, int qno);
+extern int mlx4_en_rx_stats(struct ether *dev, char *buf, size_t len);
+extern int mlx4_en_tx_stats(struct ether *dev, char *buf, size_t len);
 
 static const struct pci_device_id *search_pci_table(struct pci_device *needle)
 {
@@ -3877,16 +3889,20 @@ static void ether_attach(struct ether *edev)
 
 static void ether_transmit(struct ether *edev)
 {
-	struct block *block;
-
-	while ((block = qget(edev->oq)))
-		mlx4_send_packet(block, edev);
+	mlx4_en_xmit_queue(edev, 0);
 }
 
 static long ether_ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 {
-	printk("edev %p a %p n %d offset %u\n", edev, a, n, offset);
-	return 0;
+	char *p;
+	int l;
+
+	p = kzmalloc(READSTR, KMALLOC_WAIT);
+	l = mlx4_en_rx_stats(edev, p, READSTR);
+	mlx4_en_tx_stats(edev, p + l, READSTR - l);
+	n = readstr(offset, a, n, p);
+	kfree(p);
+	return n;
 }
 
 static long ether_ctl(struct ether *edev, void *buf, long n)
@@ -3980,8 +3996,12 @@ static int mlx4_pnp(struct ether *edev)
 
 	edev->attach = ether_attach;
 	edev->transmit = ether_transmit;
+	edev->transmit_queue = mlx4_en_xmit_queue;
 	edev->ifstat = ether_ifstat;
 	edev->ctl = ether_ctl;
+	edev->poll = mlx4_en_poll;
+	edev->busypoll = mlx4_en_busy_poll;
+	edev->coalesce = mlx4_en_coalesce;
 	edev->shutdown = ether_shutdown;
 
 	edev->arg = edev;
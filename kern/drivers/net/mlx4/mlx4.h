@@ -871,7 +871,12 @@ struct mlx4_priv {
 	struct mlx4_steer	*steer;
 	struct list_head	bf_list;
 	qlock_t		bf_mutex;
+#if 0 // AKAROS_PORT
 	struct io_mapping	*bf_mapping;
+#else
+	void __iomem		*bf_mapping;	/* write-combining */
+	size_t			bf_len;
+#endif
 	void __iomem            *clock_mapping;
 	int			reserved_mtts;
 	int			fs_hash_mode;
@@ -147,6 +147,10 @@ enum {
 #define SMALL_PACKET_SIZE      (256 - NET_IP_ALIGN)
 #define HEADER_COPY_SIZE       (128 - NET_IP_ALIGN)
 #define MLX4_LOOPBACK_TEST_PAYLOAD (HEADER_COPY_SIZE - ETHERHDRSIZE)
+/* Whole RX pages kept per ring for reuse once all of their frags are free */
+#define MLX4_EN_RX_RECYCLE_PAGES	32
+/* Most TXBBs posted in a burst before we ring the TX doorbell anyway */
+#define MLX4_EN_TX_DOORBELL_BATCH	64
 
 #define MLX4_EN_MIN_MTU		46
 #define ETH_BCAST		0xffffffffffffULL
@@ -249,12 +253,15 @@ struct mlx4_en_tx_ring {
 	unsigned long		wake_queue;
 
 	/* cache line used and dirtied in mlx4_en_xmit() */
+	spinlock_t		xmit_lock;	/* serializes mlx4_en_xmit_queue() */
 	uint32_t			prod ____cacheline_aligned_in_smp;
 	unsigned long		bytes;
 	unsigned long		packets;
 	unsigned long		tx_csum;
 	unsigned long		tso_packets;
 	unsigned long		xmit_more;
+	unsigned long		tx_bf;		/* doorbells sent by BlueFlame */
+	uint32_t		doorbell_prod;	/* prod as of the last doorbell */
 	struct mlx4_bf		bf;
 	unsigned long		queue_stopped;
 
@@ -314,6 +321,16 @@ struct mlx4_en_rx_ring {
 	unsigned long csum_complete;
 	int hwtstamp_rx_filter;
 	cpumask_var_t affinity_mask;
+#if 1 /* AKAROS */
+	/* Pages come back here from freeb() of zero-copy blocks and from the
+	 * driver's own frag frees, on any core. */
+	spinlock_t recycle_lock;
+	struct page *recycle[MLX4_EN_RX_RECYCLE_PAGES];
+	unsigned int nr_recycle;
+	unsigned long recycle_hits;
+	unsigned long recycle_misses;
+	unsigned long rx_zcopy;
+#endif
 };
 
 struct mlx4_en_cq {
@@ -344,6 +361,10 @@ struct mlx4_en_cq {
 	spinlock_t poll_lock; /* protects from LLS/napi conflicts */
 #endif  /* CONFIG_NET_RX_BUSY_POLL */
 	struct irq_desc *irq_desc;
+	/* Akaros busy polling.  The RX kmsg and pollers drain the CQ under
+	 * busy_lock; while polling is set, the kmsg leaves the CQ unarmed. */
+	spinlock_t busy_lock;
+	int polling;
 };
 
 struct mlx4_en_port_profile {
@@ -799,6 +820,9 @@ int mlx4_en_create_drop_qp(struct mlx4_en_priv *priv);
 void mlx4_en_destroy_drop_qp(struct mlx4_en_priv *priv);
 int mlx4_en_free_tx_buf(struct ether *dev, struct mlx4_en_tx_ring *ring);
 void mlx4_en_rx_irq(struct mlx4_cq *mcq);
+int mlx4_en_poll(struct ether *dev, int budget);
+void mlx4_en_busy_poll(struct ether *dev, int on);
+void mlx4_en_coalesce(struct ether *dev, int usec);
 
 int mlx4_SET_MCAST_FLTR(struct mlx4_dev *dev, uint8_t port, uint64_t mac,
 			uint64_t clear, uint8_t mode);
@@ -170,8 +170,6 @@ EXPORT_SYMBOL_GPL(mlx4_uar_free);
 
 int mlx4_bf_alloc(struct mlx4_dev *dev, struct mlx4_bf *bf, int node)
 {
-	panic("Disabled");
-#if 0 // AKAROS_PORT
 	struct mlx4_priv *priv = mlx4_priv(dev);
 	struct mlx4_uar *uar;
 	int err = 0;
@@ -206,7 +204,12 @@ int mlx4_bf_alloc(struct mlx4_dev *dev, struct mlx4_bf *bf, int node)
 			goto free_uar;
 		}
 
+#if 0 // AKAROS_PORT
 		uar->bf_map = io_mapping_map_wc(priv->bf_mapping, uar->index << PAGE_SHIFT);
+#else
+		/* map_bf_area() mapped all of the BF pages at once */
+		uar->bf_map = priv->bf_mapping + (uar->index << PAGE_SHIFT);
+#endif
 		if (!uar->bf_map) {
 			err = -ENOMEM;
 			goto unamp_uar;
@@ -239,14 +242,11 @@ free_kmalloc:
 out:
 	qunlock(&priv->bf_mutex);
 	return err;
-#endif
 }
 EXPORT_SYMBOL_GPL(mlx4_bf_alloc);
 
 void mlx4_bf_free(struct mlx4_dev *dev, struct mlx4_bf *bf)
 {
-	panic("Disabled");
-#if 0 // AKAROS_PORT
 	struct mlx4_priv *priv = mlx4_priv(dev);
 	int idx;
 
@@ -260,7 +260,9 @@ void mlx4_bf_free(struct mlx4_dev *dev, struct mlx4_bf *bf)
 		if (!list_empty(&bf->uar->bf_list))
 			list_del(&bf->uar->bf_list);
 
+#if 0 // AKAROS_PORT
 		io_mapping_unmap(bf->uar->bf_map);
+#endif
 		iounmap(bf->uar->map);
 		mlx4_uar_free(dev, bf->uar);
 		kfree(bf->uar);
@@ -268,7 +270,6 @@ void mlx4_bf_free(struct mlx4_dev *dev, struct mlx4_bf *bf)
 		list_add(&bf->uar->bf_list, &priv->bf_list);
 
 	qunlock(&priv->bf_mutex);
-#endif
 }
 EXPORT_SYMBOL_GPL(mlx4_bf_free);
 
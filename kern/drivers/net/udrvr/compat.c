@@ -14,6 +14,8 @@
 #include <pmap.h>
 #include <smp.h>
 #include <devfs.h>
+#include <event.h>
+#include <process.h>
 #include <linux/rdma/ib_user_verbs.h>
 #include "uverbs.h"
 
@@ -680,7 +682,12 @@ ssize_t check_old_abi(struct file *filp, const char __user *buf, size_t count)
 		return -EFAULT;
 
 	tmp = hdr.command & IB_USER_VERBS_CMD_COMMAND_MASK;
-	if ((tmp >= 52) && (tmp <= 53)) {
+	if (tmp == IB_USER_VERBS_CMD_AKAROS_CQ_EVQ) {
+		if (hdr.in_words * 4 != count)
+			return -EINVAL;
+		return ib_uverbs_akaros_cq_evq(file, buf + sizeof(hdr),
+		                               count - sizeof(hdr));
+	} else if ((tmp >= 52) && (tmp <= 53)) {
 		return compat_ex(file, count, buf);
 	} else if (tmp == IB_USER_VERBS_CMD_MODIFY_QP) {
 		return compat(file, count, buf);
@@ -695,3 +702,36 @@ ssize_t check_old_abi(struct file *filp, const char __user *buf, size_t count)
 }
 
 /* END: Support older version of libibverbs */
+
+/*
+ * CQ completion events to an event queue.  Completion data stays in the CQ,
+ * which the user polls directly (it's in user memory, and the doorbells are
+ * mmapped), so all we do here is poke the user: a CEQ post is a few atomics in
+ * user memory, instead of a kmalloc'd entry for a file read.  Called from the
+ * HCA's completion interrupt.
+ */
+void ib_uverbs_send_cq_event(struct ib_ucq_object *ucq)
+{
+	struct event_msg msg = {0};
+	struct event_queue *ev_q = ACCESS_ONCE(ucq->ev_q);
+
+	if (!ev_q)
+		return;
+	/* ev_type and ev_proc were set before ev_q */
+	rmb();
+	msg.ev_type = ucq->ev_type;
+	msg.ev_arg2 = 1;
+	msg.ev_arg3 = (void *)ucq->uobject.user_handle;
+	ucq->comp_events_reported++;
+	send_event(ucq->ev_proc, ev_q, &msg, 0);
+}
+
+/* Called once the CQ is destroyed, so no more completion events can come. */
+void ib_uverbs_release_cq_evq(struct ib_ucq_object *ucq)
+{
+	if (ucq->ev_proc) {
+		proc_decref(ucq->ev_proc);
+		ucq->ev_proc = NULL;
+	}
+	ucq->ev_q = NULL;
+}
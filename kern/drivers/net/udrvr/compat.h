@@ -228,3 +228,10 @@ extern void sysfs_create(int devnum, const struct file_operations *verb_fops,
 
 extern ssize_t check_old_abi(struct file *filp, const char __user *buf,
                              size_t count);
+
+struct ib_uverbs_file;
+struct ib_ucq_object;
+extern ssize_t ib_uverbs_akaros_cq_evq(struct ib_uverbs_file *file,
+                                       const char __user *buf, int in_len);
+extern void ib_uverbs_send_cq_event(struct ib_ucq_object *ucq);
+extern void ib_uverbs_release_cq_evq(struct ib_ucq_object *ucq);
@@ -55,7 +55,6 @@
 #define	ib_sysfs_setup()		0
 #define	ib_device_register_sysfs(d, c)	0
 
-#define	alloc_workqueue(str, a, b)	create_singlethread_workqueue(str)
 #define	kobject_put(p)
 
 #endif	/* AKAROS */
@@ -168,6 +168,10 @@ struct ib_ucq_object {
 	struct list_head	async_list;
 	u32			comp_events_reported;
 	u32			async_events_reported;
+	/* AKAROS: see ib_uverbs_akaros_cq_evq */
+	struct proc	       *ev_proc;
+	struct event_queue     *ev_q;
+	u32			ev_type;
 };
 
 extern spinlock_t ib_uverbs_idr_lock;
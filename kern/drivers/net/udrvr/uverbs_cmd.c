@@ -44,6 +44,8 @@
 #include "uverbs.h"
 #include "core_priv.h"
 #else	/* AKAROS */
+#include <event.h>
+#include <process.h>
 #include "uverbs.h"
 
 static void release_uobj(struct kref *kref);
@@ -1441,6 +1443,11 @@ ssize_t ib_uverbs_create_cq(struct ib_uverbs_file *file,
 	obj->uverbs_file	   = file;
 	obj->comp_events_reported  = 0;
 	obj->async_events_reported = 0;
+#if 1	/* AKAROS */
+	obj->ev_proc		   = NULL;
+	obj->ev_q		   = NULL;
+	obj->ev_type		   = 0;
+#endif	/* AKAROS */
 	INIT_LIST_HEAD(&obj->comp_list);
 	INIT_LIST_HEAD(&obj->async_list);
 
@@ -1635,6 +1642,53 @@ ssize_t ib_uverbs_req_notify_cq(struct ib_uverbs_file *file,
 	return in_len;
 }
 
+#if 1	/* AKAROS */
+/*
+ * Sets (or clears, with ev_q == 0) the event queue for a CQ's completion
+ * events.  See ib_uverbs_akaros_cq_evq in ib_user_verbs.h.
+ */
+ssize_t ib_uverbs_akaros_cq_evq(struct ib_uverbs_file *file,
+				const char __user *buf, int in_len)
+{
+	struct ib_uverbs_akaros_cq_evq	cmd;
+	struct ib_ucq_object	       *obj;
+	struct ib_cq		       *cq;
+
+	if (!file->ucontext)
+		return -EINVAL;
+
+	if (in_len < sizeof cmd)
+		return -EINVAL;
+
+	if (copy_from_user(&cmd, buf, sizeof cmd))
+		return -EFAULT;
+
+	if (cmd.ev_q && !is_user_rwaddr((void *)cmd.ev_q,
+					sizeof(struct event_queue)))
+		return -EFAULT;
+
+	cq = idr_read_cq(cmd.cq_handle, file->ucontext, 0);
+	if (!cq)
+		return -EINVAL;
+
+	obj = container_of(cq->uobject, struct ib_ucq_object, uobject);
+	/* The comp handler reads ev_q first, then the rest */
+	obj->ev_q = NULL;
+	wmb();
+	if (!obj->ev_proc) {
+		proc_incref(current, 1);
+		obj->ev_proc = current;
+	}
+	obj->ev_type = cmd.ev_type;
+	wmb();
+	obj->ev_q = (struct event_queue *)cmd.ev_q;
+
+	put_cq_read(cq);
+
+	return in_len + sizeof(struct ib_uverbs_cmd_hdr);
+}
+#endif	/* AKAROS */
+
 ssize_t ib_uverbs_destroy_cq(struct ib_uverbs_file *file,
 			     const char __user *buf, int in_len,
 			     int out_len)
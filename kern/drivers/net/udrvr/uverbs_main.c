@@ -185,6 +185,10 @@ void ib_uverbs_release_ucq(struct ib_uverbs_file *file,
 {
 	struct ib_uverbs_event *evt, *tmp;
 
+#if 1	/* AKAROS */
+	ib_uverbs_release_cq_evq(uobj);
+#endif	/* AKAROS */
+
 	if (ev_file) {
 		spin_lock_irq(&ev_file->lock);
 		list_for_each_entry_safe(evt, tmp, &uobj->comp_list, obj_list) {
@@ -477,6 +481,16 @@ void ib_uverbs_comp_handler(struct ib_cq *cq, void *cq_context)
 	struct ib_uverbs_event	       *entry;
 	unsigned long			flags;
 
+#if 1	/* AKAROS */
+	if (cq->uobject) {
+		uobj = container_of(cq->uobject, struct ib_ucq_object, uobject);
+		if (ACCESS_ONCE(uobj->ev_q)) {
+			ib_uverbs_send_cq_event(uobj);
+			return;
+		}
+	}
+#endif	/* AKAROS */
+
 	if (!file)
 		return;
 
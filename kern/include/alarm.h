@@ -8,8 +8,10 @@
  * (picture running the ksched then).  The other style is to block/sleep on the
  * awaiter after the alarm is set.
  *
- * Like with most systems, you won't wake up til after the time you specify (for
- * now).  This might change, esp if we tweak things to coalesce alarms.
+ * Like with most systems, you won't wake up til after the time you specify.
+ * Awaiters can also give some slack with set_awaiter_slack(): they may go off
+ * up to that much later, which lets alarms that are close together share an
+ * interrupt.
  *
  * All tchains come with locks.  Originally, I left these out, since the pcpu
  * tchains didn't need them (disable_irq was sufficient).  However, disabling
@@ -57,6 +59,10 @@
  * or:
  * 	reset_alarm_rel(tchain, waiter, USEC);
  *
+ * If you don't care if it's a little late (say, up to 100 usec), do this
+ * before setting the alarm:
+ * 	set_awaiter_slack(waiter, 100);
+ *
  * Don't forget to manage your memory at some (safe) point:
  * 	kfree(waiter);
  * In the future, we might have a slab for these.  You can get it from wherever
@@ -87,24 +93,39 @@ struct alarm_waiter {
 		struct semaphore			sem;		/* kthread will sleep on this */
 	};
 	void						*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	uint64_t					slack;			/* TSC ticks we can be late */
+	uint64_t					fire_time;		/* wake_up_time, plus slack */
+	BSD_LIST_ENTRY(alarm_waiter)	next;
+	uint8_t						tw_level;
+	uint8_t						tw_slot;
 	bool						on_tchain;
 	bool						irq_ok;
 	bool						holds_tchain_lock;
 	bool						has_func;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+BSD_LIST_HEAD(awaiters_list, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
+/* Timer chains are hierarchical timing wheels.  Level 0 slots are one wheel
+ * tick (2^TW_TICK_SHIFT TSC ticks) wide, and each level's slots are
+ * TW_LEVEL_SIZE times wider than the one below it.  See alarm.c. */
+#define TW_TICK_SHIFT			12
+#define TW_LEVEL_SHIFT			6
+#define TW_LEVEL_SIZE			(1 << TW_LEVEL_SHIFT)
+#define TW_NR_LEVELS			8
+
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
- * set_interrupt() is a method for setting the interrupt source. */
+ * set_interrupt() is a method for setting the interrupt source.  It arms the
+ * interrupt for earliest_time, or disarms it if that is ALARM_POISON_TIME. */
 struct timer_chain {
 	spinlock_t					lock;
-	struct awaiters_tailq		waiters;
 	uint64_t					earliest_time;
-	uint64_t					latest_time;
+	uint64_t					clk;			/* wheel ticks */
+	unsigned long				nr_waiters;
+	uint64_t					tw_bitmap[TW_NR_LEVELS];
+	struct awaiters_list		tw_slots[TW_NR_LEVELS][TW_LEVEL_SIZE];
 	void (*set_interrupt)(struct timer_chain *);
 };
 
@@ -121,6 +142,8 @@ void init_awaiter_irq(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* How late, in usec, the awaiter can go off.  Defaults to 0. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec);
 /* Arms/disarms the alarm. */
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 bool unset_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
@@ -40,14 +40,15 @@
  * I don't make any assumptions about the memory for the apipe.  It could be
  * kmalloced, embedded in a struct, whatever.  Hence the lack of refcnts too.
  *
- * Everything is multi-reader, multi-writer.  Pretty simple inside (no
- * fancy tricks, just went with a cv_lock for all ops).  If we want to
- * make this faster in the future, we can take a look at using some tricks
- * from the BCQs and Xen ring buffers to allow concurrent reads and writes.
+ * By default, everything is multi-reader, multi-writer.  Pretty simple inside
+ * (no fancy tricks, just went with a cv_lock for all ops).  Reads and writes
+ * of many elements copy them in at most two chunks and do one wakeup.
  *
- * Likewise, we can make this a little more complicated and optimize for copying
- * many elements at once (like sys_pipe).  But we can hold off til we see how
- * people use this.  For now, this is built for one copy at a time. */
+ * If a pipe will only ever have one reader and one writer at a time, set it up
+ * with apipe_init_spsc().  Then reads and writes don't take the lock, unless
+ * they need to sleep or wake the other side, like the Xen rings: the reader
+ * only moves rd_off, and the writer only moves wr_off.  In this mode,
+ * apipe_read_cond()'s f is called without the lock held. */
 
 #pragma once
 
@@ -67,11 +68,17 @@ struct atomic_pipe {
 	struct cond_var				ap_general_readers;
 	struct cond_var				ap_writers;
 	bool						ap_has_priority_reader;
+	bool						ap_spsc;
+	bool						ap_rd_sleeping;	/* SPSC only */
+	bool						ap_wr_sleeping;	/* SPSC only */
 };
 
 void apipe_init(struct atomic_pipe *ap, void *buf, size_t buf_sz,
                 size_t elem_sz);
+void apipe_init_spsc(struct atomic_pipe *ap, void *buf, size_t buf_sz,
+                     size_t elem_sz);
 int apipe_read(struct atomic_pipe *ap, void *buf, size_t nr_elem);
+int apipe_read_locked(struct atomic_pipe *ap, void *buf, size_t nr_elem);
 int apipe_read_cond(struct atomic_pipe *ap,
 		    int(*f)(struct atomic_pipe *pipe, void *arg), void *arg);
 int apipe_write(struct atomic_pipe *ap, void *buf, size_t nr_elem);
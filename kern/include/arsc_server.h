@@ -14,12 +14,14 @@
 #include <syscall.h>
 #include <error.h>
 
-extern struct proc_list arsc_proc_list;
-extern spinlock_t arsc_proc_lock;
+/* Each server core polls the rings of the procs on its list */
+struct arsc_server {
+	spinlock_t					lock;
+	struct proc_list			procs;
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
+void arsc_init(void);
 syscall_sring_t* sys_init_arsc(struct proc* p);
 intreg_t syscall_async(struct proc* p, syscall_req_t *syscall);
 void arsc_server(uint32_t srcid, long a0, long a1, long a2);
-
-static intreg_t process_generic_syscalls(struct proc* p, size_t max);
 #endif //ARSC_SERVER
@@ -55,6 +55,8 @@ typedef struct spinlock spinlock_t;
 #define SPINLOCK_INITIALIZER_IRQSAVE SPINLOCK_INITIALIZER
 #endif
 
+#include <lockstat.h>
+
 /* Arch dependent helpers/funcs: */
 extern inline void __spinlock_init(spinlock_t *lock);
 extern inline bool spin_locked(spinlock_t *lock);
@@ -77,16 +79,30 @@ void spinlock_debug(spinlock_t *lock);
 /* Just inline the arch-specific __ versions */
 static inline void spin_lock(spinlock_t *lock)
 {
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled)) {
+		lockstat_spin_lock(lock);
+		return;
+	}
+#endif
 	__spin_lock(lock);
 }
 
 static inline bool spin_trylock(spinlock_t *lock)
 {
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled))
+		return lockstat_spin_trylock(lock);
+#endif
 	return __spin_trylock(lock);
 }
 
 static inline void spin_unlock(spinlock_t *lock)
 {
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled))
+		lockstat_released(lock);
+#endif
 	__spin_unlock(lock);
 }
 
@@ -11,6 +11,7 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <alarm.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -20,6 +21,59 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+/* Request queue tunables */
+#define BDEV_PLUG_USEC			100		/* how long we wait to build batches */
+#define BDEV_MAX_BATCH_SECTORS	1024	/* sectors per merged IO */
+#define BDEV_MAX_IN_FLIGHT		4		/* batches the device works on at once */
+#define BDEV_LATENCY_USEC		5000	/* the RAM disk's fake IO latency */
+
+struct block_device;
+struct block_request;
+TAILQ_HEAD(breq_tailq, block_request);
+
+/* A run of adjacent requests that the device does as one IO */
+struct bdev_batch {
+	struct block_device			*bdev;
+	struct breq_tailq			breqs;
+	struct alarm_waiter			done_waiter;	/* fakes the completion IRQ */
+	bool						busy;
+};
+
+/* Per-device request queue.  Submitted requests wait here, sorted by sector,
+ * while the queue is plugged.  When it unplugs, adjacent requests are merged
+ * into batches, and up to BDEV_MAX_IN_FLIGHT batches go to the device.  The
+ * rest wait for a batch to complete. */
+struct bdev_queue {
+	spinlock_t					lock;
+	struct breq_tailq			pending;
+	unsigned long				nr_pending_sectors;
+	bool						plugged;
+	bool						unplug_armed;
+	struct alarm_waiter			unplug_waiter;
+	unsigned int				nr_in_flight;
+	struct bdev_batch			batches[BDEV_MAX_IN_FLIGHT];
+};
+
+struct buffer_head;
+TAILQ_HEAD(bh_tailq, buffer_head);
+
+/* Metadata buffer cache.  The blocks live in the bdev's page map, which already
+ * indexes them by (bdev, block).  This tracks the BHs handed out by
+ * bdev_get_buffer() on a CLOCK list, and evicts their pages once the device
+ * caches more than max_bytes of buffers. */
+#define BDEV_BCACHE_MAX_BYTES	(4 * 1024 * 1024)
+
+struct bdev_bcache {
+	spinlock_t					lock;
+	struct bh_tailq				lru;		/* CLOCK order, hand at the head */
+	size_t						nr_bytes;
+	size_t						max_bytes;
+	bool						shrinking;
+	unsigned long				nr_hits;
+	unsigned long				nr_misses;
+	unsigned long				nr_evictions;
+};
+
 /* Every block device is represented by one of these, with custom methods, as
  * applicable for the type of device.  Subject to massive changes. */
 #define BDEV_INLINE_NAME 10
@@ -31,10 +85,9 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
+	struct bdev_queue			b_queue;
+	struct bdev_bcache			b_bcache;
 	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -42,6 +95,7 @@ struct block_device {
 #define BH_UPTODATE		0x002	/* buffer is filled with file data */
 #define BH_DIRTY		0x004	/* buffer is dirty */
 #define BH_NEEDS_ZEROED	0x008	/* buffer should be 0'd, not read in */
+#define BH_REFERENCED	0x010	/* used since the CLOCK hand last passed */
 
 /* This maps to and from a buffer within a page to a block(s) on a bdev.  Some
  * of it might not be needed later, etc (page, numblock). */
@@ -53,6 +107,7 @@ struct buffer_head {
 	struct block_device			*bh_bdev;
 	unsigned long				bh_sector;
 	unsigned int				bh_nr_sector;		/* length (in sectors) */
+	TAILQ_ENTRY(buffer_head)	bh_lru;				/* bdev_get_buffer() BHs */
 };
 struct kmem_cache *bh_kcache;
 
@@ -62,6 +117,10 @@ struct buffer_head *bdev_get_buffer(struct block_device *bdev,
                                     unsigned long blk_num, unsigned int blk_sz);
 void bdev_dirty_buffer(struct buffer_head *bh);
 void bdev_put_buffer(struct buffer_head *bh);
+void bdev_set_bcache_max(struct block_device *bdev, size_t max_bytes);
+void print_bdev_bcache(struct block_device *bdev);
+int bdev_write_pages(struct block_device *bdev, struct page **pages,
+                     unsigned int nr, bool only_dirty);
 
 /* This encapsulates the work of a request (instead of having a variety of
  * slightly-different functions for things like read/write and scatter-gather
@@ -72,7 +131,11 @@ void bdev_put_buffer(struct buffer_head *bh);
  *
  * bhs normally points to the inline version (enough for a page).  kmalloc
  * another array of BH pointers if you want more.  The BHs do not need to be
- * linked or otherwise associated with a page mapping. */
+ * linked or otherwise associated with a page mapping.
+ *
+ * Requests complete asynchronously: the callback runs (in RKM context) once
+ * the IO is done, and the request can be freed then.  Callers that want to
+ * wait use generic_breq_done() and sleep_on_breq(). */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
 struct block_request;
 struct block_request {
@@ -83,6 +146,10 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	/* Used by the request queue */
+	TAILQ_ENTRY(block_request)	link;
+	unsigned long				first_sector;
+	unsigned long				end_sector;		/* one past the last BH */
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
@@ -91,6 +158,8 @@ struct kmem_cache *breq_kcache;	/* for the block requests */
 #define BREQ_WRITE 			0x002
 
 void block_init(void);
+void bdev_queue_init(struct block_device *bdev);
+void bdev_bcache_init(struct block_device *bdev);
 struct block_device *get_bdev(char *path);
 void free_bhs(struct page *page);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
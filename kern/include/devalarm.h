@@ -11,6 +11,7 @@
 #include <alarm.h>
 #include <event.h>
 #include <atomic.h>
+#include <ros/alarm_slots.h>
 
 struct proc_alarm {
 	TAILQ_ENTRY(proc_alarm)		link;
@@ -19,6 +20,9 @@ struct proc_alarm {
 	struct alarm_waiter			a_waiter;
 	struct proc					*proc;
 	struct event_queue			*ev_q;
+	struct alarm_slots			*slots;		/* kva, if in slot mode */
+	struct page					*slots_page;
+	spinlock_t					slots_lock;	/* serializes rearming */
 };
 TAILQ_HEAD(proc_alarm_list, proc_alarm);
 
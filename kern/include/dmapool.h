@@ -0,0 +1,25 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * DMA pool stats, for #kprof/dmapoolstat.  The pool interface itself is the
+ * Linux one, in linux/compat_todo.h. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define DMA_POOL_NAME_LEN			32
+
+struct dma_pool_stats {
+	char						name[DMA_POOL_NAME_LEN];
+	size_t						size;
+	size_t						nr_pages;
+	size_t						nr_remote_pages;	/* not on their core's node */
+	size_t						nr_in_use;			/* blocks out of the pages */
+	size_t						nr_cached;			/* of those, in core caches */
+	uint64_t					nr_allocs;
+	uint64_t					nr_cache_hits;
+	uint64_t					nr_frees;
+};
+
+size_t dma_pool_get_stats(struct dma_pool_stats **stats_p);
@@ -148,6 +148,7 @@ typedef long elf_aux_t[2];
 
 struct file;
 bool is_valid_elf(struct file *f);
+void print_elf_images(void);
 int load_elf(struct proc* p, struct file* f,
              int argc, char *argv[], int envc, char *envp[]);
 ssize_t get_startup_argc(struct proc *p);
@@ -17,6 +17,7 @@
 #include <sys/queue.h>
 #include <atomic.h>
 #include <mm.h>
+#include <rcu.h>
 #include <vfs.h>
 #include <schedule.h>
 #include <devalarm.h>
@@ -24,6 +25,14 @@
 #include <arch/vmm/vmm.h>
 
 TAILQ_HEAD(vcore_tailq, vcore);
+
+/* Per-vcore event counts.  Only the core running the vcore bumps them (see
+ * cur_vcore_stats()), so they don't need atomics. */
+struct vcore_stats {
+	uint64_t nr_syscalls;
+	uint64_t nr_page_faults;
+	uint64_t nr_notifs;
+};
 /* 'struct proc_list' declared in sched.h (not ideal...) */
 
 #define PROC_PROGNAME_SZ 20
@@ -31,6 +40,7 @@ TAILQ_HEAD(vcore_tailq, vcore);
 struct proc {
 	TAILQ_ENTRY(proc) proc_arsc_link;
 	TAILQ_ENTRY(proc) sibling_link;
+	TAILQ_ENTRY(proc) reap_link;	/* on the reaper's list, once freed */
 	spinlock_t proc_lock;
 	struct user_context scp_ctx; 	/* context for an SCP.  TODO: move to vc0 */
 	char user[64]; /* user name */
@@ -56,11 +66,14 @@ struct proc {
 	struct cond_var child_wait;	/* signal for dying or o/w waitable child */
 	uint32_t state;				// Status of the process
 	struct kref p_kref;		/* Refcnt */
+	struct proc *pid_hash_next;	/* RCU: pid2proc() walks these locklessly */
+	struct rcu_head p_rcu;
 	uint32_t env_flags;
 	/* Lists of vcores */
 	struct vcore_tailq online_vcs;
 	struct vcore_tailq bulk_preempted_vcs;
 	struct vcore_tailq inactive_vcs;
+	struct vcore_stats *vc_stats;	/* one per vcore, up to max_vcores */
 	/* Scheduler mgmt (info, data, whatever) */
 	struct sched_proc_data ksched_data;
 
@@ -85,7 +98,14 @@ struct proc {
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
+	struct vmr_tree vm_tree;	/* same VMRs, for lookups */
+	struct vm_region *vmr_hint;	/* last VMR found, protected by vmr_lock */
 	int vmr_history;
+	uint64_t nr_tlb_shootdowns;	/* protected by the proc_lock */
+	uint64_t nr_tlb_shootdown_ipis;
+	uint64_t nr_cow_shared;		/* pages shared at fork, by the pte_lock */
+	uint64_t nr_cow_faults;
+	uint64_t nr_cow_copies;
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
@@ -108,9 +128,6 @@ struct proc {
 	struct chan					*dot;
 
 
-	/* UCQ hashlocks */
-	struct hashlock				*ucq_hashlock;
-	struct small_hashlock		ucq_hl_noref;	/* don't reference directly */
 	/* For devalarm */
 	struct proc_alarm_set		alarmset;
 	struct cv_lookup_tailq		abortable_sleepers;
@@ -122,6 +139,13 @@ struct proc {
 	struct strace				*strace;
 	bool						strace_on;
 	bool						strace_inherit;
+
+	/* Counters that only count while we run, for #proc/PID/perf */
+	struct perfmon_proc			*perf;
+	/* Hardware cache/membw class of service, 0 for the default (x86 RDT) */
+	int							rdt_cos;
+	/* Kernel memory charged to us, for #proc/PID/kmem */
+	struct kmem_acct			*kmem_acct;
 };
 
 /* Til we remove all Env references */
@@ -137,6 +161,7 @@ extern atomic_t num_envs;		// Number of envs
 int		env_setup_vm(env_t *e);
 void	env_user_mem_free(env_t* e, void* start, size_t len);
 void	env_pagetable_free(env_t* e);
+size_t	env_pagetable_bytes(env_t* e);
 
 typedef int (*mem_walk_callback_t)(env_t* e, pte_t pte, void* va, void* arg);
 int		env_user_mem_walk(env_t* e, void* start, size_t len, mem_walk_callback_t callback, void* arg);
@@ -111,12 +111,16 @@ the crap we keep around for glibc/posix is (probably still) in octal. */
 #define EXT2_NOCOMPR_FL			0x00000400	/* access raw compressed data */
 #define EXT2_ECOMPR_FL			0x00000800	/* compression error */
 /* End of compression flags */
-#define EXT2_BTREE_FL			0x00010000	/* b-tree format directory */
-#define EXT2_INDEX_FL			0x00010000	/* hash indexed directory */
-#define EXT2_IMAGIC_FL			0x00020000	/* AFS directory */
-#define EXT3_JOURNAL_DATA_FL	0x00040000	/* journal file data */
+#define EXT2_BTREE_FL			0x00001000	/* b-tree format directory */
+#define EXT2_INDEX_FL			0x00001000	/* hash indexed directory */
+#define EXT2_IMAGIC_FL			0x00002000	/* AFS directory */
+#define EXT3_JOURNAL_DATA_FL	0x00004000	/* journal file data */
 #define EXT2_RESERVED_FL		0x80000000	/* reserved for ext2 library */
 
+/* Superblock s_flags */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	/* dir hashes use signed chars */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* dir hashes use unsigned chars */
+
 /* Directory entry file types */
 #define EXT2_FT_UNKNOWN			0	/* unknown file type */
 #define EXT2_FT_REG_FILE		1	/* regular file */
@@ -181,7 +185,9 @@ struct ext2_sb {
 /* Next chunk, Other options */
 	uint32_t					s_default_mount_opts;
 	uint32_t					s_first_meta_bg;	/* BG id of first meta */
-	uint8_t						s_reserved[760];
+	uint8_t						s_reserved1[88];	/* ext3/4 stuff we skip */
+	uint32_t					s_flags;			/* misc, e.g. hash sign */
+	uint8_t						s_reserved2[668];
 };
 
 /* All block ids are absolute (not relative to the BG). */
@@ -242,6 +248,41 @@ struct ext2_dirent {
 	uint8_t						dir_name[256];		/* might be < 255 on disc */
 };
 
+/* Hash indexed (htree) directories.  Block 0 of the dir starts with the . and
+ * .. dirents, and .. covers the rest of the block, which holds the root info
+ * and the first level of dx_entries.  Interior index blocks are one empty
+ * dirent covering the whole block, followed by dx_entries.  The first entry's
+ * hash slot holds the count and limit instead, and its hash is implicitly 0.
+ * Entries are sorted by hash and point at the dir block covering hashes from
+ * theirs up to the next one's.  The leaves are normal dirent blocks. */
+#define EXT2_HASH_LEGACY			0
+#define EXT2_HASH_HALF_MD4			1
+#define EXT2_HASH_TEA				2
+#define EXT2_HASH_LEGACY_UNSIGNED	3
+#define EXT2_HASH_HALF_MD4_UNSIGNED	4
+#define EXT2_HASH_TEA_UNSIGNED		5
+
+#define EXT2_DX_MAX_LEVELS			3		/* root plus two (ext4 largedir) */
+#define EXT2_DX_BLOCK_MASK			0x00ffffff
+
+struct ext2_dx_root_info {
+	uint32_t					reserved_zero;
+	uint8_t						hash_version;
+	uint8_t						info_length;		/* 8 */
+	uint8_t						indirect_levels;	/* 0 if root points at leaves */
+	uint8_t						unused_flags;
+};
+
+struct ext2_dx_entry {
+	uint32_t					hash;				/* low bit: collision cont */
+	uint32_t					block;				/* dir block */
+};
+
+struct ext2_dx_countlimit {
+	uint16_t					limit;				/* max entries in the block */
+	uint16_t					count;				/* including this one */
+};
+
 /* Every FS must extern it's type, and be included in vfs_init() */
 extern struct fs_type ext2_fs_type;
 
@@ -249,15 +290,68 @@ extern struct fs_type ext2_fs_type;
  * the block group descriptor table.  For now, s_dirty (VFS) will track the
  * dirtiness of all things hanging off the sb.  Both of the objects contained
  * are kmalloc()d, as is this struct. */
+/* Block preallocation.  When a file needs a block, we grab a run of free blocks
+ * from the bitmap, and hand out the rest of the run for the file's next blocks
+ * without touching the bitmap again.  Small files share one window per FS (a
+ * locality group), so that they get packed together instead of each holding
+ * onto a run.  Unused blocks go back to the bitmap when the window is dropped. */
+#define EXT2_PREALLOC_BLOCKS		32
+#define EXT2_LG_PREALLOC_BLOCKS		256
+#define EXT2_LG_MAX_FILE_BLOCKS		16		/* files below this use the LG */
+
+struct ext2_prealloc {
+	spinlock_t					pa_lock;
+	uint32_t					pa_start;			/* next FS block to use */
+	uint32_t					pa_len;				/* 0 if empty */
+};
+
 struct ext2_sb_info {
 	struct ext2_sb				*e2sb;
 	struct ext2_block_group		*e2bg;
 	unsigned int				nr_bgs;
+	struct ext2_prealloc		lg_pa;				/* shared by small files */
+};
+
+/* A run of an inode's blocks that are on consecutive FS blocks */
+#define EXT2_NR_EXTENTS			8
+
+struct ext2_extent {
+	uint32_t					e_ino_blk;			/* first block of the file */
+	uint32_t					e_fs_blk;			/* first FS block */
+	uint32_t					e_len;				/* 0 if unused */
+};
+
+/* In-memory name index of an unindexed directory, built by the first lookup
+ * that scans the whole dir.  Once built, it has every entry, so a miss means
+ * the name isn't there. */
+#define EXT2_DIRHASH_MIN_BLOCKS	2		/* smaller dirs just get scanned */
+
+struct ext2_dirhash_ent {
+	struct ext2_dirhash_ent		*next;
+	uint32_t					ino;
+	uint8_t						namelen;
+	char						name[];				/* not null terminated */
+};
+
+struct ext2_dirhash {
+	unsigned int				nr_buckets;			/* power of 2 */
+	unsigned int				nr_ents;
+	struct ext2_dirhash_ent		*buckets[];
 };
 
 /* Inode in-memory data.  This stuff is in cpu-native endianness.  If we start
  * using the data in the actual inode and in the buffer cache, change
- * ext2_my_bh() and its two callers.  Assume this data is dirty. */
+ * ext2_my_bh() and its two callers.  Assume this data is dirty.
+ *
+ * i_ext caches block mappings we found in the indirect tables, so that reading
+ * a file sequentially doesn't walk the tables for every page.  i_dirhash is the
+ * name index for unindexed dirs, and i_pa is the file's block preallocation. */
 struct ext2_i_info {
 	uint32_t					i_block[15];		/* list of blocks reserved*/
+	spinlock_t					i_ext_lock;
+	unsigned int				i_ext_last;			/* last extent we used */
+	unsigned int				i_ext_victim;		/* next one to replace */
+	struct ext2_extent			i_ext[EXT2_NR_EXTENTS];
+	spinlock_t					i_dirhash_lock;
+	struct ext2_dirhash			*i_dirhash;			/* dirs only, or 0 */	struct ext2_prealloc		i_pa;
 };
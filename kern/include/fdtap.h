@@ -30,6 +30,12 @@ struct fd_tap {
 	void						*data;
 };
 
+/* Max taps handled by one call to the batched ops */
+#define FDTAP_BATCH				32
+
 int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
+int add_fd_taps(struct proc *p, struct fd_tap_req *tap_reqs, int nr_reqs);
 int remove_fd_tap(struct proc *p, int fd);
+int remove_fd_taps(struct proc *p, struct fd_tap_req *tap_reqs, int nr_reqs);
+int modify_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
 int fire_tap(struct fd_tap *tap, int filter);
@@ -29,6 +29,8 @@
 
 #pragma once
 #include <ns.h>
+#include <rcu.h>
+#include <alarm.h>
 
 enum {
 	Addrlen = 64,
@@ -81,6 +83,9 @@ struct conv {
 	uint32_t tos;				/* type of service */
 	int ignoreadvice;			/* don't terminate connection on icmp errors */
 	bool nonblock;				/* set to nonblocking, O_NONBLOCK style */
+	uint32_t busypoll;			/* usec to spin on the NIC before blocking */
+	bool reuseport;				/* may announce a port others announced */
+	uint64_t pacing_rate;		/* bytes/sec for the ifc's fq, 0 for no limit */
 
 	uint8_t ipversion;
 	uint8_t laddr[IPaddrlen];	/* local IP address */
@@ -161,6 +166,11 @@ struct medium {
 	/* address resolution */
 	void (*ares) (struct Fs *, int unused_int, uint8_t * unused_uint8_p_t, uint8_t *, int, int);	/* resolve */
 	void (*areg) (struct Ipifc * unused_Ipifc, uint8_t * unused_uint8_p_t);	/* register */
+	void (*arefresh) (struct Ipifc *, uint8_t *);	/* revalidate */
+
+	/* spin on the device for usec or until done(arg), instead of waiting
+	 * for an interrupt.  returns false if the device can't. */
+	bool (*busypoll) (struct Ipifc *, uint64_t, bool (*)(void *), void *);
 
 	/* v6 address generation */
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
@@ -222,6 +232,7 @@ struct Ipifc {
 	int mbps;					/* megabits per second */
 	void *arg;					/* medium specific */
 	int reassemble;				/* reassemble IP packets before forwarding */
+	struct Ipfq *fq;			/* fair queue on output, if on */
 
 	/* these are used so that we can unbind on the fly */
 	spinlock_t idlock;
@@ -254,9 +265,16 @@ struct Ipmulti {
 
 /*
  *  hash table for 2 ip addresses + 2 ports
+ *
+ *  Connected convs hash on the whole 4-tuple into conns, which doubles when
+ *  it averages more than one conv a bucket.  Announced convs go in listen,
+ *  keyed on what they match.  Lookups take no locks, just RCU; lock only
+ *  serializes writers.  A conv found this way can be closed and reused under
+ *  the reader, so recheck its addresses once it is locked.
  */
 enum {
 	Nipht = 521,				/* convenient prime */
+	Niphtconns = 256,			/* initial conns buckets, a power of 2 */
 
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
@@ -268,17 +286,29 @@ struct Iphash {
 	struct Iphash *next;
 	struct conv *c;
 	int match;
+	struct rcu_head rcu;
+};
+
+struct Iphtab {
+	uint32_t mask;
+	struct rcu_head rcu;
+	struct Iphash *b[];
 };
 
-struct Iphash;
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	qlock_t lock;
+	uint32_t seed;
+	unsigned int nconns;
+	struct Iphtab *conns;
+	struct Iphash *listen[Nipht];
 };
+void iphtinit(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
+struct conv *iphtlookconn(struct Ipht *ht, uint8_t *sa, uint16_t sp,
+                          uint8_t *da, uint16_t dp);
 
 /*
  *  one per multiplexed Protocol
@@ -348,6 +378,10 @@ struct Fs {
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;		/* used as temp when reinjecting routes */
+	struct rtrie *v4trie;		/* compiled from v4root, for lookups */
+	struct rtrie *v6trie;
+	struct rendez rtrv;			/* wakes routetrieproc */
+	bool rtdirty;				/* routes changed since the last rebuild */
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -465,6 +499,7 @@ struct RouteTree {
 	struct Ipifc *ifc;
 	char tag[4];
 	struct kref kref;
+	struct rcu_head rcu;
 };
 
 struct V4route {
@@ -494,6 +529,10 @@ extern void v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 extern void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock);
 extern void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock);
 extern struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c);
+extern void routeinit(struct Fs *f);
+extern struct rtrie *rtriebuild(struct route **r, int n, int alen);
+extern struct route *rtrielookup(struct rtrie *t, uint8_t *a);
+extern void rtriefree(struct rtrie *t);
 extern struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c);
 extern long routeread(struct Fs *f, char *unused_char_p_t, uint32_t, int);
 extern long routewrite(struct Fs *f, struct chan *, char *unused_char_p_t, int);
@@ -529,6 +568,7 @@ struct arpent {
 	struct block *last;
 	uint64_t ctime;			/* time entry was created or refreshed */
 	uint64_t utime;			/* time entry was last used */
+	uint64_t ftime;			/* time we last asked to refresh it */
 	uint8_t state;
 	struct arpent *nextrxt;		/* re-transmit chain */
 	uint64_t rtime;			/* time for next retransmission */
@@ -543,10 +583,12 @@ extern int arpwrite(struct Fs *, char *unused_char_p_t, long);
 extern struct arpent *arpget(struct arp *, struct block *bp, int version,
 							 struct Ipifc *ifc, uint8_t * ip, uint8_t * h);
 extern void arprelease(struct arp *, struct arpent *a);
+extern bool arpsolicit(struct arp *, struct arpent *a);
 extern struct block *arpresolve(struct arp *, struct arpent *a,
 								struct medium *type, uint8_t * mac);
 extern void arpenter(struct Fs *, int version, uint8_t * ip,
 					 uint8_t * mac, int len, int norefresh);
+extern int arpstats(struct Fs *, char *, int);
 
 /*
  * ipaux.c
@@ -614,6 +656,8 @@ extern int iptentative(struct Fs *, uint8_t * addr);
 extern int ipisbm(uint8_t *);
 extern int ipismulticast(uint8_t *);
 extern struct Ipifc *findipifc(struct Fs *, uint8_t * remote, int type);
+extern bool ipifcbusypoll(struct Fs *, uint8_t *, uint64_t,
+                          bool (*)(void *), void *);
 extern void findprimaryip(struct Fs *, uint8_t * unused_uint8_p_t);
 extern void findlocalip(struct Fs *, uint8_t * local, uint8_t * remote);
 extern int ipv4local(struct Ipifc *ifc, uint8_t * addr);
@@ -632,6 +676,8 @@ extern void ipifcaddroute(struct Fs *, int unused_int,
 extern void ipifcremroute(struct Fs *, int unused_int, uint8_t * u8pt,
 						  uint8_t * u8pt2);
 extern void ipifcremmulti(struct conv *c, uint8_t * ma, uint8_t * ia);
+extern void ipifcoput(struct Ipifc *ifc, struct block *bp, int version,
+                      uint8_t *gate, struct conv *c);
 extern void ipifcaddmulti(struct conv *c, uint8_t * ma, uint8_t * ia);
 extern long ipselftabread(struct Fs *, char *a, uint32_t offset, int n);
 extern void ipsendra6(struct Fs *f, int on);
@@ -655,6 +701,7 @@ extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbsum_scalar(uint8_t *addr, int len);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
@@ -665,6 +712,9 @@ static inline void ptclcsum_finalize(struct block *bp, unsigned int feat)
 	unsigned int flag = bp->flag & BCKSUM_FLAGS;
 	uint8_t *csum_store;
 
+	/* NICs that segment also checksum the segments */
+	if (flag & feat & (Btso | Buso))
+		return;
 	if (flag && (flag & feat) != flag) {
 		csum_store = bp->rp + bp->checksum_start + bp->checksum_offset;
 		/* NOTE pseudo-header partial checksum (if any) is already placed at
@@ -938,6 +988,7 @@ struct netfile {
 	int nmaddr;					/* number of multicast addresses */
 
 	struct queue *in;			/* input buffer */
+	struct etherring *ring;		/* user packet ring, replaces in */
 };
 
 /*
@@ -965,6 +1016,7 @@ enum {
 	NETF_PADMIN = (1 << NETF_PADMIN_SHIFT),	/* device pads to mintu */
 	NETF_SG	= (1 << NETF_SG_SHIFT),		/* device can do scatter/gather */
 	NETF_TSO = (1 << NS_TSO_SHIFT),		/* device can do TSO */
+	NETF_USO = (1 << NS_USO_SHIFT),		/* device can segment UDP */
 	NETF_LRO = (1 << NETF_LRO_SHIFT),	/* device can do LRO */
 };
 /*
@@ -1045,6 +1097,26 @@ enum {
 	MaxEther = 32,
 	MaxFID = 16,
 	Ntypes = 8,
+	Maxqueues = 8,		/* RX and TX queues per interface */
+	Rsskeylen = 40,		/* Toeplitz hash key */
+	Rssretalen = 128,	/* RSS redirection table entries */
+};
+
+/* RX interrupt coalescing state, managed by devether.  In adaptive mode a
+ * sampler maps the RX packet rate from [rate_low, rate_high] linearly onto
+ * [usec_low, usec_high]. */
+struct ethercoal {
+	qlock_t qlock;
+	int usec;					/* current hold-off, -1: driver default */
+	bool adaptive;
+	bool armed;					/* sampler alarm is set */
+	int usec_low;
+	int usec_high;
+	uint32_t rate_low;			/* pkts/sec */
+	uint32_t rate_high;
+	int last_in;				/* inpackets at the last sample */
+	uint64_t last_tsc;
+	struct alarm_waiter alarm;
 };
 
 struct ether {
@@ -1074,6 +1146,35 @@ struct ether {
 
 	struct queue *oq;
 
+	/* Multi-queue NICs set nr_txq and nr_rxq in their reset routine.  oq is
+	 * txq[0].  etheroq() picks a TX queue by core and calls transmit_queue,
+	 * if set, instead of transmit.  The driver programs rss_key and rss_reta
+	 * when it attaches; they spread RX flows over the nr_rxq queues, each of
+	 * which should interrupt etherqcore(i).  Queues registered with
+	 * etherqirq() have their own vector, qvec[i] (0 if not), which the
+	 * "irqcore" ctl can route to another core. */
+	int nr_txq;
+	int nr_rxq;
+	struct queue *txq[Maxqueues];
+	int qvec[Maxqueues];
+	int qcore[Maxqueues];
+	void (*transmit_queue) (struct ether *, int);
+	uint8_t rss_key[Rsskeylen];
+	uint8_t rss_reta[Rssretalen];
+
+	/* Busy polling, optional.  poll passes up to budget received packets
+	 * upstream from any RX queue without waiting for an interrupt.
+	 * busypoll(1) and busypoll(0) bracket a run of polls; RX interrupts stay
+	 * masked in between, so a spinning reader isn't raced by the rproc. */
+	int (*poll) (struct ether *, int);
+	void (*busypoll) (struct ether *, int);
+
+	/* RX interrupt coalescing, optional.  coalesce has the NIC hold off RX
+	 * interrupts for about usec, clamped to what it can do; 0 means an
+	 * interrupt per packet.  Called from process context. */
+	void (*coalesce) (struct ether *, int);
+	struct ethercoal coal;
+
 	qlock_t vlq;				/* array change */
 	int nvlan;
 	struct ether *vlans[MaxFID];
@@ -1082,6 +1183,11 @@ struct ether {
 };
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern void etherringfree(struct netfile *);
+extern bool etherbusypoll(struct chan *, uint64_t, bool (*)(void *), void *);
+extern int etherqcore(int qidx);
+extern int etherqirq(struct ether *, int qidx, int irq,
+                     void (*)(struct hw_trapframe *, void *), void *, uint32_t);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
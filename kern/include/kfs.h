@@ -15,12 +15,28 @@
 /* Every FS must extern it's type, and be included in vfs_init() */
 extern struct fs_type kfs_fs_type;
 
+/* Compressed files, with CONFIG_KFS_COMPRESS.  scripts/kfs-zpack replaces a
+ * file in the CPIO with this header, then each chunk_sz chunk of the file,
+ * deflated (raw, no zlib header) on its own.  Chunk i is at offsets[i] through
+ * offsets[i + 1], from the start of the header, and is stored as is if it
+ * didn't shrink.  We inflate a page's chunk when the page is read, so the page
+ * can be dropped and read again later.  Fields are little endian. */
+#define KFS_Z_MAGIC				"KFSZ"
+
+struct kfs_z_hdr {
+	char					magic[4];
+	uint32_t				chunk_sz;		/* must be PGSIZE */
+	uint32_t				size;			/* uncompressed */
+	uint32_t				offsets[];		/* nr_chunks + 1 */
+};
+
 /* KFS-specific inode info.  Could use a union, but I want to init filestart to
  * 0 to catch bugs. */
 struct kfs_i_info {
 	struct dentry_tailq		children;		/* our childrens */
 	void					*filestart;		/* or our file location */
 	size_t					init_size;		/* file size on the backing store */
+	bool					compressed;		/* filestart is a kfs_z_hdr */
 };
 
 /* KFS VFS functions.  Exported for use by similar FSs (devices, for now) */
@@ -10,10 +10,30 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 13
+/* kmalloc's caches go from KMALLOC_SMALLEST to KMALLOC_LARGEST in power of two
+ * orders.  Each order is split into KMALLOC_CLASSES_PER_ORDER size classes, so
+ * with a shift of 2 we have classes at 1x, 1.25x, 1.5x, and 1.75x of a power of
+ * two.  That caps the internal fragmentation at 25% instead of 50%.  Sizes
+ * include the kmalloc_tag. */
+#define KMALLOC_NR_ORDERS 13
+#define KMALLOC_CLASS_SHIFT 2
+#define KMALLOC_CLASSES_PER_ORDER (1 << KMALLOC_CLASS_SHIFT)
+#define NUM_KMALLOC_CACHES (KMALLOC_NR_ORDERS * KMALLOC_CLASSES_PER_ORDER + 1)
 #define KMALLOC_ALIGNMENT 16
 #define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_LARGEST (KMALLOC_SMALLEST << KMALLOC_NR_ORDERS)
+
+/* Per size class statistics.  Allocations too big for a cache go to the page
+ * allocator and are accounted in the last entry, KMALLOC_PAGES_CLASS. */
+#define KMALLOC_PAGES_CLASS NUM_KMALLOC_CACHES
+#define KMALLOC_NR_STAT_CLASSES (NUM_KMALLOC_CACHES + 1)
+
+struct kmalloc_class_stats {
+	uint64_t nr_allocs;
+	uint64_t nr_frees;
+	uint64_t bytes_requested;
+	uint64_t bytes_allocated;
+};
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
@@ -25,20 +45,32 @@ void *krealloc(void *buf, size_t size, int flags);
 void *kreallocarray(void *buf, size_t nmemb, size_t size, int flags);
 int kmalloc_refcnt(void *buf);
 void kmalloc_incref(void *buf);
+void kmalloc_charge(void *buf);
+void kmalloc_uncharge(void *buf);
 void kfree(void *buf);
 void kmalloc_canary_check(char *str);
+size_t kmalloc_class_size(int class);
+void kmalloc_get_class_stats(int class, struct kmalloc_class_stats *stats);
+void kmalloc_reset_stats(void);
 void *debug_canary;
 
 /* Flags to pass to kmalloc */
 /* Not implemented yet. Block until it is available. */
 #define KMALLOC_WAIT			(1 << 2)
 #define KMALLOC_ERROR			(1 << 3)
+/* Which subsystem to account the memory to (kmem_acct.h), default KMEM_OTHER.
+ * These bits are above the Linux __GFP_ flags that drivers pass us. */
+#define KMALLOC_KMEM_SHIFT		28
+#define KMALLOC_KMEM_MASK		0x7
+#define KMALLOC_KMEM(subsys)	((subsys) << KMALLOC_KMEM_SHIFT)
 
 /* Kmalloc tag flags looks like this:
  *
  * +--------------28---------------+-----4------+
  * |       Flag specific data      |    Flags   |
  * +-------------------------------+------------+
+ *
+ * For CACHE and PAGES, the data is the kmem subsystem.
  */
 #define KMALLOC_TAG_CACHE		1	/* memory came from slabs */
 #define KMALLOC_TAG_PAGES		2	/* memory came from page allocator */
@@ -48,15 +80,20 @@ void *debug_canary;
 
 #define KMALLOC_CANARY 0xdeadbabe
 
+struct kmem_acct;
+
 /* The kmalloc align/free paths require that flags is at the end of this
- * struct, and that it is not padded. */
+ * struct, and that it is not padded.  The refcnt is a bare atomic instead of a
+ * kref, since the release function is always the same, which leaves room for
+ * the process the buffer is charged to. */
 struct kmalloc_tag {
 	union {
 		struct kmem_cache *my_cache;
 		size_t num_pages;
 		uint64_t unused_force_align;
 	};
-	struct kref kref;
+	atomic_t refcnt;
+	struct kmem_acct *acct;
 	uint32_t canary;
 	int flags;
 };
@@ -0,0 +1,52 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Kernel memory accounting.  Allocations are tagged with a subsystem and
+ * charged to the process that was current when they were made, so we can tell
+ * who is pinning kernel memory (#proc/PID/kmem, #kprof/kmemstat).
+ *
+ * Every charge also goes into per-core, per-subsystem counters, whether or not
+ * there was a process to charge.  A buffer freed on another core leaves one
+ * core's counter high and the other's low, but the sums are right.
+ *
+ * A process's kmem_acct outlives the process until everything charged to it is
+ * freed: each charged allocation holds a reference. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <kref.h>
+
+struct proc;
+
+enum {
+	KMEM_OTHER,
+	KMEM_BLOCK,		/* network and IO blocks */
+	KMEM_CHAN,		/* chans, while they are open */
+	KMEM_PGTBL,		/* page tables, not charged to processes */
+	KMEM_KSTACK,	/* kthread stacks, not charged to processes */
+	KMEM_VMR,		/* vm_regions */
+	KMEM_NR_SUBSYS,
+};
+
+extern const char *kmem_subsys_names[KMEM_NR_SUBSYS];
+
+struct kmem_acct {
+	struct kref					kref;
+	atomic_t					bytes[KMEM_NR_SUBSYS];
+};
+
+/* System-wide bytes per subsystem: all of them, and those charged to
+ * processes. */
+struct kmem_subsys_stats {
+	long						bytes;
+	long						charged;
+};
+
+struct kmem_acct *kmem_charge(int subsys, size_t bytes);
+void kmem_uncharge(struct kmem_acct *acct, int subsys, size_t bytes);
+void kmem_account(int subsys, long bytes);
+void kmem_acct_proc_init(struct proc *p);
+void kmem_acct_proc_free(struct proc *p);
+void kmem_acct_get_proc(struct proc *p, long bytes[KMEM_NR_SUBSYS]);
+void kmem_get_subsys_stats(struct kmem_subsys_stats stats[KMEM_NR_SUBSYS]);
@@ -61,3 +61,14 @@ extern char ktest_msg[1024];
 void register_ktest_suite(struct ktest_suite *suite);
 void run_ktest_suite(struct ktest_suite *suite);
 void run_registered_ktest_suites();
+bool run_named_ktest_suite(const char *name);
+
+#define KBENCH_RESULTS_SZ		16384
+
+/* Benchmark results.  Each report is one line of key=value pairs:
+ *	KBENCH name=NAME cores=N ops=N ns=N ns_per_op=N.NN
+ * printed to the console and saved for #regress/kbench. */
+void kbench_report(const char *name, int nr_cores, uint64_t nr_ops,
+                   uint64_t nsec);
+size_t kbench_results(char *buf, size_t bufsz);
+void kbench_clear_results(void);
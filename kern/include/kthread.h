@@ -28,6 +28,8 @@ TAILQ_HEAD(semaphore_tailq, semaphore);
 
 #define KTH_IS_KTASK			(1 << 0)
 #define KTH_SAVE_ADDR_SPACE		(1 << 1)
+/* Running shrinkers.  Allocations don't recurse into reclaim. */
+#define KTH_IN_RECLAIM			(1 << 2)
 #define KTH_KTASK_FLAGS			(KTH_IS_KTASK)
 #define KTH_DEFAULT_FLAGS		(KTH_SAVE_ADDR_SPACE)
 
@@ -46,7 +48,8 @@ struct kthread {
 	char						*name;
 	char						generic_buf[GENBUF_SZ];
 	struct systrace_record		*trace;
-	struct systrace_record		*strace;
+	bool						strace;		/* trace goes to the proc's strace too */
+	uint64_t					blocked_at;	/* nsec, for off-CPU profiling */
 };
 
 /* Semaphore for kthreads to sleep on.  0 or less means you need to sleep */
@@ -55,6 +58,10 @@ struct semaphore {
 	int 						nr_signals;
 	spinlock_t 					lock;
 	bool						irq_okay;
+#ifdef CONFIG_SEM_SPINWAIT
+	struct kthread				*holder;	/* last downer, a hint */
+	uint32_t					holder_core;
+#endif
 #ifdef CONFIG_SEMAPHORE_DEBUG
 	TAILQ_ENTRY(semaphore)		link;
 	bool						is_on_list;	/* would like better sys/queue.h */
@@ -100,9 +107,21 @@ struct cv_lookup_elm {
 };
 TAILQ_HEAD(cv_lookup_tailq, cv_lookup_elm);
 
+/* Per-core kstack counters.  allocs and frees count get_kstack() and
+ * put_kstack() calls; cache_hits are the allocs that didn't need a new stack. */
+struct kstack_stats {
+	uint64_t					nr_allocs;
+	uint64_t					nr_cache_hits;
+	uint64_t					nr_frees;
+	unsigned int				nr_cached;
+};
+
 uintptr_t get_kstack(void);
 void put_kstack(uintptr_t stacktop);
 uintptr_t *kstack_bottom_addr(uintptr_t stacktop);
+bool kstack_is_guard(uintptr_t va);
+void kstack_get_stats(int coreid, struct kstack_stats *stats);
+void kstack_reset_stats(void);
 void kthread_init(void);
 struct kthread *__kthread_zalloc(void);
 void restart_kthread(struct kthread *kthread);
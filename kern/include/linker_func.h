@@ -25,7 +25,14 @@
  *
  * And foo() will run during the third level of functions.
  *
- * For now, all levels are run sequentially, and with interrupts enabled. */
+ * All levels are run sequentially on core 0, and with interrupts enabled.
+ *
+ * linker_func_async() functions are for slow inits (e.g. probing hardware) that
+ * do not depend on anything else run at link time, nor on each other.  They
+ * are started before level 1, spread across the other cores, and all of them
+ * have finished by the time level 4 is done.
+ *
+ * Each function is timed, and the times are printed after level 4. */
 
 #pragma once
 
@@ -33,6 +40,7 @@
 #define __linkerfunc2  __attribute__((__section__(".linkerfunc2")))
 #define __linkerfunc3  __attribute__((__section__(".linkerfunc3")))
 #define __linkerfunc4  __attribute__((__section__(".linkerfunc4")))
+#define __linkerfuncasync  __attribute__((__section__(".linkerfuncasync")))
 
 typedef void (*linker_func_t)(void);
 
@@ -56,6 +64,11 @@ typedef void (*linker_func_t)(void);
 	linker_func_t __linkerfunc4 __##x = (x);                                   \
 	void (x)(void)
 
+#define linker_func_async(x)                                                   \
+	void (x)(void);                                                            \
+	linker_func_t __linkerfuncasync __##x = (x);                               \
+	void (x)(void)
+
 extern linker_func_t __linkerfunc1start[];
 extern linker_func_t __linkerfunc1end[];
 extern linker_func_t __linkerfunc2start[];
@@ -64,3 +77,5 @@ extern linker_func_t __linkerfunc3start[];
 extern linker_func_t __linkerfunc3end[];
 extern linker_func_t __linkerfunc4start[];
 extern linker_func_t __linkerfunc4end[];
+extern linker_func_t __linkerfuncasyncstart[];
+extern linker_func_t __linkerfuncasyncend[];
@@ -125,6 +125,8 @@ struct rb_root {
 	struct rb_node *rb_node;
 };
 
+/* Linux drivers want their RB_ROOT, not the one from sys/tree.h */
+#undef RB_ROOT
 #define RB_ROOT	(struct rb_root) { NULL, }
 
 static inline void rb_link_node(struct rb_node * node, struct rb_node * parent,
@@ -850,7 +852,7 @@ static inline void *lowmem_page_address(struct page *page)
 
 #define page_address(page) lowmem_page_address(page)
 
-#define netif_get_num_default_rss_queues() (8 /* FIXME */)
+#define netif_get_num_default_rss_queues() MIN(8, num_cores)
 
 static inline void netdev_rss_key_fill(void *buffer, size_t len)
 {
@@ -889,7 +891,7 @@ static inline const char *pci_name(const struct pci_device *pdev)
 #define dma_get_cache_alignment(...) (1 /* XXX */)
 #define dev_to_node(...) (0 /* XXX */)
 #define set_dev_node(...) /* TODO */
-#define num_online_cpus() (1U /* XXX */)
+#define num_online_cpus() ((unsigned int)num_cores)
 #define cpu_to_node(cpu) ((void)(cpu),0)
 
 #define pcie_get_minimum_link(dev, speed, width) ({ \
@@ -95,6 +95,9 @@ enum {
 	IB_USER_VERBS_EX_CMD_DESTROY_FLOW,
 };
 
+/* AKAROS: sends a CQ's completion events to an event queue. */
+#define IB_USER_VERBS_CMD_AKAROS_CQ_EVQ	0x70
+
 /*
  * Make sure that all structs defined in this file remain laid out so
  * that they pack the same way on 32-bit and 64-bit architectures (to
@@ -116,6 +119,19 @@ struct ib_uverbs_comp_event_desc {
 	__u64 cq_handle;
 };
 
+/*
+ * AKAROS: instead of a completion channel, a CQ can have a struct event_queue,
+ * usually with a CEQ mbox.  Each completion event sends ev_type (the CEQ
+ * index), with ev_arg2 = 1 (the coalesced count, for CEQ_ADD) and ev_arg3 =
+ * the CQ's user_handle (the CEQ blob).  ev_q == 0 turns the events off.  The
+ * user still arms the CQ (req_notify) and polls it from user space.
+ */
+struct ib_uverbs_akaros_cq_evq {
+	__u32 cq_handle;
+	__u32 ev_type;
+	__u64 ev_q;
+};
+
 /*
  * All commands from userspace should start with a __u32 command field
  * followed by __u16 in_words and out_words fields (which give the
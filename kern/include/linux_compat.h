@@ -35,14 +35,7 @@
 //#define CONFIG_INET 1 	// will deal with this manually
 #define CONFIG_PCI_MSI 1
 
-#define __rcu
-#define rcu_read_lock()
-#define rcu_read_unlock()
-#define rcu_dereference(x) (x)
-#define rcu_dereference_protected(x, y) (x)
-#define rcu_assign_pointer(dst, src) (dst) = (src)
-#define RCU_INIT_POINTER(dst, src) rcu_assign_pointer(dst, src)
-#define synchronize_rcu()
+#include <rcu.h>
 
 #define atomic_cmpxchg(_addr, _old, _new)                                      \
 ({                                                                             \
@@ -83,15 +76,17 @@ enum dma_data_direction {
 	DMA_NONE = 3,
 };
 
-static inline void *__dma_alloc_coherent(size_t size, dma_addr_t *dma_handle,
-                                         gfp_t flags)
+/* Prefers NUMA node 'node', or anywhere for -1 */
+static inline void *__dma_alloc_coherent_node(int node, size_t size,
+                                              dma_addr_t *dma_handle,
+                                              gfp_t flags)
 {
 	size_t order = LOG2_UP(nr_pages(size));
 	/* our shitty allocator doesn't align the higher order allocations, so we
 	 * go 2x, and align manually.  we don't save the original pointer, so we
 	 * can't free them later. */
-	void *vaddr = get_cont_pages(order > 0 ?  order + 1 : order,
-	                             flags);
+	void *vaddr = get_cont_pages_node(node, order > 0 ?  order + 1 : order,
+	                                  flags);
 	if (!vaddr) {
 		*dma_handle = 0;
 		return 0;
@@ -102,6 +97,12 @@ static inline void *__dma_alloc_coherent(size_t size, dma_addr_t *dma_handle,
 	return vaddr;
 }
 
+static inline void *__dma_alloc_coherent(size_t size, dma_addr_t *dma_handle,
+                                         gfp_t flags)
+{
+	return __dma_alloc_coherent_node(-1, size, dma_handle, flags);
+}
+
 static inline void *__dma_zalloc_coherent(size_t size, dma_addr_t *dma_handle,
                                           gfp_t flags)
 {
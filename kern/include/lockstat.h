@@ -0,0 +1,51 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Lock contention profiling.
+ *
+ * With CONFIG_LOCK_STATS, spinlocks and MCS locks check lockstat_enabled on
+ * lock and unlock.  It is off by default, so the cost is a predictable branch.
+ * Once it's turned on (echo on > #kprof/lockstat), each core keeps a table of
+ * lock call sites with acquisition counts, time spent waiting, a histogram of
+ * the waits, and time spent holding the lock.  Reading #kprof/lockstat merges
+ * the cores' tables and prints the worst sites first. */
+
+#pragma once
+
+#include <ros/common.h>
+
+/* Wait histogram bucket i counts contended waits of fewer than
+ * LOCKSTAT_HIST_BASE << (2 * i) cycles.  The last bucket gets the rest. */
+#define LOCKSTAT_NR_BUCKETS		8
+#define LOCKSTAT_HIST_BASE		256
+
+struct lockstat_site {
+	uintptr_t					pc;
+	uintptr_t					lock;		/* most recent lock from this site */
+	uint64_t					nr_acquires;
+	uint64_t					nr_contended;
+	uint64_t					wait_tsc;
+	uint64_t					max_wait_tsc;
+	uint64_t					hold_tsc;
+	uint64_t					max_hold_tsc;
+	uint64_t					wait_hist[LOCKSTAT_NR_BUCKETS];
+};
+
+struct spinlock;
+
+#ifdef CONFIG_LOCK_STATS
+
+extern bool lockstat_enabled;
+
+void lockstat_spin_lock(struct spinlock *lock);
+void __lockstat_spin_lock(struct spinlock *lock, uintptr_t pc);
+bool lockstat_spin_trylock(struct spinlock *lock);
+void lockstat_acquired(void *lock, uintptr_t pc, uint64_t wait_tsc,
+                       bool contended);
+void lockstat_released(void *lock);
+
+void lockstat_enable(bool on);
+void lockstat_reset(void);
+size_t lockstat_snapshot(struct lockstat_site **sites_p);
+
+#endif /* CONFIG_LOCK_STATS */
@@ -0,0 +1,57 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * MCS queue locks for the kernel.
+ *
+ * Each waiter spins on its own qnode instead of on the lock word, so a
+ * contended lock hands off with a single cache line transfer instead of every
+ * waiter hammering the lock.  Waiters are served in FIFO order.
+ *
+ * The caller provides the qnode, and must pass the same one to unlock.  The
+ * stack is fine, since we never block while holding a spinlock:
+ *
+ * 		struct mcs_lock_qnode qn;
+ *
+ * 		mcs_lock_irqsave(&foo->lock, &qn);
+ * 		...
+ * 		mcs_unlock_irqsave(&foo->lock, &qn);
+ *
+ * These are for locks that have shown up as contended.  For everything else,
+ * a spinlock_t is smaller and a little cheaper. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <arch/arch.h>
+#include <atomic.h>
+
+struct mcs_lock_qnode {
+	struct mcs_lock_qnode		*next;
+	int							locked;
+	bool						irq_en;			/* for the irqsave variants */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct mcs_lock {
+	struct mcs_lock_qnode		*lock;			/* the tail of the queue */
+#ifdef CONFIG_SPINLOCK_DEBUG
+	uintptr_t					call_site;
+	uint32_t					calling_core;
+	unsigned long				nr_acquires;
+	unsigned long				nr_contended;
+#endif
+};
+
+#define MCS_LOCK_INIT {0}
+
+void mcs_lock_init(struct mcs_lock *lock);
+void mcs_lock_lock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode);
+bool mcs_lock_trylock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode);
+void mcs_lock_unlock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode);
+void mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_lock_qnode *qnode);
+void mcs_unlock_irqsave(struct mcs_lock *lock, struct mcs_lock_qnode *qnode);
+void mcs_lock_debug(struct mcs_lock *lock);
+
+static inline bool mcs_lock_locked(struct mcs_lock *lock)
+{
+	return ACCESS_ONCE(lock->lock) != 0;
+}
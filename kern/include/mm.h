@@ -11,6 +11,7 @@
 #include <ros/mman.h>
 #include <atomic.h>
 #include <sys/queue.h>
+#include <sys/tree.h>
 #include <slab.h>
 
 struct file;
@@ -18,11 +19,13 @@ struct proc;								/* preprocessor games */
 
 /* Basic structure defining a region of a process's virtual memory.  Note we
  * don't refcnt these.  Either they are in the TAILQ/tree, or they should be
- * freed.  There should be no other references floating around.  We still need
+ * freed.  The TAILQ is sorted by address, for walking neighbors.  The tree is
+ * keyed on vm_end, for lookups.  There should be no other references floating around.  We still need
  * to sort out how we share memory and how we'll do private memory with these
  * VMRs. */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
+	RB_ENTRY(vm_region)			vm_tree_link;
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
 	struct proc					*vm_proc;	/* owning process, for now */
 	uintptr_t					vm_base;
@@ -31,8 +34,15 @@ struct vm_region {
 	int							vm_flags;	
 	struct file					*vm_file;
 	size_t						vm_foff;
+	/* File fault tuning, set by madvise().  Protected by the vmr_lock. */
+	unsigned int				vm_fault_around;	/* pages to map per fault */
+	unsigned int				vm_ra_max;			/* max read-ahead window */
+	unsigned int				vm_ra_win;			/* current window */
+	unsigned long				vm_ra_next;			/* expected next fault idx */
+	unsigned long				vm_ra_end;			/* read-ahead issued til */
 };
 TAILQ_HEAD(vmr_tailq, vm_region);			/* Declares 'struct vmr_tailq' */
+RB_HEAD(vmr_tree, vm_region);				/* Declares 'struct vmr_tree' */
 
 /* VM Region Management Functions.  For now, these just maintain themselves -
  * anything related to mapping needs to be done by the caller. */
@@ -65,6 +75,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
               struct file *f, size_t offset);
 int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
 int munmap(struct proc *p, uintptr_t addr, size_t len);
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
@@ -36,6 +36,8 @@
 #include <fdtap.h>
 #include <ros/fs.h>
 #include <vfs.h>
+#include <rhashtable.h>
+#include <rcu.h>
 
 /*
  * functions (possibly) linked in, complete, from libc.
@@ -353,7 +355,8 @@ enum {
 #define NS_TCPCK_SHIFT 4
 #define NS_PKTCK_SHIFT 5
 #define NS_TSO_SHIFT 6
-#define NS_SHIFT_MAX 6
+#define NS_USO_SHIFT 7
+#define NS_SHIFT_MAX 7
 
 enum {
 	BINTR = (1 << 0),
@@ -363,14 +366,19 @@ enum {
 	Btcpck = (1 << NS_TCPCK_SHIFT),	/* tcp checksum */
 	Bpktck = (1 << NS_PKTCK_SHIFT),	/* packet checksum */
 	Btso = (1 << NS_TSO_SHIFT),	/* TSO */
+	Buso = (1 << NS_USO_SHIFT),	/* UDP segmentation */
+	Bmore = (1 << 8),	/* more packets follow; don't kick the NIC yet */
 };
-#define BCKSUM_FLAGS (Bipck|Budpck|Btcpck|Bpktck|Btso)
+#define BCKSUM_FLAGS (Bipck|Budpck|Btcpck|Bpktck|Btso|Buso)
 
 struct extra_bdata {
 	uintptr_t base;
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	/* If set, base isn't kmalloc'd: its owner is told via this kref when the
+	 * last user of base lets go, e.g. zero-copy user pages. */
+	struct kref *ref;
 };
 
 struct block {
@@ -462,6 +470,9 @@ struct dev {
 //  int (*config)( int unused_int, char *unused_char_p_t, DevConf*);
 	char *(*chaninfo) (struct chan *, char *, size_t);
 	int (*tapfd) (struct chan *, struct fd_tap *, int);
+	/* If set, namec can cache walks that end on this device, and this says
+	 * whether a cached chan still names what it did. */
+	bool (*revalidate) (struct chan *);
 	/* we need to be aligned, we think to 64 bytes, for the linker tables. */
 } __attribute__ ((aligned(64)));
 
@@ -502,12 +513,21 @@ struct mount {
 	char *spec;
 };
 
+/* from's type, dev, and qid.path, which is what a walk looks mounts up by */
+struct mhead_key {
+	int type;
+	uint32_t dev;
+	uint64_t path;
+};
+
 struct mhead {
 	struct kref ref;
 	struct rwlock lock;
 	struct chan *from;			/* channel mounted upon */
 	struct mount *mount;		/* what's mounted upon it */
 	struct mhead *hash;			/* Hash chain */
+	struct mhead_key key;		/* for the pgrp's mnt_ht */
+	struct rcu_head rcu;
 };
 
 struct mnt {
@@ -535,6 +555,18 @@ enum {
 };
 #define MOUNTH(p,qid)	((p)->mnthash[(qid).path&((1<<MNTLOG)-1)])
 
+/* One slot of a pgrp's walk cache: where path led from the root chan */
+struct walkcache {
+	char *path;					/* names joined by '/' */
+	uint32_t hash;
+	int root_type;
+	uint32_t root_dev;
+	struct qid root_qid;
+	struct chan *c;
+};
+
+#define NWCACHE			64
+
 struct mntparam {
 	struct chan *chan;
 	struct chan *authchan;
@@ -546,7 +578,7 @@ struct pgrp {
 	struct kref ref;			/* also used as a lock when mounting */
 	uint32_t pgrpid;
 	qlock_t debug;				/* single access via devproc.c */
-	struct rwlock ns;			/* Namespace n read/one write lock */
+	struct brwlock ns;			/* Namespace n read/one write lock */
 	qlock_t nsh;
 	struct mhead *mnthash[MNTHASH];
 	int progmode;
@@ -554,6 +586,14 @@ struct pgrp {
 	struct chan *slash;
 	int nodevs;
 	int pin;
+	spinlock_t wc_lock;
+	uint32_t wc_gen;			/* changes on every flush */
+	struct walkcache wcache[NWCACHE];
+	/* mheads by key, for lockless findmount().  Changes with ns held. */
+	struct rhashtable mnt_ht;
+	atomic_t nr_walks;
+	atomic_t nr_mnt_crossings;
+	unsigned long max_walk_crossings;
 };
 
 struct evalue {
@@ -633,6 +673,8 @@ enum {
 	Qkick = (1 << 5),	/* always call the kick routine after qwrite */
 	Qdropoverflow = (1 << 6),	/* writes that would block will be dropped */
 	Qnonblock = (1 << 7),	/* do not block, throw EAGAIN */
+	Qzcopy = (1 << 8),	/* pin users' pages for big writes, instead of copying */
+	Qspsc = (1 << 9),	/* one reader, one writer: skip their qlocks */
 };
 
 #define DEVDOTDOT -1
@@ -650,11 +692,20 @@ void addrootfile(char *unused_char_p_t, uint8_t * unused_uint8_p_t, uint32_t);
 struct block *adjustblock(struct block *, int);
 struct block *allocb(int);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
+void ebd_incref(struct extra_bdata *ebd);
+void ebd_decref(struct extra_bdata *ebd);
 int block_append_extra(struct block *b, int len, int mem_flags);
+struct page;
+struct page_map;
+int block_append_page(struct block *b, struct page *page, size_t off,
+                      size_t len, void (*put)(struct page *), int mem_flags);
+struct block *block_from_pm(struct page_map *pm, uint64_t off, size_t len);
 int anyhigher(void);
 int anyready(void);
 void _assert(char *unused_char_p_t);
 struct block *bl2mem(uint8_t * unused_uint8_p_t, struct block *, int);
+size_t bl2iov(struct block *b, struct iovec *iov, int iovcnt);
+struct block *iov2bl(struct iovec *iov, int iovcnt, size_t len);
 int blocklen(struct block *);
 char *channame(struct chan *);
 void cclose(struct chan *);
@@ -693,6 +744,10 @@ void cursordisable(void);
 int cursoron(int);
 void cursoroff(int);
 void cwrite(struct chan *, uint8_t * unused_uint8_p_t, int unused_int, int64_t);
+void cqid(struct chan *);
+int cstat(struct chan *, uint8_t *, int);
+void cstatupdate(struct chan *, uint8_t *, int);
+void cstatdrop(struct chan *);
 struct chan *devattach(const char *name, char *spec);
 struct block *devbread(struct chan *, long, uint32_t);
 long devbwrite(struct chan *, struct block *, uint32_t);
@@ -710,6 +765,7 @@ struct chan *devopen(struct chan *, int unused_int,
 					 struct dirtab *, int unused_int2, Devgen *);
 void devpermcheck(char *unused_char_p_t, uint32_t, int);
 void devremove(struct chan *);
+bool devrevalidate(struct chan *);
 void devreset(void);
 void devshutdown(void);
 int devstat(struct chan *, uint8_t * unused_uint8_p_t, int unused_int,
@@ -722,6 +778,9 @@ char *devchaninfo(struct chan *chan, char *ret, size_t ret_l);
 void disinit(void *);
 void disfault(void *, char *unused_char_p_t);
 int domount(struct chan **, struct mhead **);
+void wcache_flush(struct pgrp *);
+int mhead_index(struct pgrp *, struct mhead *);
+void mhead_unindex(struct pgrp *, struct mhead *);
 void drawactive(int);
 void drawcmap(void);
 void dumpstack(void);
@@ -834,9 +893,13 @@ int qiwrite(struct queue *, void *, int);
 int qlen(struct queue *);
 void qdropoverflow(struct queue *, bool);
 void qnonblock(struct queue *, bool);
+void qcoalesce(struct queue *, bool);
+void qzerocopy(struct queue *, bool);
 struct queue *qopen(int unused_int, int, void (*)(void *), void *);
 int qpass(struct queue *, struct block *);
 int qpassnolim(struct queue *, struct block *);
+int qpass_merge(struct queue *q, struct block *b,
+                bool (*merge)(struct block *last, struct block *b));
 int qproduce(struct queue *, void *, int);
 void qputback(struct queue *, struct block *);
 long qread(struct queue *, void *, int);
@@ -957,6 +1020,8 @@ int sysopen(char *path, int vfs_flags);
 long unionread(struct chan *c, void *va, long n);
 void read_exactly_n(struct chan *c, void *vp, long n);
 long sysread(int fd, void *va, long n);
+long sysreadv(int fd, struct iovec *iov, int iovcnt);
+long syspreadv(int fd, struct iovec *iov, int iovcnt, int64_t off);
 long syspread(int fd, void *va, long n, int64_t off);
 int sysremove(char *path);
 int64_t sysseek(int fd, int64_t off, int whence);
@@ -964,7 +1029,12 @@ void validstat(uint8_t * s, int n, int slashok);
 int sysstat(char *path, uint8_t*, int n);
 int sysstatakaros(char *path, struct kstat *);
 long syswrite(int fd, void *va, long n);
+long syswritev(int fd, struct iovec *iov, int iovcnt);
+long syspwritev(int fd, struct iovec *iov, int iovcnt, int64_t off);
 long syspwrite(int fd, void *va, long n, int64_t off);
+long syssendfile(int out_fd, int in_fd, int64_t *offp, long count);
+long syssendpm(int out_fd, struct page_map *pm, size_t size, int64_t *offp,
+               long count);
 int syswstat(char *path, uint8_t * buf, int n);
 struct dir *chandirstat(struct chan *c);
 struct dir *sysdirstat(char *name);
@@ -52,14 +52,33 @@ struct page {
 								/* pg_private is overloaded. */
 };
 
+/* Per-NUMA-node counters.  An allocation is 'remote' if it had to fall back
+ * to a node other than the caller's. */
+struct page_node_stats {
+	size_t						nr_free_pages;
+	size_t						nr_pages;
+	size_t						wmark_low;
+	size_t						wmark_high;
+	uint64_t					nr_local_allocs;
+	uint64_t					nr_remote_allocs;
+	size_t						nr_zero_pages;
+	uint64_t					nr_zero_hits;
+	uint64_t					nr_zero_misses;
+};
+
 /******** Externally visible global variables ************/
 extern uint8_t* global_cache_colors_map;
 extern spinlock_t colored_page_free_list_lock;
 extern page_list_t *colored_page_free_list;
+extern int nr_page_nodes;
 
 /*************** Functional Interface *******************/
 void page_alloc_init(struct multiboot_info *mbi);
 void colored_page_alloc_init(void);
+void page_alloc_numa_init(void);
+void page_alloc_get_node_stats(int node, struct page_node_stats *stats);
+bool page_zero_idle(void);
+bool page_alloc_below_wmark(bool high);
 
 error_t upage_alloc(struct proc* p, page_t **page, int zero);
 error_t kpage_alloc(page_t **page);
@@ -70,6 +89,7 @@ error_t kpage_alloc_specific(page_t **page, size_t ppn);
 
 void *get_cont_pages(size_t order, int flags);
 void *get_cont_pages_node(int node, size_t order, int flags);
+void *get_aligned_cont_pages_node(int node, size_t order, int flags);
 void *get_cont_phys_pages_at(size_t order, physaddr_t at, int flags);
 void free_cont_pages(void *buf, size_t order);
 
@@ -20,6 +20,9 @@ struct block_device;
 struct chan;
 struct page_map_operations;
 
+/* Radix tree tag for dirty pages */
+#define PM_TAG_DIRTY			0
+
 /* Every object that has pages, like an inode or the swap (or even direct block
  * devices) has a page_map, tracking which of its pages are currently in memory.
  * It is a map, per object, from index to physical page frame. */
@@ -35,7 +38,14 @@ struct page_map {
 	spinlock_t					pm_lock;
 	struct vmr_tailq			pm_vmrs;
 	atomic_t					pm_removal;
+	unsigned long				pm_nr_dirty;	/* protected by pm_lock */
+	TAILQ_ENTRY(page_map)		pm_dirty_link;	/* on the flusher's list */
+	bool						pm_on_dirty_list;
+	TAILQ_ENTRY(page_map)		pm_reclaim_link;
+	unsigned long				pm_reclaim_idx;	/* reclaim's clock hand */
+	bool						pm_unevictable;	/* reclaim skips it */
 };
+TAILQ_HEAD(page_map_tailq, page_map);
 
 /* Operations performed on a page_map.  These are usually FS specific, which
  * get assigned when the inode is created.
@@ -43,16 +53,15 @@ struct page_map {
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
+	int (*writepages) (struct page_map *, struct page **, unsigned int);
+	void (*releasepage) (struct page_map *, struct page *);
 /*	readpages: read a list of pages
-	writepage: write from a page to its backing store
-	writepages: write a list of pages
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
 	commit_write: complete a write (disk backed pages)
 	bmap: get a logical block number from a file block index
 	invalidate page: invalidate, part of truncating
-	release page: prepare to release 
 	direct_io: bypass the page cache */
 };
 
@@ -62,8 +71,18 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+int pm_add_uptodate_page(struct page_map *pm, unsigned long index,
+                         struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs);
+void pm_page_dirty(struct page *page);
+unsigned long pm_writeback(struct page_map *pm, unsigned long nr_pgs);
+void pm_throttle_dirty(struct page_map *pm);
+void pm_writeback_detach(struct page_map *pm);
+void pm_writeback_init(void);
+unsigned long pm_reclaim(unsigned long nr_pages, uint64_t *nr_scanned);
+void pm_mark_idle(struct page_map *pm, unsigned long index,
+                  unsigned long nr_pgs);
 void print_page_map_info(struct page_map *pm);
@@ -0,0 +1,47 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Per-CPU circular buffers with any number of lock-free readers, for logs and
+ * traces.  Each core appends records to its own buffer, overwriting the oldest
+ * records when it's full.  Writers take no locks (they disable IRQs on their
+ * own core), so they can be used from anywhere but NMI context.
+ *
+ * Readers don't consume anything.  Each has its own cursor, with a position in
+ * every core's buffer, and sees records in timestamp order across cores.  A
+ * reader that falls behind a writer skips to the oldest record still in the
+ * buffer, and counts what it missed in its cursor's lost_bytes.  Records are
+ * never returned partially overwritten.
+ *
+ * Unlike struct circular_buffer, nothing here needs external locking, but a
+ * record must fit in one core's buffer, and readers can't seek by offset. */
+
+#pragma once
+
+#include <sys/types.h>
+#include <arch/arch.h>
+
+struct pcpu_cbuf_cpu {
+	char *data;
+	uint64_t head;				/* end of the newest record */
+	uint64_t tail;				/* start of the oldest record */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct pcpu_cbuf {
+	struct pcpu_cbuf_cpu *cpus;
+	size_t size;				/* per core, power of 2 */
+};
+
+struct pcpu_cbuf_cursor {
+	uint64_t *pos;				/* per core */
+	uint64_t lost_bytes;
+};
+
+bool pcpu_cbuf_init(struct pcpu_cbuf *cb, size_t size);
+void pcpu_cbuf_destroy(struct pcpu_cbuf *cb);
+size_t pcpu_cbuf_write(struct pcpu_cbuf *cb, const void *data, size_t len);
+bool pcpu_cbuf_cursor_init(struct pcpu_cbuf *cb, struct pcpu_cbuf_cursor *cur,
+                           bool from_now);
+void pcpu_cbuf_cursor_destroy(struct pcpu_cbuf_cursor *cur);
+ssize_t pcpu_cbuf_read(struct pcpu_cbuf *cb, struct pcpu_cbuf_cursor *cur,
+                       void *data, size_t len, int *cpu, uint64_t *tsc);
+size_t pcpu_cbuf_max_write_size(const struct pcpu_cbuf *cb);
@@ -96,6 +96,8 @@ bool regions_collide_unsafe(uintptr_t start1, uintptr_t end1,
 
 /* Arch specific implementations for these */
 pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create);
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create);
+int pgdir_split_jumbo(pgdir_t pgdir, const void *va);
 int get_va_perms(pgdir_t pgdir, const void *va);
 int arch_pgdir_setup(pgdir_t boot_copy, pgdir_t *new_pd);
 physaddr_t arch_pgdir_get_cr3(pgdir_t pd);
@@ -165,3 +167,10 @@ static inline unsigned long nr_pages(size_t nr_bytes)
  * the generic arch/pmap.h.  It's likely that many of these ops will be inlined
  * for speed in pmap_ops. */
 #include <arch/pmap_ops.h>
+
+/* Number of little pages mapped by a final PTE.  The only jumbos we map for
+ * userspace are PTSIZE. */
+static inline unsigned long pte_nr_pgs(pte_t pte)
+{
+	return pte_is_jumbo(pte) ? PTSIZE >> PGSHIFT : 1;
+}
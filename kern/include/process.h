@@ -59,9 +59,9 @@ struct process_set {
 	struct proc **procs;
 };
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
+/* Writers and iterators of the pid hash hold the lock.  pid2proc() doesn't */
 extern spinlock_t pid_hash_lock;
+void __pid_hash_for_each(void (*func)(void *item, void *opaque), void *opaque);
 
 /* Initialization */
 void proc_init(void);
@@ -72,6 +72,11 @@ void proc_init_procdata(struct proc* p);
 
 /* Process management: */
 struct proc *pid_nth(unsigned int n);
+/* Kernel-internal proc_alloc flags, next to the PROC_DUP_ ones from userspace.
+ * PROC_SPAWN means we're about to load a new binary, so we don't need the
+ * parent's CLOEXEC files. */
+#define PROC_SPAWN				(1 << 16)
+
 error_t proc_alloc(struct proc **pp, struct proc *parent, int flags);
 void __proc_ready(struct proc *p);
 struct proc *proc_create(struct file *prog, char **argv, char **envp);
@@ -91,6 +96,7 @@ int proc_change_to_m(struct proc *p);
 void __proc_save_fpu_s(struct proc *p);
 void __proc_save_context_s(struct proc *p);
 void proc_yield(struct proc *p, bool being_nice);
+void proc_yield_to(struct proc *p, struct proc *target, struct event_msg *msg);
 void proc_notify(struct proc *p, uint32_t vcoreid);
 void proc_wakeup(struct proc *p);
 bool __proc_is_mcp(struct proc *p);
@@ -131,6 +137,7 @@ void __unmap_vcore(struct proc *p, uint32_t vcoreid);
 void vcore_account_online(struct proc *p, uint32_t vcoreid);
 void vcore_account_offline(struct proc *p, uint32_t vcoreid);
 uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid);
+struct vcore_stats *cur_vcore_stats(struct proc *p);
 
 /* Preemption management.  Some of these will change */
 void __proc_preempt_warn(struct proc *p, uint32_t vcoreid, uint64_t when);
@@ -138,6 +145,7 @@ void __proc_preempt_warnall(struct proc *p, uint64_t when);
 void __proc_preempt_core(struct proc *p, uint32_t pcoreid);
 uint32_t __proc_preempt_all(struct proc *p, uint32_t *pc_arr);
 bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
 void proc_preempt_all(struct proc *p, uint64_t usec);
 
 /* Current / cr3 / context management */
@@ -147,6 +155,18 @@ void abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
 
+/* TLB shootdown batching.  Code changing a bunch of PTEs collects the VA ranges
+ * it touched and then does a single shootdown for all of them. */
+struct tlb_gather {
+	struct proc					*p;
+	uintptr_t					start;
+	uintptr_t					end;
+};
+
+void tlb_gather_init(struct tlb_gather *tlb, struct proc *p);
+void tlb_gather_add(struct tlb_gather *tlb, uintptr_t start, uintptr_t end);
+void tlb_gather_flush(struct tlb_gather *tlb);
+
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
 void __set_curctx(uint32_t srcid, long a0, long a1, long a2);
@@ -161,6 +181,8 @@ void proc_init_ctx(struct user_context *ctx, uint32_t vcoreid, uintptr_t entryp,
                    uintptr_t stack_top, uintptr_t tls_desc);
 void proc_secure_ctx(struct user_context *ctx);
 void __abandon_core(void);
+void __arch_proc_startcore(struct proc *p, uint32_t vcoreid);
+void __arch_proc_free(struct proc *p);
 
 /* Degubbing */
 void print_allpids(void);
@@ -12,6 +12,7 @@ struct hw_trapframe;
 struct proc;
 struct file;
 struct cmdbuf;
+struct kthread;
 
 int profiler_configure(struct cmdbuf *cb);
 void profiler_append_configure_usage(char *msgbuf, size_t buflen);
@@ -24,6 +25,9 @@ void profiler_add_trace(uintptr_t pc, uint64_t info);
 void profiler_control_trace(int onoff);
 void profiler_trace_data_flush(void);
 void profiler_add_hw_sample(struct hw_trapframe *hw_tf, uint64_t info);
+bool profiler_offcpu_enabled(void);
+void profiler_add_offcpu_sample(struct kthread *kth, uintptr_t pc,
+								uintptr_t fp);
 int profiler_size(void);
 int profiler_read(void *va, int n);
 void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
@@ -12,14 +12,25 @@
  * There are some utility functions, probably unimplemented til we need them,
  * that will make the tree have enough memory for future calls.
  *
- * You can also store a tag along with the void* for a given item, and do
- * lookups based on those tags.  Or you will be able to, once it is
- * implemented. */
+ * You can also set up to RADIX_NR_TAGS tags on each item, and do gang lookups
+ * of just the tagged items.  Every node has a bitmap per tag: a leaf's bit is
+ * set if that item is tagged, and an interior node's bit is set if anything in
+ * that child's subtree is tagged, so tagged lookups skip untagged subtrees.
+ * Tag operations need the writers' lock.
+ *
+ * Lookups (radix_lookup, radix_lookup_slot, radix_gang_lookup) do not need the
+ * caller's lock: writers fully initialize nodes before linking them in, and
+ * each node knows its own height, so a reader racing with a grow sees a
+ * consistent (sub)tree.  Writers still need to be serialized by the caller.
+ * Trees made with radix_tree_init_lockless() never free their nodes, so
+ * readers can't be holding a freed node.  (Until we have RCU to defer the
+ * frees). */
 
 #pragma once
 
 #define LOG_RNODE_SLOTS 6
 #define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)
+#define RADIX_NR_TAGS 2
 
 #include <ros/common.h>
 
@@ -27,8 +38,10 @@ struct radix_node {
 	void						*items[NR_RNODE_SLOTS];
 	unsigned int				num_items;
 	bool						leaf;
+	unsigned int				height;		/* 1 for leaves */
 	struct radix_node			*parent;
 	struct radix_node			**my_slot;
+	uint64_t					tags[RADIX_NR_TAGS];	/* bit per slot */
 };
 
 /* Defines the whole tree. */
@@ -36,11 +49,13 @@ struct radix_tree {
 	struct radix_node			*root;
 	unsigned int				depth;
 	unsigned long				upper_bound;
+	bool						lockless;	/* readers don't lock */
 };
 
 void radix_init(void);		/* initializes the whole radix system */
-#define RADIX_INITIALIZER {0, 0, 0}
+#define RADIX_INITIALIZER {0, 0, 0, FALSE}
 void radix_tree_init(struct radix_tree *tree);	/* inits one tree */
+void radix_tree_init_lockless(struct radix_tree *tree);
 void radix_tree_destroy(struct radix_tree *tree);
 
 /* Item management */
@@ -0,0 +1,52 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Read-Copy-Update, quiescent-state based.
+ *
+ * Readers wrap lookups with rcu_read_lock() / rcu_read_unlock() and load
+ * RCU-protected pointers with rcu_dereference().  Readers must not block.
+ * Writers publish with rcu_assign_pointer() and, after unlinking an object,
+ * either call_rcu() to free it later or synchronize_rcu() to wait.
+ *
+ * The kernel is not preemptible, so a core that is processing routine kernel
+ * messages (which happens from smp_idle() and on the way back to userspace,
+ * including MCP core handoffs via __startcore) is not in a read-side critical
+ * section.  That is our quiescent state.  A grace period ends once every core
+ * has passed through one.  A kthread drives the grace periods, nudging slow
+ * cores with a routine kernel message, and runs the callbacks.
+ *
+ * Callbacks run in that kthread.  They can block, but please don't.
+ * synchronize_rcu() blocks, and needs the other cores to be processing kernel
+ * messages, so don't use it while booting. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+
+struct rcu_head {
+	struct rcu_head				*next;
+	void						(*func)(struct rcu_head *head);
+};
+
+/* Annotation only, for pointers that readers load with rcu_dereference() */
+#define __rcu
+
+#define rcu_read_lock() cmb()
+#define rcu_read_unlock() cmb()
+
+#define rcu_dereference(p) ACCESS_ONCE(p)
+#define rcu_dereference_protected(p, cond) (p)
+
+#define rcu_assign_pointer(p, v)                                               \
+({                                                                             \
+	wmb();                                                                     \
+	ACCESS_ONCE(p) = (v);                                                      \
+})
+/* For NULL, or for objects readers can't reach yet */
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+void rcu_init(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+void rcu_report_qs(void);
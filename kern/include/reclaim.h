@@ -0,0 +1,55 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.  When a NUMA node's free pages drop below its low watermark,
+ * the page allocator kicks the reclaim ktask, which runs the shrinkers until
+ * every node is back above its high watermark.  Allocations that can block
+ * (KMALLOC_WAIT) and still fail run the shrinkers themselves before giving up.
+ *
+ * A shrinker is anything holding memory it can give back: the slab caches'
+ * empty slabs, clean page cache pages, the mount cache.  Its scan function
+ * tries to free nr_pages pages and returns how many it freed.  Scans can block,
+ * and only one runs at a time.  Shrinkers don't know about nodes; whatever they
+ * free goes back to its own node.  See #kprof/reclaimstat. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+
+#define SHRINKER_NAME_LEN			32
+
+struct shrinker {
+	const char					*name;
+	unsigned long (*scan)(struct shrinker *s, unsigned long nr_pages);
+	/* Counters, protected by the reclaim qlock.  Scans may add the number of
+	 * objects they looked at to nr_scanned. */
+	uint64_t					nr_calls;
+	uint64_t					nr_scanned;
+	uint64_t					nr_freed;
+	TAILQ_ENTRY(shrinker)		link;
+};
+TAILQ_HEAD(shrinker_tailq, shrinker);
+
+struct shrinker_stats {
+	char						name[SHRINKER_NAME_LEN];
+	uint64_t					nr_calls;
+	uint64_t					nr_scanned;
+	uint64_t					nr_freed;
+};
+
+struct reclaim_stats {
+	uint64_t					nr_wakeups;		/* of the reclaim ktask */
+	uint64_t					nr_bg_passes;
+	uint64_t					nr_bg_freed;
+	uint64_t					nr_direct_passes;	/* by failed allocations */
+	uint64_t					nr_direct_freed;
+};
+
+void register_shrinker(struct shrinker *s);
+void unregister_shrinker(struct shrinker *s);
+void reclaim_kick(void);
+unsigned long reclaim_direct(unsigned long nr_pages);
+void reclaim_get_stats(struct reclaim_stats *stats);
+size_t reclaim_get_shrinker_stats(struct shrinker_stats **stats_p);
+void reclaim_init(void);
@@ -0,0 +1,182 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Resizable hash tables with lockless readers.
+ *
+ * The table is open addressed with linear probing, and it stores pointers to
+ * the caller's objects.  Writers hold the table's lock (the generated insert
+ * and remove functions grab it).  Readers don't lock: they look up under
+ * rcu_read_lock(), so objects must be freed with call_rcu() or after a
+ * synchronize_rcu().
+ *
+ * When a table gets too full of items and tombstones, we allocate a new one and
+ * every insert and remove moves RHT_MIGRATE_BATCH slots of the old table over,
+ * so no writer pays for a full rehash.  Until the migration is done, readers
+ * check the old table and then the new one.  An item that is moved is in the
+ * new table before it leaves the old one, and a reader that misses while items
+ * were moving retries, which we detect with a seq counter.
+ *
+ * The hash and compare functions are inlined into type-specific accessors:
+ *
+ *		static size_t foo_hash(struct foo *f) ...
+ *		static size_t foo_key_hash(unsigned long key) ...
+ *		static bool foo_eq(struct foo *f, unsigned long key) ...
+ *		DEFINE_RHASHTABLE(foo, struct foo, unsigned long, foo_hash, foo_key_hash,
+ *		                  foo_eq);
+ *
+ * which defines foo_lookup(ht, key), foo_insert(ht, item) and
+ * foo_remove(ht, key).  Keys must be unique; callers check before inserting. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+#include <rcu.h>
+
+#define RHT_EMPTY				((void*)0)
+#define RHT_TOMBSTONE			((void*)1)
+#define RHT_MIN_SLOTS			64
+#define RHT_MIGRATE_BATCH		16
+
+struct rht_tab {
+	size_t						nr_slots;		/* power of 2 */
+	size_t						nr_used;		/* items and tombstones */
+	struct rcu_head				rcu;
+	void						*slots[];
+};
+
+struct rhashtable {
+	struct rht_tab				*tab;			/* inserts go here */
+	struct rht_tab				*old;			/* migrating from, or 0 */
+	size_t						migrate_idx;	/* next slot of old to move */
+	size_t						nr_items;
+	seq_ctr_t					seq;			/* changes when items move */
+	spinlock_t					lock;			/* for writers */
+};
+
+typedef size_t (*rht_hash_t)(void *item);
+
+void rhashtable_init(struct rhashtable *ht, size_t nr_items_hint);
+void rhashtable_destroy(struct rhashtable *ht);
+void rhashtable_for_each(struct rhashtable *ht,
+                         void (*func)(void *item, void *opaque), void *opaque);
+/* Writer helpers, call with the lock held */
+void __rht_migrate(struct rhashtable *ht, rht_hash_t hash, size_t nr);
+int __rht_insert(struct rhashtable *ht, void *item, rht_hash_t hash);
+
+static inline void *__rht_tab_lookup(struct rht_tab *tab, const void *key,
+                                     size_t hash,
+                                     bool (*eq)(void *item, const void *key))
+{
+	size_t mask = tab->nr_slots - 1;
+	void *item;
+
+	for (size_t i = 0; i < tab->nr_slots; i++) {
+		item = ACCESS_ONCE(tab->slots[(hash + i) & mask]);
+		if (item == RHT_EMPTY)
+			return 0;
+		if (item == RHT_TOMBSTONE)
+			continue;
+		if (eq(item, key))
+			return item;
+	}
+	return 0;
+}
+
+/* Call under rcu_read_lock() or with the lock held */
+static inline void *__rht_lookup(struct rhashtable *ht, const void *key,
+                                 size_t hash,
+                                 bool (*eq)(void *item, const void *key))
+{
+	struct rht_tab *old, *tab;
+	seq_ctr_t seq;
+	void *item;
+
+	do {
+		seq = ACCESS_ONCE(ht->seq);
+		rmb();
+		old = rcu_dereference(ht->old);
+		tab = rcu_dereference(ht->tab);
+		if (old && (item = __rht_tab_lookup(old, key, hash, eq)))
+			return item;
+		if ((item = __rht_tab_lookup(tab, key, hash, eq)))
+			return item;
+		rmb();
+	} while (seqctr_retry(seq, ACCESS_ONCE(ht->seq)));
+	return 0;
+}
+
+/* Tombstones key's item in tab, returning it.  Call with the lock held. */
+static inline void *__rht_tab_remove(struct rht_tab *tab, const void *key,
+                                     size_t hash,
+                                     bool (*eq)(void *item, const void *key))
+{
+	size_t mask = tab->nr_slots - 1;
+	void **slot;
+
+	for (size_t i = 0; i < tab->nr_slots; i++) {
+		slot = &tab->slots[(hash + i) & mask];
+		if (*slot == RHT_EMPTY)
+			return 0;
+		if (*slot == RHT_TOMBSTONE)
+			continue;
+		if (eq(*slot, key)) {
+			void *item = *slot;
+
+			ACCESS_ONCE(*slot) = RHT_TOMBSTONE;
+			return item;
+		}
+	}
+	return 0;
+}
+
+static inline void *__rht_remove(struct rhashtable *ht, const void *key,
+                                 size_t hash, rht_hash_t item_hash,
+                                 bool (*eq)(void *item, const void *key))
+{
+	void *item = 0;
+
+	spin_lock(&ht->lock);
+	if (ht->old)
+		item = __rht_tab_remove(ht->old, key, hash, eq);
+	if (!item)
+		item = __rht_tab_remove(ht->tab, key, hash, eq);
+	if (item)
+		ht->nr_items--;
+	if (ht->old)
+		__rht_migrate(ht, item_hash, RHT_MIGRATE_BATCH);
+	spin_unlock(&ht->lock);
+	return item;
+}
+
+#define DEFINE_RHASHTABLE(name, type, key_type, item_hash, key_hash, key_eq)   \
+static size_t __##name##_rht_hash(void *item)                                  \
+{                                                                              \
+	return item_hash((type*)item);                                             \
+}                                                                              \
+                                                                               \
+static inline bool __##name##_rht_eq(void *item, const void *key)              \
+{                                                                              \
+	return key_eq((type*)item, *(const key_type*)key);                         \
+}                                                                              \
+                                                                               \
+static inline type *name##_lookup(struct rhashtable *ht, key_type key)        \
+{                                                                              \
+	return __rht_lookup(ht, &key, key_hash(key), __##name##_rht_eq);           \
+}                                                                              \
+                                                                               \
+static inline int name##_insert(struct rhashtable *ht, type *item)            \
+{                                                                              \
+	int ret;                                                                   \
+                                                                               \
+	spin_lock(&ht->lock);                                                      \
+	ret = __rht_insert(ht, item, __##name##_rht_hash);                         \
+	spin_unlock(&ht->lock);                                                    \
+	return ret;                                                                \
+}                                                                              \
+                                                                               \
+static inline type *name##_remove(struct rhashtable *ht, key_type key)        \
+{                                                                              \
+	return __rht_remove(ht, &key, key_hash(key), __##name##_rht_hash,          \
+	                    __##name##_rht_eq);                                    \
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Alarm slots for #alarm.  A process hands the kernel one page of its own
+ * memory with the "slots ADDR" ctl message on an alarm.  From then on, the
+ * alarm ignores its timer file and instead fires for each slot whose deadline
+ * has passed.
+ *
+ * A deadline is an absolute TSC time, and 0 means the slot is disarmed.  When
+ * a slot's deadline passes, the kernel swaps it back to 0 and sends an EV_ALARM
+ * with ev_arg2 = the alarm's id and ev_arg4 = the slot.  If the process changed
+ * the deadline in the meantime, the swap fails and nothing is sent.
+ *
+ * The kernel scans the slots at next_scan, the earliest deadline it saw.  0
+ * means it is idle or in the middle of a scan.  To arm a slot, store the
+ * deadline, then do a full memory barrier and read next_scan.  If next_scan is
+ * 0 or later than the deadline, write "kick" to the ctl file, which rescans
+ * now.  Otherwise the kernel will see the new deadline by itself, so pushing a
+ * timeout out, disarming, and arming behind the earliest deadline are all just
+ * stores.  Disarming can race with a firing, so be ready for an event for a
+ * slot you just disarmed.
+ *
+ * The page must be page aligned, writable and populated (MAP_POPULATE |
+ * MAP_LOCKED).  The kernel holds a reference on it until the alarm is
+ * closed. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/arch/mmu.h>
+
+#define ALARM_SLOTS_HDR_SZ		64
+#define ALARM_NR_SLOTS			((PGSIZE - ALARM_SLOTS_HDR_SZ) / sizeof(uint64_t))
+
+struct alarm_slots {
+	uint64_t					next_scan;	/* written by the kernel */
+	uint8_t						pad[ALARM_SLOTS_HDR_SZ - sizeof(uint64_t)];
+	uint64_t					deadline[ALARM_NR_SLOTS];
+};
@@ -30,7 +30,16 @@
  *
  * In general, every time we have an event, we make sure there's a pointer in
  * the ring.  That's the purposed of 'idx_posted' - whether or not we think our
- * index is posted in the ring. */
+ * index is posted in the ring.
+ *
+ * The ring's indexes are shared by every producer and consumer.  When many
+ * cores send events to one CEQ, prod_idx is a hot cache line.  A CEQ can
+ * instead be in bitmap mode: the consumer provides a bitmap with a bit per
+ * event and a summary with a bit per bitmap word.  Instead of posting in the
+ * ring, the producer sets the event's bit, then its word's summary bit.
+ * Producers only share cache lines when their event IDs are close, and
+ * consumers find work by scanning the (small) summary.  Coalescing and
+ * idx_posted work the same way in both modes. */
 
 #pragma once
 
@@ -40,6 +49,9 @@
 #define CEQ_OR					1
 #define CEQ_ADD					2
 
+/* Bitmap mode: bits per bitmap or summary word */
+#define CEQ_WORD_BITS			(sizeof(long) * 8)
+
 struct ceq_event {
 	atomic_t					coalesce;		/* ev_arg2 */
 	uint64_t					blob_data;		/* ev_arg3 */
@@ -75,4 +87,6 @@ struct ceq {
 	atomic_t					cons_pub_idx;	/* how far has been consumed */
 	atomic_t					cons_pvt_idx;	/* next cons slot to get */
 	uint32_t					u_lock[2];		/* user space lock */
+	atomic_t					*bitmap;		/* consumer pointer, or 0 */
+	atomic_t					*summary;		/* consumer pointer */
 };
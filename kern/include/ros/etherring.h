@@ -0,0 +1,79 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Packet rings for #ether connections.  A process hands the kernel a chunk of
+ * its own memory with the "ring ADDR NRX NTX [EVQ EVID]" ctl message on an
+ * ether connection.  From then on, packets for that connection's type are
+ * copied into RX slots instead of being queued for read(), and the process can
+ * queue packets for transmit in TX slots and push them out with one "kick" ctl
+ * message per batch.
+ *
+ * The memory is one header page followed by NRX RX slots and then NTX TX slots.
+ * NRX and NTX are powers of two.  The memory must be page aligned, writable and
+ * populated (MAP_POPULATE | MAP_LOCKED); the kernel holds references on the
+ * pages until the connection is closed.
+ *
+ * Each queue is a single-producer, single-consumer ring of free-running
+ * indexes: slot i lives at index (i & (nslots - 1)).  The kernel produces RX
+ * and consumes TX; the process does the opposite.  Each side only writes its
+ * own index, after a write barrier.
+ *
+ * A TX frame may span several consecutive slots: every slot but the last has
+ * ETHER_RING_F_MORE set.  Only the first slot's flags and offload fields count
+ * for the frame.  The offloads mirror the block's checksum and segmentation
+ * flags: csum_start is where checksumming starts, csum_offset is where the sum
+ * goes relative to csum_start, and the pseudo-header sum must already be there,
+ * like tcpcksum() leaves it.  TSO and USO frames are IPv4, with csum_start at
+ * the TCP or UDP header, and are cut into mss byte segments.  ETHER_RING_F_SRC
+ * keeps the frame's source address instead of the NIC's, and is only honored
+ * on connections in bridge mode. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/arch/mmu.h>
+
+#define ETHER_RING_SLOTSZ		2048
+#define ETHER_RING_MAXSLOTS		4096
+/* Largest TSO/USO frame, headers included */
+#define ETHER_RING_MAXGSO		(64 * 1024 + 128)
+
+/* TX slot flags */
+#define ETHER_RING_F_MORE		(1 << 0)	/* frame continues in next slot */
+#define ETHER_RING_F_TCPCK		(1 << 1)
+#define ETHER_RING_F_UDPCK		(1 << 2)
+#define ETHER_RING_F_TSO		(1 << 3)
+#define ETHER_RING_F_USO		(1 << 4)
+#define ETHER_RING_F_SRC		(1 << 5)
+
+struct ether_ring_slot {
+	uint16_t					len;
+	uint16_t					flags;
+	uint16_t					csum_start;
+	uint16_t					csum_offset;
+	uint16_t					mss;
+	uint16_t					pad[3];
+	uint8_t						data[ETHER_RING_SLOTSZ - 16];
+};
+
+/* prod and cons are written by different sides, so they get their own cache
+ * lines. */
+struct ether_ring_q {
+	uint32_t					prod;
+	uint32_t					nslots;
+	uint32_t					drops;		/* RX: ring full or pkt too big */
+	uint8_t						pad0[64 - 12];
+	uint32_t					cons;
+	uint8_t						pad1[64 - 4];
+};
+
+struct ether_ring_hdr {
+	struct ether_ring_q			rx;
+	struct ether_ring_q			tx;
+};
+
+/* Number of pages the process must provide for a ring. */
+static inline size_t ether_ring_pages(size_t nrx, size_t ntx)
+{
+	return 1 + ((nrx + ntx) * ETHER_RING_SLOTSZ + PGSIZE - 1) / PGSIZE;
+}
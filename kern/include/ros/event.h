@@ -23,6 +23,7 @@
 #define EVENT_ROUNDROBIN		0x00080	/* pick a vcore, RR style */
 #define EVENT_VCORE_APPRO		0x00100	/* send to where the kernel wants */
 #define EVENT_WAKEUP			0x00200	/* wake up the process after sending */
+#define EVENT_TIMESTAMP			0x00400	/* stamp UCQ msgs with the post time */
 
 /* Event Message Types */
 #define EV_NONE					 0
@@ -54,6 +55,7 @@ struct event_msg {
 	uint32_t					ev_arg2;
 	void						*ev_arg3;
 	uint64_t					ev_arg4;
+	uint64_t					ev_tsc;		/* kernel post time, if stamped */
 };
 
 /* Include here since the mboxes need to know event.h basics (e.g. event_msg) */
@@ -0,0 +1,48 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Binary interface to #ip conversations, for the socket shim's hot paths.
+ *
+ * Reading a conversation's "info" file returns a struct ipconv_info, instead of
+ * the text of "local", "remote", and "status".  Writing a struct ipconv_ctl to
+ * its "ctl" file sets one option, like the text "nonblock", "reuseport", etc.
+ * messages.  Text messages never start with a 0 byte, which is how the kernel
+ * tells them apart. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define IPCONV_ADDRLEN			16
+
+/* Addresses are in the 16 byte format of the text files (v4 addresses are
+ * v4-in-v6).  Ports are in host order. */
+struct ipconv_info {
+	uint8_t						laddr[IPCONV_ADDRLEN];
+	uint8_t						raddr[IPCONV_ADDRLEN];
+	uint16_t					lport;
+	uint16_t					rport;
+	uint8_t						ipversion;		/* 4 or 6 */
+	uint8_t						nonblock;
+	uint8_t						reuseport;
+	uint8_t						ttl;
+	uint8_t						tos;
+	uint8_t						pad[3];
+	uint32_t					busypoll;		/* usec */
+};
+
+enum {
+	IPCONV_CTL_NONBLOCK = 1,
+	IPCONV_CTL_REUSEPORT,
+	IPCONV_CTL_ZEROCOPY,
+	IPCONV_CTL_TTL,
+	IPCONV_CTL_TOS,
+	IPCONV_CTL_BUSYPOLL,
+};
+
+struct ipconv_ctl {
+	uint8_t						zero;			/* must be 0 */
+	uint8_t						op;				/* IPCONV_CTL_ */
+	uint16_t					pad;
+	uint32_t					arg;
+};
@@ -35,9 +35,19 @@
 #define MAP_POPULATE	0x08000
 #define MAP_NONBLOCK	0x10000
 #define MAP_STACK		0x20000
+#define MAP_HUGETLB		0x40000	/* back anon memory with jumbo pages */
 
 #define MAP_FAILED		((void*)-1)
 
+/* madvise() advice.  The first four only matter for file-backed memory, and
+ * MADV_FREE only for anonymous memory. */
+#define MADV_NORMAL		0
+#define MADV_RANDOM		1
+#define MADV_SEQUENTIAL	2
+#define MADV_WILLNEED	3
+#define MADV_DONTNEED	4
+#define MADV_FREE		8
+
 /* Other mmap flags, which we probably won't support
 #define MAP_32BIT
 */
@@ -67,6 +67,14 @@ typedef struct procinfo {
 /* We align this so that the kernel can easily allocate it in the BSS */
 struct proc_global_info {
 	unsigned long cpu_feats[__NR_CPU_FEAT_BITS];
+	/* Wall clock, in ns since the epoch: walltime_ns_base plus the TSC ticks
+	 * since walltime_tsc_base, at walltime_tsc_freq.  That freq starts out as
+	 * the TSC's, and differs when the kernel slews the clock.  Written under
+	 * the seqctr; see __ros_tsc2walltime_ns(). */
+	seq_ctr_t walltime_seqctr;
+	uint64_t walltime_tsc_freq;
+	uint64_t walltime_tsc_base;
+	uint64_t walltime_ns_base;
 } __attribute__((aligned(PGSIZE)));
 #define PROCGINFO_NUM_PAGES  (sizeof(struct proc_global_info) / PGSIZE)
 
@@ -114,4 +122,32 @@ static inline uint32_t __get_vcoreid(void)
 	return __get_vcoreid_from_procinfo();
 }
 
+/* Converts a TSC reading to wall clock ns, without a syscall.  Readers taking
+ * the TSC before the kernel rebases the clock will get a time a little before
+ * the new base, which is what they'd have gotten had they been faster. */
+static inline uint64_t __ros_tsc2walltime_ns(uint64_t tsc)
+{
+	struct proc_global_info *gi = &__proc_global_info;
+	uint64_t freq, tsc_base, ns_base, delta;
+	seq_ctr_t old_seq;
+
+	do {
+		cmb();
+		old_seq = gi->walltime_seqctr;
+		rmb();
+		freq = gi->walltime_tsc_freq;
+		tsc_base = gi->walltime_tsc_base;
+		ns_base = gi->walltime_ns_base;
+	} while (seqctr_retry(old_seq, gi->walltime_seqctr));
+	/* Split the division, so we don't overflow for long deltas */
+	if (tsc >= tsc_base) {
+		delta = tsc - tsc_base;
+		return ns_base + (delta / freq) * 1000000000 +
+		       (delta % freq) * 1000000000 / freq;
+	}
+	delta = tsc_base - tsc;
+	return ns_base - (delta / freq) * 1000000000 -
+	       (delta % freq) * 1000000000 / freq;
+}
+
 #endif /* ifndef ROS_KERNEL */
@@ -18,6 +18,9 @@
 
 #define PROF_DOM_TIMER 1
 #define PROF_DOM_PMU 2
+/* A kthread ran again after blocking.  The data is how long it was blocked, in
+ * nsec, and the trace is where it blocked. */
+#define PROF_DOM_OFFCPU 3
 
 #define PROFTYPE_KERN_TRACE64	1
 
@@ -58,3 +61,19 @@ struct proftype_new_process {
 	uint32_t pid;
 	uint8_t path[0];
 } __attribute__((packed));
+
+/* With "compress on" in #kprof/kpctl, kpdata is a series of chunks instead of
+ * the bare records.  Each chunk is a prof_zchunk followed by z_len bytes: raw
+ * deflate data (no zlib header) that inflates to raw_len bytes, or the raw
+ * bytes themselves if PROF_ZCHUNK_STORED is set.  Chunks split records at
+ * arbitrary points; the records are the concatenation of all chunks' bytes.
+ * The magic can't be mistaken for the start of a record. */
+#define PROF_ZCHUNK_MAGIC		0x315a504b	/* "KPZ1" */
+#define PROF_ZCHUNK_STORED		(1 << 0)
+
+struct prof_zchunk {
+	uint32_t magic;
+	uint32_t raw_len;
+	uint32_t z_len;
+	uint32_t flags;
+} __attribute__((packed));
@@ -13,6 +13,10 @@
 #define SC_ABORT				0x0010		/* syscall abort attempted */
 
 #define MAX_ERRSTR_LEN			128
+/* Most syscalls the kernel will take in one trap.  The rest are ignored. */
+#define MAX_NR_BATCHED_SYSCS	64
+/* Most iovecs readv/writev take */
+#define MAX_NR_IOVECS			1024
 
 struct syscall {
 	unsigned int				num;
@@ -0,0 +1,36 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Binary syscall trace records, read from /proc/PID/strace and #kprof/systrace.
+ * The kernel doesn't format them; see tests/strace.c.
+ *
+ * An entry record has end_timestamp == 0 and no data.  The exit record repeats
+ * the entry's fields, with the retval and whatever data the syscall saved
+ * (e.g. the path for open, the buffer for read and write).  Readers should
+ * read in multiples of sizeof(struct systrace_record). */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define SYSTR_RECORD_SZ				256
+
+struct systrace_record {
+	struct systrace_record_anon {
+		uint64_t		start_timestamp;	/* nsec */
+		uint64_t		end_timestamp;
+		uint64_t		syscallno;
+		uint64_t		arg0;
+		uint64_t		arg1;
+		uint64_t		arg2;
+		uint64_t		arg3;
+		uint64_t		arg4;
+		uint64_t		arg5;
+		int64_t			retval;
+		int32_t			pid;
+		uint32_t		coreid;
+		uint32_t		vcoreid;
+		uint32_t		datalen;
+	};
+	uint8_t			data[SYSTR_RECORD_SZ - sizeof(struct systrace_record_anon)];
+};
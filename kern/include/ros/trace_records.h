@@ -0,0 +1,27 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Binary records read from #kprof/trace.  See kern/include/tracepoint.h. */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define TP_SYSCALL_ENTER		0	/* sysc num, sysc, arg0 */
+#define TP_SYSCALL_EXIT			1	/* sysc num, sysc, retval */
+#define TP_KMSG_SEND			2	/* dst core, pc, type */
+#define TP_KMSG_HANDLE			3	/* src core, pc, 0 */
+#define TP_PAGE_FAULT			4	/* va, prot, retval */
+#define TP_BLOCK_SUBMIT			5	/* breq, first sector, nr sectors */
+#define TP_BLOCK_COMPLETE		6	/* breq, first sector, nr sectors */
+#define TP_QIO_BLOCK			7	/* queue, 0 for read, 1 for write */
+#define TP_QIO_WAKE				8	/* queue, 0 for read, 1 for write */
+#define NR_TRACEPOINTS			9
+
+struct trace_record {
+	uint64_t tstamp;			/* nsec */
+	uint16_t id;
+	uint16_t coreid;
+	uint32_t pid;				/* 0 if no process was current */
+	uint64_t args[3];
+} __attribute__((packed));
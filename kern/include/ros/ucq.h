@@ -5,8 +5,15 @@
  * Unbounded concurrent queues.  Linked buffers/arrays of elements, in page
  * size chunks.  The pages/buffers are linked together by an info struct at the
  * beginning of the page.  Producers and consumers sync on the idxes when
- * operating in a page, and page swaps are synced via the proc* for the kernel
- * and via the ucq's u_lock for the user. 
+ * operating in a page.  For the kernel, a page swap is done by the one producer
+ * whose slot is the first one past the end of the page; the others wait for it.
+ * For the user, page swaps are synced via the ucq's u_lock.
+ *
+ * Used pages are recycled: consumers push them onto a stack of spare pages
+ * (spare_pg is the top, linked through cons_next_pg), up to UCQ_MAX_SPARE_PGS,
+ * and the kernel pops from it before resorting to mmap.  There is only ever
+ * one pusher (under the u_lock) and one popper (the swapping producer), so the
+ * stack has no ABA problem.
  *
  * There's a bunch of details and issues discussed in the Documentation.
  *
@@ -33,13 +40,18 @@
  * etc. */
 struct ucq {
 	atomic_t					prod_idx;		/* both pg and slot nr */
-	atomic_t					spare_pg;		/* mmaped, unused page */
+	atomic_t					spare_pg;		/* stack of unused pages */
 	atomic_t					nr_extra_pgs;	/* nr pages mmaped */
 	atomic_t					cons_idx;		/* cons pg and slot nr */
 	bool						prod_overflow;	/* flag to prevent wraparound */
 	bool						ucq_ready;		/* ucq is ready to be used */
 	/* Userspace lock for modifying the UCQ */
 	uint32_t					u_lock[2];
+	atomic_t					nr_spare_pgs;	/* pages on spare_pg */
+	/* Stats, written by the kernel */
+	atomic_t					nr_pg_swaps;	/* times a page filled up */
+	atomic_t					nr_pg_mmaps;	/* swaps with no spare page */
+	atomic_t					nr_pg_waits;	/* producers that waited */
 };
 
 /* Struct at the beginning of every page/buffer, tracking consumers and
@@ -63,6 +75,7 @@ struct ucq_page {
 };
 
 #define UCQ_WARN_THRESH			1000			/* nr pages befor warning */
+#define UCQ_MAX_SPARE_PGS		8				/* more get munmapped */
 
 #define NR_MSG_PER_PAGE ((PGSIZE - ROUNDUP(sizeof(struct ucq_page_header),     \
                                            __alignof__(struct msg_container))) \
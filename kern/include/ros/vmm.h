@@ -9,8 +9,9 @@
 #include <ros/arch/vmm.h>
 
 #define	VMM_VMCALL_PRINTF	0x1	/* Enable VMCALL output console hack */
+#define	VMM_HALT_POLL		0x2	/* Kernel polls briefly for IRQs on HLT */
 
-#define VMM_ALL_FLAGS	(VMM_VMCALL_PRINTF)
+#define VMM_ALL_FLAGS	(VMM_VMCALL_PRINTF | VMM_HALT_POLL)
 
 enum {
 	RESUME,
@@ -8,13 +8,19 @@
  * info. 
  *
  * One consequence of this: "if some reader holds a rwlock, then any other
- * thread (including itself) can get an rlock". */
+ * thread (including itself) can get an rlock".
+ *
+ * brwlocks are "big reader" locks with the same semantics, for data that is
+ * read all the time and written rarely.  Readers only touch a per-core counter,
+ * so they don't bounce a cache line around.  Writers are expensive: they check
+ * every core's counter.  Each lock costs a cache line per core. */
 
 #pragma once
 
 #include <ros/common.h>
 #include <kthread.h>
 #include <atomic.h>
+#include <arch/arch.h>
 
 struct rwlock {
 	spinlock_t					lock;
@@ -31,3 +37,25 @@ bool canrlock(struct rwlock *rw_lock);
 void runlock(struct rwlock *rw_lock);
 void wlock(struct rwlock *rw_lock);
 void wunlock(struct rwlock *rw_lock);
+
+struct brw_slot {
+	long						nr_readers;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct brwlock {
+	struct brw_slot				*slots;		/* num_cores of them */
+	spinlock_t					lock;
+	bool						writing;
+	unsigned int				nr_drainers;
+	struct cond_var				readers;
+	struct cond_var				writers;
+	struct cond_var				drain;
+};
+
+void brwinit(struct brwlock *bl);
+void brwdestroy(struct brwlock *bl);
+void brlock(struct brwlock *bl);
+bool canbrlock(struct brwlock *bl);
+void brunlock(struct brwlock *bl);
+void bwlock(struct brwlock *bl);
+void bwunlock(struct brwlock *bl);
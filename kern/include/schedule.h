@@ -13,6 +13,7 @@
 #include <corerequest.h>
 
 struct proc;	/* process.h includes us, but we need pointers now */
+struct scp_runq;
 TAILQ_HEAD(proc_list, proc);		/* Declares 'struct proc_list' */
 
 /* One of these embedded in every struct proc */
@@ -20,6 +21,14 @@ struct sched_proc_data {
 	TAILQ_ENTRY(proc)			proc_link;			/* tailq linkage */
 	struct proc_list 			*cur_list;			/* which tailq we're on */
 	struct core_request_data	crd;				/* prov/alloc cores */
+	int							core_prio;			/* higher can preempt */
+	unsigned int				core_shares;		/* weight for fair share */
+	uint64_t					core_deadline;		/* usec to wait for cores */
+	uint64_t					want_since;			/* tsc, when it got needy */
+	struct scp_runq				*runq;				/* SCP run queue, if any */
+	uint64_t					vruntime;			/* SCP weighted run time */
+	uint64_t					scp_ticks;			/* run time charged so far */
+	uint32_t					scp_core;			/* last core the SCP ran on */
 	/* count of lists? */
 	/* other accounting info */
 };
@@ -44,6 +53,10 @@ void __sched_scp_wakeup(struct proc *p);
  * cores, given to MCPs, that have been async returned to the ksched. */
 void __sched_put_idle_core(struct proc *p, uint32_t coreid);
 void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num);
+/* p yielded coreid and is handing it straight to target (proc_yield_to()).  If
+ * this returns TRUE, the core is allocated to target; give it to them or put
+ * it back with __sched_put_idle_core(target, coreid). */
+bool __sched_donate_core(struct proc *p, struct proc *target, uint32_t coreid);
 
 /************** Decision making **************/
 /* Call the main scheduling algorithm.  Not clear yet if the main kernel will
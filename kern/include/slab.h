@@ -12,7 +12,9 @@
  *
  * For large objects, the kmem_slabs point to bufctls, which have the address
  * of their large buffers.  These slabs can consist of more than one contiguous
- * page.
+ * page.  When a large object is allocated, its bufctl goes into the cache's
+ * allocated-buffer hash, keyed by the buffer's address, which is how free finds
+ * the bufctl.  Large objects are exactly obj_size (rounded up to align) bytes.
  *
  * For small objects, the slabs do not use the bufctls.  Instead, they point to
  * the next free object in the slab.  The free objects themselves hold the
@@ -24,6 +26,23 @@
  * overwrite things, so we need to add an extra 4-8 bytes per object for the
  * pointer, and then pass over that data when we return the actual object's
  * address.  This also might fuck with alignment.
+ *
+ * In front of the slabs sits a magazine layer, based on Bonwick and Adams's
+ * "Magazines and Vmem" paper.  Each core has a loaded and a previous magazine,
+ * which are small stacks of constructed objects.  The common alloc and free
+ * paths only touch the calling core's magazines, with irqs disabled.  When
+ * both are empty (alloc) or full (free), the core exchanges a magazine with the
+ * cache's depot, which is a pair of lists of full and empty magazines.  Only
+ * when the depot can't help do we take the cache_lock and hit the slabs.
+ *
+ * Magazines are turned on for all caches once the per-cpu data is set up (we
+ * need num_cores).  Caches created with KMC_NOMAG skip the layer entirely.
+ *
+ * Caches created with KMC_HUGE carve their slabs out of 2MB-aligned chunks of
+ * physical memory, shared by all such caches, instead of taking pages from
+ * wherever the page allocator finds them.  The direct map uses jumbo pages, so
+ * the objects of these caches are covered by a few TLB entries.  The slabs are
+ * still regular pages and are freed like any other.
  */
 
 #pragma once
@@ -32,21 +51,43 @@
 #include <arch/mmu.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <mcs_lock.h>
 
 /* Back in the day, their cutoff for "large objects" was 512B, based on
  * measurements and on not wanting more than 1/8 of internal fragmentation. */
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Rounds per magazine.  14 makes a magazine exactly two cache lines. */
+#define KMC_MAG_SZ 14
+
+/* Flags for kmem_cache_create */
+#define KMC_NOMAG			(1 << 0)	/* bypass the per-core magazines */
+#define KMC_HUGE			(1 << 1)	/* slabs come from 2MB chunks */
+#define KMC_ACCT			(1 << 2)	/* charge objects, see KMC_KMEM */
+/* Charges each object to the current process under the kmem subsystem (see
+ * kmem_acct.h).  The cache keeps who to uncharge behind each object. */
+#define KMC_KMEM_SHIFT		8
+#define KMC_KMEM_MASK		0xf
+#define KMC_KMEM(subsys)	(KMC_ACCT | ((subsys) << KMC_KMEM_SHIFT))
+
 struct kmem_slab;
 
+/* Buckets in the hash table embedded in each kmem_cache.  Once a cache has more
+ * than KMC_HASH_LOAD allocated objects per bucket, we switch to page-sized (or
+ * larger) tables from the page allocator. */
+#define KMC_HASH_INIT_SZ 16
+#define KMC_HASH_LOAD 2
+
 /* Control block for buffers for large-object slabs */
 struct kmem_bufctl {
 	TAILQ_ENTRY(kmem_bufctl) link;
+	SLIST_ENTRY(kmem_bufctl) hash_link;
 	void *buf_addr;
 	struct kmem_slab *my_slab;
 };
 TAILQ_HEAD(kmem_bufctl_list, kmem_bufctl);
+SLIST_HEAD(kmem_bufctl_slist, kmem_bufctl);
 
 /* Slabs contain the objects.  Can be either full, partial, or empty,
  * determined by checking the number of objects busy vs total.  For large
@@ -64,20 +105,58 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine) link;
+	unsigned long nr_rounds;
+	void *rounds[KMC_MAG_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* Per-core state for a kmem_cache.  Only accessed by its core, with irqs
+ * disabled.  Either magazine can be NULL.  prev is always full, empty, or
+ * NULL. */
+struct kmem_pcpu_cache {
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	unsigned long nr_allocs;
+	unsigned long nr_frees;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* The depot holds full and empty magazines for the whole cache.  The _min
+ * fields track the smallest list length since the last reap; that many
+ * magazines weren't needed during the interval and are what we reap. */
+struct kmem_depot {
+	spinlock_t lock;
+	struct kmem_mag_slist full;
+	struct kmem_mag_slist empty;
+	unsigned long nr_full;
+	unsigned long nr_empty;
+	unsigned long nr_full_min;
+	unsigned long nr_empty_min;
+};
+
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
-	spinlock_t cache_lock;
+	struct mcs_lock cache_lock;
 	const char *name;
 	size_t obj_size;
 	int align;
 	int flags;
+	size_t acct_off;		/* KMC_ACCT: where the kmem_acct pointer is */
 	struct kmem_slab_list full_slab_list;
 	struct kmem_slab_list partial_slab_list;
 	struct kmem_slab_list empty_slab_list;
 	void (*ctor)(void *, size_t);
 	void (*dtor)(void *, size_t);
 	unsigned long nr_cur_alloc;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
+	/* buf -> bufctl for allocated large objects, protected by the cache_lock */
+	struct kmem_bufctl_slist *alloc_hash;
+	size_t hh_nr_buckets;
+	size_t hh_nr_items;
+	struct kmem_bufctl_slist static_hash[KMC_HASH_INIT_SZ];
 };
 
 /* List of all kmem_caches, sorted in order of size */
@@ -95,7 +174,8 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
-void kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap_all(void);
 
 /* Debug */
 void print_kmem_cache(struct kmem_cache *kc);
@@ -63,11 +63,20 @@ struct per_cpu_info {
 	taskstate_t *tss;
 	segdesc_t *gdt;
 #endif
-	/* KMSGs */
-	spinlock_t immed_amsg_lock;
-	struct kernel_msg_list immed_amsgs;
-	spinlock_t routine_amsg_lock;
-	struct kernel_msg_list routine_amsgs;
+	/* KMSGs.  Senders push onto the lock-free stacks; this core grabs a whole
+	 * stack at a time.  Routine messages wait in routine_batch, in order. */
+	struct kernel_message *immed_amsgs;
+	struct kernel_message *routine_amsgs;
+	struct kernel_msg_list routine_batch;
+	/* Sender side: kmsg IPIs we sent, and ones we skipped since the
+	 * destination already had one coming. */
+	unsigned long nr_kmsg_ipis;
+	unsigned long nr_kmsg_ipis_avoided;
+	/* FPU saves for vcores and SCPs: how many, how many were skipped since
+	 * the state was untouched, and how much we wrote. */
+	unsigned long nr_fp_saves;
+	unsigned long nr_fp_saves_skipped;
+	uint64_t fp_bytes_saved;
 	/* profiling -- opaque to all but the profiling code. */
 	void *profiling;
 }__attribute__((aligned(ARCH_CL_SIZE)));
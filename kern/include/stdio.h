@@ -32,6 +32,9 @@ void	vprintfmt(void (*putch)(int, void**), void **putdat, const char *fmt, va_li
 // lib/printf.c
 int	( cprintf)(const char *fmt, ...);
 int	vcprintf(const char *fmt, va_list);
+void printk_buffer_init(void);
+void printk_sync(void);
+size_t printk_hist_read(void *va, size_t n, uint64_t off);
 
 // lib/sprintf.c
 int	snprintf(char *str, int size, const char *fmt, ...);
@@ -24,6 +24,9 @@ void *memset(void* p, int what, size_t sz);
 int   memcmp(const void* s1, const void* s2, size_t sz);
 void *memcpy(void* dst, const void* src, size_t sz);
 void *memmove(void *dst, const void* src, size_t sz);
+/* Non-temporal versions, for big buffers that won't be used again soon */
+void *memcpy_nt(void *dst, const void *src, size_t sz);
+void *memset_nt(void *p, int what, size_t sz);
 void *memchr(const void *mem, int chr, int len);
 
 void *memfind(const void *s, int c, size_t len);
@@ -7,46 +7,40 @@
 #include <process.h>
 #include <kref.h>
 #include <ns.h>
+#include <bitmask.h>
+#include <ros/systrace.h>
 
 #define SYSTRACE_ON					0x01
 #define SYSTRACE_LOUD				0x02
 #define SYSTRACE_ALLPROC			0x04
 
-#define MAX_SYSTRACES				1024
+#define SYSTRACE_RING_SLOTS			256		/* per core, power of 2 */
 
 #define SYSCALL_STRLEN				128
 
 #define MAX_ASRC_BATCH				10
 
-#define SYSTR_RECORD_SZ				256
-#define SYSTR_BUF_SZ 				PGSIZE
-#define SYSTR_PRETTY_BUF_SZ			(SYSTR_BUF_SZ -                            \
-                                     sizeof(struct systrace_record))
-struct systrace_record {
-	struct systrace_record_anon {
-		uint64_t		start_timestamp, end_timestamp;
-		uintreg_t		syscallno;
-		uintreg_t		arg0;
-		uintreg_t		arg1;
-		uintreg_t		arg2;
-		uintreg_t		arg3;
-		uintreg_t		arg4;
-		uintreg_t		arg5;
-		uintreg_t		retval;
-		int				pid;
-		uint32_t		coreid;
-		uint32_t		vcoreid;
-		char			*pretty_buf;
-		uint8_t			datalen;
-	};
-	uint8_t			data[SYSTR_RECORD_SZ - sizeof(struct systrace_record_anon)];
-};
+/* Syscalls numbered this high or higher can't be picked by the strace filter */
+#define STRACE_MAX_SYSC				256
+
+/* Latency histograms: bucket i counts syscalls that took fewer than 2^(i+1)
+ * TSC ticks.  The last bucket gets the rest.  Syscalls numbered
+ * SYSC_LAT_MAX_SYSC or higher aren't counted. */
+#define SYSC_LAT_MAX_SYSC			256
+#define SYSC_LAT_NR_BUCKETS			40
 
 struct strace {
 	bool tracing;
 	bool inherit;
 	atomic_t nr_drops;
 	unsigned long appx_nr_sysc;
+	/* Filters, set with stracefilter on /proc/PID/ctl.  Zero means no filter.
+	 * With a latency threshold, only exit records for syscalls that took at
+	 * least that long are sent. */
+	bool filter_sysc_on;
+	DECL_BITMASK(filter_sysc, STRACE_MAX_SYSC);
+	pid_t filter_pid;
+	uint64_t filter_lat_nsec;
 	struct kref procs; /* when procs goes to zero, q is hung up. */
 	struct kref users; /* when users goes to zero, q and struct are freed. */
 	struct queue *q;
@@ -86,6 +80,11 @@ int systrace_reg(bool all, struct proc *p);
 int systrace_dereg(bool all, struct proc *p);
 void systrace_print(bool all, struct proc *p);
 void systrace_clear_buffer(void);
+size_t systrace_read(void *va, size_t n);
+
+/* Latency histograms */
+size_t sysc_lat_print(char *buf, size_t bufsz);
+void sysc_lat_reset(void);
 
 /* Utility */
 bool syscall_uses_fd(struct syscall *sysc, int fd);
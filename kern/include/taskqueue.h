@@ -9,16 +9,26 @@
  * 
  * Linux workqueue wrappers:
  *
+ * Each workqueue has a pool of pending work per core, or a single pool if it is
+ * WQ_UNBOUND.  A pool's work is run by 'drainers', which are routine kmsgs that
+ * run work until the pool is empty, so a burst of queue_work() calls costs one
+ * kmsg.  If a drainer blocks, the next queue_work() starts another one, so
+ * blocking work doesn't hold up the rest of the pool (unless the workqueue is
+ * WQ_ORDERED).
+ *
  * Caveats:
- * - Workqueues have no core affinity or anything.  queued work goes to the
- * calling core.  Scheduled work goes to core 0.
- * - There are no extra delays in time.  All work are RKMs.
- * - You can't cancel a message.  The differences btw work and delayed_work
- * aren't entirely clear.
+ * - queue_work() uses the calling core's pool.  Scheduled work goes to core 0.
+ * Unbound work runs on the calling core, unless an MCP owns it.
+ * - Queueing work that is already pending does nothing and returns FALSE.
+ * - Delayed work uses an alarm on the calling core, with some slack so that it
+ * can share an interrupt with nearby alarms.
+ * - cancel_*_sync() don't wait for work that is already running.
  */
 
 #pragma once
 
+#include <alarm.h>
+
 typedef void (*task_fn_t)(void *context, int pending);
 struct taskqueue {};
 struct task {
@@ -39,20 +49,31 @@ int taskqueue_enqueue(struct taskqueue *queue, struct task *task);
 	(str)->ta_func = func;                                                     \
 	(str)->ta_context = (void*)arg;
 
-struct workqueue_struct {
-};
+#define WQ_UNBOUND				(1 << 0)	/* one pool, not per core */
+#define WQ_ORDERED				(1 << 1)	/* one item at a time, in order */
+#define WQ_NAME_LEN				32
+
+struct workqueue_struct;
+struct wq_pool;
 
 struct work_struct {
 	void (*func)(struct work_struct *);
-	/* TODO: args and bookkeeping to support cancel{,_sync}. */
 	void *arg;
+	TAILQ_ENTRY(work_struct)	link;
+	struct wq_pool				*pool;		/* set while on a pool */
+	atomic_t					pending;	/* queued, or its alarm is set */
+	uint64_t					queued_tsc;
 };
+TAILQ_HEAD(work_tailq, work_struct);
 
 /* Delayed work is embedded in other structs.  Handlers will expect to get a
  * work_struct pointer. */
 struct delayed_work {
 	struct work_struct 			work;
-	/* TODO: support for the actual alarm / timer */
+	struct workqueue_struct		*wq;
+	uint32_t					coreid;
+	struct alarm_waiter			alarm;
+	struct timer_chain			*tchain;	/* where alarm was last set */
 };
 
 static inline struct delayed_work *to_delayed_work(struct work_struct *work)
@@ -60,17 +81,53 @@ static inline struct delayed_work *to_delayed_work(struct work_struct *work)
 	return container_of(work, struct delayed_work, work);
 }
 
-#define INIT_DELAYED_WORK(dwp, funcp) (dwp)->work.func = (funcp)
-#define INIT_WORK(wp, funcp) (wp)->func = (funcp)
+static inline bool work_pending(struct work_struct *work)
+{
+	return atomic_read(&work->pending);
+}
+
+static inline bool delayed_work_pending(struct delayed_work *dwork)
+{
+	return work_pending(&dwork->work);
+}
+
+/* Snapshot of a workqueue's counters.  Delays are from queueing to running,
+ * in TSC ticks.  coalesced counts attempts to queue already-pending work. */
+struct wq_stats {
+	char						name[WQ_NAME_LEN];
+	unsigned int				flags;
+	uint64_t					nr_queued;
+	uint64_t					nr_coalesced;
+	uint64_t					nr_run;
+	uint64_t					total_delay;
+	uint64_t					max_delay;
+};
+
+extern struct workqueue_struct *system_wq;
+
+void init_work(struct work_struct *work, void (*func)(struct work_struct *));
+void init_delayed_work(struct delayed_work *dwork,
+                       void (*func)(struct work_struct *));
+#define INIT_DELAYED_WORK(dwp, funcp) init_delayed_work(dwp, funcp)
+#define INIT_WORK(wp, funcp) init_work(wp, funcp)
+
+void workqueue_init(void);
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags,
+                                         int max_active);
 void flush_workqueue(struct workqueue_struct *wq);
 void destroy_workqueue(struct workqueue_struct *wq);
 struct workqueue_struct *create_singlethread_workqueue(char *name);
+size_t workqueue_get_stats(struct wq_stats **stats_p);
 
+bool queue_work_on(int coreid, struct workqueue_struct *wq,
+                   struct work_struct *work);
 bool queue_work(struct workqueue_struct *wq, struct work_struct *dwork);
 bool schedule_work(struct work_struct *dwork);
 bool cancel_work(struct work_struct *dwork);
 bool cancel_work_sync(struct work_struct *dwork);
 
+bool queue_delayed_work_on(int coreid, struct workqueue_struct *wq,
+                           struct delayed_work *dwork, unsigned long delay);
 bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
                         unsigned long delay);
 bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
@@ -14,6 +14,9 @@ uint64_t sec2tsc(uint64_t sec);
 uint64_t msec2tsc(uint64_t msec);
 uint64_t usec2tsc(uint64_t usec);
 uint64_t nsec2tsc(uint64_t nsec);
+void walltime_init(void);
+void set_walltime(uint64_t epoch_ns);
+void set_walltime_slew(long ppb);
 uint64_t epoch_tsc(void);
 uint64_t epoch_sec(void);
 uint64_t epoch_msec(void);
@@ -0,0 +1,33 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Static tracepoints.
+ *
+ * A tracepoint is a call to tracepoint(TP_FOO, a0, a1, a2) at a fixed spot in
+ * the kernel.  The IDs and what their args mean are in ros/trace_records.h.
+ * Tracepoints are off by default, so the cost is a predictable branch on
+ * tracepoints_enabled.  Once one is turned on (echo on page_fault >
+ * #kprof/trace), each hit writes a timestamped struct trace_record into its
+ * core's ring.  Reading #kprof/trace drains the rings.  If a ring fills up
+ * before anyone reads it, new records are dropped and counted. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/trace_records.h>
+#include <compiler.h>
+
+extern uint64_t tracepoints_enabled;
+
+#define tracepoint(id, a0, a1, a2)                                             \
+do {                                                                           \
+	if (unlikely(tracepoints_enabled & (1ULL << (id))))                        \
+		__tracepoint((id), (uint64_t)(a0), (uint64_t)(a1), (uint64_t)(a2));    \
+} while (0)
+
+void __tracepoint(int id, uint64_t a0, uint64_t a1, uint64_t a2);
+
+int tracepoint_enable(const char *name, bool on);
+void tracepoint_reset(void);
+size_t tracepoint_read(void *va, size_t n);
+size_t tracepoint_status(char *buf, size_t bufsz);
@@ -15,6 +15,10 @@ typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
 
 void idt_init(void);
 int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf);
+int register_irq_core(int irq, isr_t handler, void *irq_arg, uint32_t tbdf,
+                      int os_coreid);
+int register_irq_vector(int irq, isr_t handler, void *irq_arg, uint32_t tbdf,
+                        int os_coreid);
 int route_irqs(int cpu_vec, int coreid);
 void print_trapframe(struct hw_trapframe *hw_tf);
 void print_swtrapframe(struct sw_trapframe *sw_tf);
@@ -28,6 +32,8 @@ void timer_interrupt(struct hw_trapframe *hw_tf, void *data);
 extern inline void save_fp_state(struct ancillary_state *silly);
 extern inline void restore_fp_state(struct ancillary_state *silly);
 extern inline void init_fp_state(void);
+/* Returns the bytes saved; 0 if the state was in its init config. */
+extern inline size_t save_fp_state_lazy(struct ancillary_state *silly);
 /* Set stacktop for the current core to be the stack the kernel will start on
  * when trapping/interrupting from userspace */
 void set_stack_top(uintptr_t stacktop);
@@ -113,6 +119,8 @@ typedef struct kernel_message kernel_message_t;
 void kernel_msg_init(void);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+bool send_kernel_message_noipi(uint32_t dst, amr_t pc, long arg0, long arg1,
+                               long arg2, int type);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 bool has_routine_kmsg(void);
 void process_routine_kmsg(void);
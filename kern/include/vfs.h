@@ -24,6 +24,8 @@
 #include <pagemap.h>
 #include <blockdev.h>
 #include <fdtap.h>
+#include <rcu.h>
+#include <rhashtable.h>
 
 /* ghetto preprocessor hacks (since proc includes vfs) */
 struct page;
@@ -133,11 +135,11 @@ struct super_block {
 	struct io_wb_tailq			s_io_wb;		/* writebacks */
 	struct file_tailq			s_files;		/* assigned files */
 	struct dentry_tailq			s_lru_d;		/* unused dentries (in dcache)*/
+	struct dentry_tailq			s_lru_neg;		/* negative dentries */
+	unsigned int				s_nr_neg;		/* nr on s_lru_neg */
 	spinlock_t					s_lru_lock;
-	struct hashtable			*s_dcache;		/* dentry cache */
-	spinlock_t					s_dcache_lock;
-	struct hashtable			*s_icache;		/* inode cache */
-	spinlock_t					s_icache_lock;
+	struct dcache_bucket		*s_dcache;		/* dentry cache */
+	struct rhashtable			s_icache;		/* inode cache, by i_ino */
 	struct block_device			*s_bdev;
 	TAILQ_ENTRY(super_block)	s_instances;	/* list of sbs of this fs type*/
 	char						s_name[32];
@@ -174,6 +176,7 @@ struct inode {
 	struct dentry_tailq			i_dentry;		/* all dentries pointing here*/
 	unsigned long				i_ino;
 	struct kref					i_kref;
+	struct rcu_head				i_rcu;
 	int							i_mode;			/* access mode and file type */
 	unsigned int				i_nlink;		/* hard links */
 	uid_t						i_uid;
@@ -227,6 +230,20 @@ struct inode_operations {
 #define DENTRY_USED			0x01 	/* has a kref > 0 */
 #define DENTRY_NEGATIVE		0x02	/* cache of a failed lookup */
 #define DENTRY_DYING		0x04	/* should be freed on release */
+#define DENTRY_HASHED		0x08	/* in the dcache */
+
+/* The dcache is a hash table per superblock.  Writers lock the bucket, readers
+ * walk the chains under RCU.  Lock ordering: bucket lock, then d_lock, then the
+ * sb's s_lru_lock.  Negative dentries past DCACHE_MAX_NEG get pruned, oldest
+ * first. */
+#define DCACHE_NR_BUCKETS	512		/* power of 2 */
+#define DCACHE_MAX_NEG		1024	/* per superblock */
+#define DCACHE_PRUNE_BATCH	32
+
+struct dcache_bucket {
+	spinlock_t					lock;
+	struct dentry				*head;
+};
 
 /* Dentry: in memory object, corresponding to an element of a path.  E.g. /,
  * usr, bin, and vim are all dentries.  All have inodes.  Vim happens to be a
@@ -241,6 +258,8 @@ struct dentry {
 	spinlock_t					d_lock;
 	struct inode				*d_inode;
 	TAILQ_ENTRY(dentry)			d_lru;			/* unused list */
+	struct dentry				*d_hash_next;	/* dcache bucket chain */
+	struct rcu_head				d_rcu;
 	TAILQ_ENTRY(dentry)			d_alias;		/* linkage for i_dentry */
 	struct dentry_tailq			d_subdirs;
 	TAILQ_ENTRY(dentry)			d_subdirs_link;
@@ -392,7 +411,7 @@ struct file_desc {
 
 /* All open files for a process */
 struct fd_table {
-	spinlock_t					lock;
+	spinlock_t					lock;			/* chan lookups don't lock */
 	bool						closed;
 	int							max_files;		/* max files ptd to by fd */
 	int							max_fdset;		/* max of the current fd_set */
@@ -463,6 +482,7 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want);
 void dcache_put(struct super_block *sb, struct dentry *key_val);
 struct dentry *dcache_remove(struct super_block *sb, struct dentry *key);
 void dcache_prune(struct super_block *sb, bool negative_only);
+void dcache_prune_nr(struct super_block *sb, bool negative, unsigned int nr);
 int generic_dentry_hash(struct dentry *dentry, struct qstr *qstr);
 
 /* Inode Functions */
@@ -509,7 +529,7 @@ int insert_obj_fdt(struct fd_table *fdt, void *obj, int low_fd, int fd_flags,
                    bool must_use_low, bool vfs);
 bool close_fd(struct fd_table *fdt, int fd);
 void close_fdt(struct fd_table *open_files, bool cloexec);
-void clone_fdt(struct fd_table *src, struct fd_table *dst);
+void clone_fdt(struct fd_table *src, struct fd_table *dst, bool cloexec);
 
 struct file *get_file_from_fd(struct fd_table *open_files, int fd);
 void put_file_from_fd(struct fd_table *open_files, int file_desc);
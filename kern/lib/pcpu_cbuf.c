@@ -0,0 +1,212 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Per-CPU circular buffers.  See pcpu_cbuf.h.
+ *
+ * Positions are byte counts since the buffer was created, so they never wrap,
+ * and a core's buffer holds the bytes in [tail, head).  Records start on
+ * 8-byte boundaries with a header giving their unpadded length.  Only the
+ * owning core writes head, tail, and the data.
+ *
+ * Before overwriting old records, the writer publishes the new tail.  A reader
+ * copies a record out and then checks that tail hasn't passed it; if it has,
+ * the copy may be torn, so the reader drops it and resyncs at the tail.  This
+ * is a seqlock where tail is the sequence. */
+
+#include <pcpu_cbuf.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <assert.h>
+#include <smp.h>
+
+struct pcpu_cbuf_rec {
+	uint32_t len;				/* header included, padding not */
+	uint32_t pad;
+	uint64_t tsc;
+};
+
+static size_t pcpu_cbuf_rec_size(size_t len)
+{
+	return ROUNDUP(sizeof(struct pcpu_cbuf_rec) + len, sizeof(uint64_t));
+}
+
+static void pcpu_cbuf_copy_in(struct pcpu_cbuf *cb, struct pcpu_cbuf_cpu *c,
+                              uint64_t pos, const void *src, size_t len)
+{
+	size_t off = pos & (cb->size - 1);
+	size_t amt = MIN(len, cb->size - off);
+
+	memcpy(c->data + off, src, amt);
+	memcpy(c->data, src + amt, len - amt);
+}
+
+static void pcpu_cbuf_copy_out(struct pcpu_cbuf *cb, struct pcpu_cbuf_cpu *c,
+                               uint64_t pos, void *dst, size_t len)
+{
+	size_t off = pos & (cb->size - 1);
+	size_t amt = MIN(len, cb->size - off);
+
+	memcpy(dst, c->data + off, amt);
+	memcpy(dst + amt, c->data, len - amt);
+}
+
+/* Sets up a buffer of size bytes (rounded up to a power of 2) per core. */
+bool pcpu_cbuf_init(struct pcpu_cbuf *cb, size_t size)
+{
+	size = MAX(ROUNDUPPWR2(size), sizeof(struct pcpu_cbuf_rec));
+	cb->size = size;
+	cb->cpus = kzmalloc_align(sizeof(struct pcpu_cbuf_cpu) * num_cores,
+	                          KMALLOC_WAIT, ARCH_CL_SIZE);
+	if (!cb->cpus)
+		return FALSE;
+	for (int i = 0; i < num_cores; i++) {
+		cb->cpus[i].data = kmalloc(size, KMALLOC_WAIT);
+		if (!cb->cpus[i].data) {
+			pcpu_cbuf_destroy(cb);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* No one can be writing or reading. */
+void pcpu_cbuf_destroy(struct pcpu_cbuf *cb)
+{
+	if (!cb->cpus)
+		return;
+	for (int i = 0; i < num_cores; i++)
+		kfree(cb->cpus[i].data);
+	kfree(cb->cpus);
+	cb->cpus = NULL;
+}
+
+size_t pcpu_cbuf_max_write_size(const struct pcpu_cbuf *cb)
+{
+	return cb->size - sizeof(struct pcpu_cbuf_rec);
+}
+
+/* Appends a record to the calling core's buffer, dropping old records to make
+ * room.  Returns len, or 0 if the record can never fit. */
+size_t pcpu_cbuf_write(struct pcpu_cbuf *cb, const void *data, size_t len)
+{
+	size_t esize = pcpu_cbuf_rec_size(len);
+	struct pcpu_cbuf_rec rec;
+	struct pcpu_cbuf_cpu *c;
+	uint64_t head, tail;
+	int8_t irq_state = 0;
+
+	if (esize > cb->size)
+		return 0;
+	disable_irqsave(&irq_state);
+	c = &cb->cpus[core_id()];
+	head = c->head;
+	tail = c->tail;
+	while (head + esize - tail > cb->size) {
+		pcpu_cbuf_copy_out(cb, c, tail, &rec, sizeof(rec));
+		tail += pcpu_cbuf_rec_size(rec.len - sizeof(rec));
+	}
+	if (tail != c->tail) {
+		ACCESS_ONCE(c->tail) = tail;
+		/* Readers must see the new tail before any of the new data */
+		wmb();
+	}
+	rec.len = sizeof(rec) + len;
+	rec.pad = 0;
+	rec.tsc = read_tsc();
+	pcpu_cbuf_copy_in(cb, c, head, &rec, sizeof(rec));
+	pcpu_cbuf_copy_in(cb, c, head + sizeof(rec), data, len);
+	/* The record must be visible before the head that covers it */
+	wmb();
+	ACCESS_ONCE(c->head) = head + esize;
+	enable_irqsave(&irq_state);
+	return len;
+}
+
+/* Starts a reader at the oldest records, or, if from_now, after the newest. */
+bool pcpu_cbuf_cursor_init(struct pcpu_cbuf *cb, struct pcpu_cbuf_cursor *cur,
+                           bool from_now)
+{
+	cur->pos = kzmalloc(sizeof(uint64_t) * num_cores, KMALLOC_WAIT);
+	if (!cur->pos)
+		return FALSE;
+	cur->lost_bytes = 0;
+	for (int i = 0; i < num_cores; i++)
+		cur->pos[i] = from_now ? ACCESS_ONCE(cb->cpus[i].head)
+		                       : ACCESS_ONCE(cb->cpus[i].tail);
+	return TRUE;
+}
+
+void pcpu_cbuf_cursor_destroy(struct pcpu_cbuf_cursor *cur)
+{
+	kfree(cur->pos);
+	cur->pos = NULL;
+}
+
+/* Moves pos to the tail if the writer overwrote it.  Returns TRUE if there's
+ * a record at pos, whose header we copy into rec. */
+static bool pcpu_cbuf_peek(struct pcpu_cbuf *cb, struct pcpu_cbuf_cursor *cur,
+                           int cpu, struct pcpu_cbuf_rec *rec)
+{
+	struct pcpu_cbuf_cpu *c = &cb->cpus[cpu];
+	uint64_t *pos = &cur->pos[cpu];
+	uint64_t head, tail;
+
+	while (1) {
+		head = ACCESS_ONCE(c->head);
+		tail = ACCESS_ONCE(c->tail);
+		if (*pos < tail) {
+			cur->lost_bytes += tail - *pos;
+			*pos = tail;
+		}
+		if (*pos >= head)
+			return FALSE;
+		/* pairs with the writer's wmb before it published head */
+		rmb();
+		pcpu_cbuf_copy_out(cb, c, *pos, rec, sizeof(*rec));
+		/* pairs with the writer's wmb after it published tail */
+		rmb();
+		if (ACCESS_ONCE(c->tail) <= *pos)
+			return TRUE;
+	}
+}
+
+/* Copies the oldest record that cur hasn't seen, from any core, into data,
+ * truncating it to len bytes.  Returns the record's full length, or -1 if
+ * there aren't any new records.  cpu and tsc, if not NULL, get the core that
+ * wrote it and when. */
+ssize_t pcpu_cbuf_read(struct pcpu_cbuf *cb, struct pcpu_cbuf_cursor *cur,
+                       void *data, size_t len, int *cpu, uint64_t *tsc)
+{
+	struct pcpu_cbuf_rec rec, best_rec;
+	struct pcpu_cbuf_cpu *c;
+	int best;
+	size_t rlen;
+
+	while (1) {
+		best = -1;
+		for (int i = 0; i < num_cores; i++) {
+			if (!pcpu_cbuf_peek(cb, cur, i, &rec))
+				continue;
+			if (best < 0 || rec.tsc < best_rec.tsc) {
+				best = i;
+				best_rec = rec;
+			}
+		}
+		if (best < 0)
+			return -1;
+		c = &cb->cpus[best];
+		rlen = best_rec.len - sizeof(rec);
+		pcpu_cbuf_copy_out(cb, c, cur->pos[best] + sizeof(rec), data,
+		                   MIN(len, rlen));
+		rmb();
+		/* Overwritten while we copied; peek will count it as lost */
+		if (ACCESS_ONCE(c->tail) > cur->pos[best])
+			continue;
+		cur->pos[best] += pcpu_cbuf_rec_size(rlen);
+		if (cpu)
+			*cpu = best;
+		if (tsc)
+			*tsc = best_rec.tsc;
+		return rlen;
+	}
+}
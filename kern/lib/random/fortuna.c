@@ -120,7 +120,7 @@ struct FState {
 	mdCtx pool[numPools];
 	ciphCtx ciph;
 	unsigned reseedCount;
-	int32_t lastReseedTime;
+	uint64_t lastReseedTime;
 	unsigned pool0Bytes;
 	unsigned rndPos;
 	int tricksDone;
@@ -137,7 +137,8 @@ typedef struct FState FState;
 
 static void ciph_init(ciphCtx *ctx, const uint8_t *key, int klen)
 {
-	rijndael_set_key(ctx, (const uint32_t *)key, klen, 1);
+	/* klen is in bytes, rijndael wants bits */
+	rijndael_set_key(ctx, (const uint32_t *)key, klen * 8, 1);
 }
 
 static void ciph_encrypt(ciphCtx *ctx, const uint8_t *in, uint8_t *out)
@@ -206,10 +207,10 @@ static void encrypt_counter(FState *st, uint8_t *dst)
 static int enough_time_passed(FState *st)
 {
 	int ok;
-	int32_t now;
-	int32_t last = st->lastReseedTime;
+	uint64_t now;
+	uint64_t last = st->lastReseedTime;
 
-	now = tsc2sec(read_tsc());
+	now = tsc2usec(read_tsc());
 
 	/* check how much time has passed */
 	ok = 0;
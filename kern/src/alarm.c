@@ -7,11 +7,31 @@
  * systems, you won't wake up til after the time you specify. (for now, this
  * might change).
  *
+ * Each tchain is a hierarchical timing wheel, keyed on the awaiters' fire_time:
+ * their wake_up_time, rounded up within their slack (see __set_fire_time()).
+ * Rounding lines up nearby alarms that can tolerate it on the same time, so
+ * they go off in one interrupt.
+ *
+ * tchain->clk is the wheel's notion of now, in wheel ticks.  An awaiter goes in
+ * the lowest level where its slot is fewer than TW_LEVEL_SIZE slots past clk's
+ * slot at that level, so inserts and removals are O(1).  Level 0 can hold clk's
+ * own slot, but the higher levels never do.  When clk moves into a higher-level
+ * slot, that slot's awaiters cascade down to the lower levels (or fire).
+ *
+ * The interrupt is set for the earliest level-0 awaiter or for the start of the
+ * next occupied higher-level slot, whichever comes first.  That way we never go
+ * off early and we cascade on time.  Each level has a bitmap of its occupied
+ * slots, so finding those is cheap.
+ *
+ * Removing an awaiter doesn't reprogram the interrupt, even if it was the
+ * earliest.  We'll take an interrupt with nothing to do and reprogram then,
+ * which is cheaper than a timer write on every unset_alarm() (the common case
+ * for timeouts).  The exception is when the tchain goes empty; then we turn the
+ * interrupt off, so idle cores stay quiet.
+ *
  * TODO:
  * 	- have a kernel sense of time, instead of just the TSC or whatever timer the
- * 	chain uses...
- * 	- coalesce or otherwise deal with alarms that are close to cut down on
- * 	interrupt overhead. */
+ * 	chain uses... */
 
 #include <ros/common.h>
 #include <sys/queue.h>
@@ -21,29 +41,22 @@
 #include <smp.h>
 #include <kmalloc.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
-static void reset_tchain_times(struct timer_chain *tchain)
-{
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
-	}
-}
+#define TW_SLOT_MASK (TW_LEVEL_SIZE - 1)
 
 /* One time set up of a tchain, currently called in per_cpu_init() */
 void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	tchain->earliest_time = ALARM_POISON_TIME;
+	tchain->clk = read_tsc() >> TW_TICK_SHIFT;
+	tchain->nr_waiters = 0;
+	for (int i = 0; i < TW_NR_LEVELS; i++) {
+		tchain->tw_bitmap[i] = 0;
+		for (int j = 0; j < TW_LEVEL_SIZE; j++)
+			BSD_LIST_INIT(&tchain->tw_slots[i][j]);
+	}
 	tchain->set_interrupt = set_interrupt;
-	reset_tchain_times(tchain);
 }
 
 /* Initializes a new awaiter.  Pass 0 for the function if you want it to be a
@@ -51,6 +64,7 @@ void init_timer_chain(struct timer_chain *tchain,
 static void __init_awaiter(struct alarm_waiter *waiter)
 {
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
 	waiter->on_tchain = FALSE;
 	waiter->holds_tchain_lock = FALSE;
 	if (!waiter->has_func)
@@ -105,22 +119,110 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec)
+{
+	waiter->slack = usec2tsc(usec);
+}
+
+/* Rounds the wake up time up to the largest power of two that fits in the
+ * slack.  Alarms with similar slack that are close together end up with the
+ * same fire_time. */
+static void __set_fire_time(struct alarm_waiter *waiter)
+{
+	uint64_t mask;
+
+	if (!waiter->slack) {
+		waiter->fire_time = waiter->wake_up_time;
+		return;
+	}
+	mask = (1ULL << LOG2_DOWN(waiter->slack)) - 1;
+	waiter->fire_time = (waiter->wake_up_time + mask) & ~mask;
+	if (waiter->fire_time < waiter->wake_up_time)	/* wrapped */
+		waiter->fire_time = waiter->wake_up_time;
+}
+
+static uint64_t tw_level_clk(uint64_t clk, int level)
+{
+	return clk >> (level * TW_LEVEL_SHIFT);
+}
+
+static void __tw_insert(struct timer_chain *tchain, struct alarm_waiter *waiter)
+{
+	uint64_t exp = MAX(waiter->fire_time >> TW_TICK_SHIFT, tchain->clk);
+	uint64_t slot_nr;
+	int level;
+
+	for (level = 0; level < TW_NR_LEVELS; level++) {
+		slot_nr = tw_level_clk(exp, level);
+		if (slot_nr - tw_level_clk(tchain->clk, level) < TW_LEVEL_SIZE)
+			break;
+	}
+	/* Past the end of the top level.  Park it in the last slot; it'll cascade
+	 * back here until it fits. */
+	if (level == TW_NR_LEVELS) {
+		level = TW_NR_LEVELS - 1;
+		slot_nr = tw_level_clk(tchain->clk, level) + TW_LEVEL_SIZE - 1;
+	}
+	waiter->tw_level = level;
+	waiter->tw_slot = slot_nr & TW_SLOT_MASK;
+	BSD_LIST_INSERT_HEAD(&tchain->tw_slots[level][waiter->tw_slot], waiter,
+	                     next);
+	tchain->tw_bitmap[level] |= 1ULL << waiter->tw_slot;
+}
+
+static void __tw_remove(struct timer_chain *tchain, struct alarm_waiter *waiter)
+{
+	BSD_LIST_REMOVE(waiter, next);
+	if (BSD_LIST_EMPTY(&tchain->tw_slots[waiter->tw_level][waiter->tw_slot]))
+		tchain->tw_bitmap[waiter->tw_level] &= ~(1ULL << waiter->tw_slot);
+}
+
+/* Returns how many slots past 'from' the first occupied slot is, or -1. */
+static int tw_first_slot(uint64_t bitmap, unsigned int from)
+{
+	if (!bitmap)
+		return -1;
+	if (from)
+		bitmap = (bitmap >> from) | (bitmap << (TW_LEVEL_SIZE - from));
+	return __builtin_ctzll(bitmap);
+}
+
+/* Returns when the tchain next needs to go off, or ALARM_POISON_TIME. */
+static uint64_t __tw_next_event(struct timer_chain *tchain)
+{
+	struct alarm_waiter *i;
+	uint64_t next = (uint64_t)-1;
+	uint64_t level_clk;
+	int off;
+
+	if (!tchain->nr_waiters)
+		return ALARM_POISON_TIME;
+	off = tw_first_slot(tchain->tw_bitmap[0], tchain->clk & TW_SLOT_MASK);
+	if (off >= 0) {
+		BSD_LIST_FOREACH(i, &tchain->tw_slots[0][(tchain->clk + off) &
+		                                         TW_SLOT_MASK], next)
+			next = MIN(next, i->fire_time);
+	}
+	for (int level = 1; level < TW_NR_LEVELS; level++) {
+		level_clk = tw_level_clk(tchain->clk, level);
+		off = tw_first_slot(tchain->tw_bitmap[level], level_clk & TW_SLOT_MASK);
+		if (off < 0)
+			continue;
+		next = MIN(next, (level_clk + off) << (level * TW_LEVEL_SHIFT +
+		                                       TW_TICK_SHIFT));
+	}
+	assert(next != (uint64_t)-1);
+	return next;
+}
+
 /* Helper, makes sure the interrupt is turned on at the right time.  Most of the
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		/* Turn it off */
-		printd("Turning alarm off\n");
-		tchain->set_interrupt(tchain);
-	} else {
-		/* Make sure it is on and set to the earliest time */
-		assert(tchain->earliest_time != ALARM_POISON_TIME);
-		/* TODO: check for times in the past or very close to now */
-		printd("Turning alarm on for %llu\n", tchain->earliest_time);
-		tchain->set_interrupt(tchain);
-	}
+	tchain->earliest_time = __tw_next_event(tchain);
+	printd("Setting alarm for %llu\n", tchain->earliest_time);
+	tchain->set_interrupt(tchain);
 }
 
 static void __run_awaiter(uint32_t srcid, long a0, long a1, long a2)
@@ -148,39 +250,76 @@ static void wake_awaiter(struct alarm_waiter *waiter,
 	}
 }
 
+/* Wakes everyone on list whose time is up, and puts the rest back in the
+ * wheel.  Handlers can (re)arm themselves, but not touch the list. */
+static void __tw_run_list(struct timer_chain *tchain,
+                          struct awaiters_list *list, uint64_t now,
+                          struct hw_trapframe *hw_tf)
+{
+	struct alarm_waiter *i;
+
+	while ((i = BSD_LIST_FIRST(list))) {
+		BSD_LIST_REMOVE(i, next);
+		if (i->fire_time > now) {
+			__tw_insert(tchain, i);
+			continue;
+		}
+		i->on_tchain = FALSE;
+		tchain->nr_waiters--;
+		cmb();	/* enforce waking after removal */
+		/* Don't touch the waiter after waking it, since it could be in use on
+		 * another core (and the waiter can be clobbered as the kthread unwinds
+		 * its stack).  Or it could be kfreed */
+		wake_awaiter(i, hw_tf);
+	}
+}
+
+static void __tw_run_slot(struct timer_chain *tchain, int level,
+                          unsigned int slot, uint64_t now,
+                          struct hw_trapframe *hw_tf)
+{
+	struct awaiters_list list = BSD_LIST_HEAD_INITIALIZER(list);
+
+	if (!(tchain->tw_bitmap[level] & (1ULL << slot)))
+		return;
+	BSD_LIST_SWAP(&list, &tchain->tw_slots[level][slot], alarm_waiter, next);
+	tchain->tw_bitmap[level] &= ~(1ULL << slot);
+	__tw_run_list(tchain, &list, now, hw_tf);
+}
+
+/* Moves clk up to now.  Higher-level slots that clk entered cascade down, top
+ * level first, then we run the level 0 slots that clk passed or is in. */
+static void __tw_advance(struct timer_chain *tchain, uint64_t now,
+                         struct hw_trapframe *hw_tf)
+{
+	uint64_t old_clk = tchain->clk;
+	uint64_t new_clk = MAX(now >> TW_TICK_SHIFT, old_clk);
+	uint64_t from, nr;
+
+	tchain->clk = new_clk;
+	for (int level = TW_NR_LEVELS - 1; level > 0; level--) {
+		from = tw_level_clk(old_clk, level);
+		nr = MIN(tw_level_clk(new_clk, level) - from, TW_LEVEL_SIZE);
+		for (uint64_t j = 1; j <= nr; j++)
+			__tw_run_slot(tchain, level, (from + j) & TW_SLOT_MASK, now, hw_tf);
+	}
+	nr = MIN(new_clk - old_clk, TW_LEVEL_SIZE - 1);
+	for (uint64_t j = 0; j <= nr; j++)
+		__tw_run_slot(tchain, 0, (old_clk + j) & TW_SLOT_MASK, now, hw_tf);
+}
+
 /* This is called when an interrupt triggers a tchain, and needs to wake up
  * everyone whose time is up.  Called from IRQ context. */
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 {
-	struct alarm_waiter *i, *temp;
 	uint64_t now = read_tsc();
-	bool changed_list = FALSE;
 	/* why do we disable irqs here?  the lock is irqsave, but we (think we) know
 	 * the timer IRQ for this tchain won't fire again.  disabling irqs is nice
 	 * for the lock debugger.  i don't want to disable the debugger completely,
 	 * and we can't make the debugger ignore irq context code either in the
 	 * general case.  it might be nice for handlers to have IRQs disabled too.*/
 	spin_lock_irqsave(&tchain->lock);
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
-		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			changed_list = TRUE;
-			i->on_tchain = FALSE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
-			cmb();	/* enforce waking after removal */
-			/* Don't touch the waiter after waking it, since it could be in use
-			 * on another core (and the waiter can be clobbered as the kthread
-			 * unwinds its stack).  Or it could be kfreed */
-			wake_awaiter(i, hw_tf);
-		} else {
-			break;
-		}
-	}
-	if (changed_list) {
-		reset_tchain_times(tchain);
-	}
+	__tw_advance(tchain, now, hw_tf);
 	/* Need to reset the interrupt no matter what */
 	reset_tchain_interrupt(tchain);
 	spin_unlock_irqsave(&tchain->lock);
@@ -191,45 +330,16 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	assert(!waiter->on_tchain);
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt later */
-		return TRUE;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	__set_fire_time(waiter);
+	__tw_insert(tchain, waiter);
+	tchain->nr_waiters++;
+	/* Only need to touch the interrupt if we're going off before it */
+	return tchain->earliest_time == ALARM_POISON_TIME ||
+	       waiter->fire_time < tchain->earliest_time;
 }
 
 static void __set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
@@ -252,27 +362,17 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 }
 
 /* Helper, rips the waiter from the tchain, knowing that it is on the list.
- * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
- * lock. */
+ * Returns TRUE if the tchain interrupt needs to be reset, which is only when the
+ * tchain is now empty: idle cores shouldn't take an interrupt for nothing.
+ * Otherwise, if this was the earliest waiter, the interrupt will find nothing
+ * to do and set itself for the next one.  Callers hold the lock. */
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
-	/* Need to make sure earliest and latest are set, in case we're mucking with
-	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-		reset_int = TRUE;		/* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	__tw_remove(tchain, waiter);
+	tchain->nr_waiters--;
 	waiter->on_tchain = FALSE;
-	return reset_int;
+	return !tchain->nr_waiters;
 }
 
 /* Removes waiter from the tchain before it goes off.  Returns TRUE if we
@@ -402,8 +502,8 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
-	if (time) {
+	time = tchain->earliest_time;
+	if (time != ALARM_POISON_TIME) {
 		/* Arm the alarm.  For times in the past, we just need to make sure it
 		 * goes off. */
 		now = read_tsc();
@@ -427,28 +527,29 @@ void print_chain(struct timer_chain *tchain)
 {
 	struct alarm_waiter *i;
 	spin_lock_irqsave(&tchain->lock);
-	printk("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
-		if (i->has_func) {
-			uintptr_t f;
-			if (i->irq_ok)
-				f = (uintptr_t)i->func_irq;
-			else
-				f = (uintptr_t)i->func;
-			char *f_name = get_fn_name(f);
-			printk("\tWaiter %p, time %llu, func %p (%s)\n", i,
-			       i->wake_up_time, f, f_name);
-			kfree(f_name);
-			continue;
+	printk("Chain %p has %lu waiters, next alarm: %llu, clk: %llu\n", tchain,
+	       tchain->nr_waiters, tchain->earliest_time, tchain->clk);
+	for (int level = 0; level < TW_NR_LEVELS; level++) {
+		for (int slot = 0; slot < TW_LEVEL_SIZE; slot++) {
+			BSD_LIST_FOREACH(i, &tchain->tw_slots[level][slot], next) {
+				if (i->has_func) {
+					uintptr_t f;
+					if (i->irq_ok)
+						f = (uintptr_t)i->func_irq;
+					else
+						f = (uintptr_t)i->func;
+					char *f_name = get_fn_name(f);
+					printk("\tWaiter %p, time %llu, func %p (%s)\n", i,
+					       i->wake_up_time, f, f_name);
+					kfree(f_name);
+					continue;
+				}
+				struct kthread *kthread = TAILQ_FIRST(&i->sem.waiters);
+				printk("\tWaiter %p, time: %llu, kthread: %p (%p) %s\n", i,
+				       i->wake_up_time, kthread, (kthread ? kthread->proc : 0),
+				       (kthread ? kthread->name : 0));
+			}
 		}
-		struct kthread *kthread = TAILQ_FIRST(&i->sem.waiters);
-		printk("\tWaiter %p, time: %llu, kthread: %p (%p) %s\n", i,
-		       i->wake_up_time, kthread, (kthread ? kthread->proc : 0),
-		       (kthread ? kthread->name : 0));
-
 	}
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -9,7 +9,13 @@
  * then all paths (like error paths) will have to signal.  Not a big deal
  * either way, but just need to catch all the cases.  Other non-obvious
  * cases are that read and write methods need to wake other readers and
- * writers (in the absence of a broadcast wakeup) */
+ * writers (in the absence of a broadcast wakeup)
+ *
+ * SPSC pipes don't take the lock to move data.  A side that needs to sleep
+ * sets its sleeping flag, then rechecks the other side's offset, under the
+ * lock.  The other side moves its offset, then checks the flag, and only then
+ * grabs the lock to wake it.  The mb()s between those pairs mean either the
+ * sleeper sees the new offset or the waker sees the flag. */
 
 #include <apipe.h>
 #include <ros/ring_buffer.h>
@@ -33,6 +39,17 @@ void apipe_init(struct atomic_pipe *ap, void *buf, size_t buf_sz,
 	cv_init_with_lock(&ap->ap_general_readers, &ap->ap_lock);
 	cv_init_with_lock(&ap->ap_writers, &ap->ap_lock);
 	ap->ap_has_priority_reader = FALSE;
+	ap->ap_spsc = FALSE;
+	ap->ap_rd_sleeping = FALSE;
+	ap->ap_wr_sleeping = FALSE;
+}
+
+/* A pipe with at most one reader and one writer at a time.  See apipe.h. */
+void apipe_init_spsc(struct atomic_pipe *ap, void *buf, size_t buf_sz,
+                     size_t elem_sz)
+{
+	apipe_init(ap, buf, buf_sz, elem_sz);
+	ap->ap_spsc = TRUE;
 }
 
 void apipe_open_reader(struct atomic_pipe *ap)
@@ -80,37 +97,143 @@ void apipe_close_writer(struct atomic_pipe *ap)
 	spin_unlock(&ap->ap_lock);
 }
 
-/* read a pipe that is already locked. */
-int apipe_read_locked(struct atomic_pipe *ap, void *buf, size_t nr_elem)
+/* Helpers: copy nr_elem elements to/from the ring at off, in at most two
+ * chunks.  The ring is a power of 2 elements, so the index is the lower n bits
+ * of the offset. */
+static void __apipe_copy_out(struct atomic_pipe *ap, void *buf, size_t off,
+                             size_t nr_elem)
 {
-	size_t rd_idx;
-	int nr_copied = 0;
+	size_t idx = off & (ap->ap_ring_sz - 1);
+	size_t first = MIN(nr_elem, ap->ap_ring_sz - idx);
+
+	memcpy(buf, ap->ap_buf + idx * ap->ap_elem_sz, first * ap->ap_elem_sz);
+	memcpy(buf + first * ap->ap_elem_sz, ap->ap_buf,
+	       (nr_elem - first) * ap->ap_elem_sz);
+}
+
+static void __apipe_copy_in(struct atomic_pipe *ap, void *buf, size_t off,
+                            size_t nr_elem)
+{
+	size_t idx = off & (ap->ap_ring_sz - 1);
+	size_t first = MIN(nr_elem, ap->ap_ring_sz - idx);
+
+	memcpy(ap->ap_buf + idx * ap->ap_elem_sz, buf, first * ap->ap_elem_sz);
+	memcpy(ap->ap_buf, buf + first * ap->ap_elem_sz,
+	       (nr_elem - first) * ap->ap_elem_sz);
+}
 
-	for (int i = 0; i < nr_elem; i++) {
-		/* readers that call read_locked directly might have failed to check for
-		 * emptiness, so we'll double check early. */
-		if (__ring_empty(ap->ap_wr_off, ap->ap_rd_off))
+/* SPSC helper: sleeps on cv while the other side's offset is still old.
+ * Returns FALSE if it didn't move and no one on the other side (nr_others) is
+ * left to move it. */
+static bool __apipe_spsc_wait(struct atomic_pipe *ap, struct cond_var *cv,
+                              bool *sleeping, size_t *off, size_t old,
+                              unsigned int *nr_others)
+{
+	bool ret = TRUE;
+
+	spin_lock(&ap->ap_lock);
+	*sleeping = TRUE;
+	/* Pairs with __apipe_spsc_wake().  Our flag must be visible before we
+	 * check their offset. */
+	mb();
+	while (ACCESS_ONCE(*off) == old) {
+		if (!*nr_others) {
+			ret = FALSE;
 			break;
-		/* power of 2 elements in the ring buffer, index is the lower n bits */
-		rd_idx = ap->ap_rd_off & (ap->ap_ring_sz - 1);
-		memcpy(buf, ap->ap_buf + rd_idx * ap->ap_elem_sz, ap->ap_elem_sz);
-		ap->ap_rd_off++;
-		buf += ap->ap_elem_sz;
-		nr_copied++;
+		}
+		cv_wait(cv);
+		cpu_relax();
 	}
+	*sleeping = FALSE;
+	spin_unlock(&ap->ap_lock);
+	return ret;
+}
+
+/* SPSC helper: wakes the other side if it's sleeping on cv.  Call after moving
+ * our offset. */
+static void __apipe_spsc_wake(struct atomic_pipe *ap, struct cond_var *cv,
+                              bool *sleeping)
+{
+	/* Our offset must be visible before we check their flag */
+	mb();
+	if (!ACCESS_ONCE(*sleeping))
+		return;
+	spin_lock(&ap->ap_lock);
+	__cv_broadcast(cv);
+	spin_unlock(&ap->ap_lock);
+}
+
+/* SPSC: copies out what's there, up to nr_elem, without blocking. */
+static int __apipe_spsc_read(struct atomic_pipe *ap, void *buf, size_t nr_elem)
+{
+	size_t wr_off = ACCESS_ONCE(ap->ap_wr_off);
+	size_t nr = MIN(nr_elem, __ring_nr_full(wr_off, ap->ap_rd_off));
+
+	if (!nr)
+		return 0;
+	/* Pairs with the wmb in __apipe_spsc_write(): elements before wr_off */
+	rmb();
+	__apipe_copy_out(ap, buf, ap->ap_rd_off, nr);
+	/* Done reading the slots before the writer can have them back */
+	rwmb();
+	ACCESS_ONCE(ap->ap_rd_off) = ap->ap_rd_off + nr;
+	__apipe_spsc_wake(ap, &ap->ap_writers, &ap->ap_wr_sleeping);
+	return nr;
+}
+
+static int __apipe_spsc_write(struct atomic_pipe *ap, void *buf,
+                              size_t nr_elem)
+{
+	size_t rd_off = ACCESS_ONCE(ap->ap_rd_off);
+	size_t nr = MIN(nr_elem, __ring_nr_empty(ap->ap_ring_sz, ap->ap_wr_off,
+	                                         rd_off));
+
+	if (!nr)
+		return 0;
+	/* The reader is done with the slots before rd_off; pairs with its rwmb */
+	rwmb();
+	__apipe_copy_in(ap, buf, ap->ap_wr_off, nr);
+	wmb();
+	ACCESS_ONCE(ap->ap_wr_off) = ap->ap_wr_off + nr;
+	__apipe_spsc_wake(ap, &ap->ap_general_readers, &ap->ap_rd_sleeping);
+	return nr;
+}
+
+/* read a pipe that is already locked.  For SPSC pipes, there's no lock; this is
+ * just a non-blocking read. */
+int apipe_read_locked(struct atomic_pipe *ap, void *buf, size_t nr_elem)
+{
+	size_t nr;
+
+	if (ap->ap_spsc)
+		return __apipe_spsc_read(ap, buf, nr_elem);
+	/* readers that call read_locked directly might have failed to check for
+	 * emptiness, so we copy at most what's there. */
+	nr = MIN(nr_elem, __ring_nr_full(ap->ap_wr_off, ap->ap_rd_off));
+	__apipe_copy_out(ap, buf, ap->ap_rd_off, nr);
+	ap->ap_rd_off += nr;
 	/* We could have multiple writers blocked.  Just broadcast for them all.
 	 * Alternatively, we could signal one, and then it's on the writers to
 	 * signal further writers (see the note at the top of this file). */
 	__cv_broadcast(&ap->ap_writers);
-	return nr_copied;
+	return nr;
 }
 
 
 int apipe_read(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 {
-	size_t rd_idx;
 	int nr_copied = 0;
 
+	if (ap->ap_spsc) {
+		while (!(nr_copied = __apipe_spsc_read(ap, buf, nr_elem))) {
+			if (!nr_elem ||
+			    !__apipe_spsc_wait(ap, &ap->ap_general_readers,
+			                       &ap->ap_rd_sleeping, &ap->ap_wr_off,
+			                       ap->ap_rd_off, &ap->ap_nr_writers))
+				return 0;
+		}
+		return nr_copied;
+	}
 	spin_lock(&ap->ap_lock);
 	/* Need to wait til the priority reader is gone, and the ring isn't empty.
 	 * If we do this as two steps, (either of priority check or empty check
@@ -138,9 +261,20 @@ int apipe_read(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 
 int apipe_write(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 {
-	size_t wr_idx;
 	int nr_copied = 0;
 
+	if (ap->ap_spsc) {
+		/* The writer is full when the reader's offset is a ring behind */
+		while (!(nr_copied = __apipe_spsc_write(ap, buf, nr_elem))) {
+			if (!nr_elem ||
+			    !__apipe_spsc_wait(ap, &ap->ap_writers, &ap->ap_wr_sleeping,
+			                       &ap->ap_rd_off,
+			                       ap->ap_wr_off - ap->ap_ring_sz,
+			                       &ap->ap_nr_readers))
+				return 0;
+		}
+		return nr_copied;
+	}
 	spin_lock(&ap->ap_lock);
 	/* not sure if we want to check for readers first or not */
 	while (__ring_full(ap->ap_ring_sz, ap->ap_wr_off, ap->ap_rd_off)) {
@@ -151,16 +285,11 @@ int apipe_write(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 		cv_wait(&ap->ap_writers);
 		cpu_relax();
 	}
-	for (int i = 0; i < nr_elem; i++) {
-		/* power of 2 elements in the ring buffer, index is the lower n bits */
-		wr_idx = ap->ap_wr_off & (ap->ap_ring_sz - 1);
-		memcpy(ap->ap_buf + wr_idx * ap->ap_elem_sz, buf, ap->ap_elem_sz);
-		ap->ap_wr_off++;
-		buf += ap->ap_elem_sz;
-		nr_copied++;
-		if (__ring_full(ap->ap_ring_sz, ap->ap_wr_off, ap->ap_rd_off))
-			break;
-	}
+	/* Copy as much as fits, in one shot */
+	nr_copied = MIN(nr_elem, __ring_nr_empty(ap->ap_ring_sz, ap->ap_wr_off,
+	                                         ap->ap_rd_off));
+	__apipe_copy_in(ap, buf, ap->ap_wr_off, nr_copied);
+	ap->ap_wr_off += nr_copied;
 	/* We only need to wake readers, since the reader that woke us used a
 	 * broadcast.  o/w, we'd need to wake the next writer.  (same goes for the
 	 * error case). */
@@ -188,9 +317,24 @@ void *apipe_head(struct atomic_pipe *ap)
 int apipe_read_cond(struct atomic_pipe *ap,
 		    int(*f)(struct atomic_pipe *pipe, void *arg), void *arg)
 {
-	size_t rd_idx;
+	size_t wr_off;
 	int ret;
 
+	if (ap->ap_spsc) {
+		/* We're the only reader, so no priority to sort out.  f reads with
+		 * apipe_read_locked(), which is lockless.  Sleep until there's
+		 * something f hasn't seen. */
+		while (1) {
+			wr_off = ACCESS_ONCE(ap->ap_wr_off);
+			ret = f(ap, arg);
+			if (ret)
+				return ret;
+			if (!__apipe_spsc_wait(ap, &ap->ap_general_readers,
+			                       &ap->ap_rd_sleeping, &ap->ap_wr_off, wr_off,
+			                       &ap->ap_nr_writers))
+				return -1;
+		}
+	}
 	spin_lock(&ap->ap_lock);
 	/* Can only have one priority reader at a time.  Wait our turn. */
 	while (ap->ap_has_priority_reader) {
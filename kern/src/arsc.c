@@ -15,11 +15,29 @@
 #include <smp.h>
 #include <arsc_server.h>
 #include <kref.h>
+#include <kthread.h>
 
+#ifdef CONFIG_ARSC_SERVER
+#define NR_ARSC_SERVERS CONFIG_ARSC_NR_CORES
+#define ARSC_POLL_ROUNDS CONFIG_ARSC_POLL_ROUNDS
+#else
+#define NR_ARSC_SERVERS 1
+#define ARSC_POLL_ROUNDS 0
+#endif
 
+static struct arsc_server *arsc_servers;	/* only with CONFIG_ARSC_SERVER */
 
-struct proc_list arsc_proc_list = TAILQ_HEAD_INITIALIZER(arsc_proc_list);
-spinlock_t arsc_proc_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static intreg_t process_generic_syscalls(struct proc *p, size_t max);
+
+void arsc_init(void)
+{
+	arsc_servers = kzmalloc(sizeof(struct arsc_server) * NR_ARSC_SERVERS,
+	                        KMALLOC_WAIT);
+	for (int i = 0; i < NR_ARSC_SERVERS; i++) {
+		spinlock_init_irqsave(&arsc_servers[i].lock);
+		TAILQ_INIT(&arsc_servers[i].procs);
+	}
+}
 
 intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
 {
@@ -30,9 +48,15 @@ intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
 
 syscall_sring_t* sys_init_arsc(struct proc *p)
 {
-	kref_get(&p->p_kref, 1);		/* we're storing an external ref here */
 	syscall_sring_t* sring;
+	struct arsc_server *srv;
 	void * va;
+
+	if (!arsc_servers) {
+		set_errno(ENOSYS);
+		return NULL;
+	}
+	kref_get(&p->p_kref, 1);		/* we're storing an external ref here */
 	// TODO: need to pin this page in the future when swapping happens
 	va = do_mmap(p,MMAP_LOWEST_VA, SYSCALLRINGSIZE, PROT_READ | PROT_WRITE,
 	             MAP_ANONYMOUS | MAP_POPULATE, NULL, 0);
@@ -49,32 +73,63 @@ syscall_sring_t* sys_init_arsc(struct proc *p)
 	               sring,
 	               SYSCALLRINGSIZE);
 
-	spin_lock_irqsave(&arsc_proc_lock);
-	TAILQ_INSERT_TAIL(&arsc_proc_list, p, proc_arsc_link);
-	spin_unlock_irqsave(&arsc_proc_lock);
+	srv = &arsc_servers[p->pid % NR_ARSC_SERVERS];
+	spin_lock_irqsave(&srv->lock);
+	TAILQ_INSERT_TAIL(&srv->procs, p, proc_arsc_link);
+	spin_unlock_irqsave(&srv->lock);
 	return (syscall_sring_t*)va;
 }
 
+/* Makes one pass over srv's procs, doing up to a batch of syscalls for each.
+ * Returns how many syscalls we ran.
+ *
+ * Only this server removes procs from its list, so p's next pointer is still
+ * good after we drop the lock to work on p (which may block). */
+static size_t arsc_server_pass(struct arsc_server *srv)
+{
+	struct proc *p, *next;
+	size_t count = 0;
+
+	spin_lock_irqsave(&srv->lock);
+	p = TAILQ_FIRST(&srv->procs);
+	spin_unlock_irqsave(&srv->lock);
+	for (; p; p = next) {
+		/* Probably want to try to process a dying process's syscalls. */
+		count += process_generic_syscalls(p, MAX_ASRC_BATCH);
+		spin_lock_irqsave(&srv->lock);
+		next = TAILQ_NEXT(p, proc_arsc_link);
+		if (p->state == PROC_DYING) {
+			TAILQ_REMOVE(&srv->procs, p, proc_arsc_link);
+			spin_unlock_irqsave(&srv->lock);
+			proc_decref(p);
+			continue;
+		}
+		spin_unlock_irqsave(&srv->lock);
+	}
+	return count;
+}
+
+/* Runs forever on its own core, as a routine kmsg, serving the procs hashed to
+ * server a0.  We poll while there is work, and for ARSC_POLL_ROUNDS empty
+ * passes after that, then back off with ever-longer sleeps. */
 void arsc_server(uint32_t srcid, long a0, long a1, long a2)
 {
-	struct proc *p = NULL;
-	TAILQ_INIT(&arsc_proc_list);
+	struct arsc_server *srv = &arsc_servers[a0];
+	unsigned int idle_rounds = 0;
+	uint64_t sleep_usec = 1;
+
 	while (1) {
-		while (TAILQ_EMPTY(&arsc_proc_list))
+		if (arsc_server_pass(srv)) {
+			idle_rounds = 0;
+			sleep_usec = 1;
+			continue;
+		}
+		if (idle_rounds++ < ARSC_POLL_ROUNDS) {
 			cpu_relax();
-		
-		TAILQ_FOREACH(p, &arsc_proc_list, proc_arsc_link) {
-			/* Probably want to try to process a dying process's syscalls.  If
-			 * not, just move it to an else case */
-			process_generic_syscalls (p, MAX_ASRC_BATCH); 
-			if (p->state == PROC_DYING) {
-				TAILQ_REMOVE(&arsc_proc_list, p, proc_arsc_link);
-				proc_decref(p);
-				/* Need to break out, so the TAILQ_FOREACH doesn't flip out.
-				 * It's not fair, but we're not dealing with that yet anyway */
-				break;
-			}
+			continue;
 		}
+		kthread_usleep(sleep_usec);
+		sleep_usec = MIN(sleep_usec * 2, 1000);
 	}
 }
 
@@ -82,7 +137,6 @@ static intreg_t process_generic_syscalls(struct proc *p, size_t max)
 {
 	size_t count = 0;
 	syscall_back_ring_t* sysbr = &p->syscallbackring;
-	struct per_cpu_info* pcpui = &per_cpu_info[core_id()];
 	uintptr_t old_proc;
 	// looking at a process not initialized to perform arsc. 
 	if (sysbr == NULL) 
@@ -106,8 +160,9 @@ static intreg_t process_generic_syscalls(struct proc *p, size_t max)
 		// this assumes we get our answer immediately for the syscall.
 		syscall_req_t* req = RING_GET_REQUEST(sysbr, ++sysbr->req_cons);
 		
-		pcpui->cur_kthread->sysc = req->sc;
-		run_local_syscall(req->sc); // TODO: blocking call will block arcs as well.
+		/* Completes the sysc, including posting to its ev_q, if any.  TODO: a
+		 * blocking call will block the whole server. */
+		run_local_syscall(req->sc);
 		
 		// need to keep the slot in the ring buffer if it is blocked
 		(sysbr->rsp_prod_pvt)++;
@@ -75,6 +75,13 @@ void spin_lock(spinlock_t *lock)
 		}
 	}
 lock:
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled)) {
+		__lockstat_spin_lock(lock, get_caller_pc());
+		post_lock(lock, coreid);
+		return;
+	}
+#endif
 	__spin_lock(lock);
 	/* Memory barriers are handled by the particular arches */
 	post_lock(lock, coreid);
@@ -86,8 +93,13 @@ bool spin_trylock(spinlock_t *lock)
 {
 	uint32_t coreid = core_id_early();
 	bool ret = __spin_trylock(lock);
-	if (ret)
+	if (ret) {
+#ifdef CONFIG_LOCK_STATS
+		if (unlikely(lockstat_enabled))
+			lockstat_acquired(lock, get_caller_pc(), 0, FALSE);
+#endif
 		post_lock(lock, coreid);
+	}
 	return ret;
 }
 
@@ -96,6 +108,10 @@ void spin_unlock(spinlock_t *lock)
 	decrease_lock_depth(lock->calling_core);
 	/* Memory barriers are handled by the particular arches */
 	assert(spin_locked(lock));
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled))
+		lockstat_released(lock);
+#endif
 	__spin_unlock(lock);
 }
 
@@ -13,6 +13,7 @@
 /* These two are needed for the fake interrupt */
 #include <alarm.h>
 #include <smp.h>
+#include <tracepoint.h>
 
 struct file_operations block_f_op;
 struct page_map_operations block_pm_op;
@@ -39,6 +40,8 @@ void block_init(void)
 	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
 	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
 	strlcpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
+	bdev_queue_init(ram_bd);
+	bdev_bcache_init(ram_bd);
 	/* Connect it to the file system */
 	struct file *ram_bf = make_device("/dev/ramdisk", S_IRUSR | S_IWUSR,
 	                                  __S_IFBLK, &block_f_op);
@@ -79,52 +82,213 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
-int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
+/* Does the IO for one request's BHs.  This is the RAM disk's "device".
+ *
+ * Runs of BHs that are contiguous both on the device and in memory are one
+ * extent, and we do each extent in one go. */
+static void bdev_do_breq(struct block_device *bdev, struct block_request *breq)
 {
 	void *src, *dst;
 	unsigned long first_sector;
 	unsigned int nr_sector;
+	int j;
 
-	for (int i = 0; i < breq->nr_bhs; i++) {
+	for (int i = 0; i < breq->nr_bhs; i = j) {
 		first_sector = breq->bhs[i]->bh_sector;
 		nr_sector = breq->bhs[i]->bh_nr_sector;
-		/* Sectors are indexed starting with 0, for now. */
-		if (first_sector + nr_sector > bdev->b_nr_sector) {
-			warn("Exceeding the num sectors!");
-			return -1;
+		for (j = i + 1; j < breq->nr_bhs; j++) {
+			if (breq->bhs[j]->bh_sector != first_sector + nr_sector)
+				break;
+			if (breq->bhs[j]->bh_buffer != breq->bhs[i]->bh_buffer +
+			                               (nr_sector << SECTOR_SZ_LOG))
+				break;
+			nr_sector += breq->bhs[j]->bh_nr_sector;
 		}
 		if (breq->flags & BREQ_READ) {
 			dst = breq->bhs[i]->bh_buffer;
 			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
+		} else {
 			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
 			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
 		}
 		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
+}
+
+static void bdev_dispatch(struct block_device *bdev);
+
+/* Fake completion IRQ for a batch: the device is done with its requests. */
+static void bdev_batch_done(struct alarm_waiter *waiter)
+{
+	struct bdev_batch *batch = (struct bdev_batch*)waiter->data;
+	struct bdev_queue *q = &batch->bdev->b_queue;
+	struct block_request *breq;
+
+	/* The callback can free the breq, so it must be off our list first */
+	while ((breq = TAILQ_FIRST(&batch->breqs))) {
+		TAILQ_REMOVE(&batch->breqs, breq, link);
+		tracepoint(TP_BLOCK_COMPLETE, breq, breq->first_sector,
+		           breq->end_sector - breq->first_sector);
 		if (breq->callback)
 			breq->callback(breq);
-		kfree(waiter);
 	}
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
-	/* Stitch things up, so we know how to find things later */
-	waiter->data = breq;
-	/* Set for 5ms. */
-	set_awaiter_rel(waiter, 5000);
-	set_alarm(tchain, waiter);
+	spin_lock_irqsave(&q->lock);
+	batch->busy = FALSE;
+	q->nr_in_flight--;
+	spin_unlock_irqsave(&q->lock);
+	bdev_dispatch(batch->bdev);
+}
+
+/* Pulls the first pending request and the ones adjacent to it (and in the same
+ * direction) into batch.  Call with the queue locked. */
+static void __bdev_fill_batch(struct bdev_queue *q, struct bdev_batch *batch)
+{
+	struct block_request *breq, *next;
+	unsigned long end, nr_sectors;
+
+	breq = TAILQ_FIRST(&q->pending);
+	end = breq->end_sector;
+	nr_sectors = 0;
+	do {
+		next = TAILQ_NEXT(breq, link);
+		TAILQ_REMOVE(&q->pending, breq, link);
+		TAILQ_INSERT_TAIL(&batch->breqs, breq, link);
+		q->nr_pending_sectors -= breq->end_sector - breq->first_sector;
+		nr_sectors += breq->end_sector - breq->first_sector;
+		end = breq->end_sector;
+		breq = next;
+	} while (breq && (breq->flags == TAILQ_FIRST(&batch->breqs)->flags) &&
+	         (breq->first_sector == end) &&
+	         (nr_sectors + breq->end_sector - breq->first_sector <=
+	          BDEV_MAX_BATCH_SECTORS));
+}
+
+/* Sends batches to the device until we run out of requests or free slots. */
+static void bdev_dispatch(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+	struct bdev_batch *batch;
+	struct block_request *breq;
+
+	while (1) {
+		spin_lock_irqsave(&q->lock);
+		if (q->plugged || TAILQ_EMPTY(&q->pending) ||
+		    (q->nr_in_flight == BDEV_MAX_IN_FLIGHT)) {
+			spin_unlock_irqsave(&q->lock);
+			return;
+		}
+		for (int i = 0; i < BDEV_MAX_IN_FLIGHT; i++) {
+			batch = &q->batches[i];
+			if (!batch->busy)
+				break;
+		}
+		assert(!batch->busy);
+		batch->busy = TRUE;
+		q->nr_in_flight++;
+		__bdev_fill_batch(q, batch);
+		spin_unlock_irqsave(&q->lock);
+		/* The batch is ours until it completes */
+		TAILQ_FOREACH(breq, &batch->breqs, link)
+			bdev_do_breq(bdev, breq);
+		init_awaiter(&batch->done_waiter, bdev_batch_done);
+		batch->done_waiter.data = batch;
+		set_awaiter_rel(&batch->done_waiter, BDEV_LATENCY_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, &batch->done_waiter);
+	}
+}
+
+static void bdev_unplug(struct alarm_waiter *waiter)
+{
+	struct block_device *bdev = (struct block_device*)waiter->data;
+	struct bdev_queue *q = &bdev->b_queue;
+
+	spin_lock_irqsave(&q->lock);
+	q->unplug_armed = FALSE;
+	q->plugged = FALSE;
+	spin_unlock_irqsave(&q->lock);
+	bdev_dispatch(bdev);
+}
+
+void bdev_queue_init(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+
+	spinlock_init_irqsave(&q->lock);
+	TAILQ_INIT(&q->pending);
+	q->nr_pending_sectors = 0;
+	q->plugged = FALSE;
+	q->unplug_armed = FALSE;
+	q->nr_in_flight = 0;
+	for (int i = 0; i < BDEV_MAX_IN_FLIGHT; i++) {
+		q->batches[i].bdev = bdev;
+		TAILQ_INIT(&q->batches[i].breqs);
+		q->batches[i].busy = FALSE;
+	}
+}
+
+/* Queues a request for the device.  The queue plugs for BDEV_PLUG_USEC after
+ * the first request, so that requests submitted close together (e.g. by
+ * readahead or writeback) can be merged.  Once enough sectors are waiting for
+ * a full batch, we unplug early.  The request's callback runs when the IO is
+ * done.  Returns -1 if the request is bad, without calling the callback. */
+int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+	struct block_request *i;
+	struct buffer_head *bh;
+	bool unplug = FALSE;
+
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
+	for (int j = 0; j < breq->nr_bhs; j++) {
+		bh = breq->bhs[j];
+		/* Sectors are indexed starting with 0, for now. */
+		if (bh->bh_sector + bh->bh_nr_sector > bdev->b_nr_sector) {
+			warn("Exceeding the num sectors!");
+			return -1;
+		}
+	}
+	if (breq->nr_bhs) {
+		bh = breq->bhs[breq->nr_bhs - 1];
+		breq->first_sector = breq->bhs[0]->bh_sector;
+		breq->end_sector = bh->bh_sector + bh->bh_nr_sector;
+		/* BHs could be out of order; that just makes us merge less */
+		if (breq->end_sector < breq->first_sector)
+			breq->end_sector = breq->first_sector;
+	} else {
+		breq->first_sector = 0;
+		breq->end_sector = 0;
+	}
+	tracepoint(TP_BLOCK_SUBMIT, breq, breq->first_sector,
+	           breq->end_sector - breq->first_sector);
+	spin_lock_irqsave(&q->lock);
+	/* Keep pending sorted by sector, so adjacent requests are neighbors */
+	TAILQ_FOREACH_REVERSE(i, &q->pending, breq_tailq, link) {
+		if (i->first_sector <= breq->first_sector)
+			break;
+	}
+	if (i)
+		TAILQ_INSERT_AFTER(&q->pending, i, breq, link);
+	else
+		TAILQ_INSERT_HEAD(&q->pending, breq, link);
+	q->nr_pending_sectors += breq->end_sector - breq->first_sector;
+	if (q->nr_pending_sectors >= BDEV_MAX_BATCH_SECTORS) {
+		q->plugged = FALSE;
+		unplug = TRUE;
+	} else if (!q->plugged) {
+		q->plugged = TRUE;
+		/* If an old unplug is still pending, it'll just unplug us sooner */
+		if (!q->unplug_armed) {
+			q->unplug_armed = TRUE;
+			init_awaiter(&q->unplug_waiter, bdev_unplug);
+			q->unplug_waiter.data = bdev;
+			set_awaiter_rel(&q->unplug_waiter, BDEV_PLUG_USEC);
+			set_alarm(&per_cpu_info[core_id()].tchain, &q->unplug_waiter);
+		}
+	}
+	spin_unlock_irqsave(&q->lock);
+	if (unplug)
+		bdev_dispatch(bdev);
 	return 0;
 }
 
@@ -159,6 +323,101 @@ int block_readpage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
+void bdev_bcache_init(struct block_device *bdev)
+{
+	struct bdev_bcache *bc = &bdev->b_bcache;
+
+	spinlock_init(&bc->lock);
+	TAILQ_INIT(&bc->lru);
+	bc->nr_bytes = 0;
+	bc->max_bytes = BDEV_BCACHE_MAX_BYTES;
+	bc->shrinking = FALSE;
+	bc->nr_hits = 0;
+	bc->nr_misses = 0;
+	bc->nr_evictions = 0;
+}
+
+void bdev_set_bcache_max(struct block_device *bdev, size_t max_bytes)
+{
+	bdev->b_bcache.max_bytes = max_bytes;
+}
+
+static void bcache_add(struct bdev_bcache *bc, struct buffer_head *bh)
+{
+	spin_lock(&bc->lock);
+	TAILQ_INSERT_TAIL(&bc->lru, bh, bh_lru);
+	bc->nr_bytes += bh->bh_nr_sector << SECTOR_SZ_LOG;
+	spin_unlock(&bc->lock);
+}
+
+/* Runs the CLOCK hand until the cache is under its limit.  Referenced BHs get a
+ * second chance.  Otherwise we try to remove the BH's whole page from the page
+ * map, which writes it back if needed and calls block_releasepage() to take its
+ * BHs off the list.  Pages that are in use (someone holds a buffer) stay.  Each
+ * call scans a bounded number of BHs (at least two laps of the CLOCK). */
+static void bcache_shrink(struct block_device *bdev)
+{
+	struct bdev_bcache *bc = &bdev->b_bcache;
+	struct buffer_head *bh;
+	unsigned long pg_idx;
+	size_t nr_scan;
+
+	spin_lock(&bc->lock);
+	if (bc->shrinking || (bc->nr_bytes <= bc->max_bytes)) {
+		spin_unlock(&bc->lock);
+		return;
+	}
+	bc->shrinking = TRUE;
+	nr_scan = 2 * (bc->nr_bytes >> SECTOR_SZ_LOG);
+	while ((bc->nr_bytes > bc->max_bytes) && nr_scan--) {
+		bh = TAILQ_FIRST(&bc->lru);
+		if (!bh)
+			break;
+		TAILQ_REMOVE(&bc->lru, bh, bh_lru);
+		TAILQ_INSERT_TAIL(&bc->lru, bh, bh_lru);
+		if (bh->bh_flags & BH_REFERENCED) {
+			bh->bh_flags &= ~BH_REFERENCED;
+			continue;
+		}
+		/* block_releasepage() needs the lock, and can free bh */
+		pg_idx = bh->bh_page->pg_index;
+		spin_unlock(&bc->lock);
+		if (pm_remove_contig(&bdev->b_pm, pg_idx, 1))
+			bc->nr_evictions++;
+		spin_lock(&bc->lock);
+	}
+	bc->shrinking = FALSE;
+	spin_unlock(&bc->lock);
+}
+
+/* Called by the page map when it removes one of our pages.  Call with the PM
+ * locked. */
+static void block_releasepage(struct page_map *pm, struct page *page)
+{
+	struct bdev_bcache *bc = &pm->pm_bdev->b_bcache;
+	struct buffer_head *bh;
+
+	if (!(atomic_read(&page->pg_flags) & PG_BUFFER))
+		return;
+	spin_lock(&bc->lock);
+	for (bh = page->pg_private; bh; bh = bh->bh_next) {
+		TAILQ_REMOVE(&bc->lru, bh, bh_lru);
+		bc->nr_bytes -= bh->bh_nr_sector << SECTOR_SZ_LOG;
+	}
+	spin_unlock(&bc->lock);
+	free_bhs(page);
+}
+
+void print_bdev_bcache(struct block_device *bdev)
+{
+	struct bdev_bcache *bc = &bdev->b_bcache;
+
+	printk("Buffer cache for %s\n", bdev->b_name);
+	printk("\tBytes: %lu / %lu\n", bc->nr_bytes, bc->max_bytes);
+	printk("\tHits: %lu, Misses: %lu, Evictions: %lu\n", bc->nr_hits,
+	       bc->nr_misses, bc->nr_evictions);
+}
+
 /* Returns a BH pointing to the buffer where blk_num from bdev is located (given
  * blocks of size blk_sz).  This uses the page cache for the page allocations
  * and evictions, but only caches blocks that are requested.  Check the docs for
@@ -168,6 +427,9 @@ int block_readpage(struct page_map *pm, struct page *page)
  * Note we're using the lock_page() to sync (which is what we do with the page
  * cache too.  It's not ideal, but keeps things simpler for now.
  *
+ * The BHs are the device's buffer cache; new ones may push out older ones,
+ * see bcache_shrink().
+ *
  * Also note we're a little inconsistent with the use of sector sizes in certain
  * files.  We'll sort it eventually. */
 struct buffer_head *bdev_get_buffer(struct block_device *bdev,
@@ -226,12 +488,18 @@ retry:
 		goto retry;
 	}
 	bh = new;
+	bcache_add(&bdev->b_bcache, bh);
 found:
 	/* At this point, we have the BH for our buf, but it might not be up to
 	 * date, and there might be someone else trying to update it. */
 	/* is it already here and up to date?  if so, we're done */
-	if (bh->bh_flags & BH_UPTODATE)
+	if (bh->bh_flags & BH_UPTODATE) {
+		/* TODO: race on flag modification, like the others */
+		if (!(bh->bh_flags & BH_REFERENCED))
+			bh->bh_flags |= BH_REFERENCED;
+		bdev->b_bcache.nr_hits++;
 		return bh;
+	}
 	/* if not, try to lock the page (could BLOCK).  Using this for syncing. */
 	lock_page(page);
 	/* double check, are we up to date?  if so, we're done */
@@ -256,9 +524,79 @@ found:
 	/* after the data is read, we mark it up to date and unlock the page. */
 	bh->bh_flags |= BH_UPTODATE;
 	unlock_page(page);
+	bdev->b_bcache.nr_misses++;
+	/* our page ref keeps our own page from being evicted */
+	bcache_shrink(bdev);
 	return bh;
 }
 
+/* Writes the BHs of nr pages to bdev in one block request, in page order, so
+ * contiguous extents get merged by bdev_submit_request().  If only_dirty, we
+ * skip BHs that aren't BH_DIRTY, such as blocks of a bdev page that were never
+ * read in. */
+int bdev_write_pages(struct block_device *bdev, struct page **pages,
+                     unsigned int nr, bool only_dirty)
+{
+	struct block_request *breq;
+	struct buffer_head *bh;
+	unsigned int nr_bhs = 0;
+	int error;
+
+	for (int i = 0; i < nr; i++) {
+		for (bh = pages[i]->pg_private; bh; bh = bh->bh_next)
+			nr_bhs++;
+	}
+	breq = kmem_cache_alloc(breq_kcache, 0);
+	if (!breq)
+		return -ENOMEM;
+	breq->flags = BREQ_WRITE;
+	breq->callback = generic_breq_done;
+	breq->data = 0;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	if (nr_bhs > NR_INLINE_BH) {
+		breq->bhs = kmalloc(nr_bhs * sizeof(struct buffer_head*), KMALLOC_WAIT);
+		if (!breq->bhs) {
+			kmem_cache_free(breq_kcache, breq);
+			return -ENOMEM;
+		}
+	}
+	breq->nr_bhs = 0;
+	for (int i = 0; i < nr; i++) {
+		for (bh = pages[i]->pg_private; bh; bh = bh->bh_next) {
+			if (only_dirty && !(bh->bh_flags & BH_DIRTY))
+				continue;
+			/* if it is redirtied while we write, the page will be too */
+			bh->bh_flags &= ~BH_DIRTY;
+			breq->bhs[breq->nr_bhs++] = bh;
+		}
+	}
+	error = 0;
+	if (breq->nr_bhs) {
+		error = bdev_submit_request(bdev, breq);
+		if (!error)
+			sleep_on_breq(breq);
+	}
+	/* our caller will redirty the pages */
+	for (int i = 0; error && (i < breq->nr_bhs); i++)
+		breq->bhs[i]->bh_flags |= BH_DIRTY;
+	if (breq->bhs != breq->local_bhs)
+		kfree(breq->bhs);
+	kmem_cache_free(breq_kcache, breq);
+	return error;
+}
+
+/* Writes back the dirty blocks of a bdev's page */
+int block_writepage(struct page_map *pm, struct page *page)
+{
+	return bdev_write_pages(pm->pm_bdev, &page, 1, TRUE);
+}
+
+int block_writepages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	return bdev_write_pages(pm->pm_bdev, pages, nr, TRUE);
+}
+
 /* Will dirty the block/BH/page for the given block/buffer.  Will have to be
  * careful with the page reclaimer - if someone holds a reference, they can
  * still dirty it. */
@@ -267,7 +605,7 @@ void bdev_dirty_buffer(struct buffer_head *bh)
 	struct page *page = bh->bh_page;
 	/* TODO: race on flag modification */
 	bh->bh_flags |= BH_DIRTY;
-	atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_page_dirty(page);
 }
 
 /* Decrefs the buffer from bdev_get_buffer().  Call this when you no longer
@@ -281,6 +619,9 @@ void bdev_put_buffer(struct buffer_head *bh)
 /* Block device page map ops: */
 struct page_map_operations block_pm_op = {
 	block_readpage,
+	block_writepage,
+	block_writepages,
+	block_releasepage,
 };
 
 /* Block device file ops: for now, we don't let you do much of anything */
@@ -20,6 +20,28 @@ static void error_addr(struct ceq *ceq, struct proc *p, void *addr)
 	       addr, p->pid);
 }
 
+/* Bitmap mode: sets idx's bit, then its word's bit in the summary.  The
+ * consumer clears a summary bit only after it sees the word empty, and then it
+ * rechecks the word, so setting them in this order never loses an idx. */
+static void post_ceq_bitmap(struct ceq *ceq, struct proc *p, int32_t idx)
+{
+	unsigned long word_idx = idx / CEQ_WORD_BITS;
+	atomic_t *word, *sum;
+
+	word = &(ACCESS_ONCE(ceq->bitmap))[word_idx];
+	sum = &(ACCESS_ONCE(ceq->summary))[word_idx / CEQ_WORD_BITS];
+	if (!is_user_rwaddr(word, sizeof(atomic_t))) {
+		error_addr(ceq, p, word);
+		return;
+	}
+	if (!is_user_rwaddr(sum, sizeof(atomic_t))) {
+		error_addr(ceq, p, sum);
+		return;
+	}
+	atomic_or(word, 1UL << (idx % CEQ_WORD_BITS));
+	atomic_or(sum, 1UL << (word_idx % CEQ_WORD_BITS));
+}
+
 void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 {
 	struct ceq_event *ceq_ev;
@@ -77,6 +99,10 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	/* idx_posted write happens before the writes posting it.  the following
 	 * atomic provides the cpu mb() */
 	cmb();
+	if (ACCESS_ONCE(ceq->bitmap)) {
+		post_ceq_bitmap(ceq, p, msg->ev_type);
+		return;
+	}
 	/* I considered checking the buffer for full-ness or the ceq overflow here.
 	 * Those would be reads, which would require a wrmb() right above for every
 	 * ring post, all for something we check for later anyways and for something
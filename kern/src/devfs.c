@@ -33,6 +33,14 @@ void devfs_init(void)
 	} else {
 		kref_put(&dentry->d_kref);
 	}
+	/* Named shared memory (shm_open(), parlib's shmring) is plain KFS files in
+	 * /dev/shm.  Their pages live in the page map and can be mmapped shared. */
+	dentry = lookup_dentry("/dev/shm/", 0);
+	if (!dentry) {
+		assert(!do_mkdir("/dev/shm/", S_IRWXU | S_IRWXG | S_IRWXO));
+	} else {
+		kref_put(&dentry->d_kref);
+	}
 	/* Notice we don't kref_put().  We're storing the refs globally */
 	dev_stdin = make_device("/dev/stdin", S_IRUSR | S_IRGRP | S_IROTH,
 	                        __S_IFCHR, &dev_f_op_stdin);
@@ -20,9 +20,33 @@
  * least 'size' bytes.  Free blocks are tracked in an unsorted singly-linked
  * list of free blocks within the page.  Used blocks aren't tracked, but we
  * keep a count of how many are currently allocated from each page.
+ *
+ * Akaros: each core also caches up to DMA_POOL_PCPU_MAX free blocks, and moves
+ * them to and from the pages DMA_POOL_PCPU_BATCH at a time, so the pool lock is
+ * only taken once per batch.  Cores refill from pages on their own NUMA node
+ * first, and new pages come from the refilling core's node.  Pages are only
+ * given back when the pool is destroyed, like in Linux.
  */
 
 #include <linux_compat.h>
+#include <dmapool.h>
+#include <arch/topology.h>
+
+#define DMA_POOL_PCPU_MAX		32
+#define DMA_POOL_PCPU_BATCH		16
+
+struct dma_pool_block {
+	void *vaddr;
+	dma_addr_t dma;
+};
+
+struct dma_pool_pcpu {
+	struct dma_pool_block blocks[DMA_POOL_PCPU_MAX];
+	unsigned int nr_blocks;
+	uint64_t nr_allocs;
+	uint64_t nr_cache_hits;
+	uint64_t nr_frees;
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct dma_pool {
 	struct list_head page_list;
@@ -31,8 +55,11 @@ struct dma_pool {
 	void *dev;
 	size_t allocation;
 	size_t boundary;
-	char name[32];
+	char name[DMA_POOL_NAME_LEN];
 	struct list_head pools;
+	struct dma_pool_pcpu *pcpu;
+	size_t nr_pages;
+	size_t nr_remote_pages;
 };
 
 struct dma_page {
@@ -41,8 +68,19 @@ struct dma_page {
 	dma_addr_t dma;
 	unsigned int in_use;
 	unsigned int offset;
+	int node;
 };
 
+static LINUX_LIST_HEAD(all_pools);
+static spinlock_t all_pools_lock = SPINLOCK_INITIALIZER;
+
+static int pool_local_node(void)
+{
+	if (nr_page_nodes == 1)
+		return 0;
+	return numa_id();
+}
+
 /**
  * dma_pool_create - Creates a pool of consistent memory blocks, for dma.
  */
@@ -72,7 +110,7 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 	else if ((boundary < size) || (boundary & (boundary - 1)))
 		return NULL;
 
-	retval = kmalloc(sizeof(*retval), KMALLOC_WAIT);
+	retval = kzmalloc(sizeof(*retval), KMALLOC_WAIT);
 	if (!retval)
 		return retval;
 
@@ -81,21 +119,46 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 	retval->dev = dev;	/* FIXME */
 
 	INIT_LIST_HEAD(&retval->page_list);
-	spinlock_init(&retval->lock);
+	spinlock_init_irqsave(&retval->lock);
 	retval->size = size;
 	retval->boundary = boundary;
 	retval->allocation = allocation;
+	retval->pcpu = kzmalloc(sizeof(struct dma_pool_pcpu) * num_cores,
+	                        KMALLOC_WAIT);
 
-	INIT_LIST_HEAD(&retval->pools);
-
-	/* TODO device_create_file */
+	spin_lock(&all_pools_lock);
+	list_add_tail(&retval->pools, &all_pools);
+	spin_unlock(&all_pools_lock);
 
 	return retval;
 }
 
+/* The caller must be done with all of the pool's blocks. */
 void dma_pool_destroy(struct dma_pool *pool)
 {
-	/* TODO */
+	struct dma_page *page, *tmp;
+	size_t nr_in_use = 0, nr_cached = 0;
+
+	if (!pool)
+		return;
+	spin_lock(&all_pools_lock);
+	list_del(&pool->pools);
+	spin_unlock(&all_pools_lock);
+
+	for (int i = 0; i < num_cores; i++)
+		nr_cached += pool->pcpu[i].nr_blocks;
+	list_for_each_entry_safe(page, tmp, &pool->page_list, page_list) {
+		nr_in_use += page->in_use;
+		list_del(&page->page_list);
+		dma_free_coherent(pool->dev, pool->allocation, page->vaddr,
+		                  page->dma);
+		kfree(page);
+	}
+	if (nr_in_use != nr_cached)
+		warn("dma_pool_destroy %s, %lu blocks still in use", pool->name,
+		     nr_in_use - nr_cached);
+	kfree(pool->pcpu);
+	kfree(pool);
 }
 
 static void pool_initialise_page(struct dma_pool *pool, struct dma_page *page)
@@ -114,19 +177,22 @@ static void pool_initialise_page(struct dma_pool *pool, struct dma_page *page)
 	} while (offset < pool->allocation);
 }
 
-static struct dma_page *pool_alloc_page(struct dma_pool *pool, int mem_flags)
+static struct dma_page *pool_alloc_page(struct dma_pool *pool, int node,
+                                        int mem_flags)
 {
 	struct dma_page *page;
 
 	page = kmalloc(sizeof(*page), mem_flags);
 	if (!page)
 		return NULL;
-	page->vaddr = dma_alloc_coherent(pool->dev, pool->allocation,
-					 &page->dma, mem_flags);
+	page->vaddr = __dma_alloc_coherent_node(node, pool->allocation,
+	                                        &page->dma, mem_flags);
 	if (page->vaddr) {
 		pool_initialise_page(pool, page);
 		page->in_use = 0;
 		page->offset = 0;
+		/* Where it actually landed; the node may have been out of memory */
+		page->node = nr_page_nodes == 1 ? 0 : paddr_to_numa_id(page->dma);
 	} else {
 		kfree(page);
 		page = NULL;
@@ -134,34 +200,207 @@ static struct dma_page *pool_alloc_page(struct dma_pool *pool, int mem_flags)
 	return page;
 }
 
-void *dma_pool_alloc(struct dma_pool *pool, int mem_flags, dma_addr_t *handle)
+/* Takes up to nr free blocks from page.  Hold the pool lock. */
+static int __pool_take_page(struct dma_pool *pool, struct dma_page *page,
+                            struct dma_pool_block *blocks, int nr)
 {
-	struct dma_page *page;
-	size_t offset;
-	void *retval;
+	unsigned int offset;
+	int i;
 
-	/* FIXME take care of locks */
+	for (i = 0; i < nr && page->offset < pool->allocation; i++) {
+		offset = page->offset;
+		page->offset = *(int *)(page->vaddr + offset);	/* "next" */
+		page->in_use++;
+		blocks[i].vaddr = page->vaddr + offset;
+		blocks[i].dma = page->dma + offset;
+	}
+	return i;
+}
 
+/* Takes up to nr free blocks, preferring pages on node.  Hold the pool lock. */
+static int __pool_take(struct dma_pool *pool, int node,
+                       struct dma_pool_block *blocks, int nr)
+{
+	struct dma_page *page;
+	int got = 0;
+
+	list_for_each_entry(page, &pool->page_list, page_list) {
+		if (page->node == node)
+			got += __pool_take_page(pool, page, blocks + got, nr - got);
+		if (got == nr)
+			return got;
+	}
 	list_for_each_entry(page, &pool->page_list, page_list) {
-		if (page->offset < pool->allocation)
-			goto ready;
+		if (page->node != node)
+			got += __pool_take_page(pool, page, blocks + got, nr - got);
+		if (got == nr)
+			return got;
 	}
+	return got;
+}
 
-	page = pool_alloc_page(pool, mem_flags);
-	if (!page)
-		return NULL;
+/* Gets up to nr free blocks from the pages, adding a page if there are none.
+ * Returns how many we got, 0 if we're out of memory. */
+static int pool_get_blocks(struct dma_pool *pool, struct dma_pool_block *blocks,
+                           int nr, int mem_flags)
+{
+	struct dma_page *page;
+	int node = pool_local_node();
+	int got;
 
+	spin_lock_irqsave(&pool->lock);
+	got = __pool_take(pool, node, blocks, nr);
+	spin_unlock_irqsave(&pool->lock);
+	if (got)
+		return got;
+	/* The allocation can block, so we don't hold the lock.  Someone else might
+	 * add a page too, which is fine. */
+	page = pool_alloc_page(pool, node, mem_flags);
+	if (!page)
+		return 0;
+	spin_lock_irqsave(&pool->lock);
 	list_add(&page->page_list, &pool->page_list);
-ready:
-	page->in_use++;
-	offset = page->offset;
-	page->offset = *(int *)(page->vaddr + offset);	/* "next" */
-	retval = offset + page->vaddr;
-	*handle = offset + page->dma;
-	return retval;
+	pool->nr_pages++;
+	if (page->node != node)
+		pool->nr_remote_pages++;
+	got = __pool_take_page(pool, page, blocks, nr);
+	spin_unlock_irqsave(&pool->lock);
+	return got;
+}
+
+static struct dma_page *pool_find_page(struct dma_pool *pool, dma_addr_t dma)
+{
+	struct dma_page *page;
+
+	list_for_each_entry(page, &pool->page_list, page_list) {
+		if (dma < page->dma)
+			continue;
+		if (dma < page->dma + pool->allocation)
+			return page;
+	}
+	return NULL;
+}
+
+/* Gives blocks back to their pages. */
+static void pool_put_blocks(struct dma_pool *pool,
+                            struct dma_pool_block *blocks, int nr)
+{
+	struct dma_page *page;
+	unsigned int offset;
+
+	spin_lock_irqsave(&pool->lock);
+	for (int i = 0; i < nr; i++) {
+		page = pool_find_page(pool, blocks[i].dma);
+		if (!page) {
+			warn("dma_pool_free %s, %p/%p not allocated", pool->name,
+			     blocks[i].vaddr, blocks[i].dma);
+			continue;
+		}
+		offset = blocks[i].vaddr - page->vaddr;
+		*(int *)blocks[i].vaddr = page->offset;
+		page->offset = offset;
+		page->in_use--;
+	}
+	spin_unlock_irqsave(&pool->lock);
+}
+
+void *dma_pool_alloc(struct dma_pool *pool, int mem_flags, dma_addr_t *handle)
+{
+	struct dma_pool_pcpu *pc;
+	struct dma_pool_block blocks[DMA_POOL_PCPU_BATCH];
+	void *vaddr;
+	int8_t irq_state = 0;
+	int got, kept;
+
+	disable_irqsave(&irq_state);
+	pc = &pool->pcpu[core_id()];
+	pc->nr_allocs++;
+	if (pc->nr_blocks) {
+		pc->nr_cache_hits++;
+		pc->nr_blocks--;
+		vaddr = pc->blocks[pc->nr_blocks].vaddr;
+		*handle = pc->blocks[pc->nr_blocks].dma;
+		enable_irqsave(&irq_state);
+		return vaddr;
+	}
+	enable_irqsave(&irq_state);
+
+	got = pool_get_blocks(pool, blocks, DMA_POOL_PCPU_BATCH, mem_flags);
+	if (!got)
+		return NULL;
+	/* We keep the first one and cache the rest, on whatever core we're on now.
+	 * That core might have refilled in the meantime. */
+	disable_irqsave(&irq_state);
+	pc = &pool->pcpu[core_id()];
+	for (kept = 1; kept < got && pc->nr_blocks < DMA_POOL_PCPU_MAX; kept++)
+		pc->blocks[pc->nr_blocks++] = blocks[kept];
+	enable_irqsave(&irq_state);
+	if (kept < got)
+		pool_put_blocks(pool, blocks + kept, got - kept);
+	*handle = blocks[0].dma;
+	return blocks[0].vaddr;
 }
 
 void dma_pool_free(struct dma_pool *pool, void *vaddr, dma_addr_t addr)
 {
-	/* TODO */
+	struct dma_pool_pcpu *pc;
+	struct dma_pool_block blocks[DMA_POOL_PCPU_BATCH];
+	int8_t irq_state = 0;
+	int nr_flush = 0;
+
+	disable_irqsave(&irq_state);
+	pc = &pool->pcpu[core_id()];
+	pc->nr_frees++;
+	if (pc->nr_blocks == DMA_POOL_PCPU_MAX) {
+		nr_flush = DMA_POOL_PCPU_BATCH;
+		pc->nr_blocks -= nr_flush;
+		memcpy(blocks, &pc->blocks[pc->nr_blocks],
+		       nr_flush * sizeof(struct dma_pool_block));
+	}
+	pc->blocks[pc->nr_blocks].vaddr = vaddr;
+	pc->blocks[pc->nr_blocks].dma = addr;
+	pc->nr_blocks++;
+	enable_irqsave(&irq_state);
+	if (nr_flush)
+		pool_put_blocks(pool, blocks, nr_flush);
+}
+
+/* Returns a kmalloc'd array of stats, one per pool, and how many there are.
+ * The per-core numbers are read racily. */
+size_t dma_pool_get_stats(struct dma_pool_stats **stats_p)
+{
+	struct dma_pool *pool;
+	struct dma_pool_stats *stats, *st;
+	struct dma_page *page;
+	size_t nr_pools = 0, i = 0;
+
+	spin_lock(&all_pools_lock);
+	list_for_each_entry(pool, &all_pools, pools)
+		nr_pools++;
+	stats = kzmalloc(sizeof(struct dma_pool_stats) * (nr_pools + 1), 0);
+	if (!stats) {
+		spin_unlock(&all_pools_lock);
+		*stats_p = 0;
+		return 0;
+	}
+	list_for_each_entry(pool, &all_pools, pools) {
+		st = &stats[i++];
+		strlcpy(st->name, pool->name, sizeof(st->name));
+		st->size = pool->size;
+		for (int j = 0; j < num_cores; j++) {
+			st->nr_cached += pool->pcpu[j].nr_blocks;
+			st->nr_allocs += pool->pcpu[j].nr_allocs;
+			st->nr_cache_hits += pool->pcpu[j].nr_cache_hits;
+			st->nr_frees += pool->pcpu[j].nr_frees;
+		}
+		spin_lock_irqsave(&pool->lock);
+		st->nr_pages = pool->nr_pages;
+		st->nr_remote_pages = pool->nr_remote_pages;
+		list_for_each_entry(page, &pool->page_list, page_list)
+			st->nr_in_use += page->in_use;
+		spin_unlock_irqsave(&pool->lock);
+	}
+	spin_unlock(&all_pools_lock);
+	*stats_p = stats;
+	return nr_pools;
 }
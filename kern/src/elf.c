@@ -135,20 +135,79 @@ static uintptr_t populate_stack(struct proc *p, int argc, char *argv[],
 /* We need the writable flag for ld.  Even though the elf header says it wants
  * RX (and not W) for its main program header, it will page fault (eip 56f0,
  * 46f0 after being relocated to 0x1000, va 0x20f4). */
-static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
-                        elf_info_t *ei, bool writable)
+/* Parsed ELF and program headers of a binary.  We cache these per inode, so
+ * spawning a hot binary doesn't read and check its headers every time.  An
+ * image is stale once its inode's size or mtime changes. */
+struct elf_image {
+	struct kref					kref;
+	struct inode				*inode;		/* holds a ref */
+	size_t						i_size;
+	struct timespec				i_mtime;
+	unsigned long				last_use;
+	bool						elf64;
+	uint16_t					e_phnum;
+	uint16_t					e_phoff;
+	uintptr_t					e_entry;
+	bool						dynamic;
+	char						interp[256];
+	void						*phdrs;
+};
+
+#define NR_ELF_IMAGES				16
+
+static struct elf_image *elf_images[NR_ELF_IMAGES];
+static spinlock_t elf_images_lock = SPINLOCK_INITIALIZER;
+static unsigned long elf_images_tick;
+static unsigned long nr_elf_image_hits, nr_elf_image_misses;
+
+/* Callable from kfunc, to see how well the cache does */
+void print_elf_images(void)
 {
-	int ret = -1;
-	ei->phdr = -1;
-	ei->dynamic = 0;
-	ei->highest_addr = 0;
+	struct elf_image *img;
+
+	spin_lock(&elf_images_lock);
+	printk("ELF images: %lu hits, %lu misses\n", nr_elf_image_hits,
+	       nr_elf_image_misses);
+	for (int i = 0; i < NR_ELF_IMAGES; i++) {
+		img = elf_images[i];
+		if (img)
+			printk("\t%02d: inode %p, %d phdrs, %s\n", i, img->inode,
+			       img->e_phnum, img->dynamic ? img->interp : "static");
+	}
+	spin_unlock(&elf_images_lock);
+}
+
+static void elf_image_release(struct kref *kref)
+{
+	struct elf_image *img = container_of(kref, struct elf_image, kref);
+
+	kref_put(&img->inode->i_kref);
+	kfree(img->phdrs);
+	kfree(img);
+}
+
+static bool elf_image_fresh(struct elf_image *img, struct inode *inode)
+{
+	return img->inode == inode && img->i_size == inode->i_size &&
+	       !memcmp(&img->i_mtime, &inode->i_mtime, sizeof(struct timespec));
+}
+
+/* Reads and checks f's headers.  Returns an image with a ref for the caller, or
+ * 0 on failure.  Call from a ktask. */
+static struct elf_image *elf_image_parse(struct file *f)
+{
+	struct inode *inode = f->f_dentry->d_inode;
+	struct elf_image *img;
 	off64_t f_off = 0;
-	void* phdrs = 0;
-	int mm_perms, mm_flags = MAP_FIXED;
-	
-	/* When reading on behalf of the kernel, we need to switch to a ktask so
-	 * the VFS (and maybe other places) know. (TODO: KFOP) */
-	uintptr_t old_ret = switch_to_ktask();
+
+	img = kzmalloc(sizeof(struct elf_image), 0);
+	if (!img)
+		return 0;
+	kref_init(&img->kref, elf_image_release, 1);
+	kref_get(&inode->i_kref, 1);
+	img->inode = inode;
+	img->i_size = inode->i_size;
+	img->i_mtime = inode->i_mtime;
 
 	/* Read in ELF header. */
 	elf64_t elfhdr_storage;
@@ -194,16 +253,121 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 		printk("[kernel] load_one_elf: Bad program headers\n");
 		goto fail;
 	}
-	phdrs = kmalloc(e_phnum * phsz, 0);
+	img->phdrs = kmalloc(e_phnum * phsz, 0);
 	f_off = e_phoff;
-	if (!phdrs || f->f_op->read(f, phdrs, e_phnum * phsz, &f_off) !=
-	              e_phnum * phsz) {
+	if (!img->phdrs || f->f_op->read(f, img->phdrs, e_phnum * phsz, &f_off) !=
+	                   e_phnum * phsz) {
 		printk("[kernel] load_one_elf: could not get program headers\n");
 		goto fail;
 	}
+	img->elf64 = elf64;
+	img->e_phnum = e_phnum;
+	img->e_phoff = e_phoff;
+	img->e_entry = elf_field(elfhdr, e_entry);
+	for (int i = 0; i < e_phnum; i++) {
+		proghdr32_t* ph32 = (proghdr32_t*)img->phdrs + i;
+		proghdr64_t* ph64 = (proghdr64_t*)img->phdrs + i;
+
+		if (elf_field(ph, p_type) != ELF_PROG_INTERP)
+			continue;
+		f_off = elf_field(ph, p_offset);
+		ssize_t maxlen = sizeof(img->interp);
+		ssize_t bytes = f->f_op->read(f, img->interp, maxlen, &f_off);
+		/* trying to catch errors.  don't know how big it could be, but it
+		 * should be at least 0. */
+		if (bytes <= 0) {
+			printk("[kernel] load_one_elf: could not read ei->interp\n");
+			goto fail;
+		}
+
+		maxlen = MIN(maxlen, bytes);
+		if (strnlen(img->interp, maxlen) == maxlen) {
+			printk("[kernel] load_one_elf: interpreter name too long\n");
+			goto fail;
+		}
+
+		img->dynamic = TRUE;
+	}
+	return img;
+fail:
+	kref_put(&img->kref);
+	return 0;
+}
+
+/* Returns f's parsed headers with a ref for the caller, from the cache if we
+ * have them.  Call from a ktask. */
+static struct elf_image *elf_image_get(struct file *f)
+{
+	struct inode *inode = f->f_dentry->d_inode;
+	struct elf_image *img, *old = 0;
+	int victim = 0;
+
+	spin_lock(&elf_images_lock);
+	for (int i = 0; i < NR_ELF_IMAGES; i++) {
+		img = elf_images[i];
+		if (img && elf_image_fresh(img, inode)) {
+			img->last_use = ++elf_images_tick;
+			kref_get(&img->kref, 1);
+			nr_elf_image_hits++;
+			spin_unlock(&elf_images_lock);
+			return img;
+		}
+	}
+	nr_elf_image_misses++;
+	spin_unlock(&elf_images_lock);
+
+	img = elf_image_parse(f);
+	if (!img)
+		return 0;
+	spin_lock(&elf_images_lock);
+	/* Replace a stale image of this inode, an empty slot, or the LRU one */
+	for (int i = 0; i < NR_ELF_IMAGES; i++) {
+		if (!elf_images[i] || elf_images[i]->inode == inode) {
+			victim = i;
+			break;
+		}
+		if (elf_images[i]->last_use < elf_images[victim]->last_use)
+			victim = i;
+	}
+	old = elf_images[victim];
+	img->last_use = ++elf_images_tick;
+	kref_get(&img->kref, 1);
+	elf_images[victim] = img;
+	spin_unlock(&elf_images_lock);
+	if (old)
+		kref_put(&old->kref);
+	return img;
+}
+
+static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
+                        elf_info_t *ei, bool writable)
+{
+	int ret = -1;
+	ei->phdr = -1;
+	ei->dynamic = 0;
+	ei->highest_addr = 0;
+	struct elf_image *img;
+	int mm_perms, mm_flags = MAP_FIXED;
+	
+	/* When reading on behalf of the kernel, we need to switch to a ktask so
+	 * the VFS (and maybe other places) know. (TODO: KFOP) */
+	uintptr_t old_ret = switch_to_ktask();
+
+	img = elf_image_get(f);
+	if (!img)
+		goto fail;
+	bool elf64 = img->elf64;
+	size_t phsz = elf64 ? sizeof(proghdr64_t) : sizeof(proghdr32_t);
+	uint16_t e_phnum = img->e_phnum;
+	uint16_t e_phoff = img->e_phoff;
+
+	if (img->dynamic) {
+		ei->dynamic = 1;
+		strlcpy(ei->interp, img->interp, sizeof(ei->interp));
+	}
 	for (int i = 0; i < e_phnum; i++) {
-		proghdr32_t* ph32 = (proghdr32_t*)phdrs + i;
-		proghdr64_t* ph64 = (proghdr64_t*)phdrs + i;
+		proghdr32_t* ph32 = (proghdr32_t*)img->phdrs + i;
+		proghdr64_t* ph64 = (proghdr64_t*)img->phdrs + i;
 		uint16_t p_type = elf_field(ph, p_type);
 		uintptr_t p_va = elf_field(ph, p_va);
 		uintptr_t p_offset = elf_field(ph, p_offset);
@@ -220,25 +384,6 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 
 		if (p_type == ELF_PROG_PHDR)
 			ei->phdr = p_va;
-		else if (p_type == ELF_PROG_INTERP) {
-			f_off = p_offset;
-			ssize_t maxlen = sizeof(ei->interp);
-			ssize_t bytes = f->f_op->read(f, ei->interp, maxlen, &f_off);
-			/* trying to catch errors.  don't know how big it could be, but it
-			 * should be at least 0. */
-			if (bytes <= 0) {
-				printk("[kernel] load_one_elf: could not read ei->interp\n");
-				goto fail;
-			}
-
-			maxlen = MIN(maxlen, bytes);
-			if (strnlen(ei->interp, maxlen) == maxlen) {
-				printk("[kernel] load_one_elf: interpreter name too long\n");
-				goto fail;
-			}
-
-			ei->dynamic = 1;
-		}
 		else if (p_type == ELF_PROG_LOAD && p_memsz) {
 			if (p_align % PGSIZE) {
 				printk("[kernel] load_one_elf: not page aligned\n");
@@ -274,9 +419,18 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 				uintptr_t partial = PGOFF(filesz);
 
 				if (filesz - partial) {
+					int full_flags = mm_flags;
+
+#ifdef CONFIG_ELF_PREFAULT
+					/* Text and rodata of a binary that ran recently are
+					 * probably in the page cache.  Map those pages now, instead
+					 * of faulting on each. */
+					if (!(p_flags & ELF_PROT_WRITE))
+						full_flags |= MAP_POPULATE | MAP_NONBLOCK;
+#endif
 					/* Map the complete pages. */
 					if (do_mmap(p, memstart, filesz - partial, mm_perms,
-					            mm_flags, f, filestart) == MAP_FAILED) {
+					            full_flags, f, filestart) == MAP_FAILED) {
 						printk("[kernel] load_one_elf: complete mmap failed\n");
 						goto fail;
 					}
@@ -342,14 +496,14 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 		}
 		ei->phdr = (long)phdr_addr + e_phoff;
 	}
-	ei->entry = elf_field(elfhdr, e_entry) + pg_num * PGSIZE;
+	ei->entry = img->e_entry + pg_num * PGSIZE;
 	ei->phnum = e_phnum;
 	ei->elf64 = elf64;
 	ret = 0;
 	/* Fall-through */
 fail:
-	if (phdrs)
-		kfree(phdrs);
+	if (img)
+		kref_put(&img->kref);
 	switch_back_from_ktask(old_ret);
 	return ret;
 }
@@ -112,8 +112,10 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 		if (!pte_is_mapped(pte))
 			return 0;
 		page_t *page = pa2page(pte_get_paddr(pte));
+		unsigned long nr_pgs = pte_nr_pgs(pte);
 		pte_clear(pte);
-		page_decref(page);
+		for (int i = 0; i < nr_pgs; i++)
+			page_decref(page + i);
 		/* TODO: consider other states here (like !P, yet still tracking a page,
 		 * for VM tricks, page map stuff, etc.  Should be okay: once we're
 		 * freeing, everything else about this proc is dead. */
@@ -77,12 +77,18 @@ static void send_evbitmap_msg(struct evbitmap *evbm, struct event_msg *msg)
 static void post_ev_msg(struct proc *p, struct event_mbox *mbox,
                         struct event_msg *msg, int ev_flags)
 {
+	struct event_msg local_msg;
+
 	printd("[kernel] Sending event type %d to mbox %p\n", msg->ev_type, mbox);
 	/* Sanity check */
 	assert(p);
 	switch (mbox->type) {
 		case (EV_MBOX_UCQ):
-			send_ucq_msg(&mbox->ucq, p, msg);
+			/* Only UCQs carry the whole message.  Callers don't always zero
+			 * their msgs, so the stamp is always set one way or the other. */
+			local_msg = *msg;
+			local_msg.ev_tsc = ev_flags & EVENT_TIMESTAMP ? read_tsc() : 0;
+			send_ucq_msg(&mbox->ucq, p, &local_msg);
 			break;
 		case (EV_MBOX_BITMAP):
 			send_evbitmap_msg(&mbox->evbm, msg);
@@ -95,6 +101,21 @@ static void post_ev_msg(struct proc *p, struct event_mbox *mbox,
 	}
 }
 
+/* Posts nr msgs to the mbox.  Bitmaps only need to flag the reader once. */
+static void post_ev_msgs(struct proc *p, struct event_mbox *mbox,
+                         struct event_msg *msgs, size_t nr, int ev_flags)
+{
+	if (mbox->type == EV_MBOX_BITMAP) {
+		for (size_t i = 0; i < nr; i++)
+			SET_BITMASK_BIT_ATOMIC(mbox->evbm.bitmap, msgs[i].ev_type);
+		wmb();
+		mbox->evbm.check_bits = TRUE;
+		return;
+	}
+	for (size_t i = 0; i < nr; i++)
+		post_ev_msg(p, mbox, &msgs[i], ev_flags);
+}
+
 /* Helper: use this when sending a message to a VCPD mbox.  It just posts to the
  * ev_mbox and sets notif pending.  Note this uses a userspace address for the
  * VCPD (though not a user's pointer). */
@@ -361,15 +382,24 @@ static void send_indir(struct proc *p, struct event_queue *ev_q,
  * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid)
+{
+	send_events_batch(p, ev_q, msg, 1, vcoreid);
+}
+
+/* Sends nr msgs to ev_q, like nr calls to send_event(), but with one address
+ * space switch, one vcore pick, and at most one INDIR / IPI and wakeup for the
+ * whole batch.  SPAM_PUBLIC ev_qs still spam each message on its own. */
+void send_events_batch(struct proc *p, struct event_queue *ev_q,
+                       struct event_msg *msgs, size_t nr, uint32_t vcoreid)
 {
 	uintptr_t old_proc;
 	struct event_mbox *ev_mbox = 0;
 
 	assert(!in_irq_ctx(&per_cpu_info[core_id()]));
 	assert(p);
-	if (p->state == PROC_DYING)
+	if (p->state == PROC_DYING || !nr)
 		return;
-	printd("[kernel] sending msg to proc %p, ev_q %p\n", p, ev_q);
+	printd("[kernel] sending %d msgs to proc %p, ev_q %p\n", nr, p, ev_q);
 	if (!ev_q) {
 		warn("[kernel] Null ev_q - kernel code should check before sending!");
 		return;
@@ -413,7 +443,8 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * we'll prefer to send it to whatever vcoreid we determined at this point
 	 * (via APPRO or whatever). */
 	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC) {
-		spam_public_msg(p, msg, vcoreid, ev_q->ev_flags);
+		for (size_t i = 0; i < nr; i++)
+			spam_public_msg(p, &msgs[i], vcoreid, ev_q->ev_flags);
 		goto wakeup;
 	}
 	/* We aren't spamming and we know the default vcore, and now we need to
@@ -437,7 +468,7 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 		printk("[kernel] Illegal addr for ev_mbox\n");
 		goto out;
 	}
-	post_ev_msg(p, ev_mbox, msg, ev_q->ev_flags);
+	post_ev_msgs(p, ev_mbox, msgs, nr, ev_q->ev_flags);
 	wmb();	/* ensure ev_msg write is before alerting the vcore */
 	/* Prod/alert a vcore with an IPI or INDIR, if desired.  INDIR will also
 	 * call try_notify (IPI) later */
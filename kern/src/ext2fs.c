@@ -157,59 +157,72 @@ void ext2_dirty_metablock(struct super_block *sb, void *buffer)
 		bdev_dirty_buffer(bh);
 }
 
-/* Helper for alloc_block.  It will try to alloc a block from the BG, starting
- * with blk_idx (relative number within the BG).   If successful, it will return
- * the FS block number via *block_num.  TODO: concurrency protection */
-static bool ext2_tryalloc(struct super_block *sb, struct ext2_block_group *bg,
-                          unsigned int blk_idx, uint32_t *block_num)
+/* Helper for ext2_alloc_run().  It will try to alloc a run of up to want free
+ * blocks from the BG, looking for the first free block from blk_idx (relative
+ * number within the BG) onwards.  Runs don't cross BGs.  If successful, it
+ * returns the length and the first FS block number via *block_num, otherwise 0.
+ * TODO: concurrency protection */
+static unsigned int ext2_tryalloc(struct super_block *sb,
+                                  struct ext2_block_group *bg,
+                                  unsigned int blk_idx, unsigned int want,
+                                  uint32_t *block_num)
 {
 	uint8_t *blk_bitmap;
 	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)sb->s_fs_info;
 	unsigned int blks_per_bg = le32_to_cpu(e2sbi->e2sb->s_blocks_per_group);
-	bool found = FALSE;
+	unsigned int len = 0;
 
 	/* Check to see if there are any free blocks */
 	if (!le32_to_cpu(bg->bg_free_blocks_cnt))
-		return FALSE;
+		return 0;
+	want = MIN(want, le32_to_cpu(bg->bg_free_blocks_cnt));
 	/* Check the bitmap for your desired block.  We'll loop through the whole
-	 * BG, starting with the one we want first. */
+	 * BG, starting with the one we want first, skipping full bytes. */
 	blk_bitmap = ext2_get_metablock(sb, bg->bg_block_bitmap);
-	for (int i = 0; i < blks_per_bg; i++) {
+	for (int i = 0; i < blks_per_bg; ) {
+		if (!(blk_idx % 8) && (blk_bitmap[blk_idx / 8] == 0xff)) {
+			i += 8;
+			blk_idx = (blk_idx + 8) % blks_per_bg;
+			continue;
+		}
 		if (!(GET_BITMASK_BIT(blk_bitmap, blk_idx))) {
-			SET_BITMASK_BIT(blk_bitmap, blk_idx);
-			bg->bg_free_blocks_cnt--;
+			/* Found one, take as many after it as we can */
+			while ((len < want) && (blk_idx + len < blks_per_bg) &&
+			       !(GET_BITMASK_BIT(blk_bitmap, blk_idx + len))) {
+				SET_BITMASK_BIT(blk_bitmap, blk_idx + len);
+				len++;
+			}
+			bg->bg_free_blocks_cnt -= len;
 			ext2_dirty_metablock(sb, blk_bitmap);
-			found = TRUE;
 			break;
 		}
+		i++;
 		/* Note: the wrap-around hasn't been tested yet */
 		blk_idx = (blk_idx + 1) % blks_per_bg;
 	}
 	ext2_put_metablock(sb, blk_bitmap);
-	if (found)
+	if (len)
 		*block_num = ext2_bgidx2block(sb, bg, blk_idx);
-	return found;
+	return len;
 }
 
-/* This allocates a fresh block for the inode, preferably 'fetish' (name
- * courtesy of L.F.), returning the FS block number that's been allocated.
- * Note, Linux does some block preallocation here.  Consider doing the same (off
- * the in-memory inode).  Note the lack of concurrency protections here. */
-uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
+/* Allocates a run of up to want blocks, preferably starting at 'fetish' (name
+ * courtesy of L.F.).  Returns the length, at least 1, and the first FS block
+ * via *block_num. */
+static unsigned int ext2_alloc_run(struct super_block *sb, uint32_t fetish,
+                                   unsigned int want, uint32_t *block_num)
 {
-	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)inode->i_sb->s_fs_info;
+	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)sb->s_fs_info;
 	struct ext2_block_group *fetish_bg, *bg_i = e2sbi->e2bg;
-	unsigned int blk_idx;
-	bool found = FALSE;
-	uint32_t retval = 0;
+	unsigned int blk_idx, len;
 
 	/* Get our ideal starting point */
-	fetish_bg = ext2_block2bg(inode->i_sb, fetish);
-	blk_idx = ext2_block2bgidx(inode->i_sb, fetish);
+	fetish_bg = ext2_block2bg(sb, fetish);
+	blk_idx = ext2_block2bgidx(sb, fetish);
 	/* Try to find a free block in the BG of the one we desire */
-	found = ext2_tryalloc(inode->i_sb, fetish_bg, blk_idx, &retval);
-	if (found)
-		return retval;
+	len = ext2_tryalloc(sb, fetish_bg, blk_idx, want, block_num);
+	if (len)
+		return len;
 
 	warn("This part hasn't been tested yet.");
 	/* Find a block anywhere else (perhaps using the log trick, but for now just
@@ -217,12 +230,102 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	for (int i = 0; i < e2sbi->nr_bgs; i++, bg_i++) {
 		if (bg_i == fetish_bg)
 			continue;
-		found = ext2_tryalloc(inode->i_sb, bg_i, 0, &retval);
-		if (found)
+		len = ext2_tryalloc(sb, bg_i, 0, want, block_num);
+		if (len)
 			break;
 	}
-	if (!found)
+	if (!len)
 		panic("Ran out of blocks! (probably a bug)");
+	return len;
+}
+
+/* Gives len blocks, starting at FS block blk_num, back to the bitmap.  They
+ * must be in the same BG. */
+static void ext2_free_blocks(struct super_block *sb, uint32_t blk_num,
+                             unsigned int len)
+{
+	struct ext2_block_group *bg = ext2_block2bg(sb, blk_num);
+	unsigned int blk_idx = ext2_block2bgidx(sb, blk_num);
+	uint8_t *blk_bitmap;
+
+	blk_bitmap = ext2_get_metablock(sb, bg->bg_block_bitmap);
+	for (unsigned int i = 0; i < len; i++) {
+		assert(GET_BITMASK_BIT(blk_bitmap, blk_idx + i));
+		CLR_BITMASK_BIT(blk_bitmap, blk_idx + i);
+	}
+	bg->bg_free_blocks_cnt += len;
+	ext2_dirty_metablock(sb, blk_bitmap);
+	ext2_put_metablock(sb, blk_bitmap);
+}
+
+static void ext2_prealloc_init(struct ext2_prealloc *pa)
+{
+	spinlock_init(&pa->pa_lock);
+	pa->pa_start = 0;
+	pa->pa_len = 0;
+}
+
+/* Returns the unused blocks in pa to the bitmap */
+static void ext2_prealloc_discard(struct super_block *sb,
+                                  struct ext2_prealloc *pa)
+{
+	uint32_t start, len;
+
+	spin_lock(&pa->pa_lock);
+	start = pa->pa_start;
+	len = pa->pa_len;
+	pa->pa_len = 0;
+	spin_unlock(&pa->pa_lock);
+	if (len)
+		ext2_free_blocks(sb, start, len);
+}
+
+/* This allocates a fresh block for the inode, preferably 'fetish', returning
+ * the FS block number that's been allocated.  If the inode's window (or the
+ * locality group's, for small files) has blocks, we use the next one, which is
+ * usually right after the file's last block.  Otherwise we allocate a new run
+ * near fetish and keep the rest of it as the window.  Note the lack of
+ * concurrency protections for the bitmaps here. */
+uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
+{
+	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)inode->i_sb->s_fs_info;
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	struct ext2_prealloc *pa;
+	unsigned int want, len;
+	uint32_t retval, start;
+
+	if (inode->i_blocks < EXT2_LG_MAX_FILE_BLOCKS *
+	                      (inode->i_sb->s_blocksize >> 9)) {
+		pa = &e2sbi->lg_pa;
+		want = EXT2_LG_PREALLOC_BLOCKS;
+	} else {
+		pa = &e2ii->i_pa;
+		want = EXT2_PREALLOC_BLOCKS;
+	}
+	spin_lock(&pa->pa_lock);
+	if (pa->pa_len) {
+		retval = pa->pa_start++;
+		pa->pa_len--;
+		spin_unlock(&pa->pa_lock);
+		return retval;
+	}
+	spin_unlock(&pa->pa_lock);
+	/* Searching the bitmap can block, so we can't hold the lock.  If someone
+	 * else refilled the window in the meantime, we give ours back. */
+	len = ext2_alloc_run(inode->i_sb, fetish, want, &retval);
+	start = retval + 1;
+	len--;
+	if (len) {
+		spin_lock(&pa->pa_lock);
+		if (!pa->pa_len) {
+			pa->pa_start = start;
+			pa->pa_len = len;
+			len = 0;
+		}
+		spin_unlock(&pa->pa_lock);
+		if (len)
+			ext2_free_blocks(inode->i_sb, start, len);
+	}
 	return retval;
 }
 
@@ -419,14 +522,140 @@ uint32_t *ext2_lookup_inotable_slot(struct inode *inode, uint32_t ino_block)
 	return blk_slot;
 }
 
+static void ext2_i_info_init(struct ext2_i_info *e2ii)
+{
+	spinlock_init(&e2ii->i_ext_lock);
+	e2ii->i_ext_last = 0;
+	e2ii->i_ext_victim = 0;
+	memset(e2ii->i_ext, 0, sizeof(e2ii->i_ext));
+	spinlock_init(&e2ii->i_dirhash_lock);
+	e2ii->i_dirhash = 0;	ext2_prealloc_init(&e2ii->i_pa);
+}
+
+static void ext2_dirhash_free(struct ext2_dirhash *dh)
+{
+	struct ext2_dirhash_ent *ent, *next;
+
+	if (!dh)
+		return;
+	for (unsigned int i = 0; i < dh->nr_buckets; i++) {
+		for (ent = dh->buckets[i]; ent; ent = next) {
+			next = ent->next;
+			kfree(ent);
+		}
+	}
+	kfree(dh);
+}
+
+static bool ext2_extent_has(struct ext2_extent *ext, uint32_t ino_blk)
+{
+	return ino_blk - ext->e_ino_blk < ext->e_len;
+}
+
+/* Returns the cached FS block for ino_blk, or 0 if it's not cached.  We check
+ * the last extent we used first, which is the one sequential readers want. */
+static uint32_t ext2_extent_lookup(struct inode *inode, uint32_t ino_blk)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	struct ext2_extent *ext;
+	uint32_t fs_blk = 0;
+
+	spin_lock(&e2ii->i_ext_lock);
+	ext = &e2ii->i_ext[e2ii->i_ext_last];
+	if (ext2_extent_has(ext, ino_blk)) {
+		fs_blk = ext->e_fs_blk + (ino_blk - ext->e_ino_blk);
+		goto out;
+	}
+	for (int i = 0; i < EXT2_NR_EXTENTS; i++) {
+		ext = &e2ii->i_ext[i];
+		if (ext2_extent_has(ext, ino_blk)) {
+			fs_blk = ext->e_fs_blk + (ino_blk - ext->e_ino_blk);
+			e2ii->i_ext_last = i;
+			break;
+		}
+	}
+out:
+	spin_unlock(&e2ii->i_ext_lock);
+	return fs_blk;
+}
+
+/* Caches that the len blocks at ino_blk are on the FS blocks at fs_blk.  A run
+ * that starts in or right after a cached extent, at the matching FS block,
+ * grows that extent.  Otherwise it replaces one, round-robin. */
+static void ext2_extent_insert(struct inode *inode, uint32_t ino_blk,
+                               uint32_t fs_blk, uint32_t len)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	struct ext2_extent *ext;
+	int i;
+
+	spin_lock(&e2ii->i_ext_lock);
+	for (i = 0; i < EXT2_NR_EXTENTS; i++) {
+		ext = &e2ii->i_ext[i];
+		if (!ext->e_len || (ino_blk - ext->e_ino_blk > ext->e_len))
+			continue;
+		if (fs_blk - ext->e_fs_blk != ino_blk - ext->e_ino_blk)
+			continue;
+		ext->e_len = MAX(ext->e_len, ino_blk - ext->e_ino_blk + len);
+		goto out;
+	}
+	i = e2ii->i_ext_victim;
+	e2ii->i_ext_victim = (i + 1) % EXT2_NR_EXTENTS;
+	ext = &e2ii->i_ext[i];
+	ext->e_ino_blk = ino_blk;
+	ext->e_fs_blk = fs_blk;
+	ext->e_len = len;
+out:
+	e2ii->i_ext_last = i;
+	spin_unlock(&e2ii->i_ext_lock);
+}
+
+/* Forgets all of inode's cached mappings.  Anything that unmaps or moves blocks
+ * needs to call this. */
+static void ext2_extents_clear(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+
+	spin_lock(&e2ii->i_ext_lock);
+	for (int i = 0; i < EXT2_NR_EXTENTS; i++)
+		e2ii->i_ext[i].e_len = 0;
+	spin_unlock(&e2ii->i_ext_lock);
+}
+
+/* Returns the FS block for ino_blk, or 0 if there isn't one.  On a cache miss,
+ * we walk the tables, and cache the run of consecutive FS blocks that starts at
+ * ino_blk, as far as the table we found it in goes. */
+static uint32_t ext2_map_inoblock(struct inode *inode, uint32_t ino_blk)
+{
+	unsigned int blksize = inode->i_sb->s_blocksize;
+	uint32_t fs_blk, *blk_slot, nr_slots, len;
+
+	fs_blk = ext2_extent_lookup(inode, ino_blk);
+	if (fs_blk)
+		return fs_blk;
+	blk_slot = ext2_lookup_inotable_slot(inode, ino_blk);
+	fs_blk = le32_to_cpu(*blk_slot);
+	if (fs_blk) {
+		if (ino_blk < 12)
+			nr_slots = 12 - ino_blk;	/* direct blocks, in e2ii */
+		else
+			nr_slots = (blksize - ((uintptr_t)blk_slot & (blksize - 1))) /
+			           sizeof(uint32_t);
+		for (len = 1; len < nr_slots; len++) {
+			if (le32_to_cpu(blk_slot[len]) != fs_blk + len)
+				break;
+		}
+		ext2_extent_insert(inode, ino_blk, fs_blk, len);
+	}
+	ext2_put_metablock(inode->i_sb, blk_slot);
+	return fs_blk;
+}
+
 /* Determines the FS block id for a given inode block id.  Convenience wrapper
  * that may go away soon. */
 uint32_t ext2_find_inoblock(struct inode *inode, unsigned int ino_block)
 {
-	uint32_t retval, *buf = ext2_lookup_inotable_slot(inode, ino_block);
-	retval = *buf;
-	ext2_put_metablock(inode->i_sb, buf);
-	return retval;
+	return ext2_map_inoblock(inode, ino_block);
 }
 
 /* Returns an incref'd metadata block for the contents of the ino block.  Don't
@@ -436,12 +665,11 @@ uint32_t ext2_find_inoblock(struct inode *inode, unsigned int ino_block)
 void *ext2_get_ino_metablock(struct inode *inode, unsigned long ino_block)
 {
 	uint32_t blkid, *retval, *blk_slot;
-	blk_slot = ext2_lookup_inotable_slot(inode, ino_block);
-	blkid = le32_to_cpu(*blk_slot);
-	if (blkid) {
-		ext2_put_metablock(inode->i_sb, blk_slot);
+
+	blkid = ext2_map_inoblock(inode, ino_block);
+	if (blkid)
 		return ext2_get_metablock(inode->i_sb, blkid);
-	}
+	blk_slot = ext2_lookup_inotable_slot(inode, ino_block);
 	/* If there isn't a block there, alloc and insert one.  This block will be
 	 * the next big chunk of "file" data for this inode. */
 	blkid = ext2_alloc_block(inode, ext2_bgidx2block(inode->i_sb,
@@ -450,6 +678,7 @@ void *ext2_get_ino_metablock(struct inode *inode, unsigned long ino_block)
 	*blk_slot = cpu_to_le32(blkid);
 	ext2_dirty_metablock(inode->i_sb, blk_slot);
 	ext2_put_metablock(inode->i_sb, blk_slot);
+	ext2_extent_insert(inode, ino_block, blkid, 1);
 	inode->i_blocks += inode->i_sb->s_blocksize >> 9;	/* inc by 1 FS block */
 	inode->i_size += inode->i_sb->s_blocksize;
 	retval = ext2_get_metablock(inode->i_sb, blkid);
@@ -604,6 +833,7 @@ struct super_block *ext2_get_sb(struct fs_type *fs, int flags,
 	/* store the in-memory copy of the disk SB and bg desc table */
 	((struct ext2_sb_info*)sb->s_fs_info)->e2sb = e2sb;
 	((struct ext2_sb_info*)sb->s_fs_info)->e2bg = e2bg;
+	ext2_prealloc_init(&((struct ext2_sb_info*)sb->s_fs_info)->lg_pa);
 	/* Precompute the number of BGs */
 	num_blks = le32_to_cpu(e2sb->s_blocks_cnt);
 	blks_per_group = le32_to_cpu(e2sb->s_blocks_per_group);
@@ -620,7 +850,8 @@ struct super_block *ext2_get_sb(struct fs_type *fs, int flags,
 
 void ext2_kill_sb(struct super_block *sb)
 {
-	/* don't forget to kfree the s_fs_info and its two members */
+	/* don't forget to kfree the s_fs_info and its two members, and to
+	 * ext2_prealloc_discard() the lg_pa */
 	panic("Killing an EXT2 SB is not supported!");
 }
 
@@ -643,7 +874,7 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 	struct block_device *bdev = inode->i_sb->s_bdev;
 	unsigned int blk_per_pg = PGSIZE / inode->i_sb->s_blocksize;
 	unsigned int sct_per_blk = inode->i_sb->s_blocksize / bdev->b_sector_sz;
-	uint32_t ino_blk_num, fs_blk_num = 0, *fs_blk_slot;
+	uint32_t ino_blk_num, fs_blk_num = 0, mapped_blk, *fs_blk_slot;
 
 	bh = kmem_cache_alloc(bh_kcache, 0);
 	page->pg_private = bh;
@@ -657,6 +888,12 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 		bh->bh_bdev = bdev;							/* uncounted ref */
 		/* compute the first sector of the FS block for the ith buf in the pg */
 		ino_blk_num = page->pg_index * blk_per_pg + i;
+		/* Usually the block is mapped, and in a cached extent */
+		mapped_blk = ext2_map_inoblock(inode, ino_blk_num);
+		if (mapped_blk) {
+			fs_blk_num = mapped_blk;
+			goto have_blk;
+		}
 		fs_blk_slot = ext2_lookup_inotable_slot(inode, ino_blk_num);
 		/* If there isn't a block there, lets get one.  The previous fs_blk_num
 		 * is our hint (or we have to compute one). */
@@ -677,6 +914,8 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 			fs_blk_num = *fs_blk_slot;
 		}
 		ext2_put_metablock(inode->i_sb, fs_blk_slot);
+		ext2_extent_insert(inode, ino_blk_num, fs_blk_num, 1);
+have_blk:
 		bh->bh_sector = fs_blk_num * sct_per_blk;
 		bh->bh_nr_sector = sct_per_blk;
 		/* Stop if we're the last block in the page.  We could be going beyond
@@ -731,7 +970,7 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 		} else {
 			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
 			bh->bh_flags |= BH_DIRTY;
-			atomic_or(&bh->bh_page->pg_flags, PG_DIRTY);
+			pm_page_dirty(bh->bh_page);
 		}
 	}
 	retval = bdev_submit_request(bdev, breq);
@@ -754,9 +993,24 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
+/* Writes back a batch of a file's pages in one block request.  Consecutive
+ * pages often have consecutive blocks, which the bdev does as one extent. */
+int ext2_writepages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	return bdev_write_pages(pm->pm_host->i_sb->s_bdev, pages, nr, FALSE);
+}
+
+/* The PM is removing page; free the BHs ext2_mappage() hung off it. */
+void ext2_releasepage(struct page_map *pm, struct page *page)
+{
+	if (atomic_read(&page->pg_flags) & PG_BUFFER)
+		free_bhs(page);
+}
+
+/* Writes a page back to its blocks.  The BHs were set up by ext2_readpage(). */
 int ext2_writepage(struct page_map *pm, struct page *page)
 {
-	return -1;
+	return ext2_writepages(pm, &page, 1);
 }
 
 /* Super Operations */
@@ -782,6 +1036,10 @@ struct inode *ext2_alloc_inode(struct super_block *sb)
  * inode is still on disc is irrelevant. */
 void ext2_dealloc_inode(struct inode *inode)
 {
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+
+	ext2_dirhash_free(e2ii->i_dirhash);
+	ext2_prealloc_discard(inode->i_sb, &e2ii->i_pa);
 	kmem_cache_free(ext2_i_kcache, inode->i_fs_info);
 }
 
@@ -852,6 +1110,7 @@ void ext2_read_inode(struct inode *inode)
 	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
 	for (int i = 0; i < 15; i++)
 		e2ii->i_block[i] = le32_to_cpu(my_ino->i_block[i]);
+	ext2_i_info_init(e2ii);
 	/* TODO: (HASH) unused: inode->i_hash add to hash (saves on disc reading) */
 	/* TODO: we could consider saving a pointer to the disk inode and pinning
 	 * its buffer in memory, but for now we'll just free it. */
@@ -1050,6 +1309,175 @@ static void ext2_write_dirent(struct ext2_dirent *e2dir, struct dentry *dentry,
 	        sizeof(e2dir->dir_name));
 }
 
+/* Dirhash helpers.  The name hash is the same djb2 as generic_dentry_hash(). */
+static size_t ext2_name_hash(const char *name, size_t len)
+{
+	size_t hash = 5381;
+
+	for (size_t i = 0; i < len; i++)
+		hash = ((hash << 5) + hash) + name[i];
+	return hash;
+}
+
+static struct ext2_dirhash_ent *ext2_dirhash_ent_alloc(const char *name,
+                                                       size_t len, uint32_t ino)
+{
+	struct ext2_dirhash_ent *ent;
+
+	ent = kmalloc(sizeof(struct ext2_dirhash_ent) + len, 0);
+	if (!ent)
+		return 0;
+	ent->ino = ino;
+	ent->namelen = len;
+	memcpy(ent->name, name, len);
+	return ent;
+}
+
+static void __ext2_dirhash_add(struct ext2_dirhash *dh,
+                               struct ext2_dirhash_ent *ent)
+{
+	size_t idx = ext2_name_hash(ent->name, ent->namelen) &
+	             (dh->nr_buckets - 1);
+
+	ent->next = dh->buckets[idx];
+	dh->buckets[idx] = ent;
+	dh->nr_ents++;
+}
+
+/* Helper for ext2_dirhash_build(), collects the used dirents on a list.  Stops
+ * (returns TRUE) if we run out of memory. */
+static bool dirhash_each_func(struct ext2_dirent *dir_i, long a1, long a2,
+                              long a3)
+{
+	struct ext2_dirhash_ent **list = (struct ext2_dirhash_ent**)a1;
+	unsigned int *nr_ents = (unsigned int*)a2;
+	struct ext2_dirhash_ent *ent;
+
+	if (!le32_to_cpu(dir_i->dir_inode))
+		return FALSE;
+	ent = ext2_dirhash_ent_alloc((char*)dir_i->dir_name, dir_i->dir_namelen,
+	                             le32_to_cpu(dir_i->dir_inode));
+	if (!ent)
+		return TRUE;
+	ent->next = *list;
+	*list = ent;
+	(*nr_ents)++;
+	return FALSE;
+}
+
+/* Reads all of dir's entries into a new dirhash.  Returns 0 if we couldn't get
+ * the memory. */
+static struct ext2_dirhash *ext2_dirhash_build(struct inode *dir)
+{
+	struct ext2_dirhash_ent *list = 0, *ent, *next;
+	struct ext2_dirhash *dh = 0;
+	unsigned int nr_ents = 0, nr_buckets;
+
+	if (ext2_foreach_dirent(dir, dirhash_each_func, (long)&list,
+	                        (long)&nr_ents, 0)) {
+		nr_buckets = ROUNDUPPWR2(MAX(nr_ents, 16));
+		dh = kzmalloc(sizeof(struct ext2_dirhash) +
+		              nr_buckets * sizeof(struct ext2_dirhash_ent*), 0);
+	}
+	if (!dh) {
+		for (ent = list; ent; ent = next) {
+			next = ent->next;
+			kfree(ent);
+		}
+		return 0;
+	}
+	dh->nr_buckets = nr_buckets;
+	for (ent = list; ent; ent = next) {
+		next = ent->next;
+		__ext2_dirhash_add(dh, ent);
+	}
+	return dh;
+}
+
+/* Returns the ino of name in dir's dirhash, 0 if dir doesn't have that name, or
+ * -1 if we don't have a dirhash and the caller needs to scan.  The first lookup
+ * in a big enough dir builds the dirhash, which costs one full scan. */
+static long ext2_dirhash_lookup(struct inode *dir, const char *name, size_t len)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)dir->i_fs_info;
+	struct ext2_dirhash *dh;
+	struct ext2_dirhash_ent *ent;
+	long ino = 0;
+
+	if (dir->i_size < EXT2_DIRHASH_MIN_BLOCKS * dir->i_sb->s_blocksize)
+		return -1;
+	spin_lock(&e2ii->i_dirhash_lock);
+	dh = e2ii->i_dirhash;
+	spin_unlock(&e2ii->i_dirhash_lock);
+	if (!dh) {
+		/* Building reads the dir, which can block, so we can't hold the lock.
+		 * If someone beat us to it, we use theirs. */
+		dh = ext2_dirhash_build(dir);
+		if (!dh)
+			return -1;
+		spin_lock(&e2ii->i_dirhash_lock);
+		if (!e2ii->i_dirhash) {
+			e2ii->i_dirhash = dh;
+			dh = 0;
+		}
+		spin_unlock(&e2ii->i_dirhash_lock);
+		ext2_dirhash_free(dh);
+	}
+	spin_lock(&e2ii->i_dirhash_lock);
+	dh = e2ii->i_dirhash;
+	if (!dh) {
+		ino = -1;
+		goto out;
+	}
+	ent = dh->buckets[ext2_name_hash(name, len) & (dh->nr_buckets - 1)];
+	for (; ent; ent = ent->next) {
+		if ((ent->namelen == len) && !memcmp(ent->name, name, len)) {
+			ino = ent->ino;
+			break;
+		}
+	}
+out:
+	spin_unlock(&e2ii->i_dirhash_lock);
+	return ino;
+}
+
+/* Adds dentry's new dirent to dir's dirhash, if it has one.  If we can't, we
+ * drop the dirhash, since it must have every entry. */
+static void ext2_dirhash_insert(struct inode *dir, struct dentry *dentry)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)dir->i_fs_info;
+	struct ext2_dirhash_ent *ent;
+	struct ext2_dirhash *drop = 0;
+
+	ent = ext2_dirhash_ent_alloc(dentry->d_name.name, dentry->d_name.len,
+	                             dentry->d_inode->i_ino);
+	spin_lock(&e2ii->i_dirhash_lock);
+	if (e2ii->i_dirhash) {
+		if (ent) {
+			__ext2_dirhash_add(e2ii->i_dirhash, ent);
+			ent = 0;
+		} else {
+			drop = e2ii->i_dirhash;
+			e2ii->i_dirhash = 0;
+		}
+	}
+	spin_unlock(&e2ii->i_dirhash_lock);
+	kfree(ent);
+	ext2_dirhash_free(drop);
+}
+
+static void ext2_dirhash_clear(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	struct ext2_dirhash *dh;
+
+	spin_lock(&e2ii->i_dirhash_lock);
+	dh = e2ii->i_dirhash;
+	e2ii->i_dirhash = 0;
+	spin_unlock(&e2ii->i_dirhash_lock);
+	ext2_dirhash_free(dh);
+}
+
 /* Helper for ext2_create().  This tries to squeeze a dirent in the slack space
  * after an existing dirent, returning TRUE if it succeeded (to break out). */
 static bool create_each_func(struct ext2_dirent *dir_i, long a1, long a2,
@@ -1062,10 +1490,9 @@ static bool create_each_func(struct ext2_dirent *dir_i, long a1, long a2,
 	unsigned int real_len = ext2_dirent_len(dir_i);
 	/* How much room is available after this dir_i before the next one */
 	unsigned int record_slack = le16_to_cpu(dir_i->dir_reclen) - real_len;
-	/* TODO: Note that this technique will clobber any directory indexing.  They
-	 * exist after the .. entry with an inode of 0.  Check the docs for
-	 * specifics and think up a nice way to tell the diff between a reserved
-	 * entry and an unused one, when inode == 0. */
+	/* Note that this technique will clobber any directory indexing.  They
+	 * exist after the .. entry with an inode of 0.  ext2_create() drops the
+	 * index before we get here. */
 	if (record_slack < our_rec_len)
 		return FALSE;
 	/* At this point, there is enough room for us.  Stick our new one in right
@@ -1104,6 +1531,7 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 	e2ii = (struct ext2_i_info*)inode->i_fs_info;
 	for (int i = 0; i < 15; i++)
 		e2ii->i_block[i] = le32_to_cpu(disk_inode->i_block[i]);
+	ext2_i_info_init(e2ii);
 	/* Dirty and put the disk inode */
 	ext2_dirty_metablock(dentry->d_sb, disk_inode);
 	ext2_put_metablock(dentry->d_sb, disk_inode);
@@ -1111,8 +1539,17 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 	/* Note the disk dir_name is not null terminated */
 	our_rec_len = ROUNDUP(8 + dentry->d_name.len, 4);
 	assert(our_rec_len <= 8 + 256);
-	/* Consider caching the start point for future dirent ops.  Or even using
-	 * the indexed directory.... */
+	/* We don't maintain htree indexes, and the dirent could land in the index
+	 * blocks.  Drop the index, like other ext2 drivers do (fsck -D rebuilds
+	 * it).  The index blocks look like empty dirents to a scan. */
+	if (dir->i_flags & EXT2_INDEX_FL) {
+		dir->i_flags &= ~EXT2_INDEX_FL;
+		disk_inode = ext2_get_diskinode(dir);
+		disk_inode->i_flags = cpu_to_le32(dir->i_flags);
+		ext2_dirty_metablock(dentry->d_sb, disk_inode);
+		ext2_put_metablock(dentry->d_sb, disk_inode);
+	}
+	/* Consider caching the start point for future dirent ops. */
 	dir_block = ext2_foreach_dirent(dir, create_each_func, (long)dentry,
 	                                (long)our_rec_len, (long)mode);
 	/* If this returned a block number, we didn't find room in any of the
@@ -1125,6 +1562,7 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 		ext2_dirty_metablock(dentry->d_sb, new_dirent);
 		ext2_put_metablock(dentry->d_sb, new_dirent);
 	}
+	ext2_dirhash_insert(dir, dentry);
 	return 0;
 }
 
@@ -1146,6 +1584,329 @@ static bool lookup_each_func(struct ext2_dirent *dir_i, long a1, long a2,
 	return FALSE;
 }
 
+/* Htree hashes, which have to match what mke2fs and Linux put on disk. */
+#define EXT2_ROL32(x, s)	(((x) << (s)) | ((x) >> (32 - (s))))
+#define EXT2_TEA_DELTA		0x9e3779b9
+#define EXT2_MD4_F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z)	(((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z)	((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s)                                    \
+	(a += f(b, c, d) + (x), a = EXT2_ROL32(a, s))
+#define EXT2_MD4_K2			013240474631U
+#define EXT2_MD4_K3			015666365641U
+#define EXT2_HTREE_EOF		0x7fffffffU
+
+static int ext2_hash_char(const char *name, int i, bool unsig)
+{
+	return unsig ? (int)((unsigned char)name[i]) : (int)((signed char)name[i]);
+}
+
+static uint32_t ext2_dx_hack_hash(const char *name, int len, bool unsig)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (int i = 0; i < len; i++) {
+		hash = hash1 + (hash0 ^ (ext2_hash_char(name, i, unsig) * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/* Packs up to num words of msg into buf, padding with the length */
+static void ext2_str2hashbuf(const char *msg, int len, uint32_t *buf, int num,
+                             bool unsig)
+{
+	uint32_t pad, val;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int i = 0; i < len; i++) {
+		val = ext2_hash_char(msg, i, unsig) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static void ext2_half_md4(uint32_t buf[4], uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0], 3);
+	EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1], 7);
+	EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2], 11);
+	EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3], 19);
+	EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4], 3);
+	EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5], 7);
+	EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6], 11);
+	EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7], 19);
+
+	EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + EXT2_MD4_K2, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + EXT2_MD4_K2, 5);
+	EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + EXT2_MD4_K2, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + EXT2_MD4_K2, 13);
+	EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + EXT2_MD4_K2, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + EXT2_MD4_K2, 5);
+	EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + EXT2_MD4_K2, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + EXT2_MD4_K2, 13);
+
+	EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + EXT2_MD4_K3, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + EXT2_MD4_K3, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + EXT2_MD4_K3, 11);
+	EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + EXT2_MD4_K3, 15);
+	EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + EXT2_MD4_K3, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + EXT2_MD4_K3, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + EXT2_MD4_K3, 11);
+	EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + EXT2_MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void ext2_tea(uint32_t buf[4], uint32_t in[4])
+{
+	uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+
+	for (int n = 0; n < 16; n++) {
+		sum += EXT2_TEA_DELTA;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/* Returns the htree hash of name, with the low (collision) bit clear */
+static uint32_t ext2_dx_hash(const char *name, int len, int version,
+                             uint32_t *seed)
+{
+	uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	uint32_t in[8], hash;
+	bool unsig = version >= EXT2_HASH_LEGACY_UNSIGNED;
+
+	/* An all-zero seed means use the default */
+	for (int i = 0; i < 4; i++) {
+		if (seed[i]) {
+			for (int j = 0; j < 4; j++)
+				buf[j] = le32_to_cpu(seed[j]);
+			break;
+		}
+	}
+	switch (version) {
+	case EXT2_HASH_LEGACY:
+	case EXT2_HASH_LEGACY_UNSIGNED:
+		hash = ext2_dx_hack_hash(name, len, unsig);
+		break;
+	case EXT2_HASH_HALF_MD4:
+	case EXT2_HASH_HALF_MD4_UNSIGNED:
+		for (; len > 0; len -= 32, name += 32) {
+			ext2_str2hashbuf(name, len, in, 8, unsig);
+			ext2_half_md4(buf, in);
+		}
+		hash = buf[1];
+		break;
+	case EXT2_HASH_TEA:
+	case EXT2_HASH_TEA_UNSIGNED:
+		for (; len > 0; len -= 16, name += 16) {
+			ext2_str2hashbuf(name, len, in, 4, unsig);
+			ext2_tea(buf, in);
+		}
+		hash = buf[0];
+		break;
+	default:
+		panic("Bad htree hash version %d", version);
+	}
+	hash &= ~1;
+	if (hash == EXT2_HTREE_EOF << 1)
+		hash = (EXT2_HTREE_EOF - 1) << 1;
+	return hash;
+}
+
+/* One level of our path through an htree index */
+struct ext2_dx_frame {
+	void						*blk;
+	struct ext2_dx_entry		*entries;
+	struct ext2_dx_entry		*at;
+	unsigned int				count;
+};
+
+/* Sets up frame for the index entries at entries, in blk.  Returns FALSE if
+ * they don't make sense. */
+static bool ext2_dx_frame_init(struct inode *dir, struct ext2_dx_frame *frame,
+                               void *blk, struct ext2_dx_entry *entries)
+{
+	struct ext2_dx_countlimit *cl = (struct ext2_dx_countlimit*)entries;
+	unsigned int limit = le16_to_cpu(cl->limit);
+
+	frame->blk = blk;
+	frame->entries = entries;
+	frame->at = entries;
+	frame->count = le16_to_cpu(cl->count);
+	return frame->count && (frame->count <= limit) &&
+	       ((void*)(entries + limit) <= blk + dir->i_sb->s_blocksize);
+}
+
+/* Returns the dir block entry at points to, or 0 if it's past the end of dir
+ * (0 is the root, which is never a valid child). */
+static uint32_t ext2_dx_child(struct inode *dir, struct ext2_dx_entry *at)
+{
+	uint32_t blk = le32_to_cpu(at->block) & EXT2_DX_BLOCK_MASK;
+
+	if (blk >= dir->i_size / dir->i_sb->s_blocksize)
+		return 0;
+	return blk;
+}
+
+/* Loads the index node for frame's parent's entry, returning FALSE if it's bad */
+static bool ext2_dx_load_node(struct inode *dir, struct ext2_dx_frame *frame,
+                              struct ext2_dx_entry *parent_at)
+{
+	uint32_t child = ext2_dx_child(dir, parent_at);
+	void *blk;
+
+	frame->blk = 0;
+	if (!child)
+		return FALSE;
+	blk = ext2_get_ino_metablock(dir, child);
+	/* Interior nodes start with an empty dirent covering the block */
+	return ext2_dx_frame_init(dir, frame, blk, blk + 8);
+}
+
+/* Moves the path to the next leaf, if that leaf could have more names with
+ * hash.  The low bit of a block's starting hash means it continues a run of
+ * collisions from the previous block.  Returns FALSE if we're done. */
+static bool ext2_dx_next_leaf(struct inode *dir, struct ext2_dx_frame *frames,
+                              int nr_frames, uint32_t hash)
+{
+	int i = nr_frames - 1;
+
+	while (frames[i].at + 1 == frames[i].entries + frames[i].count) {
+		if (i-- == 0)
+			return FALSE;
+	}
+	frames[i].at++;
+	if ((le32_to_cpu(frames[i].at->hash) & ~1) != hash)
+		return FALSE;
+	for (i++; i < nr_frames; i++) {
+		ext2_put_metablock(dir->i_sb, frames[i].blk);
+		if (!ext2_dx_load_node(dir, &frames[i], frames[i - 1].at))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Scans one dir block for dentry's name, loading the inode if we find it */
+static bool ext2_dirblock_lookup(struct inode *dir, uint32_t dir_blk,
+                                 struct dentry *dentry)
+{
+	unsigned int blksize = dir->i_sb->s_blocksize;
+	void *blk = ext2_get_ino_metablock(dir, dir_blk);
+	struct ext2_dirent *dir_i;
+	bool found = FALSE;
+
+	for (unsigned int off = 0; off + 8 <= blksize; off += dir_i->dir_reclen) {
+		dir_i = blk + off;
+		if (!dir_i->dir_reclen)
+			break;
+		if (le32_to_cpu(dir_i->dir_inode) &&
+		    lookup_each_func(dir_i, (long)dentry, 0, 0)) {
+			found = TRUE;
+			break;
+		}
+	}
+	ext2_put_metablock(dir->i_sb, blk);
+	return found;
+}
+
+/* Looks up dentry's name in an htree indexed dir: we binary search each level
+ * of the index for the name's hash, then scan the leaf block it points to.
+ * Returns 1 if we found it, 0 if it isn't there, and -1 if we don't understand
+ * the index, in which case the caller should scan the whole dir. */
+static int ext2_dx_lookup(struct inode *dir, struct dentry *dentry)
+{
+	struct ext2_sb *e2sb = ((struct ext2_sb_info*)dir->i_sb->s_fs_info)->e2sb;
+	struct ext2_dx_frame frames[EXT2_DX_MAX_LEVELS] = {{0}};
+	struct ext2_dx_root_info *info;
+	struct ext2_dx_entry *p, *q, *m;
+	void *root;
+	uint32_t hash, leaf;
+	int version, nr_frames = 0, ret = -1;
+
+	root = ext2_get_ino_metablock(dir, 0);
+	/* The info is right after the . and .. dirents, 12 bytes each */
+	info = root + 24;
+	if (info->reserved_zero || (info->info_length != 8) ||
+	    (info->indirect_levels >= EXT2_DX_MAX_LEVELS) ||
+	    (info->hash_version > EXT2_HASH_TEA)) {
+		ext2_put_metablock(dir->i_sb, root);
+		goto out;
+	}
+	version = info->hash_version;
+	if (le32_to_cpu(e2sb->s_flags) & EXT2_FLAGS_UNSIGNED_HASH)
+		version += EXT2_HASH_LEGACY_UNSIGNED;
+	hash = ext2_dx_hash(dentry->d_name.name, dentry->d_name.len, version,
+	                    e2sb->s_hash_seed);
+	if (!ext2_dx_frame_init(dir, &frames[nr_frames++], root,
+	                        (void*)info + info->info_length))
+		goto out;
+	for (;;) {
+		/* Find the last entry whose hash is <= ours.  The first entry has no
+		 * hash (its slot is the count and limit), and covers from 0. */
+		p = frames[nr_frames - 1].entries + 1;
+		q = frames[nr_frames - 1].entries + frames[nr_frames - 1].count - 1;
+		while (p <= q) {
+			m = p + (q - p) / 2;
+			if (le32_to_cpu(m->hash) > hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		frames[nr_frames - 1].at = p - 1;
+		if (nr_frames > info->indirect_levels)
+			break;
+		if (!ext2_dx_load_node(dir, &frames[nr_frames],
+		                       frames[nr_frames - 1].at)) {
+			nr_frames++;
+			goto out;
+		}
+		nr_frames++;
+	}
+	ret = 0;
+	do {
+		leaf = ext2_dx_child(dir, frames[nr_frames - 1].at);
+		if (!leaf) {
+			ret = -1;
+			break;
+		}
+		if (ext2_dirblock_lookup(dir, leaf, dentry)) {
+			ret = 1;
+			break;
+		}
+	} while (ext2_dx_next_leaf(dir, frames, nr_frames, hash));
+out:
+	for (int i = 0; i < nr_frames; i++) {
+		if (frames[i].blk)
+			ext2_put_metablock(dir->i_sb, frames[i].blk);
+	}
+	if (ret < 0)
+		warn_once("Bad htree index in dir %lu, scanning it", dir->i_ino);
+	return ret;
+}
+
 /* Searches the directory for the filename in the dentry, filling in the dentry
  * with the FS specific info of this file.  If it succeeds, it will pass back
  * the *dentry you should use (which might be the same as the one you passed in).
@@ -1156,11 +1917,32 @@ static bool lookup_each_func(struct ext2_dirent *dir_i, long a1, long a2,
 struct dentry *ext2_lookup(struct inode *dir, struct dentry *dentry,
                            struct nameidata *nd)
 {
+	struct ext2_sb *e2sb = ((struct ext2_sb_info*)dir->i_sb->s_fs_info)->e2sb;
+	long ino;
+
 	assert(S_ISDIR(dir->i_mode));
-	struct ext2_dirent *dir_buf, *dir_i;
+	if ((dir->i_flags & EXT2_INDEX_FL) &&
+	    (le32_to_cpu(e2sb->s_feature_compat) & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		switch (ext2_dx_lookup(dir, dentry)) {
+		case 1:
+			return dentry;
+		case 0:
+			goto not_found;
+		}
+		/* Bad index, fall through to the scan */
+	} else {
+		ino = ext2_dirhash_lookup(dir, dentry->d_name.name, dentry->d_name.len);
+		if (ino > 0) {
+			load_inode(dentry, ino);
+			return dentry;
+		}
+		if (!ino)
+			goto not_found;
+	}
 	if (!ext2_foreach_dirent(dir, lookup_each_func, (long)dentry, 0, 0))
 		return dentry;
-	printd("EXT2: Not Found, %s\n", dentry->d_name.name);	
+not_found:
+	printd("EXT2: Not Found, %s\n", dentry->d_name.name);
 	return 0;
 }
 
@@ -1254,6 +2036,13 @@ I_AM_HERE;
 /* Modifies the size of the file of inode to whatever its i_size is set to */
 void ext2_truncate(struct inode *inode)
 {
+	/* We don't free blocks yet, but the cached mappings past the new size
+	 * shouldn't outlive them once we do. */
+	ext2_extents_clear(inode);
+	ext2_prealloc_discard(inode->i_sb,
+	                      &((struct ext2_i_info*)inode->i_fs_info)->i_pa);
+	if (S_ISDIR(inode->i_mode))
+		ext2_dirhash_clear(inode);
 }
 
 /* Checks whether the the access mode is allowed for the file belonging to the
@@ -1441,6 +2230,8 @@ int ext2_check_flags(int flags)
 struct page_map_operations ext2_pm_op = {
 	ext2_readpage,
 	ext2_writepage,
+	ext2_writepages,
+	ext2_releasepage,
 };
 
 struct super_operations ext2_s_op = {
@@ -27,53 +27,34 @@ static void tap_full_release(struct kref *kref)
 	tap_min_release(kref);
 }
 
-/* Adds a tap with the file/qid of the underlying device for the requested FD.
- * The FD must be a chan, and the device must support the filter requested.
- *
- * Returns -1 or some other device-specific non-zero number on failure, 0 on
- * success. */
-int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
+/* Installs tap in the FD table, for the FD and process the tap was set up
+ * with.  Caller holds the fdt lock.  Returns 0 on success, -1 with errno. */
+static int __install_fd_tap(struct fd_table *fdt, struct fd_tap *tap)
 {
-	struct fd_table *fdt = &p->open_files;
-	struct fd_tap *tap;
-	int ret = 0;
 	struct chan *chan;
-	int fd = tap_req->fd;
-
-	if (fd < 0) {
-		set_errno(EBADF);
-		return -1;
-	}
-	tap = kzmalloc(sizeof(struct fd_tap), KMALLOC_WAIT);
-	tap->proc = p;
-	tap->fd = fd;
-	tap->filter = tap_req->filter;
-	tap->ev_q = tap_req->ev_q;
-	tap->ev_id = tap_req->ev_id;
-	tap->data = tap_req->data;
+	int fd = tap->fd;
 
-	spin_lock(&fdt->lock);
 	if (fd >= fdt->max_fdset) {
 		set_errno(ENFILE);
-		goto out_with_lock;
+		return -1;
 	}
 	if (!GET_BITMASK_BIT(fdt->open_fds->fds_bits, fd)) {
 		set_errno(EBADF);
-		goto out_with_lock;
+		return -1;
 	}
 	if (!fdt->fd[fd].fd_chan) {
 		set_error(EINVAL, "Can't tap a VFS file");
-		goto out_with_lock;
+		return -1;
 	}
 	chan = fdt->fd[fd].fd_chan;
 	if (fdt->fd[fd].fd_tap) {
 		set_error(EBUSY, "FD %d already has a tap", fd);
-		goto out_with_lock;
+		return -1;
 	}
 	if (!devtab[chan->type].tapfd) {
 		set_error(ENOSYS, "Device %s does not handle taps",
 				  devtab[chan->type].name);
-		goto out_with_lock;
+		return -1;
 	}
 	/* need to keep chan alive for our call to the device.  someone else
 	 * could come in and close the FD and the chan, once we unlock */
@@ -83,59 +64,174 @@ int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 	 * happening until we've attempted to register with the device. */
 	kref_init(&tap->kref, tap_full_release, 2);
 	fdt->fd[fd].fd_tap = tap;
-	/* As soon as we unlock, another thread can come in and remove our old tap
-	 * from the table and decref it.  Our ref keeps us from removing it yet,
-	 * as well as keeps the memory safe.  However, a new tap can be installed
-	 * and registered with the device before we even attempt to register.  The
+	return 0;
+}
+
+/* Undoes an install of a tap that never made it into the device (or whose
+ * device registration failed).  Drops our ref too. */
+static void __uninstall_fd_tap(struct fd_table *fdt, struct fd_tap *tap)
+{
+	/* We haven't decreffed, so we know our tap pointer is unique. */
+	spin_lock(&fdt->lock);
+	if (fdt->fd[tap->fd].fd_tap == tap) {
+		fdt->fd[tap->fd].fd_tap = 0;
+		/* normally we can't decref a tap while holding a lock, but we
+		 * know we have another reference so this won't trigger a release */
+		kref_put(&tap->kref);
+	}
+	spin_unlock(&fdt->lock);
+	/* Regardless of whether someone else removed it or not, *we* are the
+	 * only ones that know that registration failed and that we shouldn't
+	 * remove it.  Since we still hold a ref, we can change the release
+	 * method to skip the device dereg. */
+	tap->kref.release = tap_min_release;
+	kref_put(&tap->kref);
+}
+
+/* Adds taps with the file/qid of the underlying device for the requested FDs.
+ * The FDs must be chans, and the devices must support the filters requested.
+ *
+ * The FD table lock is taken once for the whole batch.  Device registration
+ * still happens once per tap, outside that lock.  Processing stops at the
+ * first failure, and any later taps from the batch are backed out.  Returns
+ * the number of taps added; if that is less than nr_reqs, errno/errstr are set
+ * for tap_reqs[ret]. */
+int add_fd_taps(struct proc *p, struct fd_tap_req *tap_reqs, int nr_reqs)
+{
+	struct fd_table *fdt = &p->open_files;
+	struct fd_tap *taps[FDTAP_BATCH];
+	struct fd_tap *tap;
+	struct fd_tap_req *req;
+	int nr_inst, nr_done, ret;
+
+	nr_reqs = MIN(nr_reqs, FDTAP_BATCH);
+	/* Allocate before locking; we can block here */
+	for (int i = 0; i < nr_reqs; i++) {
+		req = &tap_reqs[i];
+		tap = kzmalloc(sizeof(struct fd_tap), KMALLOC_WAIT);
+		tap->proc = p;
+		tap->fd = req->fd;
+		tap->filter = req->filter;
+		tap->ev_q = req->ev_q;
+		tap->ev_id = req->ev_id;
+		tap->data = req->data;
+		taps[i] = tap;
+	}
+	spin_lock(&fdt->lock);
+	for (nr_inst = 0; nr_inst < nr_reqs; nr_inst++) {
+		if (taps[nr_inst]->fd < 0) {
+			set_errno(EBADF);
+			break;
+		}
+		if (__install_fd_tap(fdt, taps[nr_inst]))
+			break;
+	}
+	/* As soon as we unlock, another thread can come in and remove our old taps
+	 * from the table and decref them.  Our refs keep us from removing them yet,
+	 * as well as keep the memory safe.  However, new taps can be installed and
+	 * registered with the device before we even attempt to register.  The
 	 * devices should be able to handle multiple, distinct taps, even if they
 	 * happen to have the same {proc, fd} tuple. */
 	spin_unlock(&fdt->lock);
+	for (int i = nr_inst; i < nr_reqs; i++)
+		kfree(taps[i]);
 	/* For refcnting fans, the tap ref is weak/uncounted.  We'll protect the
 	 * memory and call the device when tap is being released. */
-	ret = devtab[chan->type].tapfd(chan, tap, FDTAP_CMD_ADD);
-	if (ret) {
-		/* we failed, so we need to make sure *our* tap is removed.  We haven't
-		 * decreffed, so we know our tap pointer is unique. */
-		spin_lock(&fdt->lock);
-		if (fdt->fd[fd].fd_tap == tap) {
-			fdt->fd[fd].fd_tap = 0;
-			/* normally we can't decref a tap while holding a lock, but we
-			 * know we have another reference so this won't trigger a release */
-			kref_put(&tap->kref);
-		}
-		spin_unlock(&fdt->lock);
-		/* Regardless of whether someone else removed it or not, *we* are the
-		 * only ones that know that registration failed and that we shouldn't
-		 * remove it.  Since we still hold a ref, we can change the release
-		 * method to skip the device dereg. */
-		tap->kref.release = tap_min_release;
+	for (nr_done = 0; nr_done < nr_inst; nr_done++) {
+		tap = taps[nr_done];
+		ret = devtab[tap->chan->type].tapfd(tap->chan, tap, FDTAP_CMD_ADD);
+		if (ret)
+			break;
+		kref_put(&tap->kref);
+	}
+	/* The failed tap and the ones after it never got to their device.  The
+	 * device already set errno; backing out doesn't touch it. */
+	for (int i = nr_done; i < nr_inst; i++)
+		__uninstall_fd_tap(fdt, taps[i]);
+	return nr_done;
+}
+
+/* Adds a single tap.  Returns -1 on failure, 0 on success. */
+int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
+{
+	return add_fd_taps(p, tap_req, 1) == 1 ? 0 : -1;
+}
+
+/* Removes the FD taps associated with the FDs of tap_reqs, taking the FD table
+ * lock once for the batch.  Stops at the first FD that isn't tapped.  Returns
+ * the number removed; if that is less than nr_reqs, errno/errstr are set for
+ * tap_reqs[ret]. */
+int remove_fd_taps(struct proc *p, struct fd_tap_req *tap_reqs, int nr_reqs)
+{
+	struct fd_table *fdt = &p->open_files;
+	struct fd_tap *taps[FDTAP_BATCH];
+	int fd, nr_done;
+
+	nr_reqs = MIN(nr_reqs, FDTAP_BATCH);
+	spin_lock(&fdt->lock);
+	for (nr_done = 0; nr_done < nr_reqs; nr_done++) {
+		fd = tap_reqs[nr_done].fd;
+		if (fd < 0 || fd >= fdt->max_fdset || !fdt->fd[fd].fd_tap)
+			break;
+		taps[nr_done] = fdt->fd[fd].fd_tap;
+		fdt->fd[fd].fd_tap = 0;
 	}
-	kref_put(&tap->kref);
-	return ret;
-out_with_lock:
 	spin_unlock(&fdt->lock);
-	kfree(tap);
-	return -1;
+	/* The final put calls into the device, so no locks held */
+	for (int i = 0; i < nr_done; i++)
+		kref_put(&taps[i]->kref);
+	if (nr_done < nr_reqs)
+		set_error(EBADF, "FD %d was not tapped", tap_reqs[nr_done].fd);
+	return nr_done;
 }
 
 /* Removes the FD tap associated with FD.  Returns 0 on success, -1 with
  * errno/errstr on failure. */
 int remove_fd_tap(struct proc *p, int fd)
+{
+	struct fd_tap_req req = {.fd = fd, .cmd = FDTAP_CMD_REM};
+
+	return remove_fd_taps(p, &req, 1) == 1 ? 0 : -1;
+}
+
+/* Changes the filter, event queue, ID and data of FD's existing tap, without
+ * tearing down its device registration.  The device checks the new filter
+ * first, with a copy of the tap.  An event that races with us may fire with a
+ * mix of the old and new settings.  Returns 0 on success, -1 with
+ * errno/errstr on failure. */
+int modify_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 {
 	struct fd_table *fdt = &p->open_files;
 	struct fd_tap *tap;
+	struct fd_tap new_tap;
+	int fd = tap_req->fd;
+	int ret;
 
 	spin_lock(&fdt->lock);
-	tap = fdt->fd[fd].fd_tap;
-	fdt->fd[fd].fd_tap = 0;
-	spin_unlock(&fdt->lock);
-	if (tap) {
-		kref_put(&tap->kref);
-		return 0;
-	} else {
+	if (fd < 0 || fd >= fdt->max_fdset || !fdt->fd[fd].fd_tap) {
+		spin_unlock(&fdt->lock);
 		set_error(EBADF, "FD %d was not tapped", fd);
 		return -1;
 	}
+	tap = fdt->fd[fd].fd_tap;
+	/* keeps the tap and its chan alive after we unlock */
+	kref_get(&tap->kref, 1);
+	spin_unlock(&fdt->lock);
+	new_tap = *tap;
+	new_tap.filter = tap_req->filter;
+	new_tap.ev_q = tap_req->ev_q;
+	new_tap.ev_id = tap_req->ev_id;
+	new_tap.data = tap_req->data;
+	ret = devtab[tap->chan->type].tapfd(tap->chan, &new_tap, FDTAP_CMD_MOD);
+	if (!ret) {
+		tap->ev_q = new_tap.ev_q;
+		tap->ev_id = new_tap.ev_id;
+		tap->data = new_tap.data;
+		wmb();	/* the rest of the tap before the filter that lets it fire */
+		tap->filter = new_tap.filter;
+	}
+	kref_put(&tap->kref);
+	return ret ? -1 : 0;
 }
 
 /* Fires off tap, with the events of filter having occurred.  Returns -1 on
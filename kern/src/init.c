@@ -41,13 +41,19 @@
 #include <blockdev.h>
 #include <ext2fs.h>
 #include <kthread.h>
+#include <rcu.h>
 #include <console.h>
 #include <linker_func.h>
 #include <ip.h>
 #include <acpi.h>
 #include <coreboot_tables.h>
+#include <taskqueue.h>
+#include <completion.h>
+#include <kdebug.h>
+#include <reclaim.h>
 
 #define MAX_BOOT_CMDLINE_SIZE 4096
+#define MAX_BOOT_PHASES 16
 
 #define ASSIGN_PTRVAL(prm, top, val)			\
 	do {										\
@@ -62,6 +68,16 @@ struct proc_global_info __proc_global_info;
 struct sysinfo_t sysinfo;
 static char boot_cmdline[MAX_BOOT_CMDLINE_SIZE];
 
+/* TSC stamps at the end of each phase of kernel_init().  We can't convert them
+ * to time until train_timing(), so we print them all at the end of boot. */
+struct boot_phase {
+	const char *name;
+	uint64_t tsc;
+};
+static struct boot_phase boot_phases[MAX_BOOT_PHASES];
+static int nr_boot_phases;
+static uint64_t boot_start_tsc;
+
 static void run_linker_funcs(void);
 static int run_init_script(void);
 
@@ -106,6 +122,28 @@ const char *get_boot_option(const char *base, const char *option, char *param,
 	return arg;
 }
 
+static void boot_phase_done(const char *name)
+{
+	if (nr_boot_phases == MAX_BOOT_PHASES)
+		return;
+	boot_phases[nr_boot_phases].name = name;
+	boot_phases[nr_boot_phases].tsc = read_tsc();
+	nr_boot_phases++;
+}
+
+static void print_boot_phases(void)
+{
+	uint64_t prev = boot_start_tsc;
+
+	printk("Boot time breakdown (usec):\n");
+	for (int i = 0; i < nr_boot_phases; i++) {
+		printk("\t%-12s %10llu\n", boot_phases[i].name,
+		       tsc2usec(boot_phases[i].tsc - prev));
+		prev = boot_phases[i].tsc;
+	}
+	printk("\t%-12s %10llu\n", "total", tsc2usec(prev - boot_start_tsc));
+}
+
 static void extract_multiboot_cmdline(struct multiboot_info *mbi)
 {
 	if (mbi && (mbi->flags & MULTIBOOT_INFO_CMDLINE) && mbi->cmdline) {
@@ -122,8 +160,10 @@ static void extract_multiboot_cmdline(struct multiboot_info *mbi)
 void kernel_init(multiboot_info_t *mboot_info)
 {
 	extern char __start_bss[], __stop_bss[];
+	uint64_t start_tsc = read_tsc();
 
 	memset(__start_bss, 0, __stop_bss - __start_bss);
+	boot_start_tsc = start_tsc;
 	/* mboot_info is a physical address.  while some arches currently have the
 	 * lower memory mapped, everyone should have it mapped at kernbase by now.
 	 * also, it might be in 'free' memory, so once we start dynamically using
@@ -136,6 +176,7 @@ void kernel_init(multiboot_info_t *mboot_info)
 	print_cpuinfo();
 
 	printk("Boot Command Line: '%s'\n", boot_cmdline);
+	boot_phase_done("console");
 
 	exception_table_init();
 	cache_init();					// Determine systems's cache properties
@@ -146,28 +187,41 @@ void kernel_init(multiboot_info_t *mboot_info)
 	radix_init();
 	cache_color_alloc_init();       // Inits data structs
 	colored_page_alloc_init();      // Allocates colors for agnostic processes
+	boot_phase_done("memory");
 	acpiinit();
 	topology_init();
+	page_alloc_numa_init();
+	boot_phase_done("acpi");
 	percpu_init();
 	kthread_init();					/* might need to tweak when this happens */
 	vmr_init();
 	file_init();
 	page_check();
+	boot_phase_done("kernel");
 	idt_init();
 	kernel_msg_init();
+	workqueue_init();
+	rcu_init();
 	timer_init();
+	walltime_init();
+	reclaim_init();
 	vfs_init();
 	devfs_init();
+	boot_phase_done("traps/vfs");
 	train_timing();
+	boot_phase_done("timing");
 	kb_buf_init(&cons_buf);
 	arch_init();
+	boot_phase_done("arch/smp");
 	block_init();
 	enable_irq();
 	run_linker_funcs();
+	boot_phase_done("linker");
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and medium
 	 * pre-inits, which need to happen before devether. */
 	devtabreset();
 	devtabinit();
+	boot_phase_done("devices");
 
 #ifdef CONFIG_EXT2FS
 	mount_fs(&ext2_fs_type, "/dev/ramdisk", "/mnt", 0);
@@ -176,7 +230,10 @@ void kernel_init(multiboot_info_t *mboot_info)
 	eth_audio_init();
 #endif /* CONFIG_ETH_AUDIO */
 	get_coreboot_info(&sysinfo);
+	boot_phase_done("misc");
+	print_boot_phases();
 	booting = 0;
+	printk_buffer_init();
 
 #ifdef CONFIG_RUN_INIT_SCRIPT
 	if (run_init_script()) {
@@ -248,6 +305,8 @@ void _panic(const char *file, int line, const char *fmt,...)
 	/* We're panicing, possibly in a place that can't handle the lock checker */
 	pcpui = &per_cpu_info[core_id_early()];
 	pcpui->__lock_checking_enabled--;
+	/* Get out whatever was buffered before we print, and print synchronously */
+	printk_sync();
 	va_start(ap, fmt);
 	printk("kernel panic at %s:%d, from core %d: ", file, line,
 	       core_id_early());
@@ -277,6 +336,25 @@ void _warn(const char *file, int line, const char *fmt,...)
 	va_end(ap);
 }
 
+struct linker_func_time {
+	linker_func_t func;
+	uint64_t usec;
+	int coreid;
+};
+
+static struct linker_func_time *lf_times;
+static int nr_lf_times;
+
+static void __run_link(linker_func_t func, struct linker_func_time *lft)
+{
+	uint64_t start = read_tsc();
+
+	func();
+	lft->func = func;
+	lft->usec = tsc2usec(read_tsc() - start);
+	lft->coreid = core_id();
+}
+
 static void run_links(linker_func_t *linkstart, linker_func_t *linkend)
 {
 	/* Unlike with devtab, our linker sections for the function pointers are
@@ -285,16 +363,71 @@ static void run_links(linker_func_t *linkstart, linker_func_t *linkend)
 	printd("linkstart %p, linkend %p\n", linkstart, linkend);
 	for (int i = 0; &linkstart[i] < linkend; i++) {
 		printd("i %d, linkfunc %p\n", i, linkstart[i]);
-		linkstart[i]();
+		__run_link(linkstart[i], &lf_times[nr_lf_times++]);
+	}
+}
+
+static void __run_link_async(uint32_t srcid, long a0, long a1, long a2)
+{
+	__run_link((linker_func_t)a0, (struct linker_func_time*)a1);
+	completion_complete((struct completion*)a2, 1);
+}
+
+/* Sends the async funcs round-robin to the cores other than ours.  They run as
+ * routine kmsgs, once those cores are idle. */
+static void run_links_async(linker_func_t *linkstart, linker_func_t *linkend,
+                            struct completion *comp)
+{
+	int coreid = core_id();
+
+	completion_init(comp, linkend - linkstart);
+	for (int i = 0; &linkstart[i] < linkend; i++) {
+		if (num_cores == 1) {
+			__run_link_async(coreid, (long)linkstart[i],
+			                 (long)&lf_times[nr_lf_times++], (long)comp);
+			continue;
+		}
+		do {
+			coreid = (coreid + 1) % num_cores;
+		} while (coreid == core_id());
+		send_kernel_message(coreid, __run_link_async, (long)linkstart[i],
+		                    (long)&lf_times[nr_lf_times++], (long)comp,
+		                    KMSG_ROUTINE);
+	}
+}
+
+static void print_linker_func_times(void)
+{
+	char *name;
+
+	printk("Linker func times (usec):\n");
+	for (int i = 0; i < nr_lf_times; i++) {
+		name = get_fn_name((uintptr_t)lf_times[i].func);
+		printk("\t%-32s %10llu on core %d\n", name, lf_times[i].usec,
+		       lf_times[i].coreid);
+		kfree(name);
 	}
 }
 
 static void run_linker_funcs(void)
 {
+	struct completion async_comp;
+
+	lf_times = kzmalloc(sizeof(struct linker_func_time) *
+	                    ((__linkerfunc1end - __linkerfunc1start) +
+	                     (__linkerfunc2end - __linkerfunc2start) +
+	                     (__linkerfunc3end - __linkerfunc3start) +
+	                     (__linkerfunc4end - __linkerfunc4start) +
+	                     (__linkerfuncasyncend - __linkerfuncasyncstart)),
+	                    KMALLOC_WAIT);
+	run_links_async(__linkerfuncasyncstart, __linkerfuncasyncend, &async_comp);
 	run_links(__linkerfunc1start, __linkerfunc1end);
 	run_links(__linkerfunc2start, __linkerfunc2end);
 	run_links(__linkerfunc3start, __linkerfunc3end);
 	run_links(__linkerfunc4start, __linkerfunc4end);
+	completion_wait(&async_comp);
+	print_linker_func_times();
+	kfree(lf_times);
 }
 
 /* You need to reference PROVIDE symbols somewhere, or they won't be included.
@@ -303,7 +436,8 @@ void debug_linker_tables(void)
 {
 	extern struct dev __devtabstart[];
 	extern struct dev __devtabend[];
-	printk("devtab %p %p\nlink1 %p %p\nlink2 %p %p\nlink3 %p %p\nlink4 %p %p\n",
+	printk("devtab %p %p\nlink1 %p %p\nlink2 %p %p\nlink3 %p %p\nlink4 %p %p\n"
+	       "linkasync %p %p\n",
 	       __devtabstart,
 	       __devtabend,
 		   __linkerfunc1start,
@@ -313,7 +447,9 @@ void debug_linker_tables(void)
 		   __linkerfunc3start,
 		   __linkerfunc3end,
 		   __linkerfunc4start,
-		   __linkerfunc4end);
+		   __linkerfunc4end,
+		   __linkerfuncasyncstart,
+		   __linkerfuncasyncend);
 }
 
 #endif //Everything For Free
@@ -16,6 +16,9 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <kthread.h>
+#include <endian.h>
+#include <zlib.h>
 
 #define KFS_MAX_FILE_SIZE 1024*1024*128
 #define KFS_MAGIC 0xdead0001
@@ -45,12 +48,82 @@ static unsigned long kfs_get_free_ino(void)
 /* Slabs for KFS specific info chunks */
 struct kmem_cache *kfs_i_kcache;
 
+#ifdef CONFIG_KFS_COMPRESS
+/* One inflate stream for all compressed files.  Its workspace is big, and we
+ * only inflate a page at a time. */
+static qlock_t kfs_z_qlock;
+static struct z_stream_s kfs_z_strm;
+#endif
+
 static void kfs_init(void)
 {
 	kfs_i_kcache = kmem_cache_create("kfs_ino_info", sizeof(struct kfs_i_info),
 	                                 __alignof__(struct kfs_i_info), 0, 0, 0);
+#ifdef CONFIG_KFS_COMPRESS
+	qlock_init(&kfs_z_qlock);
+	kfs_z_strm.workspace = kmalloc(zlib_inflate_workspacesize(), KMALLOC_WAIT);
+	assert(kfs_z_strm.workspace);
+	if (zlib_inflateInit2(&kfs_z_strm, -MAX_WBITS) != Z_OK)
+		panic("KFS couldn't init zlib");
+#endif
+}
+
+#ifdef CONFIG_KFS_COMPRESS
+/* Inflates chunk idx of a compressed file into dst, which has room for a whole
+ * chunk.  Returns 0 on success. */
+static int kfs_z_read_chunk(struct kfs_z_hdr *zhdr, unsigned long idx,
+                            void *dst)
+{
+	uint32_t start = le32_to_cpu(zhdr->offsets[idx]);
+	uint32_t end = le32_to_cpu(zhdr->offsets[idx + 1]);
+	size_t len = MIN(PGSIZE, le32_to_cpu(zhdr->size) - idx * PGSIZE);
+	int ret;
+
+	if (end - start == len) {
+		memcpy(dst, (void*)zhdr + start, len);
+		return 0;
+	}
+	qlock(&kfs_z_qlock);
+	zlib_inflateReset(&kfs_z_strm);
+	kfs_z_strm.next_in = (void*)zhdr + start;
+	kfs_z_strm.avail_in = end - start;
+	kfs_z_strm.next_out = dst;
+	kfs_z_strm.avail_out = len;
+	ret = zlib_inflate(&kfs_z_strm, Z_FINISH);
+	if ((ret == Z_STREAM_END) && (kfs_z_strm.total_out == len))
+		ret = 0;
+	else
+		ret = -EIO;
+	qunlock(&kfs_z_qlock);
+	return ret;
 }
 
+/* Sets up k_i_info for the CPIO file, if it came from kfs-zpack.  Returns the
+ * uncompressed size, or -1 if the header is bad. */
+static ssize_t kfs_z_init_file(struct kfs_i_info *k_i_info,
+                               struct cpio_bin_hdr *c_bhdr)
+{
+	struct kfs_z_hdr *zhdr = (struct kfs_z_hdr*)c_bhdr->c_filestart;
+	size_t size, nr_chunks;
+
+	if ((c_bhdr->c_filesize < sizeof(struct kfs_z_hdr)) ||
+	    memcmp(zhdr->magic, KFS_Z_MAGIC, sizeof(zhdr->magic)))
+		return c_bhdr->c_filesize;
+	size = le32_to_cpu(zhdr->size);
+	nr_chunks = DIV_ROUND_UP(size, PGSIZE);
+	if ((le32_to_cpu(zhdr->chunk_sz) != PGSIZE) ||
+	    (sizeof(struct kfs_z_hdr) + (nr_chunks + 1) * sizeof(uint32_t) >
+	     c_bhdr->c_filesize) ||
+	    (le32_to_cpu(zhdr->offsets[nr_chunks]) != c_bhdr->c_filesize)) {
+		printk("Bad compressed file %s in the CPIO\n", c_bhdr->c_filename);
+		return -1;
+	}
+	k_i_info->compressed = TRUE;
+	k_i_info->init_size = size;
+	return size;
+}
+#endif
+
 /* Creates the SB (normally would read in from disc and create).  Passes it's
  * ref out to whoever consumes this.  Returns 0 on failure.
  * TODO: consider pulling out more of the FS-independent stuff, if possible.
@@ -130,7 +203,18 @@ int kfs_readpage(struct page_map *pm, struct page *page)
 		memset(page2kva(page), 0, PGSIZE);
 	} else {
 		size_t copy_amt = MIN(PGSIZE, k_i_info->init_size - pg_idx_byte);
+#ifdef CONFIG_KFS_COMPRESS
+		/* init_size can be less than the chunk, if we were truncated */
+		if (k_i_info->compressed) {
+			if (kfs_z_read_chunk(k_i_info->filestart, page->pg_index,
+			                     page2kva(page)))
+				return -EIO;
+		} else {
+			memcpy(page2kva(page), (void*)begin, copy_amt);
+		}
+#else
 		memcpy(page2kva(page), (void*)begin, copy_amt);
+#endif
 		memset(page2kva(page) + copy_amt, 0, PGSIZE - copy_amt);
 	}
 	struct buffer_head *bh = kmem_cache_alloc(bh_kcache, 0);
@@ -153,10 +237,12 @@ int kfs_readpage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
+/* KFS files only live in the page cache, so there is nowhere to write them.  We
+ * claim success, so writeback doesn't keep redirtying and retrying the page. */
 int kfs_writepage(struct page_map *pm, struct page *page)
 {
 	warn_once("KFS writepage does not save file contents!\n");
-	return -1;
+	return 0;
 }
 
 /* Super Operations */
@@ -178,6 +264,7 @@ struct inode *kfs_alloc_inode(struct super_block *sb)
 	TAILQ_INIT(&((struct kfs_i_info*)inode->i_fs_info)->children);
 	((struct kfs_i_info*)inode->i_fs_info)->filestart = 0;
 	((struct kfs_i_info*)inode->i_fs_info)->init_size = 0;
+	((struct kfs_i_info*)inode->i_fs_info)->compressed = FALSE;
 	return inode;
 }
 
@@ -295,6 +382,8 @@ static void kfs_init_inode(struct inode *dir, struct dentry *dentry)
 	struct inode *inode = dentry->d_inode;
 	kref_get(&dentry->d_kref, 1);	/* to pin the dentry in RAM, KFS-style... */
 	inode->i_ino = kfs_get_free_ino();
+	/* The page cache is the only copy of what was written */
+	inode->i_mapping->pm_unevictable = TRUE;
 	/* our parent dentry's inode tracks our dentry info.  We do this
 	 * since it's all in memory and we aren't using the dcache yet.
 	 * We're reusing the subdirs link, which is used by the VFS when
@@ -412,6 +501,8 @@ int kfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	struct inode *inode = dentry->d_inode;
 	kref_get(&dentry->d_kref, 1);	/* to pin the dentry in RAM, KFS-style... */
 	inode->i_ino = kfs_get_free_ino();
+	/* The page cache is the only copy of what was written */
+	inode->i_mapping->pm_unevictable = TRUE;
 	SET_FTYPE(inode->i_mode, __S_IFDIR);
 	inode->i_fop = &kfs_f_op_dir;
 	/* get ready to have our own kids */
@@ -816,6 +907,7 @@ static int __add_kfs_entry(struct dentry *parent, char *path,
 	struct inode *inode;
 	int err, retval;
 	char *symname, old_end;			/* for symlink manipulation */
+	ssize_t size = c_bhdr->c_filesize;
 
 	if (first_slash) {
 		/* get the first part, find that dentry, pass in the second part,
@@ -872,6 +964,13 @@ static int __add_kfs_entry(struct dentry *parent, char *path,
 														c_bhdr->c_filestart;
 				((struct kfs_i_info*)dentry->d_inode->i_fs_info)->init_size =
 														c_bhdr->c_filesize;
+#ifdef CONFIG_KFS_COMPRESS
+				size = kfs_z_init_file(dentry->d_inode->i_fs_info, c_bhdr);
+				if (size < 0) {
+					kref_put(&dentry->d_kref);
+					return -1;
+				}
+#endif
 				break;
 			default:
 				printk("Unknown file type %d in the CPIO!",
@@ -886,11 +985,11 @@ static int __add_kfs_entry(struct dentry *parent, char *path,
 		inode->i_atime.tv_sec = c_bhdr->c_mtime;
 		inode->i_ctime.tv_sec = c_bhdr->c_mtime;
 		inode->i_mtime.tv_sec = c_bhdr->c_mtime;
-		inode->i_size = c_bhdr->c_filesize;
+		inode->i_size = size;
 		//inode->i_XXX = c_bhdr->c_dev;			/* and friends */
 		inode->i_bdev = 0;						/* assuming blockdev? */
 		inode->i_socket = FALSE;
-		inode->i_blocks = c_bhdr->c_filesize;	/* blocksize == 1 */
+		inode->i_blocks = size;					/* blocksize == 1 */
 		kref_put(&dentry->d_kref);
 	}
 	return 0;
@@ -12,16 +12,110 @@
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
+#include <percpu.h>
+#include <smp.h>
+#include <kmem_acct.h>
 
 #define kmallocdebug(args...)  //printk(args)
 
+#ifdef CONFIG_KMALLOC_HUGE_SLABS
+#define KMALLOC_CACHE_FLAGS		KMC_HUGE
+#else
+#define KMALLOC_CACHE_FLAGS		0
+#endif
+
 //List of physical pages used by kmalloc
 static spinlock_t pages_list_lock = SPINLOCK_INITIALIZER;
 static page_list_t pages_list;
 
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
-static void __kfree_release(struct kref *kref);
+/* Per-core stats, so we don't bounce a cache line on every kmalloc.  These are
+ * plain increments: a kmalloc from IRQ context can race with one on the same
+ * core and lose a count, which is fine for stats. */
+struct kmalloc_pcpu_stats {
+	struct kmalloc_class_stats classes[KMALLOC_NR_STAT_CLASSES];
+};
+static DEFINE_PERCPU(struct kmalloc_pcpu_stats, kmalloc_stats);
+
+static void __kfree_release(struct kmalloc_tag *tag);
+
+/* Returns the smallest size class that fits ksize bytes.  Past class 0, an
+ * order's classes are spaced 1 / KMALLOC_CLASSES_PER_ORDER of the order's base
+ * apart, with the last class of an order being the next power of two. */
+static int __ksize_to_class(size_t ksize)
+{
+	size_t order_base;
+	int order;
+
+	if (ksize <= KMALLOC_SMALLEST)
+		return 0;
+	order = LOG2_UP(ksize) - 1;
+	order_base = 1UL << order;
+	return (order - LOG2_UP(KMALLOC_SMALLEST)) * KMALLOC_CLASSES_PER_ORDER +
+	       DIV_ROUND_UP(ksize - order_base, order_base >> KMALLOC_CLASS_SHIFT);
+}
+
+/* Object size, including the tag, of a size class. */
+size_t kmalloc_class_size(int class)
+{
+	size_t order_base;
+
+	if (!class)
+		return KMALLOC_SMALLEST;
+	order_base = KMALLOC_SMALLEST << ((class - 1) / KMALLOC_CLASSES_PER_ORDER);
+	return order_base + ((class - 1) % KMALLOC_CLASSES_PER_ORDER + 1) *
+	                    (order_base >> KMALLOC_CLASS_SHIFT);
+}
+
+static void __kmalloc_account_alloc(int class, size_t size, size_t ksize)
+{
+	struct kmalloc_class_stats *stats;
+
+	stats = &PERCPU_VARPTR(kmalloc_stats)->classes[class];
+	stats->nr_allocs++;
+	stats->bytes_requested += size;
+	stats->bytes_allocated += ksize;
+}
+
+static void __kmalloc_account_free(int class)
+{
+	PERCPU_VARPTR(kmalloc_stats)->classes[class].nr_frees++;
+}
+
+/* Sums a class's stats across all cores. */
+void kmalloc_get_class_stats(int class, struct kmalloc_class_stats *stats)
+{
+	struct kmalloc_class_stats *pcpu_stats;
+
+	assert(class < KMALLOC_NR_STAT_CLASSES);
+	memset(stats, 0, sizeof(struct kmalloc_class_stats));
+	for (int i = 0; i < num_cores; i++) {
+		pcpu_stats = &_PERCPU_VARPTR(kmalloc_stats, i)->classes[class];
+		stats->nr_allocs += pcpu_stats->nr_allocs;
+		stats->nr_frees += pcpu_stats->nr_frees;
+		stats->bytes_requested += pcpu_stats->bytes_requested;
+		stats->bytes_allocated += pcpu_stats->bytes_allocated;
+	}
+}
+
+/* Racy with concurrent kmallocs, but close enough. */
+void kmalloc_reset_stats(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(kmalloc_stats, i), 0,
+		       sizeof(struct kmalloc_pcpu_stats));
+}
+
+/* percpu_init copies the boot stats (on the template) to every core.  Keep them
+ * on core 0 only, so we don't count them num_cores times. */
+static void kmalloc_stats_init(void)
+{
+	for (int i = 1; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(kmalloc_stats, i), 0,
+		       sizeof(struct kmalloc_pcpu_stats));
+}
+DEFINE_PERCPU_INIT(kmalloc_stats_init);
 
 void kmalloc_init(void)
 {
@@ -29,16 +123,45 @@ void kmalloc_init(void)
 	 * returns are 16 byte aligned.  we used to check the actual size == 16,
 	 * since we adjusted the KMALLOC_SMALLEST based on that. */
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
+	/* every size class needs to keep the alignment too */
+	static_assert(ALIGNED(KMALLOC_SMALLEST >> KMALLOC_CLASS_SHIFT,
+	                      KMALLOC_ALIGNMENT));
+	/* the tag keeps the kmem subsystem in its flag specific data */
+	static_assert(KMEM_NR_SUBSYS <= KMALLOC_KMEM_MASK + 1);
 	/* build caches of common sizes.  this size will later include the tag and
 	 * the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
-		kmalloc_caches[i] = kmem_cache_create("kmalloc_cache", ksize,
-		                                      KMALLOC_ALIGNMENT, 0, 0, 0);
-		ksize <<= 1;
+		kmalloc_caches[i] = kmem_cache_create("kmalloc_cache",
+		                                      kmalloc_class_size(i),
+		                                      KMALLOC_ALIGNMENT,
+		                                      KMALLOC_CACHE_FLAGS, 0, 0);
 	}
 }
 
+/* Bytes behind a CACHE or PAGES tag, which is what we charge */
+static size_t __km_tag_bytes(struct kmalloc_tag *tag)
+{
+	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
+		return tag->my_cache->obj_size;
+	return (1UL << LOG2_UP(tag->num_pages)) * PGSIZE;
+}
+
+static int __km_tag_subsys(struct kmalloc_tag *tag)
+{
+	return (tag->flags >> KMALLOC_ALIGN_SHIFT) & KMALLOC_KMEM_MASK;
+}
+
+static void __km_tag_init(struct kmalloc_tag *tag, int tag_type, int flags)
+{
+	int subsys = (flags >> KMALLOC_KMEM_SHIFT) & KMALLOC_KMEM_MASK;
+
+	assert(subsys < KMEM_NR_SUBSYS);
+	tag->flags = tag_type | (subsys << KMALLOC_ALIGN_SHIFT);
+	tag->canary = KMALLOC_CANARY;
+	atomic_init(&tag->refcnt, 1);
+	tag->acct = kmem_charge(subsys, __km_tag_bytes(tag));
+}
+
 void *kmalloc(size_t size, int flags) 
 {
 	// reserve space for bookkeeping and preserve alignment
@@ -46,10 +169,7 @@ void *kmalloc(size_t size, int flags)
 	void *buf;
 	int cache_id;
 	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
+	cache_id = __ksize_to_class(ksize);
 	// if we don't have a cache to handle it, alloc cont pages
 	if (cache_id >= NUM_KMALLOC_CACHES) {
 		size_t num_pgs = ROUNDUP(size + sizeof(struct kmalloc_tag), PGSIZE) /
@@ -57,24 +177,23 @@ void *kmalloc(size_t size, int flags)
 		buf = get_cont_pages(LOG2_UP(num_pgs), flags);
 		if (!buf)
 			panic("Kmalloc failed!  Handle me!");
+		__kmalloc_account_alloc(KMALLOC_PAGES_CLASS, size,
+		                        (1UL << LOG2_UP(num_pgs)) * PGSIZE);
 		// fill in the kmalloc tag
 		struct kmalloc_tag *tag = buf;
-		tag->flags = KMALLOC_TAG_PAGES;
 		tag->num_pages = num_pgs;
-		tag->canary = KMALLOC_CANARY;
-		kref_init(&tag->kref, __kfree_release, 1);
+		__km_tag_init(tag, KMALLOC_TAG_PAGES, flags);
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
 	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
+	__kmalloc_account_alloc(cache_id, size, kmalloc_class_size(cache_id));
 	// store a pointer to the buffers kmem_cache in it's bookkeeping space
 	struct kmalloc_tag *tag = buf;
-	tag->flags = KMALLOC_TAG_CACHE;
 	tag->my_cache = kmalloc_caches[cache_id];
-	tag->canary = KMALLOC_CANARY;
-	kref_init(&tag->kref, __kfree_release, 1);
+	__km_tag_init(tag, KMALLOC_TAG_CACHE, flags);
 	return buf + sizeof(struct kmalloc_tag);
 }
 
@@ -198,38 +317,75 @@ void *krealloc(void* buf, size_t size, int flags)
 void kmalloc_incref(void *buf)
 {
 	void *orig_buf = __get_unaligned_orig_buf(buf);
+	bool got_ref;
+
 	buf = orig_buf ? orig_buf : buf;
-	/* if we want a smaller tag, we can extract the code from kref and manually
-	 * set the release method in kfree. */
-	kref_get(&__get_km_tag(buf)->kref, 1);
+	/* Will panic on zero, like kref_get */
+	got_ref = atomic_add_not_zero(&__get_km_tag(buf)->refcnt, 1);
+	assert(got_ref);
 }
 
 int kmalloc_refcnt(void *buf)
 {
 	void *orig_buf = __get_unaligned_orig_buf(buf);
 	buf = orig_buf ? orig_buf : buf;
-	return kref_refcnt(&__get_km_tag(buf)->kref);
+	return atomic_read(&__get_km_tag(buf)->refcnt);
 }
 
-static void __kfree_release(struct kref *kref)
+/* Moves buf's charge to the current process, e.g. when a cached buffer gets
+ * reused on someone else's behalf. */
+void kmalloc_charge(void *buf)
 {
-	struct kmalloc_tag *tag = container_of(kref, struct kmalloc_tag, kref);
-	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
+	void *orig_buf = __get_unaligned_orig_buf(buf);
+	struct kmalloc_tag *tag;
+
+	buf = orig_buf ? orig_buf : buf;
+	tag = __get_km_tag(buf);
+	kmem_uncharge(tag->acct, __km_tag_subsys(tag), __km_tag_bytes(tag));
+	tag->acct = kmem_charge(__km_tag_subsys(tag), __km_tag_bytes(tag));
+}
+
+/* Stops charging buf to its process.  It still counts for its subsystem. */
+void kmalloc_uncharge(void *buf)
+{
+	void *orig_buf = __get_unaligned_orig_buf(buf);
+	struct kmalloc_tag *tag;
+
+	buf = orig_buf ? orig_buf : buf;
+	tag = __get_km_tag(buf);
+	if (!tag->acct)
+		return;
+	kmem_uncharge(tag->acct, __km_tag_subsys(tag), __km_tag_bytes(tag));
+	kmem_account(__km_tag_subsys(tag), __km_tag_bytes(tag));
+	tag->acct = 0;
+}
+
+static void __kfree_release(struct kmalloc_tag *tag)
+{
+	kmem_uncharge(tag->acct, __km_tag_subsys(tag), __km_tag_bytes(tag));
+	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE) {
+		__kmalloc_account_free(__ksize_to_class(tag->my_cache->obj_size));
 		kmem_cache_free(tag->my_cache, tag);
-	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES)
+	} else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES) {
+		__kmalloc_account_free(KMALLOC_PAGES_CLASS);
 		free_cont_pages(tag, LOG2_UP(tag->num_pages));
-	else
+	} else
 		panic("Bad flag 0x%x in %s", tag->flags, __FUNCTION__);
 }
 
 void kfree(void *buf)
 {
 	void *orig_buf;
+	struct kmalloc_tag *tag;
+
 	if (buf == NULL)
 		return;
 	orig_buf = __get_unaligned_orig_buf(buf);
 	buf = orig_buf ? orig_buf : buf;
-	kref_put(&__get_km_tag(buf)->kref);
+	tag = __get_km_tag(buf);
+	assert(atomic_read(&tag->refcnt) > 0);		/* catch some bugs */
+	if (atomic_sub_and_test(&tag->refcnt, 1))
+		__kfree_release(tag);
 }
 
 void kmalloc_canary_check(char *str)
@@ -0,0 +1,132 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Kernel memory accounting.  See kmem_acct.h. */
+
+#include <kmem_acct.h>
+#include <kmalloc.h>
+#include <process.h>
+#include <percpu.h>
+#include <smp.h>
+#include <trap.h>
+#include <assert.h>
+
+const char *kmem_subsys_names[KMEM_NR_SUBSYS] = {
+	[KMEM_OTHER] = "other",
+	[KMEM_BLOCK] = "block",
+	[KMEM_CHAN] = "chan",
+	[KMEM_PGTBL] = "pgtbl",
+	[KMEM_KSTACK] = "kstack",
+	[KMEM_VMR] = "vmr",
+};
+
+/* Bumped with IRQs off, since IRQ handlers allocate too.  The counters are
+ * signed: a core that frees more than it allocated goes negative. */
+struct kmem_pcpu_stats {
+	struct kmem_subsys_stats	subsys[KMEM_NR_SUBSYS];
+};
+static DEFINE_PERCPU(struct kmem_pcpu_stats, kmem_stats);
+
+/* percpu_init copies the boot counts (on the template) to every core.  Keep
+ * them on core 0 only, like the kmalloc stats. */
+static void kmem_stats_init(void)
+{
+	for (int i = 1; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(kmem_stats, i), 0,
+		       sizeof(struct kmem_pcpu_stats));
+}
+DEFINE_PERCPU_INIT(kmem_stats_init);
+
+static void __kmem_count(int subsys, long bytes, bool charged)
+{
+	struct kmem_subsys_stats *st;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	st = &PERCPU_VARPTR(kmem_stats)->subsys[subsys];
+	st->bytes += bytes;
+	if (charged)
+		st->charged += bytes;
+	enable_irqsave(&irq_state);
+}
+
+/* Counts bytes of subsys memory that don't belong to any process. */
+void kmem_account(int subsys, long bytes)
+{
+	__kmem_count(subsys, bytes, FALSE);
+}
+
+/* Charges bytes of subsys memory to the current process, if there is one.
+ * Returns the kmem_acct charged, with a reference, or 0.  Pass it to
+ * kmem_uncharge when the memory is freed.
+ *
+ * IRQ handlers aren't running on behalf of whoever they interrupted, so their
+ * allocations are only counted. */
+struct kmem_acct *kmem_charge(int subsys, size_t bytes)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct kmem_acct *acct = 0;
+
+	if (pcpui->cur_proc && !in_irq_ctx(pcpui))
+		acct = pcpui->cur_proc->kmem_acct;
+	if (acct) {
+		kref_get(&acct->kref, 1);
+		atomic_add(&acct->bytes[subsys], bytes);
+	}
+	__kmem_count(subsys, bytes, acct != 0);
+	return acct;
+}
+
+void kmem_uncharge(struct kmem_acct *acct, int subsys, size_t bytes)
+{
+	__kmem_count(subsys, -(long)bytes, acct != 0);
+	if (acct) {
+		atomic_add(&acct->bytes[subsys], -(long)bytes);
+		kref_put(&acct->kref);
+	}
+}
+
+static void kmem_acct_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct kmem_acct, kref));
+}
+
+void kmem_acct_proc_init(struct proc *p)
+{
+	struct kmem_acct *acct = kzmalloc(sizeof(struct kmem_acct), KMALLOC_WAIT);
+
+	kref_init(&acct->kref, kmem_acct_release, 1);
+	/* Anything we allocate from here on is p's */
+	p->kmem_acct = acct;
+}
+
+/* Drops p's ref.  Whatever p still has charged keeps the acct alive. */
+void kmem_acct_proc_free(struct proc *p)
+{
+	if (!p->kmem_acct)
+		return;
+	kref_put(&p->kmem_acct->kref);
+	p->kmem_acct = 0;
+}
+
+void kmem_acct_get_proc(struct proc *p, long bytes[KMEM_NR_SUBSYS])
+{
+	for (int i = 0; i < KMEM_NR_SUBSYS; i++)
+		bytes[i] = p->kmem_acct ? atomic_read(&p->kmem_acct->bytes[i]) : 0;
+}
+
+/* Sums the per-core counters.  Racy with concurrent allocs, but close
+ * enough. */
+void kmem_get_subsys_stats(struct kmem_subsys_stats stats[KMEM_NR_SUBSYS])
+{
+	struct kmem_subsys_stats *st;
+
+	memset(stats, 0, sizeof(struct kmem_subsys_stats) * KMEM_NR_SUBSYS);
+	for (int i = 0; i < num_cores; i++) {
+		for (int j = 0; j < KMEM_NR_SUBSYS; j++) {
+			st = &_PERCPU_VARPTR(kmem_stats, i)->subsys[j];
+			stats[j].bytes += st->bytes;
+			stats[j].charged += st->charged;
+		}
+	}
+}
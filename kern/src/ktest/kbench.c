@@ -0,0 +1,386 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Kernel microbenchmarks.  These are ktests that time a primitive and report
+ * with kbench_report(), which prints a KBENCH line and saves it for
+ * #regress/kbench.  They only fail if the primitive itself fails.
+ *
+ * The multicore benchmarks run their loop on the first N cores at once, by
+ * sending routine kmsgs, so the other cores should be idle. */
+
+#include <ktest.h>
+#include <linker_func.h>
+#include <kmalloc.h>
+#include <slab.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <smp.h>
+#include <trap.h>
+#include <alarm.h>
+#include <radix.h>
+#include <rwlock.h>
+#include <atomic.h>
+#include <ns.h>
+#include <apipe.h>
+#include <time.h>
+#include <string.h>
+
+KTEST_SUITE("KBENCH")
+
+#define KBENCH_NR_OPS			100000
+#define KBENCH_NR_KMSGS			10000
+#define KBENCH_NR_RADIX			65536
+#define KBENCH_QIO_CHUNK		1024
+#define KBENCH_QIO_BYTES		(64 << 20)
+#define KBENCH_NR_LOCKS			100000
+#define KBENCH_MEM_ORDER		4		/* 64KB buffers */
+#define KBENCH_NR_MEM			1000
+#define KBENCH_NR_APIPE			(1 << 20)
+#define KBENCH_APIPE_BATCH		16
+
+bool test_kmalloc_bench(void)
+{
+	uint64_t start = nsec();
+	void *buf;
+
+	for (int i = 0; i < KBENCH_NR_OPS; i++) {
+		buf = kmalloc(64, 0);
+		KT_ASSERT_M("kmalloc failed", buf);
+		kfree(buf);
+	}
+	kbench_report("kmalloc_64", 1, KBENCH_NR_OPS, nsec() - start);
+	return true;
+}
+
+bool test_slab_bench(void)
+{
+	struct kmem_cache *kc = kmem_cache_create("kbench", 128, 8, 0, NULL,
+	                                          NULL);
+	uint64_t start = nsec();
+	void *obj;
+
+	for (int i = 0; i < KBENCH_NR_OPS; i++) {
+		obj = kmem_cache_alloc(kc, 0);
+		KT_ASSERT_M("kmem_cache_alloc failed", obj);
+		kmem_cache_free(kc, obj);
+	}
+	kbench_report("slab_128", 1, KBENCH_NR_OPS, nsec() - start);
+	kmem_cache_destroy(kc);
+	return true;
+}
+
+bool test_page_alloc_bench(void)
+{
+	uint64_t start = nsec();
+	struct page *page;
+
+	for (int i = 0; i < KBENCH_NR_OPS; i++) {
+		KT_ASSERT_M("kpage_alloc failed", !kpage_alloc(&page));
+		page_decref(page);
+	}
+	kbench_report("page_alloc", 1, KBENCH_NR_OPS, nsec() - start);
+	return true;
+}
+
+static volatile bool kbench_pong;
+
+static void __kbench_pong(uint32_t srcid, long a0, long a1, long a2)
+{
+	kbench_pong = TRUE;
+}
+
+static void __kbench_ping(uint32_t srcid, long a0, long a1, long a2)
+{
+	send_kernel_message(srcid, __kbench_pong, 0, 0, 0, KMSG_IMMEDIATE);
+}
+
+/* Immediate kmsg to another core, which sends one back. */
+bool test_kmsg_bench(void)
+{
+	int other = core_id() ? 0 : 1;
+	uint64_t start;
+
+	if (num_cores < 2) {
+		printk("%s: need 2 cores, skipping\n", __FUNCTION__);
+		return true;
+	}
+	enable_irq();
+	start = nsec();
+	for (int i = 0; i < KBENCH_NR_KMSGS; i++) {
+		kbench_pong = FALSE;
+		send_kernel_message(other, __kbench_ping, 0, 0, 0, KMSG_IMMEDIATE);
+		while (!kbench_pong)
+			cpu_relax();
+	}
+	kbench_report("kmsg_roundtrip", 2, KBENCH_NR_KMSGS, nsec() - start);
+	return true;
+}
+
+static void __kbench_alarm(struct alarm_waiter *waiter)
+{
+}
+
+bool test_alarm_bench(void)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter waiter;
+	uint64_t start;
+
+	init_awaiter(&waiter, __kbench_alarm);
+	start = nsec();
+	for (int i = 0; i < KBENCH_NR_OPS; i++) {
+		set_awaiter_rel(&waiter, 1000000000);
+		set_alarm(tchain, &waiter);
+		unset_alarm(tchain, &waiter);
+	}
+	kbench_report("alarm_set_unset", 1, KBENCH_NR_OPS, nsec() - start);
+	return true;
+}
+
+/* Bytes through a queue, a chunk in and a chunk out at a time.  ops are
+ * bytes. */
+bool test_qio_bench(void)
+{
+	struct queue *q = qopen(KBENCH_QIO_CHUNK * 16, 0, NULL, NULL);
+	char *buf = kmalloc(KBENCH_QIO_CHUNK, KMALLOC_WAIT);
+	uint64_t start;
+
+	KT_ASSERT_M("qopen failed", q);
+	memset(buf, 0xa5, KBENCH_QIO_CHUNK);
+	start = nsec();
+	for (int i = 0; i < KBENCH_QIO_BYTES / KBENCH_QIO_CHUNK; i++) {
+		qwrite(q, buf, KBENCH_QIO_CHUNK);
+		KT_ASSERT_M("Short qread",
+		            qread(q, buf, KBENCH_QIO_CHUNK) == KBENCH_QIO_CHUNK);
+	}
+	kbench_report("qio_bytes", 1, KBENCH_QIO_BYTES, nsec() - start);
+	qfree(q);
+	kfree(buf);
+	return true;
+}
+
+bool test_radix_bench(void)
+{
+	struct radix_tree tree;
+	uint64_t start;
+
+	radix_tree_init(&tree);
+	start = nsec();
+	for (unsigned long i = 0; i < KBENCH_NR_RADIX; i++)
+		KT_ASSERT_M("radix_insert failed",
+		            !radix_insert(&tree, i, (void*)(i + 1), NULL));
+	kbench_report("radix_insert", 1, KBENCH_NR_RADIX, nsec() - start);
+	start = nsec();
+	for (unsigned long i = 0; i < KBENCH_NR_RADIX; i++)
+		KT_ASSERT_M("radix_lookup failed",
+		            radix_lookup(&tree, i) == (void*)(i + 1));
+	kbench_report("radix_lookup", 1, KBENCH_NR_RADIX, nsec() - start);
+	for (unsigned long i = 0; i < KBENCH_NR_RADIX; i++)
+		radix_delete(&tree, i);
+	radix_tree_destroy(&tree);
+	return true;
+}
+
+/* ops are bytes */
+bool test_memcpy_bench(void)
+{
+	size_t sz = PGSIZE << KBENCH_MEM_ORDER;
+	void *src = get_cont_pages(KBENCH_MEM_ORDER, 0);
+	void *dst = get_cont_pages(KBENCH_MEM_ORDER, 0);
+	uint64_t start;
+
+	KT_ASSERT_M("get_cont_pages failed", src && dst);
+	memset(src, 0xa5, sz);
+	start = nsec();
+	for (int i = 0; i < KBENCH_NR_MEM; i++)
+		memcpy(dst, src, sz);
+	kbench_report("memcpy_64k", 1, (uint64_t)KBENCH_NR_MEM * sz,
+	              nsec() - start);
+	start = nsec();
+	for (int i = 0; i < KBENCH_NR_MEM; i++)
+		memcpy_nt(dst, src, sz);
+	kbench_report("memcpy_nt_64k", 1, (uint64_t)KBENCH_NR_MEM * sz,
+	              nsec() - start);
+	start = nsec();
+	for (int i = 0; i < KBENCH_NR_MEM; i++)
+		memset(dst, 0, sz);
+	kbench_report("memset_64k", 1, (uint64_t)KBENCH_NR_MEM * sz,
+	              nsec() - start);
+	start = nsec();
+	for (int i = 0; i < KBENCH_NR_MEM; i++)
+		memset_nt(dst, 0, sz);
+	kbench_report("memset_nt_64k", 1, (uint64_t)KBENCH_NR_MEM * sz,
+	              nsec() - start);
+	free_cont_pages(src, KBENCH_MEM_ORDER);
+	free_cont_pages(dst, KBENCH_MEM_ORDER);
+	return true;
+}
+
+static struct atomic_pipe kbench_apipe;
+
+static void __kbench_apipe_writer(uint32_t srcid, long a0, long a1, long a2)
+{
+	uint64_t elems[KBENCH_APIPE_BATCH] = {0};
+	size_t left = KBENCH_NR_APIPE;
+	int ret;
+
+	while (left) {
+		ret = apipe_write(&kbench_apipe, elems, MIN((size_t)a0, left));
+		if (!ret)
+			break;
+		left -= ret;
+	}
+	apipe_close_writer(&kbench_apipe);
+}
+
+/* Elements written on another core and read on this one, batch at a time.
+ * ops are elements. */
+static bool kbench_apipe(const char *name, bool spsc, size_t batch)
+{
+	uint64_t elems[KBENCH_APIPE_BATCH];
+	void *buf = kmalloc(PGSIZE, KMALLOC_WAIT);
+	uint64_t total = 0;
+	uint64_t start;
+	int ret;
+
+	if (spsc)
+		apipe_init_spsc(&kbench_apipe, buf, PGSIZE, sizeof(uint64_t));
+	else
+		apipe_init(&kbench_apipe, buf, PGSIZE, sizeof(uint64_t));
+	start = nsec();
+	send_kernel_message(core_id() ? 0 : 1, __kbench_apipe_writer, batch, 0,
+	                    0, KMSG_ROUTINE);
+	while ((ret = apipe_read(&kbench_apipe, elems, batch)) > 0)
+		total += ret;
+	kbench_report(name, 2, total, nsec() - start);
+	kfree(buf);
+	return total == KBENCH_NR_APIPE;
+}
+
+bool test_apipe_bench(void)
+{
+	if (num_cores < 2) {
+		printk("%s: need 2 cores, skipping\n", __FUNCTION__);
+		return true;
+	}
+	KT_ASSERT(kbench_apipe("apipe_1", FALSE, 1));
+	KT_ASSERT(kbench_apipe("apipe_spsc_1", TRUE, 1));
+	KT_ASSERT(kbench_apipe("apipe_16", FALSE, KBENCH_APIPE_BATCH));
+	KT_ASSERT(kbench_apipe("apipe_spsc_16", TRUE, KBENCH_APIPE_BATCH));
+	return true;
+}
+
+/* Runs func on nr_cores cores at once: this one and the first others. */
+struct kbench_mc {
+	void (*func)(void);
+	int nr_cores;
+	atomic_t nr_ready;
+	atomic_t nr_done;
+};
+
+static void kbench_mc_run(struct kbench_mc *mc)
+{
+	atomic_inc(&mc->nr_ready);
+	while (atomic_read(&mc->nr_ready) < mc->nr_cores)
+		cpu_relax();
+	mc->func();
+	atomic_inc(&mc->nr_done);
+}
+
+static void __kbench_mc_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	kbench_mc_run((struct kbench_mc*)a0);
+}
+
+static uint64_t kbench_on_cores(void (*func)(void), int nr_cores)
+{
+	struct kbench_mc mc = {.func = func, .nr_cores = nr_cores};
+	uint64_t start;
+	int sent = 1;
+
+	atomic_init(&mc.nr_ready, 0);
+	atomic_init(&mc.nr_done, 0);
+	start = nsec();
+	for (int i = 0; i < num_cores && sent < nr_cores; i++) {
+		if (i == core_id())
+			continue;
+		send_kernel_message(i, __kbench_mc_kmsg, (long)&mc, 0, 0,
+		                    KMSG_ROUTINE);
+		sent++;
+	}
+	kbench_mc_run(&mc);
+	while (atomic_read(&mc.nr_done) < nr_cores)
+		cpu_relax();
+	return nsec() - start;
+}
+
+static spinlock_t kbench_spinlock = SPINLOCK_INITIALIZER;
+static struct rwlock kbench_rwlock;
+static volatile uint64_t kbench_shared;
+
+static void __kbench_spinlock(void)
+{
+	for (int i = 0; i < KBENCH_NR_LOCKS; i++) {
+		spin_lock(&kbench_spinlock);
+		kbench_shared++;
+		spin_unlock(&kbench_spinlock);
+	}
+}
+
+static void __kbench_rlock(void)
+{
+	for (int i = 0; i < KBENCH_NR_LOCKS; i++) {
+		rlock(&kbench_rwlock);
+		runlock(&kbench_rwlock);
+	}
+}
+
+/* ops are total lock acquisitions across the cores.  We double the cores each
+ * round, ending with all of them. */
+static void kbench_contention(const char *name, void (*func)(void))
+{
+	int nr_cores = 1;
+
+	while (1) {
+		kbench_report(name, nr_cores, (uint64_t)KBENCH_NR_LOCKS * nr_cores,
+		              kbench_on_cores(func, nr_cores));
+		if (nr_cores == num_cores)
+			break;
+		nr_cores = MIN(nr_cores * 2, num_cores);
+	}
+}
+
+bool test_spinlock_bench(void)
+{
+	kbench_shared = 0;
+	kbench_contention("spinlock", __kbench_spinlock);
+	return true;
+}
+
+bool test_rwlock_bench(void)
+{
+	rwinit(&kbench_rwlock);
+	kbench_contention("rwlock_read", __kbench_rlock);
+	return true;
+}
+
+static struct ktest ktests[] = {
+	KTEST_REG(kmalloc_bench,		CONFIG_BENCH_kmalloc),
+	KTEST_REG(slab_bench,			CONFIG_BENCH_slab),
+	KTEST_REG(page_alloc_bench,		CONFIG_BENCH_page_alloc),
+	KTEST_REG(kmsg_bench,			CONFIG_BENCH_kmsg),
+	KTEST_REG(alarm_bench,			CONFIG_BENCH_alarm),
+	KTEST_REG(qio_bench,			CONFIG_BENCH_qio),
+	KTEST_REG(radix_bench,			CONFIG_BENCH_radix),
+	KTEST_REG(memcpy_bench,			CONFIG_BENCH_memcpy),
+	KTEST_REG(apipe_bench,			CONFIG_BENCH_apipe),
+	KTEST_REG(spinlock_bench,		CONFIG_BENCH_spinlock),
+	KTEST_REG(rwlock_bench,			CONFIG_BENCH_rwlock),
+};
+
+static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
+
+linker_func_1(register_kbench_ktests)
+{
+	REGISTER_KTESTS(ktests, num_ktests);
+}
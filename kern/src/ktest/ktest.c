@@ -1,6 +1,8 @@
 #include <stdbool.h>
 #include <ktest.h>
 #include <sys/queue.h>
+#include <string.h>
+#include <atomic.h>
 
 /* Global string used to report info about the last completed test */
 char ktest_msg[1024];
@@ -9,6 +11,10 @@ char ktest_msg[1024];
 SLIST_HEAD(suiteq, ktest_suite);
 static struct suiteq ktest_suiteq = SLIST_HEAD_INITIALIZER(ktest_suiteq);
 
+static char kbench_buf[KBENCH_RESULTS_SZ];
+static size_t kbench_len;
+static spinlock_t kbench_lock = SPINLOCK_INITIALIZER;
+
 void register_ktest_suite(struct ktest_suite *suite)
 {
 	SLIST_INSERT_HEAD(&ktest_suiteq, suite, link);
@@ -22,6 +28,20 @@ void run_registered_ktest_suites()
 	}
 }
 
+/* Returns FALSE if there's no suite called name. */
+bool run_named_ktest_suite(const char *name)
+{
+	struct ktest_suite *suite = NULL;
+
+	SLIST_FOREACH(suite, &ktest_suiteq, link) {
+		if (!strcmp(suite->name, name)) {
+			run_ktest_suite(suite);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 void run_ktest_suite(struct ktest_suite *suite)
 {
 	printk("<-- BEGIN_KERNEL_%s_TESTS -->\n", suite->name);
@@ -49,3 +69,41 @@ void run_ktest_suite(struct ktest_suite *suite)
 	printk("<-- END_KERNEL_%s_TESTS -->\n", suite->name);
 }
 
+void kbench_report(const char *name, int nr_cores, uint64_t nr_ops,
+                   uint64_t nsec)
+{
+	char line[160];
+	uint64_t ns_per_op_100 = nr_ops ? nsec * 100 / nr_ops : 0;
+	size_t len;
+
+	len = snprintf(line, sizeof(line), "KBENCH name=%s cores=%d ops=%llu "
+	               "ns=%llu ns_per_op=%llu.%02llu\n", name, nr_cores, nr_ops, nsec, ns_per_op_100 / 100,
+	               ns_per_op_100 % 100);
+	printk("%s", line);
+	spin_lock(&kbench_lock);
+	if (kbench_len + len < sizeof(kbench_buf)) {
+		memcpy(kbench_buf + kbench_len, line, len);
+		kbench_len += len;
+	}
+	spin_unlock(&kbench_lock);
+}
+
+/* Copies the saved reports into buf, with a trailing \0. */
+size_t kbench_results(char *buf, size_t bufsz)
+{
+	size_t len;
+
+	spin_lock(&kbench_lock);
+	len = MIN(kbench_len, bufsz - 1);
+	memcpy(buf, kbench_buf, len);
+	spin_unlock(&kbench_lock);
+	buf[len] = 0;
+	return len;
+}
+
+void kbench_clear_results(void)
+{
+	spin_lock(&kbench_lock);
+	kbench_len = 0;
+	spin_unlock(&kbench_lock);
+}
@@ -1,6 +1,7 @@
 #include <ip.h>
 #include <ktest.h>
 #include <linker_func.h>
+#include <time.h>
 
 KTEST_SUITE("NET")
 
@@ -44,6 +45,32 @@ bool test_ptclbsum(void)
 	return true;
 }
 
+/* ptclbsum() sums large buffers with wider loops than ptclbsum_scalar().  Long
+ * runs of 0xff make the carries back up, so test those too. */
+bool test_ptclbsum_wide(void)
+{
+	uint16_t csum, expected;
+	uint8_t buf[2100];
+	int i, off, len, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = pass ? 0xff : (i * 7 + (i >> 8)) & 0xff;
+		for (off = 0; off < 16; off++) {
+			for (len = 0; len <= sizeof(buf) - off; len++) {
+				csum = ptclbsum(buf + off, len);
+				expected = ptclbsum_scalar(buf + off, len);
+				if (csum != expected) {
+					printk("pass %d off %d len %d csum %04x expected %04x\n",
+					       pass, off, len, csum, expected);
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
 #define CSUM_BENCH_BUFSIZE 4000
 
 bool test_simplesum_bench(void)
@@ -80,10 +107,215 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+bool test_ptclbsum_scalar_bench(void)
+{
+	uint8_t buf[CSUM_BENCH_BUFSIZE];
+	uint16_t csum = 0;
+	int i, j, len;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i & 0xff;
+	for (i = 0; i < sizeof(buf); i++) {
+		for (j = i; j < sizeof(buf); j++) {
+			len = j - i + 1;
+			csum += ptclbsum_scalar(buf + i, len);
+		}
+	}
+	return true;
+}
+
+#define IPHT_NCONV 1000
+
+/* Fills a conv hash past a couple of resizes, then checks that every
+ * connection and the listener are found, and that removed ones aren't. */
+bool test_ipht(void)
+{
+	struct Ipht *ht;
+	struct conv *convs, *c, listener;
+	uint8_t laddr[IPaddrlen] = {[10] = 0xff, [11] = 0xff, 10, 0, 0, 1};
+	int i;
+
+	ht = kzmalloc(sizeof(struct Ipht), KMALLOC_WAIT);
+	convs = kzmalloc(IPHT_NCONV * sizeof(struct conv), KMALLOC_WAIT);
+	KT_ASSERT(ht && convs);
+	iphtinit(ht);
+
+	memset(&listener, 0, sizeof(listener));
+	ipmove(listener.laddr, laddr);
+	listener.lport = 80;
+	iphtadd(ht, &listener);
+	for (i = 0; i < IPHT_NCONV; i++) {
+		c = &convs[i];
+		ipmove(c->laddr, laddr);
+		ipmove(c->raddr, laddr);
+		c->raddr[14] = i >> 8;
+		c->raddr[15] = i;
+		c->rport = 1024 + i;
+		c->lport = 80;
+		iphtadd(ht, c);
+	}
+	KT_ASSERT_M("conns table should have grown",
+	            ht->conns->mask + 1 >= IPHT_NCONV);
+	for (i = 0; i < IPHT_NCONV; i++) {
+		c = &convs[i];
+		KT_ASSERT(iphtlookconn(ht, c->raddr, c->rport, laddr, 80) == c);
+		KT_ASSERT(iphtlook(ht, c->raddr, c->rport + 1, laddr, 80) ==
+		          &listener);
+	}
+	for (i = 0; i < IPHT_NCONV; i += 2)
+		iphtrem(ht, &convs[i]);
+	for (i = 0; i < IPHT_NCONV; i++) {
+		c = &convs[i];
+		KT_ASSERT(iphtlookconn(ht, c->raddr, c->rport, laddr, 80) ==
+		          (i % 2 ? c : NULL));
+	}
+	for (i = 1; i < IPHT_NCONV; i += 2)
+		iphtrem(ht, &convs[i]);
+	iphtrem(ht, &listener);
+	KT_ASSERT(ht->nconns == 0);
+	KT_ASSERT(iphtlook(ht, laddr, 1, laddr, 80) == NULL);
+
+	/* the entries go after a grace period; they don't touch the convs */
+	synchronize_rcu();
+	kfree(ht->conns);
+	kfree(ht);
+	kfree(convs);
+	return true;
+}
+
+#define IPHT_NLISTENERS 4
+
+/* Listeners sharing a port with reuseport: each flow keeps going to the same
+ * one, and all of them get some flows. */
+bool test_ipht_reuseport(void)
+{
+	struct Ipht *ht;
+	struct conv listeners[IPHT_NLISTENERS], *c;
+	int hits[IPHT_NLISTENERS] = {0};
+	uint8_t laddr[IPaddrlen] = {[10] = 0xff, [11] = 0xff, 10, 0, 0, 1};
+	uint8_t raddr[IPaddrlen];
+	int i, j;
+
+	ht = kzmalloc(sizeof(struct Ipht), KMALLOC_WAIT);
+	KT_ASSERT(ht);
+	iphtinit(ht);
+	memset(listeners, 0, sizeof(listeners));
+	for (i = 0; i < IPHT_NLISTENERS; i++) {
+		listeners[i].lport = 80;
+		listeners[i].reuseport = TRUE;
+		iphtadd(ht, &listeners[i]);
+	}
+	ipmove(raddr, laddr);
+	for (i = 0; i < 256; i++) {
+		raddr[15] = i;
+		c = iphtlook(ht, raddr, 1024 + i, laddr, 80);
+		KT_ASSERT(c >= listeners && c < listeners + IPHT_NLISTENERS);
+		KT_ASSERT_M("a flow should stick to one listener",
+		            iphtlook(ht, raddr, 1024 + i, laddr, 80) == c);
+		hits[c - listeners]++;
+	}
+	for (j = 0; j < IPHT_NLISTENERS; j++)
+		KT_ASSERT_M("every listener should get flows", hits[j] > 0);
+	for (i = 0; i < IPHT_NLISTENERS; i++)
+		iphtrem(ht, &listeners[i]);
+
+	synchronize_rcu();
+	kfree(ht->conns);
+	kfree(ht);
+	return true;
+}
+
+#define RTRIE_NROUTES 20000
+#define RTRIE_NCHECKS 1000
+#define RTRIE_NLOOKUPS 1000000
+
+static uint32_t rtrie_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed;
+}
+
+/* Longest match the slow way, over every route */
+static struct route *rtrie_slow(struct route **r, int n, uint32_t a)
+{
+	struct route *best = NULL;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (a < r[i]->v4.address || a > r[i]->v4.endaddress)
+			continue;
+		if (best == NULL || r[i]->v4.endaddress - r[i]->v4.address <
+		                    best->v4.endaddress - best->v4.address)
+			best = r[i];
+	}
+	return best;
+}
+
+/* Builds a trie over lots of v4 prefixes, checks it against a linear scan,
+ * and reports lookups per second. */
+bool test_rtrie(void)
+{
+	struct route **r, *q, *want;
+	struct rtrie *t;
+	uint8_t a[IPv4addrlen];
+	uint32_t seed = 1, m, x;
+	uint64_t start, ns;
+	int i, plen;
+
+	r = kzmalloc(RTRIE_NROUTES * sizeof(struct route *), KMALLOC_WAIT);
+	KT_ASSERT(r);
+	for (i = 0; i < RTRIE_NROUTES; i++) {
+		r[i] = kzmalloc(sizeof(struct route), KMALLOC_WAIT);
+		KT_ASSERT(r[i]);
+		/* mostly /24s out of a few /8s, like a VPN's routes */
+		plen = i == 0 ? 0 : 8 + rtrie_rand(&seed) % 25;
+		m = plen ? ~0U << (32 - plen) : 0;
+		x = (10 + rtrie_rand(&seed) % 4) << 24 | (rtrie_rand(&seed) & 0xffffff);
+		r[i]->rt.type = Rv4;
+		r[i]->v4.address = x & m;
+		r[i]->v4.endaddress = (x & m) | ~m;
+	}
+	t = rtriebuild(r, RTRIE_NROUTES, IPv4addrlen);
+	KT_ASSERT_M("every route is a prefix", t);
+
+	for (i = 0; i < RTRIE_NCHECKS; i++) {
+		x = (10 + rtrie_rand(&seed) % 5) << 24 | (rtrie_rand(&seed) & 0xffffff);
+		/* aim for a route's range half the time */
+		if (i & 1)
+			x = r[rtrie_rand(&seed) % RTRIE_NROUTES]->v4.address;
+		hnputl(a, x);
+		q = rtrielookup(t, a);
+		want = rtrie_slow(r, RTRIE_NROUTES, x);
+		KT_ASSERT_M("trie should find the longest match", q && want &&
+		            q->v4.address == want->v4.address &&
+		            q->v4.endaddress == want->v4.endaddress);
+	}
+
+	start = nsec();
+	for (i = 0; i < RTRIE_NLOOKUPS; i++) {
+		hnputl(a, (10 + (i & 3)) << 24 | (rtrie_rand(&seed) & 0xffffff));
+		q = rtrielookup(t, a);
+	}
+	ns = MAX(nsec() - start, 1);
+	printk("rtrie: %d routes, %llu lookups/sec\n", RTRIE_NROUTES,
+	       (uint64_t)RTRIE_NLOOKUPS * 1000000000 / ns);
+
+	rtriefree(t);
+	for (i = 0; i < RTRIE_NROUTES; i++)
+		kfree(r[i]);
+	kfree(r);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
+	KTEST_REG(ptclbsum_wide,		CONFIG_TEST_ptclbsum_wide),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ptclbsum_scalar_bench,	CONFIG_TEST_ptclbsum_scalar_bench),
+	KTEST_REG(ipht,					CONFIG_TEST_ipht),
+	KTEST_REG(ipht_reuseport,		CONFIG_TEST_ipht_reuseport),
+	KTEST_REG(rtrie,				CONFIG_TEST_rtrie),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
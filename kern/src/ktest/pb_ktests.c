@@ -33,8 +33,10 @@
 #include <slab.h>
 #include <kmalloc.h>
 #include <hashtable.h>
+#include <rhashtable.h>
 #include <radix.h>
 #include <circular_buffer.h>
+#include <pcpu_cbuf.h>
 #include <monitor.h>
 #include <kthread.h>
 #include <schedule.h>
@@ -46,7 +48,10 @@
 
 #include <apipe.h>
 #include <rwlock.h>
+#include <mcs_lock.h>
+#include <lockstat.h>
 #include <rendez.h>
+#include <rcu.h>
 #include <ktest.h>
 #include <smallidpool.h>
 #include <linker_func.h>
@@ -702,6 +707,40 @@ bool test_kernel_messages(void)
 	return true;
 }
 #endif // CONFIG_X86
+
+#define KMSG_ORDER_NR 1000
+static long kmsg_order_seen[KMSG_ORDER_NR];
+static atomic_t kmsg_order_idx;
+
+static void __test_kmsg_order(uint32_t srcid, long a0, long a1, long a2)
+{
+	kmsg_order_seen[atomic_fetch_and_add(&kmsg_order_idx, 1)] = a0;
+}
+
+/* Kmsgs from one core to another run in the order they were sent, even though
+ * the queues are LIFO stacks under the hood. */
+bool test_kmsg_order(void)
+{
+	unsigned long avoided = per_cpu_info[core_id()].nr_kmsg_ipis_avoided;
+	int type;
+
+	if (num_cores < 2)
+		return true;
+	for (int pass = 0; pass < 2; pass++) {
+		type = pass ? KMSG_IMMEDIATE : KMSG_ROUTINE;
+		atomic_init(&kmsg_order_idx, 0);
+		for (int i = 0; i < KMSG_ORDER_NR; i++)
+			send_kernel_message(1, __test_kmsg_order, i, 0, 0, type);
+		while (atomic_read(&kmsg_order_idx) != KMSG_ORDER_NR)
+			cpu_relax();
+		for (int i = 0; i < KMSG_ORDER_NR; i++)
+			KT_ASSERT_M("Kmsgs ran out of order", kmsg_order_seen[i] == i);
+	}
+	/* Not guaranteed, but with back-to-back sends, core 1 can't keep up */
+	if (per_cpu_info[core_id()].nr_kmsg_ipis_avoided == avoided)
+		printk("No kmsg IPIs avoided, core 1 was fast\n");
+	return true;
+}
 static void test_single_cache(int iters, size_t size, int align, int flags,
                               void (*ctor)(void *, size_t),
                               void (*dtor)(void *, size_t))
@@ -741,6 +780,142 @@ bool test_slab(void)
 	return true;
 }
 
+bool test_slab_magazines(void)
+{
+	struct kmem_cache *test_cache;
+	/* Enough to spill past both of a core's magazines into the depot */
+	const int nr_objs = KMC_MAG_SZ * 6;
+	void *objs[nr_objs];
+	void *obj;
+
+	test_cache = kmem_cache_create("test_mag_cache", 64, 8, 0, NULL, NULL);
+	KT_ASSERT_M("Cache should have per-core magazines",
+	            test_cache->pcpu_caches);
+	for (int i = 0; i < nr_objs; i++)
+		objs[i] = kmem_cache_alloc(test_cache, 0);
+	KT_ASSERT_M("Slab layer should see every object",
+	            test_cache->nr_cur_alloc == nr_objs);
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(test_cache, objs[i]);
+	KT_ASSERT_M("Magazined objects should still count as allocated",
+	            test_cache->nr_cur_alloc == nr_objs);
+	KT_ASSERT_M("Extra full magazines should be in the depot",
+	            test_cache->depot.nr_full);
+	/* The last freed object is on top of the loaded magazine */
+	obj = kmem_cache_alloc(test_cache, 0);
+	KT_ASSERT_M("Magazine should be LIFO", obj == objs[nr_objs - 1]);
+	kmem_cache_free(test_cache, obj);
+	/* First reap ends the working set interval; the second one frees the
+	 * magazines that went unused during it. */
+	kmem_cache_reap(test_cache);
+	kmem_cache_reap(test_cache);
+	KT_ASSERT_M("Reap should empty an idle depot",
+	            !test_cache->depot.nr_full && !test_cache->depot.nr_empty);
+	KT_ASSERT_M("Only the core's magazines should hold objects",
+	            test_cache->nr_cur_alloc <= 2 * KMC_MAG_SZ);
+	kmem_cache_destroy(test_cache);
+	return true;
+}
+
+bool test_slab_large_objs(void)
+{
+	struct kmem_cache *test_cache;
+	/* Enough to outgrow the static hash table */
+	const int nr_objs = KMC_HASH_INIT_SZ * KMC_HASH_LOAD * 4;
+	void *objs[nr_objs];
+
+	test_cache = kmem_cache_create("test_large_cache", 1024, 1024, KMC_NOMAG,
+	                               NULL, NULL);
+	for (int i = 0; i < nr_objs; i++) {
+		objs[i] = kmem_cache_alloc(test_cache, 0);
+		KT_ASSERT_M("Large object should be aligned", ALIGNED(objs[i], 1024));
+	}
+	KT_ASSERT_M("Every object should be in the hash",
+	            test_cache->hh_nr_items == nr_objs);
+	KT_ASSERT_M("Hash should have grown",
+	            test_cache->alloc_hash != test_cache->static_hash);
+	/* Objects are exactly sized, so a slab's 8 objects fit in two pages */
+	for (int i = 1; i < NUM_BUF_PER_SLAB; i++)
+		KT_ASSERT_M("Large objects should be packed",
+		            objs[i - 1] - objs[i] == 1024 ||
+		            objs[i] - objs[i - 1] == 1024);
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(test_cache, objs[i]);
+	KT_ASSERT_M("Hash should be empty", !test_cache->hh_nr_items);
+	kmem_cache_destroy(test_cache);
+	return true;
+}
+
+bool test_slab_huge(void)
+{
+	struct kmem_cache *test_cache;
+	/* A few small slabs' worth */
+	const int nr_objs = 4 * PGSIZE / 64;
+	void *objs[nr_objs];
+	uintptr_t chunks[2] = {0};
+
+	test_cache = kmem_cache_create("test_huge_cache", 56, 8,
+	                               KMC_HUGE | KMC_NOMAG, NULL, NULL);
+	for (int i = 0; i < nr_objs; i++)
+		objs[i] = kmem_cache_alloc(test_cache, 0);
+	/* The slabs are carved from one chunk, unless we used up its end */
+	for (int i = 0; i < nr_objs; i++) {
+		uintptr_t chunk = ROUNDDOWN((uintptr_t)objs[i], PTSIZE);
+
+		if (!chunks[0] || chunks[0] == chunk)
+			chunks[0] = chunk;
+		else if (!chunks[1] || chunks[1] == chunk)
+			chunks[1] = chunk;
+		else
+			KT_ASSERT_M("Huge slabs should come from 2MB chunks", FALSE);
+	}
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(test_cache, objs[i]);
+	kmem_cache_destroy(test_cache);
+	return true;
+}
+
+bool test_page_numa(void)
+{
+	struct page_node_stats stats;
+	void *buf;
+
+	for (int i = 0; i < nr_page_nodes; i++) {
+		page_alloc_get_node_stats(i, &stats);
+		buf = get_cont_pages_node(i, 2, 0);
+		KT_ASSERT_M("Should get contiguous pages", buf);
+		/* The node could have run out between the check and the alloc, but
+		 * not if it has plenty of pages. */
+		if (stats.nr_free_pages > 1024)
+			KT_ASSERT_M("Pages should come from the requested node",
+			            paddr_to_numa_id(PADDR(buf)) == i);
+		free_cont_pages(buf, 2);
+	}
+	if (nr_page_nodes > 1)
+		KT_ASSERT_M("Should have a NUMA id", numa_id() < nr_page_nodes);
+	return true;
+}
+
+bool test_page_pcpu(void)
+{
+	struct page *a_page, *b_page;
+	int8_t irq_state = 0;
+
+	/* Keep IRQ handlers from using our core's cache in between */
+	disable_irqsave(&irq_state);
+	KT_ASSERT_M("Should get a page", !kpage_alloc(&a_page));
+	page_decref(a_page);
+	KT_ASSERT_M("A cached page shouldn't look free",
+	            !page_is_free(page2ppn(a_page)));
+	KT_ASSERT_M("Should get a page", !kpage_alloc(&b_page));
+	KT_ASSERT_M("Should get the hot page back", a_page == b_page);
+	KT_ASSERT_M("Page should have one ref",
+	            kref_refcnt(&b_page->pg_kref) == 1);
+	page_decref(b_page);
+	enable_irqsave(&irq_state);
+	return true;
+}
+
 // TODO: Add assertions.
 bool test_kmalloc(void)
 {
@@ -748,7 +923,10 @@ bool test_kmalloc(void)
 	void *bufs[NUM_KMALLOC_CACHES + 1];	
 	size_t size;
 	for (int i = 0; i < NUM_KMALLOC_CACHES + 1; i++){
-		size = (KMALLOC_SMALLEST << i) - sizeof(struct kmalloc_tag);
+		if (i < NUM_KMALLOC_CACHES)
+			size = kmalloc_class_size(i) - sizeof(struct kmalloc_tag);
+		else
+			size = (KMALLOC_LARGEST << 1) - sizeof(struct kmalloc_tag);
 		bufs[i] = kmalloc(size, 0);
 		printk("Size %d, Addr = %p\n", size, bufs[i]);
 	}
@@ -880,6 +1058,74 @@ bool test_hashtable(void)
 	return true;
 }
 
+struct rht_test_item {
+	unsigned long				key;
+};
+
+/* Few hash values, so we get lots of collisions and long probes */
+static size_t rht_test_key_hash(unsigned long key)
+{
+	return key % 7;
+}
+
+static size_t rht_test_hash(struct rht_test_item *item)
+{
+	return rht_test_key_hash(item->key);
+}
+
+static bool rht_test_eq(struct rht_test_item *item, unsigned long key)
+{
+	return item->key == key;
+}
+
+DEFINE_RHASHTABLE(rht_test, struct rht_test_item, unsigned long, rht_test_hash,
+                  rht_test_key_hash, rht_test_eq);
+
+bool test_rhashtable(void)
+{
+	#define NR_RHT_TEST_ITEMS 1000
+	struct rht_test_item *items;
+	struct rhashtable ht;
+
+	items = kmalloc(sizeof(struct rht_test_item) * NR_RHT_TEST_ITEMS,
+	                KMALLOC_WAIT);
+	rhashtable_init(&ht, 0);
+	/* Enough to force several resizes, some of them while migrating */
+	for (int i = 0; i < NR_RHT_TEST_ITEMS; i++) {
+		items[i].key = i;
+		KT_ASSERT_M("Inserting into an rhashtable should work",
+		            !rht_test_insert(&ht, &items[i]));
+		KT_ASSERT_M("The first item should still be there",
+		            rht_test_lookup(&ht, 0) == &items[0]);
+	}
+	for (int i = 0; i < NR_RHT_TEST_ITEMS; i++)
+		KT_ASSERT_M("Every item should be found",
+		            rht_test_lookup(&ht, i) == &items[i]);
+	KT_ASSERT_M("Missing keys should not be found",
+	            !rht_test_lookup(&ht, NR_RHT_TEST_ITEMS));
+	/* Remove the evens, leaving tombstones between the odds */
+	for (int i = 0; i < NR_RHT_TEST_ITEMS; i += 2)
+		KT_ASSERT_M("Removing should return the item",
+		            rht_test_remove(&ht, i) == &items[i]);
+	for (int i = 0; i < NR_RHT_TEST_ITEMS; i++)
+		KT_ASSERT_M("Only the odd items should be left",
+		            (rht_test_lookup(&ht, i) == &items[i]) == (i % 2));
+	KT_ASSERT_M("The count should be half the items",
+	            ht.nr_items == NR_RHT_TEST_ITEMS / 2);
+	/* Reinserting reuses tombstones or triggers a same-size rehash */
+	for (int i = 0; i < NR_RHT_TEST_ITEMS; i += 2)
+		KT_ASSERT_M("Reinserting should work",
+		            !rht_test_insert(&ht, &items[i]));
+	for (int i = 0; i < NR_RHT_TEST_ITEMS; i++)
+		KT_ASSERT_M("Every item should be back",
+		            rht_test_lookup(&ht, i) == &items[i]);
+	/* The old tables are freed by RCU callbacks */
+	synchronize_rcu();
+	rhashtable_destroy(&ht);
+	kfree(items);
+	return true;
+}
+
 bool test_circular_buffer(void)
 {
 	static const size_t cbsize = 4096;
@@ -957,6 +1203,65 @@ bool test_circular_buffer(void)
 	return TRUE;
 }
 
+bool test_pcpu_cbuf(void)
+{
+	static const size_t cbsize = 4096;
+	struct pcpu_cbuf cb;
+	struct pcpu_cbuf_cursor c1, c2;
+	uint64_t seq, last_tsc, tsc;
+	ssize_t ret;
+	size_t nr;
+	int cpu;
+
+	KT_ASSERT_M("Failed to build the pcpu circular buffer",
+	            pcpu_cbuf_init(&cb, cbsize));
+	KT_ASSERT(pcpu_cbuf_cursor_init(&cb, &c1, FALSE));
+	for (seq = 0; seq < 64; seq++)
+		KT_ASSERT_M("pcpu cbuf write failed",
+		            pcpu_cbuf_write(&cb, &seq, sizeof(seq)) == sizeof(seq));
+	/* A second reader, starting now, sees only later records */
+	KT_ASSERT(pcpu_cbuf_cursor_init(&cb, &c2, TRUE));
+	for (uint64_t i = 64; i < 96; i++)
+		pcpu_cbuf_write(&cb, &i, sizeof(i));
+
+	last_tsc = 0;
+	for (nr = 0; nr < 96; nr++) {
+		ret = pcpu_cbuf_read(&cb, &c1, &seq, sizeof(seq), &cpu, &tsc);
+		KT_ASSERT_M("Missing pcpu cbuf record", ret == sizeof(seq));
+		KT_ASSERT_M("Records should be in order", seq == nr);
+		KT_ASSERT_M("Timestamps should be ascending", tsc >= last_tsc);
+		last_tsc = tsc;
+	}
+	KT_ASSERT(pcpu_cbuf_read(&cb, &c1, &seq, sizeof(seq), NULL, NULL) < 0);
+	KT_ASSERT_M("Nothing should be lost", c1.lost_bytes == 0);
+	for (nr = 64; nr < 96; nr++) {
+		ret = pcpu_cbuf_read(&cb, &c2, &seq, sizeof(seq), NULL, NULL);
+		KT_ASSERT_M("Second reader missed a record",
+		            ret == sizeof(seq) && seq == nr);
+	}
+	KT_ASSERT(pcpu_cbuf_read(&cb, &c2, &seq, sizeof(seq), NULL, NULL) < 0);
+
+	/* Lap c2: it skips to the oldest record and counts what it missed */
+	for (uint64_t i = 96; i < 96 + cbsize; i++)
+		pcpu_cbuf_write(&cb, &i, sizeof(i));
+	ret = pcpu_cbuf_read(&cb, &c2, &seq, sizeof(seq), NULL, NULL);
+	KT_ASSERT_M("Overrun reader should resync", ret == sizeof(seq));
+	KT_ASSERT_M("Overrun reader should count lost bytes", c2.lost_bytes);
+	while ((ret = pcpu_cbuf_read(&cb, &c2, &nr, sizeof(nr), NULL, NULL)) > 0) {
+		KT_ASSERT_M("Records should be in order", nr == seq + 1);
+		seq = nr;
+	}
+	KT_ASSERT_M("Should end at the newest record", seq == 96 + cbsize - 1);
+
+	KT_ASSERT_M("Oversized write should fail",
+	            !pcpu_cbuf_write(&cb, &seq, cbsize));
+	pcpu_cbuf_cursor_destroy(&c1);
+	pcpu_cbuf_cursor_destroy(&c2);
+	pcpu_cbuf_destroy(&cb);
+
+	return TRUE;
+}
+
 /* Ghetto test, only tests one prod or consumer at a time */
 // TODO: Un-guetto test, add assertions.
 bool test_bcq(void)
@@ -1100,6 +1405,8 @@ bool test_ucq(void)
 			send_ucq_msg(ucq, p, &msg);
 		}
 		printk("nr_pages: %d\n", atomic_read(&ucq->nr_extra_pgs));
+		printk("pg swaps: %d, mmaps: %d\n", atomic_read(&ucq->nr_pg_swaps),
+		       atomic_read(&ucq->nr_pg_mmaps));
 		/* other things we could do:
 		 *  - concurrent producers / consumers...  ugh.
 		 *  - would require a kmsg to another core, instead of a local alarm
@@ -1155,6 +1462,8 @@ bool test_vm_regions(void)
 	struct proc pr, *p = &pr;	/* too lazy to even create one */
 	int n = 0;
 	TAILQ_INIT(&p->vm_regions);
+	RB_INIT(&p->vm_tree);
+	p->vmr_hint = 0;
 
 	struct vmr_summary {
 		uintptr_t base; 
@@ -1258,8 +1567,13 @@ bool test_vm_regions(void)
 	merge_vmr(vmrs[0], vmrs[2]);
 	results[0].end = 0x9000;
 	check_vmrs(p, results, 1, n++);
+	/* the lookup hint pointed at the merged-away vmr */
+	KT_ASSERT_M("We should find the merged vmr",
+	            (vmrs[0] == find_vmr(p, 0x8500)));
 	destroy_vmr(vmrs[0]);
 	check_vmrs(p, results, 0, n++);
+	KT_ASSERT_M("We shouldn't be able to find a vmr",
+	            !find_vmr(p, 0x2500) && !find_first_vmr(p, 0x1000));
 	/* Check the automerge function */
 	vmrs[0] = create_vmr(p, 0x2000, 0x1000);
 	vmrs[1] = create_vmr(p, 0x3000, 0x1000);
@@ -1295,6 +1609,7 @@ bool test_radix_tree(void)
 	struct radix_tree real_tree = RADIX_INITIALIZER;
 	struct radix_tree *tree = &real_tree;
 	void *retval;
+	void *gang[8];
 
 	KT_ASSERT_M("It should be possible to insert at 0", 
 	            !radix_insert(tree, 0, (void*)0xdeadbeef, 0));
@@ -1321,6 +1636,14 @@ bool test_radix_tree(void)
 	            !radix_insert(tree, 4095, (void*)0x4095, 0));
 	KT_ASSERT_M("It should be possible to insert a three-tier", 
 	            !radix_insert(tree, 4096, (void*)0x4096, 0));
+	KT_ASSERT_M("Gang lookup should find the items in key order",
+	            (radix_gang_lookup(tree, gang, 4, 8) == 4) &&
+	            (gang[0] == (void*)0x04040404) &&
+	            (gang[1] == (void*)0xcafebabe) &&
+	            (gang[2] == (void*)0x4095) && (gang[3] == (void*)0x4096));
+	KT_ASSERT_M("Gang lookup should stop at max_items",
+	            (radix_gang_lookup(tree, gang, 0, 2) == 2) &&
+	            (gang[0] == (void*)0xdeadbeef));
 	//print_radix_tree(tree);
 	radix_delete(tree, 65);
 	radix_delete(tree, 3);
@@ -1329,6 +1652,43 @@ bool test_radix_tree(void)
 	radix_delete(tree, 4096);
 	//print_radix_tree(tree);
 
+	/* Lockless trees keep their nodes, but should otherwise act the same */
+	radix_tree_init_lockless(tree);
+	for (int i = 0; i < 5000; i += 7)
+		KT_ASSERT(!radix_insert(tree, i, (void*)(long)(i + 1), 0));
+	for (int i = 0; i < 5000; i += 7)
+		KT_ASSERT(radix_delete(tree, i) == (void*)(long)(i + 1));
+	KT_ASSERT_M("A lockless tree should be empty after deleting",
+	            !radix_lookup(tree, 4095) && !radix_gang_lookup(tree, gang, 0, 8));
+	KT_ASSERT_M("It should be possible to reuse a lockless tree's nodes",
+	            !radix_insert(tree, 4095, (void*)0x4095, 0) &&
+	            (radix_lookup(tree, 4095) == (void*)0x4095));
+	radix_delete(tree, 4095);
+
+	/* Tags survive the tree growing, and tagged lookups skip untagged items */
+	for (int i = 0; i < 300; i++)
+		radix_insert(tree, i, (void*)(long)(i + 1), 0);
+	radix_tag_set(tree, 5, 0);
+	radix_tag_set(tree, 200, 0);
+	radix_insert(tree, 5000, (void*)5001, 0);
+	radix_tag_set(tree, 5000, 0);
+	KT_ASSERT_M("Tagged items should be tagged, and only for their tag",
+	            radix_tag_get(tree, 5, 0) && radix_tag_get(tree, 200, 0) &&
+	            !radix_tag_get(tree, 6, 0) && !radix_tag_get(tree, 5, 1) &&
+	            radix_tree_tagged(tree, 0) && !radix_tree_tagged(tree, 1));
+	KT_ASSERT_M("Tagged gang lookup should find just the tagged items",
+	            (radix_tag_gang_lookup(tree, gang, 6, 8, 0) == 2) &&
+	            (gang[0] == (void*)201) && (gang[1] == (void*)5001));
+	radix_tag_clear(tree, 200, 0);
+	radix_delete(tree, 5000);
+	KT_ASSERT_M("Clearing and deleting should untag items",
+	            (radix_tag_gang_lookup(tree, gang, 0, 8, 0) == 1) &&
+	            (gang[0] == (void*)6));
+	radix_tag_clear(tree, 5, 0);
+	KT_ASSERT_M("The tree should be untagged", !radix_tree_tagged(tree, 0));
+	for (int i = 0; i < 300; i++)
+		radix_delete(tree, i);
+
 	return true;
 }
 
@@ -1532,6 +1892,88 @@ bool test_atomics(void)
 	return true;
 }
 
+static struct mcs_lock test_mcs = MCS_LOCK_INIT;
+static unsigned long test_mcs_count;
+static atomic_t test_mcs_cores_left;
+
+static void __test_mcs_lock(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct mcs_lock_qnode qn;
+
+	for (int i = 0; i < 100000; i++) {
+		if (i & 1) {
+			mcs_lock_irqsave(&test_mcs, &qn);
+			test_mcs_count++;
+			mcs_unlock_irqsave(&test_mcs, &qn);
+		} else {
+			mcs_lock_lock(&test_mcs, &qn);
+			test_mcs_count++;
+			mcs_lock_unlock(&test_mcs, &qn);
+		}
+	}
+	atomic_dec(&test_mcs_cores_left);
+}
+
+bool test_mcs_lock(void)
+{
+	struct mcs_lock_qnode qn, qn2;
+	bool irq_was_on;
+
+	mcs_lock_lock(&test_mcs, &qn);
+	KT_ASSERT(mcs_lock_locked(&test_mcs));
+	KT_ASSERT_M("Trylock succeeded on a held lock",
+	            !mcs_lock_trylock(&test_mcs, &qn2));
+	mcs_lock_unlock(&test_mcs, &qn);
+	KT_ASSERT(!mcs_lock_locked(&test_mcs));
+	KT_ASSERT(mcs_lock_trylock(&test_mcs, &qn2));
+	mcs_lock_unlock(&test_mcs, &qn2);
+
+	irq_was_on = irq_is_enabled();
+	mcs_lock_irqsave(&test_mcs, &qn);
+	KT_ASSERT(!irq_is_enabled());
+	mcs_unlock_irqsave(&test_mcs, &qn);
+	KT_ASSERT_M("Irqsave unlock didn't restore IRQs",
+	            irq_is_enabled() == irq_was_on);
+
+	test_mcs_count = 0;
+	atomic_init(&test_mcs_cores_left, num_cores - 1);
+	for (int i = 1; i < num_cores; i++)
+		send_kernel_message(i, __test_mcs_lock, 0, 0, 0, KMSG_ROUTINE);
+	while (atomic_read(&test_mcs_cores_left))
+		cpu_relax();
+	KT_ASSERT_M("MCS lock lost an increment",
+	            test_mcs_count == 100000 * (num_cores - 1));
+	return true;
+}
+
+bool test_lockstat(void)
+{
+#ifdef CONFIG_LOCK_STATS
+	spinlock_t lock = SPINLOCK_INITIALIZER;
+	struct lockstat_site *sites;
+	size_t nr_sites;
+	bool found = FALSE;
+
+	lockstat_enable(TRUE);
+	for (int i = 0; i < 10; i++) {
+		spin_lock(&lock);
+		spin_unlock(&lock);
+	}
+	lockstat_enable(FALSE);
+	nr_sites = lockstat_snapshot(&sites);
+	for (int i = 0; i < nr_sites; i++) {
+		if (sites[i].lock != (uintptr_t)&lock)
+			continue;
+		found = TRUE;
+		KT_ASSERT(sites[i].nr_acquires >= 10);
+		KT_ASSERT(!sites[i].nr_contended);
+	}
+	kfree(sites);
+	KT_ASSERT_M("Lockstat didn't record our lock", found);
+#endif
+	return true;
+}
+
 /* Helper KMSG for test_abort.  Core 1 does this, while core 0 sends an IRQ. */
 static void __test_try_halt(uint32_t srcid, long a0, long a1, long a2)
 {
@@ -1905,6 +2347,74 @@ bool test_rwlock(void)
 	return true;
 }
 
+static struct brwlock brwlock, *brwl = &brwlock;
+static atomic_t brwlock_counter;
+static unsigned long brwlock_shared[2];
+
+bool test_brwlock(void)
+{
+	bool ret;
+
+	brwinit(brwl);
+	/* Recursive readers, like the rwlock */
+	brlock(brwl);
+	ret = canbrlock(brwl);
+	KT_ASSERT(ret);
+	brunlock(brwl);
+	brunlock(brwl);
+	bwlock(brwl);
+	ret = canbrlock(brwl);
+	KT_ASSERT_M("Got a read lock while a writer held it", !ret);
+	bwunlock(brwl);
+
+	/* Writers keep both words equal; readers check they never see a torn
+	 * update.  The readers also block, so they unlock on other cores. */
+	void __test_brwlock(uint32_t srcid, long a0, long a1, long a2)
+	{
+		int rand = read_tsc() & 0xff;
+
+		for (int i = 0; i < 10000; i++) {
+			switch ((rand * i) % 5) {
+			case 0:
+			case 1:
+				brlock(brwl);
+				if (ACCESS_ONCE(brwlock_shared[0]) !=
+				    ACCESS_ONCE(brwlock_shared[1]))
+					panic("brwlock reader saw a writer!");
+				if (!(i % 256))
+					kthread_yield();
+				brunlock(brwl);
+				break;
+			case 2:
+			case 3:
+				if (canbrlock(brwl))
+					brunlock(brwl);
+				break;
+			case 4:
+				bwlock(brwl);
+				ACCESS_ONCE(brwlock_shared[0]) = brwlock_shared[0] + 1;
+				cpu_relax();
+				ACCESS_ONCE(brwlock_shared[1]) = brwlock_shared[1] + 1;
+				bwunlock(brwl);
+				break;
+			}
+		}
+		atomic_dec(&brwlock_counter);
+	}
+
+	atomic_init(&brwlock_counter, (num_cores - 1) * 4);
+	for (int i = 1; i < num_cores; i++)
+		for (int j = 0; j < 4; j++)
+			send_kernel_message(i, __test_brwlock, 0, 0, 0, KMSG_ROUTINE);
+	while (atomic_read(&brwlock_counter))
+		cpu_relax();
+	KT_ASSERT(brwlock_shared[0] == brwlock_shared[1]);
+	brwdestroy(brwl);
+	printk("brwlock test complete\n");
+
+	return true;
+}
+
 /* Funcs and global vars for test_rv() */
 static struct rendez local_rv;
 static struct rendez *rv = &local_rv;
@@ -1924,6 +2434,38 @@ void __test_rv_wakeup(uint32_t srcid, long a0, long a1, long a2)
 	atomic_dec(&counter);
 }
 
+static atomic_t rcu_cb_count;
+
+static void __test_rcu_cb(struct rcu_head *head)
+{
+	atomic_inc(&rcu_cb_count);
+}
+
+bool test_rcu(void)
+{
+	#define NR_RCU_TEST_CBS 10
+	struct rcu_head heads[NR_RCU_TEST_CBS];
+	int8_t irq_state = 0;
+
+	atomic_set(&rcu_cb_count, 0);
+	for (int i = 0; i < NR_RCU_TEST_CBS; i++)
+		call_rcu(&heads[i], __test_rcu_cb);
+	/* callbacks queued before synchronize_rcu() are in the same or an earlier
+	 * batch, so they have all run once it returns */
+	synchronize_rcu();
+	KT_ASSERT_M("All callbacks should have run",
+	            atomic_read(&rcu_cb_count) == NR_RCU_TEST_CBS);
+	/* call_rcu() should work with IRQs off, too */
+	disable_irqsave(&irq_state);
+	call_rcu(&heads[0], __test_rcu_cb);
+	enable_irqsave(&irq_state);
+	synchronize_rcu();
+	KT_ASSERT_M("The IRQ-disabled callback should have run",
+	            atomic_read(&rcu_cb_count) == NR_RCU_TEST_CBS + 1);
+	KT_ASSERT_M("pid2proc should not find a bogus pid", !pid2proc(0));
+	return true;
+}
+
 void __test_rv_sleeper(uint32_t srcid, long a0, long a1, long a2)
 {
 	rendez_sleep(rv, __rendez_cond, (void*)&state);
@@ -2029,6 +2571,52 @@ bool test_alarm(void)
 	return true;
 }
 
+#define ALARM_WHEEL_NR 32
+
+static atomic_t alarm_wheel_nr_fired;
+static bool alarm_wheel_early;
+
+static void __test_alarm_wheel(struct alarm_waiter *waiter,
+                               struct hw_trapframe *hw_tf)
+{
+	if (read_tsc() < waiter->wake_up_time)
+		alarm_wheel_early = TRUE;
+	atomic_inc(&alarm_wheel_nr_fired);
+}
+
+/* Alarms spread over several wheel levels, some with slack, all go off and none
+ * go off early.  The far one gets unset before it fires. */
+bool test_alarm_wheel(void)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter waiters[ALARM_WHEEL_NR], far;
+	int8_t irq_state = 0;
+
+	atomic_init(&alarm_wheel_nr_fired, 0);
+	alarm_wheel_early = FALSE;
+	disable_irqsave(&irq_state);
+	for (int i = 0; i < ALARM_WHEEL_NR; i++) {
+		init_awaiter_irq(&waiters[i], __test_alarm_wheel);
+		/* out of order, from 0 to ~30 msec, with a few identical times */
+		set_awaiter_rel(&waiters[i], ((i * 7) % ALARM_WHEEL_NR) * 1000);
+		if (i % 2)
+			set_awaiter_slack(&waiters[i], 500);
+		set_alarm(tchain, &waiters[i]);
+	}
+	init_awaiter_irq(&far, __test_alarm_wheel);
+	set_awaiter_rel(&far, 1000000000);
+	set_alarm(tchain, &far);
+	enable_irqsave(&irq_state);
+
+	while (atomic_read(&alarm_wheel_nr_fired) != ALARM_WHEEL_NR)
+		cpu_relax();
+	KT_ASSERT_M("Alarm went off early", !alarm_wheel_early);
+	KT_ASSERT_M("Far alarm already fired", unset_alarm(tchain, &far));
+	for (int i = 0; i < ALARM_WHEEL_NR; i++)
+		KT_ASSERT_M("Waiter still on the tchain", !waiters[i].on_tchain);
+	return true;
+}
+
 bool test_kmalloc_incref(void)
 {
 	/* this test is a bit invasive of the kmalloc internals */
@@ -2043,14 +2631,14 @@ bool test_kmalloc_incref(void)
 
 	bool test_buftag(void *b, struct kmalloc_tag *btag, char *str)
 	{
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 1);
+		KT_ASSERT_M(str, atomic_read(&btag->refcnt) == 1);
 		kmalloc_incref(b);
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 2);
+		KT_ASSERT_M(str, atomic_read(&btag->refcnt) == 2);
 		kfree(b);
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 1);
+		KT_ASSERT_M(str, atomic_read(&btag->refcnt) == 1);
 		kfree(b);
 		/* dangerous read, it's been freed */
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 0);
+		KT_ASSERT_M(str, atomic_read(&btag->refcnt) == 0);
 		return TRUE;
 	}
 
@@ -2392,6 +2980,7 @@ bool test_cmdline_parse(void)
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
+	KTEST_REG(kmsg_order,         CONFIG_TEST_kmsg_order),
 	KTEST_REG(pic_reception,      CONFIG_TEST_pic_reception),
 	KTEST_REG(lapic_status_bit,   CONFIG_TEST_lapic_status_bit),
 	KTEST_REG(pit,                CONFIG_TEST_pit),
@@ -2408,9 +2997,16 @@ static struct ktest ktests[] = {
 	KTEST_REG(checklists,         CONFIG_TEST_checklists),
 	KTEST_REG(smp_call_functions, CONFIG_TEST_smp_call_functions),
 	KTEST_REG(slab,               CONFIG_TEST_slab),
+	KTEST_REG(slab_magazines,     CONFIG_TEST_slab_magazines),
+	KTEST_REG(slab_large_objs,    CONFIG_TEST_slab_large_objs),
+	KTEST_REG(slab_huge,          CONFIG_TEST_slab_huge),
+	KTEST_REG(page_numa,          CONFIG_TEST_page_numa),
+	KTEST_REG(page_pcpu,          CONFIG_TEST_page_pcpu),
 	KTEST_REG(kmalloc,            CONFIG_TEST_kmalloc),
 	KTEST_REG(hashtable,          CONFIG_TEST_hashtable),
+	KTEST_REG(rhashtable,         CONFIG_TEST_rhashtable),
 	KTEST_REG(circular_buffer,    CONFIG_TEST_circular_buffer),
+	KTEST_REG(pcpu_cbuf,          CONFIG_TEST_pcpu_cbuf),
 	KTEST_REG(bcq,                CONFIG_TEST_bcq),
 	KTEST_REG(ucq,                CONFIG_TEST_ucq),
 	KTEST_REG(vm_regions,         CONFIG_TEST_vm_regions),
@@ -2419,14 +3015,19 @@ static struct ktest ktests[] = {
 	KTEST_REG(kthreads,           CONFIG_TEST_kthreads),
 	KTEST_REG(kref,               CONFIG_TEST_kref),
 	KTEST_REG(atomics,            CONFIG_TEST_atomics),
+	KTEST_REG(mcs_lock,           CONFIG_TEST_mcs_lock),
+	KTEST_REG(lockstat,           CONFIG_TEST_lockstat),
 	KTEST_REG(abort_halt,         CONFIG_TEST_abort_halt),
 	KTEST_REG(cv,                 CONFIG_TEST_cv),
 	KTEST_REG(memset,             CONFIG_TEST_memset),
 	KTEST_REG(setjmp,             CONFIG_TEST_setjmp),
 	KTEST_REG(apipe,              CONFIG_TEST_apipe),
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
+	KTEST_REG(brwlock,            CONFIG_TEST_brwlock),
+	KTEST_REG(rcu,                CONFIG_TEST_rcu),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
+	KTEST_REG(alarm_wheel,        CONFIG_TEST_alarm_wheel),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
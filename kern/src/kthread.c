@@ -6,32 +6,270 @@
  * reason, usually during blocking IO operations. */
 
 #include <kthread.h>
+#include <arch/arch.h>
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
+#include <mm.h>
 #include <smp.h>
 #include <schedule.h>
 #include <kstack.h>
+#include <percpu.h>
 #include <arch/uaccess.h>
+#include <profiler.h>
+#include <kmem_acct.h>
+
+/* Each core keeps a few free kstacks, so that kthreads that block and restart
+ * don't go back to the page allocator for every stack.  Stacks freed past the
+ * high-water mark go back to the allocator. */
+#define KSTACK_PCPU_HIGH			8
+
+struct kstack_pcpu_cache {
+	uintptr_t					stacks[KSTACK_PCPU_HIGH];
+	unsigned int				nr_stacks;
+	uint64_t					nr_allocs;
+	uint64_t					nr_cache_hits;
+	uint64_t					nr_frees;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static DEFINE_PERCPU(struct kstack_pcpu_cache, kstack_pcpu_caches);
+static bool kstack_pcpu_ready;
+
+static void kstack_pcpu_init(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(kstack_pcpu_caches, i), 0,
+		       sizeof(struct kstack_pcpu_cache));
+	kstack_pcpu_ready = TRUE;
+}
+DEFINE_PERCPU_INIT(kstack_pcpu_init);
 
-uintptr_t get_kstack(void)
+#ifdef CONFIG_KSTACK_GUARD
+/* Guarded stacks live in a vmap arena, each with KSTKSIZE of unmapped space
+ * below it, so running off the bottom of a stack faults instead of scribbling
+ * on whatever is next to it.  The fault can't push a frame on the overflowed
+ * stack, so it becomes a double fault, which runs on its own IST stack.
+ *
+ * We can't add kernel mappings to every address space after boot (see
+ * map_vmap_segment()), so kstack_guard_init() builds the page tables for the
+ * whole arena while every pgdir still shares them.  A slot's PTEs are filled in
+ * the first time the slot is used.  Slots are never unmapped, which would need
+ * a global shootdown; a freed slot keeps its pages and waits on
+ * kstack_free_slots for reuse.  Once the arena is used up, we fall back to
+ * unguarded stacks. */
+#define KSTACK_GUARD_NR_SLOTS		1024
+#define KSTACK_SLOT_SIZE			(2 * KSTKSIZE)
+#define KSTACK_ARENA_SIZE			(KSTACK_GUARD_NR_SLOTS * KSTACK_SLOT_SIZE)
+
+static uintptr_t kstack_arena;
+static spinlock_t kstack_slot_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static uintptr_t kstack_free_slots[KSTACK_GUARD_NR_SLOTS];
+static unsigned int kstack_nr_free_slots;
+static unsigned int kstack_next_slot;
+
+static void kstack_guard_init(void)
+{
+	uintptr_t arena;
+	pte_t pte;
+
+	/* One extra stack's worth, so the stacktops can be KSTKSIZE aligned */
+	arena = get_vmap_segment((KSTACK_ARENA_SIZE + KSTKSIZE) >> PGSHIFT);
+	if (!arena) {
+		warn("No vmap space for guarded kstacks, using unguarded stacks");
+		return;
+	}
+	arena = ROUNDUP(arena, KSTKSIZE);
+	for (uintptr_t va = arena; va < arena + KSTACK_ARENA_SIZE; va += PGSIZE) {
+		pte = pgdir_walk(boot_pgdir, (void*)va, 1);
+		assert(pte_walk_okay(pte));
+	}
+	kstack_arena = arena;
+}
+
+static bool is_guarded_kstack(uintptr_t stacktop)
+{
+	return kstack_arena && (stacktop > kstack_arena) &&
+	       (stacktop <= kstack_arena + KSTACK_ARENA_SIZE);
+}
+
+bool kstack_is_guard(uintptr_t va)
+{
+	if (!kstack_arena || (va < kstack_arena) ||
+	    (va >= kstack_arena + KSTACK_ARENA_SIZE))
+		return FALSE;
+	return (va - kstack_arena) % KSTACK_SLOT_SIZE < KSTKSIZE;
+}
+
+static void __map_kstack_slot(uintptr_t stackbot)
+{
+	struct page *page;
+	pte_t pte;
+	error_t ret;
+
+	for (uintptr_t va = stackbot; va < stackbot + KSTKSIZE; va += PGSIZE) {
+		ret = kpage_alloc(&page);
+		assert(!ret);
+		pte = pgdir_walk(boot_pgdir, (void*)va, 0);
+		assert(pte_walk_okay(pte));
+		pte_write(pte, page2pa(page), PTE_KERN_RW | PTE_G);
+	}
+	/* Guarded slots keep their pages forever */
+	kmem_account(KMEM_KSTACK, KSTKSIZE);
+}
+
+static uintptr_t get_guarded_kstack(void)
+{
+	uintptr_t stacktop = 0;
+	bool fresh = FALSE;
+
+	if (!kstack_arena)
+		return 0;
+	spin_lock_irqsave(&kstack_slot_lock);
+	if (kstack_nr_free_slots) {
+		stacktop = kstack_free_slots[--kstack_nr_free_slots];
+	} else if (kstack_next_slot < KSTACK_GUARD_NR_SLOTS) {
+		stacktop = kstack_arena + ++kstack_next_slot * KSTACK_SLOT_SIZE;
+		fresh = TRUE;
+	}
+	spin_unlock_irqsave(&kstack_slot_lock);
+	/* Nothing else can see a fresh slot yet, and its page tables exist, so we
+	 * don't need the lock to fill in its PTEs.  The PTEs were never present,
+	 * so there's nothing stale in any TLB. */
+	if (fresh)
+		__map_kstack_slot(stacktop - KSTKSIZE);
+	return stacktop;
+}
+
+static void put_guarded_kstack(uintptr_t stacktop)
 {
-	uintptr_t stackbot;
+	spin_lock_irqsave(&kstack_slot_lock);
+	assert(kstack_nr_free_slots < KSTACK_GUARD_NR_SLOTS);
+	kstack_free_slots[kstack_nr_free_slots++] = stacktop;
+	spin_unlock_irqsave(&kstack_slot_lock);
+}
+
+#else
+
+static void kstack_guard_init(void)
+{
+}
+
+static bool is_guarded_kstack(uintptr_t stacktop)
+{
+	return FALSE;
+}
+
+bool kstack_is_guard(uintptr_t va)
+{
+	return FALSE;
+}
+
+static uintptr_t get_guarded_kstack(void)
+{
+	return 0;
+}
+
+static void put_guarded_kstack(uintptr_t stacktop)
+{
+}
+
+#endif /* CONFIG_KSTACK_GUARD */
+
+/* Gets a stack from the allocators, skipping the per-core cache */
+static uintptr_t __get_kstack(void)
+{
+	uintptr_t stackbot, stacktop;
+
+	stacktop = get_guarded_kstack();
+	if (stacktop)
+		return stacktop;
 	if (KSTKSIZE == PGSIZE)
 		stackbot = (uintptr_t)kpage_alloc_addr();
 	else
 		stackbot = (uintptr_t)get_cont_pages(KSTKSHIFT - PGSHIFT, 0);
 	assert(stackbot);
+	kmem_account(KMEM_KSTACK, KSTKSIZE);
 	return stackbot + KSTKSIZE;
 }
 
-void put_kstack(uintptr_t stacktop)
+static void __put_kstack(uintptr_t stacktop)
 {
 	uintptr_t stackbot = stacktop - KSTKSIZE;
+
+	if (is_guarded_kstack(stacktop)) {
+		put_guarded_kstack(stacktop);
+		return;
+	}
 	if (KSTKSIZE == PGSIZE)
 		page_decref(kva2page((void*)stackbot));
 	else
 		free_cont_pages((void*)stackbot, KSTKSHIFT - PGSHIFT);
+	kmem_account(KMEM_KSTACK, -KSTKSIZE);
+}
+
+uintptr_t get_kstack(void)
+{
+	struct kstack_pcpu_cache *kpc;
+	uintptr_t stacktop = 0;
+	int8_t irq_state = 0;
+
+	if (kstack_pcpu_ready) {
+		disable_irqsave(&irq_state);
+		kpc = PERCPU_VARPTR(kstack_pcpu_caches);
+		kpc->nr_allocs++;
+		if (kpc->nr_stacks) {
+			stacktop = kpc->stacks[--kpc->nr_stacks];
+			kpc->nr_cache_hits++;
+		}
+		enable_irqsave(&irq_state);
+		if (stacktop)
+			return stacktop;
+	}
+	return __get_kstack();
+}
+
+void put_kstack(uintptr_t stacktop)
+{
+	struct kstack_pcpu_cache *kpc;
+	bool cached = FALSE;
+	int8_t irq_state = 0;
+
+	if (kstack_pcpu_ready) {
+		disable_irqsave(&irq_state);
+		kpc = PERCPU_VARPTR(kstack_pcpu_caches);
+		kpc->nr_frees++;
+		if (kpc->nr_stacks < KSTACK_PCPU_HIGH) {
+			kpc->stacks[kpc->nr_stacks++] = stacktop;
+			cached = TRUE;
+		}
+		enable_irqsave(&irq_state);
+		if (cached)
+			return;
+	}
+	__put_kstack(stacktop);
+}
+
+void kstack_get_stats(int coreid, struct kstack_stats *stats)
+{
+	struct kstack_pcpu_cache *kpc = _PERCPU_VARPTR(kstack_pcpu_caches, coreid);
+
+	stats->nr_allocs = kpc->nr_allocs;
+	stats->nr_cache_hits = kpc->nr_cache_hits;
+	stats->nr_frees = kpc->nr_frees;
+	stats->nr_cached = kpc->nr_stacks;
+}
+
+/* Racy with concurrent allocs, but close enough. */
+void kstack_reset_stats(void)
+{
+	struct kstack_pcpu_cache *kpc;
+
+	for (int i = 0; i < num_cores; i++) {
+		kpc = _PERCPU_VARPTR(kstack_pcpu_caches, i);
+		kpc->nr_allocs = 0;
+		kpc->nr_cache_hits = 0;
+		kpc->nr_frees = 0;
+	}
 }
 
 uintptr_t *kstack_bottom_addr(uintptr_t stacktop)
@@ -47,6 +285,7 @@ void kthread_init(void)
 {
 	kthread_kcache = kmem_cache_create("kthread", sizeof(struct kthread),
 	                                   __alignof__(struct kthread), 0, 0, 0);
+	kstack_guard_init();
 }
 
 /* Used by early init routines (smp_boot, etc) */
@@ -141,9 +380,9 @@ static void __launch_kthread(uint32_t srcid, long a0, long a1, long a2)
 	assert(0);
 }
 
-/* Call this when a kthread becomes runnable/unblocked.  We don't do anything
+/* Picks the core a runnable kthread will run on.  We don't do anything
  * particularly smart yet, but when we do, we can put it here. */
-void kthread_runnable(struct kthread *kthread)
+static uint32_t kthread_dst_core(struct kthread *kthread)
 {
 	uint32_t dst = core_id();
 	#if 0
@@ -159,8 +398,33 @@ void kthread_runnable(struct kthread *kthread)
 	}
 	#endif
 	/* For lack of anything better, send it to ourselves. (TODO: KSCHED) */
-	send_kernel_message(dst, __launch_kthread, (long)kthread, 0, 0,
-	                    KMSG_ROUTINE);
+	return dst;
+}
+
+/* Call this when a kthread becomes runnable/unblocked. */
+void kthread_runnable(struct kthread *kthread)
+{
+	send_kernel_message(kthread_dst_core(kthread), __launch_kthread,
+	                    (long)kthread, 0, 0, KMSG_ROUTINE);
+}
+
+/* Makes every kthread on batch runnable, sending at most one IPI to each
+ * destination core.  Like kthread_runnable(), we can't touch a kthread once
+ * its kmsg is out, including its link. */
+static void kthread_runnable_batch(struct kthread_tailq *batch)
+{
+	struct kthread *kthread, *temp;
+	uint32_t ipi_dsts[num_cores];
+	uint32_t nr_ipis = 0;
+	uint32_t dst;
+
+	TAILQ_FOREACH_SAFE(kthread, batch, link, temp) {
+		dst = kthread_dst_core(kthread);
+		if (send_kernel_message_noipi(dst, __launch_kthread, (long)kthread, 0,
+		                              0, KMSG_ROUTINE))
+			ipi_dsts[nr_ipis++] = dst;
+	}
+	send_ipi_multi(ipi_dsts, nr_ipis, I_KERNEL_MSG);
 }
 
 /* Kmsg helper for kthread_yield */
@@ -256,6 +520,10 @@ static void sem_init_common(struct semaphore *sem, int signals)
 {
 	TAILQ_INIT(&sem->waiters);
 	sem->nr_signals = signals;
+#ifdef CONFIG_SEM_SPINWAIT
+	sem->holder = 0;
+	sem->holder_core = 0;
+#endif
 #ifdef CONFIG_SEMAPHORE_DEBUG
 	sem->is_on_list = FALSE;
 	sem->bt_pc = 0;
@@ -278,6 +546,38 @@ void sem_init_irqsave(struct semaphore *sem, int signals)
 	sem->irq_okay = TRUE;
 }
 
+#ifdef CONFIG_SEM_SPINWAIT
+/* Remembers who downed the sem, so waiters can tell whether spinning is worth
+ * it.  Call with the sem locked.  This is only a hint: sems don't have owners,
+ * and waiters read it locklessly.  A kthread that slept and was woken doesn't
+ * set it, since it can't touch the sem after the up (it might be gone). */
+static void sem_set_holder(struct semaphore *sem, struct kthread *kthread)
+{
+	sem->holder = kthread;
+	sem->holder_core = core_id();
+}
+
+/* Whether whoever last downed the sem is running on another core right now,
+ * and thus might up it soon.  If it blocked or is on our core, spinning won't
+ * help. */
+static bool sem_holder_running(struct semaphore *sem)
+{
+	struct kthread *holder = ACCESS_ONCE(sem->holder);
+	uint32_t holder_core = ACCESS_ONCE(sem->holder_core);
+
+	if (!holder || holder_core == core_id())
+		return FALSE;
+	return ACCESS_ONCE(per_cpu_info[holder_core].cur_kthread) == holder;
+}
+
+#else
+
+static void sem_set_holder(struct semaphore *sem, struct kthread *kthread)
+{
+}
+
+#endif /* CONFIG_SEM_SPINWAIT */
+
 bool sem_trydown(struct semaphore *sem)
 {
 	bool ret = FALSE;
@@ -288,6 +588,7 @@ bool sem_trydown(struct semaphore *sem)
 	if (sem->nr_signals > 0) {
 		sem->nr_signals--;
 		ret = TRUE;
+		sem_set_holder(sem, per_cpu_info[core_id()].cur_kthread);
 		debug_downed_sem(sem);
 	}
 	spin_unlock(&sem->lock);
@@ -312,9 +613,13 @@ void sem_down(struct semaphore *sem)
 	/* Try to down the semaphore.  If there is a signal there, we can skip all
 	 * of the sleep prep and just return. */
 #ifdef CONFIG_SEM_SPINWAIT
+	/* Spin only while the holder is running elsewhere.  If it's blocked, it
+	 * won't up the sem any time soon, and we should get out of the way. */
 	for (int i = 0; i < CONFIG_SEM_SPINWAIT_NR_LOOPS; i++) {
 		if (sem_trydown(sem))
 			goto block_return_path;
+		if (!sem_holder_running(sem))
+			break;
 		cpu_relax();
 	}
 #else
@@ -382,6 +687,7 @@ void sem_down(struct semaphore *sem)
 	} else {
 		kthread->proc = 0;
 	} 
+	kthread->blocked_at = profiler_offcpu_enabled() ? nsec() : 0;
 	if (setjmp(&kthread->context))
 		goto block_return_path;
 	spin_lock(&sem->lock);
@@ -405,9 +711,11 @@ void sem_down(struct semaphore *sem)
 	}
 	/* We get here if we should not sleep on sem (the signal beat the sleep).
 	 * We debug_downed_sem since we actually downed it - just didn't sleep. */
+	sem_set_holder(sem, kthread);
 	debug_downed_sem(sem);
 	spin_unlock(&sem->lock);
 	printd("[kernel] Didn't sleep, unwinding...\n");
+	kthread->blocked_at = 0;
 	/* Restore the core's current and default stacktop */
 	current = kthread->proc;			/* arguably unnecessary */
 	if (kthread->proc)
@@ -430,6 +738,11 @@ block_return_path:
 	 * them. */
 	if (irqs_were_on)
 		enable_irq();
+	/* We might be on another core now, so pcpui is stale.  The short-circuit
+	 * paths never set blocked_at. */
+	kthread = per_cpu_info[core_id()].cur_kthread;
+	if (kthread->blocked_at)
+		profiler_add_offcpu_sample(kthread, read_pc(), read_bp());
 	return;
 }
 
@@ -449,6 +762,9 @@ bool sem_up(struct semaphore *sem)
 	} else {
 		assert(TAILQ_EMPTY(&sem->waiters));
 	}
+#ifdef CONFIG_SEM_SPINWAIT
+	sem->holder = 0;
+#endif
 	debug_upped_sem(sem);
 	spin_unlock(&sem->lock);
 	/* Note that once we call kthread_runnable(), we cannot touch the sem again.
@@ -677,6 +993,26 @@ static void sem_wake_one(struct semaphore *sem)
 	kthread_runnable(kthread);
 }
 
+/* Helper, wakes nr waiters, and there should have been at least that many.
+ * This takes the sem lock once, and the wakeups are batched per core. */
+static void sem_wake_many(struct semaphore *sem, int nr)
+{
+	struct kthread_tailq batch = TAILQ_HEAD_INITIALIZER(batch);
+	struct kthread *kthread;
+
+	spin_lock(&sem->lock);
+	assert(nr_sem_waiters(sem) >= nr);
+	sem->nr_signals += nr;
+	for (int i = 0; i < nr; i++) {
+		kthread = TAILQ_FIRST(&sem->waiters);
+		TAILQ_REMOVE(&sem->waiters, kthread, link);
+		TAILQ_INSERT_TAIL(&batch, kthread, link);
+	}
+	debug_upped_sem(sem);
+	spin_unlock(&sem->lock);
+	kthread_runnable_batch(&batch);
+}
+
 void __cv_signal(struct cond_var *cv)
 {
 	/* Can't short circuit this stuff.  We need to make sure any waiters that
@@ -694,11 +1030,14 @@ void __cv_signal(struct cond_var *cv)
 
 void __cv_broadcast(struct cond_var *cv)
 {
+	int nr_waiters;
+
 	while (cv->nr_waiters != nr_sem_waiters(&cv->sem))
 		cpu_relax();
-	while (cv->nr_waiters) {
-		cv->nr_waiters--;
-		sem_wake_one(&cv->sem);
+	nr_waiters = cv->nr_waiters;
+	if (nr_waiters) {
+		cv->nr_waiters = 0;
+		sem_wake_many(&cv->sem, nr_waiters);
 	}
 }
 
@@ -0,0 +1,254 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Lock contention profiling.  See lockstat.h.
+ *
+ * Each core has its own table of sites, hashed by the PC of the lock call, and
+ * a small stack of the locks it holds, so unlock can find the acquisition time
+ * and the site.  Spinlocks are always released on the core that grabbed them.
+ * All of the bookkeeping runs with IRQs off, so IRQ handlers that take locks
+ * don't trample the outer lock's entries.  This code can't grab any locks.
+ *
+ * Readers and resetters race with the cores updating their tables.  The
+ * numbers are statistics; close enough is fine. */
+
+#include <lockstat.h>
+#include <atomic.h>
+#include <percpu.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <assert.h>
+#include <sort.h>
+#include <kthread.h>
+#include <smp.h>
+
+#define LOCKSTAT_NR_SITES		512		/* per core, power of 2 */
+#define LOCKSTAT_MAX_HELD		16
+
+struct lockstat_held {
+	void						*lock;
+	struct lockstat_site		*site;
+	uint64_t					start;
+};
+
+struct lockstat_pcpu {
+	struct lockstat_site		sites[LOCKSTAT_NR_SITES];
+	struct lockstat_held		held[LOCKSTAT_MAX_HELD];
+	unsigned int				nr_held;
+};
+
+bool lockstat_enabled;
+static DEFINE_PERCPU(struct lockstat_pcpu *, lockstat_pcpu);
+static qlock_t lockstat_qlock = QLOCK_INITIALIZER(lockstat_qlock);
+
+static struct lockstat_site *lockstat_find_site(struct lockstat_site *sites,
+                                                uintptr_t pc)
+{
+	unsigned int idx = ((pc >> 2) * 0x9E3779B1) & (LOCKSTAT_NR_SITES - 1);
+
+	for (int i = 0; i < LOCKSTAT_NR_SITES; i++) {
+		if (sites[idx].pc == pc)
+			return &sites[idx];
+		if (!sites[idx].pc) {
+			sites[idx].pc = pc;
+			return &sites[idx];
+		}
+		idx = (idx + 1) & (LOCKSTAT_NR_SITES - 1);
+	}
+	return NULL;
+}
+
+static unsigned int lockstat_bucket(uint64_t wait_tsc)
+{
+	unsigned int i;
+	uint64_t limit = LOCKSTAT_HIST_BASE;
+
+	for (i = 0; i < LOCKSTAT_NR_BUCKETS - 1; i++, limit <<= 2) {
+		if (wait_tsc < limit)
+			break;
+	}
+	return i;
+}
+
+void lockstat_acquired(void *lock, uintptr_t pc, uint64_t wait_tsc,
+                       bool contended)
+{
+	struct lockstat_pcpu *ls;
+	struct lockstat_site *site;
+	struct lockstat_held *held;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	ls = PERCPU_VAR(lockstat_pcpu);
+	/* enabled before we allocated, on a core that raced with lockstat_enable */
+	if (!ls)
+		goto out;
+	site = lockstat_find_site(ls->sites, pc);
+	if (site) {
+		site->lock = (uintptr_t)lock;
+		site->nr_acquires++;
+		if (contended) {
+			site->nr_contended++;
+			site->wait_tsc += wait_tsc;
+			site->max_wait_tsc = MAX(site->max_wait_tsc, wait_tsc);
+			site->wait_hist[lockstat_bucket(wait_tsc)]++;
+		}
+	}
+	if (ls->nr_held < LOCKSTAT_MAX_HELD) {
+		held = &ls->held[ls->nr_held++];
+		held->lock = lock;
+		held->site = site;
+		held->start = read_tsc();
+	}
+out:
+	enable_irqsave(&irq_state);
+}
+
+void lockstat_released(void *lock)
+{
+	struct lockstat_pcpu *ls;
+	struct lockstat_held *held;
+	struct lockstat_site *site;
+	uint64_t hold_tsc;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	ls = PERCPU_VAR(lockstat_pcpu);
+	if (!ls)
+		goto out;
+	/* Usually the most recent lock is the one being released */
+	for (int i = ls->nr_held - 1; i >= 0; i--) {
+		held = &ls->held[i];
+		if (held->lock != lock)
+			continue;
+		site = held->site;
+		if (site) {
+			hold_tsc = read_tsc() - held->start;
+			site->hold_tsc += hold_tsc;
+			site->max_hold_tsc = MAX(site->max_hold_tsc, hold_tsc);
+		}
+		*held = ls->held[--ls->nr_held];
+		break;
+	}
+out:
+	enable_irqsave(&irq_state);
+}
+
+void __lockstat_spin_lock(struct spinlock *lock, uintptr_t pc)
+{
+	uint64_t start;
+
+	if (__spin_trylock(lock)) {
+		lockstat_acquired(lock, pc, 0, FALSE);
+		return;
+	}
+	start = read_tsc();
+	__spin_lock(lock);
+	lockstat_acquired(lock, pc, read_tsc() - start, TRUE);
+}
+
+/* Called from the inlined spin_lock(), so our return address is the lock's
+ * call site. */
+void lockstat_spin_lock(struct spinlock *lock)
+{
+	__lockstat_spin_lock(lock, (uintptr_t)__builtin_return_address(0));
+}
+
+bool lockstat_spin_trylock(struct spinlock *lock)
+{
+	if (!__spin_trylock(lock))
+		return FALSE;
+	lockstat_acquired(lock, (uintptr_t)__builtin_return_address(0), 0, FALSE);
+	return TRUE;
+}
+
+/* Turning it on allocates the tables the first time, and forgets about any
+ * locks that were held the last time it was on. */
+void lockstat_enable(bool on)
+{
+	struct lockstat_pcpu *ls;
+
+	qlock(&lockstat_qlock);
+	if (on && !lockstat_enabled) {
+		for (int i = 0; i < num_cores; i++) {
+			ls = _PERCPU_VAR(lockstat_pcpu, i);
+			if (!ls) {
+				ls = kzmalloc(sizeof(struct lockstat_pcpu), KMALLOC_WAIT);
+				_PERCPU_VAR(lockstat_pcpu, i) = ls;
+			}
+			ls->nr_held = 0;
+		}
+		wmb();	/* publish the tables before the flag */
+	}
+	ACCESS_ONCE(lockstat_enabled) = on;
+	qunlock(&lockstat_qlock);
+}
+
+void lockstat_reset(void)
+{
+	struct lockstat_pcpu *ls;
+
+	qlock(&lockstat_qlock);
+	for (int i = 0; i < num_cores; i++) {
+		ls = _PERCPU_VAR(lockstat_pcpu, i);
+		if (ls)
+			memset(ls->sites, 0, sizeof(ls->sites));
+	}
+	qunlock(&lockstat_qlock);
+}
+
+static int lockstat_cmp_wait(const void *a, const void *b)
+{
+	const struct lockstat_site *sa = a, *sb = b;
+
+	if (sa->wait_tsc != sb->wait_tsc)
+		return sa->wait_tsc < sb->wait_tsc ? 1 : -1;
+	if (sa->nr_acquires != sb->nr_acquires)
+		return sa->nr_acquires < sb->nr_acquires ? 1 : -1;
+	return 0;
+}
+
+/* Merges every core's sites into a kmalloced array, sorted by total wait time,
+ * worst first.  Returns the number of sites; the caller frees *sites_p. */
+size_t lockstat_snapshot(struct lockstat_site **sites_p)
+{
+	struct lockstat_site *sites, *from, *to;
+	struct lockstat_pcpu *ls;
+	size_t nr_sites = 0;
+
+	sites = kzmalloc(sizeof(struct lockstat_site) * LOCKSTAT_NR_SITES,
+	                 KMALLOC_WAIT);
+	qlock(&lockstat_qlock);
+	for (int i = 0; i < num_cores; i++) {
+		ls = _PERCPU_VAR(lockstat_pcpu, i);
+		if (!ls)
+			continue;
+		for (int j = 0; j < LOCKSTAT_NR_SITES; j++) {
+			from = &ls->sites[j];
+			if (!from->pc)
+				continue;
+			/* Sites beyond what one core can track get dropped. */
+			to = lockstat_find_site(sites, from->pc);
+			if (!to)
+				continue;
+			to->lock = from->lock;
+			to->nr_acquires += from->nr_acquires;
+			to->nr_contended += from->nr_contended;
+			to->wait_tsc += from->wait_tsc;
+			to->max_wait_tsc = MAX(to->max_wait_tsc, from->max_wait_tsc);
+			to->hold_tsc += from->hold_tsc;
+			to->max_hold_tsc = MAX(to->max_hold_tsc, from->max_hold_tsc);
+			for (int k = 0; k < LOCKSTAT_NR_BUCKETS; k++)
+				to->wait_hist[k] += from->wait_hist[k];
+		}
+	}
+	qunlock(&lockstat_qlock);
+	/* Compact the hash table, then sort */
+	for (int i = 0; i < LOCKSTAT_NR_SITES; i++) {
+		if (sites[i].pc)
+			sites[nr_sites++] = sites[i];
+	}
+	sort(sites, nr_sites, sizeof(struct lockstat_site), lockstat_cmp_wait);
+	*sites_p = sites;
+	return nr_sites;
+}
@@ -0,0 +1,178 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * MCS queue locks.  This is the kernel version of parlib's mcs_lock, using a
+ * CAS on unlock instead of the usurper dance, since all of our arches have a
+ * real CAS.
+ *
+ * With CONFIG_SPINLOCK_DEBUG, the lock tracks its last holder and how often it
+ * was acquired and contended, and acquisitions count towards the core's
+ * lock_depth, like spinlocks.  With CONFIG_TRACE_LOCKS, acquisitions go in the
+ * pcpui trace ring.  CONFIG_LOCK_STATS feeds the lock profiler. */
+
+#include <mcs_lock.h>
+#include <arch/kdebug.h>
+#include <smp.h>
+#include <stdio.h>
+#include <kdebug.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef CONFIG_SPINLOCK_DEBUG
+
+static void mcs_post_lock(struct mcs_lock *lock, bool contended, uintptr_t pc)
+{
+	uint32_t coreid = core_id_early();
+	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
+
+	if (pcpui->__lock_checking_enabled == 1)
+		pcpui_trace_locks(pcpui, lock);
+	lock->call_site = pc;
+	lock->calling_core = coreid;
+	lock->nr_acquires++;
+	if (contended)
+		lock->nr_contended++;
+	pcpui->lock_depth++;
+}
+
+static void mcs_pre_unlock(struct mcs_lock *lock)
+{
+	assert(mcs_lock_locked(lock));
+	per_cpu_info[lock->calling_core].lock_depth--;
+}
+
+void mcs_lock_debug(struct mcs_lock *lock)
+{
+	uintptr_t pc = lock->call_site;
+	char *func_name;
+
+	printk("MCS lock %p: %lu acquires, %lu contended\n", lock,
+	       lock->nr_acquires, lock->nr_contended);
+	if (!pc) {
+		printk("MCS lock %p: never locked\n", lock);
+		return;
+	}
+	func_name = get_fn_name(pc);
+	printk("MCS lock %p: currently %slocked.  Last locked at [<%p>] in %s on "
+	       "core %d\n", lock, mcs_lock_locked(lock) ? "" : "un", pc, func_name,
+	       lock->calling_core);
+	kfree(func_name);
+}
+
+#else
+
+static void mcs_post_lock(struct mcs_lock *lock, bool contended, uintptr_t pc)
+{
+}
+
+static void mcs_pre_unlock(struct mcs_lock *lock)
+{
+}
+
+void mcs_lock_debug(struct mcs_lock *lock)
+{
+}
+
+#endif /* CONFIG_SPINLOCK_DEBUG */
+
+void mcs_lock_init(struct mcs_lock *lock)
+{
+	memset(lock, 0, sizeof(struct mcs_lock));
+}
+
+static struct mcs_lock_qnode *mcs_qnode_swap(struct mcs_lock_qnode **addr,
+                                             struct mcs_lock_qnode *val)
+{
+	return (struct mcs_lock_qnode*)atomic_swap((atomic_t*)addr, (long)val);
+}
+
+static void __mcs_lock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode,
+                       uintptr_t pc)
+{
+	struct mcs_lock_qnode *predecessor;
+#ifdef CONFIG_LOCK_STATS
+	bool stats = lockstat_enabled;
+	uint64_t start = stats ? read_tsc() : 0;
+#endif
+
+	qnode->next = 0;
+	qnode->locked = 1;
+	cmb();	/* swap provides a CPU mb() */
+	predecessor = mcs_qnode_swap(&lock->lock, qnode);
+	if (predecessor) {
+		/* The swap ordered our qnode writes before we became visible. */
+		ACCESS_ONCE(predecessor->next) = qnode;
+		while (ACCESS_ONCE(qnode->locked))
+			cpu_relax();
+	}
+	cmb();	/* the swap, or the read of locked, is our acquire */
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(stats))
+		lockstat_acquired(lock, pc, predecessor ? read_tsc() - start : 0,
+		                  predecessor != 0);
+#endif
+	mcs_post_lock(lock, predecessor != 0, pc);
+}
+
+void mcs_lock_lock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode)
+{
+	__mcs_lock(lock, qnode, get_caller_pc());
+}
+
+bool mcs_lock_trylock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode)
+{
+	qnode->next = 0;
+	qnode->locked = 0;
+	cmb();	/* CAS provides a CPU mb() */
+	if (!atomic_cas_ptr((void**)&lock->lock, 0, qnode))
+		return FALSE;
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled))
+		lockstat_acquired(lock, get_caller_pc(), 0, FALSE);
+#endif
+	mcs_post_lock(lock, FALSE, get_caller_pc());
+	return TRUE;
+}
+
+void mcs_lock_unlock(struct mcs_lock *lock, struct mcs_lock_qnode *qnode)
+{
+	struct mcs_lock_qnode *next;
+
+	mcs_pre_unlock(lock);
+#ifdef CONFIG_LOCK_STATS
+	if (unlikely(lockstat_enabled))
+		lockstat_released(lock);
+#endif
+	next = ACCESS_ONCE(qnode->next);
+	if (!next) {
+		/* If we're still the tail, no one is waiting. */
+		if (atomic_cas_ptr((void**)&lock->lock, qnode, 0))
+			return;
+		/* Someone swapped in behind us, but hasn't linked in yet.  Spin (very
+		 * briefly!) til they do. */
+		while (!(next = ACCESS_ONCE(qnode->next)))
+			cpu_relax();
+	}
+	wmb();	/* need to make sure any previous writes don't pass unlocking */
+	rwmb();	/* need to make sure any reads happen before the unlocking */
+	ACCESS_ONCE(next->locked) = 0;
+}
+
+void mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_lock_qnode *qnode)
+{
+	bool irq_en = irq_is_enabled();
+
+	disable_irq();
+	__mcs_lock(lock, qnode, get_caller_pc());
+	qnode->irq_en = irq_en;
+}
+
+void mcs_unlock_irqsave(struct mcs_lock *lock, struct mcs_lock_qnode *qnode)
+{
+	bool irq_en = qnode->irq_en;
+
+	mcs_lock_unlock(lock, qnode);
+	if (irq_en)
+		enable_irq();
+}
@@ -22,13 +22,47 @@
 #include <syscall.h>
 #include <slab.h>
 #include <kmalloc.h>
+#include <kmem_acct.h>
 #include <vfs.h>
 #include <smp.h>
 #include <profiler.h>
+#include <arch/topology.h>
+#include <kthread.h>
+#include <tracepoint.h>
+
+/* MAP_HUGETLB anon memory is backed by PTSIZE jumbos, when possible */
+#define JUMBO_NR_PGS	(PTSIZE >> PGSHIFT)
+#define JUMBO_ORDER		LOG2_DOWN(JUMBO_NR_PGS)
+
+/* Sequential read-ahead starts with this window, in pages, then doubles */
+#define RA_MIN_WIN		4
+
+/* Tearing down an address space frees this much VA (a multiple of PTSIZE) per
+ * hold of the PTE lock */
+#define UNMAP_CHUNK_SZ	(64 << 20)
 
 struct kmem_cache *vmr_kcache;
 
+/* VMRs don't overlap, so sorting them by vm_end also sorts them by vm_base.
+ * This lets us change a VMR's bounds in place (split, merge, grow, shrink)
+ * without reinserting it, so long as it doesn't cross its neighbors. */
+static int vmr_cmp(struct vm_region *a, struct vm_region *b)
+{
+	if (a->vm_end < b->vm_end)
+		return -1;
+	if (a->vm_end > b->vm_end)
+		return 1;
+	return 0;
+}
+
+RB_GENERATE_STATIC(vmr_tree, vm_region, vm_tree_link, vmr_cmp);
+
 static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg);
+static int __do_madv_drop(struct proc *p, uintptr_t addr, size_t len,
+                          int advice);
+static void vmr_readahead(struct vm_region *vmr, unsigned long idx,
+                          unsigned long nr_pgs);
+
 /* minor helper, will ease the file->chan transition */
 static struct page_map *file2pm(struct file *file)
 {
@@ -38,15 +72,32 @@ static struct page_map *file2pm(struct file *file)
 void vmr_init(void)
 {
 	vmr_kcache = kmem_cache_create("vm_regions", sizeof(struct vm_region),
-	                               __alignof__(struct dentry), 0, 0, 0);
+	                               __alignof__(struct dentry),
+	                               KMC_KMEM(KMEM_VMR), 0, 0);
+}
+
+/* Helper: returns the lowest VMR ending after va (which is the one holding va,
+ * if any), or 0. */
+static struct vm_region *__vmr_first_after(struct proc *p, uintptr_t va)
+{
+	struct vm_region *vmr = RB_ROOT(&p->vm_tree), *ret = 0;
+
+	while (vmr) {
+		if (va < vmr->vm_end) {
+			ret = vmr;
+			vmr = RB_LEFT(vmr, vm_tree_link);
+		} else {
+			vmr = RB_RIGHT(vmr, vm_tree_link);
+		}
+	}
+	return ret;
 }
 
 /* For now, the caller will set the prot, flags, file, and offset.  In the
  * future, we may put those in here, to do clever things with merging vm_regions
  * that are the same.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * TODO: take a look at solari's vmem alloc. */
 struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 {
 	struct vm_region *vmr = 0, *vm_i, *vm_next;
@@ -67,7 +118,14 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 		vmr->vm_base = va;
 		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
 	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
+		/* Skip the gaps below the 'hint' va: start from the last VMR that ends
+		 * at or below va, if there is one. */
+		vm_next = __vmr_first_after(p, va);
+		vm_next = vm_next ? TAILQ_PREV(vm_next, vmr_tailq, vm_link)
+		                  : TAILQ_LAST(&p->vm_regions, vmr_tailq);
+		if (vm_next)
+			vm_i = vm_next;
+		for (; vm_i; vm_i = TAILQ_NEXT(vm_i, vm_link)) {
 			vm_next = TAILQ_NEXT(vm_i, vm_link);
 			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
 			/* skip til we get past the 'hint' va */
@@ -94,12 +152,45 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 	if (vmr) {
 		vmr->vm_proc = p;
 		vmr->vm_end = vmr->vm_base + len;
+		RB_INSERT(vmr_tree, &p->vm_tree, vmr);
 	}
 	if (!vmr)
 		warn("Not making a VMR, wanted %p, + %p = %p", va, len, va + len);
 	return vmr;
 }
 
+/* Sets the file fault tuning for vmr, based on madvise() advice */
+static void vmr_set_advice(struct vm_region *vmr, int advice)
+{
+	switch (advice) {
+	case MADV_RANDOM:
+		vmr->vm_fault_around = 0;
+		vmr->vm_ra_max = 0;
+		break;
+	case MADV_SEQUENTIAL:
+		vmr->vm_fault_around = CONFIG_FAULT_AROUND_PAGES;
+		vmr->vm_ra_max = CONFIG_READAHEAD_PAGES * 2;
+		break;
+	default:
+		vmr->vm_fault_around = CONFIG_FAULT_AROUND_PAGES;
+		vmr->vm_ra_max = CONFIG_READAHEAD_PAGES;
+	}
+	vmr->vm_ra_win = 0;
+	vmr->vm_ra_next = 0;
+	vmr->vm_ra_end = 0;
+}
+
+/* Helper: new_vmr gets old_vmr's tuning, but none of its read-ahead state */
+static void vmr_copy_tuning(struct vm_region *new_vmr,
+                            struct vm_region *old_vmr)
+{
+	new_vmr->vm_fault_around = old_vmr->vm_fault_around;
+	new_vmr->vm_ra_max = old_vmr->vm_ra_max;
+	new_vmr->vm_ra_win = 0;
+	new_vmr->vm_ra_next = 0;
+	new_vmr->vm_ra_end = 0;
+}
+
 /* Split a VMR at va, returning the new VMR.  It is set up the same way, with
  * file offsets fixed accordingly.  'va' is the beginning of the new one, and
  * must be page aligned. */
@@ -117,8 +208,10 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
 	old_vmr->vm_end = va;
+	RB_INSERT(vmr_tree, &old_vmr->vm_proc->vm_tree, new_vmr);
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
+	vmr_copy_tuning(new_vmr, old_vmr);
 	if (old_vmr->vm_file) {
 		kref_get(&old_vmr->vm_file->f_kref, 1);
 		new_vmr->vm_file = old_vmr->vm_file;
@@ -140,7 +233,9 @@ int merge_vmr(struct vm_region *first, struct vm_region *second)
 	if ((first->vm_end != second->vm_base) ||
 	    (first->vm_prot != second->vm_prot) ||
 	    (first->vm_flags != second->vm_flags) ||
-	    (first->vm_file != second->vm_file))
+	    (first->vm_file != second->vm_file) ||
+	    (first->vm_fault_around != second->vm_fault_around) ||
+	    (first->vm_ra_max != second->vm_ra_max))
 		return -1;
 	if ((first->vm_file) && (second->vm_foff != first->vm_foff +
 	                         first->vm_end - first->vm_base))
@@ -202,6 +297,9 @@ void destroy_vmr(struct vm_region *vmr)
 		kref_put(&vmr->vm_file->f_kref);
 	}
 	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
+	RB_REMOVE(vmr_tree, &vmr->vm_proc->vm_tree, vmr);
+	if (vmr->vm_proc->vmr_hint == vmr)
+		vmr->vm_proc->vmr_hint = 0;
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
@@ -209,28 +307,27 @@ void destroy_vmr(struct vm_region *vmr)
  * if there is none. */
 struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-	}
-	return 0;
+	struct vm_region *vmr = p->vmr_hint;
+
+	/* Faults tend to hit the same VMR repeatedly */
+	if (vmr && (vmr->vm_base <= va) && (vmr->vm_end > va))
+		return vmr;
+	vmr = __vmr_first_after(p, va);
+	if (!vmr || (vmr->vm_base > va))
+		return 0;
+	p->vmr_hint = vmr;
+	return vmr;
 }
 
 /* Finds the first vmr after va (including the one holding va), or 0 if there is
  * none. */
 struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
-			return vmr;
-	}
-	return 0;
+	struct vm_region *vmr = p->vmr_hint;
+
+	if (vmr && (vmr->vm_base <= va) && (vmr->vm_end > va))
+		return vmr;
+	return __vmr_first_after(p, va);
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
@@ -240,25 +337,38 @@ void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 	struct vm_region *vmr;
 	if ((vmr = find_vmr(p, va)))
 		split_vmr(vmr, va);
-	/* TODO: don't want to do another find (linear search) */
 	if ((vmr = find_vmr(p, va + len)))
 		split_vmr(vmr, va + len);
 }
 
+/* Frees all of p's pages and VMRs, a chunk at a time.  From a ktask (the proc
+ * reaper), we yield between chunks, so a huge process doesn't hog the core and
+ * its memory comes back as we go. */
 void unmap_and_destroy_vmrs(struct proc *p)
 {
 	struct vm_region *vmr_i, *vmr_temp;
-	/* this only gets called from __proc_free, so there should be no sync
-	 * concerns.  still, better safe than sorry. */
+	bool may_yield = is_ktask(per_cpu_info[core_id()].cur_kthread);
+	uintptr_t va, end;
+
+	/* this only gets called from __proc_free's reaper and exec, so there should
+	 * be no sync concerns.  still, better safe than sorry.  (that's also why
+	 * the reaper can drop the lock mid-walk: no one else can get at p). */
 	spin_lock(&p->vmr_lock);
 	p->vmr_history++;
-	spin_lock(&p->pte_lock);
 	TAILQ_FOREACH(vmr_i, &p->vm_regions, vm_link) {
-		/* note this CB sets the PTE = 0, regardless of if it was P or not */
-		env_user_mem_walk(p, (void*)vmr_i->vm_base,
-		                  vmr_i->vm_end - vmr_i->vm_base, __vmr_free_pgs, 0);
+		for (va = vmr_i->vm_base; va < vmr_i->vm_end; va = end) {
+			end = MIN(vmr_i->vm_end, ROUNDUP(va + 1, UNMAP_CHUNK_SZ));
+			spin_lock(&p->pte_lock);
+			/* this CB sets the PTE = 0, regardless of if it was P or not */
+			env_user_mem_walk(p, (void*)va, end - va, __vmr_free_pgs, 0);
+			spin_unlock(&p->pte_lock);
+			if (may_yield) {
+				spin_unlock(&p->vmr_lock);
+				kthread_yield();
+				spin_lock(&p->vmr_lock);
+			}
+		}
 	}
-	spin_unlock(&p->pte_lock);
 	/* need the safe style, since destroy_vmr modifies the list.  also, we want
 	 * to do this outside the pte lock, since it grabs the pm lock. */
 	TAILQ_FOREACH_SAFE(vmr_i, &p->vm_regions, vm_link, vmr_temp)
@@ -266,12 +376,16 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+/* Helper: gives new_p the pages of p in [va_start, va_end).  Little pages are
+ * shared copy-on-write: both PTEs become read-only and PTE_COW, and the first
+ * write fault in either process gets its own copy (see __hpf_cow()).  Jumbos
+ * are copied into little pages.  The TLB ranges of p we write-protected are
+ * added to tlb.  0 on success, -ERROR on failure. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
-                      uintptr_t va_end)
+                      uintptr_t va_end, struct tlb_gather *tlb)
 {
+	int ret;
+
 	/* Sanity checks.  If these fail, we had a screwed up VMR.
 	 * Check for: alignment, wraparound, or userspace addresses */
 	if ((PGOFF(va_start)) ||
@@ -285,20 +399,42 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 	int copy_page(struct proc *p, pte_t pte, void *va, void *arg) {
 		struct proc *new_p = (struct proc*)arg;
 		struct page *pp;
+		int settings;
+
 		if (pte_is_unmapped(pte))
 			return 0;
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
-		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
+		if (pte_is_mapped(pte) && !pte_is_jumbo(pte) &&
+		    (pte_is_cow(pte) ||
+		     kref_refcnt(&pa2page(pte_get_paddr(pte))->pg_kref) == 1)) {
+			/* Private and anon VMRs never map page cache pages, so pp is ours
+			 * to share.  A writable page with other refs is pinned by the
+			 * kernel (e.g. an ether ring), and p must keep writing to that
+			 * page, so we copy those instead.  page_insert takes the child's
+			 * ref. */
+			pp = pa2page(pte_get_paddr(pte));
+			settings = (pte_get_settings(pte) & ~PTE_PERM) | PTE_USER_RO |
+			           PTE_COW;
+			if (page_insert(new_p->env_pgdir, pp, va, settings))
 				return -ENOMEM;
-			if (page_insert(new_p->env_pgdir, pp, va, pte_get_settings(pte))) {
+			pte_write(pte, pte_get_paddr(pte), settings);
+			tlb_gather_add(tlb, (uintptr_t)va, (uintptr_t)va + PGSIZE);
+			new_p->nr_cow_shared++;
+		} else if (pte_is_mapped(pte)) {
+			/* The child gets little pages, even for a jumbo */
+			for (int i = 0; i < pte_nr_pgs(pte); i++) {
+				if (upage_alloc(new_p, &pp, 0))
+					return -ENOMEM;
+				if (page_insert(new_p->env_pgdir, pp, va + i * PGSIZE,
+				                pte_get_settings(pte) & ~PTE_PS)) {
+					page_decref(pp);
+					return -ENOMEM;
+				}
+				memcpy(page2kva(pp), KADDR(pte_get_paddr(pte) + i * PGSIZE),
+				       PGSIZE);
 				page_decref(pp);
-				return -ENOMEM;
 			}
-			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
-			page_decref(pp);
 		} else if (pte_is_paged_out(pte)) {
 			/* TODO: (SWAP) will need to either make a copy or CoW/refcnt the
 			 * backend store.  For now, this PTE will be the same as the
@@ -309,13 +445,17 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		}
 		return 0;
 	}
-	return env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
-	                         new_p);
+	/* The pte_lock keeps p's page faults from racing with our write protect */
+	spin_lock(&p->pte_lock);
+	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
+	                        new_p);
+	spin_unlock(&p->pte_lock);
+	return ret;
 }
 
 /* This will make new_p have the same VMRs as p, and it will make sure all
- * physical pages are copied over, with the exception of MAP_SHARED files.
- * This is used by fork().
+ * physical pages are shared copy-on-write, with the exception of MAP_SHARED
+ * files, which are just shared.  This is used by fork().
  *
  * Note that if you are working on a VMR that is a file, you'll want to be
  * careful about how it is mapped (SHARED, PRIVATE, etc). */
@@ -323,10 +463,17 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 {
 	int ret = 0;
 	struct vm_region *vmr, *vm_i;
+	struct tlb_gather tlb;
+
+	/* Once p's PTEs are write protected, p must not use its old TLB entries,
+	 * even if we fail partway. */
+	tlb_gather_init(&tlb, p);
 	TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
 		vmr = kmem_cache_alloc(vmr_kcache, 0);
-		if (!vmr)
-			return -ENOMEM;
+		if (!vmr) {
+			ret = -ENOMEM;
+			break;
+		}
 		vmr->vm_proc = new_p;
 		vmr->vm_base = vm_i->vm_base;
 		vmr->vm_end = vm_i->vm_end;
@@ -334,19 +481,23 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 		vmr->vm_flags = vm_i->vm_flags;	
 		vmr->vm_file = vm_i->vm_file;
 		vmr->vm_foff = vm_i->vm_foff;
+		vmr_copy_tuning(vmr, vm_i);
 		if (vm_i->vm_file) {
 			kref_get(&vm_i->vm_file->f_kref, 1);
 			pm_add_vmr(file2pm(vm_i->vm_file), vmr);
 		}
 		if (!vmr->vm_file || vmr->vm_flags & MAP_PRIVATE) {
 			assert(!(vmr->vm_flags & MAP_SHARED));
-			/* Copy over the memory from one VMR to the other */
-			if ((ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end)))
-				return ret;
+			/* Share the memory from one VMR to the other */
+			ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end, &tlb);
 		}
 		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
+		RB_INSERT(vmr_tree, &new_p->vm_tree, vmr);
+		if (ret)
+			break;
 	}
-	return 0;
+	tlb_gather_flush(&tlb);
+	return ret;
 }
 
 void print_vmrs(struct proc *p)
@@ -513,6 +664,60 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	return 0;
 }
 
+/* Helper: tries to back the PTSIZE-aligned region around va with a jumbo page
+ * from the local NUMA node.  The region must be entirely within vmr and must
+ * not have any little pages mapped yet.  Returns 0 if the region is now backed
+ * by a jumbo, -ERROR if the caller should use little pages instead. */
+static int map_jumbo_at_addr(struct proc *p, struct vm_region *vmr,
+                             uintptr_t va, int prot)
+{
+	uintptr_t jva = ROUNDDOWN(va, PTSIZE);
+	void *kva;
+	pte_t pte;
+
+	if ((jva < vmr->vm_base) || (jva + PTSIZE > vmr->vm_end))
+		return -EINVAL;
+	/* Don't bother allocating if there are already little pages */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)jva, FALSE);
+	if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		return pte_is_jumbo(pte) ? 0 : -EEXIST;
+	}
+	spin_unlock(&p->pte_lock);
+	kva = get_cont_pages_node(numa_id(), JUMBO_ORDER, 0);
+	if (!kva)
+		return -ENOMEM;
+	memset(kva, 0, PTSIZE);
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)jva, TRUE);
+	if (!pte_walk_okay(pte) || pte_is_mapped(pte)) {
+		/* Lost a race with another fault, or out of memory for the PT */
+		spin_unlock(&p->pte_lock);
+		free_cont_pages(kva, JUMBO_ORDER);
+		return pte_walk_okay(pte) && pte_is_jumbo(pte) ? 0 : -EEXIST;
+	}
+	/* We have a ref on each of the little pages, which the PTE now stores */
+	pte_write(pte, PADDR(kva), prot | PTE_PS);
+	spin_unlock(&p->pte_lock);
+	return 0;
+}
+
+/* Helper: jumbos can't be partially unmapped or reprotected, so this breaks up
+ * any jumbos straddling the ends of [addr, addr + len) into little pages. */
+static int __split_jumbos(struct proc *p, uintptr_t addr, size_t len)
+{
+	int ret = 0;
+
+	spin_lock(&p->pte_lock);
+	if (addr % PTSIZE)
+		ret = pgdir_split_jumbo(p->env_pgdir, (void*)addr);
+	if (!ret && ((addr + len) % PTSIZE))
+		ret = pgdir_split_jumbo(p->env_pgdir, (void*)(addr + len));
+	spin_unlock(&p->pte_lock);
+	return ret;
+}
+
 /* Helper: copies *pp's contents to a new page, replacing your page pointer.  If
  * this succeeds, you'll have a non-PM page, which matters for how you put it.*/
 static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
@@ -528,12 +733,18 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
  * mappable, which isn't true if there are concurrent changes to the VMRs. */
-static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
+static int populate_anon_va(struct proc *p, struct vm_region *vmr,
+                            uintptr_t va, unsigned long nr_pgs, int pte_prot)
 {
 	struct page *page;
 	int ret;
 	for (long i = 0; i < nr_pgs; i++) {
+		if ((vmr->vm_flags & MAP_HUGETLB) &&
+		    !((va + i * PGSIZE) % PTSIZE) && (i + JUMBO_NR_PGS <= nr_pgs) &&
+		    !map_jumbo_at_addr(p, vmr, va + i * PGSIZE, pte_prot)) {
+			i += JUMBO_NR_PGS - 1;
+			continue;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
@@ -563,6 +774,11 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 		if (ret) {
 			if (ret != -EAGAIN)
 				break;
+			/* MAP_NONBLOCK only maps what is already resident */
+			if (flags & MAP_NONBLOCK) {
+				ret = 0;
+				continue;
+			}
 			spin_unlock(&p->vmr_lock);
 			/* might block here, can't hold the spinlock */
 			ret = pm_load_page(pm, pm_idx0 + i, &page);
@@ -612,14 +828,19 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	if (addr == 0)
 		addr = BRK_END;
 	assert(!PGOFF(offset));
+	/* Jumbos are only for anonymous memory */
+	if (file)
+		flags &= ~MAP_HUGETLB;
 
 	/* MCPs will need their code and data pinned.  This check will start to fail
 	 * after uthread_slim_init(), at which point userspace should have enough
 	 * control over its mmaps (i.e. no longer done by LD or load_elf) that it
 	 * can ask for pinned and populated pages.  Except for dl_opens(). */
 	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[0];
-	if (file && (atomic_read(&vcpd->flags) & VC_SCP_NOVCCTX))
+	if (file && (atomic_read(&vcpd->flags) & VC_SCP_NOVCCTX)) {
 		flags |= MAP_POPULATE | MAP_LOCKED;
+		flags &= ~MAP_NONBLOCK;
+	}
 	/* Need to make sure nothing is in our way when we want a FIXED location.
 	 * We just need to split on the end points (if they exist), and then remove
 	 * everything in between.  __do_munmap() will do this.  Careful, this means
@@ -668,6 +889,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		}
 		kref_get(&file->f_kref, 1);
 		pm_add_vmr(file2pm(file), vmr);
+		vmr_set_advice(vmr, MADV_NORMAL);
 	}
 	vmr->vm_file = file;
 	vmr = merge_me(vmr);		/* attempts to merge with neighbors */
@@ -678,7 +900,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, vmr, addr, nr_pgs, pte_prot);
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on the file
 			 * keeps the pm alive when we unlock */
@@ -728,13 +950,18 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	struct vm_region *vmr, *next_vmr;
 	pte_t pte;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tlb;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
+	if (__split_jumbos(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this is aggressively splitting, when we might not need to if the
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans.  Finally, we might be able to merge when we are done. */
 	isolate_vmrs(p, addr, len);
+	tlb_gather_init(&tlb, p);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		if (vmr->vm_prot == prot)
@@ -753,16 +980,19 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		for (uintptr_t va = vmr->vm_base; va < vmr->vm_end; va += PGSIZE) {
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
-				shootdown_needed = TRUE;
+				/* CoW pages stay read-only until their write fault */
+				if (pte_is_cow(pte) && pte_prot == PTE_USER_RW)
+					pte_replace_perm(pte, PTE_USER_RO);
+				else
+					pte_replace_perm(pte, pte_prot);
+				tlb_gather_add(&tlb, va, va + PGSIZE);
 			}
 		}
 		spin_unlock(&p->pte_lock);
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_flush(&tlb);
 	return 0;
 }
 
@@ -790,15 +1020,87 @@ int munmap(struct proc *p, uintptr_t addr, size_t len)
 	return ret;
 }
 
+/* The fault tuning advice only matters to file-backed VMRs.  MADV_WILLNEED
+ * starts reading the part of the range that isn't in the page cache yet.
+ * MADV_DONTNEED and MADV_FREE drop pages; see __do_madv_drop(). */
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice)
+{
+	struct vm_region *vmr;
+	struct page *page;
+	uintptr_t end, start_i, end_i;
+	unsigned long idx, nr_file_pgs, nr_pgs;
+	int ret;
+
+	if (!len)
+		return 0;
+	if ((addr % PGSIZE) || (addr < MMAP_LOWEST_VA)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	end = ROUNDUP(addr + len, PGSIZE);
+	if (end > UMAPTOP || addr > end) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	switch (advice) {
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+	case MADV_WILLNEED:
+		break;
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		spin_lock(&p->vmr_lock);
+		ret = __do_madv_drop(p, addr, end - addr, advice);
+		spin_unlock(&p->vmr_lock);
+		return ret;
+	default:
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&p->vmr_lock);
+	if (advice != MADV_WILLNEED) {
+		p->vmr_history++;
+		isolate_vmrs(p, addr, end - addr);
+	}
+	for (vmr = find_first_vmr(p, addr); vmr && vmr->vm_base < end;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if (!vmr->vm_file)
+			continue;
+		if (advice != MADV_WILLNEED) {
+			vmr_set_advice(vmr, advice);
+			continue;
+		}
+		start_i = MAX(addr, vmr->vm_base);
+		end_i = MIN(end, vmr->vm_end);
+		idx = (start_i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+		nr_file_pgs = nr_pages(vmr->vm_file->f_dentry->d_inode->i_size);
+		if (idx >= nr_file_pgs)
+			continue;
+		nr_pgs = MIN((end_i - start_i) >> PGSHIFT, nr_file_pgs - idx);
+		/* No sense in a ktask for pages we already have */
+		while (nr_pgs && !pm_load_page_nowait(file2pm(vmr->vm_file), idx,
+		                                      &page)) {
+			pm_put_page(page);
+			idx++;
+			nr_pgs--;
+		}
+		vmr_readahead(vmr, idx, nr_pgs);
+	}
+	spin_unlock(&p->vmr_lock);
+	return 0;
+}
+
 static int __munmap_mark_not_present(struct proc *p, pte_t pte, void *va,
                                      void *arg)
 {
-	bool *shootdown_needed = (bool*)arg;
+	struct tlb_gather *tlb = (struct tlb_gather*)arg;
 	/* could put in some checks here for !P and also !0 */
 	if (!pte_is_present(pte))	/* unmapped (== 0) *ptes are also not PTE_P */
 		return 0;
 	pte_clear_present(pte);
-	*shootdown_needed = TRUE;
+	tlb_gather_add(tlb, (uintptr_t)va,
+	               (uintptr_t)va + (pte_nr_pgs(pte) << PGSHIFT));
 	return 0;
 }
 
@@ -821,6 +1123,13 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 	if (pte_is_unmapped(pte))
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
+	if (pte_is_jumbo(pte)) {
+		/* Only anon memory has jumbos, and the PTE holds every page's ref */
+		for (int i = 0; i < pte_nr_pgs(pte); i++)
+			page_decref(page + i);
+		pte_clear(pte);
+		return 0;
+	}
 	pte_clear(pte);
 	if (!(atomic_read(&page->pg_flags) & PG_PAGEMAP))
 		page_decref(page);
@@ -830,25 +1139,29 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr, *first_vmr;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tlb;
 
+	if (__split_jumbos(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
+	tlb_gather_init(&tlb, p);
 	spin_lock(&p->pte_lock);	/* changing PTEs */
 	while (vmr && vmr->vm_base < addr + len) {
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
-		                  __munmap_mark_not_present, &shootdown_needed);
+		                  __munmap_mark_not_present, &tlb);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
 	/* we haven't freed the pages yet; still using the PTEs to store the them.
 	 * There should be no races with inserts/faults, since we still hold the mm
 	 * lock since the previous CB. */
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_flush(&tlb);
 	vmr = first_vmr;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* there is rarely more than one VMR in this loop.  o/w, we'll need to
@@ -864,6 +1177,129 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	return 0;
 }
 
+/* Drops the pages in [addr, addr + len), leaving the VMRs as they are.  Anon
+ * memory faults back in zeroed, and private file mappings lose their copies of
+ * pages.  Shared file mappings keep their PTEs, since only the page cache knows
+ * whether pages are dirty; we tell it that the pages are idle instead, and
+ * reclaim drops them first.
+ *
+ * MADV_FREE is for allocators giving back anon memory they might reuse, which
+ * can then hold either the old data or zeros.  Freeing lazily would take a way
+ * for reclaim to find anon pages, which we don't have.  So we free right away
+ * if memory is short, and otherwise leave the pages, saving a fault and a
+ * zeroing if the allocator reuses them.  Hold the vmr_lock. */
+static int __do_madv_drop(struct proc *p, uintptr_t addr, size_t len,
+                          int advice)
+{
+	struct vm_region *vmr, *first_vmr;
+	struct tlb_gather tlb;
+	uintptr_t start_i, end_i, end = addr + len;
+
+	first_vmr = find_first_vmr(p, addr);
+	for (vmr = first_vmr; vmr && vmr->vm_base < end;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if ((vmr->vm_flags & MAP_LOCKED) ||
+		    ((advice == MADV_FREE) && vmr->vm_file)) {
+			set_errno(EINVAL);
+			return -1;
+		}
+	}
+	if ((advice == MADV_FREE) && !page_alloc_below_wmark(TRUE))
+		return 0;
+	if (__split_jumbos(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	/* Same dance as munmap: mark !P, shootdown, then free */
+	tlb_gather_init(&tlb, p);
+	spin_lock(&p->pte_lock);
+	for (vmr = first_vmr; vmr && vmr->vm_base < end;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if (vmr->vm_file && (vmr->vm_flags & MAP_SHARED))
+			continue;
+		start_i = MAX(addr, vmr->vm_base);
+		end_i = MIN(end, vmr->vm_end);
+		env_user_mem_walk(p, (void*)start_i, end_i - start_i,
+		                  __munmap_mark_not_present, &tlb);
+	}
+	spin_unlock(&p->pte_lock);
+	tlb_gather_flush(&tlb);
+	spin_lock(&p->pte_lock);
+	for (vmr = first_vmr; vmr && vmr->vm_base < end;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if (vmr->vm_file && (vmr->vm_flags & MAP_SHARED))
+			continue;
+		start_i = MAX(addr, vmr->vm_base);
+		end_i = MIN(end, vmr->vm_end);
+		env_user_mem_walk(p, (void*)start_i, end_i - start_i,
+		                  __vmr_free_pgs, 0);
+	}
+	spin_unlock(&p->pte_lock);
+	for (vmr = first_vmr; vmr && vmr->vm_base < end;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if (!vmr->vm_file)
+			continue;
+		start_i = MAX(addr, vmr->vm_base);
+		end_i = MIN(end, vmr->vm_end);
+		pm_mark_idle(file2pm(vmr->vm_file),
+		             (start_i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT,
+		             (end_i - start_i) >> PGSHIFT);
+	}
+	return 0;
+}
+
+/* Helper: the PTE prot for pages in vmr */
+static int vmr_pte_prot(struct vm_region *vmr)
+{
+	return (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	       (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
+}
+
+/* Helper: handles a write fault on a copy-on-write PTE, which fork() set up.
+ * If no one else has the page anymore, we just make it writable.  Otherwise we
+ * give p its own copy.  Returns -ENOENT if va isn't CoW, and the caller should
+ * handle the fault as usual.  Hold the vmr_lock. */
+static int __hpf_cow(struct proc *p, struct vm_region *vmr, uintptr_t va)
+{
+	struct page *old_pg, *new_pg;
+	pte_t pte;
+	int settings;
+	bool copied = FALSE;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (!pte_walk_okay(pte) || !pte_is_mapped(pte) || !pte_is_cow(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	p->nr_cow_faults++;
+	old_pg = pa2page(pte_get_paddr(pte));
+	settings = (pte_get_settings(pte) & ~(PTE_PERM | PTE_COW)) |
+	           vmr_pte_prot(vmr);
+	/* No one can get a new ref on the page: the other sharers' PTEs are gone,
+	 * and fork only shares pages that are in our PTEs. */
+	if (kref_refcnt(&old_pg->pg_kref) == 1) {
+		pte_write(pte, page2pa(old_pg), settings);
+	} else {
+		if (upage_alloc(p, &new_pg, FALSE)) {
+			spin_unlock(&p->pte_lock);
+			return -ENOMEM;
+		}
+		memcpy(page2kva(new_pg), page2kva(old_pg), PGSIZE);
+		/* The PTE's ref on old_pg moves to new_pg */
+		pte_write(pte, page2pa(new_pg), settings);
+		p->nr_cow_copies++;
+		copied = TRUE;
+	}
+	spin_unlock(&p->pte_lock);
+	/* Other cores could still read through the old page */
+	if (copied) {
+		proc_tlbshootdown(p, va, va + PGSIZE);
+		page_decref(old_pg);
+	}
+	return 0;
+}
+
 /* Helper - drop the page differently based on where it is from */
 static void __put_page(struct page *page)
 {
@@ -873,6 +1309,128 @@ static void __put_page(struct page *page)
 		page_decref(page);
 }
 
+struct pm_readahead {
+	struct file					*file;
+	unsigned long				idx;
+	unsigned long				nr_pgs;
+};
+
+static void __pm_readahead_ktask(void *arg)
+{
+	struct pm_readahead *ra = (struct pm_readahead*)arg;
+	struct page *page;
+
+	for (unsigned long i = 0; i < ra->nr_pgs; i++) {
+		if (pm_load_page(ra->file->f_mapping, ra->idx + i, &page))
+			break;
+		pm_put_page(page);
+	}
+	kref_put(&ra->file->f_kref);
+	kfree(ra);
+}
+
+/* Asynchronously loads [idx, idx + nr_pgs) of vmr's file into the page cache.
+ * The loading is done by a ktask, which can block. */
+static void vmr_readahead(struct vm_region *vmr, unsigned long idx,
+                          unsigned long nr_pgs)
+{
+	struct pm_readahead *ra;
+
+	if (!nr_pgs)
+		return;
+	ra = kmalloc(sizeof(struct pm_readahead), 0);
+	if (!ra)
+		return;
+	kref_get(&vmr->vm_file->f_kref, 1);
+	ra->file = vmr->vm_file;
+	ra->idx = idx;
+	ra->nr_pgs = nr_pgs;
+	ktask("pm_readahead", __pm_readahead_ktask, ra);
+}
+
+/* Helper: called on a file fault at f_idx.  If the faults look sequential, we
+ * grow the read-ahead window, and we keep about a window's worth of pages
+ * ahead of the faults in flight.  Hold the vmr_lock. */
+static void __hpf_readahead(struct vm_region *vmr, unsigned long f_idx)
+{
+	unsigned long nr_file_pgs, ra_start, ra_stop;
+
+	if (!vmr->vm_ra_max)
+		return;
+	if (vmr->vm_ra_win && (f_idx == vmr->vm_ra_next)) {
+		vmr->vm_ra_win = MIN(vmr->vm_ra_win * 2, vmr->vm_ra_max);
+	} else {
+		vmr->vm_ra_win = MIN(RA_MIN_WIN, vmr->vm_ra_max);
+		vmr->vm_ra_end = f_idx + 1;
+	}
+	vmr->vm_ra_next = f_idx + 1;
+	/* At least half a window is already in flight */
+	if ((vmr->vm_ra_end > f_idx + 1) &&
+	    (vmr->vm_ra_end - (f_idx + 1) >= vmr->vm_ra_win / 2))
+		return;
+	nr_file_pgs = nr_pages(vmr->vm_file->f_dentry->d_inode->i_size);
+	ra_start = MAX(vmr->vm_ra_end, f_idx + 1);
+	ra_stop = MIN(f_idx + 1 + vmr->vm_ra_win,
+	              MIN(nr_file_pgs, (vmr->vm_end - vmr->vm_base +
+	                                 vmr->vm_foff) >> PGSHIFT));
+	if (ra_start >= ra_stop)
+		return;
+	vmr_readahead(vmr, ra_start, ra_stop - ra_start);
+	vmr->vm_ra_end = ra_stop;
+}
+
+/* Helper: after a file fault at va, maps the neighboring pages (in an aligned
+ * window of vm_fault_around pages) that are already up to date in the page
+ * cache.  This never blocks or starts IO.  Hold the vmr_lock. */
+static void __hpf_fault_around(struct proc *p, struct vm_region *vmr,
+                               uintptr_t va, int pte_prot)
+{
+	struct page_map *pm = vmr->vm_file->f_mapping;
+	unsigned long nr_file_pgs, idx;
+	size_t win = (size_t)vmr->vm_fault_around << PGSHIFT;
+	uintptr_t start, end;
+	struct page *page;
+	bool mapped;
+	pte_t pte;
+
+	if (vmr->vm_fault_around <= 1)
+		return;
+	nr_file_pgs = nr_pages(vmr->vm_file->f_dentry->d_inode->i_size);
+	start = MAX(ROUNDDOWN(va, win), vmr->vm_base);
+	end = MIN(ROUNDDOWN(va, win) + win, vmr->vm_end);
+	for (uintptr_t va_i = start; va_i < end; va_i += PGSIZE) {
+		if (va_i == va)
+			continue;
+		idx = (va_i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+		if (idx >= nr_file_pgs)
+			break;
+		spin_lock(&p->pte_lock);
+		pte = pgdir_walk(p->env_pgdir, (void*)va_i, FALSE);
+		mapped = pte_walk_okay(pte) && pte_is_mapped(pte);
+		spin_unlock(&p->pte_lock);
+		if (mapped)
+			continue;
+		if (pm_load_page_nowait(pm, idx, &page))
+			continue;
+		if (vmr->vm_flags & MAP_PRIVATE) {
+			if (__copy_and_swap_pmpg(p, &page)) {
+				pm_put_page(page);
+				break;
+			}
+		}
+		if (vmr->vm_prot & PROT_EXEC)
+			icache_flush_page((void*)va_i, page2kva(page));
+		mapped = !map_page_at_addr(p, page, va_i, pte_prot);
+		if (atomic_read(&page->pg_flags) & PG_PAGEMAP)
+			pm_put_page(page);
+		if (!mapped)
+			break;
+		/* The next sequential fault will be past whatever we mapped */
+		if (idx == vmr->vm_ra_next)
+			vmr->vm_ra_next++;
+	}
+}
+
 static int __hpf_load_page(struct proc *p, struct page_map *pm,
                            unsigned long idx, struct page **page, bool first)
 {
@@ -941,8 +1499,11 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	unsigned int f_idx;	/* index of the missing page in the file */
 	int ret = 0;
 	bool first = TRUE;
+	struct vcore_stats *vcs;
 	va = ROUNDDOWN(va,PGSIZE);
 
+	if ((vcs = cur_vcore_stats(p)))
+		vcs->nr_page_faults++;
 refault:
 	/* read access to the VMRs TODO: RCU */
 	spin_lock(&p->vmr_lock);
@@ -957,8 +1518,17 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	if (prot & PROT_WRITE) {
+		ret = __hpf_cow(p, vmr, va);
+		if (ret != -ENOENT)
+			goto out;
+		ret = 0;
+	}
 	if (!vmr->vm_file) {
 		/* No file - just want anonymous memory */
+		if ((vmr->vm_flags & MAP_HUGETLB) &&
+		    !map_jumbo_at_addr(p, vmr, va, vmr_pte_prot(vmr)))
+			goto out;
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -987,6 +1557,9 @@ refault:
 			ret = -ESPIPE; /* linux sends a SIGBUS at access time */
 			goto out;
 		}
+		/* Kick off read-ahead before we (possibly) block on this page */
+		if (first)
+			__hpf_readahead(vmr, f_idx);
 		ret = pm_load_page_nowait(vmr->vm_file->f_mapping, f_idx, &a_page);
 		if (ret) {
 			if (ret != -EAGAIN)
@@ -1019,11 +1592,11 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do this
 	 * separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
-	ret = map_page_at_addr(p, a_page, va, pte_prot);
+	ret = map_page_at_addr(p, a_page, va, vmr_pte_prot(vmr));
 	if (ret) {
 		printd("map_page_at for %p fails with %d\n", va, ret);
+	} else if (vmr->vm_file) {
+		__hpf_fault_around(p, vmr, va, vmr_pte_prot(vmr));
 	}
 	/* fall through, even for errors */
 out_put_pg:
@@ -1039,7 +1612,10 @@ out:
 
 int handle_page_fault(struct proc *p, uintptr_t va, int prot)
 {
-	return __hpf(p, va, prot, TRUE);
+	int ret = __hpf(p, va, prot, TRUE);
+
+	tracepoint(TP_PAGE_FAULT, va, prot, ret);
+	return ret;
 }
 
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot)
@@ -1071,7 +1647,7 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 		           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr->vm_file) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot)) {
+			if (populate_anon_va(p, vmr, va, nr_pgs_this_vmr, pte_prot)) {
 				/* on any error, we can just bail.  we might be underestimating
 				 * nr_filled. */
 				break;
@@ -1101,7 +1677,9 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 uintptr_t dyn_vmap_llim = KERN_DYN_TOP;
 spinlock_t dyn_vmap_lock = SPINLOCK_INITIALIZER;
 
-/* Reserve space in the kernel dynamic memory map area */
+/* Reserve space in the kernel dynamic memory map area.  Unlike the KERNBASE
+ * direct map, these are mapped with 4K pages (map_vmap_segment), so things like
+ * kstack guard pages work. */
 uintptr_t get_vmap_segment(unsigned long num_pages)
 {
 	uintptr_t retval;
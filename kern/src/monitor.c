@@ -719,7 +719,7 @@ int mon_trace(int argc, char **argv, struct hw_trapframe *hw_tf)
 				printk("No room to trace more processes\n");
 		} else if (!strcmp(argv[2], "stop")) {
 			/* Stop. To see the output, kfunc systrace_print and systrace_clear */
-			/* or cat #K/kptrace or /prof/kptrace */
+			/* or read the binary records from /prof/systrace (see strace -r) */
 			systrace_stop();
 		}
 	} else if (!strcmp(argv[1], "coretf")) {
@@ -919,6 +919,7 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 		printk("\tls DIR: print the dir tree starting with DIR\n");
 		printk("\tpid: proc PID's fs crap placeholder\n");
 		printk("\tpmflusher: start a ktask to keep flushing all PMs\n");
+		printk("\tbcache DEV: show the buffer cache stats of block device DEV\n");
 		return 1;
 	}
 	if (!strcmp(argv[1], "open")) {
@@ -952,14 +953,15 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 			printk("Superblock for %s\n", sb->s_name);
 			printk("DENTRY     FLAGS      REFCNT NAME\n");
 			printk("--------------------------------\n");
-			/* Hash helper */
-			void print_dcache_entry(void *item, void *opaque)
-			{
-				struct dentry *d_i = (struct dentry*)item;
-				printk("%p %p %02d     %s\n", d_i, d_i->d_flags,
-				       kref_refcnt(&d_i->d_kref), d_i->d_name.name);
+			for (int i = 0; i < DCACHE_NR_BUCKETS; i++) {
+				spin_lock(&sb->s_dcache[i].lock);
+				for (dentry = sb->s_dcache[i].head; dentry;
+				     dentry = dentry->d_hash_next)
+					printk("%p %p %02d     %s\n", dentry, dentry->d_flags,
+					       kref_refcnt(&dentry->d_kref),
+					       dentry->d_name.name);
+				spin_unlock(&sb->s_dcache[i].lock);
 			}
-			hash_for_each(sb->s_dcache, print_dcache_entry, NULL);
 		}
 		if (argc < 3)
 			return 0;
@@ -970,6 +972,10 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 				TAILQ_FOREACH(dentry, &sb->s_lru_d, d_lru)
 					printk("Dentry: %p, Name: %s\n", dentry,
 					       dentry->d_name.name);
+				printk("Negative (%d):\n", sb->s_nr_neg);
+				TAILQ_FOREACH(dentry, &sb->s_lru_neg, d_lru)
+					printk("Dentry: %p, Name: %s\n", dentry,
+					       dentry->d_name.name);
 			}
 		} else if (!strcmp(argv[2], "prune")) {
 			printk("Pruning unused dentries\n");
@@ -995,6 +1001,14 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 		/* whatever.  placeholder. */
 	} else if (!strcmp(argv[1], "pmflusher")) {
 		ktask("pm_flusher", pm_flusher, 0);
+	} else if (!strcmp(argv[1], "bcache")) {
+		if (argc != 3) {
+			printk("Give me a block device.\n");
+			return 1;
+		}
+		struct block_device *bdev = get_bdev(argv[2]);
+		print_bdev_bcache(bdev);
+		kref_put(&bdev->b_kref);
 	} else {
 		printk("Bad option\n");
 		return 1;
@@ -47,6 +47,11 @@
 enum {
 	NHASH = (1 << 6),
 	NCACHE = 256,
+	NREFRESH = 32,
+	Arpmaxhold = 16,	/* packets held per unresolved neighbor */
+
+	Arplife = 15 * 60 * 1000,	/* ms an entry lives without a reconfirm */
+	Arprefresh = 10 * 60 * 1000,	/* ms before we revalidate an entry in use */
 
 	AOK = 1,
 	AWAIT = 2,
@@ -58,11 +63,31 @@ char *arpstate[] = {
 	"WAIT",
 };
 
+/* hot-path counters, one per core so hits don't share a cache line */
+struct arpstat {
+	uint64_t hits;
+	uint64_t misses;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* an entry rxmitproc should resolve or revalidate with the medium */
+struct arprefresh {
+	uint8_t ip[IPaddrlen];
+	struct Ipifc *ifc;
+	uint8_t ifcid;
+};
+
 /*
  *  one per Fs
+ *
+ *  Lookups of resolved entries don't take the qlock.  Anything that changes
+ *  the hash chains or an entry's ip, mac, type, state or ctime does so under
+ *  the qlock, inside arpwbegin/arpwend, and readers retry (by falling back to
+ *  the locked path) if seq moved.  Entries live in cache[] and are never
+ *  freed, so a racing reader at worst walks a stale chain.
  */
 struct arp {
 	qlock_t qlock;
+	seq_ctr_t seq;
 	struct Fs *f;
 	struct arpent *hash[NHASH];
 	struct arpent cache[NCACHE];
@@ -70,6 +95,14 @@ struct arp {
 	struct proc *rxmitp;		/* neib sol re-transmit proc */
 	struct rendez rxmtq;
 	struct block *dropf, *dropl;
+	struct arprefresh refresh[NREFRESH];
+	int nrefresh;
+	struct arpstat *stats;
+	uint64_t resolutions;
+	uint64_t refreshes;
+	uint64_t expired;
+	uint64_t solicits;
+	uint64_t holddrops;
 };
 
 #define haship(s) ((s)[IPaddrlen-1]%NHASH)
@@ -77,9 +110,21 @@ struct arp {
 int ReTransTimer = RETRANS_TIMER;
 static void rxmitproc(void *v);
 
+static inline void arpwbegin(struct arp *arp)
+{
+	__seq_start_write(&arp->seq);
+}
+
+static inline void arpwend(struct arp *arp)
+{
+	__seq_end_write(&arp->seq);
+}
+
 void arpinit(struct Fs *f)
 {
 	f->arp = kzmalloc(sizeof(struct arp), KMALLOC_WAIT);
+	f->arp->stats = kzmalloc_align(num_cores * sizeof(struct arpstat),
+	                               KMALLOC_WAIT, ARCH_CL_SIZE);
 	qlock_init(&f->arp->qlock);
 	rendez_init(&f->arp->rxmtq);
 	f->arp->f = f;
@@ -135,6 +180,7 @@ static struct arpent *newarp6(struct arp *arp, uint8_t * ip, struct Ipifc *ifc,
 		}
 	}
 
+	arpwbegin(arp);
 	/* take out of current chain */
 	l = &arp->hash[haship(a->ip)];
 	for (f = *l; f; f = f->hash) {
@@ -153,7 +199,12 @@ static struct arpent *newarp6(struct arp *arp, uint8_t * ip, struct Ipifc *ifc,
 	memmove(a->ip, ip, sizeof(a->ip));
 	a->utime = NOW;
 	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
+	a->ftime = 0;
 	a->type = m;
+	/* callers set the real state, but it must not read as AOK with the old
+	 * entry's mac once we leave the write section. */
+	a->state = AWAIT;
+	arpwend(arp);
 
 	a->rtime = NOW + ReTransTimer;
 	a->rxtsrem = MAX_MULTICAST_SOLICIT;
@@ -191,6 +242,7 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 {
 	struct arpent *f, **l;
 
+	arpwbegin(arp);
 	a->utime = 0;
 	a->ctime = 0;
 	a->type = 0;
@@ -205,6 +257,7 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 		}
 		l = &f->hash;
 	}
+	arpwend(arp);
 
 	/* take out of re-transmit chain */
 	l = &arp->rxmt;
@@ -222,6 +275,117 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 	a->ifc = NULL;
 }
 
+/*
+ *  fill in the media address from a fresh, resolved entry without taking the
+ *  qlock.  returns false if there isn't one or we raced with a writer, in
+ *  which case the caller takes the locked path.
+ */
+static bool arpfastget(struct arp *arp, uint8_t *ip, struct medium *type,
+                       uint8_t *mac)
+{
+	struct arpent *a;
+	seq_ctr_t seq;
+	bool found = false;
+	int n = 0;
+
+	seq = ACCESS_ONCE(arp->seq);
+	rmb();
+	for (a = ACCESS_ONCE(arp->hash[haship(ip)]); a; a = ACCESS_ONCE(a->hash)) {
+		/* chains can be rewired under us; don't chase a cycle */
+		if (++n > NCACHE)
+			return false;
+		if (a->type == type && ipcmp(ip, a->ip) == 0)
+			break;
+	}
+	if (a && a->state == AOK && NOW - a->ctime < Arprefresh) {
+		memmove(mac, a->mac, type->maclen);
+		found = true;
+	}
+	if (seqctr_retry(seq, ACCESS_ONCE(arp->seq)))
+		return false;
+	/* racy, but utime only picks victims in newarp6 */
+	if (found)
+		a->utime = NOW;
+	return found;
+}
+
+/*
+ *  queue a for rxmitproc to send a request for, through the medium's arefresh.
+ *  returns false if the queue is full.  called with arp qlocked.
+ */
+static bool arpqueue(struct arp *arp, struct arpent *a)
+{
+	struct arprefresh *r;
+
+	if (arp->nrefresh == NREFRESH)
+		return false;
+	r = &arp->refresh[arp->nrefresh++];
+	memmove(r->ip, a->ip, sizeof(r->ip));
+	r->ifc = a->ifc;
+	r->ifcid = a->ifcid;
+	rendez_wakeup(&arp->rxmtq);
+	return true;
+}
+
+/*
+ *  ask rxmitproc to revalidate an entry that is still in use, so that it
+ *  doesn't expire under active traffic.  called with arp qlocked.
+ */
+static void arpqrefresh(struct arp *arp, struct arpent *a)
+{
+	if (a->ifc == NULL || a->type->arefresh == NULL)
+		return;
+	if (NOW - a->ftime < 1000)
+		return;
+	if (!arpqueue(arp, a))
+		return;
+	a->ftime = NOW;
+	arp->refreshes++;
+}
+
+/*
+ *  ask rxmitproc to send a request for an unresolved entry, so that the
+ *  sender doesn't build and transmit it inline.  returns false if we couldn't,
+ *  in which case the next packet for a will try again.  called with arp
+ *  qlocked, by the medium's bwrite.
+ */
+bool arpsolicit(struct arp *arp, struct arpent *a)
+{
+	if (a->ifc == NULL || a->type->arefresh == NULL)
+		return false;
+	if (!arpqueue(arp, a))
+		return false;
+	arp->solicits++;
+	return true;
+}
+
+/*
+ *  hold bp until a resolves, dropping the oldest held packet if a already has
+ *  Arpmaxhold of them.  called with arp qlocked.
+ */
+static void arphold(struct arp *arp, struct arpent *a, struct block *bp)
+{
+	struct block *xp;
+	int n = 0;
+
+	for (xp = a->hold; xp; xp = xp->list)
+		n++;
+	if (n >= Arpmaxhold) {
+		xp = a->hold;
+		a->hold = xp->list;
+		if (a->hold == NULL)
+			a->last = NULL;
+		freeblist(xp);
+		arp->holddrops++;
+	}
+	if (a->hold)
+		a->last->list = bp;
+	else
+		a->hold = bp;
+	a->last = bp;
+	bp->list = NULL;
+}
+
 /*
  *  fill in the media address if we have it.  Otherwise return an
  *  arpent that represents the state of the address resolution FSM
@@ -231,17 +395,22 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 					  struct Ipifc *ifc, uint8_t * ip, uint8_t * mac)
 {
-	int hash, len;
+	int hash;
 	struct arpent *a;
 	struct medium *type = ifc->m;
 	uint8_t v6ip[IPaddrlen];
-	uint16_t *s, *d;
 
 	if (version == V4) {
 		v4tov6(v6ip, ip);
 		ip = v6ip;
 	}
 
+	if (arpfastget(arp, ip, type, mac)) {
+		arp->stats[core_id()].hits++;
+		return NULL;
+	}
+	arp->stats[core_id()].misses++;
+
 	qlock(&arp->qlock);
 	hash = haship(ip);
 	for (a = arp->hash[hash]; a; a = a->hash) {
@@ -256,28 +425,20 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 	}
 	a->utime = NOW;
 	if (a->state == AWAIT) {
-		if (bp != NULL) {
-			if (a->hold)
-				a->last->list = bp;
-			else
-				a->hold = bp;
-			a->last = bp;
-			bp->list = NULL;
-		}
+		if (bp != NULL)
+			arphold(arp, a, bp);
 		return a;	/* return with arp qlocked */
 	}
 
-	s = (uint16_t *)a->mac;
-	d = (uint16_t *)mac;
-	len = a->type->maclen / 2;
-	while (len) {
-		*d++ = *s++;
-		len--;
-	}
+	memmove(mac, a->mac, a->type->maclen);
 
-	/* remove old entries */
-	if (NOW - a->ctime > 15 * 60 * 1000)
+	/* remove old entries, and revalidate ones that are getting there */
+	if (NOW - a->ctime > Arplife) {
 		cleanarpent(arp, a);
+		arp->expired++;
+	} else if (NOW - a->ctime >= Arprefresh) {
+		arpqrefresh(arp, a);
+	}
 
 	qunlock(&arp->qlock);
 	return NULL;
@@ -314,9 +475,12 @@ struct block *arpresolve(struct arp *arp, struct arpent *a, struct medium *type,
 		}
 	}
 
+	arpwbegin(arp);
 	memmove(a->mac, mac, type->maclen);
 	a->type = type;
 	a->state = AOK;
+	arpwend(arp);
+	arp->resolutions++;
 	a->utime = NOW;
 	bp = a->hold;
 	a->hold = NULL;
@@ -377,8 +541,13 @@ arpenter(struct Fs *fs, int version, uint8_t * ip, uint8_t * mac, int n,
 			continue;
 
 		if (ipcmp(a->ip, ip) == 0) {
+			if (a->state == AWAIT)
+				arp->resolutions++;
+			arpwbegin(arp);
 			a->state = AOK;
 			memmove(a->mac, mac, type->maclen);
+			a->ctime = NOW;
+			arpwend(arp);
 
 			if (version == V6) {
 				/* take out of re-transmit chain */
@@ -398,8 +567,7 @@ arpenter(struct Fs *fs, int version, uint8_t * ip, uint8_t * mac, int n,
 			a->hold = NULL;
 			if (version == V4)
 				ip += IPv4off;
-			a->utime = NOW;
-			a->ctime = a->utime;
+			a->utime = a->ctime;
 			qunlock(&arp->qlock);
 
 			while (bp) {
@@ -426,10 +594,12 @@ arpenter(struct Fs *fs, int version, uint8_t * ip, uint8_t * mac, int n,
 
 	if (refresh == 0) {
 		a = newarp6(arp, ip, ifc, 0);
+		arpwbegin(arp);
 		a->state = AOK;
 		a->type = type;
 		a->ctime = NOW;
 		memmove(a->mac, mac, type->maclen);
+		arpwend(arp);
 	}
 
 	qunlock(&arp->qlock);
@@ -459,6 +629,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	n = getfields(buf, f, 4, 1, " ");
 	if (strcmp(f[0], "flush") == 0) {
 		qlock(&arp->qlock);
+		arpwbegin(arp);
 		for (a = arp->cache; a < &arp->cache[NCACHE]; a++) {
 			memset(a->ip, 0, sizeof(a->ip));
 			memset(a->mac, 0, sizeof(a->mac));
@@ -472,6 +643,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 			}
 		}
 		memset(arp->hash, 0, sizeof(arp->hash));
+		arpwend(arp);
 		// clear all pkts on these lists (rxmt, dropf/l)
 		arp->rxmt = NULL;
 		arp->dropf = NULL;
@@ -511,6 +683,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 
 		parseip(ip, f[1]);
 		qlock(&arp->qlock);
+		arpwbegin(arp);
 
 		l = &arp->hash[haship(ip)];
 		for (a = *l; a; a = a->hash) {
@@ -540,6 +713,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 			memset(a->ip, 0, sizeof(a->ip));
 			memset(a->mac, 0, sizeof(a->mac));
 		}
+		arpwend(arp);
 		qunlock(&arp->qlock);
 	} else
 		error(EINVAL, ERROR_FIXME);
@@ -587,6 +761,40 @@ int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 	return n;
 }
 
+int arpstats(struct Fs *f, char *buf, int len)
+{
+	struct arp *arp = f->arp;
+	uint64_t hits = 0, misses = 0;
+	char *p, *e;
+
+	for (int i = 0; i < num_cores; i++) {
+		hits += arp->stats[i].hits;
+		misses += arp->stats[i].misses;
+	}
+	p = buf;
+	e = p + len;
+	p = seprintf(p, e, "ArpHits: %llu\n", hits);
+	p = seprintf(p, e, "ArpMisses: %llu\n", misses);
+	p = seprintf(p, e, "ArpResolutions: %llu\n", arp->resolutions);
+	p = seprintf(p, e, "ArpRefreshes: %llu\n", arp->refreshes);
+	p = seprintf(p, e, "ArpExpired: %llu\n", arp->expired);
+	p = seprintf(p, e, "ArpSolicits: %llu\n", arp->solicits);
+	p = seprintf(p, e, "ArpHoldDrops: %llu\n", arp->holddrops);
+	return p - buf;
+}
+
+/* called without the arp qlock; the medium may need to send through ipoput */
+static void arpdorefresh(struct arprefresh *r)
+{
+	struct Ipifc *ifc = r->ifc;
+
+	if (!canrlock(&ifc->rwlock))
+		return;
+	if (r->ifcid == ifc->ifcid && ifc->m != NULL && ifc->m->arefresh != NULL)
+		ifc->m->arefresh(ifc, r->ip);
+	runlock(&ifc->rwlock);
+}
+
 static uint64_t rxmitsols(struct arp *arp)
 {
 	unsigned int sflag;
@@ -596,6 +804,8 @@ static uint64_t rxmitsols(struct arp *arp)
 	uint8_t ipsrc[IPaddrlen];
 	struct Ipifc *ifc = NULL;
 	uint64_t nrxt;
+	struct arprefresh refresh[NREFRESH];
+	int nrefresh;
 
 	qlock(&arp->qlock);
 	f = arp->f;
@@ -665,12 +875,17 @@ dodrops:
 	xp = arp->dropf;
 	arp->dropf = NULL;
 	arp->dropl = NULL;
+	nrefresh = arp->nrefresh;
+	memmove(refresh, arp->refresh, nrefresh * sizeof(struct arprefresh));
+	arp->nrefresh = 0;
 	qunlock(&arp->qlock);
 
 	for (; xp; xp = next) {
 		next = xp->list;
 		icmphostunr(f, ifc, xp, icmp6_adr_unreach, 1);
 	}
+	for (int i = 0; i < nrefresh; i++)
+		arpdorefresh(&refresh[i]);
 
 	return nrxt;
 
@@ -681,7 +896,7 @@ static int rxready(void *v)
 	struct arp *arp = (struct arp *)v;
 	int x;
 
-	x = ((arp->rxmt != NULL) || (arp->dropf != NULL));
+	x = ((arp->rxmt != NULL) || (arp->dropf != NULL) || arp->nrefresh);
 
 	return x;
 }
@@ -39,6 +39,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <ros/ipconv.h>
 
 struct dev ipdevtab;
 
@@ -71,6 +72,7 @@ enum {
 	Qlocal,
 	Qremote,
 	Qstatus,
+	Qinfo,
 	Qsnoop,
 
 	Logtype = 5,
@@ -156,6 +158,9 @@ static int ip3gen(struct chan *c, int i, struct dir *dp)
 		case Qstatus:
 			p = "status";
 			break;
+		case Qinfo:
+			p = "info";
+			break;
 	}
 	return founddevdir(c, q, p, 0, cv->owner, 0444, dp);
 }
@@ -276,6 +281,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 		case Qlocal:
 		case Qremote:
 		case Qstatus:
+		case Qinfo:
 		case Qsnoop:
 			return ip3gen(c, TYPE(c->qid), dp);
 	}
@@ -315,6 +321,7 @@ static struct Fs *ipgetfs(int dev)
 		rwinit(&f->rwlock);
 		qlock_init(&f->iprouter.qlock);
 		ip_init(f);
+		routeinit(f);
 		arpinit(f);
 		netloginit(f);
 		for (i = 0; ipprotoinit[i]; i++)
@@ -423,6 +430,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 		case Qprotodir:
 		case Qconvdir:
 		case Qstatus:
+		case Qinfo:
 		case Qremote:
 		case Qlocal:
 		case Qstats:
@@ -725,6 +733,48 @@ enum {
 	Statelen = 32 * 1024,
 };
 
+static bool ipreadready(void *arg)
+{
+	struct conv *c = arg;
+
+	return qlen(c->rq) > 0 || qisclosed(c->rq);
+}
+
+/* With "busypoll USEC", a reader on an MCP spins on the NIC for up to USEC
+ * waiting for data, instead of sleeping until the RX interrupt, the driver's
+ * kthread and the stack get around to waking it. */
+static void ipbusypoll(struct conv *c)
+{
+	uint8_t *addr;
+
+	if (!c->busypoll || ipreadready(c))
+		return;
+	if (!current || !__proc_is_mcp(current))
+		return;
+	addr = ipcmp(c->raddr, IPnoaddr) != 0 ? c->raddr : c->laddr;
+	ipifcbusypoll(c->p->f, addr, c->busypoll, ipreadready, c);
+}
+
+/* The binary version of local, remote and (some of) status, so the socket shim
+ * can getsockname() without formatting and parsing text. */
+static long ipinforead(struct conv *c, char *buf, long n, uint32_t offset)
+{
+	struct ipconv_info info;
+
+	memset(&info, 0, sizeof(info));
+	ipmove(info.laddr, c->laddr);
+	ipmove(info.raddr, c->raddr);
+	info.lport = c->lport;
+	info.rport = c->rport;
+	info.ipversion = c->ipversion;
+	info.nonblock = c->nonblock;
+	info.reuseport = c->reuseport;
+	info.ttl = c->ttl;
+	info.tos = c->tos;
+	info.busypoll = c->busypoll;
+	return readmem(offset, buf, n, &info, sizeof(info));
+}
+
 static long ipread(struct chan *ch, void *a, long n, int64_t off)
 {
 	struct conv *c;
@@ -799,8 +849,12 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 			rv = readstr(offset, p, n, buf);
 			kfree(buf);
 			return rv;
+		case Qinfo:
+			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			return ipinforead(c, p, n, offset);
 		case Qdata:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			ipbusypoll(c);
 			return qread(c->rq, a, n);
 		case Qerr:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
@@ -831,6 +885,7 @@ static struct block *ipbread(struct chan *ch, long n, uint32_t offset)
 			f = ipfs[ch->dev];
 			x = f->p[PROTO(ch->qid)];
 			c = x->conv[CONV(ch->qid)];
+			ipbusypoll(c);
 			return qbread(c->rq, n);
 		default:
 			return devbread(ch, n, offset);
@@ -863,6 +918,10 @@ static void setluniqueport(struct conv *c, int lport)
 			break;
 		if (xp == c)
 			continue;
+		/* listeners that all asked for it can share a port */
+		if (xp->state == Announced && xp->reuseport && c->reuseport
+			&& strcmp(xp->owner, c->owner) == 0)
+			continue;
 		if ((xp->state == Connected || xp->state == Announced)
 			&& xp->lport == lport
 			&& xp->rport == c->rport
@@ -1034,6 +1093,8 @@ static void connectctlmsg(struct Proto *x, struct conv *c, struct cmdbuf *cb)
 	ERRSTACK(1);
 	char *p;
 
+	if (c->state == Connecting && c->nonblock)
+		error(EALREADY, "connect in progress");
 	if (c->state != 0)
 		error(EBUSY, ERROR_FIXME);
 	c->state = Connecting;
@@ -1042,6 +1103,10 @@ static void connectctlmsg(struct Proto *x, struct conv *c, struct cmdbuf *cb)
 		error(EFAIL, "connect not supported");
 	x->connect(c, cb->f, cb->nf);
 
+	/* Nonblocking convs don't wait for the handshake.  Fsconnected() fires the
+	 * data taps when it's done: WRITABLE on success, ERROR on failure. */
+	if (c->nonblock && !connected(c))
+		error(EINPROGRESS, "connect in progress");
 	qunlock(&c->qlock);
 	if (waserror()) {
 		qlock(&c->qlock);
@@ -1149,6 +1214,53 @@ err:
 	error(EINVAL, "nonblock [on|off]");
 }
 
+static void zerocopyctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		goto err;
+	if (!strcmp(cb->f[1], "on"))
+		qzerocopy(c->wq, TRUE);
+	else if (!strcmp(cb->f[1], "off"))
+		qzerocopy(c->wq, FALSE);
+	else
+		goto err;
+	return;
+err:
+	error(EINVAL, "zerocopy [on|off]");
+}
+
+/* Lets several convs announce the same port, for instance one per core, each
+ * with its own accept queue.  iphtlook() splits incoming flows between them by
+ * hash.  Has to come before the announce. */
+static void reuseportctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (c->state != Idle)
+		error(EBUSY, "reuseport must be set before announce");
+	if (cb->nf < 2)
+		goto err;
+	if (!strcmp(cb->f[1], "on"))
+		c->reuseport = TRUE;
+	else if (!strcmp(cb->f[1], "off"))
+		c->reuseport = FALSE;
+	else
+		goto err;
+	return;
+err:
+	error(EINVAL, "reuseport [on|off]");
+}
+
+static void busypollctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	long usec;
+
+	if (cb->nf < 2)
+		error(EINVAL, "busypoll USEC");
+	usec = strtol(cb->f[1], 0, 0);
+	if (usec < 0 || usec > 1000000)
+		error(EINVAL, "busypoll %ld usec out of range [0, 1000000]", usec);
+	c->busypoll = usec;
+}
+
 static void tosctlmsg(struct conv *c, struct cmdbuf *cb)
 {
 	if (cb->nf < 2)
@@ -1165,6 +1277,43 @@ static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->ttl = atoi(cb->f[1]);
 }
 
+/* Binary ctl messages, see ros/ipconv.h.  Called with the conv qlocked. */
+static void ipbinctlmsg(struct conv *c, void *a, long n)
+{
+	struct ipconv_ctl ctl;
+
+	if (n != sizeof(ctl))
+		error(EINVAL, "bad binary ctl size %ld", n);
+	memcpy(&ctl, a, sizeof(ctl));
+	switch (ctl.op) {
+		case IPCONV_CTL_NONBLOCK:
+			Fsconvnonblock(c, ctl.arg ? TRUE : FALSE);
+			break;
+		case IPCONV_CTL_REUSEPORT:
+			if (c->state != Idle)
+				error(EBUSY, "reuseport must be set before announce");
+			c->reuseport = ctl.arg ? TRUE : FALSE;
+			break;
+		case IPCONV_CTL_ZEROCOPY:
+			qzerocopy(c->wq, ctl.arg ? TRUE : FALSE);
+			break;
+		case IPCONV_CTL_TTL:
+			c->ttl = ctl.arg ? MIN(ctl.arg, MAXTTL) : MAXTTL;
+			break;
+		case IPCONV_CTL_TOS:
+			c->tos = ctl.arg;
+			break;
+		case IPCONV_CTL_BUSYPOLL:
+			if (ctl.arg > 1000000)
+				error(EINVAL, "busypoll %u usec out of range [0, 1000000]",
+				      ctl.arg);
+			c->busypoll = ctl.arg;
+			break;
+		default:
+			error(EINVAL, "unknown binary ctl op %d", ctl.op);
+	}
+}
+
 static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 {
 	ERRSTACK(1);
@@ -1199,6 +1348,17 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 		case Qctl:
 			x = f->p[PROTO(ch->qid)];
 			c = x->conv[CONV(ch->qid)];
+			if (n && !a[0]) {
+				qlock(&c->qlock);
+				if (waserror()) {
+					qunlock(&c->qlock);
+					nexterror();
+				}
+				ipbinctlmsg(c, a, n);
+				qunlock(&c->qlock);
+				poperror();
+				break;
+			}
 			cb = parsecmd(a, n);
 
 			qlock(&c->qlock);
@@ -1217,10 +1377,16 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 				bindctlmsg(x, c, cb);
 			else if (strcmp(cb->f[0], "nonblock") == 0)
 				nonblockctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "zerocopy") == 0)
+				zerocopyctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "reuseport") == 0)
+				reuseportctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ttl") == 0)
 				ttlctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "tos") == 0)
 				tosctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "busypoll") == 0)
+				busypollctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
@@ -1278,10 +1444,19 @@ static long ipbwrite(struct chan *ch, struct block *bp, uint32_t offset)
 	}
 }
 
+static void fire_data_taps(struct conv *conv, int filter)
+{
+	struct fd_tap *tap_i;
+
+	spin_lock(&conv->tap_lock);
+	SLIST_FOREACH(tap_i, &conv->data_taps, link)
+		fire_tap(tap_i, filter);
+	spin_unlock(&conv->tap_lock);
+}
+
 static void ip_wake_cb(struct queue *q, void *data, int filter)
 {
 	struct conv *conv = (struct conv*)data;
-	struct fd_tap *tap_i;
 	/* For these two, we want to ignore events on the opposite end of the
 	 * queues.  For instance, we want to know when the WQ is writable.  Our
 	 * writes will actually make it readable - we don't want to trigger a tap
@@ -1308,10 +1483,7 @@ static void ip_wake_cb(struct queue *q, void *data, int filter)
 	 * - if fire_tap takes a while, holding the lock only slows down other
 	 * events on this *same* conversation, or other tap registration.  not a
 	 * huge deal. */
-	spin_lock(&conv->tap_lock);
-	SLIST_FOREACH(tap_i, &conv->data_taps, link)
-		fire_tap(tap_i, filter);
-	spin_unlock(&conv->tap_lock);
+	fire_data_taps(conv, filter);
 }
 
 int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
@@ -1357,6 +1529,10 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 					}
 					ret = 0;
 					break;
+				case (FDTAP_CMD_MOD):
+					/* filter checked above; fdtap updates the tap */
+					ret = 0;
+					break;
 				default:
 					set_errno(ENOSYS);
 					set_errstr("Unsupported #%s data tap command %p",
@@ -1382,6 +1558,9 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 					SLIST_REMOVE(&conv->listen_taps, tap, fd_tap, link);
 					ret = 0;
 					break;
+				case (FDTAP_CMD_MOD):
+					ret = 0;
+					break;
 				default:
 					set_errno(ENOSYS);
 					set_errstr("Unsupported #%s listen tap command %p",
@@ -1529,6 +1708,9 @@ retry:
 	c->ttl = MAXTTL;
 	c->tos = DFLTTOS;
 	c->nonblock = FALSE;
+	c->busypoll = 0;
+	c->reuseport = FALSE;
+	c->pacing_rate = 0;
 	qreopen(c->rq);
 	qreopen(c->wq);
 	qreopen(c->eq);
@@ -1549,6 +1731,8 @@ int Fsconnected(struct conv *c, char *msg)
 
 		case Connecting:
 			c->state = Connected;
+			fire_data_taps(c, c->cerr[0] ? FDTAP_FILT_ERROR
+			                             : FDTAP_FILT_WRITABLE);
 			break;
 	}
 
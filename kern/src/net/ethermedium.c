@@ -67,6 +67,10 @@ static void etherremmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * ia);
 static struct block *multicastarp(struct Fs *f, struct arpent *a,
 								  struct medium *, uint8_t * mac);
 static void sendarp(struct Ipifc *ifc, struct arpent *a);
+static void etherarpreq(struct Ipifc *ifc, uint8_t *ip);
+static void etherrefresh(struct Ipifc *ifc, uint8_t *ip);
+static bool etherpoll(struct Ipifc *ifc, uint64_t usec, bool (*done)(void *),
+                      void *arg);
 static void sendgarp(struct Ipifc *ifc, uint8_t * unused_uint8_p_t);
 static int multicastea(uint8_t * ea, uint8_t * ip);
 static void recvarpproc(void *);
@@ -86,6 +90,8 @@ struct medium ethermedium = {
 	.remmulti = etherremmulti,
 	.ares = arpenter,
 	.areg = sendgarp,
+	.arefresh = etherrefresh,
+	.busypoll = etherpoll,
 	.pref2addr = etherpref2addr,
 };
 
@@ -102,6 +108,8 @@ struct medium trexmedium = {
 	.remmulti = etherremmulti,
 	.ares = arpenter,
 	.areg = sendgarp,
+	.arefresh = etherrefresh,
+	.busypoll = etherpoll,
 	.pref2addr = etherpref2addr,
 };
 
@@ -163,6 +171,8 @@ static unsigned int parsefeat(char *ptr)
 		feat |= NETF_SG;
 	if (strstr(ptr, "tso"))
 		feat |= NETF_TSO;
+	if (strstr(ptr, "uso"))
+		feat |= NETF_USO;
 	return feat;
 }
 
@@ -260,6 +270,8 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	} else {
 		ifc->feat = 0;
 	}
+	/* devether segments TSO and USO blocks itself if the NIC can't */
+	ifc->feat |= NETF_TSO | NETF_USO;
 	/*
 	 *  open arp conversation
 	 */
@@ -549,12 +561,11 @@ static void etherremmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
  *  send an ethernet arp
  *  (only v4, v6 uses the neighbor discovery, rfc1970)
  *
- * May drop packets on stale arps. */
+ *  the request itself goes out from the arp ktask (through etherrefresh), so
+ *  the sender only queues it.  arpget holds a bounded number of packets for a
+ *  meanwhile, which go out when the reply comes in. */
 static void sendarp(struct Ipifc *ifc, struct arpent *a)
 {
-	int n;
-	struct block *bp;
-	Etherarp *e;
 	Etherrock *er = ifc->arg;
 
 	/* don't do anything if it's been less than a second since the last.  ctime
@@ -566,26 +577,29 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 		return;
 	}
 
-	/* remove all but the last message.  brho: this might be unnecessary.  we'll
-	 * eventually send them.  but they should be quite stale at this point. */
-	while ((bp = a->hold) != NULL) {
-		if (bp == a->last)
-			break;
-		a->hold = bp->list;
-		freeblist(bp);
-	}
-
-	/* update last sent time */
-	a->ctime = NOW;
+	/* update last sent time, unless we couldn't queue it */
+	if (arpsolicit(er->f->arp, a))
+		a->ctime = NOW;
 	arprelease(er->f->arp, a);
+}
+
+/*
+ *  broadcast an arp request for ip, a v4 address in v6 form.
+ */
+static void etherarpreq(struct Ipifc *ifc, uint8_t *ip)
+{
+	int n;
+	struct block *bp;
+	Etherarp *e;
+	Etherrock *er = ifc->arg;
 
 	n = sizeof(Etherarp);
-	if (n < a->type->mintu)
-		n = a->type->mintu;
+	if (n < ifc->m->mintu)
+		n = ifc->m->mintu;
 	bp = allocb(n);
 	memset(bp->rp, 0, n);
 	e = (Etherarp *) bp->rp;
-	memmove(e->tpa, a->ip + IPv4off, sizeof(e->tpa));
+	memmove(e->tpa, ip + IPv4off, sizeof(e->tpa));
 	ipv4local(ifc, e->spa);
 	memmove(e->sha, ifc->mac, sizeof(e->sha));
 	memset(e->d, 0xff, sizeof(e->d));	/* ethernet broadcast */
@@ -604,6 +618,38 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 		printd("arp: send: %r\n");
 }
 
+/*
+ *  revalidate a resolved neighbor that is still in use.  the entry stays
+ *  usable meanwhile; the reply refreshes it through arpenter.  called from
+ *  the arp ktask with ifc rlocked.
+ */
+static void etherrefresh(struct Ipifc *ifc, uint8_t *ip)
+{
+	int sflag;
+	Etherrock *er = ifc->arg;
+	uint8_t ipsrc[IPaddrlen];
+
+	if (isv4(ip)) {
+		etherarpreq(ifc, ip);
+		return;
+	}
+	if ((sflag = ipv6anylocal(ifc, ipsrc)))
+		icmpns(er->f, ipsrc, sflag, ip, TARG_UNI, ifc->mac);
+}
+
+/*
+ *  spin on the nic under the v4 data channel; v6 shares the device.
+ */
+static bool etherpoll(struct Ipifc *ifc, uint64_t usec, bool (*done)(void *),
+                      void *arg)
+{
+	Etherrock *er = ifc->arg;
+
+	if (er->mchan4 == NULL)
+		return FALSE;
+	return etherbusypoll(er->mchan4, usec, done, arg);
+}
+
 static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 {
 	int sflag;
@@ -719,7 +765,11 @@ static void recvarp(struct Ipifc *ifc)
 				break;
 			}
 
-			arpenter(er->f, V4, e->spa, e->sha, sizeof(e->sha), 0);
+			/* a gratuitous reply (announcing spa, not answering us) only
+			 * updates an entry we already have.  we don't want every host
+			 * that announces itself taking a slot from neighbors in use. */
+			arpenter(er->f, V4, e->spa, e->sha, sizeof(e->sha),
+			         !memcmp(e->spa, e->tpa, sizeof(e->spa)));
 			break;
 
 		case ARPREQUEST:
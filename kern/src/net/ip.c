@@ -54,6 +54,12 @@ enum {
 	IP_MF = 0x2000,	/* More fragments */
 	IP6FHDR = 8,	/* sizeof(Fraghdr6) */
 	IP_MAX = 64 * 1024,	/* Maximum Internet packet size */
+
+	Nfraghash4 = 256,	/* v4 reassembly hash buckets */
+	Nfragq4 = 1024,		/* v4 reassembly queues */
+	Fraglife = 30 * 1000,	/* ms a reassembly queue may live */
+	Fragqmem = 2 * IP_MAX,	/* bytes one queue may hold */
+	Fragmem = 4 * 1024 * 1024,	/* bytes all v4 queues may hold */
 };
 
 #define BLKIPVER(xp)	(((struct Ip4hdr*)((xp)->rp))->vihl&0xF0)
@@ -99,12 +105,36 @@ enum {
 
 struct fragment4 {
 	struct block *blist;
-	struct fragment4 *next;
+	struct fragment4 *next;		/* hash chain, or free list */
+	TAILQ_ENTRY(fragment4) link;	/* age list */
 	uint32_t src;
 	uint32_t dst;
 	uint16_t id;
+	uint8_t proto;
+	uint16_t bucket;
+	uint32_t bytes;
 	uint64_t age;
 };
+TAILQ_HEAD(fragment4_tailq, fragment4);
+
+/*
+ *  v4 reassembly queues, hashed on (src, dst, id, proto).  Every queue lives
+ *  for Fraglife, so the age list is oldest first and one alarm, set for its
+ *  head, expires them all.  The alarm handler runs from a routine kmsg, so
+ *  this is a spinlock, and blocks are freed after dropping it.
+ */
+struct fragtab4 {
+	spinlock_t lock;
+	uint32_t seed;
+	struct fragment4 *hash[Nfraghash4];
+	struct fragment4_tailq age;
+	struct fragment4 *free;
+	uint32_t bytes;				/* held by all queues */
+	struct alarm_waiter alarm;
+	bool armed;
+	struct IP *ip;
+	struct fragment4 pool[Nfragq4];
+};
 
 struct fragment6 {
 	struct block *blist;
@@ -124,9 +154,7 @@ struct Ipfrag {
 struct IP {
 	uint32_t stats[Nstats];
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
+	struct fragtab4 *frag4;
 	int id4;
 
 	qlock_t fraglock6;
@@ -169,8 +197,7 @@ static char *statnames[] = {
 uint16_t ipcsum(uint8_t * unused_uint8_p_t);
 struct block *ip4reassemble(struct IP *, int unused_int,
 							struct block *, struct Ip4hdr *);
-void ipfragfree4(struct IP *, struct fragment4 *);
-struct fragment4 *ipfragallo4(struct IP *);
+static void fragexpire4(struct alarm_waiter *waiter);
 
 void ip_init_6(struct Fs *f)
 {
@@ -196,21 +223,27 @@ void ip_init_6(struct Fs *f)
 
 }
 
-void initfrag(struct IP *ip, int size)
+static void initfrag4(struct IP *ip)
 {
-	struct fragment4 *fq4, *eq4;
-	struct fragment6 *fq6, *eq6;
-
-	ip->fragfree4 =
-		(struct fragment4 *)kzmalloc(sizeof(struct fragment4) * size, 0);
-	if (ip->fragfree4 == NULL)
-		panic("initfrag");
+	struct fragtab4 *t;
+	int i;
 
-	eq4 = &ip->fragfree4[size];
-	for (fq4 = ip->fragfree4; fq4 < eq4; fq4++)
-		fq4->next = fq4 + 1;
+	t = kzmalloc(sizeof(struct fragtab4), KMALLOC_WAIT);
+	spinlock_init(&t->lock);
+	urandom_read(&t->seed, sizeof(t->seed));
+	TAILQ_INIT(&t->age);
+	for (i = 0; i < Nfragq4; i++) {
+		t->pool[i].next = t->free;
+		t->free = &t->pool[i];
+	}
+	init_awaiter(&t->alarm, fragexpire4);
+	t->ip = ip;
+	ip->frag4 = t;
+}
 
-	ip->fragfree4[size - 1].next = NULL;
+void initfrag(struct IP *ip, int size)
+{
+	struct fragment6 *fq6, *eq6;
 
 	ip->fragfree6 =
 		(struct fragment6 *)kzmalloc(sizeof(struct fragment6) * size, 0);
@@ -229,8 +262,8 @@ void ip_init(struct Fs *f)
 	struct IP *ip;
 
 	ip = kzmalloc(sizeof(struct IP), 0);
-	qlock_init(&ip->fraglock4);
 	qlock_init(&ip->fraglock6);
+	initfrag4(ip);
 	initfrag(ip, 100);
 	f->ip = ip;
 
@@ -323,7 +356,7 @@ ipoput4(struct Fs *f,
 
 	/* If we dont need to fragment just send it */
 	medialen = ifc->maxtu - ifc->m->hsize;
-	if (bp->flag & Btso || len <= medialen) {
+	if (bp->flag & (Btso | Buso) || len <= medialen) {
 		if (!gating)
 			hnputs(eh->id, NEXT_ID(ip->id4));
 		hnputs(eh->length, len);
@@ -334,7 +367,7 @@ ipoput4(struct Fs *f,
 		eh->cksum[0] = 0;
 		eh->cksum[1] = 0;
 		hnputs(eh->cksum, ipcsum(&eh->vihl));
-		ifc->m->bwrite(ifc, bp, V4, gate);
+		ipifcoput(ifc, bp, V4, gate, c);
 		runlock(&ifc->rwlock);
 		poperror();
 		return 0;
@@ -402,7 +435,7 @@ ipoput4(struct Fs *f,
 		feh->cksum[0] = 0;
 		feh->cksum[1] = 0;
 		hnputs(feh->cksum, ipcsum(&feh->vihl));
-		ifc->m->bwrite(ifc, nb, V4, gate);
+		ipifcoput(ifc, nb, V4, gate, c);
 		ip->stats[FragCreates]++;
 	}
 	ip->stats[FragOKs]++;
@@ -526,6 +559,12 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 			}
 		}
 
+		/* GRO'd TCP segments get resegmented on the way out */
+		if (bp->flag & Btso) {
+			bp->flag = (bp->flag & ~BCKSUM_FLAGS) | Btso | Btcpck;
+			bp->checksum_start = IP4HDR;
+			bp->checksum_offset = 16;
+		}
 		ip->stats[ForwDatagrams]++;
 		tos = h->tos;
 		hop = h->ttl;
@@ -576,19 +615,124 @@ int ipstats(struct Fs *f, char *buf, int len)
 	return p - buf;
 }
 
+static uint32_t fraghash4(struct fragtab4 *t, uint32_t src, uint32_t dst,
+                          uint16_t id, uint8_t proto)
+{
+	uint32_t h = t->seed ^ (id << 8 | proto);
+
+	h = (h ^ src) * 0x9e3779b1 ^ dst;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h % Nfraghash4;
+}
+
+/* Drops blocks chained on ->list by fragunlink4 and friends. */
+static void fragfreedead(struct block *dead)
+{
+	struct block *next;
+
+	for (; dead; dead = next) {
+		next = dead->list;
+		freeblist(dead);
+	}
+}
+
+/*
+ *  take a queue out of the table and put it on the free list.  its blocks are
+ *  added to dead, for the caller to free once it drops the lock.
+ */
+static struct block *fragunlink4(struct fragtab4 *t, struct fragment4 *f,
+                                 struct block *dead)
+{
+	struct fragment4 **l;
+
+	for (l = &t->hash[f->bucket]; *l != f; l = &(*l)->next)
+		;
+	*l = f->next;
+	TAILQ_REMOVE(&t->age, f, link);
+	t->bytes -= f->bytes;
+	if (f->blist) {
+		f->blist->list = dead;
+		dead = f->blist;
+		f->blist = NULL;
+	}
+	f->next = t->free;
+	t->free = f;
+	return dead;
+}
+
+/* Arms the alarm for the oldest queue, if it isn't already.  Hold t->lock. */
+static void fragarm4(struct fragtab4 *t)
+{
+	struct fragment4 *f = TAILQ_FIRST(&t->age);
+	uint64_t now = NOW;
+
+	if (t->armed || f == NULL)
+		return;
+	t->armed = true;
+	set_awaiter_rel(&t->alarm, f->age > now ? (f->age - now) * 1000 : 0);
+	set_alarm(&per_cpu_info[core_id()].tchain, &t->alarm);
+}
+
+static void fragexpire4(struct alarm_waiter *waiter)
+{
+	struct fragtab4 *t = container_of(waiter, struct fragtab4, alarm);
+	struct fragment4 *f;
+	struct block *dead = NULL;
+
+	spin_lock(&t->lock);
+	while ((f = TAILQ_FIRST(&t->age)) != NULL && f->age <= NOW) {
+		t->ip->stats[ReasmTimeout]++;
+		dead = fragunlink4(t, f, dead);
+	}
+	t->armed = false;
+	fragarm4(t);
+	spin_unlock(&t->lock);
+	fragfreedead(dead);
+}
+
+/*
+ *  make room for len more bytes, dropping the oldest queues other than keep.
+ *  returns a free queue if keep is NULL.  hold t->lock.
+ */
+static struct fragment4 *fragroom4(struct fragtab4 *t, struct fragment4 *keep,
+                                   uint32_t len, struct block **dead)
+{
+	struct fragment4 *f, *victim;
+
+	while (t->bytes + len > Fragmem || (keep == NULL && t->free == NULL)) {
+		victim = TAILQ_FIRST(&t->age);
+		if (victim == keep)
+			victim = TAILQ_NEXT(victim, link);
+		if (victim == NULL)
+			break;
+		t->ip->stats[ReasmFails]++;
+		*dead = fragunlink4(t, victim, *dead);
+	}
+	if (keep != NULL)
+		return keep;
+	f = t->free;
+	t->free = f->next;
+	return f;
+}
+
 struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 							struct Ip4hdr *ih)
 {
+	struct fragtab4 *t = ip->frag4;
 	int fend;
 	uint16_t id;
-	struct fragment4 *f, *fnext;
-	uint32_t src, dst;
-	struct block *bl, **l, *last, *prev;
+	uint8_t proto;
+	struct fragment4 *f;
+	uint32_t src, dst, h;
+	struct block *bl, **l, *last, *prev, *dead = NULL;
 	int ovlap, len, fragsize, pktposn;
 
 	src = nhgetl(ih->src);
 	dst = nhgetl(ih->dst);
 	id = nhgets(ih->id);
+	proto = ih->proto;
 
 	/*
 	 *  block lists are too hard, pullupblock into a single block
@@ -598,19 +742,23 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 		ih = (struct Ip4hdr *)(bp->rp);
 	}
 
-	qlock(&ip->fraglock4);
+	/* padblock can block, so do it before taking the lock */
+	if (bp->base + sizeof(struct Ipfrag) >= bp->rp) {
+		bp = padblock(bp, sizeof(struct Ipfrag));
+		bp->rp += sizeof(struct Ipfrag);
+		ih = (struct Ip4hdr *)(bp->rp);
+	}
+
+	spin_lock(&t->lock);
 
 	/*
 	 *  find a reassembly queue for this fragment
 	 */
-	for (f = ip->flisthead4; f; f = fnext) {
-		fnext = f->next;	/* because ipfragfree4 changes the list */
-		if (f->src == src && f->dst == dst && f->id == id)
+	h = fraghash4(t, src, dst, id, proto);
+	for (f = t->hash[h]; f; f = f->next) {
+		if (f->src == src && f->dst == dst && f->id == id
+		    && f->proto == proto)
 			break;
-		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
-			ipfragfree4(ip, f);
-		}
 	}
 
 	/*
@@ -620,35 +768,54 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 	 */
 	if (!ih->tos && (offset & ~(IP_MF | IP_DF)) == 0) {
 		if (f != NULL) {
-			ipfragfree4(ip, f);
+			dead = fragunlink4(t, f, dead);
 			ip->stats[ReasmFails]++;
 		}
-		qunlock(&ip->fraglock4);
+		spin_unlock(&t->lock);
+		fragfreedead(dead);
 		return bp;
 	}
 
-	if (bp->base + sizeof(struct Ipfrag) >= bp->rp) {
-		bp = padblock(bp, sizeof(struct Ipfrag));
-		bp->rp += sizeof(struct Ipfrag);
-	}
-
 	BKFG(bp)->foff = offset << 3;
 	BKFG(bp)->flen = nhgets(ih->length) - IP4HDR;
 
 	/* First fragment allocates a reassembly queue */
 	if (f == NULL) {
-		f = ipfragallo4(ip);
+		f = fragroom4(t, NULL, BLEN(bp), &dead);
 		f->id = id;
 		f->src = src;
 		f->dst = dst;
+		f->proto = proto;
+		f->bucket = h;
+		f->next = t->hash[h];
+		t->hash[h] = f;
+		f->age = NOW + Fraglife;
+		TAILQ_INSERT_TAIL(&t->age, f, link);
 
 		f->blist = bp;
+		f->bytes = BLEN(bp);
+		t->bytes += f->bytes;
+		fragarm4(t);
 
-		qunlock(&ip->fraglock4);
+		spin_unlock(&t->lock);
+		fragfreedead(dead);
 		ip->stats[ReasmReqds]++;
 		return NULL;
 	}
 
+	/* no real datagram needs this much; someone is feeding us overlaps */
+	if (f->bytes + BLEN(bp) > Fragqmem) {
+		dead = fragunlink4(t, f, dead);
+		spin_unlock(&t->lock);
+		ip->stats[ReasmFails]++;
+		fragfreedead(dead);
+		freeblist(bp);
+		return NULL;
+	}
+	fragroom4(t, f, BLEN(bp), &dead);
+	f->bytes += BLEN(bp);
+	t->bytes += BLEN(bp);
+
 	/*
 	 *  find the new fragment's position in the queue
 	 */
@@ -666,8 +833,9 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 		ovlap = BKFG(prev)->foff + BKFG(prev)->flen - BKFG(bp)->foff;
 		if (ovlap > 0) {
 			if (ovlap >= BKFG(bp)->flen) {
+				spin_unlock(&t->lock);
+				fragfreedead(dead);
 				freeblist(bp);
-				qunlock(&ip->fraglock4);
 				return NULL;
 			}
 			BKFG(prev)->flen -= ovlap;
@@ -697,7 +865,8 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 			}
 			last = (*l)->next;
 			(*l)->next = NULL;
-			freeblist(*l);
+			(*l)->list = dead;
+			dead = *l;
 			*l = last;
 		}
 	}
@@ -727,86 +896,27 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 
 			bl = f->blist;
 			f->blist = NULL;
-			ipfragfree4(ip, f);
+			dead = fragunlink4(t, f, dead);
+			spin_unlock(&t->lock);
+			fragfreedead(dead);
 			ih = BLKIP(bl);
 			hnputs(ih->length, len);
-			qunlock(&ip->fraglock4);
 			ip->stats[ReasmOKs]++;
 			return bl;
 		}
 		pktposn += BKFG(bl)->flen;
 	}
-	qunlock(&ip->fraglock4);
+	spin_unlock(&t->lock);
+	fragfreedead(dead);
 	return NULL;
 }
 
-/*
- * ipfragfree4 - Free a list of fragments - assume hold fraglock4
- */
-void ipfragfree4(struct IP *ip, struct fragment4 *frag)
-{
-	struct fragment4 *fl, **l;
-
-	if (frag->blist)
-		freeblist(frag->blist);
-
-	frag->src = 0;
-	frag->id = 0;
-	frag->blist = NULL;
-
-	l = &ip->flisthead4;
-	for (fl = *l; fl; fl = fl->next) {
-		if (fl == frag) {
-			*l = frag->next;
-			break;
-		}
-		l = &fl->next;
-	}
-
-	frag->next = ip->fragfree4;
-	ip->fragfree4 = frag;
-
-}
-
-/*
- * ipfragallo4 - allocate a reassembly queue - assume hold fraglock4
- */
-struct fragment4 *ipfragallo4(struct IP *ip)
-{
-	struct fragment4 *f;
-
-	while (ip->fragfree4 == NULL) {
-		/* free last entry on fraglist */
-		for (f = ip->flisthead4; f->next; f = f->next) ;
-		ipfragfree4(ip, f);
-	}
-	f = ip->fragfree4;
-	ip->fragfree4 = f->next;
-	f->next = ip->flisthead4;
-	ip->flisthead4 = f;
-	f->age = NOW + 30000;
-
-	return f;
-}
-
 /* coreboot.c among other things needs this
  * type of checksum.
  */
 uint16_t ipchecksum(uint8_t *addr, int len)
 {
-	uint16_t sum = 0;
-
-	while (len > 0) {
-		sum += addr[0] << 8 | addr[1];
-		len -= 2;
-		addr += 2;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	return (sum ^ 0xffff);
-
+	return ~ptclbsum(addr, len) & 0xffff;
 }
 
 /* change this to call ipchecksum later.
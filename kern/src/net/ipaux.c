@@ -589,16 +589,104 @@ uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
 	uint32_t ret;
 	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
 		^ dp;
-	ret %= Nhash;
+	ret %= Nipht;
 	return ret;
 }
 
+/* Hash for the conns table.  Mixes in all of both addresses, so v6 peers that
+ * share a low byte still spread, and a per-table seed, so a peer picking its
+ * ports can't aim for one bucket. */
+static uint32_t iphashconn(struct Ipht *ht, uint8_t *sa, uint16_t sp,
+                           uint8_t *da, uint16_t dp)
+{
+	uint32_t h = ht->seed ^ (sp << 16 | dp);
+	int i;
+
+	for (i = 0; i < IPaddrlen; i += 4)
+		h = (h ^ nhgetl(sa + i)) * 0x9e3779b1 ^ nhgetl(da + i);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h;
+}
+
+static struct Iphtab *iphtaballoc(uint32_t nb)
+{
+	struct Iphtab *t;
+
+	t = kzmalloc(sizeof(struct Iphtab) + nb * sizeof(struct Iphash *), 0);
+	if (t != NULL)
+		t->mask = nb - 1;
+	return t;
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	qlock_init(&ht->lock);
+	urandom_read(&ht->seed, sizeof(ht->seed));
+	ht->conns = iphtaballoc(Niphtconns);
+	if (ht->conns == NULL)
+		panic("iphtinit: no memory");
+}
+
+static void __iphash_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct Iphash, rcu));
+}
+
+static void __iphtab_free_rcu(struct rcu_head *head)
+{
+	struct Iphtab *t = container_of(head, struct Iphtab, rcu);
+	struct Iphash *h, *next;
+	uint32_t i;
+
+	for (i = 0; i <= t->mask; i++) {
+		for (h = t->b[i]; h != NULL; h = next) {
+			next = h->next;
+			kfree(h);
+		}
+	}
+	kfree(t);
+}
+
+/* Doubles conns.  Readers may be walking the old table, so its entries stay
+ * put and the new table gets copies; both go away after a grace period.
+ * Called with ht->lock held. */
+static void iphtgrow(struct Ipht *ht)
+{
+	struct Iphtab *old = ht->conns, *new;
+	struct Iphash *h, *n;
+	struct conv *c;
+	uint32_t i, hv;
+
+	new = iphtaballoc((old->mask + 1) * 2);
+	if (new == NULL)
+		return;
+	for (i = 0; i <= old->mask; i++) {
+		for (h = old->b[i]; h != NULL; h = h->next) {
+			n = kzmalloc(sizeof(*n), 0);
+			if (n == NULL) {
+				/* never published, so free it now */
+				__iphtab_free_rcu(&new->rcu);
+				return;
+			}
+			c = h->c;
+			n->c = c;
+			n->match = h->match;
+			hv = iphashconn(ht, c->raddr, c->rport, c->laddr, c->lport);
+			n->next = new->b[hv & new->mask];
+			new->b[hv & new->mask] = n;
+		}
+	}
+	rcu_assign_pointer(ht->conns, new);
+	call_rcu(&old->rcu, __iphtab_free_rcu);
+}
+
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
-	struct Iphash *h;
+	struct Iphash *h, **l;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
 	h = kzmalloc(sizeof(*h), 0);
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
 		h->match = IPmatchexact;
@@ -617,102 +705,152 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 	}
 	h->c = c;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	qlock(&ht->lock);
+	if (h->match == IPmatchexact) {
+		if (++ht->nconns > ht->conns->mask + 1)
+			iphtgrow(ht);
+		hv = iphashconn(ht, c->raddr, c->rport, c->laddr, c->lport);
+		l = &ht->conns->b[hv & ht->conns->mask];
+	} else {
+		l = &ht->listen[iphash(c->raddr, c->rport, c->laddr, c->lport)];
+	}
+	h->next = *l;
+	rcu_assign_pointer(*l, h);
+	qunlock(&ht->lock);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
 	struct Iphash **l, *h;
+	bool conn = ipcmp(c->raddr, IPnoaddr) != 0;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
+	qlock(&ht->lock);
+	if (conn) {
+		hv = iphashconn(ht, c->raddr, c->rport, c->laddr, c->lport);
+		l = &ht->conns->b[hv & ht->conns->mask];
+	} else {
+		l = &ht->listen[iphash(c->raddr, c->rport, c->laddr, c->lport)];
+	}
+	for (; (*l) != NULL; l = &(*l)->next)
 		if ((*l)->c == c) {
 			h = *l;
-			(*l) = h->next;
-			kfree(h);
+			rcu_assign_pointer(*l, h->next);
+			call_rcu(&h->rcu, __iphash_free_rcu);
+			if (conn)
+				ht->nconns--;
 			break;
 		}
-	spin_unlock(&ht->lock);
+	qunlock(&ht->lock);
 }
 
-/* look for a matching conversation with the following precedence
- *	connected && raddr,rport,laddr,lport
- *	announced && laddr,lport
- *	announced && *,lport
- *	announced && laddr,*
- *	announced && *,*
- */
-struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
-					  uint16_t dp)
+/* Connected convs only: raddr,rport,laddr,lport */
+struct conv *iphtlookconn(struct Ipht *ht, uint8_t *sa, uint16_t sp,
+                          uint8_t *da, uint16_t dp)
 {
-	uint32_t hv;
+	struct Iphtab *t;
 	struct Iphash *h;
-	struct conv *c;
+	struct conv *c, *ret = NULL;
 
-	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
+	rcu_read_lock();
+	t = rcu_dereference(ht->conns);
+	h = rcu_dereference(t->b[iphashconn(ht, sa, sp, da, dp) & t->mask]);
+	for (; h != NULL; h = rcu_dereference(h->next)) {
 		c = h->c;
 		if (sp == c->rport && dp == c->lport
 			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
+			ret = c;
+			break;
 		}
 	}
+	rcu_read_unlock();
+	return ret;
+}
 
-	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+static bool iphtlistenmatch(struct conv *c, int match, uint8_t *da,
+                            uint16_t dp)
+{
+	switch (match) {
+		case IPmatchpa:
+			return dp == c->lport && ipcmp(da, c->laddr) == 0;
+		case IPmatchport:
+			return dp == c->lport;
+		case IPmatchaddr:
+			return ipcmp(da, c->laddr) == 0;
+		case IPmatchany:
+			return TRUE;
 	}
+	return FALSE;
+}
 
-	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
+/* Announced convs: the first of listen[hv] with the given match type that
+ * passes the check for it.  If that one has reuseport, so do all the others
+ * that match (see setluniqueport()), and the flow's hash picks one of them, so
+ * a flow sticks to one listener while the set doesn't change. */
+static struct conv *iphtlooklisten(struct Ipht *ht, uint32_t hv, int match,
+                                   uint8_t *sa, uint16_t sp, uint8_t *da,
+                                   uint16_t dp)
+{
+	struct Iphash *h;
+	struct conv *c, *first = NULL;
+	unsigned int n = 0, k;
+
+	for (h = rcu_dereference(ht->listen[hv]); h != NULL;
+	     h = rcu_dereference(h->next)) {
+		if (h->match != match || !iphtlistenmatch(h->c, match, da, dp))
 			continue;
-		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
+		if (first == NULL) {
+			first = h->c;
+			if (!first->reuseport)
+				return first;
 		}
+		n++;
 	}
-
-	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
+	if (n <= 1)
+		return first;
+
+	/* the chain may have changed since; settle for the last match */
+	k = iphashconn(ht, sa, sp, da, dp) % n;
+	c = first;
+	for (h = rcu_dereference(ht->listen[hv]); h != NULL;
+	     h = rcu_dereference(h->next)) {
+		if (h->match != match || !iphtlistenmatch(h->c, match, da, dp))
 			continue;
 		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+		if (k-- == 0)
+			break;
 	}
+	return c;
+}
 
-	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
-			continue;
-		c = h->c;
-		spin_unlock(&ht->lock);
+/* look for a matching conversation with the following precedence
+ *	connected && raddr,rport,laddr,lport
+ *	announced && laddr,lport
+ *	announced && *,lport
+ *	announced && laddr,*
+ *	announced && *,*
+ */
+struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
+					  uint16_t dp)
+{
+	struct conv *c;
+
+	c = iphtlookconn(ht, sa, sp, da, dp);
+	if (c != NULL)
 		return c;
-	}
-	spin_unlock(&ht->lock);
-	return NULL;
+
+	rcu_read_lock();
+	c = iphtlooklisten(ht, iphash(IPnoaddr, 0, da, dp), IPmatchpa,
+	                   sa, sp, da, dp);
+	if (c == NULL)
+		c = iphtlooklisten(ht, iphash(IPnoaddr, 0, IPnoaddr, dp),
+		                   IPmatchport, sa, sp, da, dp);
+	if (c == NULL)
+		c = iphtlooklisten(ht, iphash(IPnoaddr, 0, da, 0), IPmatchaddr,
+		                   sa, sp, da, dp);
+	if (c == NULL)
+		c = iphtlooklisten(ht, iphash(IPnoaddr, 0, IPnoaddr, 0),
+		                   IPmatchany, sa, sp, da, dp);
+	rcu_read_unlock();
+	return c;
 }
@@ -195,6 +195,383 @@ static void ipifcbind(struct conv *c, char **argv, int argc)
 	poperror();
 }
 
+/*
+ *  Fair queueing on output.  Each flow, a conv and next hop pair, gets its
+ *  own queue, and ipfqproc takes packets from them round robin, a quantum of
+ *  bytes at a time (DRR).  A flow whose conv set a pacing_rate must also wait
+ *  after each packet until it would have gone out at that rate; such flows
+ *  sit on the throttled list, and ipfqproc sleeps on an alarm until the first
+ *  of them is due.  Without fq, ipifcoput hands packets straight to the
+ *  medium.
+ */
+enum {
+	Nfqhash = 1024,
+	Fqlimit = 10000,	/* packets queued on an ifc */
+	Fqflowlimit = 100,	/* packets queued on a flow */
+	Fqidlems = 3000,	/* empty flows are freed after this long */
+};
+
+struct Fqflow {
+	struct Fqflow *hnext;		/* hash chain */
+	struct Fqflow *next;		/* new, old or throttled list */
+	struct conv *c;
+	uint8_t gate[IPaddrlen];
+	int version;
+	struct block *head;			/* packets, linked by b->list */
+	struct block *tail;
+	int qlen;
+	int credit;					/* bytes left this round */
+	bool active;				/* on one of the lists */
+	uint64_t rate;				/* bytes/sec, 0 if not paced */
+	uint64_t time_next;			/* nsec when we may send again */
+	uint64_t idle;				/* nsec when we went inactive */
+};
+
+struct Fqlist {
+	struct Fqflow *head;
+	struct Fqflow *tail;
+};
+
+struct Ipfq {
+	spinlock_t lock;
+	struct Ipifc *ifc;
+	struct rendez rv;
+	bool sleeping;				/* ipfqproc wants a wakeup */
+	bool dying;					/* ipfqproc should free us */
+	int quantum;
+	int qlen;
+	struct Fqlist new;			/* flows that just got busy go first */
+	struct Fqlist old;
+	struct Fqflow *throttled;
+	uint64_t tnext;				/* earliest time_next on throttled */
+	unsigned int nflows;
+	uint64_t drops;
+	uint64_t throttles;
+	struct Fqflow *hash[Nfqhash];
+};
+
+static void fqlistadd(struct Fqlist *l, struct Fqflow *f)
+{
+	f->next = NULL;
+	if (l->tail)
+		l->tail->next = f;
+	else
+		l->head = f;
+	l->tail = f;
+}
+
+static struct Fqflow *fqlistpop(struct Fqlist *l)
+{
+	struct Fqflow *f = l->head;
+
+	if (f) {
+		l->head = f->next;
+		if (l->head == NULL)
+			l->tail = NULL;
+		f->next = NULL;
+	}
+	return f;
+}
+
+static uint32_t fqhash(struct conv *c, uint8_t *gate)
+{
+	uint32_t h = (uintptr_t)c >> 6;
+	int i;
+
+	for (i = 0; i < IPaddrlen; i += 4)
+		h = (h ^ nhgetl(gate + i)) * 0x9e3779b1;
+	return (h ^ h >> 16) & (Nfqhash - 1);
+}
+
+/* called with fq locked */
+static struct Fqflow *fqlookup(struct Ipfq *fq, struct conv *c, uint8_t *gate,
+                               int version, uint64_t now)
+{
+	struct Fqflow *f, **l;
+	uint32_t h;
+
+	h = fqhash(c, gate);
+	for (l = &fq->hash[h]; (f = *l) != NULL;) {
+		if (f->c == c && f->version == version && ipcmp(f->gate, gate) == 0)
+			return f;
+		/* convs get reused, so reap flows rather than wait for a close */
+		if (!f->active && now - f->idle > Fqidlems * 1000000ULL) {
+			*l = f->hnext;
+			kfree(f);
+			fq->nflows--;
+			continue;
+		}
+		l = &f->hnext;
+	}
+	f = kzmalloc(sizeof(*f), 0);
+	if (f == NULL)
+		return NULL;
+	f->c = c;
+	ipmove(f->gate, gate);
+	f->version = version;
+	f->hnext = fq->hash[h];
+	fq->hash[h] = f;
+	fq->nflows++;
+	return f;
+}
+
+/*
+ *  the next packet to send, if any flow may send.  if some are throttled,
+ *  *wait is how long until the first of them may.
+ *
+ *  called with fq locked
+ */
+static struct block *fqdequeue(struct Ipfq *fq, uint64_t now,
+                               struct Fqflow **fp, uint64_t *wait)
+{
+	struct Fqflow *f, **l;
+	struct Fqlist *list;
+	struct block *bp;
+	int len;
+
+	if (fq->throttled && now >= fq->tnext) {
+		fq->tnext = UINT64_MAX;
+		for (l = &fq->throttled; (f = *l) != NULL;) {
+			if (f->time_next <= now) {
+				*l = f->next;
+				fqlistadd(&fq->old, f);
+				continue;
+			}
+			fq->tnext = MIN(fq->tnext, f->time_next);
+			l = &f->next;
+		}
+	}
+
+	for (;;) {
+		list = fq->new.head ? &fq->new : &fq->old;
+		f = list->head;
+		if (f == NULL)
+			break;
+		if (f->credit <= 0) {
+			fqlistpop(list);
+			f->credit += fq->quantum;
+			fqlistadd(&fq->old, f);
+			continue;
+		}
+		if (f->head == NULL) {
+			fqlistpop(list);
+			f->active = FALSE;
+			f->idle = now;
+			continue;
+		}
+		if (f->time_next > now) {
+			fqlistpop(list);
+			f->next = fq->throttled;
+			fq->throttled = f;
+			fq->tnext = MIN(fq->tnext, f->time_next);
+			fq->throttles++;
+			continue;
+		}
+		bp = f->head;
+		f->head = bp->list;
+		if (f->head == NULL)
+			f->tail = NULL;
+		bp->list = NULL;
+		f->qlen--;
+		fq->qlen--;
+		len = blocklen(bp);
+		f->credit -= len;
+		if (f->rate)
+			f->time_next = now + len * 1000000000ULL / f->rate;
+		*fp = f;
+		return bp;
+	}
+	*wait = fq->throttled ? MAX(fq->tnext - now, 1) : 0;
+	return NULL;
+}
+
+static int fqready(void *a)
+{
+	struct Ipfq *fq = a;
+
+	return !fq->sleeping;
+}
+
+static void fqfree(struct Ipfq *fq)
+{
+	struct Fqflow *f;
+	int i;
+
+	for (i = 0; i < Nfqhash; i++) {
+		while ((f = fq->hash[i]) != NULL) {
+			fq->hash[i] = f->hnext;
+			while (f->head) {
+				struct block *bp = f->head;
+
+				f->head = bp->list;
+				freeblist(bp);
+			}
+			kfree(f);
+		}
+	}
+	kfree(fq);
+}
+
+static void ipfqproc(void *a)
+{
+	ERRSTACK(1);
+	struct Ipfq *fq = a;
+	struct Ipifc *ifc = fq->ifc;
+	struct Fqflow *f;
+	struct block *bp;
+	uint8_t gate[IPaddrlen];
+	int version;
+	uint64_t wait;
+
+	for (;;) {
+		spin_lock(&fq->lock);
+		fq->sleeping = FALSE;
+		if (fq->dying) {
+			spin_unlock(&fq->lock);
+			fqfree(fq);
+			return;
+		}
+		bp = fqdequeue(fq, nsec(), &f, &wait);
+		if (bp == NULL) {
+			fq->sleeping = TRUE;
+			spin_unlock(&fq->lock);
+			if (wait)
+				rendez_sleep_timeout(&fq->rv, fqready, fq,
+				                     MAX(wait / 1000, 1));
+			else
+				rendez_sleep(&fq->rv, fqready, fq);
+			continue;
+		}
+		version = f->version;
+		ipmove(gate, f->gate);
+		spin_unlock(&fq->lock);
+
+		/* unbind or fq off may be waiting for the wlock to stop us */
+		if (!canrlock(&ifc->rwlock)) {
+			freeblist(bp);
+			continue;
+		}
+		/* discard error style */
+		if (!waserror()) {
+			if (ifc->fq == fq && ifc->m != NULL)
+				ifc->m->bwrite(ifc, bp, version, gate);
+			else
+				freeblist(bp);
+		}
+		poperror();
+		runlock(&ifc->rwlock);
+	}
+}
+
+/*
+ *  send a packet on ifc, through fq if it's on
+ *
+ *  called with ifc rlocked
+ */
+void ipifcoput(struct Ipifc *ifc, struct block *bp, int version, uint8_t *gate,
+               struct conv *c)
+{
+	struct Ipfq *fq = ifc->fq;
+	struct Fqflow *f;
+	bool wake;
+
+	if (fq == NULL) {
+		ifc->m->bwrite(ifc, bp, version, gate);
+		return;
+	}
+	spin_lock(&fq->lock);
+	f = fqlookup(fq, c, gate, version, nsec());
+	if (f == NULL || fq->qlen >= Fqlimit || f->qlen >= Fqflowlimit) {
+		fq->drops++;
+		spin_unlock(&fq->lock);
+		freeblist(bp);
+		return;
+	}
+	f->rate = c ? c->pacing_rate : 0;
+	bp->list = NULL;
+	if (f->tail)
+		f->tail->list = bp;
+	else
+		f->head = bp;
+	f->tail = bp;
+	f->qlen++;
+	fq->qlen++;
+	if (!f->active) {
+		f->active = TRUE;
+		f->credit = fq->quantum;
+		fqlistadd(&fq->new, f);
+	}
+	wake = fq->sleeping;
+	fq->sleeping = FALSE;
+	spin_unlock(&fq->lock);
+	if (wake)
+		rendez_wakeup(&fq->rv);
+}
+
+/* called with ifc wlocked */
+static void ipifcfqoff(struct Ipifc *ifc)
+{
+	struct Ipfq *fq = ifc->fq;
+
+	if (fq == NULL)
+		return;
+	ifc->fq = NULL;
+	spin_lock(&fq->lock);
+	fq->dying = TRUE;
+	fq->sleeping = FALSE;
+	spin_unlock(&fq->lock);
+	rendez_wakeup(&fq->rv);
+}
+
+/*
+ *  fq on [quantum]
+ *  fq off
+ */
+static void ipifcfq(struct Ipifc *ifc, char **argv, int argc)
+{
+	struct Ipfq *fq;
+	int quantum;
+
+	if (argc < 2)
+		error(EINVAL, "usage: fq on [quantum]|off");
+	if (strcmp(argv[1], "off") == 0) {
+		wlock(&ifc->rwlock);
+		ipifcfqoff(ifc);
+		wunlock(&ifc->rwlock);
+		return;
+	}
+	if (strcmp(argv[1], "on") != 0)
+		error(EINVAL, "usage: fq on [quantum]|off");
+	quantum = 0;
+	if (argc > 2) {
+		quantum = atoi(argv[2]);
+		if (quantum <= 0)
+			error(EINVAL, "bad fq quantum %s", argv[2]);
+	}
+
+	wlock(&ifc->rwlock);
+	if (ifc->m == NULL) {
+		wunlock(&ifc->rwlock);
+		error(EFAIL, "ipifc not yet bound to device");
+	}
+	if (quantum == 0)
+		quantum = 2 * ifc->maxtu;
+	if (ifc->fq != NULL) {
+		ifc->fq->quantum = quantum;
+		wunlock(&ifc->rwlock);
+		return;
+	}
+	fq = kzmalloc(sizeof(*fq), KMALLOC_WAIT);
+	spinlock_init(&fq->lock);
+	rendez_init(&fq->rv);
+	fq->ifc = ifc;
+	fq->quantum = quantum;
+	fq->tnext = UINT64_MAX;
+	ifc->fq = fq;
+	wunlock(&ifc->rwlock);
+	ktask("ipfqproc", ipfqproc, fq);
+}
+
 /*
  *  detach a device from an interface, close the interface
  *  called with ifc->conv closed
@@ -215,6 +592,8 @@ static void ipifcunbind(struct Ipifc *ifc)
 		ifc->conv->inuse--;
 	ifc->ifcid++;
 
+	ipifcfqoff(ifc);
+
 	/* disassociate device */
 	if (ifc->m != NULL && ifc->m->unbind)
 		(*ifc->m->unbind) (ifc);
@@ -263,6 +642,14 @@ static int ipifcstate(struct conv *c, char *state, int n)
 					  lifc->validlt, lifc->preflt);
 	if (ifc->lifc == NULL)
 		m += snprintf(state + m, n - m, "\n");
+	if (ifc->fq != NULL) {
+		spin_lock(&ifc->fq->lock);
+		m += snprintf(state + m, n - m,
+		              "fq quantum %d flows %u qlen %d drops %llu throttled %llu\n",
+		              ifc->fq->quantum, ifc->fq->nflows, ifc->fq->qlen,
+		              ifc->fq->drops, ifc->fq->throttles);
+		spin_unlock(&ifc->fq->lock);
+	}
 	runlock(&ifc->rwlock);
 	return m;
 }
@@ -825,13 +1212,18 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 		ipifcsendra6(ifc, argv, argc);
 	else if (strcmp(argv[0], "recvra6") == 0)
 		ipifcrecvra6(ifc, argv, argc);
+	else if (strcmp(argv[0], "fq") == 0)
+		ipifcfq(ifc, argv, argc);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
 
 int ipifcstats(struct Proto *ipifc, char *buf, int len)
 {
-	return ipstats(ipifc->f, buf, len);
+	int n;
+
+	n = ipstats(ipifc->f, buf, len);
+	return n + arpstats(ipifc->f, buf + n, len - n);
 }
 
 void ipifcinit(struct Fs *f)
@@ -1128,6 +1520,43 @@ int ipforme(struct Fs *f, uint8_t * addr)
 	return 0;
 }
 
+/*
+ *  spin on the nic behind the ifc that reaches addr, or behind any ifc that
+ *  can spin if addr is unspecified or off-net, for up to usec or until
+ *  done(arg).  returns false if there was no such ifc.
+ */
+bool ipifcbusypoll(struct Fs *f, uint8_t *addr, uint64_t usec,
+                   bool (*done)(void *), void *arg)
+{
+	ERRSTACK(1);
+	struct conv **cp, **e;
+	struct Ipifc *ifc, *x;
+	bool ret = FALSE;
+
+	ifc = NULL;
+	if (ipcmp(addr, IPnoaddr) != 0 && ipcmp(addr, v4prefix) != 0)
+		ifc = findipifc(f, addr, 0);
+	e = &f->ipifc->conv[f->ipifc->nc];
+	for (cp = f->ipifc->conv; ifc == NULL && cp < e; cp++) {
+		if (*cp == NULL)
+			continue;
+		x = (struct Ipifc *)(*cp)->ptcl;
+		if (x->m != NULL && x->m->busypoll != NULL)
+			ifc = x;
+	}
+	if (ifc == NULL || !canrlock(&ifc->rwlock))
+		return FALSE;
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	if (ifc->m != NULL && ifc->m->busypoll != NULL)
+		ret = ifc->m->busypoll(ifc, usec, done, arg);
+	runlock(&ifc->rwlock);
+	poperror();
+	return ret;
+}
+
 /*
  *  find the ifc on same net as the remote system.  If none,
  *  return NULL.
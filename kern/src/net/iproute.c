@@ -47,11 +47,17 @@ static void calcd(struct route *);
 /* these are used for all instances of IP */
 struct route *v4freelist;
 struct route *v6freelist;
+static spinlock_t routefreelock = SPINLOCK_INITIALIZER;
 rwlock_t routelock;
 uint32_t v4routegeneration, v6routegeneration;
 
-static void freeroute(struct route *r)
+/* Lookups walk the route trees without the routelock, so a freed route goes
+ * back on the freelist (and gets reused) only after an RCU grace period.
+ * Routes are never kfreed: convs cache route pointers (checking the route
+ * generation). */
+static void __freeroute_rcu(struct rcu_head *head)
 {
+	struct route *r = container_of(head, struct route, rt.rcu);
 	struct route **l;
 
 	r->rt.left = NULL;
@@ -60,8 +66,15 @@ static void freeroute(struct route *r)
 		l = &v4freelist;
 	else
 		l = &v6freelist;
+	spin_lock(&routefreelock);
 	r->rt.mid = *l;
 	*l = r;
+	spin_unlock(&routefreelock);
+}
+
+static void freeroute(struct route *r)
+{
+	call_rcu(&r->rt.rcu, __freeroute_rcu);
 }
 
 static struct route *allocroute(int type)
@@ -78,10 +91,12 @@ static struct route *allocroute(int type)
 		l = &v6freelist;
 	}
 
+	spin_lock(&routefreelock);
 	r = *l;
-	if (r != NULL) {
+	if (r != NULL)
 		*l = r->rt.mid;
-	} else {
+	spin_unlock(&routefreelock);
+	if (r == NULL) {
 		r = kzmalloc(n, 0);
 		if (r == NULL)
 			panic("out of routing nodes");
@@ -265,8 +280,8 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 
 	p = *cur;
 	if (p == 0) {
-		*cur = new;
 		new->rt.depth = 1;
+		rcu_assign_pointer(*cur, new);
 		return;
 	}
 
@@ -285,8 +300,8 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 			 *  queue tree node to be
 			 *  merged into root.
 			 */
-			*cur = new;
 			new->rt.depth = 1;
+			rcu_assign_pointer(*cur, new);
 			addqueue(&f->queue, p);
 			break;
 		case Requals:
@@ -310,6 +325,352 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 	balancetree(cur);
 }
 
+/*
+ *  Poptrie (Asai and Ohara, SIGCOMM '15) over the route forest, so lookups
+ *  take a few cache lines instead of walking a tree.  Each node covers 6 bits
+ *  of the address.  vec marks the slots that have children, which are packed
+ *  together from base1 in nodes[], so a child's index is base1 plus the
+ *  popcount of vec below the slot.  The other slots are leaves: leafvec marks
+ *  the slots where a run of them with the same route starts, and those runs
+ *  are packed from base0 in leaves[].
+ *
+ *  Tries are rebuilt from the forest by routetrieproc a little after routes
+ *  change, and stamped with the route generation they were built from.  Until
+ *  the new one is up, lookups see a stale generation and walk the forest.
+ */
+enum {
+	Rtstride = 6,
+	Rtfanout = 1 << Rtstride,
+	Rtdelayus = 10000,		/* batch route changes this long */
+};
+
+struct rtnode {
+	uint64_t vec;
+	uint64_t leafvec;
+	uint32_t base0;
+	uint32_t base1;
+};
+
+struct rtrie {
+	uint32_t gen;
+	int alen;
+	struct rtnode *nodes;
+	struct route **leaves;
+	struct rcu_head rcu;
+};
+
+/* a plain multibit trie, which rtriebuild compresses */
+struct rtbuild {
+	struct route *leaf[Rtfanout];
+	int16_t plen[Rtfanout];
+	struct rtbuild *child[Rtfanout];
+};
+
+/* Rtstride bits of a, starting at bit off, past the end of a is zeros */
+static inline unsigned int rtbits(uint8_t *a, int alen, int off)
+{
+	int i = off / 8;
+	unsigned int w;
+
+	w = (i < alen ? a[i] : 0) << 8 | (i + 1 < alen ? a[i + 1] : 0);
+	return (w >> (16 - Rtstride - off % 8)) & (Rtfanout - 1);
+}
+
+struct route *rtrielookup(struct rtrie *t, uint8_t *a)
+{
+	struct rtnode *n = &t->nodes[0];
+	unsigned int i;
+	uint64_t upto;
+	int off;
+
+	for (off = 0;; off += Rtstride) {
+		i = rtbits(a, t->alen, off);
+		upto = (2ULL << i) - 1;
+		if (!(n->vec & (1ULL << i)))
+			return t->leaves[n->base0 +
+			                 __builtin_popcountll(n->leafvec & upto) - 1];
+		n = &t->nodes[n->base1 + __builtin_popcountll(n->vec & upto) - 1];
+	}
+}
+
+/* the prefix length of [s, e], or -1 if it isn't a prefix */
+static int rtprefixlen(uint8_t *s, uint8_t *e, int alen)
+{
+	int i, len;
+	uint8_t d;
+
+	len = -1;
+	for (i = 0; i < alen; i++) {
+		d = s[i] ^ e[i];
+		if (s[i] & d || (e[i] & d) != d)
+			return -1;
+		if (len < 0) {
+			if (d == 0)
+				continue;
+			/* d must be 0...01...1 */
+			if (d & (d + 1))
+				return -1;
+			len = i * 8 + 8 - __builtin_popcount(d);
+		} else if (d != 0xff) {
+			return -1;
+		}
+	}
+	return len < 0 ? alen * 8 : len;
+}
+
+static struct rtbuild *rtbuildalloc(void)
+{
+	struct rtbuild *b;
+	int i;
+
+	b = kzmalloc(sizeof(*b), KMALLOC_WAIT);
+	for (i = 0; i < Rtfanout; i++)
+		b->plen[i] = -1;
+	return b;
+}
+
+static void rtbuildadd(struct rtbuild *b, uint8_t *a, int alen, int plen,
+                       struct route *r)
+{
+	unsigned int i, n;
+	int off;
+
+	for (off = 0; plen > off + Rtstride; off += Rtstride) {
+		i = rtbits(a, alen, off);
+		if (b->child[i] == NULL)
+			b->child[i] = rtbuildalloc();
+		b = b->child[i];
+	}
+	n = 1 << (off + Rtstride - plen);
+	for (i = rtbits(a, alen, off) & ~(n - 1); n--; i++) {
+		/* the first route wins a tie; routes are in every bucket they span */
+		if (b->plen[i] < plen) {
+			b->leaf[i] = r;
+			b->plen[i] = plen;
+		}
+	}
+}
+
+/* push shorter prefixes down into the children, and count what we'll need */
+static void rtbuildpush(struct rtbuild *b, struct route *r, int plen,
+                        int *nnodes, int *nleaves)
+{
+	struct route *last = NULL;
+	bool first = TRUE;
+	int i;
+
+	(*nnodes)++;
+	for (i = 0; i < Rtfanout; i++) {
+		if (b->plen[i] < plen) {
+			b->leaf[i] = r;
+			b->plen[i] = plen;
+		}
+		if (b->child[i] != NULL) {
+			rtbuildpush(b->child[i], b->leaf[i], b->plen[i], nnodes, nleaves);
+			continue;
+		}
+		if (first || b->leaf[i] != last)
+			(*nleaves)++;
+		first = FALSE;
+		last = b->leaf[i];
+	}
+}
+
+static void rtbuildemit(struct rtrie *t, struct rtbuild *b, int idx,
+                        int *nnodes, int *nleaves)
+{
+	struct rtnode *n = &t->nodes[idx];
+	struct route *last = NULL;
+	bool first = TRUE;
+	int i, k;
+
+	n->base0 = *nleaves;
+	n->base1 = *nnodes;
+	for (i = 0; i < Rtfanout; i++) {
+		if (b->child[i] != NULL) {
+			n->vec |= 1ULL << i;
+			(*nnodes)++;
+			continue;
+		}
+		if (first || b->leaf[i] != last) {
+			n->leafvec |= 1ULL << i;
+			t->leaves[(*nleaves)++] = b->leaf[i];
+		}
+		first = FALSE;
+		last = b->leaf[i];
+	}
+	for (i = 0, k = 0; i < Rtfanout; i++)
+		if (b->child[i] != NULL)
+			rtbuildemit(t, b->child[i], n->base1 + k++, nnodes, nleaves);
+}
+
+static void rtbuildfree(struct rtbuild *b)
+{
+	int i;
+
+	for (i = 0; i < Rtfanout; i++)
+		if (b->child[i] != NULL)
+			rtbuildfree(b->child[i]);
+	kfree(b);
+}
+
+void rtriefree(struct rtrie *t)
+{
+	kfree(t->nodes);
+	kfree(t->leaves);
+	kfree(t);
+}
+
+static void __rtriefree_rcu(struct rcu_head *head)
+{
+	rtriefree(container_of(head, struct rtrie, rcu));
+}
+
+static void rtriekey(struct route *r, uint8_t *s, uint8_t *e)
+{
+	int i;
+
+	if (r->rt.type & Rv4) {
+		hnputl(s, r->v4.address);
+		hnputl(e, r->v4.endaddress);
+		return;
+	}
+	for (i = 0; i < IPllen; i++) {
+		hnputl(s + 4 * i, r->v6.address[i]);
+		hnputl(e + 4 * i, r->v6.endaddress[i]);
+	}
+}
+
+/*
+ *  Build a trie over n routes of one family, or return NULL if one of them
+ *  isn't a prefix.
+ */
+struct rtrie *rtriebuild(struct route **r, int n, int alen)
+{
+	uint8_t s[IPaddrlen], e[IPaddrlen];
+	struct rtbuild *b;
+	struct rtrie *t;
+	int i, plen, nnodes, nleaves;
+
+	b = rtbuildalloc();
+	for (i = 0; i < n; i++) {
+		rtriekey(r[i], s, e);
+		plen = rtprefixlen(s, e, alen);
+		if (plen < 0) {
+			rtbuildfree(b);
+			return NULL;
+		}
+		rtbuildadd(b, s, alen, plen, r[i]);
+	}
+	nnodes = nleaves = 0;
+	rtbuildpush(b, NULL, -1, &nnodes, &nleaves);
+
+	t = kzmalloc(sizeof(*t), KMALLOC_WAIT);
+	t->alen = alen;
+	t->nodes = kzmalloc(nnodes * sizeof(struct rtnode), KMALLOC_WAIT);
+	t->leaves = kzmalloc(nleaves * sizeof(struct route *), KMALLOC_WAIT);
+	nnodes = 1;
+	nleaves = 0;
+	rtbuildemit(t, b, 0, &nnodes, &nleaves);
+	rtbuildfree(b);
+	return t;
+}
+
+static int rtcount(struct route *r)
+{
+	if (r == NULL)
+		return 0;
+	return 1 + rtcount(r->rt.left) + rtcount(r->rt.mid) + rtcount(r->rt.right);
+}
+
+static int rtcollect(struct route *r, struct route **v, int i)
+{
+	if (r == NULL)
+		return i;
+	v[i++] = r;
+	i = rtcollect(r->rt.left, v, i);
+	i = rtcollect(r->rt.mid, v, i);
+	return rtcollect(r->rt.right, v, i);
+}
+
+/* called with routelock rlocked */
+static struct rtrie *rtriefromforest(struct route **root, int alen, uint32_t gen)
+{
+	struct route **v;
+	struct rtrie *t;
+	int h, n;
+
+	n = 0;
+	for (h = 0; h < 1 << Lroot; h++)
+		n += rtcount(root[h]);
+	v = kmalloc(MAX(n, 1) * sizeof(struct route *), KMALLOC_WAIT);
+	n = 0;
+	for (h = 0; h < 1 << Lroot; h++)
+		n = rtcollect(root[h], v, n);
+	t = rtriebuild(v, n, alen);
+	kfree(v);
+	if (t != NULL)
+		t->gen = gen;
+	return t;
+}
+
+static void rtriepublish(struct rtrie **p, struct rtrie *t)
+{
+	struct rtrie *old = *p;
+
+	rcu_assign_pointer(*p, t);
+	if (old != NULL)
+		call_rcu(&old->rcu, __rtriefree_rcu);
+}
+
+static int rtdirty(void *arg)
+{
+	struct Fs *f = arg;
+
+	return f->rtdirty;
+}
+
+static void routetrieproc(void *arg)
+{
+	struct Fs *f = arg;
+	struct rtrie *t4, *t6;
+	uint32_t g4, g6;
+
+	for (;;) {
+		rendez_sleep(&f->rtrv, rtdirty, f);
+		kthread_usleep(Rtdelayus);
+		f->rtdirty = FALSE;
+
+		rlock(&routelock);
+		g4 = v4routegeneration;
+		g6 = v6routegeneration;
+		t4 = NULL;
+		if (f->v4trie == NULL || f->v4trie->gen != g4)
+			t4 = rtriefromforest(f->v4root, IPv4addrlen, g4);
+		t6 = NULL;
+		if (f->v6trie == NULL || f->v6trie->gen != g6)
+			t6 = rtriefromforest(f->v6root, IPaddrlen, g6);
+		runlock(&routelock);
+
+		if (t4 != NULL)
+			rtriepublish(&f->v4trie, t4);
+		if (t6 != NULL)
+			rtriepublish(&f->v6trie, t6);
+	}
+}
+
+static void routechanged(struct Fs *f)
+{
+	f->rtdirty = TRUE;
+	rendez_wakeup(&f->rtrv);
+}
+
+void routeinit(struct Fs *f)
+{
+	rendez_init(&f->rtrv);
+	ktask("routetrie", routetrieproc, f);
+}
+
 #define	V4H(a)	((a&0x07ffffff)>>(32-Lroot-5))
 
 void
@@ -344,6 +705,7 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		wunlock(&routelock);
 	}
 	v4routegeneration++;
+	routechanged(f);
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
 }
@@ -390,6 +752,7 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		wunlock(&routelock);
 	}
 	v6routegeneration++;
+	routechanged(f);
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
 }
@@ -460,6 +823,7 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			wunlock(&routelock);
 	}
 	v4routegeneration++;
+	routechanged(f);
 
 	ipifcremroute(f, Rv4, a, mask);
 }
@@ -506,16 +870,36 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			wunlock(&routelock);
 	}
 	v6routegeneration++;
+	routechanged(f);
 
 	ipifcremroute(f, 0, a, mask);
 }
 
-struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
+/* called in an RCU read-side section */
+static struct route *v4treelookup(struct Fs *f, uint32_t la)
 {
 	struct route *p, *q;
+
+	q = NULL;
+	for (p = rcu_dereference(f->v4root[V4H(la)]); p;)
+		if (la >= p->v4.address) {
+			if (la <= p->v4.endaddress) {
+				q = p;
+				p = rcu_dereference(p->rt.mid);
+			} else
+				p = rcu_dereference(p->rt.right);
+		} else
+			p = rcu_dereference(p->rt.left);
+	return q;
+}
+
+struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
+{
+	struct route *q;
 	uint32_t la;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	struct rtrie *t;
 
 	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
 		&& c->rgen == v4routegeneration)
@@ -523,15 +907,15 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 
 	la = nhgetl(a);
 	q = NULL;
-	for (p = f->v4root[V4H(la)]; p;)
-		if (la >= p->v4.address) {
-			if (la <= p->v4.endaddress) {
-				q = p;
-				p = p->rt.mid;
-			} else
-				p = p->rt.right;
-		} else
-			p = p->rt.left;
+	/* A lookup racing with a route change might miss a route, but it will
+	 * never walk into a freed one. */
+	rcu_read_lock();
+	t = rcu_dereference(f->v4trie);
+	if (t != NULL && t->gen == v4routegeneration)
+		q = rtrielookup(t, a);
+	else
+		q = v4treelookup(f, la);
+	rcu_read_unlock();
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -554,37 +938,22 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 	return q;
 }
 
-struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
+/* called in an RCU read-side section */
+static struct route *v6treelookup(struct Fs *f, uint32_t *la)
 {
 	struct route *p, *q;
-	uint32_t la[IPllen];
-	int h;
 	uint32_t x, y;
-	uint8_t gate[IPaddrlen];
-	struct Ipifc *ifc;
-
-	if (memcmp(a, v4prefix, IPv4off) == 0) {
-		q = v4lookup(f, a + IPv4off, c);
-		if (q != NULL)
-			return q;
-	}
-
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v6routegeneration)
-		return c->r;
-
-	for (h = 0; h < IPllen; h++)
-		la[h] = nhgetl(a + 4 * h);
+	int h;
 
-	q = 0;
-	for (p = f->v6root[V6H(la)]; p;) {
+	q = NULL;
+	for (p = rcu_dereference(f->v6root[V6H(la)]); p;) {
 		for (h = 0; h < IPllen; h++) {
 			x = la[h];
 			y = p->v6.address[h];
 			if (x == y)
 				continue;
 			if (x < y) {
-				p = p->rt.left;
+				p = rcu_dereference(p->rt.left);
 				goto next;
 			}
 			break;
@@ -595,15 +964,48 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 			if (x == y)
 				continue;
 			if (x > y) {
-				p = p->rt.right;
+				p = rcu_dereference(p->rt.right);
 				goto next;
 			}
 			break;
 		}
 		q = p;
-		p = p->rt.mid;
+		p = rcu_dereference(p->rt.mid);
 next:	;
 	}
+	return q;
+}
+
+struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
+{
+	struct route *q;
+	uint32_t la[IPllen];
+	int h;
+	uint8_t gate[IPaddrlen];
+	struct Ipifc *ifc;
+	struct rtrie *t;
+
+	if (memcmp(a, v4prefix, IPv4off) == 0) {
+		q = v4lookup(f, a + IPv4off, c);
+		if (q != NULL)
+			return q;
+	}
+
+	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
+		&& c->rgen == v6routegeneration)
+		return c->r;
+
+	for (h = 0; h < IPllen; h++)
+		la[h] = nhgetl(a + 4 * h);
+
+	q = 0;
+	rcu_read_lock();
+	t = rcu_dereference(f->v6trie);
+	if (t != NULL && t->gen == v6routegeneration)
+		q = rtrielookup(t, a);
+	else
+		q = v6treelookup(f, la);
+	rcu_read_unlock();
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -131,9 +131,7 @@ struct Ipfrag {
 struct IP {
 	uint32_t stats[Nstats];
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
+	struct fragtab4 *frag4;
 	int id4;
 
 	qlock_t fraglock6;
@@ -237,7 +235,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 	medialen = ifc->maxtu - ifc->m->hsize;
 	if (len <= medialen) {
 		hnputs(eh->ploadlen, len - IPV6HDR_LEN);
-		ifc->m->bwrite(ifc, bp, V6, gate);
+		ipifcoput(ifc, bp, V6, gate, c);
 		runlock(&ifc->rwlock);
 		poperror();
 		return 0;
@@ -329,7 +327,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 				xp = xp->next;
 		}
 
-		ifc->m->bwrite(ifc, nb, V6, gate);
+		ipifcoput(ifc, nb, V6, gate, c);
 		ip->stats[FragCreates]++;
 	}
 	ip->stats[FragOKs]++;
@@ -454,7 +452,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 }
 
 /*
- * ipfragfree6 - copied from ipfragfree4 - assume hold fraglock6
+ * ipfragfree6 - Free a list of fragments - assume hold fraglock6
  */
 void ipfragfree6(struct IP *ip, struct fragment6 *frag)
 {
@@ -482,7 +480,7 @@ void ipfragfree6(struct IP *ip, struct fragment6 *frag)
 }
 
 /*
- * ipfragallo6 - copied from ipfragalloc4
+ * ipfragallo6 - allocate a reassembly queue - assume hold fraglock6
  */
 struct fragment6 *ipfragallo6(struct IP *ip)
 {
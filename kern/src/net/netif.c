@@ -314,9 +314,29 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 				j += snprintf(p + j, READSTR - j, "sg ");
 			if (nif->feat & NETF_TSO)
 				j += snprintf(p + j, READSTR - j, "tso ");
+			if (nif->feat & NETF_USO)
+				j += snprintf(p + j, READSTR - j, "uso ");
 			if (nif->feat & NETF_LRO)
 				j += snprintf(p + j, READSTR - j, "lro ");
-			snprintf(p + j, READSTR - j, "\n");
+			j += snprintf(p + j, READSTR - j, "\n");
+			if (nif->coalesce != NULL) {
+				if (nif->coal.usec < 0)
+					j += snprintf(p + j, READSTR - j, "coalesce: default%s\n",
+					              nif->coal.adaptive ? " adaptive" : "");
+				else
+					j += snprintf(p + j, READSTR - j, "coalesce: %d usec%s\n",
+					              nif->coal.usec,
+					              nif->coal.adaptive ? " adaptive" : "");
+			}
+			if (nif->qvec[0]) {
+				/* queue:core for each queue with its own vector */
+				j += snprintf(p + j, READSTR - j, "irqcore:");
+				for (i = 0; i < Maxqueues; i++)
+					if (nif->qvec[i])
+						j += snprintf(p + j, READSTR - j, " %d:%d", i,
+						              nif->qcore[i]);
+				snprintf(p + j, READSTR - j, "\n");
+			}
 			n = readstr(offset, a, n, p);
 			kfree(p);
 			return n;
@@ -522,6 +542,8 @@ void netifclose(struct ether *nif, struct chan *c)
 			--(nif->all);
 			qunlock(&nif->qlock);
 		}
+		if (f->ring)
+			etherringfree(f);
 		f->owner[0] = 0;
 		f->type = 0;
 		f->bridge = 0;
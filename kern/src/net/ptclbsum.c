@@ -40,6 +40,7 @@
 #include <smp.h>
 #include <ip.h>
 #include <endian.h>
+#include <cpu_feat.h>
 
 static short endian = 1;
 static uint8_t *aendian = (uint8_t *) & endian;
@@ -207,16 +208,106 @@ in_cksumdata(const void *buf, int len)
 	REDUCE32;
 	return sum;
 }
-uint16_t ptclbsum(uint8_t * addr, int len)
+
+/* Sums 128 bytes per iteration with ADCX (CF) and ADOX (OF) running two
+ * independent carry chains into 64 bit one's complement accumulators.  A single
+ * adc chain is latency bound and is no faster than in_cksumdata(), so CPUs
+ * without ADX just use that.  This only uses GPRs: the kernel is built without
+ * SSE and does not save the user's FP state on entry, so vector code is out.
+ *
+ * lea and jrcxz leave the flags alone, so the carries ride along until the end,
+ * where we add each one back twice: the first can carry out (all-ones + 1), and
+ * the second adds that lost end-around carry.  nr_128b must be > 0. */
+static uint64_t csum_bulk_adx(const uint64_t *p, unsigned long nr_128b)
+{
+	uint64_t sum = 0, sum2 = 0, zero = 0;
+
+	asm volatile("xorq %[zero], %[zero]\n\t"	/* clears CF and OF */
+	             "1:\n\t"
+	             "adcxq  0*8(%[p]), %[sum]\n\t"
+	             "adoxq  1*8(%[p]), %[sum2]\n\t"
+	             "adcxq  2*8(%[p]), %[sum]\n\t"
+	             "adoxq  3*8(%[p]), %[sum2]\n\t"
+	             "adcxq  4*8(%[p]), %[sum]\n\t"
+	             "adoxq  5*8(%[p]), %[sum2]\n\t"
+	             "adcxq  6*8(%[p]), %[sum]\n\t"
+	             "adoxq  7*8(%[p]), %[sum2]\n\t"
+	             "adcxq  8*8(%[p]), %[sum]\n\t"
+	             "adoxq  9*8(%[p]), %[sum2]\n\t"
+	             "adcxq 10*8(%[p]), %[sum]\n\t"
+	             "adoxq 11*8(%[p]), %[sum2]\n\t"
+	             "adcxq 12*8(%[p]), %[sum]\n\t"
+	             "adoxq 13*8(%[p]), %[sum2]\n\t"
+	             "adcxq 14*8(%[p]), %[sum]\n\t"
+	             "adoxq 15*8(%[p]), %[sum2]\n\t"
+	             "leaq 128(%[p]), %[p]\n\t"
+	             "leaq -1(%[nr]), %[nr]\n\t"
+	             "jrcxz 2f\n\t"
+	             "jmp 1b\n\t"
+	             "2:\n\t"
+	             "adcxq %[zero], %[sum]\n\t"
+	             "adoxq %[zero], %[sum2]\n\t"
+	             "adcxq %[zero], %[sum]\n\t"
+	             "adoxq %[zero], %[sum2]\n\t"
+	             : [sum] "+r" (sum), [sum2] "+r" (sum2), [p] "+r" (p),
+	               [nr] "+c" (nr_128b), [zero] "+r" (zero)
+	             :
+	             : "cc", "memory");
+	sum += sum2;
+	if (sum < sum2)
+		sum++;
+	return sum;
+}
+
+/* Returns the same partial sum as in_cksumdata(), modulo 0xffff and with the
+ * bytes in the same lanes.  The unaligned head and the tail go through
+ * in_cksumdata(), which keeps bytes in lanes by their address, and the bulk
+ * starts 8 byte aligned, so the pieces can just be added. */
+static uint64_t in_cksumdata_wide(const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	uint64_t sum = 0, bulk;
+	int head, nr_128b;
+
+	if (len < 256 || !cpu_has_feat(CPU_FEAT_X86_ADX))
+		return in_cksumdata(buf, len);
+	head = -(uintptr_t)p & 7;
+	if (head) {
+		sum = in_cksumdata(p, head);
+		p += head;
+		len -= head;
+	}
+	nr_128b = len / 128;
+	bulk = csum_bulk_adx((const uint64_t *)p, nr_128b);
+	sum += (bulk & 0xffffffff) + (bulk >> 32);
+	p += nr_128b * 128;
+	len -= nr_128b * 128;
+	if (len)
+		sum += in_cksumdata(p, len);
+	return sum;
+}
+
+static uint16_t __ptclbsum(uint64_t sum, uint8_t *addr)
 {
-	uint64_t sum = in_cksumdata(addr, len);
 	union q_util q_util;
 	union l_util l_util;
+
 	if ((uintptr_t)addr & 1)
 		sum <<= 8;
 	REDUCE16;
 	return cpu_to_be16(sum);
 }
+
+uint16_t ptclbsum(uint8_t * addr, int len)
+{
+	return __ptclbsum(in_cksumdata_wide(addr, len), addr);
+}
+
+/* The plain C version, for ktests to check ptclbsum() against. */
+uint16_t ptclbsum_scalar(uint8_t *addr, int len)
+{
+	return __ptclbsum(in_cksumdata(addr, len), addr);
+}
 #else
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
@@ -284,4 +375,9 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbsum_scalar(uint8_t *addr, int len)
+{
+	return ptclbsum(addr, len);
+}
 #endif
@@ -74,7 +74,9 @@ enum {
 	TcptimerON = 1,
 	TcptimerDONE = 2,
 	MAX_TIME = (1 << 20),	/* Forever */
-	TCP_ACK = 50,	/* Timed ack sequence in ms */
+	NTCPWHEEL = 256,	/* slots in a timer wheel, must be a power of 2 */
+	TCP_ACK = 100,	/* Timed ack sequence in ms */
+	QUICKACKS = 16,	/* segments acked at once when data starts flowing */
 	MAXBACKMS = 9 * 60 * 1000,	/* longest backoff time (ms) before hangup */
 
 	URG = 0x20,	/* Data marked urgent */
@@ -90,6 +92,12 @@ enum {
 	MSS_LENGTH = 4,	/* Mean segment size */
 	WSOPT = 3,
 	WS_LENGTH = 3,	/* Bits to scale window size by */
+	SACK_OK_OPT = 4,
+	SACK_OK_LENGTH = 2,	/* SACK permitted (SYN only) */
+	SACK_OPT = 5,
+	MAX_NR_SACKS_PER_PACKET = 4,	/* fits in the option space, no timestamps */
+	MAX_NR_SND_SACKS = 10,	/* scoreboard: blocks the peer told us about */
+	MAX_NR_RCV_SACKS = 4,	/* blocks we tell the peer about */
 	MSL2 = 10,
 	MSPTICK = 50,	/* Milliseconds per timer tick */
 	DEF_MSS = 1460,	/* Default mean segment */
@@ -102,12 +110,18 @@ enum {
 
 	TCPREXMTTHRESH = 3,	/* dupack threshhold for rxt */
 
+	TAHOE_RECOVERY = 1,	/* snd.recovery: go-back-N from snd.una */
+	SACK_RECOVERY = 2,	/* snd.recovery: RFC 6675, fill the holes */
+
 	FORCE = 1,
 	CLONE = 2,
 	RETRAN = 4,
 	ACTIVE = 8,
 	SYNACK = 16,
 	TSO = 32,
+	/* Largest TSO payload, leaving room in the IP length for the headers and
+	 * 40 bytes of TCP options */
+	TSO_MAX = QMAX - TCP4_PKT - TCP4_HDRSIZE - 40,
 
 	LOGAGAIN = 3,
 	LOGDGAIN = 2,
@@ -125,6 +139,8 @@ enum {
 	Time_wait,
 
 	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
+	DEF_SYNQ = 256,	/* default per listener limit on calls in limbo */
+	MAX_SYNQ = Maxlimbo,
 	NLHT = 256,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
 
@@ -143,13 +159,26 @@ struct Tcptimer {
 	Tcptimer *next;
 	Tcptimer *prev;
 	Tcptimer *readynext;
+	struct tcpwheel *wheel;		/* the wheel we were last put on */
 	int state;
-	uint64_t start;
-	uint64_t count;
+	uint64_t start;				/* ticks from tcpgo until we fire */
+	uint64_t when;				/* tick we fire on */
 	void (*func) (void *);
 	void *arg;
 };
 
+/*
+ *  Running timers hang off per-core hashed wheels.  A timer due on tick T is
+ *  in slot T % NTCPWHEEL of the wheel of the core that started it, so each
+ *  tick tcpackproc only looks at one slot per wheel, skipping the timers that
+ *  are a lap or more away.  The lock is only contended when a timer is stopped
+ *  from a different core than started it.
+ */
+struct tcpwheel {
+	spinlock_t lock;
+	Tcptimer *slot[NTCPWHEEL];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /*
  *  v4 and v6 pseudo headers used for
  *  checksuming tcp
@@ -204,6 +233,15 @@ struct Tcp6hdr {
  *  a packet in ntohtcp{4,6}() and stuck into
  *  a packet in htontcp{4,6}().
  */
+/* SACK block edges, [left, right) in sequence space */
+struct sack_block {
+	uint32_t left;
+	uint32_t right;
+};
+
+/* Length of a SACK option carrying n blocks */
+#define SACK_LENGTH(n) (2 + 8 * (n))
+
 typedef struct Tcp Tcp;
 struct Tcp {
 	uint16_t source;
@@ -216,6 +254,9 @@ struct Tcp {
 	uint16_t urg;
 	uint16_t mss;				/* max segment size option (if not zero) */
 	uint16_t len;				/* size of data */
+	uint8_t sack_ok;			/* SACK permitted option (SYN only) */
+	uint8_t nr_sacks;			/* SACK option blocks */
+	struct sack_block sacks[MAX_NR_SACKS_PER_PACKET];
 };
 
 /*
@@ -230,10 +271,50 @@ struct Reseq {
 	uint16_t length;
 };
 
+/* Per-connection state for the congestion control modules */
+struct cubic_state {
+	uint32_t w_max;				/* cwind before the last reduction */
+	uint32_t origin;			/* cwind the cubic curve is centered on */
+	uint32_t k;					/* ms from the epoch until back at origin */
+	uint64_t epoch_start;		/* when the growth epoch started, 0 if none */
+	uint32_t reno_cwind;		/* what reno would have, for TCP friendliness */
+};
+
+#define BBR_BW_ROUNDS 10
+
+struct bbr_state {
+	uint32_t round_end;			/* a round ends when this gets acked */
+	uint64_t round_start;		/* when the round started */
+	uint32_t round_delivered;	/* bytes acked this round */
+	uint32_t bw[BBR_BW_ROUNDS];	/* delivery rate per round, bytes/ms */
+	int bw_idx;
+	uint32_t min_rtt;			/* ms, 0 until the first round */
+	uint64_t min_rtt_stamp;
+	uint32_t full_bw;			/* startup: bw when it last grew 25% */
+	int full_bw_rounds;			/* startup: rounds since then */
+	bool filled_pipe;			/* out of startup */
+	int cycle_idx;				/* probe bw gain cycle */
+};
+
+typedef struct Tcpctl Tcpctl;
+
+/*
+ *  congestion control.  update() hands new acks to cong_avoid outside of
+ *  loss recovery, and the loss paths ask ssthresh where to back off to.
+ *  pacing_rate, if set, says how fast the ifc's fq should let us send, in
+ *  bytes/sec; without it we pace at a multiple of cwind per srtt.
+ */
+struct tcp_cc_ops {
+	char *name;
+	/* ack is the new snd.una, acked the bytes it covers */
+	void (*cong_avoid)(Tcpctl *tcb, uint32_t ack, uint32_t acked);
+	uint32_t (*ssthresh)(Tcpctl *tcb);
+	uint64_t (*pacing_rate)(Tcpctl *tcb);
+};
+
 /*
  *  the qlock in the Conv locks this structure
  */
-typedef struct Tcpctl Tcpctl;
 struct Tcpctl {
 	uint8_t state;				/* Connection state */
 	uint8_t type;				/* Listening or active connection */
@@ -250,20 +331,29 @@ struct Tcpctl {
 		uint32_t dupacks;		/* number of duplicate acks rcvd */
 		int recovery;			/* loss recovery flag */
 		uint32_t rxt;			/* right window marker for recovery */
+		/* SACK scoreboard, sorted, no overlaps, all above una */
+		struct sack_block sacks[MAX_NR_SND_SACKS];
+		int nr_sacks;
+		uint32_t high_rxt;		/* highest seq retransmitted in recovery */
 	} snd;
 	struct {
 		uint32_t nxt;			/* Receive pointer to next uint8_t slot */
 		uint32_t wnd;			/* Receive window incoming */
 		uint32_t urg;			/* Urgent pointer */
 		int blocked;
-		int una;				/* unacked data segs */
+		int una;				/* unacked data bytes */
+		int quickack;			/* segs left to ack without delay */
+		uint64_t lastdata;		/* when data last arrived */
 		int scale;				/* how much to left shift window in rcved packets */
+		/* out of order data we hold, most recently received first */
+		struct sack_block sacks[MAX_NR_RCV_SACKS];
+		int nr_sacks;
 	} rcv;
 	uint32_t iss;				/* Initial sequence number */
 	int sawwsopt;				/* true if we saw a wsopt on the incoming SYN */
 	uint32_t cwind;				/* Congestion window */
 	int scale;					/* desired snd.scale */
-	uint16_t ssthresh;			/* Slow start threshold */
+	uint32_t ssthresh;			/* Slow start threshold */
 	int resent;					/* Bytes just resent */
 	int irs;					/* Initial received squence */
 	uint16_t mss;				/* Mean segment size */
@@ -285,6 +375,16 @@ struct Tcpctl {
 	uint64_t time;				/* time Finwait2 or Syn_received was sent */
 	int nochecksum;				/* non-zero means don't send checksums */
 	int flgcnt;					/* number of flags in the sequence (FIN,SEQ) */
+	int sack_ok;				/* both sides sent SACK permitted */
+	uint32_t sack_recoveries;	/* times we entered SACK recovery */
+	uint32_t sack_rxmits;		/* segments resent to fill SACK holes */
+	uint16_t synq;				/* listeners: max calls in limbo */
+	uint16_t nsynq;				/* listeners: calls in limbo now */
+	struct tcp_cc_ops *cc;		/* congestion control */
+	union {
+		struct cubic_state cubic;
+		struct bbr_state bbr;
+	} cc_state;
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -301,9 +401,10 @@ struct Tcpctl {
  *  In particular they aren't on a listener's queue so that they don't figure
  *  in the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue
- *  of 70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  Each listener may only have tcb->synq calls in limbo, and limbo as a whole
+ *  holds at most Maxlimbo.  Past either limit we answer with a SYN cookie
+ *  instead: the SYN ACK's sequence number encodes enough to rebuild the call
+ *  when the ACK comes back, and we keep no state at all in the meantime.
  */
 typedef struct Limbo Limbo;
 struct Limbo {
@@ -321,6 +422,8 @@ struct Limbo {
 	uint64_t lastsend;			/* last time we sent a synack */
 	uint8_t version;			/* v4 or v6 */
 	uint8_t rexmits;			/* number of retransmissions */
+	uint8_t sack_ok;			/* other end sent SACK permitted */
+	struct conv *listener;		/* whose synq this call counts against */
 };
 
 int tcp_irtt = DEF_RTT;			/* Initial guess at round trip time */
@@ -345,6 +448,17 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	SackRecoveries,
+	SackRxmits,
+	LimboHits,
+	LimboOverflows,
+	SynCookiesSent,
+	SynCookiesRecv,
+	SynCookiesFailed,
+	DataSegsIn,
+	AcksSent,
+	DelayedAcks,
+	QuickAcks,
 
 	Nstats
 };
@@ -365,13 +479,24 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[SackRecoveries] "SackRecoveries",
+	[SackRxmits] "SackRxmits",
+	[LimboHits] "LimboHits",
+	[LimboOverflows] "LimboOverflows",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesRecv] "SynCookiesRecv",
+	[SynCookiesFailed] "SynCookiesFailed",
+	[DataSegsIn] "DataSegsIn",
+	[AcksSent] "AcksSent",
+	[DelayedAcks] "DelayedAcks",
+	[QuickAcks] "QuickAcks",
 };
 
 typedef struct Tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
+	/* timer wheels, one per core, and the tick tcpackproc is on */
+	struct tcpwheel *wheels;
+	uint64_t tick;
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
@@ -380,6 +505,10 @@ struct tcppriv {
 	int nlimbo;
 	Limbo *lht[NLHT];
 
+	/* for SYN cookies, once limbo is full */
+	uint32_t cookiesecret[2];
+	uint64_t lastcookie;		/* when we last sent one */
+
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
 	int ackprocstarted;
@@ -417,6 +546,8 @@ void tcpsettimer(Tcpctl *);
 void tcpsynackrtt(struct conv *);
 void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
 
+static struct tcp_cc_ops newreno_cc;
+
 static void limborexmit(struct Proto *);
 static void limbo(struct conv *, uint8_t * unused_uint8_p_t, uint8_t *, Tcp *,
 				  int);
@@ -472,18 +603,23 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
+	struct tcppriv *tpriv;
 
 	s = (Tcpctl *) (c->ptcl);
+	tpriv = c->p->priv;
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %llu katimer.count %llu sack %d snd.sacks %d rcv.sacks %d sackrecov %u sackrxmit %u cc %s ssthresh %u\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start,
+					timerleft(tpriv, &s->timer), s->rerecv,
+					s->katimer.start, timerleft(tpriv, &s->katimer), s->sack_ok,
+					s->snd.nr_sacks, s->rcv.nr_sacks, s->sack_recoveries,
+					s->sack_rxmits, s->cc->name, s->ssthresh);
 }
 
 static int tcpinuse(struct conv *c)
@@ -615,50 +751,74 @@ void tcpacktimer(void *v)
 	poperror();
 }
 
+/* the acktimer went off with data still unacked */
+static void tcpdelack(void *v)
+{
+	struct conv *s = v;
+	struct tcppriv *tpriv = s->p->priv;
+
+	tpriv->stats[DelayedAcks]++;
+	tcpacktimer(v);
+}
+
 static void tcpcreate(struct conv *c)
 {
 	c->rq = qopen(QMAX, Qcoalesce, tcpacktimer, c);
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
+/* called with t->wheel locked */
+static void timerunlink(Tcptimer *t)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		t->wheel->slot[t->when & (NTCPWHEEL - 1)] = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+/* take t off its wheel, if it's on one, and leave it in newstate */
+static void timerstop(Tcptimer *t, int newstate)
+{
+	struct tcpwheel *w;
+
+	for (;;) {
+		w = ACCESS_ONCE(t->wheel);
+		if (w == NULL) {
+			t->state = newstate;
+			return;
 		}
+		spin_lock(&w->lock);
+		/* tcpgo may have moved it to another core's wheel */
+		if (t->wheel == w)
+			break;
+		spin_unlock(&w->lock);
 	}
+	if (t->state == TcptimerON)
+		timerunlink(t);
 	t->state = newstate;
+	spin_unlock(&w->lock);
+}
+
+/* ticks until a running timer fires */
+static uint64_t timerleft(struct tcppriv *priv, Tcptimer *t)
+{
+	if (t->state != TcptimerON)
+		return 0;
+	return t->when - priv->tick;
 }
 
 void tcpackproc(void *a)
 {
 	ERRSTACK(1);
 	Tcptimer *t, *tp, *timeo;
+	struct tcpwheel *w;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
+	uint64_t tick;
+	int i;
 
 	tcp = a;
 	priv = tcp->priv;
@@ -666,28 +826,26 @@ void tcpackproc(void *a)
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
 
-		qlock(&priv->tl);
+		/* tcpgo reads the tick under a wheel lock, so it can't put a timer
+		 * in a slot we have already passed. */
+		tick = ++priv->tick;
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
+		for (i = 0; i < num_cores; i++) {
+			w = &priv->wheels[i];
+			spin_lock(&w->lock);
+			for (t = w->slot[tick & (NTCPWHEEL - 1)]; t != NULL; t = tp) {
+				tp = t->next;
+				if (t->when > tick)
+					continue;
+				timerunlink(t);
+				t->state = TcptimerDONE;
+				t->readynext = timeo;
+				timeo = t;
 			}
+			spin_unlock(&w->lock);
 		}
-		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -702,13 +860,27 @@ void tcpackproc(void *a)
 
 void tcpgo(struct tcppriv *priv, Tcptimer * t)
 {
+	struct tcpwheel *w;
+	Tcptimer **slot;
+
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
-	t->count = t->start;
-	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	w = &priv->wheels[core_id()];
+	if (t->wheel != w)
+		timerstop(t, TcptimerOFF);
+	spin_lock(&w->lock);
+	if (t->wheel == w && t->state == TcptimerON)
+		timerunlink(t);
+	t->wheel = w;
+	t->when = priv->tick + t->start;
+	slot = &w->slot[t->when & (NTCPWHEEL - 1)];
+	t->next = *slot;
+	if (t->next)
+		t->next->prev = t;
+	*slot = t;
+	t->state = TcptimerON;
+	spin_unlock(&w->lock);
 }
 
 void tcphalt(struct tcppriv *priv, Tcptimer * t)
@@ -716,9 +888,7 @@ void tcphalt(struct tcppriv *priv, Tcptimer * t)
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
-	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	timerstop(t, TcptimerOFF);
 }
 
 int backoff(int n)
@@ -793,7 +963,8 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 			*scale = HaveWS | 1;
 		else
 			*scale = HaveWS | 0;
-		if (ifc->feat & NETF_TSO)
+		/* ipoput6 doesn't know about super-segments */
+		if ((ifc->feat & NETF_TSO) && version == V4)
 			*flags |= TSO;
 	} else
 		*scale = HaveWS | 0;
@@ -813,6 +984,7 @@ void inittcpctl(struct conv *s, int mode)
 	memset(tcb, 0, sizeof(Tcpctl));
 
 	tcb->ssthresh = 65535;
+	tcb->cc = &newreno_cc;
 	tcb->srtt = tcp_irtt << LOGAGAIN;
 	tcb->mdev = 0;
 
@@ -822,7 +994,7 @@ void inittcpctl(struct conv *s, int mode)
 	tcb->timer.arg = s;
 	tcb->rtt_timer.start = MAX_TIME;
 	tcb->acktimer.start = TCP_ACK / MSPTICK;
-	tcb->acktimer.func = tcpacktimer;
+	tcb->acktimer.func = tcpdelack;
 	tcb->acktimer.arg = s;
 	tcb->katimer.start = DEF_KAT / MSPTICK;
 	tcb->katimer.func = tcpkeepalive;
@@ -901,6 +1073,7 @@ void tcpstart(struct conv *s, int mode)
 		case TCP_LISTEN:
 			tpriv->stats[PassiveOpens]++;
 			tcb->flags |= CLONE;
+			tcb->synq = DEF_SYNQ;
 			tcpsetstate(s, Listen);
 			break;
 
@@ -935,6 +1108,57 @@ static char *tcpflag(uint16_t flag)
 	return buf;
 }
 
+/* Length of tcph's options, not counting padding.  SYNs carry the MSS, window
+ * scale and SACK permitted options; everything else might carry SACKs. */
+static uint16_t tcp_opts_len(Tcp *tcph)
+{
+	uint16_t len = 0;
+
+	if (tcph->flags & SYN) {
+		if (tcph->mss)
+			len += MSS_LENGTH;
+		if (tcph->ws)
+			len += WS_LENGTH;
+		if (tcph->sack_ok)
+			len += SACK_OK_LENGTH;
+	} else if (tcph->nr_sacks) {
+		len += SACK_LENGTH(tcph->nr_sacks);
+	}
+	return len;
+}
+
+/* Writes tcph's options at opt, followed by optpad bytes of padding */
+static void write_tcp_opts(Tcp *tcph, uint8_t *opt, uint16_t optpad)
+{
+	if (tcph->flags & SYN) {
+		if (tcph->mss != 0) {
+			*opt++ = MSSOPT;
+			*opt++ = MSS_LENGTH;
+			hnputs(opt, tcph->mss);
+			opt += 2;
+		}
+		if (tcph->ws != 0) {
+			*opt++ = WSOPT;
+			*opt++ = WS_LENGTH;
+			*opt++ = tcph->ws;
+		}
+		if (tcph->sack_ok) {
+			*opt++ = SACK_OK_OPT;
+			*opt++ = SACK_OK_LENGTH;
+		}
+	} else if (tcph->nr_sacks) {
+		*opt++ = SACK_OPT;
+		*opt++ = SACK_LENGTH(tcph->nr_sacks);
+		for (int i = 0; i < tcph->nr_sacks; i++) {
+			hnputl(opt, tcph->sacks[i].left);
+			hnputl(opt + 4, tcph->sacks[i].right);
+			opt += 8;
+		}
+	}
+	while (optpad-- > 0)
+		*opt++ = NOOPOPT;
+}
+
 struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 					   Tcpctl * tcb)
 {
@@ -942,19 +1166,12 @@ struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 	Tcp6hdr *h;
 	uint16_t csum;
 	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
 
-	hdrlen = TCP6_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	hdrlen = TCP6_HDRSIZE + tcp_opts_len(tcph);
+	optpad = hdrlen & 3;
+	if (optpad)
+		optpad = 4 - optpad;
+	hdrlen += optpad;
 
 	if (data) {
 		dlen = blocklen(data);
@@ -985,22 +1202,7 @@ struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
 
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	write_tcp_opts(tcph, h->tcpopt, optpad);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1025,19 +1227,12 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	Tcp4hdr *h;
 	uint16_t csum;
 	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
 
-	hdrlen = TCP4_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	hdrlen = TCP4_HDRSIZE + tcp_opts_len(tcph);
+	optpad = hdrlen & 3;
+	if (optpad)
+		optpad = 4 - optpad;
+	hdrlen += optpad;
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1064,22 +1259,7 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
 
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	write_tcp_opts(tcph, h->tcpopt, optpad);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1094,6 +1274,24 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	return data;
 }
 
+/* Parses a SACK option, optlen includes the kind and length bytes.  We only
+ * keep the first few blocks, which the peer sends most recent first. */
+static void parse_inbound_sacks(Tcp *tcph, uint8_t *opt, uint16_t optlen)
+{
+	int nr_sacks;
+
+	if (optlen < SACK_LENGTH(1) || (optlen - 2) % 8)
+		return;
+	nr_sacks = MIN((optlen - 2) / 8, MAX_NR_SACKS_PER_PACKET);
+	opt += 2;
+	for (int i = 0; i < nr_sacks; i++) {
+		tcph->sacks[i].left = nhgetl(opt);
+		tcph->sacks[i].right = nhgetl(opt + 4);
+		opt += 8;
+	}
+	tcph->nr_sacks = nr_sacks;
+}
+
 int ntohtcp6(Tcp * tcph, struct block **bpp)
 {
 	Tcp6hdr *h;
@@ -1122,6 +1320,8 @@ int ntohtcp6(Tcp * tcph, struct block **bpp)
 	tcph->urg = nhgets(h->tcpurg);
 	tcph->mss = 0;
 	tcph->ws = 0;
+	tcph->sack_ok = 0;
+	tcph->nr_sacks = 0;
 	tcph->len = nhgets(h->ploadlen) - hdrlen;
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP6_PKT);
@@ -1148,6 +1348,13 @@ int ntohtcp6(Tcp * tcph, struct block **bpp)
 				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
 					tcph->ws = HaveWS | *(optr + 2);
 				break;
+			case SACK_OK_OPT:
+				if (optlen == SACK_OK_LENGTH)
+					tcph->sack_ok = TRUE;
+				break;
+			case SACK_OPT:
+				parse_inbound_sacks(tcph, optr, optlen);
+				break;
 		}
 		n -= optlen;
 		optr += optlen;
@@ -1184,6 +1391,8 @@ int ntohtcp4(Tcp * tcph, struct block **bpp)
 	tcph->urg = nhgets(h->tcpurg);
 	tcph->mss = 0;
 	tcph->ws = 0;
+	tcph->sack_ok = 0;
+	tcph->nr_sacks = 0;
 	tcph->len = nhgets(h->length) - (hdrlen + TCP4_PKT);
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP4_PKT);
@@ -1210,6 +1419,13 @@ int ntohtcp4(Tcp * tcph, struct block **bpp)
 				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
 					tcph->ws = HaveWS | *(optr + 2);
 				break;
+			case SACK_OK_OPT:
+				if (optlen == SACK_OK_LENGTH)
+					tcph->sack_ok = TRUE;
+				break;
+			case SACK_OPT:
+				parse_inbound_sacks(tcph, optr, optlen);
+				break;
 		}
 		n -= optlen;
 		optr += optlen;
@@ -1303,6 +1519,8 @@ sndrst(struct Proto *tcp, uint8_t * source, uint8_t * dest,
 	seg->urg = 0;
 	seg->mss = 0;
 	seg->ws = 0;
+	seg->sack_ok = 0;
+	seg->nr_sacks = 0;
 	switch (version) {
 		case V4:
 			hbp = htontcp4(seg, NULL, &ph4, NULL);
@@ -1344,6 +1562,8 @@ static void tcphangup(struct conv *s)
 			seg.urg = 0;
 			seg.mss = 0;
 			seg.ws = 0;
+			seg.sack_ok = 0;
+			seg.nr_sacks = 0;
 			switch (s->ipversion) {
 				case V4:
 					tcb->protohdr.tcp4hdr.vihl = IP_VER4;
@@ -1417,6 +1637,9 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 		seg.ws = 0;
 		lp->sndscale = 0;
 	}
+	/* likewise for SACK */
+	seg.sack_ok = lp->sack_ok;
+	seg.nr_sacks = 0;
 
 	switch (lp->version) {
 		case V4:
@@ -1441,7 +1664,142 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 #define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
 
 /*
- *  put a call into limbo and respond with a SYN ACK
+ *  SYN cookies.  The top 5 bits of the ISS are a clock that ticks every
+ *  COOKIE_PERIOD ms, the next 3 index cookiemss[], and the low 24 are a keyed
+ *  hash of the connection, the peer's ISS, and those 8 bits.  We can't
+ *  remember window scaling or SACK, so a cookie SYN ACK doesn't offer them.
+ */
+enum {
+	COOKIE_MSSSHIFT = 24,
+	COOKIE_HASHMASK = (1 << COOKIE_MSSSHIFT) - 1,
+	COOKIE_PERIOD = 64000,
+};
+
+static const uint16_t cookiemss[] = {
+	536, 1220, 1300, 1380, 1420, 1440, 1460, 8960
+};
+
+static uint32_t cookieclock(void)
+{
+	return (NOW / COOKIE_PERIOD) & 0x1f;
+}
+
+static uint32_t cookiehash(struct tcppriv *tpriv, Limbo *lp, uint32_t bits)
+{
+	uint32_t h = tpriv->cookiesecret[0] ^ (lp->lport << 16 | lp->rport);
+	int i;
+
+	for (i = 0; i < IPaddrlen; i += 4)
+		h = (h ^ nhgetl(lp->raddr + i)) * 0x9e3779b1 ^ nhgetl(lp->laddr + i);
+	h = (h ^ lp->irs) * 0x9e3779b1 ^ bits ^ tpriv->cookiesecret[1];
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h & COOKIE_HASHMASK;
+}
+
+/* pick lp->iss for a call we won't remember, rounding lp->mss down to fit */
+static void mkcookie(struct tcppriv *tpriv, Limbo *lp)
+{
+	uint32_t bits;
+	int i;
+
+	for (i = ARRAY_SIZE(cookiemss) - 1; i > 0; i--)
+		if (cookiemss[i] <= lp->mss)
+			break;
+	lp->mss = cookiemss[i];
+	bits = cookieclock() << 3 | i;
+	lp->iss = bits << COOKIE_MSSSHIFT | cookiehash(tpriv, lp, bits);
+}
+
+/* is lp->iss a cookie from this tick or the last?  if so, recover lp->mss */
+static bool chkcookie(struct tcppriv *tpriv, Limbo *lp)
+{
+	uint32_t bits = lp->iss >> COOKIE_MSSSHIFT;
+
+	if (((cookieclock() - (bits >> 3)) & 0x1f) > 1)
+		return FALSE;
+	if (cookiehash(tpriv, lp, bits) != (lp->iss & COOKIE_HASHMASK))
+		return FALSE;
+	lp->mss = cookiemss[bits & 7];
+	return TRUE;
+}
+
+/*
+ *  answer a SYN without putting it in limbo
+ *
+ *  called with proto locked
+ */
+static void sndcookie(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
+                      int version)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	Limbo lp;
+
+	memset(&lp, 0, sizeof(lp));
+	lp.version = version;
+	ipmove(lp.laddr, dest);
+	ipmove(lp.raddr, source);
+	lp.lport = seg->dest;
+	lp.rport = seg->source;
+	lp.mss = seg->mss;
+	lp.irs = seg->seq;
+	mkcookie(tpriv, &lp);
+	if (sndsynack(s->p, &lp) < 0)
+		return;
+	tpriv->stats[SynCookiesSent]++;
+	tpriv->lastcookie = lp.lastsend;
+}
+
+/*
+ *  rebuild a call from the ACK of a cookie SYN ACK, if that's what this is
+ *
+ *  called with proto locked
+ */
+static bool cookieincoming(struct tcppriv *tpriv, Tcp *segp, uint8_t *src,
+                           uint8_t *dst, uint8_t version, Limbo *lp)
+{
+	/* don't bother unless we've been handing them out */
+	if (tpriv->lastcookie == 0 || NOW - tpriv->lastcookie > 2 * COOKIE_PERIOD)
+		return FALSE;
+	memset(lp, 0, sizeof(*lp));
+	lp->version = version;
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = segp->seq - 1;
+	lp->iss = segp->ack - 1;
+	if (!chkcookie(tpriv, lp)) {
+		tpriv->stats[SynCookiesFailed]++;
+		return FALSE;
+	}
+	tpriv->stats[SynCookiesRecv]++;
+	return TRUE;
+}
+
+/*
+ *  take a call out of limbo's counts and free it.  the caller unlinks it.
+ *
+ *  called with proto locked
+ */
+static void limbofree(struct tcppriv *tpriv, Limbo *lp)
+{
+	struct conv *s = lp->listener;
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	tpriv->nlimbo--;
+	/* the listener may have closed, and its conv been reused, since */
+	if (tcb->state == Listen && s->lport == lp->lport && tcb->nsynq > 0)
+		tcb->nsynq--;
+	kfree(lp);
+}
+
+/*
+ *  put a call into limbo and respond with a SYN ACK.  if the listener's
+ *  synq or limbo is full, respond with a SYN cookie instead.
  *
  *  called with proto locked
  */
@@ -1450,9 +1808,11 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 {
 	Limbo *lp, **l;
 	struct tcppriv *tpriv;
+	Tcpctl *tcb;
 	int h;
 
 	tpriv = s->p->priv;
+	tcb = (Tcpctl *) s->ptcl;
 	h = hashipa(source, seg->source);
 
 	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
@@ -1471,16 +1831,17 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 	}
 	lp = *l;
 	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
-		} else {
-			lp = kzmalloc(sizeof(*lp), 0);
-			if (lp == NULL)
-				return;
-			tpriv->nlimbo++;
+		if (tcb->nsynq >= tcb->synq || tpriv->nlimbo >= Maxlimbo) {
+			tpriv->stats[LimboOverflows]++;
+			sndcookie(s, source, dest, seg, version);
+			return;
 		}
+		lp = kzmalloc(sizeof(*lp), 0);
+		if (lp == NULL)
+			return;
+		tpriv->nlimbo++;
+		tcb->nsynq++;
+		lp->listener = s;
 		*l = lp;
 		lp->version = version;
 		ipmove(lp->laddr, dest);
@@ -1489,14 +1850,14 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 		lp->rport = seg->source;
 		lp->mss = seg->mss;
 		lp->rcvscale = seg->ws;
+		lp->sack_ok = seg->sack_ok;
 		lp->irs = seg->seq;
 		urandom_read(&lp->iss, sizeof(lp->iss));
 	}
 
 	if (sndsynack(s->p, lp) < 0) {
 		*l = lp->next;
-		tpriv->nlimbo--;
-		kfree(lp);
+		limbofree(tpriv, lp);
 	}
 }
 
@@ -1526,9 +1887,8 @@ static void limborexmit(struct Proto *tcp)
 
 			/* time it out after 1 second */
 			if (++(lp->rexmits) > 5) {
-				tpriv->nlimbo--;
 				*l = lp->next;
-				kfree(lp);
+				limbofree(tpriv, lp);
 				continue;
 			}
 
@@ -1537,9 +1897,8 @@ static void limborexmit(struct Proto *tcp)
 				continue;
 
 			if (sndsynack(tcp, lp) < 0) {
-				tpriv->nlimbo--;
 				*l = lp->next;
-				kfree(lp);
+				limbofree(tpriv, lp);
 				continue;
 			}
 
@@ -1578,9 +1937,8 @@ limborst(struct conv *s, Tcp * segp, uint8_t * src, uint8_t * dst,
 
 		/* RST can only follow the SYN */
 		if (segp->seq == lp->irs + 1) {
-			tpriv->nlimbo--;
 			*l = lp->next;
-			kfree(lp);
+			limbofree(tpriv, lp);
 		}
 		break;
 	}
@@ -1588,7 +1946,8 @@ limborst(struct conv *s, Tcp * segp, uint8_t * src, uint8_t * dst,
 
 /*
  *  come here when we finally get an ACK to our SYN-ACK.
- *  lookup call in limbo.  if found, create a new conversation
+ *  lookup call in limbo, or check for a cookie.  if found, create a new
+ *  conversation
  *
  *  called with proto locked
  */
@@ -1600,7 +1959,8 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	struct tcppriv *tpriv;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
-	Limbo *lp, **l;
+	Limbo *lp, **l, call;
+	bool cookie;
 	int h;
 
 	/* unless it's just an ack, it can't be someone coming out of limbo */
@@ -1629,15 +1989,20 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 		if (segp->seq != lp->irs + 1 || segp->ack != lp->iss + 1) {
 			netlog(s->p->f, Logtcp, "tcpincoming s 0x%lx/0x%lx a 0x%lx 0x%lx\n",
 				   segp->seq, lp->irs + 1, segp->ack, lp->iss + 1);
-			lp = NULL;
-		} else {
-			tpriv->nlimbo--;
-			*l = lp->next;
+			return NULL;
 		}
+		*l = lp->next;
 		break;
 	}
-	if (lp == NULL)
+	cookie = lp == NULL;
+	if (!cookie) {
+		tpriv->stats[LimboHits]++;
+		call = *lp;
+		limbofree(tpriv, lp);
+	} else if (!cookieincoming(tpriv, segp, src, dst, version, &call)) {
 		return NULL;
+	}
+	lp = &call;
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
 	if (new == NULL)
@@ -1674,16 +2039,17 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
+	tcb->sack_ok = lp->sack_ok;
 
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->mss;
 
-	/* set initial round trip time */
-	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
-	tcpsynackrtt(new);
-
-	kfree(lp);
+	/* set initial round trip time.  a cookie doesn't say when we sent it. */
+	if (!cookie) {
+		tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
+		tcpsynackrtt(new);
+	}
 
 	/* set up proto header */
 	switch (version) {
@@ -1769,12 +2135,491 @@ void tcpsynackrtt(struct conv *s)
 	tcphalt(tpriv, &tcb->rtt_timer);
 }
 
+static uint32_t seq_min(uint32_t x, uint32_t y)
+{
+	return seq_lt(x, y) ? x : y;
+}
+
+static uint32_t seq_max(uint32_t x, uint32_t y)
+{
+	return seq_gt(x, y) ? x : y;
+}
+
+/*
+ *  SACK, RFC 2018, with RFC 6675 loss recovery.
+ *
+ *  As a receiver, we remember the out of order data we have queued in
+ *  rcv.sacks and put it in the SACK option of every ack.  As a sender,
+ *  snd.sacks is our scoreboard of what the peer has told us it has.  When
+ *  we enter recovery, we use it to estimate how much is in flight (the pipe)
+ *  and resend only the holes that are considered lost.
+ */
+
+/* Adds [left, right) to the receive SACK blocks, merging any blocks it
+ * overlaps or touches.  The new block goes first, the oldest falls off. */
+static void track_rcv_sack(Tcpctl *tcb, uint32_t left, uint32_t right)
+{
+	struct sack_block *sacks = tcb->rcv.sacks;
+	int nr = 0;
+
+	if (!tcb->sack_ok || !seq_lt(left, right))
+		return;
+	for (int i = 0; i < tcb->rcv.nr_sacks; i++) {
+		if (seq_le(sacks[i].left, right) && seq_le(left, sacks[i].right)) {
+			left = seq_min(left, sacks[i].left);
+			right = seq_max(right, sacks[i].right);
+			continue;
+		}
+		sacks[nr++] = sacks[i];
+	}
+	nr = MIN(nr, MAX_NR_RCV_SACKS - 1);
+	memmove(&sacks[1], &sacks[0], nr * sizeof(struct sack_block));
+	sacks[0].left = left;
+	sacks[0].right = right;
+	tcb->rcv.nr_sacks = nr + 1;
+}
+
+/* Drops receive SACK blocks that rcv.nxt has caught up to.  We consume the
+ * reseq queue in order, so a block is either entirely above rcv.nxt or gone. */
+static void trim_rcv_sacks(Tcpctl *tcb)
+{
+	int nr = 0;
+
+	for (int i = 0; i < tcb->rcv.nr_sacks; i++) {
+		if (seq_le(tcb->rcv.sacks[i].right, tcb->rcv.nxt))
+			continue;
+		tcb->rcv.sacks[nr] = tcb->rcv.sacks[i];
+		tcb->rcv.sacks[nr].left = seq_max(tcb->rcv.sacks[nr].left,
+		                                  tcb->rcv.nxt);
+		nr++;
+	}
+	tcb->rcv.nr_sacks = nr;
+}
+
+/* Merges [left, right) into the scoreboard.  If it is full, the highest block
+ * gets dropped, which at worst makes us resend something the peer has. */
+static void sack_merge(Tcpctl *tcb, uint32_t left, uint32_t right)
+{
+	struct sack_block *sb = tcb->snd.sacks;
+	int i, j, n = tcb->snd.nr_sacks;
+
+	for (i = 0; i < n; i++) {
+		if (seq_ge(sb[i].right, left))
+			break;
+	}
+	for (j = i; j < n && seq_le(sb[j].left, right); j++) {
+		left = seq_min(left, sb[j].left);
+		right = seq_max(right, sb[j].right);
+	}
+	if (i == j) {
+		/* no overlaps, insert at i */
+		if (n == MAX_NR_SND_SACKS) {
+			if (i == n)
+				return;
+			n--;
+		}
+		memmove(&sb[i + 1], &sb[i], (n - i) * sizeof(struct sack_block));
+		n++;
+	} else {
+		/* blocks i through j - 1 collapse into i */
+		memmove(&sb[i + 1], &sb[j], (n - j) * sizeof(struct sack_block));
+		n -= j - i - 1;
+	}
+	sb[i].left = left;
+	sb[i].right = right;
+	tcb->snd.nr_sacks = n;
+}
+
+/* Adds the SACK blocks from an incoming ack to the scoreboard */
+static void update_sacks(Tcpctl *tcb, Tcp *seg)
+{
+	struct sack_block *sack;
+
+	for (int i = 0; i < seg->nr_sacks; i++) {
+		sack = &seg->sacks[i];
+		/* D-SACKs and garbage: only take what we sent and is unacked */
+		if (!seq_lt(sack->left, sack->right) ||
+		    seq_lt(sack->left, tcb->snd.una) ||
+		    seq_gt(sack->right, tcb->snd.nxt))
+			continue;
+		sack_merge(tcb, sack->left, sack->right);
+	}
+}
+
+/* Drops the parts of the scoreboard that snd.una covers */
+static void trim_snd_sacks(Tcpctl *tcb)
+{
+	int nr = 0;
+
+	for (int i = 0; i < tcb->snd.nr_sacks; i++) {
+		if (seq_le(tcb->snd.sacks[i].right, tcb->snd.una))
+			continue;
+		tcb->snd.sacks[nr] = tcb->snd.sacks[i];
+		tcb->snd.sacks[nr].left = seq_max(tcb->snd.sacks[nr].left,
+		                                  tcb->snd.una);
+		nr++;
+	}
+	tcb->snd.nr_sacks = nr;
+}
+
+static uint32_t sacked_bytes(Tcpctl *tcb)
+{
+	uint32_t sacked = 0;
+
+	for (int i = 0; i < tcb->snd.nr_sacks; i++)
+		sacked += tcb->snd.sacks[i].right - tcb->snd.sacks[i].left;
+	return sacked;
+}
+
+/* Bytes in [left, right) that the peer hasn't SACKed */
+static uint32_t sack_holes_len(Tcpctl *tcb, uint32_t left, uint32_t right)
+{
+	struct sack_block *sb;
+	uint32_t len, l, r;
+
+	if (!seq_lt(left, right))
+		return 0;
+	len = right - left;
+	for (int i = 0; i < tcb->snd.nr_sacks; i++) {
+		sb = &tcb->snd.sacks[i];
+		l = seq_max(sb->left, left);
+		r = seq_min(sb->right, right);
+		if (seq_lt(l, r))
+			len -= r - l;
+	}
+	return len;
+}
+
+/* RFC 6675's IsLost() for the whole scoreboard: every hole below the returned
+ * sequence has more than (DupThresh - 1) * SMSS bytes SACKed above it.  We're
+ * in recovery, so the first hole is lost no matter what. */
+static uint32_t sack_lost_edge(Tcpctl *tcb)
+{
+	uint32_t sacked = 0;
+
+	for (int i = tcb->snd.nr_sacks - 1; i >= 0; i--) {
+		sacked += tcb->snd.sacks[i].right - tcb->snd.sacks[i].left;
+		if (sacked > (TCPREXMTTHRESH - 1) * tcb->mss)
+			return tcb->snd.sacks[i].left;
+	}
+	return tcb->snd.nr_sacks ? tcb->snd.sacks[0].left : tcb->snd.una;
+}
+
+/* RFC 6675's SetPipe(): unSACKed data is in flight, except for the lost holes
+ * we haven't resent yet. */
+static uint32_t sack_pipe(Tcpctl *tcb)
+{
+	uint32_t rxt = seq_max(tcb->snd.high_rxt, tcb->snd.una);
+
+	return sack_holes_len(tcb, tcb->snd.una, tcb->snd.nxt) -
+	       sack_holes_len(tcb, rxt, seq_max(rxt, sack_lost_edge(tcb)));
+}
+
+/* RFC 6675's NextSeg(), rule 1: finds the lowest lost hole we haven't resent.
+ * Returns TRUE with the hole's start and length, FALSE if there is none and we
+ * should send new data. */
+static bool sack_next_hole(Tcpctl *tcb, uint32_t *start, uint32_t *len)
+{
+	struct sack_block *sb;
+	uint32_t seq = seq_max(tcb->snd.high_rxt, tcb->snd.una);
+	uint32_t lost_edge = sack_lost_edge(tcb);
+
+	for (int i = 0; i < tcb->snd.nr_sacks; i++) {
+		sb = &tcb->snd.sacks[i];
+		if (seq_le(sb->right, seq))
+			continue;
+		if (seq_le(sb->left, seq)) {
+			seq = sb->right;
+			continue;
+		}
+		if (!seq_lt(seq, lost_edge))
+			return FALSE;
+		*start = seq;
+		*len = sb->left - seq;
+		return TRUE;
+	}
+	/* anything above the highest SACK isn't known to be lost */
+	return FALSE;
+}
+
+static void sack_enter_recovery(struct conv *s, Tcpctl *tcb)
+{
+	struct tcppriv *tpriv = s->p->priv;
+
+	tcb->snd.recovery = SACK_RECOVERY;
+	tcb->snd.rxt = tcb->snd.nxt;
+	tcb->snd.high_rxt = tcb->snd.una;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->cwind = tcb->ssthresh;
+	tcb->sack_recoveries++;
+	tpriv->stats[SackRecoveries]++;
+	netlog(s->p->f, Logtcprxmt, "sack recovery una %lu nxt %lu cwind %u\n",
+	       tcb->snd.una, tcb->snd.nxt, tcb->cwind);
+}
+
+/* Grows cwind by expand, but not past the peer's window */
+static void cwind_grow(Tcpctl *tcb, uint32_t expand)
+{
+	if (tcb->cwind >= tcb->snd.wnd)
+		return;
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
+/* RFC 5681: half of what's in flight, but at least two segments */
+static uint32_t half_flight(Tcpctl *tcb)
+{
+	return MAX((tcb->snd.nxt - tcb->snd.una) / 2, 2 * tcb->mss);
+}
+
+/* Slow start, then a segment per window */
+static void newreno_cong_avoid(Tcpctl *tcb, uint32_t ack, uint32_t acked)
+{
+	uint32_t expand;
+
+	if (tcb->cwind < tcb->ssthresh) {
+		expand = tcb->mss;
+		if (acked < expand)
+			expand = acked;
+	} else
+		expand = ((int)tcb->mss * tcb->mss) / tcb->cwind;
+	cwind_grow(tcb, expand);
+}
+
+static struct tcp_cc_ops newreno_cc = {
+	.name = "newreno",
+	.cong_avoid = newreno_cong_avoid,
+	.ssthresh = half_flight,
+};
+
+/*
+ *  CUBIC, RFC 8312.  After a loss, cwind follows W(t) = C(t - K)^3 + W_max,
+ *  flattening out around the old W_max and then probing past it, independent
+ *  of the RTT.  C = 0.4, beta = 0.7.  Windows are in bytes, times in ms.
+ */
+#define CUBIC_MAX_DT 1000000	/* ms; keeps dt^3 in 64 bits */
+
+/* Hacker's Delight integer cube root */
+static uint32_t icbrt64(uint64_t x)
+{
+	uint64_t y = 0, b;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		y += y;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+	return y;
+}
+
+static void cubic_cong_avoid(Tcpctl *tcb, uint32_t ack, uint32_t acked)
+{
+	struct cubic_state *c = &tcb->cc_state.cubic;
+	uint64_t now, t, dt, delta, target, expand;
+
+	if (tcb->cwind < tcb->ssthresh) {
+		cwind_grow(tcb, MIN(acked, tcb->mss));
+		return;
+	}
+	now = NOW;
+	if (!c->epoch_start) {
+		c->epoch_start = now;
+		c->reno_cwind = tcb->cwind;
+		if (tcb->cwind < c->w_max) {
+			/* K^3 = (W_max - cwind) / C, in segments and seconds */
+			c->k = icbrt64((uint64_t)((c->w_max - tcb->cwind) / tcb->mss)
+			               * 2500000000ULL);
+			c->origin = c->w_max;
+		} else {
+			c->k = 0;
+			c->origin = tcb->cwind;
+		}
+	}
+	/* where we'll be an RTT from now */
+	t = now - c->epoch_start + (tcb->srtt >> LOGAGAIN);
+	dt = MIN(t > c->k ? t - c->k : c->k - t, CUBIC_MAX_DT);
+	delta = (dt * dt * dt / 10000000) * 4 * tcb->mss / 1000;
+	if (t > c->k)
+		target = c->origin + delta;
+	else
+		target = c->origin > delta ? c->origin - delta : 0;
+
+	/* don't be slower than reno would be: 3 * beta / (2 - beta) = 0.53 */
+	c->reno_cwind += MAX((uint64_t)acked * tcb->mss * 53 /
+	                     (100 * c->reno_cwind), 1);
+	target = MAX(target, c->reno_cwind);
+
+	if (target > tcb->cwind) {
+		/* at most 1.5x per RTT */
+		expand = (target - tcb->cwind) * acked / tcb->cwind;
+		expand = MIN(expand, acked / 2);
+	} else {
+		expand = (uint64_t)tcb->mss * acked / (100 * tcb->cwind);
+	}
+	cwind_grow(tcb, MAX(expand, 1));
+}
+
+static uint32_t cubic_ssthresh(Tcpctl *tcb)
+{
+	struct cubic_state *c = &tcb->cc_state.cubic;
+
+	c->epoch_start = 0;
+	/* fast convergence: if we didn't make it back to W_max, let go of some */
+	if (tcb->cwind < c->w_max)
+		c->w_max = tcb->cwind * 17 / 20;
+	else
+		c->w_max = tcb->cwind;
+	return MAX(tcb->cwind * 7 / 10, 2 * tcb->mss);
+}
+
+static struct tcp_cc_ops cubic_cc = {
+	.name = "cubic",
+	.cong_avoid = cubic_cong_avoid,
+	.ssthresh = cubic_ssthresh,
+};
+
+/*
+ *  BBR-style model based control.  Each round trip we measure the delivery
+ *  rate and the round's duration.  cwind tracks gain * max_bw * min_rtt, the
+ *  bandwidth-delay product, and ignores losses.  Startup grows
+ *  the window at 2.89x until the bandwidth stops growing 25% a round.  After
+ *  that, the gain cycles to probe for more bandwidth and then drain the queue
+ *  it made.  Like real BBR we also pace at gain * max_bw, though that only
+ *  takes effect on ifcs with fq on.
+ */
+#define BBR_MIN_RTT_MS 10000	/* how long a min_rtt sample is good for */
+
+static int bbr_cycle_gain[] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+static uint32_t bbr_max_bw(struct bbr_state *b)
+{
+	uint32_t bw = 0;
+
+	for (int i = 0; i < BBR_BW_ROUNDS; i++)
+		bw = MAX(bw, b->bw[i]);
+	return bw;
+}
+
+static uint32_t bbr_bdp(Tcpctl *tcb)
+{
+	struct bbr_state *b = &tcb->cc_state.bbr;
+
+	return MIN((uint64_t)bbr_max_bw(b) * b->min_rtt, UINT32_MAX / 4);
+}
+
+static void bbr_end_round(Tcpctl *tcb, uint64_t now)
+{
+	struct bbr_state *b = &tcb->cc_state.bbr;
+	uint32_t elapsed = MAX(now - b->round_start, 1);
+
+	b->bw[b->bw_idx] = b->round_delivered / elapsed;
+	b->bw_idx = (b->bw_idx + 1) % BBR_BW_ROUNDS;
+	if (!b->min_rtt || elapsed < b->min_rtt ||
+	    now - b->min_rtt_stamp > BBR_MIN_RTT_MS) {
+		b->min_rtt = elapsed;
+		b->min_rtt_stamp = now;
+	}
+	if (!b->filled_pipe) {
+		if (bbr_max_bw(b) >= (uint64_t)b->full_bw * 5 / 4) {
+			b->full_bw = bbr_max_bw(b);
+			b->full_bw_rounds = 0;
+		} else if (++b->full_bw_rounds >= 3) {
+			b->filled_pipe = TRUE;
+		}
+	} else {
+		b->cycle_idx = (b->cycle_idx + 1) % ARRAY_SIZE(bbr_cycle_gain);
+	}
+}
+
+static void bbr_cong_avoid(Tcpctl *tcb, uint32_t ack, uint32_t acked)
+{
+	struct bbr_state *b = &tcb->cc_state.bbr;
+	uint64_t now = NOW;
+	uint64_t target;
+
+	b->round_delivered += acked;
+	if (!b->round_start || seq_ge(ack, b->round_end)) {
+		if (b->round_start)
+			bbr_end_round(tcb, now);
+		b->round_end = tcb->snd.nxt;
+		b->round_start = now;
+		b->round_delivered = 0;
+	}
+	if (!b->min_rtt) {
+		/* no model yet, slow start */
+		cwind_grow(tcb, MIN(acked, tcb->mss));
+		return;
+	}
+	target = (uint64_t)bbr_bdp(tcb) *
+	         (b->filled_pipe ? 2 * bbr_cycle_gain[b->cycle_idx] : 289) / 100;
+	target = MAX(target, 4 * tcb->mss);
+	if (tcb->cwind < target)
+		cwind_grow(tcb, MIN(acked, target - tcb->cwind));
+	else
+		tcb->cwind = target;
+}
+
+/* The model, not the loss, says what the path holds */
+static uint32_t bbr_ssthresh(Tcpctl *tcb)
+{
+	return MAX(bbr_bdp(tcb), 4 * tcb->mss);
+}
+
+/* Real BBR's pacing: gain * max_bw, no matter what cwind is */
+static uint64_t bbr_pacing_rate(Tcpctl *tcb)
+{
+	struct bbr_state *b = &tcb->cc_state.bbr;
+
+	if (!b->min_rtt)
+		return 0;
+	return (uint64_t)bbr_max_bw(b) * 1000 *
+	       (b->filled_pipe ? bbr_cycle_gain[b->cycle_idx] : 289) / 100;
+}
+
+static struct tcp_cc_ops bbr_cc = {
+	.name = "bbr",
+	.cong_avoid = bbr_cong_avoid,
+	.ssthresh = bbr_ssthresh,
+	.pacing_rate = bbr_pacing_rate,
+};
+
+static struct tcp_cc_ops *tcp_ccs[] = {
+	&newreno_cc,
+	&cubic_cc,
+	&bbr_cc,
+};
+
+/*
+ *  Spread cwind over an srtt, with headroom so pacing doesn't hold back
+ *  growth: 2x in slow start, 1.2x after (what Linux does).
+ */
+static void tcpsetpacing(struct conv *s, Tcpctl *tcb)
+{
+	uint64_t srtt = tcb->srtt >> LOGAGAIN;
+
+	if (tcb->cc->pacing_rate) {
+		s->pacing_rate = tcb->cc->pacing_rate(tcb);
+		return;
+	}
+	if (srtt == 0) {
+		s->pacing_rate = 0;
+		return;
+	}
+	s->pacing_rate = (uint64_t)tcb->cwind * 1000 / srtt *
+	                 (tcb->cwind < tcb->ssthresh ? 200 : 120) / 100;
+}
+
 void update(struct conv *s, Tcp * seg)
 {
 	int rtt, delta;
 	Tcpctl *tcb;
 	uint32_t acked;
-	uint32_t expand;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -1786,6 +2631,9 @@ void update(struct conv *s, Tcp * seg)
 		return;
 	}
 
+	if (tcb->sack_ok && seg->nr_sacks)
+		update_sacks(tcb, seg);
+
 	/* added by Dong Lin for fast retransmission */
 	if (seg->ack == tcb->snd.una
 		&& tcb->snd.una != tcb->snd.nxt
@@ -1795,12 +2643,19 @@ void update(struct conv *s, Tcp * seg)
 		netlog(s->p->f, Logtcprxmt, "dupack %lu ack %lu sndwnd %d advwin %d\n",
 			   tcb->snd.dupacks, seg->ack, tcb->snd.wnd, seg->wnd);
 
-		if (++tcb->snd.dupacks == TCPREXMTTHRESH) {
+		++tcb->snd.dupacks;
+		if (tcb->sack_ok && tcb->snd.nr_sacks) {
+			/* RFC 6675: enough dupacks, or enough SACKed above una */
+			if (!tcb->snd.recovery &&
+			    (tcb->snd.dupacks >= TCPREXMTTHRESH ||
+			     sacked_bytes(tcb) > (TCPREXMTTHRESH - 1) * tcb->mss))
+				sack_enter_recovery(s, tcb);
+		} else if (tcb->snd.dupacks == TCPREXMTTHRESH) {
 			/*
 			 *  tahoe tcp rxt the packet, half sshthresh,
 			 *  and set cwnd to one packet
 			 */
-			tcb->snd.recovery = 1;
+			tcb->snd.recovery = TAHOE_RECOVERY;
 			tcb->snd.rxt = tcb->snd.nxt;
 			netlog(s->p->f, Logtcprxmt, "fast rxt %lu, nxt %lu\n", tcb->snd.una,
 				   tcb->snd.nxt);
@@ -1852,21 +2707,9 @@ void update(struct conv *s, Tcp * seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			expand = tcb->mss;
-			if (acked < expand)
-				expand = acked;
-		} else
-			expand = ((int)tcb->mss * tcb->mss) / tcb->cwind;
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
+	/* open the window as long as we're not recovering from lost packets */
+	if (!tcb->snd.recovery)
+		tcb->cc->cong_avoid(tcb, seg->ack, acked);
 
 	/* Adjust the timers according to the round trip time */
 	if (tcb->rtt_timer.state == TcptimerON && seq_ge(seg->ack, tcb->rttseq)) {
@@ -1874,7 +2717,7 @@ void update(struct conv *s, Tcp * seg)
 		if ((tcb->flags & RETRAN) == 0) {
 			tcb->backoff = 0;
 			tcb->backedoff = 0;
-			rtt = tcb->rtt_timer.start - tcb->rtt_timer.count;
+			rtt = tcb->rtt_timer.start - timerleft(tpriv, &tcb->rtt_timer);
 			if (rtt == 0)
 				rtt = 1;	/* otherwise all close systems will rexmit in 0 time */
 			rtt *= MSPTICK;
@@ -1901,6 +2744,7 @@ done:
 		tcb->flgcnt--;
 
 	tcb->snd.una = seg->ack;
+	trim_snd_sacks(tcb);
 	if (seq_gt(seg->ack, tcb->snd.urg))
 		tcb->snd.urg = seg->ack;
 
@@ -1915,6 +2759,19 @@ done:
 	tcb->flags &= ~RETRAN;
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
+	tcpsetpacing(s, tcb);
+}
+
+/* Whether s, locked, is still the connection for this 4-tuple */
+static bool tcpconnmatch(struct conv *s, uint8_t *raddr, uint16_t rport,
+                         uint8_t *laddr, uint16_t lport)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	if (tcb->state == Closed || tcb->state == Listen)
+		return FALSE;
+	return s->rport == rport && s->lport == lport &&
+	       ipcmp(s->raddr, raddr) == 0 && ipcmp(s->laddr, laddr) == 0;
 }
 
 void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
@@ -2017,6 +2874,17 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		}
 	}
 
+	/* Established conversations don't need the protocol lock: find them
+	 * locklessly and make sure they are still the same connection once we
+	 * hold their own lock. */
+	s = iphtlookconn(&tpriv->ht, source, seg.source, dest, seg.dest);
+	if (s != NULL) {
+		qlock(&s->qlock);
+		if (tcpconnmatch(s, source, seg.source, dest, seg.dest))
+			goto locked;
+		qunlock(&s->qlock);
+	}
+
 	/* lock protocol while searching for a conversation */
 	qlock(&tcp->qlock);
 
@@ -2062,13 +2930,14 @@ reset:
 	 * locked and implements the state machine directly out of the RFC.
 	 * Out-of-band data is ignored - it was always a bad idea.
 	 */
+	qlock(&s->qlock);
+	qunlock(&tcp->qlock);
+locked:
 	tcb = (Tcpctl *) s->ptcl;
 	if (waserror()) {
 		qunlock(&s->qlock);
 		nexterror();
 	}
-	qlock(&s->qlock);
-	qunlock(&tcp->qlock);
 
 	/* fix up window */
 	seg.wnd <<= tcb->rcv.scale;
@@ -2287,18 +3156,29 @@ reset:
 						bp = NULL;
 
 						/*
-						 *  Force an ack every 2 data messages.  This is
-						 *  a hack for rob to make his home system run
-						 *  faster.
+						 *  Delayed acks, RFC 1122 4.2.3.2: ack every
+						 *  second full sized segment, else let the
+						 *  acktimer do it, unless a reply carries it
+						 *  first.
 						 *
-						 *  this also keeps the standard TCP congestion
-						 *  control working since it needs an ack every
-						 *  2 max segs worth.  This is not quite that,
-						 *  but under a real stream is equivalent since
-						 *  every packet has a max seg in it.
+						 *  When data starts flowing, or again after an
+						 *  idle RTO, the sender is in slow start and its
+						 *  cwnd only grows as our acks come back, so ack
+						 *  the first QUICKACKS segments right away.
 						 */
-						if (++(tcb->rcv.una) >= 2)
+						tpriv->stats[DataSegsIn]++;
+						if (NOW - tcb->rcv.lastdata > (tcb->srtt >> LOGAGAIN)
+						    + tcb->mdev + MSPTICK)
+							tcb->rcv.quickack = QUICKACKS;
+						tcb->rcv.lastdata = NOW;
+						tcb->rcv.una += length;
+						if (tcb->rcv.quickack) {
+							tcb->rcv.quickack--;
+							tpriv->stats[QuickAcks]++;
+							tcb->flags |= FORCE;
+						} else if (tcb->rcv.una >= 2 * tcb->mss) {
 							tcb->flags |= FORCE;
+						}
 					}
 					tcb->rcv.nxt += length;
 
@@ -2408,7 +3288,8 @@ void tcpoutput(struct conv *s)
 	Tcpctl *tcb;
 	struct block *hbp, *bp;
 	int sndcnt, n;
-	uint32_t ssize, dsize, usable, sent;
+	uint32_t ssize, dsize, usable, sent, pipe, hole, hole_len, payload_mss;
+	bool sack_rxmit;
 	struct Fs *f;
 	struct tcppriv *tpriv;
 	uint8_t version;
@@ -2443,6 +3324,7 @@ void tcpoutput(struct conv *s)
 		/* Compute usable segment based on offered window and limit
 		 * window probes to one
 		 */
+		sack_rxmit = FALSE;
 		if (tcb->snd.wnd == 0) {
 			if (sent != 0) {
 				if ((tcb->flags & FORCE) == 0)
@@ -2450,6 +3332,20 @@ void tcpoutput(struct conv *s)
 //              tcb->snd.ptr = tcb->snd.una;
 			}
 			usable = 1;
+		} else if (tcb->snd.recovery == SACK_RECOVERY) {
+			/* the pipe says what's in flight, and the holes go first */
+			pipe = sack_pipe(tcb);
+			usable = tcb->cwind > pipe ? tcb->cwind - pipe : 0;
+			if (usable && sack_next_hole(tcb, &hole, &hole_len)) {
+				tcb->snd.ptr = hole;
+				sent = hole - tcb->snd.una;
+				usable = MIN(usable, hole_len);
+				sack_rxmit = TRUE;
+			} else if (tcb->snd.wnd > sent) {
+				usable = MIN(usable, tcb->snd.wnd - sent);
+			} else {
+				usable = 0;
+			}
 		} else {
 			usable = tcb->cwind;
 			if (tcb->snd.wnd < usable)
@@ -2462,16 +3358,22 @@ void tcpoutput(struct conv *s)
 				   tcb->snd.wnd, tcb->cwind);
 		if (usable < ssize)
 			ssize = usable;
-		if (ssize > tcb->mss) {
+		/* our SACK option comes out of the segment's payload */
+		trim_rcv_sacks(tcb);
+		payload_mss = tcb->mss;
+		if (tcb->sack_ok && tcb->rcv.nr_sacks)
+			payload_mss -= ROUNDUP(SACK_LENGTH(MIN(tcb->rcv.nr_sacks,
+			                                       MAX_NR_SACKS_PER_PACKET)),
+			                       4);
+		if (ssize > payload_mss) {
 			if ((tcb->flags & TSO) == 0) {
-				ssize = tcb->mss;
+				ssize = payload_mss;
 			} else {
 				int segs, window;
 
-				/*  Don't send too much.  32K is arbitrary..
-				 */
-				if (ssize > 32 * 1024)
-					ssize = 32 * 1024;
+				/* Don't send more than one IP packet's worth */
+				if (ssize > TSO_MAX)
+					ssize = TSO_MAX;
 
 				/* Clamp xmit to an integral MSS to
 				 * avoid ragged tail segments causing
@@ -2481,8 +3383,8 @@ void tcpoutput(struct conv *s)
 				 * next multiple of 4, to ensure we
 				 * still yeild.
 				 */
-				segs = ssize / tcb->mss;
-				ssize = segs * tcb->mss;
+				segs = ssize / payload_mss;
+				ssize = segs * payload_mss;
 				msgs += segs;
 				if (segs > 3)
 					msgs = (msgs + 4) & ~3;
@@ -2507,6 +3409,8 @@ void tcpoutput(struct conv *s)
 		seg.flags = ACK;
 		seg.mss = 0;
 		seg.ws = 0;
+		seg.sack_ok = 0;
+		seg.nr_sacks = 0;
 		switch (tcb->state) {
 			case Syn_sent:
 				seg.flags = 0;
@@ -2515,6 +3419,7 @@ void tcpoutput(struct conv *s)
 					dsize--;
 					seg.mss = tcb->mss;
 					seg.ws = tcb->scale;
+					seg.sack_ok = TRUE;
 				}
 				break;
 			case Syn_received:
@@ -2529,12 +3434,18 @@ void tcpoutput(struct conv *s)
 					ssize = 1;
 					seg.mss = tcb->mss;
 					seg.ws = tcb->scale;
+					seg.sack_ok = tcb->sack_ok;
 				}
 				break;
 		}
 		seg.seq = tcb->snd.ptr;
 		seg.ack = tcb->rcv.nxt;
 		seg.wnd = tcb->rcv.wnd;
+		if (tcb->sack_ok && !(seg.flags & SYN)) {
+			seg.nr_sacks = MIN(tcb->rcv.nr_sacks, MAX_NR_SACKS_PER_PACKET);
+			memcpy(seg.sacks, tcb->rcv.sacks,
+			       seg.nr_sacks * sizeof(struct sack_block));
+		}
 
 		/* Pull out data to send */
 		bp = NULL;
@@ -2544,9 +3455,9 @@ void tcpoutput(struct conv *s)
 				seg.flags |= FIN;
 				dsize--;
 			}
-			if (BLEN(bp) > tcb->mss) {
+			if (BLEN(bp) > payload_mss) {
 				bp->flag |= Btso;
-				bp->mss = tcb->mss;
+				bp->mss = payload_mss;
 			}
 		}
 
@@ -2566,6 +3477,8 @@ void tcpoutput(struct conv *s)
 		}
 
 		tcb->snd.ptr += ssize;
+		if (ssize == 0)
+			tpriv->stats[AcksSent]++;
 
 		/* Pull up the send pointer so we can accept acks
 		 * for this window
@@ -2573,6 +3486,14 @@ void tcpoutput(struct conv *s)
 		if (seq_gt(tcb->snd.ptr, tcb->snd.nxt))
 			tcb->snd.nxt = tcb->snd.ptr;
 
+		/* hole filled, go back to sending from the end */
+		if (sack_rxmit) {
+			tcb->snd.high_rxt = tcb->snd.ptr;
+			tcb->snd.ptr = tcb->snd.nxt;
+			tcb->sack_rxmits++;
+			tpriv->stats[SackRxmits]++;
+		}
+
 		/* Build header, link data and compute cksum */
 		switch (version) {
 			case V4:
@@ -2607,8 +3528,8 @@ void tcpoutput(struct conv *s)
 			 *  measure the longest packet only in case the
 			 *  transmission time dominates RTT
 			 */
-			if (tcb->rtt_timer.state != TcptimerON)
-				if (ssize == tcb->mss) {
+			if (tcb->rtt_timer.state != TcptimerON && !sack_rxmit)
+				if (ssize == payload_mss) {
 					tcpgo(tpriv, &tcb->rtt_timer);
 					tcb->rttseq = tcb->snd.ptr;
 				}
@@ -2661,6 +3582,8 @@ void tcpsendka(struct conv *s)
 	seg.flags = ACK | PSH;
 	seg.mss = 0;
 	seg.ws = 0;
+	seg.sack_ok = 0;
+	seg.nr_sacks = 0;
 	if (tcpporthogdefense)
 		urandom_read(&seg.seq, sizeof(seg.seq));
 	else
@@ -2775,11 +3698,7 @@ void tcprxmit(struct conv *s)
 	tcb->flags |= RETRAN | FORCE;
 	tcb->snd.ptr = tcb->snd.una;
 
-	/*
-	 *  We should be halving the slow start threshhold (down to one
-	 *  mss) but leaving it at mss seems to work well enough
-	 */
-	tcb->ssthresh = tcb->mss;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
 
 	/*
 	 *  pull window down to a single packet
@@ -2819,6 +3738,10 @@ void tcptimeout(void *arg)
 			}
 			netlog(s->p->f, Logtcprxmt, "timeout rexmit 0x%lx %llu/%llu\n",
 				   tcb->snd.una, tcb->timer.start, NOW);
+			/* RFC 2018: the receiver may have reneged, so after a timeout
+			 * we forget what it SACKed and go back to go-back-N */
+			tcb->snd.nr_sacks = 0;
+			tcb->snd.recovery = 0;
 			tcpsettimer(tcb);
 			tcprxmit(s);
 			tpriv->stats[RetransTimeouts]++;
@@ -2860,6 +3783,9 @@ void procsyn(struct conv *s, Tcp * seg)
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = seg->wnd;
 	tcb->cwind = tcb->mss;
+
+	/* we always offer SACK on our SYN, so it's up to the other side */
+	tcb->sack_ok = seg->sack_ok;
 }
 
 int
@@ -2879,6 +3805,8 @@ addreseq(Tcpctl * tcb, struct tcppriv *tpriv, Tcp * seg,
 	rp->bp = bp;
 	rp->length = length;
 
+	track_rcv_sack(tcb, seg->seq, seg->seq + length);
+
 	/* Place on reassembly list sorting by starting seq number */
 	rp1 = tcb->reseq;
 	if (rp1 == NULL || seq_lt(seg->seq, rp1->seg.seq)) {
@@ -2922,6 +3850,8 @@ addreseq(Tcpctl * tcb, struct tcppriv *tpriv, Tcp * seg,
 			kfree(rp);
 		}
 		tcb->reseq = NULL;
+		/* the peer has to resend what we SACKed */
+		tcb->rcv.nr_sacks = 0;
 
 		return -1;
 	}
@@ -3075,6 +4005,38 @@ static void tcpporthogdefensectl(char *val)
 }
 
 /* called with c qlocked */
+static void tcpsetcc(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	if (n < 2)
+		error(EINVAL, "usage: cc newreno|cubic|bbr");
+	for (int i = 0; i < ARRAY_SIZE(tcp_ccs); i++) {
+		if (strcmp(f[1], tcp_ccs[i]->name))
+			continue;
+		tcb->cc = tcp_ccs[i];
+		memset(&tcb->cc_state, 0, sizeof(tcb->cc_state));
+		return;
+	}
+	error(EINVAL, "unknown congestion control %s", f[1]);
+}
+
+/* limit a listener's calls in limbo; past it, we send SYN cookies */
+static void tcpsetsynq(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	int len;
+
+	if (n < 2)
+		error(EINVAL, "usage: synq LEN");
+	if (tcb->state != Listen)
+		error(EINVAL, "synq only applies to listeners");
+	len = atoi(f[1]);
+	if (len < 0 || len > MAX_SYNQ)
+		error(EINVAL, "synq must be from 0 to %d", MAX_SYNQ);
+	tcb->synq = len;
+}
+
 static void tcpctl(struct conv *c, char **f, int n)
 {
 	if (n == 1 && strcmp(f[0], "hangup") == 0)
@@ -3083,6 +4045,10 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpstartka(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "checksum") == 0)
 		tcpsetchecksum(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "synq") == 0)
+		tcpsetsynq(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
 	else
@@ -3169,8 +4135,13 @@ void tcpinit(struct Fs *fs)
 
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
-	qlock_init(&tpriv->tl);
+	tpriv->wheels = kzmalloc_align(num_cores * sizeof(struct tcpwheel),
+	                               KMALLOC_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < num_cores; i++)
+		spinlock_init(&tpriv->wheels[i].lock);
 	qlock_init(&tpriv->apl);
+	iphtinit(&tpriv->ht);
+	urandom_read(tpriv->cookiesecret, sizeof(tpriv->cookiesecret));
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
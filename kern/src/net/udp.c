@@ -70,6 +70,8 @@ enum {
 	IP_UDPPROTO = 17,
 	UDP_USEAD7 = 52,
 	UDP_USEAD6 = 36,
+	UDP_BATCHLEN = 2,	/* record length prefix in batch mode */
+	UDP_GROMAX = 32 * 1024,	/* most a gro merge grows a queued block to */
 
 	Udprxms = 200,
 	Udptickms = 100,
@@ -132,6 +134,8 @@ struct Udppriv {
 	/* non-MIB stats */
 	uint32_t csumerr;			/* checksum errors */
 	uint32_t lenerr;			/* short packet */
+	uint32_t batcherr;			/* malformed batch record */
+	uint32_t usosent;			/* super-datagrams handed to the ifc */
 };
 
 void (*etherprofiler) (char *name, int qlen);
@@ -144,6 +148,9 @@ typedef struct Udpcb Udpcb;
 struct Udpcb {
 	qlock_t qlock;
 	uint8_t headers;
+	uint8_t batch;				/* length-prefixed records per read/write */
+	uint8_t gro;				/* merge batch records in rq */
+	uint16_t gso;				/* split writes into datagrams this big */
 };
 
 static void udpconnect(struct conv *c, char **argv, int argc)
@@ -199,13 +206,135 @@ static void udpclose(struct conv *c)
 
 	ucb = (Udpcb *) c->ptcl;
 	ucb->headers = 0;
+	ucb->batch = 0;
+	ucb->gro = 0;
+	ucb->gso = 0;
+	qcoalesce(c->rq, FALSE);
 
 	qunlock(&c->qlock);
 }
 
+static void udpkick1(struct conv *c, struct block *bp);
+
+/* bytes of user-supplied addresses in front of each datagram */
+static int udphdrlen(Udpcb *ucb)
+{
+	switch (ucb->headers) {
+		case 7:
+			return UDP_USEAD7;
+		case 6:
+			return UDP_USEAD6;
+	}
+	return 0;
+}
+
+/* can we hand the ifc one super-datagram of dlen bytes for it to split? */
+static bool udpusook(struct conv *c, uint8_t *laddr, uint8_t *raddr, int dlen)
+{
+	struct route *r;
+
+	if (dlen + UDP4_IPHDR_SZ + UDP_UDPHDR_SZ > 0xffff)
+		return FALSE;
+	if (!isv4(raddr) || !(isv4(laddr) || ipcmp(laddr, IPnoaddr) == 0))
+		return FALSE;
+	r = v4lookup(c->p->f, raddr + IPv4off, NULL);
+	return r != NULL && r->rt.ifc != NULL && (r->rt.ifc->feat & NETF_USO);
+}
+
+/*
+ *  with "gso N" set, a datagram longer than N is a run of N byte datagrams to
+ *  the same place, the last maybe shorter.  v4 ifcs that take USO get it as
+ *  one super-datagram that devether (or the NIC) cuts up after routing, arp
+ *  and the ifc queue; otherwise we cut it up here.
+ */
+static void udpkickgso(struct conv *c, struct block *bp)
+{
+	Udpcb *ucb = (Udpcb *) c->ptcl;
+	Udppriv *upriv = c->p->priv;
+	struct block *nbp;
+	uint8_t *laddr, *raddr;
+	int hdrlen, dlen, off, n;
+
+	hdrlen = udphdrlen(ucb);
+	dlen = blocklen(bp) - hdrlen;
+	if (ucb->gso == 0 || dlen <= ucb->gso) {
+		udpkick1(c, bp);
+		return;
+	}
+	bp = pullupblock(bp, hdrlen);
+	if (bp == NULL)
+		return;
+	raddr = hdrlen ? bp->rp : c->raddr;
+	laddr = hdrlen ? bp->rp + IPaddrlen : c->laddr;
+	if (udpusook(c, laddr, raddr, dlen)) {
+		bp->flag |= Buso;
+		bp->mss = ucb->gso;
+		upriv->usosent++;
+		udpkick1(c, bp);
+		return;
+	}
+	bp = linearizeblock(concatblock(bp));
+	for (off = hdrlen; off < BLEN(bp); off += n) {
+		n = MIN(BLEN(bp) - off, ucb->gso);
+		nbp = allocb(hdrlen + n);
+		memmove(nbp->wp, bp->rp, hdrlen);
+		memmove(nbp->wp + hdrlen, bp->rp + off, n);
+		nbp->wp += hdrlen + n;
+		udpkick1(c, nbp);
+	}
+	freeb(bp);
+}
+
+/*
+ *  in batch mode, a write is a run of records, each a 2 byte length followed
+ *  by what a single write would carry, headers included if they're on.  the
+ *  whole write must fit in one block (Maxatomic), since we only see one block
+ *  at a time; a record running past the end is dropped.
+ */
+static void udpkickbatch(struct conv *c, struct block *bp)
+{
+	Udppriv *upriv = c->p->priv;
+	struct block *nbp;
+	uint8_t *p, *e;
+	int len;
+
+	bp = linearizeblock(concatblock(bp));
+	p = bp->rp;
+	e = bp->wp;
+	while (e - p >= UDP_BATCHLEN) {
+		len = nhgets(p);
+		p += UDP_BATCHLEN;
+		if (len > e - p) {
+			upriv->batcherr++;
+			netlog(c->p->f, Logudp, "udp: short batch record %d > %d\n",
+			       len, (int)(e - p));
+			break;
+		}
+		nbp = allocb(len);
+		memmove(nbp->wp, p, len);
+		nbp->wp += len;
+		p += len;
+		udpkickgso(c, nbp);
+	}
+	freeb(bp);
+}
+
 void udpkick(void *x, struct block *bp)
 {
 	struct conv *c = x;
+	Udpcb *ucb;
+
+	if (bp == NULL)
+		return;
+	ucb = (Udpcb *) c->ptcl;
+	if (ucb->batch)
+		udpkickbatch(c, bp);
+	else
+		udpkickgso(c, bp);
+}
+
+static void udpkick1(struct conv *c, struct block *bp)
+{
 	Udp4hdr *uh4;
 	Udp6hdr *uh6;
 	uint16_t rport;
@@ -222,8 +351,6 @@ void udpkick(void *x, struct block *bp)
 	f = c->p->f;
 
 	netlog(c->p->f, Logudp, "udp: kick\n");
-	if (bp == NULL)
-		return;
 
 	ucb = (Udpcb *) c->ptcl;
 	switch (ucb->headers) {
@@ -365,6 +492,40 @@ void udpkick(void *x, struct block *bp)
 	upriv->ustats.udpOutDatagrams++;
 }
 
+/*
+ *  qpass_merge() callback for batch mode with gro on: appends b's record to
+ *  the last block in rq, which the reader hasn't taken yet, so the reader is
+ *  woken once per run of datagrams instead of once each.  every record carries
+ *  its own length (and addresses, with headers on), so unlike tcp's gro we
+ *  needn't match flows, only bound the block: a reader must read at least
+ *  UDP_GROMAX at a time, since a message that doesn't fit is truncated.
+ */
+static bool udpgromerge(struct block *last, struct block *b)
+{
+	struct extra_bdata *ebd;
+	int slot;
+
+	if (b->free || b->extra_len || b->next)
+		return FALSE;
+	if (BLEN(last) + BLEN(b) > UDP_GROMAX)
+		return FALSE;
+	for (slot = last->nr_extra_bufs; slot > 0; slot--) {
+		if (last->extra_data[slot - 1].base)
+			break;
+	}
+	if (slot == last->nr_extra_bufs &&
+	    block_add_extd(last, slot + 8, 0))
+		return FALSE;
+	/* the ebd holds a ref on b's memory, which outlives freeb(b) */
+	kmalloc_incref(b);
+	ebd = &last->extra_data[slot];
+	ebd->base = (uintptr_t)b;
+	ebd->off = (uint32_t)(b->rp - (uint8_t*)b);
+	ebd->len = BLEN(b);
+	last->extra_len += ebd->len;
+	return TRUE;
+}
+
 void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 {
 	int len;
@@ -557,6 +718,11 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 			break;
 	}
 
+	if (ucb->batch) {
+		bp = padblock(bp, UDP_BATCHLEN);
+		hnputs(bp->rp, blocklen(bp) - UDP_BATCHLEN);
+	}
+
 	if (bp->next)
 		bp = concatblock(bp);
 
@@ -568,11 +734,37 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 		return;
 	}
 
-	qpass(c->rq, bp);
+	if (ucb->batch && ucb->gro)
+		qpass_merge(c->rq, bp, udpgromerge);
+	else
+		qpass(c->rq, bp);
 	qunlock(&c->qlock);
 
 }
 
+/*
+ *  reads in batch mode return as many whole records as fit, each with the
+ *  same 2 byte length prefix that writes use.
+ */
+static void udpsetbatch(struct conv *c, bool on)
+{
+	Udpcb *ucb = (Udpcb*)c->ptcl;
+
+	ucb->batch = on;
+	qcoalesce(c->rq, on);
+}
+
+/* "gso N": later writes longer than N bytes are runs of N byte datagrams */
+static void udpsetgso(struct conv *c, char *arg)
+{
+	Udpcb *ucb = (Udpcb*)c->ptcl;
+	int n = atoi(arg);
+
+	if (n < 0 || n > 0xffff - UDP4_IPHDR_SZ - UDP_UDPHDR_SZ)
+		error(EINVAL, "bad gso size %d", n);
+	ucb->gso = n;
+}
+
 static void udpctl(struct conv *c, char **f, int n)
 {
 	Udpcb *ucb = (Udpcb*)c->ptcl;
@@ -581,6 +773,12 @@ static void udpctl(struct conv *c, char **f, int n)
 		ucb->headers = 6;
 	else if ((n == 1) && strcmp(f[0], "headers") == 0)
 		ucb->headers = 7;
+	else if ((n == 1 || n == 2) && strcmp(f[0], "batch") == 0)
+		udpsetbatch(c, n == 1 || strcmp(f[1], "off") != 0);
+	else if ((n == 1 || n == 2) && strcmp(f[0], "gro") == 0)
+		ucb->gro = n == 1 || strcmp(f[1], "off") != 0;
+	else if ((n == 2) && strcmp(f[0], "gso") == 0)
+		udpsetgso(c, f[1]);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -651,6 +849,8 @@ int udpstats(struct Proto *udp, char *buf, int len)
 	p = seprintf(p, e, "NoPorts: %u\n", upriv->ustats.udpNoPorts);
 	p = seprintf(p, e, "InErrors: %u\n", upriv->ustats.udpInErrors);
 	p = seprintf(p, e, "OutDatagrams: %u\n", upriv->ustats.udpOutDatagrams);
+	p = seprintf(p, e, "BatchErrors: %u\n", upriv->batcherr);
+	p = seprintf(p, e, "UsoSent: %u\n", upriv->usosent);
 	return p - buf;
 }
 
@@ -668,6 +868,7 @@ void udpinit(struct Fs *fs)
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
 	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&((Udppriv *)udp->priv)->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->announce = udpannounce;
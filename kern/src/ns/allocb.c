@@ -30,6 +30,7 @@
 #include <kfs.h>
 #include <slab.h>
 #include <kmalloc.h>
+#include <kmem_acct.h>
 #include <kref.h>
 #include <string.h>
 #include <stdio.h>
@@ -40,6 +41,7 @@
 #include <smp.h>
 #include <ip.h>
 #include <process.h>
+#include <percpu.h>
 
 /* Note that Hdrspc is only available via padblock (to the 'left' of the rp). */
 enum {
@@ -50,6 +52,99 @@ enum {
 
 static atomic_t ialloc_bytes = 0;
 
+/* Per-core caches of free blocks, for the common sizes: small header blocks
+ * and ethernet MTU-sized packets.  Blocks of those sizes are allocated at the
+ * class size, and freeb() puts them back here instead of kfreeing them, if no
+ * one else has a ref on them (e.g. a clone pointing at the body).  IRQs are
+ * off while we touch our core's caches, since drivers alloc and free blocks
+ * from IRQ context. */
+#define NR_BLOCK_CLASSES 2
+#define BLOCK_CACHE_MAX 64
+
+static const int block_class_sizes[NR_BLOCK_CLASSES] = {256, 2048};
+
+struct block_cache {
+	struct block				*head;
+	unsigned int				nr;
+	unsigned long				nr_hits;
+	unsigned long				nr_misses;
+	unsigned long				nr_recycled;
+};
+
+struct block_caches {
+	struct block_cache			classes[NR_BLOCK_CLASSES];
+};
+
+static DEFINE_PERCPU(struct block_caches, block_caches);
+
+static size_t block_alloc_size(int size)
+{
+	return sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1);
+}
+
+/* Returns the cache class for a block of size bytes, or -1 */
+static int block_size_class(int size)
+{
+	for (int i = 0; i < NR_BLOCK_CLASSES; i++) {
+		if (size <= block_class_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+static struct block *block_cache_get(int class)
+{
+	struct block_cache *bc;
+	struct block *b;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	bc = &PERCPU_VAR(block_caches).classes[class];
+	b = bc->head;
+	if (b) {
+		bc->head = b->next;
+		bc->nr--;
+		bc->nr_hits++;
+	} else {
+		bc->nr_misses++;
+	}
+	enable_irqsave(&irq_state);
+	return b;
+}
+
+/* Tries to stash a dead block; returns TRUE if we took it. */
+static bool block_cache_put(struct block *b)
+{
+	struct block_cache *bc;
+	size_t alloc_size = b->lim - (uint8_t*)b;
+	int class = -1;
+	bool ret = FALSE;
+	int8_t irq_state = 0;
+
+	for (int i = 0; i < NR_BLOCK_CLASSES; i++) {
+		if (alloc_size == block_alloc_size(block_class_sizes[i])) {
+			class = i;
+			break;
+		}
+	}
+	/* Clones may still point into the body, and they'll kfree it. */
+	if (class < 0 || kmalloc_refcnt(b) != 1)
+		return FALSE;
+	/* Before we publish it; once we do, another core could grab it */
+	kmalloc_uncharge(b);
+	disable_irqsave(&irq_state);
+	bc = &PERCPU_VAR(block_caches).classes[class];
+	if (bc->nr < BLOCK_CACHE_MAX) {
+		b->next = bc->head;
+		bc->head = b;
+		bc->nr++;
+		bc->nr_recycled++;
+		ret = TRUE;
+	}
+	enable_irqsave(&irq_state);
+	return ret;
+}
+
 /*
  *  allocate blocks (round data base address to 64 bit boundary).
  *  if mallocz gives us more than we asked for, leave room at the front
@@ -57,12 +152,21 @@ static atomic_t ialloc_bytes = 0;
  */
 static struct block *_allocb(int size, int mem_flags)
 {
-	struct block *b;
+	struct block *b = NULL;
 	uintptr_t addr;
 	int n;
-
-	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
-				mem_flags);
+	int class = block_size_class(size);
+
+	if (class >= 0) {
+		size = block_class_sizes[class];
+		b = block_cache_get(class);
+		/* Cached blocks aren't charged to anyone */
+		if (b)
+			kmalloc_charge(b);
+	}
+	if (!b)
+		b = kmalloc(block_alloc_size(size),
+		            mem_flags | KMALLOC_KMEM(KMEM_BLOCK));
 	if (b == NULL)
 		return NULL;
 
@@ -83,9 +187,7 @@ static struct block *_allocb(int size, int mem_flags)
 	 * Not on akaros yet.
 	 b->lim = ((uint8_t*)b) + msize(b);
 	 */
-	b->lim =
-		((uint8_t *) b) + sizeof(struct block) + size + Hdrspc + (BLOCKALIGN -
-																  1);
+	b->lim = ((uint8_t *) b) + block_alloc_size(size);
 	b->rp = b->base;
 	n = b->lim - b->base - size;
 	b->rp += n & ~(BLOCKALIGN - 1);
@@ -118,12 +220,13 @@ int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags)
 	if (old_nr_bufs >= nr_bufs)
 		return 0;
 	if (b->extra_data) {
-		new_bdata = krealloc(b->extra_data, new_amt, mem_flags);
+		new_bdata = krealloc(b->extra_data, new_amt,
+		                     mem_flags | KMALLOC_KMEM(KMEM_BLOCK));
 		if (!new_bdata)
 			return -1;
 		memset(new_bdata + old_amt, 0, new_amt - old_amt);
 	} else {
-		new_bdata = kzmalloc(new_amt, mem_flags);
+		new_bdata = kzmalloc(new_amt, mem_flags | KMALLOC_KMEM(KMEM_BLOCK));
 		if (!new_bdata)
 			return - 1;
 	}
@@ -132,6 +235,26 @@ int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags)
 	return 0;
 }
 
+/* Takes another reference on ebd's buffer, e.g. for a clone pointing at it. */
+void ebd_incref(struct extra_bdata *ebd)
+{
+	if (ebd->ref)
+		kref_get(ebd->ref, 1);
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+/* Drops ebd's reference on its buffer and clears ebd. */
+void ebd_decref(struct extra_bdata *ebd)
+{
+	if (ebd->ref)
+		kref_put(ebd->ref);
+	else
+		kfree((void*)ebd->base);
+	ebd->base = ebd->off = ebd->len = 0;
+	ebd->ref = 0;
+}
+
 /* Go backwards from the end of the list, remember the last unused slot, and
  * stop when a used slot is encountered. */
 static struct extra_bdata *next_unused_slot(struct block *b)
@@ -161,7 +284,7 @@ int block_append_extra(struct block *b, int len, int mem_flags)
 		ebd = next_unused_slot(b);
 		assert(ebd);
 	}
-	ebd->base = (uintptr_t)kzmalloc(len, mem_flags);
+	ebd->base = (uintptr_t)kzmalloc(len, mem_flags | KMALLOC_KMEM(KMEM_BLOCK));
 	if (!ebd->base)
 		return -1;
 	ebd->off = 0;
@@ -170,6 +293,87 @@ int block_append_extra(struct block *b, int len, int mem_flags)
 	return 0;
 }
 
+/* A page that blocks point at.  We hold one ref on the page, dropped with put
+ * (e.g. page_decref or pm_put_page), until the last block lets go. */
+struct page_bref {
+	struct kref					kref;
+	struct page					*page;
+	void						(*put)(struct page *);
+};
+
+static void page_bref_release(struct kref *kref)
+{
+	struct page_bref *pb = container_of(kref, struct page_bref, kref);
+
+	pb->put(pb->page);
+	kfree(pb);
+}
+
+/* Appends [off, off + len) of page to b's extra data.  b takes the caller's ref
+ * on page, which we drop with put when no block points at it anymore.
+ *
+ * Returns 0 on success or -1 on error, in which case the caller keeps its
+ * ref. */
+int block_append_page(struct block *b, struct page *page, size_t off,
+                      size_t len, void (*put)(struct page *), int mem_flags)
+{
+	struct extra_bdata *ebd;
+	struct page_bref *pb;
+
+	ebd = next_unused_slot(b);
+	if (!ebd) {
+		if (block_add_extd(b, b->nr_extra_bufs + 1, mem_flags) != 0)
+			return -1;
+		ebd = next_unused_slot(b);
+		assert(ebd);
+	}
+	pb = kmalloc(sizeof(struct page_bref),
+	             mem_flags | KMALLOC_KMEM(KMEM_BLOCK));
+	if (!pb)
+		return -1;
+	kref_init(&pb->kref, page_bref_release, 1);
+	pb->page = page;
+	pb->put = put;
+	ebd->ref = &pb->kref;
+	ebd->base = (uintptr_t)page2kva(page);
+	ebd->off = off;
+	ebd->len = len;
+	b->extra_len += len;
+	return 0;
+}
+
+/* Returns a block whose extra data is pm's pages for [off, off + len), loading
+ * them if needed.  Nothing is copied; the pages stay pinned in pm until the
+ * block (and any clones of it) is freed.  Throws on IO errors. */
+struct block *block_from_pm(struct page_map *pm, uint64_t off, size_t len)
+{
+	ERRSTACK(1);
+	unsigned long first = off >> PGSHIFT;
+	unsigned int nr_pages = (ROUNDUP(off + len, PGSIZE) >> PGSHIFT) - first;
+	struct page *page;
+	struct block *b;
+	size_t amt;
+	int ret;
+
+	b = allocb(0);
+	block_add_extd(b, nr_pages, KMALLOC_WAIT);
+	if (waserror()) {
+		freeb(b);
+		nexterror();
+	}
+	for (int i = 0; len; i++) {
+		ret = pm_load_page(pm, first + i, &page);
+		if (ret)
+			error(-ret, "couldn't load page %lu of the file", first + i);
+		amt = MIN(len, PGSIZE - PGOFF(off));
+		block_append_page(b, page, PGOFF(off), amt, pm_put_page, KMALLOC_WAIT);
+		off += amt;
+		len -= amt;
+	}
+	poperror();
+	return b;
+}
+
 /*
  *  interrupt time allocation
  */
@@ -202,12 +406,10 @@ void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -236,6 +438,8 @@ void freeb(struct block *b)
 		atomic_add(&ialloc_bytes, -(b->lim - b->base));
 	}
 
+	if (block_cache_put(b))
+		return;
 	/* poison the block in case someone is still holding onto it */
 	b->next = dead;
 	b->rp = dead;
@@ -286,7 +490,23 @@ void checkb(struct block *b, char *msg)
 
 void iallocsummary(void)
 {
+	struct block_cache *bc;
+	unsigned long nr, hits, misses, recycled;
+
 	printd("ialloc %lu/%lu\n", atomic_read(&ialloc_bytes), 0 /*conf.ialloc */ );
+	for (int i = 0; i < NR_BLOCK_CLASSES; i++) {
+		nr = hits = misses = recycled = 0;
+		for (int j = 0; j < num_cores; j++) {
+			bc = &_PERCPU_VAR(block_caches, j).classes[i];
+			nr += bc->nr;
+			hits += bc->nr_hits;
+			misses += bc->nr_misses;
+			recycled += bc->nr_recycled;
+		}
+		printk("block cache %4d: %lu cached, %lu hits, %lu misses, "
+		       "%lu recycled\n", block_class_sizes[i], nr, hits, misses,
+		       recycled);
+	}
 }
 
 void printblock(struct block *b)
@@ -39,28 +39,430 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <pagemap.h>
+#include <page_alloc.h>
+#include <time.h>
+#include <reclaim.h>
+
+/* The client cache for mounts made with MCACHE.  Every file we cache gets a
+ * mntcache, keyed by the chan's type, dev (unique per attach) and qid.path.
+ * File data lives in the mntcache's page map, in whole pages only: the tail of
+ * a file always comes from the server, which also tells us where EOF is.
+ *
+ * 9P has no leases, so we go by qid.vers.  Whenever we hear of a different
+ * version of a file (walk, open, stat), we drop what we had for it.  Stats are
+ * also only good for CSTAT_TTL_NSEC, since not every change bumps the version.
+ *
+ * Like Plan 9's, mntcaches are never freed, just reused.  A chan's mcp is only
+ * a hint: we check the key under the mntcache's qlock before using it. */
+
+#define NCFILE				512
+#define NCHASH				128
+#define CACHE_MAX_PAGES		(1 << 14)	/* for the whole cache */
+#define CFILE_MAX_PAGES		(1 << 12)	/* so one file can't take it all */
+#define CSTAT_TTL_NSEC		1000000000ULL
+
+struct mntcache {
+	qlock_t						lock;
+	/* The key is protected by cache.lock.  Users recheck it once they hold
+	 * lock, and it only changes under lock when the mntcache is reused. */
+	int							type;
+	uint32_t					dev;
+	struct qid					qid;
+	struct page_map				pm;
+	unsigned long				nr_pages;
+	unsigned long				max_idx;	/* past the highest page */
+	uint8_t						*stat;
+	int							nstat;
+	uint64_t					stat_time;
+	struct mntcache				*hash;		/* protected by cache.lock */
+	TAILQ_ENTRY(mntcache)		lru;		/* protected by cache.lock */
+};
+TAILQ_HEAD(mntcache_tailq, mntcache);
+
+static struct {
+	spinlock_t					lock;
+	struct mntcache				*hash[NCHASH];
+	struct mntcache_tailq		lru;		/* least recently used first */
+	atomic_t					nr_pages;
+} cache;
+
+/* We fill pages ourselves, from data we already read.  There's no readpage. */
+static struct page_map_operations cache_pm_op;
+
+static struct mntcache **cache_bucket(int type, uint32_t dev, uint64_t path)
+{
+	return &cache.hash[(path ^ dev ^ type) % NCHASH];
+}
+
+static bool cache_match(struct mntcache *e, struct chan *c)
+{
+	return e->type == c->type && e->dev == c->dev &&
+	       e->qid.path == c->qid.path;
+}
+
+/* Drops all of e's pages and its stat.  Returns the number of pages dropped.
+ * Call with e's lock held. */
+static int cache_purge(struct mntcache *e)
+{
+	int nr_removed = 0;
+
+	if (e->nr_pages) {
+		nr_removed = pm_remove_contig(&e->pm, 0, e->max_idx);
+		atomic_add(&cache.nr_pages, -nr_removed);
+		e->nr_pages -= nr_removed;
+		/* Nothing else holds refs on our pages while we have the lock */
+		if (e->nr_pages)
+			warn_once("mntcache %p kept %lu pages", e, e->nr_pages);
+	}
+	if (!e->nr_pages)
+		e->max_idx = 0;
+	kfree(e->stat);
+	e->stat = NULL;
+	e->nstat = 0;
+	return nr_removed;
+}
+
+/* Drops what e has if it's for a different version than qid.  Call with e's
+ * lock held. */
+static void cache_check_vers(struct mntcache *e, struct qid *qid)
+{
+	if (e->qid.vers == qid->vers)
+		return;
+	cache_purge(e);
+	e->qid.vers = qid->vers;
+}
+
+/* Finds c's mntcache, returning it locked, or 0 if there isn't one */
+static struct mntcache *cache_find(struct chan *c)
+{
+	struct mntcache *e;
+
+	spin_lock(&cache.lock);
+	for (e = *cache_bucket(c->type, c->dev, c->qid.path); e; e = e->hash) {
+		if (cache_match(e, c)) {
+			TAILQ_REMOVE(&cache.lru, e, lru);
+			TAILQ_INSERT_TAIL(&cache.lru, e, lru);
+			break;
+		}
+	}
+	spin_unlock(&cache.lock);
+	if (!e)
+		return 0;
+	qlock(&e->lock);
+	/* It could have been reused while we weren't looking */
+	if (!cache_match(e, c)) {
+		qunlock(&e->lock);
+		return 0;
+	}
+	return e;
+}
+
+static void cache_unhash(struct mntcache *e)
+{
+	struct mntcache **pp;
+
+	if (e->type == -1)
+		return;
+	for (pp = cache_bucket(e->type, e->dev, e->qid.path); *pp;
+	     pp = &(*pp)->hash) {
+		if (*pp == e) {
+			*pp = e->hash;
+			break;
+		}
+	}
+	e->type = -1;
+}
+
+/* Returns c's mntcache, locked, reusing the least recently used one if c
+ * doesn't have one yet. */
+static struct mntcache *cache_get(struct chan *c)
+{
+	struct mntcache *e, *i;
+
+	while (!(e = cache_find(c))) {
+		spin_lock(&cache.lock);
+		e = TAILQ_FIRST(&cache.lru);
+		TAILQ_REMOVE(&cache.lru, e, lru);
+		TAILQ_INSERT_TAIL(&cache.lru, e, lru);
+		cache_unhash(e);
+		spin_unlock(&cache.lock);
+
+		qlock(&e->lock);
+		cache_purge(e);
+		spin_lock(&cache.lock);
+		/* Someone else could have made one for c while we slept */
+		for (i = *cache_bucket(c->type, c->dev, c->qid.path); i; i = i->hash) {
+			if (cache_match(i, c))
+				break;
+		}
+		if (!i && e->type == -1) {
+			e->type = c->type;
+			e->dev = c->dev;
+			e->qid = c->qid;
+			e->hash = *cache_bucket(c->type, c->dev, c->qid.path);
+			*cache_bucket(c->type, c->dev, c->qid.path) = e;
+			spin_unlock(&cache.lock);
+			return e;
+		}
+		spin_unlock(&cache.lock);
+		qunlock(&e->lock);
+	}
+	return e;
+}
+
+/* Returns c's mntcache from copen(), locked, if it still holds c's version */
+static struct mntcache *cache_lock_mcp(struct chan *c)
+{
+	struct mntcache *e = c->mcp;
+
+	if (!e)
+		return 0;
+	qlock(&e->lock);
+	if (!cache_match(e, c) || e->qid.vers != c->qid.vers) {
+		qunlock(&e->lock);
+		return 0;
+	}
+	return e;
+}
+
+/* Frees up a page by dropping the pages of some other file.  We hold self's
+ * lock, so we only try the others' locks, lest we deadlock. */
+static bool cache_shrink(struct mntcache *self)
+{
+	struct mntcache *e;
+
+	spin_lock(&cache.lock);
+	TAILQ_FOREACH(e, &cache.lru, lru) {
+		if (e != self && e->nr_pages && canqlock(&e->lock))
+			break;
+	}
+	spin_unlock(&cache.lock);
+	if (!e)
+		return FALSE;
+	cache_purge(e);
+	qunlock(&e->lock);
+	return atomic_read(&cache.nr_pages) < CACHE_MAX_PAGES;
+}
+
+/* Shrinker for the reclaimer.  We keep our own count of our pages, so they are
+ * unevictable to the page cache's reclaim, and we give them up a whole file at
+ * a time, least recently used first. */
+static unsigned long cache_reclaim(struct shrinker *s, unsigned long nr_pages)
+{
+	struct mntcache *e;
+	unsigned long nr_freed = 0;
+	int nr_removed;
+
+	while (nr_freed < nr_pages) {
+		spin_lock(&cache.lock);
+		TAILQ_FOREACH(e, &cache.lru, lru) {
+			if (e->nr_pages && canqlock(&e->lock))
+				break;
+		}
+		spin_unlock(&cache.lock);
+		if (!e)
+			break;
+		s->nr_scanned += e->nr_pages;
+		nr_removed = cache_purge(e);
+		qunlock(&e->lock);
+		/* we'd just find it again */
+		if (!nr_removed)
+			break;
+		nr_freed += nr_removed;
+	}
+	return nr_freed;
+}
+
+static struct shrinker cache_shrinker = {
+	.name = "mntcache",
+	.scan = cache_reclaim,
+};
+
+/* Copies a page's worth of data into e's page idx, adding it if need be.  Call
+ * with e's lock held. */
+static void cache_fill(struct mntcache *e, unsigned long idx, uint8_t *data)
+{
+	struct page *page;
+
+	if (!pm_load_page_nowait(&e->pm, idx, &page)) {
+		memcpy(page2kva(page), data, PGSIZE);
+		pm_put_page(page);
+		return;
+	}
+	if (idx >= CFILE_MAX_PAGES)
+		return;
+	if (atomic_read(&cache.nr_pages) >= CACHE_MAX_PAGES && !cache_shrink(e))
+		return;
+	if (kpage_alloc(&page))
+		return;
+	memcpy(page2kva(page), data, PGSIZE);
+	if (pm_add_uptodate_page(&e->pm, idx, page)) {
+		page_decref(page);
+		return;
+	}
+	e->nr_pages++;
+	atomic_inc(&cache.nr_pages);
+	e->max_idx = MAX(e->max_idx, idx + 1);
+}
 
-/*
- * no cache in hosted mode
- */
 void cinit(void)
 {
+	struct mntcache *e;
+
+	spinlock_init(&cache.lock);
+	TAILQ_INIT(&cache.lru);
+	atomic_set(&cache.nr_pages, 0);
+	for (int i = 0; i < NCFILE; i++) {
+		e = kzmalloc(sizeof(struct mntcache), KMALLOC_WAIT);
+		qlock_init(&e->lock);
+		e->type = -1;
+		pm_init(&e->pm, &cache_pm_op, NULL);
+		e->pm.pm_unevictable = TRUE;
+		TAILQ_INSERT_TAIL(&cache.lru, e, lru);
+	}
+	register_shrinker(&cache_shrinker);
 }
 
+/* Called when c is opened on a cached mount */
 void copen(struct chan *c)
 {
-	c->flag &= ~CCACHE;
+	struct mntcache *e;
+
+	e = cache_get(c);
+	cache_check_vers(e, &c->qid);
+	c->mcp = e;
+	qunlock(&e->lock);
 }
 
-int cread(struct chan *c, uint8_t * b, int n, int64_t off)
+/* Tells the cache about c's qid, which just came from the server */
+void cqid(struct chan *c)
 {
-	return 0;
+	struct mntcache *e;
+
+	if (!(c->flag & CCACHE))
+		return;
+	e = cache_find(c);
+	if (!e)
+		return;
+	cache_check_vers(e, &c->qid);
+	qunlock(&e->lock);
 }
 
-void cwrite(struct chan *c, uint8_t * buf, int n, int64_t off)
+/* Copies what we have cached of [off, off + len) into buf.  We stop at the
+ * first page we don't have, and return how much we copied. */
+int cread(struct chan *c, uint8_t *buf, int len, int64_t off)
 {
+	struct mntcache *e;
+	struct page *page;
+	int amt, total = 0;
+
+	if (off < 0 || !(e = cache_lock_mcp(c)))
+		return 0;
+	while (len > 0) {
+		if (pm_load_page_nowait(&e->pm, off >> PGSHIFT, &page))
+			break;
+		amt = MIN(len, PGSIZE - PGOFF(off));
+		memcpy(buf, page2kva(page) + PGOFF(off), amt);
+		pm_put_page(page);
+		buf += amt;
+		off += amt;
+		len -= amt;
+		total += amt;
+	}
+	qunlock(&e->lock);
+	return total;
 }
 
-void cupdate(struct chan *c, uint8_t * buf, int n, int64_t off)
+/* Caches the whole pages of data we just read from the server */
+void cupdate(struct chan *c, uint8_t *buf, int len, int64_t off)
 {
+	struct mntcache *e;
+	int64_t pos;
+
+	if (off < 0 || len <= 0 || !(e = cache_lock_mcp(c)))
+		return;
+	for (pos = ROUNDUP(off, PGSIZE); pos + PGSIZE <= off + len; pos += PGSIZE)
+		cache_fill(e, pos >> PGSHIFT, buf + (pos - off));
+	qunlock(&e->lock);
+}
+
+/* Writes through to the pages we have, and caches any whole pages written */
+void cwrite(struct chan *c, uint8_t *buf, int len, int64_t off)
+{
+	struct mntcache *e;
+	struct page *page;
+	int amt;
+
+	if (off < 0 || len <= 0 || !(e = cache_lock_mcp(c)))
+		return;
+	kfree(e->stat);
+	e->stat = NULL;
+	e->nstat = 0;
+	while (len > 0) {
+		amt = MIN(len, PGSIZE - PGOFF(off));
+		if (amt == PGSIZE) {
+			cache_fill(e, off >> PGSHIFT, buf);
+		} else if (!pm_load_page_nowait(&e->pm, off >> PGSHIFT, &page)) {
+			memcpy(page2kva(page) + PGOFF(off), buf, amt);
+			pm_put_page(page);
+		}
+		buf += amt;
+		off += amt;
+		len -= amt;
+	}
+	qunlock(&e->lock);
+}
+
+/* Copies c's cached stat into dp, returning its length, or 0 if we don't have
+ * a fresh one that fits. */
+int cstat(struct chan *c, uint8_t *dp, int n)
+{
+	struct mntcache *e;
+	int ret = 0;
+
+	if (!(c->flag & CCACHE) || !(e = cache_find(c)))
+		return 0;
+	if (e->stat && e->qid.vers == c->qid.vers && e->nstat <= n &&
+	    nsec() - e->stat_time < CSTAT_TTL_NSEC) {
+		memcpy(dp, e->stat, e->nstat);
+		ret = e->nstat;
+	}
+	qunlock(&e->lock);
+	return ret;
+}
+
+/* Caches the stat dp, which just came from the server for c */
+void cstatupdate(struct chan *c, uint8_t *dp, int n)
+{
+	struct mntcache *e;
+	struct qid qid;
+	uint8_t *stat;
+
+	if (!(c->flag & CCACHE))
+		return;
+	/* The qid follows size[2] type[2] dev[4] */
+	qid.vers = GBIT32(dp + BIT16SZ + BIT16SZ + BIT32SZ + BIT8SZ);
+	stat = kmalloc(n, KMALLOC_WAIT);
+	memcpy(stat, dp, n);
+	e = cache_get(c);
+	cache_check_vers(e, &qid);
+	kfree(e->stat);
+	e->stat = stat;
+	e->nstat = n;
+	e->stat_time = nsec();
+	qunlock(&e->lock);
+}
+
+/* Forgets c's stat, e.g. after a wstat */
+void cstatdrop(struct chan *c)
+{
+	struct mntcache *e;
+
+	if (!(c->flag & CCACHE) || !(e = cache_find(c)))
+		return;
+	kfree(e->stat);
+	e->stat = NULL;
+	e->nstat = 0;
+	qunlock(&e->lock);
 }
@@ -30,6 +30,7 @@
 #include <kfs.h>
 #include <slab.h>
 #include <kmalloc.h>
+#include <kmem_acct.h>
 #include <kref.h>
 #include <string.h>
 #include <stdio.h>
@@ -173,7 +174,7 @@ struct chan *newchan(void)
 	spin_unlock(&(&chanalloc)->lock);
 
 	if (c == NULL) {
-		c = kzmalloc(sizeof(struct chan), 0);
+		c = kzmalloc(sizeof(struct chan), KMALLOC_KMEM(KMEM_CHAN));
 		spin_lock(&(&chanalloc)->lock);
 		c->fid = ++chanalloc.fid;
 		c->link = chanalloc.list;
@@ -181,6 +182,9 @@ struct chan *newchan(void)
 		spin_unlock(&(&chanalloc)->lock);
 		spinlock_init(&c->lock);
 		qlock_init(&c->umqlock);
+	} else {
+		/* Free chans aren't charged to anyone */
+		kmalloc_charge(c);
 	}
 
 	/* if you get an error before associating with a dev, cclose skips calling
@@ -298,6 +302,7 @@ void chanfree(struct chan *c)
 	c->buf = NULL;
 	c->bufused = 0;
 	c->ateof = 0;
+	kmalloc_uncharge(c);
 
 	spin_lock(&(&chanalloc)->lock);
 	c->next = chanalloc.free;
@@ -370,11 +375,49 @@ int eqchantdqid(struct chan *a, int type, int dev, struct qid qid, int pathonly)
 	return 1;
 }
 
+static void __mh_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct mhead, rcu));
+}
+
 static void mh_release(struct kref *kref)
 {
 	struct mhead *mh = container_of(kref, struct mhead, ref);
 	mh->mount = (struct mount *)0xCafeBeef;
-	kfree(mh);
+	/* findmount() could still be looking at it */
+	call_rcu(&mh->rcu, __mh_free_rcu);
+}
+
+static size_t mhead_key_hash(struct mhead_key key)
+{
+	return (key.path ^ ((uint64_t)key.dev << 16) ^ key.type) * 0x9e370001UL;
+}
+
+static size_t mhead_hash(struct mhead *mh)
+{
+	return mhead_key_hash(mh->key);
+}
+
+static bool mhead_eq(struct mhead *mh, struct mhead_key key)
+{
+	return mh->key.type == key.type && mh->key.dev == key.dev &&
+	       mh->key.path == key.path;
+}
+
+DEFINE_RHASHTABLE(mnt_ht, struct mhead, struct mhead_key, mhead_hash,
+                  mhead_key_hash, mhead_eq);
+
+/* Adds mh to pg's mount index.  Call with pg->ns write locked, when mh goes on
+ * a mnthash chain.  Returns 0 or -ENOMEM. */
+int mhead_index(struct pgrp *pg, struct mhead *mh)
+{
+	return mnt_ht_insert(&pg->mnt_ht, mh);
+}
+
+/* Call with pg->ns write locked, when mh comes off its mnthash chain */
+void mhead_unindex(struct pgrp *pg, struct mhead *mh)
+{
+	mnt_ht_remove(&pg->mnt_ht, mh->key);
 }
 
 struct mhead *newmhead(struct chan *from)
@@ -385,6 +428,9 @@ struct mhead *newmhead(struct chan *from)
 	kref_init(&mh->ref, mh_release, 1);
 	rwinit(&mh->lock);
 	mh->from = from;
+	mh->key.type = from->type;
+	mh->key.dev = from->dev;
+	mh->key.path = from->qid.path;
 	chan_incref(from);
 
 /*
@@ -439,7 +485,7 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		error(EEXIST, ERROR_FIXME);
 
 	pg = current->pgrp;
-	wlock(&pg->ns);
+	bwlock(&pg->ns);
 
 	l = &MOUNTH(pg, old->qid);
 	for (m = *l; m; m = m->hash) {
@@ -454,6 +500,11 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		 *  head and add to the hash table.
 		 */
 		m = newmhead(old);
+		if (mhead_index(pg, m)) {
+			bwunlock(&pg->ns);
+			putmhead(m);
+			error(ENOMEM, "out of memory for the mount index");
+		}
 		*l = m;
 
 		/*
@@ -468,7 +519,7 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		wunlock(&m->lock);
 		nexterror();
 	}
-	wunlock(&pg->ns);
+	bwunlock(&pg->ns);
 
 	nm = newmount(m, new, flag, spec);
 	if (mh != NULL && mh->mount != NULL) {
@@ -506,6 +557,7 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 
 	wunlock(&m->lock);
 	poperror();
+	wcache_flush(pg);
 	return nm->mountid;
 }
 
@@ -528,7 +580,7 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 	 */
 
 	pg = current->pgrp;
-	wlock(&pg->ns);
+	bwlock(&pg->ns);
 
 	l = &MOUNTH(pg, mnt->qid);
 	for (m = *l; m; m = m->hash) {
@@ -538,19 +590,21 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 	}
 
 	if (m == 0) {
-		wunlock(&pg->ns);
+		bwunlock(&pg->ns);
 		error(ENOENT, ERROR_FIXME);
 	}
 
 	wlock(&m->lock);
 	if (mounted == 0) {
 		*l = m->hash;
-		wunlock(&pg->ns);
+		mhead_unindex(pg, m);
+		bwunlock(&pg->ns);
 		mountfree(m->mount);
 		m->mount = NULL;
 		cclose(m->from);
 		wunlock(&m->lock);
 		putmhead(m);
+		wcache_flush(pg);
 		return;
 	}
 
@@ -564,20 +618,23 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 			mountfree(f);
 			if (m->mount == NULL) {
 				*l = m->hash;
+				mhead_unindex(pg, m);
 				cclose(m->from);
 				wunlock(&m->lock);
-				wunlock(&pg->ns);
+				bwunlock(&pg->ns);
 				putmhead(m);
+				wcache_flush(pg);
 				return;
 			}
 			wunlock(&m->lock);
-			wunlock(&pg->ns);
+			bwunlock(&pg->ns);
+			wcache_flush(pg);
 			return;
 		}
 		p = &f->next;
 	}
 	wunlock(&m->lock);
-	wunlock(&pg->ns);
+	bwunlock(&pg->ns);
 	error(ENOENT, ERROR_FIXME);
 }
 
@@ -597,42 +654,45 @@ struct chan *cclone(struct chan *c)
 	return nc;
 }
 
+/* Looks up what's mounted on (type, dev, qid.path) without taking the ns
+ * lock: mheads are indexed in pg->mnt_ht and freed after an RCU grace period,
+ * so we can grab a ref on one unless it's on its way out. */
 int
 findmount(struct chan **cp,
 		  struct mhead **mp, int type, int dev, struct qid qid)
 {
 	struct pgrp *pg;
 	struct mhead *m;
+	struct mhead_key key = {.type = type, .dev = dev, .path = qid.path};
 
 	pg = current->pgrp;
-	rlock(&pg->ns);
-	for (m = MOUNTH(pg, qid); m; m = m->hash) {
-		rlock(&m->lock);
-		if (m->from == NULL) {
-			printd("m %p m->from 0\n", m);
-			runlock(&m->lock);
-			continue;
-		}
-		if (eqchantdqid(m->from, type, dev, qid, 1)) {
-			runlock(&pg->ns);
-			if (mp != NULL) {
-				kref_get(&m->ref, 1);
-				if (*mp != NULL)
-					putmhead(*mp);
-				*mp = m;
-			}
-			if (*cp != NULL)
-				cclose(*cp);
-			chan_incref(m->mount->to);
-			*cp = m->mount->to;
-			runlock(&m->lock);
-			return 1;
-		}
+	rcu_read_lock();
+	m = mnt_ht_lookup(&pg->mnt_ht, key);
+	if (m && !kref_get_not_zero(&m->ref, 1))
+		m = NULL;
+	rcu_read_unlock();
+	if (m == NULL)
+		return 0;
+	rlock(&m->lock);
+	/* It could have been unmounted since we found it */
+	if (m->mount == NULL) {
 		runlock(&m->lock);
+		putmhead(m);
+		return 0;
 	}
-
-	runlock(&pg->ns);
-	return 0;
+	if (*cp != NULL)
+		cclose(*cp);
+	chan_incref(m->mount->to);
+	*cp = m->mount->to;
+	runlock(&m->lock);
+	if (mp != NULL) {
+		if (*mp != NULL)
+			putmhead(*mp);
+		*mp = m;
+	} else {
+		putmhead(m);
+	}
+	return 1;
 }
 
 int domount(struct chan **cp, struct mhead **mp)
@@ -649,9 +709,9 @@ struct chan *undomount(struct chan *c, struct cname *name)
 	struct mhead **h, **he, *f;
 
 	pg = current->pgrp;
-	rlock(&pg->ns);
+	brlock(&pg->ns);
 	if (waserror()) {
-		runlock(&pg->ns);
+		brunlock(&pg->ns);
 		nexterror();
 	}
 
@@ -680,7 +740,7 @@ struct chan *undomount(struct chan *c, struct cname *name)
 		}
 	}
 	poperror();
-	runlock(&pg->ns);
+	brunlock(&pg->ns);
 	return c;
 }
 
@@ -696,6 +756,8 @@ int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror
 	struct mount *f;
 	struct mhead *mh, *nmh;
 	struct walkqid *wq;
+	struct pgrp *pg = current->pgrp;
+	unsigned long nr_cross = 0;
 
 	c = *cp;
 	chan_incref(c);
@@ -740,7 +802,7 @@ int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror
 		}
 
 		if (!dotdot && can_mount)
-			domount(&c, &mh);
+			nr_cross += domount(&c, &mh);
 
 		type = c->type;
 		dev = c->dev;
@@ -786,8 +848,10 @@ int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror
 			nc = NULL;
 			if (can_mount)
 				for (i = 0; i < wq->nqid && i < ntry - 1; i++)
-					if (findmount(&nc, &nmh, type, dev, wq->qid[i]))
+					if (findmount(&nc, &nmh, type, dev, wq->qid[i])) {
+						nr_cross++;
 						break;
+					}
 			if (nc == NULL) {	/* no mount points along path */
 				if (wq->clone == NULL) {
 					cclose(c);
@@ -844,6 +908,199 @@ int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror
 	*cp = c;
 	if (nerror)
 		*nerror = 0;
+	/* Racy max, it's just a stat */
+	atomic_inc(&pg->nr_walks);
+	atomic_add(&pg->nr_mnt_crossings, nr_cross);
+	if (nr_cross > pg->max_walk_crossings)
+		pg->max_walk_crossings = nr_cross;
+	return 0;
+}
+
+/* The walk cache remembers where absolute paths led, per namespace, so that
+ * opening the same path again skips the walk and the mount lookups along it.
+ * We only cache walks from slash without '..' that end on a device with a
+ * revalidate op.  Mounts and unmounts flush the whole cache, and wc_gen keeps a
+ * walk that raced with a flush from caching its result. */
+
+/* Joins names with '/' into a kmalloc'd string, and hashes it */
+static char *wcache_path(char **names, int nnames, uint32_t *hash)
+{
+	size_t len = 0;
+	uint32_t h = 5381;
+	char *path, *p;
+
+	for (int i = 0; i < nnames; i++)
+		len += strlen(names[i]) + 1;
+	path = kmalloc(len, KMALLOC_WAIT);
+	p = path;
+	for (int i = 0; i < nnames; i++) {
+		if (i)
+			*p++ = '/';
+		p += strlcpy(p, names[i], len - (p - path));
+	}
+	for (p = path; *p; p++)
+		h = h * 33 + *p;
+	*hash = h;
+	return path;
+}
+
+static bool wcache_match(struct walkcache *wc, struct chan *root, char *path,
+                         uint32_t hash)
+{
+	return wc->c && wc->hash == hash && !strcmp(wc->path, path) &&
+	       eqchantdqid(root, wc->root_type, wc->root_dev, wc->root_qid, 1);
+}
+
+/* Returns a ref on the chan path led to from root, or 0 */
+static struct chan *wcache_lookup(struct pgrp *pg, struct chan *root,
+                                  char *path, uint32_t hash)
+{
+	struct walkcache *wc = &pg->wcache[hash % NWCACHE];
+	struct chan *c = NULL;
+
+	spin_lock(&pg->wc_lock);
+	if (wcache_match(wc, root, path, hash)) {
+		c = wc->c;
+		chan_incref(c);
+	}
+	spin_unlock(&pg->wc_lock);
+	return c;
+}
+
+/* Empties the slot for path, if it still holds c */
+static void wcache_remove(struct pgrp *pg, char *path, uint32_t hash,
+                          struct chan *c)
+{
+	struct walkcache *wc = &pg->wcache[hash % NWCACHE];
+	char *old_path = NULL;
+	struct chan *old = NULL;
+
+	spin_lock(&pg->wc_lock);
+	if (wc->c == c) {
+		old = wc->c;
+		old_path = wc->path;
+		wc->c = NULL;
+		wc->path = NULL;
+	}
+	spin_unlock(&pg->wc_lock);
+	kfree(old_path);
+	if (old)
+		cclose(old);
+}
+
+/* Caches a copy of c for path from root, unless the cache was flushed since
+ * gen.  Consumes path. */
+static void wcache_insert(struct pgrp *pg, struct chan *root, char *path,
+                          uint32_t hash, struct chan *c, uint32_t gen)
+{
+	struct walkcache *wc = &pg->wcache[hash % NWCACHE];
+	char *old_path = NULL;
+	struct chan *nc, *old = NULL;
+
+	nc = cclone(c);
+	nc->mountpoint = c->mountpoint;
+	spin_lock(&pg->wc_lock);
+	if (pg->wc_gen == gen) {
+		old = wc->c;
+		old_path = wc->path;
+		wc->path = path;
+		wc->hash = hash;
+		wc->root_type = root->type;
+		wc->root_dev = root->dev;
+		wc->root_qid = root->qid;
+		wc->c = nc;
+		path = NULL;
+		nc = NULL;
+	}
+	spin_unlock(&pg->wc_lock);
+	kfree(path);
+	kfree(old_path);
+	if (old)
+		cclose(old);
+	if (nc)
+		cclose(nc);
+}
+
+void wcache_flush(struct pgrp *pg)
+{
+	struct walkcache *wc;
+	char *path;
+	struct chan *c;
+
+	spin_lock(&pg->wc_lock);
+	pg->wc_gen++;
+	spin_unlock(&pg->wc_lock);
+	for (int i = 0; i < NWCACHE; i++) {
+		wc = &pg->wcache[i];
+		spin_lock(&pg->wc_lock);
+		c = wc->c;
+		path = wc->path;
+		wc->c = NULL;
+		wc->path = NULL;
+		spin_unlock(&pg->wc_lock);
+		kfree(path);
+		if (c)
+			cclose(c);
+	}
+}
+
+/* walk(), through the walk cache if we're walking from slash */
+static int walk_cached(struct chan **cp, char **names, int nnames,
+                       bool can_mount, int *nerror)
+{
+	ERRSTACK(1);
+	struct pgrp *pg = current->pgrp;
+	struct chan *root = *cp;
+	struct chan *c, *nc;
+	char *path;
+	uint32_t hash, gen;
+
+	if (!can_mount || !nnames || !pg || root != current->slash)
+		return walk(cp, names, nnames, can_mount, nerror);
+	for (int i = 0; i < nnames; i++) {
+		if (isdotdot(names[i]))
+			return walk(cp, names, nnames, can_mount, nerror);
+	}
+	path = wcache_path(names, nnames, &hash);
+	c = wcache_lookup(pg, root, path, hash);
+	if (c) {
+		if (devtab[c->type].revalidate(c)) {
+			kfree(path);
+			if (waserror()) {
+				cclose(c);
+				nexterror();
+			}
+			nc = cclone(c);
+			poperror();
+			nc->mountpoint = c->mountpoint;
+			cclose(c);
+			cclose(*cp);
+			*cp = nc;
+			if (nerror)
+				*nerror = 0;
+			return 0;
+		}
+		wcache_remove(pg, path, hash, c);
+		cclose(c);
+	}
+	/* walk() closes our ref on root, but slash keeps it alive */
+	gen = ACCESS_ONCE(pg->wc_gen);
+	if (walk(cp, names, nnames, can_mount, nerror) < 0) {
+		kfree(path);
+		return -1;
+	}
+	c = *cp;
+	if (devtab[c->type].revalidate && devtab[c->type].revalidate(c)) {
+		if (waserror()) {
+			kfree(path);
+			poperror();
+			return 0;
+		}
+		wcache_insert(pg, root, path, hash, c, gen);
+		poperror();
+	} else {
+		kfree(path);
+	}
 	return 0;
 }
 
@@ -1042,7 +1299,7 @@ static struct chan *__namec_from(struct chan *c, char *aname, int amode,
 		e.ARRAY_SIZEs--;
 	}
 
-	if (walk(&c, e.elems, e.ARRAY_SIZEs, can_mount, &npath) < 0) {
+	if (walk_cached(&c, e.elems, e.ARRAY_SIZEs, can_mount, &npath) < 0) {
 		if (npath < 0 || npath > e.ARRAY_SIZEs) {
 			printd("namec %s walk error npath=%d\n", aname, npath);
 			error(EFAIL, "walk failed");
@@ -1132,8 +1389,6 @@ Open:
 						c->umh = m;
 					else
 						putmhead(m);
-					if (omode == O_EXEC)
-						c->flag &= ~CCACHE;
 					/* here is where convert omode/vfs flags to c->flags.
 					 * careful, O_CLOEXEC and O_REMCLO are in there.  might need
 					 * to change that. */
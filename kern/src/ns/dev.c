@@ -470,6 +470,12 @@ void devremove(struct chan *c)
 	error(EPERM, ERROR_FIXME);
 }
 
+/* For devices whose names never go away, so a cached walk stays good */
+bool devrevalidate(struct chan *c)
+{
+	return TRUE;
+}
+
 int devwstat(struct chan *c, uint8_t * unused_uint8_p_t, int i)
 {
 	error(EPERM, ERROR_FIXME);
@@ -49,7 +49,7 @@ void closepgrp(struct pgrp *p)
 {
 	struct mhead **h, **e, *f, *next;
 
-	wlock(&p->ns);
+	bwlock(&p->ns);
 	p->pgrpid = -1;
 
 	e = &p->mnthash[MNTHASH];
@@ -64,9 +64,12 @@ void closepgrp(struct pgrp *p)
 			putmhead(f);
 		}
 	}
-	wunlock(&p->ns);
+	bwunlock(&p->ns);
+	rhashtable_destroy(&p->mnt_ht);
+	wcache_flush(p);
 	cclose(p->dot);
 	cclose(p->slash);
+	brwdestroy(&p->ns);
 	kfree(p);
 }
 
@@ -85,8 +88,10 @@ struct pgrp *newpgrp(void)
 	p->pgrpid = NEXT_ID(pgrpid);
 	p->progmode = 0644;
 	qlock_init(&p->debug);
-	rwinit(&p->ns);
+	brwinit(&p->ns);
 	qlock_init(&p->nsh);
+	spinlock_init(&p->wc_lock);
+	rhashtable_init(&p->mnt_ht, MNTHASH);
 	return p;
 }
 
@@ -120,9 +125,9 @@ void pgrpcpy(struct pgrp *to, struct pgrp *from)
 	struct mount *n, *m, **link, *order;
 	struct mhead *f, **tom, **l, *mh;
 
-	wlock(&from->ns);
+	bwlock(&from->ns);
 	if (waserror()) {
-		wunlock(&from->ns);
+		bwunlock(&from->ns);
 		nexterror();
 	}
 	order = 0;
@@ -138,6 +143,10 @@ void pgrpcpy(struct pgrp *to, struct pgrp *from)
 			mh = newmhead(f->from);
 			if (!mh)
 				error(ENOMEM, ERROR_FIXME);
+			if (mhead_index(to, mh)) {
+				putmhead(mh);
+				error(ENOMEM, "out of memory for the mount index");
+			}
 			*l = mh;
 			l = &mh->hash;
 			link = &mh->mount;
@@ -166,7 +175,7 @@ void pgrpcpy(struct pgrp *to, struct pgrp *from)
 	to->nodevs = from->nodevs;
 
 	poperror();
-	wunlock(&from->ns);
+	bwunlock(&from->ns);
 }
 
 struct mount *newmount(struct mhead *mh, struct chan *to, int flag, char *spec)
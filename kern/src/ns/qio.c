@@ -39,6 +39,10 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <umem.h>
+#include <mm.h>
+#include <kthread.h>
+#include <tracepoint.h>
 
 #define PANIC_EXTRA(b)							\
 {									\
@@ -53,6 +57,7 @@ static uint32_t padblockcnt;
 static uint32_t concatblockcnt;
 static uint32_t pullupblockcnt;
 static uint32_t copyblockcnt;
+static uint32_t linearizecnt;
 static uint32_t consumecnt;
 static uint32_t producecnt;
 static uint32_t qcopycnt;
@@ -98,6 +103,46 @@ enum {
 
 unsigned int qiomaxatomic = Maxatomic;
 
+/* Helpers for the reader and writer qlocks.  Callers that promise a single
+ * reader and a single writer (Qspsc) skip them; q->lock still protects the
+ * block list and sleeping against each other. */
+static void qrlock(struct queue *q)
+{
+	if (!(q->state & Qspsc))
+		qlock(&q->rlock);
+}
+
+static void qrunlock(struct queue *q)
+{
+	if (!(q->state & Qspsc))
+		qunlock(&q->rlock);
+}
+
+static void qwlock(struct queue *q)
+{
+	if (!(q->state & Qspsc))
+		qlock(&q->wlock);
+}
+
+static void qwunlock(struct queue *q)
+{
+	if (!(q->state & Qspsc))
+		qunlock(&q->wlock);
+}
+
+/* Helpers: wake anyone sleeping to read or write q */
+static void qwake_readers(struct queue *q)
+{
+	if (rendez_wakeup(&q->rr))
+		tracepoint(TP_QIO_WAKE, q, 0, 0);
+}
+
+static void qwake_writers(struct queue *q)
+{
+	if (rendez_wakeup(&q->wr))
+		tracepoint(TP_QIO_WAKE, q, 1, 0);
+}
+
 /* Helper: fires a wake callback, sending 'filter' */
 static void qwake_cb(struct queue *q, int filter)
 {
@@ -109,8 +154,9 @@ void ixsummary(void)
 {
 	debugging ^= 1;
 	iallocsummary();
-	printd("pad %lu, concat %lu, pullup %lu, copy %lu\n",
-		   padblockcnt, concatblockcnt, pullupblockcnt, copyblockcnt);
+	printd("pad %lu, concat %lu, pullup %lu, copy %lu, linearize %lu\n",
+		   padblockcnt, concatblockcnt, pullupblockcnt, copyblockcnt,
+		   linearizecnt);
 	printd("consume %lu, produce %lu, qcopy %lu\n",
 		   consumecnt, producecnt, qcopycnt);
 }
@@ -257,6 +303,7 @@ struct block *linearizeblock(struct block *b)
 	if (!b->extra_len)
 		return b;
 
+	linearizecnt++;
 	newb = allocb(BLEN(b));
 	len = BHLEN(b);
 	memcpy(newb->wp, b->rp, len);
@@ -320,11 +367,8 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->len -= seglen;
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
-			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
-				ebd->off = 0;
-				ebd->base = 0;
-			}
+			if (ebd->len == 0)
+				ebd_decref(ebd);
 		}
 		/* maybe just call pullupblock recursively here */
 		if (len)
@@ -408,11 +452,8 @@ static int pullext(struct block *bp, int count)
 		bytes += rem;
 		ed->off += rem;
 		ed->len -= rem;
-		if (ed->len == 0) {
-			kfree((void *)ed->base);
-			ed->base = 0;
-			ed->off = 0;
-		}
+		if (ed->len == 0)
+			ebd_decref(ed);
 	}
 	return bytes;
 }
@@ -434,11 +475,8 @@ static int dropext(struct block *bp, int count)
 		count -= rem;
 		bytes += rem;
 		ed->len -= rem;
-		if (ed->len == 0) {
-			kfree((void *)ed->base);
-			ed->base = 0;
-			ed->off = 0;
-		}
+		if (ed->len == 0)
+			ebd_decref(ed);
 	}
 	return bytes;
 }
@@ -617,7 +655,7 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_decref(ebd);
 		ebd->base = ebd->off = ebd->len = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
@@ -658,7 +696,7 @@ struct block *qget(struct queue *q)
 	spin_unlock_irqsave(&q->lock);
 
 	if (dowakeup) {
-		rendez_wakeup(&q->wr);
+		qwake_writers(q);
 		/* We only send the writable event on wakeup, which is edge triggered */
 		qwake_cb(q, FDTAP_FILT_WRITABLE);
 	}
@@ -705,11 +743,10 @@ int qdiscard(struct queue *q, int len)
 				if (!ebd->base || !ebd->len)
 					continue;
 				if (extra_amt >= ebd->len) {
-					/* remove the entire entry, note the kfree release */
+					/* remove the entire entry, dropping our ref on it */
 					b->extra_len -= ebd->len;
 					extra_amt -= ebd->len;
-					kfree((void*)ebd->base);
-					ebd->base = ebd->off = ebd->len = 0;
+					ebd_decref(ebd);
 					continue;
 				}
 				ebd->off += extra_amt;
@@ -739,7 +776,7 @@ int qdiscard(struct queue *q, int len)
 	spin_unlock_irqsave(&q->lock);
 
 	if (dowakeup) {
-		rendez_wakeup(&q->wr);
+		qwake_writers(q);
 		qwake_cb(q, FDTAP_FILT_WRITABLE);
 	}
 
@@ -809,7 +846,7 @@ int qconsume(struct queue *q, void *vp, int len)
 	spin_unlock_irqsave(&q->lock);
 
 	if (dowakeup) {
-		rendez_wakeup(&q->wr);
+		qwake_writers(q);
 		qwake_cb(q, FDTAP_FILT_WRITABLE);
 	}
 
@@ -866,13 +903,41 @@ int qpass(struct queue *q, struct block *b)
 	spin_unlock_irqsave(&q->lock);
 
 	if (dowakeup) {
-		rendez_wakeup(&q->rr);
+		qwake_readers(q);
 		qwake_cb(q, FDTAP_FILT_READABLE);
 	}
 
 	return len;
 }
 
+/* Like qpass() for a single block, but first offers b to merge(), which can
+ * absorb b into the last block in the queue, which no reader has taken yet.
+ * merge() runs with the queue locked, and may only add to the last block's
+ * extra data.  If it returns TRUE, b is freed. */
+int qpass_merge(struct queue *q, struct block *b,
+                bool (*merge)(struct block *last, struct block *b))
+{
+	int old_len, dlen;
+
+	spin_lock_irqsave(&q->lock);
+	if (q->blast && !(q->state & Qclosed) && q->len < q->limit) {
+		old_len = BLEN(q->blast);
+		if (merge(q->blast, b)) {
+			dlen = BLEN(q->blast) - old_len;
+			q->len += dlen;
+			q->dlen += dlen;
+			if (q->len >= q->limit / 2)
+				q->state |= Qflow;
+			/* no wakeup: the reader already has q->blast to read */
+			spin_unlock_irqsave(&q->lock);
+			freeb(b);
+			return dlen;
+		}
+	}
+	spin_unlock_irqsave(&q->lock);
+	return qpass(q, b);
+}
+
 int qpassnolim(struct queue *q, struct block *b)
 {
 	int dlen, len, dowakeup;
@@ -915,7 +980,7 @@ int qpassnolim(struct queue *q, struct block *b)
 	spin_unlock_irqsave(&q->lock);
 
 	if (dowakeup) {
-		rendez_wakeup(&q->rr);
+		qwake_readers(q);
 		qwake_cb(q, FDTAP_FILT_READABLE);
 	}
 
@@ -1003,7 +1068,7 @@ int qproduce(struct queue *q, void *vp, int len)
 	spin_unlock_irqsave(&q->lock);
 
 	if (dowakeup) {
-		rendez_wakeup(&q->rr);
+		qwake_readers(q);
 		qwake_cb(q, FDTAP_FILT_READABLE);
 	}
 
@@ -1013,8 +1078,8 @@ int qproduce(struct queue *q, void *vp, int len)
 /* Add an extra_data entry to newb at newb_idx pointing to b's body, starting at
  * body_rp, for up to len.  Returns the len consumed. 
  *
- * The base is 'b', so that we can kfree it later.  This currently ties us to
- * using kfree for the release method for all extra_data.
+ * The base is 'b', so that we can kfree it later.  Extra_data that isn't
+ * kmalloc'd has an ebd->ref, which ebd_incref/decref() handle.
  *
  * It is possible to have a body size that is 0, if there is no offset, and
  * b->wp == b->rp.  This will have an extra data entry of 0 length. */
@@ -1050,7 +1115,8 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	ebd_incref(b_ebd);
+	n_ebd->ref = b_ebd->ref;
 	n_ebd->base = b_ebd->base;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
@@ -1313,6 +1379,7 @@ static bool qwait(struct queue *q)
 		}
 		spin_unlock_irqsave(&q->lock);
 		/* may throw an error() */
+		tracepoint(TP_QIO_BLOCK, q, 0, 0);
 		rendez_sleep(&q->rr, notempty, q);
 		spin_lock_irqsave(&q->lock);
 	}
@@ -1384,8 +1451,7 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		if (!ebd->len) {
 			/* we don't actually have to decref here.  it's also done in
 			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
-			ebd->base = ebd->off = 0;
+			ebd_decref(ebd);
 		}
 		to += copy_amt;
 		amt -= copy_amt;
@@ -1422,6 +1488,45 @@ struct block *bl2mem(uint8_t * p, struct block *b, int n)
 	return NULL;
 }
 
+/* Copies the contents of a string of blocks into the iovecs, extra_data and
+ * all, without linearizing the blocks first.  All of the blocks are freed, even
+ * if the iovecs run out.  Returns the amount copied. */
+size_t bl2iov(struct block *b, struct iovec *iov, int iovcnt)
+{
+	struct block *next;
+	size_t amt, iov_off = 0, copied = 0;
+
+	for (; b != NULL; b = next) {
+		while (BLEN(b) && iovcnt) {
+			amt = MIN(BLEN(b), iov->iov_len - iov_off);
+			amt = read_from_block(b, iov->iov_base + iov_off, amt);
+			iov_off += amt;
+			copied += amt;
+			if (iov_off == iov->iov_len) {
+				iov++;
+				iovcnt--;
+				iov_off = 0;
+			}
+		}
+		next = b->next;
+		freeb(b);
+	}
+	return copied;
+}
+
+/* Gathers len bytes from the iovecs into a single block */
+struct block *iov2bl(struct iovec *iov, int iovcnt, size_t len)
+{
+	struct block *b = allocb(len);
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(b->wp, iov[i].iov_base, iov[i].iov_len);
+		b->wp += iov[i].iov_len;
+	}
+	assert(BLEN(b) == len);
+	return b;
+}
+
 /*
  *  copy the contents of memory into a string of blocks.
  *  return NULL on error.
@@ -1490,7 +1595,7 @@ static void qwakeup_iunlock(struct queue *q)
 	if (dowakeup) {
 		if (q->kick)
 			q->kick(q->arg);
-		rendez_wakeup(&q->wr);
+		qwake_writers(q);
 		qwake_cb(q, FDTAP_FILT_WRITABLE);
 	}
 }
@@ -1504,9 +1609,9 @@ struct block *qbread(struct queue *q, int len)
 	struct block *b, *nb;
 	int n;
 
-	qlock(&q->rlock);
+	qrlock(q);
 	if (waserror()) {
-		qunlock(&q->rlock);
+		qrunlock(q);
 		nexterror();
 	}
 
@@ -1514,7 +1619,7 @@ struct block *qbread(struct queue *q, int len)
 	if (!qwait(q)) {
 		/* queue closed */
 		spin_unlock_irqsave(&q->lock);
-		qunlock(&q->rlock);
+		qrunlock(q);
 		poperror();
 		return NULL;
 	}
@@ -1541,7 +1646,7 @@ struct block *qbread(struct queue *q, int len)
 	qwakeup_iunlock(q);
 
 	poperror();
-	qunlock(&q->rlock);
+	qrunlock(q);
 	return nb;
 }
 
@@ -1555,9 +1660,9 @@ long qread(struct queue *q, void *vp, int len)
 	struct block *b, *first, **l;
 	int m, n;
 
-	qlock(&q->rlock);
+	qrlock(q);
 	if (waserror()) {
-		qunlock(&q->rlock);
+		qrunlock(q);
 		nexterror();
 	}
 
@@ -1566,7 +1671,7 @@ again:
 	if (!qwait(q)) {
 		/* queue closed */
 		spin_unlock_irqsave(&q->lock);
-		qunlock(&q->rlock);
+		qrunlock(q);
 		poperror();
 		return 0;
 	}
@@ -1624,7 +1729,7 @@ again:
 	qwakeup_iunlock(q);
 
 	poperror();
-	qunlock(&q->rlock);
+	qrunlock(q);
 	return n;
 }
 
@@ -1654,11 +1759,11 @@ long qbwrite(struct queue *q, struct block *b)
 	}
 
 	dowakeup = 0;
-	qlock(&q->wlock);
+	qwlock(q);
 	if (waserror()) {
 		if (b != NULL && should_free_b)
 			freeb(b);
-		qunlock(&q->wlock);
+		qwunlock(q);
 		nexterror();
 	}
 
@@ -1680,7 +1785,7 @@ long qbwrite(struct queue *q, struct block *b)
 			spin_unlock_irqsave(&q->lock);
 			freeb(b);
 			dropcnt += n;
-			qunlock(&q->wlock);
+			qwunlock(q);
 			poperror();
 			return n;
 		}
@@ -1717,7 +1822,7 @@ long qbwrite(struct queue *q, struct block *b)
 
 	/* wakeup anyone consuming at the other end */
 	if (dowakeup) {
-		rendez_wakeup(&q->rr);
+		qwake_readers(q);
 		qwake_cb(q, FDTAP_FILT_READABLE);
 	}
 
@@ -1740,10 +1845,11 @@ long qbwrite(struct queue *q, struct block *b)
 		spin_lock_irqsave(&q->lock);
 		q->state |= Qflow;
 		spin_unlock_irqsave(&q->lock);
+		tracepoint(TP_QIO_BLOCK, q, 1, 0);
 		rendez_sleep(&q->wr, qnotfull, q);
 	}
 
-	qunlock(&q->wlock);
+	qwunlock(q);
 	poperror();
 	return n;
 }
@@ -1777,13 +1883,125 @@ long qibwrite(struct queue *q, struct block *b)
 	if (dowakeup) {
 		if (q->kick)
 			q->kick(q->arg);
-		rendez_wakeup(&q->rr);
+		qwake_readers(q);
 		qwake_cb(q, FDTAP_FILT_READABLE);
 	}
 
 	return n;
 }
 
+#ifdef CONFIG_BLOCK_EXTRAS
+/* Zero-copy writes.  We pin the user's pages and point the blocks' extra_data
+ * at them.  Every ebd pointing at the pages, including clones (e.g. for TCP
+ * retransmits), holds a ref on the zcopy_ref.  When the last one goes (the NIC
+ * or protocol is done with the data), we unpin the pages and wake the writer.
+ * The writer returns to userspace only then, so the buffer is safe to reuse
+ * once the (possibly async) syscall completes. */
+struct zcopy_ref {
+	struct kref					kref;
+	struct semaphore			sem;
+	unsigned int				nr_pages;
+	struct page					*pages[];
+};
+
+/* Smaller writes aren't worth the pinning */
+#define ZCOPY_MIN_LEN PGSIZE
+
+static void zcopy_release(struct kref *kref)
+{
+	struct zcopy_ref *zc = container_of(kref, struct zcopy_ref, kref);
+
+	for (int i = 0; i < zc->nr_pages; i++)
+		page_decref(zc->pages[i]);
+	sem_up(&zc->sem);
+}
+
+/* Pins the pages of p's [va, va + len) into zc.  Returns FALSE if some page
+ * isn't mapped (e.g. jumbo pages), in which case nothing is pinned. */
+static bool zcopy_pin(struct proc *p, uintptr_t va, size_t len,
+                      struct zcopy_ref *zc)
+{
+	uintptr_t start = ROUNDDOWN(va, PGSIZE);
+	unsigned int nr_pages = (ROUNDUP(va + len, PGSIZE) - start) >> PGSHIFT;
+	struct page *page;
+
+	/* Fault in anything the user hasn't touched yet */
+	populate_va(p, start, nr_pages);
+	spin_lock(&p->pte_lock);
+	for (int i = 0; i < nr_pages; i++) {
+		page = page_lookup(p->env_pgdir, (void*)(start + i * PGSIZE), 0);
+		if (!page) {
+			spin_unlock(&p->pte_lock);
+			for (int j = 0; j < i; j++)
+				page_decref(zc->pages[j]);
+			return FALSE;
+		}
+		page_incref(page);
+		zc->pages[i] = page;
+	}
+	spin_unlock(&p->pte_lock);
+	zc->nr_pages = nr_pages;
+	return TRUE;
+}
+
+/* Like qwrite, but from the pinned pages of the current process, instead of
+ * copying.  Returns -1 if we couldn't pin, having written nothing. */
+static int qwrite_zcopy(struct queue *q, void *vp, int len)
+{
+	ERRSTACK(1);
+	uintptr_t va = (uintptr_t)vp;
+	unsigned int nr_pages;
+	struct zcopy_ref *zc;
+	struct extra_bdata *ebd;
+	struct block *b;
+	int n, amt, pg_idx;
+	int sofar = 0;
+
+	nr_pages = (ROUNDUP(va + len, PGSIZE) - ROUNDDOWN(va, PGSIZE)) >> PGSHIFT;
+	zc = kmalloc(sizeof(struct zcopy_ref) + nr_pages * sizeof(struct page*),
+	             KMALLOC_WAIT);
+	if (!zcopy_pin(current, va, len, zc)) {
+		kfree(zc);
+		return -1;
+	}
+	kref_init(&zc->kref, zcopy_release, 1);
+	sem_init(&zc->sem, 0);
+	if (waserror()) {
+		/* Blocks we already queued might still point at the pages */
+		kref_put(&zc->kref);
+		sem_down(&zc->sem);
+		kfree(zc);
+		nexterror();
+	}
+	do {
+		n = MIN(len - sofar, Maxatomic);
+		/* header space, like qwrite, and one extra per page touched */
+		b = allocb(64);
+		block_add_extd(b, n / PGSIZE + 2, KMALLOC_WAIT);
+		for (int i = 0; n; i++) {
+			pg_idx = (ROUNDDOWN(va + sofar, PGSIZE) - ROUNDDOWN(va, PGSIZE)) >>
+			         PGSHIFT;
+			amt = MIN(n, PGSIZE - PGOFF(va + sofar));
+			ebd = &b->extra_data[i];
+			kref_get(&zc->kref, 1);
+			ebd->ref = &zc->kref;
+			ebd->base = (uintptr_t)page2kva(zc->pages[pg_idx]);
+			ebd->off = PGOFF(va + sofar);
+			ebd->len = amt;
+			b->extra_len += amt;
+			n -= amt;
+			sofar += amt;
+		}
+		qbwrite(q, b);
+	} while (sofar < len && (q->state & Qmsg) == 0);
+	poperror();
+	kref_put(&zc->kref);
+	sem_down(&zc->sem);
+	kfree(zc);
+	return len;
+}
+#endif /* CONFIG_BLOCK_EXTRAS */
+
 /*
  *  write to a queue.  only Maxatomic bytes at a time is atomic.
  */
@@ -1797,6 +2015,17 @@ int qwrite(struct queue *q, void *vp, int len)
 	QDEBUG if (!islo())
 		 printd("qwrite hi %p\n", getcallerpc(&q));
 
+#ifdef CONFIG_BLOCK_EXTRAS
+	/* Zero-copy writes block until the data is sent, so they make no sense
+	 * for queues that mustn't block. */
+	if ((q->state & Qzcopy) && !(q->state & (Qnonblock | Qdropoverflow)) &&
+	    (len >= ZCOPY_MIN_LEN) && current && is_user_raddr(vp, len)) {
+		n = qwrite_zcopy(q, vp, len);
+		if (n >= 0)
+			return n;
+	}
+#endif
+
 	sofar = 0;
 	do {
 		n = len - sofar;
@@ -1904,8 +2133,8 @@ void qclose(struct queue *q)
 	freeblist(bfirst);
 
 	/* wake up readers/writers */
-	rendez_wakeup(&q->rr);
-	rendez_wakeup(&q->wr);
+	qwake_readers(q);
+	qwake_writers(q);
 	qwake_cb(q, FDTAP_FILT_HANGUP);
 }
 
@@ -1927,8 +2156,8 @@ void qhangup(struct queue *q, char *msg)
 	spin_unlock_irqsave(&q->lock);
 
 	/* wake up readers/writers */
-	rendez_wakeup(&q->rr);
-	rendez_wakeup(&q->wr);
+	qwake_readers(q);
+	qwake_writers(q);
 	qwake_cb(q, FDTAP_FILT_HANGUP);
 }
 
@@ -2012,6 +2241,29 @@ void qnonblock(struct queue *q, bool onoff)
 		q->state &= ~Qnonblock;
 }
 
+/* set whether a read takes as many whole blocks as fit, instead of one.  On a
+ * Qmsg queue, that's as many whole messages as fit. */
+void qcoalesce(struct queue *q, bool onoff)
+{
+	spin_lock_irqsave(&q->lock);
+	if (onoff)
+		q->state |= Qcoalesce;
+	else
+		q->state &= ~Qcoalesce;
+	spin_unlock_irqsave(&q->lock);
+}
+
+/* set whether big writes from userspace pin the user's pages instead of
+ * copying.  Those writes wait until the data is no longer needed (e.g. sent, or
+ * ACKed for TCP).  Only with CONFIG_BLOCK_EXTRAS. */
+void qzerocopy(struct queue *q, bool onoff)
+{
+	if (onoff)
+		q->state |= Qzcopy;
+	else
+		q->state &= ~Qzcopy;
+}
+
 /*
  *  flush the output queue
  */
@@ -2031,7 +2283,7 @@ void qflush(struct queue *q)
 	freeblist(bfirst);
 
 	/* wake up writers */
-	rendez_wakeup(&q->wr);
+	qwake_writers(q);
 	qwake_cb(q, FDTAP_FILT_WRITABLE);
 }
 
@@ -795,6 +795,79 @@ long syspread(int fd, void *va, long n, int64_t off)
 	return rread(fd, va, n, &off);
 }
 
+/* Total length of the iovecs, throws if it overflows */
+static long iov_total_len(struct iovec *iov, int iovcnt)
+{
+	long n = 0;
+
+	if (iovcnt < 0)
+		error(EINVAL, "bad iovcnt %d", iovcnt);
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > INT64_MAX - n)
+			error(EINVAL, "iovecs are too long");
+		n += iov[i].iov_len;
+	}
+	return n;
+}
+
+/* Scatter-gather read.  One bread from the device, with the blocks (and their
+ * extra_data) copied straight into the iovecs, so stream devices keep their
+ * message boundaries, same as a single read().  No directories.  With offp,
+ * reads from *offp and leaves the chan's offset alone, like rread(). */
+static long rreadv(int fd, struct iovec *iov, int iovcnt, int64_t *offp)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	struct block *bl;
+	int64_t off;
+	long n;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (c->qid.type & QTDIR)
+		error(EISDIR, "can't readv a directory");
+	n = iov_total_len(iov, iovcnt);
+	if (n) {
+		if (offp == NULL) {
+			spin_lock(&c->lock);	/* lock for int64_t assignment */
+			off = c->offset;
+			spin_unlock(&c->lock);
+		} else {
+			off = *offp;
+		}
+		if (off < 0)
+			error(EINVAL, "bad offset %lld", off);
+		bl = devtab[c->type].bread(c, n, off);
+		n = bl2iov(bl, iov, iovcnt);
+		if (offp == NULL) {
+			spin_lock(&c->lock);
+			c->offset += n;
+			spin_unlock(&c->lock);
+		}
+	}
+	poperror();
+	cclose(c);
+	poperror();
+	return n;
+}
+
+long sysreadv(int fd, struct iovec *iov, int iovcnt)
+{
+	return rreadv(fd, iov, iovcnt, NULL);
+}
+
+long syspreadv(int fd, struct iovec *iov, int iovcnt, int64_t off)
+{
+	return rreadv(fd, iov, iovcnt, &off);
+}
+
 int sysremove(char *path)
 {
 	ERRSTACK(2);
@@ -1082,6 +1155,200 @@ long syspwrite(int fd, void *va, long n, int64_t off)
 	return rwrite(fd, va, n, &off);
 }
 
+/* Scatter-gather write.  The iovecs are gathered into one block and handed to
+ * the device's bwrite, so it is one message on a stream, same as a single
+ * write().  Doesn't do O_APPEND.  With offp, writes at *offp and leaves the
+ * chan's offset alone. */
+static long rwritev(int fd, struct iovec *iov, int iovcnt, int64_t *offp)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	int64_t off;
+	long n;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (c->qid.type & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	if (c->flag & O_APPEND)
+		error(ENOTSUP, "writev doesn't support O_APPEND");
+	n = iov_total_len(iov, iovcnt);
+	if (n) {
+		if (offp == NULL) {
+			spin_lock(&c->lock);	/* legacy lock for int64 assignment */
+			off = c->offset;
+			spin_unlock(&c->lock);
+		} else {
+			off = *offp;
+		}
+		if (off < 0)
+			error(EINVAL, "bad offset %lld", off);
+		n = devtab[c->type].bwrite(c, iov2bl(iov, iovcnt, n), off);
+		if (offp == NULL) {
+			spin_lock(&c->lock);
+			c->offset += n;
+			spin_unlock(&c->lock);
+		}
+	}
+	poperror();
+	cclose(c);
+	poperror();
+	return n;
+}
+
+long syswritev(int fd, struct iovec *iov, int iovcnt)
+{
+	return rwritev(fd, iov, iovcnt, NULL);
+}
+
+long syspwritev(int fd, struct iovec *iov, int iovcnt, int64_t off)
+{
+	return rwritev(fd, iov, iovcnt, &off);
+}
+
+/* The chan end of a sendfile: somewhere we can hand blocks to, e.g. a
+ * conversation's data file or a pipe. */
+static struct chan *sendfile_outchan(int out_fd)
+{
+	struct chan *c;
+
+	c = fdtochan(&current->open_files, out_fd, O_WRITE, 1, 1);
+	if ((c->qid.type & QTDIR) || (c->flag & O_APPEND)) {
+		cclose(c);
+		error(EINVAL, "can't sendfile to a directory or O_APPEND file");
+	}
+	return c;
+}
+
+/* Writes b to c at c's offset, returning how much was written.  Devices that
+ * queue blocks take b as is; devbwrite only knows the block's header, so it
+ * gets a linear copy. */
+static long sendfile_bwrite(struct chan *c, struct block *b)
+{
+	int64_t off;
+	long n;
+
+	if (devtab[c->type].bwrite == devbwrite)
+		b = linearizeblock(b);
+	spin_lock(&c->lock);	/* legacy lock for int64 assignment */
+	off = c->offset;
+	spin_unlock(&c->lock);
+	n = devtab[c->type].bwrite(c, b, off);
+	spin_lock(&c->lock);
+	c->offset += n;
+	spin_unlock(&c->lock);
+	return n;
+}
+
+/* Moves up to count bytes from in_fd, at *offp or its chan's offset if offp
+ * is NULL, to out_fd without copying through the user.  Each chunk is one
+ * bread/bwrite, so queue-backed devices (pipes, conversations) just pass
+ * their blocks along.  Returns the amount moved, which is short at EOF or if
+ * we got an error partway through. */
+long syssendfile(int out_fd, int in_fd, int64_t *offp, long count)
+{
+	ERRSTACK(2);
+	struct chan *in, *out;
+	struct block *b;
+	volatile long sofar = 0;
+	int64_t off;
+	long n, m;
+
+	if (waserror()) {
+		poperror();
+		return sofar ? sofar : -1;
+	}
+	if (count < 0)
+		error(EINVAL, ERROR_FIXME);
+	in = fdtochan(&current->open_files, in_fd, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(in);
+		nexterror();
+	}
+	if (in->qid.type & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	out = sendfile_outchan(out_fd);
+	if (waserror()) {
+		cclose(out);
+		nexterror();
+	}
+	while (sofar < count) {
+		if (offp) {
+			off = *offp;
+		} else {
+			spin_lock(&in->lock);
+			off = in->offset;
+			spin_unlock(&in->lock);
+		}
+		n = MIN(count - sofar, qiomaxatomic);
+		b = devtab[in->type].bread(in, n, off);
+		n = BLEN(b);
+		if (!n) {
+			freeb(b);
+			break;
+		}
+		if (offp) {
+			*offp += n;
+		} else {
+			spin_lock(&in->lock);
+			in->offset += n;
+			spin_unlock(&in->lock);
+		}
+		m = sendfile_bwrite(out, b);
+		sofar += m;
+		if (m < n)
+			break;
+	}
+	poperror();
+	cclose(out);
+	poperror();
+	cclose(in);
+	poperror();
+	return sofar;
+}
+
+/* Like syssendfile, but the source is a page map, e.g. a VFS file's page
+ * cache, holding size bytes.  The blocks we send point at the cached pages. */
+long syssendpm(int out_fd, struct page_map *pm, size_t size, int64_t *offp,
+               long count)
+{
+	ERRSTACK(2);
+	struct chan *out;
+	volatile long sofar = 0;
+	long n, m;
+
+	if (waserror()) {
+		poperror();
+		return sofar ? sofar : -1;
+	}
+	if (count < 0 || *offp < 0)
+		error(EINVAL, ERROR_FIXME);
+	out = sendfile_outchan(out_fd);
+	if (waserror()) {
+		cclose(out);
+		nexterror();
+	}
+	while (sofar < count && *offp < size) {
+		n = MIN(MIN(count - sofar, qiomaxatomic), size - *offp);
+		m = sendfile_bwrite(out, block_from_pm(pm, *offp, n));
+		*offp += m;
+		sofar += m;
+		if (m < n)
+			break;
+	}
+	poperror();
+	cclose(out);
+	poperror();
+	return sofar;
+}
+
 int syswstat(char *path, uint8_t * buf, int n)
 {
 	ERRSTACK(2);
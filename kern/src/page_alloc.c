@@ -14,6 +14,9 @@
 #include <string.h>
 #include <kmalloc.h>
 #include <blockdev.h>
+#include <arch/topology.h>
+#include <percpu.h>
+#include <reclaim.h>
 
 #define l1 (available_caches.l1)
 #define l2 (available_caches.l2)
@@ -33,6 +36,84 @@ static error_t __page_alloc_specific(page_t **page, size_t ppn);
 uint8_t* global_cache_colors_map;
 size_t global_next_color = 0;
 
+/* Free pages are kept in per-NUMA-node colored lists.  Until
+ * page_alloc_numa_init() runs, there is only node 0, whose lists are the
+ * arch's colored_page_free_list.  All of the nodes are protected by the
+ * colored_page_free_list_lock. */
+struct page_node {
+	page_list_t					*free_lists;
+	size_t						nr_free_pages;
+	size_t						nr_pages;		/* free at boot */
+	size_t						wmark_low;
+	size_t						wmark_high;
+	uint64_t					nr_local_allocs;
+	uint64_t					nr_remote_allocs;
+	page_list_t					zero_pages;
+	size_t						nr_zero_pages;
+	uint64_t					nr_zero_hits;
+	uint64_t					nr_zero_misses;
+};
+
+static struct page_node boot_page_node;
+static struct page_node *page_nodes = &boot_page_node;
+int nr_page_nodes = 1;
+
+static page_list_t *node_free_lists(int node)
+{
+	return node ? page_nodes[node].free_lists : colored_page_free_list;
+}
+
+/* Each core keeps a small cache of hot pages in front of the node lists, so
+ * that single page allocs and frees don't need the global lock.  Pages in a
+ * core's cache keep a refcnt of 1, so that they don't look free to the
+ * scanning allocators (get_cont_pages(), etc).  The caches are refilled and
+ * drained in batches. */
+#define PAGE_PCPU_BATCH				16
+#define PAGE_PCPU_HIGH				64
+
+struct page_pcpu_cache {
+	page_list_t					pages;
+	unsigned int				nr_pages;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static DEFINE_PERCPU(struct page_pcpu_cache, page_pcpu_caches);
+static bool page_pcpu_ready;
+
+/* Idle cores zero free pages ahead of time into their node's zero pool, so
+ * that allocations that want a zeroed page (anonymous faults, mostly) can skip
+ * the memset.  Like the per-core caches, pages in the pool are allocated
+ * (refcnt 1), and they go back to the free lists when get_cont_pages() is
+ * desperate.  Idle cores leave PAGE_ZERO_MIN_FREE pages alone. */
+#define PAGE_ZERO_POOL_MAX			1024	/* per node */
+#define PAGE_ZERO_BATCH				8
+#define PAGE_ZERO_MIN_FREE			4096
+
+/* Set once the nodes are final, since the pools live in them */
+static bool page_zero_ready;
+
+/* Once a node's free pages drop below its low watermark, allocators kick the
+ * reclaimer, which frees memory until every node is back above its high
+ * watermark.  The marks are fractions of what the node had free at boot, with a
+ * floor so that small machines keep some slack. */
+#define PAGE_WMARK_LOW_SHIFT		6		/* 1/64th */
+#define PAGE_WMARK_MIN_LOW			256
+
+/* Which node's lists a page belongs on. */
+static int page_numa_node(struct page *page)
+{
+	if (nr_page_nodes == 1)
+		return 0;
+	return paddr_to_numa_id(page2pa(page));
+}
+
+/* The calling core's node, which is where we try to allocate first. */
+static int page_local_node(void)
+{
+	if (nr_page_nodes == 1)
+		return 0;
+	return numa_id();
+}
+
 void colored_page_alloc_init()
 {
 	global_cache_colors_map = 
@@ -51,7 +132,9 @@ static void __page_init(struct page *page)
 	sem_init(&page->pg_sem, 0);
 }
 
-#define __PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, predicate) \
+#define __PAGE_ALLOC_FROM_RANGE_GENERIC(node, page, base_color, range,      \
+                                        predicate)                          \
+	page_list_t *lists = node_free_lists(node);                             \
 	/* Find first available color with pages available */                   \
     /* in the given range */                                                \
 	int i = base_color;                                                     \
@@ -61,42 +144,305 @@ static void __page_init(struct page *page)
 	}                                                                       \
 	/* Allocate a page from that color */                                   \
 	if(i < (base_color+range)) {                                            \
-		*page = BSD_LIST_FIRST(&colored_page_free_list[i]);                 \
+		*page = BSD_LIST_FIRST(&lists[i]);                                  \
 		BSD_LIST_REMOVE(*page, pg_link);                                    \
+		page_nodes[node].nr_free_pages--;                                   \
 		__page_init(*page);                                                 \
 		return i;                                                           \
 	}                                                                       \
 	return -ENOMEM;
 
-static ssize_t __page_alloc_from_color_range(page_t** page,  
+static ssize_t __page_alloc_from_color_range(int node, page_t** page,
                                            uint16_t base_color,
                                            uint16_t range) 
 {
-	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, 
-	                 !BSD_LIST_EMPTY(&colored_page_free_list[i]));
+	__PAGE_ALLOC_FROM_RANGE_GENERIC(node, page, base_color, range,
+	                 !BSD_LIST_EMPTY(&lists[i]));
 }
 
-static ssize_t __page_alloc_from_color_map_range(page_t** page, uint8_t* map, 
+static ssize_t __page_alloc_from_color_map_range(int node, page_t** page,
+                                              uint8_t* map,
                                               size_t base_color, size_t range)
 {  
-	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, 
+	__PAGE_ALLOC_FROM_RANGE_GENERIC(node, page, base_color, range,
 		    GET_BITMASK_BIT(map, i) &&
-			!BSD_LIST_EMPTY(&colored_page_free_list[i]))
+			!BSD_LIST_EMPTY(&lists[i]))
 }
 
-static ssize_t __colored_page_alloc(uint8_t* map, page_t** page, 
+static ssize_t __colored_page_alloc(int node, uint8_t* map, page_t** page,
                                                size_t next_color)
 {
 	ssize_t ret;
-	if((ret = __page_alloc_from_color_map_range(page, map, 
+	if((ret = __page_alloc_from_color_map_range(node, page, map,
 	                           next_color, llc_cache->num_colors - next_color)) < 0)
-		ret = __page_alloc_from_color_map_range(page, map, 0, next_color);
+		ret = __page_alloc_from_color_map_range(node, page, map, 0, next_color);
+	return ret;
+}
+
+static ssize_t __kernel_page_alloc(int node, page_t** page)
+{
+	ssize_t ret;
+	if ((ret = __page_alloc_from_color_range(node, page, global_next_color,
+	                            llc_cache->num_colors - global_next_color)) < 0)
+		ret = __page_alloc_from_color_range(node, page, 0, global_next_color);
 	return ret;
 }
 
+/* Kicks the reclaimer if any node is below its low watermark.  Call without
+ * the free list lock.  The reads are racy, which is fine for a hint. */
+static void page_check_wmarks(void)
+{
+	for (int n = 0; n < nr_page_nodes; n++) {
+		if (page_nodes[n].nr_free_pages < page_nodes[n].wmark_low) {
+			reclaim_kick();
+			return;
+		}
+	}
+}
+
+/* Returns TRUE if any node has fewer free pages than its high watermark, or
+ * its low one if !high. */
+bool page_alloc_below_wmark(bool high)
+{
+	struct page_node *pn;
+
+	for (int n = 0; n < nr_page_nodes; n++) {
+		pn = &page_nodes[n];
+		if (pn->nr_free_pages < (high ? pn->wmark_high : pn->wmark_low))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Records whether an allocation got a page from the caller's node. */
+static void __account_node_alloc(int node, bool local)
+{
+	if (local)
+		page_nodes[node].nr_local_allocs++;
+	else
+		page_nodes[node].nr_remote_allocs++;
+}
+
+static void page_pcpu_init(void)
+{
+	for (int i = 0; i < num_cores; i++) {
+		struct page_pcpu_cache *pcc = _PERCPU_VARPTR(page_pcpu_caches, i);
+
+		BSD_LIST_INIT(&pcc->pages);
+		pcc->nr_pages = 0;
+	}
+	page_pcpu_ready = TRUE;
+}
+DEFINE_PERCPU_INIT(page_pcpu_init);
+
+/* Fills pcc with a batch of pages, preferring the local node.  Call with IRQs
+ * disabled. */
+static void __page_pcpu_refill(struct page_pcpu_cache *pcc)
+{
+	struct page *page;
+	ssize_t ret;
+	int local, node;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	local = page_local_node();
+	for (int n = 0; n < nr_page_nodes; n++) {
+		node = (local + n) % nr_page_nodes;
+		while (pcc->nr_pages < PAGE_PCPU_BATCH) {
+			ret = __kernel_page_alloc(node, &page);
+			if (ret < 0)
+				break;
+			global_next_color = ret;
+			__account_node_alloc(node, n == 0);
+			BSD_LIST_INSERT_HEAD(&pcc->pages, page, pg_link);
+			pcc->nr_pages++;
+		}
+		if (pcc->nr_pages == PAGE_PCPU_BATCH)
+			break;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	page_check_wmarks();
+}
+
+/* Gives up to nr pages from pcc back to their node lists.  Call with IRQs
+ * disabled.  Returns the number of pages drained. */
+static unsigned int __page_pcpu_drain(struct page_pcpu_cache *pcc,
+                                      unsigned int nr)
+{
+	struct page *page;
+	unsigned int drained = 0;
+	int node;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	while (drained < nr && pcc->nr_pages) {
+		page = BSD_LIST_FIRST(&pcc->pages);
+		BSD_LIST_REMOVE(page, pg_link);
+		pcc->nr_pages--;
+		node = page_numa_node(page);
+		page_setref(page, 0);
+		BSD_LIST_INSERT_HEAD(
+		   &(node_free_lists(node)[get_page_color(page2ppn(page), llc_cache)]),
+		   page, pg_link);
+		page_nodes[node].nr_free_pages++;
+		drained++;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return drained;
+}
+
+/* Returns a page from this core's cache, or 0 if there are no free pages. */
+static struct page *page_pcpu_alloc(void)
+{
+	struct page_pcpu_cache *pcc;
+	struct page *page = 0;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pcc = PERCPU_VARPTR(page_pcpu_caches);
+	if (!pcc->nr_pages)
+		__page_pcpu_refill(pcc);
+	if (pcc->nr_pages) {
+		page = BSD_LIST_FIRST(&pcc->pages);
+		BSD_LIST_REMOVE(page, pg_link);
+		pcc->nr_pages--;
+	}
+	enable_irqsave(&irq_state);
+	if (page)
+		__page_init(page);
+	return page;
+}
+
+/* Puts a page, whose last ref we hold, in this core's cache. */
+static void page_pcpu_free(struct page *page)
+{
+	struct page_pcpu_cache *pcc;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pcc = PERCPU_VARPTR(page_pcpu_caches);
+	BSD_LIST_INSERT_HEAD(&pcc->pages, page, pg_link);
+	pcc->nr_pages++;
+	if (pcc->nr_pages > PAGE_PCPU_HIGH)
+		__page_pcpu_drain(pcc, PAGE_PCPU_BATCH);
+	enable_irqsave(&irq_state);
+}
+
+/* Drains this core's page cache.  Returns the number of pages drained. */
+static unsigned int page_pcpu_drain(void)
+{
+	struct page_pcpu_cache *pcc;
+	unsigned int drained;
+	int8_t irq_state = 0;
+
+	if (!page_pcpu_ready)
+		return 0;
+	disable_irqsave(&irq_state);
+	pcc = PERCPU_VARPTR(page_pcpu_caches);
+	drained = __page_pcpu_drain(pcc, pcc->nr_pages);
+	enable_irqsave(&irq_state);
+	return drained;
+}
+
+/* Returns a pre-zeroed page, preferring the local node, or 0 if the pools are
+ * empty. */
+static struct page *page_zero_alloc(void)
+{
+	struct page *page = 0;
+	int local, node;
+
+	if (!page_zero_ready)
+		return 0;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	local = page_local_node();
+	for (int n = 0; n < nr_page_nodes; n++) {
+		node = (local + n) % nr_page_nodes;
+		page = BSD_LIST_FIRST(&page_nodes[node].zero_pages);
+		if (page) {
+			BSD_LIST_REMOVE(page, pg_link);
+			page_nodes[node].nr_zero_pages--;
+			__account_node_alloc(node, n == 0);
+			break;
+		}
+	}
+	if (page)
+		page_nodes[local].nr_zero_hits++;
+	else
+		page_nodes[local].nr_zero_misses++;
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (page)
+		__page_init(page);
+	return page;
+}
+
+/* Called by idle cores.  Zeroes a batch of free pages from this core's node
+ * into the node's zero pool.  Returns TRUE if it zeroed anything, in which case
+ * the caller should check for real work before calling again. */
+bool page_zero_idle(void)
+{
+	struct page *pages[PAGE_ZERO_BATCH];
+	struct page_node *pn;
+	int node, nr = 0;
+	ssize_t ret;
+
+	if (!page_zero_ready)
+		return FALSE;
+	node = page_local_node();
+	pn = &page_nodes[node];
+	if (ACCESS_ONCE(pn->nr_zero_pages) >= PAGE_ZERO_POOL_MAX)
+		return FALSE;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	while (nr < PAGE_ZERO_BATCH && pn->nr_free_pages > PAGE_ZERO_MIN_FREE &&
+	       pn->nr_zero_pages + nr < PAGE_ZERO_POOL_MAX) {
+		ret = __kernel_page_alloc(node, &pages[nr]);
+		if (ret < 0)
+			break;
+		global_next_color = ret;
+		nr++;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (!nr)
+		return FALSE;
+	/* These won't be touched until someone faults them in */
+	for (int i = 0; i < nr; i++)
+		memset_nt(page2kva(pages[i]), 0, PGSIZE);
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < nr; i++)
+		BSD_LIST_INSERT_HEAD(&pn->zero_pages, pages[i], pg_link);
+	pn->nr_zero_pages += nr;
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return TRUE;
+}
+
+/* Gives every node's zero pool back to its free lists.  Returns the number of
+ * pages freed. */
+static unsigned int page_zero_drain(void)
+{
+	struct page *page;
+	unsigned int drained = 0;
+
+	if (!page_zero_ready)
+		return 0;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int node = 0; node < nr_page_nodes; node++) {
+		while ((page = BSD_LIST_FIRST(&page_nodes[node].zero_pages))) {
+			BSD_LIST_REMOVE(page, pg_link);
+			page_nodes[node].nr_zero_pages--;
+			page_setref(page, 0);
+			BSD_LIST_INSERT_HEAD(
+			   &(node_free_lists(node)[get_page_color(page2ppn(page),
+			                                          llc_cache)]),
+			   page, pg_link);
+			page_nodes[node].nr_free_pages++;
+			drained++;
+		}
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return drained;
+}
+
 static void __real_page_alloc(struct page *page)
 {
 	BSD_LIST_REMOVE(page, pg_link);
+	page_nodes[page_numa_node(page)].nr_free_pages--;
 	__page_init(page);
 }
 
@@ -125,10 +471,37 @@ static error_t __page_alloc_specific(page_t** page, size_t ppn)
  */
 error_t upage_alloc(struct proc* p, page_t** page, int zero)
 {
+	ssize_t ret = -ENOMEM;
+	int local, node;
+
+	/* Only uncolored processes can use the (colorless) per-core cache */
+	if (page_pcpu_ready && p->cache_colors_map == global_cache_colors_map) {
+		if (zero) {
+			*page = page_zero_alloc();
+			if (*page)
+				return 0;
+		}
+		*page = page_pcpu_alloc();
+		if (!*page)
+			return -ENOMEM;
+		if (zero)
+			memset(page2kva(*page), 0, PGSIZE);
+		return 0;
+	}
 	spin_lock_irqsave(&colored_page_free_list_lock);
-	ssize_t ret = __colored_page_alloc(p->cache_colors_map, 
-	                                     page, p->next_cache_color);
+	/* Try the local node first, then fall back to the others in order */
+	local = page_local_node();
+	for (int n = 0; n < nr_page_nodes; n++) {
+		node = (local + n) % nr_page_nodes;
+		ret = __colored_page_alloc(node, p->cache_colors_map, page,
+		                           p->next_cache_color);
+		if (ret >= 0) {
+			__account_node_alloc(node, n == 0);
+			break;
+		}
+	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	page_check_wmarks();
 
 	if (ret >= 0) {
 		if(zero)
@@ -142,17 +515,29 @@ error_t upage_alloc(struct proc* p, page_t** page, int zero)
 /* Allocates a refcounted page of memory for the kernel's use */
 error_t kpage_alloc(page_t** page) 
 {
-	ssize_t ret;
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	if ((ret = __page_alloc_from_color_range(page, global_next_color, 
-	                            llc_cache->num_colors - global_next_color)) < 0)
-		ret = __page_alloc_from_color_range(page, 0, global_next_color);
+	ssize_t ret = -ENOMEM;
+	int local, node;
 
+	if (page_pcpu_ready) {
+		*page = page_pcpu_alloc();
+		return *page ? ESUCCESS : -ENOMEM;
+	}
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	local = page_local_node();
+	for (int n = 0; n < nr_page_nodes; n++) {
+		node = (local + n) % nr_page_nodes;
+		ret = __kernel_page_alloc(node, page);
+		if (ret >= 0) {
+			__account_node_alloc(node, n == 0);
+			break;
+		}
+	}
 	if (ret >= 0) {
 		global_next_color = ret;        
 		ret = ESUCCESS;
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	page_check_wmarks();
 	
 	return ret;
 }
@@ -169,9 +554,15 @@ void *kpage_alloc_addr(void)
 
 void *kpage_zalloc_addr(void)
 {
-	void *retval = kpage_alloc_addr();
+	struct page *page = page_zero_alloc();
+	void *retval;
+
+	if (page)
+		return page2kva(page);
+	retval = kpage_alloc_addr();
+	/* no reason to pull the zeros into the cache */
 	if (retval)
-		memset(retval, 0, PGSIZE);
+		memset_nt(retval, 0, PGSIZE);
 	return retval;
 }
 
@@ -184,18 +575,25 @@ void *kpage_zalloc_addr(void)
  *
  * @return The KVA of the first page, NULL otherwise.
  */
-void *get_cont_pages(size_t order, int flags)
+/* Helper: is ppn free and, if node >= 0, on that node? */
+static bool __page_is_free_on(size_t ppn, int node)
 {
-	size_t npages = 1 << order;	
+	if (!page_is_free(ppn))
+		return FALSE;
+	return node < 0 || page_numa_node(ppn2page(ppn)) == node;
+}
 
+/* Finds and allocates 'npages' consecutive free pages, all on 'node' if node is
+ * non-negative.  Returns the first ppn, or -1.  Hold the lock. */
+static int __get_cont_pages(size_t npages, int node)
+{
 	size_t naddrpages = max_paddr / PGSIZE;
 	// Find 'npages' free consecutive pages
 	int first = -1;
-	spin_lock_irqsave(&colored_page_free_list_lock);
 	for(int i=(naddrpages-1); i>=(npages-1); i--) {
 		int j;
 		for(j=i; j>=(i-(npages-1)); j--) {
-			if( !page_is_free(j) ) {
+			if (!__page_is_free_on(j, node)) {
 				i = j - 1;
 				break;
 			}
@@ -205,27 +603,44 @@ void *get_cont_pages(size_t order, int flags)
 			break;
 		}
 	}
+	if (first == -1)
+		return -1;
+	for(int i=0; i<npages; i++) {
+		page_t* page;
+		__page_alloc_specific(&page, first+i);
+	}
+	return first;
+}
+
+void *get_cont_pages(size_t order, int flags)
+{
+	int first;
+
+	do {
+		spin_lock_irqsave(&colored_page_free_list_lock);
+		first = __get_cont_pages(1 << order, -1);
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		/* Our core's cached pages or the zero pools might be what's
+		 * fragmenting memory.  Callers that can wait can also reclaim. */
+	} while (first == -1 && (page_pcpu_drain() || page_zero_drain() ||
+	                         ((flags & KMALLOC_WAIT) &&
+	                          reclaim_direct(1 << order))));
+	page_check_wmarks();
 	//If we couldn't find them, return NULL
 	if( first == -1 ) {
-		spin_unlock_irqsave(&colored_page_free_list_lock);
 		if (flags & KMALLOC_ERROR)
 			error(ENOMEM, ERROR_FIXME);
 		return NULL;
 	}
-
-	for(int i=0; i<npages; i++) {
-		page_t* page;
-		__page_alloc_specific(&page, first+i);
-	}
-	spin_unlock_irqsave(&colored_page_free_list_lock);
 	return ppn2kva(first);
 }
 
 /**
  * @brief Allocated 2^order contiguous physical pages.  Will increment the
- * reference count for the pages. Get them from NUMA node node.
+ * reference count for the pages. Get them from NUMA node node, if possible,
+ * otherwise from anywhere.
  *
- * @param[in] node which node to allocate from. Unimplemented.
+ * @param[in] node which node to allocate from.
  * @param[in] order order of the allocation
  * @param[in] flags memory allocation flags
  *
@@ -233,7 +648,88 @@ void *get_cont_pages(size_t order, int flags)
  */
 void *get_cont_pages_node(int node, size_t order, int flags)
 {
-	return get_cont_pages(order, flags);
+	int first;
+
+	if (node < 0 || node >= nr_page_nodes)
+		return get_cont_pages(order, flags);
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	first = __get_cont_pages(1 << order, node);
+	if (first != -1)
+		__account_node_alloc(node, node == page_local_node());
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (first == -1)
+		return get_cont_pages(order, flags);
+	page_check_wmarks();
+	return ppn2kva(first);
+}
+
+/* Like __get_cont_pages, but the run starts on a multiple of npages, which must
+ * be a power of two.  Hold the lock. */
+static long __get_aligned_cont_pages(size_t npages, int node)
+{
+	size_t naddrpages = max_paddr / PGSIZE;
+	size_t j;
+
+	if (npages > naddrpages)
+		return -1;
+	for (long first = ROUNDDOWN(naddrpages - npages, npages); first >= 0;
+	     first -= npages) {
+		for (j = first; j < first + npages; j++) {
+			if (!__page_is_free_on(j, node))
+				break;
+		}
+		if (j != first + npages)
+			continue;
+		for (j = first; j < first + npages; j++) {
+			page_t *page;
+
+			__page_alloc_specific(&page, j);
+		}
+		return first;
+	}
+	return -1;
+}
+
+/**
+ * @brief Allocated 2^order contiguous physical pages, aligned to their size,
+ * e.g. a 2MB run that a single jumbo PTE maps.  Get them from NUMA node node,
+ * if possible, otherwise from anywhere.
+ *
+ * These are individual pages, like get_cont_pages', so parts of the run can be
+ * freed on their own.
+ *
+ * @param[in] node which node to allocate from, or -1 for any.
+ * @param[in] order order of the allocation
+ * @param[in] flags memory allocation flags
+ *
+ * @return The KVA of the first page, NULL otherwise.
+ */
+void *get_aligned_cont_pages_node(int node, size_t order, int flags)
+{
+	long first = -1;
+
+	if (node >= nr_page_nodes)
+		node = -1;
+	do {
+		spin_lock_irqsave(&colored_page_free_list_lock);
+		if (node >= 0) {
+			first = __get_aligned_cont_pages(1 << order, node);
+			if (first != -1)
+				__account_node_alloc(node, node == page_local_node());
+		}
+		if (first == -1)
+			first = __get_aligned_cont_pages(1 << order, -1);
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+	} while (first == -1 && (page_pcpu_drain() || page_zero_drain() ||
+	                         ((flags & KMALLOC_WAIT) &&
+	                          reclaim_direct(1 << order))));
+	page_check_wmarks();
+	if (first == -1) {
+		if (flags & KMALLOC_ERROR)
+			error(ENOMEM, ERROR_FIXME);
+		return NULL;
+	}
+	return ppn2kva(first);
 }
 
 /**
@@ -280,6 +776,7 @@ void *get_cont_phys_pages_at(size_t order, physaddr_t at, int flags)
 void free_cont_pages(void *buf, size_t order)
 {
 	size_t npages = 1 << order;	
+	/* These go straight back to the node lists, not our per-core cache */
 	spin_lock_irqsave(&colored_page_free_list_lock);
 	for (size_t i = kva2ppn(buf); i < kva2ppn(buf) + npages; i++) {
 		page_t* page = ppn2page(i);
@@ -339,6 +836,15 @@ void page_incref(page_t *page)
  * refs. */
 void page_decref(page_t *page)
 {
+	/* If we hold the only ref, no one else can get one, so we can hand the page
+	 * to our core's cache without ever dropping the ref to 0. */
+	if (page_pcpu_ready && kref_refcnt(&page->pg_kref) == 1 &&
+	    page_numa_node(page) == page_local_node()) {
+		if (atomic_read(&page->pg_flags) & PG_BUFFER)
+			free_bhs(page);
+		page_pcpu_free(page);
+		return;
+	}
 	spin_lock_irqsave(&colored_page_free_list_lock);
 	__page_decref(page);
 	spin_unlock_irqsave(&colored_page_free_list_lock);
@@ -355,16 +861,86 @@ static void __page_decref(page_t *page)
 static void page_release(struct kref *kref)
 {
 	struct page *page = container_of(kref, struct page, pg_kref);
+	int node = page_numa_node(page);
 
 	if (atomic_read(&page->pg_flags) & PG_BUFFER)
 		free_bhs(page);
-	/* Give our page back to the free list.  The protections for this are that
-	 * the list lock is grabbed by page_decref. */
+	/* Give our page back to its node's free list.  The protections for this
+	 * are that the list lock is grabbed by page_decref. */
 	BSD_LIST_INSERT_HEAD(
-	   &(colored_page_free_list[get_page_color(page2ppn(page), llc_cache)]),
+	   &(node_free_lists(node)[get_page_color(page2ppn(page), llc_cache)]),
 	   page,
 	   pg_link
 	);
+	page_nodes[node].nr_free_pages++;
+}
+
+/* Splits the boot free lists into per-node lists.  Needs the SRAT (acpiinit)
+ * and the topology, so this runs well after page_alloc_init().  On machines
+ * with one node, this just counts the free pages. */
+void page_alloc_numa_init(void)
+{
+	int nr_nodes = MAX(num_numa_nodes, 1);
+	struct page_node *nodes = &boot_page_node;
+	struct page *page, *temp;
+	int node;
+
+	if (nr_nodes > 1) {
+		nodes = kzmalloc(nr_nodes * sizeof(struct page_node), 0);
+		assert(nodes);
+		for (int n = 1; n < nr_nodes; n++) {
+			nodes[n].free_lists = kmalloc(llc_cache->num_colors *
+			                              sizeof(page_list_t), 0);
+			assert(nodes[n].free_lists);
+			for (int i = 0; i < llc_cache->num_colors; i++)
+				BSD_LIST_INIT(&nodes[n].free_lists[i]);
+		}
+	}
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	nodes[0] = boot_page_node;
+	nodes[0].nr_free_pages = 0;
+	for (int i = 0; i < llc_cache->num_colors; i++) {
+		BSD_LIST_FOREACH_SAFE(page, &colored_page_free_list[i], pg_link,
+		                      temp) {
+			node = nr_nodes > 1 ? paddr_to_numa_id(page2pa(page)) : 0;
+			if (node) {
+				BSD_LIST_REMOVE(page, pg_link);
+				BSD_LIST_INSERT_HEAD(&nodes[node].free_lists[i], page,
+				                     pg_link);
+			}
+			nodes[node].nr_free_pages++;
+		}
+	}
+	for (int n = 0; n < nr_nodes; n++) {
+		nodes[n].nr_pages = nodes[n].nr_free_pages;
+		nodes[n].wmark_low = MAX(nodes[n].nr_pages >> PAGE_WMARK_LOW_SHIFT,
+		                         PAGE_WMARK_MIN_LOW);
+		nodes[n].wmark_high = nodes[n].wmark_low * 2;
+	}
+	page_nodes = nodes;
+	nr_page_nodes = nr_nodes;
+	page_zero_ready = TRUE;
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (nr_nodes > 1) {
+		for (int n = 0; n < nr_nodes; n++)
+			printk("NUMA node %d: %lu free pages\n", n,
+			       nodes[n].nr_free_pages);
+	}
+}
+
+void page_alloc_get_node_stats(int node, struct page_node_stats *stats)
+{
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	stats->nr_free_pages = page_nodes[node].nr_free_pages;
+	stats->nr_pages = page_nodes[node].nr_pages;
+	stats->wmark_low = page_nodes[node].wmark_low;
+	stats->wmark_high = page_nodes[node].wmark_high;
+	stats->nr_local_allocs = page_nodes[node].nr_local_allocs;
+	stats->nr_remote_allocs = page_nodes[node].nr_remote_allocs;
+	stats->nr_zero_pages = page_nodes[node].nr_zero_pages;
+	stats->nr_zero_hits = page_nodes[node].nr_zero_hits;
+	stats->nr_zero_misses = page_nodes[node].nr_zero_misses;
+	spin_unlock_irqsave(&colored_page_free_list_lock);
 }
 
 /* Helper when initializing a page - just to prevent the proliferation of
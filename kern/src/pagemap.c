@@ -9,9 +9,60 @@
 #include <atomic.h>
 #include <radix.h>
 #include <kref.h>
+#include <rendez.h>
+#include <kthread.h>
 #include <assert.h>
 #include <stdio.h>
 
+/* Dirty page writeback.  Dirty pages are tagged in their PM's tree, and PMs
+ * with dirty pages are on a global list.  A flusher ktask writes them back
+ * periodically, or sooner once more than PM_DIRTY_BG_RATIO percent of memory is
+ * dirty.  Writers that push it over PM_DIRTY_RATIO percent write back their own
+ * PM before returning.
+ *
+ * Lock ordering: pm_lock -> pm_dirty_lock. */
+#define PM_DIRTY_BG_RATIO		10
+#define PM_DIRTY_RATIO			20
+#define PM_FLUSH_PERIOD_USEC	5000000
+#define PM_WB_BATCH				32		/* pages per writepages call */
+
+static atomic_t nr_dirty_pages;
+static spinlock_t pm_dirty_lock = SPINLOCK_INITIALIZER;
+static struct page_map_tailq pm_dirty_list =
+                             TAILQ_HEAD_INITIALIZER(pm_dirty_list);
+static struct page_map *pm_flushing;	/* PM the flusher is working on */
+static struct rendez pm_flush_rv;
+
+/* Page cache reclaim.  Every PM is on pm_reclaim_list, and the reclaimer
+ * (reclaim.c) takes them round-robin.  Within a PM, it's CLOCK: the hand sweeps
+ * the tree from pm_reclaim_idx, and a slot's REMOVAL bit doubles as a 'not
+ * referenced' bit, since every lookup clears it.  The hand sets it on idle
+ * pages it passes.  Those that still have it when the hand comes back around
+ * weren't looked up in between, and get removed.  Pages that are only used
+ * through mmaps never get looked up, so they look idle and get unmapped; the
+ * next access soft faults them back in.
+ *
+ * Dirty pages are left for the flusher, and the next sweep gets them.  PMs
+ * whose pages only live in memory (KFS) or that manage their own pages (the
+ * mount cache) are pm_unevictable. */
+#define PM_RECLAIM_BATCH		32		/* pages per tree lookup */
+#define PM_RECLAIM_SCAN_RATIO	4		/* pages swept per page wanted */
+
+static spinlock_t pm_reclaim_lock = SPINLOCK_INITIALIZER;
+static struct page_map_tailq pm_reclaim_list =
+                             TAILQ_HEAD_INITIALIZER(pm_reclaim_list);
+static struct page_map *pm_reclaiming;	/* PM the reclaimer is sweeping */
+
+static unsigned long pm_dirty_bg_thresh(void)
+{
+	return max_nr_pages * PM_DIRTY_BG_RATIO / 100;
+}
+
+static unsigned long pm_dirty_thresh(void)
+{
+	return max_nr_pages * PM_DIRTY_RATIO / 100;
+}
+
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
 	/* note that the VMR being reverse-mapped by the PM is protected by the PM's
@@ -78,11 +129,15 @@ static void *pm_slot_dec_refcnt(void *slot_val)
 	return (void*)((unsigned long)slot_val - (1UL << PM_REFCNT_SHIFT));
 }
 
+/* Slots with flags or refs but no ppn (e.g. during insertion or removal) have
+ * no page.  We never alloc page 0. */
 static struct page *pm_slot_get_page(void *slot_val)
 {
-	if (!slot_val)
+	unsigned long ppn = (unsigned long)slot_val & ((1UL << PM_FLAGS_SHIFT) - 1);
+
+	if (!ppn)
 		return 0;
-	return ppn2page((unsigned long)slot_val & ((1UL << PM_FLAGS_SHIFT) - 1));
+	return ppn2page(ppn);
 }
 
 static void *pm_slot_set_page(void *slot_val, struct page *pg)
@@ -97,12 +152,19 @@ static void *pm_slot_set_page(void *slot_val, struct page *pg)
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 {
 	pm->pm_bdev = host;						/* note the uncounted ref */
-	radix_tree_init(&pm->pm_tree);
+	radix_tree_init_lockless(&pm->pm_tree);
 	pm->pm_num_pages = 0;					/* no pages in a new pm */
 	pm->pm_op = op;
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
 	atomic_set(&pm->pm_removal, 0);
+	pm->pm_nr_dirty = 0;
+	pm->pm_on_dirty_list = FALSE;
+	pm->pm_reclaim_idx = 0;
+	pm->pm_unevictable = FALSE;
+	spin_lock(&pm_reclaim_lock);
+	TAILQ_INSERT_TAIL(&pm_reclaim_list, pm, pm_reclaim_link);
+	spin_unlock(&pm_reclaim_lock);
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -112,9 +174,11 @@ static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 	void **tree_slot;
 	void *old_slot_val, *slot_val;
 	struct page *page = 0;
-	/* Read walking the PM tree TODO: (RCU) */
-	spin_lock(&pm->pm_lock);
-	/* We're syncing with removal.  The deal is that if we grab the page (and
+	/* Read walking the PM tree doesn't need the pm_lock: the tree never frees
+	 * its nodes, and pm_insert_page() doesn't publish a page in a slot until
+	 * the page's pg_tree_slot is set.
+	 *
+	 * We're syncing with removal.  The deal is that if we grab the page (and
 	 * we'd only do that if the page != 0), we up the slot ref and clear
 	 * removal.  A remover will only remove it if removal is still set.  If we
 	 * grab and release while removal is in progress, even though we no longer
@@ -135,7 +199,6 @@ static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 	} while (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val));
 	assert(page->pg_tree_slot == tree_slot);
 out:
-	spin_unlock(&pm->pm_lock);
 	return page;
 }
 
@@ -158,20 +221,20 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	spin_lock(&pm->pm_lock);
 	page->pg_mapping = pm;	/* debugging */
 	page->pg_index = index;
-	/* no one should be looking at the tree slot til we stop write locking.  the
-	 * only other one who looks is removal, who requires a PM write lock. */
-	page->pg_tree_slot = (void*)0xdeadbeef;	/* poison */
 	slot_val = pm_slot_inc_refcnt(slot_val);
-	/* passing the page ref from the caller to the slot */
-	slot_val = pm_slot_set_page(slot_val, page);
-	/* shouldn't need a CAS or anything for the slot write, since we hold the
-	 * write lock.  o/w, we'd need to get the slot and CAS instead of insert. */
+	/* Lockless lookups can see the slot as soon as we insert it, so we insert
+	 * it without a page (lookups treat it as empty), set the page's tree slot,
+	 * then publish the page.  Removal and other writers need the PM lock, so
+	 * there's no need to CAS. */
 	ret = radix_insert(&pm->pm_tree, index, slot_val, &tree_slot);
 	if (ret) {
 		spin_unlock(&pm->pm_lock);
 		return ret;
 	}
 	page->pg_tree_slot = tree_slot;
+	wmb();
+	/* passing the page ref from the caller to the slot */
+	ACCESS_ONCE(*tree_slot) = pm_slot_set_page(slot_val, page);
 	pm->pm_num_pages++;
 	spin_unlock(&pm->pm_lock);
 	return 0;
@@ -247,6 +310,23 @@ load_locked_page:
 	return 0;
 }
 
+/* Puts page, which the caller already filled, in the page map at index.  This
+ * is for page maps whose owners fill pages from data they already have, instead
+ * of with readpage.  On success, the page map takes the caller's page ref.
+ * Returns -EEXIST if there already is a page at index. */
+int pm_add_uptodate_page(struct page_map *pm, unsigned long index,
+                         struct page *page)
+{
+	int ret;
+
+	atomic_set(&page->pg_flags, PG_UPTODATE | PG_PAGEMAP);
+	page->pg_sem.nr_signals = 1;	/* unlocked */
+	ret = pm_insert_page(pm, index, page);
+	if (!ret)
+		pm_put_page(page);
+	return ret;
+}
+
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp)
 {
@@ -262,6 +342,221 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* Marks page dirty and tags it in pm.  Call with the pm_lock held. */
+static void __pm_page_dirty(struct page_map *pm, struct page *page)
+{
+	if (atomic_read(&page->pg_flags) & PG_DIRTY)
+		return;
+	atomic_or(&page->pg_flags, PG_DIRTY);
+	radix_tag_set(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+	pm->pm_nr_dirty++;
+	spin_lock(&pm_dirty_lock);
+	if (!pm->pm_on_dirty_list) {
+		TAILQ_INSERT_TAIL(&pm_dirty_list, pm, pm_dirty_link);
+		pm->pm_on_dirty_list = TRUE;
+	}
+	spin_unlock(&pm_dirty_lock);
+	if (atomic_fetch_and_add(&nr_dirty_pages, 1) + 1 > pm_dirty_bg_thresh())
+		rendez_wakeup(&pm_flush_rv);
+}
+
+/* Marks a page in a page map dirty, after its contents were changed.  The
+ * caller needs a PM slot ref on the page (e.g. from pm_load_page()). */
+void pm_page_dirty(struct page *page)
+{
+	struct page_map *pm = page->pg_mapping;
+
+	/* Writeback clears the flag before writing, so if it is still set, our
+	 * changes will be written. */
+	mb();
+	if (atomic_read(&page->pg_flags) & PG_DIRTY)
+		return;
+	spin_lock(&pm->pm_lock);
+	__pm_page_dirty(pm, page);
+	spin_unlock(&pm->pm_lock);
+}
+
+/* Clears page's dirty flag and tag, once someone has decided to write it back.
+ * Call with the pm_lock held. */
+static void __pm_page_clean(struct page_map *pm, struct page *page)
+{
+	if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
+		return;
+	atomic_and(&page->pg_flags, ~PG_DIRTY);
+	radix_tag_clear(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+	pm->pm_nr_dirty--;
+	atomic_dec(&nr_dirty_pages);
+}
+
+/* Gets a PM slot ref on a page we found in the tree while holding the pm_lock.
+ * Like pm_find_page(), this aborts a removal of the page. */
+static void __pm_get_page(struct page *page)
+{
+	void **tree_slot = page->pg_tree_slot;
+	void *old_slot_val, *slot_val;
+
+	do {
+		old_slot_val = ACCESS_ONCE(*tree_slot);
+		slot_val = pm_slot_clear_removal(old_slot_val);
+		slot_val = pm_slot_inc_refcnt(slot_val);
+	} while (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val));
+}
+
+/* Writes back pages that were cleaned with __pm_page_clean(), in one call to
+ * writepages if the PM has it.  Pages that fail are dirtied again. */
+static void pm_write_pages(struct page_map *pm, struct page **pages,
+                           unsigned int nr)
+{
+	int ret = 0;
+
+	if (pm->pm_op->writepages) {
+		ret = pm->pm_op->writepages(pm, pages, nr);
+	} else if (pm->pm_op->writepage) {
+		for (int i = 0; i < nr; i++)
+			ret |= pm->pm_op->writepage(pm, pages[i]);
+	} else {
+		return;
+	}
+	if (ret) {
+		warn_once("Writeback failed for PM %p (%d)", pm, ret);
+		for (int i = 0; i < nr; i++)
+			pm_page_dirty(pages[i]);
+	}
+}
+
+/* Writes back up to nr_pgs of pm's dirty pages, in index order and in batches
+ * of PM_WB_BATCH.  Returns the number of pages written.  This can block. */
+unsigned long pm_writeback(struct page_map *pm, unsigned long nr_pgs)
+{
+	void *slot_vals[PM_WB_BATCH];
+	struct page *pages[PM_WB_BATCH];
+	struct page *page;
+	unsigned long index = 0, nr_done = 0;
+	int nr_found, nr_batch;
+
+	if (!pm->pm_op || (!pm->pm_op->writepages && !pm->pm_op->writepage))
+		return 0;
+	while (nr_done < nr_pgs) {
+		nr_batch = 0;
+		spin_lock(&pm->pm_lock);
+		nr_found = radix_tag_gang_lookup(&pm->pm_tree, slot_vals, index,
+		                                 MIN(PM_WB_BATCH, nr_pgs - nr_done),
+		                                 PM_TAG_DIRTY);
+		for (int i = 0; i < nr_found; i++) {
+			page = pm_slot_get_page(slot_vals[i]);
+			if (!page)
+				continue;
+			index = page->pg_index + 1;
+			__pm_get_page(page);
+			__pm_page_clean(pm, page);
+			pages[nr_batch++] = page;
+		}
+		spin_unlock(&pm->pm_lock);
+		if (!nr_batch)
+			break;
+		pm_write_pages(pm, pages, nr_batch);
+		for (int i = 0; i < nr_batch; i++)
+			pm_put_page(pages[i]);
+		nr_done += nr_batch;
+	}
+	return nr_done;
+}
+
+/* Called by writers after dirtying pages of pm.  If too much of memory is
+ * dirty, the writer pays for it by writing back its own PM. */
+void pm_throttle_dirty(struct page_map *pm)
+{
+	if (atomic_read(&nr_dirty_pages) <= pm_dirty_thresh())
+		return;
+	rendez_wakeup(&pm_flush_rv);
+	pm_writeback(pm, ACCESS_ONCE(pm->pm_nr_dirty));
+}
+
+/* Takes pm off the flusher's and the reclaimer's lists and waits for them to be
+ * done with it.  Call before freeing pm's host.  Any pages still dirty are
+ * dropped from the accounting, since they go away with the PM. */
+void pm_writeback_detach(struct page_map *pm)
+{
+	spin_lock(&pm->pm_lock);
+	atomic_add(&nr_dirty_pages, -(long)pm->pm_nr_dirty);
+	pm->pm_nr_dirty = 0;
+	spin_unlock(&pm->pm_lock);
+	spin_lock(&pm_dirty_lock);
+	while (1) {
+		if (pm->pm_on_dirty_list) {
+			TAILQ_REMOVE(&pm_dirty_list, pm, pm_dirty_link);
+			pm->pm_on_dirty_list = FALSE;
+		}
+		if (pm_flushing != pm)
+			break;
+		spin_unlock(&pm_dirty_lock);
+		kthread_yield();
+		spin_lock(&pm_dirty_lock);
+	}
+	spin_unlock(&pm_dirty_lock);
+	spin_lock(&pm_reclaim_lock);
+	TAILQ_REMOVE(&pm_reclaim_list, pm, pm_reclaim_link);
+	while (pm_reclaiming == pm) {
+		spin_unlock(&pm_reclaim_lock);
+		kthread_yield();
+		spin_lock(&pm_reclaim_lock);
+	}
+	spin_unlock(&pm_reclaim_lock);
+}
+
+static int pm_flusher_should_run(void *unused)
+{
+	return atomic_read(&nr_dirty_pages) > pm_dirty_bg_thresh();
+}
+
+/* Each pass writes back the PMs that were on the dirty list when it started.
+ * PMs that get dirtied during the pass go back on the tail, and we'll get them
+ * next time. */
+static void pm_flusher_ktask(void *unused)
+{
+	struct page_map *pm;
+	unsigned long nr_pms;
+
+	while (1) {
+		rendez_sleep_timeout(&pm_flush_rv, pm_flusher_should_run, 0,
+		                     PM_FLUSH_PERIOD_USEC);
+		nr_pms = 0;
+		spin_lock(&pm_dirty_lock);
+		TAILQ_FOREACH(pm, &pm_dirty_list, pm_dirty_link)
+			nr_pms++;
+		spin_unlock(&pm_dirty_lock);
+		for (; nr_pms; nr_pms--) {
+			spin_lock(&pm_dirty_lock);
+			pm = TAILQ_FIRST(&pm_dirty_list);
+			if (!pm) {
+				spin_unlock(&pm_dirty_lock);
+				break;
+			}
+			TAILQ_REMOVE(&pm_dirty_list, pm, pm_dirty_link);
+			pm->pm_on_dirty_list = FALSE;
+			pm_flushing = pm;
+			spin_unlock(&pm_dirty_lock);
+			pm_writeback(pm, ACCESS_ONCE(pm->pm_nr_dirty));
+			spin_lock(&pm->pm_lock);
+			spin_lock(&pm_dirty_lock);
+			pm_flushing = 0;
+			/* we only wrote what was dirty when we started */
+			if (pm->pm_nr_dirty && !pm->pm_on_dirty_list) {
+				TAILQ_INSERT_TAIL(&pm_dirty_list, pm, pm_dirty_link);
+				pm->pm_on_dirty_list = TRUE;
+			}
+			spin_unlock(&pm_dirty_lock);
+			spin_unlock(&pm->pm_lock);
+		}
+	}
+}
+
+void pm_writeback_init(void)
+{
+	rendez_init(&pm_flush_rv);
+	ktask("pm_flusher", pm_flusher_ktask, 0);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -331,8 +626,9 @@ static int __pm_mark_dirty_pgs_unmap(struct proc *p, pte_t pte, void *va,
 	page = pa2page(pte_get_paddr(pte));
 	/* need to check for removal again, just like in mark_not_present */
 	if (atomic_read(&page->pg_flags) & PG_REMOVAL) {
+		/* our caller, pm_remove_contig(), holds the pm_lock */
 		if (pte_is_dirty(pte))
-			atomic_or(&page->pg_flags, PG_DIRTY);
+			__pm_page_dirty(page->pg_mapping, page);
 		pte_clear(pte);
 	}
 	return 0;
@@ -349,10 +645,10 @@ static int __pm_mark_unmap(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
-static void shootdown_and_reset_ptrstore(void *proc_ptrs[], int *arr_idx)
+static void flush_and_reset_tlbs(struct tlb_gather tlbs[], int *arr_idx)
 {
 	for (int i = 0; i < *arr_idx; i++)
-		proc_tlbshootdown((struct proc*)proc_ptrs[i], 0, 0);
+		tlb_gather_flush(&tlbs[i]);
 	*arr_idx = 0;
 }
 
@@ -368,10 +664,14 @@ int pm_remove_contig(struct page_map *pm, unsigned long index,
 	void *old_slot_val, *slot_val;
 	struct vm_region *vmr_i;
 	bool pm_has_pinned_vmrs = FALSE;
-	/* using this for both procs and later WBs */
 	#define PTR_ARR_LEN 10
+	/* batched shootdowns, one per proc */
+	struct tlb_gather tlbs[PTR_ARR_LEN];
+	int nr_tlbs = 0;
+	/* pages to WB */
 	void *ptr_store[PTR_ARR_LEN];
 	int ptr_free_idx = 0;
+	uintptr_t start_va, end_va;
 	struct page *page;
 	/* could also call a simpler remove if nr_pgs == 1 */
 	if (!nr_pgs)
@@ -466,23 +766,27 @@ next_loop_mark_rm:
 		 * soft-faulted back in. */
 		vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_not_present);
 		spin_unlock(&vmr_i->vm_proc->pte_lock);
-		/* batching TLB shootdowns for a given proc (continue if found).
-		 * the proc stays alive while we hold a read lock on the PM tree,
+		/* batching TLB shootdowns for a given proc, over the VAs this vmr
+		 * maps.  the proc stays alive while we hold a read lock on the PM tree,
 		 * since the VMR can't get yanked out yet. */
-		for (i = 0; i < ptr_free_idx; i++) {
-			if (ptr_store[i] == vmr_i->vm_proc)
+		start_va = (uintptr_t)vmr_idx_to_va(vmr_i, index);
+		end_va = MIN(vmr_i->vm_end, start_va + (nr_pgs << PGSHIFT));
+		for (i = 0; i < nr_tlbs; i++) {
+			if (tlbs[i].p == vmr_i->vm_proc)
 				break;
 		}
-		if (i != ptr_free_idx)
-			continue;
-		if (ptr_free_idx == PTR_ARR_LEN)
-			shootdown_and_reset_ptrstore(ptr_store, &ptr_free_idx);
-		ptr_store[ptr_free_idx++] = vmr_i->vm_proc;
+		if (i == nr_tlbs) {
+			if (nr_tlbs == PTR_ARR_LEN)
+				flush_and_reset_tlbs(tlbs, &nr_tlbs);
+			i = nr_tlbs++;
+			tlb_gather_init(&tlbs[i], vmr_i->vm_proc);
+		}
+		tlb_gather_add(&tlbs[i], start_va, end_va);
 	}
 	/* Need to shootdown so that all TLBs have the page marked absent.  Then we
 	 * can check the dirty bit, now that concurrent accesses will fault.  btw,
 	 * we have a lock ordering: pm (RCU) -> proc lock (state, vcmap, etc) */
-	shootdown_and_reset_ptrstore(ptr_store, &ptr_free_idx);
+	flush_and_reset_tlbs(tlbs, &nr_tlbs);
 	/* Now that we've shotdown, we can check for dirtiness.  One downside to
 	 * this approach is we check every VMR for a page, even once we know the
 	 * page is dirty.  We also need to unmap the pages (set ptes to 0) for any
@@ -533,15 +837,14 @@ handle_dirty:
 			ptr_store[ptr_free_idx++] = page;
 			/* once we've decided to WB, we can clear the dirty flag.  might
 			 * have an extra WB later, but we won't miss new data */
-			atomic_and(&page->pg_flags, ~PG_DIRTY);
+			__pm_page_clean(pm, page);
 		}
 	}
 	/* we're unlocking, meaning VMRs and the radix tree can be changed, but we
 	 * are still the only remover. still can have new refs that clear REMOVAL */
 	spin_unlock(&pm->pm_lock);
-	/* could batch these up, etc. */
-	for (int j = 0; j < ptr_free_idx; j++)
-		pm->pm_op->writepage(pm, (struct page*)ptr_store[j]);
+	if (ptr_free_idx)
+		pm_write_pages(pm, (struct page**)ptr_store, ptr_free_idx);
 	ptr_free_idx = 0;
 	spin_lock(&pm->pm_lock);
 	/* bailed out of the dirty check loop earlier, need to finish and WB.  i is
@@ -582,6 +885,10 @@ handle_dirty:
 		/* at this point, we're free at last!  When we update the radix tree, it
 		 * still thinks it has an item.  This is fine.  Lookups will now fail
 		 * (since the page is 0), and insertions will block on the write lock.*/
+		__pm_page_clean(pm, page);
+		/* let the owner clean up anything hanging off the page, like BHs */
+		if (pm->pm_op->releasepage)
+			pm->pm_op->releasepage(pm, page);
 		atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
 		page_decref(page);
 		nr_removed++;
@@ -593,11 +900,160 @@ handle_dirty:
 	return nr_removed;
 }
 
+/* Moves the clock hand over page, which is in the tree.  Returns TRUE if it was
+ * idle for a whole sweep and should be removed.  Call with the pm_lock held, so
+ * the page can't be removed and reused under us. */
+static bool pm_reclaim_age(struct page *page)
+{
+	void **tree_slot = page->pg_tree_slot;
+	void *old_slot_val, *slot_val;
+
+	old_slot_val = ACCESS_ONCE(*tree_slot);
+	if (pm_slot_get_page(old_slot_val) != page)
+		return FALSE;
+	if (pm_slot_check_refcnt(old_slot_val))
+		return FALSE;
+	if (pm_slot_check_removal(old_slot_val))
+		return !(atomic_read(&page->pg_flags) & (PG_DIRTY | PG_LOCKED));
+	/* If we lose the race, someone just used it */
+	slot_val = pm_slot_set_removal(old_slot_val);
+	atomic_cas_ptr(tree_slot, old_slot_val, slot_val);
+	return FALSE;
+}
+
+/* Sweeps pm's clock hand over up to nr_to_scan pages, removing the idle ones in
+ * runs of contiguous indexes.  Returns the number removed, and the number swept
+ * in *nr_swept. */
+static unsigned long pm_reclaim_sweep(struct page_map *pm,
+                                      unsigned long nr_to_scan,
+                                      unsigned long *nr_swept)
+{
+	void *slot_vals[PM_RECLAIM_BATCH];
+	unsigned long victims[PM_RECLAIM_BATCH];
+	struct page *page;
+	unsigned long index = pm->pm_reclaim_idx, start;
+	unsigned long nr_done = 0, nr_removed = 0;
+	int nr_found, nr_victims, run;
+	bool wrapped = FALSE;
+
+	while (nr_done < nr_to_scan) {
+		nr_victims = 0;
+		start = index;
+		spin_lock(&pm->pm_lock);
+		nr_found = radix_gang_lookup(&pm->pm_tree, slot_vals, index,
+		                             MIN(PM_RECLAIM_BATCH,
+		                                 nr_to_scan - nr_done));
+		for (int i = 0; i < nr_found; i++) {
+			page = pm_slot_get_page(slot_vals[i]);
+			if (!page)
+				continue;
+			index = page->pg_index + 1;
+			nr_done++;
+			if (pm_reclaim_age(page))
+				victims[nr_victims++] = page->pg_index;
+		}
+		spin_unlock(&pm->pm_lock);
+		if (!nr_found) {
+			/* the hand wraps around, once per call */
+			if (wrapped || !index)
+				break;
+			wrapped = TRUE;
+			index = 0;
+			continue;
+		}
+		/* only slots mid-removal, which have no page to tell us their index */
+		if (index == start)
+			break;
+		for (int i = 0; i < nr_victims; i += run) {
+			for (run = 1; i + run < nr_victims; run++) {
+				if (victims[i + run] != victims[i] + run)
+					break;
+			}
+			nr_removed += pm_remove_contig(pm, victims[i], run);
+		}
+	}
+	pm->pm_reclaim_idx = index;
+	*nr_swept = nr_done;
+	return nr_removed;
+}
+
+/* Tells reclaim that no one wants [index, index + nr_pgs) of pm for now.  The
+ * next sweep removes those pages, unless they get looked up first. */
+void pm_mark_idle(struct page_map *pm, unsigned long index,
+                  unsigned long nr_pgs)
+{
+	void *slot_vals[PM_RECLAIM_BATCH];
+	struct page *page;
+	unsigned long start, end = index + nr_pgs;
+	int nr_found;
+
+	while (index < end) {
+		start = index;
+		spin_lock(&pm->pm_lock);
+		nr_found = radix_gang_lookup(&pm->pm_tree, slot_vals, index,
+		                             MIN(PM_RECLAIM_BATCH, end - index));
+		for (int i = 0; i < nr_found; i++) {
+			page = pm_slot_get_page(slot_vals[i]);
+			if (!page)
+				continue;
+			index = page->pg_index + 1;
+			if (page->pg_index < end)
+				pm_reclaim_age(page);
+		}
+		spin_unlock(&pm->pm_lock);
+		/* done, or only slots mid-removal left */
+		if (!nr_found || index == start)
+			break;
+	}
+}
+
+/* Removes up to nr_pages idle, clean pages from the page cache, sweeping PMs
+ * in turn.  Returns the number removed, and adds the number swept to
+ * *nr_scanned.  Only the reclaimer calls this, one at a time.  This can
+ * block. */
+unsigned long pm_reclaim(unsigned long nr_pages, uint64_t *nr_scanned)
+{
+	struct page_map *pm;
+	unsigned long nr_pms = 0, nr_removed = 0, nr_swept;
+	unsigned long budget = nr_pages * PM_RECLAIM_SCAN_RATIO;
+
+	spin_lock(&pm_reclaim_lock);
+	TAILQ_FOREACH(pm, &pm_reclaim_list, pm_reclaim_link)
+		nr_pms++;
+	spin_unlock(&pm_reclaim_lock);
+	for (; nr_pms && budget && nr_removed < nr_pages; nr_pms--) {
+		spin_lock(&pm_reclaim_lock);
+		pm = TAILQ_FIRST(&pm_reclaim_list);
+		if (!pm) {
+			spin_unlock(&pm_reclaim_lock);
+			break;
+		}
+		/* the next PM goes first next time */
+		TAILQ_REMOVE(&pm_reclaim_list, pm, pm_reclaim_link);
+		TAILQ_INSERT_TAIL(&pm_reclaim_list, pm, pm_reclaim_link);
+		if (pm->pm_unevictable || !pm->pm_num_pages) {
+			spin_unlock(&pm_reclaim_lock);
+			continue;
+		}
+		pm_reclaiming = pm;
+		spin_unlock(&pm_reclaim_lock);
+		nr_removed += pm_reclaim_sweep(pm, MIN(budget, pm->pm_num_pages),
+		                               &nr_swept);
+		budget -= MIN(budget, nr_swept);
+		*nr_scanned += nr_swept;
+		spin_lock(&pm_reclaim_lock);
+		pm_reclaiming = 0;
+		spin_unlock(&pm_reclaim_lock);
+	}
+	return nr_removed;
+}
+
 void print_page_map_info(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
 	printk("Page Map %p\n", pm);
 	printk("\tNum pages: %lu\n", pm->pm_num_pages);
+	printk("\tNum dirty: %lu\n", pm->pm_nr_dirty);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
 		printk("\tVMR proc %d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n",
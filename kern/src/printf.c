@@ -9,9 +9,65 @@
 #include <stdarg.h>
 #include <smp.h>
 #include <kprof.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <string.h>
+#include <time.h>
 
 spinlock_t output_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
+/* Everything that made it to the console, for #cons/printk.  Only written with
+ * output_lock held.  hist_end is the total number of bytes ever written, which
+ * is also the file offset of the end of the log. */
+#define PRINTK_HIST_SZ		(1 << 18)
+static char printk_hist[PRINTK_HIST_SZ];
+static uint64_t printk_hist_end;
+
+static void printk_hist_put(const char *buf, size_t len)
+{
+	size_t idx, amt;
+
+	while (len) {
+		idx = printk_hist_end % PRINTK_HIST_SZ;
+		amt = MIN(len, PRINTK_HIST_SZ - idx);
+		memcpy(printk_hist + idx, buf, amt);
+		buf += amt;
+		len -= amt;
+		printk_hist_end += amt;
+	}
+}
+
+/* This is unlocked, so that readers never hold up printers.  If the log wraps
+ * while we copy, the reader will see a slurred buffer.  Reads from offsets that
+ * have already been overwritten start at the oldest byte we still have. */
+size_t printk_hist_read(void *va, size_t n, uint64_t off)
+{
+	uint64_t end = ACCESS_ONCE(printk_hist_end);
+	uint64_t start = end > PRINTK_HIST_SZ ? end - PRINTK_HIST_SZ : 0;
+	size_t idx, amt, copied = 0;
+
+	if (off < start)
+		off = start;
+	if (off >= end)
+		return 0;
+	n = MIN(n, end - off);
+	while (copied < n) {
+		idx = (off + copied) % PRINTK_HIST_SZ;
+		amt = MIN(n - copied, PRINTK_HIST_SZ - idx);
+		memcpy(va + copied, printk_hist + idx, amt);
+		copied += amt;
+	}
+	return n;
+}
+
+/* Writes to the console and the history. */
+static void printk_output(const char *buf, int len)
+{
+	cputbuf(buf, len);
+	printk_hist_put(buf, len);
+}
+
 void putch(int ch, int **cnt)
 {
 	cputchar(ch);
@@ -35,11 +91,205 @@ void buffered_putch(int ch, int **cnt)
 
 	if(ch == -1 || buflen == buffered_putch_bufsize)
 	{
-		cputbuf(buf,buflen);
+		printk_output(buf, buflen);
 		buflen = 0;
 	}
 }
 
+#ifdef CONFIG_PRINTK_BUFFERED
+
+/* Per-core printk rings.  Each core writes whole messages into its own ring,
+ * with IRQs disabled, and never takes a lock.  A ktask drains the rings to the
+ * console, oldest message first across all cores.  If a ring is full, the
+ * message is dropped and counted.
+ *
+ * Each message is a printk_rec header, followed by len bytes of text.  prod and
+ * cons are byte counts; only the owning core moves prod, and only a flusher
+ * (with printk_flush_lock) moves cons. */
+#define PRINTK_RING_SZ		(1 << 14)
+#define PRINTK_LINE_SZ		256
+#define PRINTK_FLUSH_USEC	10000
+
+struct printk_rec {
+	uint64_t tsc;
+	uint32_t len;
+};
+
+struct printk_ring {
+	uint64_t prod;
+	uint64_t cons;
+	unsigned long nr_dropped;
+	unsigned long nr_reported;
+	char buf[PRINTK_RING_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct printk_ring *printk_rings;
+static bool printk_buffered;
+static spinlock_t printk_flush_lock = SPINLOCK_INITIALIZER;
+static struct rendez printk_rv;
+static atomic_t printk_kicked;
+
+static void ring_copy_in(struct printk_ring *pr, uint64_t pos, const void *src,
+                         size_t len)
+{
+	size_t idx = pos % PRINTK_RING_SZ;
+	size_t amt = MIN(len, PRINTK_RING_SZ - idx);
+
+	memcpy(pr->buf + idx, src, amt);
+	memcpy(pr->buf, src + amt, len - amt);
+}
+
+static void ring_copy_out(struct printk_ring *pr, uint64_t pos, void *dst,
+                          size_t len)
+{
+	size_t idx = pos % PRINTK_RING_SZ;
+	size_t amt = MIN(len, PRINTK_RING_SZ - idx);
+
+	memcpy(dst, pr->buf + idx, amt);
+	memcpy(dst + amt, pr->buf, len - amt);
+}
+
+/* Returns the number of chars printed, or -1 if the caller should print it
+ * synchronously. */
+static int printk_ring_vprintf(const char *fmt, va_list ap)
+{
+	struct printk_ring *pr;
+	struct printk_rec rec;
+	char buf[PRINTK_LINE_SZ];
+	int8_t irq_state = 0;
+	uint64_t used;
+	va_list args;
+	int len;
+
+	va_copy(args, ap);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len >= sizeof(buf))
+		return -1;
+	disable_irqsave(&irq_state);
+	pr = &printk_rings[core_id()];
+	used = pr->prod - ACCESS_ONCE(pr->cons);
+	if (used + sizeof(rec) + len > PRINTK_RING_SZ) {
+		pr->nr_dropped++;
+	} else {
+		rec.tsc = read_tsc();
+		rec.len = len;
+		ring_copy_in(pr, pr->prod, &rec, sizeof(rec));
+		ring_copy_in(pr, pr->prod + sizeof(rec), buf, len);
+		wmb();	/* the message is in the ring before we publish it */
+		pr->prod += sizeof(rec) + len;
+		used += sizeof(rec) + len;
+	}
+	enable_irqsave(&irq_state);
+	/* Don't wait for the timeout if we're filling up.  The wakeup grabs locks,
+	 * so we skip it if we might be printing while holding an irqsave lock. */
+	if ((used > PRINTK_RING_SZ / 2) && irq_is_enabled() &&
+	    !atomic_swap(&printk_kicked, 1))
+		rendez_wakeup(&printk_rv);
+	return len;
+}
+
+/* Prints every message in the rings, in TSC order.  Caller holds
+ * printk_flush_lock. */
+static void __printk_flush_rings(void)
+{
+	static char buf[PRINTK_LINE_SZ];
+	struct printk_ring *pr, *oldest;
+	struct printk_rec rec, oldest_rec;
+	char note[64];
+	int len;
+
+	while (1) {
+		oldest = NULL;
+		for (int i = 0; i < num_cores; i++) {
+			pr = &printk_rings[i];
+			if (pr->cons == ACCESS_ONCE(pr->prod))
+				continue;
+			rmb();	/* see the message after seeing prod */
+			ring_copy_out(pr, pr->cons, &rec, sizeof(rec));
+			if (!oldest || (rec.tsc < oldest_rec.tsc)) {
+				oldest = pr;
+				oldest_rec = rec;
+			}
+		}
+		if (!oldest)
+			break;
+		ring_copy_out(oldest, oldest->cons + sizeof(rec), buf, oldest_rec.len);
+		wmb();	/* done reading before the producer can reuse the space */
+		oldest->cons += sizeof(rec) + oldest_rec.len;
+		spin_lock_irqsave(&output_lock);
+		printk_output(buf, oldest_rec.len);
+		spin_unlock_irqsave(&output_lock);
+	}
+	for (int i = 0; i < num_cores; i++) {
+		pr = &printk_rings[i];
+		if (pr->nr_reported == ACCESS_ONCE(pr->nr_dropped))
+			continue;
+		len = snprintf(note, sizeof(note),
+		               "[printk: core %d dropped %lu messages]\n", i,
+		               pr->nr_dropped - pr->nr_reported);
+		pr->nr_reported += pr->nr_dropped - pr->nr_reported;
+		spin_lock_irqsave(&output_lock);
+		printk_output(note, len);
+		spin_unlock_irqsave(&output_lock);
+	}
+}
+
+static int printk_should_flush(void *arg)
+{
+	return atomic_read(&printk_kicked);
+}
+
+static void __printk_flusher(void *arg)
+{
+	while (1) {
+		rendez_sleep_timeout(&printk_rv, printk_should_flush, NULL,
+		                     PRINTK_FLUSH_USEC);
+		atomic_set(&printk_kicked, 0);
+		spin_lock(&printk_flush_lock);
+		__printk_flush_rings();
+		spin_unlock(&printk_flush_lock);
+	}
+}
+
+/* Called once we're done booting, so core_id() works and num_cores is set. */
+void printk_buffer_init(void)
+{
+	printk_rings = kzmalloc(sizeof(struct printk_ring) * num_cores,
+	                        KMALLOC_WAIT);
+	rendez_init(&printk_rv);
+	atomic_init(&printk_kicked, 0);
+	ktask("printk_flush", __printk_flusher, NULL);
+	wmb();	/* the rings are ready before anyone uses them */
+	printk_buffered = TRUE;
+}
+
+/* Turns off buffering and prints whatever is in the rings, for panic and the
+ * like.  If a flusher is already running (maybe it's us, crashing), we don't
+ * wait for it, and the rest of the rings are lost. */
+void printk_sync(void)
+{
+	if (!printk_buffered)
+		return;
+	printk_buffered = FALSE;
+	if (!spin_trylock(&printk_flush_lock))
+		return;
+	__printk_flush_rings();
+	spin_unlock(&printk_flush_lock);
+}
+
+#else
+
+void printk_buffer_init(void)
+{
+}
+
+void printk_sync(void)
+{
+}
+
+#endif /* CONFIG_PRINTK_BUFFERED */
+
 int vcprintf(const char *fmt, va_list ap)
 {
 	struct per_cpu_info *pcpui;
@@ -61,6 +311,16 @@ int vcprintf(const char *fmt, va_list ap)
 		pcpui = &per_cpu_info[0];
 	else
 		pcpui = &per_cpu_info[core_id()];
+#ifdef CONFIG_PRINTK_BUFFERED
+	/* Faults and the like print synchronously, since we might not be around
+	 * to see them flushed. */
+	if (printk_buffered && !ktrap_depth(pcpui)) {
+		cnt = printk_ring_vprintf(fmt, ap);
+		if (cnt >= 0)
+			return cnt;
+		cnt = 0;
+	}
+#endif /* CONFIG_PRINTK_BUFFERED */
 	/* lock all output.  this will catch any printfs at line granularity.  when
 	 * tracing, we short-circuit the main lock call, so as not to clobber the
 	 * results as we print. */
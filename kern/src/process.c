@@ -8,6 +8,7 @@
 #include <process.h>
 #include <atomic.h>
 #include <smp.h>
+#include <percpu.h>
 #include <pmap.h>
 #include <trap.h>
 #include <umem.h>
@@ -16,7 +17,6 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
-#include <hashtable.h>
 #include <slab.h>
 #include <sys/queue.h>
 #include <frontend.h>
@@ -25,6 +25,8 @@
 #include <arsc_server.h>
 #include <devfs.h>
 #include <kmalloc.h>
+#include <kmem_acct.h>
+#include <rendez.h>
 
 struct kmem_cache *proc_cache;
 
@@ -37,45 +39,169 @@ static void __proc_free(struct kref *kref);
 static bool scp_is_vcctx_ready(struct preempt_data *vcpd);
 static void save_vc_fp_state(struct preempt_data *vcpd);
 static void restore_vc_fp_state(struct preempt_data *vcpd);
+static void __proc_donate_core(struct proc *p, struct proc *target,
+                               uint32_t pcoreid, struct event_msg *msg);
 
 /* PID management. */
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
 static DECL_BITMASK(pid_bmask, PID_MAX + 1);
 spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
+/* Chained hash of procs, by pid.  Writers hold the pid_hash_lock.  Readers
+ * (pid2proc) walk the chains under RCU, so procs are freed after a grace
+ * period. */
+#define PID_HASH_SZ 256
+static struct proc *pid_hash[PID_HASH_SZ];
 spinlock_t pid_hash_lock; // initialized in proc_init
 
-/* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
- * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
- * you'll also see a warning, for now).  Consider doing this with atomics. */
-static pid_t get_free_pid(void)
+/* Procs whose last ref is gone, waiting for the reaper ktask to free their
+ * address space.  __proc_free() can run anywhere, and tearing down a big
+ * process takes a while. */
+static struct proc_list proc_reap_list = TAILQ_HEAD_INITIALIZER(proc_reap_list);
+static spinlock_t proc_reap_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct rendez proc_reap_rv;
+static void proc_reaper_ktask(void *unused);
+
+static struct proc **pid_hash_bucket(pid_t pid)
+{
+	return &pid_hash[pid % PID_HASH_SZ];
+}
+
+static void __pid_hash_insert(struct proc *p)
+{
+	struct proc **bucket = pid_hash_bucket(p->pid);
+
+	p->pid_hash_next = *bucket;
+	rcu_assign_pointer(*bucket, p);
+}
+
+/* Returns TRUE if p was in the hash.  p's pid_hash_next is left alone, for any
+ * readers still on p. */
+static bool __pid_hash_remove(struct proc *p)
+{
+	struct proc **pp;
+
+	for (pp = pid_hash_bucket(p->pid); *pp; pp = &(*pp)->pid_hash_next) {
+		if (*pp == p) {
+			ACCESS_ONCE(*pp) = p->pid_hash_next;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Calls func on every proc in the hash.  Hold the pid_hash_lock. */
+void __pid_hash_for_each(void (*func)(void *item, void *opaque), void *opaque)
+{
+	struct proc *p;
+
+	for (int i = 0; i < PID_HASH_SZ; i++)
+		for (p = pid_hash[i]; p; p = p->pid_hash_next)
+			func(p, opaque);
+}
+
+/* Each core caches a batch of free PIDs, so process creation doesn't take the
+ * pid_bmask_lock every time.  Freed PIDs are also batched per core before we
+ * clear their bits.  We don't hand freed PIDs straight back out: they go back
+ * to the bitmask, which we scan circularly, so a PID isn't reused soon after
+ * its process exits. */
+#define PID_PCPU_BATCH				16
+
+struct pid_pcpu_cache {
+	pid_t						free[PID_PCPU_BATCH];
+	unsigned int				nr_free;
+	pid_t						dead[PID_PCPU_BATCH];
+	unsigned int				nr_dead;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static DEFINE_PERCPU(struct pid_pcpu_cache, pid_pcpu_caches);
+static bool pid_pcpu_ready;
+
+static void pid_pcpu_init(void)
+{
+	for (int i = 0; i < num_cores; i++) {
+		struct pid_pcpu_cache *ppc = _PERCPU_VARPTR(pid_pcpu_caches, i);
+
+		ppc->nr_free = 0;
+		ppc->nr_dead = 0;
+	}
+	pid_pcpu_ready = TRUE;
+}
+DEFINE_PERCPU_INIT(pid_pcpu_init);
+
+/* Finds up to nr free entries (zero) in the pid_bitmask, marks them busy, and
+ * puts them in pids.  Set means busy.  PID 0 is reserved (in proc_init).
+ * Returns how many we found. */
+static unsigned int get_free_pids(pid_t *pids, unsigned int nr)
 {
 	static pid_t next_free_pid = 1;
-	pid_t my_pid = 0;
+	unsigned int found = 0;
 
 	spin_lock(&pid_bmask_lock);
-	// atomically (can lock for now, then change to atomic_and_return
 	FOR_CIRC_BUFFER(next_free_pid, PID_MAX + 1, i) {
 		// always points to the next to test
 		next_free_pid = (next_free_pid + 1) % (PID_MAX + 1);
 		if (!GET_BITMASK_BIT(pid_bmask, i)) {
 			SET_BITMASK_BIT(pid_bmask, i);
-			my_pid = i;
-			break;
+			pids[found++] = i;
+			if (found == nr)
+				break;
 		}
 	}
 	spin_unlock(&pid_bmask_lock);
+	return found;
+}
+
+/* Returns pids to the pid bitmask */
+static void put_free_pids(pid_t *pids, unsigned int nr)
+{
+	spin_lock(&pid_bmask_lock);
+	for (int i = 0; i < nr; i++)
+		CLR_BITMASK_BIT(pid_bmask, pids[i]);
+	spin_unlock(&pid_bmask_lock);
+}
+
+/* Returns a free PID, preferably from this core's cache.  A return value of 0
+ * is a failure (and you'll also see a warning, for now). */
+static pid_t get_free_pid(void)
+{
+	struct pid_pcpu_cache *ppc;
+	pid_t my_pid = 0;
+	int8_t irq_state = 0;
+
+	if (!pid_pcpu_ready) {
+		get_free_pids(&my_pid, 1);
+	} else {
+		disable_irqsave(&irq_state);
+		ppc = PERCPU_VARPTR(pid_pcpu_caches);
+		if (!ppc->nr_free)
+			ppc->nr_free = get_free_pids(ppc->free, PID_PCPU_BATCH);
+		if (ppc->nr_free)
+			my_pid = ppc->free[--ppc->nr_free];
+		enable_irqsave(&irq_state);
+	}
 	if (!my_pid)
 		warn("Shazbot!  Unable to find a PID!  You need to deal with this!\n");
 	return my_pid;
 }
 
-/* Return a pid to the pid bitmask */
+/* Return a pid to the pid bitmask, eventually */
 static void put_free_pid(pid_t pid)
 {
-	spin_lock(&pid_bmask_lock);
-	CLR_BITMASK_BIT(pid_bmask, pid);
-	spin_unlock(&pid_bmask_lock);
+	struct pid_pcpu_cache *ppc;
+	int8_t irq_state = 0;
+
+	if (!pid_pcpu_ready) {
+		put_free_pids(&pid, 1);
+		return;
+	}
+	disable_irqsave(&irq_state);
+	ppc = PERCPU_VARPTR(pid_pcpu_caches);
+	ppc->dead[ppc->nr_dead++] = pid;
+	if (ppc->nr_dead == PID_PCPU_BATCH) {
+		put_free_pids(ppc->dead, ppc->nr_dead);
+		ppc->nr_dead = 0;
+	}
+	enable_irqsave(&irq_state);
 }
 
 /* 'resume' is the time int ticks of the most recent onlining.  'total' is the
@@ -104,6 +230,18 @@ uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid)
 	return vc->total_ticks;
 }
 
+/* Returns the stats of p's vcore on the calling core, or 0 if p isn't running
+ * here.  Work done for p elsewhere (e.g. a kthread on another core) isn't
+ * counted. */
+struct vcore_stats *cur_vcore_stats(struct proc *p)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (pcpui->owning_proc != p)
+		return 0;
+	return &p->vc_stats[pcpui->owning_vcoreid];
+}
+
 /* While this could be done with just an assignment, this gives us the
  * opportunity to check for bad transitions.  Might compile these out later, so
  * we shouldn't rely on them for sanity checking from userspace.  */
@@ -173,18 +311,23 @@ int __proc_set_state(struct proc *p, uint32_t state)
 
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).  RCU
+ * protects us from getting p, (someone else removes and frees p), then
+ * get_not_zero() on p: __proc_free() frees p after a grace period. */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
-	if (p)
+	struct proc *p;
+
+	rcu_read_lock();
+	for (p = rcu_dereference(*pid_hash_bucket(pid)); p;
+	     p = rcu_dereference(p->pid_hash_next)) {
+		if (p->pid != pid)
+			continue;
 		if (!kref_get_not_zero(&p->p_kref, 1))
 			p = 0;
-	spin_unlock(&pid_hash_lock);
+		break;
+	}
+	rcu_read_unlock();
 	return p;
 }
 
@@ -193,43 +336,29 @@ struct proc *pid2proc(pid_t pid)
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
  * process is dying and we should not have the ref (and thus return 0).  We need
  * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * then get_not_zero() on p. */
 struct proc *pid_nth(unsigned int n)
 {
 	struct proc *p;
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_count(pid_hash)) {
-		spin_unlock(&pid_hash_lock);
-		return NULL;
-	}
-	struct hashtable_itr *iter = hashtable_iterator(pid_hash);
-	p = hashtable_iterator_value(iter);
-
-	while (p) {
-		/* if this process is not valid, it doesn't count,
-		 * so continue
-		 */
 
-		if (kref_get_not_zero(&p->p_kref, 1)) {
+	spin_lock(&pid_hash_lock);
+	for (int i = 0; i < PID_HASH_SZ; i++) {
+		for (p = pid_hash[i]; p; p = p->pid_hash_next) {
+			/* if this process is not valid, it doesn't count, so continue */
+			if (!kref_get_not_zero(&p->p_kref, 1))
+				continue;
 			/* this one counts */
-			if (! n){
+			if (!n) {
 				printd("pid_nth: at end, p %p\n", p);
-				break;
+				spin_unlock(&pid_hash_lock);
+				return p;
 			}
 			kref_put(&p->p_kref);
 			n--;
 		}
-		if (!hashtable_iterator_advance(iter)) {
-			p = NULL;
-			break;
-		}
-		p = hashtable_iterator_value(iter);
 	}
-
 	spin_unlock(&pid_hash_lock);
-	kfree(iter);
-	return p;
+	return NULL;
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -244,12 +373,11 @@ void proc_init(void)
 	/* Init PID mask and hash.  pid 0 is reserved. */
 	SET_BITMASK_BIT(pid_bmask, 0);
 	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
+	rendez_init(&proc_reap_rv);
+	ktask("proc_reaper", proc_reaper_ktask, 0);
 }
 
 void proc_set_progname(struct proc *p, char *name)
@@ -330,6 +458,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 		kmem_cache_free(proc_cache, p);
 		return -ENOFREEPID;
 	}
+	kmem_acct_proc_init(p);
 	if (parent && parent->binary_path)
 		kstrdup(&p->binary_path, parent->binary_path);
 	/* Set the basic status variables. */
@@ -353,6 +482,8 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	spinlock_init(&p->vmr_lock);
 	spinlock_init(&p->pte_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	RB_INIT(&p->vm_tree);
+	p->vmr_hint = 0;
 	p->vmr_history = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before initing
@@ -363,6 +494,8 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	/* Init procinfo/procdata.  Procinfo's argp/argb are 0'd */
 	proc_init_procinfo(p);
 	proc_init_procdata(p);
+	p->vc_stats = kzmalloc(sizeof(struct vcore_stats) *
+	                       p->procinfo->max_vcores, KMALLOC_WAIT);
 
 	/* Initialize the generic sysevent ring buffer */
 	SHARED_RING_INIT(&p->procdata->syseventring);
@@ -388,7 +521,8 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	p->open_files.open_fds = (struct fd_set*)&p->open_files.open_fds_init;
 	if (parent) {
 		if (flags & PROC_DUP_FGRP)
-			clone_fdt(&parent->open_files, &p->open_files);
+			clone_fdt(&parent->open_files, &p->open_files,
+			          flags & PROC_SPAWN ? TRUE : FALSE);
 	} else {
 		/* no parent, we're created from the kernel */
 		int fd;
@@ -399,9 +533,6 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 		fd = insert_file(&p->open_files, dev_stderr, 2, TRUE, FALSE);
 		assert(fd == 2);
 	}
-	/* Init the ucq hash lock */
-	p->ucq_hashlock = (struct hashlock*)&p->ucq_hl_noref;
-	hashlock_init_irqsave(p->ucq_hashlock, HASHLOCK_DEFAULT_SZ);
 
 	atomic_inc(&num_envs);
 	frontend_proc_init(p);
@@ -427,7 +558,7 @@ void __proc_ready(struct proc *p)
 	 * doing stuff to us before we're added to the pid_hash? */
 	__sched_proc_register(p);
 	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
+	__pid_hash_insert(p);
 	spin_unlock(&pid_hash_lock);
 }
 
@@ -453,14 +584,74 @@ static int __cb_assert_no_pg(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
+static void __proc_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(proc_cache, container_of(head, struct proc, p_rcu));
+}
+
+/* Frees p's memory: its address space, page tables, and other allocations,
+ * then the struct proc itself.  Only the reaper calls this, since it can take
+ * a while and yields between chunks of the address space. */
+static void __proc_reap(struct proc *p)
+{
+	/* now we'll finally decref files for the file-backed vmrs */
+	unmap_and_destroy_vmrs(p);
+	frontend_proc_free(p);	/* TODO: please remove me one day */
+	/* Free any colors allocated to this process */
+	if (p->cache_colors_map != global_cache_colors_map) {
+		for(int i = 0; i < llc_cache->num_colors; i++)
+			cache_color_free(llc_cache, p->cache_colors_map);
+		cache_colors_map_free(p->cache_colors_map);
+	}
+	/* all memory below UMAPTOP should have been freed via the VMRs.  the stuff
+	 * above is the global page and procinfo/procdata */
+	env_user_mem_free(p, (void*)UMAPTOP, UVPT - UMAPTOP); /* 3rd arg = len... */
+	env_user_mem_walk(p, 0, UMAPTOP, __cb_assert_no_pg, 0);
+	/* These need to be freed again, since they were allocated with a refcnt. */
+	free_cont_pages(p->procinfo, LOG2_UP(PROCINFO_NUM_PAGES));
+	free_cont_pages(p->procdata, LOG2_UP(PROCDATA_NUM_PAGES));
+	kfree(p->vc_stats);
+	/* No core has these loaded anymore; they all abandoned us */
+	kfree(p->perf);
+	__arch_proc_free(p);
+	kmem_acct_proc_free(p);
+
+	env_pagetable_free(p);
+	arch_pgdir_clear(&p->env_pgdir);
+	p->env_cr3 = 0;
+
+	atomic_dec(&num_envs);
+
+	/* Dealloc the struct proc, once pid2proc() can't be looking at it */
+	call_rcu(&p->p_rcu, __proc_free_rcu);
+}
+
+static int proc_reap_should_run(void *unused)
+{
+	return !TAILQ_EMPTY(&proc_reap_list);
+}
+
+static void proc_reaper_ktask(void *unused)
+{
+	struct proc *p;
+
+	while (1) {
+		rendez_sleep(&proc_reap_rv, proc_reap_should_run, 0);
+		spin_lock_irqsave(&proc_reap_lock);
+		p = TAILQ_FIRST(&proc_reap_list);
+		TAILQ_REMOVE(&proc_reap_list, p, reap_link);
+		spin_unlock_irqsave(&proc_reap_lock);
+		__proc_reap(p);
+	}
+}
+
 /* This is called by kref_put(), once the last reference to the process is
- * gone.  Don't call this otherwise (it will panic).  It will clean up the
- * address space and deallocate any other used memory. */
+ * gone.  Don't call this otherwise (it will panic).  It drops p's references
+ * and PID, then hands p to the reaper to free its memory in the background. */
 static void __proc_free(struct kref *kref)
 {
 	struct proc *p = container_of(kref, struct proc, p_kref);
-	void *hash_ret;
-	physaddr_t pa;
+	bool in_hash;
 
 	printd("[PID %d] freeing proc: %d\n", current ? current->pid : 0, p->pid);
 	// All parts of the kernel should have decref'd before __proc_free is called
@@ -479,41 +670,29 @@ static void __proc_free(struct kref *kref)
 	p->dot = p->slash = 0; /* catch bugs */
 	kref_put(&p->fs_env.root->d_kref);
 	kref_put(&p->fs_env.pwd->d_kref);
-	/* now we'll finally decref files for the file-backed vmrs */
-	unmap_and_destroy_vmrs(p);
-	frontend_proc_free(p);	/* TODO: please remove me one day */
-	/* Free any colors allocated to this process */
-	if (p->cache_colors_map != global_cache_colors_map) {
-		for(int i = 0; i < llc_cache->num_colors; i++)
-			cache_color_free(llc_cache, p->cache_colors_map);
-		cache_colors_map_free(p->cache_colors_map);
-	}
-	/* Remove us from the pid_hash and give our PID back (in that order). */
+	/* Remove us from the pid_hash and give our PID back (in that order).  The
+	 * reaper still has p, but no one can find it anymore. */
 	spin_lock(&pid_hash_lock);
-	hash_ret = hashtable_remove(pid_hash, (void*)(long)p->pid);
+	in_hash = __pid_hash_remove(p);
 	spin_unlock(&pid_hash_lock);
 	/* might not be in the hash/ready, if we failed during proc creation */
-	if (hash_ret)
+	if (in_hash)
 		put_free_pid(p->pid);
 	else
 		printd("[kernel] pid %d not in the PID hash in %s\n", p->pid,
 		       __FUNCTION__);
-	/* all memory below UMAPTOP should have been freed via the VMRs.  the stuff
-	 * above is the global page and procinfo/procdata */
-	env_user_mem_free(p, (void*)UMAPTOP, UVPT - UMAPTOP); /* 3rd arg = len... */
-	env_user_mem_walk(p, 0, UMAPTOP, __cb_assert_no_pg, 0);
-	/* These need to be freed again, since they were allocated with a refcnt. */
-	free_cont_pages(p->procinfo, LOG2_UP(PROCINFO_NUM_PAGES));
-	free_cont_pages(p->procdata, LOG2_UP(PROCDATA_NUM_PAGES));
-
-	env_pagetable_free(p);
-	arch_pgdir_clear(&p->env_pgdir);
-	p->env_cr3 = 0;
+	spin_lock_irqsave(&proc_reap_lock);
+	TAILQ_INSERT_TAIL(&proc_reap_list, p, reap_link);
+	spin_unlock_irqsave(&proc_reap_lock);
+	rendez_wakeup(&proc_reap_rv);
+}
 
-	atomic_dec(&num_envs);
+static void __proc_close_files(void *arg)
+{
+	struct proc *p = (struct proc*)arg;
 
-	/* Dealloc the struct proc */
-	kmem_cache_free(proc_cache, p);
+	close_fdt(&p->open_files, FALSE);
+	proc_decref(p);
 }
 
 /* Whether or not actor can control target.  TODO: do something reasonable here.
@@ -687,6 +866,8 @@ static void __send_bulkp_events(struct proc *p)
 void __proc_run_m(struct proc *p)
 {
 	struct vcore *vc_i;
+	uint32_t ipi_dsts[p->procinfo->num_vcores];
+	uint32_t nr_ipis = 0;
 	switch (p->state) {
 		case (PROC_WAITING):
 		case (PROC_DYING):
@@ -704,13 +885,16 @@ void __proc_run_m(struct proc *p)
 				proc_incref(p, p->procinfo->num_vcores * 2);
 				/* Send kernel messages to all online vcores (which were added
 				 * to the list and mapped in __proc_give_cores()), making them
-				 * turn online */
+				 * turn online.  Queue them all, then IPI in bulk. */
 				TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-					send_kernel_message(vc_i->pcoreid, __startcore, (long)p,
-					                    (long)vcore2vcoreid(p, vc_i),
-					                    (long)vc_i->nr_preempts_sent,
-					                    KMSG_ROUTINE);
+					if (send_kernel_message_noipi(vc_i->pcoreid, __startcore,
+					                              (long)p,
+					                              (long)vcore2vcoreid(p, vc_i),
+					                              (long)vc_i->nr_preempts_sent,
+					                              KMSG_ROUTINE))
+						ipi_dsts[nr_ipis++] = vc_i->pcoreid;
 				}
+				send_ipi_multi(ipi_dsts, nr_ipis, I_KERNEL_MSG);
 			} else {
 				warn("Tried to proc_run() an _M with no vcores!");
 			}
@@ -755,6 +939,7 @@ void __proc_startcore(struct proc *p, struct user_context *ctx)
 	 * to block later and lose track of our address space. */
 	assert(!is_ktask(pcpui->cur_kthread));
 	__set_proc_current(p);
+	__arch_proc_startcore(p, pcpui->owning_vcoreid);
 	__set_cpu_state(pcpui, CPU_STATE_USER);
 	proc_pop_ctx(ctx);
 }
@@ -880,8 +1065,12 @@ void proc_destroy(struct proc *p)
 	 * require parent's to never ignore that signal (or risk never reaping).
 	 *
 	 * Also note that any mmap'd files will still be mmapped.  You can close the
-	 * file after mmapping, with no effect. */
-	close_fdt(&p->open_files, FALSE);
+	 * file after mmapping, with no effect.
+	 *
+	 * Closing every chan can take a while, so a ktask does it.  Our cores are
+	 * already on their way back to the ksched. */
+	proc_incref(p, 1);
+	ktask("proc_close_files", __proc_close_files, p);
 	/* Tell the ksched about our death, and which cores we freed up */
 	__sched_proc_destroy(p, pc_arr, nr_cores_revoked);
 	/* Tell our parent about our state change (to DYING) */
@@ -1048,11 +1237,22 @@ static uint32_t get_pcoreid(struct proc *p, uint32_t vcoreid)
  *		Excess flagged FXRSTR: 42 ns
  * If we don't do it, we'll need to initialize every VCPD at process creation
  * time with a good FPU state (x86 control words are initialized as 0s, like the
- * rest of VCPD). */
+ * rest of VCPD).
+ *
+ * Vcores that never touched the FPU or extended state (AVX-512 is several KB)
+ * don't pay for a full save; see save_fp_state_lazy(). */
 static void save_vc_fp_state(struct preempt_data *vcpd)
 {
-	save_fp_state(&vcpd->preempt_anc);
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	size_t bytes;
+
+	bytes = save_fp_state_lazy(&vcpd->preempt_anc);
 	vcpd->rflags |= VC_FPU_SAVED;
+	pcpui->nr_fp_saves++;
+	if (bytes)
+		pcpui->fp_bytes_saved += bytes;
+	else
+		pcpui->nr_fp_saves_skipped++;
 }
 
 /* Conditionally restores the FP state from VCPD.  If the state was not valid,
@@ -1111,8 +1311,12 @@ void __proc_save_context_s(struct proc *p)
  *
  * We disable interrupts for most of it too, since we need to protect
  * current_ctx and not race with __notify (which doesn't play well with
- * concurrent yielders). */
-void proc_yield(struct proc *p, bool being_nice)
+ * concurrent yielders).
+ *
+ * If target is set, p is an MCP handing its core to target (proc_yield_to()),
+ * instead of back to the ksched. */
+static void __proc_yield(struct proc *p, bool being_nice, struct proc *target,
+                         struct event_msg *msg)
 {
 	uint32_t vcoreid, pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
@@ -1124,6 +1328,9 @@ void proc_yield(struct proc *p, bool being_nice)
 	spin_lock(&p->proc_lock); /* horrible scalability.  =( */
 	switch (p->state) {
 		case (PROC_RUNNING_S):
+			/* SCPs have no vcores to give away */
+			if (target)
+				goto out_failed;
 			if (!being_nice) {
 				/* waiting for an event to unblock us */
 				vcpd = &p->procdata->vcore_preempt_data[0];
@@ -1188,9 +1395,10 @@ void proc_yield(struct proc *p, bool being_nice)
 	 * yielding (nice or otherwise).  If not, this is just a regular yield. */
 	if (vc->preempt_pending) {
 		vc->preempt_pending = 0;
-	} else {
+	} else if (!target) {
 		/* Optional: on a normal yield, check to see if we are putting them
-		 * below amt_wanted (help with user races) and bail. */
+		 * below amt_wanted (help with user races) and bail.  Donors still
+		 * want their core; they'll get it back with the reply. */
 		if (p->procdata->res_req[RES_CORES].amt_wanted >=
 		                       p->procinfo->num_vcores)
 			goto out_failed;
@@ -1244,8 +1452,11 @@ void proc_yield(struct proc *p, bool being_nice)
 	spin_unlock(&p->proc_lock);
 	/* We discard the current context, but we still need to restore the core */
 	arch_finalize_ctx(pcpui->cur_ctx);
-	/* Hand the now-idle core to the ksched */
-	__sched_put_idle_core(p, pcoreid);
+	/* Hand the now-idle core to the ksched, or straight to target */
+	if (target)
+		__proc_donate_core(p, target, pcoreid, msg);
+	else
+		__sched_put_idle_core(p, pcoreid);
 	goto out_yield_core;
 out_failed:
 	/* for some reason we just want to return, either to take a KMSG that cleans
@@ -1260,6 +1471,61 @@ out_yield_core:				/* successfully yielded the core */
 	smp_idle();
 }
 
+void proc_yield(struct proc *p, bool being_nice)
+{
+	__proc_yield(p, being_nice, 0, 0);
+}
+
+/* Gives pcoreid, which p just yielded, to target and sends it msg.  target gets
+ * the core like a ksched grant, on one of its inactive vcores, but the vcore
+ * starts here, from our kmsg queue, without a trip through the ksched.  If
+ * target can't take it (an SCP, dying, or the core is provisioned to someone
+ * else), the core goes back to the ksched.  msg is sent either way.  Eats the
+ * reference on target. */
+static void __proc_donate_core(struct proc *p, struct proc *target,
+                               uint32_t pcoreid, struct event_msg *msg)
+{
+	uint32_t vcoreid = 0;
+
+	if (!__proc_is_mcp(target) || !__sched_donate_core(p, target, pcoreid)) {
+		__sched_put_idle_core(p, pcoreid);
+		goto out;
+	}
+	spin_lock(&target->proc_lock);
+	/* Like proc_wakeup(), but we're running it ourselves */
+	if (target->state == PROC_WAITING)
+		__proc_set_state(target, PROC_RUNNABLE_M);
+	/* All of its vcores could be online already */
+	if ((TAILQ_EMPTY(&target->inactive_vcs) &&
+	     TAILQ_EMPTY(&target->bulk_preempted_vcs)) ||
+	    __proc_give_cores(target, &pcoreid, 1)) {
+		spin_unlock(&target->proc_lock);
+		__sched_put_idle_core(target, pcoreid);
+		goto out;
+	}
+	vcoreid = get_vcoreid(target, pcoreid);
+	/* Sends the __startcore (to us) if target wasn't running */
+	__proc_run_m(target);
+	spin_unlock(&target->proc_lock);
+out:
+	/* The vcore will find msg when it starts, if target's ev_q sends it to
+	 * EVENT_VCORE_APPRO. */
+	send_kernel_event(target, msg, vcoreid);
+	proc_decref(target);
+}
+
+/* Synchronous IPC, L4-style: p's calling vcore yields its core directly to
+ * target, which runs one of its vcores on it and gets msg.  The server replies
+ * the same way, handing the core back.  Call this from vcore context of an MCP.
+ *
+ * Like proc_yield(), this does not return if it worked, and eats both
+ * references.  If it returns, p kept its vcore (say, it has a notif pending),
+ * msg was not sent, and we still hold the references. */
+void proc_yield_to(struct proc *p, struct proc *target, struct event_msg *msg)
+{
+	__proc_yield(p, FALSE, target, msg);
+}
+
 /* Sends a notification (aka active notification, aka IPI) to p's vcore.  We
  * only send a notification if one they are enabled.  There's a bunch of weird
  * cases with this, and how pending / enabled are signals between the user and
@@ -1452,6 +1718,23 @@ bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
 	return retval;
 }
 
+/* Warns p that it will lose pcoreid in usec, without taking the core.  The
+ * ksched comes back for it later, and a vcore that yields before then gives the
+ * core up on its own.  Returns TRUE if p still had the core mapped. */
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
+{
+	uint64_t warn_time = read_tsc() + usec2tsc(usec);
+	bool retval = FALSE;
+
+	spin_lock(&p->proc_lock);
+	if (p->state == PROC_RUNNING_M && is_mapped_vcore(p, pcoreid)) {
+		__proc_preempt_warn(p, get_vcoreid(p, pcoreid), warn_time);
+		retval = TRUE;
+	}
+	spin_unlock(&p->proc_lock);
+	return retval;
+}
+
 /* Warns and preempts all from p.  No delaying / alarming, or anything.  The
  * warning will be for u usec from now. */
 void proc_preempt_all(struct proc *p, uint64_t usec)
@@ -1566,6 +1849,8 @@ static void __proc_give_cores_running(struct proc *p, uint32_t *pc_arr,
                                       uint32_t num)
 {
 	struct vcore *vc_i;
+	uint32_t ipi_dsts[num];
+	uint32_t nr_ipis = 0;
 	/* Up the refcnt, since num cores are going to start using this
 	 * process and have it loaded in their owning_proc and 'current'. */
 	proc_incref(p, num * 2);	/* keep in sync with __startcore */
@@ -1574,11 +1859,14 @@ static void __proc_give_cores_running(struct proc *p, uint32_t *pc_arr,
 	assert(TAILQ_EMPTY(&p->bulk_preempted_vcs));
 	for (int i = 0; i < num; i++) {
 		assert(__proc_give_a_pcore(p, pc_arr[i], &p->inactive_vcs, &vc_i));
-		send_kernel_message(pc_arr[i], __startcore, (long)p,
-		                    (long)vcore2vcoreid(p, vc_i),
-		                    (long)vc_i->nr_preempts_sent, KMSG_ROUTINE);
+		if (send_kernel_message_noipi(pc_arr[i], __startcore, (long)p,
+		                              (long)vcore2vcoreid(p, vc_i),
+		                              (long)vc_i->nr_preempts_sent,
+		                              KMSG_ROUTINE))
+			ipi_dsts[nr_ipis++] = pc_arr[i];
 	}
 	__seq_end_write(&p->procinfo->coremap_seqctr);
+	send_ipi_multi(ipi_dsts, nr_ipis, I_KERNEL_MSG);
 }
 
 /* Gives process p the additional num cores listed in pcorelist.  If the proc is
@@ -1627,8 +1915,9 @@ int __proc_give_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 
 /********** Core revocation (bulk and single) ***********/
 
-/* Revokes a single vcore from a process (unmaps or sends a KMSG to unmap). */
-static void __proc_revoke_core(struct proc *p, uint32_t vcoreid, bool preempt)
+/* Revokes a single vcore from a process (sends a KMSG to unmap).  Doesn't send
+ * the IPI; returns TRUE if the vcore's pcore needs one (send_ipi_multi()). */
+static bool __proc_revoke_core(struct proc *p, uint32_t vcoreid, bool preempt)
 {
 	uint32_t pcoreid = get_pcoreid(p, vcoreid);
 	struct preempt_data *vcpd;
@@ -1636,20 +1925,25 @@ static void __proc_revoke_core(struct proc *p, uint32_t vcoreid, bool preempt)
 		/* Lock the vcore's state (necessary for preemption recovery) */
 		vcpd = &p->procdata->vcore_preempt_data[vcoreid];
 		atomic_or(&vcpd->flags, VC_K_LOCK);
-		send_kernel_message(pcoreid, __preempt, (long)p, 0, 0, KMSG_ROUTINE);
-	} else {
-		send_kernel_message(pcoreid, __death, 0, 0, 0, KMSG_ROUTINE);
+		return send_kernel_message_noipi(pcoreid, __preempt, (long)p, 0, 0,
+		                                 KMSG_ROUTINE);
 	}
+	return send_kernel_message_noipi(pcoreid, __death, 0, 0, 0, KMSG_ROUTINE);
 }
 
 /* Revokes all cores from the process (unmaps or sends a KMSGS). */
 static void __proc_revoke_allcores(struct proc *p, bool preempt)
 {
 	struct vcore *vc_i;
-	/* TODO: if we ever get broadcast messaging, use it here (still need to lock
-	 * the vcores' states for preemption) */
-	TAILQ_FOREACH(vc_i, &p->online_vcs, list)
-		__proc_revoke_core(p, vcore2vcoreid(p, vc_i), preempt);
+	uint32_t ipi_dsts[p->procinfo->num_vcores];
+	uint32_t nr_ipis = 0;
+	/* Queue all the messages (locking the vcores' states for preemption), then
+	 * IPI in bulk */
+	TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
+		if (__proc_revoke_core(p, vcore2vcoreid(p, vc_i), preempt))
+			ipi_dsts[nr_ipis++] = vc_i->pcoreid;
+	}
+	send_ipi_multi(ipi_dsts, nr_ipis, I_KERNEL_MSG);
 }
 
 /* Might be faster to scan the vcoremap than to walk the list... */
@@ -1671,15 +1965,18 @@ void __proc_take_corelist(struct proc *p, uint32_t *pc_arr, uint32_t num,
 {
 	struct vcore *vc;
 	uint32_t vcoreid;
+	uint32_t ipi_dsts[num];
+	uint32_t nr_ipis = 0;
 	assert(p->state & (PROC_RUNNING_M | PROC_RUNNABLE_M));
 	__seq_start_write(&p->procinfo->coremap_seqctr);
 	for (int i = 0; i < num; i++) {
 		vcoreid = get_vcoreid(p, pc_arr[i]);
 		/* Sanity check */
 		assert(pc_arr[i] == get_pcoreid(p, vcoreid));
-		/* Revoke / unmap core */
-		if (p->state == PROC_RUNNING_M)
-			__proc_revoke_core(p, vcoreid, preempt);
+		/* Revoke / unmap core.  The IPIs go out in bulk, below. */
+		if (p->state == PROC_RUNNING_M &&
+		    __proc_revoke_core(p, vcoreid, preempt))
+			ipi_dsts[nr_ipis++] = pc_arr[i];
 		__unmap_vcore(p, vcoreid);
 		/* Change lists for the vcore.  Note, the vcore is already unmapped
 		 * and/or the messages are already in flight.  The only code that looks
@@ -1693,6 +1990,7 @@ void __proc_take_corelist(struct proc *p, uint32_t *pc_arr, uint32_t num,
 	p->procinfo->num_vcores -= num;
 	__seq_end_write(&p->procinfo->coremap_seqctr);
 	p->procinfo->res_grant[RES_CORES] -= num;
+	send_ipi_multi(ipi_dsts, nr_ipis, I_KERNEL_MSG);
 }
 
 /* Takes all cores from a process (revoke via kmsg or unmap), putting them on
@@ -1838,10 +2136,9 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 }
 
 /* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+ * (aka, all vcores for now).  The receivers flush [start, end), using INVLPG
+ * for small ranges and a full flush for big (or empty, e.g. 0, 0) ones.  If
+ * you're changing a lot of PTEs, batch up the shootdowns with a tlb_gather.
  *
  * Would be nice to have a broadcast kmsg at this point.  Note this may send a
  * message to the calling core (interrupting it, possibly while holding the
@@ -1855,26 +2152,50 @@ void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 	/* TODO: we might be able to avoid locking here in the future (we must hit
 	 * all online, and we can check __mapped).  it'll be complicated. */
 	spin_lock(&p->proc_lock);
+	p->nr_tlb_shootdowns++;
 	switch (p->state) {
 		case (PROC_RUNNING_S):
-			tlbflush();
+			tlb_flush_range(start, end);
 			break;
 		case (PROC_RUNNING_M):
-			/* TODO: (TLB) sanity checks and rounding on the ranges */
 			TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
 				send_kernel_message(vc_i->pcoreid, __tlbshootdown, start, end,
 				                    0, KMSG_IMMEDIATE);
+				p->nr_tlb_shootdown_ipis++;
 			}
 			break;
 		default:
 			/* TODO: til we fix shootdowns, there are some odd cases where we
 			 * have the address space loaded, but the state is in transition. */
 			if (p == current)
-				tlbflush();
+				tlb_flush_range(start, end);
 	}
 	spin_unlock(&p->proc_lock);
 }
 
+void tlb_gather_init(struct tlb_gather *tlb, struct proc *p)
+{
+	tlb->p = p;
+	tlb->start = (uintptr_t)-1;
+	tlb->end = 0;
+}
+
+/* Adds [start, end) to the ranges to shoot down.  We just track the span of
+ * all of the ranges: large spans turn into a full flush anyway. */
+void tlb_gather_add(struct tlb_gather *tlb, uintptr_t start, uintptr_t end)
+{
+	tlb->start = MIN(tlb->start, start);
+	tlb->end = MAX(tlb->end, end);
+}
+
+/* Shoots down everything gathered so far, if anything. */
+void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	if (tlb->start < tlb->end)
+		proc_tlbshootdown(tlb->p, tlb->start, tlb->end);
+	tlb_gather_init(tlb, tlb->p);
+}
+
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
  * given process's vcore.  Caller needs to set up things like owning_proc and
  * whatnot.  Note that we might not have p loaded as current. */
@@ -1961,6 +2282,9 @@ int proc_change_to_vcore(struct proc *p, uint32_t new_vcoreid,
 	struct vcore *caller_vc, *new_vc;
 	struct event_msg preempt_msg = {0};
 	int retval = -EAGAIN;	/* by default, try again */
+	bool set_ctx_now = FALSE;
+	uint32_t new_nr_preempts_sent;
+	int8_t irq_state = 0;
 	/* Need to not reach outside the vcoremap, which might be smaller in the
 	 * future, but should always be as big as max_vcores */
 	if (new_vcoreid >= p->procinfo->max_vcores)
@@ -2065,15 +2389,32 @@ int proc_change_to_vcore(struct proc *p, uint32_t new_vcoreid,
 	 * owning_vcoreid.  This matters for other KMSGS that will run before
 	 * __set_curctx (like __notify). */
 	pcpui->cur_ctx = 0;
-	/* Need to send a kmsg to finish.  We can't set_curctx til the __PR is done,
-	 * but we can't spin right here while holding the lock (can't spin while
-	 * waiting on a message, roughly) */
-	send_kernel_message(pcoreid, __set_curctx, (long)p, (long)new_vcoreid,
-	                    (long)new_vc->nr_preempts_sent, KMSG_ROUTINE);
+	new_nr_preempts_sent = new_vc->nr_preempts_sent;
+	if (new_nr_preempts_sent == new_vc->nr_preempts_done) {
+		/* Common case: no __PR of the new vcore is in flight, so there's
+		 * nothing to wait for.  We set_curctx ourselves once we unlock, and
+		 * skip the kmsg. */
+		set_ctx_now = TRUE;
+	} else {
+		/* Need to send a kmsg to finish.  We can't set_curctx til the __PR is
+		 * done, but we can't spin right here while holding the lock (can't
+		 * spin while waiting on a message, roughly) */
+		send_kernel_message(pcoreid, __set_curctx, (long)p, (long)new_vcoreid,
+		                    (long)new_nr_preempts_sent, KMSG_ROUTINE);
+	}
 	retval = 0;
 	/* Fall through to exit */
 out_locked:
 	spin_unlock(&p->proc_lock);
+	if (set_ctx_now) {
+		/* Any __PR sent after we unlocked is a routine kmsg behind us, and it
+		 * will find the new cur_ctx.  Using the nr_sent from when we held the
+		 * lock means we won't wait on it.  The kmsg would have run with irqs
+		 * off, so we do too. */
+		disable_irqsave(&irq_state);
+		__set_curctx_to_vcoreid(p, new_vcoreid, new_nr_preempts_sent);
+		enable_irqsave(&irq_state);
+	}
 	return retval;
 }
 
@@ -2152,6 +2493,7 @@ void __notify(uint32_t srcid, long a0, long a1, long a2)
 	if (vcpd->notif_disabled)
 		return;
 	vcpd->notif_disabled = TRUE;
+	p->vc_stats[vcoreid].nr_notifs++;
 	/* save the old ctx in the uthread slot, build and pop a new one.  Note that
 	 * silly state isn't our business for a notification. */
 	copy_current_ctx_to(&vcpd->uthread_ctx);
@@ -2239,8 +2581,7 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
  * addresses from a0 to a1. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	tlb_flush_range((uintptr_t)a0, (uintptr_t)a1);
 }
 
 void print_allpids(void)
@@ -2262,7 +2603,7 @@ void print_allpids(void)
 	       PROC_PROGNAME_SZ - 5, "");
 	printk("------------------------------%s\n", dashes);
 	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state, NULL);
+	__pid_hash_for_each(print_proc_state, NULL);
 	spin_unlock(&pid_hash_lock);
 }
 
@@ -2295,7 +2636,7 @@ void proc_get_set(struct process_set *pset)
 			error(-ENOMEM, ERROR_FIXME);
 
 		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, enum_proc, pset);
+		__pid_hash_for_each(enum_proc, pset);
 		spin_unlock(&pid_hash_lock);
 
 	} while (pset->num_processes == pset->size);
@@ -2401,7 +2742,7 @@ void check_my_owner(void)
 			if (vc_i->pcoreid == core_id()) {
 				/* Immediate message was sent, we should get it when we enable
 				 * interrupts, which should cause us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (ACCESS_ONCE(pcpui->immed_amsgs))
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
@@ -2416,7 +2757,7 @@ void check_my_owner(void)
 	extern int booting;
 	if (!booting && !pcpui->owning_proc) {
 		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot, NULL);
+		__pid_hash_for_each(shazbot, NULL);
 		spin_unlock(&pid_hash_lock);
 	}
 }
@@ -23,22 +23,70 @@
 #include <err.h>
 #include <core_set.h>
 #include <string.h>
+#include <kdebug.h>
 #include "profiler.h"
 
 #define PROFILER_MAX_PRG_PATH	256
 #define PROFILER_BT_DEPTH 16
 
+#define PROFILER_HIST_MAX_PROBES 16
+#define PROFILER_HIST_LINE_SIZE 4096
+
 #define VBE_MAX_SIZE(t) ((8 * sizeof(t) + 6) / 7)
+#define PROFILER_MAX_RECORD_SIZE (2 * VBE_MAX_SIZE(uint64_t) + \
+	sizeof(struct proftype_user_trace64) + PROFILER_BT_DEPTH * sizeof(uint64_t))
+
+/* In histogram mode, each core counts samples per distinct stack in its own
+ * open-addressed hash table, instead of logging every sample.  A flush swaps
+ * each core's table with its (empty) spare, then merges the full ones and
+ * writes them out as folded stacks, one "frame;frame;... count" line per stack,
+ * root first, which flame graph tools read directly.  A stack that
+ * can't find a slot is counted as dropped. */
+struct profiler_hist_entry {
+	uint64_t hash;					/* 0 while the slot is free */
+	uint64_t count;
+	uint32_t pid;					/* 0 for kernel stacks */
+	uint32_t depth;
+	uintptr_t trace[PROFILER_BT_DEPTH];
+};
+
+struct profiler_hist {
+	size_t nr_entries;				/* power of 2 */
+	size_t nr_used;
+	uint64_t nr_dropped;
+	struct profiler_hist_entry entries[];
+};
+
+/* Each core's samples go into its own fixed-size ring.  The ring is lock-free:
+ * the core itself is the only producer, and profiler_read() (serialized by its
+ * callers) the only consumer.  Producers reserve space by advancing reserve and
+ * publish whole records by advancing head, which the consumer follows with
+ * tail.  A sample that interrupts another one (say, an NMI during a timer
+ * sample) nests inside it: it reserves after it, and whoever finishes last
+ * publishes both.  When the ring is full, new samples are dropped. */
+struct profiler_ring {
+	char *data;
+	size_t size;					/* power of 2 */
+	atomic_t reserve;
+	unsigned long head;
+	unsigned long tail;
+	int nesting;
+};
 
 struct profiler_cpu_context {
-	struct block *block;
+	struct profiler_ring ring;
 	int cpu;
 	int tracing;
 	size_t dropped_data_size;
+	struct profiler_hist *hist;
+	struct profiler_hist *hist_spare;
 };
 
 static int profiler_queue_limit = 64 * 1024 * 1024;
 static size_t profiler_cpu_buffer_size = 65536;
+static bool profiler_hist_mode;
+static bool profiler_offcpu;
+static size_t profiler_hist_entries = 4096;
 static qlock_t profiler_mtx = QLOCK_INITIALIZER(profiler_mtx);
 static struct kref profiler_kref;
 static struct profiler_cpu_context *profiler_percpu_ctx;
@@ -61,43 +109,68 @@ static inline char *vb_encode_uint64(char *data, uint64_t n)
 	return data;
 }
 
-static struct block *profiler_buffer_write(struct profiler_cpu_context *cpu_buf,
-                                           struct block *b)
+static void profiler_ring_copy_in(struct profiler_ring *ring,
+                                  unsigned long off, const void *src,
+                                  size_t len)
 {
-	if (b) {
-		qibwrite(profiler_queue, b);
+	size_t pos = off & (ring->size - 1);
+	size_t amt = MIN(len, ring->size - pos);
 
-		if (qlen(profiler_queue) > profiler_queue_limit) {
-			b = qget(profiler_queue);
-			if (likely(b)) {
-				cpu_buf->dropped_data_size += BLEN(b);
-				freeb(b);
-			}
-		}
-	}
+	memcpy(ring->data + pos, src, amt);
+	memcpy(ring->data, src + amt, len - amt);
+}
+
+static void profiler_ring_copy_out(struct profiler_ring *ring,
+                                   unsigned long off, void *dst, size_t len)
+{
+	size_t pos = off & (ring->size - 1);
+	size_t amt = MIN(len, ring->size - pos);
 
-	return iallocb(profiler_cpu_buffer_size);
+	memcpy(dst, ring->data + pos, amt);
+	memcpy(dst + amt, ring->data, len - amt);
 }
 
-static char *profiler_cpu_buffer_write_reserve(
-	struct profiler_cpu_context *cpu_buf, size_t size, struct block **pb)
+/* Appends a record to cpu_buf's ring, from the core that owns it.  Never
+ * blocks or allocates, so it's safe from IRQ and NMI context. */
+static void profiler_ring_write(struct profiler_cpu_context *cpu_buf,
+                                const void *rec, size_t len)
 {
-	struct block *b = cpu_buf->block;
+	struct profiler_ring *ring = &cpu_buf->ring;
+	unsigned long off;
 
-	if (unlikely((!b) || (b->lim - b->wp) < size)) {
-		cpu_buf->block = b = profiler_buffer_write(cpu_buf, b);
-		if (unlikely(!b))
-			return NULL;
+	ring->nesting++;
+	cmb();	/* anyone nesting inside us from here on won't publish */
+	/* A nester can reserve between our read and our update, so CAS.  It's
+	 * only ever this core, so the CAS doesn't bounce any lines. */
+	do {
+		off = atomic_read(&ring->reserve);
+		if (ring->size - (off - ACCESS_ONCE(ring->tail)) < len) {
+			cpu_buf->dropped_data_size += len;
+			goto publish;
+		}
+	} while (!atomic_cas(&ring->reserve, off, off + len));
+	profiler_ring_copy_in(ring, off, rec, len);
+publish:
+	cmb();
+	while (1) {
+		if (ring->nesting == 1) {
+			wmb();	/* data must be visible before the head that covers it */
+			ring->head = atomic_read(&ring->reserve);
+		}
+		cmb();
+		ring->nesting--;
+		cmb();
+		/* Someone may have nested in after we published, and left it to us */
+		if (ring->nesting || ring->head == atomic_read(&ring->reserve))
+			break;
+		ring->nesting++;
+		cmb();
 	}
-	*pb = b;
-
-	return (char *) b->wp;
 }
 
-static inline void profiler_cpu_buffer_write_commit(
-	struct profiler_cpu_context *cpu_buf, struct block *b, size_t size)
+static size_t profiler_ring_used(struct profiler_ring *ring)
 {
-	b->wp += size;
+	return ACCESS_ONCE(ring->head) - ring->tail;
 }
 
 static inline size_t profiler_max_envelope_size(void)
@@ -111,29 +184,24 @@ static void profiler_push_kernel_trace64(struct profiler_cpu_context *cpu_buf,
 {
 	size_t size = sizeof(struct proftype_kern_trace64) +
 		count * sizeof(uint64_t);
-	struct block *b;
-	void *resptr = profiler_cpu_buffer_write_reserve(
-	    cpu_buf, size + profiler_max_envelope_size(), &b);
-	void *ptr = resptr;
+	char rec[PROFILER_MAX_RECORD_SIZE];
+	char *ptr = rec;
+	struct proftype_kern_trace64 *record;
 
-	if (likely(ptr)) {
-		struct proftype_kern_trace64 *record;
+	ptr = vb_encode_uint64(ptr, PROFTYPE_KERN_TRACE64);
+	ptr = vb_encode_uint64(ptr, size);
 
-		ptr = vb_encode_uint64(ptr, PROFTYPE_KERN_TRACE64);
-		ptr = vb_encode_uint64(ptr, size);
+	record = (struct proftype_kern_trace64 *) ptr;
+	ptr += size;
 
-		record = (struct proftype_kern_trace64 *) ptr;
-		ptr += size;
+	record->info = info;
+	record->tstamp = nsec();
+	record->cpu = cpu_buf->cpu;
+	record->num_traces = count;
+	for (size_t i = 0; i < count; i++)
+		record->trace[i] = (uint64_t) trace[i];
 
-		record->info = info;
-		record->tstamp = nsec();
-		record->cpu = cpu_buf->cpu;
-		record->num_traces = count;
-		for (size_t i = 0; i < count; i++)
-			record->trace[i] = (uint64_t) trace[i];
-
-		profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
-	}
+	profiler_ring_write(cpu_buf, rec, ptr - rec);
 }
 
 static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
@@ -142,30 +210,163 @@ static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
 {
 	size_t size = sizeof(struct proftype_user_trace64) +
 		count * sizeof(uint64_t);
-	struct block *b;
-	void *resptr = profiler_cpu_buffer_write_reserve(
-	    cpu_buf, size + profiler_max_envelope_size(), &b);
-	void *ptr = resptr;
+	char rec[PROFILER_MAX_RECORD_SIZE];
+	char *ptr = rec;
+	struct proftype_user_trace64 *record;
 
-	if (likely(ptr)) {
-		struct proftype_user_trace64 *record;
+	ptr = vb_encode_uint64(ptr, PROFTYPE_USER_TRACE64);
+	ptr = vb_encode_uint64(ptr, size);
 
-		ptr = vb_encode_uint64(ptr, PROFTYPE_USER_TRACE64);
-		ptr = vb_encode_uint64(ptr, size);
+	record = (struct proftype_user_trace64 *) ptr;
+	ptr += size;
 
-		record = (struct proftype_user_trace64 *) ptr;
-		ptr += size;
+	record->info = info;
+	record->tstamp = nsec();
+	record->pid = p->pid;
+	record->cpu = cpu_buf->cpu;
+	record->num_traces = count;
+	for (size_t i = 0; i < count; i++)
+		record->trace[i] = (uint64_t) trace[i];
 
-		record->info = info;
-		record->tstamp = nsec();
-		record->pid = p->pid;
-		record->cpu = cpu_buf->cpu;
-		record->num_traces = count;
-		for (size_t i = 0; i < count; i++)
-			record->trace[i] = (uint64_t) trace[i];
+	profiler_ring_write(cpu_buf, rec, ptr - rec);
+}
+
+static struct profiler_hist *profiler_hist_alloc(size_t nr_entries)
+{
+	struct profiler_hist *hist;
+
+	hist = kzmalloc(sizeof(struct profiler_hist) +
+	                nr_entries * sizeof(struct profiler_hist_entry),
+	                KMALLOC_WAIT);
+	hist->nr_entries = nr_entries;
+	return hist;
+}
+
+static void profiler_hist_reset(struct profiler_hist *hist)
+{
+	memset(hist->entries, 0,
+	       hist->nr_entries * sizeof(struct profiler_hist_entry));
+	hist->nr_used = 0;
+	hist->nr_dropped = 0;
+}
+
+static uint64_t profiler_hist_hash(uint32_t pid, const uintptr_t *trace,
+                                   size_t count)
+{
+	uint64_t hash = pid;
+
+	for (size_t i = 0; i < count; i++) {
+		hash = (hash ^ trace[i]) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 32;
+	}
+	/* 0 marks free slots */
+	return hash ? hash : 1;
+}
+
+/* Adds nr samples of a stack to hist.  Returns FALSE if there was no room. */
+static bool profiler_hist_add(struct profiler_hist *hist, uint64_t hash,
+                              uint32_t pid, const uintptr_t *trace,
+                              size_t count, uint64_t nr)
+{
+	size_t mask = hist->nr_entries - 1;
+	struct profiler_hist_entry *e;
+
+	for (size_t i = 0; i < PROFILER_HIST_MAX_PROBES; i++) {
+		e = &hist->entries[(hash + i) & mask];
+		if (!e->hash) {
+			e->pid = pid;
+			e->depth = count;
+			memcpy(e->trace, trace, count * sizeof(uintptr_t));
+			e->count = nr;
+			e->hash = hash;
+			hist->nr_used++;
+			return TRUE;
+		}
+		if (e->hash == hash && e->pid == pid && e->depth == count &&
+		    !memcmp(e->trace, trace, count * sizeof(uintptr_t))) {
+			e->count += nr;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Off-CPU samples count for how long they were blocked, in usec, so a stack's
+ * count is the time spent there, either way. */
+static void profiler_hist_sample(struct profiler_cpu_context *cpu_buf,
+                                 uint32_t pid, const uintptr_t *trace,
+                                 size_t count, uint64_t info)
+{
+	struct profiler_hist *hist = cpu_buf->hist;
+	uint64_t nr = 1;
+
+	if (PROF_INFO_DOM(info) == PROF_DOM_OFFCPU)
+		nr = MAX(PROF_INFO_DATA(info) / 1000, 1);
+	if (!profiler_hist_add(hist, profiler_hist_hash(pid, trace, count), pid,
+	                       trace, count, nr))
+		hist->nr_dropped++;
+}
+
+static void profiler_hist_emit_entry(struct profiler_hist_entry *e, char *buf)
+{
+	size_t bufsz = PROFILER_HIST_LINE_SIZE;
+	size_t len = 0;
+	char *fn;
+
+	if (e->pid)
+		len += snprintf(buf + len, bufsz - len, "pid%u", e->pid);
+	else
+		len += snprintf(buf + len, bufsz - len, "kernel");
+	for (int i = e->depth - 1; i >= 0; i--) {
+		fn = e->pid ? NULL : get_fn_name(e->trace[i]);
+		if (fn)
+			len += snprintf(buf + len, bufsz - len, ";%s", fn);
+		else
+			len += snprintf(buf + len, bufsz - len, ";%p", e->trace[i]);
+		kfree(fn);
+	}
+	len += snprintf(buf + len, bufsz - len, " %llu\n", e->count);
+	qiwrite(profiler_queue, buf, MIN(len, bufsz - 1));
+}
 
-		profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
+/* Merges the cores' spare tables, which a flush just filled, writes the result
+ * to the queue, and empties them for the next flush. */
+static void profiler_hist_emit(void)
+{
+	struct profiler_cpu_context *cpu_buf;
+	struct profiler_hist *merged, *hist;
+	struct profiler_hist_entry *e;
+	uint64_t nr_dropped = 0;
+	size_t nr_used = 0;
+	char *buf;
+
+	for (int i = 0; i < num_cores; i++)
+		nr_used += profiler_get_cpu_ctx(i)->hist_spare->nr_used;
+	merged = profiler_hist_alloc(ROUNDUPPWR2(MAX(nr_used * 2, 1)));
+	for (int i = 0; i < num_cores; i++) {
+		hist = profiler_get_cpu_ctx(i)->hist_spare;
+		nr_dropped += hist->nr_dropped;
+		for (size_t j = 0; j < hist->nr_entries; j++) {
+			e = &hist->entries[j];
+			if (!e->hash)
+				continue;
+			if (!profiler_hist_add(merged, e->hash, e->pid, e->trace, e->depth,
+			                       e->count))
+				nr_dropped += e->count;
+		}
+		profiler_hist_reset(hist);
+	}
+	buf = kmalloc(PROFILER_HIST_LINE_SIZE, KMALLOC_WAIT);
+	for (size_t j = 0; j < merged->nr_entries; j++) {
+		if (merged->entries[j].hash)
+			profiler_hist_emit_entry(&merged->entries[j], buf);
+	}
+	if (nr_dropped) {
+		snprintf(buf, PROFILER_HIST_LINE_SIZE, "dropped %llu\n", nr_dropped);
+		qiwrite(profiler_queue, buf, strlen(buf));
 	}
+	kfree(buf);
+	kfree(merged);
 }
 
 static void profiler_push_pid_mmap(struct proc *p, uintptr_t addr, size_t msize,
@@ -253,6 +454,11 @@ static void profiler_emit_current_system_status(void)
 
 static void free_cpu_buffers(void)
 {
+	for (int i = 0; profiler_percpu_ctx && i < num_cores; i++) {
+		kfree(profiler_percpu_ctx[i].ring.data);
+		kfree(profiler_percpu_ctx[i].hist);
+		kfree(profiler_percpu_ctx[i].hist_spare);
+	}
 	kfree(profiler_percpu_ctx);
 	profiler_percpu_ctx = NULL;
 
@@ -284,6 +490,13 @@ static void alloc_cpu_buffers(void)
 		struct profiler_cpu_context *b = &profiler_percpu_ctx[i];
 
 		b->cpu = i;
+		if (profiler_hist_mode) {
+			b->hist = profiler_hist_alloc(profiler_hist_entries);
+			b->hist_spare = profiler_hist_alloc(profiler_hist_entries);
+		} else {
+			b->ring.size = profiler_cpu_buffer_size;
+			b->ring.data = kmalloc(b->ring.size, KMALLOC_WAIT);
+		}
 	}
 }
 
@@ -314,8 +527,44 @@ int profiler_configure(struct cmdbuf *cb)
 	if (!strcmp(cb->f[0], "prof_cpubufsz")) {
 		if (cb->nf < 2)
 			error(EFAIL, "prof_cpubufsz KB");
-		profiler_cpu_buffer_size = (size_t) profiler_get_checked_value(
-			cb->f[1], 1024, 16 * 1024, 1024 * 1024);
+		if (kref_refcnt(&profiler_kref) > 0)
+			error(EFAIL, "Profiler already running");
+		profiler_cpu_buffer_size = ROUNDUPPWR2((size_t)
+			profiler_get_checked_value(cb->f[1], 1024, 16 * 1024,
+			                           1024 * 1024));
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_mode")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_mode trace|hist");
+		if (kref_refcnt(&profiler_kref) > 0)
+			error(EFAIL, "Profiler already running");
+		if (!strcmp(cb->f[1], "trace"))
+			profiler_hist_mode = FALSE;
+		else if (!strcmp(cb->f[1], "hist"))
+			profiler_hist_mode = TRUE;
+		else
+			error(EFAIL, "prof_mode trace|hist");
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_offcpu")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_offcpu on|off");
+		if (!strcmp(cb->f[1], "on"))
+			profiler_offcpu = TRUE;
+		else if (!strcmp(cb->f[1], "off"))
+			profiler_offcpu = FALSE;
+		else
+			error(EFAIL, "prof_offcpu on|off");
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_histsz")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_histsz NR_STACKS");
+		if (kref_refcnt(&profiler_kref) > 0)
+			error(EFAIL, "Profiler already running");
+		profiler_hist_entries = ROUNDUPPWR2(profiler_get_checked_value(
+			cb->f[1], 1, 64, 1024 * 1024));
 		return 1;
 	}
 
@@ -327,6 +576,9 @@ void profiler_append_configure_usage(char *msgbuf, size_t buflen)
 	const char * const cmds[] = {
 		"prof_qlimit",
 		"prof_cpubufsz",
+		"prof_mode",
+		"prof_histsz",
+		"prof_offcpu",
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(cmds); i++) {
@@ -382,7 +634,9 @@ void profiler_setup(void)
 	 */
 	__kref_get(&profiler_kref, 1);
 
-	profiler_emit_current_system_status();
+	/* Folded stack output has no place for mmap and process records */
+	if (!profiler_hist_mode)
+		profiler_emit_current_system_status();
 
 	poperror();
 	qunlock(&profiler_mtx);
@@ -395,10 +649,14 @@ void profiler_cleanup(void)
 
 static void profiler_cpu_flush(struct profiler_cpu_context *cpu_buf)
 {
-	if (cpu_buf->block && profiler_queue) {
-		qibwrite(profiler_queue, cpu_buf->block);
+	struct profiler_hist *hist = cpu_buf->hist;
 
-		cpu_buf->block = NULL;
+	/* Samples from here on go to the empty spare.  One that interrupts us
+	 * either sees the old table and finishes with it before we return, or
+	 * sees the new one. */
+	if (hist) {
+		cpu_buf->hist = cpu_buf->hist_spare;
+		cpu_buf->hist_spare = hist;
 	}
 }
 
@@ -421,6 +679,8 @@ void profiler_control_trace(int onoff)
 	core_set_fill_available(&cset);
 	smp_do_in_cores(&cset, profiler_core_trace_enable,
 	                (void *) (uintptr_t) onoff);
+	if (!onoff && profiler_hist_mode)
+		profiler_hist_emit();
 }
 
 static void profiler_core_flush(void *opaque)
@@ -439,6 +699,8 @@ void profiler_trace_data_flush(void)
 	core_set_init(&cset);
 	core_set_fill_available(&cset);
 	smp_do_in_cores(&cset, profiler_core_flush, NULL);
+	if (profiler_hist_mode)
+		profiler_hist_emit();
 }
 
 void profiler_add_trace(uintptr_t pc, uint64_t info)
@@ -463,7 +725,10 @@ void profiler_add_kernel_backtrace(uintptr_t pc, uintptr_t fp, uint64_t info)
 				n = backtrace_list(pc, fp, trace + 1,
 				                   PROFILER_BT_DEPTH - 1) + 1;
 
-			profiler_push_kernel_trace64(cpu_buf, trace, n, info);
+			if (cpu_buf->hist)
+				profiler_hist_sample(cpu_buf, 0, trace, n, info);
+			else
+				profiler_push_kernel_trace64(cpu_buf, trace, n, info);
 		}
 		kref_put(&profiler_kref);
 	}
@@ -484,7 +749,10 @@ void profiler_add_user_backtrace(uintptr_t pc, uintptr_t fp, uint64_t info)
 				n = backtrace_user_list(pc, fp, trace + 1,
 				                        PROFILER_BT_DEPTH - 1) + 1;
 
-			profiler_push_user_trace64(cpu_buf, p, trace, n, info);
+			if (cpu_buf->hist)
+				profiler_hist_sample(cpu_buf, p->pid, trace, n, info);
+			else
+				profiler_push_user_trace64(cpu_buf, p, trace, n, info);
 		}
 		kref_put(&profiler_kref);
 	}
@@ -500,21 +768,91 @@ void profiler_add_hw_sample(struct hw_trapframe *hw_tf, uint64_t info)
 		                            info);
 }
 
+/* Whether a kthread that's about to block should note when, for
+ * profiler_add_offcpu_sample(). */
+bool profiler_offcpu_enabled(void)
+{
+	return profiler_offcpu && kref_refcnt(&profiler_kref) > 0;
+}
+
+/* Called by kth once it runs again after blocking, from the frame (pc, fp)
+ * that blocked.  We log where it blocked, tagged with how long it was off the
+ * core.  An SCP waits for its syscall as a whole, so we also log its user
+ * stack.  An MCP's uthreads switch in userspace, where we can't see them, and
+ * its vcore's user context has nothing to do with the syscall. */
+void profiler_add_offcpu_sample(struct kthread *kth, uintptr_t pc,
+                                uintptr_t fp)
+{
+	uint64_t info = PROF_MKINFO(PROF_DOM_OFFCPU, nsec() - kth->blocked_at);
+	struct proc *p = current;
+
+	kth->blocked_at = 0;
+	profiler_add_kernel_backtrace(pc, fp, info);
+	if (p && kth->sysc && !__proc_is_mcp(p))
+		profiler_add_user_backtrace(get_user_ctx_pc(&p->scp_ctx),
+		                            get_user_ctx_fp(&p->scp_ctx), info);
+}
+
 int profiler_size(void)
 {
-	return profiler_queue ? qlen(profiler_queue) : 0;
+	size_t size;
+
+	if (!profiler_queue)
+		return 0;
+	size = qlen(profiler_queue);
+	for (int i = 0; profiler_percpu_ctx && i < num_cores; i++)
+		size += profiler_ring_used(&profiler_get_cpu_ctx(i)->ring);
+	return size;
 }
 
+/* Copies out up to n bytes from the ring, and frees them for the producer. */
+static size_t profiler_ring_read(struct profiler_ring *ring, void *va,
+                                 size_t n)
+{
+	unsigned long head = ACCESS_ONCE(ring->head);
+	size_t amt = MIN(head - ring->tail, n);
+
+	rmb();	/* pairs with the producer's wmb before it published head */
+	profiler_ring_copy_out(ring, ring->tail, va, amt);
+	mb();	/* done reading before the producer can write over it */
+	ring->tail += amt;
+	return amt;
+}
+
+/* Reads are serialized by kprof.  The queue's records (mmaps and processes) go
+ * first, so tools see a process before its samples.  Then we drain the rings a
+ * core at a time, copying straight out of them.  A read that stops partway
+ * through a core's ring leaves read_core there, and the next read picks up
+ * where it left off before anything else, so records are never split up. */
 int profiler_read(void *va, int n)
 {
-	return profiler_queue ? qread(profiler_queue, va, n) : 0;
+	static int read_core;
+	static bool read_partial;
+	struct profiler_ring *ring;
+	size_t done = 0;
+
+	if (!profiler_queue)
+		return 0;
+	if (!read_partial && qlen(profiler_queue))
+		return qread(profiler_queue, va, n);
+	for (int i = 0; profiler_percpu_ctx && i < num_cores && done < n; i++) {
+		ring = &profiler_get_cpu_ctx(read_core)->ring;
+		if (ring->data)
+			done += profiler_ring_read(ring, va + done, n - done);
+		read_partial = ring->data && profiler_ring_used(ring);
+		if (read_partial)
+			break;
+		read_core = (read_core + 1) % num_cores;
+	}
+	return done;
 }
 
 void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
                           int flags, struct file *f, size_t offset)
 {
 	if (kref_get_not_zero(&profiler_kref, 1)) {
-		if (f && (prot & PROT_EXEC) && profiler_percpu_ctx) {
+		if (f && (prot & PROT_EXEC) && profiler_percpu_ctx &&
+		    !profiler_hist_mode) {
 			char path_buf[PROFILER_MAX_PRG_PATH];
 			char *path = file_abs_path(f, path_buf, sizeof(path_buf));
 
@@ -528,7 +866,7 @@ void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
 void profiler_notify_new_process(struct proc *p)
 {
 	if (kref_get_not_zero(&profiler_kref, 1)) {
-		if (profiler_percpu_ctx && p->binary_path)
+		if (profiler_percpu_ctx && p->binary_path && !profiler_hist_mode)
 			profiler_push_new_process(p);
 		kref_put(&profiler_kref);
 	}
@@ -2,9 +2,10 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Radix Trees!  Just the basics, doesn't do tagging or anything fancy. */
+ * Radix Trees!  Just the basics, plus tagging. */
 
 #include <ros/errno.h>
+#include <atomic.h>
 #include <radix.h>
 #include <slab.h>
 #include <string.h>
@@ -14,7 +15,10 @@ struct kmem_cache *radix_kcache;
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key,
                                               bool extend);
-static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot);
+static void __radix_remove_slot(struct radix_tree *tree,
+                                struct radix_node *r_node,
+                                struct radix_node **slot);
+static void __radix_tag_clear_up(struct radix_node *r_node, int idx, int tag);
 
 /* Initializes the radix tree system, mostly just builds the kcache */
 void radix_init(void)
@@ -29,6 +33,24 @@ void radix_tree_init(struct radix_tree *tree)
 	tree->root = 0;
 	tree->depth = 0;
 	tree->upper_bound = 0;
+	tree->lockless = FALSE;
+}
+
+/* Initializes a tree whose readers won't hold the writers' lock.  Such a tree
+ * keeps its empty nodes around, instead of freeing them out from under a
+ * reader.  TODO: RCU, then free them after a grace period. */
+void radix_tree_init_lockless(struct radix_tree *tree)
+{
+	radix_tree_init(tree);
+	tree->lockless = TRUE;
+}
+
+/* Number of keys a node of height 'height' can cover */
+static unsigned long radix_reach(unsigned int height)
+{
+	if (LOG_RNODE_SLOTS * height >= sizeof(unsigned long) * 8)
+		return (unsigned long)-1;
+	return 1UL << (LOG_RNODE_SLOTS * height);
 }
 
 /* Will clean up all the memory associated with a tree.  Shouldn't be necessary
@@ -58,21 +80,29 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 		if (!r_node)
 			return -ENOMEM;
 		memset(r_node, 0, sizeof(struct radix_node));
+		r_node->height = tree->depth + 1;
 		if (tree->root) {
 			/* tree->root is the old root, now a child of the future root */
 			r_node->items[0] = tree->root;
 			tree->root->parent = r_node;
 			tree->root->my_slot = (struct radix_node**)&r_node->items[0];
 			r_node->num_items = 1;
+			/* the old root is our slot 0, and it carries its tags up */
+			for (int i = 0; i < RADIX_NR_TAGS; i++) {
+				if (tree->root->tags[i])
+					r_node->tags[i] = 1;
+			}
 		} else {
 			/* if there was no root before, we're both the root and a leaf */
 			r_node->leaf = TRUE;
 			r_node->parent = 0;
 		}
-		tree->root = r_node;
 		r_node->my_slot = &tree->root;
+		/* lockless readers can find r_node once it is the root */
+		wmb();
+		ACCESS_ONCE(tree->root) = r_node;
 		tree->depth++;
-		tree->upper_bound = 1 << (LOG_RNODE_SLOTS * tree->depth);
+		tree->upper_bound = radix_reach(tree->depth);
 	}
 	assert(tree->root);
 	/* the tree now thinks it is tall enough, so find the last node, insert in
@@ -82,7 +112,7 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
 	if (*slot)
 		return -EEXIST;
-	*slot = item;
+	ACCESS_ONCE(*slot) = item;
 	r_node->num_items++;
 	if (slot_p)
 		*slot_p = slot;
@@ -91,17 +121,28 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 
 /* Removes an item from it's parent's structure, freeing the parent if there is
  * nothing left, potentially recursively. */
-static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot)
+static void __radix_remove_slot(struct radix_tree *tree,
+                                struct radix_node *r_node,
+                                struct radix_node **slot)
 {
+	int idx = (void**)slot - r_node->items;
+
 	assert(*slot);		/* make sure there is something there */
+	for (int i = 0; i < RADIX_NR_TAGS; i++) {
+		if (r_node->tags[i] & (1ULL << idx))
+			__radix_tag_clear_up(r_node, idx, i);
+	}
 	*slot = 0;
 	r_node->num_items--;
+	/* lockless readers might still be looking at r_node */
+	if (tree->lockless)
+		return;
 	/* this check excludes the root, but the if else handles it.  For now, once
 	 * we have a root, we'll always keep it (will need some changing in
 	 * radix_insert() */
 	if (!r_node->num_items && r_node->parent) {
 		if (r_node->parent)
-			__radix_remove_slot(r_node->parent, r_node->my_slot);
+			__radix_remove_slot(tree, r_node->parent, r_node->my_slot);
 		else			/* we're the last node, attached to the actual tree */
 			*(r_node->my_slot) = 0;
 		kmem_cache_free(radix_kcache, r_node);
@@ -123,7 +164,7 @@ void *radix_delete(struct radix_tree *tree, unsigned long key)
 	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
 	retval = *slot;
 	if (retval) {
-		__radix_remove_slot(r_node, (struct radix_node**)slot);	
+		__radix_remove_slot(tree, r_node, (struct radix_node**)slot);
 	} else {
 		/* it's okay to delete an empty, but i want to know about it for now */
 		warn("Tried to remove a non-existant item from a radix tree!");
@@ -172,13 +213,16 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
 				child_node = kmem_cache_alloc(radix_kcache, 0);
 				if (!child_node)
 					return 0;
-				r_node->items[idx] = child_node;
 				memset(child_node, 0, sizeof(struct radix_node));
 				/* when we are on the last iteration (i == 2), the child will be
 				 * a leaf. */
 				child_node->leaf = (i == 2) ? TRUE : FALSE;
+				child_node->height = i - 1;
 				child_node->parent = r_node;
 				child_node->my_slot = (struct radix_node**)&r_node->items[idx];
+				/* lockless readers can find child_node once it is linked */
+				wmb();
+				ACCESS_ONCE(r_node->items[idx]) = child_node;
 				r_node->num_items++;
 				r_node = (struct radix_node*)r_node->items[idx];
 			}
@@ -190,22 +234,65 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
 }
 
 /* Returns a pointer to the slot for the given key.  0 if there is no such slot,
- * etc */
+ * etc.
+ *
+ * This doesn't need the writers' lock.  We trust the height of the root we
+ * find, not the tree's depth, since a grow could be changing the latter. */
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key)
 {
 	printd("RADIX: lookup slot %d\n", key);
-	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
-	if (!r_node)
+	struct radix_node *r_node = ACCESS_ONCE(tree->root);
+	unsigned long idx;
+
+	if (!r_node || (key >= radix_reach(r_node->height)))
 		return 0;
+	for (int i = r_node->height; i > 1; i--) {
+		idx = (key >> (LOG_RNODE_SLOTS * (i - 1))) & (NR_RNODE_SLOTS - 1);
+		r_node = ACCESS_ONCE(r_node->items[idx]);
+		if (!r_node)
+			return 0;
+	}
 	key = key & (NR_RNODE_SLOTS - 1);
 	return &r_node->items[key];
 }
 
+/* Helper: collects up to max_items items from r_node's subtree whose keys are
+ * at least first.  r_node's first slot is for key 'base'. */
+static unsigned int __radix_gang(struct radix_node *r_node, unsigned long base,
+                                 unsigned long first, void **results,
+                                 unsigned int max_items)
+{
+	unsigned long span = radix_reach(r_node->height - 1);
+	unsigned int nr = 0;
+	void *item;
+
+	for (int i = 0; (i < NR_RNODE_SLOTS) && (nr < max_items); i++) {
+		/* skip slots whose whole span is below first */
+		if ((first > base) && ((first - base) / span > i))
+			continue;
+		item = ACCESS_ONCE(r_node->items[i]);
+		if (!item)
+			continue;
+		if (r_node->leaf)
+			results[nr++] = item;
+		else
+			nr += __radix_gang(item, base + i * span, first, results + nr,
+			                   max_items - nr);
+	}
+	return nr;
+}
+
+/* Fills results with up to max_items items, in key order, starting from key
+ * first.  Returns the number found.  Like radix_lookup, this doesn't need the
+ * writers' lock, though the results are only a snapshot. */
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	struct radix_node *r_node = ACCESS_ONCE(tree->root);
+
+	if (!r_node || (first >= radix_reach(r_node->height)))
+		return 0;
+	return __radix_gang(r_node, 0, first, results, max_items);
 }
 
 
@@ -222,35 +309,120 @@ int radix_preload(struct radix_tree *tree, int flags)
 }
 
 
+/* Returns r_node's slot index in its parent */
+static int radix_node_idx(struct radix_node *r_node)
+{
+	return (void**)r_node->my_slot - r_node->parent->items;
+}
+
+/* Sets the tag for slot idx of r_node, and for each ancestor's slot on the way
+ * up.  We can stop once we find one that is already set. */
+static void __radix_tag_set_up(struct radix_node *r_node, int idx, int tag)
+{
+	while (r_node) {
+		if (r_node->tags[tag] & (1ULL << idx))
+			return;
+		r_node->tags[tag] |= 1ULL << idx;
+		if (!r_node->parent)
+			return;
+		idx = radix_node_idx(r_node);
+		r_node = r_node->parent;
+	}
+}
+
+/* Clears the tag for slot idx of r_node, and for the ancestors whose subtrees
+ * no longer have anything tagged. */
+static void __radix_tag_clear_up(struct radix_node *r_node, int idx, int tag)
+{
+	while (r_node) {
+		r_node->tags[tag] &= ~(1ULL << idx);
+		if (r_node->tags[tag] || !r_node->parent)
+			return;
+		idx = radix_node_idx(r_node);
+		r_node = r_node->parent;
+	}
+}
+
+/* Tags the item at key, returning the item, or 0 if there is no item. */
 void *radix_tag_set(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, 0);
+	int idx = key & (NR_RNODE_SLOTS - 1);
+
+	assert(tag < RADIX_NR_TAGS);
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	__radix_tag_set_up(r_node, idx, tag);
+	return r_node->items[idx];
 }
 
+/* Untags the item at key, returning the item, or 0 if there is no item. */
 void *radix_tag_clear(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, 0);
+	int idx = key & (NR_RNODE_SLOTS - 1);
+
+	assert(tag < RADIX_NR_TAGS);
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	if (r_node->tags[tag] & (1ULL << idx))
+		__radix_tag_clear_up(r_node, idx, tag);
+	return r_node->items[idx];
 }
 
 int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, 0);
+	int idx = key & (NR_RNODE_SLOTS - 1);
+
+	assert(tag < RADIX_NR_TAGS);
+	if (!r_node)
+		return FALSE;
+	return r_node->tags[tag] & (1ULL << idx) ? TRUE : FALSE;
 }
 
+/* Returns TRUE if any item in the tree is tagged */
 int radix_tree_tagged(struct radix_tree *tree, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	assert(tag < RADIX_NR_TAGS);
+	return tree->root && tree->root->tags[tag] ? TRUE : FALSE;
+}
+
+/* Helper: like __radix_gang, but only follows tagged slots. */
+static unsigned int __radix_tag_gang(struct radix_node *r_node,
+                                     unsigned long base, unsigned long first,
+                                     void **results, unsigned int max_items,
+                                     int tag)
+{
+	unsigned long span = radix_reach(r_node->height - 1);
+	unsigned int nr = 0;
+
+	for (int i = 0; (i < NR_RNODE_SLOTS) && (nr < max_items); i++) {
+		if (!(r_node->tags[tag] & (1ULL << i)))
+			continue;
+		if ((first > base) && ((first - base) / span > i))
+			continue;
+		if (r_node->leaf)
+			results[nr++] = r_node->items[i];
+		else
+			nr += __radix_tag_gang(r_node->items[i], base + i * span, first,
+			                       results + nr, max_items - nr, tag);
+	}
+	return nr;
 }
 
+/* Fills results with up to max_items tagged items, in key order, starting from
+ * key first.  Returns the number found.  Unlike radix_gang_lookup, this needs
+ * the writers' lock. */
 int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
                           unsigned long first, unsigned int max_items, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *r_node = tree->root;
+
+	assert(tag < RADIX_NR_TAGS);
+	if (!r_node || (first >= radix_reach(r_node->height)))
+		return 0;
+	return __radix_tag_gang(r_node, 0, first, results, max_items, tag);
 }
 
 void print_radix_tree(struct radix_tree *tree)
@@ -265,9 +437,10 @@ void print_radix_tree(struct radix_tree *tree)
 		char buf[32] = {0};
 		for (int i = 0; i < depth; i++)
 			buf[i] = '\t';
-		printk("%sRnode %p, parent %p, myslot %p, %d items, leaf? %d\n",
-		       buf, r_node, r_node->parent, r_node->my_slot, r_node->num_items,
-		       r_node->leaf);
+		printk("%sRnode %p, parent %p, myslot %p, %d items, leaf? %d, h %d, "
+		       "tags %016llx %016llx\n", buf, r_node, r_node->parent,
+		       r_node->my_slot, r_node->num_items, r_node->leaf, r_node->height,
+		       r_node->tags[0], r_node->tags[1]);
 		for (int i = 0; i < NR_RNODE_SLOTS; i++) {
 			if (!r_node->items[i])
 				continue;
@@ -0,0 +1,134 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Quiescent-state based RCU.  See rcu.h for the rules.
+ *
+ * Callbacks are collected on one list.  The grace period kthread grabs the
+ * whole list, starts a grace period by bumping rcu_gp_seq, and waits for every
+ * core to report a quiescent state for that sequence number.  Then it runs the
+ * batch.  Callbacks queued while a batch is waiting go in the next batch. */
+
+#include <rcu.h>
+#include <kthread.h>
+#include <smp.h>
+#include <trap.h>
+#include <percpu.h>
+#include <assert.h>
+#include <stdio.h>
+
+static unsigned long rcu_gp_seq;
+static DEFINE_PERCPU(unsigned long, rcu_qs_seq);
+
+static spinlock_t rcu_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct rcu_head *rcu_pending;	/* waiting for the next GP */
+static struct rcu_head **rcu_pending_tail = &rcu_pending;
+static struct semaphore rcu_work_sem;	/* upped when rcu_pending gets work */
+static struct semaphore rcu_gp_sem;		/* upped when the GP is over */
+static atomic_t rcu_nr_cores_left;
+
+/* Called at quiescent points, with IRQs disabled, from process_routine_kmsg().
+ * Cheap unless a grace period is waiting on this core. */
+void rcu_report_qs(void)
+{
+	unsigned long gp = ACCESS_ONCE(rcu_gp_seq);
+	int8_t irq_state = 0;
+
+	if (PERCPU_VAR(rcu_qs_seq) == gp)
+		return;
+	PERCPU_VAR(rcu_qs_seq) = gp;
+	if (atomic_sub_and_test(&rcu_nr_cores_left, 1))
+		sem_up_irqsave(&rcu_gp_sem, &irq_state);
+}
+
+/* Doesn't need to do anything: handling any routine kmsg is a quiescent
+ * state. */
+static void __rcu_nudge(uint32_t srcid, long a0, long a1, long a2)
+{
+}
+
+/* Starts a GP and waits for all cores to pass through a quiescent state */
+static void rcu_wait_for_gp(void)
+{
+	int8_t irq_state = 0;
+
+	atomic_set(&rcu_nr_cores_left, num_cores);
+	/* Cores report once they see the new gp_seq, so the count must be set
+	 * first. */
+	wmb();
+	ACCESS_ONCE(rcu_gp_seq) = rcu_gp_seq + 1;
+	for (int i = 0; i < num_cores; i++) {
+		if (ACCESS_ONCE(_PERCPU_VAR(rcu_qs_seq, i)) != rcu_gp_seq)
+			send_kernel_message(i, __rcu_nudge, 0, 0, 0, KMSG_ROUTINE);
+	}
+	sem_down_irqsave(&rcu_gp_sem, &irq_state);
+}
+
+static void rcu_gp_ktask(void *arg)
+{
+	struct rcu_head *batch, *next;
+	int8_t irq_state = 0;
+
+	while (1) {
+		sem_down_irqsave(&rcu_work_sem, &irq_state);
+		spin_lock_irqsave(&rcu_lock);
+		batch = rcu_pending;
+		rcu_pending = 0;
+		rcu_pending_tail = &rcu_pending;
+		spin_unlock_irqsave(&rcu_lock);
+		/* the sem may have been upped more than once for this batch */
+		if (!batch)
+			continue;
+		rcu_wait_for_gp();
+		for (; batch; batch = next) {
+			next = batch->next;
+			batch->func(batch);
+		}
+	}
+}
+
+void rcu_init(void)
+{
+	sem_init_irqsave(&rcu_work_sem, 0);
+	sem_init_irqsave(&rcu_gp_sem, 0);
+	ktask("rcu_gp", rcu_gp_ktask, 0);
+}
+
+/* Arranges for func(head) to run after all current readers are done.  Safe to
+ * call from any context. */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	bool was_empty;
+	int8_t irq_state = 0;
+
+	head->next = 0;
+	head->func = func;
+	spin_lock_irqsave(&rcu_lock);
+	was_empty = !rcu_pending;
+	*rcu_pending_tail = head;
+	rcu_pending_tail = &head->next;
+	spin_unlock_irqsave(&rcu_lock);
+	if (was_empty)
+		sem_up_irqsave(&rcu_work_sem, &irq_state);
+}
+
+struct rcu_sync {
+	struct rcu_head				head;
+	struct semaphore			sem;
+};
+
+static void __rcu_sync_cb(struct rcu_head *head)
+{
+	struct rcu_sync *sync = container_of(head, struct rcu_sync, head);
+
+	sem_up(&sync->sem);
+}
+
+/* Blocks until all readers that might have started before the call are done */
+void synchronize_rcu(void)
+{
+	struct rcu_sync sync;
+
+	sem_init(&sync.sem, 0);
+	call_rcu(&sync.head, __rcu_sync_cb);
+	sem_down(&sync.sem);
+}
@@ -0,0 +1,206 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.  See reclaim.h.
+ *
+ * The reclaim qlock serializes passes over the shrinkers and changes to the
+ * list, so a shrinker is never unregistered while it runs.  The spinlock lets
+ * stats readers walk the list without waiting for a pass.  A kthread running
+ * shrinkers is marked KTH_IN_RECLAIM, so that allocations made by the shrinkers
+ * themselves don't reclaim too. */
+
+#include <reclaim.h>
+#include <page_alloc.h>
+#include <pagemap.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <rendez.h>
+#include <kthread.h>
+#include <smp.h>
+#include <trap.h>
+#include <string.h>
+#include <assert.h>
+
+#define RECLAIM_BATCH				256		/* pages per pass */
+#define RECLAIM_MAX_IDLE_PASSES		4		/* passes that freed nothing */
+#define RECLAIM_BACKOFF_USEC		100000
+/* The page cache's first sweep over pages might only age them */
+#define RECLAIM_DIRECT_PASSES		2
+
+static qlock_t reclaim_qlock = QLOCK_INITIALIZER(reclaim_qlock);
+static spinlock_t shrinker_lock = SPINLOCK_INITIALIZER;
+static struct shrinker_tailq shrinkers = TAILQ_HEAD_INITIALIZER(shrinkers);
+static struct reclaim_stats reclaim_stats;
+static struct rendez reclaim_rv;
+static atomic_t reclaim_kicked;
+static bool reclaim_ready;
+
+void register_shrinker(struct shrinker *s)
+{
+	qlock(&reclaim_qlock);
+	spin_lock(&shrinker_lock);
+	TAILQ_INSERT_TAIL(&shrinkers, s, link);
+	spin_unlock(&shrinker_lock);
+	qunlock(&reclaim_qlock);
+}
+
+void unregister_shrinker(struct shrinker *s)
+{
+	qlock(&reclaim_qlock);
+	spin_lock(&shrinker_lock);
+	TAILQ_REMOVE(&shrinkers, s, link);
+	spin_unlock(&shrinker_lock);
+	qunlock(&reclaim_qlock);
+}
+
+/* Runs the shrinkers, in the order they registered, until nr_pages are freed.
+ * Returns the number freed. */
+static unsigned long reclaim_shrink(unsigned long nr_pages, bool direct)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	struct shrinker *s;
+	unsigned long freed, nr_freed = 0;
+
+	kth->flags |= KTH_IN_RECLAIM;
+	qlock(&reclaim_qlock);
+	TAILQ_FOREACH(s, &shrinkers, link) {
+		freed = s->scan(s, nr_pages - nr_freed);
+		s->nr_calls++;
+		s->nr_freed += freed;
+		nr_freed += freed;
+		if (nr_freed >= nr_pages)
+			break;
+	}
+	if (direct) {
+		reclaim_stats.nr_direct_passes++;
+		reclaim_stats.nr_direct_freed += nr_freed;
+	} else {
+		reclaim_stats.nr_bg_passes++;
+		reclaim_stats.nr_bg_freed += nr_freed;
+	}
+	qunlock(&reclaim_qlock);
+	kth->flags &= ~KTH_IN_RECLAIM;
+	return nr_freed;
+}
+
+/* Wakes the reclaim ktask.  Allocators call this on every allocation while a
+ * node is low, so only the first call after the ktask went to sleep wakes it.
+ * Safe from IRQ context. */
+void reclaim_kick(void)
+{
+	if (!reclaim_ready || atomic_swap(&reclaim_kicked, 1))
+		return;
+	rendez_wakeup(&reclaim_rv);
+}
+
+/* Called by allocations that can block, once they failed.  Returns the number
+ * of pages freed, so the caller knows whether retrying is worth it. */
+unsigned long reclaim_direct(unsigned long nr_pages)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	unsigned long nr_freed = 0;
+
+	if (!reclaim_ready || !can_block(pcpui) ||
+	    (pcpui->cur_kthread->flags & KTH_IN_RECLAIM))
+		return 0;
+	reclaim_kick();
+	for (int i = 0; i < RECLAIM_DIRECT_PASSES && !nr_freed; i++)
+		nr_freed = reclaim_shrink(nr_pages, TRUE);
+	return nr_freed;
+}
+
+static int reclaim_should_run(void *unused)
+{
+	return page_alloc_below_wmark(FALSE);
+}
+
+/* Sleeps until a node is low, then frees batches until every node is above
+ * its high watermark.  If the shrinkers stop making progress, we back off for
+ * a while instead of spinning; whatever is left is pinned or dirty. */
+static void reclaim_ktask(void *unused)
+{
+	int nr_idle;
+
+	while (1) {
+		atomic_set(&reclaim_kicked, 0);
+		rendez_sleep(&reclaim_rv, reclaim_should_run, 0);
+		reclaim_stats.nr_wakeups++;
+		nr_idle = 0;
+		while (page_alloc_below_wmark(TRUE)) {
+			if (reclaim_shrink(RECLAIM_BATCH, FALSE)) {
+				nr_idle = 0;
+				continue;
+			}
+			if (++nr_idle == RECLAIM_MAX_IDLE_PASSES) {
+				kthread_usleep(RECLAIM_BACKOFF_USEC);
+				break;
+			}
+		}
+	}
+}
+
+/* Racy snapshot of the counters, which are updated under the qlock. */
+void reclaim_get_stats(struct reclaim_stats *stats)
+{
+	*stats = reclaim_stats;
+}
+
+/* Returns a kmalloced array of the shrinkers' stats, which the caller frees,
+ * and its length.  The counters are a racy snapshot. */
+size_t reclaim_get_shrinker_stats(struct shrinker_stats **stats_p)
+{
+	struct shrinker *s;
+	struct shrinker_stats *stats, *st;
+	size_t nr_shrinkers = 0, i = 0;
+
+	spin_lock(&shrinker_lock);
+	TAILQ_FOREACH(s, &shrinkers, link)
+		nr_shrinkers++;
+	stats = kzmalloc(sizeof(struct shrinker_stats) * (nr_shrinkers + 1), 0);
+	if (!stats) {
+		spin_unlock(&shrinker_lock);
+		*stats_p = 0;
+		return 0;
+	}
+	TAILQ_FOREACH(s, &shrinkers, link) {
+		st = &stats[i++];
+		strlcpy(st->name, s->name, sizeof(st->name));
+		st->nr_calls = s->nr_calls;
+		st->nr_scanned = s->nr_scanned;
+		st->nr_freed = s->nr_freed;
+	}
+	spin_unlock(&shrinker_lock);
+	*stats_p = stats;
+	return nr_shrinkers;
+}
+
+/* Empty slabs are the cheapest to give back: nothing needs to be read in again
+ * later.  This reaps every cache, no matter how much we asked for. */
+static unsigned long slab_shrink(struct shrinker *s, unsigned long nr_pages)
+{
+	return kmem_cache_reap_all();
+}
+
+static unsigned long pm_shrink(struct shrinker *s, unsigned long nr_pages)
+{
+	return pm_reclaim(nr_pages, &s->nr_scanned);
+}
+
+static struct shrinker slab_shrinker = {
+	.name = "slab",
+	.scan = slab_shrink,
+};
+
+static struct shrinker pm_shrinker = {
+	.name = "pagecache",
+	.scan = pm_shrink,
+};
+
+void reclaim_init(void)
+{
+	rendez_init(&reclaim_rv);
+	register_shrinker(&slab_shrinker);
+	register_shrinker(&pm_shrinker);
+	ktask("reclaim", reclaim_ktask, 0);
+	reclaim_ready = TRUE;
+}
@@ -0,0 +1,152 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Resizable hash tables with lockless readers.  See rhashtable.h. */
+
+#include <rhashtable.h>
+#include <kmalloc.h>
+#include <assert.h>
+#include <stdio.h>
+#include <error.h>
+
+static struct rht_tab *rht_tab_alloc(size_t nr_slots, int flags)
+{
+	struct rht_tab *tab;
+
+	tab = kzmalloc(sizeof(struct rht_tab) + nr_slots * sizeof(void*), flags);
+	if (!tab)
+		return 0;
+	tab->nr_slots = nr_slots;
+	return tab;
+}
+
+static void __rht_tab_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct rht_tab, rcu));
+}
+
+void rhashtable_init(struct rhashtable *ht, size_t nr_items_hint)
+{
+	size_t nr_slots = ROUNDUPPWR2(MAX(nr_items_hint * 2, RHT_MIN_SLOTS));
+
+	ht->tab = rht_tab_alloc(nr_slots, KMALLOC_WAIT);
+	ht->old = 0;
+	ht->migrate_idx = 0;
+	ht->nr_items = 0;
+	ht->seq = 0;
+	spinlock_init(&ht->lock);
+}
+
+/* Caller makes sure there are no more users */
+void rhashtable_destroy(struct rhashtable *ht)
+{
+	kfree(ht->old);
+	kfree(ht->tab);
+	ht->old = 0;
+	ht->tab = 0;
+}
+
+/* Runs func on every item, with the lock held */
+void rhashtable_for_each(struct rhashtable *ht,
+                         void (*func)(void *item, void *opaque), void *opaque)
+{
+	struct rht_tab *tabs[2];
+	void *item;
+
+	spin_lock(&ht->lock);
+	tabs[0] = ht->old;
+	tabs[1] = ht->tab;
+	for (int t = 0; t < 2; t++) {
+		if (!tabs[t])
+			continue;
+		for (size_t i = 0; i < tabs[t]->nr_slots; i++) {
+			item = tabs[t]->slots[i];
+			if (item != RHT_EMPTY && item != RHT_TOMBSTONE)
+				func(item, opaque);
+		}
+	}
+	spin_unlock(&ht->lock);
+}
+
+/* Puts item in the first free slot of its probe sequence.  There is always one,
+ * since we keep tables from filling up. */
+static void rht_tab_insert(struct rht_tab *tab, void *item, size_t hash)
+{
+	size_t mask = tab->nr_slots - 1;
+	void **slot;
+
+	for (size_t i = 0; i < tab->nr_slots; i++) {
+		slot = &tab->slots[(hash + i) & mask];
+		if (*slot == RHT_EMPTY)
+			tab->nr_used++;
+		else if (*slot != RHT_TOMBSTONE)
+			continue;
+		/* A reader can see the item as soon as we write the pointer */
+		wmb();
+		ACCESS_ONCE(*slot) = item;
+		return;
+	}
+	panic("Full rhashtable tab %p!", tab);
+}
+
+/* Moves up to nr slots of the old table into the new one.  Readers check old,
+ * then new, so we put an item in new before removing it from old.  The seq
+ * counter tells readers that missed that something moved. */
+void __rht_migrate(struct rhashtable *ht, rht_hash_t hash, size_t nr)
+{
+	struct rht_tab *old = ht->old;
+	void *item;
+
+	__seq_start_write(&ht->seq);
+	for (; nr && ht->migrate_idx < old->nr_slots; nr--, ht->migrate_idx++) {
+		item = old->slots[ht->migrate_idx];
+		if (item == RHT_EMPTY || item == RHT_TOMBSTONE)
+			continue;
+		rht_tab_insert(ht->tab, item, hash(item));
+		ACCESS_ONCE(old->slots[ht->migrate_idx]) = RHT_TOMBSTONE;
+	}
+	if (ht->migrate_idx == old->nr_slots)
+		RCU_INIT_POINTER(ht->old, 0);
+	__seq_end_write(&ht->seq);
+	if (!ht->old)
+		call_rcu(&old->rcu, __rht_tab_free_rcu);
+}
+
+/* Switches inserts to a new table, sized for the items we have now.  That
+ * might be the same size as before, if the old one was mostly tombstones. */
+static bool rht_start_resize(struct rhashtable *ht, rht_hash_t hash)
+{
+	struct rht_tab *new;
+	size_t nr_slots = ROUNDUPPWR2(MAX((ht->nr_items + 1) * 2, RHT_MIN_SLOTS));
+
+	/* If we're still migrating from a previous resize, finish that first */
+	if (ht->old)
+		__rht_migrate(ht, hash, ht->old->nr_slots);
+	/* We're holding a spinlock */
+	new = rht_tab_alloc(nr_slots, 0);
+	if (!new)
+		return FALSE;
+	__seq_start_write(&ht->seq);
+	ht->migrate_idx = 0;
+	rcu_assign_pointer(ht->old, ht->tab);
+	rcu_assign_pointer(ht->tab, new);
+	__seq_end_write(&ht->seq);
+	return TRUE;
+}
+
+/* Returns 0 on success, -ENOMEM if the table is full and we couldn't grow it */
+int __rht_insert(struct rhashtable *ht, void *item, rht_hash_t hash)
+{
+	struct rht_tab *tab = ht->tab;
+
+	/* Keep the load (items and tombstones) under 3/4 */
+	if ((tab->nr_used + 1) * 4 > tab->nr_slots * 3) {
+		if (!rht_start_resize(ht, hash) && tab->nr_used + 1 >= tab->nr_slots)
+			return -ENOMEM;
+	}
+	rht_tab_insert(ht->tab, item, hash(item));
+	ht->nr_items++;
+	if (ht->old)
+		__rht_migrate(ht, hash, RHT_MIGRATE_BATCH);
+	return 0;
+}
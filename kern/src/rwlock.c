@@ -33,6 +33,8 @@
 #include <rwlock.h>
 #include <atomic.h>
 #include <kthread.h>
+#include <kmalloc.h>
+#include <smp.h>
 
 void rwinit(struct rwlock *rw_lock)
 {
@@ -119,3 +121,121 @@ void wunlock(struct rwlock *rw_lock)
 	__cv_broadcast(&rw_lock->readers);
 	spin_unlock(&rw_lock->lock);
 }
+
+/* Big reader locks.
+ *
+ * A reader increments its core's counter, then checks for a writer.  A writer
+ * sets 'writing', then sums the counters.  With a full barrier on both sides,
+ * either the reader sees the writer and backs off, or the writer counts the
+ * reader.  Readers can block while holding the lock and unlock on another
+ * core, so a single counter can go negative; only the sum means anything.
+ *
+ * To keep the "any thread can rlock if some reader holds it" property, a
+ * writer that finds readers does not hold 'writing' while it waits for them.
+ * It lets the readers back in and sleeps on 'drain' until the count might be
+ * zero, then tries again.  Like the rwlock, writers can starve. */
+
+void brwinit(struct brwlock *bl)
+{
+	bl->slots = kzmalloc_align(sizeof(struct brw_slot) * num_cores,
+	                           KMALLOC_WAIT, ARCH_CL_SIZE);
+	spinlock_init(&bl->lock);
+	bl->writing = FALSE;
+	bl->nr_drainers = 0;
+	cv_init_with_lock(&bl->readers, &bl->lock);
+	cv_init_with_lock(&bl->writers, &bl->lock);
+	cv_init_with_lock(&bl->drain, &bl->lock);
+}
+
+void brwdestroy(struct brwlock *bl)
+{
+	kfree(bl->slots);
+	bl->slots = 0;
+}
+
+static long __brw_nr_readers(struct brwlock *bl)
+{
+	long sum = 0;
+
+	for (int i = 0; i < num_cores; i++)
+		sum += ACCESS_ONCE(bl->slots[i].nr_readers);
+	return sum;
+}
+
+/* Returns TRUE if we got the lock.  On failure, there was a writer. */
+static bool __brlock_try(struct brwlock *bl)
+{
+	long *nr = &bl->slots[core_id()].nr_readers;
+
+	/* Sleeping locks aren't used from IRQ context, so nothing else on this core
+	 * touches our counter while we do. */
+	ACCESS_ONCE(*nr) = *nr + 1;
+	mb();	/* syncs with the writer's mb between 'writing' and the sum */
+	if (likely(!ACCESS_ONCE(bl->writing)))
+		return TRUE;
+	brunlock(bl);
+	return FALSE;
+}
+
+void brlock(struct brwlock *bl)
+{
+	while (!__brlock_try(bl)) {
+		spin_lock(&bl->lock);
+		while (bl->writing)
+			cv_wait(&bl->readers);
+		spin_unlock(&bl->lock);
+	}
+}
+
+bool canbrlock(struct brwlock *bl)
+{
+	return __brlock_try(bl);
+}
+
+void brunlock(struct brwlock *bl)
+{
+	long *nr = &bl->slots[core_id()].nr_readers;
+
+	ACCESS_ONCE(*nr) = *nr - 1;
+	mb();	/* syncs with the writer's mb between nr_drainers and the sum */
+	if (unlikely(ACCESS_ONCE(bl->nr_drainers))) {
+		spin_lock(&bl->lock);
+		__cv_broadcast(&bl->drain);
+		spin_unlock(&bl->lock);
+	}
+}
+
+void bwlock(struct brwlock *bl)
+{
+	spin_lock(&bl->lock);
+	while (1) {
+		if (bl->writing) {
+			cv_wait(&bl->writers);
+			continue;
+		}
+		bl->writing = TRUE;
+		mb();
+		if (!__brw_nr_readers(bl))
+			break;
+		bl->writing = FALSE;
+		__cv_broadcast(&bl->readers);
+		bl->nr_drainers++;
+		mb();
+		/* A reader that unlocks after this sum will see nr_drainers and wake
+		 * us.  It needs the lock to do so, which we hold until we sleep. */
+		if (__brw_nr_readers(bl))
+			cv_wait(&bl->drain);
+		bl->nr_drainers--;
+	}
+	spin_unlock(&bl->lock);
+}
+
+void bwunlock(struct brwlock *bl)
+{
+	spin_lock(&bl->lock);
+	bl->writing = FALSE;
+	if (bl->writers.nr_waiters)
+		__cv_signal(&bl->writers);
+	__cv_broadcast(&bl->readers);
+	spin_unlock(&bl->lock);
+}
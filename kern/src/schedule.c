@@ -14,14 +14,27 @@
 #include <smp.h>
 #include <manager.h>
 #include <alarm.h>
+#include <kmalloc.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
 
-/* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
- * waiting or otherwise not considered for sched decisions. */
-struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
-struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
-/* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
+/* SCP run queues.  Each LL core runs SCPs from its own queue, sorted by
+ * vruntime: the time each SCP has run, weighted by its shares.  The SCP that
+ * has run the least goes next, and a running SCP is only descheduled for one
+ * that has run less.  SCPs wake up on the queue of the core they last ran on,
+ * unless another LL core's queue is shorter, and an idle LL core steals from
+ * the busiest queue.  Each queue has its own lock, so SCP wakeups don't need
+ * the sched_lock.  SCPs that are running or waiting aren't on any list. */
+struct scp_runq {
+	spinlock_t					lock;
+	struct proc_list			runnable;
+	unsigned int				nr_runnable;
+	uint64_t					min_vruntime;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct scp_runq *scp_runqs;		/* one per core, only LL cores use them */
+
+/* Process Lists.  mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
  * I'm expecting to want the flexibility of the pointers later. */
 struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
 struct proc_list all_mcps_2 = TAILQ_HEAD_INITIALIZER(all_mcps_2);
@@ -67,15 +80,38 @@ spinlock_t sched_lock = SPINLOCK_INITIALIZER;
 
 /* Alarm struct, for our example 'timer tick' */
 struct alarm_waiter ksched_waiter;
+/* Whether ksched_waiter is armed or running.  Protected by the sched_lock. */
+static bool ksched_tick_on;
 
 #define TIMER_TICK_USEC 10000 	/* 10msec */
 
-/* Helper: Sets up a timer tick on the calling core to go off 10 msec from now.
- * This assumes the calling core is an LL core, etc. */
-static void set_ksched_alarm(void)
+/* MCPs split the CG cores in proportion to their shares.  An MCP can always
+ * use idle cores beyond its share, but when an MCP under its share wants more,
+ * we take them back from MCPs over their share.  Those MCPs get a preemption
+ * warning first, and we revoke the core REVOKE_WARN_USEC later (or sooner, if
+ * an MCP's deadline is up), unless they yielded it in the meantime.  MCPs with
+ * a deadline (latency-critical ones) get all the cores they want, ahead of
+ * everyone else.  Protected by the sched_lock. */
+#define CORE_SHARES_DEFAULT 100
+#define REVOKE_WARN_USEC 1000 	/* 1msec */
+
+struct core_revocation {
+	struct proc					*victim;	/* who was warned, weak ref */
+	uint64_t					when;		/* tsc */
+};
+static struct core_revocation *core_revocations;	/* one per pcore */
+static uint32_t nr_revocations;
+static struct alarm_waiter revoke_waiter;
+
+/* Helper: Sets up the timer tick on core 0 to go off 10 msec from now, unless
+ * it is already on.  Safe to call from any core.  Hold the sched_lock. */
+static void __ksched_tick_start(void)
 {
+	if (ksched_tick_on)
+		return;
+	ksched_tick_on = TRUE;
 	set_awaiter_rel(&ksched_waiter, TIMER_TICK_USEC);
-	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	set_alarm(&per_cpu_info[0].tchain, &ksched_waiter);
 }
 
 /* Need a kmsg to just run the sched, but not to rearm */
@@ -84,6 +120,33 @@ static void __just_sched(uint32_t srcid, long a0, long a1, long a2)
 	run_scheduler();
 }
 
+/* Helper: is there anything for the tick to do?  SCPs waiting for a core need
+ * to be timesliced in, and MCPs that still want cores need to be retried, since
+ * we don't hear about every core that gets freed up.  Hold the sched_lock. */
+static bool __ksched_tick_needed(void)
+{
+	struct proc *p;
+
+#ifndef CONFIG_KSCHED_TICKLESS
+	return TRUE;
+#endif
+	for (int i = 0; i < num_cores; i++) {
+		if (is_ll_core(i) && ACCESS_ONCE(scp_runqs[i].nr_runnable))
+			return TRUE;
+	}
+	if (nr_revocations)
+		return TRUE;
+	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link) {
+		if (p->state != PROC_WAITING && get_cores_needed(p))
+			return TRUE;
+	}
+	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link) {
+		if (p->state != PROC_WAITING && get_cores_needed(p))
+			return TRUE;
+	}
+	return FALSE;
+}
+
 /* RKM alarm, to run the scheduler tick (not in interrupt context) and reset the
  * alarm.  Note that interrupts will be disabled, but this is not the same as
  * interrupt context.  We're a routine kmsg, which means the core is in a
@@ -92,27 +155,56 @@ static void __ksched_tick(struct alarm_waiter *waiter)
 {
 	/* TODO: imagine doing some accounting here */
 	run_scheduler();
+	spin_lock(&sched_lock);
+	if (!__ksched_tick_needed()) {
+		/* Whoever gives us work next will restart the tick */
+		ksched_tick_on = FALSE;
+		spin_unlock(&sched_lock);
+		return;
+	}
 	/* Set our alarm to go off, incrementing from our last tick (instead of
 	 * setting it relative to now, since some time has passed since the alarm
 	 * first went off.  Note, this may be now or in the past! */
 	set_awaiter_inc(&ksched_waiter, TIMER_TICK_USEC);
-	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	set_alarm(&per_cpu_info[0].tchain, &ksched_waiter);
+	spin_unlock(&sched_lock);
+}
+
+/* RKM alarm, to revoke warned cores once their time is up */
+static void __revoke_tick(struct alarm_waiter *waiter)
+{
+	run_scheduler();
 }
 
 void schedule_init(void)
 {
+	core_revocations = kzmalloc(sizeof(struct core_revocation) * num_cores,
+	                            KMALLOC_WAIT);
+	assert(core_revocations);
+	scp_runqs = kzmalloc_align(sizeof(struct scp_runq) * num_cores,
+	                           KMALLOC_WAIT, ARCH_CL_SIZE);
+	assert(scp_runqs);
+	for (int i = 0; i < num_cores; i++) {
+		spinlock_init(&scp_runqs[i].lock);
+		TAILQ_INIT(&scp_runqs[i].runnable);
+	}
 	spin_lock(&sched_lock);
 	assert(!core_id());		/* want the alarm on core0 for now */
 	init_awaiter(&ksched_waiter, __ksched_tick);
-	set_ksched_alarm();
+	init_awaiter(&revoke_waiter, __revoke_tick);
+	__ksched_tick_start();
 	corealloc_init();
 	spin_unlock(&sched_lock);
 
 #ifdef CONFIG_ARSC_SERVER
-	int arsc_coreid = get_any_idle_core();
-	assert(arsc_coreid >= 0);
-	send_kernel_message(arsc_coreid, arsc_server, 0, 0, 0, KMSG_ROUTINE);
-	printk("Using core %d for the ARSC server\n", arsc_coreid);
+	arsc_init();
+	for (int i = 0; i < CONFIG_ARSC_NR_CORES; i++) {
+		int arsc_coreid = get_any_idle_core();
+
+		assert(arsc_coreid >= 0);
+		send_kernel_message(arsc_coreid, arsc_server, i, 0, 0, KMSG_ROUTINE);
+		printk("Using core %d for ARSC server %d\n", arsc_coreid, i);
+	}
 #endif /* CONFIG_ARSC_SERVER */
 }
 
@@ -147,6 +239,117 @@ static void remove_from_any_list(struct proc *p)
 	}
 }
 
+/* Returns p's vruntime as of now.  If p is running, this counts the time since
+ * it went online. */
+static uint64_t scp_vruntime(struct proc *p, bool running)
+{
+	struct sched_proc_data *sd = &p->ksched_data;
+	uint64_t ticks = vcore_account_gettotal(p, 0);
+
+	if (running)
+		ticks += read_tsc() - p->procinfo->vcoremap[0].resume_ticks;
+	return sd->vruntime + (ticks - sd->scp_ticks) * CORE_SHARES_DEFAULT /
+	                      sd->core_shares;
+}
+
+/* Puts p on rq, in vruntime order.  Does nothing if p is already on a queue.
+ * Hold rq's lock. */
+static void __scp_enqueue(struct scp_runq *rq, struct proc *p)
+{
+	struct sched_proc_data *sd = &p->ksched_data;
+	uint64_t credit = usec2tsc(TIMER_TICK_USEC);
+	struct proc *i;
+
+	/* Wakeups onto different queues can race; only one wins */
+	if (!atomic_cas_ptr((void**)&sd->runq, 0, rq))
+		return;
+	sd->vruntime = scp_vruntime(p, FALSE);
+	sd->scp_ticks = vcore_account_gettotal(p, 0);
+	/* Sleepers get a little credit, but not enough to hog the core */
+	if (rq->min_vruntime > credit)
+		sd->vruntime = MAX(sd->vruntime, rq->min_vruntime - credit);
+	rq->nr_runnable++;
+	TAILQ_FOREACH(i, &rq->runnable, ksched_data.proc_link) {
+		if (i->ksched_data.vruntime > sd->vruntime) {
+			TAILQ_INSERT_BEFORE(i, p, ksched_data.proc_link);
+			return;
+		}
+	}
+	TAILQ_INSERT_TAIL(&rq->runnable, p, ksched_data.proc_link);
+}
+
+/* Hold rq's lock, and p must be on rq */
+static void __scp_dequeue(struct scp_runq *rq, struct proc *p)
+{
+	TAILQ_REMOVE(&rq->runnable, p, ksched_data.proc_link);
+	rq->nr_runnable--;
+	p->ksched_data.runq = 0;
+}
+
+/* Takes p off whatever SCP run queue it's on, if any */
+static void scp_runq_remove(struct proc *p)
+{
+	struct scp_runq *rq;
+
+	while ((rq = ACCESS_ONCE(p->ksched_data.runq))) {
+		spin_lock(&rq->lock);
+		if (p->ksched_data.runq == rq) {
+			__scp_dequeue(rq, p);
+			spin_unlock(&rq->lock);
+			return;
+		}
+		spin_unlock(&rq->lock);
+	}
+}
+
+/* Picks the queue for a waking SCP.  We stick with the last core it ran on,
+ * unless another LL core's queue is shorter by more than one. */
+static uint32_t scp_wakeup_core(struct proc *p)
+{
+	uint32_t best = p->ksched_data.scp_core;
+
+	if (!is_ll_core(best))
+		best = 0;
+	for (int i = 0; i < num_cores; i++) {
+		if (!is_ll_core(i))
+			continue;
+		if (ACCESS_ONCE(scp_runqs[i].nr_runnable) + 1 <
+		    ACCESS_ONCE(scp_runqs[best].nr_runnable))
+			best = i;
+	}
+	return best;
+}
+
+/* Takes the next SCP from the busiest other LL core's queue, for our idle core.
+ * Returns it with a ref, or 0 if there was nothing to steal. */
+static struct proc *scp_steal(struct scp_runq *rq)
+{
+	struct scp_runq *victim = 0;
+	struct proc *p;
+	int64_t lag;
+
+	for (int i = 0; i < num_cores; i++) {
+		if (!is_ll_core(i) || &scp_runqs[i] == rq)
+			continue;
+		if (!victim || ACCESS_ONCE(scp_runqs[i].nr_runnable) >
+		               ACCESS_ONCE(victim->nr_runnable))
+			victim = &scp_runqs[i];
+	}
+	if (!victim || !ACCESS_ONCE(victim->nr_runnable))
+		return 0;
+	spin_lock(&victim->lock);
+	p = TAILQ_FIRST(&victim->runnable);
+	if (p) {
+		__scp_dequeue(victim, p);
+		proc_incref(p, 1);
+		/* Carry its place in line over to our queue's clock */
+		lag = p->ksched_data.vruntime - victim->min_vruntime;
+		p->ksched_data.vruntime = MAX((int64_t)rq->min_vruntime + lag, 0);
+	}
+	spin_unlock(&victim->lock);
+	return p;
+}
+
 /************** Process Management Callbacks **************/
 /* a couple notes:
  * - the proc lock is NOT held for any of these calls.  currently, there is no
@@ -164,7 +367,7 @@ void __sched_proc_register(struct proc *p)
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
 	spin_lock(&sched_lock);
 	corealloc_proc_init(p);
-	add_to_list(p, &unrunnable_scps);
+	p->ksched_data.core_shares = CORE_SHARES_DEFAULT;
 	spin_unlock(&sched_lock);
 }
 
@@ -184,10 +387,10 @@ void __sched_proc_change_to_m(struct proc *p)
 		printk("[kernel] process needs to specify amt_wanted\n");
 		p->procdata->res_req[RES_CORES].amt_wanted = 1;
 	}
-	/* For now, this should only ever be called on an unrunnable.  It's
-	 * probably a bug, at this stage in development, to do o/w. */
-	remove_from_list(p, &unrunnable_scps);
-	//remove_from_any_list(p); 	/* ^^ instead of this */
+	/* For now, this should only ever be called on a running SCP, which is not
+	 * on a run queue.  It's probably a bug, at this stage in development, to do
+	 * o/w. */
+	scp_runq_remove(p);
 	add_to_list(p, primary_mcps);
 	spin_unlock(&sched_lock);
 	//poke_ksched(p, RES_CORES);
@@ -208,8 +411,16 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 	/* Remove from whatever list we are on (if any - might not be on one if it
 	 * was in the middle of __run_mcp_sched) */
 	remove_from_any_list(p);
+	scp_runq_remove(p);
 	if (nr_cores)
 		__track_core_dealloc_bulk(p, pc_arr, nr_cores);
+	/* Our pointers to p are weak; don't let them outlive p */
+	for (int i = 0; i < num_cores; i++) {
+		if (core_revocations[i].victim == p) {
+			core_revocations[i].victim = 0;
+			nr_revocations--;
+		}
+	}
 	spin_unlock(&sched_lock);
 	/* Drop the cradle-to-the-grave reference, jet-li */
 	proc_decref(p);
@@ -224,6 +435,7 @@ void __sched_mcp_wakeup(struct proc *p)
 		return;
 	}
 	/* could try and prioritize p somehow (move it to the front of the list). */
+	__ksched_tick_start();
 	spin_unlock(&sched_lock);
 	/* note they could be dying at this point too. */
 	poke(&ksched_poker, p);
@@ -232,31 +444,33 @@ void __sched_mcp_wakeup(struct proc *p)
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_scp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
+	uint32_t coreid = scp_wakeup_core(p);
+	struct scp_runq *rq = &scp_runqs[coreid];
+
+	spin_lock(&rq->lock);
+	/* Checking under the runq lock, so we don't race with
+	 * __sched_proc_destroy() taking it off the queue. */
 	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
+		spin_unlock(&rq->lock);
 		return;
 	}
-	/* might not be on a list if it is new.  o/w, it should be unrunnable */
-	remove_from_any_list(p);
-	add_to_list(p, &runnable_scps);
-	spin_unlock(&sched_lock);
-	/* we could be on a CG core, and all the mgmt cores could be halted.  if we
-	 * don't tell one of them about the new proc, they will sleep until the
-	 * timer tick goes off. */
-	if (!management_core()) {
-		/* TODO: pick a better core and only send if halted.
+	__scp_enqueue(rq, p);
+	spin_unlock(&rq->lock);
+	/* Only need the big lock if the tick is off (tickless) */
+	if (!ACCESS_ONCE(ksched_tick_on)) {
+		spin_lock(&sched_lock);
+		__ksched_tick_start();
+		spin_unlock(&sched_lock);
+	}
+	/* the LL core we picked could be halted.  if we don't tell it about the new
+	 * proc, it will sleep until the timer tick goes off. */
+	if (coreid != core_id()) {
+		/* TODO: only send if halted.
 		 *
 		 * FYI, a POKE on x86 might lose a rare race with halt code, since the
 		 * poke handler does not abort halts.  if this happens, the next timer
-		 * IRQ would wake up the core.
-		 *
-		 * ideally, we'd know if a specific mgmt core is sleeping and wake it
-		 * up.  o/w, we could interrupt an already-running mgmt core that won't
-		 * get to our new proc anytime soon.  also, by poking core 0, a
-		 * different mgmt core could remain idle (and this process would sleep)
-		 * until its tick goes off */
-		send_ipi(0, I_POKE_CORE);
+		 * IRQ would wake up the core. */
+		send_ipi(coreid, I_POKE_CORE);
 	}
 }
 
@@ -281,58 +495,99 @@ void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 	/* could trigger a sched decision here */
 }
 
-/* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
-static bool __schedule_scp(void)
+/* Callback for a core that p yielded to target.  The core moves from p to
+ * target without hitting the idle list, unless it is provisioned to someone
+ * else.  Those go back to the ksched, so it can give them to their owner.
+ * Returns TRUE if target has the core.  No proc locks are held. */
+bool __sched_donate_core(struct proc *p, struct proc *target, uint32_t coreid)
+{
+	struct proc *prov_proc;
+
+	spin_lock(&sched_lock);
+	prov_proc = get_prov_proc(coreid);
+	if ((prov_proc && prov_proc != target) || target->state == PROC_DYING) {
+		spin_unlock(&sched_lock);
+		return FALSE;
+	}
+	__track_core_dealloc(p, coreid);
+	__track_core_alloc(target, coreid);
+	spin_unlock(&sched_lock);
+	return TRUE;
+}
+
+/* LL cores should call this to schedule the calling core and give it to an
+ * SCP.  Don't hold the sched_lock.  returns TRUE if it scheduled a proc. */
+static bool schedule_scp(void)
 {
 	// TODO: sort out lock ordering (proc_run_s also locks)
-	struct proc *p;
+	struct proc *p, *owner;
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
-	/* if there are any runnables, run them here and put any currently running
-	 * SCP on the tail of the runnable queue. */
-	if ((p = TAILQ_FIRST(&runnable_scps))) {
-		/* someone is currently running, dequeue them */
-		if (pcpui->owning_proc) {
-			spin_lock(&pcpui->owning_proc->proc_lock);
-			/* process might be dying, with a KMSG to clean it up waiting on
-			 * this core.  can't do much, so we'll attempt to restart */
-			if (pcpui->owning_proc->state == PROC_DYING) {
-				send_kernel_message(core_id(), __just_sched, 0, 0, 0,
-				                    KMSG_ROUTINE);
-				spin_unlock(&pcpui->owning_proc->proc_lock);
-				return FALSE;
-			}
-			printd("Descheduled %d in favor of %d\n", pcpui->owning_proc->pid,
-			       p->pid);
-			__proc_set_state(pcpui->owning_proc, PROC_RUNNABLE_S);
-			/* Saving FP state aggressively.  Odds are, the SCP was hit by an
-			 * IRQ and has a HW ctx, in which case we must save. */
-			__proc_save_fpu_s(pcpui->owning_proc);
-			__proc_save_context_s(pcpui->owning_proc);
-			vcore_account_offline(pcpui->owning_proc, 0);
-			__seq_start_write(&p->procinfo->coremap_seqctr);
-			__unmap_vcore(p, 0);
-			__seq_end_write(&p->procinfo->coremap_seqctr);
-			spin_unlock(&pcpui->owning_proc->proc_lock);
-			/* round-robin the SCPs (inserts at the end of the queue) */
-			switch_lists(pcpui->owning_proc, &unrunnable_scps, &runnable_scps);
-			clear_owning_proc(pcoreid);
-			/* Note we abandon core.  It's not strictly necessary.  If
-			 * we didn't, the TLB would still be loaded with the old
-			 * one, til we proc_run_s, and the various paths in
-			 * proc_run_s would pick it up.  This way is a bit safer for
-			 * future changes, but has an extra (empty) TLB flush.  */
-			abandon_core();
-		} 
-		/* Run the new proc */
-		switch_lists(p, &runnable_scps, &unrunnable_scps);
-		printd("PID of the SCP i'm running: %d\n", p->pid);
-		proc_run_s(p);	/* gives it core we're running on */
-		return TRUE;
+	struct scp_runq *rq = &scp_runqs[pcoreid];
+
+	owner = pcpui->owning_proc;
+	spin_lock(&rq->lock);
+	p = TAILQ_FIRST(&rq->runnable);
+	/* Let our SCP run until it has run more than the next one in line */
+	if (p && owner && scp_vruntime(owner, TRUE) <= p->ksched_data.vruntime)
+		p = 0;
+	if (p) {
+		__scp_dequeue(rq, p);
+		rq->min_vruntime = MAX(rq->min_vruntime, p->ksched_data.vruntime);
+		/* the queue's ref was the cradle-to-grave ref; we need our own once
+		 * we unlock */
+		proc_incref(p, 1);
 	}
-	return FALSE;
+	spin_unlock(&rq->lock);
+	if (!p && !owner)
+		p = scp_steal(rq);
+	if (!p)
+		return FALSE;
+	/* someone is currently running, dequeue them */
+	if (owner) {
+		spin_lock(&owner->proc_lock);
+		/* process might be dying, with a KMSG to clean it up waiting on
+		 * this core.  can't do much, so we'll attempt to restart */
+		if (owner->state == PROC_DYING) {
+			send_kernel_message(core_id(), __just_sched, 0, 0, 0,
+			                    KMSG_ROUTINE);
+			spin_unlock(&owner->proc_lock);
+			spin_lock(&rq->lock);
+			__scp_enqueue(rq, p);
+			spin_unlock(&rq->lock);
+			proc_decref(p);
+			return FALSE;
+		}
+		printd("Descheduled %d in favor of %d\n", owner->pid, p->pid);
+		__proc_set_state(owner, PROC_RUNNABLE_S);
+		/* Saving FP state aggressively.  Odds are, the SCP was hit by an
+		 * IRQ and has a HW ctx, in which case we must save. */
+		__proc_save_fpu_s(owner);
+		__proc_save_context_s(owner);
+		vcore_account_offline(owner, 0);
+		__seq_start_write(&p->procinfo->coremap_seqctr);
+		__unmap_vcore(p, 0);
+		__seq_end_write(&p->procinfo->coremap_seqctr);
+		spin_unlock(&owner->proc_lock);
+		/* back in line, by its vruntime.  must do this before we drop the
+		 * owning_proc ref. */
+		spin_lock(&rq->lock);
+		__scp_enqueue(rq, owner);
+		spin_unlock(&rq->lock);
+		clear_owning_proc(pcoreid);
+		/* Note we abandon core.  It's not strictly necessary.  If
+		 * we didn't, the TLB would still be loaded with the old
+		 * one, til we proc_run_s, and the various paths in
+		 * proc_run_s would pick it up.  This way is a bit safer for
+		 * future changes, but has an extra (empty) TLB flush.  */
+		abandon_core();
+	}
+	/* Run the new proc */
+	printd("PID of the SCP i'm running: %d\n", p->pid);
+	p->ksched_data.scp_core = pcoreid;
+	proc_run_s(p);	/* gives it core we're running on */
+	proc_decref(p);
+	return TRUE;
 }
 
 /* Returns how many new cores p needs.  This doesn't lock the proc, so your
@@ -371,61 +626,247 @@ static uint32_t get_cores_needed(struct proc *p)
 	return amt_wanted - amt_granted;
 }
 
+/* Helper: the order in which we service MCPs that want cores.  Those with
+ * deadlines go first, earliest deadline first.  Everyone else goes by how few
+ * cores they have per share.  Ties keep the list order (FCFS). */
+static bool __mcp_before(struct proc *a, struct proc *b)
+{
+	struct sched_proc_data *sa = &a->ksched_data;
+	struct sched_proc_data *sb = &b->ksched_data;
+
+	if (sa->core_deadline && sb->core_deadline)
+		return sa->want_since + usec2tsc(sa->core_deadline) <
+		       sb->want_since + usec2tsc(sb->core_deadline);
+	if (sa->core_deadline || sb->core_deadline)
+		return sa->core_deadline != 0;
+	return (uint64_t)a->procinfo->res_grant[RES_CORES] * sb->core_shares <
+	       (uint64_t)b->procinfo->res_grant[RES_CORES] * sa->core_shares;
+}
+
+/* Helper: how many cores p should have, out of the pool left over after the
+ * deadline MCPs, given the shares of everyone that wants cores. */
+static uint32_t __mcp_entitlement(struct proc *p, uint32_t pool,
+                                  uint64_t total_shares)
+{
+	if (!total_shares)
+		return 0;
+	return pool * (uint64_t)p->ksched_data.core_shares / total_shares;
+}
+
+/* Helper: revokes the warned cores whose time is up.  Like __core_request, this
+ * unlocks the sched_lock for a bit, relying on being the only preemptor. */
+static void __revoke_due_cores(void)
+{
+	struct core_revocation *rv;
+	struct proc *victims[num_cores];
+	uint32_t pcoreids[num_cores];
+	bool success[num_cores];
+	uint32_t nr_due = 0;
+	uint64_t now = read_tsc();
+
+	if (!nr_revocations)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		rv = &core_revocations[i];
+		if (!rv->victim)
+			continue;
+		/* They yielded it, or it was taken some other way */
+		if (get_alloc_proc(i) != rv->victim) {
+			rv->victim = 0;
+			nr_revocations--;
+			continue;
+		}
+		if (now < rv->when)
+			continue;
+		victims[nr_due] = rv->victim;
+		pcoreids[nr_due] = i;
+		nr_due++;
+		proc_incref(rv->victim, 1);
+		rv->victim = 0;
+		nr_revocations--;
+	}
+	if (!nr_due)
+		return;
+	spin_unlock(&sched_lock);
+	for (int i = 0; i < nr_due; i++) {
+		/* Unlocked peek; proc_preempt_core() rechecks the mapping */
+		success[i] = victims[i]->state == PROC_RUNNING_M &&
+		             proc_preempt_core(victims[i], pcoreids[i], 0);
+	}
+	spin_lock(&sched_lock);
+	for (int i = 0; i < nr_due; i++) {
+		/* On failure, whoever unmapped the core will put it on the idle list.
+		 * We don't want the core ourselves, so no need to wait for them. */
+		if (success[i])
+			__track_core_dealloc(victims[i], pcoreids[i]);
+		proc_decref(victims[i]);
+	}
+}
+
+/* Helper: if MCPs under their share (or with deadlines) still want cores, warn
+ * MCPs over their share that they're about to lose some.  Call after servicing
+ * requests, with all MCPs on the secondary list.  Unlocks the sched_lock for a
+ * bit. */
+static void __warn_revocations(void)
+{
+	struct proc *p;
+	struct sched_proc_data *sd;
+	struct proc *victims[num_cores];
+	uint32_t pcoreids[num_cores];
+	uint32_t pool = max_vcores(0);
+	uint32_t granted, needed, entitled, over, nr_warns = 0;
+	uint64_t total_shares = 0;
+	uint64_t now = read_tsc();
+	uint64_t warn_usec = REVOKE_WARN_USEC;
+	uint64_t deadline;
+	long shortfall = 0;
+
+	/* Deadline MCPs come off the top; the rest split what's left */
+	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link) {
+		if (p->state == PROC_WAITING)
+			continue;
+		sd = &p->ksched_data;
+		granted = p->procinfo->res_grant[RES_CORES];
+		needed = get_cores_needed(p);
+		if (!sd->core_deadline) {
+			total_shares += sd->core_shares;
+			continue;
+		}
+		pool -= MIN(pool, granted + needed);
+		if (!needed)
+			continue;
+		shortfall += needed;
+		deadline = sd->want_since + usec2tsc(sd->core_deadline);
+		warn_usec = MIN(warn_usec, now < deadline ? tsc2usec(deadline - now)
+		                                          : 0);
+	}
+	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link) {
+		if (p->state == PROC_WAITING || p->ksched_data.core_deadline)
+			continue;
+		granted = p->procinfo->res_grant[RES_CORES];
+		entitled = __mcp_entitlement(p, pool, total_shares);
+		if (granted < entitled)
+			shortfall += MIN(get_cores_needed(p), entitled - granted);
+	}
+	/* Cores we already warned about are on their way */
+	shortfall -= nr_revocations;
+	if (shortfall <= 0)
+		return;
+	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link) {
+		if (p->ksched_data.core_deadline)
+			continue;
+		granted = p->procinfo->res_grant[RES_CORES];
+		entitled = __mcp_entitlement(p, pool, total_shares);
+		if (granted <= entitled)
+			continue;
+		over = granted - entitled;
+		for (int i = 0; i < num_cores && over && shortfall; i++) {
+			if (get_alloc_proc(i) != p)
+				continue;
+			if (core_revocations[i].victim == p) {
+				over--;
+				continue;
+			}
+			/* Cores provisioned to p are p's to keep */
+			if (get_prov_proc(i) == p)
+				continue;
+			core_revocations[i].victim = p;
+			core_revocations[i].when = now + usec2tsc(warn_usec);
+			nr_revocations++;
+			victims[nr_warns] = p;
+			pcoreids[nr_warns] = i;
+			nr_warns++;
+			proc_incref(p, 1);
+			over--;
+			shortfall--;
+		}
+		if (!shortfall)
+			break;
+	}
+	if (!nr_warns)
+		return;
+	reset_alarm_abs(&per_cpu_info[0].tchain, &revoke_waiter,
+	                now + usec2tsc(warn_usec));
+	spin_unlock(&sched_lock);
+	/* If the warning doesn't land, __revoke_due_cores() will notice the core
+	 * changed hands. */
+	for (int i = 0; i < nr_warns; i++)
+		proc_preempt_warn_core(victims[i], pcoreids[i], warn_usec);
+	spin_lock(&sched_lock);
+	for (int i = 0; i < nr_warns; i++)
+		proc_decref(victims[i]);
+}
+
 /* Actual work of the MCP kscheduler.  if we were called by poke_ksched, *arg
  * might be the process who wanted special service.  this would be the case if
  * we weren't already running the ksched.  Sort of a ghetto way to "post work",
  * such that it's an optimization. */
 static void __run_mcp_ksched(void *arg)
 {
-	struct proc *p, *temp;
+	struct proc *p, *temp, *best;
 	uint32_t amt_needed;
 	struct proc_list *temp_mcp_list;
 	/* locking to protect the MCP lists' integrity and membership */
 	spin_lock(&sched_lock);
-	/* 2-pass scheme: check each proc on the primary list (FCFS).  if they need
-	 * nothing, put them on the secondary list.  if they need something, rip
-	 * them off the list, service them, and if they are still not dying, put
-	 * them on the secondary list.  We cull the entire primary list, so that
-	 * when we start from the beginning each time, we aren't repeatedly checking
-	 * procs we looked at on previous waves.
+	/* Take back cores from anyone whose warning is up, so the procs that need
+	 * them can have them below. */
+	__revoke_due_cores();
+	/* 2-pass scheme: check each proc on the primary list.  if they need
+	 * nothing, put them on the secondary list.  of those that need something,
+	 * rip the first in line (see __mcp_before()) off the list, service it, and
+	 * if it is still not dying, put it on the secondary list.  We cull the
+	 * entire primary list, so that when we start from the beginning each time,
+	 * we aren't repeatedly checking procs we looked at on previous waves.
 	 *
 	 * TODO: we could modify this such that procs that we failed to service move
 	 * to yet another list or something.  We can also move the WAITINGs to
 	 * another list and have wakeup move them back, etc. */
 	while (!TAILQ_EMPTY(primary_mcps)) {
+		best = 0;
 		TAILQ_FOREACH_SAFE(p, primary_mcps, ksched_data.proc_link, temp) {
 			if (p->state == PROC_WAITING) {	/* unlocked peek at the state */
+				p->ksched_data.want_since = 0;
 				switch_lists(p, primary_mcps, secondary_mcps);
 				continue;
 			}
-			amt_needed = get_cores_needed(p);
-			if (!amt_needed) {
+			if (!get_cores_needed(p)) {
+				p->ksched_data.want_since = 0;
 				switch_lists(p, primary_mcps, secondary_mcps);
 				continue;
 			}
-			/* o/w, we want to give cores to this proc */
-			remove_from_list(p, primary_mcps);
-			/* now it won't die, but it could get removed from lists and have
-			 * its stuff unprov'd when we unlock */
-			proc_incref(p, 1);
-			/* GIANT WARNING: __core_req will unlock the sched lock for a bit.
-			 * It will return with it locked still.  We could unlock before we
-			 * pass in, but they will relock right away. */
-			// notionally_unlock(&ksched_lock);	/* for mouse-eyed viewers */
-			__core_request(p, amt_needed);
-			// notionally_lock(&ksched_lock);
-			/* Peeking at the state is okay, since we hold a ref.  Once it is
-			 * DYING, it'll remain DYING until we decref.  And if there is a
-			 * concurrent death, that will spin on the ksched lock (which we
-			 * hold, and which protects the proc lists). */
-			if (p->state != PROC_DYING)
-				add_to_list(p, secondary_mcps);
-			proc_decref(p);			/* fyi, this may trigger __proc_free */
-			/* need to break: the proc lists may have changed when we unlocked
-			 * in core_req in ways that the FOREACH_SAFE can't handle. */
-			break;
+			if (!p->ksched_data.want_since)
+				p->ksched_data.want_since = read_tsc();
+			if (!best || __mcp_before(p, best))
+				best = p;
 		}
+		if (!best)
+			break;
+		/* o/w, we want to give cores to this proc */
+		p = best;
+		amt_needed = get_cores_needed(p);
+		remove_from_list(p, primary_mcps);
+		/* now it won't die, but it could get removed from lists and have
+		 * its stuff unprov'd when we unlock */
+		proc_incref(p, 1);
+		/* GIANT WARNING: __core_req will unlock the sched lock for a bit.
+		 * It will return with it locked still.  We could unlock before we
+		 * pass in, but they will relock right away. */
+		// notionally_unlock(&ksched_lock);	/* for mouse-eyed viewers */
+		__core_request(p, amt_needed);
+		// notionally_lock(&ksched_lock);
+		/* Peeking at the state is okay, since we hold a ref.  Once it is
+		 * DYING, it'll remain DYING until we decref.  And if there is a
+		 * concurrent death, that will spin on the ksched lock (which we
+		 * hold, and which protects the proc lists). */
+		if (p->state != PROC_DYING)
+			add_to_list(p, secondary_mcps);
+		proc_decref(p);			/* fyi, this may trigger __proc_free */
+		/* the proc lists may have changed when we unlocked in core_req, so
+		 * we start over from the top of the primary list. */
 	}
+	/* Whoever is still short on cores can take them from those over their
+	 * share, after a warning. */
+	__warn_revocations();
 	/* at this point, we moved all the procs over to the secondary list, and
 	 * attempted to service the ones that wanted something.  now just swap the
 	 * lists for the next invocation of the ksched. */
@@ -447,11 +888,8 @@ void run_scheduler(void)
 	/* MCP scheduling: post work, then poke.  for now, i just want the func to
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
-	if (management_core()) {
-		spin_lock(&sched_lock);
-		__schedule_scp();
-		spin_unlock(&sched_lock);
-	}
+	if (is_ll_core(core_id()))
+		schedule_scp();
 }
 
 /* A process is asking the ksched to look at its resource desires.  The
@@ -463,6 +901,10 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 	 * other structs/flags) */
 	if (!__proc_is_mcp(p))
 		return;
+	/* in case we can't give them what they want right away */
+	spin_lock(&sched_lock);
+	__ksched_tick_start();
+	spin_unlock(&sched_lock);
 	poke(&ksched_poker, p);
 }
 
@@ -473,11 +915,9 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 void cpu_bored(void)
 {
 	bool new_proc = FALSE;
-	if (!management_core())
+	if (!is_ll_core(core_id()))
 		return;
-	spin_lock(&sched_lock);
-	new_proc = __schedule_scp();
-	spin_unlock(&sched_lock);
+	new_proc = schedule_scp();
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
 	if (new_proc) {
@@ -550,9 +990,9 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		 * out, so we exit the loop. */
 		if (pcoreid == -1)
 			break;
-		/* If the pcore chosen currently has a proc allocated to it, we know
-		 * it must be provisioned to p, but not allocated to it. We need to try
-		 * to preempt. After this block, the core will be track_dealloc'd and
+		/* If the pcore chosen currently has a proc allocated to it, it is
+		 * provisioned to p, but not allocated to it, or the core allocator
+		 * decided p outranks its owner. We need to try to preempt. After this block, the core will be track_dealloc'd and
 		 * on the idle list (regardless of whether we had to preempt or not) */
 		if (get_alloc_proc(pcoreid)) {
 			proc_to_preempt = get_alloc_proc(pcoreid);
@@ -683,11 +1123,16 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 void sched_diag(void)
 {
 	struct proc *p;
+	for (int i = 0; i < num_cores; i++) {
+		if (!is_ll_core(i))
+			continue;
+		spin_lock(&scp_runqs[i].lock);
+		TAILQ_FOREACH(p, &scp_runqs[i].runnable, ksched_data.proc_link)
+			printk("Runnable _S PID: %d on core %d, vruntime %llu\n", p->pid,
+			       i, p->ksched_data.vruntime);
+		spin_unlock(&scp_runqs[i].lock);
+	}
 	spin_lock(&sched_lock);
-	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
-		printk("Runnable _S PID: %d\n", p->pid);
-	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
-		printk("Unrunnable _S PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link)
 		printk("Primary MCP PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
@@ -714,7 +1159,7 @@ void print_all_resources(void)
 		print_resources((struct proc*)item);
 	}
 	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources, NULL);
+	__pid_hash_for_each(__print_resources, NULL);
 	spin_unlock(&pid_hash_lock);
 }
 
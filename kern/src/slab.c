@@ -6,19 +6,29 @@
  *
  * Slab allocator, based on the SunOS 5.4 allocator paper.
  *
- * Note that we don't have a hash table for buf to bufctl for the large buffer
- * objects, so we use the same style for small objects: store the pointer to the
- * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
- */
+ * Large objects find their bufctl via the cache's allocated-buffer hash table,
+ * like in the paper.  Small objects still store the pointer to the next free
+ * object at the top of the slab object.
+ *
+ * The magazine layer (see slab.h) sits on top of the slab functions.  Objects
+ * in magazines are still constructed and still count as allocated from the
+ * slab layer's point of view (nr_cur_alloc). */
 
 #include <slab.h>
 #include <stdio.h>
 #include <assert.h>
 #include <pmap.h>
 #include <kmalloc.h>
+#include <percpu.h>
+#include <smp.h>
+#include <kthread.h>
+#include <kmem_acct.h>
 
 struct kmem_cache_list kmem_caches;
 spinlock_t kmem_caches_lock;
+/* The cache kmem_cache_reap_all() is working on, protected by the
+ * kmem_caches_lock.  Destroyers wait for the reaper to move on. */
+static struct kmem_cache *kmem_reaping;
 
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
@@ -26,7 +36,25 @@ static bool kmem_cache_grow(struct kmem_cache *cp);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
-struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache, *kmem_magazine_cache;
+
+/* Set once num_cores is known and we can build per-core caches */
+static bool kmem_pcpu_ready;
+
+/* The 2MB chunk KMC_HUGE slabs are carved from: [next, end) is what's left */
+static struct {
+	spinlock_t lock;
+	uintptr_t next;
+	uintptr_t end;
+} kmem_chunk = {.lock = SPINLOCK_INITIALIZER_IRQSAVE};
+
+static void kmem_cache_init_pcpu(struct kmem_cache *kc)
+{
+	if (kc->flags & KMC_NOMAG)
+		return;
+	kc->pcpu_caches = kzmalloc_align(sizeof(struct kmem_pcpu_cache) *
+	                                 num_cores, 0, ARCH_CL_SIZE);
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -35,17 +63,37 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 {
 	assert(kc);
 	assert(align);
-	spinlock_init_irqsave(&kc->cache_lock);
+	mcs_lock_init(&kc->cache_lock);
 	kc->name = name;
 	kc->obj_size = obj_size;
 	kc->align = align;
 	kc->flags = flags;
+	kc->acct_off = 0;
+	if (flags & KMC_ACCT) {
+		kc->acct_off = ROUNDUP(obj_size, sizeof(struct kmem_acct*));
+		kc->obj_size = kc->acct_off + sizeof(struct kmem_acct*);
+	}
 	TAILQ_INIT(&kc->full_slab_list);
 	TAILQ_INIT(&kc->partial_slab_list);
 	TAILQ_INIT(&kc->empty_slab_list);
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
+	kc->pcpu_caches = NULL;
+	spinlock_init_irqsave(&kc->depot.lock);
+	SLIST_INIT(&kc->depot.full);
+	SLIST_INIT(&kc->depot.empty);
+	kc->depot.nr_full = 0;
+	kc->depot.nr_empty = 0;
+	kc->depot.nr_full_min = 0;
+	kc->depot.nr_empty_min = 0;
+	for (int i = 0; i < KMC_HASH_INIT_SZ; i++)
+		SLIST_INIT(&kc->static_hash[i]);
+	kc->alloc_hash = kc->static_hash;
+	kc->hh_nr_buckets = KMC_HASH_INIT_SZ;
+	kc->hh_nr_items = 0;
+	if (kmem_pcpu_ready)
+		kmem_cache_init_pcpu(kc);
 	
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
@@ -79,7 +127,28 @@ void kmem_cache_init(void)
 	kmem_bufctl_cache = kmem_cache_create("kmem_bufctl",
 	                         sizeof(struct kmem_bufctl),
 	                         __alignof__(struct kmem_bufctl), 0, NULL, NULL); 
+	/* Magazines for the magazine cache would need magazines... */
+	kmem_magazine_cache = kmem_cache_create("kmem_magazine",
+	                           sizeof(struct kmem_magazine),
+	                           __alignof__(struct kmem_magazine), KMC_NOMAG,
+	                           NULL, NULL);
+}
+
+/* Turns on the magazine layer for all existing caches.  Runs once the per-cpu
+ * data exists, while we're still single-core.  Caches made after this get
+ * their per-core caches in __kmem_cache_create. */
+static void kmem_cache_pcpu_init(void)
+{
+	struct kmem_cache *i;
+
+	/* No need for the kmem_caches_lock; no one else is running yet.  Holding
+	 * it would also invert the cache_lock -> kmem_caches_lock order, since we
+	 * kmalloc in here. */
+	SLIST_FOREACH(i, &kmem_caches, link)
+		kmem_cache_init_pcpu(i);
+	kmem_pcpu_ready = TRUE;
 }
+DEFINE_PERCPU_INIT(kmem_cache_pcpu_init);
 
 /* Cache management */
 struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
@@ -92,7 +161,9 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
 	return kc;
 }
 
-static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
+/* Returns the number of pages freed. */
+static size_t kmem_slab_destroy(struct kmem_cache *cp,
+                                struct kmem_slab *a_slab)
 {
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
 		/* Deconstruct all the objects, if necessary */
@@ -104,6 +175,7 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			}
 		}
 		page_decref(kva2page((void*)ROUNDDOWN((uintptr_t)a_slab, PGSIZE)));
+		return 1;
 	} else {
 		struct kmem_bufctl *i;
 		void *page_start = (void*)-1;
@@ -117,7 +189,7 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			// Track the lowest buffer address, which is the start of the buffer
 			page_start = MIN(page_start, i->buf_addr);
 			/* Deconstruct all the objects, if necessary */
-			if (cp->dtor) // TODO: (BUF)
+			if (cp->dtor)
 				cp->dtor(i->buf_addr, cp->obj_size);
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
@@ -125,39 +197,83 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 		free_cont_pages(page_start, order_pg_alloc);
 		// free the slab object
 		kmem_cache_free(kmem_slab_cache, a_slab);
+		return 1 << order_pg_alloc;
 	}
 }
 
-/* Once you call destroy, never use this cache again... o/w there may be weird
- * races, and other serious issues.  */
-void kmem_cache_destroy(struct kmem_cache *cp)
+static struct kmem_bufctl_slist *__buf_hash_bucket(struct kmem_cache *cp,
+                                                   void *buf)
 {
-	struct kmem_slab *a_slab, *next;
+	/* Large objects are at least SLAB_LARGE_CUTOFF apart, so the low bits of
+	 * buf are useless for hashing. */
+	uintptr_t key = (uintptr_t)buf >> LOG2_DOWN(SLAB_LARGE_CUTOFF);
 
-	spin_lock_irqsave(&cp->cache_lock);
-	assert(TAILQ_EMPTY(&cp->full_slab_list));
-	assert(TAILQ_EMPTY(&cp->partial_slab_list));
-	/* Clean out the empty list.  We can't use a regular FOREACH here, since the
-	 * link element is stored in the slab struct, which is stored on the page
-	 * that we are freeing. */
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-	while (a_slab) {
-		next = TAILQ_NEXT(a_slab, link);
-		kmem_slab_destroy(cp, a_slab);
-		a_slab = next;
+	return &cp->alloc_hash[key & (cp->hh_nr_buckets - 1)];
+}
+
+/* Doubles the hash table, moving to page-allocated tables once we outgrow the
+ * static one.  We can't kmalloc, since we hold the cache_lock and we might be a
+ * kmalloc cache.  If we're out of memory, we just keep the old table. */
+static void __kmem_hash_resize(struct kmem_cache *cp)
+{
+	struct kmem_bufctl_slist *old_hash = cp->alloc_hash;
+	size_t old_nr = cp->hh_nr_buckets;
+	struct kmem_bufctl *a_bufctl;
+	size_t new_nr, order;
+
+	new_nr = MAX(old_nr * 2, PGSIZE / sizeof(struct kmem_bufctl_slist));
+	order = LOG2_UP(ROUNDUP(new_nr * sizeof(struct kmem_bufctl_slist), PGSIZE)
+	                / PGSIZE);
+	cp->alloc_hash = get_cont_pages(order, 0);
+	if (!cp->alloc_hash) {
+		cp->alloc_hash = old_hash;
+		return;
 	}
-	spin_lock_irqsave(&kmem_caches_lock);
-	SLIST_REMOVE(&kmem_caches, cp, kmem_cache, link);
-	spin_unlock_irqsave(&kmem_caches_lock);
-	kmem_cache_free(&kmem_cache_cache, cp); 
-	spin_unlock_irqsave(&cp->cache_lock);
+	cp->hh_nr_buckets = new_nr;
+	for (int i = 0; i < new_nr; i++)
+		SLIST_INIT(&cp->alloc_hash[i]);
+	for (int i = 0; i < old_nr; i++) {
+		while ((a_bufctl = SLIST_FIRST(&old_hash[i]))) {
+			SLIST_REMOVE_HEAD(&old_hash[i], hash_link);
+			SLIST_INSERT_HEAD(__buf_hash_bucket(cp, a_bufctl->buf_addr),
+			                  a_bufctl, hash_link);
+		}
+	}
+	if (old_hash != cp->static_hash)
+		free_cont_pages(old_hash, LOG2_UP(ROUNDUP(old_nr *
+		                          sizeof(struct kmem_bufctl_slist), PGSIZE) /
+		                          PGSIZE));
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+static void __kmem_hash_insert(struct kmem_cache *cp,
+                               struct kmem_bufctl *a_bufctl)
+{
+	SLIST_INSERT_HEAD(__buf_hash_bucket(cp, a_bufctl->buf_addr), a_bufctl,
+	                  hash_link);
+	if (++cp->hh_nr_items > cp->hh_nr_buckets * KMC_HASH_LOAD)
+		__kmem_hash_resize(cp);
+}
+
+static struct kmem_bufctl *__kmem_hash_remove(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_bufctl_slist *bucket = __buf_hash_bucket(cp, buf);
+	struct kmem_bufctl *a_bufctl;
+
+	SLIST_FOREACH(a_bufctl, bucket, hash_link) {
+		if (a_bufctl->buf_addr == buf) {
+			SLIST_REMOVE(bucket, a_bufctl, kmem_bufctl, hash_link);
+			cp->hh_nr_items--;
+			return a_bufctl;
+		}
+	}
+	panic("Freeing %p, which was not allocated from cache %s", buf, cp->name);
+}
+
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp)
 {
+	struct mcs_lock_qnode qn;
 	void *retval = NULL;
-	spin_lock_irqsave(&cp->cache_lock);
+	mcs_lock_irqsave(&cp->cache_lock, &qn);
 	// look at partial list
 	struct kmem_slab *a_slab = TAILQ_FIRST(&cp->partial_slab_list);
 	// 	if none, go to empty list and get an empty and make it partial
@@ -165,11 +281,8 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 		// TODO: think about non-sleeping flags
 		if (TAILQ_EMPTY(&cp->empty_slab_list) &&
 			!kmem_cache_grow(cp)) {
-			spin_unlock_irqsave(&cp->cache_lock);
-			if (flags & KMALLOC_ERROR)
-				error(ENOMEM, ERROR_FIXME);
-			else
-				panic("[German Accent]: OOM for a small slab growth!!!");
+			mcs_unlock_irqsave(&cp->cache_lock, &qn);
+			return NULL;
 		}
 		// move to partial list
 		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
@@ -187,6 +300,7 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 		// rip the first bufctl out of the partial slab's buf list
 		struct kmem_bufctl *a_bufctl = TAILQ_FIRST(&a_slab->bufctl_freelist);
 		TAILQ_REMOVE(&a_slab->bufctl_freelist, a_bufctl, link);
+		__kmem_hash_insert(cp, a_bufctl);
 		retval = a_bufctl->buf_addr;
 	}
 	a_slab->num_busy_obj++;
@@ -196,22 +310,17 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 		TAILQ_INSERT_HEAD(&cp->full_slab_list, a_slab, link);
 	}
 	cp->nr_cur_alloc++;
-	spin_unlock_irqsave(&cp->cache_lock);
+	mcs_unlock_irqsave(&cp->cache_lock, &qn);
 	return retval;
 }
 
-static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
-{
-	// TODO: hash table for back reference (BUF)
-	return *((struct kmem_bufctl**)(buf + offset));
-}
-
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
+	struct mcs_lock_qnode qn;
 
-	spin_lock_irqsave(&cp->cache_lock);
+	mcs_lock_irqsave(&cp->cache_lock, &qn);
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
 		// find its slab
 		a_slab = (struct kmem_slab*)(ROUNDDOWN((uintptr_t)buf, PGSIZE) +
@@ -222,8 +331,7 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 		a_slab->free_small_obj = buf;
 	} else {
 		/* Give the bufctl back to the parent slab */
-		// TODO: (BUF) change the interface to not take an offset
-		a_bufctl = buf2bufctl(buf, cp->obj_size);
+		a_bufctl = __kmem_hash_remove(cp, buf);
 		a_slab = a_bufctl->my_slab;
 		TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
 	}
@@ -238,10 +346,285 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
 		TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
 	}
-	spin_unlock_irqsave(&cp->cache_lock);
+	mcs_unlock_irqsave(&cp->cache_lock, &qn);
+}
+
+/* Depot helpers.  Grab the depot lock before calling these. */
+static struct kmem_magazine *depot_get_full(struct kmem_depot *depot)
+{
+	struct kmem_magazine *mag = SLIST_FIRST(&depot->full);
+
+	if (!mag)
+		return NULL;
+	SLIST_REMOVE_HEAD(&depot->full, link);
+	depot->nr_full--;
+	depot->nr_full_min = MIN(depot->nr_full_min, depot->nr_full);
+	return mag;
+}
+
+static struct kmem_magazine *depot_get_empty(struct kmem_depot *depot)
+{
+	struct kmem_magazine *mag = SLIST_FIRST(&depot->empty);
+
+	if (!mag)
+		return NULL;
+	SLIST_REMOVE_HEAD(&depot->empty, link);
+	depot->nr_empty--;
+	depot->nr_empty_min = MIN(depot->nr_empty_min, depot->nr_empty);
+	return mag;
+}
+
+static void depot_put_full(struct kmem_depot *depot, struct kmem_magazine *mag)
+{
+	SLIST_INSERT_HEAD(&depot->full, mag, link);
+	depot->nr_full++;
+}
+
+static void depot_put_empty(struct kmem_depot *depot, struct kmem_magazine *mag)
+{
+	SLIST_INSERT_HEAD(&depot->empty, mag, link);
+	depot->nr_empty++;
+}
+
+/* Returns all of a magazine's rounds to the slab layer and frees it. */
+static void kmem_mag_destroy(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(cp, mag->rounds[i]);
+	__kmem_free_to_slab(kmem_magazine_cache, mag);
+}
+
+/* Tries to get an object from this core's magazines, swapping with the depot if
+ * needed.  Returns 0 if we need to go to the slab layer. */
+static void *__kmem_alloc_from_pcpu(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	void *retval = NULL;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pcc = &cp->pcpu_caches[core_id()];
+	if (pcc->loaded && pcc->loaded->nr_rounds)
+		goto pop;
+	if (pcc->prev && pcc->prev->nr_rounds) {
+		mag = pcc->loaded;
+		pcc->loaded = pcc->prev;
+		pcc->prev = mag;
+		goto pop;
+	}
+	spin_lock(&cp->depot.lock);
+	mag = depot_get_full(&cp->depot);
+	if (!mag) {
+		spin_unlock(&cp->depot.lock);
+		goto out;
+	}
+	/* prev is empty or NULL, and loaded is empty too */
+	if (pcc->prev)
+		depot_put_empty(&cp->depot, pcc->prev);
+	spin_unlock(&cp->depot.lock);
+	pcc->prev = pcc->loaded;
+	pcc->loaded = mag;
+pop:
+	retval = pcc->loaded->rounds[--pcc->loaded->nr_rounds];
+	pcc->nr_allocs++;
+out:
+	enable_irqsave(&irq_state);
+	return retval;
+}
+
+/* Tries to put an object in this core's magazines, swapping with the depot if
+ * needed.  Returns FALSE if we need to go to the slab layer. */
+static bool __kmem_free_to_pcpu(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pcc = &cp->pcpu_caches[core_id()];
+	if (pcc->loaded && pcc->loaded->nr_rounds < KMC_MAG_SZ)
+		goto push;
+	if (pcc->prev && !pcc->prev->nr_rounds) {
+		mag = pcc->loaded;
+		pcc->loaded = pcc->prev;
+		pcc->prev = mag;
+		goto push;
+	}
+	spin_lock(&cp->depot.lock);
+	mag = depot_get_empty(&cp->depot);
+	if (!mag) {
+		spin_unlock(&cp->depot.lock);
+		mag = __kmem_alloc_from_slab(kmem_magazine_cache);
+		if (!mag) {
+			enable_irqsave(&irq_state);
+			return FALSE;
+		}
+		mag->nr_rounds = 0;
+		spin_lock(&cp->depot.lock);
+	}
+	/* prev is full or NULL, and loaded is full too */
+	if (pcc->prev)
+		depot_put_full(&cp->depot, pcc->prev);
+	spin_unlock(&cp->depot.lock);
+	pcc->prev = pcc->loaded;
+	pcc->loaded = mag;
+push:
+	pcc->loaded->rounds[pcc->loaded->nr_rounds++] = buf;
+	pcc->nr_frees++;
+	enable_irqsave(&irq_state);
+	return TRUE;
+}
+
+/* Empties every core's magazines into the slab layer.  Only safe when no one
+ * is using the cache (i.e. destroy). */
+static void kmem_cache_drain_pcpu(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	for (int i = 0; i < num_cores; i++) {
+		pcc = &cp->pcpu_caches[i];
+		if (pcc->loaded)
+			kmem_mag_destroy(cp, pcc->loaded);
+		if (pcc->prev)
+			kmem_mag_destroy(cp, pcc->prev);
+		pcc->loaded = NULL;
+		pcc->prev = NULL;
+	}
+}
+
+/* Frees the magazines that were not needed since the last reap.  If all is
+ * set, we free every magazine in the depot. */
+static void kmem_depot_reap(struct kmem_cache *cp, bool all)
+{
+	struct kmem_mag_slist victims = SLIST_HEAD_INITIALIZER(victims);
+	struct kmem_magazine *mag;
+	unsigned long nr_full, nr_empty;
+
+	spin_lock_irqsave(&cp->depot.lock);
+	nr_full = all ? cp->depot.nr_full : cp->depot.nr_full_min;
+	nr_empty = all ? cp->depot.nr_empty : cp->depot.nr_empty_min;
+	for (int i = 0; i < nr_full; i++)
+		SLIST_INSERT_HEAD(&victims, depot_get_full(&cp->depot), link);
+	for (int i = 0; i < nr_empty; i++)
+		SLIST_INSERT_HEAD(&victims, depot_get_empty(&cp->depot), link);
+	/* Start a new working set interval */
+	cp->depot.nr_full_min = cp->depot.nr_full;
+	cp->depot.nr_empty_min = cp->depot.nr_empty;
+	spin_unlock_irqsave(&cp->depot.lock);
+	/* Can't use FOREACH, since the link is in the mag we're freeing */
+	while ((mag = SLIST_FIRST(&victims))) {
+		SLIST_REMOVE_HEAD(&victims, link);
+		kmem_mag_destroy(cp, mag);
+	}
+}
+
+/* Once you call destroy, never use this cache again... o/w there may be weird
+ * races, and other serious issues.  */
+void kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_slab *a_slab, *next;
+	struct mcs_lock_qnode qn;
+
+	spin_lock_irqsave(&kmem_caches_lock);
+	while (kmem_reaping == cp) {
+		spin_unlock_irqsave(&kmem_caches_lock);
+		kthread_yield();
+		spin_lock_irqsave(&kmem_caches_lock);
+	}
+	SLIST_REMOVE(&kmem_caches, cp, kmem_cache, link);
+	spin_unlock_irqsave(&kmem_caches_lock);
+	if (cp->pcpu_caches) {
+		kmem_cache_drain_pcpu(cp);
+		kmem_depot_reap(cp, TRUE);
+		kfree(cp->pcpu_caches);
+	}
+	mcs_lock_irqsave(&cp->cache_lock, &qn);
+	assert(TAILQ_EMPTY(&cp->full_slab_list));
+	assert(TAILQ_EMPTY(&cp->partial_slab_list));
+	/* Clean out the empty list.  We can't use a regular FOREACH here, since the
+	 * link element is stored in the slab struct, which is stored on the page
+	 * that we are freeing. */
+	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
+	while (a_slab) {
+		next = TAILQ_NEXT(a_slab, link);
+		kmem_slab_destroy(cp, a_slab);
+		a_slab = next;
+	}
+	assert(!cp->hh_nr_items);
+	if (cp->alloc_hash != cp->static_hash)
+		free_cont_pages(cp->alloc_hash, LOG2_UP(ROUNDUP(cp->hh_nr_buckets *
+		                sizeof(struct kmem_bufctl_slist), PGSIZE) / PGSIZE));
+	mcs_unlock_irqsave(&cp->cache_lock, &qn);
+	kmem_cache_free(&kmem_cache_cache, cp); 
+}
+
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	void *retval = NULL;
+
+	if (cp->pcpu_caches)
+		retval = __kmem_alloc_from_pcpu(cp);
+	if (!retval)
+		retval = __kmem_alloc_from_slab(cp);
+	if (!retval) {
+		if (flags & KMALLOC_ERROR)
+			error(ENOMEM, ERROR_FIXME);
+		else
+			panic("[German Accent]: OOM for a small slab growth!!!");
+	}
+	if (cp->flags & KMC_ACCT)
+		*(struct kmem_acct**)(retval + cp->acct_off) =
+			kmem_charge((cp->flags >> KMC_KMEM_SHIFT) & KMC_KMEM_MASK,
+			            cp->obj_size);
+	return retval;
+}
+
+void kmem_cache_free(struct kmem_cache *cp, void *buf)
+{
+	if (cp->flags & KMC_ACCT)
+		kmem_uncharge(*(struct kmem_acct**)(buf + cp->acct_off),
+		              (cp->flags >> KMC_KMEM_SHIFT) & KMC_KMEM_MASK,
+		              cp->obj_size);
+	if (cp->pcpu_caches && __kmem_free_to_pcpu(cp, buf))
+		return;
+	__kmem_free_to_slab(cp, buf);
 }
 
 /* Back end: internal functions */
+/* Gets 2^order contiguous pages for a KMC_HUGE slab from the current chunk,
+ * starting a new one if needed.  Returns 0 if we can't get a chunk, in which
+ * case the caller can fall back to any old pages. */
+static void *kmem_chunk_alloc(size_t order)
+{
+	size_t size = PGSIZE << order;
+	void *ret;
+
+	if (size > PTSIZE)
+		return 0;
+	spin_lock_irqsave(&kmem_chunk.lock);
+	if (kmem_chunk.next + size > kmem_chunk.end) {
+		void *chunk = get_aligned_cont_pages_node(-1, LOG2_UP(PTSIZE / PGSIZE),
+		                                          0);
+
+		if (!chunk) {
+			spin_unlock_irqsave(&kmem_chunk.lock);
+			return 0;
+		}
+		/* The rest of the old chunk is too small for this slab; give it back
+		 * rather than track it. */
+		for (; kmem_chunk.next < kmem_chunk.end; kmem_chunk.next += PGSIZE)
+			page_decref(kva2page((void*)kmem_chunk.next));
+		kmem_chunk.next = (uintptr_t)chunk;
+		kmem_chunk.end = (uintptr_t)chunk + PTSIZE;
+	}
+	ret = (void*)kmem_chunk.next;
+	kmem_chunk.next += size;
+	spin_unlock_irqsave(&kmem_chunk.lock);
+	return ret;
+}
+
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
  * at a time.
@@ -256,8 +639,13 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
 		// Just get a single page for small slabs
 		page_t *a_page;
+		void *chunk_pg = 0;
 
-		if (kpage_alloc(&a_page))
+		if (cp->flags & KMC_HUGE)
+			chunk_pg = kmem_chunk_alloc(0);
+		if (chunk_pg)
+			a_page = kva2page(chunk_pg);
+		else if (kpage_alloc(&a_page))
 			return FALSE;
 		// the slab struct is stored at the end of the page
 		a_slab = (struct kmem_slab*)(page2kva(a_page) + PGSIZE -
@@ -284,15 +672,19 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
 		if (!a_slab)
 			return FALSE;
-		// TODO: hash table for back reference (BUF)
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+		/* No need for a back pointer; free finds bufctls in the hash. */
+		a_slab->obj_size = ROUNDUP(cp->obj_size, cp->align);
 		/* Figure out how much memory we want.  We need at least min_pgs.  We'll
 		 * ask for the next highest order (power of 2) number of pages */
 		size_t min_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
 		                         PGSIZE;
 		size_t order_pg_alloc = LOG2_UP(min_pgs);
-		void *buf = get_cont_pages(order_pg_alloc, 0);
+		void *buf = 0;
 
+		if (cp->flags & KMC_HUGE)
+			buf = kmem_chunk_alloc(order_pg_alloc);
+		if (!buf)
+			buf = get_cont_pages(order_pg_alloc, 0);
 		if (!buf) {
 			kmem_cache_free(kmem_slab_cache, a_slab);
 			return FALSE;
@@ -311,8 +703,6 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 			TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
 			a_bufctl->buf_addr = buf;
 			a_bufctl->my_slab = a_slab;
-			// TODO: (BUF) write the bufctl reference at the bottom of the buffer.
-			*(struct kmem_bufctl**)(buf + cp->obj_size) = a_bufctl;
 			buf += a_slab->obj_size;
 		}
 	}
@@ -322,27 +712,60 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	return TRUE;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
-void kmem_cache_reap(struct kmem_cache *cp)
+/* This returns the depot's unused magazines to the slabs, then deallocs every
+ * slab from the empty list.  Magazines held by cores are left alone.  Returns
+ * the number of pages freed.  TODO: think a bit more about this.  We can do
+ * things like not free all of the empty lists to prevent thrashing.  See 3.4 in
+ * the paper. */
+size_t kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
-	
+	struct mcs_lock_qnode qn;
+	size_t nr_pages = 0;
+
+	if (cp->pcpu_caches)
+		kmem_depot_reap(cp, FALSE);
 	// Destroy all empty slabs.  Refer to the notes about the while loop
-	spin_lock_irqsave(&cp->cache_lock);
+	mcs_lock_irqsave(&cp->cache_lock, &qn);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
-		kmem_slab_destroy(cp, a_slab);
+		nr_pages += kmem_slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
-	spin_unlock_irqsave(&cp->cache_lock);
+	mcs_unlock_irqsave(&cp->cache_lock, &qn);
+	return nr_pages;
+}
+
+/* Reaps every cache, for the reclaimer.  We can't hold the kmem_caches_lock
+ * while reaping (cache_lock -> kmem_caches_lock), so kmem_reaping keeps the
+ * cache we're on, and thus our place in the list, from being destroyed.  Only
+ * one reaper at a time; the reclaimer's qlock sees to that.  Returns the number
+ * of pages freed. */
+size_t kmem_cache_reap_all(void)
+{
+	struct kmem_cache *cp;
+	size_t nr_pages = 0;
+
+	spin_lock_irqsave(&kmem_caches_lock);
+	cp = SLIST_FIRST(&kmem_caches);
+	while (cp) {
+		kmem_reaping = cp;
+		spin_unlock_irqsave(&kmem_caches_lock);
+		nr_pages += kmem_cache_reap(cp);
+		spin_lock_irqsave(&kmem_caches_lock);
+		cp = SLIST_NEXT(cp, link);
+	}
+	kmem_reaping = 0;
+	spin_unlock_irqsave(&kmem_caches_lock);
+	return nr_pages;
 }
 
 void print_kmem_cache(struct kmem_cache *cp)
 {
-	spin_lock_irqsave(&cp->cache_lock);
+	struct mcs_lock_qnode qn;
+
+	mcs_lock_irqsave(&cp->cache_lock, &qn);
 	printk("\nPrinting kmem_cache:\n---------------------\n");
 	printk("Name: %s\n", cp->name);
 	printk("Objsize: %d\n", cp->obj_size);
@@ -354,7 +777,11 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printk("Slab Partial: %p\n", cp->partial_slab_list);
 	printk("Slab Empty: %p\n", cp->empty_slab_list);
 	printk("Current Allocations: %d\n", cp->nr_cur_alloc);
-	spin_unlock_irqsave(&cp->cache_lock);
+	if (cp->pcpu_caches) {
+		printk("Depot full mags: %d\n", cp->depot.nr_full);
+		printk("Depot empty mags: %d\n", cp->depot.nr_empty);
+	}
+	mcs_unlock_irqsave(&cp->cache_lock, &qn);
 }
 
 void print_kmem_slab(struct kmem_slab *slab)
@@ -20,6 +20,7 @@
 #include <kmalloc.h>
 #include <core_set.h>
 #include <completion.h>
+#include <page_alloc.h>
 
 struct all_cpu_work {
 	struct completion comp;
@@ -70,6 +71,11 @@ static void __attribute__((noinline, noreturn)) __smp_idle(void)
 		process_routine_kmsg();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
+		/* Still nothing to do.  Pre-zero some pages, then check again. */
+		if (page_zero_idle()) {
+			enable_irq();	/* let in any IRQs before we go around */
+			continue;
+		}
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via an
 		 * interrupt right while PRKM is returning, and we wouldn't catch
@@ -113,10 +119,9 @@ void smp_percpu_init(void)
 	kthread->flags = KTH_KTASK_FLAGS;
 	per_cpu_info[coreid].spare = 0;
 	/* Init relevant lists */
-	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
-	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
+	per_cpu_info[coreid].immed_amsgs = 0;
+	per_cpu_info[coreid].routine_amsgs = 0;
+	STAILQ_INIT(&per_cpu_info[coreid].routine_batch);
 	/* Initialize the per-core timer chain */
 	init_timer_chain(&per_cpu_info[coreid].tchain, set_pcpu_alarm_interrupt);
 #ifdef CONFIG_KTHREAD_POISON
@@ -1,9 +1,21 @@
-// Basic string routines.  Not hardware optimized, but not shabby.
+// Basic string routines.  Mostly not hardware optimized, but not shabby.
 
 #include <stdio.h>
 #include <string.h>
 #include <ros/memlayout.h>
 #include <assert.h>
+#ifdef CONFIG_X86
+#include <cpu_feat.h>
+
+/* In support64.S */
+void *memcpy_erms(void *dst, const void *src, size_t n);
+void *memset_erms(void *v, int c, size_t n);
+#endif
+
+/* Below this, rep movsb/stosb's startup cost beats the word loops */
+#define STRING_ERMS_MIN		256
+/* Above this, a copy will push everything else out of the cache anyway */
+#define STRING_NT_MIN		(1 << 20)
 
 int
 strlen(const char *s)
@@ -228,6 +240,10 @@ memset(void *v, int c, size_t _n)
 
 	if (n == 0) return NULL; // zra: complain here?
 
+#ifdef CONFIG_X86
+	if (n >= STRING_ERMS_MIN && cpu_has_feat(CPU_FEAT_X86_ERMS))
+		return memset_erms(v, c, n);
+#endif
 	p = v;
 
     while (n > 0 && ((uintptr_t)p & (sizeof(long)-1)))
@@ -262,6 +278,12 @@ memcpy(void* dst, const void* src, size_t _n)
 	size_t n = _n;
 	int align = sizeof(long)-1;
 
+#ifdef CONFIG_X86
+	if (n >= STRING_NT_MIN)
+		return memcpy_nt(dst, src, n);
+	if (n >= STRING_ERMS_MIN && cpu_has_feat(CPU_FEAT_X86_ERMS))
+		return memcpy_erms(dst, src, n);
+#endif
 	s = src;
 	d = dst;
 
@@ -317,12 +339,33 @@ memmove(void *dst, const void *src, size_t _n)
 #endif
 }
 
+#ifndef CONFIG_X86
+/* x86 has real ones in support64.S */
+void *memcpy_nt(void *dst, const void *src, size_t n)
+{
+	return memcpy(dst, src, n);
+}
+
+void *memset_nt(void *v, int c, size_t n)
+{
+	return memset(v, c, n);
+}
+#endif
+
 int
 memcmp(const void *v1, const void *v2, size_t n)
 {
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
 
+	/* skip the equal words, then find the byte that differs */
+	if ((((uintptr_t)s1 | (uintptr_t)s2) & (sizeof(long)-1)) == 0) {
+		while (n >= sizeof(long) && *(long*)s1 == *(long*)s2) {
+			s1 += sizeof(long);
+			s2 += sizeof(long);
+			n -= sizeof(long);
+		}
+	}
 	while (n-- > 0) {
 		if (*s1 != *s2)
 			return (int) *s1 - (int) *s2;
@@ -35,173 +35,115 @@
 #include <kprof.h>
 #include <termios.h>
 #include <manager.h>
+#include <tracepoint.h>
+#include <percpu.h>
+#include <kthread.h>
 
 /* Tracing Globals */
 int systrace_flags = 0;
-struct systrace_record *systrace_buffer = 0;
-uint32_t systrace_bufidx = 0;
-size_t systrace_bufsize = 0;
 spinlock_t systrace_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
+/* The global tracer's records.  Each core only writes its own ring, with IRQs
+ * off, and readers drain under systrace_qlock, so tracing doesn't share
+ * anything between cores on the syscall path.  Full rings drop new records. */
+struct systrace_ring {
+	uint64_t					head;
+	uint64_t					tail;
+	uint64_t					nr_dropped;
+	struct systrace_record		recs[SYSTRACE_RING_SLOTS];
+};
+
+static DEFINE_PERCPU(struct systrace_ring *, systrace_ring);
+static qlock_t systrace_qlock = QLOCK_INITIALIZER(systrace_qlock);
+
+/* Always on: each core counts its syscalls' latencies in its own table, so the
+ * cost is a TSC read and an increment.  Syscalls that don't return (exec,
+ * yield) aren't counted. */
+struct sysc_lat_hist {
+	uint64_t					hist[SYSC_LAT_MAX_SYSC][SYSC_LAT_NR_BUCKETS];
+};
+
+static DEFINE_PERCPU(struct sysc_lat_hist *, sysc_lat_hist);
+
 static bool __trace_this_proc(struct proc *p)
 {
 	return (systrace_flags & SYSTRACE_ON) &&
 		((systrace_flags & SYSTRACE_ALLPROC) || is_traced_proc(p));
 }
 
-static size_t systrace_fill_pretty_buf(struct systrace_record *trace)
+static bool strace_wants(struct strace *strace, struct proc *p,
+                         uintreg_t sc_num)
 {
-	size_t len = 0;
-	struct timespec ts_start;
-	struct timespec ts_end;
-	char what = 'X';
-	tsc2timespec(trace->start_timestamp, &ts_start);
-	tsc2timespec(trace->end_timestamp, &ts_end);
-	if (trace->end_timestamp == 0)
-		what = 'E';
-
-	len = snprintf(trace->pretty_buf, SYSTR_PRETTY_BUF_SZ - len,
-	           "%c [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
-	           "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: 0x%llx proc: %d core: %d "
-	           "vcore: %d data: ",
-	           what,
-	           ts_start.tv_sec,
-	           ts_start.tv_nsec,
-	           ts_end.tv_sec,
-	           ts_end.tv_nsec,
-	           trace->syscallno,
-	           syscall_table[trace->syscallno].name,
-	           trace->arg0,
-	           trace->arg1,
-	           trace->arg2,
-	           trace->arg3,
-	           trace->arg4,
-	           trace->arg5,
-	           trace->retval,
-	           trace->pid,
-	           trace->coreid,
-	           trace->vcoreid);
-
-	len += printdump(trace->pretty_buf + len,
-			 trace->datalen,
-	                 SYSTR_PRETTY_BUF_SZ - len - 1,
-	                 trace->data);
-	len += snprintf(trace->pretty_buf + len, SYSTR_PRETTY_BUF_SZ - len, "\n");
-	return len;
+	if (strace->filter_pid && strace->filter_pid != p->pid)
+		return FALSE;
+	if (!strace->filter_sysc_on)
+		return TRUE;
+	if (sc_num >= STRACE_MAX_SYSC)
+		return FALSE;
+	return GET_BITMASK_BIT(strace->filter_sysc, sc_num);
 }
 
-/* On enter, we have !trace, a sysc, and retval is meaningless.  On exit, we had
- * trace, retval and !sysc */
-static struct systrace_record *sctrace(struct systrace_record *trace,
-                                       struct proc *p, struct syscall *sysc,
-                                       long retval)
+/* We're using qiwrite, which has no flow control.  We'll do it manually. */
+static void strace_send(struct strace *strace, struct systrace_record *trace)
 {
-	int n;
-	uintreg_t cp = 0;
-	int datalen = 0;
-
-	assert(p->strace);
-
-	if (!trace) {
-		/* We're using qiwrite, which has no flow control.  We'll do it
-		 * manually. */
-		if (qfull(p->strace->q)) {
-			atomic_inc(&p->strace->nr_drops);
-			return NULL;
-		}
-		// TODO: could we allocb and then write that block?
-		// Still, if we're tracing, we take a hit, and this is so
-		// much more efficient than strace it's not clear we care.
-		trace = kmalloc(SYSTR_BUF_SZ, 0);
+	if (qfull(strace->q)) {
+		atomic_inc(&strace->nr_drops);
+		return;
+	}
+	qiwrite(strace->q, trace, sizeof(struct systrace_record));
+}
 
-		if (!trace) {
-			atomic_inc(&p->strace->nr_drops);
-			return NULL;
-		}
-		/* Avoiding the atomic op.  We sacrifice accuracy for less overhead. */
-		p->strace->appx_nr_sysc++;
+static void systrace_ring_push(struct systrace_record *trace)
+{
+	struct systrace_ring *ring;
+	int8_t irq_state = 0;
 
-		int coreid, vcoreid;
-		struct proc *p = current;
-
-		coreid = core_id();
-		vcoreid = proc_get_vcoreid(p);
-
-		// TODO: functionalize this, if we decide this
-		// approach is OK.
-		trace->start_timestamp = read_tsc();
-		trace->end_timestamp = 0;
-		trace->syscallno = sysc->num;
-		trace->arg0 = sysc->arg0;
-		trace->arg1 = sysc->arg1;
-		trace->arg2 = sysc->arg2;
-		trace->arg3 = sysc->arg3;
-		trace->arg4 = sysc->arg4;
-		trace->arg5 = sysc->arg5;
-		trace->pid = p->pid;
-		trace->coreid = coreid;
-		trace->vcoreid = vcoreid;
-		trace->pretty_buf = (char*)trace + sizeof(struct systrace_record);
-		trace->datalen = 0;
-		trace->data[0] = 0;
-		switch (sysc->num) {
-		case SYS_write:
-			cp = sysc->arg1;
-			datalen = sysc->arg2;
-			break;
-		case SYS_openat:
-			cp = sysc->arg1;
-			datalen = sysc->arg2;
-			break;
-		}
-	} else {
-		trace->end_timestamp = read_tsc();
-		trace->retval = retval;
-		switch (trace->syscallno) {
-		case SYS_read:
-			cp = trace->arg1;
-			datalen = retval < 0 ? 0 : retval;
-			break;
-		}
+	disable_irqsave(&irq_state);
+	ring = PERCPU_VAR(systrace_ring);
+	if (!ring)
+		goto out;
+	if (ring->head - ACCESS_ONCE(ring->tail) >= SYSTRACE_RING_SLOTS) {
+		ring->nr_dropped++;
+		goto out;
 	}
+	ring->recs[ring->head & (SYSTRACE_RING_SLOTS - 1)] = *trace;
+	wmb();	/* the record is written before the reader can see it */
+	ACCESS_ONCE(ring->head) = ring->head + 1;
+out:
+	enable_irqsave(&irq_state);
+}
 
-	trace->datalen = MIN(sizeof(trace->data), datalen);
-	memmove(trace->data, (void *)cp, trace->datalen);
-	n = systrace_fill_pretty_buf(trace);
-	qiwrite(p->strace->q, trace->pretty_buf, n);
-	return trace;
+static void systrace_printk(const char *what, struct systrace_record *trace)
+{
+	printk("%s [%16llu] Syscall %3d (%12s):(0x%llx, 0x%llx, 0x%llx, 0x%llx, "
+	       "0x%llx, 0x%llx) ret: 0x%llx proc: %d core: %d vcore: %d\n", what,
+	       trace->start_timestamp, trace->syscallno,
+	       syscall_table[trace->syscallno].name, trace->arg0, trace->arg1,
+	       trace->arg2, trace->arg3, trace->arg4, trace->arg5, trace->retval,
+	       trace->pid, trace->coreid, trace->vcoreid);
 }
 
+/* Starts a record for the syscall if either tracer wants it.  The syscall can
+ * save data in kthread->trace while it runs, which goes out in the exit
+ * record. */
 static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 {
 	struct systrace_record *trace;
-	int coreid, vcoreid;
 	struct proc *p = current;
+	bool strace = p->strace_on && strace_wants(p->strace, p, sysc->num);
 
-	if (p->strace_on)
-		kthread->strace = sctrace(NULL, p, sysc, 0);
-	else
-		kthread->strace = 0;
-
-	/* TODO: merge these two types of tracing, or just remove this old one */
-	if (!__trace_this_proc(p))
-		return;
 	assert(!kthread->trace);	/* catch memory leaks */
-	coreid = core_id();
-	vcoreid = proc_get_vcoreid(p);
-	if (systrace_flags & SYSTRACE_LOUD) {
-		printk("ENTER [%16llu] Syscall %3d (%12s):(0x%llx, 0x%llx, 0x%llx, "
-		       "0x%llx, 0x%llx, 0x%llx) proc: %d core: %d vcore: %d\n",
-		       read_tsc(),
-		       sysc->num, syscall_table[sysc->num].name,
-			   sysc->arg0, sysc->arg1, sysc->arg2, sysc->arg3, sysc->arg4,
-			   sysc->arg5, p->pid, coreid, vcoreid);
-	}
-	trace = kmalloc(SYSTR_BUF_SZ, 0);
-	if (!trace)
+	kthread->strace = FALSE;
+	if (!strace && !__trace_this_proc(p))
 		return;
-	kthread->trace = trace;
-	trace->start_timestamp = read_tsc();
+	trace = kmalloc(sizeof(struct systrace_record), 0);
+	if (!trace) {
+		if (strace)
+			atomic_inc(&p->strace->nr_drops);
+		return;
+	}
+	trace->start_timestamp = nsec();
+	trace->end_timestamp = 0;
 	trace->syscallno = sysc->num;
 	trace->arg0 = sysc->arg0;
 	trace->arg1 = sysc->arg1;
@@ -209,35 +151,42 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 	trace->arg3 = sysc->arg3;
 	trace->arg4 = sysc->arg4;
 	trace->arg5 = sysc->arg5;
+	trace->retval = 0;
 	trace->pid = p->pid;
-	trace->coreid = coreid;
-	trace->vcoreid = vcoreid;
-	trace->pretty_buf = (char*)trace + sizeof(struct systrace_record);
+	trace->coreid = core_id();
+	trace->vcoreid = proc_get_vcoreid(p);
 	trace->datalen = 0;
-	trace->data[0] = 0;
+	kthread->trace = trace;
+	kthread->strace = strace;
+	if (strace) {
+		/* Avoiding the atomic op.  We sacrifice accuracy for less overhead. */
+		p->strace->appx_nr_sysc++;
+		if (!p->strace->filter_lat_nsec)
+			strace_send(p->strace, trace);
+	}
+	if (__trace_this_proc(p) && (systrace_flags & SYSTRACE_LOUD))
+		systrace_printk("ENTER", trace);
 }
 
 static void systrace_finish_trace(struct kthread *kthread, long retval)
 {
 	struct systrace_record *trace = kthread->trace;
-	size_t pretty_len;
-
-	if (trace) {
-		trace->end_timestamp = read_tsc();
-		trace->retval = retval;
-		kthread->trace = 0;
-		pretty_len = systrace_fill_pretty_buf(trace);
-		kprof_tracedata_write(trace->pretty_buf, pretty_len);
+	struct proc *p = current;
+
+	if (!trace)
+		return;
+	kthread->trace = 0;
+	trace->end_timestamp = nsec();
+	trace->retval = retval;
+	if (kthread->strace && trace->end_timestamp - trace->start_timestamp >=
+	                       p->strace->filter_lat_nsec)
+		strace_send(p->strace, trace);
+	if (__trace_this_proc(p)) {
+		systrace_ring_push(trace);
 		if (systrace_flags & SYSTRACE_LOUD)
-			printk("EXIT %s", trace->pretty_buf);
-		kfree(trace);
-	}
-	/* TODO: merge with or remove the old tracer */
-	if (kthread->strace) {
-		sctrace(kthread->strace, current, 0, retval);
-		kfree(kthread->strace);
-		kthread->strace = 0;
+			systrace_printk("EXIT", trace);
 	}
+	kfree(trace);
 }
 
 #ifdef CONFIG_SYSCALL_STRING_SAVING
@@ -715,13 +664,13 @@ static int sys_proc_create(struct proc *p, char *path, size_t path_l,
 	/* TODO: need to split the proc creation, since you must load after setting
 	 * args/env, since auxp gets set up there. */
 	//new_p = proc_create(program, 0, 0);
-	if (proc_alloc(&new_p, current, flags)) {
+	/* PROC_SPAWN skips the CLOEXEC files, even though this isn't really an
+	 * exec */
+	if (proc_alloc(&new_p, current, flags | PROC_SPAWN)) {
 		set_errstr("Failed to alloc new proc");
 		goto error_proc_alloc;
 	}
 	inherit_strace(p, new_p);
-	/* close the CLOEXEC ones, even though this isn't really an exec */
-	close_fdt(&new_p->open_files, TRUE);
 	/* Load the elf. */
 	if (load_elf(new_p, program, argc, argv, envc, envp)) {
 		set_errstr("Failed to load elf");
@@ -861,8 +810,9 @@ static ssize_t sys_fork(env_t* e)
 	}
 	/* Switch to the new proc's address space and finish the syscall.  We'll
 	 * never naturally finish this syscall for the new proc, since its memory
-	 * is cloned before we return for the original process.  If we ever do CoW
-	 * for forked memory, this will be the first place that gets CoW'd. */
+	 * is cloned before we return for the original process.  The sysc is in a
+	 * CoW page, so this is usually the child's first CoW fault.  switch_to()
+	 * makes env current, so the fault is handled for env. */
 	temp = switch_to(env);
 	finish_current_sysc(0);
 	switch_back(env, temp);
@@ -1207,6 +1157,11 @@ static intreg_t sys_munmap(struct proc *p, void *addr, size_t len)
 	return munmap(p, (uintptr_t)addr, len);
 }
 
+static intreg_t sys_madvise(struct proc *p, void *addr, size_t len, int advice)
+{
+	return madvise(p, (uintptr_t)addr, len, advice);
+}
+
 static ssize_t sys_shared_page_alloc(env_t* p1,
                                      void **_addr, pid_t p2_id,
                                      int p1_flags, int p2_flags
@@ -1282,6 +1237,56 @@ static int sys_notify(struct proc *p, int target_pid, unsigned int ev_type,
 	return 0;
 }
 
+/* Sends target_pid an ev_type message, handing it the calling vcore's core.
+ * The kernel fills in ev_arg2 with our pid, so the server knows whom to reply
+ * to.  The reply comes back the same way, and our vcore restarts fresh at
+ * vcore_entry when it does.  If we can't give up the core (an SCP, or our vcore
+ * has a notif pending), the message is sent anyway and we return 0.  Callers
+ * should be in vcore context; see vcore_ipc_call(). */
+static int sys_ipc_call(struct proc *p, int target_pid, unsigned int ev_type,
+                        uint16_t ev_arg1, void *ev_arg3, uint64_t ev_arg4)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct event_msg local_msg = {0};
+	struct proc *target;
+
+	if (ev_type >= MAX_NR_EVENT) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	target = get_controllable_proc(p, target_pid);
+	if (!target)
+		return -1;
+	if (target == p) {
+		proc_decref(target);
+		set_errno(EINVAL);
+		return -1;
+	}
+	local_msg.ev_type = ev_type;
+	local_msg.ev_arg1 = ev_arg1;
+	local_msg.ev_arg2 = p->pid;
+	local_msg.ev_arg3 = ev_arg3;
+	local_msg.ev_arg4 = ev_arg4;
+	if (!__proc_is_mcp(p)) {
+		send_kernel_event(target, &local_msg, 0);
+		proc_decref(target);
+		return 0;
+	}
+	/* Like sys_proc_yield(), we usually don't return, so finish up now */
+	free_sysc_str(pcpui->cur_kthread);
+	systrace_finish_trace(pcpui->cur_kthread, 0);
+	finish_sysc(pcpui->cur_kthread->sysc, pcpui->cur_proc);
+	pcpui->cur_kthread->sysc = 0;	/* don't touch sysc again */
+	proc_incref(p, 1);
+	proc_yield_to(p, target, &local_msg);
+	/* We kept the core; the message still goes out */
+	proc_decref(p);
+	send_kernel_event(target, &local_msg, 0);
+	proc_decref(target);
+	smp_idle();
+	assert(0);
+}
+
 /* Will notify the calling process on the given vcore, independently of WANTED
  * or advertised vcoreid.  If you change the parameters, change pop_user_ctx().
  */
@@ -1558,6 +1563,192 @@ static intreg_t sys_write(struct proc *p, int fd, const void *buf, size_t len)
 
 }
 
+/* Copies in and checks the user's iovecs.  Returns a kmalloc'd copy, or 0 with
+ * errno set. */
+static struct iovec *copy_in_iovecs(struct proc *p, const struct iovec *u_iov,
+                                    int iovcnt, bool writable)
+{
+	struct iovec *iov;
+
+	if ((iovcnt <= 0) || (iovcnt > MAX_NR_IOVECS)) {
+		set_error(EINVAL, "bad iovcnt %d", iovcnt);
+		return 0;
+	}
+	iov = user_memdup_errno(p, u_iov, sizeof(struct iovec) * iovcnt);
+	if (!iov)
+		return 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (writable ? !is_user_rwaddr(iov[i].iov_base, iov[i].iov_len)
+		             : !is_user_raddr(iov[i].iov_base, iov[i].iov_len)) {
+			kfree(iov);
+			set_error(EFAULT, "bad iovec %d", i);
+			return 0;
+		}
+	}
+	return iov;
+}
+
+/* VFS files just get a read or write per iovec, starting at *offp */
+static ssize_t vfs_rw_iovecs(struct file *file, struct iovec *iov, int iovcnt,
+                             bool is_read, off64_t *offp)
+{
+	ssize_t ret, total = 0;
+
+	if ((is_read && !file->f_op->read) || (!is_read && !file->f_op->write)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (is_read)
+			ret = file->f_op->read(file, iov[i].iov_base, iov[i].iov_len,
+			                       offp);
+		else
+			ret = file->f_op->write(file, iov[i].iov_base, iov[i].iov_len,
+			                        offp);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		if (ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+static intreg_t sys_readv(struct proc *p, int fd, const struct iovec *u_iov,
+                          int iovcnt)
+{
+	ssize_t ret;
+	struct iovec *iov;
+	struct file *file;
+
+	sysc_save_str("readv on fd %d", fd);
+	iov = copy_in_iovecs(p, u_iov, iovcnt, TRUE);
+	if (!iov)
+		return -1;
+	file = get_file_from_fd(&p->open_files, fd);
+	/* VFS */
+	if (file) {
+		ret = vfs_rw_iovecs(file, iov, iovcnt, TRUE, &file->f_pos);
+		kref_put(&file->f_kref);
+	} else {
+		/* plan9: the blocks get scattered into the iovecs directly */
+		ret = sysreadv(fd, iov, iovcnt);
+	}
+	kfree(iov);
+	return ret;
+}
+
+static intreg_t sys_writev(struct proc *p, int fd, const struct iovec *u_iov,
+                           int iovcnt)
+{
+	ssize_t ret;
+	struct iovec *iov;
+	struct file *file;
+
+	sysc_save_str("writev on fd %d", fd);
+	iov = copy_in_iovecs(p, u_iov, iovcnt, FALSE);
+	if (!iov)
+		return -1;
+	file = get_file_from_fd(&p->open_files, fd);
+	/* VFS */
+	if (file) {
+		ret = vfs_rw_iovecs(file, iov, iovcnt, FALSE, &file->f_pos);
+		kref_put(&file->f_kref);
+	} else {
+		ret = syswritev(fd, iov, iovcnt);
+	}
+	kfree(iov);
+	return ret;
+}
+
+/* readv at offset, leaving the file's offset alone.  Lets a process keep many
+ * reads of one file in flight at once, e.g. a batch of async syscalls. */
+static intreg_t sys_preadv(struct proc *p, int fd, const struct iovec *u_iov,
+                           int iovcnt, off64_t offset)
+{
+	ssize_t ret;
+	struct iovec *iov;
+	struct file *file;
+
+	sysc_save_str("preadv on fd %d at %lld", fd, offset);
+	if (offset < 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	iov = copy_in_iovecs(p, u_iov, iovcnt, TRUE);
+	if (!iov)
+		return -1;
+	file = get_file_from_fd(&p->open_files, fd);
+	if (file) {
+		ret = vfs_rw_iovecs(file, iov, iovcnt, TRUE, &offset);
+		kref_put(&file->f_kref);
+	} else {
+		ret = syspreadv(fd, iov, iovcnt, offset);
+	}
+	kfree(iov);
+	return ret;
+}
+
+static intreg_t sys_pwritev(struct proc *p, int fd, const struct iovec *u_iov,
+                            int iovcnt, off64_t offset)
+{
+	ssize_t ret;
+	struct iovec *iov;
+	struct file *file;
+
+	sysc_save_str("pwritev on fd %d at %lld", fd, offset);
+	if (offset < 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	iov = copy_in_iovecs(p, u_iov, iovcnt, FALSE);
+	if (!iov)
+		return -1;
+	file = get_file_from_fd(&p->open_files, fd);
+	if (file) {
+		ret = vfs_rw_iovecs(file, iov, iovcnt, FALSE, &offset);
+		kref_put(&file->f_kref);
+	} else {
+		ret = syspwritev(fd, iov, iovcnt, offset);
+	}
+	kfree(iov);
+	return ret;
+}
+
+/* Moves count bytes from in_fd to out_fd in the kernel.  out_fd must be a 9ns
+ * chan.  If u_off is set, we read in_fd from *u_off and update it, and leave
+ * in_fd's offset alone.  VFS files send their page cache pages. */
+static intreg_t sys_sendfile(struct proc *p, int out_fd, int in_fd,
+                             off64_t *u_off, size_t count)
+{
+	off64_t off;
+	ssize_t ret;
+	struct file *file;
+
+	sysc_save_str("sendfile from fd %d to fd %d", in_fd, out_fd);
+	if (u_off && memcpy_from_user_errno(p, &off, u_off, sizeof(off64_t)))
+		return -1;
+	file = get_file_from_fd(&p->open_files, in_fd);
+	/* VFS */
+	if (file) {
+		if (!(file->f_mode & S_IRUSR)) {
+			kref_put(&file->f_kref);
+			set_errno(EBADF);
+			return -1;
+		}
+		ret = syssendpm(out_fd, file->f_mapping,
+		                file->f_dentry->d_inode->i_size,
+		                u_off ? &off : &file->f_pos, count);
+		kref_put(&file->f_kref);
+	} else {
+		ret = syssendfile(out_fd, in_fd, u_off ? &off : NULL, count);
+	}
+	if (ret >= 0 && u_off &&
+	    memcpy_to_user_errno(p, u_off, &off, sizeof(off64_t)))
+		return -1;
+	return ret;
+}
+
 /* Checks args/reads in the path, opens the file (relative to fromfd if the path
  * is not absolute), and inserts it into the process's open file list. */
 static intreg_t sys_openat(struct proc *p, int fromfd, const char *path,
@@ -2059,26 +2250,13 @@ intreg_t sys_pipe(struct proc *p, int *u_pipefd, int flags)
 	return 0;
 }
 
+/* Userspace can read the wall clock from proc_global_info without trapping.
+ * This is for old binaries. */
 intreg_t sys_gettimeofday(struct proc *p, int *buf)
 {
-	static spinlock_t gtod_lock = SPINLOCK_INITIALIZER;
-	static int t0 = 0;
-
-	spin_lock(&gtod_lock);
-	if(t0 == 0)
-
-#if (defined CONFIG_APPSERVER)
-	t0 = ufe(time,0,0,0,0);
-#else
-	// Nanwan's birthday, bitches!!
-	t0 = 1242129600;
-#endif
-	spin_unlock(&gtod_lock);
-
-	long long dt = read_tsc();
+	uint64_t now = epoch_nsec();
 	/* TODO: This probably wants its own function, using a struct timeval */
-	long kbuf[2] = {t0+dt/system_timing.tsc_freq,
-	    (dt%system_timing.tsc_freq)*1000000/system_timing.tsc_freq};
+	long kbuf[2] = {now / 1000000000, (now % 1000000000) / 1000};
 
 	return memcpy_to_user_errno(p,buf,kbuf,sizeof(kbuf));
 }
@@ -2519,17 +2697,33 @@ static intreg_t sys_dup_fds_to(struct proc *p, unsigned int pid,
 	return ret;
 }
 
-/* 0 on success, anything else is an error, with errno/errstr set */
-static int handle_tap_req(struct proc *p, struct fd_tap_req *req)
+/* Length of the run of requests starting at req that can be handed to fdtap
+ * as one batch: consecutive ADDs or REMs. */
+static size_t tap_req_run(struct fd_tap_req *req, size_t nr_reqs)
+{
+	size_t run = 1;
+
+	if (req->cmd != FDTAP_CMD_ADD && req->cmd != FDTAP_CMD_REM)
+		return 1;
+	while (run < nr_reqs && run < FDTAP_BATCH && req[run].cmd == req->cmd)
+		run++;
+	return run;
+}
+
+/* Returns the number of the run's requests that succeeded, with errno/errstr
+ * set for the first one that didn't. */
+static int handle_tap_reqs(struct proc *p, struct fd_tap_req *req, size_t run)
 {
 	switch (req->cmd) {
 		case (FDTAP_CMD_ADD):
-			return add_fd_tap(p, req);
+			return add_fd_taps(p, req, run);
 		case (FDTAP_CMD_REM):
-			return remove_fd_tap(p, req->fd);
+			return remove_fd_taps(p, req, run);
+		case (FDTAP_CMD_MOD):
+			return modify_fd_tap(p, req) ? 0 : 1;
 		default:
 			set_error(ENOSYS, "FD Tap Command %d not supported", req->cmd);
-			return -1;
+			return 0;
 	}
 }
 
@@ -2539,14 +2733,19 @@ static int handle_tap_req(struct proc *p, struct fd_tap_req *req)
 static intreg_t sys_tap_fds(struct proc *p, struct fd_tap_req *tap_reqs,
                             size_t nr_reqs)
 {
-	struct fd_tap_req *req_i = tap_reqs;
-	int done;
+	size_t done = 0;
+	size_t run;
+	int ret;
+
 	if (!is_user_rwaddr(tap_reqs, sizeof(struct fd_tap_req) * nr_reqs)) {
 		set_errno(EINVAL);
 		return 0;
 	}
-	for (done = 0; done < nr_reqs; done++, req_i++) {
-		if (handle_tap_req(p, req_i))
+	while (done < nr_reqs) {
+		run = tap_req_run(tap_reqs + done, nr_reqs - done);
+		ret = handle_tap_reqs(p, tap_reqs + done, run);
+		done += ret;
+		if (ret < run)
 			break;
 	}
 	return done;
@@ -2576,6 +2775,8 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_mmap] = {(syscall_t)sys_mmap, "mmap"},
 	[SYS_munmap] = {(syscall_t)sys_munmap, "munmap"},
 	[SYS_mprotect] = {(syscall_t)sys_mprotect, "mprotect"},
+	[SYS_madvise] = {(syscall_t)sys_madvise, "madvise"},
+	[SYS_ipc_call] = {(syscall_t)sys_ipc_call, "ipc_call"},
 	[SYS_shared_page_alloc] = {(syscall_t)sys_shared_page_alloc, "pa"},
 	[SYS_shared_page_free] = {(syscall_t)sys_shared_page_free, "pf"},
 	[SYS_provision] = {(syscall_t)sys_provision, "provision"},
@@ -2632,6 +2833,11 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_rename] ={(syscall_t)sys_rename, "rename"},
 	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to, "dup_fds_to"},
 	[SYS_tap_fds] = {(syscall_t)sys_tap_fds, "tap_fds"},
+	[SYS_readv] = {(syscall_t)sys_readv, "readv"},
+	[SYS_writev] = {(syscall_t)sys_writev, "writev"},
+	[SYS_sendfile] = {(syscall_t)sys_sendfile, "sendfile"},
+	[SYS_preadv] = {(syscall_t)sys_preadv, "preadv"},
+	[SYS_pwritev] = {(syscall_t)sys_pwritev, "pwritev"},
 };
 const int max_syscall = sizeof(syscall_table)/sizeof(syscall_table[0]);
 
@@ -2682,11 +2888,29 @@ intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
 	return ret;
 }
 
+static void sysc_lat_record(uintreg_t sc_num, uint64_t tsc)
+{
+	struct sysc_lat_hist *h = PERCPU_VAR(sysc_lat_hist);
+
+	if (sc_num >= SYSC_LAT_MAX_SYSC)
+		return;
+	if (unlikely(!h)) {
+		/* Each core sets up its own table on its first syscall */
+		h = kzmalloc(sizeof(struct sysc_lat_hist), 0);
+		if (!h)
+			return;
+		PERCPU_VAR(sysc_lat_hist) = h;
+	}
+	h->hist[sc_num][MIN(LOG2_DOWN(tsc), SYSC_LAT_NR_BUCKETS - 1)]++;
+}
+
 /* Execute the syscall on the local core */
 void run_local_syscall(struct syscall *sysc)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct proc *p = pcpui->cur_proc;
+	struct vcore_stats *vcs;
+	uint64_t start_tsc;
 
 	/* In lieu of pinning, we just check the sysc and will PF on the user addr
 	 * later (if the addr was unmapped).  Which is the plan for all UMEM. */
@@ -2696,16 +2920,22 @@ void run_local_syscall(struct syscall *sysc)
 		return;
 	}
 	pcpui->cur_kthread->sysc = sysc;	/* let the core know which sysc it is */
+	if ((vcs = cur_vcore_stats(p)))
+		vcs->nr_syscalls++;
 	systrace_start_trace(pcpui->cur_kthread, sysc);
 	alloc_sysc_str(pcpui->cur_kthread);
+	tracepoint(TP_SYSCALL_ENTER, sysc->num, sysc, sysc->arg0);
 	/* syscall() does not return for exec and yield, so put any cleanup in there
 	 * too. */
+	start_tsc = read_tsc();
 	sysc->retval = syscall(pcpui->cur_proc, sysc->num, sysc->arg0, sysc->arg1,
 	                       sysc->arg2, sysc->arg3, sysc->arg4, sysc->arg5);
+	sysc_lat_record(sysc->num, read_tsc() - start_tsc);
 	/* Need to re-load pcpui, in case we migrated */
 	pcpui = &per_cpu_info[core_id()];
 	free_sysc_str(pcpui->cur_kthread);
 	systrace_finish_trace(pcpui->cur_kthread, sysc->retval);
+	tracepoint(TP_SYSCALL_EXIT, sysc->num, sysc, sysc->retval);
 	/* Some 9ns paths set errstr, but not errno.  glibc will ignore errstr.
 	 * this is somewhat hacky, since errno might get set unnecessarily */
 	if ((current_errstr()[0] != 0) && (!sysc->err))
@@ -2714,9 +2944,52 @@ void run_local_syscall(struct syscall *sysc)
 	pcpui->cur_kthread->sysc = NULL;	/* No longer working on sysc */
 }
 
+/* Syscalls that operate on the calling context, which only the first syscall
+ * of a batch has. */
+static bool sysc_needs_user_ctx(unsigned int num)
+{
+	switch (num) {
+	case SYS_yield:
+	case SYS_change_vcore:
+	case SYS_fork:
+	case SYS_exec:
+	case SYS_change_to_m:
+	case SYS_vc_entry:
+	case SYS_pop_ctx:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Runs one of the trailing syscalls of a batch, from a routine kmsg.  Each
+ * runs in its own kmsg, so if one blocks, the next kmsg runs in a fresh
+ * kthread and the batch keeps going. */
+static void __run_batched_sysc(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	struct syscall *sysc = (struct syscall*)a1;
+	uintptr_t old_proc;
+
+	old_proc = switch_to(p);
+	if (sysc_needs_user_ctx(ACCESS_ONCE(sysc->num))) {
+		sysc->err = EINVAL;
+		sysc->retval = -1;
+		finish_sysc(sysc, p);
+	} else {
+		run_local_syscall(sysc);
+	}
+	/* The sysc might have blocked, and we could be on another core */
+	switch_back(p, old_proc);
+	proc_decref(p);
+}
+
 /* A process can trap and call this function, which will set up the core to
  * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
- * at least one, it will run it directly. */
+ * at least one, it will run it directly.
+ *
+ * The syscalls after the first get a routine kmsg each, which we'll process
+ * before returning to userspace.  Userspace can't count on any ordering among
+ * them, and each completes (SC_DONE, events) on its own. */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 {
 	int retval;
@@ -2725,9 +2998,20 @@ void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 		printk("[kernel] No nr_sysc, probably a bug, user!\n");
 		return;
 	}
-	/* For all after the first call, send ourselves a KMSG (TODO). */
-	if (nr_syscs != 1)
-		warn("Only one supported (Debutante calls: %d)\n", nr_syscs);
+	nr_syscs = MIN(nr_syscs, MAX_NR_BATCHED_SYSCS);
+	if (nr_syscs > 1 && !is_user_rwaddr(sysc,
+	                                    nr_syscs * sizeof(struct syscall))) {
+		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
+		       nr_syscs * sizeof(struct syscall), __FUNCTION__);
+		return;
+	}
+	/* Send these before running the first, which might not return (exec,
+	 * yield) or might block.  Each kmsg holds a ref on p. */
+	for (int i = 1; i < nr_syscs; i++) {
+		proc_incref(p, 1);
+		send_kernel_message(core_id(), __run_batched_sysc, (long)p,
+		                    (long)&sysc[i], 0, KMSG_ROUTINE);
+	}
 	/* Call the first one directly.  (we already checked to make sure there is
 	 * 1) */
 	run_local_syscall(sysc);
@@ -2756,26 +3040,22 @@ void __signal_syscall(struct syscall *sysc, struct proc *p)
 }
 
 /* Syscall tracing */
-static void __init_systrace(void)
-{
-	systrace_buffer = kmalloc(MAX_SYSTRACES*sizeof(struct systrace_record), 0);
-	if (!systrace_buffer)
-		panic("Unable to alloc a trace buffer\n");
-	systrace_bufidx = 0;
-	systrace_bufsize = MAX_SYSTRACES;
-	/* Note we never free the buffer - it's around forever.  Feel free to change
-	 * this if you want to change the size or something dynamically. */
-}
-
 /* If you call this while it is running, it will change the mode */
 void systrace_start(bool silent)
 {
-	static bool init = FALSE;
+	struct systrace_ring *ring;
+
 	spin_lock_irqsave(&systrace_lock);
-	if (!init) {
-		__init_systrace();
-		init = TRUE;
+	/* Note we never free the rings - they're around forever. */
+	for (int i = 0; i < num_cores; i++) {
+		if (_PERCPU_VAR(systrace_ring, i))
+			continue;
+		ring = kzmalloc(sizeof(struct systrace_ring), 0);
+		if (!ring)
+			panic("Unable to alloc a trace ring\n");
+		_PERCPU_VAR(systrace_ring, i) = ring;
 	}
+	wmb();	/* publish the rings before the flags */
 	systrace_flags = silent ? SYSTRACE_ON : SYSTRACE_ON | SYSTRACE_LOUD;
 	spin_unlock_irqsave(&systrace_lock);
 }
@@ -2827,36 +3107,134 @@ int systrace_dereg(bool all, struct proc *p)
 	return 0;
 }
 
-/* Regardless of locking, someone could be writing into the buffer */
+/* Prints what's in the rings, without draining them.  Regardless of locking,
+ * the cores could be writing into the rings. */
 void systrace_print(bool all, struct proc *p)
 {
-	spin_lock_irqsave(&systrace_lock);
-	/* if you want to be clever, you could make this start from the earliest
-	 * timestamp and loop around.  Careful of concurrent writes. */
-	for (int i = 0; i < systrace_bufsize; i++)
-		if (systrace_buffer[i].start_timestamp)
-			printk("[%16llu] Syscall %3d (%12s):(%p, %p, %p, %p, %p,"
-			       "%p) proc: %d core: %d vcore: %d\n",
-			       systrace_buffer[i].start_timestamp,
-			       systrace_buffer[i].syscallno,
-			       syscall_table[systrace_buffer[i].syscallno].name,
-			       systrace_buffer[i].arg0,
-			       systrace_buffer[i].arg1,
-			       systrace_buffer[i].arg2,
-			       systrace_buffer[i].arg3,
-			       systrace_buffer[i].arg4,
-			       systrace_buffer[i].arg5,
-			       systrace_buffer[i].pid,
-			       systrace_buffer[i].coreid,
-			       systrace_buffer[i].vcoreid);
-	spin_unlock_irqsave(&systrace_lock);
+	struct systrace_ring *ring;
+
+	for (int i = 0; i < num_cores; i++) {
+		ring = _PERCPU_VAR(systrace_ring, i);
+		if (!ring)
+			continue;
+		for (uint64_t j = ring->tail; j != ACCESS_ONCE(ring->head); j++)
+			systrace_printk("",
+			                &ring->recs[j & (SYSTRACE_RING_SLOTS - 1)]);
+		if (ring->nr_dropped)
+			printk("Core %d dropped %llu records\n", i, ring->nr_dropped);
+	}
 }
 
 void systrace_clear_buffer(void)
 {
-	spin_lock_irqsave(&systrace_lock);
-	memset(systrace_buffer, 0, sizeof(struct systrace_record) * MAX_SYSTRACES);
-	spin_unlock_irqsave(&systrace_lock);
+	struct systrace_ring *ring;
+
+	qlock(&systrace_qlock);
+	for (int i = 0; i < num_cores; i++) {
+		ring = _PERCPU_VAR(systrace_ring, i);
+		if (!ring)
+			continue;
+		ring->nr_dropped = 0;
+		ACCESS_ONCE(ring->tail) = ACCESS_ONCE(ring->head);
+	}
+	qunlock(&systrace_qlock);
+}
+
+/* Drains whole records from the cores' rings into va, a core at a time.
+ * Returns the number of bytes copied. */
+size_t systrace_read(void *va, size_t n)
+{
+	struct systrace_ring *ring;
+	size_t nr_recs = n / sizeof(struct systrace_record);
+	size_t copied = 0;
+	uint64_t head;
+
+	qlock(&systrace_qlock);
+	for (int i = 0; i < num_cores && copied < nr_recs; i++) {
+		ring = _PERCPU_VAR(systrace_ring, i);
+		if (!ring)
+			continue;
+		head = ACCESS_ONCE(ring->head);
+		rmb();	/* read the records after the head that covers them */
+		while (ring->tail != head && copied < nr_recs) {
+			memcpy((struct systrace_record*)va + copied++,
+			       &ring->recs[ring->tail & (SYSTRACE_RING_SLOTS - 1)],
+			       sizeof(struct systrace_record));
+			mb();	/* done with the slot before handing it back */
+			ACCESS_ONCE(ring->tail) = ring->tail + 1;
+		}
+	}
+	qunlock(&systrace_qlock);
+	return copied * sizeof(struct systrace_record);
+}
+
+/* Upper bound, in nsec, of the bucket holding the pct'th percentile of hist. */
+static uint64_t sysc_lat_pct(uint64_t *hist, uint64_t total, int pct)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < SYSC_LAT_NR_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+	return tsc2nsec(2ULL << i);
+}
+
+/* Prints one row per syscall that has run, merging the cores' tables.
+ * Latencies are bucket upper bounds, so they're within a factor of two. */
+size_t sysc_lat_print(char *buf, size_t bufsz)
+{
+	struct sysc_lat_hist *h;
+	uint64_t hist[SYSC_LAT_NR_BUCKETS];
+	uint64_t total;
+	size_t len = 0;
+	int max;
+
+	len += snprintf(buf + len, bufsz - len, "%-16s %12s %12s %12s %12s %12s\n",
+	                "syscall", "count", "p50_ns", "p90_ns", "p99_ns",
+	                "max_ns");
+	for (int sc = 0; sc < MIN(max_syscall, SYSC_LAT_MAX_SYSC); sc++) {
+		memset(hist, 0, sizeof(hist));
+		total = 0;
+		max = 0;
+		for (int i = 0; i < num_cores; i++) {
+			h = _PERCPU_VAR(sysc_lat_hist, i);
+			if (!h)
+				continue;
+			for (int j = 0; j < SYSC_LAT_NR_BUCKETS; j++) {
+				hist[j] += h->hist[sc][j];
+				total += h->hist[sc][j];
+			}
+		}
+		if (!total || !syscall_table[sc].name)
+			continue;
+		for (int j = 0; j < SYSC_LAT_NR_BUCKETS; j++) {
+			if (hist[j])
+				max = j;
+		}
+		len += snprintf(buf + len, bufsz - len,
+		                "%-16s %12llu %12llu %12llu %12llu %12llu\n",
+		                syscall_table[sc].name, total,
+		                sysc_lat_pct(hist, total, 50),
+		                sysc_lat_pct(hist, total, 90),
+		                sysc_lat_pct(hist, total, 99),
+		                tsc2nsec(2ULL << max));
+	}
+	return len;
+}
+
+/* Racy with concurrent syscalls, but close enough. */
+void sysc_lat_reset(void)
+{
+	struct sysc_lat_hist *h;
+
+	for (int i = 0; i < num_cores; i++) {
+		h = _PERCPU_VAR(sysc_lat_hist, i);
+		if (h)
+			memset(h, 0, sizeof(struct sysc_lat_hist));
+	}
 }
 
 bool syscall_uses_fd(struct syscall *sysc, int fd)
@@ -9,6 +9,10 @@
 #include <taskqueue.h>
 #include <trap.h>
 #include <kthread.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <string.h>
+#include <alarm.h>
 
 /* BSD Taskqueue wrappers. */
 static void __tq_wrapper(uint32_t srcid, long a0, long a1, long a2)
@@ -27,87 +31,341 @@ int taskqueue_enqueue(struct taskqueue *queue, struct task *task)
 
 
 /* Linux workqueue wrappers */
+
+/* Linux drivers think in jiffies, and we pretend HZ is 100. */
+#define WQ_JIFFY_USEC			10000
+/* Delayed work can go off up to 1/8th of its delay late */
+#define WQ_DELAY_SLACK_SHIFT	3
+
+struct wq_pool {
+	spinlock_t					lock;
+	struct work_tailq			pending;
+	struct workqueue_struct		*wq;
+	uint32_t					coreid;		/* unused for unbound pools */
+	unsigned int				nr_workers;	/* drainers in flight */
+	struct kthread				*worker;	/* last drainer to run work */
+	uint32_t					worker_core;
+	uint64_t					nr_queued;
+	uint64_t					nr_run;
+	uint64_t					total_delay;
+	uint64_t					max_delay;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct workqueue_struct {
+	char						name[WQ_NAME_LEN];
+	unsigned int				flags;
+	unsigned int				nr_pools;
+	struct wq_pool				*pools;
+	atomic_t					nr_inflight;	/* queued or running */
+	atomic_t					nr_coalesced;
+	TAILQ_ENTRY(workqueue_struct)	link;
+};
+TAILQ_HEAD(wq_tailq, workqueue_struct);
+
+static struct wq_tailq all_wqs = TAILQ_HEAD_INITIALIZER(all_wqs);
+static spinlock_t all_wqs_lock = SPINLOCK_INITIALIZER;
+struct workqueue_struct *system_wq;
+
+void workqueue_init(void)
+{
+	system_wq = alloc_workqueue("events", 0, 0);
+	assert(system_wq);
+}
+
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags,
+                                         int max_active)
+{
+	struct workqueue_struct *wq;
+	struct wq_pool *pool;
+
+	wq = kzmalloc(sizeof(struct workqueue_struct), KMALLOC_WAIT);
+	strlcpy(wq->name, name, sizeof(wq->name));
+	wq->flags = flags;
+	wq->nr_pools = flags & WQ_UNBOUND ? 1 : num_cores;
+	wq->pools = kzmalloc_align(wq->nr_pools * sizeof(struct wq_pool),
+	                           KMALLOC_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < wq->nr_pools; i++) {
+		pool = &wq->pools[i];
+		spinlock_init_irqsave(&pool->lock);
+		TAILQ_INIT(&pool->pending);
+		pool->wq = wq;
+		pool->coreid = i;
+	}
+	atomic_init(&wq->nr_inflight, 0);
+	atomic_init(&wq->nr_coalesced, 0);
+	spin_lock(&all_wqs_lock);
+	TAILQ_INSERT_TAIL(&all_wqs, wq, link);
+	spin_unlock(&all_wqs_lock);
+	return wq;
+}
+
+/* Waits for all queued work to run.  Delayed work whose alarm hasn't gone off
+ * yet isn't waited on, same as Linux.  Don't call this from work on wq. */
 void flush_workqueue(struct workqueue_struct *wq)
 {
+	while (atomic_read(&wq->nr_inflight))
+		kthread_yield();
 }
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
+	if (!wq)
+		return;
+	spin_lock(&all_wqs_lock);
+	TAILQ_REMOVE(&all_wqs, wq, link);
+	spin_unlock(&all_wqs_lock);
+	flush_workqueue(wq);
+	/* Drainers touch their pool after the last work runs */
+	for (int i = 0; i < wq->nr_pools; i++) {
+		while (ACCESS_ONCE(wq->pools[i].nr_workers))
+			kthread_yield();
+	}
+	kfree(wq->pools);
+	kfree(wq);
 }
 
+/* Linux's singlethread workqueues run one item at a time, in order. */
 struct workqueue_struct *create_singlethread_workqueue(char *name)
 {
-	/* Non-canonical addr on AMD64.  No one should be derefing this. */
-	return (void*)0xf0f0f0f0f0f0f0f0;
+	return alloc_workqueue(name, WQ_UNBOUND | WQ_ORDERED, 1);
 }
 
-static void __wq_wrapper(uint32_t srcid, long a0, long a1, long a2)
+/* Returns the number of workqueues, with a kmalloc'd array of their stats in
+ * *stats_p, which the caller frees.  Racy with concurrent work, but close
+ * enough. */
+size_t workqueue_get_stats(struct wq_stats **stats_p)
 {
-	struct work_struct *work = (struct work_struct*)a0;
-	work->func(work);
+	struct workqueue_struct *wq;
+	struct wq_stats *stats;
+	struct wq_pool *pool;
+	size_t nr_wqs = 0, i = 0;
+
+	spin_lock(&all_wqs_lock);
+	TAILQ_FOREACH(wq, &all_wqs, link)
+		nr_wqs++;
+	stats = kzmalloc(sizeof(struct wq_stats) * (nr_wqs + 1), 0);
+	if (!stats) {
+		spin_unlock(&all_wqs_lock);
+		*stats_p = 0;
+		return 0;
+	}
+	TAILQ_FOREACH(wq, &all_wqs, link) {
+		strlcpy(stats[i].name, wq->name, sizeof(stats[i].name));
+		stats[i].flags = wq->flags;
+		stats[i].nr_coalesced = atomic_read(&wq->nr_coalesced);
+		for (int j = 0; j < wq->nr_pools; j++) {
+			pool = &wq->pools[j];
+			stats[i].nr_queued += pool->nr_queued;
+			stats[i].nr_run += pool->nr_run;
+			stats[i].total_delay += pool->total_delay;
+			stats[i].max_delay = MAX(stats[i].max_delay, pool->max_delay);
+		}
+		i++;
+	}
+	spin_unlock(&all_wqs_lock);
+	*stats_p = stats;
+	return nr_wqs;
 }
 
-static void __wq_wrapper_delay(uint32_t srcid, long a0, long a1, long a2)
+void init_work(struct work_struct *work, void (*func)(struct work_struct *))
 {
-	struct work_struct *work = (struct work_struct*)a0;
-	unsigned long delay = (unsigned long)a1;
-	kthread_usleep(delay * 10000);
-	work->func(work);
+	work->func = func;
+	work->pool = 0;
+	atomic_init(&work->pending, 0);
 }
 
-static void send_work(int coreid, struct work_struct *work)
+static void __delayed_work_fire(struct alarm_waiter *waiter,
+                                struct hw_trapframe *hw_tf);
+
+void init_delayed_work(struct delayed_work *dwork,
+                       void (*func)(struct work_struct *))
 {
-	send_kernel_message(coreid, __wq_wrapper, (long)work, 0, 0, KMSG_ROUTINE);
+	init_work(&dwork->work, func);
+	dwork->wq = 0;
+	dwork->tchain = 0;
+	init_awaiter_irq(&dwork->alarm, __delayed_work_fire);
 }
 
-static void send_work_delay(int coreid, struct delayed_work *work,
-                            unsigned long delay)
+/* Whether the pool's last drainer is still running work, as opposed to being
+ * blocked.  A drainer that hasn't started yet counts as running. */
+static bool wq_worker_running(struct wq_pool *pool)
 {
-	send_kernel_message(coreid, __wq_wrapper_delay, (long)work, (long)delay, 0,
-	                    KMSG_ROUTINE);
+	if (!pool->worker)
+		return TRUE;
+	return ACCESS_ONCE(per_cpu_info[pool->worker_core].cur_kthread) ==
+	       pool->worker;
 }
 
-bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+/* Where a pool's drainers run.  Unbound work stays on the calling core, unless
+ * that would interrupt an MCP. */
+static uint32_t wq_pool_core(struct wq_pool *pool)
+{
+	if (!(pool->wq->flags & WQ_UNBOUND))
+		return pool->coreid;
+	if (per_cpu_info[core_id()].owning_proc)
+		return 0;
+	return core_id();
+}
+
+/* Runs a pool's work until there is none left.  The work func can free the
+ * work, so we can't touch it after calling func. */
+static void __wq_drain(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct wq_pool *pool = (struct wq_pool*)a0;
+	struct workqueue_struct *wq = pool->wq;
+	struct work_struct *work;
+	uint64_t delay;
+
+	while (1) {
+		spin_lock_irqsave(&pool->lock);
+		work = TAILQ_FIRST(&pool->pending);
+		if (!work) {
+			pool->nr_workers--;
+			spin_unlock_irqsave(&pool->lock);
+			return;
+		}
+		TAILQ_REMOVE(&pool->pending, work, link);
+		work->pool = 0;
+		pool->worker = per_cpu_info[core_id()].cur_kthread;
+		pool->worker_core = core_id();
+		delay = read_tsc() - work->queued_tsc;
+		pool->nr_run++;
+		pool->total_delay += delay;
+		pool->max_delay = MAX(pool->max_delay, delay);
+		/* Clear pending first, so the work can requeue itself */
+		atomic_set(&work->pending, 0);
+		spin_unlock_irqsave(&pool->lock);
+		work->func(work);
+		atomic_dec(&wq->nr_inflight);
+	}
+}
+
+/* Puts work on the coreid's pool and makes sure a drainer is coming.  The
+ * caller already set work->pending.  Safe to call from IRQ context. */
+static void __queue_work(uint32_t coreid, struct workqueue_struct *wq,
+                         struct work_struct *work)
 {
-	send_work(core_id(), work);
+	struct wq_pool *pool = &wq->pools[wq->flags & WQ_UNBOUND ? 0 : coreid];
+	bool kick = FALSE;
+
+	atomic_inc(&wq->nr_inflight);
+	spin_lock_irqsave(&pool->lock);
+	work->queued_tsc = read_tsc();
+	work->pool = pool;
+	TAILQ_INSERT_TAIL(&pool->pending, work, link);
+	pool->nr_queued++;
+	/* One drainer handles everything queued before it runs.  We only need
+	 * another if the current one blocked in some work. */
+	if (!pool->nr_workers ||
+	    (!(wq->flags & WQ_ORDERED) && !wq_worker_running(pool))) {
+		pool->nr_workers++;
+		pool->worker = 0;
+		kick = TRUE;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	if (kick)
+		send_kernel_message(wq_pool_core(pool), __wq_drain, (long)pool, 0, 0,
+		                    KMSG_ROUTINE);
+}
+
+bool queue_work_on(int coreid, struct workqueue_struct *wq,
+                   struct work_struct *work)
+{
+	if (atomic_swap(&work->pending, 1)) {
+		atomic_inc(&wq->nr_coalesced);
+		return FALSE;
+	}
+	__queue_work(coreid, wq, work);
 	return TRUE;
 }
 
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return queue_work_on(core_id(), wq, work);
+}
+
 bool schedule_work(struct work_struct *work)
 {
-	send_work(0, work);
-	return TRUE;
+	return queue_work_on(0, system_wq, work);
 }
 
-bool cancel_work(struct work_struct *dwork)
+/* Takes work off its pool, if it hasn't started running yet. */
+bool cancel_work(struct work_struct *work)
 {
-	return FALSE;
+	struct wq_pool *pool = ACCESS_ONCE(work->pool);
+	bool ret = FALSE;
+
+	if (!pool)
+		return FALSE;
+	spin_lock_irqsave(&pool->lock);
+	if (work->pool == pool) {
+		TAILQ_REMOVE(&pool->pending, work, link);
+		work->pool = 0;
+		atomic_set(&work->pending, 0);
+		atomic_dec(&pool->wq->nr_inflight);
+		ret = TRUE;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	return ret;
 }
 
-bool cancel_work_sync(struct work_struct *dwork)
+bool cancel_work_sync(struct work_struct *work)
 {
-	return FALSE;
+	return cancel_work(work);
+}
+
+static void __delayed_work_fire(struct alarm_waiter *waiter,
+                                struct hw_trapframe *hw_tf)
+{
+	struct delayed_work *dwork = container_of(waiter, struct delayed_work,
+	                                          alarm);
+
+	__queue_work(dwork->coreid, dwork->wq, &dwork->work);
+}
+
+bool queue_delayed_work_on(int coreid, struct workqueue_struct *wq,
+                           struct delayed_work *dwork, unsigned long delay)
+{
+	uint64_t usec = delay * WQ_JIFFY_USEC;
+
+	if (atomic_swap(&dwork->work.pending, 1)) {
+		atomic_inc(&wq->nr_coalesced);
+		return FALSE;
+	}
+	if (!delay) {
+		__queue_work(coreid, wq, &dwork->work);
+		return TRUE;
+	}
+	dwork->wq = wq;
+	dwork->coreid = coreid;
+	dwork->tchain = &per_cpu_info[core_id()].tchain;
+	set_awaiter_rel(&dwork->alarm, usec);
+	set_awaiter_slack(&dwork->alarm, usec >> WQ_DELAY_SLACK_SHIFT);
+	set_alarm(dwork->tchain, &dwork->alarm);
+	return TRUE;
 }
 
 bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
                         unsigned long delay)
 {
-	send_work_delay(core_id(), dwork, delay);
-	return TRUE;
+	return queue_delayed_work_on(core_id(), wq, dwork, delay);
 }
 
 bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
 {
-	send_work_delay(0, dwork, delay);
-	return TRUE;
+	return queue_delayed_work_on(0, system_wq, dwork, delay);
 }
 
 bool cancel_delayed_work(struct delayed_work *dwork)
 {
-	return FALSE;
+	if (dwork->tchain && unset_alarm(dwork->tchain, &dwork->alarm)) {
+		atomic_set(&dwork->work.pending, 0);
+		return TRUE;
+	}
+	return cancel_work(&dwork->work);
 }
 
 bool cancel_delayed_work_sync(struct delayed_work *dwork)
 {
-	return FALSE;
+	return cancel_delayed_work(dwork);
 }
@@ -118,32 +118,106 @@ uint64_t nsec2tsc(uint64_t nsec)
 		return (nsec * system_timing.tsc_freq) / 1000000000;
 }
 
-/* TODO: figure out what epoch time TSC == 0 is and store that as boot_tsc */
+/* The wall clock lives in proc_global_info, so userspace can read it without
+ * trapping.  Writers serialize on the lock and bump the seqctr around their
+ * changes.
+ *
+ * TODO: figure out what epoch time TSC == 0 is and use that at boot. */
 static uint64_t boot_sec = 1242129600; /* nanwan's birthday */
+static spinlock_t walltime_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+
+/* Same as userspace's __ros_tsc2walltime_ns() */
+static uint64_t tsc2walltime_ns(uint64_t tsc)
+{
+	struct proc_global_info *gi = &__proc_global_info;
+	uint64_t freq, tsc_base, ns_base, delta;
+	seq_ctr_t old_seq;
+
+	do {
+		cmb();
+		old_seq = gi->walltime_seqctr;
+		rmb();
+		freq = gi->walltime_tsc_freq;
+		tsc_base = gi->walltime_tsc_base;
+		ns_base = gi->walltime_ns_base;
+	} while (seqctr_retry(old_seq, gi->walltime_seqctr));
+	/* Other cores' TSCs could be a little behind the base */
+	if (tsc >= tsc_base) {
+		delta = tsc - tsc_base;
+		return ns_base + (delta / freq) * 1000000000 +
+		       (delta % freq) * 1000000000 / freq;
+	}
+	delta = tsc_base - tsc;
+	return ns_base - (delta / freq) * 1000000000 -
+	       (delta % freq) * 1000000000 / freq;
+}
+
+/* Rebases the wall clock at the current TSC, to ns, with TSC frequency freq. */
+static void __walltime_rebase(uint64_t ns, uint64_t freq)
+{
+	struct proc_global_info *gi = &__proc_global_info;
+
+	__seq_start_write(&gi->walltime_seqctr);
+	gi->walltime_tsc_base = read_tsc();
+	gi->walltime_ns_base = ns;
+	gi->walltime_tsc_freq = freq;
+	__seq_end_write(&gi->walltime_seqctr);
+}
+
+/* Call once the TSC is calibrated */
+void walltime_init(void)
+{
+	spin_lock_irqsave(&walltime_lock);
+	__walltime_rebase(boot_sec * 1000000000, system_timing.tsc_freq);
+	spin_unlock_irqsave(&walltime_lock);
+}
+
+/* Sets the wall clock to epoch_ns, e.g. from an RTC or an NTP step. */
+void set_walltime(uint64_t epoch_ns)
+{
+	spin_lock_irqsave(&walltime_lock);
+	__walltime_rebase(epoch_ns, __proc_global_info.walltime_tsc_freq);
+	spin_unlock_irqsave(&walltime_lock);
+}
+
+/* Slews the wall clock: from now on, it runs ppb parts per billion faster
+ * (positive) or slower than the TSC.  Not cumulative. */
+void set_walltime_slew(long ppb)
+{
+	uint64_t freq = system_timing.tsc_freq;
+
+	/* A faster clock means fewer TSC ticks per wall second */
+	freq -= (long)(freq / 1000) * ppb / 1000000;
+	spin_lock_irqsave(&walltime_lock);
+	__walltime_rebase(tsc2walltime_ns(read_tsc()), freq);
+	spin_unlock_irqsave(&walltime_lock);
+}
 
+/* The TSC value, at the TSC's frequency, whose time since TSC == 0 is the wall
+ * clock. */
 uint64_t epoch_tsc(void)
 {
-	return read_tsc() + sec2tsc(boot_sec);
+	return nsec2tsc(epoch_nsec());
 }
 
 uint64_t epoch_sec(void)
 {
-	return tsc2sec(epoch_tsc());
+	return epoch_nsec() / 1000000000;
 }
 
 uint64_t epoch_msec(void)
 {
-	return tsc2msec(epoch_tsc());
+	return epoch_nsec() / 1000000;
 }
 
 uint64_t epoch_usec(void)
 {
-	return tsc2usec(epoch_tsc());
+	return epoch_nsec() / 1000;
 }
 
 uint64_t epoch_nsec(void)
 {
-	return tsc2nsec(epoch_tsc());
+	return tsc2walltime_ns(read_tsc());
 }
 
 void tsc2timespec(uint64_t tsc_time, struct timespec *ts)
@@ -0,0 +1,182 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Static tracepoints.  See tracepoint.h.
+ *
+ * Each core has a ring of records that only it writes, and that only the
+ * reader (under tp_qlock) consumes, so the rings need no locks.  The writer
+ * runs with IRQs off, so a tracepoint in an IRQ handler can't interleave with
+ * one it interrupted.  The rings hold the raw TSC; the reader converts it to
+ * nsec, which keeps the division off the traced path.
+ *
+ * We don't use trace_ring here: its rings are walked in place with
+ * trace_ring_foreach(), but these need to be drained while they fill. */
+
+#include <tracepoint.h>
+#include <atomic.h>
+#include <percpu.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <kthread.h>
+#include <smp.h>
+#include <time.h>
+#include <env.h>
+#include <arch/arch.h>
+
+#define TP_RING_SLOTS			1024	/* per core, power of 2 */
+
+struct tp_ring {
+	uint64_t					head;		/* written by the core */
+	uint64_t					tail;		/* written by the reader */
+	uint64_t					nr_dropped;
+	struct trace_record			recs[TP_RING_SLOTS];
+};
+
+uint64_t tracepoints_enabled;
+static DEFINE_PERCPU(struct tp_ring *, tp_ring);
+static qlock_t tp_qlock = QLOCK_INITIALIZER(tp_qlock);
+
+static const char *tp_names[NR_TRACEPOINTS] = {
+	[TP_SYSCALL_ENTER]	= "syscall_enter",
+	[TP_SYSCALL_EXIT]	= "syscall_exit",
+	[TP_KMSG_SEND]		= "kmsg_send",
+	[TP_KMSG_HANDLE]	= "kmsg_handle",
+	[TP_PAGE_FAULT]		= "page_fault",
+	[TP_BLOCK_SUBMIT]	= "block_submit",
+	[TP_BLOCK_COMPLETE]	= "block_complete",
+	[TP_QIO_BLOCK]		= "qio_block",
+	[TP_QIO_WAKE]		= "qio_wake",
+};
+
+void __tracepoint(int id, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+	struct tp_ring *ring;
+	struct trace_record *rec;
+	struct proc *p;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	ring = PERCPU_VAR(tp_ring);
+	/* enabled before we allocated, on a core that raced with the enable */
+	if (!ring)
+		goto out;
+	if (ring->head - ACCESS_ONCE(ring->tail) >= TP_RING_SLOTS) {
+		ring->nr_dropped++;
+		goto out;
+	}
+	rec = &ring->recs[ring->head & (TP_RING_SLOTS - 1)];
+	p = current;
+	rec->tstamp = read_tsc();
+	rec->id = id;
+	rec->coreid = core_id();
+	rec->pid = p ? p->pid : 0;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	wmb();	/* the record is written before the reader can see it */
+	ACCESS_ONCE(ring->head) = ring->head + 1;
+out:
+	enable_irqsave(&irq_state);
+}
+
+/* Turns on or off the tracepoint called name, or all of them.  Returns -1 if
+ * there's no such tracepoint. */
+int tracepoint_enable(const char *name, bool on)
+{
+	uint64_t mask = 0;
+	struct tp_ring *ring;
+
+	if (!strcmp(name, "all")) {
+		mask = (1ULL << NR_TRACEPOINTS) - 1;
+	} else {
+		for (int i = 0; i < NR_TRACEPOINTS; i++) {
+			if (!strcmp(name, tp_names[i]))
+				mask = 1ULL << i;
+		}
+	}
+	if (!mask)
+		return -1;
+	qlock(&tp_qlock);
+	if (on) {
+		for (int i = 0; i < num_cores; i++) {
+			if (_PERCPU_VAR(tp_ring, i))
+				continue;
+			ring = kzmalloc(sizeof(struct tp_ring), KMALLOC_WAIT);
+			_PERCPU_VAR(tp_ring, i) = ring;
+		}
+		wmb();	/* publish the rings before the flags */
+		ACCESS_ONCE(tracepoints_enabled) = tracepoints_enabled | mask;
+	} else {
+		ACCESS_ONCE(tracepoints_enabled) = tracepoints_enabled & ~mask;
+	}
+	qunlock(&tp_qlock);
+	return 0;
+}
+
+/* Throws away whatever is in the rings. */
+void tracepoint_reset(void)
+{
+	struct tp_ring *ring;
+
+	qlock(&tp_qlock);
+	for (int i = 0; i < num_cores; i++) {
+		ring = _PERCPU_VAR(tp_ring, i);
+		if (!ring)
+			continue;
+		ring->nr_dropped = 0;
+		ACCESS_ONCE(ring->tail) = ACCESS_ONCE(ring->head);
+	}
+	qunlock(&tp_qlock);
+}
+
+/* Drains whole records from the cores' rings into va, a core at a time.
+ * Records from one core are in order; sort by tstamp to merge the cores.
+ * Returns the number of bytes copied. */
+size_t tracepoint_read(void *va, size_t n)
+{
+	struct tp_ring *ring;
+	struct trace_record *rec;
+	size_t nr_recs = n / sizeof(struct trace_record);
+	size_t copied = 0;
+	uint64_t head;
+
+	qlock(&tp_qlock);
+	for (int i = 0; i < num_cores && copied < nr_recs; i++) {
+		ring = _PERCPU_VAR(tp_ring, i);
+		if (!ring)
+			continue;
+		head = ACCESS_ONCE(ring->head);
+		rmb();	/* read the records after the head that covers them */
+		while (ring->tail != head && copied < nr_recs) {
+			rec = (struct trace_record*)va + copied++;
+			*rec = ring->recs[ring->tail & (TP_RING_SLOTS - 1)];
+			rec->tstamp = tsc2nsec(rec->tstamp);
+			mb();	/* done with the slot before handing it back */
+			ACCESS_ONCE(ring->tail) = ring->tail + 1;
+		}
+	}
+	qunlock(&tp_qlock);
+	return copied * sizeof(struct trace_record);
+}
+
+/* Prints the tracepoints, whether they're on, and the drop count into buf. */
+size_t tracepoint_status(char *buf, size_t bufsz)
+{
+	size_t len = 0;
+	uint64_t nr_dropped = 0;
+	struct tp_ring *ring;
+
+	for (int i = 0; i < NR_TRACEPOINTS; i++)
+		len += snprintf(buf + len, bufsz - len, "%s%s%s", i ? " " : "",
+		                tp_names[i],
+		                tracepoints_enabled & (1ULL << i) ? "(on)" : "");
+	for (int i = 0; i < num_cores; i++) {
+		ring = _PERCPU_VAR(tp_ring, i);
+		if (ring)
+			nr_dropped += ring->nr_dropped;
+	}
+	len += snprintf(buf + len, bufsz - len, "; %llu dropped", nr_dropped);
+	return len;
+}
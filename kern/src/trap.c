@@ -12,6 +12,8 @@
 #include <assert.h>
 #include <kdebug.h>
 #include <kmalloc.h>
+#include <rcu.h>
+#include <tracepoint.h>
 
 static void print_unhandled_trap(struct proc *p, struct user_context *ctx,
                                  unsigned int trap_nr, unsigned int err,
@@ -138,10 +140,48 @@ void kernel_msg_init(void)
 	                   sizeof(struct kernel_message), ARCH_CL_SIZE, 0, 0, 0);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+/* Pushes kmsg onto a core's lock-free kmsg stack.  Returns TRUE if the stack
+ * was empty.  The consumer only ever takes the whole stack, so there's no ABA
+ * problem. */
+static bool kmsg_push(struct kernel_message **stack,
+                      struct kernel_message *kmsg)
+{
+	struct kernel_message *old;
+
+	do {
+		old = ACCESS_ONCE(*stack);
+		kmsg->link.stqe_next = old;
+	} while (!atomic_cas_ptr((void**)stack, old, kmsg));
+	return !old;
+}
+
+/* Takes every kmsg off a core's stack.  They come off newest first; returns
+ * them oldest first in list. */
+static void kmsg_grab_all(struct kernel_message **stack,
+                          struct kernel_msg_list *list)
+{
+	struct kernel_message *kmsg, *next;
+
+	STAILQ_INIT(list);
+	if (!ACCESS_ONCE(*stack))
+		return;
+	kmsg = (struct kernel_message*)atomic_swap((atomic_t*)stack, 0);
+	for (; kmsg; kmsg = next) {
+		next = kmsg->link.stqe_next;
+		STAILQ_INSERT_HEAD(list, kmsg, link);
+	}
+}
+
+/* Queues a kernel message for dst, like send_kernel_message(), but leaves the
+ * IPI to the caller, so it can send one IPI to many cores (send_ipi_multi()).
+ * Returns TRUE if dst needs an I_KERNEL_MSG IPI. */
+bool send_kernel_message_noipi(uint32_t dst, amr_t pc, long arg0, long arg1,
+                               long arg2, int type)
 {
 	kernel_message_t *k_msg;
+	struct per_cpu_info *pcpui;
+	bool was_empty;
+
 	assert(pc);
 	// note this will be freed on the destination core
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
@@ -153,22 +193,37 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 	k_msg->arg2 = arg2;
 	switch (type) {
 		case KMSG_IMMEDIATE:
-			spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
+			was_empty = kmsg_push(&per_cpu_info[dst].immed_amsgs, k_msg);
 			break;
 		case KMSG_ROUTINE:
-			spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
+			was_empty = kmsg_push(&per_cpu_info[dst].routine_amsgs, k_msg);
+			/* if we're sending a routine message locally, we don't want/need
+			 * an IPI */
+			if (dst == k_msg->srcid)
+				return FALSE;
 			break;
 		default:
 			panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we don't
-	 * need an wmb_f() */
-	/* if we're sending a routine message locally, we don't want/need an IPI */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
+	/* The CAS is a full barrier, so we don't need a wmb_f() before the IPI.
+	 *
+	 * Whoever made the stack non-empty sends the IPI.  Until the destination
+	 * takes the stack (after that IPI arrives), later messages just ride along.
+	 * For routine messages, the destination won't halt or return to userspace
+	 * while its stack is non-empty. */
+	pcpui = &per_cpu_info[k_msg->srcid];
+	if (was_empty)
+		pcpui->nr_kmsg_ipis++;
+	else
+		pcpui->nr_kmsg_ipis_avoided++;
+	return was_empty;
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	tracepoint(TP_KMSG_SEND, dst, pc, type);
+	if (send_kernel_message_noipi(dst, pc, arg0, arg1, arg2, type))
 		send_ipi(dst, I_KERNEL_MSG);
 	return 0;
 }
@@ -186,42 +241,41 @@ void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct kernel_message *kmsg_i, *temp;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
-		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list */
-	spin_lock_irqsave(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
+	struct kernel_msg_list list;
+
+	/* Any immediates sent after this will send another IPI. */
+	kmsg_grab_all(&pcpui->immed_amsgs, &list);
+	STAILQ_FOREACH_SAFE(kmsg_i, &list, link, temp) {
 		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
+		tracepoint(TP_KMSG_HANDLE, kmsg_i->srcid, kmsg_i->pc, 0);
 		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message, link);
 		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
 	}
-	spin_unlock_irqsave(&pcpui->immed_amsg_lock);
 }
 
 bool has_routine_kmsg(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	/* lockless peek */
-	return !STAILQ_EMPTY(&pcpui->routine_amsgs);
+	return !STAILQ_EMPTY(&pcpui->routine_batch) ||
+	       ACCESS_ONCE(pcpui->routine_amsgs);
 }
 
-/* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
- * empty. */
+/* Helper function, gets the next routine KMSG (RKM).  Returns 0 if there are
+ * none.  IRQs are disabled by our caller, and only this core touches the
+ * routine_batch. */
 static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
 {
 	struct kernel_message *kmsg;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list.
-	 * IRQs are disabled by our caller. */
-	spin_lock(&pcpui->routine_amsg_lock);
-	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
+	struct kernel_msg_list list;
+
+	if (STAILQ_EMPTY(&pcpui->routine_batch)) {
+		kmsg_grab_all(&pcpui->routine_amsgs, &list);
+		STAILQ_CONCAT(&pcpui->routine_batch, &list);
+	}
+	kmsg = STAILQ_FIRST(&pcpui->routine_batch);
 	if (kmsg)
-		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
+		STAILQ_REMOVE_HEAD(&pcpui->routine_batch, link);
 	return kmsg;
 }
 
@@ -244,6 +298,8 @@ void process_routine_kmsg(void)
 	 * the IPI is used to keep the core from going to sleep - even though RKMs
 	 * aren't handled in the kmsg handler.  Check smp_idle() for more info. */
 	assert(!irq_is_enabled());
+	/* Callers are never in an RCU read-side critical section */
+	rcu_report_qs();
 	while ((kmsg = get_next_rkmsg(pcpui))) {
 		/* Copy in, and then free, in case we don't return */
 		msg_cp = *kmsg;
@@ -256,6 +312,7 @@ void process_routine_kmsg(void)
 		 * (change_to), it's not really the rest of the syscall context. */
 		pcpui->cur_kthread->flags = KTH_KTASK_FLAGS;
 		pcpui_trace_kmsg(pcpui, (uintptr_t)msg_cp.pc);
+		tracepoint(TP_KMSG_HANDLE, msg_cp.srcid, msg_cp.pc, 0);
 		msg_cp.pc(msg_cp.srcid, msg_cp.arg0, msg_cp.arg1, msg_cp.arg2);
 		/* And if we make it back, be sure to restore the default flags.  If we
 		 * never return, but the kthread exits via some other way (smp_idle()),
@@ -284,37 +341,43 @@ void process_routine_kmsg(void)
 void print_kmsgs(uint32_t coreid)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
-	void __print_kmsgs(struct kernel_msg_list *list, char *type)
+	void __print_kmsg(struct kernel_message *kmsg_i, char *type)
 	{
 		char *fn_name;
-		struct kernel_message *kmsg_i;
-		STAILQ_FOREACH(kmsg_i, list, link) {
-			fn_name = get_fn_name((long)kmsg_i->pc);
-			printk("%s KMSG on %d from %d to run %p(%s)\n", type,
-			       kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc, fn_name);
-			kfree(fn_name);
-		}
+
+		fn_name = get_fn_name((long)kmsg_i->pc);
+		printk("%s KMSG on %d from %d to run %p(%s)\n", type,
+		       kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc, fn_name);
+		kfree(fn_name);
 	}
-	__print_kmsgs(&pcpui->immed_amsgs, "Immedte");
-	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
+	struct kernel_message *kmsg_i;
+
+	/* The stacks are newest first */
+	for (kmsg_i = pcpui->immed_amsgs; kmsg_i; kmsg_i = kmsg_i->link.stqe_next)
+		__print_kmsg(kmsg_i, "Immedte");
+	STAILQ_FOREACH(kmsg_i, &pcpui->routine_batch, link)
+		__print_kmsg(kmsg_i, "Routine");
+	for (kmsg_i = pcpui->routine_amsgs; kmsg_i; kmsg_i = kmsg_i->link.stqe_next)
+		__print_kmsg(kmsg_i, "Routine");
 }
 
-/* Debugging stuff */
+/* Debugging stuff, also racy */
 void kmsg_queue_stat(void)
 {
 	struct kernel_message *kmsg;
 	bool immed_emp, routine_emp;
 	for (int i = 0; i < num_cores; i++) {
-		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		spin_lock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		printk("Core %d's immed_emp: %d, routine_emp %d\n", i, immed_emp,
-               routine_emp);
+		immed_emp = !ACCESS_ONCE(per_cpu_info[i].immed_amsgs);
+		routine_emp = !ACCESS_ONCE(per_cpu_info[i].routine_amsgs) &&
+		              STAILQ_EMPTY(&per_cpu_info[i].routine_batch);
+		printk("Core %d's immed_emp: %d, routine_emp %d, IPIs sent %lu, "
+		       "avoided %lu\n", i, immed_emp, routine_emp,
+		       per_cpu_info[i].nr_kmsg_ipis,
+		       per_cpu_info[i].nr_kmsg_ipis_avoided);
 		if (!immed_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
+			kmsg = ACCESS_ONCE(per_cpu_info[i].immed_amsgs);
+			if (!kmsg)
+				continue;
 			printk("Immed msg on core %d:\n", i);
 			printk("\tsrc:  %d\n", kmsg->srcid);
 			printk("\tdst:  %d\n", kmsg->dstid);
@@ -324,7 +387,11 @@ void kmsg_queue_stat(void)
 			printk("\targ2: %p\n", kmsg->arg2);
 		}
 		if (!routine_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
+			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_batch);
+			if (!kmsg)
+				kmsg = ACCESS_ONCE(per_cpu_info[i].routine_amsgs);
+			if (!kmsg)
+				continue;
 			printk("Routine msg on core %d:\n", i);
 			printk("\tsrc:  %d\n", kmsg->srcid);
 			printk("\tdst:  %d\n", kmsg->dstid);
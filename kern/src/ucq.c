@@ -10,42 +10,36 @@
 #include <mm.h>
 #include <atomic.h>
 
-/* Proc p needs to be current, and you should have checked that ucq is valid
- * memory.  We'll assert it here, to catch any of your bugs.  =) */
-void send_ucq_msg(struct ucq *ucq, struct proc *p, struct event_msg *msg)
+/* Pops a page off the ucq's spare stack.  Returns 0 if there are none, and -1
+ * if the user gave us garbage. */
+static struct ucq_page *get_spare_pg(struct ucq *ucq)
 {
-	uintptr_t my_slot = 0;
-	struct ucq_page *new_page, *old_page;
-	struct msg_container *my_msg;
+	uintptr_t pg, next;
+
+	do {
+		pg = atomic_read(&ucq->spare_pg);
+		if (!pg)
+			return 0;
+		if (!is_user_rwaddr((void*)pg, PGSIZE) || PGOFF(pg))
+			return (struct ucq_page*)-1;
+		next = ((struct ucq_page*)pg)->header.cons_next_pg;
+	} while (!atomic_cas(&ucq->spare_pg, pg, next));
+	atomic_dec(&ucq->nr_spare_pgs);
+	return (struct ucq_page*)pg;
+}
+
+/* Moves the producers onto a new page.  Only called by the producer whose slot
+ * is the first one past the end of old_page, so there is only ever one of us
+ * per ucq.  Returns our slot (the first one on the new page), or 0 on error.
+ * On error, we rewind prod_idx so that the next producer tries the swap again.
+ * Either way, prod_overflow is cleared, releasing the producers waiting on
+ * us. */
+static uintptr_t swap_ucq_page(struct ucq *ucq, struct proc *p,
+                               struct ucq_page *old_page)
+{
+	struct ucq_page *new_page;
+	uintptr_t my_slot;
 
-	assert(is_user_rwaddr(ucq, sizeof(struct ucq)));
-	/* So we can try to send ucqs to _Ss before they initialize */
-	if (!ucq->ucq_ready) {
-		if (__proc_is_mcp(p))
-			warn("proc %d is _M with an uninitialized ucq %p\n", p->pid, ucq);
-		return;
-	}
-	/* Bypass fetching/incrementing the counter if we're overflowing, helps
-	 * prevent wraparound issues on the counter (only 12 bits of counter) */
-	if (ucq->prod_overflow)
-		goto grab_lock;
-	/* Grab a potential slot */
-	my_slot = (uintptr_t)atomic_fetch_and_add(&ucq->prod_idx, 1);
-	if (slot_is_good(my_slot))
-		goto have_slot;
-	/* Warn others to not bother with the fetch_and_add */
-	ucq->prod_overflow = TRUE;
-	/* Sanity check */
-	if (PGOFF(my_slot) > 3000)
-		warn("Abnormally high counter, there's probably something wrong!");
-grab_lock:
-	/* Lock, for this proc/ucq.  Using an irqsave, since we may want to send ucq
-	 * messages from irq context. */
-	hash_lock_irqsave(p->ucq_hashlock, (long)ucq);
-	/* Grab a potential slot (again, preventing another DoS) */
-	my_slot = (uintptr_t)atomic_fetch_and_add(&ucq->prod_idx, 1);
-	if (slot_is_good(my_slot))
-		goto unlock_lock;
 	/* Check to make sure the old_page was good before we do anything too
 	 * intense (we deref it later).  Bad pages are likely due to
 	 * user-malfeasance or neglect.
@@ -53,13 +47,15 @@ grab_lock:
 	 * The is_user_rwaddr() check on old_page might catch addresses below
 	 * MMAP_LOWEST_VA, and we can also handle a PF, but we'll explicitly check
 	 * for 0 just to be sure (and it's a likely error). */
-	old_page = (struct ucq_page*)PTE_ADDR(my_slot);
 	if (!is_user_rwaddr(old_page, PGSIZE) || !old_page)
-		goto error_addr_unlock;
-	/* Things still aren't fixed, so we need to reset everything */
-	/* Try to get the spare page, so we don't have to mmap a new one */
-	new_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg, 0);
+		goto error_addr;
+	atomic_inc(&ucq->nr_pg_swaps);
+	/* Try to get a spare page, so we don't have to mmap a new one */
+	new_page = get_spare_pg(ucq);
+	if (new_page == (struct ucq_page*)-1)
+		goto error_addr;
 	if (!new_page) {
+		atomic_inc(&ucq->nr_pg_mmaps);
 		/* Warn if we have a ridiculous amount of pages in the ucq */
 		if (atomic_fetch_and_add(&ucq->nr_extra_pgs, 1) > UCQ_WARN_THRESH)
 			warn("Over %d pages in ucq %p for pid %d!\n", UCQ_WARN_THRESH,
@@ -72,10 +68,6 @@ grab_lock:
 		                                     MAP_ANON | MAP_POPULATE, 0, 0);
 		assert(new_page);
 		assert(!PGOFF(new_page));
-	} else {
-		/* If we're using the user-supplied new_page, we need to check it */
-		if (!is_user_rwaddr(new_page, PGSIZE) || PGOFF(new_page))
-			goto error_addr_unlock;
 	}
 	/* Now we have a page.  Lets make sure it's set up properly */
 	new_page->header.cons_next_pg = 0;
@@ -86,16 +78,68 @@ grab_lock:
 	 * slot (number '0') for us (reservation prevents DoS). */
 	my_slot = (uintptr_t)new_page;
 	atomic_set(&ucq->prod_idx, my_slot + 1);
-	/* Fallthrough to clear overflow and unlock */
-unlock_lock:
-	/* Clear the overflow, so new producers will try to get a slot */
+	/* Clear the overflow, so new producers will try to get a slot.  The
+	 * atomic_set is a write barrier on x86; the wmb is for everyone else. */
+	wmb();
 	ucq->prod_overflow = FALSE;
-	/* At this point, any normal (non-locking) producers can succeed in getting
-	 * a slot.  The ones that failed earlier will fight for the lock, then
-	 * quickly proceed when they get a good slot */
-	hash_unlock_irqsave(p->ucq_hashlock, (long)ucq);
-	/* Fall through to having a slot */
-have_slot:
+	return my_slot;
+error_addr:
+	/* Had a bad addr while swapping.  This is a bit more serious */
+	warn("Bad addr in ucq page management!");
+	atomic_set(&ucq->prod_idx, (uintptr_t)old_page + NR_MSG_PER_PAGE);
+	wmb();
+	ucq->prod_overflow = FALSE;
+	return 0;
+}
+
+/* Proc p needs to be current, and you should have checked that ucq is valid
+ * memory.  We'll assert it here, to catch any of your bugs.  =) */
+void send_ucq_msg(struct ucq *ucq, struct proc *p, struct event_msg *msg)
+{
+	uintptr_t my_slot;
+	struct msg_container *my_msg;
+	int8_t irq_state = 0;
+
+	assert(is_user_rwaddr(ucq, sizeof(struct ucq)));
+	/* So we can try to send ucqs to _Ss before they initialize */
+	if (!ucq->ucq_ready) {
+		if (__proc_is_mcp(p))
+			warn("proc %d is _M with an uninitialized ucq %p\n", p->pid, ucq);
+		return;
+	}
+	/* We may send ucq messages from irq context.  With irqs off, the producer
+	 * that swaps pages can't be interrupted by one waiting on it. */
+	disable_irqsave(&irq_state);
+	while (1) {
+		/* Bypass fetching/incrementing the counter if we're overflowing, helps
+		 * prevent wraparound issues on the counter (only 12 bits of
+		 * counter) */
+		if (!ACCESS_ONCE(ucq->prod_overflow)) {
+			/* Grab a potential slot */
+			my_slot = (uintptr_t)atomic_fetch_and_add(&ucq->prod_idx, 1);
+			if (slot_is_good(my_slot))
+				break;
+			/* The first bad slot belongs to the page swapper */
+			if (PGOFF(my_slot) == NR_MSG_PER_PAGE) {
+				/* Warn others to not bother with the fetch_and_add */
+				ucq->prod_overflow = TRUE;
+				my_slot = swap_ucq_page(ucq, p,
+				                        (struct ucq_page*)PTE_ADDR(my_slot));
+				if (!my_slot)
+					goto error_addr;
+				break;
+			}
+			/* Sanity check */
+			if (PGOFF(my_slot) > 3000)
+				warn("Abnormally high counter, there's probably something wrong!");
+		}
+		/* Someone else is swapping (or is about to).  Wait for them, then
+		 * try again. */
+		atomic_inc(&ucq->nr_pg_waits);
+		while (ACCESS_ONCE(ucq->prod_overflow))
+			cpu_relax();
+	}
+	enable_irqsave(&irq_state);
 	/* Sanity check on our slot. */
 	assert(slot_is_good(my_slot));
 	/* Convert slot to actual msg_container.  Note we never actually deref
@@ -103,7 +147,7 @@ have_slot:
 	my_msg = slot2msg(my_slot);
 	/* Make sure our msg is user RW */
 	if (!is_user_rwaddr(my_msg, sizeof(struct msg_container)))
-		goto error_addr;
+		goto error_addr_irq;
 	/* Finally write the message */
 	my_msg->ev_msg = *msg;
 	wmb();
@@ -111,13 +155,9 @@ have_slot:
 	 * our message (they could have been spinning on it) */
 	my_msg->ready = TRUE;
 	return;
-error_addr_unlock:
-	/* Had a bad addr while holding the lock.  This is a bit more serious */
-	warn("Bad addr in ucq page management!");
-	ucq->prod_overflow = FALSE;
-	hash_unlock_irqsave(p->ucq_hashlock, (long)ucq);
-	/* Fall-through to normal error out */
 error_addr:
+	enable_irqsave(&irq_state);
+error_addr_irq:
 	warn("Invalid user address, not sending a message");
 	/* TODO: consider killing the process here.  For now, just catch it.  For
 	 * some cases, we have a slot that we never fill in, though if we had a bad
@@ -139,8 +179,12 @@ void print_ucq(struct proc *p, struct ucq *ucq)
 	printk("UCQ %p\n", ucq);
 	printk("prod_idx: %p, cons_idx: %p\n", atomic_read(&ucq->prod_idx),
 	       atomic_read(&ucq->cons_idx));
-	printk("spare_pg: %p, nr_extra_pgs: %d\n", atomic_read(&ucq->spare_pg),
+	printk("spare_pg: %p, nr_spare_pgs: %d, nr_extra_pgs: %d\n",
+	       atomic_read(&ucq->spare_pg), atomic_read(&ucq->nr_spare_pgs),
 	       atomic_read(&ucq->nr_extra_pgs));
+	printk("pg swaps: %d, mmaps: %d, producer waits: %d\n",
+	       atomic_read(&ucq->nr_pg_swaps), atomic_read(&ucq->nr_pg_mmaps),
+	       atomic_read(&ucq->nr_pg_waits));
 	printk("prod_overflow: %d\n", ucq->prod_overflow);
 	/* Try to see our previous ucqs */
 	for (int i = atomic_read(&ucq->prod_idx), count = 0;
@@ -14,6 +14,7 @@
 #include <kmalloc.h>
 #include <assert.h>
 #include <pmap.h>
+#include <mm.h>
 #include <smp.h>
 
 static int string_copy_from_user(char *dst, const char *src)
@@ -199,6 +200,7 @@ bool uva_is_kva(struct proc *p, void *uva, void *kva)
 uintptr_t uva2kva(struct proc *p, void *uva, size_t len, int prot)
 {
 	struct page *u_page;
+	pte_t pte;
 	uintptr_t offset = PGOFF(uva);
 	if (!p)
 		return 0;
@@ -209,9 +211,17 @@ uintptr_t uva2kva(struct proc *p, void *uva, size_t len, int prot)
 		if (!is_user_raddr(uva, len))
 			return 0;
 	}
-	u_page = page_lookup(p->env_pgdir, uva, 0);
+	u_page = page_lookup(p->env_pgdir, uva, &pte);
 	if (!u_page)
 		return 0;
+	/* Writers need their own copy of a page shared since fork */
+	if ((prot & PROT_WRITE) && pte_is_cow(pte)) {
+		if (handle_page_fault_nofile(p, (uintptr_t)uva, PROT_WRITE))
+			return 0;
+		u_page = page_lookup(p->env_pgdir, uva, 0);
+		if (!u_page)
+			return 0;
+	}
 	return (uintptr_t)page2kva(u_page) + offset;
 }
 
@@ -108,6 +108,9 @@ void vfs_init(void)
 	TAILQ_FOREACH(fs, &file_systems, list)
 		printk("Supports the %s Filesystem\n", fs->name);
 
+	/* start the page cache's flusher before anyone can dirty pages */
+	pm_writeback_init();
+
 	/* mounting KFS at the root (/), pending root= parameters */
 	// TODO: linux creates a temp root_fs, then mounts the real root onto that
 	default_ns.root = __mount_fs(&kfs_fs_type, "RAM", NULL, 0, &default_ns);
@@ -566,23 +569,26 @@ out:
 
 /* Superblock functions */
 
-/* Dentry "hash" function for the hash table to use.  Since we already have the
- * hash in the qstr, we don't need to rehash.  Also, note we'll be using the
- * dentry in question as both the key and the value. */
-static size_t __dcache_hash(void *k)
+/* Dcache bucket for a dentry.  Since we already have the hash in the qstr, we
+ * don't need to rehash the name, just mix in the parent. */
+static struct dcache_bucket *dcache_bucket(struct super_block *sb,
+                                           struct dentry *d)
 {
-	return (size_t)((struct dentry*)k)->d_name.hash;
+	size_t hash = d->d_name.hash ^ ((uintptr_t)d->d_parent >> 6);
+
+	return &sb->s_dcache[hash & (DCACHE_NR_BUCKETS - 1)];
 }
 
-/* Dentry cache hashtable equality function.  This means we need to pass in some
- * minimal dentry when doing a lookup. */
-static ssize_t __dcache_eq(void *k1, void *k2)
+/* Dcache equality function.  This means we need to pass in some minimal dentry
+ * when doing a lookup. */
+static bool dcache_eq(struct dentry *d1, struct dentry *d2)
 {
-	if (((struct dentry*)k1)->d_parent != ((struct dentry*)k2)->d_parent)
-		return 0;
+	if (d1->d_parent != d2->d_parent)
+		return FALSE;
+	if (d1->d_name.hash != d2->d_name.hash)
+		return FALSE;
 	/* TODO: use the FS-specific string comparison */
-	return !strcmp(((struct dentry*)k1)->d_name.name,
-	               ((struct dentry*)k2)->d_name.name);
+	return !strcmp(d1->d_name.name, d2->d_name.name);
 }
 
 /* Helper to alloc and initialize a generic superblock.  This handles all the
@@ -598,12 +604,17 @@ struct super_block *get_sb(void)
 	TAILQ_INIT(&sb->s_dirty_i);
 	TAILQ_INIT(&sb->s_io_wb);
 	TAILQ_INIT(&sb->s_lru_d);
+	TAILQ_INIT(&sb->s_lru_neg);
+	sb->s_nr_neg = 0;
 	TAILQ_INIT(&sb->s_files);
-	sb->s_dcache = create_hashtable(100, __dcache_hash, __dcache_eq);
-	sb->s_icache = create_hashtable(100, __generic_hash, __generic_eq);
+	sb->s_dcache = kmalloc(sizeof(struct dcache_bucket) * DCACHE_NR_BUCKETS,
+	                       KMALLOC_WAIT);
+	for (int i = 0; i < DCACHE_NR_BUCKETS; i++) {
+		spinlock_init(&sb->s_dcache[i].lock);
+		sb->s_dcache[i].head = 0;
+	}
+	rhashtable_init(&sb->s_icache, 100);
 	spinlock_init(&sb->s_lru_lock);
-	spinlock_init(&sb->s_dcache_lock);
-	spinlock_init(&sb->s_icache_lock);
 	sb->s_fs_info = 0; // can override somewhere else
 	return sb;
 }
@@ -705,6 +716,7 @@ struct dentry *get_dentry_with_ops(struct super_block *sb,
 	}
 	dentry->d_parent = parent;
 	dentry->d_flags = DENTRY_USED;
+	dentry->d_hash_next = 0;
 	dentry->d_fs_info = 0;
 	dentry_set_name(dentry, name);
 	/* Catch bugs by aggressively zeroing this (o/w we use old stuff) */
@@ -754,7 +766,12 @@ void dentry_release(struct kref *kref)
 		if (dentry->d_flags & DENTRY_USED) {
 			dentry->d_flags &= ~DENTRY_USED;
 			spin_lock(&dentry->d_sb->s_lru_lock);
-			TAILQ_INSERT_TAIL(&dentry->d_sb->s_lru_d, dentry, d_lru);
+			if (dentry->d_flags & DENTRY_NEGATIVE) {
+				TAILQ_INSERT_TAIL(&dentry->d_sb->s_lru_neg, dentry, d_lru);
+				dentry->d_sb->s_nr_neg++;
+			} else {
+				TAILQ_INSERT_TAIL(&dentry->d_sb->s_lru_d, dentry, d_lru);
+			}
 			spin_unlock(&dentry->d_sb->s_lru_lock);
 		} else {
 			/* and make sure it wasn't USED, then UNUSED again */
@@ -765,6 +782,17 @@ void dentry_release(struct kref *kref)
 	spin_unlock(&dentry->d_lock);
 }
 
+/* dcache_get() readers may still be looking at the name and the chain link */
+static void __dentry_free_rcu(struct rcu_head *head)
+{
+	struct dentry *dentry = container_of(head, struct dentry, d_rcu);
+
+	/* TODO: check/test the boundaries on this. */
+	if (dentry->d_name.len > DNAME_INLINE_LEN)
+		kfree((void*)dentry->d_name.name);
+	kmem_cache_free(dentry_kcache, dentry);
+}
+
 /* Called when we really dealloc and get rid of a dentry (like when it is
  * removed from the dcache, either for memory or correctness reasons)
  *
@@ -780,9 +808,6 @@ void __dentry_free(struct dentry *dentry)
 		printd("Freeing dentry %p: %s\n", dentry, dentry->d_name.name);
 	assert(dentry->d_op);	/* catch bugs.  a while back, some lacked d_op */
 	dentry->d_op->d_release(dentry);
-	/* TODO: check/test the boundaries on this. */
-	if (dentry->d_name.len > DNAME_INLINE_LEN)
-		kfree((void*)dentry->d_name.name);
 	kref_put(&dentry->d_sb->s_kref);
 	if (dentry->d_parent)
 		kref_put(&dentry->d_parent->d_kref);
@@ -792,7 +817,7 @@ void __dentry_free(struct dentry *dentry)
 		TAILQ_REMOVE(&dentry->d_inode->i_dentry, dentry, d_alias);
 		kref_put(&dentry->d_inode->i_kref);	/* dentries kref inodes */
 	}
-	kmem_cache_free(dentry_kcache, dentry);
+	call_rcu(&dentry->d_rcu, __dentry_free_rcu);
 }
 
 /* Looks up the dentry for the given path, returning a refcnt'd dentry (or 0).
@@ -816,6 +841,50 @@ struct dentry *lookup_dentry(char *path, int flags)
 	return dentry;
 }
 
+/* Finds what_i_want in b's chain.  Call with b's lock or the RCU read lock. */
+static struct dentry *__dcache_find(struct dcache_bucket *b,
+                                    struct dentry *what_i_want)
+{
+	struct dentry *d_i;
+
+	for (d_i = rcu_dereference(b->head); d_i;
+	     d_i = rcu_dereference(d_i->d_hash_next)) {
+		if (dcache_eq(d_i, what_i_want))
+			return d_i;
+	}
+	return 0;
+}
+
+/* Unlinks d from b's chain.  Call with b's lock held.  Readers may still be
+ * walking d, so its d_hash_next stays intact until the RCU free. */
+static void __dcache_unlink(struct dcache_bucket *b, struct dentry *d)
+{
+	struct dentry **pp;
+
+	for (pp = &b->head; *pp; pp = &(*pp)->d_hash_next) {
+		if (*pp == d) {
+			rcu_assign_pointer(*pp, d->d_hash_next);
+			d->d_flags &= ~DENTRY_HASHED;
+			return;
+		}
+	}
+	warn("Dentry %p (%s) wasn't in its dcache bucket!", d, d->d_name.name);
+}
+
+/* Takes an unused dentry (!USED, kref == 0, on an LRU) off its LRU.  Call with
+ * d_lock held. */
+static void __dcache_lru_remove(struct super_block *sb, struct dentry *d)
+{
+	spin_lock(&sb->s_lru_lock);
+	if (d->d_flags & DENTRY_NEGATIVE) {
+		TAILQ_REMOVE(&sb->s_lru_neg, d, d_lru);
+		sb->s_nr_neg--;
+	} else {
+		TAILQ_REMOVE(&sb->s_lru_d, d, d_lru);
+	}
+	spin_unlock(&sb->s_lru_lock);
+}
+
 /* Get a dentry from the dcache.  At a minimum, we need the name hash and parent
  * in what_i_want, though most uses will probably be from a get_dentry() call.
  * We pass in the SB in the off chance that we don't want to use a get'd dentry.
@@ -833,20 +902,46 @@ struct dentry *lookup_dentry(char *path, int flags)
  *
  * This is where we do the "kref resurrection" - we are returning a kref'd
  * object, even if it wasn't kref'd before.  This means the dcache does NOT hold
- * krefs (it is a weak/internal ref), but it is a source of kref generation.  We
- * sync up with the possible freeing of the dentry by locking the table.  See
- * Doc/kref for more info. */
+ * krefs (it is a weak/internal ref), but it is a source of kref generation.
+ *
+ * The common case is a dentry that is in use (e.g. a directory with cached
+ * children, which kref their parent).  We find those under RCU and take a kref
+ * if it isn't zero, without any locks.  Resurrecting an unused dentry needs the
+ * bucket lock, which syncs with the pruners.  See Doc/kref for more info. */
 struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 {
+	struct dcache_bucket *b = dcache_bucket(sb, what_i_want);
 	struct dentry *found;
-	/* This lock protects the hash, as well as ensures the returned object
-	 * doesn't get deleted/freed out from under us */
-	spin_lock(&sb->s_dcache_lock);
-	found = hashtable_search(sb->s_dcache, what_i_want);
+
+	rcu_read_lock();
+	found = __dcache_find(b, what_i_want);
 	if (found) {
 		if (found->d_flags & DENTRY_NEGATIVE) {
 			what_i_want->d_flags |= DENTRY_NEGATIVE;
-			spin_unlock(&sb->s_dcache_lock);
+			rcu_read_unlock();
+			return 0;
+		}
+		if (kref_get_not_zero(&found->d_kref, 1)) {
+			rcu_read_unlock();
+			/* We raced with a dcache_remove() (unlink, rename) */
+			if (!(found->d_flags & DENTRY_HASHED)) {
+				kref_put(&found->d_kref);
+				return 0;
+			}
+			return found;
+		}
+	}
+	rcu_read_unlock();
+	if (!found)
+		return 0;
+	/* It was unused.  The lock protects the chain, as well as ensures the
+	 * returned object doesn't get deleted/freed out from under us */
+	spin_lock(&b->lock);
+	found = __dcache_find(b, what_i_want);
+	if (found) {
+		if (found->d_flags & DENTRY_NEGATIVE) {
+			what_i_want->d_flags |= DENTRY_NEGATIVE;
+			spin_unlock(&b->lock);
 			return 0;
 		}
 		spin_lock(&found->d_lock);
@@ -855,13 +950,11 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 		 * should resurrect */
 		if (!(found->d_flags & DENTRY_USED)) {
 			found->d_flags |= DENTRY_USED;
-			spin_lock(&sb->s_lru_lock);
-			TAILQ_REMOVE(&sb->s_lru_d, found, d_lru);
-			spin_unlock(&sb->s_lru_lock);
+			__dcache_lru_remove(sb, found);
 		}
 		spin_unlock(&found->d_lock);
 	}
-	spin_unlock(&sb->s_dcache_lock);
+	spin_unlock(&b->lock);
 	return found;
 }
 
@@ -870,29 +963,41 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
  * now we'll remove it and put the new one in there. */
 void dcache_put(struct super_block *sb, struct dentry *key_val)
 {
-	struct dentry *old;
-	int retval;
-	spin_lock(&sb->s_dcache_lock);
-	old = hashtable_remove(sb->s_dcache, key_val);
-	/* if it is old and non-negative, our caller lost a race with someone else
-	 * adding the dentry.  but since we yanked it out, like a bunch of idiots,
-	 * we still have to put it back.  should be fairly rare. */
-	if (old && (old->d_flags & DENTRY_NEGATIVE)) {
-		/* This is possible, but rare for now (about to be put on the LRU) */
-		assert(!(old->d_flags & DENTRY_USED));
-		assert(!kref_refcnt(&old->d_kref));
-		spin_lock(&sb->s_lru_lock);
-		TAILQ_REMOVE(&sb->s_lru_d, old, d_lru);
-		spin_unlock(&sb->s_lru_lock);
-		/* TODO: this seems suspect.  isn't this the same memory as key_val?
-		 * in which case, we just adjust the flags (remove NEG) and reinsert? */
-		assert(old != key_val); // checking TODO comment
-		__dentry_free(old);
-	}
-	/* this returns 0 on failure (TODO: Fix this ghetto shit) */
- 	retval = hashtable_insert(sb->s_dcache, key_val, key_val);
-	assert(retval);
-	spin_unlock(&sb->s_dcache_lock);
+	struct dcache_bucket *b = dcache_bucket(sb, key_val);
+	struct dentry *old, *victim = 0;
+
+	spin_lock(&b->lock);
+	old = __dcache_find(b, key_val);
+	if (old) {
+		__dcache_unlink(b, old);
+		/* if it is old and non-negative, our caller lost a race with someone
+		 * else adding the dentry.  but since we yanked it out, like a bunch
+		 * of idiots, we still have to put it back.  should be fairly rare. */
+		if (old->d_flags & DENTRY_NEGATIVE) {
+			/* This is possible, but rare for now (about to be put on the
+			 * LRU) */
+			assert(!(old->d_flags & DENTRY_USED));
+			assert(!kref_refcnt(&old->d_kref));
+			spin_lock(&old->d_lock);
+			__dcache_lru_remove(sb, old);
+			spin_unlock(&old->d_lock);
+			/* TODO: this seems suspect.  isn't this the same memory as
+			 * key_val?  in which case, we just adjust the flags (remove NEG)
+			 * and reinsert? */
+			assert(old != key_val); // checking TODO comment
+			victim = old;
+		}
+	}
+	key_val->d_flags |= DENTRY_HASHED;
+	key_val->d_hash_next = b->head;
+	rcu_assign_pointer(b->head, key_val);
+	spin_unlock(&b->lock);
+	/* Freeing puts the parent, which may land it on an LRU */
+	if (victim)
+		__dentry_free(victim);
+	if ((key_val->d_flags & DENTRY_NEGATIVE) &&
+	    (ACCESS_ONCE(sb->s_nr_neg) > DCACHE_MAX_NEG))
+		dcache_prune_nr(sb, TRUE, DCACHE_PRUNE_BATCH);
 }
 
 /* Will remove and return the dentry.  Caller deallocs the key, but the retval
@@ -902,38 +1007,54 @@ void dcache_put(struct super_block *sb, struct dentry *key_val)
  * there. */
 struct dentry *dcache_remove(struct super_block *sb, struct dentry *key)
 {
+	struct dcache_bucket *b = dcache_bucket(sb, key);
 	struct dentry *retval;
-	spin_lock(&sb->s_dcache_lock);
-	retval = hashtable_remove(sb->s_dcache, key);
-	spin_unlock(&sb->s_dcache_lock);
+
+	spin_lock(&b->lock);
+	retval = __dcache_find(b, key);
+	if (retval)
+		__dcache_unlink(b, retval);
+	spin_unlock(&b->lock);
 	return retval;
 }
 
-/* This will clean out the LRU list, which are the unused dentries of the dentry
- * cache.  This will optionally only free the negative ones.  Note that we grab
- * the hash lock for the time we traverse the LRU list - this prevents someone
- * from getting a kref from the dcache, which could cause us trouble (we rip
- * someone off the list, who isn't unused, and they try to rip them off the
- * list). */
-void dcache_prune(struct super_block *sb, bool negative_only)
+/* Frees up to nr of the oldest unused dentries of the dcache, from either the
+ * negative or the positive LRU list.  Note the lock ordering: we hold the LRU
+ * lock while walking the list, so we can only trylock the bucket and the
+ * dentry.  Those we can't get are skipped; they are likely being looked up or
+ * released. */
+void dcache_prune_nr(struct super_block *sb, bool negative, unsigned int nr)
 {
 	struct dentry *d_i, *temp;
+	struct dcache_bucket *b;
+	struct dentry_tailq *lru = negative ? &sb->s_lru_neg : &sb->s_lru_d;
 	struct dentry_tailq victims = TAILQ_HEAD_INITIALIZER(victims);
 
-	spin_lock(&sb->s_dcache_lock);
 	spin_lock(&sb->s_lru_lock);
-	TAILQ_FOREACH_SAFE(d_i, &sb->s_lru_d, d_lru, temp) {
-		if (!(d_i->d_flags & DENTRY_USED)) {
-			if (negative_only && !(d_i->d_flags & DENTRY_NEGATIVE))
-				continue;
+	TAILQ_FOREACH_SAFE(d_i, lru, d_lru, temp) {
+		if (!nr)
+			break;
+		b = dcache_bucket(sb, d_i);
+		if (!spin_trylock(&b->lock))
+			continue;
+		if (!spin_trylock(&d_i->d_lock)) {
+			spin_unlock(&b->lock);
+			continue;
+		}
+		if (!(d_i->d_flags & DENTRY_USED) && !kref_refcnt(&d_i->d_kref)) {
 			/* another place where we'd be better off with tools, not sol'ns */
-			hashtable_remove(sb->s_dcache, d_i);
-			TAILQ_REMOVE(&sb->s_lru_d, d_i, d_lru);
+			if (d_i->d_flags & DENTRY_HASHED)
+				__dcache_unlink(b, d_i);
+			TAILQ_REMOVE(lru, d_i, d_lru);
+			if (negative)
+				sb->s_nr_neg--;
 			TAILQ_INSERT_HEAD(&victims, d_i, d_lru);
+			nr--;
 		}
+		spin_unlock(&d_i->d_lock);
+		spin_unlock(&b->lock);
 	}
 	spin_unlock(&sb->s_lru_lock);
-	spin_unlock(&sb->s_dcache_lock);
 	/* Now do the actual freeing, outside of the hash/LRU list locks.  This is
 	 * necessary since __dentry_free() will decref its parent, which may get
 	 * released and try to add itself to the LRU. */
@@ -942,6 +1063,15 @@ void dcache_prune(struct super_block *sb, bool negative_only)
 		assert(!kref_refcnt(&d_i->d_kref));
 		__dentry_free(d_i);
 	}
+}
+
+/* This will clean out the LRU lists, which are the unused dentries of the
+ * dentry cache.  This will optionally only free the negative ones. */
+void dcache_prune(struct super_block *sb, bool negative_only)
+{
+	dcache_prune_nr(sb, TRUE, (unsigned int)-1);
+	if (!negative_only)
+		dcache_prune_nr(sb, FALSE, (unsigned int)-1);
 	/* It is possible at this point that there are new items on the LRU.  We
 	 * could loop back until that list is empty, if we care about this. */
 }
@@ -1105,12 +1235,23 @@ int check_perms(struct inode *inode, int access_mode)
 	return 0;	/* anything goes! */
 }
 
+static void __inode_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(inode_kcache, container_of(head, struct inode, i_rcu));
+}
+
 /* Called after all external refs are gone to clean up the inode.  Once this is
  * called, all dentries pointing here are already done (one of them triggered
  * this via kref_put(). */
 void inode_release(struct kref *kref)
 {
 	struct inode *inode = container_of(kref, struct inode, i_kref);
+
+	/* Write back the file's data while the FS still knows the inode, and keep
+	 * the flusher away from the PM before we free it. */
+	if (inode->i_nlink)
+		pm_writeback(inode->i_mapping, inode->i_mapping->pm_nr_dirty);
+	pm_writeback_detach(inode->i_mapping);
 	TAILQ_REMOVE(&inode->i_sb->s_inodes, inode, i_sb_list);
 	icache_remove(inode->i_sb, inode->i_ino);
 	/* Might need to write back or delete the file/inode */
@@ -1131,7 +1272,8 @@ void inode_release(struct kref *kref)
 	kref_put(&inode->i_sb->s_kref);
 	/* TODO: clean this up */
 	assert(inode->i_mapping == &inode->i_pm);
-	kmem_cache_free(inode_kcache, inode);
+	/* icache_get() readers might still be looking at it */
+	call_rcu(&inode->i_rcu, __inode_free_rcu);
 }
 
 /* Fills in kstat with the stat information for the inode */
@@ -1173,36 +1315,56 @@ void print_kstat(struct kstat *kstat)
 /* Inode Cache management.  In general, search on the ino, get a refcnt'd value
  * back.  Remove does not give you a reference back - it should only be called
  * in inode_release(). */
+static size_t icache_key_hash(unsigned long ino)
+{
+	/* 0x9e370001UL used by Linux (32 bit), same as __generic_hash() */
+	return ino * 0x9e370001UL;
+}
+
+static size_t icache_hash(struct inode *inode)
+{
+	return icache_key_hash(inode->i_ino);
+}
+
+static bool icache_eq(struct inode *inode, unsigned long ino)
+{
+	return inode->i_ino == ino;
+}
+
+DEFINE_RHASHTABLE(icache_ht, struct inode, unsigned long, icache_hash,
+                  icache_key_hash, icache_eq);
+
 struct inode *icache_get(struct super_block *sb, unsigned long ino)
 {
+	struct inode *inode;
+
 	/* This is the same style as in pid2proc, it's the "safely create a strong
-	 * reference from a weak one, so long as other strong ones exist" pattern */
-	spin_lock(&sb->s_icache_lock);
-	struct inode *inode = hashtable_search(sb->s_icache, (void*)ino);
+	 * reference from a weak one, so long as other strong ones exist" pattern.
+	 * Inodes are freed after an RCU grace period. */
+	rcu_read_lock();
+	inode = icache_ht_lookup(&sb->s_icache, ino);
 	if (inode)
 		if (!kref_get_not_zero(&inode->i_kref, 1))
 			inode = 0;
-	spin_unlock(&sb->s_icache_lock);
+	rcu_read_unlock();
 	return inode;
 }
 
 void icache_put(struct super_block *sb, struct inode *inode)
 {
-	spin_lock(&sb->s_icache_lock);
+	int ret;
+
 	/* there's a race in load_ino() that could trigger this */
-	assert(!hashtable_search(sb->s_icache, (void*)inode->i_ino));
-	hashtable_insert(sb->s_icache, (void*)inode->i_ino, inode);
-	spin_unlock(&sb->s_icache_lock);
+	assert(!icache_ht_lookup(&sb->s_icache, inode->i_ino));
+	ret = icache_ht_insert(&sb->s_icache, inode);
+	assert(!ret);
 }
 
 struct inode *icache_remove(struct super_block *sb, unsigned long ino)
 {
 	struct inode *inode;
-	/* Presumably these hashtable removals could be easier since callers
-	 * actually know who they are (same with the pid2proc hash) */
-	spin_lock(&sb->s_icache_lock);
-	inode = hashtable_remove(sb->s_icache, (void*)ino);
-	spin_unlock(&sb->s_icache_lock);
+
+	inode = icache_ht_remove(&sb->s_icache, ino);
 	assert(inode && !kref_refcnt(&inode->i_kref));
 	return inode;
 }
@@ -1326,10 +1488,11 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 			memcpy(page2kva(page) + page_off, buf, copy_amt);
 		buf += copy_amt;
 		page_off = 0;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_dirty(page);
 		pm_put_page(page);	/* it's still in the cache, we just don't need it */
 	}
 	assert(buf == buf_end);
+	pm_throttle_dirty(file->f_mapping);
 	*offset = orig_off + count;
 	return count;
 }
@@ -2355,14 +2518,84 @@ void *kread_whole_file(struct file *file)
 
 /* Process-related File management functions */
 
+/* Heap-allocated fd arrays.  Lockless readers could still be looking at an
+ * array after we grow past it, so we free them after an RCU grace period. */
+struct fd_array_rcu {
+	struct rcu_head				rcu;
+	struct file_desc			fds[];
+};
+
+static struct file_desc *fd_array_alloc(int nr_fds)
+{
+	struct fd_array_rcu *fda;
+
+	fda = kzmalloc(sizeof(struct fd_array_rcu) +
+	               nr_fds * sizeof(struct file_desc), 0);
+	return fda ? fda->fds : NULL;
+}
+
+static void __fd_array_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct fd_array_rcu, rcu));
+}
+
+static void fd_array_free(struct file_desc *fds)
+{
+	struct fd_array_rcu *fda = container_of(fds, struct fd_array_rcu, fds);
+
+	call_rcu(&fda->rcu, __fd_array_free_rcu);
+}
+
+/* Chans are never freed, only recycled through chanalloc, so we can look one
+ * up without the lock: grab a ref if it's still alive, then make sure the slot
+ * still points to it.  If it doesn't, the chan was closed (and maybe reused)
+ * under us and we try again.
+ *
+ * Writers grow the array before raising max_files, and the final close_fdt()
+ * sets closed before shrinking them back, so the array we index is always big
+ * enough, unless it's closed. */
+static struct chan *lookup_fd_chan(struct fd_table *fdt, int fd, bool incref)
+{
+	struct file_desc *fds;
+	struct chan *chan;
+	int max_files;
+
+	rcu_read_lock();
+	do {
+		max_files = ACCESS_ONCE(fdt->max_files);
+		rmb();
+		fds = rcu_dereference(fdt->fd);
+		rmb();
+		if (ACCESS_ONCE(fdt->closed) || fd >= max_files) {
+			chan = NULL;
+			break;
+		}
+		chan = ACCESS_ONCE(fds[fd].fd_chan);
+		if (!chan || !incref)
+			break;
+		if (kref_get_not_zero(&chan->ref, 1)) {
+			if (ACCESS_ONCE(fds[fd].fd_chan) == chan)
+				break;
+			cclose(chan);
+		}
+		cpu_relax();
+	} while (1);
+	rcu_read_unlock();
+	return chan;
+}
+
 /* Given any FD, get the appropriate object, 0 o/w.  Set vfs if you're looking
  * for a file, o/w a chan.  Set incref if you want a reference count (which is a
- * 9ns thing, you can't use the pointer if you didn't incref). */
+ * 9ns thing, you can't use the pointer if you didn't incref).
+ *
+ * Chan lookups don't lock the fd table, which every read and write hits. */
 void *lookup_fd(struct fd_table *fdt, int fd, bool incref, bool vfs)
 {
 	void *retval = 0;
 	if (fd < 0)
 		return 0;
+	if (!vfs)
+		return lookup_fd_chan(fdt, fd, incref);
 	spin_lock(&fdt->lock);
 	if (fdt->closed) {
 		spin_unlock(&fdt->lock);
@@ -2373,18 +2606,10 @@ void *lookup_fd(struct fd_table *fdt, int fd, bool incref, bool vfs)
 			/* while max_files and max_fdset might not line up, we should never
 			 * have a valid fdset higher than files */
 			assert(fd < fdt->max_files);
-			if (vfs)
-				retval = fdt->fd[fd].fd_file;
-			else
-				retval = fdt->fd[fd].fd_chan;
-			/* retval could be 0 if we asked for the wrong one (e.g. it's a
-			 * file, but we asked for a chan) */
-			if (retval && incref) {
-				if (vfs)
-					kref_get(&((struct file*)retval)->f_kref, 1);
-				else
-					chan_incref((struct chan*)retval);
-			}
+			retval = fdt->fd[fd].fd_file;
+			/* retval could be 0 if we asked for the wrong one (it's a chan) */
+			if (retval && incref)
+				kref_get(&((struct file*)retval)->f_kref, 1);
 		}
 	}
 	spin_unlock(&fdt->lock);
@@ -2416,7 +2641,7 @@ static int grow_fd_set(struct fd_table *open_files)
 	n = open_files->max_files + NR_OPEN_FILES_DEFAULT;
 	if (n > NR_FILE_DESC_MAX)
 		return -EMFILE;
-	nfd = kzmalloc(n * sizeof(struct file_desc), 0);
+	nfd = fd_array_alloc(n);
 	if (nfd == NULL)
 		return -ENOMEM;
 
@@ -2424,14 +2649,16 @@ static int grow_fd_set(struct fd_table *open_files)
 	ofd = open_files->fd;
 	memmove(nfd, ofd, open_files->max_files * sizeof(struct file_desc));
 
-	/* Update the array and the maxes for both max_files and max_fdset */
-	open_files->fd = nfd;
+	/* Update the array and then the maxes for both max_files and max_fdset.
+	 * Lockless readers trust max_files for whatever array they see after it. */
+	rcu_assign_pointer(open_files->fd, nfd);
+	wmb();
 	open_files->max_files = n;
 	open_files->max_fdset = n;
 
 	/* Only free the old one if it wasn't pointing to open_files->fd_array */
 	if (ofd != open_files->fd_array)
-		kfree(ofd);
+		fd_array_free(ofd);
 	return 0;
 }
 
@@ -2451,9 +2678,13 @@ static void free_fd_set(struct fd_table *open_files)
 		open_files->open_fds = (struct fd_set*)&open_files->open_fds_init;
 		kfree(free_me);
 
+		/* Readers that see the small array will also see closed */
+		open_files->max_files = NR_OPEN_FILES_DEFAULT;
+		open_files->max_fdset = NR_FILE_DESC_DEFAULT;
+		wmb();
 		free_me = open_files->fd;
-		open_files->fd = open_files->fd_array;
-		kfree(free_me);
+		rcu_assign_pointer(open_files->fd, open_files->fd_array);
+		fd_array_free(free_me);
 	}
 }
 
@@ -2476,7 +2707,7 @@ bool close_fd(struct fd_table *fdt, int fd)
 			chan = fdt->fd[fd].fd_chan;
 			tap = fdt->fd[fd].fd_tap;
 			fdt->fd[fd].fd_file = 0;
-			fdt->fd[fd].fd_chan = 0;
+			ACCESS_ONCE(fdt->fd[fd].fd_chan) = 0;
 			fdt->fd[fd].fd_tap = 0;
 			CLR_BITMASK_BIT(fdt->open_fds->fds_bits, fd);
 			if (fd < fdt->hint_min_fd)
@@ -2500,6 +2731,28 @@ void put_file_from_fd(struct fd_table *open_files, int file_desc)
 	close_fd(open_files, file_desc);
 }
 
+/* Returns the first clear bit in [from, to) of bits, or to.  Skips whole bytes
+ * of open fds at a time. */
+static int find_free_fd(uint8_t *bits, int from, int to)
+{
+	uint8_t byte;
+
+	while (from < to) {
+		if (!(from & 7) && from + 8 <= to) {
+			byte = bits[from / 8];
+			if (byte == 0xff) {
+				from += 8;
+				continue;
+			}
+			return from + __builtin_ctz(~byte & 0xff);
+		}
+		if (!GET_BITMASK_BIT(bits, from))
+			return from;
+		from++;
+	}
+	return to;
+}
+
 static int __get_fd(struct fd_table *open_files, int low_fd, bool must_use_low)
 {
 	int slot = -1;
@@ -2518,9 +2771,9 @@ static int __get_fd(struct fd_table *open_files, int low_fd, bool must_use_low)
 	/* Loop until we have a valid slot (we grow the fd_array at the bottom of
  	 * the loop if we haven't found a slot in the current array */
 	while (slot == -1) {
-		for (low_fd; low_fd < open_files->max_fdset; low_fd++) {
-			if (GET_BITMASK_BIT(open_files->open_fds->fds_bits, low_fd))
-				continue;
+		low_fd = find_free_fd(open_files->open_fds->fds_bits, low_fd,
+		                      open_files->max_fdset);
+		if (low_fd < open_files->max_fdset) {
 			slot = low_fd;
 			SET_BITMASK_BIT(open_files->open_fds->fds_bits, slot);
 			assert(slot < open_files->max_files &&
@@ -2528,7 +2781,6 @@ static int __get_fd(struct fd_table *open_files, int low_fd, bool must_use_low)
 			/* We know slot >= hint, since we started with the hint */
 			if (update_hint)
 				open_files->hint_min_fd = slot + 1;
-			break;
 		}
 		if (slot == -1)	{
 			if ((error = grow_fd_set(open_files)))
@@ -2553,6 +2805,7 @@ int insert_obj_fdt(struct fd_table *fdt, void *obj, int low_fd, int fd_flags,
 	}
 	assert(slot < fdt->max_files &&
 	       fdt->fd[slot].fd_file == 0);
+	fdt->fd[slot].fd_flags = fd_flags;
 	if (vfs) {
 		kref_get(&((struct file*)obj)->f_kref, 1);
 		fdt->fd[slot].fd_file = obj;
@@ -2560,9 +2813,10 @@ int insert_obj_fdt(struct fd_table *fdt, void *obj, int low_fd, int fd_flags,
 	} else {
 		chan_incref((struct chan*)obj);
 		fdt->fd[slot].fd_file = 0;
-		fdt->fd[slot].fd_chan = obj;
+		/* Lockless lookups can see the chan as soon as we set it */
+		wmb();
+		ACCESS_ONCE(fdt->fd[slot].fd_chan) = obj;
 	}
-	fdt->fd[slot].fd_flags = fd_flags;
 	spin_unlock(&fdt->lock);
 	return slot;
 }
@@ -2621,7 +2875,7 @@ void close_fdt(struct fd_table *fdt, bool cloexec)
 				fdt->fd[i].fd_file = 0;
 				to_close[idx++].fd_file = file;
 			} else {
-				fdt->fd[i].fd_chan = 0;
+				ACCESS_ONCE(fdt->fd[i].fd_chan) = 0;
 				to_close[idx++].fd_chan = chan;
 			}
 			CLR_BITMASK_BIT(fdt->open_fds->fds_bits, i);
@@ -2630,8 +2884,10 @@ void close_fdt(struct fd_table *fdt, bool cloexec)
 	/* it's just a hint, we can build back up from being 0 */
 	fdt->hint_min_fd = 0;
 	if (!cloexec) {
-		free_fd_set(fdt);
+		/* Lockless lookups check closed after they grab the array */
 		fdt->closed = TRUE;
+		wmb();
+		free_fd_set(fdt);
 	}
 	spin_unlock(&fdt->lock);
 	/* We go through some hoops to close/decref outside the lock.  Nice for not
@@ -2649,7 +2905,9 @@ void close_fdt(struct fd_table *fdt, bool cloexec)
 }
 
 /* Inserts all of the files from src into dst, used by sys_fork(). */
-void clone_fdt(struct fd_table *src, struct fd_table *dst)
+/* Copies src's open files into dst.  If cloexec, we skip the FD_CLOEXEC ones,
+ * which is what spawn wants, instead of taking refs and closing them later. */
+void clone_fdt(struct fd_table *src, struct fd_table *dst, bool cloexec)
 {
 	struct file *file;
 	struct chan *chan;
@@ -2667,6 +2925,8 @@ void clone_fdt(struct fd_table *src, struct fd_table *dst)
 	}
 	for (int i = 0; i < src->max_fdset; i++) {
 		if (GET_BITMASK_BIT(src->open_fds->fds_bits, i)) {
+			if (cloexec && (src->fd[i].fd_flags & FD_CLOEXEC))
+				continue;
 			/* while max_files and max_fdset might not line up, we should never
 			 * have a valid fdset higher than files */
 			assert(i < src->max_files);
@@ -2676,6 +2936,7 @@ void clone_fdt(struct fd_table *src, struct fd_table *dst)
 			SET_BITMASK_BIT(dst->open_fds->fds_bits, i);
 			dst->fd[i].fd_file = file;
 			dst->fd[i].fd_chan = chan;
+			dst->fd[i].fd_flags = src->fd[i].fd_flags;
 			if (file)
 				kref_get(&file->f_kref, 1);
 			else
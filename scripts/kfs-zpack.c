@@ -0,0 +1,132 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * kfs-zpack: compresses files in place for a CONFIG_KFS_COMPRESS initramfs.
+ *
+ * Usage: kfs-zpack FILE...
+ *
+ * Each file is split into KFS_Z_CHUNK byte chunks, and each chunk is deflated on
+ * its own, so the kernel can inflate any page of the file without the ones
+ * before it.  The file becomes:
+ *
+ *		"KFSZ" | chunk_sz | size | offsets[nr_chunks + 1] | chunks
+ *
+ * with little-endian 32 bit fields, and offsets from the start of the file.  A
+ * chunk that didn't shrink is stored as is.  Files that wouldn't get smaller
+ * are left alone.  This must match struct kfs_z_hdr in kern/include/kfs.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#define KFS_Z_MAGIC			"KFSZ"
+#define KFS_Z_CHUNK			4096
+
+static void put_le32(uint8_t *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+/* Deflates len bytes of src into dst, returning the compressed size, or len if
+ * it didn't get smaller (in which case dst has a copy of src). */
+static size_t deflate_chunk(uint8_t *dst, uint8_t *src, size_t len)
+{
+	z_stream strm;
+	size_t ret;
+
+	memset(&strm, 0, sizeof(strm));
+	/* Negative window bits for raw deflate, which is what the kernel's
+	 * zlib_inflateInit2(-MAX_WBITS) expects. */
+	if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "kfs-zpack: deflateInit2 failed\n");
+		exit(1);
+	}
+	strm.next_in = src;
+	strm.avail_in = len;
+	strm.next_out = dst;
+	strm.avail_out = len - 1;
+	if (deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+		ret = strm.total_out;
+	} else {
+		memcpy(dst, src, len);
+		ret = len;
+	}
+	deflateEnd(&strm);
+	return ret;
+}
+
+static int zpack(const char *path)
+{
+	FILE *f;
+	uint8_t *in, *out;
+	size_t size, nr_chunks, hdr_len, off, len;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	/* Tiny files aren't worth a header */
+	if (size <= KFS_Z_CHUNK / 4) {
+		fclose(f);
+		return 0;
+	}
+	in = malloc(size);
+	if (!in || fread(in, 1, size, f) != size) {
+		fprintf(stderr, "kfs-zpack: failed to read %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	nr_chunks = (size + KFS_Z_CHUNK - 1) / KFS_Z_CHUNK;
+	hdr_len = 12 + (nr_chunks + 1) * 4;
+	/* Worst case, every chunk is stored */
+	out = malloc(hdr_len + size);
+	if (!out) {
+		fprintf(stderr, "kfs-zpack: out of memory for %s\n", path);
+		return -1;
+	}
+	memcpy(out, KFS_Z_MAGIC, 4);
+	put_le32(out + 4, KFS_Z_CHUNK);
+	put_le32(out + 8, size);
+	off = hdr_len;
+	for (size_t i = 0; i < nr_chunks; i++) {
+		put_le32(out + 12 + i * 4, off);
+		len = size - i * KFS_Z_CHUNK;
+		if (len > KFS_Z_CHUNK)
+			len = KFS_Z_CHUNK;
+		off += deflate_chunk(out + off, in + i * KFS_Z_CHUNK, len);
+	}
+	put_le32(out + 12 + nr_chunks * 4, off);
+	if (off < size) {
+		f = fopen(path, "wb");
+		if (!f || fwrite(out, 1, off, f) != off) {
+			perror(path);
+			return -1;
+		}
+		fclose(f);
+	}
+	free(in);
+	free(out);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (zpack(argv[i]))
+			ret = 1;
+	}
+	return ret;
+}
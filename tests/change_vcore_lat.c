@@ -0,0 +1,92 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Measures the cost of sys_change_vcore().  Vcores 0 and 1 take turns on a
+ * single pcore, each changing to the other, which is the common case in
+ * preemption recovery: both vcores are ours and neither has a preemption in
+ * flight.
+ *
+ * Usage: change_vcore_lat [-n NR_LOOPS] */
+
+#include <parlib/parlib.h>
+#include <parlib/arch/arch.h>
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <parlib/event.h>
+#include <parlib/timing.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void ghetto_vcore_entry(void);
+
+struct schedule_ops ghetto_sched_ops = {
+	.sched_entry = ghetto_vcore_entry,
+};
+
+/* All MCP syscalls will spin instead of blocking */
+static void __ros_syscall_spinon(struct syscall *sysc)
+{
+	while (!(atomic_read(&sysc->flags) & (SC_DONE | SC_PROGRESS)))
+		cpu_relax();
+}
+
+/* Vcore 1 starts here the first time.  After that, it returns from the
+ * syscall each time vcore 0 changes to it. */
+void ghetto_vcore_entry(void)
+{
+	if (vcore_id() == 0)
+		run_current_uthread();
+	while (1)
+		sys_change_vcore(0, FALSE);
+}
+
+int main(int argc, char **argv)
+{
+	struct uthread dummy = {0};
+	unsigned long nr_loops = 100000;
+	uint64_t start, end;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_loops = strtoul(optarg, 0, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n NR_LOOPS]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (max_vcores() < 2) {
+		fprintf(stderr, "Need at least 2 vcores\n");
+		exit(1);
+	}
+	/* Just a hack to get into _M mode on one vcore, like mhello */
+	uthread_2ls_init(&dummy, &ghetto_sched_ops);
+	uthread_mcp_init();
+	ros_syscall_blockon = __ros_syscall_spinon;
+	/* Each change sends a preempt or check_msgs event.  We're not recovering
+	 * from anything, and don't want them piling up. */
+	disable_kevent(EV_VCORE_PREEMPT);
+	disable_kevent(EV_CHECK_MSGS);
+	/* The kernel only lets vcore context change vcores.  Vcore 1 will restart
+	 * us right here, with notifs still disabled. */
+	disable_notifs(0);
+	/* The first change starts vcore 1 fresh; don't count it */
+	sys_change_vcore(1, FALSE);
+	start = read_tsc();
+	for (unsigned long i = 0; i < nr_loops; i++) {
+		ret = sys_change_vcore(1, FALSE);
+		if (ret) {
+			enable_notifs(0);
+			fprintf(stderr, "change_vcore failed: %d\n", ret);
+			exit(1);
+		}
+	}
+	end = read_tsc();
+	enable_notifs(0);
+	printf("%lu round trips: %llu nsec per vcore change\n", nr_loops,
+	       nr_loops ? tsc2nsec(end - start) / (2 * nr_loops) : 0);
+	return 0;
+}
@@ -36,6 +36,7 @@
 
 #include <parlib/tsc-compat.h>
 #include <benchutil/measure.h>
+#include <benchutil/bench.h>
 
 #else
 
@@ -45,6 +46,8 @@
 
 #include "../user/benchutil/include/measure.h"
 #include "../user/benchutil/measure.c"
+#include "../user/benchutil/include/benchutil/bench.h"
+#include "../user/benchutil/bench.c"
 
 static void os_prep_work(pthread_t *worker_threads, int nr_threads)
 {
@@ -466,7 +469,8 @@ static struct argp_option options[] = {
 	                                             "\tmcspdro\n"
 	                                             "\t__mcspdro\n"
 	                                             "\tspin\n"
-	                                             "\tspinpdr"},
+	                                             "\tspinpdr\n"
+	                                             "\tticketpdr"},
 	{0, 0, 0, 0, "Other options (not mandatory):"},
 	{"adj_workers",	OPT_ADJ_WORKERS, 0,	0, "Adjust workers such that the "
 	                                       "number of workers equals the "
@@ -489,6 +493,7 @@ struct prog_args {
 	bool						fake_vc_ctx;
 	bool						adj_workers;
 	char						*outfile_path;
+	char						*lock_name;
 	void *(*lock_type)(void *arg);
 };
 struct prog_args pargs = {0};
@@ -605,6 +610,7 @@ lock_func(spin,
 
 #ifdef __ros__
 struct spin_pdr_lock spdr_lock = SPINPDR_INITIALIZER;
+struct ticket_pdr_lock tpdr_lock = TICKET_PDR_INITIALIZER;
 struct mcs_pdr_lock mcspdr_lock;
 struct mcs_pdro_lock mcspdro_lock = MCSPDRO_LOCK_INIT;
 
@@ -620,12 +626,16 @@ lock_func(__mcspdro,
 lock_func(spinpdr,
           spin_pdr_lock(&spdr_lock);,
           spin_pdr_unlock(&spdr_lock);)
+lock_func(ticketpdr,
+          ticket_pdr_lock(&tpdr_lock);,
+          ticket_pdr_unlock(&tpdr_lock);)
 #else
 
 fake_lock_func(mcspdr, 0, 0);
 fake_lock_func(mcspdro, 0, 0);
 fake_lock_func(__mcspdro, 0, 0);
 fake_lock_func(spinpdr, 0, 0);
+fake_lock_func(ticketpdr, 0, 0);
 
 #endif
 
@@ -699,6 +709,8 @@ static void print_preempt_trace(uint64_t starttsc, int nr_print_rows)
 {
 	/* reusing nr_print_rows for the nr preempt/indirs rows as well */
 	int preempt_rows = MIN(MAX_NR_EVENT_TRACES, nr_print_rows);
+	uint64_t pdr_preempted, pdr_recovered;
+
 	if (pargs.fake_vc_ctx) {
 		printf("No preempt trace available when faking vc ctx\n");
 		return;
@@ -706,6 +718,9 @@ static void print_preempt_trace(uint64_t starttsc, int nr_print_rows)
 	printf("\n");
 	printf("Nr Preempts: %d\n", atomic_read(&preempt_cnt));
 	printf("Nr Indirs  : %d\n", atomic_read(&indir_cnt));
+	get_vcore_pdr_stats(&pdr_preempted, &pdr_recovered);
+	printf("Nr PDR preempted vcores seen: %llu, recovered: %llu\n",
+	       pdr_preempted, pdr_recovered);
 	if (preempt_rows)
 		printf("Preempt/Indir events:\n-----------------\n");
 	for (int i = 0; i < preempt_rows; i++) {
@@ -810,6 +825,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 			}
 			break;
 		case 't':
+			pargs->lock_name = arg;
 			if (!strcmp("mcs", arg)) {
 				pargs->lock_type = mcs_thread;
 				break;
@@ -838,6 +854,10 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 				pargs->lock_type = spinpdr_thread;
 				break;
 			}
+			if (!strcmp("ticketpdr", arg)) {
+				pargs->lock_type = ticketpdr_thread;
+				break;
+			}
 			printf("Unknown locktype %s\n\n", arg);
 			argp_usage(state);
 			break;
@@ -869,6 +889,37 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
+/* Summarizes the per-attempt latencies with the benchutil harness, in nsec, so
+ * runs can be compared across builds (BENCH_FORMAT=json or csv). */
+static void bench_latency(const char *what, int nr_threads, int nr_loops,
+                          int (*get_sample)(void **data, int i, int j,
+                                            uint64_t *sample))
+{
+	struct bench_result res;
+	char name[64];
+	double *samples;
+	double nsec_per_tick = 1000000000.0 / get_tsc_freq();
+	unsigned int nr_samples = 0;
+	uint64_t sample;
+
+	samples = malloc(sizeof(double) * nr_threads * nr_loops);
+	if (!samples) {
+		perror("bench samples malloc");
+		return;
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		for (int j = 0; j < nr_loops; j++) {
+			if (get_sample((void**)times, i, j, &sample))
+				continue;
+			samples[nr_samples++] = sample * nsec_per_tick;
+		}
+	}
+	snprintf(name, sizeof(name), "lock_test_%s_%s", pargs.lock_name, what);
+	if (!bench_summarize(name, nr_threads, 1, samples, nr_samples, &res))
+		bench_report(&res);
+	free(samples);
+}
+
 int main(int argc, char** argv)
 {
 	pthread_t *worker_threads;
@@ -971,6 +1022,9 @@ int main(int argc, char** argv)
 	       total_loops / nr_threads);
 	for (int i = 0; i < nr_threads; i++)
 		printf("\tThread %d performed %lu loops\n", i, (long)loops_done[i]);
+	printf("\n");
+	bench_latency("acq", nr_threads, nr_loops, get_acq_latency);
+	bench_latency("hld", nr_threads, nr_loops, get_hld_latency);
 
 	if (pargs.outfile_path) {
 		fprintf(outfile, "#");
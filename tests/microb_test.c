@@ -7,16 +7,18 @@
  *
  * To use this, define a function of the form:
  *
- * 		void my_test(unsigned long nr_loops)
+ * 		void my_test(void *arg, uint64_t nr_loops)
  *
  * Which does some computation you wish to measure inside a loop that run
  * nr_loops times.  Then in microb_test(), add your function in a line such as:
  *
- * 		test_time_ns(my_test, 100000);
+ * 		microb_run(mode, my_test, 100000);
  *
- * This macro will run your test and print the results.  Pick a loop amount that
- * is reasonable for your operation.  You can also use test_time_us() for longer
- * operations.
+ * This runs your test with the benchutil harness (warmup, reps, outlier
+ * rejection; see benchutil/bench.h) and prints ns per iteration.  Pick a loop
+ * amount that is reasonable for your operation.  The loop overhead is reported
+ * as its own benchmark, so you can subtract it.  Set BENCH_FORMAT=json or csv
+ * for output you can compare across builds.
  *
  * Notes:
  * - I went with this style so you could do some prep work before and after the
@@ -45,6 +47,7 @@
 #include <parlib/parlib.h>
 #include <parlib/vcore.h>
 #include <parlib/timing.h>
+#include <benchutil/bench.h>
 
 static uint32_t __get_pcoreid(void)
 {
@@ -53,7 +56,7 @@ static uint32_t __get_pcoreid(void)
 
 /* Testing functions here */
 
-void set_tlsdesc_test(unsigned long nr_loops)
+void set_tlsdesc_test(void *arg, uint64_t nr_loops)
 {
 #ifdef __i386__
 	uint32_t vcoreid = vcore_id();
@@ -72,66 +75,32 @@ void set_tlsdesc_test(unsigned long nr_loops)
 
 /* Internal test infrastructure */
 
-void loop_overhead(unsigned long nr_loops)
+void loop_overhead(void *arg, uint64_t nr_loops)
 {
     for (int i = 0; i < nr_loops; i++) {
 		cmb();
     }
 }
 
-/* Runs func(loops) and returns the usec elapsed */
-#define __test_time_us(func, loops)                                            \
+/* Runs func with the harness, named after the mode we're in */
+#define microb_run(mode, func, loops)                                          \
 ({                                                                             \
-	struct timeval start_tv = {0};                                             \
-	struct timeval end_tv = {0};                                               \
-	if (gettimeofday(&start_tv, 0))                                            \
-		perror("Start time error...");                                         \
-	(func)((loops));                                                           \
-	if (gettimeofday(&end_tv, 0))                                              \
-		perror("End time error...");                                           \
-	((end_tv.tv_sec - start_tv.tv_sec) * 1000000 +                             \
-	 (end_tv.tv_usec - start_tv.tv_usec));                                     \
-})
-
-/* Runs func(loops) and returns the nsec elapsed */
-#define __test_time_ns(func, loops)                                            \
-({                                                                             \
-	(__test_time_us((func), (loops)) * 1000);                                  \
-})
-
-/* Runs func(loops), subtracts the loop overhead, and prints the result */
-#define test_time_us(func, loops)                                              \
-({                                                                             \
-	unsigned long long usec_diff;                                              \
-	usec_diff = __test_time_us((func), (loops)) - nsec_per_loop * loops / 1000;\
-	printf("\"%s\" total: %lluus, per iteration: %lluus\n", #func, usec_diff,  \
-	       usec_diff / (loops));                                               \
-})
-
-/* Runs func(loops), subtracts the loop overhead, and prints the result */
-#define test_time_ns(func, loops)                                              \
-({                                                                             \
-	unsigned long long nsec_diff;                                              \
-	nsec_diff = __test_time_ns((func), (loops)) - nsec_per_loop * (loops);     \
-	printf("\"%s\" total: %lluns, per iteration: %lluns\n", #func, nsec_diff,  \
-	       nsec_diff / (loops));                                               \
+	char name[64];                                                             \
+	snprintf(name, sizeof(name), "%s_%s", (mode), #func);                      \
+	bench_run(name, (func), NULL, (loops), NULL);                              \
 })
 
 static void microb_test(void)
 {
-	unsigned long long nsec_per_loop;
-	printf("We are %sin MCP mode, running on vcore %d, pcore %d\n",
-	       (in_multi_mode() ? "" : "not "), vcore_id(),
-	       __get_pcoreid());
-	/* We divide the overhead by loops, and later we multiply again, which drops
-	 * off some accuracy at the expense of usability (can do different
-	 * iterations for different tests without worrying about recomputing the
-	 * loop overhead). */
-	nsec_per_loop = __test_time_ns(loop_overhead, 100000) / 100000;
-	printd("Loop overhead per loop: %lluns\n", nsec_per_loop);
+	const char *mode = in_multi_mode() ? "mcp" : "scp";
+
+	/* stderr, so it doesn't get mixed into CSV or JSON */
+	fprintf(stderr, "We are %sin MCP mode, running on vcore %d, pcore %d\n",
+	        (in_multi_mode() ? "" : "not "), vcore_id(), __get_pcoreid());
+	microb_run(mode, loop_overhead, 100000);
 
-	/* Add your tests here.  Func name, number of loops */
-	test_time_ns(set_tlsdesc_test , 100000);
+	/* Add your tests here.  Mode, func name, number of loops */
+	microb_run(mode, set_tlsdesc_test, 100000);
 }
 
 void *worker_thread(void* arg)
@@ -145,7 +114,7 @@ int main(int argc, char** argv)
 	pthread_t child;
 	void *child_ret;
 	microb_test();
-	printf("Spawning worker thread, etc...\n");
+	fprintf(stderr, "Spawning worker thread, etc...\n");
 	pthread_create(&child, NULL, &worker_thread, NULL);
 	pthread_join(child, &child_ret);
 } 
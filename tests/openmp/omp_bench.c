@@ -0,0 +1,133 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Compares OpenMP parallel regions and barriers against doing the same with
+ * pthreads directly: creating and joining a thread per worker for each region,
+ * and a pthread_barrier_t.
+ *
+ * Usage: omp_bench [-n NR_LOOPS] [-t NR_THREADS]
+ *
+ * NR_THREADS defaults to max_vcores(), which is also OpenMP's default team
+ * size. */
+
+#include <omp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <parlib/arch/arch.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+
+static int nr_loops = 10000;
+static int nr_threads;
+static pthread_barrier_t pth_barrier;
+
+static void print_result(const char *what, uint64_t ticks)
+{
+	printf("%-24s %8llu nsec\n", what, tsc2nsec(ticks) / nr_loops);
+}
+
+static void omp_regions(void)
+{
+	uint64_t start = read_tsc();
+
+	for (int i = 0; i < nr_loops; i++) {
+		#pragma omp parallel num_threads(nr_threads)
+		cmb();
+	}
+	print_result("omp parallel region", read_tsc() - start);
+}
+
+static void omp_barriers(void)
+{
+	uint64_t start = read_tsc();
+
+	#pragma omp parallel num_threads(nr_threads)
+	{
+		for (int i = 0; i < nr_loops; i++) {
+			#pragma omp barrier
+		}
+	}
+	print_result("omp barrier", read_tsc() - start);
+}
+
+static void *pth_nop(void *arg)
+{
+	return 0;
+}
+
+static void pth_regions(void)
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_threads);
+	uint64_t start = read_tsc();
+
+	for (int i = 0; i < nr_loops; i++) {
+		/* The caller is worker 0, like an OpenMP master */
+		for (int j = 1; j < nr_threads; j++)
+			pthread_create(&threads[j], NULL, pth_nop, NULL);
+		for (int j = 1; j < nr_threads; j++)
+			pthread_join(threads[j], NULL);
+	}
+	print_result("pthread create/join", read_tsc() - start);
+	free(threads);
+}
+
+static void *pth_barrier_loop(void *arg)
+{
+	for (int i = 0; i < nr_loops; i++)
+		pthread_barrier_wait(&pth_barrier);
+	return 0;
+}
+
+static void pth_barriers(void)
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_threads);
+	uint64_t start;
+
+	pthread_barrier_init(&pth_barrier, NULL, nr_threads);
+	start = read_tsc();
+	for (int j = 1; j < nr_threads; j++)
+		pthread_create(&threads[j], NULL, pth_barrier_loop, NULL);
+	pth_barrier_loop(NULL);
+	for (int j = 1; j < nr_threads; j++)
+		pthread_join(threads[j], NULL);
+	print_result("pthread barrier", read_tsc() - start);
+	pthread_barrier_destroy(&pth_barrier);
+	free(threads);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	nr_threads = max_vcores();
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_loops = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n NR_LOOPS] [-t NR_THREADS]\n",
+			        argv[0]);
+			exit(1);
+		}
+	}
+	if (nr_loops <= 0 || nr_threads <= 0) {
+		fprintf(stderr, "Need positive loops and threads\n");
+		exit(1);
+	}
+	printf("%d threads, %d loops, per-loop averages:\n", nr_threads, nr_loops);
+	/* The first region creates the team's threads; don't count it */
+	#pragma omp parallel num_threads(nr_threads)
+	cmb();
+	omp_regions();
+	omp_barriers();
+	pth_regions();
+	pth_barriers();
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <parlib/parlib.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -11,6 +12,8 @@ pthread_barrier_t barrier;
 int nr_threads = 100;
 int nr_loops = 10000;
 int nr_vcores = 0;
+int barrier_type = PTHREAD_BARRIER_CENTRAL;
+atomic_t nr_serial;
 
 pthread_t *my_threads;
 void **my_retvals;
@@ -21,7 +24,8 @@ void *thread(void *arg)
 	while (!run_barriertest)
 		cpu_relax();
 	for(int i = 0; i < nr_loops; i++) {
-		pthread_barrier_wait(&barrier);
+		if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+			atomic_inc(&nr_serial);
 	}
 	return (void*)(long)pthread_self()->id;
 }
@@ -31,14 +35,18 @@ int main(int argc, char** argv)
 	struct timeval start_tv = {0};
 	struct timeval end_tv = {0};
 	long usec_diff;
+	pthread_barrierattr_t attr;
 	if (argc > 1)
 		nr_threads = strtol(argv[1], 0, 10);
 	if (argc > 2)
 		nr_loops = strtol(argv[2], 0, 10);
 	if (argc > 3)
 		nr_vcores = strtol(argv[3], 0, 10);
-	printf("Running %d threads for %d iterations on %d vcores\n",
-	       nr_threads, nr_loops, nr_vcores);
+	if (argc > 4 && !strcmp(argv[4], "tree"))
+		barrier_type = PTHREAD_BARRIER_TREE;
+	printf("Running %d threads for %d iterations on %d vcores, %s barrier\n",
+	       nr_threads, nr_loops, nr_vcores,
+	       barrier_type == PTHREAD_BARRIER_TREE ? "tree" : "central");
 	nr_threads = MIN(nr_threads, MAX_NR_TEST_THREADS);
 	my_threads = malloc(sizeof(pthread_t) * nr_threads);
 	my_retvals = malloc(sizeof(void*) * nr_threads);
@@ -54,7 +62,10 @@ int main(int argc, char** argv)
 				   __procinfo.vcoremap[i].pcoreid);
 		}
 	}
-	pthread_barrier_init(&barrier, NULL, nr_threads);
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_settype_np(&attr, barrier_type);
+	pthread_barrier_init(&barrier, &attr, nr_threads);
+	pthread_barrierattr_destroy(&attr);
 	for (int i = 0; i < nr_threads; i++) {
 		pthread_create(&my_threads[i], NULL, &thread, NULL);
 	}
@@ -67,6 +78,9 @@ int main(int argc, char** argv)
 	if (gettimeofday(&end_tv, 0))
 		perror("End time error...");
 	pthread_barrier_destroy(&barrier);
+	if (atomic_read(&nr_serial) != nr_loops)
+		printf("Failed: %ld serial threads for %d loops\n",
+		       atomic_read(&nr_serial), nr_loops);
 	usec_diff = (end_tv.tv_sec - start_tv.tv_sec) * 1000000 +
 	            (end_tv.tv_usec - start_tv.tv_usec);
 	printf("Done: %d threads, %d loops, %d vcores\n",
@@ -3,7 +3,10 @@
  * See LICENSE for details.
  *
  * Basic pthread switcher, bypassing the 2LS.  Use for benchmarking and
- * 2LS-inspiration. */
+ * 2LS-inspiration.
+ *
+ * Reports context switch latency with the benchutil harness; each rep
+ * includes creating the two threads. */
 
 #include <stdio.h>
 #include <pthread.h>
@@ -11,6 +14,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include "misc-compat.h"
+#include <benchutil/bench.h>
 
 pthread_t th1, th2;
 int nr_switch_loops = 100;
@@ -56,22 +60,14 @@ void *switch_thread(void *arg)
 	return 0;
 }
 
-int main(int argc, char** argv) 
+/* ops are context switches, two per loop */
+static void switch_bench(void *arg, uint64_t nr_ops)
 {
-	struct timeval start_tv = {0};
-	struct timeval end_tv = {0};
-	long usec_diff;
-	long nr_ctx_switches;
 	void *join_ret;
 
-	if (argc > 1)
-		nr_switch_loops = strtol(argv[1], 0, 10);
-	printf("Making 2 threads of %d switches each\n", nr_switch_loops);
-
-	pthread_can_vcore_request(FALSE);	/* 2LS won't manage vcores */
-	pthread_need_tls(FALSE);
-	pthread_mcp_init();					/* gives us one vcore */
-
+	nr_switch_loops = nr_ops / 2;
+	ready = FALSE;
+	should_exit = FALSE;
 	/* each is passed the other's pthread_t.  th1 starts the switching. */
 	if (pthread_create(&th1, NULL, &switch_thread, &th2))
 		perror("pth_create 1 failed");
@@ -79,24 +75,23 @@ int main(int argc, char** argv)
 	if (__pthread_create(&th2, NULL, &switch_thread, &th1))
 		perror("pth_create 2 failed");
 
-	if (gettimeofday(&start_tv, 0))
-		perror("Start time error...");
-
 	ready = TRUE;			/* signal to any spinning uthreads to start */
 
 	pthread_join(th1, &join_ret);
 	pthread_join(th2, &join_ret);
+}
 
-	if (gettimeofday(&end_tv, 0))
-		perror("End time error...");
-	nr_ctx_switches = 2 * nr_switch_loops;
-	usec_diff = (end_tv.tv_sec - start_tv.tv_sec) * 1000000 +
-	            (end_tv.tv_usec - start_tv.tv_usec);
-	printf("Done: %d loops\n", nr_switch_loops);
-	printf("Nr context switches: %ld\n", nr_ctx_switches);
-	printf("Time to run: %ld usec\n", usec_diff);
-	printf("Context switch latency: %d nsec\n",
-	       (int)(1000LL*usec_diff / nr_ctx_switches));
-	printf("Context switches / sec: %d\n\n",
-	       (int)(1000000LL*nr_ctx_switches / usec_diff));
-} 
+int main(int argc, char** argv)
+{
+	int nr_loops = nr_switch_loops;
+
+	if (argc > 1)
+		nr_loops = strtol(argv[1], 0, 10);
+	fprintf(stderr, "Making 2 threads of %d switches each\n", nr_loops);
+
+	pthread_can_vcore_request(FALSE);	/* 2LS won't manage vcores */
+	pthread_need_tls(FALSE);
+	pthread_mcp_init();					/* gives us one vcore */
+
+	bench_run("pthread_switch", switch_bench, NULL, 2 * nr_loops, NULL);
+}
@@ -0,0 +1,94 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Measures spawn latency: the time to create, run, and reap a process.
+ *
+ * Usage: spawn_lat [-n NR_LOOPS] [PROGRAM]
+ *
+ * PROGRAM defaults to ourselves, which just exits when it sees the child arg.
+ * The first spawn is reported separately, since it pays for the cold ELF
+ * header cache and page cache. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <parlib/arch/arch.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+static int spawn_one(char *path, char **argv)
+{
+	int pid, status;
+
+	pid = sys_proc_create(path, strlen(path), argv, NULL, 0);
+	if (pid < 0) {
+		perror("proc_create");
+		return -1;
+	}
+	if (sys_proc_run(pid) < 0) {
+		perror("proc_run");
+		return -1;
+	}
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_loops = 1000;
+	char self[512];
+	char *path;
+	char *child_argv[3];
+	uint64_t start, first, total = 0, min = (uint64_t)-1, max = 0, lat;
+	int opt;
+
+	/* detect the child by the arg */
+	if (argc > 1 && !strcmp(argv[1], "--child"))
+		return 0;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_loops = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n NR_LOOPS] [PROGRAM]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc) {
+		path = argv[optind];
+		child_argv[0] = path;
+		child_argv[1] = 0;
+	} else {
+		snprintf(self, sizeof(self), "/bin/%s", argv[0]);
+		path = self;
+		child_argv[0] = path;
+		child_argv[1] = "--child";
+		child_argv[2] = 0;
+	}
+
+	start = read_tsc();
+	if (spawn_one(path, child_argv))
+		exit(1);
+	first = read_tsc() - start;
+	for (int i = 0; i < nr_loops; i++) {
+		start = read_tsc();
+		if (spawn_one(path, child_argv))
+			exit(1);
+		lat = read_tsc() - start;
+		total += lat;
+		min = MIN(min, lat);
+		max = MAX(max, lat);
+	}
+	printf("%s: first spawn %llu usec\n", path, tsc2usec(first));
+	if (nr_loops)
+		printf("%d spawns: avg %llu usec, min %llu usec, max %llu usec\n",
+		       nr_loops, tsc2usec(total / nr_loops), tsc2usec(min),
+		       tsc2usec(max));
+	return 0;
+}
@@ -1,52 +1,232 @@
 /* Copyright (c) 2016 Google Inc., All Rights Reserved.
  * Ron Minnich <rminnich@google.com>
- * See LICENSE for details. */
+ * See LICENSE for details.
+ *
+ * The kernel sends binary struct systrace_records (ros/systrace.h); we do the
+ * formatting.  Filters are applied in the kernel, so syscalls we don't want
+ * never leave it. */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <parlib/parlib.h>
 #include <unistd.h>
-#include <signal.h>
-#include <iplib/iplib.h>
-#include <iplib/icmp.h>
-#include <ctype.h>
-#include <pthread.h>
-#include <parlib/spinlock.h>
-#include <parlib/timing.h>
-#include <parlib/tsc-compat.h>
-#include <parlib/printf-ext.h>
-#include <benchutil/alarm.h>
-#include <ndblib/ndb.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <ros/syscall.h>
+#include <ros/systrace.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 
-void usage(void)
+static const char *sysc_names[] = {
+	[SYS_null] = "null",
+	[SYS_block] = "block",
+	[SYS_cache_buster] = "buster",
+	[SYS_cache_invalidate] = "wbinv",
+	[SYS_reboot] = "reboot!",
+	[SYS_cputs] = "cputs",
+	[SYS_cgetc] = "cgetc",
+	[SYS_getpcoreid] = "getpcoreid",
+	[SYS_getvcoreid] = "getvcoreid",
+	[SYS_getpid] = "getpid",
+	[SYS_proc_create] = "proc_create",
+	[SYS_proc_run] = "proc_run",
+	[SYS_proc_destroy] = "proc_destroy",
+	[SYS_yield] = "proc_yield",
+	[SYS_change_vcore] = "change_vcore",
+	[SYS_fork] = "fork",
+	[SYS_exec] = "exec",
+	[SYS_waitpid] = "waitpid",
+	[SYS_mmap] = "mmap",
+	[SYS_munmap] = "munmap",
+	[SYS_mprotect] = "mprotect",
+	[SYS_madvise] = "madvise",
+	[SYS_shared_page_alloc] = "pa",
+	[SYS_shared_page_free] = "pf",
+	[SYS_provision] = "provision",
+	[SYS_notify] = "notify",
+	[SYS_self_notify] = "self_notify",
+	[SYS_ipc_call] = "ipc_call",
+	[SYS_vc_entry] = "vc_entry",
+	[SYS_halt_core] = "halt_core",
+	[SYS_init_arsc] = "init_arsc",
+	[SYS_change_to_m] = "change_to_m",
+	[SYS_vmm_setup] = "vmm_setup",
+	[SYS_vmm_poke_guest] = "vmm_poke_guest",
+	[SYS_poke_ksched] = "poke_ksched",
+	[SYS_abort_sysc] = "abort_sysc",
+	[SYS_abort_sysc_fd] = "abort_sysc_fd",
+	[SYS_populate_va] = "populate_va",
+	[SYS_nanosleep] = "nanosleep",
+	[SYS_pop_ctx] = "pop_ctx",
+	[SYS_read] = "read",
+	[SYS_write] = "write",
+	[SYS_openat] = "openat",
+	[SYS_close] = "close",
+	[SYS_fstat] = "fstat",
+	[SYS_stat] = "stat",
+	[SYS_lstat] = "lstat",
+	[SYS_fcntl] = "fcntl",
+	[SYS_access] = "access",
+	[SYS_umask] = "umask",
+	[SYS_llseek] = "llseek",
+	[SYS_link] = "link",
+	[SYS_unlink] = "unlink",
+	[SYS_symlink] = "symlink",
+	[SYS_readlink] = "readlink",
+	[SYS_chdir] = "chdir",
+	[SYS_fchdir] = "fchdir",
+	[SYS_getcwd] = "getcwd",
+	[SYS_mkdir] = "mkdir",
+	[SYS_rmdir] = "rmdir",
+	[SYS_pipe] = "pipe",
+	[SYS_gettimeofday] = "gettime",
+	[SYS_tcgetattr] = "tcgetattr",
+	[SYS_tcsetattr] = "tcsetattr",
+	[SYS_setuid] = "setuid",
+	[SYS_setgid] = "setgid",
+	[SYS_nbind] = "nbind",
+	[SYS_nmount] = "nmount",
+	[SYS_nunmount] = "nunmount",
+	[SYS_fd2path] = "fd2path",
+	[SYS_wstat] = "wstat",
+	[SYS_fwstat] = "fwstat",
+	[SYS_rename] = "rename",
+	[SYS_dup_fds_to] = "dup_fds_to",
+	[SYS_tap_fds] = "tap_fds",
+	[SYS_readv] = "readv",
+	[SYS_writev] = "writev",
+	[SYS_sendfile] = "sendfile",
+	[SYS_preadv] = "preadv",
+	[SYS_pwritev] = "pwritev",
+};
+
+static void usage(void)
 {
-	fprintf(stderr, "usage: strace command [args...]\n");
+	fprintf(stderr,
+	        "usage: strace [-e SYSC[,SYSC...]] [-p PID] [-l USEC] "
+	        "command [args...]\n"
+	        "       strace -r FILE\n"
+	        "\t-e: only trace these syscalls (names or numbers)\n"
+	        "\t-p: only trace this PID (a child of command)\n"
+	        "\t-l: only trace syscalls that take at least USEC\n"
+	        "\t-r: print the records in FILE, e.g. /prof/systrace\n");
 	exit(1);
 }
 
-void main(int argc, char **argv, char **envp)
+static const char *sysc_name(uint64_t num)
+{
+	if (num < COUNT_OF(sysc_names) && sysc_names[num])
+		return sysc_names[num];
+	return "???";
+}
+
+static int sysc_lookup(const char *name)
+{
+	if (isdigit(name[0]))
+		return strtol(name, 0, 0);
+	for (int i = 0; i < COUNT_OF(sysc_names); i++) {
+		if (sysc_names[i] && !strcmp(name, sysc_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+/* Printables as is, \ooo for the rest. */
+static void print_data(FILE *out, struct systrace_record *t)
 {
-	int fd;
+	size_t len = MIN(t->datalen, sizeof(t->data));
+
+	fputc('\'', out);
+	for (size_t i = 0; i < len; i++) {
+		if (isprint(t->data[i]))
+			fputc(t->data[i], out);
+		else
+			fprintf(out, "\\%03o", t->data[i]);
+	}
+	fputc('\'', out);
+}
+
+static void print_record(FILE *out, struct systrace_record *t)
+{
+	fprintf(out, "%c [%7llu.%09llu]-[%7llu.%09llu] Syscall %3llu (%12s):"
+	        "(0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: 0x%llx "
+	        "proc: %d core: %u vcore: %u data: ",
+	        t->end_timestamp ? 'X' : 'E',
+	        t->start_timestamp / 1000000000, t->start_timestamp % 1000000000,
+	        t->end_timestamp / 1000000000, t->end_timestamp % 1000000000,
+	        t->syscallno, sysc_name(t->syscallno), t->arg0, t->arg1, t->arg2,
+	        t->arg3, t->arg4, t->arg5, t->retval, t->pid, t->coreid,
+	        t->vcoreid);
+	print_data(out, t);
+	fputc('\n', out);
+}
+
+/* Prints records from fd until it runs dry.  Reads are whole records. */
+static void print_records(int fd)
+{
+	static struct systrace_record recs[64];
+	ssize_t amt;
+
+	while ((amt = read(fd, recs, sizeof(recs))) > 0) {
+		for (int i = 0; i < amt / sizeof(struct systrace_record); i++)
+			print_record(stderr, &recs[i]);
+	}
+}
+
+static void ctl_write(int fd, const char *cmd)
+{
+	if (write(fd, cmd, strlen(cmd)) < strlen(cmd)) {
+		fprintf(stderr, "write to ctl %s: %r\n", cmd);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv, char **envp)
+{
+	int fd, ctlfd, opt, num;
 	int pid;
-	int amt;
 	static char p[2 * MAX_PATH_LEN];
-	static char buf[16384];
+	static char filter[MAX_PATH_LEN];
+	char *tok, *prog_name;
+	char *sysc_filter = NULL;
+	unsigned long lat_usec = 0, filter_pid = 0;
 	struct syscall sysc;
-	char *prog_name = argv[1];
 
-
-	if (argc < 2)
+	while ((opt = getopt(argc, argv, "+e:p:l:r:")) != -1) {
+		switch (opt) {
+		case 'e':
+			sysc_filter = optarg;
+			break;
+		case 'p':
+			filter_pid = strtoul(optarg, 0, 0);
+			break;
+		case 'l':
+			lat_usec = strtoul(optarg, 0, 0);
+			break;
+		case 'r':
+			fd = open(optarg, O_READ);
+			if (fd < 0) {
+				fprintf(stderr, "open %s: %r\n", optarg);
+				exit(1);
+			}
+			print_records(fd);
+			exit(0);
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc)
 		usage();
-	if ((*argv[1] != '/') && (*argv[1] != '.')) {
-		snprintf(p, sizeof(p), "/bin/%s", argv[1]);
+	prog_name = argv[optind];
+	if ((*prog_name != '/') && (*prog_name != '.')) {
+		snprintf(p, sizeof(p), "/bin/%s", prog_name);
 		prog_name = p;
 	}
 
-	pid = sys_proc_create(prog_name, strlen(prog_name), argv + 1, envp,
+	pid = sys_proc_create(prog_name, strlen(prog_name), argv + optind, envp,
 	                      PROC_DUP_FGRP);
 	if (pid < 0) {
 		perror("proc_create");
@@ -58,18 +238,32 @@ void main(int argc, char **argv, char **envp)
 	syscall_async(&sysc, SYS_waitpid, pid, NULL, 0, 0, 0, 0);
 
 	snprintf(p, sizeof(p), "/proc/%d/ctl", pid);
-	fd = open(p, O_WRITE);
-	if (fd < 0) {
+	ctlfd = open(p, O_WRITE);
+	if (ctlfd < 0) {
 		fprintf(stderr, "open %s: %r\n", p);
 		exit(1);
 	}
-
-	snprintf(p, sizeof(p), "straceall");
-	if (write(fd, p, strlen(p)) < strlen(p)) {
-		fprintf(stderr, "write to ctl %s %d: %r\n", p, fd);
-		exit(1);
+	ctl_write(ctlfd, "straceall");
+	if (sysc_filter) {
+		for (tok = strtok(sysc_filter, ","); tok; tok = strtok(NULL, ",")) {
+			num = sysc_lookup(tok);
+			if (num < 0) {
+				fprintf(stderr, "Unknown syscall %s\n", tok);
+				exit(1);
+			}
+			snprintf(filter, sizeof(filter), "stracefilter sysc %d", num);
+			ctl_write(ctlfd, filter);
+		}
 	}
-	close(fd);
+	if (filter_pid) {
+		snprintf(filter, sizeof(filter), "stracefilter pid %lu", filter_pid);
+		ctl_write(ctlfd, filter);
+	}
+	if (lat_usec) {
+		snprintf(filter, sizeof(filter), "stracefilter lat %lu", lat_usec);
+		ctl_write(ctlfd, filter);
+	}
+	close(ctlfd);
 
 	snprintf(p, sizeof(p), "/proc/%d/strace", pid);
 	fd = open(p, O_READ);
@@ -82,11 +276,7 @@ void main(int argc, char **argv, char **envp)
 	 * great that the process doesn't immediately start when you make it? */
 	sys_proc_run(pid);
 
-	while ((amt = read(fd, buf, sizeof(buf))) > 0) {
-		if (write(fileno(stderr), buf, amt) < amt) {
-			fprintf(stderr, "Write to stdout: %r\n");
-			exit(1);
-		}
-	}
+	print_records(fd);
 	fprintf(stderr, "strace of PID %d: %r\n", pid);
+	return 0;
 }
@@ -23,6 +23,11 @@
 #include <vmm/virtio_mmio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
+#include <vmm/virtio_net_dev.h>
+#include <vmm/virtio_blk_dev.h>
+#include <vmm/virtio_9p_dev.h>
+#include <vmm/virtio_balloon_dev.h>
+#include <vmm/sched.h>
 
 
 
@@ -30,164 +35,10 @@ void showstatus(FILE *f, struct vmctl *v);
 
 int msrio(struct vmctl *vcpu, uint32_t opcode);
 
-struct vmctl vmctl;
 struct vmm_gpcore_init gpci;
-
-/* Whoever holds the ball runs.  run_vm never actually grabs it - it is grabbed
- * on its behalf. */
-uth_mutex_t the_ball;
-pthread_t vm_thread;
-void (*old_thread_refl)(struct uthread *uth, struct user_context *ctx);
-
-static void copy_vmtf_to_vmctl(struct vm_trapframe *vm_tf, struct vmctl *vmctl)
-{
-	vmctl->cr3 = vm_tf->tf_cr3;
-	vmctl->gva = vm_tf->tf_guest_va;
-	vmctl->gpa = vm_tf->tf_guest_pa;
-	vmctl->exit_qual = vm_tf->tf_exit_qual;
-	if (vm_tf->tf_exit_reason == EXIT_REASON_EPT_VIOLATION)
-		vmctl->shutdown = SHUTDOWN_EPT_VIOLATION;
-	else
-		vmctl->shutdown = SHUTDOWN_UNHANDLED_EXIT_REASON;
-	vmctl->ret_code = vm_tf->tf_exit_reason;
-	vmctl->interrupt = vm_tf->tf_trap_inject;
-	vmctl->intrinfo1 = vm_tf->tf_intrinfo1;
-	vmctl->intrinfo2 = vm_tf->tf_intrinfo2;
-	/* Most of the HW TF.  Should be good enough for now */
-	vmctl->regs.tf_rax = vm_tf->tf_rax;
-	vmctl->regs.tf_rbx = vm_tf->tf_rbx;
-	vmctl->regs.tf_rcx = vm_tf->tf_rcx;
-	vmctl->regs.tf_rdx = vm_tf->tf_rdx;
-	vmctl->regs.tf_rbp = vm_tf->tf_rbp;
-	vmctl->regs.tf_rsi = vm_tf->tf_rsi;
-	vmctl->regs.tf_rdi = vm_tf->tf_rdi;
-	vmctl->regs.tf_r8  = vm_tf->tf_r8;
-	vmctl->regs.tf_r9  = vm_tf->tf_r9;
-	vmctl->regs.tf_r10 = vm_tf->tf_r10;
-	vmctl->regs.tf_r11 = vm_tf->tf_r11;
-	vmctl->regs.tf_r12 = vm_tf->tf_r12;
-	vmctl->regs.tf_r13 = vm_tf->tf_r13;
-	vmctl->regs.tf_r14 = vm_tf->tf_r14;
-	vmctl->regs.tf_r15 = vm_tf->tf_r15;
-	vmctl->regs.tf_rip = vm_tf->tf_rip;
-	vmctl->regs.tf_rflags = vm_tf->tf_rflags;
-	vmctl->regs.tf_rsp = vm_tf->tf_rsp;
-}
-
-static void copy_vmctl_to_vmtf(struct vmctl *vmctl, struct vm_trapframe *vm_tf)
-{
-	vm_tf->tf_rax = vmctl->regs.tf_rax;
-	vm_tf->tf_rbx = vmctl->regs.tf_rbx;
-	vm_tf->tf_rcx = vmctl->regs.tf_rcx;
-	vm_tf->tf_rdx = vmctl->regs.tf_rdx;
-	vm_tf->tf_rbp = vmctl->regs.tf_rbp;
-	vm_tf->tf_rsi = vmctl->regs.tf_rsi;
-	vm_tf->tf_rdi = vmctl->regs.tf_rdi;
-	vm_tf->tf_r8  = vmctl->regs.tf_r8;
-	vm_tf->tf_r9  = vmctl->regs.tf_r9;
-	vm_tf->tf_r10 = vmctl->regs.tf_r10;
-	vm_tf->tf_r11 = vmctl->regs.tf_r11;
-	vm_tf->tf_r12 = vmctl->regs.tf_r12;
-	vm_tf->tf_r13 = vmctl->regs.tf_r13;
-	vm_tf->tf_r14 = vmctl->regs.tf_r14;
-	vm_tf->tf_r15 = vmctl->regs.tf_r15;
-	vm_tf->tf_rip = vmctl->regs.tf_rip;
-	vm_tf->tf_rflags = vmctl->regs.tf_rflags;
-	vm_tf->tf_rsp = vmctl->regs.tf_rsp;
-	vm_tf->tf_cr3 = vmctl->cr3;
-	vm_tf->tf_trap_inject = vmctl->interrupt;
-	/* Don't care about the rest of the fields.  The kernel only writes them */
-}
-
-/* callback, runs in vcore context.  this sets up our initial context.  once we
- * become runnable again, we'll run the first bits of the vm ctx.  after that,
- * our context will be stopped and started and will just run whatever the guest
- * VM wants.  we'll never come back to this code or to run_vm(). */
-static void __build_vm_ctx_cb(struct uthread *uth, void *arg)
-{
-	struct pthread_tcb *pthread = (struct pthread_tcb*)uth;
-	struct vmctl *vmctl = (struct vmctl*)arg;
-	struct vm_trapframe *vm_tf;
-
-	__pthread_generic_yield(pthread);
-	pthread->state = PTH_BLK_YIELDING;
-
-	memset(&uth->u_ctx, 0, sizeof(struct user_context));
-	uth->u_ctx.type = ROS_VM_CTX;
-	vm_tf = &uth->u_ctx.tf.vm_tf;
-
-	vm_tf->tf_guest_pcoreid = 0;	/* assuming only 1 guest core */
-
-	copy_vmctl_to_vmtf(vmctl, vm_tf);
-
-	/* other HW/GP regs are 0, which should be fine.  the FP state is still
-	 * whatever we were running before, though this is pretty much unnecessary.
-	 * we mostly don't want crazy crap in the uth->as, and a non-current_uthread
-	 * VM ctx is supposed to have something in their FP state (like HW ctxs). */
-	save_fp_state(&uth->as);
-	uth->flags |= UTHREAD_FPSAVED | UTHREAD_SAVED;
-
-	uthread_runnable(uth);
-}
-
-static void *run_vm(void *arg)
-{
-	struct vmctl *vmctl = (struct vmctl*)arg;
-
-	assert(vmctl->command == REG_RSP_RIP_CR3);
-	/* We need to hack our context, so that next time we run, we're a VM ctx */
-	uthread_yield(FALSE, __build_vm_ctx_cb, arg);
-}
-
-static void vmm_thread_refl_fault(struct uthread *uth,
-                                  struct user_context *ctx)
-{
-	struct pthread_tcb *pthread = (struct pthread_tcb*)uth;
-
-	/* Hack to call the original pth 2LS op */
-	if (!ctx->type == ROS_VM_CTX) {
-		old_thread_refl(uth, ctx);
-		return;
-	}
-	__pthread_generic_yield(pthread);
-	/* normally we'd handle the vmexit here.  to work within the existing
-	 * framework, we just wake the controller thread.  It'll look at our ctx
-	 * then make us runnable again */
-	pthread->state = PTH_BLK_MUTEX;
-	uth_mutex_unlock(the_ball);		/* wake the run_vmthread */
-}
-
-
-
-/* this will start the vm thread, and return when the thread has blocked,
- * with the right info in vmctl. */
-static void run_vmthread(struct vmctl *vmctl)
-{
-	struct vm_trapframe *vm_tf;
-
-	if (!vm_thread) {
-		/* first time through, we make the vm thread.  the_ball was already
-		 * grabbed right after it was alloc'd. */
-		if (pthread_create(&vm_thread, NULL, run_vm, vmctl)) {
-			perror("pth_create");
-			exit(-1);
-		}
-		/* hack in our own handlers for some 2LS ops */
-		old_thread_refl = sched_ops->thread_refl_fault;
-		sched_ops->thread_refl_fault = vmm_thread_refl_fault;
-	} else {
-		copy_vmctl_to_vmtf(vmctl, &vm_thread->uthread.u_ctx.tf.vm_tf);
-		uth_mutex_lock(the_ball);	/* grab it for the vm_thread */
-		uthread_runnable((struct uthread*)vm_thread);
-	}
-	uth_mutex_lock(the_ball);
-	/* We woke due to a vm exit.  Need to unlock for the next time we're run */
-	uth_mutex_unlock(the_ball);
-	/* the vm stopped.  we can do whatever we want before rerunning it.  since
-	 * we're controlling the uth, we need to handle its vmexits.  we'll fill in
-	 * the vmctl, since that's the current framework. */
-	copy_vmtf_to_vmctl(&vm_thread->uthread.u_ctx.tf.vm_tf, vmctl);
-}
+/* Guest pcore 0's thread.  Its vmctl is the one we run the guest with. */
+struct guest_thread *gth;
+struct vmctl *vmctl;
 
 /* By 1999, you could just scan the hardware
  * and work it out. But 2005, that was no longer possible. How sad.
@@ -317,6 +168,8 @@ unsigned int maxresume = (unsigned int) -1;
 #define GKERNBASE (16*MiB)
 #define KERNSIZE (128*MiB+GKERNBASE)
 uint8_t _kernel[KERNSIZE];
+/* Populate all of guest RAM before the guest starts, instead of on EPT faults */
+int prefault_ram = 0;
 
 unsigned long long *p512, *p1, *p2m;
 
@@ -328,6 +181,30 @@ int resumeprompt = 0;
 //	struct virtqueue *constoguest =
 //		vring_new_virtqueue(0, 512, 8192, 0, inpages, NULL, NULL, "test");
 uint64_t virtio_mmio_base = 0x100000000ULL;
+/* virtio-net, if -e names an ether device.  Like the console's 0xE5, the vector
+ * has to match what the guest picked for the IRQ. */
+uint64_t virtio_net_mmio_base = 0x100100000ULL;
+char *virtio_net_ether;
+int virtio_net_pairs = 1;
+int virtionetirq = 33;
+int virtionetvector = 0xE6;
+/* virtio-blk, if -b names a disk image */
+uint64_t virtio_blk_mmio_base = 0x100200000ULL;
+char *virtio_blk_image;
+int virtioblkirq = 34;
+int virtioblkvector = 0xE7;
+/* virtio-9p, if -f names a directory to share.  The guest mounts it with
+ * mount -t 9p -o trans=virtio,version=9p2000.L,msize=524288 hostfs /mnt */
+uint64_t virtio_9p_mmio_base = 0x100300000ULL;
+char *virtio_9p_root;
+int virtio9pirq = 35;
+int virtio9pvector = 0xE8;
+/* virtio-balloon, if -B is given.  Its argument is how many MB to ask the guest
+ * for at boot; with 0, we only take back the free memory the guest reports. */
+uint64_t virtio_balloon_mmio_base = 0x100400000ULL;
+long virtio_balloon_mb = -1;
+int virtioballoonirq = 36;
+int virtioballoonvector = 0xE9;
 
 void vapic_status_dump(FILE *f, void *vapic);
 static void set_posted_interrupt(int vector);
@@ -489,6 +366,33 @@ vqs: {
 	}
 };
 
+static void virtio_dev_irq(struct vqdev *vqdev, int vector)
+{
+	virtio_mmio_dev_set_vring_irq(vqdev);
+	set_posted_interrupt(vector);
+	ros_syscall(SYS_vmm_poke_guest, 0, 0, 0, 0, 0, 0);
+}
+
+static void virtio_net_irq(struct vqdev *vqdev)
+{
+	virtio_dev_irq(vqdev, virtionetvector);
+}
+
+static void virtio_blk_irq(struct vqdev *vqdev)
+{
+	virtio_dev_irq(vqdev, virtioblkvector);
+}
+
+static void virtio_9p_irq(struct vqdev *vqdev)
+{
+	virtio_dev_irq(vqdev, virtio9pvector);
+}
+
+static void virtio_balloon_irq(struct vqdev *vqdev)
+{
+	virtio_dev_irq(vqdev, virtioballoonvector);
+}
+
 void lowmem() {
 	__asm__ __volatile__ (".section .lowmem, \"aw\"\n\tlow: \n\t.=0x1000\n\t.align 0x100000\n\t.previous\n");
 }
@@ -529,6 +433,25 @@ static inline int test_and_set_bit(int nr, volatile unsigned long *addr)
 	return oldbit;
 }
 
+/* Replaces the guest RAM part of _kernel with jumbo-backed anonymous memory.
+ * Guest physical addresses are our virtual addresses, and the kernel keeps the
+ * EPT in lockstep with our page tables, so the guest gets 2 MiB EPT mappings
+ * and far fewer EPT TLB misses. */
+static void map_guest_ram(void)
+{
+	void *ram;
+	int flags = MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+
+	if (prefault_ram)
+		flags |= MAP_POPULATE;
+	ram = mmap((void*)GKERNBASE, KERNSIZE - GKERNBASE, PROT_READ | PROT_WRITE,
+	           flags, -1, 0);
+	if (ram != (void*)GKERNBASE) {
+		perror("Unable to mmap guest RAM");
+		exit(1);
+	}
+}
+
 static void pir_dump()
 {
 	unsigned long *pir_ptr = gpci.posted_irq_desc;
@@ -561,11 +484,10 @@ int main(int argc, char **argv)
 		                    " noexec=off"
 		                    " nohlt"
 		                    " init=/bin/launcher"
-		                    " lapic=notscdeadline"
 		                    " lapictimerfreq=1000"
 		                    " pit=none";
 	char *cmdline_extra = "\0";
-	char *cmdline;
+	char *cmdline, *cmdline_end;
 	uint64_t *p64;
 	void *a = (void *)0xe0000;
 	struct acpi_table_rsdp *r;
@@ -577,7 +499,8 @@ int main(int argc, char **argv)
 	void *lowmem = (void *) 0x1000000;
 	//struct vmctl vmctl;
 	int amt;
-	int vmmflags = 0; // Disabled probably forever. VMM_VMCALL_PRINTF;
+	/* VMCALL printf is disabled probably forever */
+	int vmmflags = VMM_HALT_POLL;
 	uint64_t entry = 0x1200000, kerneladdress = 0x1200000;
 	int nr_gpcs = 1;
 	int ret;
@@ -589,9 +512,6 @@ int main(int argc, char **argv)
 	void *coreboot_tables = (void *) 0x1165000;
 	void *a_page;
 
-	the_ball = uth_mutex_alloc();
-	uth_mutex_lock(the_ball);
-
 	fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT,
 			PML1_PTE_REACH);
 
@@ -601,8 +521,8 @@ int main(int argc, char **argv)
 		fprintf(stderr, "kernel array @%p is above , GKERNBASE@%p sucks\n", _kernel, GKERNBASE);
 		exit(1);
 	}
-	memset(_kernel, 0, sizeof(_kernel));
-	memset(lowmem, 0xff, 2*1048576);
+	/* Guest RAM gets fresh, zeroed memory in map_guest_ram() */
+	memset(_kernel, 0, GKERNBASE - (uint64_t)_kernel);
 	memset(low4k, 0xff, 4096);
 	// avoid at all costs, requires too much instruction emulation.
 	//low4k[0x40e] = 0;
@@ -648,6 +568,29 @@ int main(int argc, char **argv)
 			argc--, argv++;
 			virtioirq = strtoull(argv[0], 0, 0);
 			break;
+		case 'p':
+			prefault_ram = 1;
+			break;
+		case 'e':
+			argc--, argv++;
+			virtio_net_ether = argv[0];
+			break;
+		case 'q':
+			argc--, argv++;
+			virtio_net_pairs = strtoul(argv[0], 0, 0);
+			break;
+		case 'b':
+			argc--, argv++;
+			virtio_blk_image = argv[0];
+			break;
+		case 'f':
+			argc--, argv++;
+			virtio_9p_root = argv[0];
+			break;
+		case 'B':
+			argc--, argv++;
+			virtio_balloon_mb = strtoul(argv[0], 0, 0);
+			break;
 		case 'c':
 			argc--, argv++;
 			cmdline_extra = argv[0];
@@ -658,9 +601,11 @@ int main(int argc, char **argv)
 		argc--, argv++;
 	}
 	if (argc < 1) {
-		fprintf(stderr, "Usage: %s vmimage [-n (no vmcall printf)] [coreboot_tables [loadaddress [entrypoint]]]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-p (prefault guest RAM)] [-e etherdir [-q nr_queue_pairs]] [-b diskimage] [-f sharedir] [-B balloon_mb] vmimage [-n (no vmcall printf)] [coreboot_tables [loadaddress [entrypoint]]]\n", argv[0]);
 		exit(1);
 	}
+	map_guest_ram();
+	memset(lowmem, 0xff, 2*1048576);
 	if (argc > 1)
 		coreboot_tables = (void *) strtoull(argv[1], 0, 0);
 	if (argc > 2)
@@ -773,7 +718,7 @@ int main(int argc, char **argv)
 	memset(a, 0, 4096);
 	a += 4096;
 	gpci.vapic_addr = a;
-	//vmctl.vapic = (uint64_t) a_page;
+	//vmctl->vapic = (uint64_t) a_page;
 	memset(a, 0, 4096);
 	((uint32_t *)a)[0x30/4] = 0x01060014;
 	p64 = a;
@@ -796,7 +741,20 @@ int main(int argc, char **argv)
 	cmdline = a;
 	a += 4096;
 	bp->hdr.cmd_line_ptr = (uintptr_t) cmdline;
-	sprintf(cmdline, "%s %s", cmdline_default, cmdline_extra);
+	cmdline_end = cmdline + sprintf(cmdline, "%s", cmdline_default);
+	if (virtio_net_ether)
+		cmdline_end += sprintf(cmdline_end, " virtio_mmio.device=1M@0x%llx:%d",
+		                       virtio_net_mmio_base, virtionetirq);
+	if (virtio_blk_image)
+		cmdline_end += sprintf(cmdline_end, " virtio_mmio.device=1M@0x%llx:%d",
+		                       virtio_blk_mmio_base, virtioblkirq);
+	if (virtio_9p_root)
+		cmdline_end += sprintf(cmdline_end, " virtio_mmio.device=1M@0x%llx:%d",
+		                       virtio_9p_mmio_base, virtio9pirq);
+	if (virtio_balloon_mb >= 0)
+		cmdline_end += sprintf(cmdline_end, " virtio_mmio.device=1M@0x%llx:%d",
+		                       virtio_balloon_mmio_base, virtioballoonirq);
+	sprintf(cmdline_end, " %s", cmdline_extra);
 
 
 	/* Put the e820 memory region information in the boot_params */
@@ -831,7 +789,8 @@ int main(int argc, char **argv)
 		pthread_can_vcore_request(FALSE);	/* 2LS won't manage vcores */
 		pthread_need_tls(FALSE);
 		pthread_mcp_init();					/* gives us one vcore */
-		vcore_request(nr_threads - 1);		/* ghetto incremental interface */
+		/* A vcore per guest pcore, each running it and its controller */
+		vcore_request(MAX(nr_threads, nr_gpcs) - 1);
 		for (int i = 0; i < nr_threads; i++) {
 			xp = __procinfo.vcoremap;
 			fprintf(stderr, "%p\n", __procinfo.vcoremap);
@@ -840,6 +799,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (vmm_init_gths(nr_gpcs)) {
+		fprintf(stderr, "Unable to set up guest threads\n");
+		exit(1);
+	}
+	gth = gpcid_to_gth(0);
+	vmctl = &gth->vmctl;
+	/* We're guest pcore 0's controller */
+	vmm_pin_controller(gth);
+
 	ret = syscall(33, 1);
 	if (ret < 0) {
 		perror("vm setup");
@@ -872,15 +840,51 @@ int main(int argc, char **argv)
 	hexdump(stdout, coreboot_tables, 512);
 	fprintf(stderr, "kernbase for pml4 is 0x%llx and entry is %llx\n", kernbase, entry);
 	fprintf(stderr, "p512 %p p512[0] is 0x%lx p1 %p p1[0] is 0x%x\n", p512, p512[0], p1, p1[0]);
-	vmctl.interrupt = 0;
-	vmctl.command = REG_RSP_RIP_CR3;
-	vmctl.cr3 = (uint64_t) p512;
-	vmctl.regs.tf_rip = entry;
-	vmctl.regs.tf_rsp = (uint64_t) &stack[1024];
-	vmctl.regs.tf_rsi = (uint64_t) bp;
+	vmctl->interrupt = 0;
+	vmctl->command = REG_RSP_RIP_CR3;
+	vmctl->cr3 = (uint64_t) p512;
+	vmctl->regs.tf_rip = entry;
+	vmctl->regs.tf_rsp = (uint64_t) &stack[1024];
+	vmctl->regs.tf_rsi = (uint64_t) bp;
 	if (mcp) {
 		/* set up virtio bits, which depend on threads being enabled. */
 		register_virtio_mmio(&vqdev, virtio_mmio_base);
+		if (virtio_net_ether) {
+			struct vqdev *netdev = virtio_net_alloc(virtio_net_ether,
+			                                        virtio_net_pairs,
+			                                        virtio_net_irq);
+
+			if (!netdev)
+				exit(1);
+			register_virtio_mmio(netdev, virtio_net_mmio_base);
+		}
+		if (virtio_blk_image) {
+			struct vqdev *blkdev = virtio_blk_alloc(virtio_blk_image,
+			                                        virtio_blk_irq);
+
+			if (!blkdev)
+				exit(1);
+			register_virtio_mmio(blkdev, virtio_blk_mmio_base);
+		}
+		if (virtio_9p_root) {
+			struct vqdev *p9dev = virtio_9p_alloc(virtio_9p_root, "hostfs",
+			                                      virtio_9p_irq);
+
+			if (!p9dev)
+				exit(1);
+			register_virtio_mmio(p9dev, virtio_9p_mmio_base);
+		}
+		if (virtio_balloon_mb >= 0) {
+			uint32_t nr_pages = virtio_balloon_mb * (1048576 / PGSIZE);
+			struct vqdev *baldev;
+
+			baldev = virtio_balloon_alloc((void*)GKERNBASE,
+			                              KERNSIZE - GKERNBASE, nr_pages,
+			                              virtio_balloon_irq);
+			if (!baldev)
+				exit(1);
+			register_virtio_mmio(baldev, virtio_balloon_mmio_base);
+		}
 	}
 	fprintf(stderr, "threads started\n");
 	fprintf(stderr, "Writing command :%s:\n", cmd);
@@ -888,7 +892,7 @@ int main(int argc, char **argv)
 	if (debug)
 		vapic_status_dump(stderr, (void *)gpci.vapic_addr);
 
-	run_vmthread(&vmctl);
+	vmm_run_gth(gth);
 
 	if (debug)
 		vapic_status_dump(stderr, (void *)gpci.vapic_addr);
@@ -907,14 +911,14 @@ int main(int argc, char **argv)
 
 		int c;
 		uint8_t byte;
-		vmctl.command = REG_RIP;
+		vmctl->command = REG_RIP;
 		if (maxresume-- == 0) {
 			debug = 1;
 			resumeprompt = 1;
 		}
 		if (debug) {
-			fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-			showstatus(stderr, &vmctl);
+			fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+			showstatus(stderr, vmctl);
 		}
 		if (resumeprompt) {
 			fprintf(stderr, "RESUME?\n");
@@ -922,102 +926,102 @@ int main(int argc, char **argv)
 			if (c == 'q')
 				break;
 		}
-		if (vmctl.shutdown == SHUTDOWN_EPT_VIOLATION) {
+		if (vmctl->shutdown == SHUTDOWN_EPT_VIOLATION) {
 			uint64_t gpa, *regp, val;
 			uint8_t regx;
 			int store, size;
 			int advance;
-			if (decode(&vmctl, &gpa, &regx, &regp, &store, &size, &advance)) {
-				fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-				showstatus(stderr, &vmctl);
+			if (decode(vmctl, &gpa, &regx, &regp, &store, &size, &advance)) {
+				fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+				showstatus(stderr, vmctl);
 				quit = 1;
 				break;
 			}
 			if (debug) fprintf(stderr, "%p %p %p %p %p %p\n", gpa, regx, regp, store, size, advance);
-			if ((gpa & ~0xfffULL) == virtiobase) {
+			if (is_virtio_mmio(gpa)) {
 				if (debug) fprintf(stderr, "DO SOME VIRTIO\n");
 				// Lucky for us the various virtio ops are well-defined.
-				virtio_mmio(&vmctl, gpa, regx, regp, store);
+				virtio_mmio(vmctl, gpa, regx, regp, store);
 				if (debug) fprintf(stderr, "store is %d:\n", store);
 				if (debug) fprintf(stderr, "REGP IS %16x:\n", *regp);
 			} else if ((gpa & 0xfee00000) == 0xfee00000) {
 				// until we fix our include mess, just put the proto here.
 				//int apic(struct vmctl *v, uint64_t gpa, int destreg, uint64_t *regp, int store);
-				//apic(&vmctl, gpa, regx, regp, store);
+				//apic(vmctl, gpa, regx, regp, store);
 			} else if ((gpa & 0xfec00000) == 0xfec00000) {
 				// until we fix our include mess, just put the proto here.
 				int do_ioapic(struct vmctl *v, uint64_t gpa, int destreg, uint64_t *regp, int store);
-				do_ioapic(&vmctl, gpa, regx, regp, store);
+				do_ioapic(vmctl, gpa, regx, regp, store);
 			} else if (gpa < 4096) {
 				uint64_t val = 0;
 				memmove(&val, &low4k[gpa], size);
 				hexdump(stdout, &low4k[gpa], size);
-				fprintf(stderr, "Low 1m, code %p read @ %p, size %d, val %p\n", vmctl.regs.tf_rip, gpa, size, val);
+				fprintf(stderr, "Low 1m, code %p read @ %p, size %d, val %p\n", vmctl->regs.tf_rip, gpa, size, val);
 				memmove(regp, &low4k[gpa], size);
 				hexdump(stdout, regp, size);
 			} else {
 				fprintf(stderr, "EPT violation: can't handle %p\n", gpa);
-				fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
+				fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
 				fprintf(stderr, "Returning 0xffffffff\n");
-				showstatus(stderr, &vmctl);
+				showstatus(stderr, vmctl);
 				// Just fill the whole register for now.
 				*regp = (uint64_t) -1;
 			}
-			vmctl.regs.tf_rip += advance;
-			if (debug) fprintf(stderr, "Advance rip by %d bytes to %p\n", advance, vmctl.regs.tf_rip);
-			vmctl.shutdown = 0;
-			vmctl.gpa = 0;
-			vmctl.command = REG_ALL;
-		} else if (vmctl.shutdown == SHUTDOWN_UNHANDLED_EXIT_REASON) {
-			switch(vmctl.ret_code){
+			vmctl->regs.tf_rip += advance;
+			if (debug) fprintf(stderr, "Advance rip by %d bytes to %p\n", advance, vmctl->regs.tf_rip);
+			vmctl->shutdown = 0;
+			vmctl->gpa = 0;
+			vmctl->command = REG_ALL;
+		} else if (vmctl->shutdown == SHUTDOWN_UNHANDLED_EXIT_REASON) {
+			switch(vmctl->ret_code){
 			case  EXIT_REASON_VMCALL:
-				byte = vmctl.regs.tf_rdi;
+				byte = vmctl->regs.tf_rdi;
 				printf("%c", byte);
 				if (byte == '\n') printf("%c", '%');
-				vmctl.regs.tf_rip += 3;
+				vmctl->regs.tf_rip += 3;
 				break;
 			case EXIT_REASON_EXTERNAL_INTERRUPT:
 				//debug = 1;
-				if (debug) fprintf(stderr, "XINT 0x%x 0x%x\n", vmctl.intrinfo1, vmctl.intrinfo2);
+				if (debug) fprintf(stderr, "XINT 0x%x 0x%x\n", vmctl->intrinfo1, vmctl->intrinfo2);
 				if (debug) pir_dump();
-				vmctl.command = RESUME;
+				vmctl->command = RESUME;
 				break;
 			case EXIT_REASON_IO_INSTRUCTION:
-				fprintf(stderr, "IO @ %p\n", vmctl.regs.tf_rip);
-				io(&vmctl);
-				vmctl.shutdown = 0;
-				vmctl.gpa = 0;
-				vmctl.command = REG_ALL;
+				fprintf(stderr, "IO @ %p\n", vmctl->regs.tf_rip);
+				io(vmctl);
+				vmctl->shutdown = 0;
+				vmctl->gpa = 0;
+				vmctl->command = REG_ALL;
 				break;
 			case EXIT_REASON_INTERRUPT_WINDOW:
 				if (consdata) {
 					if (debug) fprintf(stderr, "inject an interrupt\n");
 					virtio_mmio_set_vring_irq();
-					vmctl.interrupt = 0x80000000 | virtioirq;
-					vmctl.command = RESUME;
+					vmctl->interrupt = 0x80000000 | virtioirq;
+					vmctl->command = RESUME;
 					consdata = 0;
 				}
 				break;
 			case EXIT_REASON_MSR_WRITE:
 			case EXIT_REASON_MSR_READ:
 				fprintf(stderr, "Do an msr\n");
-				if (msrio(&vmctl, vmctl.ret_code)) {
+				if (msrio(vmctl, vmctl->ret_code)) {
 					// uh-oh, msrio failed
 					// well, hand back a GP fault which is what Intel does
-					fprintf(stderr, "MSR FAILED: RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-					showstatus(stderr, &vmctl);
+					fprintf(stderr, "MSR FAILED: RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+					showstatus(stderr, vmctl);
 
 					// Use event injection through vmctl to send
 					// a general protection fault
-					// vmctl.interrupt gets written to the VM-Entry
+					// vmctl->interrupt gets written to the VM-Entry
 					// Interruption-Information Field by vmx
-					vmctl.interrupt = (1 << 31) // "Valid" bit
+					vmctl->interrupt = (1 << 31) // "Valid" bit
 					                | (0 << 12) // Reserved by Intel
 					                | (1 << 11) // Deliver-error-code bit (set if event pushes error code to stack)
 					                | (3 << 8)  // Event type (3 is "hardware exception")
 					                | 13;       // Interrupt/exception vector (13 is "general protection fault")
 				} else {
-					vmctl.regs.tf_rip += 2;
+					vmctl->regs.tf_rip += 2;
 				}
 				break;
 			case EXIT_REASON_MWAIT_INSTRUCTION:
@@ -1030,9 +1034,9 @@ int main(int argc, char **argv)
 				if (debug)
 					vapic_status_dump(stderr, gpci.vapic_addr);
 				if (debug)fprintf(stderr, "Resume with consdata ...\n");
-				vmctl.regs.tf_rip += 3;
-				//fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-				//showstatus(stderr, &vmctl);
+				vmctl->regs.tf_rip += 3;
+				//fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+				//showstatus(stderr, vmctl);
 				break;
 			case EXIT_REASON_HLT:
 				fflush(stdout);
@@ -1042,9 +1046,9 @@ int main(int argc, char **argv)
 					;
 				//debug = 1;
 				if (debug)fprintf(stderr, "Resume with consdata ...\n");
-				vmctl.regs.tf_rip += 1;
-				//fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-				//showstatus(stderr, &vmctl);
+				vmctl->regs.tf_rip += 1;
+				//fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+				//showstatus(stderr, vmctl);
 				break;
 			case EXIT_REASON_APIC_ACCESS:
 				if (1 || debug)fprintf(stderr, "APIC READ EXIT\n");
@@ -1053,28 +1057,28 @@ int main(int argc, char **argv)
 				uint8_t regx;
 				int store, size;
 				int advance;
-				if (decode(&vmctl, &gpa, &regx, &regp, &store, &size, &advance)) {
-					fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-					showstatus(stderr, &vmctl);
+				if (decode(vmctl, &gpa, &regx, &regp, &store, &size, &advance)) {
+					fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+					showstatus(stderr, vmctl);
 					quit = 1;
 					break;
 				}
 
 				int apic(struct vmctl *v, uint64_t gpa, int destreg, uint64_t *regp, int store);
-				apic(&vmctl, gpa, regx, regp, store);
-				vmctl.regs.tf_rip += advance;
-				if (debug) fprintf(stderr, "Advance rip by %d bytes to %p\n", advance, vmctl.regs.tf_rip);
-				vmctl.shutdown = 0;
-				vmctl.gpa = 0;
-				vmctl.command = REG_ALL;
+				apic(vmctl, gpa, regx, regp, store);
+				vmctl->regs.tf_rip += advance;
+				if (debug) fprintf(stderr, "Advance rip by %d bytes to %p\n", advance, vmctl->regs.tf_rip);
+				vmctl->shutdown = 0;
+				vmctl->gpa = 0;
+				vmctl->command = REG_ALL;
 				break;
 			case EXIT_REASON_APIC_WRITE:
 				if (1 || debug)fprintf(stderr, "APIC WRITE EXIT\n");
 				break;
 			default:
-				fprintf(stderr, "Don't know how to handle exit %d\n", vmctl.ret_code);
-				fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl.regs.tf_rip, vmctl.shutdown);
-				showstatus(stderr, &vmctl);
+				fprintf(stderr, "Don't know how to handle exit %d\n", vmctl->ret_code);
+				fprintf(stderr, "RIP %p, shutdown 0x%x\n", vmctl->regs.tf_rip, vmctl->shutdown);
+				showstatus(stderr, vmctl);
 				quit = 1;
 				break;
 			}
@@ -1084,15 +1088,15 @@ int main(int argc, char **argv)
 			break;
 		if (consdata) {
 			if (debug) fprintf(stderr, "inject an interrupt\n");
-			if (debug) fprintf(stderr, "XINT 0x%x 0x%x\n", vmctl.intrinfo1, vmctl.intrinfo2);
-			vmctl.interrupt = 0x80000000 | virtioirq;
+			if (debug) fprintf(stderr, "XINT 0x%x 0x%x\n", vmctl->intrinfo1, vmctl->intrinfo2);
+			vmctl->interrupt = 0x80000000 | virtioirq;
 			virtio_mmio_set_vring_irq();
 			consdata = 0;
 			//debug = 1;
-			vmctl.command = RESUME;
+			vmctl->command = RESUME;
 		}
 		if (debug) fprintf(stderr, "NOW DO A RESUME\n");
-		run_vmthread(&vmctl);
+		vmm_run_gth(gth);
 	}
 
 	/* later.
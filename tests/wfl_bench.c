@@ -0,0 +1,128 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * wfl_bench: compares the wait-free list against its old layout, one slot per
+ * malloc'd node with no padding, kept here as old_wfl.
+ *
+ * Each op is an insert and a remove.  Each thread keeps WFL_BENCH_HELD items in
+ * the list while it runs, so the lists stay partly full, and we sweep the
+ * number of threads (vcores) up to the argument, default max_vcores().
+ *
+ * Set BENCH_FORMAT=json or csv for machine-readable output. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/atomic.h>
+#include <parlib/waitfreelist.h>
+#include <benchutil/bench.h>
+
+#define WFL_BENCH_HELD		4
+#define WFL_BENCH_BULK		8
+#define WFL_BENCH_OPS		100000
+
+struct old_wfl_entry {
+	struct old_wfl_entry *next;
+	void *data;
+};
+
+struct old_wfl {
+	struct old_wfl_entry *head;
+	struct old_wfl_entry first;
+};
+
+static void old_wfl_insert(struct old_wfl *list, void *data)
+{
+	struct old_wfl_entry *p = list->head;
+	struct old_wfl_entry *new_entry, *next;
+
+	while (1) {
+		if (p->data == NULL) {
+			if (__sync_bool_compare_and_swap(&p->data, NULL, data))
+				return;
+		}
+		if (p->next == NULL)
+			break;
+		p = p->next;
+	}
+	new_entry = malloc(sizeof(struct old_wfl_entry));
+	if (new_entry == NULL)
+		abort();
+	new_entry->data = data;
+	new_entry->next = NULL;
+	wmb();
+	while ((next = __sync_val_compare_and_swap(&p->next, NULL, new_entry)))
+		p = next;
+}
+
+static void *old_wfl_remove(struct old_wfl *list)
+{
+	for (struct old_wfl_entry *p = list->head; p != NULL; p = p->next) {
+		if (p->data != NULL) {
+			void *data = atomic_swap_ptr(&p->data, 0);
+			if (data != NULL)
+				return data;
+		}
+	}
+	return NULL;
+}
+
+static struct old_wfl old_list = {&old_list.first, {0, 0}};
+static struct wfl new_list = WFL_INITIALIZER(new_list);
+
+/* The items are just non-NULL cookies */
+#define WFL_ITEM(i) ((void*)((uintptr_t)(i) + 1))
+
+static void old_wfl_bench(void *arg, uint64_t nr_ops)
+{
+	for (int i = 0; i < WFL_BENCH_HELD; i++)
+		old_wfl_insert(&old_list, WFL_ITEM(i));
+	for (uint64_t i = 0; i < nr_ops; i++) {
+		old_wfl_insert(&old_list, WFL_ITEM(i));
+		old_wfl_remove(&old_list);
+	}
+	for (int i = 0; i < WFL_BENCH_HELD; i++)
+		old_wfl_remove(&old_list);
+}
+
+static void new_wfl_bench(void *arg, uint64_t nr_ops)
+{
+	for (int i = 0; i < WFL_BENCH_HELD; i++)
+		wfl_insert(&new_list, WFL_ITEM(i));
+	for (uint64_t i = 0; i < nr_ops; i++) {
+		wfl_insert(&new_list, WFL_ITEM(i));
+		wfl_remove(&new_list);
+	}
+	for (int i = 0; i < WFL_BENCH_HELD; i++)
+		wfl_remove(&new_list);
+}
+
+/* ops are items, WFL_BENCH_BULK at a time */
+static void bulk_wfl_bench(void *arg, uint64_t nr_ops)
+{
+	void *items[WFL_BENCH_BULK];
+
+	for (int i = 0; i < WFL_BENCH_BULK; i++)
+		items[i] = WFL_ITEM(i);
+	for (uint64_t i = 0; i < nr_ops; i += WFL_BENCH_BULK) {
+		wfl_insert_bulk(&new_list, items, WFL_BENCH_BULK);
+		wfl_remove_bulk(&new_list, items, WFL_BENCH_BULK);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_vcores = max_vcores();
+
+	if (argc > 1)
+		nr_vcores = strtol(argv[1], 0, 10);
+	bench_sweep_vcores("wfl_old", old_wfl_bench, NULL, nr_vcores,
+	                   WFL_BENCH_OPS);
+	bench_sweep_vcores("wfl_new", new_wfl_bench, NULL, nr_vcores,
+	                   WFL_BENCH_OPS);
+	bench_sweep_vcores("wfl_new_bulk", bulk_wfl_bench, NULL, nr_vcores,
+	                   WFL_BENCH_OPS);
+	return 0;
+}
@@ -22,12 +22,33 @@
    see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
    <http://www.gnu.org/licenses/>.  */
 
-/* This is a Linux specific implementation of a barrier synchronization
-   mechanism for libgomp.  This type is private to the library.  This 
-   implementation uses atomic instructions and the futex syscall.  */
+/* This is an Akaros implementation of a barrier synchronization
+   mechanism for libgomp, based on the Linux one.  This type is private to
+   the library.  This implementation uses atomic instructions and parlib's
+   futexes, and pins team threads to vcores.  */
 
 #include <limits.h>
 #include "wait.h"
+#include <parlib/vcore.h>
+
+/* Team threads are uthreads.  Keep each one on the vcore matching its team
+   id, so a team of max_vcores() threads (the default) is one thread per vcore,
+   and a thread docked in the pool comes back to the same vcore (and cache)
+   for the next parallel region.  The 2LS still runs pinned threads elsewhere
+   if we don't have their vcore.  */
+static __thread int gomp_pinned_vcore = -1;
+
+static void
+gomp_pin_to_vcore (void)
+{
+  struct gomp_thread *thr = gomp_thread ();
+  int vcoreid = thr->ts.team_id % max_vcores ();
+
+  if (__builtin_expect (vcoreid == gomp_pinned_vcore, 1))
+    return;
+  if (!pthread_pin_vcore (pthread_self (), vcoreid))
+    gomp_pinned_vcore = vcoreid;
+}
 
 
 void
@@ -43,6 +64,7 @@ gomp_barrier_wait_end (gomp_barrier_t *bar, gomp_barrier_state_t state)
     }
   else
     {
+      gomp_pin_to_vcore ();
       do
 	do_wait ((int *) &bar->generation, state);
       while (__atomic_load_n (&bar->generation, MEMMODEL_ACQUIRE) == state);
@@ -104,6 +126,7 @@ gomp_team_barrier_wait_end (gomp_barrier_t *bar, gomp_barrier_state_t state)
 	}
     }
 
+  gomp_pin_to_vcore ();
   generation = state;
   state &= ~BAR_CANCELLED;
   do
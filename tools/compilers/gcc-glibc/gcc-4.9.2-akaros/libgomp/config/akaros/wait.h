@@ -37,6 +37,12 @@
 #endif
 #include "libgomp_futex.h"
 
+/* On Akaros, team threads are uthreads, and usually one per vcore.  After
+   spinning, we give our vcore to any other ready uthread (say, a teammate
+   that got put on our vcore) a few times before sleeping on the futex.  If
+   no one else is ready, the yield is cheap and we're back to checking.  */
+#define GOMP_AKAROS_NR_YIELDS 16
+
 static inline void do_wait (int *addr, int val)
 {
   unsigned long long i, count = gomp_spin_count_var;
@@ -48,6 +54,11 @@ static inline void do_wait (int *addr, int val)
       return;
     else
       cpu_relax ();
+  for (i = 0; i < GOMP_AKAROS_NR_YIELDS; i++)
+    if (__builtin_expect (*addr != val, 0))
+      return;
+    else
+      pthread_yield ();
   futex_wait (addr, val);
 }
 
@@ -64,6 +64,7 @@
 # define MAP_POPULATE	0x08000		/* Populate (prefault) pagetables.  */
 # define MAP_NONBLOCK	0x10000		/* Do not block on IO.  */
 # define MAP_STACK	0x20000		/* Allocation is for a stack.  */
+# define MAP_HUGETLB	0x40000		/* Create huge page mapping.  */
 #endif
 
 /* Flags to `msync'.  */
@@ -89,6 +90,7 @@
 # define MADV_SEQUENTIAL  2	/* Expect sequential page references.  */
 # define MADV_WILLNEED	  3	/* Will need these pages.  */
 # define MADV_DONTNEED	  4	/* Don't need these pages.  */
+# define MADV_FREE	  8	/* Free pages only if memory pressure.  */
 # define MADV_REMOVE	  9	/* Remove these pages and resources.  */
 # define MADV_DONTFORK	  10	/* Do not inherit across fork.  */
 # define MADV_DOFORK	  11	/* Do inherit across fork.  */
@@ -56,8 +56,8 @@ int __connect(int fd, __CONST_SOCKADDR_ARG addr, socklen_t alen)
 			 * already done here */
 			if (r->stype == SOCK_DGRAM)
 				return 0;
-			/* set up a tcp or udp connection */
-			cfd = open(r->ctl, O_RDWR);
+			/* set up a tcp or udp connection.  the rock owns cfd. */
+			cfd = _sock_ctl_fd(r);
 			if (cfd < 0) {
 				return -1;
 			}
@@ -73,11 +73,8 @@ int __connect(int fd, __CONST_SOCKADDR_ARG addr, socklen_t alen)
 						 inet_ntoa(rip->sin_addr), ntohs(rip->sin_port),
 						 r->reserved ? "!r" : "");
 			n = write(cfd, msg, strlen(msg));
-			if (n < 0) {
-				close(cfd);
+			if (n < 0)
 				return -1;
-			}
-			close(cfd);
 			return 0;
 		case PF_UNIX:
 			/* null terminate the address */
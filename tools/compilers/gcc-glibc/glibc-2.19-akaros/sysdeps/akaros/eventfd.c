@@ -63,3 +63,75 @@ int eventfd_write(int efd, eventfd_t value)
 	else
 		return -1;
 }
+
+/* Must match #eventfd's shm counter layout */
+#define EFD_SHM_WAITING		(1ULL << 63)
+#define EFD_SHM_COUNT		(EFD_SHM_WAITING - 1)
+
+/* Gets a new EFD instance whose counter is *ctr, returning the FD on success.
+ * The counter must stay mapped for as long as the FD is open, and the FD only
+ * works in this process. */
+int eventfd_shm(eventfd_t *ctr, int flags)
+{
+	const char *dirname = "#eventfd";
+	int oflags = 0;
+	int dfd, ctlfd, efd = -1;
+	char cmd[64];
+	int ret;
+
+	if (flags & EFD_SEMAPHORE)
+		dirname = "#eventfd.sem";
+	if (flags & EFD_CLOEXEC)
+		oflags |= O_CLOEXEC;
+	if (flags & EFD_NONBLOCK)
+		oflags |= O_NONBLOCK;
+	*ctr = 0;
+	/* ctl and efd have to come from the same attach */
+	dfd = open(dirname, O_READ);
+	if (dfd < 0)
+		return -1;
+	ctlfd = openat(dfd, "ctl", O_WRITE);
+	if (ctlfd < 0)
+		goto out_dfd;
+	ret = snprintf(cmd, sizeof(cmd), "shm %p", ctr);
+	if (write(ctlfd, cmd, ret) == ret)
+		efd = openat(dfd, "efd", O_READ | O_WRITE | oflags);
+	close(ctlfd);
+out_dfd:
+	close(dfd);
+	return efd;
+}
+
+/* Adds value to the counter.  We only trap if someone is waiting, and only one
+ * of the producers that sees them has to. */
+int eventfd_shm_write(int efd, eventfd_t *ctr, eventfd_t value)
+{
+	eventfd_t old = __sync_fetch_and_add(ctr, value);
+
+	if (!(old & EFD_SHM_WAITING))
+		return 0;
+	old = __sync_fetch_and_and(ctr, ~EFD_SHM_WAITING);
+	if (!(old & EFD_SHM_WAITING))
+		return 0;
+	return eventfd_write(efd, 0);
+}
+
+/* Takes the count (or one of it, for semaphores) into *value.  flags must be
+ * the ones efd was made with.  Returns 0 on success.  If the count is 0, we
+ * block in the kernel, or fail with EAGAIN if efd is nonblocking. */
+int eventfd_shm_read(int efd, eventfd_t *ctr, int flags, eventfd_t *value)
+{
+	eventfd_t old, take;
+
+	/* The kernel leaves WAITING alone when taking counts, and so do we */
+	old = *ctr;
+	while (old & EFD_SHM_COUNT) {
+		take = flags & EFD_SEMAPHORE ? 1 : old & EFD_SHM_COUNT;
+		if (__sync_bool_compare_and_swap(ctr, old, old - take)) {
+			*value = take;
+			return 0;
+		}
+		old = *ctr;
+	}
+	return eventfd_read(efd, value);
+}
@@ -20,28 +20,15 @@
 
 static int toggle_nonblock(Rock *r)
 {
-	int ret, ctlfd;
-	char on_msg[] = "nonblock on";
-	char off_msg[] = "nonblock off";
+	bool on = !(r->sopts & SOCK_NONBLOCK);
 
-	ctlfd = open(r->ctl, O_RDWR);
-	if (!ctlfd)
+	if (_sock_ctl_bin(r, IPCONV_CTL_NONBLOCK, on))
 		return -1;
-	if (r->sopts & SOCK_NONBLOCK) {
-		ret = write(ctlfd, off_msg, sizeof(off_msg));
-		if (ret < 0)
-			goto out;
-		r->sopts &= ~SOCK_NONBLOCK;
-	} else {
-		ret = write(ctlfd, on_msg, sizeof(on_msg));
-		if (ret < 0)
-			goto out;
+	if (on)
 		r->sopts |= SOCK_NONBLOCK;
-	}
-	ret = 0;
-out:
-	close(ctlfd);
-	return ret;
+	else
+		r->sopts &= ~SOCK_NONBLOCK;
+	return 0;
 }
 
 /* Sets the fd's nonblock status IAW arg's settings.  Returns 0 on success.
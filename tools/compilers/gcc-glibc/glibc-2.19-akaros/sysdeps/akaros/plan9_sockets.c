@@ -25,36 +25,22 @@
 
 #include "plan9_sockets.h"
 
+/* a is "local" or "remote".  Uses the conversation's binary info file, which
+ * we keep open, instead of opening and parsing the text file each time. */
 void
 _sock_ingetaddr(Rock * r, struct sockaddr_in *ip, socklen_t * alen,
 				const char *a)
 {
-	int n, fd;
-	char *p;
-	char name[Ctlsize];
-
-	/* get remote address */
-	strcpy(name, r->ctl);
-	p = strrchr(name, '/');
-	strcpy(p + 1, a);
-	fd = open(name, O_RDONLY);
-	if (fd >= 0) {
-		n = read(fd, name, sizeof(name) - 1);
-		if (n > 0) {
-			name[n] = 0;
-			p = strchr(name, '!');
-			if (p) {
-				*p++ = 0;
-				ip->sin_family = AF_INET;
-				ip->sin_port = htons(atoi(p));
-				ip->sin_addr.s_addr = inet_addr(name);
-				if (alen)
-					*alen = sizeof(struct sockaddr_in);
-			}
-		}
-		close(fd);
-	}
+	struct ipconv_info info;
+	bool local = !strcmp(a, "local");
 
+	if (_sock_get_info(r, &info))
+		return;
+	ip->sin_family = AF_INET;
+	ip->sin_port = htons(local ? info.lport : info.rport);
+	ip->sin_addr.s_addr = plan9addr_to_naddr(local ? info.laddr : info.raddr);
+	if (alen)
+		*alen = sizeof(struct sockaddr_in);
 }
 
 /*
@@ -184,6 +170,8 @@ Rock *_sock_newrock(int fd)
 	r->other = -1;
 	r->is_listener = FALSE;
 	r->listen_fd = -1;
+	r->ctl_fd = -1;
+	r->info_fd = -1;
 	return r;
 }
 
@@ -195,6 +183,14 @@ void _sock_fd_closed(int fd)
 		return;
 	if (r->is_listener)
 		close(r->listen_fd);
+	/* These keep the conversation open, so they go when the data fd does.  If
+	 * the socket was dup()d, we'll just reopen them. */
+	if (r->ctl_fd >= 0)
+		close(r->ctl_fd);
+	r->ctl_fd = -1;
+	if (r->info_fd >= 0)
+		close(r->info_fd);
+	r->info_fd = -1;
 }
 
 /* For a ctlfd and a few other settings, it opens and returns the corresponding
@@ -337,3 +333,43 @@ int _sock_lookup_listen_fd(int sock_fd)
 		return -1;
 	return r->listen_fd;
 }
+
+/* Returns the socket's ctl fd, opening it the first time.  The socket owns the
+ * fd; don't close it. */
+int _sock_ctl_fd(Rock *r)
+{
+	if (r->ctl_fd < 0)
+		r->ctl_fd = open(r->ctl, O_RDWR);
+	return r->ctl_fd;
+}
+
+/* Sets an option with a binary ctl message (ros/ipconv.h), skipping the text
+ * formatting and parsing.  Returns 0 on success. */
+int _sock_ctl_bin(Rock *r, int op, uint32_t arg)
+{
+	struct ipconv_ctl ctl = {.zero = 0, .op = op, .arg = arg};
+	int cfd = _sock_ctl_fd(r);
+
+	if (cfd < 0)
+		return -1;
+	return write(cfd, &ctl, sizeof(ctl)) == sizeof(ctl) ? 0 : -1;
+}
+
+/* Reads the conversation's binary info.  Returns 0 on success. */
+int _sock_get_info(Rock *r, struct ipconv_info *info)
+{
+	char name[Ctlsize];
+	char *p;
+
+	if (r->info_fd < 0) {
+		strcpy(name, r->ctl);
+		p = strrchr(name, '/');
+		strcpy(p + 1, "info");
+		r->info_fd = open(name, O_RDONLY);
+		if (r->info_fd < 0)
+			return -1;
+	}
+	if (pread(r->info_fd, info, sizeof(*info), 0) != sizeof(*info))
+		return -1;
+	return 0;
+}
@@ -16,6 +16,7 @@
 
 #include <netinet/in.h>
 #include <netdb.h>
+#include <ros/ipconv.h>
 
 __BEGIN_DECLS typedef struct Rock Rock;
 
@@ -59,6 +60,8 @@ struct Rock {
 	int other;					/* fd of the remote end for Unix domain */
 	bool is_listener;			/* has called listen() and will accept() */
 	int listen_fd;				/* fd of the listen file, if any */
+	int ctl_fd;					/* cached fd of ctl, opened on demand */
+	int info_fd;				/* cached fd of the binary info file */
 };
 
 extern Rock *_sock_findrock(int, struct stat *);
@@ -74,6 +77,9 @@ extern int _sock_strip_opts(int type);
 extern int _sock_get_opts(int type);
 extern int _rock_open_listen_fd(Rock *r);
 extern int _sock_lookup_listen_fd(int sock_fd);
+extern int _sock_ctl_fd(Rock *r);
+extern int _sock_ctl_bin(Rock *r, int op, uint32_t arg);
+extern int _sock_get_info(Rock *r, struct ipconv_info *info);
 
 extern void _syserrno(void);
 
@@ -0,0 +1,31 @@
+/* Copyright (C) 2016 Free Software Foundation, Inc.
+   This file is part of the GNU C Library.
+
+   The GNU C Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The GNU C Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the GNU C Library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+#include <unistd.h>
+#include <sys/uio.h>
+#include <ros/syscall.h>
+
+/* Read data from file descriptor FD at OFFSET into the buffers described
+   by VECTOR, without using or changing the file position.  */
+ssize_t
+preadv64 (int fd, const struct iovec *vector, int count, off64_t offset)
+{
+  if (count == 0)
+    return 0;
+  return ros_syscall(SYS_preadv, fd, vector, count, offset, 0, 0);
+}
@@ -3,23 +3,28 @@
  * See LICENSE for details. */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/socket.h>
 
 #include "plan9_sockets.h"
 
+/* Writes a message to the socket's conversation ctl file */
 static int sol_socket_sso(Rock *r, int optname, void *optval, socklen_t optlen)
 {
 	switch (optname) {
-		#if 0
-		/* We don't support setting any options yet */
-		case (SO_FOO):
-			if (optlen < foo_len) {
+		case (SO_REUSEPORT):
+			if (optlen < sizeof(int)) {
 				__set_errno(EINVAL);
 				return -1;
 			}
-			r->foo = *optval;
-			break;
-		#endif
+			if (r->domain != PF_INET) {
+				__set_errno(ENOPROTOOPT);
+				return -1;
+			}
+			/* the kernel only takes it before bind or listen */
+			return _sock_ctl_bin(r, IPCONV_CTL_REUSEPORT, !!*(int*)optval);
 		default:
 			__set_errno(ENOPROTOOPT);
 			return -1;
@@ -61,6 +61,8 @@ enum EPOLL_EVENTS
 #define EPOLLHUP EPOLLHUP
     EPOLLRDHUP = 0x2000,
 #define EPOLLRDHUP EPOLLRDHUP
+    EPOLLEXCLUSIVE = 1u << 28,
+#define EPOLLEXCLUSIVE EPOLLEXCLUSIVE
     EPOLLWAKEUP = 1u << 29,
 #define EPOLLWAKEUP EPOLLWAKEUP
     EPOLLONESHOT = 1u << 30,
@@ -90,6 +92,14 @@ struct epoll_event
   epoll_data_t data;	/* User data variable */
 } __EPOLL_PACKED;
 
+/* One operation for epoll_ctl_batch.  */
+struct epoll_ctl_op
+{
+  int op;			/* EPOLL_CTL_* */
+  int fd;
+  struct epoll_event event;	/* Ignored for EPOLL_CTL_DEL */
+};
+
 
 __BEGIN_DECLS
 
@@ -113,6 +123,14 @@ extern int epoll_create1 (int __flags) __THROW;
 extern int epoll_ctl (int __epfd, int __op, int __fd,
 		      struct epoll_event *__event) __THROW;
 
+/* Akaros extension: performs the NR_OPS operations in OPS, in order, on
+   epoll instance "epfd", batching the work the kernel has to do.  Stops at
+   the first failure.  Returns the number of operations performed; if that
+   is less than NR_OPS, "errno" is set for OPS[return value].  Returns -1
+   if "epfd" is bad.  */
+extern int epoll_ctl_batch (int __epfd, struct epoll_ctl_op *__ops,
+			    int __nr_ops) __THROW;
+
 
 /* Wait for events on an epoll instance "epfd". Returns the number of
    triggered events returned in "events" buffer. Or -1 in case of
@@ -39,6 +39,19 @@ extern int eventfd_read (int __fd, eventfd_t *__value);
 /* Increment event counter.  */
 extern int eventfd_write (int __fd, eventfd_t __value);
 
+/* Akaros: return file descriptor for an event channel whose counter is *CTR,
+   in our memory.  Signal and consume with the eventfd_shm_ functions, which
+   only trap into the kernel when someone has to wait.  */
+extern int eventfd_shm (eventfd_t *__ctr, int __flags);
+
+/* Add VALUE to the counter at CTR of FD.  */
+extern int eventfd_shm_write (int __fd, eventfd_t *__ctr, eventfd_t __value);
+
+/* Take from the counter at CTR of FD, possibly waiting.  FLAGS are the ones
+   FD was made with.  */
+extern int eventfd_shm_read (int __fd, eventfd_t *__ctr, int __flags,
+			     eventfd_t *__value);
+
 __END_DECLS
 
 #endif /* sys/eventfd.h */
@@ -16,62 +16,37 @@
    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
    02111-1307 USA.  */
 
-#include <stdlib.h>
+#include <sysdep.h>
 #include <unistd.h>
-#include <string.h>
-#include <limits.h>
-#include <stdbool.h>
-#include <sys/param.h>
 #include <sys/uio.h>
 #include <errno.h>
-
-
-/* Helper function to assemble and write everything in one shot. */
-static ssize_t
-write_all(int fd, char *buf, const struct iovec *vec, int n, ssize_t bytes)
-{
-  char* bufp = buf;
-  for (int i = 0; i < n; i++)
-    bufp = __mempcpy(bufp, vec[i].iov_base, vec[i].iov_len);
-  return __write(fd, buf, bytes);
-}
+#include <signal.h>
+#include <ros/syscall.h>
+#include <parlib/signal.h>
 
 /* Write data pointed by the buffers described by VECTOR, which
    is a vector of COUNT 'struct iovec's, to file descriptor FD.
    The data is written in the order specified.
    Operates just like 'write' (see <unistd.h>) except that the data
-   are taken from VECTOR instead of a contiguous buffer.  */
+   are taken from VECTOR instead of a contiguous buffer.  The kernel
+   gathers the buffers, so this is still one write on a stream.  */
 ssize_t
 __libc_writev (int fd, const struct iovec *vector, int count)
 {
-  ssize_t bytes = 0;
-  for (int i = 0; i < count; ++i)
-    bytes += vector[i].iov_len;
-  
-  if (bytes < 0)
-  {
-    __set_errno(EINVAL);
-    return -1;
-  }
+  ssize_t ret;
 
-  /* Allocate a stack or heap buffer, then have write_all finish up. */
-  if (__builtin_expect(__libc_use_alloca(bytes), 1))
-  {
-    char* buf = __alloca(bytes);
-    return write_all(fd, buf, vector, count, bytes);
-  }
-  else
+  if (count == 0)
+    return 0;
+  ret = ros_syscall(SYS_writev, fd, vector, count, 0, 0, 0);
+  if (__builtin_expect((ret < 0) && (errno == EPIPE), 0))
   {
-    char* buf = malloc(bytes);
-    if (buf == NULL)
-    {
-      __set_errno(ENOMEM);
-      return -1;
-    }
-    ssize_t res = write_all(fd, buf, vector, count, bytes);
-    free(buf);
-    return res;
+    sigset_t mask;
+
+    sigprocmask(0, NULL, &mask);
+    if (!__sigismember(&mask, SIGPIPE))
+      signal_ops->sigself(SIGPIPE);
   }
+  return ret;
 }
 #ifndef __libc_writev
 strong_alias (__libc_writev, __writev)
@@ -3,14 +3,20 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <netdb.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/ioctl.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <assert.h>
 #include <packetizer.h>
 #include <stdexcept>
-#include <fstream>
 
 #ifdef DEBUG_MODE
 # define debug(...) (__VA_ARGS__)
@@ -18,90 +24,432 @@
 # define debug(...) do { } while(0)
 #endif
 
-static __inline uint64_t
-read_tsc(void)
+// Seconds before an unacked packet is resent
+#define RTO 0.020
+#define ACK_IDLE_MS 5
+#define GIVE_UP_SEC 10.0
+#define LINGER_SEC 1.0
+#define SOCK_BUF_SIZE (8 << 20)
+
+static double now(void)
 {
-    uint64_t tsc;
-    __asm __volatile("rdtsc" : "=A" (tsc));
-    return tsc;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-packetizer::packetizer(const char *target_mac, const char *eth_device, 
-	                     const char *filename)
+packet_socket::packet_socket(const char *eth_device)
 {
-	seqno = 0;
-	memcpy(this->target_mac, target_mac, 6);
 	strcpy(this->eth_device, eth_device);
-	strcpy(this->filename, filename);
 	memset(&myaddr, 0, sizeof(myaddr));
 
 	// setuid root to open a raw socket.  if we fail, too bad
 	seteuid(0);
-	sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	sock = socket(AF_PACKET, SOCK_RAW, htons(PACKETIZER_ETHERTYPE));
 	seteuid(getuid());
 	if(sock < 0)
 	  throw std::runtime_error("socket() failed! Maybe try running as root...");
 
 	myaddr.sll_ifindex = if_nametoindex(eth_device);
 	myaddr.sll_family = AF_PACKET;
+	myaddr.sll_protocol = htons(PACKETIZER_ETHERTYPE);
 
 	int ret = bind(sock, (struct sockaddr *)&myaddr, sizeof(myaddr));
 	if (ret < 0)
 	  throw std::runtime_error("bind() failed!");
 
-	struct timeval tv;
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,&tv,sizeof(struct timeval)) < 0)
-	  throw std::runtime_error("setsockopt() failed!");
+	// A window of jumbo frames overflows the default buffers.  Best effort.
+	int bufsz = SOCK_BUF_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
 
-	// get MAC address of local ethernet device
+	// get MAC address and MTU of local ethernet device
 	struct ifreq ifr;
 	strcpy(ifr.ifr_name, eth_device);
 	ret = ioctl(sock, SIOCGIFHWADDR, (char *)&ifr);
 	if (ret < 0)
 	  throw std::runtime_error("ioctl() failed!");
 	memcpy(&host_mac, &ifr.ifr_ifru.ifru_hwaddr.sa_data, 6);
+	ret = ioctl(sock, SIOCGIFMTU, (char *)&ifr);
+	if (ret < 0)
+	  throw std::runtime_error("ioctl() failed!");
+	mtu = ifr.ifr_mtu;
 }
 
-int packetizer::start()
+packet_socket::~packet_socket()
+{
+	close(sock);
+}
+
+void packet_socket::send_packet(packet* packet)
 {
-	std::ifstream file(filename, std::ios::in | std::ios::binary);
-	packet p(target_mac, host_mac, seqno, MAX_PAYLOAD_SIZE, NULL);
-
-	int ret;
-	printf("Starting to packetize the file: %s\n", filename);
-	file.read(p.payload, MAX_PAYLOAD_SIZE);
-	while(file) {
-		//printf("Sending chunk %d\n", seqno);
-		ret = ::sendto(sock, (char*)&p, p.size(), 0,
-		               (sockaddr*)&myaddr,sizeof(myaddr));
-		
-		volatile uint64_t tsc = read_tsc();
-		while((read_tsc() - tsc) < 34800);
-		if (ret < 0)
+	while (::sendto(sock, (char*)packet, packet->size(), 0,
+	                (sockaddr*)&myaddr, sizeof(myaddr)) < 0) {
+		if (errno != ENOBUFS)
 		  throw std::runtime_error("sending packet failed!");
-		p.header.seqno = htons(next_seqno());
-		file.read(p.payload, MAX_PAYLOAD_SIZE);
+		sched_yield();
 	}
-	if(file.gcount()) {
-		p.header.payload_size = ntohl(file.gcount());
-		p.packet_size = sizeof(p.header)+file.gcount();
-		
-		ret = ::sendto(sock, (char*)&p, p.size(), 0,
-		               (sockaddr*)&myaddr,sizeof(myaddr));
-		if (ret < 0)
+}
+
+// Returns true if a packet is waiting to be read.
+bool packet_socket::wait_packet(int timeout_ms)
+{
+	struct pollfd pfd = { sock, POLLIN, 0 };
+
+	return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+packetizer::packetizer(const char *target_mac, const char *eth_device,
+	                     const char *filename, uint32_t payload_size,
+	                     uint32_t window)
+	: packet_socket(eth_device)
+{
+	uint32_t max_payload = MAX_PAYLOAD_SIZE;
+
+	memcpy(this->target_mac, target_mac, 6);
+	strcpy(this->filename, filename);
+	// The MTU doesn't count the ethernet header, which is part of ours.
+	if (mtu < MAX_MTU)
+	  max_payload = mtu - (sizeof(packet_header) - ETH_HLEN);
+	if (!payload_size || payload_size > max_payload)
+	  payload_size = max_payload;
+	this->payload_size = payload_size;
+	if (!window || window > SACK_BITS)
+	  window = SACK_BITS;
+	this->window = window;
+}
+
+void packetizer::send_data(uint32_t seqno, double now)
+{
+	uint64_t off = (uint64_t)seqno * payload_size;
+	uint32_t len = payload_size;
+	packet_header hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	if (off + len > image_size)
+	  len = image_size - off;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.dst_mac, target_mac, 6);
+	memcpy(hdr.src_mac, host_mac, 6);
+	hdr.ethertype = htons(PACKETIZER_ETHERTYPE);
+	hdr.type = PKT_DATA;
+	hdr.seqno = htonl(seqno);
+	hdr.nr_packets = htonl(nr_packets);
+	hdr.payload_size = htonl(len);
+	hdr.offset = htobe64(off);
+	hdr.total_size = htobe64(image_size);
+	// Straight from the mapped file, no copy into a packet buffer
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void*)(image + off);
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &myaddr;
+	msg.msg_namelen = sizeof(myaddr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	while (::sendmsg(sock, &msg, 0) < 0) {
+		if (errno != ENOBUFS)
 		  throw std::runtime_error("sending packet failed!");
-		//printf("Sending chunk %d\n", seqno);
+		sched_yield();
+	}
+	sent_at[seqno] = now;
+	send_order[seqno] = nr_sends++;
+	debug(printf("Sending chunk %u\n", seqno));
+}
+
+// Resends the unacked packets in [base, end) last sent before 'before'.
+uint32_t packetizer::resend_older(uint32_t end, double before, double now)
+{
+	uint32_t nr = 0;
+
+	for (uint32_t i = base; i < end; i++) {
+		if (acked[i] || sent_at[i] >= before)
+		  continue;
+		send_data(i, now);
+		nr++;
+	}
+	return nr;
+}
+
+// A packet we sent before one the receiver has is lost (links don't reorder
+// much), unless we've resent it since.
+uint32_t packetizer::resend_holes(uint32_t highest, double now)
+{
+	uint32_t nr = 0;
+
+	for (uint32_t i = base; i < highest; i++) {
+		if (acked[i] || send_order[i] > send_order[highest])
+		  continue;
+		send_data(i, now);
+		nr++;
+	}
+	return nr;
+}
+
+uint32_t packetizer::handle_ack(const packet_ack *ack, double now)
+{
+	uint32_t cum = ntohl(ack->cum_seqno);
+	uint32_t highest = cum;
+	uint32_t nr;
+
+	if (cum > nr_packets)
+	  return 0;
+	for (uint32_t i = base; i < cum; i++)
+		acked[i] = true;
+	if (cum > base)
+	  base = cum;
+	for (uint32_t i = 0; i < SACK_BITS; i++) {
+		uint32_t seqno = cum + 1 + i;
+
+		if (seqno >= nr_packets)
+		  break;
+		if (be64toh(ack->sack[i / 64]) & (1ULL << (i % 64))) {
+			acked[seqno] = true;
+			highest = seqno;
+		}
+	}
+	nr = resend_holes(highest, now);
+	nr += resend_older(next, now - RTO, now);
+	return nr;
+}
+
+int packetizer::start()
+{
+	struct stat st;
+	uint64_t resent = 0;
+	double start_time, last_ack, t;
+	packet p;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	  throw std::runtime_error("can't open the file!");
+	image_size = st.st_size;
+	if (!image_size)
+	  throw std::runtime_error("the file is empty!");
+	if ((image_size + payload_size - 1) / payload_size > UINT32_MAX)
+	  throw std::runtime_error("the file is too big!");
+	image = (const uint8_t*)mmap(0, image_size, PROT_READ,
+	                             MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+	  throw std::runtime_error("mmap() failed!");
+	nr_packets = (image_size + payload_size - 1) / payload_size;
+	acked.assign(nr_packets, false);
+	sent_at.assign(nr_packets, 0);
+	send_order.assign(nr_packets, 0);
+	nr_sends = 0;
+	base = next = 0;
+
+	printf("Starting to packetize the file: %s (%u packets of %u bytes)\n",
+	       filename, nr_packets, payload_size);
+	start_time = last_ack = now();
+	while (base < nr_packets) {
+		t = now();
+
+		while (next < nr_packets && next - base < window)
+			send_data(next++, t);
+		if (wait_packet(RTO * 1000)) {
+			ssize_t ret = recv(sock, &p, sizeof(p.header) + sizeof(packet_ack),
+			                   0);
+
+			if (ret < (ssize_t)(sizeof(p.header) + sizeof(packet_ack)) ||
+			    p.header.type != PKT_ACK ||
+			    memcmp(p.header.dst_mac, host_mac, 6))
+			  continue;
+			last_ack = now();
+			resent += handle_ack((packet_ack*)p.payload, last_ack);
+			continue;
+		}
+		t = now();
+		if (t - last_ack > GIVE_UP_SEC)
+		  throw std::runtime_error("no acks from the target, giving up!");
+		resent += resend_older(next, t - RTO, t);
 	}
-	printf("Last chunk had %u bytes...\n", file.gcount());
+	t = now() - start_time;
+	printf("Sent %llu bytes in %.2f sec (%.1f MB/s), %llu packets resent\n",
+	       (unsigned long long)image_size, t, image_size / t / 1e6,
+	       (unsigned long long)resent);
+	munmap((void*)image, image_size);
+	return 0;
+}
+
+unpacketizer::unpacketizer(const char *eth_device, const char *filename)
+	: packet_socket(eth_device)
+{
+	strcpy(this->filename, filename);
+	fd = -1;
+	image = NULL;
+	image_size = 0;
+	nr_packets = 0;
+	cum_seqno = 0;
+}
+
+// Sizes and maps the output file when the first packet tells us how big the
+// image is.
+bool unpacketizer::setup_image(const packet_header *hdr)
+{
+	image_size = be64toh(hdr->total_size);
+	nr_packets = ntohl(hdr->nr_packets);
+	if (!image_size || !nr_packets)
+	  return false;
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	  throw std::runtime_error("can't open the file!");
+	if (ftruncate(fd, image_size) < 0)
+	  throw std::runtime_error("ftruncate() failed!");
+	image = (uint8_t*)mmap(0, image_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                       fd, 0);
+	if (image == MAP_FAILED)
+	  throw std::runtime_error("mmap() failed!");
+	got.assign(nr_packets, false);
+	memcpy(sender_mac, hdr->src_mac, 6);
+	printf("Receiving %llu bytes in %u packets into %s\n",
+	       (unsigned long long)image_size, nr_packets, filename);
+	return true;
+}
+
+void unpacketizer::send_ack(void)
+{
+	packet p(sender_mac, host_mac, PKT_ACK, 0, sizeof(packet_ack), NULL);
+	packet_ack *ack = (packet_ack*)p.payload;
+
+	memset(ack, 0, sizeof(*ack));
+	ack->cum_seqno = htonl(cum_seqno);
+	for (uint32_t i = 0; i < SACK_BITS; i++) {
+		uint32_t seqno = cum_seqno + 1 + i;
+
+		if (seqno >= nr_packets)
+		  break;
+		if (got[seqno])
+		  ack->sack[i / 64] |= 1ULL << (i % 64);
+	}
+	for (int i = 0; i < SACK_WORDS; i++)
+		ack->sack[i] = htobe64(ack->sack[i]);
+	send_packet(&p);
+}
+
+int unpacketizer::start()
+{
+	uint32_t since_ack = 0, last_seqno = 0;
+	double start_time = 0, done_time = 0;
+	packet_header hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	printf("Waiting for an image on %s\n", eth_device);
+	while (1) {
+		if (!wait_packet(ACK_IDLE_MS)) {
+			if (done_time && now() - done_time > LINGER_SEC)
+			  break;
+			if (nr_packets && since_ack) {
+				send_ack();
+				since_ack = 0;
+			}
+			continue;
+		}
+		// Peek at the header to see where the payload goes, then receive it
+		// right into place.
+		ssize_t ret = recv(sock, &hdr, sizeof(hdr), MSG_PEEK);
+		if (ret < (ssize_t)sizeof(hdr) || hdr.type != PKT_DATA ||
+		    memcmp(hdr.dst_mac, host_mac, 6) ||
+		    (!nr_packets && !setup_image(&hdr))) {
+			recv(sock, &hdr, sizeof(hdr), 0);
+			continue;
+		}
+		if (!start_time)
+		  start_time = now();
+		uint32_t seqno = ntohl(hdr.seqno);
+		uint32_t len = ntohl(hdr.payload_size);
+		uint64_t off = be64toh(hdr.offset);
+		if (seqno >= nr_packets || off > image_size ||
+		    len > image_size - off || got[seqno]) {
+			recv(sock, &hdr, sizeof(hdr), 0);
+			// A resend of something we have means our ack was lost
+			since_ack++;
+			continue;
+		}
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = image + off;
+		iov[1].iov_len = len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		ret = recvmsg(sock, &msg, 0);
+		if (ret < (ssize_t)(sizeof(hdr) + len))
+		  continue;
+		got[seqno] = true;
+		since_ack++;
+		uint32_t old_cum = cum_seqno;
+		while (cum_seqno < nr_packets && got[cum_seqno])
+			cum_seqno++;
+		// Ack right away when a hole opens or gets filled, so the sender
+		// resends quickly, and every so often otherwise.
+		bool hole = (seqno != last_seqno + 1 && seqno > cum_seqno) ||
+		            (seqno < last_seqno && cum_seqno != old_cum);
+		last_seqno = seqno;
+		if (hole || since_ack >= ACK_EVERY || cum_seqno == nr_packets) {
+			send_ack();
+			since_ack = 0;
+		}
+		if (cum_seqno == nr_packets && !done_time) {
+			done_time = now();
+			double t = done_time - start_time;
+			printf("Received %llu bytes in %.2f sec (%.1f MB/s)\n",
+			       (unsigned long long)image_size, t, image_size / t / 1e6);
+		}
+	}
+	msync(image, image_size, MS_SYNC);
+	munmap(image, image_size);
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-s PAYLOAD_SIZE] [-w WINDOW] "
+	        "TARGET_MAC DEVICE FILE\n", argv0);
+	fprintf(stderr, "       %s -r DEVICE FILE\n", argv0);
+	exit(1);
 }
 
 int main(int argc, char** argv)
 {
 	char target_mac[6];
+	unsigned int mac[6];
 	char eth_device[256];
 	char filename[256];
+	uint32_t payload_size = 0;
+	uint32_t window = DEFAULT_WINDOW;
+	bool receive = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rs:w:")) != -1) {
+		switch (opt) {
+		case 'r':
+			receive = true;
+			break;
+		case 's':
+			payload_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (receive) {
+		if (argc != 3)
+		  usage(argv[0]);
+		unpacketizer u(argv[1], argv[2]);
+		return u.start();
+	}
 	if(argc == 1) {
 		target_mac[0] = 0x00;
 		target_mac[1] = 0x24;
@@ -113,20 +461,17 @@ int main(int argc, char** argv)
 		strcpy(filename, "../../fs/i686/tests/e.y4m");
 	}
 	if(argc > 1) {
-		assert(argc == 4);
-		assert(strlen(argv[1]) == 17);
-		sscanf(argv[1], "%2x:%2x:%2x:%2x:%2x:%2x", (unsigned int *)&target_mac[0],
-		                                           (unsigned int *)&target_mac[1],
-		                                           (unsigned int *)&target_mac[2],
-		                                           (unsigned int *)&target_mac[3],
-		                                           (unsigned int *)&target_mac[4],
-		                                           (unsigned int *)&target_mac[5]);
+		if (argc != 4 || strlen(argv[1]) != 17)
+		  usage(argv[0]);
+		if (sscanf(argv[1], "%2x:%2x:%2x:%2x:%2x:%2x", &mac[0], &mac[1],
+		           &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
+		  usage(argv[0]);
+		for (int i = 0; i < 6; i++)
+			target_mac[i] = mac[i];
 		strcpy(eth_device, argv[2]);
 		strcpy(filename, argv[3]);
-		
+
 	}
-	packetizer p(target_mac, eth_device, filename);
-	p.start();
-	return 0;
+	packetizer p(target_mac, eth_device, filename, payload_size, window);
+	return p.start();
 }
-
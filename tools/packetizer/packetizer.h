@@ -3,19 +3,58 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <net/ethernet.h>
 #include <string.h>
+#include <stdint.h>
+#include <endian.h>
 #include <netpacket/packet.h>
+#include <vector>
 
 #define PACKETIZER_ETHERTYPE 0xabcd
-#define MAX_PAYLOAD_SIZE 1024
+
+// Frames carry up to a jumbo MTU.  The payload size actually used comes from
+// the device's MTU (or -s), so plain 1500 byte links still work.
+#define MAX_MTU 9000
+#define MAX_PAYLOAD_SIZE (MAX_MTU - (sizeof(packet_header) - ETH_HLEN))
 #define MAX_PACKET_SIZE (MAX_PAYLOAD_SIZE+sizeof(packet_header))
+
+// The sender keeps up to window packets in flight.  The receiver acks the
+// first seqno it is missing, plus a bitmap of what it has after that, so the
+// sender only resends the holes.
+#define DEFAULT_WINDOW 256
+#define SACK_WORDS 8
+#define SACK_BITS (SACK_WORDS * 64)
+#define ACK_EVERY 32
+
+enum {
+	PKT_DATA = 1,
+	PKT_ACK,
+};
+
+// All fields are big endian.  offset says where the payload goes in the
+// image, so the receiver can put it in place no matter what order it arrives.
 struct packet_header
 {
 	uint8_t dst_mac[6];
 	uint8_t src_mac[6];
 	uint16_t ethertype;
-	uint16_t seqno;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t seqno;
+	uint32_t nr_packets;
 	uint32_t payload_size;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t total_size;
+};
+
+// Payload of a PKT_ACK: every seqno below cum_seqno has arrived, and bit i of
+// sack says whether cum_seqno + 1 + i has.
+struct packet_ack
+{
+	uint32_t cum_seqno;
+	uint32_t pad;
+	uint64_t sack[SACK_WORDS];
 };
 
 struct packet
@@ -30,41 +69,96 @@ struct packet
 	}
 
 	packet() {}
-	packet(const char* dst_mac, const char* src_mac, 
-	       char seqno,int payload_size, const uint8_t* bytes)
+	packet(const char* dst_mac, const char* src_mac, uint8_t type,
+	       uint32_t seqno, uint32_t payload_size, const uint8_t* bytes)
 	{
+	  memset(&header, 0, sizeof(header));
 	  header.ethertype = htons(PACKETIZER_ETHERTYPE);
 	  memcpy(header.dst_mac,dst_mac,6);
 	  memcpy(header.src_mac,src_mac,6);
-	  header.seqno = htons(seqno);
-	  header.payload_size = ntohl(payload_size);
+	  header.type = type;
+	  header.seqno = htonl(seqno);
+	  header.payload_size = htonl(payload_size);
 	  if(bytes)
 	    memcpy(payload,bytes,payload_size);
 	  packet_size = sizeof(header)+payload_size;
 	}
 };
 
-class packetizer
+// Raw socket on one device, for our ethertype only.
+class packet_socket
 {
 public:
-	
-	packetizer(const char *target_mac, const char *eth_device, 
-	           const char *filename);
-	int start(void); 
+
+	packet_socket(const char *eth_device);
+	~packet_socket();
 
 protected:
 
 	sockaddr_ll myaddr;
 	int sock;
 	char host_mac[6];
-	char target_mac[6];
 	char eth_device[64];
-	char filename[256];
+	unsigned int mtu;
 
 	void send_packet(packet* packet);
+	bool wait_packet(int timeout_ms);
+};
+
+class packetizer : public packet_socket
+{
+public:
+
+	packetizer(const char *target_mac, const char *eth_device,
+	           const char *filename, uint32_t payload_size = 0,
+	           uint32_t window = DEFAULT_WINDOW);
+	int start(void);
+
+protected:
+
+	char target_mac[6];
+	char filename[256];
+	uint32_t payload_size;
+	uint32_t window;
+
+	const uint8_t *image;
+	uint64_t image_size;
+	uint32_t nr_packets;
+	uint32_t base;			// first unacked seqno
+	uint32_t next;			// first never sent seqno
+	std::vector<bool> acked;
+	std::vector<double> sent_at;
+	std::vector<uint64_t> send_order;
+	uint64_t nr_sends;
+
+	void send_data(uint32_t seqno, double now);
+	uint32_t handle_ack(const packet_ack *ack, double now);
+	uint32_t resend_older(uint32_t end, double before, double now);
+	uint32_t resend_holes(uint32_t highest, double now);
+};
+
+// Receives an image into a file, writing each payload straight into the
+// file's mapped pages.
+class unpacketizer : public packet_socket
+{
+public:
+
+	unpacketizer(const char *eth_device, const char *filename);
+	int start(void);
+
+protected:
+
+	char filename[256];
+	char sender_mac[6];
+	int fd;
+	uint8_t *image;
+	uint64_t image_size;
+	uint32_t nr_packets;
+	uint32_t cum_seqno;
+	std::vector<bool> got;
 
-	uint16_t seqno;
-	uint16_t next_seqno() { return seqno++; }
+	bool setup_image(const packet_header *hdr);
+	void send_ack(void);
 };
 
 #endif // _PACKETIZER_H
@@ -0,0 +1,292 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Raw deflate decoder, along the lines of zlib's contrib/puff.  Huffman codes
+ * are canonical, so a code is described by the number of codes of each length
+ * and the symbols in code order, and decoded a bit at a time. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "inflate.h"
+
+#define MAXBITS 15				/* longest code */
+#define MAXLCODES 286			/* literal/length codes */
+#define MAXDCODES 30			/* distance codes */
+#define MAXCODES (MAXLCODES + MAXDCODES)
+#define FIXLCODES 288			/* literal/length codes in the fixed code */
+
+struct inf_state {
+	uint8_t *out;
+	size_t outlen;
+	size_t outcnt;
+	const uint8_t *in;
+	size_t inlen;
+	size_t incnt;
+	unsigned long bitbuf;
+	int bitcnt;
+	bool err;					/* ran out of input */
+};
+
+struct huffman {
+	short *count;				/* number of codes of each length */
+	short *symbol;				/* symbols, in code order */
+};
+
+static int bits(struct inf_state *s, int need)
+{
+	unsigned long val = s->bitbuf;
+
+	while (s->bitcnt < need) {
+		if (s->incnt == s->inlen) {
+			s->err = true;
+			return 0;
+		}
+		val |= (unsigned long)s->in[s->incnt++] << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = val >> need;
+	s->bitcnt -= need;
+	return val & ((1UL << need) - 1);
+}
+
+static int stored(struct inf_state *s)
+{
+	unsigned int len;
+
+	/* stored blocks start on a byte boundary */
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+	if (s->incnt + 4 > s->inlen)
+		return -1;
+	len = s->in[s->incnt] | (s->in[s->incnt + 1] << 8);
+	if (s->in[s->incnt + 2] != (~len & 0xff) ||
+		s->in[s->incnt + 3] != ((~len >> 8) & 0xff))
+		return -1;
+	s->incnt += 4;
+	if (s->incnt + len > s->inlen || s->outcnt + len > s->outlen)
+		return -1;
+	memcpy(s->out + s->outcnt, s->in + s->incnt, len);
+	s->outcnt += len;
+	s->incnt += len;
+	return 0;
+}
+
+static int decode(struct inf_state *s, const struct huffman *h)
+{
+	int code = 0, first = 0, index = 0, count;
+
+	for (int len = 1; len <= MAXBITS; len++) {
+		code |= bits(s, 1);
+		if (s->err)
+			return -1;
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+/* Builds h from the code lengths of n symbols.  Returns 0 for a complete code,
+ * > 0 for an incomplete one, and < 0 for an over-subscribed one. */
+static int construct(struct huffman *h, const short *length, int n)
+{
+	short offs[MAXBITS + 1];
+	int left = 1;
+
+	for (int len = 0; len <= MAXBITS; len++)
+		h->count[len] = 0;
+	for (int sym = 0; sym < n; sym++)
+		h->count[length[sym]]++;
+	if (h->count[0] == n)
+		return 0;
+	for (int len = 1; len <= MAXBITS; len++) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return left;
+	}
+	offs[1] = 0;
+	for (int len = 1; len < MAXBITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (int sym = 0; sym < n; sym++) {
+		if (length[sym])
+			h->symbol[offs[length[sym]]++] = sym;
+	}
+	return left;
+}
+
+static int codes(struct inf_state *s, const struct huffman *lencode,
+				 const struct huffman *distcode)
+{
+	static const short lens[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const short lext[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const short dists[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577};
+	static const short dext[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	int symbol, len;
+	size_t dist;
+
+	do {
+		symbol = decode(s, lencode);
+		if (symbol < 0)
+			return -1;
+		if (symbol < 256) {
+			if (s->outcnt == s->outlen)
+				return -1;
+			s->out[s->outcnt++] = symbol;
+		} else if (symbol > 256) {
+			symbol -= 257;
+			if (symbol >= 29)
+				return -1;
+			len = lens[symbol] + bits(s, lext[symbol]);
+			symbol = decode(s, distcode);
+			if (symbol < 0 || symbol >= 30)
+				return -1;
+			dist = dists[symbol] + bits(s, dext[symbol]);
+			if (s->err || dist > s->outcnt || s->outcnt + len > s->outlen)
+				return -1;
+			for (; len; len--, s->outcnt++)
+				s->out[s->outcnt] = s->out[s->outcnt - dist];
+		}
+	} while (symbol != 256);
+	return 0;
+}
+
+static int fixed(struct inf_state *s)
+{
+	static short lencnt[MAXBITS + 1], lensym[FIXLCODES];
+	static short distcnt[MAXBITS + 1], distsym[MAXDCODES];
+	static struct huffman lencode = {lencnt, lensym};
+	static struct huffman distcode = {distcnt, distsym};
+	static bool built;
+	short lengths[FIXLCODES];
+	int sym;
+
+	if (!built) {
+		for (sym = 0; sym < 144; sym++)
+			lengths[sym] = 8;
+		for (; sym < 256; sym++)
+			lengths[sym] = 9;
+		for (; sym < 280; sym++)
+			lengths[sym] = 7;
+		for (; sym < FIXLCODES; sym++)
+			lengths[sym] = 8;
+		construct(&lencode, lengths, FIXLCODES);
+		for (sym = 0; sym < MAXDCODES; sym++)
+			lengths[sym] = 5;
+		construct(&distcode, lengths, MAXDCODES);
+		built = true;
+	}
+	return codes(s, &lencode, &distcode);
+}
+
+static int dynamic(struct inf_state *s)
+{
+	static const short order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	short lengths[MAXCODES];
+	short lencnt[MAXBITS + 1], lensym[MAXLCODES];
+	short distcnt[MAXBITS + 1], distsym[MAXDCODES];
+	struct huffman lencode = {lencnt, lensym};
+	struct huffman distcode = {distcnt, distsym};
+	int nlen, ndist, ncode, index, symbol, len, err;
+
+	nlen = bits(s, 5) + 257;
+	ndist = bits(s, 5) + 1;
+	ncode = bits(s, 4) + 4;
+	if (s->err || nlen > MAXLCODES || ndist > MAXDCODES)
+		return -1;
+	for (index = 0; index < ncode; index++)
+		lengths[order[index]] = bits(s, 3);
+	for (; index < 19; index++)
+		lengths[order[index]] = 0;
+	if (s->err || construct(&lencode, lengths, 19) != 0)
+		return -1;
+
+	/* the literal/length and distance code lengths, run-length coded */
+	index = 0;
+	while (index < nlen + ndist) {
+		symbol = decode(s, &lencode);
+		if (symbol < 0)
+			return -1;
+		if (symbol < 16) {
+			lengths[index++] = symbol;
+			continue;
+		}
+		len = 0;
+		if (symbol == 16) {
+			if (index == 0)
+				return -1;
+			len = lengths[index - 1];
+			symbol = 3 + bits(s, 2);
+		} else if (symbol == 17) {
+			symbol = 3 + bits(s, 3);
+		} else {
+			symbol = 11 + bits(s, 7);
+		}
+		if (s->err || index + symbol > nlen + ndist)
+			return -1;
+		while (symbol--)
+			lengths[index++] = len;
+	}
+	/* no end of block code */
+	if (lengths[256] == 0)
+		return -1;
+	/* incomplete codes are only allowed for a single code */
+	err = construct(&lencode, lengths, nlen);
+	if (err && (err < 0 || nlen != lencode.count[0] + lencode.count[1]))
+		return -1;
+	err = construct(&distcode, lengths + nlen, ndist);
+	if (err && (err < 0 || ndist != distcode.count[0] + distcode.count[1]))
+		return -1;
+	return codes(s, &lencode, &distcode);
+}
+
+/* Inflates src into dst.  Returns the number of bytes written, or -1 if the
+ * data is bad or doesn't fit. */
+ssize_t inflate_raw(void *dst, size_t dst_sz, const void *src, size_t src_sz)
+{
+	struct inf_state s;
+	int last, type, err;
+
+	memset(&s, 0, sizeof(s));
+	s.out = dst;
+	s.outlen = dst_sz;
+	s.in = src;
+	s.inlen = src_sz;
+	do {
+		last = bits(&s, 1);
+		type = bits(&s, 2);
+		if (s.err)
+			return -1;
+		switch (type) {
+		case 0:
+			err = stored(&s);
+			break;
+		case 1:
+			err = fixed(&s);
+			break;
+		case 2:
+			err = dynamic(&s);
+			break;
+		default:
+			err = -1;
+		}
+		if (err)
+			return -1;
+	} while (!last);
+	return s.outcnt;
+}
@@ -0,0 +1,12 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * A small decoder for raw deflate data (RFC 1951), for compressed kprof data.
+ * It keeps the whole output in memory, which is all perf needs, so it doesn't
+ * need a sliding window. */
+
+#pragma once
+
+#include <sys/types.h>
+
+ssize_t inflate_raw(void *dst, size_t dst_sz, const void *src, size_t src_sz);
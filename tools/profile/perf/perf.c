@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
 #include <errno.h>
 #include <parlib/parlib.h>
 #include "xlib.h"
@@ -28,12 +29,16 @@ static struct perf_context_config perf_cfg = {
 static void usage(const char *prg)
 {
 	fprintf(stderr,
-			"Use: %s {list,cpucaps,record} [-mkecxoKh] -- CMD [ARGS ...]\n"
+			"Use: %s {list,cpucaps,record,stream} [-mkecxoKph] -- CMD "
+			"[ARGS ...]\n"
 			"\tlist            Lists all the available events and their meaning.\n"
 			"\tcpucaps         Shows the system CPU capabilities in term of "
 			"performance counters.\n"
 			"\trecord           Setups the configured counters, runs CMD, and "
 			"shows the values of the counters.\n"
+			"\tstream           Like record, but writes the traces out as they "
+			"come in,\n"
+			"\t                 in perf pipe format (for 'perf report -i -').\n"
 			"Options:\n"
 			"\t-m PATH          Sets the path of the PERF file ('%s').\n"
 			"\t-k PATH          Sets the path of the KPROF control file "
@@ -51,8 +56,12 @@ static void usage(const char *prg)
 			"\t                 Examples: all:!3.4.7  0-15:!3.5.7\n"
 			"\t-x EVENT_RX      Sets the event name regular expression for "
 			"list.\n"
-			"\t-o PATH          Sets the perf output file path ('perf.data').\n"
+			"\t-o PATH          Sets the perf output file path ('perf.data', "
+			"or '-'\n"
+			"\t                 (stdout) for stream).\n"
 			"\t-K PATH          Sets the kprof data file path ('#kprof/kpdata').\n"
+			"\t-p MSEC          Sets how often stream flushes the traces "
+			"(1000).\n"
 			"\t-h               Displays this help screen.\n", prg,
 			perf_cfg.perf_file, perf_cfg.kpctl_file);
 	exit(1);
@@ -72,10 +81,10 @@ static void show_perf_arch_info(const struct perf_arch_info *pai, FILE *file)
 			pai->fix_counters_x_proc);
 }
 
-static void run_process_and_wait(int argc, const char * const *argv,
-								 const struct core_set *cores)
+static int run_process(int argc, const char * const *argv,
+					   const struct core_set *cores)
 {
-	int pid, status;
+	int pid;
 	size_t max_cores = ros_total_cores();
 	struct core_set pvcores;
 
@@ -100,14 +109,36 @@ static void run_process_and_wait(int argc, const char * const *argv,
 	}
 
 	sys_proc_run(pid);
-	waitpid(pid, &status, 0);
+
+	return pid;
+}
+
+static void run_process_and_wait(int argc, const char * const *argv,
+								 const struct core_set *cores)
+{
+	int status;
+
+	waitpid(run_process(argc, argv, cores), &status, 0);
+}
+
+static bool process_exited(void *arg)
+{
+	int status;
+
+	return waitpid(*(int *) arg, &status, WNOHANG) != 0;
+}
+
+static bool time_expired(void *arg)
+{
+	return time(NULL) >= *(time_t *) arg;
 }
 
 int main(int argc, const char * const *argv)
 {
 	int i, icmd = -1, num_events = 0;
 	const char *cmd = argv[1], *show_rx = NULL;
-	const char *kpdata_file = "#kprof/kpdata", *outfile = "perf.data";
+	const char *kpdata_file = "#kprof/kpdata", *outfile = NULL;
+	unsigned int stream_period = 1000;
 	struct perfconv_context *cctx;
 	struct perf_context *pctx;
 	struct core_set cores;
@@ -143,6 +174,9 @@ int main(int argc, const char * const *argv)
 		} else if (!strcmp(argv[i], "-K")) {
 			if (++i < argc)
 				kpdata_file = argv[i];
+		} else if (!strcmp(argv[i], "-p")) {
+			if (++i < argc)
+				stream_period = atoi(argv[i]);
 		} else if (!strcmp(argv[i], "--")) {
 			icmd = i + 1;
 			break;
@@ -160,9 +194,13 @@ int main(int argc, const char * const *argv)
 		perf_show_events(show_rx, stdout);
 	} else if (!strcmp(cmd, "cpucaps")) {
 		show_perf_arch_info(perf_context_get_arch_info(pctx), stdout);
-	} else if (!strcmp(cmd, "record")) {
+	} else if (!strcmp(cmd, "record") || !strcmp(cmd, "stream")) {
+		bool stream = !strcmp(cmd, "stream");
+
 		if (icmd < 0)
 			usage(argv[0]);
+		if (!outfile)
+			outfile = stream ? "-" : "perf.data";
 
 		for (i = 0; i < num_events; i++) {
 			struct perf_eventsel sel;
@@ -171,22 +209,38 @@ int main(int argc, const char * const *argv)
 			perf_context_event_submit(pctx, &cores, &sel);
 		}
 
-		if (!strcmp(argv[icmd], "sleep") && (icmd + 1) < argc)
-			sleep(atoi(argv[icmd + 1]));
-		else
-			run_process_and_wait(argc - icmd, argv + icmd, &cores);
-
-		perf_context_show_values(pctx, stdout);
+		if (stream) {
+			/* The values go to stderr, since stdout may be the trace */
+			if (!strcmp(argv[icmd], "sleep") && (icmd + 1) < argc) {
+				time_t end = time(NULL) + atoi(argv[icmd + 1]);
 
-		/* Flush the profiler per-CPU trace data into the main queue, so that
-		 * it will be available for read.
-		 */
-		perf_flush_context_traces(pctx);
+				perf_stream_trace_data(pctx, cctx, kpdata_file, outfile,
+									   stream_period, time_expired, &end);
+			} else {
+				int pid = run_process(argc - icmd, argv + icmd, &cores);
 
-		/* Generate the Linux perf file format with the traces which have been
-		 * created during this operation.
-		 */
-		perf_convert_trace_data(cctx, kpdata_file, outfile);
+				perf_stream_trace_data(pctx, cctx, kpdata_file, outfile,
+									   stream_period, process_exited, &pid);
+			}
+			perf_context_show_values(pctx, stderr);
+		} else {
+			if (!strcmp(argv[icmd], "sleep") && (icmd + 1) < argc)
+				sleep(atoi(argv[icmd + 1]));
+			else
+				run_process_and_wait(argc - icmd, argv + icmd, &cores);
+
+			perf_context_show_values(pctx, stdout);
+
+			/* Flush the profiler per-CPU trace data into the main queue, so
+			 * that it will be available for read.
+			 */
+			perf_flush_context_traces(pctx);
+
+			/* Generate the Linux perf file format with the traces which have
+			 * been created during this operation.
+			 */
+			perf_convert_trace_data(cctx, kpdata_file, outfile);
+		}
 	} else {
 		usage(argv[0]);
 	}
@@ -7,6 +7,7 @@
 #include <ros/arch/perfmon.h>
 #include <ros/common.h>
 #include <ros/memops.h>
+#include <ros/profiler_records.h>
 #include <sys/types.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +25,7 @@
 #include "perfconv.h"
 #include "akaros.h"
 #include "perf_core.h"
+#include "inflate.h"
 
 struct event_coords {
 	char *buffer;
@@ -192,11 +194,40 @@ void perf_finalize(void)
 	pfm_terminate();
 }
 
+static const char *const perf_pmu_names[] = {
+	[PERFMON_PMU_CORE] = "core",
+	[PERFMON_PMU_RAPL] = "rapl",
+	[PERFMON_PMU_UNC_CBO] = "cbo",
+	[PERFMON_PMU_UNC_IMC] = "imc",
+	[PERFMON_PMU_UNC_QPI] = "qpi",
+};
+
+/* Same names as Linux perf's power PMU */
+static const char *const perf_rapl_names[] = {
+	[PERFMON_RAPL_PKG] = "energy-pkg",
+	[PERFMON_RAPL_PP0] = "energy-cores",
+	[PERFMON_RAPL_PP1] = "energy-gpu",
+	[PERFMON_RAPL_DRAM] = "energy-ram",
+};
+
+static int perf_find_name(const char *const *names, size_t count,
+						  const char *name)
+{
+	for (int i = 0; i < count; i++) {
+		if (names[i] && !strcmp(names[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
 void perf_parse_event(const char *str, struct perf_eventsel *sel)
 {
 	static const char *const event_spec =
-		"{EVENT_ID:MASK,EVENT_NAME:MASK_NAME}[,os[={0,1}]][,usr[={0,1}]]"
-		"[,int[={0,1}]][,invcmsk[={0,1}]][,cmask=MASK][,icount=COUNT]";
+		"{EVENT_ID:MASK,EVENT_NAME:MASK_NAME,RAPL_NAME}[,os[={0,1}]]"
+		"[,usr[={0,1}]][,int[={0,1}]][,invcmsk[={0,1}]][,cmask=MASK]"
+		"[,icount=COUNT][,pmu={core,cbo,imc,qpi}][,box=BOX]";
+	int rapl;
 	char *dstr = xstrdup(str), *sptr, *tok, *ev;
 
 	tok = strtok_r(dstr, ",", &sptr);
@@ -222,6 +253,10 @@ void perf_parse_event(const char *str, struct perf_eventsel *sel)
 		*ev++ = 0;
 		PMEV_SET_EVENT(sel->ev.event, (uint8_t) strtoul(tok, NULL, 0));
 		PMEV_SET_MASK(sel->ev.event, (uint8_t) strtoul(ev, NULL, 0));
+	} else if ((rapl = perf_find_name(perf_rapl_names,
+									  COUNT_OF(perf_rapl_names), tok)) >= 0) {
+		PMEV_SET_EVENT(sel->ev.event, rapl);
+		PERFMON_SET_PMU(sel->ev.flags, PERFMON_PMU_RAPL);
 	} else {
 		uint32_t event, mask;
 
@@ -261,8 +296,29 @@ void perf_parse_event(const char *str, struct perf_eventsel *sel)
 				exit(1);
 			}
 			sel->ev.trigger_count = (uint64_t) strtoul(ev, NULL, 0);
+		} else if (!strcmp(tok, "pmu")) {
+			int pmu = ev ? perf_find_name(perf_pmu_names,
+										  COUNT_OF(perf_pmu_names), ev) : -1;
+
+			if (pmu < 0 || pmu == PERFMON_PMU_RAPL) {
+				fprintf(stderr, "Invalid event spec string: '%s'\n"
+						"\tShould be: %s\n", str, event_spec);
+				exit(1);
+			}
+			PERFMON_SET_PMU(sel->ev.flags, pmu);
+		} else if (!strcmp(tok, "box")) {
+			if (ev == NULL) {
+				fprintf(stderr, "Invalid event spec string: '%s'\n"
+						"\tShould be: %s\n", str, event_spec);
+				exit(1);
+			}
+			PERFMON_SET_BOX(sel->ev.flags, (uint32_t) strtoul(ev, NULL, 0));
 		}
 	}
+	if (perfmon_is_socket_event(&sel->ev) && PMEV_GET_INTEN(sel->ev.event)) {
+		fprintf(stderr, "Uncore and RAPL events can only count: '%s'\n", str);
+		exit(1);
+	}
 	if (PMEV_GET_INTEN(sel->ev.event) && !sel->ev.trigger_count) {
 		fprintf(stderr,
 				"Counter trigger count for interrupt is too small: %lu\n",
@@ -323,15 +379,19 @@ static int perf_open_event(int perf_fd, const struct core_set *cores,
 	return (int) ped;
 }
 
+/* Returns the per core values, scaled up for the time the event spent waiting
+ * for a counter.  *prunning is the smallest fraction of the time an event was
+ * actually on a counter, across cores.
+ */
 static uint64_t *perf_get_event_values(int perf_fd, int ped,
 									   struct perf_eventsel *sel,
-									   size_t *pnvalues)
+									   size_t *pnvalues, double *prunning)
 {
 	ssize_t rsize;
 	uint32_t i, n;
-	uint64_t *values;
+	uint64_t *values, enabled, running;
 	size_t bufsize = 3 * sizeof(uint64_t) + sizeof(uint32_t) +
-		MAX_NUM_CORES * sizeof(uint64_t);
+		3 * MAX_NUM_CORES * sizeof(uint64_t);
 	uint8_t *cmdbuf = xmalloc(bufsize);
 	uint8_t *wptr = cmdbuf;
 	const uint8_t *rptr = cmdbuf;
@@ -360,6 +420,17 @@ static uint64_t *perf_get_event_values(int perf_fd, int ped,
 	values = xmalloc(n * sizeof(uint64_t));
 	for (i = 0; i < n; i++)
 		rptr = get_le_u64(rptr, values + i);
+	*prunning = 1.0;
+	if (((rptr - cmdbuf) + 3 * n * sizeof(uint64_t)) <= rsize) {
+		for (i = 0; i < n; i++) {
+			get_le_u64(rptr + i * sizeof(uint64_t), &enabled);
+			get_le_u64(rptr + (n + i) * sizeof(uint64_t), &running);
+			if (!running || running >= enabled)
+				continue;
+			values[i] = (uint64_t) ((double) values[i] * enabled / running);
+			*prunning = min(*prunning, (double) running / enabled);
+		}
+	}
 	free(cmdbuf);
 
 	*pnvalues = n;
@@ -446,14 +517,19 @@ void perf_context_show_values(struct perf_context *pctx, FILE *file)
 {
 	for (int i = 0; i < pctx->event_count; i++) {
 		size_t nvalues;
+		double running;
 		struct perf_eventsel sel;
 		uint64_t *values = perf_get_event_values(pctx->perf_fd,
 												 pctx->events[i].ped, &sel,
-												 &nvalues);
+												 &nvalues, &running);
 		char ename[256];
 
 		perf_get_event_string(&pctx->events[i].sel, ename, sizeof(ename));
-		fprintf(file, "Event: %s\n\t", ename);
+		fprintf(file, "Event: %s", ename);
+		if (running < 1.0)
+			fprintf(file, " (multiplexed, scaled from %.1f%% of the time)",
+					100.0 * running);
+		fprintf(file, "\n\t");
 		for (size_t j = 0; j < nvalues; j++)
 			fprintf(file, "%lu ", values[j]);
 		fprintf(file, "\n");
@@ -614,10 +690,19 @@ void perf_get_event_string(const struct perf_eventsel *sel, char *sbuf,
 						   size_t size)
 {
 	pfm_event_info_t einfo;
+	int pmu = PERFMON_GET_PMU(sel->ev.flags);
 
     ZERO_DATA(einfo);
     einfo.size = sizeof(einfo);
-	if ((sel->eidx >= 0) &&
+	if (pmu == PERFMON_PMU_RAPL) {
+		snprintf(sbuf, size, "%s (nJ)",
+				 perf_rapl_names[PMEV_GET_EVENT(sel->ev.event)]);
+	} else if (pmu != PERFMON_PMU_CORE && pmu < COUNT_OF(perf_pmu_names)) {
+		snprintf(sbuf, size, "%s%d/0x%02x:0x%02x", perf_pmu_names[pmu],
+				 (int) PERFMON_GET_BOX(sel->ev.flags),
+				 (int) PMEV_GET_EVENT(sel->ev.event),
+				 (int) PMEV_GET_MASK(sel->ev.event));
+	} else if ((sel->eidx >= 0) &&
 		(pfm_get_event_info(sel->eidx, PFM_OS_NONE, &einfo) == PFM_SUCCESS)) {
 		const char *mask_name =
 			perf_get_event_mask_name(&einfo, PMEV_GET_MASK(sel->ev.event));
@@ -671,6 +756,61 @@ static bool perf_get_kernel_elf_path(char *path, size_t psize, size_t *ksize)
 	return rsize > 0;
 }
 
+/* Opens the kprof data at input.  If the kernel compressed it (see struct
+ * prof_zchunk), we inflate all of it and return a memory stream of the
+ * records.
+ */
+static FILE *perf_open_kpdata(const char *input)
+{
+	FILE *infile = xfopen(input, "rb");
+	struct prof_zchunk hdr;
+	char *raw = NULL, *zdata;
+	size_t raw_len = 0;
+	FILE *memfile;
+
+	if (fread(&hdr, sizeof(hdr), 1, infile) != 1 ||
+		hdr.magic != PROF_ZCHUNK_MAGIC) {
+		xfseek(infile, 0, SEEK_SET);
+		return infile;
+	}
+	do {
+		if (hdr.magic != PROF_ZCHUNK_MAGIC) {
+			fprintf(stderr, "Bad compressed chunk at offset %ld\n",
+					ftell(infile) - sizeof(hdr));
+			exit(1);
+		}
+		raw = realloc(raw, raw_len + hdr.raw_len);
+		zdata = xmalloc(hdr.z_len);
+		if (!raw || fread(zdata, 1, hdr.z_len, infile) != hdr.z_len) {
+			fprintf(stderr, "Unable to read compressed chunk\n");
+			exit(1);
+		}
+		if (hdr.flags & PROF_ZCHUNK_STORED) {
+			if (hdr.z_len != hdr.raw_len) {
+				fprintf(stderr, "Bad stored chunk\n");
+				exit(1);
+			}
+			memcpy(raw + raw_len, zdata, hdr.z_len);
+		} else if (inflate_raw(raw + raw_len, hdr.raw_len, zdata,
+							   hdr.z_len) != hdr.raw_len) {
+			fprintf(stderr, "Unable to inflate compressed chunk\n");
+			exit(1);
+		}
+		raw_len += hdr.raw_len;
+		free(zdata);
+	} while (fread(&hdr, sizeof(hdr), 1, infile) == 1);
+	fclose(infile);
+
+	/* The stream doesn't own raw; it lives as long as we do. */
+	memfile = fmemopen(raw, raw_len, "rb");
+	if (!memfile) {
+		perror("Opening inflated kprof data");
+		exit(1);
+	}
+
+	return memfile;
+}
+
 void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
 							 const char *output)
 {
@@ -678,7 +818,7 @@ void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
 	size_t ksize;
 	char kpath[1024];
 
-	infile = xfopen(input, "rb");
+	infile = perf_open_kpdata(input);
 	if (xfsize(infile) > 0) {
 		outfile = xfopen(output, "wb");
 
@@ -694,3 +834,39 @@ void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
 	}
 	fclose(infile);
 }
+
+void perf_stream_trace_data(struct perf_context *pctx,
+							struct perfconv_context *cctx, const char *input,
+							const char *output, unsigned int period_ms,
+							bool (*done)(void *), void *arg)
+{
+	FILE *infile, *outfile;
+	size_t ksize;
+	char kpath[1024];
+	bool last;
+
+	infile = xfopen(input, "rb");
+	outfile = strcmp(output, "-") ? xfopen(output, "wb") : stdout;
+
+	if (perf_get_kernel_elf_path(kpath, sizeof(kpath), &ksize))
+		perfconv_add_kernel_mmap(kpath, ksize, cctx);
+	else
+		fprintf(stderr, "Unable to fetch kernel build information!\n"
+				"Kernel traces will be missing symbol information.\n");
+
+	perfconv_stream_begin(cctx, outfile);
+	do {
+		/* Check before flushing, so that the last flush catches everything
+		 * up to when we were done.
+		 */
+		last = done(arg);
+		perf_flush_context_traces(pctx);
+		perfconv_stream_input(cctx, infile);
+		if (!last)
+			usleep(period_ms * 1000);
+	} while (!last);
+
+	if (outfile != stdout)
+		fclose(outfile);
+	fclose(infile);
+}
@@ -67,6 +67,14 @@ void perf_make_eventsel_from_event_mask(struct perf_eventsel *sel,
 										uint32_t event, uint32_t mask);
 void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
 							 const char *output);
+/* Like perf_convert_trace_data(), but converts as we go, into a perf pipe
+ * file, flushing the profiler every period_ms until done(arg) returns TRUE.
+ * An output of "-" means stdout.
+ */
+void perf_stream_trace_data(struct perf_context *pctx,
+							struct perfconv_context *cctx, const char *input,
+							const char *output, unsigned int period_ms,
+							bool (*done)(void *), void *arg);
 
 static inline const struct perf_arch_info *perf_context_get_arch_info(
 	const struct perf_context *pctx)
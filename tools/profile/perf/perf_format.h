@@ -259,6 +259,15 @@ enum perf_event_type {
 	PERF_RECORD_MAX,			/* non-ABI */
 };
 
+/* Records perf synthesizes itself, which the kernel never generates.  Files
+ * written to a pipe can't seek back to fill in the header's attrs section, so
+ * they carry each attribute inline, in a PERF_RECORD_HEADER_ATTR, ahead of the
+ * first sample that refers to it.
+ */
+enum perf_user_event_type {
+	PERF_RECORD_HEADER_ATTR		= 64,
+};
+
 #define PERF_MAX_STACK_DEPTH		127
 
 enum perf_callchain_context {
@@ -311,6 +320,27 @@ enum perf_hw_id {
 	PERF_COUNT_HW_MAX,						/* non-ABI */
 };
 
+/*
+ * Special "software" events provided by the kernel, even if the hardware
+ * does not support performance events. These events measure various
+ * physical and sw events of the kernel (and allow the profiling of them as
+ * well):
+ */
+enum perf_sw_ids {
+	PERF_COUNT_SW_CPU_CLOCK					= 0,
+	PERF_COUNT_SW_TASK_CLOCK				= 1,
+	PERF_COUNT_SW_PAGE_FAULTS				= 2,
+	PERF_COUNT_SW_CONTEXT_SWITCHES			= 3,
+	PERF_COUNT_SW_CPU_MIGRATIONS			= 4,
+	PERF_COUNT_SW_PAGE_FAULTS_MIN			= 5,
+	PERF_COUNT_SW_PAGE_FAULTS_MAJ			= 6,
+	PERF_COUNT_SW_ALIGNMENT_FAULTS			= 7,
+	PERF_COUNT_SW_EMULATION_FAULTS			= 8,
+	PERF_COUNT_SW_DUMMY						= 9,
+
+	PERF_COUNT_SW_MAX,						/* non-ABI */
+};
+
 /*
  * Hardware event_id to monitor via a performance monitoring event:
  */
@@ -510,6 +540,14 @@ struct perf_record_comm {
 	char comm[0];
 } __attribute__((packed));
 
+/* For type PERF_RECORD_HEADER_ATTR
+ */
+struct perf_record_header_attr {
+	struct perf_event_header header;
+	struct perf_event_attr attr;
+	uint64_t id[0];
+} __attribute__((packed));
+
 /* For type PERF_RECORD_SAMPLE
  * Configured with: PERF_SAMPLE_IP | PERF_SAMPLE_TID && PERF_SAMPLE_TIME &&
  * PERF_SAMPLE_ADDR && PERF_SAMPLE_ID && PERF_SAMPLE_CPU &&
@@ -66,11 +66,8 @@ static void free_record(struct perf_record *pr)
 	pr->data = NULL;
 }
 
-static int read_record(FILE *file, struct perf_record *pr)
+static void alloc_record(struct perf_record *pr)
 {
-	if (vb_fdecode_uint64(file, &pr->type) == EOF ||
-		vb_fdecode_uint64(file, &pr->size) == EOF)
-		return EOF;
 	if (pr->size > MAX_PERF_RECORD_SIZE) {
 		fprintf(stderr, "Invalid record size: type=%lu size=%lu\n", pr->type,
 				pr->size);
@@ -80,6 +77,14 @@ static int read_record(FILE *file, struct perf_record *pr)
 		pr->data = xmalloc((size_t) pr->size);
 	else
 		pr->data = pr->buffer;
+}
+
+static int read_record(FILE *file, struct perf_record *pr)
+{
+	if (vb_fdecode_uint64(file, &pr->type) == EOF ||
+		vb_fdecode_uint64(file, &pr->size) == EOF)
+		return EOF;
+	alloc_record(pr);
 	if (fread(pr->data, 1, (size_t) pr->size, file) != (size_t) pr->size) {
 		fprintf(stderr, "Unable to read record memory: size=%lu\n",
 				pr->size);
@@ -89,6 +94,32 @@ static int read_record(FILE *file, struct perf_record *pr)
 	return 0;
 }
 
+/* Like read_record(), but for a file which is still growing. If only part of
+ * the next record made it in so far, we rewind to its start and return EOF, so
+ * that a later call will read it whole.
+ */
+static int read_stream_record(FILE *file, struct perf_record *pr)
+{
+	off_t pos = ftello(file);
+
+	if (vb_fdecode_uint64(file, &pr->type) == EOF ||
+		vb_fdecode_uint64(file, &pr->size) == EOF)
+		goto rewind;
+	alloc_record(pr);
+	if (fread(pr->data, 1, (size_t) pr->size, file) != (size_t) pr->size) {
+		free_record(pr);
+		goto rewind;
+	}
+
+	return 0;
+
+rewind:
+	clearerr(file);
+	xfseek(file, pos, SEEK_SET);
+
+	return EOF;
+}
+
 static struct mem_block *mem_block_alloc(struct mem_file *mf, size_t size)
 {
 	struct mem_block *mb = xmem_arena_alloc(mf->ma,
@@ -187,6 +218,18 @@ static struct mem_file_reloc *mem_file_add_reloc(struct mem_file *mf,
 	return rel;
 }
 
+/* Data records go straight out in stream mode, since there is no header to fix
+ * up at the end.
+ */
+static void emit_record(struct perfconv_context *cctx, const void *rec,
+						size_t size)
+{
+	if (cctx->stream)
+		xfwrite(rec, size, cctx->stream);
+	else
+		mem_file_write(&cctx->data, rec, size, 0);
+}
+
 static uint64_t perfconv_make_config_id(bool is_raw, uint64_t type,
 										uint64_t event_id)
 {
@@ -289,7 +332,24 @@ static void add_attribute(struct mem_file *amf, struct mem_file *mmf,
 	mem_file_add_reloc(amf, &psids->offset);
 }
 
-static void add_default_attribute(struct mem_file *amf, struct mem_file *mmf,
+static void emit_attribute(struct perfconv_context *cctx,
+						   const struct perf_event_attr *attr, uint64_t id)
+{
+	struct perf_record_header_attr *xrec;
+	size_t size = sizeof(*xrec) + sizeof(uint64_t);
+
+	xrec = xzmalloc(size);
+	xrec->header.type = PERF_RECORD_HEADER_ATTR;
+	xrec->header.size = size;
+	xrec->attr = *attr;
+	xrec->id[0] = id;
+
+	emit_record(cctx, xrec, size);
+
+	free(xrec);
+}
+
+static void add_default_attribute(struct perfconv_context *cctx,
 								  uint64_t config, uint64_t id)
 {
 	struct perf_event_attr attr;
@@ -304,7 +364,10 @@ static void add_default_attribute(struct mem_file *amf, struct mem_file *mmf,
 		PERF_SAMPLE_ADDR | PERF_SAMPLE_ID | PERF_SAMPLE_CPU |
 		PERF_SAMPLE_CALLCHAIN;
 
-	add_attribute(amf, mmf, &attr, &id, 1);
+	if (cctx->stream)
+		emit_attribute(cctx, &attr, id);
+	else
+		add_attribute(&cctx->attrs, &cctx->misc, &attr, &id, 1);
 }
 
 static uint64_t perfconv_get_event_id(struct perfconv_context *cctx,
@@ -314,6 +377,10 @@ static uint64_t perfconv_get_event_id(struct perfconv_context *cctx,
 	uint64_t id, config;
 	struct perf_event_id *nevents;
 
+	/* Off-CPU samples carry their blocked time, which isn't part of the event
+	 */
+	if (PROF_INFO_DOM(info) == PROF_DOM_OFFCPU)
+		info = PROF_MKINFO(PROF_DOM_OFFCPU, 0);
 	for (;;) {
 		ipos = (size_t) (info % cctx->alloced_events);
 		for (i = cctx->alloced_events; (i > 0) &&
@@ -350,21 +417,29 @@ static uint64_t perfconv_get_event_id(struct perfconv_context *cctx,
 		config = perfconv_make_config_id(TRUE, PERF_TYPE_RAW,
 										 PROF_INFO_DATA(info));
 		break;
+	case PROF_DOM_OFFCPU:
+		config = perfconv_make_config_id(FALSE, PERF_TYPE_SOFTWARE,
+										 PERF_COUNT_SW_CONTEXT_SWITCHES);
+		break;
 	case PROF_DOM_TIMER:
 	default:
 		config = perfconv_make_config_id(FALSE, PERF_TYPE_HARDWARE,
 										 PERF_COUNT_HW_CPU_CYCLES);
 	}
 
-	add_default_attribute(&cctx->attrs, &cctx->misc, config, id);
+	add_default_attribute(cctx, config, id);
 
 	return id;
 }
 
+static void emit_comm(uint32_t pid, const char *comm,
+					  struct perfconv_context *cctx);
+
 static void emit_static_mmaps(struct perfconv_context *cctx)
 {
 	struct static_mmap64 *mm;
 
+	emit_comm(0, "[kernel]", cctx);
 	for (mm = cctx->static_mmaps; mm; mm = mm->next) {
 		size_t size = sizeof(struct perf_record_mmap) + strlen(mm->path) + 1;
 		struct perf_record_mmap *xrec = xzmalloc(size);
@@ -378,7 +453,7 @@ static void emit_static_mmaps(struct perfconv_context *cctx)
 		xrec->pgoff = mm->offset;
 		strcpy(xrec->filename, mm->path);
 
-		mem_file_write(&cctx->data, xrec, size, 0);
+		emit_record(cctx, xrec, size);
 
 		free(xrec);
 	}
@@ -396,7 +471,7 @@ static void emit_comm(uint32_t pid, const char *comm,
 	xrec->pid = xrec->tid = pid;
 	strcpy(xrec->comm, comm);
 
-	mem_file_write(&cctx->data, xrec, size, 0);
+	emit_record(cctx, xrec, size);
 
 	free(xrec);
 }
@@ -417,7 +492,7 @@ static void emit_pid_mmap64(struct perf_record *pr,
 	xrec->pgoff = rec->offset;
 	strcpy(xrec->filename, rec->path);
 
-	mem_file_write(&cctx->data, xrec, size, 0);
+	emit_record(cctx, xrec, size);
 
 	free(xrec);
 }
@@ -442,7 +517,7 @@ static void emit_kernel_trace64(struct perf_record *pr,
 	xrec->nr = rec->num_traces - 1;
 	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
 
-	mem_file_write(&cctx->data, xrec, size, 0);
+	emit_record(cctx, xrec, size);
 
 	free(xrec);
 }
@@ -468,7 +543,7 @@ static void emit_user_trace64(struct perf_record *pr,
 	xrec->nr = rec->num_traces - 1;
 	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
 
-	mem_file_write(&cctx->data, xrec, size, 0);
+	emit_record(cctx, xrec, size);
 
 	free(xrec);
 }
@@ -515,8 +590,6 @@ struct perfconv_context *perfconv_create_context(void)
 	mem_file_init(&cctx->data, &cctx->ma);
 	mem_file_init(&cctx->event_types, &cctx->ma);
 
-	emit_comm(0, "[kernel]", cctx);
-
 	return cctx;
 }
 
@@ -528,6 +601,34 @@ void perfconv_free_context(struct perfconv_context *cctx)
 	}
 }
 
+static bool process_record(struct perf_record *pr,
+						   struct perfconv_context *cctx)
+{
+	dbg_print(cctx, 8, stderr, "Valid record: type=%lu size=%lu\n",
+			  pr->type, pr->size);
+
+	switch (pr->type) {
+	case PROFTYPE_KERN_TRACE64:
+		emit_kernel_trace64(pr, cctx);
+		break;
+	case PROFTYPE_USER_TRACE64:
+		emit_user_trace64(pr, cctx);
+		break;
+	case PROFTYPE_PID_MMAP64:
+		emit_pid_mmap64(pr, cctx);
+		break;
+	case PROFTYPE_NEW_PROCESS:
+		emit_new_process(pr, cctx);
+		break;
+	default:
+		fprintf(stderr, "Unknown record: type=%lu size=%lu\n", pr->type,
+				pr->size);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 							FILE *output)
 {
@@ -538,30 +639,8 @@ void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 	emit_static_mmaps(cctx);
 
 	while (read_record(input, &pr) == 0) {
-		dbg_print(cctx, 8, stderr, "Valid record: type=%lu size=%lu\n",
-				  pr.type, pr.size);
-
-		processed_records++;
-
-		switch (pr.type) {
-		case PROFTYPE_KERN_TRACE64:
-			emit_kernel_trace64(&pr, cctx);
-			break;
-		case PROFTYPE_USER_TRACE64:
-			emit_user_trace64(&pr, cctx);
-			break;
-		case PROFTYPE_PID_MMAP64:
-			emit_pid_mmap64(&pr, cctx);
-			break;
-		case PROFTYPE_NEW_PROCESS:
-			emit_new_process(&pr, cctx);
-			break;
-		default:
-			fprintf(stderr, "Unknown record: type=%lu size=%lu\n", pr.type,
-					pr.size);
-			processed_records--;
-		}
-
+		if (process_record(&pr, cctx))
+			processed_records++;
 		free_record(&pr);
 	}
 
@@ -597,3 +676,31 @@ void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 	dbg_print(cctx, 2, stderr, "Conversion succeeded: %lu records converted\n",
 			  processed_records);
 }
+
+void perfconv_stream_begin(struct perfconv_context *cctx, FILE *output)
+{
+	struct perf_pipe_file_header ph;
+
+	ph.magic = PERF_MAGIC2;
+	ph.size = sizeof(ph);
+	xfwrite(&ph, sizeof(ph), output);
+
+	cctx->stream = output;
+	emit_static_mmaps(cctx);
+	fflush(output);
+}
+
+size_t perfconv_stream_input(struct perfconv_context *cctx, FILE *input)
+{
+	size_t processed_records = 0;
+	struct perf_record pr;
+
+	while (read_stream_record(input, &pr) == 0) {
+		if (process_record(&pr, cctx))
+			processed_records++;
+		free_record(&pr);
+	}
+	fflush(cctx->stream);
+
+	return processed_records;
+}
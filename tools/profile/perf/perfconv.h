@@ -68,6 +68,7 @@ struct perfconv_context {
 	struct perf_header ph;
 	struct perf_headers hdrs;
 	struct mem_file fhdrs, misc, attrs, data, event_types;
+	FILE *stream;
 };
 
 struct perfconv_context *perfconv_create_context(void);
@@ -77,3 +78,10 @@ void perfconv_add_kernel_mmap(const char *path, size_t size,
 							  struct perfconv_context *cctx);
 void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 							FILE *output);
+/* Stream mode writes perf's pipe format, which needs no seeking, so perf can
+ * read it as it arrives (e.g. perf report -i -). Begin writes the file header,
+ * then each call to perfconv_stream_input() converts all the whole records
+ * which made it into input since the last call.
+ */
+void perfconv_stream_begin(struct perfconv_context *cctx, FILE *output);
+size_t perfconv_stream_input(struct perfconv_context *cctx, FILE *input);
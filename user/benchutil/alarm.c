@@ -7,15 +7,28 @@
  * of the kernel alarms.  Under the hood, the user alarm uses the #alarm service
  * for the root of the alarm chain.
  *
- * There's only one timer chain, unlike in the kernel, for the entire process.
- * If you want one-off timers unrelated to the chain (and sent to other vcores),
- * use #alarm directly.
+ * Each vcore gets a timer chain and its own #alarm, whose events go to that
+ * vcore.  set_alarm() puts the waiter on the calling vcore's chain, so vcores
+ * don't fight over one lock.  When a vcore handles an alarm event, it also runs
+ * any expired alarms on other vcores' chains that no one is working on.  Those
+ * vcores might be preempted or offline, or just slow to get to their event.
+ *
+ * Waiters can have some slack.  Their fire_time is their wake_up_time, rounded
+ * up to a power of two that fits within the slack, so nearby timeouts line up
+ * on the same time and go off from one event.  Chains are sorted by fire_time.
+ *
+ * Each chain also hands its #alarm a page of slots and keeps its deadline in
+ * slot 0.  Moving the deadline later or turning it off is then just a store,
+ * and we only write to the kernel when the deadline moves ahead of the
+ * kernel's next scan.  Kernels without slots get the timer file, as before.
+ *
+ * If you want one-off timers unrelated to the chains, use #alarm directly.
  *
  * Your handlers will run from vcore context.
  *
  * Code differences from the kernel (for future porting):
  * - init_alarm_service, run once out of init_awaiter (or wherever).
- * - set_alarm() and friends are __tc_set_alarm(), passing global_tchain.
+ * - set_alarm() and friends are __tc_set_alarm(), passing a vcore's tchain.
  * - reset_tchain_interrupt() uses #alarm
  * - removed anything related to semaphores or kthreads
  * - spinlocks -> spin_pdr_locks
@@ -38,6 +51,8 @@
 #include <parlib/uthread.h>
 #include <parlib/spinlock.h>
 #include <parlib/timing.h>
+#include <parlib/arch/atomic.h>
+#include <sys/mman.h>
 
 /* Helper to get your own alarm.   If you don't care about a return value, pass
  * 0 and it'll be ignored.  The alarm is built, but has no evq or timer set. */
@@ -102,6 +117,43 @@ int devalarm_disable(int ctlfd)
 	return 0;
 }
 
+/* Hands the kernel slots, a page from the caller, for the alarm behind ctlfd.
+ * The alarm's timer file is off limits from then on. */
+int devalarm_set_slots(int ctlfd, struct alarm_slots *slots)
+{
+	int ret;
+	char buf[32];
+
+	ret = snprintf(buf, sizeof(buf), "slots %llx", slots);
+	ret = write(ctlfd, buf, ret);
+	if (ret <= 0)
+		return -1;
+	return 0;
+}
+
+/* Arms slot for tsc_time, or disarms it for 0.  Only traps into the kernel if
+ * the kernel would otherwise scan too late. */
+int devalarm_set_slot(int ctlfd, struct alarm_slots *slots, unsigned int slot,
+                      uint64_t tsc_time)
+{
+	uint64_t next_scan;
+	int ret;
+
+	assert(slot < ALARM_NR_SLOTS);
+	slots->deadline[slot] = tsc_time;
+	if (!tsc_time)
+		return 0;
+	/* Pairs with the kernel's write of next_scan before it scans */
+	mb();
+	next_scan = ACCESS_ONCE(slots->next_scan);
+	if (next_scan && next_scan <= tsc_time)
+		return 0;
+	ret = write(ctlfd, "kick", sizeof("kick"));
+	if (ret <= 0)
+		return -1;
+	return 0;
+}
+
 /* Helpers, basically renamed kernel interfaces, with the *tchain. */
 static void __tc_locked_set_alarm(struct timer_chain *tchain,
                                   struct alarm_waiter *waiter);
@@ -115,8 +167,9 @@ static void __tc_reset_alarm_abs(struct timer_chain *tchain,
 static void handle_user_alarm(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data);
 
-/* One chain to rule them all. */
-struct timer_chain global_tchain;
+/* One chain per vcore, max_vcores() of them. */
+static struct timer_chain *vc_tchains;
+static int nr_tchains;
 
 /* Unix time offsets so we can allow people to specify an absolute unix time to
  * an alarm, rather than an absolute time in terms of raw tsc ticks.  This
@@ -142,51 +195,85 @@ static void reset_tchain_times(struct timer_chain *tchain)
 		tchain->earliest_time = ALARM_POISON_TIME;
 		tchain->latest_time = ALARM_POISON_TIME;
 	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
+		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->fire_time;
 		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->fire_time;
 	}
 }
 
-static void init_alarm_service(void)
+/* Sets up tchain, backed by a new #alarm whose events go to vcoreid.  Returns
+ * 0 on success. */
+static int init_tchain(struct timer_chain *tchain, uint32_t vcoreid)
 {
 	int ctlfd, timerfd, alarmid;
 	struct event_queue *ev_q;
 
-	/* Initialize the unixtime_offsets */
-	init_unixtime_offsets();
-
-	/* Sets up timer chain (only one chain per process) */
-	spin_pdr_init(&global_tchain.lock);
-	TAILQ_INIT(&global_tchain.waiters);
-	reset_tchain_times(&global_tchain);
+	spin_pdr_init(&tchain->lock);
+	TAILQ_INIT(&tchain->waiters);
+	reset_tchain_times(tchain);
 
 	if (devalarm_get_fds(&ctlfd, &timerfd, &alarmid)) {
 		perror("devalarm_get_fds");
-		return;
+		return -1;
 	}
 	/* Since we're doing SPAM_PUBLIC later, we actually don't need a big ev_q.
 	 * But someone might copy/paste this and change a flag. */
-	register_ev_handler(EV_ALARM, handle_user_alarm, 0);
 	if (!(ev_q = get_eventq(EV_MBOX_UCQ))) {
 		perror("Useralarm: Failed ev_q");
-		return;
+		return -1;
 	}
-	ev_q->ev_vcore = 0;
+	/* SPAM_PUBLIC sends to another vcore if vcoreid is offline. */
+	ev_q->ev_vcore = vcoreid;
 	/* We could get multiple events for a single alarm.  It's okay, since
 	 * __trigger can handle spurious upcalls.  If it ever is not okay, then use
 	 * an INDIR (probably with SPAM_INDIR too) instead of SPAM_PUBLIC. */
 	ev_q->ev_flags = EVENT_IPI | EVENT_SPAM_PUBLIC | EVENT_WAKEUP;
 	if (devalarm_set_evq(ctlfd, ev_q)) {
 		perror("set_alarm_evq");
-		return;
+		return -1;
+	}
+	/* The slots are optional; without them, we write the timer file. */
+	tchain->slots = mmap(0, PGSIZE, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_LOCKED,
+	                     -1, 0);
+	if (tchain->slots == MAP_FAILED) {
+		tchain->slots = NULL;
+	} else if (devalarm_set_slots(ctlfd, tchain->slots)) {
+		munmap(tchain->slots, PGSIZE);
+		tchain->slots = NULL;
 	}
 	/* now the alarm is all set, just need to write the timer whenever we want
 	 * it to go off. */
-	global_tchain.alarmid = alarmid;
-	global_tchain.ctlfd = ctlfd;
-	global_tchain.timerfd = timerfd;
-	global_tchain.ev_q = ev_q;	/* mostly for debugging */
+	tchain->alarmid = alarmid;
+	tchain->ctlfd = ctlfd;
+	tchain->timerfd = timerfd;
+	tchain->ev_q = ev_q;	/* mostly for debugging */
+	return 0;
+}
+
+static void init_alarm_service(void)
+{
+	int nr_vcores = max_vcores();
+
+	/* Initialize the unixtime_offsets */
+	init_unixtime_offsets();
+
+	vc_tchains = malloc(sizeof(struct timer_chain) * nr_vcores);
+	assert(vc_tchains);
+	register_ev_handler(EV_ALARM, handle_user_alarm, 0);
+	for (int i = 0; i < nr_vcores; i++) {
+		if (init_tchain(&vc_tchains[i], i))
+			break;
+		nr_tchains++;
+	}
+	/* Everyone can still share chain 0, so long as we got that one */
+	assert(nr_tchains);
+}
+
+/* The calling vcore's tchain.  Uthreads can migrate, so this is only a hint. */
+static struct timer_chain *my_tchain(void)
+{
+	return &vc_tchains[vcore_id() % nr_tchains];
 }
 
 /* Initializes a new awaiter.  Pass 0 for the function if you want it to be a
@@ -196,8 +283,10 @@ void init_awaiter(struct alarm_waiter *waiter,
 {
 	run_once_racy(init_alarm_service());
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
 	assert(func);
 	waiter->func = func;
+	waiter->tchain = NULL;
 	waiter->on_tchain = FALSE;
 }
 
@@ -238,30 +327,67 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
-/* User interface to the global tchain */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec)
+{
+	waiter->slack = usec2tsc(usec);
+}
+
+/* Rounds the wake up time up to the largest power of two that fits in the
+ * slack.  Alarms with similar slack that are close together end up with the
+ * same fire_time. */
+static void __set_fire_time(struct alarm_waiter *waiter)
+{
+	uint64_t mask;
+
+	if (!waiter->slack) {
+		waiter->fire_time = waiter->wake_up_time;
+		return;
+	}
+	mask = (1ULL << (63 - __builtin_clzll(waiter->slack))) - 1;
+	waiter->fire_time = (waiter->wake_up_time + mask) & ~mask;
+	if (waiter->fire_time < waiter->wake_up_time)	/* wrapped */
+		waiter->fire_time = waiter->wake_up_time;
+}
+
+/* User interface to the per-vcore tchains.  __set_alarm() is for handlers, which
+ * run with their waiter's tchain locked. */
 void __set_alarm(struct alarm_waiter *waiter)
 {
-	__tc_locked_set_alarm(&global_tchain, waiter);
+	assert(waiter->tchain);
+	__tc_locked_set_alarm(waiter->tchain, waiter);
 }
 
 void set_alarm(struct alarm_waiter *waiter)
 {
-	__tc_set_alarm(&global_tchain, waiter);
+	__tc_set_alarm(my_tchain(), waiter);
 }
 
 bool unset_alarm(struct alarm_waiter *waiter)
 {
-	return __tc_unset_alarm(&global_tchain, waiter);
+	/* never set, so it can't be on a tchain */
+	if (!waiter->tchain)
+		return FALSE;
+	return __tc_unset_alarm(waiter->tchain, waiter);
 }
 
 void reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time)
 {
-	__tc_reset_alarm_abs(&global_tchain, waiter, abs_time);
+	/* If it's still on a tchain, it has to come off that one */
+	__tc_reset_alarm_abs(waiter->tchain ? waiter->tchain : my_tchain(), waiter,
+	                     abs_time);
 }
 
 /* Helper, makes sure the kernel alarm is turned on at the right time. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
+	uint64_t deadline;
+
+	if (tchain->slots) {
+		deadline = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+		if (devalarm_set_slot(tchain->ctlfd, tchain->slots, 0, deadline))
+			perror("Useralarm: Failed to kick slots");
+		return;
+	}
 	if (TAILQ_EMPTY(&tchain->waiters)) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
@@ -300,8 +426,7 @@ static void __trigger_tchain(struct timer_chain *tchain)
 	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
 		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
 		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
+		if (i->fire_time <= now) {
 			changed_list = TRUE;
 			TAILQ_REMOVE(&tchain->waiters, i, next);
 			/* Don't touch the waiter after waking it, since it could be in use
@@ -320,12 +445,47 @@ static void __trigger_tchain(struct timer_chain *tchain)
 	spin_pdr_unlock(&tchain->lock);
 }
 
+/* Runs other vcores' chains that have expired alarms, unless someone is
+ * already working on them.  The peeks are racy; worst case, we skip a chain
+ * whose own event is on the way, or take a lock for nothing. */
+static void steal_expired_alarms(struct timer_chain *mine)
+{
+	struct timer_chain *tchain;
+	uint64_t now = read_tsc();
+	uint64_t earliest;
+
+	for (int i = 0; i < nr_tchains; i++) {
+		tchain = &vc_tchains[i];
+		if (tchain == mine)
+			continue;
+		earliest = *(volatile uint64_t*)&tchain->earliest_time;
+		if ((earliest == ALARM_POISON_TIME) || (earliest > now))
+			continue;
+		if (spin_pdr_locked(&tchain->lock))
+			continue;
+		__trigger_tchain(tchain);
+	}
+}
+
 static void handle_user_alarm(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data)
 {
+	struct timer_chain *tchain = NULL;
+
 	assert(ev_type == EV_ALARM);
-	if (ev_msg && (ev_msg->ev_arg2 == global_tchain.alarmid))
-		__trigger_tchain(&global_tchain);
+	if (!ev_msg)
+		return;
+	for (int i = 0; i < nr_tchains; i++) {
+		if (ev_msg->ev_arg2 == vc_tchains[i].alarmid) {
+			tchain = &vc_tchains[i];
+			break;
+		}
+	}
+	/* Not one of ours, e.g. someone using #alarm directly */
+	if (!tchain)
+		return;
+	__trigger_tchain(tchain);
+	steal_expired_alarms(tchain);
 }
 
 /* Helper, inserts the waiter into the tchain, returning TRUE if we still need
@@ -337,26 +497,28 @@ static bool __insert_awaiter(struct timer_chain *tchain,
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	waiter->on_tchain = TRUE;
+	waiter->tchain = tchain;
+	__set_fire_time(waiter);
 	/* Either the list is empty, or not. */
 	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
+		tchain->earliest_time = waiter->fire_time;
+		tchain->latest_time = waiter->fire_time;
 		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
 		/* Need to turn on the timer interrupt later */
 		return TRUE;
 	}
 	/* If not, either we're first, last, or in the middle.  Reset the interrupt
 	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
+	if (waiter->fire_time < tchain->earliest_time) {
+		tchain->earliest_time = waiter->fire_time;
 		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
 		/* Changed the first entry; we'll need to reset the interrupt later */
 		return TRUE;
 	}
 	/* If there is a tie for last, the newer one will really go last.  We need
 	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
+	if (waiter->fire_time >= tchain->latest_time) {
+		tchain->latest_time = waiter->fire_time;
 		/* Proactively put it at the end if we know we're last */
 		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
 		return FALSE;
@@ -365,7 +527,7 @@ static bool __insert_awaiter(struct timer_chain *tchain,
 	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
 	 * will help a bit. */
 	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
+		if (waiter->fire_time < i->fire_time) {
 			TAILQ_INSERT_BEFORE(i, waiter, next);
 			return FALSE;
 		}
@@ -389,7 +551,7 @@ static void __tc_set_alarm(struct timer_chain *tchain,
                            struct alarm_waiter *waiter)
 {
 	spin_pdr_lock(&tchain->lock);
-	__set_alarm(waiter);
+	__tc_locked_set_alarm(tchain, waiter);
 	spin_pdr_unlock(&tchain->lock);
 }
 
@@ -405,12 +567,12 @@ static bool __remove_awaiter(struct timer_chain *tchain,
 	 * the first and/or last element of the chain. */
 	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
 		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
+		tchain->earliest_time = (temp) ? temp->fire_time : ALARM_POISON_TIME;
 		reset_int = TRUE;		/* we'll need to reset the timer later */
 	}
 	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
 		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
+		tchain->latest_time = (temp) ? temp->fire_time : ALARM_POISON_TIME;
 	}
 	TAILQ_REMOVE(&tchain->waiters, waiter, next);
 	return reset_int;
@@ -468,6 +630,15 @@ void print_chain(struct timer_chain *tchain)
 	spin_pdr_unlock(&tchain->lock);
 }
 
+/* Debugging: prints every vcore's chain */
+void print_all_chains(void)
+{
+	for (int i = 0; i < nr_tchains; i++) {
+		printf("Vcore %d: ", i);
+		print_chain(&vc_tchains[i]);
+	}
+}
+
 /* "parlib" alarm handlers */
 void alarm_abort_sysc(struct alarm_waiter *awaiter)
 {
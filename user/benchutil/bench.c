@@ -0,0 +1,270 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Benchmark harness.  See bench.h. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/param.h>
+#ifdef __ros__
+#include <parlib/tsc-compat.h>
+#include <benchutil/bench.h>
+#endif /* __ros__ */
+
+static struct bench_opts bench_opts = {
+	.format = BENCH_FMT_TEXT,
+	.nr_reps = BENCH_DEFAULT_REPS,
+	.nr_warmup = BENCH_DEFAULT_WARMUP,
+};
+static bool bench_opts_ready;
+static bool bench_csv_header_done;
+
+static void bench_init_opts(void)
+{
+	char *env;
+
+	if (bench_opts_ready)
+		return;
+	bench_opts_ready = true;
+	env = getenv("BENCH_FORMAT");
+	if (env) {
+		if (!strcmp(env, "csv"))
+			bench_opts.format = BENCH_FMT_CSV;
+		else if (!strcmp(env, "json"))
+			bench_opts.format = BENCH_FMT_JSON;
+		else if (strcmp(env, "text"))
+			fprintf(stderr, "bench: unknown BENCH_FORMAT %s\n", env);
+	}
+	env = getenv("BENCH_REPS");
+	if (env && strtoul(env, 0, 10))
+		bench_opts.nr_reps = strtoul(env, 0, 10);
+	env = getenv("BENCH_WARMUP");
+	if (env)
+		bench_opts.nr_warmup = strtoul(env, 0, 10);
+}
+
+void bench_set_opts(struct bench_opts *opts)
+{
+	bench_init_opts();
+	bench_opts = *opts;
+	if (!bench_opts.nr_reps)
+		bench_opts.nr_reps = 1;
+}
+
+void bench_get_opts(struct bench_opts *opts)
+{
+	bench_init_opts();
+	*opts = bench_opts;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples, p in [0, 1]. */
+static double percentile(double *samples, unsigned int nr, double p)
+{
+	unsigned int idx = ceil(p * nr);
+
+	return samples[idx ? idx - 1 : 0];
+}
+
+int bench_summarize(const char *name, unsigned int nr_vcores, uint64_t nr_ops,
+                    double *samples, unsigned int nr_samples,
+                    struct bench_result *res)
+{
+	double q1, q3, iqr, lo, hi, sum = 0, var = 0;
+	unsigned int first = 0, last;
+
+	memset(res, 0, sizeof(struct bench_result));
+	res->name = name;
+	res->nr_vcores = nr_vcores;
+	res->nr_ops = nr_ops;
+	if (!nr_samples)
+		return -1;
+	qsort(samples, nr_samples, sizeof(double), cmp_double);
+	last = nr_samples;
+	/* Tukey fences need a few samples to mean anything.  Since the samples are
+	 * sorted, the outliers are at either end. */
+	if (nr_samples >= 4) {
+		q1 = percentile(samples, nr_samples, 0.25);
+		q3 = percentile(samples, nr_samples, 0.75);
+		iqr = q3 - q1;
+		lo = q1 - 1.5 * iqr;
+		hi = q3 + 1.5 * iqr;
+		while (first < last && samples[first] < lo)
+			first++;
+		while (last > first && samples[last - 1] > hi)
+			last--;
+	}
+	res->nr_outliers = nr_samples - (last - first);
+	samples += first;
+	nr_samples = last - first;
+	res->nr_samples = nr_samples;
+	for (int i = 0; i < nr_samples; i++)
+		sum += samples[i];
+	res->mean = sum / nr_samples;
+	for (int i = 0; i < nr_samples; i++)
+		var += (samples[i] - res->mean) * (samples[i] - res->mean);
+	res->stddev = nr_samples > 1 ? sqrt(var / (nr_samples - 1)) : 0;
+	res->min = samples[0];
+	res->max = samples[nr_samples - 1];
+	res->p50 = percentile(samples, nr_samples, 0.50);
+	res->p90 = percentile(samples, nr_samples, 0.90);
+	res->p99 = percentile(samples, nr_samples, 0.99);
+	return 0;
+}
+
+/* Names go out unescaped, so keep them to identifiers. */
+void bench_report(struct bench_result *res)
+{
+	bench_init_opts();
+	switch (bench_opts.format) {
+	case BENCH_FMT_CSV:
+		if (!bench_csv_header_done) {
+			bench_csv_header_done = true;
+			printf("name,vcores,ops,samples,outliers,mean_ns,stddev_ns,"
+			       "min_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+		}
+		printf("%s,%u,%llu,%u,%u,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+		       res->name, res->nr_vcores, res->nr_ops, res->nr_samples,
+		       res->nr_outliers, res->mean, res->stddev, res->min, res->p50,
+		       res->p90, res->p99, res->max);
+		break;
+	case BENCH_FMT_JSON:
+		printf("{\"name\": \"%s\", \"vcores\": %u, \"ops\": %llu, "
+		       "\"samples\": %u, \"outliers\": %u, \"mean_ns\": %.2f, "
+		       "\"stddev_ns\": %.2f, \"min_ns\": %.2f, \"p50_ns\": %.2f, "
+		       "\"p90_ns\": %.2f, \"p99_ns\": %.2f, \"max_ns\": %.2f}\n",
+		       res->name, res->nr_vcores, res->nr_ops, res->nr_samples,
+		       res->nr_outliers, res->mean, res->stddev, res->min, res->p50,
+		       res->p90, res->p99, res->max);
+		break;
+	default:
+		printf("%-24s vc %3u: %10.2f ns/op (sd %.2f, min %.2f, 50/90/99 "
+		       "%.2f/%.2f/%.2f, max %.2f), %u samples, %u outliers\n",
+		       res->name, res->nr_vcores, res->mean, res->stddev, res->min,
+		       res->p50, res->p90, res->p99, res->max, res->nr_samples,
+		       res->nr_outliers);
+		break;
+	}
+	fflush(stdout);
+}
+
+struct bench_thread {
+	pthread_t					pth;
+	bench_func_t				func;
+	void						*arg;
+	uint64_t					nr_ops;
+	pthread_barrier_t			*barrier;
+	uint64_t					start;
+	uint64_t					end;
+};
+
+static void *__bench_thread(void *arg)
+{
+	struct bench_thread *bt = (struct bench_thread*)arg;
+
+	pthread_barrier_wait(bt->barrier);
+	bt->start = read_tsc_serialized();
+	bt->func(bt->arg, bt->nr_ops);
+	bt->end = read_tsc_serialized();
+	return 0;
+}
+
+/* Returns the nsec from the first thread's start to the last thread's end, or
+ * 0 on failure. */
+static uint64_t bench_time_vcores(bench_func_t func, void *arg,
+                                  unsigned int nr_vcores, uint64_t nr_ops)
+{
+	struct bench_thread *bts;
+	pthread_barrier_t barrier;
+	uint64_t start = UINT64_MAX, end = 0;
+
+	if (nr_vcores == 1) {
+		start = read_tsc_serialized();
+		func(arg, nr_ops);
+		end = read_tsc_serialized();
+		return tsc2nsec(end - start);
+	}
+	bts = calloc(nr_vcores, sizeof(struct bench_thread));
+	if (!bts) {
+		perror("bench: thread alloc");
+		return 0;
+	}
+	pthread_barrier_init(&barrier, NULL, nr_vcores);
+	for (int i = 0; i < nr_vcores; i++) {
+		bts[i].func = func;
+		bts[i].arg = arg;
+		bts[i].nr_ops = nr_ops;
+		bts[i].barrier = &barrier;
+		if (pthread_create(&bts[i].pth, NULL, __bench_thread, &bts[i])) {
+			perror("bench: pthread_create");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < nr_vcores; i++) {
+		pthread_join(bts[i].pth, NULL);
+		start = MIN(start, bts[i].start);
+		end = MAX(end, bts[i].end);
+	}
+	pthread_barrier_destroy(&barrier);
+	free(bts);
+	return tsc2nsec(end - start);
+}
+
+int bench_run_vcores(const char *name, bench_func_t func, void *arg,
+                     unsigned int nr_vcores, uint64_t nr_ops,
+                     struct bench_result *res)
+{
+	struct bench_result local_res;
+	double *samples;
+	unsigned int nr_samples = 0;
+	uint64_t nsec;
+	int ret;
+
+	bench_init_opts();
+	if (!res)
+		res = &local_res;
+	samples = malloc(sizeof(double) * bench_opts.nr_reps);
+	if (!samples) {
+		perror("bench: sample alloc");
+		return -1;
+	}
+	for (int i = 0; i < bench_opts.nr_warmup; i++)
+		bench_time_vcores(func, arg, nr_vcores, nr_ops);
+	for (int i = 0; i < bench_opts.nr_reps; i++) {
+		nsec = bench_time_vcores(func, arg, nr_vcores, nr_ops);
+		if (nsec)
+			samples[nr_samples++] = (double)nsec / nr_ops;
+	}
+	ret = bench_summarize(name, nr_vcores, nr_ops, samples, nr_samples, res);
+	if (!ret)
+		bench_report(res);
+	free(samples);
+	return ret;
+}
+
+int bench_run(const char *name, bench_func_t func, void *arg, uint64_t nr_ops,
+              struct bench_result *res)
+{
+	return bench_run_vcores(name, func, arg, 1, nr_ops, res);
+}
+
+void bench_sweep_vcores(const char *name, bench_func_t func, void *arg,
+                        unsigned int max_vcores, uint64_t nr_ops)
+{
+	for (unsigned int nr = 1; ; nr = MIN(nr * 2, max_vcores)) {
+		bench_run_vcores(name, func, arg, nr, nr_ops, NULL);
+		if (nr >= max_vcores)
+			break;
+	}
+}
@@ -10,11 +10,16 @@
  * This is (was) hanging out in benchutil so as to not create a dependency from
  * parlib on benchutil (usec2tsc and friends).
  *
- * There's only one timer chain, unlike in the kernel, for the entire process.
- * If you want one-off timers unrelated to the chain (and sent to other vcores),
- * use #A directly.
+ * Each vcore has its own timer chain, backed by its own #A alarm, and
+ * set_alarm() uses the calling vcore's chain.  Vcores also run expired alarms
+ * from other vcores' chains, in case those vcores are busy or offline.  If you
+ * want one-off timers unrelated to the chains, use #A directly.
  *
- * Your handlers will run from vcore context.
+ * If the kernel supports alarm slots (ros/alarm_slots.h), each chain keeps its
+ * deadline in a slot, so rearming the chain is usually just a store.
+ *
+ * Your handlers will run from vcore context, but not necessarily on the vcore
+ * that set the alarm.
  *
  * 1) To set a handler to run on an alarm:
  * 	struct alarm_waiter *waiter = malloc(sizeof(struct alarm_waiter));
@@ -22,10 +27,15 @@
  * 	waiter->data = something;
  * 	set_awaiter_rel(waiter, USEC);
  * 	set_alarm(waiter);
+ * If it's okay for the alarm to go off up to SLACK usec late, call this before
+ * set_alarm().  Alarms with slack get batched together with nearby alarms:
+ * 	set_awaiter_slack(waiter, SLACK);
  * If you want the HANDLER to run again, do this at the end of it:
  * 	set_awaiter_rel(waiter, USEC);
  * 	__set_alarm(waiter);
- * Do not call set_alarm() from within an alarm handler; you'll deadlock.
+ * Do not call set_alarm() from within an alarm handler; you'll deadlock.  Only
+ * call __set_alarm() on the waiter whose handler is running; its tchain is the
+ * one that is locked.
  * Don't forget to manage your memory at some (safe) point:
  * 	free(waiter); */
 
@@ -35,6 +45,7 @@
 #include <sys/queue.h>
 #include <parlib/spinlock.h>
 #include <parlib/event.h>
+#include <ros/alarm_slots.h>
 
 __BEGIN_DECLS
 
@@ -44,22 +55,29 @@ int devalarm_get_fds(int *ctlfd_r, int *timerfd_r, int *alarmid_r);
 int devalarm_set_evq(int ctlfd, struct event_queue *ev_q);
 int devalarm_set_time(int timerfd, uint64_t tsc_time);
 int devalarm_disable(int ctlfd);
+int devalarm_set_slots(int ctlfd, struct alarm_slots *slots);
+int devalarm_set_slot(int ctlfd, struct alarm_slots *slots, unsigned int slot,
+                      uint64_t tsc_time);
 
 /* Alarm service */
 
 /* Specifc waiter, per alarm */
+struct timer_chain;
 struct alarm_waiter {
 	uint64_t 					wake_up_time;	/* tsc time */
+	uint64_t					slack;			/* tsc ticks we can be late */
+	uint64_t					fire_time;		/* wake_up_time, plus slack */
 	void (*func) (struct alarm_waiter *waiter);
 	void						*data;
 	TAILQ_ENTRY(alarm_waiter)	next;
+	struct timer_chain			*tchain;		/* last chain we were set on */
 	bool						on_tchain;
 };
 TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
-/* Sorted collection of alarms. */
+/* Sorted collection of alarms, one per vcore, sorted by fire_time. */
 struct timer_chain {
 	struct spin_pdr_lock		lock;
 	struct awaiters_tailq		waiters;
@@ -69,7 +87,8 @@ struct timer_chain {
 	int							timerfd;
 	int							alarmid;
 	struct event_queue			*ev_q;
-};
+	struct alarm_slots			*slots;			/* 0 if no kernel support */
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 /* For fresh alarm waiters.  func == 0 for kthreads */
 void init_awaiter(struct alarm_waiter *waiter,
@@ -79,6 +98,8 @@ void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_abs_unix(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* How late, in usec, the awaiter can go off.  Defaults to 0. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec);
 /* Arms/disarms the alarm */
 void __set_alarm(struct alarm_waiter *waiter);
 void set_alarm(struct alarm_waiter *waiter);
@@ -91,5 +112,6 @@ void alarm_abort_sysc(struct alarm_waiter *awaiter);
 /* Debugging */
 #define ALARM_POISON_TIME 12345
 void print_chain(struct timer_chain *tchain);
+void print_all_chains(void);
 
 __END_DECLS
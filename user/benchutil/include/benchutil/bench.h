@@ -0,0 +1,84 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Benchmark harness.
+ *
+ * A benchmark is a function that does nr_ops of something:
+ *
+ * 		void my_bench(void *arg, uint64_t nr_ops)
+ *
+ * bench_run() calls it a few times to warm up, then times nr_reps more calls.
+ * Each rep gives a sample of nsec per op.  Samples outside the Tukey fences
+ * (1.5 IQR past the quartiles) are thrown out, and the rest are summarized
+ * (mean, stddev, min, max, and percentiles) and printed in one of three formats:
+ * a line of text, CSV, or a JSON object per line.  The machine-readable ones
+ * are meant to be collected across kernel builds and diffed.
+ *
+ * bench_sweep_vcores() runs the benchmark on 1, 2, 4, ... max_vcores threads at
+ * once; each thread does nr_ops, and the sample is the wall time of the slowest
+ * thread divided by its nr_ops.  Under the default pthread 2LS, each thread
+ * gets its own vcore if one is available.
+ *
+ * The defaults can be changed with bench_set_opts() or from the environment:
+ * BENCH_FORMAT (text, csv, json), BENCH_REPS and BENCH_WARMUP. */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+enum bench_format {
+	BENCH_FMT_TEXT,
+	BENCH_FMT_CSV,
+	BENCH_FMT_JSON,
+};
+
+#define BENCH_DEFAULT_REPS			10
+#define BENCH_DEFAULT_WARMUP		2
+
+struct bench_opts {
+	enum bench_format			format;
+	unsigned int				nr_reps;
+	unsigned int				nr_warmup;
+};
+
+/* All times are nsec per op. */
+struct bench_result {
+	const char					*name;
+	unsigned int				nr_vcores;
+	uint64_t					nr_ops;			/* per rep, per thread */
+	unsigned int				nr_samples;		/* after outliers */
+	unsigned int				nr_outliers;
+	double						mean;
+	double						stddev;
+	double						min;
+	double						max;
+	double						p50;
+	double						p90;
+	double						p99;
+};
+
+typedef void (*bench_func_t)(void *arg, uint64_t nr_ops);
+
+void bench_set_opts(struct bench_opts *opts);
+void bench_get_opts(struct bench_opts *opts);
+
+/* Run and report.  Return 0 on success, -1 if there was nothing to report. */
+int bench_run(const char *name, bench_func_t func, void *arg, uint64_t nr_ops,
+              struct bench_result *res);
+int bench_run_vcores(const char *name, bench_func_t func, void *arg,
+                     unsigned int nr_vcores, uint64_t nr_ops,
+                     struct bench_result *res);
+void bench_sweep_vcores(const char *name, bench_func_t func, void *arg,
+                        unsigned int max_vcores, uint64_t nr_ops);
+
+/* For tests that take their own samples (nsec per op, in any order).  Sorts
+ * samples in place. */
+int bench_summarize(const char *name, unsigned int nr_vcores, uint64_t nr_ops,
+                    double *samples, unsigned int nr_samples,
+                    struct bench_result *res);
+void bench_report(struct bench_result *res);
+
+__END_DECLS
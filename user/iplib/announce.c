@@ -162,6 +162,63 @@ int accept9(int ctl, char *dir)
 	return open(buf, O_RDWR);
 }
 
+/*
+ *  accept up to n pending calls on an announced dir, which must have been
+ *  announced with O_NONBLOCK.  fills in dfds[i] with the data fds, and if they
+ *  are non-zero, ctls[i] with the ctl fds and newdirs[i] with the conversation
+ *  dirs.  flags are for the new conversations, e.g. O_NONBLOCK.
+ *
+ *  returns the number accepted, or -1 with errno EAGAIN if there were none.
+ *  callers tap the listen file (FDTAP_FILT_READABLE) and drain it with this.
+ */
+int accept9_batch(char *dir, int *dfds, int *ctls, char (*newdirs)[NETPATHLEN],
+                  int n, int flags)
+{
+	char lname[Maxpath];
+	char buf[Maxpath];
+	char *cp;
+	int i, ctl, len, m;
+
+	snprintf(lname, sizeof(lname), "%s/listen", dir);
+	/* the new conversations are siblings of dir; we only parse it once */
+	strncpy(buf, dir, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	cp = strrchr(buf, '/');
+	if(cp == NULL){
+		fprintf(stderr,"accept arg format %s\n", dir);
+		errno = EINVAL;
+		return -1;
+	}
+	*++cp = 0;
+	len = cp - buf;
+
+	for(i = 0; i < n; i++){
+		ctl = open(lname, O_RDWR | O_NONBLOCK | (flags & O_NONBLOCK));
+		if(ctl < 0)
+			break;
+		m = read(ctl, cp, sizeof(buf) - len - 1);
+		if(m <= 0){
+			close(ctl);
+			break;
+		}
+		cp[m] = 0;
+		dfds[i] = accept9(ctl, buf);
+		if(dfds[i] < 0){
+			close(ctl);
+			break;
+		}
+		if(newdirs){
+			strncpy(newdirs[i], buf, NETPATHLEN);
+			newdirs[i][NETPATHLEN-1] = 0;
+		}
+		if(ctls)
+			ctls[i] = ctl;
+		else
+			close(ctl);
+	}
+	return i ? i : -1;
+}
+
 /*
  *  reject a call, tell device the reason for the rejection
  */
@@ -13,9 +13,10 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <iplib/iplib.h>
 
 #define NAMELEN 28
-#define NETPATHLEN 40
 static int isdigit(int c) {return ((c >= '0' && c <= '9'));}
 
 static int call(char *clone, char *dest, int *cfdp, char *dir, char *local,
@@ -49,10 +50,13 @@ static int call(char *clone, char *dest, int *cfdp, char *dir, char *local,
 		sprintf(name, "connect %.*s %.*s", 2*NAMELEN, dest, NAMELEN, local);
 	else
 		sprintf(name, "connect %.*s", 2*NAMELEN, dest);
-	/* connect */
+	/* connect.  a nonblocking conv returns before the handshake is done; the
+	 * caller taps the data fd for FDTAP_FILT_WRITABLE (or ERROR) */
 	if(write(cfd, name, strlen(name)) < 0){
-		close(cfd);
-		return -1;
+		if(!(flags & O_NONBLOCK) || errno != EINPROGRESS){
+			close(cfd);
+			return -1;
+		}
 	}
 
 	/* open data connection */
@@ -68,13 +72,19 @@ static int call(char *clone, char *dest, int *cfdp, char *dir, char *local,
 	return fd;
 }
 
+/*
+ *  with O_NONBLOCK, the conversation is nonblocking and dial9 returns as soon
+ *  as the connect is sent.  the fd is writable once the call is up.
+ */
 int dial9(char *dest, char *local, char *dir, int *cfdp, int flags)
 {
 	char net[128];
 	char netdir[128], csname[NETPATHLEN], *slp;
 	char clone[NAMELEN+12];
+	char cskey[NETPATHLEN+128];
+	char answer[1024], *line, *nl;
 	char *p;
-	int n;
+	int n, len;
 	int fd;
 	int rv;
 
@@ -109,6 +119,14 @@ int dial9(char *dest, char *local, char *dir, int *cfdp, int flags)
 			return call(clone, p, cfdp, dir, local, flags);
 		}
 	}
+	/* check our cache of cs answers */
+	snprintf(cskey, sizeof(cskey), "%s/cs %s", netdir, net);
+	n = nscache_lookup(cskey, answer, sizeof(answer));
+	if (n == -1)
+		return -1;
+	if (n >= 0)
+		goto dial_answer;
+
 	/* call the connection server */
 	sprintf(csname, "%s/cs", netdir);
 	fd = open(csname, O_RDWR);
@@ -124,26 +142,47 @@ int dial9(char *dest, char *local, char *dir, int *cfdp, int flags)
 	 *  send dest to connection to translate
 	 */
 	if(write(fd, net, strlen(net)) < 0){
+		nscache_insert_neg(cskey);
 		close(fd);
 		return -1;
 	}
 
 	/*
-	 *  loop through each address from the connection server till
-	 *  we get one that works.
+	 *  collect each address from the connection server, one per read.  we
+	 *  try them once we have them all, so we can cache the whole answer.
 	 */
-	rv = -1;
+	len = 0;
 	lseek(fd, 0, 0);
 	while((n = read(fd, net, sizeof(net) - 1)) > 0){
-		net[n] = 0;
-		p = strchr(net, ' ');
+		if(len + n + 1 >= sizeof(answer))
+			break;
+		memcpy(answer + len, net, n);
+		len += n;
+		answer[len++] = '\n';
+	}
+	answer[len] = 0;
+	close(fd);
+	nscache_insert(cskey, answer, len);
+
+dial_answer:
+	/*
+	 *  loop through each address till we get one that works.
+	 */
+	rv = -1;
+	for(line = answer; line && *line; line = nl){
+		nl = strchr(line, '\n');
+		if(nl)
+			*nl++ = 0;
+		p = strchr(line, ' ');
 		if(p == 0)
 			continue;
 		*p++ = 0;
-		rv = call(net, p, cfdp, dir, local, flags);
+		rv = call(line, p, cfdp, dir, local, flags);
 		if(rv >= 0)
 			break;
 	}
-	close(fd);
+	/* the name may have moved; ask cs again next time */
+	if(rv < 0)
+		nscache_remove(cskey);
 	return rv;
 }
@@ -8,7 +8,9 @@
  * artifacts of the implementation, and other issues:
  * 	- you can't epoll on an epoll fd (or any user fd).  you can only epoll on a
  * 	kernel FD that accepts your FD taps.
- * 	- there's no EPOLLONESHOT or level-triggered support.
+ * 	- there's no level-triggered support.
+ * 	- EPOLLEXCLUSIVE applies to the whole set: if any FD in the set has it,
+ * 	each batch of events wakes one waiting uthread instead of all of them.
  * 	- you can only tap one FD at a time, so you can't add the same FD to
  * 	multiple epoll sets.
  * 	- there is no support for growing the epoll set.
@@ -17,8 +19,6 @@
  * 	preempted, and are unlucky.
  * 	- epoll_create1 does not support CLOEXEC.  That'd need some work in glibc's
  * 	exec and flags in struct user_fd.
- * 	- EPOLL_CTL_MOD is just a DEL then an ADD.  There might be races associated
- * 	with that.
  * 	- epoll_pwait is probably racy.
  * 	- You can't dup an epoll fd (same as other user FDs).
  * 	- If you add a BSD socket FD to an epoll set before calling listen(), you'll
@@ -34,6 +34,7 @@
 #include <parlib/ceq.h>
 #include <parlib/uthread.h>
 #include <parlib/timing.h>
+#include <parlib/arch/atomic.h>
 #include <sys/user_fd.h>
 #include <sys/close_cb.h>
 #include <stdio.h>
@@ -50,6 +51,8 @@ struct epoll_ctlr {
 	struct event_queue			*ceq_evq;
 	struct ceq					*ceq;	/* convenience pointer */
 	unsigned int				size;
+	struct ep_fd_data			*fds;	/* size of them, indexed by FD */
+	unsigned int				nr_excl;
 	uth_mutex_t					mtx;
 	struct user_fd				ufd;
 };
@@ -59,15 +62,20 @@ static struct epoll_ctlrs all_ctlrs = TAILQ_HEAD_INITIALIZER(all_ctlrs);
 static uth_mutex_t ctlrs_mtx;
 
 /* There's some bookkeeping we need to maintain on every FD.  Right now, the FD
- * is the index into the CEQ event array, so we can just hook this into the user
- * data blob in the ceq_event.
+ * is the index into the CEQ event array, and also into the ctlr's array of
+ * these.
  *
- * If we ever do not maintain a 1:1 mapping from FDs to CEQ IDs, we can use this
- * to track the CEQ ID and FD. */
+ * epoll_wait() reads these without the ctlr's mutex, so they are never freed
+ * while the ctlr is alive.  epoll_ctl() changes them under the mutex, inside a
+ * seq counter write.  armed is cleared by whichever waiter reports an
+ * EPOLLONESHOT event, and set again by EPOLL_CTL_MOD. */
 struct ep_fd_data {
 	struct epoll_event			ep_event;
 	int							fd;
 	int							filter;
+	bool						in_use;
+	uint32_t					armed;
+	seq_ctr_t					seq;
 };
 
 /* Converts epoll events to FD taps. */
@@ -109,11 +117,24 @@ static uint32_t taps_to_ep_events(int taps)
 	return ep_ev;
 }
 
-static struct ceq_event *ep_get_ceq_ev(struct epoll_ctlr *ep, size_t idx)
+static struct ep_fd_data *ep_get_fd_data(struct epoll_ctlr *ep, size_t idx)
 {
-	if (ep->ceq_evq->ev_mbox->ceq.nr_events <= idx)
+	if (ep->size <= idx)
 		return 0;
-	return &ep->ceq_evq->ev_mbox->ceq.events[idx];
+	return &ep->fds[idx];
+}
+
+/* Writers hold ep->mtx, so there is only ever one at a time. */
+static void ep_fd_write_begin(struct ep_fd_data *ep_fd)
+{
+	ep_fd->seq++;
+	wmb();	/* odd seq before changing the contents */
+}
+
+static void ep_fd_write_end(struct ep_fd_data *ep_fd)
+{
+	wmb();	/* contents before the even seq */
+	ep_fd->seq++;
 }
 
 static struct epoll_ctlr *fd_to_cltr(int fd)
@@ -133,7 +154,8 @@ static struct event_queue *ep_get_ceq_evq(unsigned int ceq_size)
 {
 	struct event_queue *ceq_evq = get_eventq_raw();
 	ceq_evq->ev_mbox->type = EV_MBOX_CEQ;
-	ceq_init(&ceq_evq->ev_mbox->ceq, CEQ_OR, ceq_size, ceq_size);
+	/* Many cores fire taps at one epoll set; keep them off a shared ring */
+	ceq_init_bitmap(&ceq_evq->ev_mbox->ceq, CEQ_OR, ceq_size);
 	ceq_evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
 	evq_attach_wakeup_ctlr(ceq_evq);
 	return ceq_evq;
@@ -173,7 +195,6 @@ static void epoll_close(struct user_fd *ufd)
 {
 	struct epoll_ctlr *ep = container_of(ufd, struct epoll_ctlr, ufd);
 	struct fd_tap_req *tap_reqs, *tap_req_i;
-	struct ceq_event *ceq_ev_i;
 	struct ep_fd_data *ep_fd_i;
 	int nr_tap_req = 0;
 	int nr_done = 0;
@@ -182,16 +203,12 @@ static void epoll_close(struct user_fd *ufd)
 	memset(tap_reqs, 0, sizeof(struct fd_tap_req) * ep->size);
 	/* Slightly painful, O(n) with no escape hatch */
 	for (int i = 0; i < ep->size; i++) {
-		ceq_ev_i = ep_get_ceq_ev(ep, i);
-		/* CEQ should have been big enough for our size */
-		assert(ceq_ev_i);
-		ep_fd_i = (struct ep_fd_data*)ceq_ev_i->user_data;
-		if (!ep_fd_i)
+		ep_fd_i = ep_get_fd_data(ep, i);
+		if (!ep_fd_i->in_use)
 			continue;
 		tap_req_i = &tap_reqs[nr_tap_req++];
 		tap_req_i->fd = i;
 		tap_req_i->cmd = FDTAP_CMD_REM;
-		free(ep_fd_i);
 	}
 	/* Requests could fail if the tapped files are already closed.  We need to
 	 * skip the failed one (the +1) and untap the rest. */
@@ -205,6 +222,7 @@ static void epoll_close(struct user_fd *ufd)
 	TAILQ_REMOVE(&all_ctlrs, ep, link);
 	uth_mutex_unlock(ctlrs_mtx);
 	uth_mutex_free(ep->mtx);
+	free(ep->fds);
 	free(ep);
 }
 
@@ -215,6 +233,11 @@ static int init_ep_ctlr(struct epoll_ctlr *ep, int size)
 	if (size == 1)
 		size = 128;
 	ep->size = ceq_size;
+	ep->fds = calloc(ceq_size, sizeof(struct ep_fd_data));
+	if (!ep->fds) {
+		errno = ENOMEM;
+		return -1;
+	}
 	ep->mtx = uth_mutex_alloc();
 	ep->ufd.magic = EPOLL_UFD_MAGIC;
 	ep->ufd.close = epoll_close;
@@ -276,160 +299,295 @@ int epoll_create1(int flags)
 	return epoll_create(1);
 }
 
-static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
-                           struct epoll_event *event)
+/* Only support ET.  EPOLLEXCLUSIVE, as in Linux, can't be combined with
+ * EPOLLONESHOT. */
+static int ep_check_events(struct epoll_event *event)
 {
-	struct ceq_event *ceq_ev;
-	struct ep_fd_data *ep_fd;
-	struct fd_tap_req tap_req = {0};
-	int ret, filter, sock_listen_fd;
-
-	/* Only support ET.  Also, we just ignore EPOLLONESHOT.  That might work,
-	 * logically, just with spurious events firing. */
 	if (!(event->events & EPOLLET)) {
 		errno = EPERM;
 		werrstr("Epoll level-triggered not supported");
 		return -1;
 	}
-	/* The sockets-to-plan9 networking shims are a bit inconvenient.  The user
-	 * asked us to epoll on an FD, but that FD is actually a Qdata FD.  We need
-	 * to actually epoll on the listen_fd.
-	 *
-	 * As far as tracking the FD goes for epoll_wait() reporting, if the app
-	 * wants to track the FD they think we are using, then they already passed
-	 * that in event->data. */
+	if ((event->events & EPOLLEXCLUSIVE) && (event->events & EPOLLONESHOT)) {
+		errno = EINVAL;
+		werrstr("Epoll EPOLLEXCLUSIVE cannot be EPOLLONESHOT");
+		return -1;
+	}
+	return 0;
+}
+
+/* The sockets-to-plan9 networking shims are a bit inconvenient.  The user
+ * asked us to epoll on an FD, but that FD is actually a Qdata FD.  We need to
+ * actually epoll on the listen_fd.
+ *
+ * As far as tracking the FD goes for epoll_wait() reporting, if the app wants
+ * to track the FD they think we are using, then they already passed that in
+ * event->data. */
+static int ep_tapped_fd(int fd)
+{
 	extern int _sock_lookup_listen_fd(int sock_fd);	/* in glibc */
+	int sock_listen_fd;
 
 	sock_listen_fd = _sock_lookup_listen_fd(fd);
 	if (sock_listen_fd >= 0)
-		fd = sock_listen_fd;
-	ceq_ev = ep_get_ceq_ev(ep, fd);
-	if (!ceq_ev) {
-		errno = ENOMEM;
-		werrstr("Epoll set cannot grow yet!");
-		return -1;
-	}
-	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (ep_fd) {
-		errno = EEXIST;
-		return -1;
-	}
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_ADD;
+		return sock_listen_fd;
+	return fd;
+}
+
+/* Checks an op against the current state of the set and fills in the tap
+ * request for it.  fd is the FD we tap (see ep_tapped_fd()).  A tap_req with
+ * no cmd means the op needs nothing from the kernel.  Returns 0 on success, -1
+ * with errno set on failure. */
+static int __epoll_ctl_prep(struct epoll_ctlr *ep, struct epoll_ctl_op *op,
+                            int fd, struct fd_tap_req *tap_req)
+{
+	struct ep_fd_data *ep_fd;
 	/* EPOLLHUP is implicitly set for all epolls. */
-	filter = ep_events_to_taps(event->events | EPOLLHUP);
-	tap_req.filter = filter;
-	tap_req.ev_q = ep->ceq_evq;
-	tap_req.ev_id = fd;	/* using FD as the CEQ ID */
-	ret = sys_tap_fds(&tap_req, 1);
-	if (ret != 1)
-		return -1;
-	ep_fd = malloc(sizeof(struct ep_fd_data));
-	ep_fd->fd = fd;
-	ep_fd->filter = filter;
-	ep_fd->ep_event = *event;
-	ep_fd->ep_event.events |= EPOLLHUP;
-	ceq_ev->user_data = (uint64_t)ep_fd;
+	int filter = ep_events_to_taps(op->event.events | EPOLLHUP);
+
+	memset(tap_req, 0, sizeof(struct fd_tap_req));
+	tap_req->fd = fd;
+	ep_fd = ep_get_fd_data(ep, fd);
+	switch (op->op) {
+		case (EPOLL_CTL_ADD):
+			if (ep_check_events(&op->event))
+				return -1;
+			if (!ep_fd) {
+				errno = ENOMEM;
+				werrstr("Epoll set cannot grow yet!");
+				return -1;
+			}
+			if (ep_fd->in_use) {
+				errno = EEXIST;
+				return -1;
+			}
+			tap_req->cmd = FDTAP_CMD_ADD;
+			break;
+		case (EPOLL_CTL_DEL):
+			if (!ep_fd || !ep_fd->in_use) {
+				errno = ENOENT;
+				return -1;
+			}
+			assert(ep_fd->fd == fd);
+			tap_req->cmd = FDTAP_CMD_REM;
+			return 0;
+		case (EPOLL_CTL_MOD):
+			if (ep_check_events(&op->event))
+				return -1;
+			if (!ep_fd || !ep_fd->in_use) {
+				errno = ENOENT;
+				return -1;
+			}
+			/* Linux doesn't allow changing EPOLLEXCLUSIVE either */
+			if ((op->event.events | ep_fd->ep_event.events) & EPOLLEXCLUSIVE) {
+				errno = EINVAL;
+				return -1;
+			}
+			/* Same taps: we just swap in the new event and rearm */
+			if (filter == ep_fd->filter)
+				return 0;
+			tap_req->cmd = FDTAP_CMD_MOD;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	tap_req->filter = filter;
+	tap_req->ev_q = ep->ceq_evq;
+	tap_req->ev_id = fd;	/* using FD as the CEQ ID */
 	return 0;
 }
 
-static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
-                           struct epoll_event *event)
+/* Updates the set for an op whose tap request (if any) went through. */
+static void __epoll_ctl_commit(struct epoll_ctlr *ep, struct epoll_ctl_op *op,
+                               struct fd_tap_req *tap_req)
 {
-	struct ceq_event *ceq_ev;
-	struct ep_fd_data *ep_fd;
-	struct fd_tap_req tap_req = {0};
-	int ret, sock_listen_fd;
+	struct ep_fd_data *ep_fd = ep_get_fd_data(ep, tap_req->fd);
 
-	/* They could be asking to clear an epoll for a listener.  We need to remove
-	 * the tap for the real FD we tapped */
-	extern int _sock_lookup_listen_fd(int sock_fd);	/* in glibc */
-	sock_listen_fd = _sock_lookup_listen_fd(fd);
-	if (sock_listen_fd >= 0)
-		fd = sock_listen_fd;
-	ceq_ev = ep_get_ceq_ev(ep, fd);
-	if (!ceq_ev) {
-		errno = ENOENT;
-		return -1;
+	ep_fd_write_begin(ep_fd);
+	switch (op->op) {
+		case (EPOLL_CTL_ADD):
+			ep_fd->fd = tap_req->fd;
+			ep_fd->in_use = TRUE;
+			/* fall through */
+		case (EPOLL_CTL_MOD):
+			ep_fd->filter = ep_events_to_taps(op->event.events | EPOLLHUP);
+			ep_fd->ep_event = op->event;
+			ep_fd->ep_event.events |= EPOLLHUP;
+			ep_fd->armed = TRUE;
+			break;
+		case (EPOLL_CTL_DEL):
+			ep_fd->in_use = FALSE;
+			break;
 	}
-	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (!ep_fd) {
-		errno = ENOENT;
-		return -1;
+	ep_fd_write_end(ep_fd);
+	if (!(ep_fd->ep_event.events & EPOLLEXCLUSIVE) || op->op == EPOLL_CTL_MOD)
+		return;
+	if (op->op == EPOLL_CTL_ADD && !ep->nr_excl++)
+		evq_wakeup_ctlr_set_exclusive(ep->ceq_evq, TRUE);
+	if (op->op == EPOLL_CTL_DEL && !--ep->nr_excl)
+		evq_wakeup_ctlr_set_exclusive(ep->ceq_evq, FALSE);
+}
+
+/* Ops waiting to go to the kernel in one sys_tap_fds() call.  No two of them
+ * are for the same tapped FD, since each op is checked against the state the
+ * ones before it leave behind. */
+#define EP_CTL_BATCH 64
+
+struct ep_ctl_batch {
+	struct fd_tap_req			tap_reqs[EP_CTL_BATCH];
+	struct epoll_ctl_op			*ops[EP_CTL_BATCH];
+	int							nr;
+};
+
+static bool ep_ctl_batch_has(struct ep_ctl_batch *b, int fd)
+{
+	for (int i = 0; i < b->nr; i++) {
+		if (b->tap_reqs[i].fd == fd)
+			return TRUE;
 	}
-	assert(ep_fd->fd == fd);
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_REM;
-	/* ignoring the return value; we could have failed to remove it if the FD
-	 * has already closed and the kernel removed the tap. */
-	sys_tap_fds(&tap_req, 1);
-	ceq_ev->user_data = 0;
-	free(ep_fd);
-	return 0;
+	return FALSE;
 }
 
-int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+/* Sends the batch's tap requests and commits the ops that went through.
+ * Returns the number committed.  If that is less than the batch, errno is set
+ * for the op that failed. */
+static int ep_ctl_batch_flush(struct epoll_ctlr *ep, struct ep_ctl_batch *b)
 {
+	int done = 0;
 	int ret;
+
+	while (done < b->nr) {
+		ret = sys_tap_fds(b->tap_reqs + done, b->nr - done);
+		for (int i = done; i < done + ret; i++)
+			__epoll_ctl_commit(ep, b->ops[i], &b->tap_reqs[i]);
+		done += ret;
+		if (done == b->nr)
+			break;
+		/* We could have failed to remove a tap if the FD has already closed
+		 * and the kernel removed the tap.  That's fine; move past it. */
+		if (b->tap_reqs[done].cmd != FDTAP_CMD_REM)
+			break;
+		__epoll_ctl_commit(ep, b->ops[done], &b->tap_reqs[done]);
+		done++;
+	}
+	ret = done;
+	b->nr = 0;
+	return ret;
+}
+
+int epoll_ctl_batch(int epfd, struct epoll_ctl_op *ops, int nr_ops)
+{
 	struct epoll_ctlr *ep = fd_to_cltr(epfd);
+	struct ep_ctl_batch *b;
+	struct fd_tap_req tap_req;
+	int nr_done = 0;
+	int i, fd, err;
+
 	if (!ep) {
 		errno = EBADF;/* or EINVAL */
 		return -1;
 	}
-	if (fd >= USER_FD_BASE) {
-		errno = EINVAL;
-		werrstr("Epoll can't track User FDs");
+	b = malloc(sizeof(struct ep_ctl_batch));
+	if (!b) {
+		errno = ENOMEM;
 		return -1;
 	}
+	b->nr = 0;
 	uth_mutex_lock(ep->mtx);
-	switch (op) {
-		case (EPOLL_CTL_MOD):
-			/* In lieu of a proper MOD, just remove and readd.  The errors might
-			 * not work out well, and there could be a missed event in the
-			 * middle.  Not sure what the guarantees are, but we can fake a
-			 * poke. (TODO). */
-			ret = __epoll_ctl_del(ep, fd, 0);
-			if (ret)
-				break;
-			ret = __epoll_ctl_add(ep, fd, event);
-			break;
-		case (EPOLL_CTL_ADD):
-			ret = __epoll_ctl_add(ep, fd, event);
-			break;
-		case (EPOLL_CTL_DEL):
-			ret = __epoll_ctl_del(ep, fd, event);
-			break;
-		default:
-			errno = EINVAL;
-			ret = -1;
+	for (i = 0; i < nr_ops; i++) {
+		if (ops[i].fd >= USER_FD_BASE) {
+			err = EINVAL;
+			werrstr("Epoll can't track User FDs");
+			goto out_flush_err;
+		}
+		fd = ep_tapped_fd(ops[i].fd);
+		/* An op on an FD already in the batch depends on the ones before */
+		if (ep_ctl_batch_has(b, fd)) {
+			nr_done += ep_ctl_batch_flush(ep, b);
+			if (nr_done < i)
+				goto out;
+		}
+		if (__epoll_ctl_prep(ep, &ops[i], fd, &tap_req)) {
+			err = errno;
+			goto out_flush_err;
+		}
+		if (!tap_req.cmd) {
+			/* Nothing for the kernel, but it has to stay in order */
+			nr_done += ep_ctl_batch_flush(ep, b);
+			if (nr_done < i)
+				goto out;
+			__epoll_ctl_commit(ep, &ops[i], &tap_req);
+			nr_done++;
+			continue;
+		}
+		b->tap_reqs[b->nr] = tap_req;
+		b->ops[b->nr] = &ops[i];
+		if (++b->nr == EP_CTL_BATCH) {
+			nr_done += ep_ctl_batch_flush(ep, b);
+			if (nr_done < i + 1)
+				goto out;
+		}
 	}
+	nr_done += ep_ctl_batch_flush(ep, b);
+	goto out;
+out_flush_err:
+	/* The ops before the bad one still happen */
+	nr_done += ep_ctl_batch_flush(ep, b);
+	if (nr_done == i)
+		errno = err;
+out:
 	uth_mutex_unlock(ep->mtx);
-	return ret;
+	free(b);
+	return nr_done;
 }
 
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct epoll_ctl_op ctl_op = {.op = op, .fd = fd};
+
+	if (event)
+		ctl_op.event = *event;
+	if (epoll_ctl_batch(epfd, &ctl_op, 1) != 1)
+		return -1;
+	return 0;
+}
+
+/* Lockless: this can race with epoll_ctl() and other waiters. */
 static bool get_ep_event_from_msg(struct epoll_ctlr *ep, struct event_msg *msg,
                                   struct epoll_event *ep_ev)
 {
-	struct ceq_event *ceq_ev;
 	struct ep_fd_data *ep_fd;
+	seq_ctr_t seq;
+	uint32_t events;
+	bool in_use;
 
-	ceq_ev = ep_get_ceq_ev(ep, msg->ev_type);
+	ep_fd = ep_get_fd_data(ep, msg->ev_type);
 	/* should never get a tap FD > size of the epoll set */
-	assert(ceq_ev);
-	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (!ep_fd) {
+	assert(ep_fd);
+	do {
+		seq = ACCESS_ONCE(ep_fd->seq);
+		in_use = ep_fd->in_use;
+		events = ep_fd->ep_event.events;
+		ep_ev->data = ep_fd->ep_event.data;
+	} while (seqctr_retry(seq, ACCESS_ONCE(ep_fd->seq)));
+	if (!in_use) {
 		/* it's possible the FD was unregistered and this was an old
 		 * event sent to this epoll set. */
 		return FALSE;
 	}
-	ep_ev->data = ep_fd->ep_event.data;
+	/* Only one waiter gets to report a one-shot, until it is rearmed */
+	if ((events & EPOLLONESHOT) && !atomic_swap_u32(&ep_fd->armed, FALSE))
+		return FALSE;
 	ep_ev->events = taps_to_ep_events(msg->ev_arg2);
 	return TRUE;
 }
 
 /* We should be able to have multiple waiters.  ep shouldn't be closed or
  * anything, since we have the FD (that'd be bad programming on the user's
- * behalf).  We could have concurrent ADD/MOD/DEL operations (which lock). */
+ * behalf).  We could have concurrent ADD/MOD/DEL operations (which lock).
+ * Waiters don't lock: the CEQ handles concurrent consumers, and the ep_fds are
+ * read under their seq counters. */
 static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
                         int maxevents, int timeout)
 {
@@ -441,17 +599,12 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 	int recurse_ret;
 	struct syscall sysc;
 
-	/* Locking to protect get_ep_event_from_msg, specifically that the ep_fd
-	 * stored at ceq_ev->user_data does not get concurrently removed and
-	 * freed. */
-	uth_mutex_lock(ep->mtx);
 	for (int i = 0; i < maxevents; i++) {
 		if (uth_check_evqs(&msg, &which_evq, 1, ep->ceq_evq)) {
-			if (get_ep_event_from_msg(ep, &msg, &events[i]))
+			if (get_ep_event_from_msg(ep, &msg, &events[nr_ret]))
 				nr_ret++;
 		}
 	}
-	uth_mutex_unlock(ep->mtx);
 	if (nr_ret)
 		return nr_ret;
 	if (timeout == 0)
@@ -480,10 +633,8 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 	} else {
 		uth_blockon_evqs(&msg, &which_evq, 1, ep->ceq_evq);
 	}
-	uth_mutex_lock(ep->mtx);
 	if (get_ep_event_from_msg(ep, &msg, &events[0]))
 		nr_ret++;
-	uth_mutex_unlock(ep->mtx);
 	/* We might not have gotten one yet.  And regardless, there might be more
 	 * available.  Let's try again, with timeout == 0 to ensure no blocking.  We
 	 * use nr_ret (0 or 1 now) to adjust maxevents and events accordingly. */
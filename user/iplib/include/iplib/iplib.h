@@ -228,6 +228,19 @@ int dial9(char *dest, char *local, char *dir, int *cfdp, int flags);
 int announce9(char *addr, char *dir, int flags);
 int listen9(char *dir, char *newdir, int flags);
 int accept9(int ctl, char *dir);
+int accept9_batch(char *dir, int *dfds, int *ctls, char (*newdirs)[NETPATHLEN],
+                  int n, int flags);
 int reject9(int ctl, char *dir, char *cause);
 
+/* Name service cache, see nscache.c.  TTLs are in seconds. */
+#define NSCACHE_DEF_TTL			60
+#define NSCACHE_DEF_NEG_TTL		10
+
+int nscache_lookup(const char *key, char *buf, size_t buf_sz);
+void nscache_insert(const char *key, const char *answer, size_t len);
+void nscache_insert_neg(const char *key);
+void nscache_remove(const char *key);
+void nscache_flush(void);
+void nscache_set_ttl(unsigned int ttl, unsigned int neg_ttl);
+
 __END_DECLS
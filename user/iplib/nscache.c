@@ -0,0 +1,199 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Per-process cache of name service answers: cs translations for dial9() and
+ * dns queries for dnsquery().  Without it, every dial of a name pays a round
+ * trip to the connection server (and usually dns).
+ *
+ * Entries are the answer text, keyed by the query, and expire after a while.
+ * Neither cs nor dns tell us the record TTLs, so we use our own, short enough
+ * that a changed record is noticed soon.  Failed lookups are cached too, for
+ * less time, along with their errstr, so a bad name doesn't hammer dns.
+ *
+ * The cache is a hash table plus an LRU list, capped at NSCACHE_MAX_ENTS. */
+
+#include <sys/queue.h>
+#include <ros/common.h>
+#include <parlib/uthread.h>
+#include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
+#include <iplib/iplib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define NSCACHE_NR_HASH			64
+#define NSCACHE_MAX_ENTS		256
+
+struct nscache_ent {
+	SLIST_ENTRY(nscache_ent)	hash_link;
+	TAILQ_ENTRY(nscache_ent)	lru_link;
+	char						*key;
+	char						*answer;	/* errstr for negative entries */
+	size_t						len;
+	bool						negative;
+	uint64_t					expiry;		/* in seconds of TSC */
+};
+SLIST_HEAD(nscache_slist, nscache_ent);
+TAILQ_HEAD(nscache_tailq, nscache_ent);
+
+static struct nscache_slist nscache_hash[NSCACHE_NR_HASH];
+static struct nscache_tailq nscache_lru = TAILQ_HEAD_INITIALIZER(nscache_lru);
+static unsigned int nscache_nr_ents;
+static unsigned int nscache_ttl = NSCACHE_DEF_TTL;
+static unsigned int nscache_neg_ttl = NSCACHE_DEF_NEG_TTL;
+static uth_mutex_t nscache_mtx;
+
+static void nscache_init(void)
+{
+	nscache_mtx = uth_mutex_alloc();
+}
+
+static uint64_t nscache_now(void)
+{
+	return tsc2sec(read_tsc());
+}
+
+static struct nscache_slist *nscache_bucket(const char *key)
+{
+	unsigned long hash = 5381;
+
+	while (*key)
+		hash = hash * 33 + *key++;
+	return &nscache_hash[hash % NSCACHE_NR_HASH];
+}
+
+static struct nscache_ent *__nscache_find(const char *key)
+{
+	struct nscache_ent *ent;
+
+	SLIST_FOREACH(ent, nscache_bucket(key), hash_link) {
+		if (!strcmp(ent->key, key))
+			return ent;
+	}
+	return NULL;
+}
+
+static void __nscache_remove(struct nscache_ent *ent)
+{
+	SLIST_REMOVE(nscache_bucket(ent->key), ent, nscache_ent, hash_link);
+	TAILQ_REMOVE(&nscache_lru, ent, lru_link);
+	nscache_nr_ents--;
+	free(ent->key);
+	free(ent->answer);
+	free(ent);
+}
+
+/* Looks up key.  On a hit, copies up to buf_sz - 1 bytes of the answer into
+ * buf, null-terminates it, and returns the answer's length.  A cached failure
+ * returns -1 and sets errstr to the original error.  Returns -2 on a miss. */
+int nscache_lookup(const char *key, char *buf, size_t buf_sz)
+{
+	struct nscache_ent *ent;
+	int ret = -2;
+
+	run_once(nscache_init());
+	uth_mutex_lock(nscache_mtx);
+	ent = __nscache_find(key);
+	if (!ent)
+		goto out;
+	if (ent->expiry <= nscache_now()) {
+		__nscache_remove(ent);
+		goto out;
+	}
+	TAILQ_REMOVE(&nscache_lru, ent, lru_link);
+	TAILQ_INSERT_HEAD(&nscache_lru, ent, lru_link);
+	if (ent->negative) {
+		werrstr("%s", ent->answer);
+		errno = ENOENT;
+		ret = -1;
+		goto out;
+	}
+	ret = MIN(ent->len, buf_sz - 1);
+	memcpy(buf, ent->answer, ret);
+	buf[ret] = 0;
+	ret = ent->len;
+out:
+	uth_mutex_unlock(nscache_mtx);
+	return ret;
+}
+
+static void nscache_add(const char *key, const char *answer, size_t len,
+                        bool negative)
+{
+	struct nscache_ent *ent, *old;
+	unsigned int ttl = negative ? nscache_neg_ttl : nscache_ttl;
+
+	if (!ttl)
+		return;
+	ent = malloc(sizeof(struct nscache_ent));
+	if (!ent)
+		return;
+	ent->key = strdup(key);
+	ent->answer = malloc(len + 1);
+	if (!ent->key || !ent->answer) {
+		free(ent->key);
+		free(ent->answer);
+		free(ent);
+		return;
+	}
+	memcpy(ent->answer, answer, len);
+	ent->answer[len] = 0;
+	ent->len = len;
+	ent->negative = negative;
+	ent->expiry = nscache_now() + ttl;
+	run_once(nscache_init());
+	uth_mutex_lock(nscache_mtx);
+	/* Someone could have raced with us to look it up */
+	old = __nscache_find(key);
+	if (old)
+		__nscache_remove(old);
+	if (nscache_nr_ents == NSCACHE_MAX_ENTS)
+		__nscache_remove(TAILQ_LAST(&nscache_lru, nscache_tailq));
+	SLIST_INSERT_HEAD(nscache_bucket(key), ent, hash_link);
+	TAILQ_INSERT_HEAD(&nscache_lru, ent, lru_link);
+	nscache_nr_ents++;
+	uth_mutex_unlock(nscache_mtx);
+}
+
+void nscache_insert(const char *key, const char *answer, size_t len)
+{
+	nscache_add(key, answer, len, FALSE);
+}
+
+/* Caches a failed lookup of key, with the current errstr. */
+void nscache_insert_neg(const char *key)
+{
+	char *err = errstr();
+
+	nscache_add(key, err, strlen(err), TRUE);
+}
+
+/* Drops key, e.g. when none of its addresses worked. */
+void nscache_remove(const char *key)
+{
+	struct nscache_ent *ent;
+
+	run_once(nscache_init());
+	uth_mutex_lock(nscache_mtx);
+	ent = __nscache_find(key);
+	if (ent)
+		__nscache_remove(ent);
+	uth_mutex_unlock(nscache_mtx);
+}
+
+void nscache_flush(void)
+{
+	run_once(nscache_init());
+	uth_mutex_lock(nscache_mtx);
+	while (!TAILQ_EMPTY(&nscache_lru))
+		__nscache_remove(TAILQ_FIRST(&nscache_lru));
+	uth_mutex_unlock(nscache_mtx);
+}
+
+/* Sets the TTLs, in seconds, for new entries.  0 turns that kind off. */
+void nscache_set_ttl(unsigned int ttl, unsigned int neg_ttl)
+{
+	nscache_ttl = ttl;
+	nscache_neg_ttl = neg_ttl;
+}
@@ -12,25 +12,25 @@
  *
  * The problem is that we want to detect a level status (e.g. socket is
  * readable) with an edge event (e.g. socket *becomes* readable).  To do this,
- * when someone initially selects, the FD gets tracked with epoll and we
- * immediately return saying the FD is ready for whatever they asked for.  This
- * is usually not true, and the application will need to poll all of its FDs
- * once after the initial select() call.  Subsequent selects() will still be
- * tracking the FD in the epoll set.  If any edge events that come after the
- * poll (which eventually returns EAGAIN) will be caught by epoll, and a
- * subsequent select will wake up (or never block in the first place) due to the
- * reception of that edge event.
+ * when someone initially selects on an FD, the FD gets tracked with epoll and
+ * we immediately say the FD is ready for whatever they asked for.  This is
+ * usually not true, and the application will need to poll the FD until it
+ * gets EAGAIN.  After that, edge events are caught by epoll and saved in a
+ * pending set, per type (read/write/except), until a select() asks about that
+ * FD and type.  select() reports only those, so once an app's FDs are tracked,
+ * a select() call costs the number of ready FDs, plus a scan of the caller's
+ * fd_sets, and no syscalls if something is already pending.
  *
  * We maintain one FD set per program.  It tracks *any* FD being tracked by
  * *any* select call.  Regardless of whether the user asked for
- * read/write/except, the FD gets watched for anything until it closes.  This
- * will result in spurious wakeups.
+ * read/write/except, the FD gets watched for anything until it closes.
  *
- * One issue with the global FD set is that one thread may consume the epoll
- * events intended for another thread.  To get around this, only one thread is
- * the actual epoller, and the others block on a mutex.  An alternative is to
- * use a per-thread FD set, using TLS, but not every 2LS uses TLS, and
- * performance is not a concern for code using select().
+ * With a global FD set, one thread may consume the epoll events intended for
+ * another thread.  Since events go into the global pending sets, no event is
+ * lost; the other thread just needs to get a chance to look.  Only one thread
+ * at a time blocks in epoll_wait(), holding sleep_mtx.  If it wakes up for
+ * someone else's FDs, it hands sleep_mtx off (the mutex is FIFO) and gets back
+ * in line.
  *
  * Notes:
  * - pselect might be racy
@@ -38,6 +38,8 @@
  *   select use it as a timer only.  if that comes up, we can expand this.
  * - if you epoll or FD tap an FD, then try to use select on it, you'll get an
  *   error (only one tap per FD).  select() only knows about the FDs in its set.
+ * - if an app doesn't drain an FD to EAGAIN after select() says it is ready,
+ *   it may not hear about that FD again until there is new activity.
  */
 
 #include <sys/select.h>
@@ -47,17 +49,22 @@
 
 #include <ros/common.h>
 #include <parlib/uthread.h>
+#include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
 #include <sys/close_cb.h>
 #include <sys/epoll.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
 
 static int epoll_fd;
+/* These are protected by fdset_mtx */
 static fd_set all_fds;
+static fd_set pend_rd, pend_wr, pend_ex;
+static bool epolling;
 static uth_mutex_t fdset_mtx;
-static struct uthread *owner;
 static uth_mutex_t sleep_mtx;
 
 static bool fd_is_set(unsigned int fd, fd_set *set)
@@ -79,6 +86,9 @@ static void select_fd_closed(int fd)
 	 * epoll set, since that will happen automatically on close(). */
 	uth_mutex_lock(fdset_mtx);
 	FD_CLR(fd, &all_fds);
+	FD_CLR(fd, &pend_rd);
+	FD_CLR(fd, &pend_wr);
+	FD_CLR(fd, &pend_ex);
 	uth_mutex_unlock(fdset_mtx);
 }
 
@@ -103,13 +113,169 @@ static int select_tv_to_ep_timeout(struct timeval *tv)
 	return tv->tv_sec * 1000 + DIV_ROUND_UP(tv->tv_usec, 1000);
 }
 
+/* Starts tracking any FDs in the caller's sets that we aren't tracking yet.
+ * Since we don't know their state, they are pending for everything.  Called
+ * with fdset_mtx held. */
+static int select_track_fds(int nfds, fd_set *readfds, fd_set *writefds,
+                            fd_set *exceptfds)
+{
+	struct epoll_ctl_op *ops;
+	int nr_ops = 0;
+	int ret, done = 0;
+
+	for (int i = 0; i < nfds; i++) {
+		if ((fd_is_set(i, readfds) || fd_is_set(i, writefds) ||
+		    fd_is_set(i, exceptfds)) && !fd_is_set(i, &all_fds))
+			nr_ops++;
+	}
+	if (!nr_ops)
+		return 0;
+	ops = malloc(sizeof(struct epoll_ctl_op) * nr_ops);
+	if (!ops) {
+		errno = ENOMEM;
+		return -1;
+	}
+	nr_ops = 0;
+	for (int i = 0; i < nfds; i++) {
+		if ((fd_is_set(i, readfds) || fd_is_set(i, writefds) ||
+		    fd_is_set(i, exceptfds)) && !fd_is_set(i, &all_fds)) {
+			ops[nr_ops].op = EPOLL_CTL_ADD;
+			ops[nr_ops].fd = i;
+			/* FDs that we track for *any* reason with select will be
+			 * tracked for *all* reasons with epoll. */
+			ops[nr_ops].event.events = EPOLLET | EPOLLIN | EPOLLOUT |
+			                           EPOLLHUP | EPOLLERR;
+			ops[nr_ops].event.data.fd = i;
+			nr_ops++;
+		}
+	}
+	while (done < nr_ops) {
+		ret = epoll_ctl_batch(epoll_fd, ops + done, nr_ops - done);
+		if (ret < 0)
+			break;
+		done += ret;
+		if (done == nr_ops)
+			break;
+		/* We might have failed because we tried to set up too many FD tap
+		 * types.  Listen FDs, for instance, can only be tapped for READABLE
+		 * and HANGUP.  Let's try for one of those. */
+		if (errno != ENOSYS)
+			break;
+		ops[done].event.events = EPOLLET | EPOLLIN | EPOLLHUP;
+		if (epoll_ctl_batch(epoll_fd, ops + done, 1) != 1)
+			break;
+		done++;
+	}
+	for (int i = 0; i < done; i++) {
+		FD_SET(ops[i].fd, &all_fds);
+		FD_SET(ops[i].fd, &pend_rd);
+		FD_SET(ops[i].fd, &pend_wr);
+		FD_SET(ops[i].fd, &pend_ex);
+	}
+	free(ops);
+	return done == nr_ops ? 0 : -1;
+}
+
+/* Records epoll events in the pending sets.  Called with fdset_mtx held. */
+static void select_note_events(struct epoll_event *ep_results, int nr)
+{
+	int fd;
+
+	for (int i = 0; i < nr; i++) {
+		fd = ep_results[i].data.fd;
+		if (!fd_is_set(fd, &all_fds))
+			continue;
+		if (ep_results[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			FD_SET(fd, &pend_rd);
+		if (ep_results[i].events & (EPOLLOUT | EPOLLERR))
+			FD_SET(fd, &pend_wr);
+		if (ep_results[i].events & (EPOLLPRI | EPOLLERR))
+			FD_SET(fd, &pend_ex);
+	}
+}
+
+/* Moves the caller's pending FDs from the pending set into out, a word at a
+ * time.  Returns the number moved.  Called with fdset_mtx held. */
+static int select_take_pending(int nfds, fd_set *set, fd_set *pend,
+                               fd_set *out)
+{
+	int nr_words = DIV_ROUND_UP(nfds, __NFDBITS);
+	__fd_mask ready;
+	int ret = 0;
+
+	if (!set)
+		return 0;
+	for (int i = 0; i < nr_words; i++) {
+		ready = __FDS_BITS(set)[i] & __FDS_BITS(pend)[i];
+		if (i == nr_words - 1 && nfds % __NFDBITS)
+			ready &= ((__fd_mask)1 << (nfds % __NFDBITS)) - 1;
+		__FDS_BITS(pend)[i] &= ~ready;
+		__FDS_BITS(out)[i] = ready;
+		ret += __builtin_popcountl(ready);
+	}
+	return ret;
+}
+
+/* Fills in the caller's sets with whatever is pending for them.  Returns the
+ * number of ready FDs, like select().  Called with fdset_mtx held. */
+static int select_collect(int nfds, fd_set *readfds, fd_set *writefds,
+                          fd_set *exceptfds)
+{
+	fd_set rd, wr, ex;
+	int ret;
+
+	FD_ZERO(&rd);
+	FD_ZERO(&wr);
+	FD_ZERO(&ex);
+	ret = select_take_pending(nfds, readfds, &pend_rd, &rd);
+	ret += select_take_pending(nfds, writefds, &pend_wr, &wr);
+	ret += select_take_pending(nfds, exceptfds, &pend_ex, &ex);
+	if (!ret)
+		return 0;
+	if (readfds)
+		*readfds = rd;
+	if (writefds)
+		*writefds = wr;
+	if (exceptfds)
+		*exceptfds = ex;
+	return ret;
+}
+
+static void select_clear_sets(fd_set *readfds, fd_set *writefds,
+                              fd_set *exceptfds)
+{
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+}
+
+/* Waits up to ep_timeout for epoll events and puts them in the pending sets.
+ * Called with sleep_mtx held. */
+static void select_harvest(struct epoll_event *ep_results, int ep_timeout)
+{
+	int nr;
+
+	/* Need to check for up to FD_SETSIZE - nfds isn't the size of all FDs
+	 * tracked; it's the size of only our current select call */
+	nr = epoll_wait(epoll_fd, ep_results, FD_SETSIZE, ep_timeout);
+	if (nr <= 0)
+		return;
+	uth_mutex_lock(fdset_mtx);
+	select_note_events(ep_results, nr);
+	uth_mutex_unlock(fdset_mtx);
+}
+
 int select(int nfds, fd_set *readfds, fd_set *writefds,
            fd_set *exceptfds, struct timeval *timeout)
 {
-	bool changed_set = FALSE;
-	struct epoll_event ep_ev;
 	struct epoll_event *ep_results;
 	int ep_timeout = select_tv_to_ep_timeout(timeout);
+	uint64_t deadline = 0;
+	bool skip_harvest;
+	int ret;
 
 	run_once(select_init());
 	/* good thing nfds is a signed int... */
@@ -117,72 +283,69 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 		errno = EINVAL;
 		return -1;
 	}
+	nfds = MIN(nfds, FD_SETSIZE);
 	uth_mutex_lock(fdset_mtx);
-	for (int i = 0; i < nfds; i++) {
-		if ((fd_is_set(i, readfds) || fd_is_set(i, writefds) ||
-		    fd_is_set(i, exceptfds)) && !fd_is_set(i, &all_fds)) {
-
-			changed_set = TRUE;
-			FD_SET(i, &all_fds);
-			/* FDs that we track for *any* reason with select will be
-			 * tracked for *all* reasons with epoll. */
-			ep_ev.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLHUP |
-			               EPOLLERR;
-			ep_ev.data.fd = i;
-			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, i, &ep_ev)) {
-				/* We might have failed because we tried to set up too many
-				 * FD tap types.  Listen FDs, for instance, can only be
-				 * tapped for READABLE and HANGUP.  Let's try for one of
-				 * those. */
-				if (errno == ENOSYS) {
-					ep_ev.events = EPOLLET | EPOLLIN | EPOLLHUP;
-					if (!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, i, &ep_ev))
-						continue;
-				}
-				/* Careful to unlock before calling perror.  perror calls
-				 * close, which calls our CB, which grabs the lock. */
-				uth_mutex_unlock(fdset_mtx);
-				perror("select epoll_ctl failed");
-				return -1;
-			}
-		}
+	if (select_track_fds(nfds, readfds, writefds, exceptfds)) {
+		/* Careful to unlock before calling perror.  perror calls close, which
+		 * calls our CB, which grabs the lock. */
+		uth_mutex_unlock(fdset_mtx);
+		perror("select epoll_ctl failed");
+		return -1;
 	}
+	ret = select_collect(nfds, readfds, writefds, exceptfds);
+	/* If someone is blocked in epoll_wait, they'll catch any events, so there's
+	 * no need for a poll to wait behind them. */
+	skip_harvest = epolling && !ep_timeout;
 	uth_mutex_unlock(fdset_mtx);
-	/* Since we just added some FD to our tracking set, we don't know if its
-	 * readable or not.  We'll only catch edge-triggered changes in the future.
-	 * We can spuriously tell the user all FDs are ready, and next time they
-	 * can block until there is edge activity. */
-	if (changed_set)
-		return nfds;
-	/* Since there is a global epoll set, we could have multiple threads
-	 * epolling at a time and one thread could consume the events that should
-	 * wake another thread.  We don't know when the 'other' thread last polled,
-	 * so we'll need to assume its event was consumed and just return.  If a
-	 * thread selects again and no other thread has since selected, then we know
-	 * no one consumed the events.  We use an 'owner' to track which thread most
-	 * recently selected.  We use a mutex so that the extra threads sleep. */
-	uth_mutex_lock(sleep_mtx);
-	if (owner != current_uthread) {
-		/* Could thrash, if we fight with another uth for owner */
-		owner = current_uthread;
-		uth_mutex_unlock(sleep_mtx);
-		return nfds;
+	if (ret)
+		return ret;
+	if (skip_harvest) {
+		select_clear_sets(readfds, writefds, exceptfds);
+		return 0;
 	}
-	/* Need to check for up to FD_SETSIZE - nfds isn't the size of all FDs
-	 * tracked; it's the size of only our current select call */
 	ep_results = malloc(sizeof(struct epoll_event) * FD_SETSIZE);
 	if (!ep_results) {
-		uth_mutex_unlock(sleep_mtx);
 		errno = ENOMEM;
 		return -1;
 	}
-	/* Don't care which ones were set; we'll just tell the user they all were
-	 * set.  If they can't handle that, this whole plan won't work. */
-	epoll_wait(epoll_fd, ep_results, FD_SETSIZE, ep_timeout);
+	if (ep_timeout > 0)
+		deadline = read_tsc() + msec2tsc(ep_timeout);
+	uth_mutex_lock(sleep_mtx);
+	while (1) {
+		uth_mutex_lock(fdset_mtx);
+		ret = select_collect(nfds, readfds, writefds, exceptfds);
+		epolling = !ret && ep_timeout;
+		uth_mutex_unlock(fdset_mtx);
+		if (ret || ep_timeout == 0)
+			break;
+		select_harvest(ep_results, ep_timeout);
+		uth_mutex_lock(fdset_mtx);
+		epolling = FALSE;
+		ret = select_collect(nfds, readfds, writefds, exceptfds);
+		uth_mutex_unlock(fdset_mtx);
+		if (ret)
+			break;
+		if (ep_timeout > 0) {
+			if (read_tsc() >= deadline)
+				break;
+			ep_timeout = MAX(tsc2msec(deadline - read_tsc()), 1);
+		}
+		/* Woke up for someone else's FDs.  Let them have a look. */
+		uth_mutex_unlock(sleep_mtx);
+		uth_mutex_lock(sleep_mtx);
+	}
+	if (ep_timeout == 0) {
+		select_harvest(ep_results, 0);
+		uth_mutex_lock(fdset_mtx);
+		ret = select_collect(nfds, readfds, writefds, exceptfds);
+		uth_mutex_unlock(fdset_mtx);
+	}
 	uth_mutex_unlock(sleep_mtx);
 	free(ep_results);
+	if (!ret)
+		select_clear_sets(readfds, writefds, exceptfds);
 	/* TODO: consider updating timeval.  It's not mandatory (POSIX). */
-	return nfds;
+	return ret;
 }
 
 int pselect(int nfds, fd_set *readfds, fd_set *writefds,
@@ -18,7 +18,8 @@
 
 static void nstrcpy(char*, char*, int);
 static void mkptrname(char*, char*, int);
-static struct ndbtuple *doquery(int, char *dn, char *type);
+static struct ndbtuple *doquery(int, char *dn, char *type, char *key);
+static struct ndbtuple *parseanswer(char *answer);
 
 /*
  *  search for a tuple that has the given 'attr=val' and also 'rattr=x'.
@@ -30,6 +31,8 @@ struct ndbtuple*
 dnsquery(char *net, char *val, char *type)
 {
 	char rip[128];
+	char key[256];
+	char answer[4096];
 	char *p;
 	struct ndbtuple *t;
 	int fd;
@@ -40,6 +43,19 @@ dnsquery(char *net, char *val, char *type)
 
 	if(net == NULL)
 		net = "/net";
+
+	/* answers and failures are cached per process, see iplib's nscache */
+	snprintf(key, sizeof(key), "%s/dns %s %s", net, val, type);
+	switch(nscache_lookup(key, answer, sizeof(answer))){
+	case -2:
+		break;
+	case -1:
+		return NULL;
+	default:
+		t = parseanswer(answer);
+		ndbsetmalloctag(t, getcallerpc(&net));
+		return t;
+	}
 	snprintf(rip, sizeof(rip), "%s/dns", net);
 	fd = open(rip, O_RDWR);
 	if(fd < 0){
@@ -81,9 +97,9 @@ dnsquery(char *net, char *val, char *type)
 	/* if this is a reverse lookup, first lookup the domain name */
 	if(strcmp(type, "ptr") == 0){
 		mkptrname(val, rip, sizeof rip);
-		t = doquery(fd, rip, "ptr");
+		t = doquery(fd, rip, "ptr", key);
 	} else
-		t = doquery(fd, val, type);
+		t = doquery(fd, val, type, key);
 
 	/*
 	 * TODO: make fd static and keep it open to reduce 9P traffic
@@ -136,21 +152,70 @@ nstrcpy(char *to, char *from, int len)
 	to[len-1] = 0;
 }
 
+/*
+ *  add the tuples in one line of answer to the list
+ */
+static void
+addline(char *buf, struct ndbtuple **first, struct ndbtuple **last)
+{
+	struct ndbtuple *t;
+
+	t = _ndbparseline(buf);
+	if(t == NULL)
+		return;
+	if(*first)
+		(*last)->entry = t;
+	else
+		*first = t;
+	*last = t;
+	while((*last)->entry)
+		*last = (*last)->entry;
+}
+
+/*
+ *  parse a cached answer, one line per rr
+ */
 static struct ndbtuple*
-doquery(int fd, char *dn, char *type)
+parseanswer(char *answer)
 {
 	char buf[1024];
+	char *nl;
 	int n;
-	struct ndbtuple *t, *first, *last;
+	struct ndbtuple *first, *last;
+
+	first = last = NULL;
+	for(; *answer; answer = nl){
+		nl = strchr(answer, '\n');
+		nl = nl ? nl + 1 : answer + strlen(answer);
+		n = MIN(nl - answer, sizeof(buf) - 2);
+		memcpy(buf, answer, n);
+		if(n == 0 || buf[n-1] != '\n')
+			buf[n++] = '\n';
+		buf[n] = 0;
+		addline(buf, &first, &last);
+	}
+	return first;
+}
+
+static struct ndbtuple*
+doquery(int fd, char *dn, char *type, char *key)
+{
+	char buf[1024];
+	char answer[4096];
+	int n, len;
+	struct ndbtuple *first, *last;
 
 	lseek(fd, 0, 0);
 	snprintf(buf, sizeof(buf), "!%s %s", dn, type);
-	if(write(fd, buf, strlen(buf)) < 0)
+	if(write(fd, buf, strlen(buf)) < 0){
+		nscache_insert_neg(key);
 		return NULL;
+	}
 		
 	lseek(fd, 0, 0);
 
 	first = last = NULL;
+	len = 0;
 	
 	for(;;){
 		n = read(fd, buf, sizeof(buf)-2);
@@ -163,21 +228,21 @@ doquery(int fd, char *dn, char *type)
 		/* check for the error condition */
 		if(buf[0] == '!'){
 			werrstr("%s", buf+1);
+			nscache_insert_neg(key);
 			return NULL;
 		}
 
-		t = _ndbparseline(buf);
-		if(t != NULL){
-			if(first)
-				last->entry = t;
-			else
-				first = t;
-			last = t;
+		/* save the raw answer for the cache, if it fits */
+		if(len >= 0 && len + n < sizeof(answer)){
+			memcpy(answer + len, buf, n);
+			len += n;
+		} else
+			len = -1;
 
-			while(last->entry)
-				last = last->entry;
-		}
+		addline(buf, &first, &last);
 	}
+	if(len > 0)
+		nscache_insert(key, answer, len);
 
 	ndbsetmalloctag(first, getcallerpc(&fd));
 	return first;
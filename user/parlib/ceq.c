@@ -46,6 +46,105 @@ void ceq_init(struct ceq *ceq, uint8_t op, size_t nr_events, size_t ring_sz)
 	atomic_init(&ceq->cons_pvt_idx, 0);
 	parlib_static_assert(sizeof(struct spin_pdr_lock) <= sizeof(ceq->u_lock));
 	spin_pdr_init((struct spin_pdr_lock*)&ceq->u_lock);
+	ceq->bitmap = 0;
+	ceq->summary = 0;
+}
+
+static size_t ceq_nr_words(struct ceq *ceq)
+{
+	return DIV_ROUND_UP(ceq->nr_events, CEQ_WORD_BITS);
+}
+
+static size_t ceq_nr_summary(struct ceq *ceq)
+{
+	return DIV_ROUND_UP(ceq_nr_words(ceq), CEQ_WORD_BITS);
+}
+
+/* The ring is unused in bitmap mode, but the rest of the CEQ code doesn't need
+ * to know that: it stays empty and never overflows. */
+void ceq_init_bitmap(struct ceq *ceq, uint8_t op, size_t nr_events)
+{
+	atomic_t *bitmap, *summary;
+
+	ceq_init(ceq, op, nr_events, 1);
+	bitmap = malloc(sizeof(atomic_t) * ceq_nr_words(ceq));
+	memset(bitmap, 0, sizeof(atomic_t) * ceq_nr_words(ceq));
+	summary = malloc(sizeof(atomic_t) * ceq_nr_summary(ceq));
+	memset(summary, 0, sizeof(atomic_t) * ceq_nr_summary(ceq));
+	ceq->summary = summary;
+	wmb();	/* the kernel checks bitmap first, then uses summary */
+	ceq->bitmap = bitmap;
+}
+
+static void ceq_word_or(atomic_t *word, long mask)
+{
+	long old;
+
+	do {
+		old = atomic_read(word);
+	} while (!atomic_cas(word, old, old | mask));
+}
+
+static void ceq_word_and(atomic_t *word, long mask)
+{
+	long old;
+
+	do {
+		old = atomic_read(word);
+	} while (!atomic_cas(word, old, old & mask));
+}
+
+/* Helper, claims one set bit from bitmap word w_idx, returning its index into
+ * the events array, or -1 if the word was empty.  Whoever empties a word
+ * clears its summary bit, then rechecks the word, in case a producer set a bit
+ * after we looked. */
+static int32_t get_bitmap_word_idx(struct ceq *ceq, size_t w_idx)
+{
+	atomic_t *word = &ceq->bitmap[w_idx];
+	atomic_t *sum = &ceq->summary[w_idx / CEQ_WORD_BITS];
+	long sum_bit = 1UL << (w_idx % CEQ_WORD_BITS);
+	long old, new = 0;
+
+	do {
+		old = atomic_read(word);
+		if (!old)
+			break;
+		new = old & (old - 1);	/* clear the lowest bit */
+	} while (!atomic_cas(word, old, new));
+	if (!new) {
+		ceq_word_and(sum, ~sum_bit);
+		/* cas/and provide the mb between the summary write and this read */
+		if (atomic_read(word))
+			ceq_word_or(sum, sum_bit);
+	}
+	if (!old)
+		return -1;
+	return w_idx * CEQ_WORD_BITS + __builtin_ctzl(old);
+}
+
+/* Helper, returns an index into the events array from the ceq bitmap.  -1 if
+ * the bitmap was empty when we looked.  Consumers start their scan in
+ * different places, so they don't all fight over the first set bit. */
+static int32_t get_bitmap_idx(struct ceq *ceq)
+{
+	size_t nr_summary = ceq_nr_summary(ceq);
+	size_t start = vcore_id() % nr_summary;
+	size_t s_idx;
+	long sum;
+	int32_t ret;
+
+	for (size_t i = 0; i < nr_summary; i++) {
+		s_idx = (start + i) % nr_summary;
+		sum = atomic_read(&ceq->summary[s_idx]);
+		while (sum) {
+			ret = get_bitmap_word_idx(ceq, s_idx * CEQ_WORD_BITS +
+			                          __builtin_ctzl(sum));
+			if (ret != -1)
+				return ret;
+			sum &= sum - 1;
+		}
+	}
+	return -1;
 }
 
 /* Helper, returns an index into the events array from the ceq ring.  -1 if the
@@ -121,7 +220,15 @@ static bool extract_ceq_msg(struct ceq *ceq, int32_t idx, struct event_msg *msg)
  * we started getting that we do not receive. */
 bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg)
 {
-	int32_t idx = get_ring_idx(ceq);
+	int32_t idx;
+
+	if (ceq->bitmap) {
+		idx = get_bitmap_idx(ceq);
+		if (idx == -1)
+			return FALSE;
+		return extract_ceq_msg(ceq, idx, msg);
+	}
+	idx = get_ring_idx(ceq);
 	if (idx == -1) {
 		if (!ceq->ring_overflowed)
 			return FALSE;
@@ -184,8 +291,19 @@ static bool __ceq_ring_is_empty(struct ceq *ceq)
 	                    atomic_read(&ceq->cons_pvt_idx));
 }
 
+static bool __ceq_bitmap_is_empty(struct ceq *ceq)
+{
+	for (size_t i = 0; i < ceq_nr_summary(ceq); i++) {
+		if (atomic_read(&ceq->summary[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
 bool ceq_is_empty(struct ceq *ceq)
 {
+	if (ceq->bitmap)
+		return __ceq_bitmap_is_empty(ceq);
 	if (!__ceq_ring_is_empty(ceq) ||
 	    ceq->ring_overflowed ||
 	    spin_pdr_locked((struct spin_pdr_lock*)&ceq->u_lock)) {
@@ -198,4 +316,6 @@ void ceq_cleanup(struct ceq *ceq)
 {
 	free(ceq->events);
 	free(ceq->ring);
+	free(ceq->bitmap);
+	free(ceq->summary);
 }
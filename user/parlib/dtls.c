@@ -23,12 +23,14 @@
 #include <parlib/spinlock.h>
 #include <parlib/dtls.h>
 #include <parlib/slab.h>
+#include <string.h>
 
-/* The current dymamic tls implementation uses a locked linked list
- * to find the key for a given thread. We should probably find a better way to
- * do this based on a custom lock-free hash table or something. */
-#include <sys/queue.h>
-#include <parlib/spinlock.h>
+/* Each thread finds its value for a key by indexing with the key's id: the
+ * first NUM_STATIC_KEYS values live in the thread's TLS, and the rest in
+ * second-level blocks of DTLS_BLOCK_SZ values, allocated the first time the
+ * thread sets a key in that block.  Only the thread itself touches its values,
+ * so get and set take no locks.  Key ids are never reused, so a value slot
+ * belongs to at most one key. */
 
 /* Define some number of static keys, for which the memory containing the keys
  * and the per-thread memory for the values associated with those keys is
@@ -36,6 +38,9 @@
  * "specific_1stblock" field embedded directly into its pthread structure for
  * pthread_get/specific() calls. */
 #define NUM_STATIC_KEYS 32
+#define DTLS_BLOCK_SZ 32
+#define DTLS_NR_BLOCKS 64
+#define DTLS_MAX_KEYS (NUM_STATIC_KEYS + DTLS_BLOCK_SZ * DTLS_NR_BLOCKS)
 
 /* The dynamic tls key structure */
 struct dtls_key {
@@ -45,35 +50,39 @@ struct dtls_key {
   void (*dtor)(void*);
 };
 
-/* The definition of a dtls_key list and its elements */
+/* A thread's value for a key.  key is NULL until the thread sets it. */
 struct dtls_value {
-  TAILQ_ENTRY(dtls_value) link;
   struct dtls_key *key;
   void *dtls;
-}; 
-TAILQ_HEAD(dtls_list, dtls_value);
+};
+
+struct dtls_block {
+  struct dtls_value values[DTLS_BLOCK_SZ];
+};
 
 /* A struct containing all of the per thread (i.e. vcore or uthread) data
  * associated with dtls */
 typedef struct dtls_data {
-  /* A per-thread list of dtls regions */
-  struct dtls_list list;
+  /* Highest key id this thread has set, or -1 */
+  int max_id;
   /* Memory to hold dtls values for the first NUM_STATIC_KEYS keys */
   struct dtls_value early_values[NUM_STATIC_KEYS];
+  /* Lazily allocated blocks for the rest of the keys */
+  struct dtls_block *blocks[DTLS_NR_BLOCKS];
 } dtls_data_t;
 
 /* A slab of dtls keys (global to all threads) */
 static struct kmem_cache *__dtls_keys_cache;
 
-/* A slab of values for use when mapping a dtls_key to its per-thread value */
-struct kmem_cache *__dtls_values_cache;
+/* A slab of second-level blocks of per-thread values */
+struct kmem_cache *__dtls_blocks_cache;
   
 static __thread dtls_data_t __dtls_data;
 static __thread bool __dtls_initialized = false;
 static struct dtls_key static_dtls_keys[NUM_STATIC_KEYS];
 static int num_dtls_keys = 0;
 
-/* Initialize the slab caches for allocating dtls keys and values. */
+/* Initialize the slab caches for allocating dtls keys and value blocks. */
 int dtls_cache_init()
 {
   /* Make sure this only runs once */
@@ -86,9 +95,9 @@ int dtls_cache_init()
   __dtls_keys_cache = kmem_cache_create("dtls_keys_cache",
     sizeof(struct dtls_key), __alignof__(struct dtls_key), 0, NULL, NULL);
 
-  /* Initialize the global cache of dtls_values */
-  __dtls_values_cache = kmem_cache_create("dtls_values_cache",
-    sizeof(struct dtls_value), __alignof__(struct dtls_value), 0, NULL, NULL);
+  /* Initialize the global cache of dtls_blocks */
+  __dtls_blocks_cache = kmem_cache_create("dtls_blocks_cache",
+    sizeof(struct dtls_block), __alignof__(struct dtls_block), 0, NULL, NULL);
 
   return 0;
 }
@@ -97,6 +106,7 @@ static dtls_key_t __allocate_dtls_key()
 {
   dtls_key_t key;
   int keyid = __sync_fetch_and_add(&num_dtls_keys, 1);
+  assert(keyid < DTLS_MAX_KEYS);
   if (keyid < NUM_STATIC_KEYS) {
     key = &static_dtls_keys[keyid];
   } else {
@@ -116,23 +126,29 @@ static void __maybe_free_dtls_key(dtls_key_t key)
     kmem_cache_free(__dtls_keys_cache, key);
 }
 
-static struct dtls_value *__allocate_dtls_value(struct dtls_data *dtls_data,
-                                                struct dtls_key *key)
+/* Returns the slot for id, or NULL if its block isn't allocated and alloc is
+ * false. */
+static inline struct dtls_value *__dtls_slot(dtls_data_t *dtls_data, int id,
+                                             bool alloc)
 {
-  struct dtls_value *v;
-  if (key->id < NUM_STATIC_KEYS) {
-    v = &dtls_data->early_values[key->id];
-  } else {
-    v = kmem_cache_alloc(__dtls_values_cache, 0);
-  }
-  assert(v);
-  return v;
-}
+  struct dtls_block *block;
+  int blk_idx;
 
-static void __free_dtls_value(struct dtls_value *v)
-{
-  if (v->key->id >= NUM_STATIC_KEYS)
-    kmem_cache_free(__dtls_values_cache, v);
+  if (id < NUM_STATIC_KEYS)
+    return &dtls_data->early_values[id];
+  id -= NUM_STATIC_KEYS;
+  blk_idx = id / DTLS_BLOCK_SZ;
+  block = dtls_data->blocks[blk_idx];
+  if (!block) {
+    if (!alloc)
+      return NULL;
+    dtls_cache_init();
+    block = kmem_cache_alloc(__dtls_blocks_cache, 0);
+    assert(block);
+    memset(block, 0, sizeof(struct dtls_block));
+    dtls_data->blocks[blk_idx] = block;
+  }
+  return &block->values[id % DTLS_BLOCK_SZ];
 }
 
 dtls_key_t dtls_key_create(dtls_dtor_t dtor)
@@ -154,44 +170,41 @@ static inline void *__get_dtls(dtls_data_t *dtls_data, dtls_key_t key)
 {
   assert(key);
 
-  struct dtls_value *v;
-  if (key->id < NUM_STATIC_KEYS) {
-    v = &dtls_data->early_values[key->id];
-    if (v->key != NULL)
-      return v->dtls;
-  } else {
-    TAILQ_FOREACH(v, &dtls_data->list, link)
-      if (v->key == key)
-        return v->dtls;
-  }
+  struct dtls_value *v = __dtls_slot(dtls_data, key->id, false);
+  if (v && v->key == key)
+    return v->dtls;
   return NULL;
 }
 
 static inline void __set_dtls(dtls_data_t *dtls_data, dtls_key_t key, void *dtls)
 {
   assert(key);
-  __sync_fetch_and_add(&key->ref_count, 1);
 
-  struct dtls_value *v = __get_dtls(dtls_data, key);
-  if (!v) {
-    v = __allocate_dtls_value(dtls_data, key);
+  struct dtls_value *v = __dtls_slot(dtls_data, key->id, true);
+  if (!v->key) {
+    /* Our slot holds a ref on the key until we exit */
+    __sync_fetch_and_add(&key->ref_count, 1);
     v->key = key;
-    TAILQ_INSERT_HEAD(&dtls_data->list, v, link);
+    if (key->id > dtls_data->max_id)
+      dtls_data->max_id = key->id;
   }
   v->dtls = dtls;
 }
 
 static inline void __destroy_dtls(dtls_data_t *dtls_data)
 {
- struct dtls_value *v,*n;
-  v = TAILQ_FIRST(&dtls_data->list);
-  while(v != NULL) {
+  struct dtls_value *v;
+
+  /* A dtor can set other keys, possibly raising max_id, so we reread it. */
+  for (int i = 0; i <= dtls_data->max_id; i++) {
+    v = __dtls_slot(dtls_data, i, false);
+    if (!v || !v->key)
+      continue;
     dtls_key_t key = v->key;
   
-	// The dtor must be called outside of a spinlock so that it can call
-	// code that may deschedule it for a while (i.e. a mutex). Probably a
-	// good idea anyway since it can be arbitrarily long and is written by the
-	// user. Note, there is a small race here on the valid field, whereby we
+	// The dtor can call code that may deschedule it for a while (i.e. a
+	// mutex), since it can be arbitrarily long and is written by the user.
+	// Note, there is a small race here on the valid field, whereby we
 	// may run a destructor on an invalid key. At least the keys memory wont
 	// be deleted though, as protected by the ref count. Any reasonable usage
 	// of this interface should safeguard that a key is never destroyed before
@@ -201,13 +214,17 @@ static inline void __destroy_dtls(dtls_data_t *dtls_data)
       v->dtls = NULL;
       key->dtor(dtls);
     }
+    v->key = NULL;
+    v->dtls = NULL;
     __maybe_free_dtls_key(key);
-
-    n = TAILQ_NEXT(v, link);
-    TAILQ_REMOVE(&dtls_data->list, v, link);
-    __free_dtls_value(v);
-    v = n;
   }
+  for (int i = 0; i < DTLS_NR_BLOCKS; i++) {
+    if (dtls_data->blocks[i]) {
+      kmem_cache_free(__dtls_blocks_cache, dtls_data->blocks[i]);
+      dtls_data->blocks[i] = NULL;
+    }
+  }
+  dtls_data->max_id = -1;
 }
 
 void set_dtls(dtls_key_t key, void *dtls)
@@ -220,7 +237,7 @@ void set_dtls(dtls_key_t key, void *dtls)
   }
   dtls_data = &__dtls_data;
   if(!initialized) {
-    TAILQ_INIT(&dtls_data->list);
+    dtls_data->max_id = -1;
   }
   __set_dtls(dtls_data, key, dtls);
 }
@@ -22,6 +22,7 @@
 #include <parlib/spinlock.h>
 #include <parlib/mcs.h>
 #include <parlib/poke.h>
+#include <parlib/timing.h>
 #include <sys/queue.h>
 #include <malloc.h>
 
@@ -319,6 +320,40 @@ bool extract_one_mbox_msg(struct event_mbox *ev_mbox, struct event_msg *ev_msg)
 	}
 }
 
+/* Event latency histograms, indexed by ev_type and then by log2 of the number
+ * of TSC ticks between the kernel posting a message and us running the
+ * handlers.  Only messages the kernel stamped (EVENT_TIMESTAMP, UCQ mboxes) are
+ * counted. */
+static atomic_t ev_lat_hist[MAX_NR_EVENT][EV_LAT_NR_BUCKETS];
+
+static void ev_lat_record(unsigned int ev_type, uint64_t post_tsc)
+{
+	uint64_t now = read_tsc();
+	unsigned int bucket = 0;
+
+	/* The TSCs of different cores can be slightly off */
+	if (now > post_tsc)
+		bucket = LOG2_DOWN(now - post_tsc);
+	bucket = MIN(bucket, EV_LAT_NR_BUCKETS - 1);
+	atomic_inc(&ev_lat_hist[ev_type][bucket]);
+}
+
+/* Copies out ev_type's latency histogram.  Bucket i counts the messages that
+ * took [2^i, 2^(i+1)) TSC ticks to get handled. */
+void ev_lat_get_hist(unsigned int ev_type, uint64_t hist[EV_LAT_NR_BUCKETS])
+{
+	assert(ev_type < MAX_NR_EVENT);
+	for (int i = 0; i < EV_LAT_NR_BUCKETS; i++)
+		hist[i] = atomic_read(&ev_lat_hist[ev_type][i]);
+}
+
+void ev_lat_reset_hist(unsigned int ev_type)
+{
+	assert(ev_type < MAX_NR_EVENT);
+	for (int i = 0; i < EV_LAT_NR_BUCKETS; i++)
+		atomic_set(&ev_lat_hist[ev_type][i], 0);
+}
+
 /* Attempts to handle a message.  Returns 1 if we dequeued a msg, 0 o/w. */
 int handle_one_mbox_msg(struct event_mbox *ev_mbox)
 {
@@ -330,6 +365,9 @@ int handle_one_mbox_msg(struct event_mbox *ev_mbox)
 	ev_type = local_msg.ev_type;
 	assert(ev_type < MAX_NR_EVENT);
 	printd("[event] UCQ (mbox %08p), ev_type: %d\n", ev_mbox, ev_type);
+	/* Other mboxes don't fill in ev_tsc */
+	if (ev_mbox->type == EV_MBOX_UCQ && local_msg.ev_tsc)
+		ev_lat_record(ev_type, local_msg.ev_tsc);
 	run_ev_handlers(ev_type, &local_msg);
 	return 1;
 }
@@ -548,6 +586,19 @@ void print_ev_msg(struct event_msg *msg)
 	printf("\targ4 (64): 0x%16x\n", msg->ev_arg4);
 }
 
+void print_ev_lat_hist(unsigned int ev_type)
+{
+	uint64_t hist[EV_LAT_NR_BUCKETS];
+
+	ev_lat_get_hist(ev_type, hist);
+	printf("Latency histogram for ev_type %d:\n", ev_type);
+	for (int i = 0; i < EV_LAT_NR_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		printf("\t< %8llu usec: %llu\n", tsc2usec(2ULL << i), hist[i]);
+	}
+}
+
 /* Uthreads blocking on event queues
  *
  * It'd be nice to have a uthread sleep until an event queue has some activity
@@ -603,6 +654,7 @@ struct uth_sleep_ctlr {
 struct evq_wakeup_ctlr {
 	struct wait_link_tailq		waiters;
 	struct spin_pdr_lock		lock;
+	bool						exclusive;
 };
 
 /* Up to MxN of these, N of them per uthread. */
@@ -661,11 +713,17 @@ void evq_wakeup_handler(struct event_queue *ev_q)
 	assert(ectlr);
 	spin_pdr_lock(&ectlr->lock);
 	/* Note we wake up all sleepers, even though only one is likely to get the
-	 * message.  See the notes in unlink_ectlr() for more info. */
+	 * message, unless the ectlr is exclusive.  See the notes in unlink_ectlr()
+	 * for more info. */
 	TAILQ_FOREACH(i, &ectlr->waiters, link_evq) {
+		/* Exclusive: skip uthreads that are already on their way */
+		if (ectlr->exclusive && i->uth_ctlr->check_evqs)
+			continue;
 		i->uth_ctlr->check_evqs = TRUE;
 		cmb();	/* order check write before poke (poke has atomic) */
 		poke(&i->uth_ctlr->poker, i->uth_ctlr);
+		if (ectlr->exclusive)
+			break;
 	}
 	spin_pdr_unlock(&ectlr->lock);
 }
@@ -688,6 +746,14 @@ void evq_remove_wakeup_ctlr(struct event_queue *ev_q)
 	ev_q->ev_handler = 0;
 }
 
+void evq_wakeup_ctlr_set_exclusive(struct event_queue *ev_q, bool exclusive)
+{
+	struct evq_wakeup_ctlr *ectlr = ev_q->ev_udata;
+
+	assert(ectlr);
+	ectlr->exclusive = exclusive;
+}
+
 static void link_uctlr_ectlr(struct uth_sleep_ctlr *uctlr,
                              struct evq_wakeup_ctlr *ectlr,
                              struct evq_wait_link *link)
@@ -712,13 +778,17 @@ static void link_uctlr_ectlr(struct uth_sleep_ctlr *uctlr,
  * single wake up, then when we detach from an ectlr, we need to peak in the
  * mbox to see if it is not empty, and conditionally run its handler again, such
  * that no uthread sits on a ectlr that has activity/pending messages (in
- * essence, level triggered). */
-static void unlink_ectlr(struct evq_wait_link *link)
+ * essence, level triggered).
+ *
+ * Exclusive ectlrs do the single wake up, for evqs with many waiters. */
+static void unlink_ectlr(struct evq_wait_link *link, struct event_queue *ev_q)
 {
 	struct evq_wakeup_ctlr *ectlr = link->evq_ctlr;
 	spin_pdr_lock(&ectlr->lock);
 	TAILQ_REMOVE(&ectlr->waiters, link, link_evq);
 	spin_pdr_unlock(&ectlr->lock);
+	if (ectlr->exclusive && !mbox_is_empty(ev_q->ev_mbox))
+		ev_q->ev_handler(ev_q);
 }
 
 /* Helper: polls all evqs once and extracts the first message available.  The
@@ -813,7 +883,7 @@ void uth_blockon_evqs_arr(struct event_msg *ev_msg,
 	 * adjust the notif_disabled_depth for the case where we don't yield. */
 	spin_pdr_unlock(&uctlr.in_use);
 	for (int i = 0; i < nr_evqs; i++)
-		unlink_ectlr(&linkage[i]);
+		unlink_ectlr(&linkage[i], evqs[i]);
 }
 
 /* ... are event_queue *s, nr_evqs of them.  This will block until it can
@@ -15,7 +15,11 @@
  * will probably scribble over your memory.  If you pick a value that is too
  * small, then the ring may overflow, triggering an O(n) scan of the events
  * array.  You could make it == nr_events, for reasonable behavior at the
- * expense of memory. */
+ * expense of memory.
+ *
+ * ceq_init_bitmap() sets up a CEQ without a ring, for many producers sending
+ * to one CEQ.  See ros/ceq.h.  Messages come out in ID order, not in the order
+ * they were sent. */
 
 #pragma once
 
@@ -32,6 +36,7 @@ __BEGIN_DECLS
 #define CEQ_DEFAULT_SZ 128
 
 void ceq_init(struct ceq *ceq, uint8_t op, size_t nr_events, size_t ring_sz);
+void ceq_init_bitmap(struct ceq *ceq, uint8_t op, size_t nr_events);
 bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg);
 bool ceq_is_empty(struct ceq *ceq);
 void ceq_cleanup(struct ceq *ceq);
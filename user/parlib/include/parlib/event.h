@@ -69,11 +69,21 @@ void ev_we_returned(bool were_handling_remotes);
 /* Debugging */
 void print_ev_msg(struct event_msg *msg);
 
+/* Latency from kernel post to handler, for ev_qs with EVENT_TIMESTAMP.  Bucket
+ * i of a histogram counts msgs that took [2^i, 2^(i+1)) TSC ticks. */
+#define EV_LAT_NR_BUCKETS		48
+void ev_lat_get_hist(unsigned int ev_type, uint64_t hist[EV_LAT_NR_BUCKETS]);
+void ev_lat_reset_hist(unsigned int ev_type);
+void print_ev_lat_hist(unsigned int ev_type);
+
 /* Uthreads blocking on event queues.  M uthreads can block on subsets of N
  * event queues.  The structs and details are buried in event.c.  We can move
  * some of them here if users need greater control over their evqs. */
 void evq_attach_wakeup_ctlr(struct event_queue *ev_q);
 void evq_remove_wakeup_ctlr(struct event_queue *ev_q);
+/* Wake one blocked uthread per handler run instead of all of them.  A uthread
+ * that leaves the evq with messages still in it passes the wakeup along. */
+void evq_wakeup_ctlr_set_exclusive(struct event_queue *ev_q, bool exclusive);
 /* Handler, attaches to the ev_q.  Most people won't need this directly. */
 void evq_wakeup_handler(struct event_queue *ev_q);
 void uth_blockon_evqs_arr(struct event_msg *ev_msg,
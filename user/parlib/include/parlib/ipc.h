@@ -0,0 +1,28 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Synchronous cross-process calls, where the caller's core goes with the call
+ * (sys_ipc_call()).  A client uthread blocks in ipc_call(); its vcore hands its
+ * core to the server, which runs the request on one of its vcores, in vcore
+ * context, and ipc_reply()s, handing the core back.  Neither side goes through
+ * the ksched.
+ *
+ * A request's event_msg carries:
+ * - ev_arg1: the client's reply ev_type
+ * - ev_arg2: the client's pid (filled in by the kernel)
+ * - ev_arg3: the client's call, echoed back in the reply
+ * - ev_arg4: the argument, e.g. an offset into a shared buffer (shmring.h)
+ * Replies carry the return value in ev_arg4. */
+
+#pragma once
+
+#include <parlib/event.h>
+
+__BEGIN_DECLS
+
+void ipc_client_init(unsigned int reply_ev_type);
+uint64_t ipc_call(int server_pid, unsigned int ev_type, uint64_t arg);
+void ipc_server_init(unsigned int ev_type, handle_event_t handler, void *data);
+void ipc_reply(struct event_msg *req, uint64_t ret);
+
+__END_DECLS
@@ -45,6 +45,8 @@ void 		*sys_mmap(void *addr, size_t length, int prot, int flags,
                       int fd, size_t offset);
 int			sys_provision(int pid, unsigned int res_type, long res_val);
 int         sys_notify(int pid, unsigned int ev_type, struct event_msg *u_msg);
+int         sys_ipc_call(int pid, unsigned int ev_type, uint16_t ev_arg1,
+                         void *ev_arg3, uint64_t ev_arg4);
 int         sys_self_notify(uint32_t vcoreid, unsigned int ev_type,
                             struct event_msg *u_msg, bool priv);
 int         sys_halt_core(unsigned int usec);
@@ -58,6 +60,8 @@ int         sys_abort_sysc_fd(int fd);
 int         sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
 
 void		syscall_async(struct syscall *sysc, unsigned long num, ...);
+void		syscall_async_batch(struct syscall *syscs, unsigned int nr);
+void		syscall_blockon_batch(struct syscall *syscs, unsigned int nr);
 
 /* Control variables */
 extern bool parlib_wants_to_be_mcp;	/* instructs the 2LS to be an MCP */
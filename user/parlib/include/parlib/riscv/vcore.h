@@ -77,6 +77,12 @@ static inline void pop_user_ctx(struct user_context *ctx, uint32_t vcoreid)
 	__pop_ros_tf(tf, vcoreid, &__pop_ros_tf_notifs);
 }
 
+/* Cooperative switches don't save us anything here. */
+static inline void pop_user_ctx_coop(struct user_context *ctx, uint32_t vcoreid)
+{
+	pop_user_ctx(ctx, vcoreid);
+}
+
 /* Like the regular pop_user_ctx, but this one doesn't check or clear
  * notif_pending. */
 static inline void pop_user_ctx_raw(struct user_context *ctx, uint32_t vcoreid)
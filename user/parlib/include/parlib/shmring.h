@@ -0,0 +1,55 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Shared-memory rings, for passing fixed-size messages between processes.  A
+ * ring lives in a named file in /dev/shm (KFS, backed by its page map), which
+ * each side mmaps MAP_SHARED.  Any number of producers, one consumer.
+ *
+ * The consumer tells the ring its pid and an event type.  A producer only
+ * sys_notify()s the consumer when its message is the one at the consumer's
+ * index, i.e. the ring was empty from the consumer's point of view.  While the
+ * consumer keeps up, no one enters the kernel.  The consumer handles ev_type
+ * however it likes (an ev_q and handler, see event.h), and drains the ring
+ * until shm_ring_recv() fails before waiting again. */
+
+#pragma once
+
+#include <parlib/arch/arch.h>
+#include <parlib/arch/atomic.h>
+#include <ros/common.h>
+
+__BEGIN_DECLS
+
+#define SHM_RING_DIR			"/dev/shm/"
+#define SHM_RING_MAGIC			0x5348524e
+
+struct shm_ring_slot {
+	uint64_t					seq;
+	uint8_t						data[];
+};
+
+struct shm_ring {
+	uint32_t					magic;
+	uint32_t					nr_slots;		/* power of two */
+	uint32_t					msg_sz;
+	uint32_t					slot_sz;
+	int							cons_pid;		/* 0 for no notifications */
+	unsigned int				ev_type;
+	atomic_t					prod_idx __attribute__((aligned(ARCH_CL_SIZE)));
+	uint64_t					cons_idx __attribute__((aligned(ARCH_CL_SIZE)));
+	uint8_t						slots[]
+	                            __attribute__((aligned(ARCH_CL_SIZE)));
+};
+
+size_t shm_ring_size(uint32_t nr_slots, uint32_t msg_sz);
+struct shm_ring *shm_ring_create(const char *name, uint32_t nr_slots,
+                                 uint32_t msg_sz);
+struct shm_ring *shm_ring_open(const char *name);
+void shm_ring_close(struct shm_ring *ring);
+int shm_ring_unlink(const char *name);
+void shm_ring_set_consumer(struct shm_ring *ring, unsigned int ev_type);
+bool shm_ring_send(struct shm_ring *ring, const void *msg, size_t len);
+bool shm_ring_recv(struct shm_ring *ring, void *msg);
+bool shm_ring_is_empty(struct shm_ring *ring);
+
+__END_DECLS
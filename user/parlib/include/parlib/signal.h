@@ -22,6 +22,13 @@ struct sigstate {
 	struct sigdata *data;
 };
 
+/* Counters for targeted signals, see uthread_signal(). */
+struct uthread_sig_stats {
+	uint64_t nr_sent;
+	uint64_t nr_ipis;
+	uint64_t nr_run;
+};
+
 /* A set of functions related to handling posix signals on akaros. The
  * implementation of these functions is 2LS specific. */
 struct signal_ops {
@@ -55,3 +62,4 @@ void uthread_prep_pending_signals(struct uthread *uthread);
 void uthread_prep_signal_from_fault(struct uthread *uthread,
                                     int signo, int code, void *addr);
 int uthread_signal(struct uthread *uthread, int signo);
+void uthread_signal_stats(int signo, struct uthread_sig_stats *stats);
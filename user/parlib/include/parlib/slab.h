@@ -25,6 +25,20 @@
  * pointer, and then pass over that data when we return the actual object's
  * address.  This also might fuck with alignment.
  *
+ * Like the kernel's, there is a magazine layer in front of the slabs (Bonwick
+ * and Adams, "Magazines and Vmem").  Each vcore has a loaded and a previous
+ * magazine of constructed objects, and the common alloc and free paths only
+ * touch the calling vcore's magazines, with notifs disabled so the uthread
+ * can't migrate.  We don't need a lock for them: if the vcore is preempted,
+ * no one else touches its magazines until it runs again.  When both are empty
+ * (alloc) or full (free), the vcore exchanges a magazine with the cache's depot
+ * under the depot's PDR lock.  Only when the depot can't help do we take the
+ * cache_lock and hit the slabs.  Caches created with KMC_NOMAG skip the layer.
+ *
+ * slab_malloc() and friends are a malloc-style front end over a few size
+ * classes of caches, for programs with lots of small objects (e.g. a C++
+ * operator new and delete).  Their buffers must be freed with slab_free().
+ *
  * Ported directly from the kernel's slab allocator. */
 
 #pragma once
@@ -33,6 +47,7 @@
 #include <ros/arch/mmu.h>
 #include <sys/queue.h>
 #include <parlib/arch/atomic.h>
+#include <parlib/arch/arch.h>
 #include <parlib/spinlock.h>
 
 __BEGIN_DECLS
@@ -42,6 +57,12 @@ __BEGIN_DECLS
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Rounds per magazine.  14 makes a magazine exactly two cache lines. */
+#define KMC_MAG_SZ 14
+
+/* Flags for kmem_cache_create */
+#define KMC_NOMAG			(1 << 0)	/* bypass the per-vcore magazines */
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -68,6 +89,32 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine) link;
+	unsigned long nr_rounds;
+	void *rounds[KMC_MAG_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* Per-vcore state for a kmem_cache.  Only accessed from its vcore, with notifs
+ * disabled.  Either magazine can be NULL.  prev is always full, empty, or
+ * NULL. */
+struct kmem_pcpu_cache {
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	unsigned long nr_allocs;
+	unsigned long nr_frees;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* The depot holds full and empty magazines for the whole cache. */
+struct kmem_depot {
+	struct spin_pdr_lock lock;
+	struct kmem_mag_slist full;
+	struct kmem_mag_slist empty;
+	unsigned long nr_full;
+	unsigned long nr_empty;
+};
+
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
@@ -82,6 +129,8 @@ struct kmem_cache {
 	void (*ctor)(void *, size_t);
 	void (*dtor)(void *, size_t);
 	unsigned long nr_cur_alloc;
+	struct kmem_pcpu_cache *pcpu_caches;	/* one per max_vcores() */
+	struct kmem_depot depot;
 };
 
 /* List of all kmem_caches, sorted in order of size */
@@ -101,6 +150,20 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf);
 void kmem_cache_init(void);
 void kmem_cache_reap(struct kmem_cache *cp);
 
+/* Small-object malloc on top of the caches.  Anything over SLAB_MALLOC_MAX
+ * goes to malloc. */
+#define SLAB_MALLOC_MAX (SLAB_LARGE_CUTOFF - sizeof(struct slab_malloc_hdr))
+
+struct slab_malloc_hdr {
+	struct kmem_cache *cache;		/* 0 if from malloc */
+	uintptr_t pad;					/* keeps the buffer 16-byte aligned */
+};
+
+void *slab_malloc(size_t size);
+void *slab_zalloc(size_t size);
+void *slab_realloc(void *buf, size_t size);
+void slab_free(void *buf);
+
 /* Debug */
 void print_kmem_cache(struct kmem_cache *kc);
 void print_kmem_slab(struct kmem_slab *slab);
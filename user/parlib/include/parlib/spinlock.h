@@ -76,4 +76,24 @@ void spin_pdr_lock(struct spin_pdr_lock *pdr_lock);
 void spin_pdr_unlock(struct spin_pdr_lock *pdr_lock);
 bool spin_pdr_locked(struct spin_pdr_lock *pdr_lock);
 
+/* Ticket PDR locks: FIFO, unlike spin_pdr locks, for when waiters would
+ * otherwise starve.  Waiters recover a preempted lockholder, and since a
+ * preempted waiter holds up everyone behind it, they recover whoever is next
+ * too.  See get_vcore_pdr_stats() for how often that happens. */
+#define TICKET_PDR_VCOREID_UNKNOWN ((uint32_t)-1)
+
+struct ticket_pdr_lock {
+	uint32_t next;
+	uint32_t owner;
+	uint32_t lockholder;
+};
+#define TICKET_PDR_INITIALIZER {0, 0, TICKET_PDR_VCOREID_UNKNOWN}
+
+void ticket_pdr_init(struct ticket_pdr_lock *lock);
+void __ticket_pdr_lock(struct ticket_pdr_lock *lock);
+void __ticket_pdr_unlock(struct ticket_pdr_lock *lock);
+void ticket_pdr_lock(struct ticket_pdr_lock *lock);
+void ticket_pdr_unlock(struct ticket_pdr_lock *lock);
+bool ticket_pdr_locked(struct ticket_pdr_lock *lock);
+
 __END_DECLS
@@ -20,4 +20,7 @@ uint64_t msec2tsc(uint64_t msec);
 uint64_t usec2tsc(uint64_t usec);
 uint64_t nsec2tsc(uint64_t nsec);
 
+/* Wall clock time since the epoch, read from the kernel's shared page */
+uint64_t epoch_nsec(void);
+
 __END_DECLS
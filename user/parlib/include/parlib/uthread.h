@@ -40,6 +40,8 @@ struct uthread {
 };
 extern __thread struct uthread *current_uthread;
 typedef void* uth_mutex_t;
+typedef void* uth_cond_var_t;
+typedef void* uth_rwlock_t;
 
 /* 2L-Scheduler operations.  Examples in pthread.c. */
 struct schedule_ops {
@@ -59,6 +61,10 @@ struct schedule_ops {
 	void (*mutex_unlock)(uth_mutex_t);
 	/* Functions event handling wants */
 	void (*preempt_pending)(void);
+	/* Cooperative switches: called in vcore context after a yield, when vcore
+	 * context has nothing else to do.  Return a uthread to run right away on
+	 * this vcore (as sched_entry() would), skipping vcore_entry(), or 0. */
+	struct uthread *(*thread_pick_next)(void);
 };
 extern struct schedule_ops *sched_ops;
 
@@ -76,7 +82,9 @@ void uthread_mcp_init(void);
 
 /* uthread_init() does the uthread initialization of a uthread that the caller
  * created.  Call this whenever you are "starting over" with a thread.  Pass in
- * attr, if you want to override any defaults. */
+ * attr, if you want to override any defaults.  To recycle a uthread without
+ * calling uthread_cleanup(), zero it but keep its tls_desc; uthread_init() will
+ * reuse (or free) the old TLS. */
 struct uth_thread_attr {
 	bool want_tls;		/* default, no */
 };
@@ -133,4 +141,34 @@ void uth_mutex_free(uth_mutex_t m);
 void uth_mutex_lock(uth_mutex_t m);
 void uth_mutex_unlock(uth_mutex_t m);
 
+/* Debugging: how often lockers of a default (non-2LS) mutex got it after
+ * spinning, and how often they had to block.  Returns FALSE if the 2LS has its
+ * own mutexes. */
+struct uth_mutex_stats {
+	unsigned long				nr_spun;
+	unsigned long				nr_blocked;
+};
+bool uth_mutex_get_stats(uth_mutex_t m, struct uth_mutex_stats *stats);
+
+/* Condition variables, for use with uth_mutexes.  Like pthreads, wait
+ * atomically unlocks the mutex and returns with it locked.  Signal and
+ * broadcast move waiters straight onto the mutex's wait list when they can
+ * (wait morphing), so a broadcast doesn't wake everyone just to have them block
+ * on the mutex. */
+uth_cond_var_t uth_cond_var_alloc(void);
+void uth_cond_var_free(uth_cond_var_t cv);
+void uth_cond_var_wait(uth_cond_var_t cv, uth_mutex_t m);
+void uth_cond_var_signal(uth_cond_var_t cv);
+void uth_cond_var_broadcast(uth_cond_var_t cv);
+
+/* Reader-writer locks that block.  Writers get preference over new readers,
+ * and a writer unlocking lets in all waiting readers. */
+uth_rwlock_t uth_rwlock_alloc(void);
+void uth_rwlock_free(uth_rwlock_t rwl);
+void uth_rwlock_rdlock(uth_rwlock_t rwl);
+bool uth_rwlock_try_rdlock(uth_rwlock_t rwl);
+void uth_rwlock_wrlock(uth_rwlock_t rwl);
+bool uth_rwlock_try_wrlock(uth_rwlock_t rwl);
+void uth_rwlock_unlock(uth_rwlock_t rwl);
+
 __END_DECLS
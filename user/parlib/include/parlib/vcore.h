@@ -52,11 +52,14 @@ void vcore_lib_init(void);
 void vcore_change_to_m(void);
 int vcore_request(long nr_new_vcores);
 void vcore_yield(bool preempt_pending);
+void vcore_ipc_call(int pid, unsigned int ev_type, uint16_t ev_arg1,
+                    void *ev_arg3, uint64_t ev_arg4);
 void vcore_reenter(void (*entry_func)(void));
 void enable_notifs(uint32_t vcoreid);
 void disable_notifs(uint32_t vcoreid);
 void vcore_idle(void);
 void ensure_vcore_runs(uint32_t vcoreid);
+void get_vcore_pdr_stats(uint64_t *preempted, uint64_t *recovered);
 void cpu_relax_vc(uint32_t vcoreid);
 uint32_t get_vcoreid(void);
 bool check_vcoreid(const char *str, uint32_t vcoreid);
@@ -221,6 +224,15 @@ static inline uint64_t vcore_account_uptime_nsec(uint32_t vcoreid)
 
 #endif // __PIC__
 
+/* Loads tls_desc, unless it is already loaded.  The loaded TCB's self pointer
+ * caches this vcore's FS base, and reading it is much cheaper than a write
+ * (wrfsbase or, without FSGSBASE, a syscall). */
+static inline void set_tls_desc_cached(void *tls_desc)
+{
+	if (get_tls_desc() != tls_desc)
+		set_tls_desc(tls_desc);
+}
+
 /* Switches into the TLS 'tls_desc'.  Capable of being called from either
  * uthread or vcore context.  Pairs with end_access_tls_vars(). */
 #define begin_access_tls_vars(tls_desc)                                        \
@@ -251,12 +263,12 @@ static inline uint64_t vcore_account_uptime_nsec(uint32_t vcoreid)
 		vcoreid = vcore_id();                                                  \
 	}                                                                          \
 	temp_tls_desc = get_tls_desc();                                            \
-	set_tls_desc(tls_desc);                                                    \
+	set_tls_desc_cached(tls_desc);                                             \
 	begin_safe_access_tls_vars();
 
 #define end_access_tls_vars()                                                  \
 	end_safe_access_tls_vars();                                                \
-	set_tls_desc(temp_tls_desc);                                               \
+	set_tls_desc_cached(temp_tls_desc);                                        \
 	if (!invcore) {                                                            \
 		/* Note we reenable migration before enabling notifs, which is reverse
 		 * from how we disabled notifs.  We must enabling migration before
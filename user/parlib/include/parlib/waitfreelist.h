@@ -4,18 +4,32 @@
  * See LICENSE for details.
  *
  * A wait-free unordered list data structure.
- * 
+ *
+ * The list is a chain of entries, each of which is a cache-line-aligned array
+ * of WFL_ENTRY_SLOTS slots, WFL_SLOTS_PER_LINE to a cache line.  A NULL slot is
+ * free.  Inserts and removes start scanning each entry at the calling vcore's
+ * cache line, so vcores working on the list at the same time mostly stay off
+ * each other's lines.  That's just a hint; uthreads can migrate.
+ *
+ * Entries are never freed until wfl_destroy(), so the list is as big as the
+ * most it ever held at once.
  */
 
 #pragma once
 
 #include <string.h>
+#include <parlib/arch/arch.h>
 
 __BEGIN_DECLS
 
+#define WFL_SLOTS_PER_LINE (ARCH_CL_SIZE / sizeof(void*))
+#define WFL_LINES_PER_ENTRY 4
+#define WFL_ENTRY_SLOTS (WFL_SLOTS_PER_LINE * WFL_LINES_PER_ENTRY)
+
 struct wfl_entry {
   struct wfl_entry *next;
-  void *data;
+  /* next is read-mostly, so keep it off the slots' lines */
+  void *slots[WFL_ENTRY_SLOTS] __attribute__((aligned(ARCH_CL_SIZE)));
 };
 
 struct wfl {
@@ -23,7 +37,7 @@ struct wfl {
   struct wfl_entry first;
 };
 
-#define WFL_INITIALIZER(list) {&(list).first, {0, 0}}
+#define WFL_INITIALIZER(list) {&(list).first, {0, {0}}}
 
 void wfl_init(struct wfl *list);
 void wfl_destroy(struct wfl *list);
@@ -32,12 +46,16 @@ size_t wfl_size(struct wfl *list);
 void wfl_insert(struct wfl *list, void *data);
 void *wfl_remove(struct wfl *list);
 size_t wfl_remove_all(struct wfl *list, void *data);
+/* Bulk versions: insert all nr items, or remove up to nr of them into data.
+ * wfl_remove_bulk() returns how many it removed. */
+void wfl_insert_bulk(struct wfl *list, void **data, size_t nr);
+size_t wfl_remove_bulk(struct wfl *list, void **data, size_t nr);
 
-/* Iterate over list.  Safe w.r.t. inserts, but not w.r.t. removals. */
+/* Iterate over list.  Safe w.r.t. inserts, but not w.r.t. removals.  This is
+ * two loops, so a break only ends the current entry. */
 #define wfl_foreach_unsafe(elm, list) \
-  for (struct wfl_entry *_p = (list)->head; \
-       elm = _p == NULL ? NULL : _p->data, _p != NULL; \
-       _p = _p->next) \
-    if (elm)
+  for (struct wfl_entry *_p = (list)->head; _p != NULL; _p = _p->next) \
+    for (size_t _i = 0; _i < WFL_ENTRY_SLOTS; _i++) \
+      if ((elm = _p->slots[_i]) != NULL)
 
 __END_DECLS
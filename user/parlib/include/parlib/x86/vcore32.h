@@ -193,6 +193,12 @@ static inline void pop_user_ctx(struct user_context *ctx, uint32_t vcoreid)
 		pop_sw_tf(&ctx->tf.sw_tf, vcoreid);
 }
 
+/* Cooperative switches don't save us anything here. */
+static inline void pop_user_ctx_coop(struct user_context *ctx, uint32_t vcoreid)
+{
+	pop_user_ctx(ctx, vcoreid);
+}
+
 /* Like the regular pop_user_ctx, but this one doesn't check or clear
  * notif_pending.  The only case where we use this is when an IRQ/notif
  * interrupts a uthread that is in the process of disabling notifs. */
@@ -134,21 +134,11 @@ static inline void pop_hw_tf(struct hw_trapframe *tf, uint32_t vcoreid)
 	              : "memory");
 }
 
-static inline void pop_sw_tf(struct sw_trapframe *sw_tf, uint32_t vcoreid)
+static inline void __pop_sw_tf_regs(struct sw_trapframe *sw_tf,
+                                    uint32_t vcoreid)
 {
 	struct preempt_data *vcpd = &__procdata.vcore_preempt_data[vcoreid];
-	/* Restore callee-saved FPU state.  We need to clear exceptions before
-	 * reloading the FP CW, in case the new CW unmasks any.  We also need to
-	 * reset the tag word to clear out the stack.
-	 *
-	 * The main issue here is that while our context was saved in an
-	 * ABI-complaint manner, we may be starting up on a somewhat random FPU
-	 * state.  Having gibberish in registers isn't a big deal, but some of the
-	 * FP environment settings could cause trouble.  If fnclex; emms isn't
-	 * enough, we could also save/restore the entire FP env with fldenv, or do
-	 * an fninit before fldcw. */
-	asm volatile ("ldmxcsr %0" : : "m"(sw_tf->tf_mxcsr));
-	asm volatile ("fnclex; emms; fldcw %0" : : "m"(sw_tf->tf_fpucw));
+
 	/* Basic plan: restore all regs, off rcx as the sw_tf.  Switch to the new
 	 * stack, save the PC so we can jump to it later.  Use clobberably
 	 * registers for the locations of sysc, notif_dis, and notif_pend. Once on
@@ -184,6 +174,42 @@ static inline void pop_sw_tf(struct sw_trapframe *sw_tf, uint32_t vcoreid)
 	              : "memory");
 }
 
+static inline void pop_sw_tf(struct sw_trapframe *sw_tf, uint32_t vcoreid)
+{
+	/* Restore callee-saved FPU state.  We need to clear exceptions before
+	 * reloading the FP CW, in case the new CW unmasks any.  We also need to
+	 * reset the tag word to clear out the stack.
+	 *
+	 * The main issue here is that while our context was saved in an
+	 * ABI-complaint manner, we may be starting up on a somewhat random FPU
+	 * state.  Having gibberish in registers isn't a big deal, but some of the
+	 * FP environment settings could cause trouble.  If fnclex; emms isn't
+	 * enough, we could also save/restore the entire FP env with fldenv, or do
+	 * an fninit before fldcw. */
+	asm volatile ("ldmxcsr %0" : : "m"(sw_tf->tf_mxcsr));
+	asm volatile ("fnclex; emms; fldcw %0" : : "m"(sw_tf->tf_fpucw));
+	__pop_sw_tf_regs(sw_tf, vcoreid);
+}
+
+/* Pops a SW context during a cooperative switch.  Everything that ran since the
+ * last uthread saved its context (vcore context, the 2LS) followed the ABI, so
+ * the FPU is not in a random state: the x87 stack is empty and there are no
+ * pending exceptions.  We only need to reload the control words, and only if
+ * they changed. */
+static inline void pop_sw_tf_coop(struct sw_trapframe *sw_tf, uint32_t vcoreid)
+{
+	uint32_t mxcsr;
+	uint16_t fpucw;
+
+	asm volatile ("stmxcsr %0" : "=m"(mxcsr));
+	asm volatile ("fnstcw %0" : "=m"(fpucw));
+	if (mxcsr != sw_tf->tf_mxcsr)
+		asm volatile ("ldmxcsr %0" : : "m"(sw_tf->tf_mxcsr));
+	if (fpucw != sw_tf->tf_fpucw)
+		asm volatile ("fnclex; fldcw %0" : : "m"(sw_tf->tf_fpucw));
+	__pop_sw_tf_regs(sw_tf, vcoreid);
+}
+
 /* Pops a user context, reanabling notifications at the same time.  A Userspace
  * scheduler can call this when transitioning off the transition stack.
  *
@@ -209,6 +235,15 @@ static inline void pop_user_ctx(struct user_context *ctx, uint32_t vcoreid)
 	assert(0);
 }
 
+/* Like pop_user_ctx, but for a cooperative switch between uthreads, where we
+ * can skip some of the FP work.  See pop_sw_tf_coop(). */
+static inline void pop_user_ctx_coop(struct user_context *ctx, uint32_t vcoreid)
+{
+	if (ctx->type == ROS_SW_CTX)
+		pop_sw_tf_coop(&ctx->tf.sw_tf, vcoreid);
+	pop_user_ctx(ctx, vcoreid);
+}
+
 /* Like the regular pop_user_ctx, but this one doesn't check or clear
  * notif_pending.  The only case where we use this is when an IRQ/notif
  * interrupts a uthread that is in the process of disabling notifs.
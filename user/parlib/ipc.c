@@ -0,0 +1,89 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Synchronous cross-process calls.  See ipc.h. */
+
+#include <parlib/ipc.h>
+#include <parlib/uthread.h>
+#include <parlib/vcore.h>
+#include <parlib/assert.h>
+
+struct ipc_call {
+	struct uthread				*uth;
+	int							server_pid;
+	unsigned int				ev_type;
+	uint64_t					arg;
+	uint64_t					ret;
+};
+
+static unsigned int ipc_reply_ev_type;
+
+/* The kernel sends to EVENT_VCORE_APPRO, which is the vcore it just started on
+ * the donated core, so the message is handled right where it arrives. */
+static void ipc_register(unsigned int ev_type, handle_event_t handler,
+                         void *data)
+{
+	struct event_queue *ev_q;
+
+	register_ev_handler(ev_type, handler, data);
+	ev_q = get_eventq(EV_MBOX_UCQ);
+	assert(ev_q);
+	ev_q->ev_flags = EVENT_IPI | EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP |
+	                 EVENT_VCORE_APPRO;
+	register_kevent_q(ev_q, ev_type);
+}
+
+static void handle_ipc_reply(struct event_msg *ev_msg, unsigned int ev_type,
+                             void *data)
+{
+	struct ipc_call *call;
+
+	assert(ev_msg);
+	call = (struct ipc_call*)ev_msg->ev_arg3;
+	call->ret = ev_msg->ev_arg4;
+	uthread_runnable(call->uth);
+}
+
+void ipc_client_init(unsigned int reply_ev_type)
+{
+	ipc_reply_ev_type = reply_ev_type;
+	ipc_register(reply_ev_type, handle_ipc_reply, 0);
+}
+
+static void __ipc_call_cb(struct uthread *uth, void *arg)
+{
+	struct ipc_call *call = (struct ipc_call*)arg;
+
+	call->uth = uth;
+	/* Blocked before we send, so the reply can't beat us */
+	uthread_has_blocked(uth, UTH_EXT_BLK_JUSTICE);
+	vcore_ipc_call(call->server_pid, call->ev_type, ipc_reply_ev_type, call,
+	               call->arg);
+}
+
+/* Calls server_pid with arg and blocks the calling uthread until it replies.
+ * Returns the server's return value. */
+uint64_t ipc_call(int server_pid, unsigned int ev_type, uint64_t arg)
+{
+	struct ipc_call call = {.server_pid = server_pid, .ev_type = ev_type,
+	                        .arg = arg};
+
+	assert(ipc_reply_ev_type);
+	uthread_yield(TRUE, __ipc_call_cb, &call);
+	return call.ret;
+}
+
+/* handler runs in vcore context for each request, and must ipc_reply() to it
+ * eventually. */
+void ipc_server_init(unsigned int ev_type, handle_event_t handler, void *data)
+{
+	ipc_register(ev_type, handler, data);
+}
+
+/* Replies to req, handing our core back to the client.  Call from vcore
+ * context, e.g. the request's handler.  Like vcore_ipc_call(), this does not
+ * return if the core went with the reply. */
+void ipc_reply(struct event_msg *req, uint64_t ret)
+{
+	vcore_ipc_call(req->ev_arg2, req->ev_arg1, 0, req->ev_arg3, ret);
+}
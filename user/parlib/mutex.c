@@ -2,8 +2,14 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details. */
 
-/* Generic Uthread Mutexes.  2LSs implement their own methods, but we need a
- * 2LS-independent interface and default implementation. */
+/* Generic Uthread Mutexes, CVs, and rwlocks.  2LSs implement their own mutex
+ * methods, but we need a 2LS-independent interface and default implementation.
+ *
+ * The default mutex is adaptive.  If the lock is held by a uthread that is
+ * running on another vcore, and that vcore isn't preempted, a locker spins for
+ * a while before blocking, since the owner will probably unlock soon and
+ * blocking costs a 2LS context switch.  Once someone is blocked, new lockers
+ * block too; unlock hands the mutex straight to the first waiter. */
 
 #include <parlib/uthread.h>
 #include <sys/queue.h>
@@ -21,8 +27,17 @@ struct uth_default_mtx {
 	struct spin_pdr_lock		lock;
 	TAILQ_HEAD(t, uth_mtx_link)	waiters;
 	bool						locked;
+	/* Hints for spinners: who has it and where they last ran */
+	struct uthread				*owner;
+	uint32_t					owner_vcoreid;
+	/* Stats, protected by lock */
+	unsigned long				nr_spun;
+	unsigned long				nr_blocked;
 };
 
+/* How many times we'll cpu_relax() waiting on a running owner */
+#define UTH_MTX_SPINS 1000
+
 static struct uth_default_mtx *uth_default_mtx_alloc(void)
 {
 	struct uth_default_mtx *mtx;
@@ -32,6 +47,10 @@ static struct uth_default_mtx *uth_default_mtx_alloc(void)
 	spin_pdr_init(&mtx->lock);
 	TAILQ_INIT(&mtx->waiters);
 	mtx->locked = FALSE;
+	mtx->owner = NULL;
+	mtx->owner_vcoreid = 0;
+	mtx->nr_spun = 0;
+	mtx->nr_blocked = 0;
 	return mtx;
 }
 
@@ -56,16 +75,49 @@ static void __mutex_cb(struct uthread *uth, void *arg)
 	spin_pdr_unlock(&mtx->lock);
 }
 
+/* Helper: is it worth spinning on mtx?  Only if the owner is running on some
+ * other vcore that is still online.  This is all racy; it's just a hint. */
+static bool __mtx_owner_running(struct uth_default_mtx *mtx)
+{
+	struct uthread *owner = ACCESS_ONCE(mtx->owner);
+	uint32_t vcoreid = ACCESS_ONCE(mtx->owner_vcoreid);
+
+	/* Not running yet, e.g. we just handed it to a waiter, or blocked */
+	if (!owner || (ACCESS_ONCE(owner->state) != UT_RUNNING))
+		return FALSE;
+	/* If it's on our vcore, it can't run while we spin */
+	if ((vcoreid == vcore_id()) || (vcoreid >= max_vcores()))
+		return FALSE;
+	return vcore_is_mapped(vcoreid) && !vcore_is_preempted(vcoreid);
+}
+
 static void uth_default_mtx_lock(struct uth_default_mtx *mtx)
 {
 	struct uth_mtx_link link;
+	unsigned int spins = 0;
 
 	spin_pdr_lock(&mtx->lock);
+	/* Spinning is pointless if there are waiters, since they'll get it first */
+	while (mtx->locked && TAILQ_EMPTY(&mtx->waiters) &&
+	       (spins < UTH_MTX_SPINS) && __mtx_owner_running(mtx)) {
+		/* Spin outside the lock, so the owner can unlock */
+		spin_pdr_unlock(&mtx->lock);
+		do {
+			cpu_relax();
+		} while (ACCESS_ONCE(mtx->locked) && (++spins < UTH_MTX_SPINS) &&
+		         __mtx_owner_running(mtx));
+		spin_pdr_lock(&mtx->lock);
+	}
 	if (!mtx->locked) {
 		mtx->locked = TRUE;
+		mtx->owner = current_uthread;
+		mtx->owner_vcoreid = vcore_id();
+		if (spins)
+			mtx->nr_spun++;
 		spin_pdr_unlock(&mtx->lock);
 		return;
 	}
+	mtx->nr_blocked++;
 	link.mtx = mtx;
 	link.uth = current_uthread;
 	TAILQ_INSERT_TAIL(&mtx->waiters, &link, next);
@@ -73,6 +125,8 @@ static void uth_default_mtx_lock(struct uth_default_mtx *mtx)
 	 * part in vcore context, since as soon as we unlock the uthread could
 	 * restart.  (atomically yield and unlock). */
 	uthread_yield(TRUE, __mutex_cb, &link);
+	/* The unlocker handed us the mutex.  Let spinners know where we are. */
+	mtx->owner_vcoreid = vcore_id();
 }
 
 static void uth_default_mtx_unlock(struct uth_default_mtx *mtx)
@@ -81,10 +135,13 @@ static void uth_default_mtx_unlock(struct uth_default_mtx *mtx)
 
 	spin_pdr_lock(&mtx->lock);
 	first = TAILQ_FIRST(&mtx->waiters);
-	if (first)
+	if (first) {
 		TAILQ_REMOVE(&mtx->waiters, first, next);
-	else
+		mtx->owner = first->uth;
+	} else {
 		mtx->locked = FALSE;
+		mtx->owner = NULL;
+	}
 	spin_pdr_unlock(&mtx->lock);
 	if (first)
 		uthread_runnable(first->uth);
@@ -123,3 +180,295 @@ void uth_mutex_unlock(uth_mutex_t m)
 	}
 	uth_default_mtx_unlock((struct uth_default_mtx*)m);
 }
+
+bool uth_mutex_get_stats(uth_mutex_t m, struct uth_mutex_stats *stats)
+{
+	struct uth_default_mtx *mtx = (struct uth_default_mtx*)m;
+
+	/* The 2LS's mutexes are its own business */
+	if (sched_ops->mutex_alloc)
+		return FALSE;
+	spin_pdr_lock(&mtx->lock);
+	stats->nr_spun = mtx->nr_spun;
+	stats->nr_blocked = mtx->nr_blocked;
+	spin_pdr_unlock(&mtx->lock);
+	return TRUE;
+}
+
+/* Condition variables.  A waiter's link can go on the CV's list and later on
+ * a default mutex's list, so it embeds a mutex link for the latter. */
+struct uth_default_cv;
+struct uth_cv_link {
+	TAILQ_ENTRY(uth_cv_link)	next;
+	struct uth_default_cv		*cv;
+	uth_mutex_t					mtx;
+	struct uth_mtx_link			mtx_link;
+	bool						got_mtx;	/* handed the mutex on wakeup */
+};
+
+struct uth_default_cv {
+	struct spin_pdr_lock		lock;
+	TAILQ_HEAD(cv_l, uth_cv_link) waiters;
+};
+
+uth_cond_var_t uth_cond_var_alloc(void)
+{
+	struct uth_default_cv *cv;
+
+	cv = malloc(sizeof(struct uth_default_cv));
+	assert(cv);
+	spin_pdr_init(&cv->lock);
+	TAILQ_INIT(&cv->waiters);
+	return (uth_cond_var_t)cv;
+}
+
+void uth_cond_var_free(uth_cond_var_t c)
+{
+	struct uth_default_cv *cv = (struct uth_default_cv*)c;
+
+	assert(TAILQ_EMPTY(&cv->waiters));
+	free(cv);
+}
+
+static void __cv_wait_cb(struct uthread *uth, void *arg)
+{
+	struct uth_cv_link *link = (struct uth_cv_link*)arg;
+
+	/* Same lock ordering as the mutex: the CV lock comes before the 2LS's. Once
+	 * we unlock the CV, a signaller could wake us, even before we unlock the
+	 * mutex.  That's fine; we don't touch link after unlocking. */
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	spin_pdr_unlock(&link->cv->lock);
+	/* We're on the CV, so no one can miss us once they get the mutex. */
+	uth_mutex_unlock(link->mtx);
+}
+
+void uth_cond_var_wait(uth_cond_var_t c, uth_mutex_t m)
+{
+	struct uth_default_cv *cv = (struct uth_default_cv*)c;
+	struct uth_cv_link link;
+
+	link.cv = cv;
+	link.mtx = m;
+	link.mtx_link.uth = current_uthread;
+	link.got_mtx = FALSE;
+	spin_pdr_lock(&cv->lock);
+	TAILQ_INSERT_TAIL(&cv->waiters, &link, next);
+	uthread_yield(TRUE, __cv_wait_cb, &link);
+	if (link.got_mtx) {
+		/* Morphed: the unlocker handed us the mutex */
+		((struct uth_default_mtx*)m)->owner_vcoreid = vcore_id();
+		return;
+	}
+	uth_mutex_lock(m);
+}
+
+/* Wakes the waiter on link, which is no longer on the CV.  If the mutex is a
+ * default mutex that is held, the waiter goes on its wait list instead, and
+ * will get the mutex handed to it.  If the mutex is free, the waiter gets it
+ * now. */
+static void __cv_wake_one(struct uth_cv_link *link)
+{
+	struct uth_default_mtx *mtx = (struct uth_default_mtx*)link->mtx;
+	struct uthread *uth = link->mtx_link.uth;
+
+	if (sched_ops->mutex_lock) {
+		/* 2LS mutex; we can't peek inside.  Waiter will relock. */
+		uthread_runnable(uth);
+		return;
+	}
+	spin_pdr_lock(&mtx->lock);
+	/* Once we set got_mtx and drop the lock, the waiter could run and return
+	 * (possibly before our uthread_runnable(), if the handoff wakes it). */
+	link->got_mtx = TRUE;
+	if (mtx->locked) {
+		link->mtx_link.mtx = mtx;
+		TAILQ_INSERT_TAIL(&mtx->waiters, &link->mtx_link, next);
+		spin_pdr_unlock(&mtx->lock);
+		return;
+	}
+	mtx->locked = TRUE;
+	mtx->owner = uth;
+	spin_pdr_unlock(&mtx->lock);
+	uthread_runnable(uth);
+}
+
+void uth_cond_var_signal(uth_cond_var_t c)
+{
+	struct uth_default_cv *cv = (struct uth_default_cv*)c;
+	struct uth_cv_link *link;
+
+	spin_pdr_lock(&cv->lock);
+	link = TAILQ_FIRST(&cv->waiters);
+	if (link)
+		TAILQ_REMOVE(&cv->waiters, link, next);
+	spin_pdr_unlock(&cv->lock);
+	if (link)
+		__cv_wake_one(link);
+}
+
+void uth_cond_var_broadcast(uth_cond_var_t c)
+{
+	struct uth_default_cv *cv = (struct uth_default_cv*)c;
+	struct uth_cv_link *link, *next;
+	TAILQ_HEAD(cv_l, uth_cv_link) restartees = TAILQ_HEAD_INITIALIZER(restartees);
+
+	spin_pdr_lock(&cv->lock);
+	TAILQ_CONCAT(&restartees, &cv->waiters, next);
+	spin_pdr_unlock(&cv->lock);
+	/* next, since a woken waiter's link (on its stack) can go away */
+	for (link = TAILQ_FIRST(&restartees); link; link = next) {
+		next = TAILQ_NEXT(link, next);
+		__cv_wake_one(link);
+	}
+}
+
+/* Reader-writer locks.  The lock is either free (!nr_readers && !writer),
+ * held by nr_readers readers, or held by a writer.  Unlockers hand the lock to
+ * waiters, so woken waiters already hold it. */
+struct uth_rwl_link {
+	TAILQ_ENTRY(uth_rwl_link)	next;
+	struct uth_default_rwlock	*rwl;
+	struct uthread				*uth;
+};
+TAILQ_HEAD(rwl_l, uth_rwl_link);
+
+struct uth_default_rwlock {
+	struct spin_pdr_lock		lock;
+	unsigned int				nr_readers;
+	bool						has_writer;
+	struct rwl_l				readers;
+	struct rwl_l				writers;
+};
+
+uth_rwlock_t uth_rwlock_alloc(void)
+{
+	struct uth_default_rwlock *rwl;
+
+	rwl = malloc(sizeof(struct uth_default_rwlock));
+	assert(rwl);
+	spin_pdr_init(&rwl->lock);
+	rwl->nr_readers = 0;
+	rwl->has_writer = FALSE;
+	TAILQ_INIT(&rwl->readers);
+	TAILQ_INIT(&rwl->writers);
+	return (uth_rwlock_t)rwl;
+}
+
+void uth_rwlock_free(uth_rwlock_t r)
+{
+	struct uth_default_rwlock *rwl = (struct uth_default_rwlock*)r;
+
+	assert(!rwl->nr_readers && !rwl->has_writer);
+	assert(TAILQ_EMPTY(&rwl->readers) && TAILQ_EMPTY(&rwl->writers));
+	free(rwl);
+}
+
+static void __rwlock_cb(struct uthread *uth, void *arg)
+{
+	struct uth_rwl_link *link = (struct uth_rwl_link*)arg;
+
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	spin_pdr_unlock(&link->rwl->lock);
+}
+
+static bool __rwlock_can_read(struct uth_default_rwlock *rwl)
+{
+	/* Writers waiting get preference, so they don't starve */
+	return !rwl->has_writer && TAILQ_EMPTY(&rwl->writers);
+}
+
+void uth_rwlock_rdlock(uth_rwlock_t r)
+{
+	struct uth_default_rwlock *rwl = (struct uth_default_rwlock*)r;
+	struct uth_rwl_link link;
+
+	spin_pdr_lock(&rwl->lock);
+	if (__rwlock_can_read(rwl)) {
+		rwl->nr_readers++;
+		spin_pdr_unlock(&rwl->lock);
+		return;
+	}
+	link.rwl = rwl;
+	link.uth = current_uthread;
+	TAILQ_INSERT_TAIL(&rwl->readers, &link, next);
+	uthread_yield(TRUE, __rwlock_cb, &link);
+}
+
+bool uth_rwlock_try_rdlock(uth_rwlock_t r)
+{
+	struct uth_default_rwlock *rwl = (struct uth_default_rwlock*)r;
+	bool ret = FALSE;
+
+	spin_pdr_lock(&rwl->lock);
+	if (__rwlock_can_read(rwl)) {
+		rwl->nr_readers++;
+		ret = TRUE;
+	}
+	spin_pdr_unlock(&rwl->lock);
+	return ret;
+}
+
+void uth_rwlock_wrlock(uth_rwlock_t r)
+{
+	struct uth_default_rwlock *rwl = (struct uth_default_rwlock*)r;
+	struct uth_rwl_link link;
+
+	spin_pdr_lock(&rwl->lock);
+	if (!rwl->nr_readers && !rwl->has_writer) {
+		rwl->has_writer = TRUE;
+		spin_pdr_unlock(&rwl->lock);
+		return;
+	}
+	link.rwl = rwl;
+	link.uth = current_uthread;
+	TAILQ_INSERT_TAIL(&rwl->writers, &link, next);
+	uthread_yield(TRUE, __rwlock_cb, &link);
+}
+
+bool uth_rwlock_try_wrlock(uth_rwlock_t r)
+{
+	struct uth_default_rwlock *rwl = (struct uth_default_rwlock*)r;
+	bool ret = FALSE;
+
+	spin_pdr_lock(&rwl->lock);
+	if (!rwl->nr_readers && !rwl->has_writer) {
+		rwl->has_writer = TRUE;
+		ret = TRUE;
+	}
+	spin_pdr_unlock(&rwl->lock);
+	return ret;
+}
+
+void uth_rwlock_unlock(uth_rwlock_t r)
+{
+	struct uth_default_rwlock *rwl = (struct uth_default_rwlock*)r;
+	struct rwl_l restartees = TAILQ_HEAD_INITIALIZER(restartees);
+	struct uth_rwl_link *link, *next;
+
+	spin_pdr_lock(&rwl->lock);
+	if (rwl->has_writer) {
+		rwl->has_writer = FALSE;
+		/* Let all the readers in, so a stream of writers can't starve them */
+		if (!TAILQ_EMPTY(&rwl->readers)) {
+			TAILQ_FOREACH(link, &rwl->readers, next)
+				rwl->nr_readers++;
+			TAILQ_CONCAT(&restartees, &rwl->readers, next);
+		}
+	} else {
+		assert(rwl->nr_readers);
+		rwl->nr_readers--;
+	}
+	if (!rwl->nr_readers && !rwl->has_writer &&
+	    (link = TAILQ_FIRST(&rwl->writers))) {
+		TAILQ_REMOVE(&rwl->writers, link, next);
+		rwl->has_writer = TRUE;
+		TAILQ_INSERT_TAIL(&restartees, link, next);
+	}
+	spin_pdr_unlock(&rwl->lock);
+	/* next, since a woken waiter's link (on its stack) can go away */
+	for (link = TAILQ_FIRST(&restartees); link; link = next) {
+		next = TAILQ_NEXT(link, next);
+		uthread_runnable(link->uth);
+	}
+}
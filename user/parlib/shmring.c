@@ -0,0 +1,230 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Shared-memory rings.  See shmring.h.
+ *
+ * Each slot has a sequence number, which says whose turn it is.  Slot pos is
+ * free for the producer of index pos when seq == pos, and holds pos's message
+ * for the consumer when seq == pos + 1.  Producers race for prod_idx with a
+ * CAS, fill their slot, then publish it by bumping seq.  The consumer frees the
+ * slot for the next lap by setting seq to pos + nr_slots.
+ *
+ * The notification is Dekker-style: the producer stores seq then loads
+ * cons_idx, and the consumer stores cons_idx then loads seq.  Either the
+ * consumer sees the message, or the producer sees the consumer waiting on it
+ * and notifies.  Sometimes both happen, which just means a spurious event. */
+
+#include <parlib/shmring.h>
+#include <parlib/parlib.h>
+#include <parlib/common.h>
+#include <parlib/assert.h>
+#include <ros/arch/membar.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+static struct shm_ring_slot *shm_ring_slot(struct shm_ring *ring, uint64_t pos)
+{
+	size_t off = (pos & (ring->nr_slots - 1)) * ring->slot_sz;
+
+	return (struct shm_ring_slot*)(ring->slots + off);
+}
+
+static uint32_t shm_ring_slot_sz(uint32_t msg_sz)
+{
+	return ROUNDUP(sizeof(struct shm_ring_slot) + msg_sz, sizeof(uint64_t));
+}
+
+size_t shm_ring_size(uint32_t nr_slots, uint32_t msg_sz)
+{
+	return ROUNDUP(sizeof(struct shm_ring) +
+	               (size_t)nr_slots * shm_ring_slot_sz(msg_sz), PGSIZE);
+}
+
+static int shm_ring_path(char *path, const char *name)
+{
+	if (strchr(name, '/') ||
+	    snprintf(path, PATH_MAX, SHM_RING_DIR "%s", name) >= PATH_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static struct shm_ring *shm_ring_map(int fd, size_t size)
+{
+	void *addr = mmap(0, size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, fd, 0);
+
+	close(fd);
+	return addr == MAP_FAILED ? 0 : addr;
+}
+
+/* Creates and maps the ring name, which must not exist yet.  nr_slots must be a
+ * power of two.  Returns 0 and sets errno on failure. */
+struct shm_ring *shm_ring_create(const char *name, uint32_t nr_slots,
+                                 uint32_t msg_sz)
+{
+	char path[PATH_MAX];
+	struct shm_ring *ring;
+	size_t size;
+	int fd;
+
+	if (!IS_PWR2(nr_slots) || !msg_sz) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (shm_ring_path(path, name))
+		return 0;
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		return 0;
+	size = shm_ring_size(nr_slots, msg_sz);
+	if (ftruncate(fd, size)) {
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+	ring = shm_ring_map(fd, size);
+	if (!ring) {
+		unlink(path);
+		return 0;
+	}
+	ring->nr_slots = nr_slots;
+	ring->msg_sz = msg_sz;
+	ring->slot_sz = shm_ring_slot_sz(msg_sz);
+	ring->cons_pid = 0;
+	atomic_init(&ring->prod_idx, 0);
+	ring->cons_idx = 0;
+	for (uint64_t i = 0; i < nr_slots; i++)
+		shm_ring_slot(ring, i)->seq = i;
+	/* shm_ring_open() checks the magic, so it goes last */
+	wmb();
+	ring->magic = SHM_RING_MAGIC;
+	return ring;
+}
+
+/* Maps an existing ring.  Returns 0 and sets errno on failure. */
+struct shm_ring *shm_ring_open(const char *name)
+{
+	char path[PATH_MAX];
+	struct shm_ring *ring;
+	struct stat st;
+	int fd;
+
+	if (shm_ring_path(path, name))
+		return 0;
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return 0;
+	}
+	if (st.st_size < sizeof(struct shm_ring)) {
+		close(fd);
+		errno = EINVAL;
+		return 0;
+	}
+	ring = shm_ring_map(fd, st.st_size);
+	if (!ring)
+		return 0;
+	if (ACCESS_ONCE(ring->magic) != SHM_RING_MAGIC ||
+	    shm_ring_size(ring->nr_slots, ring->msg_sz) != st.st_size) {
+		munmap(ring, st.st_size);
+		errno = EINVAL;
+		return 0;
+	}
+	rmb();
+	return ring;
+}
+
+void shm_ring_close(struct shm_ring *ring)
+{
+	munmap(ring, shm_ring_size(ring->nr_slots, ring->msg_sz));
+}
+
+/* The ring's pages stay around until everyone has unmapped it. */
+int shm_ring_unlink(const char *name)
+{
+	char path[PATH_MAX];
+
+	if (shm_ring_path(path, name))
+		return -1;
+	return unlink(path);
+}
+
+/* Makes the caller the ring's consumer: it will get ev_type events when a
+ * message arrives in an empty ring. */
+void shm_ring_set_consumer(struct shm_ring *ring, unsigned int ev_type)
+{
+	ring->ev_type = ev_type;
+	wmb();
+	ring->cons_pid = getpid();
+}
+
+/* Copies len bytes of msg into the ring.  Returns FALSE if the ring is full. */
+bool shm_ring_send(struct shm_ring *ring, const void *msg, size_t len)
+{
+	struct shm_ring_slot *slot;
+	long pos, diff;
+	int cons_pid;
+
+	assert(len <= ring->msg_sz);
+	while (1) {
+		pos = atomic_read(&ring->prod_idx);
+		slot = shm_ring_slot(ring, pos);
+		diff = (long)ACCESS_ONCE(slot->seq) - pos;
+		/* The consumer hasn't freed it from the last lap */
+		if (diff < 0)
+			return FALSE;
+		if (!diff && atomic_cas(&ring->prod_idx, pos, pos + 1))
+			break;
+		cpu_relax();
+	}
+	memcpy(slot->data, msg, len);
+	wmb();
+	slot->seq = pos + 1;
+	/* Our seq store must be visible before we look at cons_idx.  Pairs with
+	 * the wrmb in shm_ring_recv(). */
+	wrmb();
+	if (ACCESS_ONCE(ring->cons_idx) != pos)
+		return TRUE;
+	cons_pid = ACCESS_ONCE(ring->cons_pid);
+	if (cons_pid)
+		sys_notify(cons_pid, ring->ev_type, 0);
+	return TRUE;
+}
+
+/* Copies the next message into msg, which must hold msg_sz bytes.  Returns
+ * FALSE if the ring is empty.  Only the consumer calls this. */
+bool shm_ring_recv(struct shm_ring *ring, void *msg)
+{
+	uint64_t pos = ring->cons_idx;
+	struct shm_ring_slot *slot = shm_ring_slot(ring, pos);
+
+	if (ACCESS_ONCE(slot->seq) != pos + 1)
+		return FALSE;
+	rmb();
+	memcpy(msg, slot->data, ring->msg_sz);
+	/* Done reading before a producer can have the slot back */
+	rwmb();
+	slot->seq = pos + ring->nr_slots;
+	ring->cons_idx = pos + 1;
+	/* Our cons_idx store must be visible before we (or our caller, deciding to
+	 * wait) look at the next slot's seq.  Pairs with shm_ring_send(). */
+	wrmb();
+	return TRUE;
+}
+
+bool shm_ring_is_empty(struct shm_ring *ring)
+{
+	uint64_t pos = ACCESS_ONCE(ring->cons_idx);
+
+	return ACCESS_ONCE(shm_ring_slot(ring, pos)->seq) != pos + 1;
+}
@@ -38,6 +38,8 @@
 #include <ros/syscall.h>
 #include <sys/mman.h>
 #include <parlib/stdio.h>
+#include <ros/arch/membar.h>
+#include <string.h>
 
 /* Forward declare our signal_ops functions. */
 static int __sigaltstack(__const struct sigaltstack *__restrict __ss,
@@ -58,6 +60,12 @@ static int __sigwaitinfo(__const sigset_t *__restrict __set,
                          siginfo_t *__restrict __info);
 static int __sigself(int signo);
 
+/* Per-signal counts of targeted signals (uthread_signal()), see
+ * uthread_signal_stats(). */
+static uint64_t sig_nr_sent[_NSIG];
+static uint64_t sig_nr_ipis[_NSIG];
+static uint64_t sig_nr_run[_NSIG];
+
 /* The default definition of signal_ops (similar to sched_ops in uthread.c) */
 struct signal_ops default_signal_ops = {
 	.sigaltstack = __sigaltstack,
@@ -196,18 +204,72 @@ static void __run_all_sighandlers(void)
 
 	for (int i = 1; i < _NSIG; i++) {
 		if (__sigismember(&andset, i)) {
-			__sigdelset(&uthread->sigstate.pending, i);
+			/* Senders set bits concurrently */
+			__sync_fetch_and_and(&uthread->sigstate.pending, ~__sigmask(i));
+			__sync_fetch_and_add(&sig_nr_run[i], 1);
 			trigger_posix_signal(i, NULL, &uthread->sigstate.data->u_ctx);
 		}
 	}
 	uthread_yield(FALSE, __exit_sighandler_cb, 0);
 }
 
+/* Helper: which vcore is uth running on?  Racy, it's just a hint.  Returns
+ * max_vcores() if it's not running. */
+static uint32_t __uth_running_vcoreid(struct uthread *uth)
+{
+	if (ACCESS_ONCE(uth->state) != UT_RUNNING)
+		return max_vcores();
+	for (uint32_t i = 0; i < max_vcores(); i++) {
+		if (!vcore_is_mapped(i))
+			continue;
+		if (ACCESS_ONCE(*get_tlsvar_linaddr(i, current_uthread)) == uth)
+			return i;
+	}
+	return max_vcores();
+}
+
+/* Sends signo to uthread.  This is all in memory: we set the bit in its pending
+ * mask, and the next time its 2LS runs it (uthread_prep_pending_signals()), it
+ * runs the handler first.  If it is running right now, we IPI its vcore, which
+ * pops into vcore context and comes right back with the handler prepped.
+ *
+ * Like regular signals, these don't queue.  Several sends before the uthread
+ * runs are one signal.  uthread_signal_stats() tells how many were sent versus
+ * run. */
 int uthread_signal(struct uthread *uthread, int signo)
 {
-	// Slightly racy with clearing of mask when triggering the signal, but
-	// that's OK, as signals are inherently racy since they don't queue up.
-	return sigaddset(&uthread->sigstate.pending, signo);
+	uint32_t vcoreid;
+
+	if (signo <= 0 || signo >= _NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+	__sync_fetch_and_add(&sig_nr_sent[signo], 1);
+	__sync_fetch_and_or(&uthread->sigstate.pending, __sigmask(signo));
+	/* Our pending write must be visible before we check whether it's running.
+	 * If we race with it starting to run, the signal waits for its next trip
+	 * through vcore context. */
+	wrmb();
+	if (uthread == current_uthread)
+		return 0;
+	vcoreid = __uth_running_vcoreid(uthread);
+	if (vcoreid == max_vcores())
+		return 0;
+	__sync_fetch_and_add(&sig_nr_ipis[signo], 1);
+	sys_self_notify(vcoreid, EV_NONE, 0, TRUE);
+	return 0;
+}
+
+/* Reports how many times signo was sent with uthread_signal(), how many of
+ * those needed an IPI, and how many times its handler ran for them. */
+void uthread_signal_stats(int signo, struct uthread_sig_stats *stats)
+{
+	memset(stats, 0, sizeof(struct uthread_sig_stats));
+	if (signo <= 0 || signo >= _NSIG)
+		return;
+	stats->nr_sent = ACCESS_ONCE(sig_nr_sent[signo]);
+	stats->nr_ipis = ACCESS_ONCE(sig_nr_ipis[signo]);
+	stats->nr_run = ACCESS_ONCE(sig_nr_run[signo]);
 }
 
 /* If there are any pending signals, prep the uthread to run it's signal
@@ -10,10 +10,18 @@
  * objects, so we use the same style for small objects: store the pointer to the
  * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
  *
+ * The magazine layer (see slab.h) sits on top of the slab functions.  Objects
+ * in magazines are still constructed and still count as allocated from the
+ * slab layer's point of view (nr_cur_alloc).
+ *
  * Ported directly from the kernel's slab allocator. */
 
 #include <parlib/slab.h>
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <parlib/assert.h>
 #include <sys/mman.h>
 #include <sys/param.h>
@@ -24,10 +32,25 @@ struct spin_pdr_lock kmem_caches_lock;
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static void kmem_cache_grow(struct kmem_cache *cp);
+static void kmem_cache_drain_pcpu(struct kmem_cache *cp);
+static void kmem_depot_reap(struct kmem_cache *cp);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
-struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache, *kmem_magazine_cache;
+
+static void kmem_cache_init_pcpu(struct kmem_cache *kc)
+{
+	int ret;
+
+	if (kc->flags & KMC_NOMAG)
+		return;
+	ret = posix_memalign((void**)&kc->pcpu_caches,
+	                     __alignof__(struct kmem_pcpu_cache),
+	                     sizeof(struct kmem_pcpu_cache) * max_vcores());
+	assert(!ret);
+	memset(kc->pcpu_caches, 0, sizeof(struct kmem_pcpu_cache) * max_vcores());
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -47,6 +70,13 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
+	kc->pcpu_caches = NULL;
+	spin_pdr_init(&kc->depot.lock);
+	SLIST_INIT(&kc->depot.full);
+	SLIST_INIT(&kc->depot.empty);
+	kc->depot.nr_full = 0;
+	kc->depot.nr_empty = 0;
+	kmem_cache_init_pcpu(kc);
 	
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
@@ -82,6 +112,12 @@ void kmem_cache_init(void)
 	__kmem_cache_create(kmem_bufctl_cache, "kmem_bufctl",
 	                    sizeof(struct kmem_bufctl),
 	                    __alignof__(struct kmem_bufctl), 0, NULL, NULL); 
+	/* Magazines for the magazine cache would need magazines... */
+	kmem_magazine_cache = kmem_cache_alloc(&kmem_cache_cache, 0);
+	__kmem_cache_create(kmem_magazine_cache, "kmem_magazine",
+	                    sizeof(struct kmem_magazine),
+	                    __alignof__(struct kmem_magazine), KMC_NOMAG, NULL,
+	                    NULL);
 }
 
 /* Cache management */
@@ -135,6 +171,11 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	if (cp->pcpu_caches) {
+		kmem_cache_drain_pcpu(cp);
+		kmem_depot_reap(cp);
+		free(cp->pcpu_caches);
+	}
 	spin_pdr_lock(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -154,8 +195,7 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp)
 {
 	void *retval = NULL;
 	spin_pdr_lock(&cp->cache_lock);
@@ -201,7 +241,7 @@ static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -236,6 +276,184 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
+/* Depot helpers.  Grab the depot lock before calling these. */
+static struct kmem_magazine *depot_get_full(struct kmem_depot *depot)
+{
+	struct kmem_magazine *mag = SLIST_FIRST(&depot->full);
+
+	if (!mag)
+		return NULL;
+	SLIST_REMOVE_HEAD(&depot->full, link);
+	depot->nr_full--;
+	return mag;
+}
+
+static struct kmem_magazine *depot_get_empty(struct kmem_depot *depot)
+{
+	struct kmem_magazine *mag = SLIST_FIRST(&depot->empty);
+
+	if (!mag)
+		return NULL;
+	SLIST_REMOVE_HEAD(&depot->empty, link);
+	depot->nr_empty--;
+	return mag;
+}
+
+static void depot_put_full(struct kmem_depot *depot, struct kmem_magazine *mag)
+{
+	SLIST_INSERT_HEAD(&depot->full, mag, link);
+	depot->nr_full++;
+}
+
+static void depot_put_empty(struct kmem_depot *depot, struct kmem_magazine *mag)
+{
+	SLIST_INSERT_HEAD(&depot->empty, mag, link);
+	depot->nr_empty++;
+}
+
+/* Returns all of a magazine's rounds to the slab layer and frees it. */
+static void kmem_mag_destroy(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(cp, mag->rounds[i]);
+	__kmem_free_to_slab(kmem_magazine_cache, mag);
+}
+
+/* Tries to get an object from this vcore's magazines, swapping with the depot
+ * if needed.  Returns 0 if we need to go to the slab layer.
+ *
+ * Disabling notifs keeps us on this vcore.  If the vcore gets preempted in
+ * here, its magazines just wait for it; the depot lock is a PDR lock, so
+ * anyone spinning on it will make sure we get to run. */
+static void *__kmem_alloc_from_pcpu(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	void *retval = NULL;
+
+	uth_disable_notifs();
+	pcc = &cp->pcpu_caches[vcore_id()];
+	if (pcc->loaded && pcc->loaded->nr_rounds)
+		goto pop;
+	if (pcc->prev && pcc->prev->nr_rounds) {
+		mag = pcc->loaded;
+		pcc->loaded = pcc->prev;
+		pcc->prev = mag;
+		goto pop;
+	}
+	spin_pdr_lock(&cp->depot.lock);
+	mag = depot_get_full(&cp->depot);
+	if (!mag) {
+		spin_pdr_unlock(&cp->depot.lock);
+		goto out;
+	}
+	/* prev is empty or NULL, and loaded is empty too */
+	if (pcc->prev)
+		depot_put_empty(&cp->depot, pcc->prev);
+	spin_pdr_unlock(&cp->depot.lock);
+	pcc->prev = pcc->loaded;
+	pcc->loaded = mag;
+pop:
+	retval = pcc->loaded->rounds[--pcc->loaded->nr_rounds];
+	pcc->nr_allocs++;
+out:
+	uth_enable_notifs();
+	return retval;
+}
+
+/* Tries to put an object in this vcore's magazines, swapping with the depot if
+ * needed.  Returns FALSE if we need to go to the slab layer. */
+static bool __kmem_free_to_pcpu(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+
+	uth_disable_notifs();
+	pcc = &cp->pcpu_caches[vcore_id()];
+	if (pcc->loaded && pcc->loaded->nr_rounds < KMC_MAG_SZ)
+		goto push;
+	if (pcc->prev && !pcc->prev->nr_rounds) {
+		mag = pcc->loaded;
+		pcc->loaded = pcc->prev;
+		pcc->prev = mag;
+		goto push;
+	}
+	spin_pdr_lock(&cp->depot.lock);
+	mag = depot_get_empty(&cp->depot);
+	if (!mag) {
+		spin_pdr_unlock(&cp->depot.lock);
+		mag = __kmem_alloc_from_slab(kmem_magazine_cache);
+		mag->nr_rounds = 0;
+		spin_pdr_lock(&cp->depot.lock);
+	}
+	/* prev is full or NULL, and loaded is full too */
+	if (pcc->prev)
+		depot_put_full(&cp->depot, pcc->prev);
+	spin_pdr_unlock(&cp->depot.lock);
+	pcc->prev = pcc->loaded;
+	pcc->loaded = mag;
+push:
+	pcc->loaded->rounds[pcc->loaded->nr_rounds++] = buf;
+	pcc->nr_frees++;
+	uth_enable_notifs();
+	return TRUE;
+}
+
+/* Empties every vcore's magazines into the slab layer.  Only safe when no one
+ * is using the cache (i.e. destroy). */
+static void kmem_cache_drain_pcpu(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc = &cp->pcpu_caches[i];
+		if (pcc->loaded)
+			kmem_mag_destroy(cp, pcc->loaded);
+		if (pcc->prev)
+			kmem_mag_destroy(cp, pcc->prev);
+		pcc->loaded = NULL;
+		pcc->prev = NULL;
+	}
+}
+
+/* Frees every magazine in the depot, returning their rounds to the slabs. */
+static void kmem_depot_reap(struct kmem_cache *cp)
+{
+	struct kmem_mag_slist victims = SLIST_HEAD_INITIALIZER(victims);
+	struct kmem_magazine *mag;
+
+	spin_pdr_lock(&cp->depot.lock);
+	while ((mag = depot_get_full(&cp->depot)))
+		SLIST_INSERT_HEAD(&victims, mag, link);
+	while ((mag = depot_get_empty(&cp->depot)))
+		SLIST_INSERT_HEAD(&victims, mag, link);
+	spin_pdr_unlock(&cp->depot.lock);
+	/* Can't use FOREACH, since the link is in the mag we're freeing */
+	while ((mag = SLIST_FIRST(&victims))) {
+		SLIST_REMOVE_HEAD(&victims, link);
+		kmem_mag_destroy(cp, mag);
+	}
+}
+
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	void *retval = NULL;
+
+	if (cp->pcpu_caches)
+		retval = __kmem_alloc_from_pcpu(cp);
+	if (!retval)
+		retval = __kmem_alloc_from_slab(cp);
+	return retval;
+}
+
+void kmem_cache_free(struct kmem_cache *cp, void *buf)
+{
+	if (cp->pcpu_caches && __kmem_free_to_pcpu(cp, buf))
+		return;
+	__kmem_free_to_slab(cp, buf);
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -308,13 +526,16 @@ static void kmem_cache_grow(struct kmem_cache *cp)
 	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+/* This deallocs every slab from the empty list, after emptying the depot's
+ * magazines into the slabs.  TODO: think a bit more about this.  We can do
+ * things like not free all of the empty lists to prevent thrashing.  See 3.4 in
+ * the paper. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 	
+	if (cp->pcpu_caches)
+		kmem_depot_reap(cp);
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_pdr_lock(&cp->cache_lock);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
@@ -340,6 +561,8 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printf("Slab Partial: 0x%08x\n", cp->partial_slab_list);
 	printf("Slab Empty: 0x%08x\n", cp->empty_slab_list);
 	printf("Current Allocations: %d\n", cp->nr_cur_alloc);
+	printf("Depot full/empty mags: %d / %d\n", cp->depot.nr_full,
+	       cp->depot.nr_empty);
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
@@ -362,3 +585,101 @@ void print_kmem_slab(struct kmem_slab *slab)
 	}
 }
 
+
+/* Size classes for slab_malloc, including the header: 32 through
+ * SLAB_LARGE_CUTOFF, in powers of 2. */
+#define SLAB_MALLOC_MIN_SHIFT 5
+#define SLAB_MALLOC_NR_CLASSES 5
+#define SLAB_MALLOC_ALIGN 16		/* what malloc gives you */
+
+static struct kmem_cache *slab_malloc_caches[SLAB_MALLOC_NR_CLASSES];
+static const char *slab_malloc_names[SLAB_MALLOC_NR_CLASSES] = {
+	"slab_malloc_32", "slab_malloc_64", "slab_malloc_128", "slab_malloc_256",
+	"slab_malloc_512",
+};
+
+static void slab_malloc_init(void)
+{
+	parlib_static_assert(1 << (SLAB_MALLOC_MIN_SHIFT +
+	                           SLAB_MALLOC_NR_CLASSES - 1) == SLAB_LARGE_CUTOFF);
+	for (int i = 0; i < SLAB_MALLOC_NR_CLASSES; i++)
+		slab_malloc_caches[i] =
+			kmem_cache_create(slab_malloc_names[i],
+			                  1 << (SLAB_MALLOC_MIN_SHIFT + i),
+			                  SLAB_MALLOC_ALIGN, 0, NULL, NULL);
+}
+
+static struct kmem_cache *slab_malloc_cache(size_t size)
+{
+	size += sizeof(struct slab_malloc_hdr);
+	for (int i = 0; i < SLAB_MALLOC_NR_CLASSES; i++) {
+		if (size <= 1 << (SLAB_MALLOC_MIN_SHIFT + i))
+			return slab_malloc_caches[i];
+	}
+	return NULL;
+}
+
+void *slab_malloc(size_t size)
+{
+	struct kmem_cache *kc;
+	struct slab_malloc_hdr *hdr;
+
+	run_once(slab_malloc_init());
+	kc = slab_malloc_cache(size);
+	if (kc)
+		hdr = kmem_cache_alloc(kc, 0);
+	else
+		hdr = malloc(sizeof(struct slab_malloc_hdr) + size);
+	if (!hdr)
+		return NULL;
+	hdr->cache = kc;
+	return hdr + 1;
+}
+
+void *slab_zalloc(size_t size)
+{
+	void *buf = slab_malloc(size);
+
+	if (buf)
+		memset(buf, 0, size);
+	return buf;
+}
+
+void slab_free(void *buf)
+{
+	struct slab_malloc_hdr *hdr;
+
+	if (!buf)
+		return;
+	hdr = (struct slab_malloc_hdr*)buf - 1;
+	if (hdr->cache)
+		kmem_cache_free(hdr->cache, hdr);
+	else
+		free(hdr);
+}
+
+void *slab_realloc(void *buf, size_t size)
+{
+	struct slab_malloc_hdr *hdr;
+	size_t old_size;
+	void *new_buf;
+
+	if (!buf)
+		return slab_malloc(size);
+	hdr = (struct slab_malloc_hdr*)buf - 1;
+	if (hdr->cache) {
+		old_size = hdr->cache->obj_size - sizeof(struct slab_malloc_hdr);
+		if (size <= old_size)
+			return buf;
+	} else {
+		/* we don't know how big it was, so let malloc copy */
+		hdr = realloc(hdr, sizeof(struct slab_malloc_hdr) + size);
+		return hdr ? hdr + 1 : NULL;
+	}
+	new_buf = slab_malloc(size);
+	if (!new_buf)
+		return NULL;
+	memcpy(new_buf, buf, old_size);
+	slab_free(buf);
+	return new_buf;
+}
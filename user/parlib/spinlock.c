@@ -145,3 +145,69 @@ void spin_pdr_unlock(struct spin_pdr_lock *pdr_lock)
 	/* Enable notifs, if we're an _M uthread */
 	uth_enable_notifs();
 }
+
+void ticket_pdr_init(struct ticket_pdr_lock *lock)
+{
+	lock->next = 0;
+	lock->owner = 0;
+	lock->lockholder = TICKET_PDR_VCOREID_UNKNOWN;
+}
+
+/* Waiters learn the lockholder's vcoreid once it advertises it.  Between a
+ * ticket coming up and the new owner writing lockholder, we don't know who has
+ * the lock, which is also when the next in line could be preempted.  If the
+ * owner doesn't change for a while, we ensure every vcore runs, like the
+ * NO_CAS spin_pdr lock does. */
+#define TICKET_PDR_SPINS_BEFORE_SCAN	1000
+
+void __ticket_pdr_lock(struct ticket_pdr_lock *lock)
+{
+	uint32_t vcoreid = vcore_id();
+	uint32_t ticket, owner, last_owner, holder;
+	unsigned int spins = 0;
+
+	ticket = __sync_fetch_and_add(&lock->next, 1);
+	last_owner = ticket;
+	while ((owner = ACCESS_ONCE(lock->owner)) != ticket) {
+		if (owner != last_owner) {
+			last_owner = owner;
+			spins = 0;
+		}
+		holder = ACCESS_ONCE(lock->lockholder);
+		if (holder != TICKET_PDR_VCOREID_UNKNOWN)
+			ensure_vcore_runs(holder);
+		if (++spins == TICKET_PDR_SPINS_BEFORE_SCAN) {
+			/* passing ourselves makes sure everyone else runs */
+			ensure_vcore_runs(vcoreid);
+			spins = 0;
+		}
+		cpu_relax();
+	}
+	lock->lockholder = vcoreid;
+	cmb();	/* the atomic fetch-add handled the CPU barrier */
+}
+
+void __ticket_pdr_unlock(struct ticket_pdr_lock *lock)
+{
+	lock->lockholder = TICKET_PDR_VCOREID_UNKNOWN;
+	wmb();	/* Need to prevent the compiler from reordering older stores. */
+	rwmb();	/* And no old reads passing either. */
+	lock->owner++;
+}
+
+void ticket_pdr_lock(struct ticket_pdr_lock *lock)
+{
+	uth_disable_notifs();
+	__ticket_pdr_lock(lock);
+}
+
+void ticket_pdr_unlock(struct ticket_pdr_lock *lock)
+{
+	__ticket_pdr_unlock(lock);
+	uth_enable_notifs();
+}
+
+bool ticket_pdr_locked(struct ticket_pdr_lock *lock)
+{
+	return ACCESS_ONCE(lock->owner) != ACCESS_ONCE(lock->next);
+}
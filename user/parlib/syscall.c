@@ -92,6 +92,13 @@ int sys_notify(int pid, unsigned int ev_type, struct event_msg *u_msg)
 	return ros_syscall(SYS_notify, pid, ev_type, u_msg, 0, 0, 0);
 }
 
+int sys_ipc_call(int pid, unsigned int ev_type, uint16_t ev_arg1,
+                 void *ev_arg3, uint64_t ev_arg4)
+{
+	return ros_syscall(SYS_ipc_call, pid, ev_type, ev_arg1, ev_arg3, ev_arg4,
+	                   0);
+}
+
 int sys_self_notify(uint32_t vcoreid, unsigned int ev_type,
                     struct event_msg *u_msg, bool priv)
 {
@@ -201,3 +208,37 @@ void syscall_async(struct syscall *sysc, unsigned long num, ...)
 	va_end(args);
 	__ros_arch_syscall((long)sysc, 1);
 }
+
+/* Submits nr syscalls, already filled in, with as few traps as possible.  The
+ * kernel runs the first directly and the rest right after, each completing on
+ * its own, in any order.  Callers can register_evq() on any of them afterwards,
+ * like with syscall_async(), or wait with syscall_blockon_batch().
+ *
+ * Don't batch syscalls that work on the calling context (yield, exec, etc).
+ * The kernel fails those with EINVAL unless they are first in a trap. */
+void syscall_async_batch(struct syscall *syscs, unsigned int nr)
+{
+	unsigned int amt;
+
+	for (int i = 0; i < nr; i++) {
+		syscs[i].flags = 0;
+		syscs[i].ev_q = 0;
+	}
+	while (nr) {
+		amt = MIN(nr, MAX_NR_BATCHED_SYSCS);
+		__ros_arch_syscall((long)syscs, amt);
+		syscs += amt;
+		nr -= amt;
+	}
+}
+
+/* Waits until all of the syscalls are done.  Uthreads block (in the 2LS) on
+ * each one that isn't done yet, so the wait costs at most one yield per
+ * outstanding syscall. */
+void syscall_blockon_batch(struct syscall *syscs, unsigned int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		while (!(atomic_read(&syscs[i].flags) & SC_DONE))
+			ros_syscall_blockon(&syscs[i]);
+	}
+}
@@ -108,3 +108,8 @@ uint64_t nsec2tsc(uint64_t nsec)
 	else
 		return (nsec * get_tsc_freq()) / 1000000000;
 }
+
+uint64_t epoch_nsec(void)
+{
+	return __ros_tsc2walltime_ns(read_tsc());
+}
@@ -31,7 +31,14 @@ void ucq_init_raw(struct ucq *ucq, uintptr_t pg1, uintptr_t pg2)
 	atomic_set(&ucq->cons_idx, pg1);
 	ucq->prod_overflow = FALSE;
 	atomic_set(&ucq->nr_extra_pgs, 0);
+	/* pg2 is the only page on the spare stack */
+	((struct ucq_page*)pg2)->header.cons_next_pg = 0;
+	atomic_set(&((struct ucq_page*)pg2)->header.nr_cons, 0);
 	atomic_set(&ucq->spare_pg, pg2);
+	atomic_set(&ucq->nr_spare_pgs, 1);
+	atomic_set(&ucq->nr_pg_swaps, 0);
+	atomic_set(&ucq->nr_pg_mmaps, 0);
+	atomic_set(&ucq->nr_pg_waits, 0);
 	parlib_static_assert(sizeof(struct spin_pdr_lock) <= sizeof(ucq->u_lock));
 	spin_pdr_init((struct spin_pdr_lock*)(&ucq->u_lock));
 	ucq->ucq_ready = TRUE;
@@ -50,14 +57,41 @@ void ucq_init(struct ucq *ucq)
 }
 
 /* Only call this on ucq's made with the simple ucq_init().  And be sure the ucq
- * is no longer in use. */
+ * is no longer in use.  Frees the producer's page and every spare page. */
 void ucq_free_pgs(struct ucq *ucq)
 {
-	uintptr_t pg1 = atomic_read(&ucq->prod_idx);
+	uintptr_t pg1 = PTE_ADDR(atomic_read(&ucq->prod_idx));
 	uintptr_t pg2 = atomic_read(&ucq->spare_pg);
-	assert(pg1 && pg2);
+	uintptr_t next;
+
+	assert(pg1);
 	munmap((void*)pg1, PGSIZE);
-	munmap((void*)pg2, PGSIZE);
+	while (pg2) {
+		next = ((struct ucq_page*)pg2)->header.cons_next_pg;
+		munmap((void*)pg2, PGSIZE);
+		pg2 = next;
+	}
+}
+
+/* Pushes a used page onto the spare stack, for the kernel to reuse.  Call with
+ * the u_lock held; we're the only pusher, and the kernel is the only popper.
+ * If we already have enough spares, the page goes back to the OS. */
+static void ucq_put_spare_pg(struct ucq *ucq, struct ucq_page *page)
+{
+	uintptr_t old_top;
+
+	if (atomic_read(&ucq->nr_spare_pgs) >= UCQ_MAX_SPARE_PGS) {
+		munmap(page, PGSIZE);
+		atomic_dec(&ucq->nr_extra_pgs);
+		return;
+	}
+	/* Inc first, so the kernel's dec after a pop never underflows */
+	atomic_inc(&ucq->nr_spare_pgs);
+	do {
+		old_top = atomic_read(&ucq->spare_pg);
+		page->header.cons_next_pg = old_top;
+		wmb();	/* the link must be visible before the page is */
+	} while (!atomic_cas(&ucq->spare_pg, old_top, (long)page));
 }
 
 /* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
@@ -66,7 +100,7 @@ void ucq_free_pgs(struct ucq *ucq)
 bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
 {
 	uintptr_t my_idx;
-	struct ucq_page *old_page, *other_page;
+	struct ucq_page *old_page;
 	struct msg_container *my_msg;
 	struct spin_pdr_lock *ucq_lock = (struct spin_pdr_lock*)(&ucq->u_lock);
 
@@ -118,18 +152,9 @@ loop_top:
 			 * aren't preeempted */
 			cpu_relax_vc(vcore_id());	/* pass in self to check everyone else*/
 		}
-		/* Now the page is done.  0 its metadata and give it up. */
-		old_page->header.cons_next_pg = 0;
+		/* Now the page is done.  0 its metadata and recycle it. */
 		atomic_set(&old_page->header.nr_cons, 0);
-		/* We want to "free" the page.  We'll try and set it as the spare.  If
-		 * there is already a spare, we'll free that one. */
-		other_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg,
-		                                           (long)old_page);
-		assert(!PGOFF(other_page));
-		if (other_page) {
-			munmap(other_page, PGSIZE);
-			atomic_dec(&ucq->nr_extra_pgs);
-		}
+		ucq_put_spare_pg(ucq, old_page);
 		/* All fixed up, unlock.  Other consumers may lock and check to make
 		 * sure things are done. */
 		spin_pdr_unlock(ucq_lock);
@@ -29,6 +29,7 @@ static int __uthread_allocate_tls(struct uthread *uthread);
 static int __uthread_reinit_tls(struct uthread *uthread);
 static void __uthread_free_tls(struct uthread *uthread);
 static void __run_current_uthread_raw(void);
+static void __run_uthread(struct uthread *uthread, bool coop);
 
 static void handle_vc_preempt(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data);
@@ -68,7 +69,7 @@ static void uthread_init_thread0(struct uthread *uthread)
  * where thread0 will be running when the program ends. */
 static void uthread_track_thread0(struct uthread *uthread)
 {
-	set_tls_desc(get_vcpd_tls_desc(0));
+	set_tls_desc_cached(get_vcpd_tls_desc(0));
 	begin_safe_access_tls_vars();
 	/* We might have a basic uthread already installed (from a prior call), so
 	 * free it before installing the new one. */
@@ -83,7 +84,7 @@ static void uthread_track_thread0(struct uthread *uthread)
 	 * vcore_context when running in scheduler_context for the SCP. */
 	__vcore_context = TRUE;
 	end_safe_access_tls_vars();
-	set_tls_desc(uthread->tls_desc);
+	set_tls_desc_cached(uthread->tls_desc);
 }
 
 /* The real 2LS calls this to transition us into mcp mode.  When it
@@ -291,6 +292,9 @@ void uthread_init(struct uthread *new_thread, struct uth_thread_attr *attr)
 	 * were interrupted off a core. */
 	new_thread->flags |= UTHREAD_SAVED;
 	new_thread->notif_disabled_depth = 0;
+	/* A recycled uthread might not have had a TLS */
+	if (new_thread->tls_desc == UTH_TLSDESC_NOTLS)
+		new_thread->tls_desc = NULL;
 	if (attr && attr->want_tls) {
 		/* Get a TLS.  If we already have one, reallocate/refresh it */
 		if (new_thread->tls_desc)
@@ -307,6 +311,8 @@ void uthread_init(struct uthread *new_thread, struct uth_thread_attr *attr)
 		__ctype_init();
 		end_access_tls_vars();
 	} else {
+		if (new_thread->tls_desc)
+			__uthread_free_tls(new_thread);
 		new_thread->tls_desc = UTH_TLSDESC_NOTLS;
 	}
 }
@@ -349,6 +355,28 @@ void uthread_paused(struct uthread *uthread)
     sched_ops->thread_paused(uthread);
 }
 
+/* Cooperative fast path out of a yield.  If vcore context has nothing to do,
+ * the 2LS can pick the next uthread and we run it directly, skipping vcore_entry
+ * and sched_entry.  Returns if we need to go the long way. */
+static void __uthread_switch_direct(uint32_t vcoreid)
+{
+	struct preempt_data *vcpd = vcpd_of(vcoreid);
+	struct uthread *next;
+
+	if (!sched_ops->thread_pick_next)
+		return;
+	if (atomic_read(&vcpd->flags) & VC_UTHREAD_STEALING)
+		return;
+	try_handle_remote_mbox();
+	/* If an event comes in after this, popping the uthread will notice. */
+	if (vcpd->notif_pending || __preempt_is_pending(vcoreid))
+		return;
+	next = sched_ops->thread_pick_next();
+	if (!next)
+		return;
+	__run_uthread(next, TRUE);
+}
+
 /* Need to have this as a separate, non-inlined function since we clobber the
  * stack pointer before calling it, and don't want the compiler to play games
  * with my hart. */
@@ -373,6 +401,7 @@ __uthread_yield(void)
 	/* Leave the current vcore completely */
 	/* TODO: if the yield func can return a failure, we can abort the yield */
 	current_uthread = NULL;
+	__uthread_switch_direct(vcore_id());
 	/* Go back to the entry point, where we can handle notifications or
 	 * reschedule someone. */
 	uthread_vcore_entry();
@@ -431,7 +460,7 @@ void uthread_yield(bool save_state, void (*yield_func)(struct uthread*, void*),
 	}
 	/* Change to the transition context (both TLS (if applicable) and stack). */
 	if (__uthread_has_tls(uthread)) {
-		set_tls_desc(get_vcpd_tls_desc(vcoreid));
+		set_tls_desc_cached(get_vcpd_tls_desc(vcoreid));
 		begin_safe_access_tls_vars();
 		assert(current_uthread == uthread);
 		/* If this assert fails, see the note in uthread_track_thread0 */
@@ -551,7 +580,7 @@ void highjack_current_uthread(struct uthread *uthread)
 	/* and make sure we are using the correct TLS for the new uthread */
 	if (__uthread_has_tls(uthread)) {
 		assert(uthread->tls_desc);
-		set_tls_desc(uthread->tls_desc);
+		set_tls_desc_cached(uthread->tls_desc);
 		begin_safe_access_tls_vars();
 		__vcoreid = vcoreid;	/* setting the uthread's TLS var */
 		end_safe_access_tls_vars();
@@ -564,7 +593,7 @@ void highjack_current_uthread(struct uthread *uthread)
 static void set_uthread_tls(struct uthread *uthread, uint32_t vcoreid)
 {
 	if (__uthread_has_tls(uthread)) {
-		set_tls_desc(uthread->tls_desc);
+		set_tls_desc_cached(uthread->tls_desc);
 		begin_safe_access_tls_vars();
 		__vcoreid = vcoreid;	/* setting the uthread's TLS var */
 		end_safe_access_tls_vars();
@@ -631,8 +660,11 @@ void run_current_uthread(void)
  * Ultimately, handling events again in these 'popping helpers' isn't even
  * necessary (we only must do it once for an entire time in VC ctx, and in
  * loops), and might have been optimizing a rare event at a cost in both
- * instructions and complexity. */
-void run_uthread(struct uthread *uthread)
+ * instructions and complexity.
+ *
+ * coop is for cooperative switches straight from another uthread's yield,
+ * which can skip some of the FP work when popping. */
+static void __run_uthread(struct uthread *uthread, bool coop)
 {
 	uint32_t vcoreid = vcore_id();
 	struct preempt_data *vcpd = vcpd_of(vcoreid);
@@ -667,10 +699,18 @@ void run_uthread(struct uthread *uthread)
 	set_uthread_tls(uthread, vcoreid);
 	/* the uth's context will soon be in the cpu (or VCPD), no longer saved */
 	uthread->flags &= ~UTHREAD_SAVED;
-	pop_user_ctx(&uthread->u_ctx, vcoreid);
+	if (coop)
+		pop_user_ctx_coop(&uthread->u_ctx, vcoreid);
+	else
+		pop_user_ctx(&uthread->u_ctx, vcoreid);
 	assert(0);
 }
 
+void run_uthread(struct uthread *uthread)
+{
+	__run_uthread(uthread, FALSE);
+}
+
 /* Runs the uthread, but doesn't care about notif pending.  Only call this when
  * there was a DONT_MIGRATE uthread, or a similar situation where the uthread
  * will check messages soon (like calling enable_notifs()). */
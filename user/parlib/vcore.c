@@ -390,6 +390,23 @@ void vcore_yield(bool preempt_pending)
 	__sync_fetch_and_or(&vcpd->flags, VC_CAN_RCV_MSG);
 }
 
+/* Sends pid an ev_type message and hands it our core, for synchronous IPC (see
+ * parlib/ipc.h).  Call from vcore context.  If it works, this does not return:
+ * the vcore restarts fresh at vcore_entry() when someone hands it a core back.
+ * If the kernel won't take the core (we have a notif pending, or we're an
+ * SCP), the message is still sent and we return.
+ *
+ * Unlike vcore_yield(), we leave amt_wanted alone; we want a core back. */
+void vcore_ipc_call(int pid, unsigned int ev_type, uint16_t ev_arg1,
+                    void *ev_arg3, uint64_t ev_arg4)
+{
+	struct preempt_data *vcpd = vcpd_of(vcore_id());
+
+	__sync_fetch_and_and(&vcpd->flags, ~VC_CAN_RCV_MSG);
+	sys_ipc_call(pid, ev_type, ev_arg1, ev_arg3, ev_arg4);
+	__sync_fetch_and_or(&vcpd->flags, VC_CAN_RCV_MSG);
+}
+
 /* Enables notifs, and deals with missed notifs by self notifying.  This should
  * be rare, so the syscall overhead isn't a big deal.  The other alternative
  * would be to uthread_yield(), which would require us to revert some uthread
@@ -455,9 +472,15 @@ void vcore_idle(void)
 
 /* Helper, that actually makes sure a vcore is running.  Call this is you really
  * want vcoreid.  More often, you'll want to call the regular version. */
+/* How often PDR lock waiters found a preempted lockholder (or predecessor), and
+ * how often their sys_change_vcore() got it running again. */
+static uint64_t nr_pdr_preempted;
+static uint64_t nr_pdr_recovered;
+
 static void __ensure_vcore_runs(uint32_t vcoreid)
 {
 	if (vcore_is_preempted(vcoreid)) {
+		__sync_fetch_and_add(&nr_pdr_preempted, 1);
 		printd("[vcore]: VC %d changing to VC %d\n", vcore_id(), vcoreid);
 		/* Note that at this moment, the vcore could still be mapped (we're
 		 * racing with __preempt.  If that happens, we'll just fail the
@@ -465,10 +488,17 @@ static void __ensure_vcore_runs(uint32_t vcoreid)
 		/* We want to recover them from preemption.  Since we know they have
 		 * notifs disabled, they will need to be directly restarted, so we can
 		 * skip the other logic and cut straight to the sys_change_vcore() */
-		sys_change_vcore(vcoreid, FALSE);
+		if (!sys_change_vcore(vcoreid, FALSE))
+			__sync_fetch_and_add(&nr_pdr_recovered, 1);
 	}
 }
 
+void get_vcore_pdr_stats(uint64_t *preempted, uint64_t *recovered)
+{
+	*preempted = ACCESS_ONCE(nr_pdr_preempted);
+	*recovered = ACCESS_ONCE(nr_pdr_recovered);
+}
+
 /* Helper, looks for any preempted vcores, making sure each of them runs at some
  * point.  This is pretty heavy-weight, and should be used to help get out of
  * weird deadlocks (spinning in vcore context, waiting on another vcore).  If
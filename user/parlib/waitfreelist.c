@@ -7,21 +7,27 @@
 #include <parlib/assert.h>
 #include <stdlib.h>
 #include <parlib/arch/atomic.h>
+#include <parlib/vcore.h>
 #include <parlib/waitfreelist.h>
 
 void wfl_init(struct wfl *list)
 {
-  list->first.next = NULL;
-  list->first.data = NULL;
+  memset(&list->first, 0, sizeof(struct wfl_entry));
   list->head = &list->first;
 }
 
+static void wfl_entry_assert_empty(struct wfl_entry *p)
+{
+  for (size_t i = 0; i < WFL_ENTRY_SLOTS; i++)
+    assert(p->slots[i] == NULL);
+}
+
 void wfl_destroy(struct wfl *list)
 {
-  assert(list->first.data == NULL);
+  wfl_entry_assert_empty(&list->first);
   struct wfl_entry *p = list->first.next; // don't free the first element
   while (p != NULL) {
-    assert(p->data == NULL);
+    wfl_entry_assert_empty(p);
     struct wfl_entry *tmp = p;
     p = p->next;
     free(tmp);
@@ -32,7 +38,7 @@ size_t wfl_capacity(struct wfl *list)
 {
   size_t res = 0;
   for (struct wfl_entry *p = list->head; p != NULL; p = p->next)
-    res++;
+    res += WFL_ENTRY_SLOTS;
   return res;
 }
 
@@ -40,92 +46,104 @@ size_t wfl_size(struct wfl *list)
 {
   size_t res = 0;
   for (struct wfl_entry *p = list->head; p != NULL; p = p->next)
-    res += p->data != NULL;
+    for (size_t i = 0; i < WFL_ENTRY_SLOTS; i++)
+      res += p->slots[i] != NULL;
   return res;
 }
 
-#if 0
-void wfl_insert(struct wfl *list, void *data)
+/* Where this vcore starts scanning each entry: its own cache line. */
+static size_t wfl_start_slot(void)
 {
-retry:
-  struct wfl_entry *p = list->head; // list head is never null
-  struct wfl_entry *new_entry = NULL;
-  while (1) {
-    if (p->data == NULL) {
-      if (__sync_bool_compare_and_swap(&p->data, NULL, data)) {
-        free(new_entry);
-        return;
-      }
-    }
-
-    if (p->next != NULL) {
-      p = p->next;
-      continue;
-    }
-
-    if (new_entry == NULL) {
-      new_entry = malloc(sizeof(struct wfl_entry));
-      if (new_entry == NULL)
-        abort();
-      new_entry->data = data;
-      new_entry->next = NULL;
-      wmb();
-    }
- 
-    if (__sync_bool_compare_and_swap(&p->next, NULL, new_entry))
-      return;
-    goto retry;
-    p = list->head;
-  }
+  return (vcore_id() % WFL_LINES_PER_ENTRY) * WFL_SLOTS_PER_LINE;
 }
-#endif
 
-void wfl_insert(struct wfl *list, void *data)
+static void **wfl_slot(struct wfl_entry *p, size_t start, size_t k)
 {
-  struct wfl_entry *p = list->head; // list head is never null
-  while (1) {
-    if (p->data == NULL) {
-      if (__sync_bool_compare_and_swap(&p->data, NULL, data))
-        return;
-    }
-
-    if (p->next == NULL)
-      break;
+  return &p->slots[(start + k) % WFL_ENTRY_SLOTS];
+}
 
-    p = p->next;
-  }
+static struct wfl_entry *wfl_entry_alloc(void)
+{
+  struct wfl_entry *new_entry;
 
-  struct wfl_entry *new_entry = malloc(sizeof(struct wfl_entry));
-  if (new_entry == NULL)
+  if (posix_memalign((void**)&new_entry, __alignof__(struct wfl_entry),
+                     sizeof(struct wfl_entry)))
     abort();
-  new_entry->data = data;
-  new_entry->next = NULL;
-
-  wmb();
+  memset(new_entry, 0, sizeof(struct wfl_entry));
+  return new_entry;
+}
 
+/* Links new_entry in at the end of the list, which is at or after p. */
+static void wfl_append(struct wfl_entry *p, struct wfl_entry *new_entry)
+{
   struct wfl_entry *next;
+
+  wmb();
   while ((next = __sync_val_compare_and_swap(&p->next, NULL, new_entry)))
     p = next;
 }
 
-void *wfl_remove(struct wfl *list)
+void wfl_insert_bulk(struct wfl *list, void **data, size_t nr)
 {
-  for (struct wfl_entry *p = list->head; p != NULL; p = p->next) {
-    if (p->data != NULL) {
-      void *data = atomic_swap_ptr(&p->data, 0);
-      if (data != NULL)
-        return data;
+  size_t start = wfl_start_slot();
+  size_t i = 0;
+  struct wfl_entry *p, *last = NULL; // list head is never null
+
+  for (p = list->head; p != NULL && i < nr; p = p->next) {
+    last = p;
+    for (size_t k = 0; k < WFL_ENTRY_SLOTS && i < nr; k++) {
+      void **slot = wfl_slot(p, start, k);
+      if (*slot == NULL && __sync_bool_compare_and_swap(slot, NULL, data[i]))
+        i++;
     }
   }
-  return NULL;
+  /* The rest go in new entries, filled before anyone can see them. */
+  while (i < nr) {
+    struct wfl_entry *new_entry = wfl_entry_alloc();
+    for (size_t k = 0; k < WFL_ENTRY_SLOTS && i < nr; k++)
+      *wfl_slot(new_entry, start, k) = data[i++];
+    wfl_append(last, new_entry);
+    last = new_entry;
+  }
+}
+
+void wfl_insert(struct wfl *list, void *data)
+{
+  wfl_insert_bulk(list, &data, 1);
+}
+
+size_t wfl_remove_bulk(struct wfl *list, void **data, size_t nr)
+{
+  size_t start = wfl_start_slot();
+  size_t n = 0;
+
+  for (struct wfl_entry *p = list->head; p != NULL && n < nr; p = p->next) {
+    for (size_t k = 0; k < WFL_ENTRY_SLOTS && n < nr; k++) {
+      void **slot = wfl_slot(p, start, k);
+      if (*slot != NULL) {
+        data[n] = atomic_swap_ptr(slot, 0);
+        n += data[n] != NULL;
+      }
+    }
+  }
+  return n;
+}
+
+void *wfl_remove(struct wfl *list)
+{
+  void *data;
+
+  return wfl_remove_bulk(list, &data, 1) ? data : NULL;
 }
 
 size_t wfl_remove_all(struct wfl *list, void *data)
 {
   size_t n = 0;
   for (struct wfl_entry *p = list->head; p != NULL; p = p->next) {
-    if (p->data == data)
-      n += __sync_bool_compare_and_swap(&p->data, data, NULL);
+    for (size_t i = 0; i < WFL_ENTRY_SLOTS; i++) {
+      if (p->slots[i] == data)
+        n += __sync_bool_compare_and_swap(&p->slots[i], data, NULL);
+    }
   }
   return n;
 }
@@ -12,46 +12,74 @@
 
 static inline int futex_wake(int *uaddr, int count);
 static inline int futex_wait(int *uaddr, int val, uint64_t ms_timeout);
+static inline int futex_requeue(int *uaddr, int nr_wake, int nr_requeue,
+                                int *uaddr2, bool cmp, int cmp_val);
 static void *timer_thread(void *arg);
 
+struct futex_bucket;
 struct futex_element {
   TAILQ_ENTRY(futex_element) link;
   pthread_t pthread;
   int *uaddr;
+  // Which bucket we're queued on, or NULL once we're removed.  Protected by
+  // that bucket's lock.  Requeue can move us to another bucket.
+  struct futex_bucket *bucket;
   uint64_t us_timeout;
   struct alarm_waiter awaiter;
   bool timedout;
 };
 TAILQ_HEAD(futex_queue, futex_element);
 
-struct futex_data {
+// Waiters are hashed by uaddr into buckets, each with its own lock, so futex
+// ops on different addresses don't contend and wakes only scan one bucket.
+#define FUTEX_HASH_BITS 8
+#define FUTEX_NR_BUCKETS (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket {
   struct mcs_pdr_lock lock;
   struct futex_queue queue;
-};
-static struct futex_data __futex;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+static struct futex_bucket __futex_buckets[FUTEX_NR_BUCKETS];
 
 static inline void futex_init()
 {
-  mcs_pdr_init(&__futex.lock);
-  TAILQ_INIT(&__futex.queue);
+  for (int i = 0; i < FUTEX_NR_BUCKETS; i++) {
+    mcs_pdr_init(&__futex_buckets[i].lock);
+    TAILQ_INIT(&__futex_buckets[i].queue);
+  }
+}
+
+static struct futex_bucket *futex_bucket(int *uaddr)
+{
+  // Fibonacci hashing; the low bits of uaddr are mostly 0.
+  uint64_t hash = ((uintptr_t)uaddr >> 2) * 0x9e3779b97f4a7c15ULL;
+
+  return &__futex_buckets[hash >> (64 - FUTEX_HASH_BITS)];
 }
 
 static void __futex_timeout(struct alarm_waiter *awaiter) {
-  struct futex_element *__e = NULL;
   struct futex_element *e = (struct futex_element*)awaiter->data;
+  struct futex_bucket *b;
+  bool removed = false;
   //printf("timeout fired: %p\n", e->uaddr);
 
   // Atomically remove the timed-out element from the futex queue if we won the
-  // race against actually completing.
-  mcs_pdr_lock(&__futex.lock);
-  TAILQ_FOREACH(__e, &__futex.queue, link)
-    if (__e == e) break;
-  if (__e != NULL)
-    TAILQ_REMOVE(&__futex.queue, e, link);
-  mcs_pdr_unlock(&__futex.lock);
+  // race against actually completing.  A requeue could move e to another
+  // bucket until we hold e's bucket's lock, so check and retry.
+  while ((b = ACCESS_ONCE(e->bucket))) {
+    mcs_pdr_lock(&b->lock);
+    if (e->bucket == b) {
+      TAILQ_REMOVE(&b->queue, e, link);
+      e->bucket = NULL;
+      removed = true;
+      mcs_pdr_unlock(&b->lock);
+      break;
+    }
+    mcs_pdr_unlock(&b->lock);
+  }
 
   // If we removed it, restart it outside the lock
-  if (__e != NULL) {
+  if (removed) {
     e->timedout = true;
     //printf("timeout: %p\n", e->uaddr);
     uthread_runnable((struct uthread*)e->pthread);
@@ -67,13 +95,14 @@ static void __futex_timeout(struct alarm_waiter *awaiter) {
 static void __futex_block(struct uthread *uthread, void *arg) {
   pthread_t pthread = (pthread_t)uthread;
   struct futex_element *e = (struct futex_element*)arg;
+  struct futex_bucket *b = e->bucket;
 
   // Set the remaining properties of the futex element
   e->pthread = pthread;
   e->timedout = false;
 
   // Insert the futex element into the queue
-  TAILQ_INSERT_TAIL(&__futex.queue, e, link);
+  TAILQ_INSERT_TAIL(&b->queue, e, link);
 
   // Set an alarm for the futex timeout if applicable
   if(e->us_timeout != (uint64_t)-1) {
@@ -89,19 +118,22 @@ static void __futex_block(struct uthread *uthread, void *arg) {
   pthread->state = PTH_BLK_MUTEX;
 
   // Unlock the pdr_lock 
-  mcs_pdr_unlock(&__futex.lock);
+  mcs_pdr_unlock(&b->lock);
 }
 
 static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
 {
+  struct futex_bucket *b = futex_bucket(uaddr);
+
   // Atomically do the following...
-  mcs_pdr_lock(&__futex.lock);
+  mcs_pdr_lock(&b->lock);
   // If the value of *uaddr matches val
   if(*uaddr == val) {
     //printf("wait: %p, %d\n", uaddr, us_timeout);
     // Create a new futex element and initialize it.
     struct futex_element e;
     e.uaddr = uaddr;
+    e.bucket = b;
     e.us_timeout = us_timeout;
     // Yield the uthread...
     // We set the remaining properties of the futex element, set the timeout
@@ -128,40 +160,40 @@ static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
       return -1;
     }
   } else {
-      mcs_pdr_unlock(&__futex.lock);
+      mcs_pdr_unlock(&b->lock);
   }
   return 0;
 }
 
-static inline int futex_wake(int *uaddr, int count)
+// Moves up to count waiters on uaddr from b to q.  Hold b's lock.  Returns how
+// many we moved.
+static int __futex_grab(struct futex_bucket *b, int *uaddr, int count,
+                        struct futex_queue *q)
 {
-  int max = count;
-  struct futex_element *e,*n = NULL;
-  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  struct futex_element *e, *n;
+  int nr = 0;
 
-  // Atomically grab all relevant futex blockers
-  // from the global futex queue
-  mcs_pdr_lock(&__futex.lock);
-  e = TAILQ_FIRST(&__futex.queue);
-  while(e != NULL) {
-    if(count > 0) {
-      n = TAILQ_NEXT(e, link);
-      if(e->uaddr == uaddr) {
-        TAILQ_REMOVE(&__futex.queue, e, link);
-        TAILQ_INSERT_TAIL(&q, e, link);
-        count--;
-      }
-      e = n;
-    }
-    else break;
+  for (e = TAILQ_FIRST(&b->queue); e && (nr < count); e = n) {
+    n = TAILQ_NEXT(e, link);
+    if (e->uaddr != uaddr)
+      continue;
+    TAILQ_REMOVE(&b->queue, e, link);
+    e->bucket = NULL;
+    TAILQ_INSERT_TAIL(q, e, link);
+    nr++;
   }
-  mcs_pdr_unlock(&__futex.lock);
+  return nr;
+}
 
-  // Unblock them outside the lock
-  e = TAILQ_FIRST(&q);
+// Unblocks everyone on q.  Don't hold any bucket locks.
+static void __futex_wake_all(struct futex_queue *q)
+{
+  struct futex_element *e, *n;
+
+  e = TAILQ_FIRST(q);
   while(e != NULL) {
     n = TAILQ_NEXT(e, link);
-    TAILQ_REMOVE(&q, e, link);
+    TAILQ_REMOVE(q, e, link);
     // Cancel the timeout if one was set
     if(e->us_timeout != (uint64_t)-1) {
       // Try and unset the alarm.  If this fails, then we have already
@@ -177,11 +209,72 @@ static inline int futex_wake(int *uaddr, int count)
         e->awaiter.data = NULL;
       }
     }
-    //printf("wake: %p\n", uaddr);
+    //printf("wake: %p\n", e->uaddr);
     uthread_runnable((struct uthread*)e->pthread);
     e = n;
   }
-  return max-count;
+}
+
+static inline int futex_wake(int *uaddr, int count)
+{
+  struct futex_bucket *b = futex_bucket(uaddr);
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  int nr;
+
+  // Atomically grab all relevant futex blockers from uaddr's bucket
+  mcs_pdr_lock(&b->lock);
+  nr = __futex_grab(b, uaddr, count, &q);
+  mcs_pdr_unlock(&b->lock);
+
+  // Unblock them outside the lock
+  __futex_wake_all(&q);
+  return nr;
+}
+
+// Wakes up to nr_wake waiters on uaddr and moves up to nr_requeue of the rest
+// to uaddr2, so they wake from a futex_wake() on uaddr2 instead of stampeding on
+// uaddr.  With cmp, fails with EAGAIN unless *uaddr == cmp_val.  Returns the
+// number woken plus the number requeued.
+static inline int futex_requeue(int *uaddr, int nr_wake, int nr_requeue,
+                                int *uaddr2, bool cmp, int cmp_val)
+{
+  struct futex_bucket *b1 = futex_bucket(uaddr);
+  struct futex_bucket *b2 = futex_bucket(uaddr2);
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  struct futex_queue moving = TAILQ_HEAD_INITIALIZER(moving);
+  struct futex_element *e;
+  int nr_woken, nr_moved;
+
+  // Lock in address order, so concurrent requeues can't deadlock
+  if (b1 <= b2) {
+    mcs_pdr_lock(&b1->lock);
+    if (b2 != b1)
+      mcs_pdr_lock(&b2->lock);
+  } else {
+    mcs_pdr_lock(&b2->lock);
+    mcs_pdr_lock(&b1->lock);
+  }
+  if (cmp && (*uaddr != cmp_val)) {
+    if (b2 != b1)
+      mcs_pdr_unlock(&b2->lock);
+    mcs_pdr_unlock(&b1->lock);
+    errno = EAGAIN;
+    return -1;
+  }
+  nr_woken = __futex_grab(b1, uaddr, nr_wake, &q);
+  nr_moved = __futex_grab(b1, uaddr, nr_requeue, &moving);
+  while ((e = TAILQ_FIRST(&moving))) {
+    TAILQ_REMOVE(&moving, e, link);
+    e->uaddr = uaddr2;
+    e->bucket = b2;
+    TAILQ_INSERT_TAIL(&b2->queue, e, link);
+  }
+  if (b2 != b1)
+    mcs_pdr_unlock(&b2->lock);
+  mcs_pdr_unlock(&b1->lock);
+
+  __futex_wake_all(&q);
+  return nr_woken + nr_moved;
 }
 
 int futex(int *uaddr, int op, int val,
@@ -190,23 +283,27 @@ int futex(int *uaddr, int op, int val,
 {
   // Round to the nearest micro-second
   uint64_t us_timeout = (uint64_t)-1;
-  assert(uaddr2 == NULL);
-  assert(val3 == 0);
-  if(timeout != NULL) {
-    us_timeout = timeout->tv_sec*1000000L + timeout->tv_nsec/1000L;
-    assert(us_timeout > 0);
-  }
 
   run_once(futex_init());
   switch(op) {
     case FUTEX_WAIT:
+      if(timeout != NULL) {
+        us_timeout = timeout->tv_sec*1000000L + timeout->tv_nsec/1000L;
+        assert(us_timeout > 0);
+      }
       return futex_wait(uaddr, val, us_timeout);
     case FUTEX_WAKE:
       return futex_wake(uaddr, val);
+    // Like Linux, the requeue ops pass nr_requeue in the timeout slot
+    case FUTEX_REQUEUE:
+      return futex_requeue(uaddr, val, (int)(uintptr_t)timeout, uaddr2, false,
+                           0);
+    case FUTEX_CMP_REQUEUE:
+      return futex_requeue(uaddr, val, (int)(uintptr_t)timeout, uaddr2, true,
+                           val3);
     default:
       errno = ENOSYS;
       return -1;
   }
   return -1;
 }
-
@@ -4,11 +4,15 @@
 
 __BEGIN_DECLS
 
+/* Same values as Linux */
 enum {
-	FUTEX_WAIT,
-	FUTEX_WAKE
+	FUTEX_WAIT = 0,
+	FUTEX_WAKE = 1,
+	FUTEX_REQUEUE = 3,
+	FUTEX_CMP_REQUEUE = 4
 };
 
+/* For the requeue ops, timeout is really the max number to requeue */
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
           int *uaddr2, int val3);
 
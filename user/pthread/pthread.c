@@ -18,11 +18,40 @@
 #include <parlib/signal.h>
 #include <parlib/arch/trap.h>
 
-struct pthread_queue ready_queue = TAILQ_HEAD_INITIALIZER(ready_queue);
-struct pthread_queue active_queue = TAILQ_HEAD_INITIALIZER(active_queue);
-struct mcs_pdr_lock queue_lock;
-int threads_ready = 0;
-int threads_active = 0;
+/* Per-vcore ready queues.  A thread goes on the queue of the vcore that made it
+ * runnable, which is usually the vcore that last ran it or the one that woke
+ * it, so its cache footprint is nearby.  Vcores run their own queue in FIFO
+ * order, and when it is empty, steal from the other vcores' queues.  With
+ * global_runqueue, everyone uses vcore 0's queue instead, like a single global
+ * ready queue.  Init'd in pthread_lib_init().
+ *
+ * Threads pinned to a vcore (pthread_pin_vcore()) go on that vcore's pinned
+ * queue, which it runs before anything else.  Other vcores only take them if
+ * the pinned vcore isn't running, so they can't get stuck. */
+struct pth_runq {
+	struct spin_pdr_lock		lock;
+	struct pthread_queue		ready;
+	unsigned int				nr_ready;
+	struct pthread_queue		pinned;
+	unsigned int				nr_pinned;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+static struct pth_runq *pth_runqs;
+static bool global_runqueue = FALSE;
+
+/* Per-vcore caches of dead pthreads.  Each one keeps its stack and TLS, so that
+ * creating a thread from the cache doesn't need to mmap, fault in, or build a
+ * new TLS.  Only threads with the default stack size are cached.  Recycled
+ * stacks are not zeroed; a thread shouldn't expect anything from its stack.
+ * Only touched from the owning vcore with notifs disabled, so no locks. */
+#define PTH_TCB_CACHE_MAX 16
+struct pth_tcb_cache {
+	struct pthread_list			tcbs;
+	unsigned int				nr;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+static struct pth_tcb_cache *pth_tcb_caches;
+
+atomic_t threads_ready;
+atomic_t threads_active;
 atomic_t threads_total;
 bool can_adjust_vcores = TRUE;
 bool need_tls = TRUE;
@@ -44,6 +73,7 @@ static void pth_thread_blockon_sysc(struct uthread *uthread, void *sysc);
 static void pth_thread_has_blocked(struct uthread *uthread, int flags);
 static void pth_thread_refl_fault(struct uthread *uth,
                                   struct user_context *ctx);
+static struct uthread *pth_thread_pick_next(void);
 
 /* Event Handlers */
 static void pth_handle_syscall(struct event_msg *ev_msg, unsigned int ev_type,
@@ -56,13 +86,95 @@ struct schedule_ops pthread_sched_ops = {
 	.thread_blockon_sysc = pth_thread_blockon_sysc,
 	.thread_has_blocked = pth_thread_has_blocked,
 	.thread_refl_fault = pth_thread_refl_fault,
+	.thread_pick_next = pth_thread_pick_next,
 };
 
 /* Static helpers */
 static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
+static struct pthread_tcb *pth_tcb_cache_get(uint32_t stacksize,
+                                             uint32_t guardsize);
+static void __pthread_free_tcb(struct pthread_tcb *pthread);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
 
+/* Helper: the ready queue threads made runnable on vcoreid go on. */
+static struct pth_runq *pth_runq_of(uint32_t vcoreid)
+{
+	return global_runqueue ? &pth_runqs[0] : &pth_runqs[vcoreid];
+}
+
+/* Helper: pops the first thread off one of runq's queues, if any.  The nr peek
+ * keeps thieves from taking locks on empty queues. */
+static struct pthread_tcb *__pth_runq_pop(struct pth_runq *runq,
+                                          struct pthread_queue *queue,
+                                          unsigned int *nr)
+{
+	struct pthread_tcb *pthread;
+
+	if (!ACCESS_ONCE(*nr))
+		return NULL;
+	spin_pdr_lock(&runq->lock);
+	pthread = TAILQ_FIRST(queue);
+	if (pthread) {
+		TAILQ_REMOVE(queue, pthread, tq_next);
+		(*nr)--;
+	}
+	spin_pdr_unlock(&runq->lock);
+	return pthread;
+}
+
+static struct pthread_tcb *pth_runq_pop(struct pth_runq *runq)
+{
+	return __pth_runq_pop(runq, &runq->ready, &runq->nr_ready);
+}
+
+static struct pthread_tcb *pth_runq_pop_pinned(struct pth_runq *runq)
+{
+	return __pth_runq_pop(runq, &runq->pinned, &runq->nr_pinned);
+}
+
+/* Helper: puts a runnable pinned thread on its vcore's pinned queue. */
+static void pth_runq_push_pinned(struct pthread_tcb *pthread)
+{
+	struct pth_runq *runq = &pth_runqs[pthread->pin_vcoreid];
+
+	spin_pdr_lock(&runq->lock);
+	TAILQ_INSERT_TAIL(&runq->pinned, pthread, tq_next);
+	runq->nr_pinned++;
+	spin_pdr_unlock(&runq->lock);
+}
+
+/* Helper: gets the next thread for vcoreid to run.  It tries vcoreid's queue,
+ * then steals from everyone else's, starting with the next vcore.  We check
+ * every queue (not just the online vcores' queues), since a vcore could have
+ * been preempted or have yielded with threads still on its queue. */
+static struct pthread_tcb *pth_get_ready(uint32_t vcoreid)
+{
+	struct pthread_tcb *pthread;
+	uint32_t nr_runqs = max_vcores();
+	uint32_t home = global_runqueue ? 0 : vcoreid;
+	uint32_t victim;
+
+	pthread = pth_runq_pop_pinned(&pth_runqs[vcoreid]);
+	if (!pthread)
+		pthread = pth_runq_pop(&pth_runqs[home]);
+	for (int i = 1; !pthread && (i < nr_runqs); i++)
+		pthread = pth_runq_pop(&pth_runqs[(home + i) % nr_runqs]);
+	/* Last resort: threads pinned to vcores that aren't running */
+	for (int i = 1; !pthread && (i < nr_runqs); i++) {
+		victim = (vcoreid + i) % nr_runqs;
+		if (!vcore_is_mapped(victim) || vcore_is_preempted(victim))
+			pthread = pth_runq_pop_pinned(&pth_runqs[victim]);
+	}
+	if (!pthread)
+		return NULL;
+	assert(pthread->state == PTH_RUNNABLE);
+	pthread->state = PTH_RUNNING;
+	atomic_dec(&threads_ready);
+	atomic_inc(&threads_active);
+	return pthread;
+}
+
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
  * event.c (table of function pointers, stuff like that). */
@@ -85,16 +197,8 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		new_thread = TAILQ_FIRST(&ready_queue);
+		new_thread = pth_get_ready(vcoreid);
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
-			assert(new_thread->state == PTH_RUNNABLE);
-			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
 			/* If you see what looks like the same uthread running in multiple
 			 * places, your list might be jacked up.  Turn this on. */
 			printd("[P] got uthread %08p on vc %d state %08p flags %08p\n",
@@ -103,7 +207,6 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
 		/* TODO: you can imagine having something smarter here, like spin for a
@@ -121,6 +224,18 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	assert(0);
 }
 
+/* Cooperative switches (e.g. pthread_yield()) run the next ready thread right
+ * from the yield, without going through pth_sched_entry(). */
+static struct uthread *pth_thread_pick_next(void)
+{
+	struct pthread_tcb *new_thread = pth_get_ready(vcore_id());
+
+	if (!new_thread)
+		return 0;
+	uthread_prep_pending_signals((struct uthread*)new_thread);
+	return (struct uthread*)new_thread;
+}
+
 /* Could move this, along with start_routine and arg, into the 2LSs */
 static void __pthread_run(void)
 {
@@ -133,6 +248,7 @@ static void __pthread_run(void)
 static void pth_thread_runnable(struct uthread *uthread)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
+	struct pth_runq *runq;
 	/* At this point, the 2LS can see why the thread blocked and was woken up in
 	 * the first place (coupling these things together).  On the yield path, the
 	 * 2LS was involved and was able to set the state.  Now when we get the
@@ -151,17 +267,25 @@ static void pth_thread_runnable(struct uthread *uthread)
 			panic("Odd state %d for pthread %08p\n", pthread->state, pthread);
 	}
 	pthread->state = PTH_RUNNABLE;
-	/* Insert the newly created thread into the ready queue of threads.
-	 * It will be removed from this queue later when vcore_entry() comes up */
-	mcs_pdr_lock(&queue_lock);
-	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
-	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
-	threads_ready++;
-	mcs_pdr_unlock(&queue_lock);
+	if (pthread->pinned) {
+		pth_runq_push_pinned(pthread);
+	} else {
+		/* Insert the newly created thread into our vcore's ready queue.  It
+		 * will be removed from this queue later when vcore_entry() comes up.
+		 * If we're a uthread, we could migrate before we lock, which just means
+		 * we use some other vcore's queue. */
+		runq = pth_runq_of(vcore_id());
+		spin_pdr_lock(&runq->lock);
+		/* Again, GIANT WARNING: if you change this, change batch wakeup code */
+		TAILQ_INSERT_TAIL(&runq->ready, pthread, tq_next);
+		runq->nr_ready++;
+		spin_pdr_unlock(&runq->lock);
+	}
+	atomic_inc(&threads_ready);
 	/* Smarter schedulers should look at the num_vcores() and how much work is
 	 * going on to make a decision about how many vcores to request. */
 	if (can_adjust_vcores)
-		vcore_request(threads_ready);
+		vcore_request(atomic_read(&threads_ready));
 }
 
 /* For some reason not under its control, the uthread stopped running (compared
@@ -364,6 +488,30 @@ void pthread_need_tls(bool need)
 	need_tls = need;
 }
 
+/* Tells the pthread 2LS to put all runnable threads on one ready queue, instead
+ * of on per-vcore queues.  Threads run in the order they became runnable, at
+ * the cost of more contention and less locality.  Useful for testing fairness.
+ * Can be changed at any time. */
+void pthread_use_global_runqueue(bool global)
+{
+	global_runqueue = global;
+}
+
+/* Pins thread to vcoreid, or unpins it for -1.  A pinned thread only runs on
+ * its vcore while that vcore is running, which keeps it (and its cache
+ * footprint) in one place, e.g. one thread per guest pcore in a VMM.  Takes
+ * effect the next time the thread becomes runnable.  The 2LS asks for vcores
+ * as usual; pin to vcores you expect to have. */
+int pthread_pin_vcore(pthread_t thread, int vcoreid)
+{
+	if (vcoreid >= (int)max_vcores())
+		return EINVAL;
+	thread->pin_vcoreid = vcoreid < 0 ? 0 : vcoreid;
+	wmb();	/* pinned is the flag; pin_vcoreid must be set when it is */
+	thread->pinned = vcoreid >= 0;
+	return 0;
+}
+
 /* Pthread interface stuff and helpers */
 
 int pthread_attr_init(pthread_attr_t *a)
@@ -371,6 +519,7 @@ int pthread_attr_init(pthread_attr_t *a)
 	a->stackaddr = 0;
  	a->stacksize = PTHREAD_STACK_SIZE;
 	a->detachstate = PTHREAD_CREATE_JOINABLE;
+	a->guardsize = 0;
 	/* priority and policy should be set by anyone changing inherit. */
 	a->sched_priority = 0;
 	a->sched_policy = 0;
@@ -385,7 +534,8 @@ int pthread_attr_destroy(pthread_attr_t *a)
 
 static void __pthread_free_stack(struct pthread_tcb *pt)
 {
-	int ret = munmap(pt->stacktop - pt->stacksize, pt->stacksize);
+	int ret = munmap(pt->stacktop - pt->stacksize - pt->guardsize,
+	                 pt->stacksize + pt->guardsize);
 	assert(!ret);
 }
 
@@ -393,11 +543,17 @@ static int __pthread_allocate_stack(struct pthread_tcb *pt)
 {
 	int force_a_page_fault;
 	assert(pt->stacksize);
-	void* stackbot = mmap(0, pt->stacksize,
+	void* stackbot = mmap(0, pt->stacksize + pt->guardsize,
 	                      PROT_READ|PROT_WRITE|PROT_EXEC,
 	                      MAP_ANONYMOUS, -1, 0);
 	if (stackbot == MAP_FAILED)
 		return -1; // errno set by mmap
+	/* The guard is the bottom of the mapping, so overflows fault */
+	if (pt->guardsize && mprotect(stackbot, pt->guardsize, PROT_NONE)) {
+		munmap(stackbot, pt->stacksize + pt->guardsize);
+		return -1;
+	}
+	stackbot += pt->guardsize;
 	pt->stacktop = stackbot + pt->stacksize;
 	/* Want the top of the stack populated, but not the rest of the stack;
 	 * that'll grow on demand (up to pt->stacksize) */
@@ -405,6 +561,53 @@ static int __pthread_allocate_stack(struct pthread_tcb *pt)
 	return 0;
 }
 
+/* Returns a cached pthread_tcb with a matching stack (and maybe a TLS), or 0.
+ * The caller resets everything else. */
+static struct pthread_tcb *pth_tcb_cache_get(uint32_t stacksize,
+                                             uint32_t guardsize)
+{
+	struct pth_tcb_cache *cache;
+	struct pthread_tcb *pthread;
+
+	if (stacksize != PTHREAD_STACK_SIZE)
+		return NULL;
+	uth_disable_notifs();
+	cache = &pth_tcb_caches[vcore_id()];
+	pthread = SLIST_FIRST(&cache->tcbs);
+	/* Just the first one; apps usually use the same attrs for every thread */
+	if (pthread && (pthread->guardsize == guardsize)) {
+		SLIST_REMOVE_HEAD(&cache->tcbs, sl_next);
+		cache->nr--;
+	} else {
+		pthread = NULL;
+	}
+	uth_enable_notifs();
+	return pthread;
+}
+
+/* Frees a pthread_tcb that no one will touch again, along with its stack and
+ * TLS, or puts them all in the calling vcore's cache. */
+static void __pthread_free_tcb(struct pthread_tcb *pthread)
+{
+	struct pth_tcb_cache *cache;
+
+	if ((pthread->stacksize == PTHREAD_STACK_SIZE) &&
+	    !(pthread->uthread.flags & UTHREAD_IS_THREAD0)) {
+		uth_disable_notifs();
+		cache = &pth_tcb_caches[vcore_id()];
+		if (cache->nr < PTH_TCB_CACHE_MAX) {
+			SLIST_INSERT_HEAD(&cache->tcbs, pthread, sl_next);
+			cache->nr++;
+			uth_enable_notifs();
+			return;
+		}
+		uth_enable_notifs();
+	}
+	uthread_cleanup(&pthread->uthread);
+	__pthread_free_stack(pthread);
+	free(pthread);
+}
+
 // Warning, this will reuse numbers eventually
 static int get_next_pid(void)
 {
@@ -448,6 +651,7 @@ int pthread_getattr_np(pthread_t __th, pthread_attr_t *__attr)
 {
 	__attr->stackaddr = __th->stacktop - __th->stacksize;
 	__attr->stacksize = __th->stacksize;
+	__attr->guardsize = __th->guardsize;
 	if (__th->detached)
 		__attr->detachstate = PTHREAD_CREATE_DETACHED;
 	else
@@ -467,7 +671,22 @@ void __attribute__((constructor)) pthread_lib_init(void)
 	init_once_racy(return);
 	uthread_lib_init();
 
-	mcs_pdr_init(&queue_lock);
+	ret = posix_memalign((void**)&pth_runqs, __alignof__(struct pth_runq),
+	                     sizeof(struct pth_runq) * max_vcores());
+	assert(!ret);
+	for (int i = 0; i < max_vcores(); i++) {
+		spin_pdr_init(&pth_runqs[i].lock);
+		TAILQ_INIT(&pth_runqs[i].ready);
+		pth_runqs[i].nr_ready = 0;
+		TAILQ_INIT(&pth_runqs[i].pinned);
+		pth_runqs[i].nr_pinned = 0;
+	}
+	pth_tcb_caches = malloc(sizeof(struct pth_tcb_cache) * max_vcores());
+	assert(pth_tcb_caches);
+	for (int i = 0; i < max_vcores(); i++) {
+		SLIST_INIT(&pth_tcb_caches[i].tcbs);
+		pth_tcb_caches[i].nr = 0;
+	}
 	/* Create a pthread_tcb for the main thread */
 	ret = posix_memalign((void**)&t, __alignof__(struct pthread_tcb),
 	                     sizeof(struct pthread_tcb));
@@ -484,11 +703,8 @@ void __attribute__((constructor)) pthread_lib_init(void)
 	t->sched_policy = SCHED_FIFO;
 	t->sched_priority = 0;
 	SLIST_INIT(&t->cr_stack);
-	/* Put the new pthread (thread0) on the active queue */
-	mcs_pdr_lock(&queue_lock);
-	threads_active++;
-	TAILQ_INSERT_TAIL(&active_queue, t, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	/* Account for the new pthread (thread0), which is running */
+	atomic_init(&threads_active, 1);
 	/* Tell the kernel where and how we want to receive events.  This is just an
 	 * example of what to do to have a notification turned on.  We're turning on
 	 * USER_IPIs, posting events to vcore 0's vcpd, and telling the kernel to
@@ -572,6 +788,9 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	struct uth_thread_attr uth_attr = {0};
 	struct pthread_tcb *parent;
 	struct pthread_tcb *pthread;
+	uint32_t stacksize = PTHREAD_STACK_SIZE;	/* default */
+	uint32_t guardsize = 0;
+	void *stacktop = 0, *tls_desc = 0;
 	int ret;
 
 	/* For now, unconditionally become an mcp when creating a pthread (if not
@@ -580,11 +799,26 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	pthread_mcp_init();
 
 	parent = (struct pthread_tcb*)current_uthread;
-	ret = posix_memalign((void**)&pthread, __alignof__(struct pthread_tcb),
-	                     sizeof(struct pthread_tcb));
-	assert(!ret);
+	if (attr) {
+		if (attr->stacksize)					/* don't set a 0 stacksize */
+			stacksize = attr->stacksize;
+		guardsize = ROUNDUP(attr->guardsize, PGSIZE);
+	}
+	pthread = pth_tcb_cache_get(stacksize, guardsize);
+	if (pthread) {
+		/* Recycled: keep the stack and TLS, reset everything else */
+		stacktop = pthread->stacktop;
+		tls_desc = pthread->uthread.tls_desc;
+	} else {
+		ret = posix_memalign((void**)&pthread, __alignof__(struct pthread_tcb),
+		                     sizeof(struct pthread_tcb));
+		assert(!ret);
+	}
 	memset(pthread, 0, sizeof(struct pthread_tcb));	/* aggressively 0 for bugs*/
-	pthread->stacksize = PTHREAD_STACK_SIZE;	/* default */
+	pthread->stacksize = stacksize;
+	pthread->guardsize = guardsize;
+	pthread->stacktop = stacktop;
+	pthread->uthread.tls_desc = tls_desc;	/* uthread_init() reuses it */
 	pthread->state = PTH_CREATED;
 	pthread->id = get_next_pid();
 	pthread->detached = FALSE;				/* default */
@@ -595,8 +829,6 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	SLIST_INIT(&pthread->cr_stack);
 	/* Respect the attributes */
 	if (attr) {
-		if (attr->stacksize)					/* don't set a 0 stacksize */
-			pthread->stacksize = attr->stacksize;
 		if (attr->detachstate == PTHREAD_CREATE_DETACHED)
 			pthread->detached = TRUE;
 		if (attr->sched_inherit == PTHREAD_EXPLICIT_SCHED) {
@@ -604,8 +836,8 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 			pthread->sched_priority = attr->sched_priority;
 		}
 	}
-	/* allocate a stack */
-	if (__pthread_allocate_stack(pthread))
+	/* allocate a stack, unless we recycled one */
+	if (!pthread->stacktop && __pthread_allocate_stack(pthread))
 		printf("We're fucked\n");
 	/* Set the u_tf to start up in __pthread_run, which will call the real
 	 * start_routine and pass it the arg.  Note those aren't set until later in
@@ -632,14 +864,10 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 }
 
 /* Helper that all pthread-controlled yield paths call.  Just does some
- * accounting.  This is another example of how the much-loathed (and loved)
- * active queue is keeping us honest.  Need to export for sem and friends. */
+ * accounting.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
-	mcs_pdr_lock(&queue_lock);
-	threads_active--;
-	TAILQ_REMOVE(&active_queue, pthread, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	atomic_dec(&threads_active);
 }
 
 /* Callback/bottom half of join, called from __uthread_yield (vcore context).
@@ -685,7 +913,7 @@ int pthread_join(struct pthread_tcb *join_target, void **retval)
 	}
 	if (retval)
 		*retval = join_target->retval;
-	free(join_target);
+	__pthread_free_tcb(join_target);
 	return 0;
 }
 
@@ -703,14 +931,13 @@ static void __pth_exit_cb(struct uthread *uthread, void *junk)
 	__pthread_generic_yield(pthread);
 	/* Catch some bugs */
 	pthread->state = PTH_EXITING;
-	/* Destroy the pthread */
-	uthread_cleanup(uthread);
-	/* Cleanup, mirroring pthread_create() */
-	__pthread_free_stack(pthread);
 	/* TODO: race on detach state (see join) */
 	if (pthread->detached) {
-		free(pthread);
+		/* Cleanup, mirroring pthread_create().  We're off the stack now. */
+		__pthread_free_tcb(pthread);
 	} else {
+		/* Our joiner frees (or caches) our tcb, stack, and TLS.  Keeping the
+		 * stack until then lets the pair get recycled together. */
 		/* See if someone is joining on us.  If not, we're done (and the
 		 * joiner will wake itself when it saw us there instead of 0). */
 		temp_pth = atomic_swap_ptr((void**)&pthread->joiner, pthread);
@@ -846,7 +1073,7 @@ int pthread_mutex_init(pthread_mutex_t* m, const pthread_mutexattr_t* attr)
 /* TODO: consider making this a 2LS op */
 static inline bool safe_to_spin(unsigned int *state)
 {
-	return !threads_ready;
+	return !atomic_read(&threads_ready);
 }
 
 /* Set *spun to 0 when calling this the first time.  It will yield after 'spins'
@@ -922,21 +1149,35 @@ static void swap_slists(struct pthread_list *a, struct pthread_list *b)
 static void wake_slist(struct pthread_list *to_wake)
 {
 	unsigned int nr_woken = 0;	/* assuming less than 4 bil threads */
+	unsigned int nr_ready = 0;
 	struct pthread_tcb *pthread_i, *pth_temp;
+	struct pth_runq *runq = pth_runq_of(vcore_id());
+	struct pthread_queue pinned = TAILQ_HEAD_INITIALIZER(pinned);
 	/* Amortize the lock grabbing over all restartees */
-	mcs_pdr_lock(&queue_lock);
+	spin_pdr_lock(&runq->lock);
 	/* Do the work of pth_thread_runnable().  We're in uth context here, but I
 	 * think it's okay.  When we need to (when locking) we drop into VC ctx, as
-	 * far as the kernel and other cores are concerned. */
+	 * far as the kernel and other cores are concerned.  Pinned threads go to
+	 * their own vcores' queues once we've unlocked ours. */
 	SLIST_FOREACH_SAFE(pthread_i, to_wake, sl_next, pth_temp) {
 		pthread_i->state = PTH_RUNNABLE;
 		nr_woken++;
-		TAILQ_INSERT_TAIL(&ready_queue, pthread_i, tq_next);
+		if (pthread_i->pinned) {
+			TAILQ_INSERT_TAIL(&pinned, pthread_i, tq_next);
+			continue;
+		}
+		nr_ready++;
+		TAILQ_INSERT_TAIL(&runq->ready, pthread_i, tq_next);
+	}
+	runq->nr_ready += nr_ready;
+	spin_pdr_unlock(&runq->lock);
+	while ((pthread_i = TAILQ_FIRST(&pinned))) {
+		TAILQ_REMOVE(&pinned, pthread_i, tq_next);
+		pth_runq_push_pinned(pthread_i);
 	}
-	threads_ready += nr_woken;
-	mcs_pdr_unlock(&queue_lock);
+	atomic_fetch_and_add(&threads_ready, nr_woken);
 	if (can_adjust_vcores)
-		vcore_request(threads_ready);
+		vcore_request(atomic_read(&threads_ready));
 }
 
 int pthread_cond_broadcast(pthread_cond_t *c)
@@ -1056,20 +1297,108 @@ int pthread_once(pthread_once_t* once_control, void (*init_routine)(void))
   return 0;
 }
 
+/* Tree barrier nodes.  Leaves take up to PTH_BARRIER_FANIN arrivals, and each
+ * inner node takes one from each of its children.  Waiters spin on their
+ * node's release word, then sleep on its list. */
+#define PTH_BARRIER_FANIN			4
+#define PTH_BARRIER_MAX_DEPTH		16
+#define PTH_BARRIER_SPINS			10000
+
+struct pth_barrier_node {
+	atomic_t					count;
+	int							cap;
+	volatile int				release;
+	struct pth_barrier_node		*parent;
+	struct spin_pdr_lock		lock;
+	struct pthread_list			waiters;
+	int							nr_waiters;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+int pthread_barrierattr_init(pthread_barrierattr_t *a)
+{
+	*a = PTHREAD_BARRIER_CENTRAL;
+	return 0;
+}
+
+int pthread_barrierattr_destroy(pthread_barrierattr_t *a)
+{
+	return 0;
+}
+
+int pthread_barrierattr_settype_np(pthread_barrierattr_t *a, int type)
+{
+	if (type != PTHREAD_BARRIER_CENTRAL && type != PTHREAD_BARRIER_TREE)
+		return EINVAL;
+	*a = type;
+	return 0;
+}
+
+/* Builds the tree bottom up: nr_leaves leaves, then each level has a node per
+ * PTH_BARRIER_FANIN nodes of the level below, up to the root. */
+static int __pth_barrier_tree_init(pthread_barrier_t *b, int count)
+{
+	int nr_nodes = 0, level_start, level_sz, nr_parents;
+	struct pth_barrier_node *node;
+
+	for (level_sz = DIV_ROUND_UP(count, PTH_BARRIER_FANIN); level_sz > 1;
+	     level_sz = DIV_ROUND_UP(level_sz, PTH_BARRIER_FANIN))
+		nr_nodes += level_sz;
+	nr_nodes++;	/* root */
+	if (posix_memalign((void**)&b->nodes, ARCH_CL_SIZE,
+	                   sizeof(struct pth_barrier_node) * nr_nodes))
+		return ENOMEM;
+	memset(b->nodes, 0, sizeof(struct pth_barrier_node) * nr_nodes);
+	for (int i = 0; i < nr_nodes; i++) {
+		node = &b->nodes[i];
+		atomic_init(&node->count, 0);
+		spin_pdr_init(&node->lock);
+		SLIST_INIT(&node->waiters);
+	}
+	b->nr_leaves = DIV_ROUND_UP(count, PTH_BARRIER_FANIN);
+	for (int i = 0; i < b->nr_leaves; i++)
+		b->nodes[i].cap = MIN(PTH_BARRIER_FANIN,
+		                      count - i * PTH_BARRIER_FANIN);
+	level_start = 0;
+	level_sz = b->nr_leaves;
+	while (level_sz > 1) {
+		nr_parents = DIV_ROUND_UP(level_sz, PTH_BARRIER_FANIN);
+		for (int i = 0; i < level_sz; i++) {
+			node = &b->nodes[level_start + level_sz + i / PTH_BARRIER_FANIN];
+			b->nodes[level_start + i].parent = node;
+			node->cap++;
+		}
+		level_start += level_sz;
+		level_sz = nr_parents;
+	}
+	return 0;
+}
+
 int pthread_barrier_init(pthread_barrier_t *b,
                          const pthread_barrierattr_t *a, int count)
 {
+	if (count <= 0)
+		return EINVAL;
 	b->total_threads = count;
 	b->sense = 0;
 	atomic_set(&b->count, count);
 	spin_pdr_init(&b->lock);
 	SLIST_INIT(&b->waiters);
 	b->nr_waiters = 0;
+	b->type = a ? *a : PTHREAD_BARRIER_CENTRAL;
+	b->nodes = 0;
+	b->nr_leaves = 0;
+	if (b->type == PTHREAD_BARRIER_TREE)
+		return __pth_barrier_tree_init(b, count);
 	return 0;
 }
 
+/* Where a barrier waiter sleeps: both barrier types have a lock, a list of
+ * sleepers, and a word that becomes ls when they're free to go. */
 struct barrier_junk {
-	pthread_barrier_t				*b;
+	struct spin_pdr_lock			*lock;
+	struct pthread_list				*waiters;
+	int								*nr_waiters;
+	volatile int					*sense;
 	int								ls;
 };
 
@@ -1077,25 +1406,133 @@ struct barrier_junk {
 static void __pth_barrier_cb(struct uthread *uthread, void *junk)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
-	pthread_barrier_t *b = ((struct barrier_junk*)junk)->b;
-	int ls = ((struct barrier_junk*)junk)->ls;
+	struct barrier_junk *bj = (struct barrier_junk*)junk;
 	/* Removes from active list, we can reuse.  must also restart */
 	__pthread_generic_yield(pthread);
 	/* TODO: if we used a trylock, we could bail as soon as we see sense */
-	spin_pdr_lock(&b->lock);
+	spin_pdr_lock(bj->lock);
 	/* If sense is ls (our free value), we lost the race and shouldn't sleep */
-	if (b->sense == ls) {
+	if (*bj->sense == bj->ls) {
 		/* TODO: i'd like to fast-path the wakeup, skipping pth_runnable */
 		pthread->state = PTH_BLK_YIELDING;	/* not sure which state for this */
-		spin_pdr_unlock(&b->lock);
+		spin_pdr_unlock(bj->lock);
 		pth_thread_runnable(uthread);
 		return;
 	}
 	/* otherwise, we sleep */
 	pthread->state = PTH_BLK_MUTEX;	/* TODO: consider ignoring this */
-	SLIST_INSERT_HEAD(&b->waiters, pthread, sl_next);
-	b->nr_waiters++;
-	spin_pdr_unlock(&b->lock);
+	SLIST_INSERT_HEAD(bj->waiters, pthread, sl_next);
+	(*bj->nr_waiters)++;
+	spin_pdr_unlock(bj->lock);
+}
+
+/* Waits for node's release word to become ls: spins a while, then sleeps. */
+static void __pth_barrier_node_wait(struct pth_barrier_node *node, int ls)
+{
+	unsigned int spin_state = 0;
+	struct barrier_junk local_junk;
+
+	for (int i = 0; i < PTH_BARRIER_SPINS; i++) {
+		if (node->release == ls)
+			return;
+		if (!safe_to_spin(&spin_state))
+			break;
+		cpu_relax();
+	}
+	local_junk.lock = &node->lock;
+	local_junk.waiters = &node->waiters;
+	local_junk.nr_waiters = &node->nr_waiters;
+	local_junk.sense = &node->release;
+	local_junk.ls = ls;
+	uthread_yield(TRUE, __pth_barrier_cb, &local_junk);
+}
+
+/* Frees node's waiters.  The release word flips before the count resets, so
+ * that anyone who gets into the node for the next round (after the reset) sees
+ * the new release word. */
+static void __pth_barrier_node_release(struct pth_barrier_node *node, int ls)
+{
+	struct pthread_list restartees = SLIST_HEAD_INITIALIZER(restartees);
+
+	wmb();
+	node->release = ls;
+	wmb();
+	atomic_set(&node->count, 0);
+	spin_pdr_lock(&node->lock);
+	if (!node->nr_waiters) {
+		spin_pdr_unlock(&node->lock);
+		return;
+	}
+	swap_slists(&restartees, &node->waiters);
+	node->nr_waiters = 0;
+	spin_pdr_unlock(&node->lock);
+	wake_slist(&restartees);
+}
+
+/* Arrive at a leaf with room.  Threads on nearby vcores start at the same
+ * leaf.  Leaves' caps add up to the number of threads, so there's always room
+ * somewhere, unless we raced ahead into the next round and the leaves we need
+ * haven't been released yet.  Whoever releases them might be waiting for a
+ * vcore, so we yield if anyone is runnable. */
+static struct pth_barrier_node *__pth_barrier_arrive(pthread_barrier_t *b,
+                                                     long *old_count)
+{
+	int start = (vcore_id() / PTH_BARRIER_FANIN) % b->nr_leaves;
+	int idx = start;
+	unsigned int spin_state = 0;
+	struct pth_barrier_node *node;
+	long count;
+
+	while (1) {
+		node = &b->nodes[idx];
+		count = atomic_read(&node->count);
+		if (count < node->cap &&
+		    atomic_cas(&node->count, count, count + 1)) {
+			*old_count = count;
+			return node;
+		}
+		idx = (idx + 1) % b->nr_leaves;
+		if (idx == start && !safe_to_spin(&spin_state))
+			pthread_yield();
+		cpu_relax();
+	}
+}
+
+/* The last arrival at a node moves up to its parent; everyone else waits on
+ * the node.  The root's last arrival is the serial thread, and it releases the
+ * nodes it won on the way up, top down.  Each thread it frees does the same for
+ * the nodes it won. */
+static int __pth_barrier_tree_wait(pthread_barrier_t *b)
+{
+	struct pth_barrier_node *won[PTH_BARRIER_MAX_DEPTH];
+	int won_ls[PTH_BARRIER_MAX_DEPTH];
+	int nr_won = 0, ret = 0;
+	struct pth_barrier_node *node;
+	long old_count;
+	int ls;
+
+	node = __pth_barrier_arrive(b, &old_count);
+	while (1) {
+		/* Read after our arrival (the atomic is a barrier), see release */
+		ls = !node->release;
+		if (old_count + 1 < node->cap) {
+			__pth_barrier_node_wait(node, ls);
+			break;
+		}
+		assert(nr_won < PTH_BARRIER_MAX_DEPTH);
+		won[nr_won] = node;
+		won_ls[nr_won] = ls;
+		nr_won++;
+		if (!node->parent) {
+			ret = PTHREAD_BARRIER_SERIAL_THREAD;
+			break;
+		}
+		node = node->parent;
+		old_count = atomic_fetch_and_add(&node->count, 1);
+	}
+	while (nr_won--)
+		__pth_barrier_node_release(won[nr_won], won_ls[nr_won]);
+	return ret;
 }
 
 /* We assume that the same threads participating in the barrier this time will
@@ -1119,8 +1556,11 @@ int pthread_barrier_wait(pthread_barrier_t *b)
 	struct pthread_list restartees = SLIST_HEAD_INITIALIZER(restartees);
 	struct pthread_tcb *pthread_i;
 	struct barrier_junk local_junk;
-	
-	long old_count = atomic_fetch_and_add(&b->count, -1);
+	long old_count;
+
+	if (b->type == PTHREAD_BARRIER_TREE)
+		return __pth_barrier_tree_wait(b);
+	old_count = atomic_fetch_and_add(&b->count, -1);
 
 	if (old_count == 1) {
 		printd("Thread %d is last to hit the barrier, resetting...\n",
@@ -1154,7 +1594,10 @@ int pthread_barrier_wait(pthread_barrier_t *b)
 		} while (safe_to_spin(&spin_state));
 
 		/* Try to sleep, when we wake/return, we're free to go */
-		local_junk.b = b;
+		local_junk.lock = &b->lock;
+		local_junk.waiters = &b->waiters;
+		local_junk.nr_waiters = &b->nr_waiters;
+		local_junk.sense = &b->sense;
 		local_junk.ls = ls;
 		uthread_yield(TRUE, __pth_barrier_cb, &local_junk);
 		// assert(b->sense == ls);
@@ -1167,6 +1610,8 @@ int pthread_barrier_destroy(pthread_barrier_t *b)
 	assert(SLIST_EMPTY(&b->waiters));
 	assert(!b->nr_waiters);
 	/* Free any locks (if we end up using an MCS) */
+	free(b->nodes);
+	b->nodes = 0;
 	return 0;
 }
 
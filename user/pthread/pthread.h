@@ -47,12 +47,15 @@ struct pthread_tcb {
 	struct pthread_tcb *joiner;			/* raced on by exit and join */
 	uint32_t id;
 	uint32_t stacksize;
+	uint32_t guardsize;		/* below the stack, part of the same mapping */
 	void *stacktop;
 	void *(*start_routine)(void*);
 	void *arg;
 	void *retval;
 	int sched_policy;
 	int sched_priority;		/* careful, GNU #defines this to __sched_priority */
+	bool pinned;
+	uint32_t pin_vcoreid;
 	struct pthread_cleanup_stack cr_stack;
 };
 typedef struct pthread_tcb* pthread_t;
@@ -90,6 +93,15 @@ typedef struct
   atomic_t lock;
 } pthread_mutex_t;
 
+/* Barrier types, set with pthread_barrierattr_settype_np().  CENTRAL (the
+ * default) has everyone hit one counter and spin on one sense word.  TREE is a
+ * combining tree: threads arrive at leaves of a few threads each and only the
+ * last arrival at a node goes up, so waiters spin on their own node's line. */
+#define PTHREAD_BARRIER_CENTRAL		0
+#define PTHREAD_BARRIER_TREE		1
+
+struct pth_barrier_node;
+
 typedef struct
 {
 	int							total_threads;
@@ -98,6 +110,9 @@ typedef struct
 	struct spin_pdr_lock		lock;
 	struct pthread_list			waiters;
 	int							nr_waiters;
+	int							type;
+	struct pth_barrier_node		*nodes;	/* TREE only */
+	int							nr_leaves;
 } pthread_barrier_t;
 
 #define WAITER_CLEARED 0
@@ -153,6 +168,8 @@ typedef dtls_key_t pthread_key_t;
 /* Akaros pthread extensions / hacks */
 void pthread_can_vcore_request(bool can);	/* default is TRUE */
 void pthread_need_tls(bool need);			/* default is TRUE */
+void pthread_use_global_runqueue(bool global);	/* default is FALSE */
+int pthread_pin_vcore(pthread_t thread, int vcoreid);	/* -1 unpins */
 void pthread_lib_init(void);
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
@@ -219,6 +236,9 @@ int pthread_equal(pthread_t t1, pthread_t t2);
 void pthread_exit(void* ret);
 int pthread_once(pthread_once_t* once_control, void (*init_routine)(void));
 
+int pthread_barrierattr_init(pthread_barrierattr_t *a);
+int pthread_barrierattr_destroy(pthread_barrierattr_t *a);
+int pthread_barrierattr_settype_np(pthread_barrierattr_t *a, int type);
 int pthread_barrier_init(pthread_barrier_t* b, const pthread_barrierattr_t* a, int count);
 int pthread_barrier_wait(pthread_barrier_t* b);
 int pthread_barrier_destroy(pthread_barrier_t* b);
@@ -0,0 +1,33 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Guest pcore threads for the VMM. */
+
+#pragma once
+
+#include <pthread.h>
+#include <parlib/uthread.h>
+#include <ros/vmm.h>
+
+/* One per guest pcore.  vmctl is how the guest pcore's controller sees its
+ * state: set it up with REG_RSP_RIP_CR3 before the first vmm_run_gth(), and
+ * each time vmm_run_gth() returns, it holds the exit to handle. */
+struct guest_thread {
+	int gpcoreid;
+	struct vmctl vmctl;
+	pthread_t vm_thread;
+	/* Whoever holds the ball runs.  The vm_thread never actually grabs it - it
+	 * is grabbed on its behalf. */
+	uth_mutex_t ball;
+};
+
+/* Sets up the guest threads for nr_gpcs guest pcores, after
+ * pthread_mcp_init().  Each guest pcore will run pinned to vcore gpcoreid, if
+ * there is one.  Returns -1 on failure. */
+int vmm_init_gths(int nr_gpcs);
+struct guest_thread *gpcid_to_gth(int gpcoreid);
+/* Runs gth's guest pcore until it exits to the VMM, with gth->vmctl filled
+ * in.  Call it from the guest pcore's controller thread; pin that to the same
+ * vcore with vmm_pin_controller(). */
+void vmm_run_gth(struct guest_thread *gth);
+void vmm_pin_controller(struct guest_thread *gth);
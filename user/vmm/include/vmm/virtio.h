@@ -54,11 +54,22 @@ void showdesc(struct virtqueue *_vq, uint16_t head);
 int virtio_get_buf_avail_start(struct virtqueue *_vq, uint16_t *last_avail_idx, struct scatterlist **sgp, int *sgplen);
 void virtio_get_buf_avail_done(struct virtqueue *_vq, uint16_t last_avail_idx, int id, int len);
 void showscatterlist(struct scatterlist *sg, int num);
+size_t sg_copy_from(struct scatterlist *iov, int nr, size_t off, void *dst,
+                    size_t len);
+size_t sg_copy_to(struct scatterlist *iov, int nr, size_t off, const void *src,
+                  size_t len);
+struct iovec;
+int sg_iovecs(struct iovec *data, struct scatterlist *iov, int nr, size_t off,
+              size_t len);
 
 unsigned int wait_for_vq_desc(struct virtqueue *vq,
 				 struct scatterlist iov[],
 				 unsigned int *out_num, unsigned int *in_num);
 void add_used(struct virtqueue *vq, unsigned int head, int len);
+int vq_nr_avail(struct virtqueue *vq);
+void vq_suppress_notify(struct virtqueue *vq);
+uint16_t vq_used_idx(struct virtqueue *vq);
+bool vq_need_irq(struct virtqueue *vq, uint16_t old, bool event_idx);
 
 /**
  * virtqueue - a queue to register buffers for sending or receiving.
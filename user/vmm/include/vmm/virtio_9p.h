@@ -24,9 +24,9 @@
  * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE. */
-#include <linux/types.h>
-#include <linux/virtio_ids.h>
-#include <linux/virtio_config.h>
+#include <stdint.h>
+#include <vmm/virtio_ids.h>
+#include <vmm/virtio_config.h>
 
 /* The feature bitmap for virtio 9P */
 
@@ -35,7 +35,7 @@
 
 struct virtio_9p_config {
 	/* length of the tag name */
-	__u16 tag_len;
+	uint16_t tag_len;
 	/* non-NULL terminated tag name */
-	__u8 tag[0];
+	uint8_t tag[0];
 } __attribute__((packed));
@@ -0,0 +1,15 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-9p device serving a host directory. */
+
+#pragma once
+
+#include <vmm/virtio_mmio.h>
+
+/* Builds a 9P2000.L device that serves the host directory root, which the
+ * guest mounts by tag.  irq is called whenever the guest should be
+ * interrupted.  Register the result with register_virtio_mmio().  Returns 0 on
+ * failure. */
+struct vqdev *virtio_9p_alloc(const char *root, const char *tag,
+                              void (*irq)(struct vqdev *vqdev));
@@ -0,0 +1,17 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-balloon device that gives guest memory back to the host. */
+
+#pragma once
+
+#include <vmm/virtio_mmio.h>
+
+/* Builds a balloon for the guest RAM mapped at [ram, ram + ram_len), which
+ * asks the guest for nr_pages 4K pages up front and takes whatever free memory
+ * it reports after that.  irq is called whenever the guest should be
+ * interrupted.  Register the result with register_virtio_mmio().  Returns 0 on
+ * failure. */
+struct vqdev *virtio_balloon_alloc(void *ram, size_t ram_len,
+                                   uint32_t nr_pages,
+                                   void (*irq)(struct vqdev *vqdev));
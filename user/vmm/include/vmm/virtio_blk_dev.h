@@ -0,0 +1,14 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-blk device backed by a file or disk image. */
+
+#pragma once
+
+#include <vmm/virtio_mmio.h>
+
+/* Builds a block device for the image at path, read-only if we can't open it
+ * for writing.  irq is called whenever the guest should be interrupted.
+ * Register the result with register_virtio_mmio().  Returns 0 on failure. */
+struct vqdev *virtio_blk_alloc(const char *path,
+                               void (*irq)(struct vqdev *vqdev));
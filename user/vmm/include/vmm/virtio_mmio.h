@@ -159,12 +159,15 @@ struct vq {
 };
 
 // a vqdev has a name; magic number; features ( we MUST have features);
+// an optional device config space (e.g. struct virtio_net_config);
 // and an array of vqs.
 struct vqdev {
 	/* Set up usually as a static initializer */
 	char *name;
 	uint32_t dev; // e.g. VIRTIO_ID_CONSOLE);
 	uint64_t device_features, driver_features;
+	void *config;
+	size_t config_len;
 	int numvqs;
 	struct vq vqs[];
 };
@@ -181,3 +184,5 @@ void dumpvirtio_mmio(FILE *f, uint64_t gpa);
 void register_virtio_mmio(struct vqdev *v, uint64_t virtio_base);
 int virtio_mmio(struct vmctl *v, uint64_t gpa, int destreg, uint64_t *regp, int store);
 void virtio_mmio_set_vring_irq(void);
+void virtio_mmio_dev_set_vring_irq(struct vqdev *vqdev);
+int is_virtio_mmio(uint64_t gpa);
@@ -0,0 +1,15 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-net device backed by an #ether connection's packet ring. */
+
+#pragma once
+
+#include <vmm/virtio_mmio.h>
+
+/* Builds a net device with nr_pairs RX/TX queue pairs plus a control queue,
+ * attached to the ether device at ether (e.g. "/net/ether0").  irq is called
+ * whenever the guest should be interrupted.  Register the result with
+ * register_virtio_mmio().  Returns 0 on failure. */
+struct vqdev *virtio_net_alloc(const char *ether, int nr_pairs,
+                               void (*irq)(struct vqdev *vqdev));
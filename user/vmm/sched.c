@@ -0,0 +1,220 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Guest pcore threads for the VMM.
+ *
+ * Each guest pcore runs as its own uthread, pinned to vcore gpcoreid, so with a
+ * vcore per guest pcore, they all run at once on their own host cores.  Exits
+ * the kernel can't handle come back to us as reflected faults on the guest
+ * pcore's thread.  We wake that guest pcore's controller, which handles the
+ * exit and resumes it.  The controller is pinned to the same vcore, so the
+ * handoff never leaves the core.
+ *
+ * IPIs between guest pcores don't come through here at all: the kernel
+ * emulates the x2APIC ICR and posts fixed IRQs straight to the target. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <parlib/arch/arch.h>
+#include <parlib/assert.h>
+#include <parlib/uthread.h>
+#include <parlib/vcore.h>
+#include <vmm/vmm.h>
+#include <vmm/sched.h>
+
+static struct guest_thread **guest_threads;
+static int nr_guest_threads;
+static void (*old_thread_refl)(struct uthread *uth, struct user_context *ctx);
+
+static void copy_vmtf_to_vmctl(struct vm_trapframe *vm_tf, struct vmctl *vmctl)
+{
+	vmctl->cr3 = vm_tf->tf_cr3;
+	vmctl->gva = vm_tf->tf_guest_va;
+	vmctl->gpa = vm_tf->tf_guest_pa;
+	vmctl->exit_qual = vm_tf->tf_exit_qual;
+	if (vm_tf->tf_exit_reason == EXIT_REASON_EPT_VIOLATION)
+		vmctl->shutdown = SHUTDOWN_EPT_VIOLATION;
+	else
+		vmctl->shutdown = SHUTDOWN_UNHANDLED_EXIT_REASON;
+	vmctl->ret_code = vm_tf->tf_exit_reason;
+	vmctl->interrupt = vm_tf->tf_trap_inject;
+	vmctl->intrinfo1 = vm_tf->tf_intrinfo1;
+	vmctl->intrinfo2 = vm_tf->tf_intrinfo2;
+	/* Most of the HW TF.  Should be good enough for now */
+	vmctl->regs.tf_rax = vm_tf->tf_rax;
+	vmctl->regs.tf_rbx = vm_tf->tf_rbx;
+	vmctl->regs.tf_rcx = vm_tf->tf_rcx;
+	vmctl->regs.tf_rdx = vm_tf->tf_rdx;
+	vmctl->regs.tf_rbp = vm_tf->tf_rbp;
+	vmctl->regs.tf_rsi = vm_tf->tf_rsi;
+	vmctl->regs.tf_rdi = vm_tf->tf_rdi;
+	vmctl->regs.tf_r8  = vm_tf->tf_r8;
+	vmctl->regs.tf_r9  = vm_tf->tf_r9;
+	vmctl->regs.tf_r10 = vm_tf->tf_r10;
+	vmctl->regs.tf_r11 = vm_tf->tf_r11;
+	vmctl->regs.tf_r12 = vm_tf->tf_r12;
+	vmctl->regs.tf_r13 = vm_tf->tf_r13;
+	vmctl->regs.tf_r14 = vm_tf->tf_r14;
+	vmctl->regs.tf_r15 = vm_tf->tf_r15;
+	vmctl->regs.tf_rip = vm_tf->tf_rip;
+	vmctl->regs.tf_rflags = vm_tf->tf_rflags;
+	vmctl->regs.tf_rsp = vm_tf->tf_rsp;
+}
+
+static void copy_vmctl_to_vmtf(struct vmctl *vmctl, struct vm_trapframe *vm_tf)
+{
+	vm_tf->tf_rax = vmctl->regs.tf_rax;
+	vm_tf->tf_rbx = vmctl->regs.tf_rbx;
+	vm_tf->tf_rcx = vmctl->regs.tf_rcx;
+	vm_tf->tf_rdx = vmctl->regs.tf_rdx;
+	vm_tf->tf_rbp = vmctl->regs.tf_rbp;
+	vm_tf->tf_rsi = vmctl->regs.tf_rsi;
+	vm_tf->tf_rdi = vmctl->regs.tf_rdi;
+	vm_tf->tf_r8  = vmctl->regs.tf_r8;
+	vm_tf->tf_r9  = vmctl->regs.tf_r9;
+	vm_tf->tf_r10 = vmctl->regs.tf_r10;
+	vm_tf->tf_r11 = vmctl->regs.tf_r11;
+	vm_tf->tf_r12 = vmctl->regs.tf_r12;
+	vm_tf->tf_r13 = vmctl->regs.tf_r13;
+	vm_tf->tf_r14 = vmctl->regs.tf_r14;
+	vm_tf->tf_r15 = vmctl->regs.tf_r15;
+	vm_tf->tf_rip = vmctl->regs.tf_rip;
+	vm_tf->tf_rflags = vmctl->regs.tf_rflags;
+	vm_tf->tf_rsp = vmctl->regs.tf_rsp;
+	vm_tf->tf_cr3 = vmctl->cr3;
+	vm_tf->tf_trap_inject = vmctl->interrupt;
+	/* Don't care about the rest of the fields.  The kernel only writes them */
+}
+
+/* callback, runs in vcore context.  this sets up our initial context.  once we
+ * become runnable again, we'll run the first bits of the vm ctx.  after that,
+ * our context will be stopped and started and will just run whatever the guest
+ * VM wants.  we'll never come back to this code or to run_vm(). */
+static void __build_vm_ctx_cb(struct uthread *uth, void *arg)
+{
+	struct pthread_tcb *pthread = (struct pthread_tcb*)uth;
+	struct guest_thread *gth = (struct guest_thread*)arg;
+	struct vm_trapframe *vm_tf;
+
+	__pthread_generic_yield(pthread);
+	pthread->state = PTH_BLK_YIELDING;
+
+	memset(&uth->u_ctx, 0, sizeof(struct user_context));
+	uth->u_ctx.type = ROS_VM_CTX;
+	vm_tf = &uth->u_ctx.tf.vm_tf;
+
+	vm_tf->tf_guest_pcoreid = gth->gpcoreid;
+
+	copy_vmctl_to_vmtf(&gth->vmctl, vm_tf);
+
+	/* other HW/GP regs are 0, which should be fine.  the FP state is still
+	 * whatever we were running before, though this is pretty much unnecessary.
+	 * we mostly don't want crazy crap in the uth->as, and a non-current_uthread
+	 * VM ctx is supposed to have something in their FP state (like HW ctxs). */
+	save_fp_state(&uth->as);
+	uth->flags |= UTHREAD_FPSAVED | UTHREAD_SAVED;
+
+	uthread_runnable(uth);
+}
+
+static void *run_vm(void *arg)
+{
+	struct guest_thread *gth = (struct guest_thread*)arg;
+
+	assert(gth->vmctl.command == REG_RSP_RIP_CR3);
+	/* We need to hack our context, so that next time we run, we're a VM ctx */
+	uthread_yield(FALSE, __build_vm_ctx_cb, arg);
+	return NULL;
+}
+
+static void vmm_thread_refl_fault(struct uthread *uth,
+                                  struct user_context *ctx)
+{
+	struct pthread_tcb *pthread = (struct pthread_tcb*)uth;
+	struct guest_thread *gth;
+
+	/* Hack to call the original pth 2LS op */
+	if (ctx->type != ROS_VM_CTX) {
+		old_thread_refl(uth, ctx);
+		return;
+	}
+	gth = gpcid_to_gth(ctx->tf.vm_tf.tf_guest_pcoreid);
+	__pthread_generic_yield(pthread);
+	/* normally we'd handle the vmexit here.  to work within the existing
+	 * framework, we just wake the controller thread.  It'll look at our ctx
+	 * then make us runnable again */
+	pthread->state = PTH_BLK_MUTEX;
+	uth_mutex_unlock(gth->ball);		/* wake the controller */
+}
+
+/* Vcore gpcoreid if we have one, so each guest pcore gets a host core. */
+static int gth_vcoreid(struct guest_thread *gth)
+{
+	return gth->gpcoreid < max_vcores() ? gth->gpcoreid : -1;
+}
+
+int vmm_init_gths(int nr_gpcs)
+{
+	struct guest_thread *gth;
+
+	guest_threads = calloc(nr_gpcs, sizeof(struct guest_thread*));
+	if (!guest_threads)
+		return -1;
+	for (int i = 0; i < nr_gpcs; i++) {
+		gth = calloc(1, sizeof(struct guest_thread));
+		if (!gth)
+			return -1;
+		gth->gpcoreid = i;
+		gth->ball = uth_mutex_alloc();
+		uth_mutex_lock(gth->ball);
+		guest_threads[i] = gth;
+	}
+	nr_guest_threads = nr_gpcs;
+	/* hack in our own handlers for some 2LS ops */
+	old_thread_refl = sched_ops->thread_refl_fault;
+	sched_ops->thread_refl_fault = vmm_thread_refl_fault;
+	return 0;
+}
+
+struct guest_thread *gpcid_to_gth(int gpcoreid)
+{
+	assert(gpcoreid < nr_guest_threads);
+	return guest_threads[gpcoreid];
+}
+
+void vmm_pin_controller(struct guest_thread *gth)
+{
+	pthread_pin_vcore(pthread_self(), gth_vcoreid(gth));
+	/* Get over there now, instead of at our next block */
+	pthread_yield();
+}
+
+/* this will start the guest pcore's thread, and return when the thread has
+ * blocked, with the right info in gth->vmctl. */
+void vmm_run_gth(struct guest_thread *gth)
+{
+	if (!gth->vm_thread) {
+		/* first time through, we make the vm thread.  the ball was already
+		 * grabbed right after it was alloc'd.  The pin applies once run_vm
+		 * yields, which is before it ever runs the guest. */
+		if (pthread_create(&gth->vm_thread, NULL, run_vm, gth)) {
+			perror("pth_create");
+			exit(-1);
+		}
+		pthread_pin_vcore(gth->vm_thread, gth_vcoreid(gth));
+	} else {
+		copy_vmctl_to_vmtf(&gth->vmctl,
+		                   &gth->vm_thread->uthread.u_ctx.tf.vm_tf);
+		uth_mutex_lock(gth->ball);	/* grab it for the vm_thread */
+		uthread_runnable((struct uthread*)gth->vm_thread);
+	}
+	uth_mutex_lock(gth->ball);
+	/* We woke due to a vm exit.  Need to unlock for the next time we're run */
+	uth_mutex_unlock(gth->ball);
+	/* the vm stopped.  we can do whatever we want before rerunning it.  since
+	 * we're controlling the uth, we need to handle its vmexits.  we'll fill in
+	 * the vmctl, since that's the current framework. */
+	copy_vmtf_to_vmctl(&gth->vm_thread->uthread.u_ctx.tf.vm_tf, &gth->vmctl);
+}
@@ -0,0 +1,974 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-9p device for the VMM: serves a host directory to the guest over
+ * 9P2000.L, which Linux mounts with -t 9p -o trans=virtio,version=9p2000.L.
+ *
+ * We agree to a large msize (VP9_MSIZE), so big reads and writes take few
+ * round trips.  Linux's virtio transport sends the data of large reads,
+ * writes, and readdirs zero-copy: the chain holds the guest's own pages right
+ * after the message header.  Either way, the data lives in guest memory, which
+ * is our memory, so we hand those buffers straight to preadv and pwritev.  The
+ * data is never copied by us, just by the kernel.  Only headers and small
+ * messages get copied out of and into the chain.
+ *
+ * Requests are handled in order by the queue's thread.  Fids are host paths,
+ * plus an fd or DIR once opened. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <parlib/arch/arch.h>
+#include <parlib/parlib.h>
+#include <ros/fs.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_ids.h>
+#include <vmm/virtio_config.h>
+#include <vmm/virtio_ring.h>
+#include <vmm/virtio_9p.h>
+#include <vmm/virtio_9p_dev.h>
+
+#define VP9_QNUM			128
+#define VP9_MSIZE			(512 * 1024)
+/* Big enough for any T-message but the data of a Twrite */
+#define VP9_TBUF_SZ			(16 * 1024)
+#define VP9_MAX_FIDS		(1 << 16)
+
+/* 9P2000.L message types.  R-messages are T-messages + 1. */
+enum {
+	P9_RLERROR = 7,
+	P9_TSTATFS = 8,
+	P9_TLOPEN = 12,
+	P9_TLCREATE = 14,
+	P9_TSYMLINK = 16,
+	P9_TREADLINK = 22,
+	P9_TGETATTR = 24,
+	P9_TSETATTR = 26,
+	P9_TREADDIR = 40,
+	P9_TFSYNC = 50,
+	P9_TMKDIR = 72,
+	P9_TRENAMEAT = 74,
+	P9_TUNLINKAT = 76,
+	P9_TVERSION = 100,
+	P9_TATTACH = 104,
+	P9_TFLUSH = 108,
+	P9_TWALK = 110,
+	P9_TREAD = 116,
+	P9_TWRITE = 118,
+	P9_TCLUNK = 120,
+};
+
+#define P9_HDR_SZ			7		/* size[4] type[1] tag[2] */
+#define P9_IOHDR_SZ			(P9_HDR_SZ + 4)	/* Rread count[4], then data */
+#define P9_TWRITE_HDR_SZ	(P9_HDR_SZ + 16)	/* fid, offset, count, data */
+#define P9_MAXWELEM			16
+#define P9_QID_SZ			13
+#define P9_QTDIR			0x80
+#define P9_QTSYMLINK		0x02
+#define P9_QTFILE			0x00
+#define P9_STATS_BASIC		0x7ffULL
+#define P9_SETATTR_MODE		0x1
+#define P9_SETATTR_SIZE		0x8
+#define P9_AT_REMOVEDIR		0x200
+#define P9_DOTL_ACCMODE		3
+#define P9_DOTL_FLAGS		(O_CREAT | O_EXCL | O_TRUNC | O_APPEND | \
+                             O_DIRECTORY | O_NOFOLLOW)
+#define V9FS_MAGIC			0x01021997
+
+struct vp9_fid {
+	char *path;						/* host path, NULL if the fid is free */
+	int fd;
+	DIR *dir;
+};
+
+/* A message being parsed or built.  Running off the end sets bad. */
+struct vp9_msg {
+	uint8_t *p;
+	uint8_t *end;
+	bool bad;
+};
+
+/* The request in flight: its chain, and how much data the handler put into the
+ * chain after the R-message header. */
+struct vp9_req {
+	struct scatterlist *out;
+	int nr_out;
+	struct scatterlist *in;
+	int nr_in;
+	size_t out_len;
+	size_t in_len;
+	size_t data_len;
+};
+
+struct virtio_9p {
+	struct vqdev *vqdev;
+	struct virtio_9p_config *config;
+	void (*irq)(struct vqdev *vqdev);
+	char *root;
+	size_t root_len;
+	uint32_t msize;
+	struct vp9_fid *fids;
+	uint32_t nr_fids;
+	uint8_t *tbuf;
+	uint8_t *rbuf;
+	struct scatterlist iov[VP9_QNUM];
+	struct iovec iovecs[VP9_QNUM];
+};
+
+typedef int (*vp9_handler_t)(struct virtio_9p *vp9, struct vp9_msg *t,
+                             struct vp9_msg *r, struct vp9_req *req);
+
+static bool vp9_has(struct virtio_9p *vp9, int feature)
+{
+	return vp9->vqdev->driver_features & (1ULL << feature);
+}
+
+static void *vp9_get(struct vp9_msg *m, size_t len)
+{
+	void *p = m->p;
+
+	if (m->bad || len > m->end - m->p) {
+		m->bad = TRUE;
+		return NULL;
+	}
+	m->p += len;
+	return p;
+}
+
+#define VP9_GET(type)                                                          \
+static type get_##type(struct vp9_msg *m)                                      \
+{                                                                              \
+	type val = 0;                                                              \
+	void *p = vp9_get(m, sizeof(type));                                        \
+                                                                               \
+	if (p)                                                                     \
+		memcpy(&val, p, sizeof(type));                                         \
+	return val;                                                                \
+}
+
+#define VP9_PUT(type)                                                          \
+static void put_##type(struct vp9_msg *m, type val)                            \
+{                                                                              \
+	void *p = vp9_get(m, sizeof(type));                                        \
+                                                                               \
+	if (p)                                                                     \
+		memcpy(p, &val, sizeof(type));                                         \
+}
+
+VP9_GET(uint8_t)
+VP9_GET(uint16_t)
+VP9_GET(uint32_t)
+VP9_GET(uint64_t)
+VP9_PUT(uint8_t)
+VP9_PUT(uint16_t)
+VP9_PUT(uint32_t)
+VP9_PUT(uint64_t)
+
+/* Gets a string into buf, which holds NAME_MAX + 1.  Returns an errno. */
+static int get_name(struct vp9_msg *m, char *buf)
+{
+	uint16_t len = get_uint16_t(m);
+	char *s = vp9_get(m, len);
+
+	if (!s)
+		return EINVAL;
+	if (len > NAME_MAX)
+		return ENAMETOOLONG;
+	memcpy(buf, s, len);
+	buf[len] = 0;
+	return 0;
+}
+
+static void put_str(struct vp9_msg *m, const char *s)
+{
+	size_t len = strlen(s);
+	void *p;
+
+	put_uint16_t(m, len);
+	p = vp9_get(m, len);
+	if (p)
+		memcpy(p, s, len);
+}
+
+static void put_qid(struct vp9_msg *m, struct stat *st)
+{
+	uint8_t type = P9_QTFILE;
+
+	if (S_ISDIR(st->st_mode))
+		type = P9_QTDIR;
+	else if (S_ISLNK(st->st_mode))
+		type = P9_QTSYMLINK;
+	put_uint8_t(m, type);
+	put_uint32_t(m, st->st_mtime);
+	put_uint64_t(m, st->st_ino);
+}
+
+static struct vp9_fid *vp9_fid(struct virtio_9p *vp9, uint32_t nr)
+{
+	if (nr >= vp9->nr_fids || !vp9->fids[nr].path)
+		return NULL;
+	return &vp9->fids[nr];
+}
+
+/* Sets up fid nr with path, which it now owns.  Returns an errno. */
+static int vp9_fid_new(struct virtio_9p *vp9, uint32_t nr, char *path)
+{
+	struct vp9_fid *fids;
+	uint32_t nr_fids = vp9->nr_fids;
+
+	if (nr >= VP9_MAX_FIDS)
+		return EMFILE;
+	if (nr >= nr_fids) {
+		while (nr >= nr_fids)
+			nr_fids = nr_fids ? nr_fids * 2 : 64;
+		fids = realloc(vp9->fids, nr_fids * sizeof(struct vp9_fid));
+		if (!fids)
+			return ENOMEM;
+		memset(fids + vp9->nr_fids, 0,
+		       (nr_fids - vp9->nr_fids) * sizeof(struct vp9_fid));
+		vp9->fids = fids;
+		vp9->nr_fids = nr_fids;
+	}
+	if (vp9->fids[nr].path)
+		return EEXIST;
+	vp9->fids[nr].path = path;
+	vp9->fids[nr].fd = -1;
+	vp9->fids[nr].dir = NULL;
+	return 0;
+}
+
+static void vp9_fid_put(struct vp9_fid *fid)
+{
+	if (fid->fd >= 0)
+		close(fid->fd);
+	if (fid->dir)
+		closedir(fid->dir);
+	free(fid->path);
+	fid->path = NULL;
+	fid->fd = -1;
+	fid->dir = NULL;
+}
+
+/* Builds dir/name in buf (PATH_MAX).  name is a single path element, and the
+ * guest never gets to name anything outside our root: walks of ".." stop at
+ * the root, and nothing else takes "." or "..".  Returns an errno. */
+static int vp9_path(struct virtio_9p *vp9, char *buf, const char *dir,
+                    const char *name)
+{
+	if (!*name || strchr(name, '/'))
+		return EINVAL;
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return EINVAL;
+	if (snprintf(buf, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+		return ENAMETOOLONG;
+	return 0;
+}
+
+/* Each step of a walk: name may also be ".." here. */
+static int vp9_walk_path(struct virtio_9p *vp9, char *buf, const char *dir,
+                         const char *name)
+{
+	char *slash;
+
+	if (strcmp(name, ".."))
+		return vp9_path(vp9, buf, dir, name);
+	strcpy(buf, dir);
+	if (strlen(buf) > vp9->root_len) {
+		slash = strrchr(buf, '/');
+		*slash = 0;
+	}
+	return 0;
+}
+
+static int vp9_version(struct virtio_9p *vp9, struct vp9_msg *t,
+                       struct vp9_msg *r, struct vp9_req *req)
+{
+	uint32_t msize = get_uint32_t(t);
+	uint16_t len = get_uint16_t(t);
+	char *version = vp9_get(t, len);
+
+	if (!version)
+		return EINVAL;
+	/* A new session: everything from the old one goes away */
+	for (uint32_t i = 0; i < vp9->nr_fids; i++) {
+		if (vp9->fids[i].path)
+			vp9_fid_put(&vp9->fids[i]);
+	}
+	vp9->msize = MIN(msize, VP9_MSIZE);
+	put_uint32_t(r, vp9->msize);
+	if (len == 8 && !memcmp(version, "9P2000.L", 8))
+		put_str(r, "9P2000.L");
+	else
+		put_str(r, "unknown");
+	return 0;
+}
+
+static int vp9_attach(struct virtio_9p *vp9, struct vp9_msg *t,
+                      struct vp9_msg *r, struct vp9_req *req)
+{
+	uint32_t nr = get_uint32_t(t);
+	struct stat st;
+	char *path;
+	int ret;
+
+	/* Ignoring afid, uname, aname, and n_uname.  Everyone gets our root. */
+	if (lstat(vp9->root, &st))
+		return errno;
+	path = strdup(vp9->root);
+	if (!path)
+		return ENOMEM;
+	ret = vp9_fid_new(vp9, nr, path);
+	if (ret) {
+		free(path);
+		return ret;
+	}
+	put_qid(r, &st);
+	return 0;
+}
+
+static int vp9_walk(struct virtio_9p *vp9, struct vp9_msg *t,
+                    struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	uint32_t newfid = get_uint32_t(t);
+	uint16_t nwname = get_uint16_t(t);
+	char path[PATH_MAX], next[PATH_MAX], name[NAME_MAX + 1];
+	uint8_t *nwqid;
+	struct stat st;
+	uint16_t i;
+	char *dup;
+	int ret = 0;
+
+	if (!fid)
+		return EBADF;
+	if (t->bad || nwname > P9_MAXWELEM)
+		return EINVAL;
+	strcpy(path, fid->path);
+	nwqid = vp9_get(r, sizeof(uint16_t));
+	if (!nwqid)
+		return EINVAL;
+	for (i = 0; i < nwname; i++) {
+		ret = get_name(t, name);
+		if (!ret)
+			ret = vp9_walk_path(vp9, next, path, name);
+		if (!ret && lstat(next, &st))
+			ret = errno;
+		if (ret)
+			break;
+		strcpy(path, next);
+		put_qid(r, &st);
+	}
+	/* Only failing the first step is an error.  Otherwise, the guest sees how
+	 * far we got, and newfid only exists if we made it all the way. */
+	if (i == 0 && nwname)
+		return ret;
+	memcpy(nwqid, &i, sizeof(uint16_t));
+	if (i < nwname)
+		return 0;
+	dup = strdup(path);
+	if (!dup)
+		return ENOMEM;
+	if (fid == vp9_fid(vp9, newfid)) {
+		free(fid->path);
+		fid->path = dup;
+		return 0;
+	}
+	ret = vp9_fid_new(vp9, newfid, dup);
+	if (ret)
+		free(dup);
+	return ret;
+}
+
+static int vp9_clunk(struct virtio_9p *vp9, struct vp9_msg *t,
+                     struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+
+	if (!fid)
+		return EBADF;
+	vp9_fid_put(fid);
+	return 0;
+}
+
+/* Linux's open flags, which 9P2000.L uses, match ours but for the access
+ * mode. */
+static int vp9_open_flags(uint32_t flags)
+{
+	static const int accmode[] = {O_RDONLY, O_WRONLY, O_RDWR, O_RDWR};
+
+	return accmode[flags & P9_DOTL_ACCMODE] | (flags & P9_DOTL_FLAGS);
+}
+
+/* Opens fid, which must not already be open, and puts its qid and iounit. */
+static int vp9_open_fid(struct vp9_fid *fid, int flags, int mode,
+                        struct vp9_msg *r)
+{
+	struct stat st;
+
+	if (fid->fd >= 0 || fid->dir)
+		return EBUSY;
+	if (lstat(fid->path, &st))
+		return errno;
+	if (S_ISDIR(st.st_mode) && !(flags & O_CREAT)) {
+		fid->dir = opendir(fid->path);
+		if (!fid->dir)
+			return errno;
+	} else {
+		fid->fd = open(fid->path, flags, mode);
+		if (fid->fd < 0)
+			return errno;
+		if (fstat(fid->fd, &st))
+			return errno;
+	}
+	put_qid(r, &st);
+	put_uint32_t(r, 0);		/* iounit: up to the guest, based on msize */
+	return 0;
+}
+
+static int vp9_lopen(struct virtio_9p *vp9, struct vp9_msg *t,
+                     struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	uint32_t flags = get_uint32_t(t);
+
+	if (!fid)
+		return EBADF;
+	return vp9_open_fid(fid, vp9_open_flags(flags) & ~O_CREAT, 0, r);
+}
+
+static int vp9_lcreate(struct virtio_9p *vp9, struct vp9_msg *t,
+                       struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	uint32_t flags, mode;
+	char *dup, *old;
+	int ret;
+
+	if (!fid)
+		return EBADF;
+	ret = get_name(t, name);
+	if (ret)
+		return ret;
+	flags = get_uint32_t(t);
+	mode = get_uint32_t(t);
+	ret = vp9_path(vp9, path, fid->path, name);
+	if (ret)
+		return ret;
+	dup = strdup(path);
+	if (!dup)
+		return ENOMEM;
+	/* The fid becomes the new file, opened */
+	old = fid->path;
+	fid->path = dup;
+	ret = vp9_open_fid(fid, vp9_open_flags(flags) | O_CREAT, mode, r);
+	if (ret) {
+		fid->path = old;
+		free(dup);
+		return ret;
+	}
+	free(old);
+	return 0;
+}
+
+static int vp9_read(struct virtio_9p *vp9, struct vp9_msg *t,
+                    struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	uint64_t offset = get_uint64_t(t);
+	uint32_t count = get_uint32_t(t);
+	ssize_t ret;
+	int nr;
+
+	if (!fid || fid->fd < 0)
+		return EBADF;
+	if (req->in_len < P9_IOHDR_SZ)
+		return EINVAL;
+	count = MIN(count, vp9->msize - P9_IOHDR_SZ);
+	count = MIN(count, req->in_len - P9_IOHDR_SZ);
+	/* Straight into the guest's buffer, right after our header */
+	nr = sg_iovecs(vp9->iovecs, req->in, req->nr_in, P9_IOHDR_SZ, count);
+	ret = preadv(fid->fd, vp9->iovecs, nr, offset);
+	if (ret < 0)
+		return errno;
+	put_uint32_t(r, ret);
+	req->data_len = ret;
+	return 0;
+}
+
+static int vp9_write(struct virtio_9p *vp9, struct vp9_msg *t,
+                     struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	uint64_t offset = get_uint64_t(t);
+	uint32_t count = get_uint32_t(t);
+	ssize_t ret;
+	int nr;
+
+	if (!fid || fid->fd < 0)
+		return EBADF;
+	if (t->bad || req->out_len < P9_TWRITE_HDR_SZ + (size_t)count)
+		return EINVAL;
+	/* Straight from the guest's buffer, right after its header */
+	nr = sg_iovecs(vp9->iovecs, req->out, req->nr_out, P9_TWRITE_HDR_SZ,
+	               count);
+	ret = pwritev(fid->fd, vp9->iovecs, nr, offset);
+	if (ret < 0)
+		return errno;
+	put_uint32_t(r, ret);
+	return 0;
+}
+
+static int vp9_readdir(struct virtio_9p *vp9, struct vp9_msg *t,
+                       struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	uint64_t offset = get_uint64_t(t);
+	uint32_t count = get_uint32_t(t);
+	char path[PATH_MAX];
+	struct vp9_msg ents;
+	struct dirent *de;
+	struct stat st;
+	uint8_t *countp;
+	long pos;
+	size_t len;
+
+	if (!fid || !fid->dir)
+		return EBADF;
+	countp = vp9_get(r, sizeof(uint32_t));
+	if (!countp)
+		return EINVAL;
+	ents.p = r->p;
+	ents.end = r->p + MIN(count, r->end - r->p);
+	ents.bad = FALSE;
+	if (offset)
+		seekdir(fid->dir, offset);
+	else
+		rewinddir(fid->dir);
+	while (1) {
+		pos = telldir(fid->dir);
+		errno = 0;
+		de = readdir(fid->dir);
+		if (!de) {
+			if (errno)
+				return errno;
+			break;
+		}
+		len = strlen(de->d_name);
+		if (P9_QID_SZ + 8 + 1 + 2 + len > ents.end - ents.p) {
+			/* Doesn't fit; it'll be first next time */
+			seekdir(fid->dir, pos);
+			break;
+		}
+		if (snprintf(path, PATH_MAX, "%s/%s", fid->path, de->d_name) >=
+		    PATH_MAX || lstat(path, &st)) {
+			memset(&st, 0, sizeof(st));
+			st.st_ino = de->d_ino;
+		}
+		put_qid(&ents, &st);
+		put_uint64_t(&ents, telldir(fid->dir));
+		put_uint8_t(&ents, IFTODT(st.st_mode));
+		put_str(&ents, de->d_name);
+	}
+	len = ents.p - r->p;
+	memcpy(countp, &(uint32_t){len}, sizeof(uint32_t));
+	r->p = ents.p;
+	return 0;
+}
+
+static int vp9_getattr(struct virtio_9p *vp9, struct vp9_msg *t,
+                       struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	struct stat st;
+
+	if (!fid)
+		return EBADF;
+	if (fid->fd >= 0 ? fstat(fid->fd, &st) : lstat(fid->path, &st))
+		return errno;
+	put_uint64_t(r, P9_STATS_BASIC);
+	put_qid(r, &st);
+	put_uint32_t(r, st.st_mode);
+	put_uint32_t(r, st.st_uid);
+	put_uint32_t(r, st.st_gid);
+	put_uint64_t(r, st.st_nlink);
+	put_uint64_t(r, st.st_rdev);
+	put_uint64_t(r, st.st_size);
+	put_uint64_t(r, st.st_blksize);
+	put_uint64_t(r, st.st_blocks);
+	put_uint64_t(r, st.st_atime);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, st.st_mtime);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, st.st_ctime);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);			/* btime, gen, and data_version: reserved */
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);
+	return 0;
+}
+
+/* Only mode and size are ours to change.  Owners and times quietly stay as
+ * they are, so things like touch and cp -p still work. */
+static int vp9_setattr(struct virtio_9p *vp9, struct vp9_msg *t,
+                       struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	uint32_t valid = get_uint32_t(t);
+	uint32_t mode = get_uint32_t(t);
+	uint64_t size;
+
+	get_uint32_t(t);	/* uid */
+	get_uint32_t(t);	/* gid */
+	size = get_uint64_t(t);
+	if (!fid)
+		return EBADF;
+	if (t->bad)
+		return EINVAL;
+	if ((valid & P9_SETATTR_MODE) && chmod(fid->path, mode))
+		return errno;
+	if (valid & P9_SETATTR_SIZE) {
+		if (fid->fd >= 0 ? ftruncate(fid->fd, size)
+		                 : truncate(fid->path, size))
+			return errno;
+	}
+	return 0;
+}
+
+static int vp9_statfs(struct virtio_9p *vp9, struct vp9_msg *t,
+                      struct vp9_msg *r, struct vp9_req *req)
+{
+	if (!vp9_fid(vp9, get_uint32_t(t)))
+		return EBADF;
+	/* We don't know the host's numbers; just enough for the guest's statfs */
+	put_uint32_t(r, V9FS_MAGIC);
+	put_uint32_t(r, PGSIZE);	/* bsize */
+	put_uint64_t(r, 0);			/* blocks, bfree, bavail, files, ffree */
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);
+	put_uint64_t(r, 0);			/* fsid */
+	put_uint32_t(r, NAME_MAX);
+	return 0;
+}
+
+static int vp9_fsync(struct virtio_9p *vp9, struct vp9_msg *t,
+                     struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+
+	if (!fid || fid->fd < 0)
+		return EBADF;
+	if (fcntl(fid->fd, F_SYNC))
+		return errno;
+	return 0;
+}
+
+static int vp9_mkdir(struct virtio_9p *vp9, struct vp9_msg *t,
+                     struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	struct stat st;
+	uint32_t mode;
+	int ret;
+
+	if (!fid)
+		return EBADF;
+	ret = get_name(t, name);
+	if (ret)
+		return ret;
+	mode = get_uint32_t(t);
+	ret = vp9_path(vp9, path, fid->path, name);
+	if (ret)
+		return ret;
+	if (mkdir(path, mode) || lstat(path, &st))
+		return errno;
+	put_qid(r, &st);
+	return 0;
+}
+
+static int vp9_symlink(struct virtio_9p *vp9, struct vp9_msg *t,
+                       struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	char path[PATH_MAX], name[NAME_MAX + 1], target[PATH_MAX];
+	uint16_t len;
+	struct stat st;
+	char *s;
+	int ret;
+
+	if (!fid)
+		return EBADF;
+	ret = get_name(t, name);
+	if (ret)
+		return ret;
+	len = get_uint16_t(t);
+	s = vp9_get(t, len);
+	if (!s)
+		return EINVAL;
+	if (len >= PATH_MAX)
+		return ENAMETOOLONG;
+	memcpy(target, s, len);
+	target[len] = 0;
+	ret = vp9_path(vp9, path, fid->path, name);
+	if (ret)
+		return ret;
+	if (symlink(target, path) || lstat(path, &st))
+		return errno;
+	put_qid(r, &st);
+	return 0;
+}
+
+static int vp9_readlink(struct virtio_9p *vp9, struct vp9_msg *t,
+                        struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	char target[PATH_MAX];
+	ssize_t len;
+
+	if (!fid)
+		return EBADF;
+	len = readlink(fid->path, target, sizeof(target) - 1);
+	if (len < 0)
+		return errno;
+	target[len] = 0;
+	put_str(r, target);
+	return 0;
+}
+
+static int vp9_renameat(struct virtio_9p *vp9, struct vp9_msg *t,
+                        struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *olddir = vp9_fid(vp9, get_uint32_t(t));
+	char oldpath[PATH_MAX], newpath[PATH_MAX], name[NAME_MAX + 1];
+	struct vp9_fid *newdir;
+	int ret;
+
+	ret = get_name(t, name);
+	if (ret)
+		return ret;
+	if (!olddir)
+		return EBADF;
+	ret = vp9_path(vp9, oldpath, olddir->path, name);
+	if (ret)
+		return ret;
+	newdir = vp9_fid(vp9, get_uint32_t(t));
+	ret = get_name(t, name);
+	if (ret)
+		return ret;
+	if (!newdir)
+		return EBADF;
+	ret = vp9_path(vp9, newpath, newdir->path, name);
+	if (ret)
+		return ret;
+	if (rename(oldpath, newpath))
+		return errno;
+	return 0;
+}
+
+static int vp9_unlinkat(struct virtio_9p *vp9, struct vp9_msg *t,
+                        struct vp9_msg *r, struct vp9_req *req)
+{
+	struct vp9_fid *fid = vp9_fid(vp9, get_uint32_t(t));
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	uint32_t flags;
+	int ret;
+
+	if (!fid)
+		return EBADF;
+	ret = get_name(t, name);
+	if (ret)
+		return ret;
+	flags = get_uint32_t(t);
+	ret = vp9_path(vp9, path, fid->path, name);
+	if (ret)
+		return ret;
+	if (flags & P9_AT_REMOVEDIR ? rmdir(path) : unlink(path))
+		return errno;
+	return 0;
+}
+
+/* We finish every request before looking at the next, so by the time we see a
+ * Tflush, whatever it was flushing is already done. */
+static int vp9_flush(struct virtio_9p *vp9, struct vp9_msg *t,
+                     struct vp9_msg *r, struct vp9_req *req)
+{
+	return 0;
+}
+
+/* Anything not in here, such as xattrs and locks, gets EOPNOTSUPP. */
+static const vp9_handler_t vp9_handlers[] = {
+	[P9_TSTATFS] = vp9_statfs,
+	[P9_TLOPEN] = vp9_lopen,
+	[P9_TLCREATE] = vp9_lcreate,
+	[P9_TSYMLINK] = vp9_symlink,
+	[P9_TREADLINK] = vp9_readlink,
+	[P9_TGETATTR] = vp9_getattr,
+	[P9_TSETATTR] = vp9_setattr,
+	[P9_TREADDIR] = vp9_readdir,
+	[P9_TFSYNC] = vp9_fsync,
+	[P9_TMKDIR] = vp9_mkdir,
+	[P9_TRENAMEAT] = vp9_renameat,
+	[P9_TUNLINKAT] = vp9_unlinkat,
+	[P9_TVERSION] = vp9_version,
+	[P9_TATTACH] = vp9_attach,
+	[P9_TFLUSH] = vp9_flush,
+	[P9_TWALK] = vp9_walk,
+	[P9_TREAD] = vp9_read,
+	[P9_TWRITE] = vp9_write,
+	[P9_TCLUNK] = vp9_clunk,
+};
+
+/* Handles the request in vp9->iov, and returns how many bytes of reply we put
+ * in its writable part. */
+static unsigned int vp9_handle(struct virtio_9p *vp9, unsigned int nr_out,
+                               unsigned int nr_in)
+{
+	struct vp9_req req = {.out = vp9->iov, .nr_out = nr_out,
+	                      .in = vp9->iov + nr_out, .nr_in = nr_in};
+	struct vp9_msg t, r;
+	uint8_t type;
+	uint16_t tag;
+	int err;
+
+	for (int i = 0; i < nr_out; i++)
+		req.out_len += req.out[i].length;
+	for (int i = 0; i < nr_in; i++)
+		req.in_len += req.in[i].length;
+	if (req.in_len < P9_HDR_SZ + sizeof(uint32_t))
+		return 0;
+	t.p = vp9->tbuf;
+	t.end = vp9->tbuf + sg_copy_from(req.out, nr_out, 0, vp9->tbuf,
+	                                 VP9_TBUF_SZ);
+	t.bad = FALSE;
+	get_uint32_t(&t);
+	type = get_uint8_t(&t);
+	tag = get_uint16_t(&t);
+	r.p = vp9->rbuf + P9_HDR_SZ;
+	r.end = vp9->rbuf + MIN(vp9->msize, req.in_len);
+	r.bad = FALSE;
+
+	if (t.bad)
+		err = EINVAL;
+	else if (type >= ARRAY_SIZE(vp9_handlers) || !vp9_handlers[type])
+		err = EOPNOTSUPP;
+	else
+		err = vp9_handlers[type](vp9, &t, &r, &req);
+	if (!err && (t.bad || r.bad))
+		err = EINVAL;
+	if (err) {
+		r.p = vp9->rbuf + P9_HDR_SZ;
+		r.bad = FALSE;
+		put_uint32_t(&r, err);
+		type = P9_RLERROR;
+		req.data_len = 0;
+	} else {
+		type++;
+	}
+	r.end = r.p;
+	r.p = vp9->rbuf;
+	put_uint32_t(&r, r.end - vp9->rbuf + req.data_len);
+	put_uint8_t(&r, type);
+	put_uint16_t(&r, tag);
+	/* Any data the handler moved itself is already in place after this */
+	sg_copy_to(req.in, nr_in, 0, vp9->rbuf, r.end - vp9->rbuf);
+	return r.end - vp9->rbuf + req.data_len;
+}
+
+static void *vp9_request(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct virtio_9p *vp9 = a->arg->arg;
+	struct virtqueue *vq = a->arg->virtio;
+	unsigned int head, nr_out, nr_in;
+	bool event_idx;
+	uint16_t old_used;
+
+	while (1) {
+		event_idx = vp9_has(vp9, VIRTIO_RING_F_EVENT_IDX);
+		old_used = vq_used_idx(vq);
+		do {
+			head = wait_for_vq_desc(vq, vp9->iov, &nr_out, &nr_in);
+			add_used(vq, head, vp9_handle(vp9, nr_out, nr_in));
+		} while (vq_nr_avail(vq));
+		if (event_idx)
+			vq_suppress_notify(vq);
+		if (vq_need_irq(vq, old_used, event_idx))
+			vp9->irq(vp9->vqdev);
+	}
+	return NULL;
+}
+
+struct vqdev *virtio_9p_alloc(const char *root, const char *tag,
+                              void (*irq)(struct vqdev *vqdev))
+{
+	struct virtio_9p *vp9;
+	struct vqdev *vqdev;
+	size_t tag_len = strlen(tag);
+
+	vp9 = calloc(1, sizeof(struct virtio_9p));
+	vqdev = calloc(1, sizeof(struct vqdev) + sizeof(struct vq));
+	if (vp9) {
+		vp9->config = calloc(1, sizeof(struct virtio_9p_config) + tag_len);
+		vp9->tbuf = malloc(VP9_TBUF_SZ);
+		vp9->rbuf = malloc(VP9_MSIZE);
+		vp9->root = strdup(root);
+	}
+	if (!vp9 || !vqdev || !vp9->config || !vp9->tbuf || !vp9->rbuf ||
+	    !vp9->root) {
+		fprintf(stderr, "virtio-9p: out of memory\n");
+		goto out_free;
+	}
+	/* Walks of ".." stop at root_len, so no trailing slashes */
+	vp9->root_len = strlen(vp9->root);
+	while (vp9->root_len > 1 && vp9->root[vp9->root_len - 1] == '/')
+		vp9->root[--vp9->root_len] = 0;
+	if (access(vp9->root, R_OK)) {
+		perror(root);
+		goto out_free;
+	}
+	vp9->vqdev = vqdev;
+	vp9->irq = irq;
+	vp9->msize = VP9_MSIZE;
+	vp9->config->tag_len = tag_len;
+	memcpy(vp9->config->tag, tag, tag_len);
+
+	vqdev->name = "9p";
+	vqdev->dev = VIRTIO_ID_9P;
+	vqdev->device_features = (1ULL << VIRTIO_9P_MOUNT_TAG) |
+	                         (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+	                         (1ULL << VIRTIO_RING_F_EVENT_IDX);
+	vqdev->config = vp9->config;
+	vqdev->config_len = sizeof(struct virtio_9p_config) + tag_len;
+	vqdev->numvqs = 1;
+	vqdev->vqs[0].name = "9preq";
+	vqdev->vqs[0].f = vp9_request;
+	vqdev->vqs[0].arg = vp9;
+	vqdev->vqs[0].maxqnum = VP9_QNUM;
+	return vqdev;
+
+out_free:
+	if (vp9) {
+		free(vp9->config);
+		free(vp9->tbuf);
+		free(vp9->rbuf);
+		free(vp9->root);
+	}
+	free(vp9);
+	free(vqdev);
+	return NULL;
+}
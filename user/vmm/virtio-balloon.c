@@ -0,0 +1,244 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-balloon device for the VMM: lets the guest hand memory back to us.
+ *
+ * Guest RAM is our own anonymous memory, and the EPT follows our page tables,
+ * so giving a page back is just an madvise(MADV_DONTNEED) of its address here:
+ * that frees the page and unmaps it from the guest too.  If the guest touches
+ * it again, it faults in a fresh zeroed page.
+ *
+ * The guest gives pages back two ways.  It inflates the balloon when we ask for
+ * pages in the config's num_pages, sending arrays of 4K PFNs on the inflate
+ * queue.  With free page reporting, it also sends big free blocks (a pageblock
+ * or more) on the reporting queue on its own, so idle memory comes back without
+ * us picking a target.  Deflating needs nothing from us, since the pages fault
+ * back in on use.
+ *
+ * Each queue's thread takes as many chains as the guest has posted, up to
+ * VBAL_BATCH, then sorts the pages and merges neighbors into runs, so a pile of
+ * PFNs turns into a few madvises.  Those go to the kernel in one syscall batch,
+ * and the guest gets one interrupt for the lot.
+ *
+ * Linux numbers the queues it finds densely, skipping those whose features
+ * aren't negotiated, so we only offer reporting; a stats queue would shift it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <parlib/arch/arch.h>
+#include <parlib/parlib.h>
+#include <ros/syscall.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_ids.h>
+#include <vmm/virtio_config.h>
+#include <vmm/virtio_ring.h>
+#include <vmm/virtio_balloon.h>
+#include <vmm/virtio_balloon_dev.h>
+
+#define VBAL_QNUM			128
+#define VBAL_BATCH			32
+#define VBAL_MAX_RUNS		256
+#define VBAL_PFN_SIZE		(1UL << VIRTIO_BALLOON_PFN_SHIFT)
+
+enum {
+	VBAL_VQ_INFLATE,
+	VBAL_VQ_DEFLATE,
+	VBAL_VQ_REPORTING,
+	VBAL_NR_VQS,
+};
+
+struct vbal_run {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+/* Each queue has its own thread, so each gets its own scratch space */
+struct vbal_queue {
+	struct virtio_balloon *vbal;
+	int type;
+	unsigned int heads[VBAL_BATCH];
+	struct vbal_run runs[VBAL_MAX_RUNS];
+	unsigned int nr_runs;
+	struct syscall syscs[VBAL_MAX_RUNS];
+	struct scatterlist iov[VBAL_QNUM];
+};
+
+struct virtio_balloon {
+	struct vqdev *vqdev;
+	struct virtio_balloon_config config;
+	void (*irq)(struct vqdev *vqdev);
+	uintptr_t ram_start;
+	uintptr_t ram_end;
+	struct vbal_queue *queues;
+};
+
+static int vbal_run_cmp(const void *a, const void *b)
+{
+	const struct vbal_run *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/* Gives the queued runs back to the host.  Sorting lets neighboring pages merge
+ * into one madvise, and the madvises all go down in one batch. */
+static void vbal_release(struct vbal_queue *q)
+{
+	struct vbal_run *run;
+	struct syscall *sysc;
+	unsigned int nr_merged = 0;
+
+	if (!q->nr_runs)
+		return;
+	qsort(q->runs, q->nr_runs, sizeof(struct vbal_run), vbal_run_cmp);
+	for (int i = 1; i < q->nr_runs; i++) {
+		run = &q->runs[nr_merged];
+		if (q->runs[i].start <= run->end)
+			run->end = MAX(run->end, q->runs[i].end);
+		else
+			q->runs[++nr_merged] = q->runs[i];
+	}
+	nr_merged++;
+	for (int i = 0; i < nr_merged; i++) {
+		sysc = &q->syscs[i];
+		memset(sysc, 0, sizeof(struct syscall));
+		sysc->num = SYS_madvise;
+		sysc->arg0 = q->runs[i].start;
+		sysc->arg1 = q->runs[i].end - q->runs[i].start;
+		sysc->arg2 = MADV_DONTNEED;
+	}
+	syscall_async_batch(q->syscs, nr_merged);
+	syscall_blockon_batch(q->syscs, nr_merged);
+	for (int i = 0; i < nr_merged; i++) {
+		if (q->syscs[i].retval)
+			fprintf(stderr, "virtio-balloon: madvise %p+%lu failed, %d\n",
+			        (void *)q->runs[i].start,
+			        q->runs[i].end - q->runs[i].start, q->syscs[i].err);
+	}
+	q->nr_runs = 0;
+}
+
+/* Queues the whole pages in [start, start + len) to be given back.  Anything
+ * outside guest RAM is ignored. */
+static void vbal_add(struct vbal_queue *q, uintptr_t start, size_t len)
+{
+	struct virtio_balloon *vbal = q->vbal;
+	uintptr_t end = ROUNDDOWN(start + len, PGSIZE);
+
+	start = ROUNDUP(start, PGSIZE);
+	start = MAX(start, vbal->ram_start);
+	end = MIN(end, vbal->ram_end);
+	if (start >= end)
+		return;
+	if (q->nr_runs == VBAL_MAX_RUNS)
+		vbal_release(q);
+	q->runs[q->nr_runs].start = start;
+	q->runs[q->nr_runs].end = end;
+	q->nr_runs++;
+}
+
+static void vbal_parse(struct vbal_queue *q, unsigned int nr_out,
+                       unsigned int nr_in)
+{
+	uint32_t *pfns;
+	size_t nr_pfns;
+
+	switch (q->type) {
+	case VBAL_VQ_INFLATE:
+		/* Guest physical addresses are our virtual addresses */
+		for (int i = 0; i < nr_out; i++) {
+			pfns = q->iov[i].v;
+			nr_pfns = q->iov[i].length / sizeof(uint32_t);
+			for (size_t j = 0; j < nr_pfns; j++)
+				vbal_add(q, (uintptr_t)pfns[j] << VIRTIO_BALLOON_PFN_SHIFT,
+				         VBAL_PFN_SIZE);
+		}
+		break;
+	case VBAL_VQ_REPORTING:
+		/* Each buffer is a free block, and its contents don't matter */
+		for (int i = 0; i < nr_out + nr_in; i++)
+			vbal_add(q, (uintptr_t)q->iov[i].v, q->iov[i].length);
+		break;
+	}
+}
+
+static void *vbal_request(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct vbal_queue *q = a->arg->arg;
+	struct virtqueue *vq = a->arg->virtio;
+	unsigned int nr_out, nr_in, nr_heads;
+	uint16_t old_used;
+
+	while (1) {
+		old_used = vq_used_idx(vq);
+		nr_heads = 0;
+		do {
+			q->heads[nr_heads] = wait_for_vq_desc(vq, q->iov, &nr_out,
+			                                      &nr_in);
+			vbal_parse(q, nr_out, nr_in);
+			nr_heads++;
+		} while (nr_heads < VBAL_BATCH && vq_nr_avail(vq));
+		/* The guest can reuse reported pages once it sees them used */
+		vbal_release(q);
+		for (int i = 0; i < nr_heads; i++)
+			add_used(vq, q->heads[i], 0);
+		if (vq_need_irq(vq, old_used, FALSE))
+			q->vbal->irq(q->vbal->vqdev);
+	}
+	return NULL;
+}
+
+struct vqdev *virtio_balloon_alloc(void *ram, size_t ram_len,
+                                   uint32_t nr_pages,
+                                   void (*irq)(struct vqdev *vqdev))
+{
+	static char *vq_names[VBAL_NR_VQS] = {"inflate", "deflate", "reporting"};
+	struct virtio_balloon *vbal;
+	struct vqdev *vqdev;
+
+	vbal = calloc(1, sizeof(struct virtio_balloon));
+	vqdev = calloc(1, sizeof(struct vqdev) + VBAL_NR_VQS * sizeof(struct vq));
+	if (vbal)
+		vbal->queues = calloc(VBAL_NR_VQS, sizeof(struct vbal_queue));
+	if (!vbal || !vqdev || !vbal->queues) {
+		fprintf(stderr, "virtio-balloon: out of memory\n");
+		goto out_free;
+	}
+	vbal->vqdev = vqdev;
+	vbal->irq = irq;
+	vbal->ram_start = (uintptr_t)ram;
+	vbal->ram_end = (uintptr_t)ram + ram_len;
+	vbal->config.num_pages = nr_pages;
+
+	vqdev->name = "balloon";
+	vqdev->dev = VIRTIO_ID_BALLOON;
+	vqdev->device_features = 1ULL << VIRTIO_BALLOON_F_REPORTING;
+	vqdev->config = &vbal->config;
+	vqdev->config_len = sizeof(vbal->config);
+	vqdev->numvqs = VBAL_NR_VQS;
+	for (int i = 0; i < VBAL_NR_VQS; i++) {
+		vbal->queues[i].vbal = vbal;
+		vbal->queues[i].type = i;
+		vqdev->vqs[i].name = vq_names[i];
+		vqdev->vqs[i].f = vbal_request;
+		vqdev->vqs[i].arg = &vbal->queues[i];
+		vqdev->vqs[i].maxqnum = VBAL_QNUM;
+	}
+	return vqdev;
+
+out_free:
+	if (vbal)
+		free(vbal->queues);
+	free(vbal);
+	free(vqdev);
+	return NULL;
+}
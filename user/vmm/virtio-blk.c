@@ -0,0 +1,278 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-blk device for the VMM, backed by a file or disk image.
+ *
+ * The request queue's thread takes as many chains as the guest has posted, up
+ * to VBLK_BATCH, and turns each read or write into a preadv or pwritev aimed
+ * straight at the guest's buffers.  The whole batch goes to the kernel with
+ * syscall_async_batch(), so a burst of requests costs one trap and the kernel
+ * can have all of them in flight at once.  A flush ends a batch: it runs after
+ * everything before it is done.
+ *
+ * We offer indirect descriptors, so a big request only takes one ring slot, and
+ * event idx, which lets us tell the guest to stop kicking us (we poll) and to
+ * take one interrupt per batch instead of one per request. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <parlib/arch/arch.h>
+#include <parlib/parlib.h>
+#include <ros/syscall.h>
+#include <ros/fs.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_ids.h>
+#include <vmm/virtio_config.h>
+#include <vmm/virtio_ring.h>
+#include <vmm/virtio_blk.h>
+#include <vmm/virtio_blk_dev.h>
+
+#define VBLK_QNUM			128
+#define VBLK_BATCH			32
+#define VBLK_SECTOR_SIZE	512
+
+struct vblk_req {
+	unsigned int head;
+	uint32_t type;
+	uint64_t sector;
+	uint8_t *status;
+	size_t len;						/* bytes of data to move */
+	unsigned int used_len;			/* bytes we wrote into the chain */
+	struct iovec *data;
+	int nr_data;
+	struct scatterlist iov[VBLK_QNUM];
+};
+
+struct virtio_blk {
+	struct vqdev *vqdev;
+	struct virtio_blk_config config;
+	void (*irq)(struct vqdev *vqdev);
+	int fd;
+	bool ro;
+	struct vblk_req *reqs;
+	struct syscall *syscs;
+	struct iovec *iovecs;
+};
+
+static const char vblk_id[VIRTIO_BLK_ID_BYTES] = "akaros-vmm-blk";
+
+static bool vblk_has(struct virtio_blk *vblk, int feature)
+{
+	return vblk->vqdev->driver_features & (1ULL << feature);
+}
+
+/* Parses one chain: the header in the readable part, and the status byte at the
+ * very end of the writable part, with the data in between.  Returns the status
+ * to report if there's nothing to submit, or -1 if req needs a syscall. */
+static int vblk_parse(struct virtio_blk *vblk, struct vblk_req *req,
+                      unsigned int nr_out, unsigned int nr_in)
+{
+	struct virtio_blk_outhdr hdr;
+	struct scatterlist *last;
+	size_t out_len = 0, in_len = 0;
+
+	for (int i = 0; i < nr_out; i++)
+		out_len += req->iov[i].length;
+	for (int i = nr_out; i < nr_out + nr_in; i++)
+		in_len += req->iov[i].length;
+	req->status = NULL;
+	req->used_len = 0;
+	req->nr_data = 0;
+	req->len = 0;
+	if (!in_len)
+		return VIRTIO_BLK_S_IOERR;
+	last = &req->iov[nr_out + nr_in - 1];
+	while (!last->length)
+		last--;
+	req->status = last->v + last->length - 1;
+	req->used_len = 1;
+	if (sg_copy_from(req->iov, nr_out, 0, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return VIRTIO_BLK_S_IOERR;
+	req->type = hdr.type & ~VIRTIO_BLK_T_BARRIER;
+	req->sector = hdr.sector;
+	switch (req->type) {
+	case VIRTIO_BLK_T_IN:
+		req->len = in_len - 1;
+		req->nr_data = sg_iovecs(req->data, req->iov + nr_out, nr_in, 0,
+		                         req->len);
+		req->used_len += req->len;
+		break;
+	case VIRTIO_BLK_T_OUT:
+		if (vblk->ro)
+			return VIRTIO_BLK_S_IOERR;
+		req->len = out_len - sizeof(hdr);
+		req->nr_data = sg_iovecs(req->data, req->iov, nr_out, sizeof(hdr),
+		                         req->len);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		return -1;
+	case VIRTIO_BLK_T_GET_ID:
+		req->used_len += sg_copy_to(req->iov + nr_out, nr_in, 0, vblk_id,
+		                            MIN(in_len - 1, sizeof(vblk_id)));
+		return VIRTIO_BLK_S_OK;
+	default:
+		return VIRTIO_BLK_S_UNSUPP;
+	}
+	if (req->len % VBLK_SECTOR_SIZE ||
+	    hdr.sector + req->len / VBLK_SECTOR_SIZE > vblk->config.capacity)
+		return VIRTIO_BLK_S_IOERR;
+	return -1;
+}
+
+static void vblk_prep_syscall(struct virtio_blk *vblk, struct syscall *sysc,
+                              struct vblk_req *req)
+{
+	memset(sysc, 0, sizeof(struct syscall));
+	sysc->num = req->type == VIRTIO_BLK_T_IN ? SYS_preadv : SYS_pwritev;
+	sysc->arg0 = vblk->fd;
+	sysc->arg1 = (long)req->data;
+	sysc->arg2 = req->nr_data;
+	sysc->arg3 = req->sector * VBLK_SECTOR_SIZE;
+}
+
+static void vblk_complete(struct virtqueue *vq, struct vblk_req *req,
+                          uint8_t status)
+{
+	if (req->status)
+		*req->status = status;
+	add_used(vq, req->head, req->used_len);
+}
+
+static void *vblk_request(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct virtio_blk *vblk = a->arg->arg;
+	struct virtqueue *vq = a->arg->virtio;
+	struct vblk_req *req;
+	struct syscall *sysc;
+	unsigned int nr_out, nr_in, nr_reqs, nr_syscs;
+	bool event_idx;
+	uint16_t old_used;
+	int status;
+
+	while (1) {
+		/* The guest negotiates features after our thread starts */
+		event_idx = vblk_has(vblk, VIRTIO_RING_F_EVENT_IDX);
+		old_used = vq_used_idx(vq);
+		nr_reqs = 0;
+		nr_syscs = 0;
+		do {
+			req = &vblk->reqs[nr_reqs++];
+			req->head = wait_for_vq_desc(vq, req->iov, &nr_out, &nr_in);
+			status = vblk_parse(vblk, req, nr_out, nr_in);
+			if (status >= 0) {
+				vblk_complete(vq, req, status);
+				nr_reqs--;
+				continue;
+			}
+			if (req->type == VIRTIO_BLK_T_FLUSH)
+				break;
+			vblk_prep_syscall(vblk, &vblk->syscs[nr_syscs++], req);
+		} while (nr_reqs < VBLK_BATCH && vq_nr_avail(vq));
+		if (event_idx)
+			vq_suppress_notify(vq);
+
+		if (nr_syscs) {
+			syscall_async_batch(vblk->syscs, nr_syscs);
+			syscall_blockon_batch(vblk->syscs, nr_syscs);
+		}
+		sysc = vblk->syscs;
+		for (int i = 0; i < nr_reqs; i++) {
+			req = &vblk->reqs[i];
+			if (req->type == VIRTIO_BLK_T_FLUSH) {
+				/* Only ever last, after the writes it covers are done */
+				status = fcntl(vblk->fd, F_SYNC) ? VIRTIO_BLK_S_IOERR
+				                                 : VIRTIO_BLK_S_OK;
+			} else {
+				status = sysc->retval == req->len ? VIRTIO_BLK_S_OK
+				                                  : VIRTIO_BLK_S_IOERR;
+				sysc++;
+			}
+			vblk_complete(vq, req, status);
+		}
+		if (vq_used_idx(vq) != old_used && vq_need_irq(vq, old_used, event_idx))
+			vblk->irq(vblk->vqdev);
+	}
+	return NULL;
+}
+
+struct vqdev *virtio_blk_alloc(const char *path,
+                               void (*irq)(struct vqdev *vqdev))
+{
+	struct virtio_blk *vblk;
+	struct vqdev *vqdev;
+	struct stat st;
+	bool ro = FALSE;
+
+	vblk = calloc(1, sizeof(struct virtio_blk));
+	vqdev = calloc(1, sizeof(struct vqdev) + sizeof(struct vq));
+	if (vblk) {
+		vblk->reqs = calloc(VBLK_BATCH, sizeof(struct vblk_req));
+		vblk->syscs = calloc(VBLK_BATCH, sizeof(struct syscall));
+		vblk->iovecs = calloc(VBLK_BATCH * VBLK_QNUM, sizeof(struct iovec));
+	}
+	if (!vblk || !vqdev || !vblk->reqs || !vblk->syscs || !vblk->iovecs) {
+		fprintf(stderr, "virtio-blk: out of memory\n");
+		goto out_free;
+	}
+	vblk->fd = open(path, O_RDWR);
+	if (vblk->fd < 0) {
+		vblk->fd = open(path, O_RDONLY);
+		ro = TRUE;
+	}
+	if (vblk->fd < 0) {
+		perror(path);
+		goto out_free;
+	}
+	if (fstat(vblk->fd, &st)) {
+		perror(path);
+		close(vblk->fd);
+		goto out_free;
+	}
+	for (int i = 0; i < VBLK_BATCH; i++)
+		vblk->reqs[i].data = &vblk->iovecs[i * VBLK_QNUM];
+	vblk->vqdev = vqdev;
+	vblk->irq = irq;
+	vblk->ro = ro;
+	vblk->config.capacity = st.st_size / VBLK_SECTOR_SIZE;
+	/* Leave room for the header and status descriptors */
+	vblk->config.seg_max = VBLK_QNUM - 2;
+	vblk->config.blk_size = VBLK_SECTOR_SIZE;
+
+	vqdev->name = "blk";
+	vqdev->dev = VIRTIO_ID_BLOCK;
+	vqdev->device_features = (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+	                         (1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+	                         (1ULL << VIRTIO_BLK_F_FLUSH) |
+	                         (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+	                         (1ULL << VIRTIO_RING_F_EVENT_IDX);
+	if (ro)
+		vqdev->device_features |= 1ULL << VIRTIO_BLK_F_RO;
+	vqdev->config = &vblk->config;
+	vqdev->config_len = sizeof(vblk->config);
+	vqdev->numvqs = 1;
+	vqdev->vqs[0].name = "blkreq";
+	vqdev->vqs[0].f = vblk_request;
+	vqdev->vqs[0].arg = vblk;
+	vqdev->vqs[0].maxqnum = VBLK_QNUM;
+	return vqdev;
+
+out_free:
+	if (vblk) {
+		free(vblk->reqs);
+		free(vblk->syscs);
+		free(vblk->iovecs);
+	}
+	free(vblk);
+	free(vqdev);
+	return NULL;
+}
@@ -66,15 +66,41 @@ typedef struct {
 	struct vqdev *vqdev;
 } mmiostate;
 
-static mmiostate mmio;
+/* Each device gets its own page of MMIO space, at the base it registered. */
+#define VIRTIO_MMIO_MAX_DEVS 8
+
+static mmiostate mmio_devs[VIRTIO_MMIO_MAX_DEVS];
+static int nr_mmio_devs;
 
 void register_virtio_mmio(struct vqdev *vqdev, uint64_t virtio_base)
 {
-	mmio.bar = virtio_base;
-	mmio.vqdev = vqdev;
+	mmiostate *mmio;
+
+	if (nr_mmio_devs == VIRTIO_MMIO_MAX_DEVS) {
+		fprintf(stderr, "Too many virtio mmio devices, dropping %s\n",
+		        vqdev->name);
+		return;
+	}
+	mmio = &mmio_devs[nr_mmio_devs++];
+	mmio->bar = virtio_base;
+	mmio->vqdev = vqdev;
+}
+
+static mmiostate *virtio_mmio_lookup(uint64_t gpa)
+{
+	for (int i = 0; i < nr_mmio_devs; i++) {
+		if ((gpa & ~0xfffULL) == mmio_devs[i].bar)
+			return &mmio_devs[i];
+	}
+	return NULL;
 }
 
-static uint32_t virtio_mmio_read(uint64_t gpa);
+int is_virtio_mmio(uint64_t gpa)
+{
+	return virtio_mmio_lookup(gpa) != NULL;
+}
+
+static uint32_t virtio_mmio_read(mmiostate *mmio, uint64_t gpa);
 char *virtio_names[] = {
 	[VIRTIO_MMIO_MAGIC_VALUE] "VIRTIO_MMIO_MAGIC_VALUE",
 	[VIRTIO_MMIO_VERSION] "VIRTIO_MMIO_VERSION",
@@ -107,10 +133,10 @@ char *virtio_names[] = {
 /* We're going to attempt to make mmio stateless, since the real machine is in
  * the guest kernel. From what we know so far, all IO to the mmio space is 32 bits.
  */
-static uint32_t virtio_mmio_read(uint64_t gpa)
+static uint32_t virtio_mmio_read(mmiostate *mmio, uint64_t gpa)
 {
 
-	unsigned int offset = gpa - mmio.bar;
+	unsigned int offset = gpa - mmio->bar;
 	uint32_t low;
 	
 	DPRINTF("virtio_mmio_read offset %s 0x%x\n", virtio_names[offset],(int)offset);
@@ -123,7 +149,7 @@ static uint32_t virtio_mmio_read(uint64_t gpa)
 	 * probe won't complain about the bad magic number, but the
 	 * device ID of zero means no backend will claim it.
 	 */
-	if (mmio.vqdev->numvqs == 0) {
+	if (mmio->vqdev->numvqs == 0) {
 		switch (offset) {
 		case VIRTIO_MMIO_MAGIC_VALUE:
 			return VIRT_MAGIC;
@@ -137,23 +163,16 @@ static uint32_t virtio_mmio_read(uint64_t gpa)
 	}
 
 
-    // WTF? Does this happen? 
+    /* Device config space.  Drivers read it a byte at a time, so hand back
+     * whatever bytes start at offset. */
     if (offset >= VIRTIO_MMIO_CONFIG) {
-	    fprintf(stderr, "Whoa. %p Reading past mmio config space? What gives?\n", gpa);
-	    return -1;
-#if 0
 	    offset -= VIRTIO_MMIO_CONFIG;
-	    switch (size) {
-	    case 1:
-		    return virtio_config_readb(vdev, offset);
-	    case 2:
-		    return virtio_config_readw(vdev, offset);
-	    case 4:
-		    return virtio_config_readl(vdev, offset);
-	    default:
-		    abort();
-	    }
-#endif
+	    if (offset >= mmio->vqdev->config_len)
+		    return 0;
+	    low = 0;
+	    memcpy(&low, mmio->vqdev->config + offset,
+		   MIN(sizeof(low), mmio->vqdev->config_len - offset));
+	    return low;
     }
 
 #if 0
@@ -168,28 +187,28 @@ static uint32_t virtio_mmio_read(uint64_t gpa)
     case VIRTIO_MMIO_VERSION:
 	    return VIRT_VERSION;
     case VIRTIO_MMIO_DEVICE_ID:
-	    return mmio.vqdev->dev;
+	    return mmio->vqdev->dev;
     case VIRTIO_MMIO_VENDOR_ID:
 	    return VIRT_VENDOR;
     case VIRTIO_MMIO_DEVICE_FEATURES:
-	low = mmio.vqdev->device_features >> ((mmio.device_features_word) ? 32 : 0);
-	DPRINTF("RETURN from 0x%x 32 bits of word %s : 0x%x \n", mmio.vqdev->device_features, 
-				mmio.device_features_word ? "high" : "low", low);
+	low = mmio->vqdev->device_features >> ((mmio->device_features_word) ? 32 : 0);
+	DPRINTF("RETURN from 0x%x 32 bits of word %s : 0x%x \n", mmio->vqdev->device_features, 
+				mmio->device_features_word ? "high" : "low", low);
 	    return low;
     case VIRTIO_MMIO_QUEUE_NUM_MAX:
-	    DPRINTF("For q %d, qnum is %d\n", mmio.qsel, mmio.vqdev->vqs[mmio.qsel].qnum);
-	    return mmio.vqdev->vqs[mmio.qsel].maxqnum;
+	    DPRINTF("For q %d, qnum is %d\n", mmio->qsel, mmio->vqdev->vqs[mmio->qsel].qnum);
+	    return mmio->vqdev->vqs[mmio->qsel].maxqnum;
     case VIRTIO_MMIO_QUEUE_PFN:
-	    return mmio.vqdev->vqs[mmio.qsel].pfn;
+	    return mmio->vqdev->vqs[mmio->qsel].pfn;
     case VIRTIO_MMIO_INTERRUPT_STATUS:
 		// pretty sure this is per-mmio, not per-q. 
-	//fprintf(stderr, "MMIO ISR 0x%08x\n", mmio.isr);
+	//fprintf(stderr, "MMIO ISR 0x%08x\n", mmio->isr);
 	//fprintf(stderr, "GPA IS 0x%016x\n", gpa);
-	//fprintf(stderr, "mmio.bar IS 0x%016x\n", mmio.bar);
-		return mmio.isr;
-	    //return mmio.vqdev->vqs[mmio.qsel].isr;
+	//fprintf(stderr, "mmio->bar IS 0x%016x\n", mmio->bar);
+		return mmio->isr;
+	    //return mmio->vqdev->vqs[mmio->qsel].isr;
     case VIRTIO_MMIO_STATUS:
-	    return mmio.vqdev->vqs[mmio.qsel].status;
+	    return mmio->vqdev->vqs[mmio->qsel].status;
     case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
     case VIRTIO_MMIO_DRIVER_FEATURES:
     case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
@@ -208,33 +227,21 @@ static uint32_t virtio_mmio_read(uint64_t gpa)
     return 0;
 }
 
-static void virtio_mmio_write(uint64_t gpa, uint32_t value)
+static void virtio_mmio_write(mmiostate *mmio, uint64_t gpa, uint32_t value)
 {
 	uint64_t val64;
 	uint32_t low, high;
-	unsigned int offset = gpa - mmio.bar;
+	unsigned int offset = gpa - mmio->bar;
 	
 	DPRINTF("virtio_mmio_write offset %s 0x%x value 0x%x\n", virtio_names[offset], (int)offset, value);
 
+    /* Device config space.  Legacy drivers write it a byte at a time, and we
+     * aren't told the access size, so only the low byte of value lands. */
     if (offset >= VIRTIO_MMIO_CONFIG) {
-	    fprintf(stderr, "Whoa. %p Writing past mmio config space? What gives?\n", gpa);
-#if 0
-        offset -= VIRTIO_MMIO_CONFIG;
-        switch (size) {
-        case 1:
-            virtio_config_writeb(vdev, offset, value);
-            break;
-        case 2:
-            virtio_config_writew(vdev, offset, value);
-            break;
-        case 4:
-            virtio_config_writel(vdev, offset, value);
-            break;
-        default:
-            abort();
-        }
-#endif
-        return;
+	    offset -= VIRTIO_MMIO_CONFIG;
+	    if (offset < mmio->vqdev->config_len)
+		    ((uint8_t *)mmio->vqdev->config)[offset] = value;
+	    return;
     }
 #if 0
     if (size != 4) {
@@ -244,83 +251,83 @@ static void virtio_mmio_write(uint64_t gpa, uint32_t value)
 #endif
     switch (offset) {
     case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
-        mmio.device_features_word = value;
+        mmio->device_features_word = value;
         break;
     case VIRTIO_MMIO_DEVICE_FEATURES:
-	if (mmio.device_features_word) {
+	if (mmio->device_features_word) {
 	    /* changing the high word. */
-	    low = mmio.vqdev->device_features;
+	    low = mmio->vqdev->device_features;
 	    high = value;
 	} else {
 	    /* changing the low word. */
-	    high = (mmio.vqdev->device_features >> 32);
+	    high = (mmio->vqdev->device_features >> 32);
 	    low = value;
 	}
-	mmio.vqdev->device_features = ((uint64_t)high << 32) | low;
-	DPRINTF("Set VIRTIO_MMIO_DEVICE_FEATURES to %p\n", mmio.vqdev->device_features);
+	mmio->vqdev->device_features = ((uint64_t)high << 32) | low;
+	DPRINTF("Set VIRTIO_MMIO_DEVICE_FEATURES to %p\n", mmio->vqdev->device_features);
 	break;
     case VIRTIO_MMIO_DRIVER_FEATURES:
-	if (mmio.driver_features_word) {
+	if (mmio->driver_features_word) {
 	    /* changing the high word. */
-	    low = mmio.vqdev->driver_features;
+	    low = mmio->vqdev->driver_features;
 	    high = value;
 	} else {
 	    /* changing the low word. */
-	    high = (mmio.vqdev->driver_features >> 32);
+	    high = (mmio->vqdev->driver_features >> 32);
 	    low = value;
 	}
-	mmio.vqdev->driver_features = ((uint64_t)high << 32) | low;
-	DPRINTF("Set VIRTIO_MMIO_DRIVER_FEATURES to %p\n", mmio.vqdev->driver_features);
+	mmio->vqdev->driver_features = ((uint64_t)high << 32) | low;
+	DPRINTF("Set VIRTIO_MMIO_DRIVER_FEATURES to %p\n", mmio->vqdev->driver_features);
         break;
     case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
-	    mmio.driver_features_word = value;
+	    mmio->driver_features_word = value;
         break;
 
     case VIRTIO_MMIO_GUEST_PAGE_SIZE:
-	    mmio.pagesize = value;
-	    DPRINTF("guest page size %d bytes\n", mmio.pagesize);
+	    mmio->pagesize = value;
+	    DPRINTF("guest page size %d bytes\n", mmio->pagesize);
         break;
     case VIRTIO_MMIO_QUEUE_SEL:
 	    /* don't check it here. Check it on use. Or maybe check it here. Who knows. */
-	    if (value < mmio.vqdev->numvqs)
-		    mmio.qsel = value;
+	    if (value < mmio->vqdev->numvqs)
+		    mmio->qsel = value;
 	    else
-		    mmio.qsel = -1;
+		    mmio->qsel = -1;
 	    break;
     case VIRTIO_MMIO_QUEUE_NUM:
-	mmio.vqdev->vqs[mmio.qsel].qnum = value;
+	mmio->vqdev->vqs[mmio->qsel].qnum = value;
         break;
     case VIRTIO_MMIO_QUEUE_ALIGN:
-	mmio.vqdev->vqs[mmio.qsel].qalign = value;
+	mmio->vqdev->vqs[mmio->qsel].qalign = value;
         break;
     case VIRTIO_MMIO_QUEUE_PFN:
 	// failure of vision: they used 32 bit numbers. Geez.
 	// v2 is better, we'll do v1 for now.
-	mmio.vqdev->vqs[mmio.qsel].pfn = value;
+	mmio->vqdev->vqs[mmio->qsel].pfn = value;
 		    // let's kick off the thread and see how it goes?
 		    struct virtio_threadarg *va = malloc(sizeof(*va));
-		    va->arg = &mmio.vqdev->vqs[mmio.qsel];
+		    va->arg = &mmio->vqdev->vqs[mmio->qsel];
 
-		    va->arg->virtio = vring_new_virtqueue(mmio.qsel, 
-							  mmio.vqdev->vqs[mmio.qsel].qnum,
-							  mmio.vqdev->vqs[mmio.qsel].qalign,
+		    va->arg->virtio = vring_new_virtqueue(mmio->qsel, 
+							  mmio->vqdev->vqs[mmio->qsel].qnum,
+							  mmio->vqdev->vqs[mmio->qsel].qalign,
 							  false, // weak_barriers
-							  (void *)(mmio.vqdev->vqs[mmio.qsel].pfn * mmio.vqdev->vqs[mmio.qsel].qalign),
+							  (void *)(mmio->vqdev->vqs[mmio->qsel].pfn * mmio->vqdev->vqs[mmio->qsel].qalign),
 							  NULL, NULL, /* callbacks */
- 							  mmio.vqdev->vqs[mmio.qsel].name);
-		    fprintf(stderr, "START THE THREAD. pfn is 0x%x, virtio is %p\n", mmio.pagesize, va->arg->virtio);
+ 							  mmio->vqdev->vqs[mmio->qsel].name);
+		    fprintf(stderr, "START THE THREAD. pfn is 0x%x, virtio is %p\n", mmio->pagesize, va->arg->virtio);
 		    if (pthread_create(&va->arg->thread, NULL, va->arg->f, va)) {
 			    fprintf(stderr, "pth_create failed for vq %s", va->arg->name);
 			    perror("pth_create");
 		    }
         break;
     case VIRTIO_MMIO_QUEUE_NOTIFY:
-	    if (value < mmio.vqdev->numvqs) {
-		    mmio.qsel = value;
+	    if (value < mmio->vqdev->numvqs) {
+		    mmio->qsel = value;
 	    }
         break;
     case VIRTIO_MMIO_INTERRUPT_ACK:
-	mmio.isr &= ~value;
+	mmio->isr &= ~value;
 	// I think we're suppose to do stuff here but the hell with it for now.
         //virtio_update_irq(vdev);
         break;
@@ -329,7 +336,7 @@ static void virtio_mmio_write(uint64_t gpa, uint32_t value)
             printf("VIRTIO_MMIO_STATUS write: NOT OK! 0x%x\n", value);
         }
 
-	mmio.status |= value & 0xff;
+	mmio->status |= value & 0xff;
 
         if (value & VIRTIO_CONFIG_S_DRIVER_OK) {
             printf("VIRTIO_MMIO_STATUS write: OK! 0x%x\n", value);
@@ -337,45 +344,45 @@ static void virtio_mmio_write(uint64_t gpa, uint32_t value)
 
         break;
     case VIRTIO_MMIO_QUEUE_DESC_LOW:
-	    val64 = mmio.vqdev->vqs[mmio.qsel].qdesc;
+	    val64 = mmio->vqdev->vqs[mmio->qsel].qdesc;
 	    val64 = val64 >> 32;
 	    val64 = (val64 <<32) | value;
-	    mmio.vqdev->vqs[mmio.qsel].qdesc = val64;
+	    mmio->vqdev->vqs[mmio->qsel].qdesc = val64;
 	    DPRINTF("qdesc set low result 0xx%x\n", val64);
 	    break;
 	    
     case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-	    val64 = (uint32_t) mmio.vqdev->vqs[mmio.qsel].qdesc;
-	    mmio.vqdev->vqs[mmio.qsel].qdesc = (((uint64_t) value) <<32) | val64;
-	    DPRINTF("qdesc set high result 0xx%x\n", mmio.vqdev->vqs[mmio.qsel].qdesc);
+	    val64 = (uint32_t) mmio->vqdev->vqs[mmio->qsel].qdesc;
+	    mmio->vqdev->vqs[mmio->qsel].qdesc = (((uint64_t) value) <<32) | val64;
+	    DPRINTF("qdesc set high result 0xx%x\n", mmio->vqdev->vqs[mmio->qsel].qdesc);
 	    break;
 	    
 /* Selected queue's Available Ring address, 64 bits in two halves */
     case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-	    val64 = mmio.vqdev->vqs[mmio.qsel].qavail;
+	    val64 = mmio->vqdev->vqs[mmio->qsel].qavail;
 	    val64 = val64 >> 32;
 	    val64 = (val64 <<32) | value;
-	    mmio.vqdev->vqs[mmio.qsel].qavail = val64;
+	    mmio->vqdev->vqs[mmio->qsel].qavail = val64;
 	    DPRINTF("qavail set low result 0xx%x\n", val64);
 	    break;
     case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-	    val64 = (uint32_t) mmio.vqdev->vqs[mmio.qsel].qavail;
-	    mmio.vqdev->vqs[mmio.qsel].qavail = (((uint64_t) value) <<32) | val64;
-	    DPRINTF("qavail set high result 0xx%x\n", mmio.vqdev->vqs[mmio.qsel].qavail);
+	    val64 = (uint32_t) mmio->vqdev->vqs[mmio->qsel].qavail;
+	    mmio->vqdev->vqs[mmio->qsel].qavail = (((uint64_t) value) <<32) | val64;
+	    DPRINTF("qavail set high result 0xx%x\n", mmio->vqdev->vqs[mmio->qsel].qavail);
 	    break;
 	    
 /* Selected queue's Used Ring address, 64 bits in two halves */
     case VIRTIO_MMIO_QUEUE_USED_LOW:
-	    val64 = mmio.vqdev->vqs[mmio.qsel].qused;
+	    val64 = mmio->vqdev->vqs[mmio->qsel].qused;
 	    val64 = val64 >> 32;
 	    val64 = (val64 <<32) | value;
-	    mmio.vqdev->vqs[mmio.qsel].qused = val64;
+	    mmio->vqdev->vqs[mmio->qsel].qused = val64;
 	    DPRINTF("qused set low result 0xx%x\n", val64);
 	    break;
     case VIRTIO_MMIO_QUEUE_USED_HIGH:
-	    val64 = (uint32_t) mmio.vqdev->vqs[mmio.qsel].qused;
-	    mmio.vqdev->vqs[mmio.qsel].qused = (((uint64_t) value) <<32) | val64;
-	    DPRINTF("qused set used result 0xx%x\n", mmio.vqdev->vqs[mmio.qsel].qused);
+	    val64 = (uint32_t) mmio->vqdev->vqs[mmio->qsel].qused;
+	    mmio->vqdev->vqs[mmio->qsel].qused = (((uint64_t) value) <<32) | val64;
+	    DPRINTF("qused set used result 0xx%x\n", mmio->vqdev->vqs[mmio->qsel].qused);
 	    break;
 	    
 	// for v2. 
@@ -383,9 +390,9 @@ static void virtio_mmio_write(uint64_t gpa, uint32_t value)
 	    if (value) {
 		    // let's kick off the thread and see how it goes?
 		    struct virtio_threadarg *va = malloc(sizeof(*va));
-		    va->arg = &mmio.vqdev->vqs[mmio.qsel];
-		    va->arg->virtio = (void *)(va->arg->pfn * mmio.pagesize);
-		    fprintf(stderr, "START THE THREAD. pfn is 0x%x, virtio is %p\n", mmio.pagesize, va->arg->virtio);
+		    va->arg = &mmio->vqdev->vqs[mmio->qsel];
+		    va->arg->virtio = (void *)(va->arg->pfn * mmio->pagesize);
+		    fprintf(stderr, "START THE THREAD. pfn is 0x%x, virtio is %p\n", mmio->pagesize, va->arg->virtio);
 		    if (pthread_create(&va->arg->thread, NULL, va->arg->f, va)) {
 			    fprintf(stderr, "pth_create failed for vq %s", va->arg->name);
 			    perror("pth_create");
@@ -409,19 +416,36 @@ static void virtio_mmio_write(uint64_t gpa, uint32_t value)
 
 }
 
+/* Sets the vring interrupt bit for the first device, the console */
 void virtio_mmio_set_vring_irq(void)
 {
-	mmio.isr |= VIRTIO_MMIO_INT_VRING;
+	mmio_devs[0].isr |= VIRTIO_MMIO_INT_VRING;
+}
+
+void virtio_mmio_dev_set_vring_irq(struct vqdev *vqdev)
+{
+	for (int i = 0; i < nr_mmio_devs; i++) {
+		if (mmio_devs[i].vqdev == vqdev)
+			mmio_devs[i].isr |= VIRTIO_MMIO_INT_VRING;
+	}
 }
 
 int virtio_mmio(struct vmctl *v, uint64_t gpa, int destreg, uint64_t *regp, int store)
 {
+	mmiostate *mmio = virtio_mmio_lookup(gpa);
+
+	if (!mmio) {
+		fprintf(stderr, "No virtio mmio device at %p\n", (void *)gpa);
+		if (!store)
+			*regp = (uint64_t)-1;
+		return -1;
+	}
 	if (store) {
-		virtio_mmio_write(gpa, *regp);
+		virtio_mmio_write(mmio, gpa, *regp);
 		DPRINTF("Write: mov %s to %s @%p val %p\n", regname(destreg), virtio_names[(uint8_t)gpa], gpa, *regp);
 	} else {
-		*regp = virtio_mmio_read(gpa);
+		*regp = virtio_mmio_read(mmio, gpa);
 		DPRINTF("Read: Set %s from %s @%p to %p\n", regname(destreg), virtio_names[(uint8_t)gpa], gpa, *regp);
 	}
-
+	return 0;
 }
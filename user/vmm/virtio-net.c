@@ -0,0 +1,446 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * virtio-net device for the VMM, backed by an #ether connection's packet ring
+ * (see ros/etherring.h).
+ *
+ * The queues are rx0, tx0, rx1, tx1, ..., then the control queue, which the
+ * guest uses to pick how many of the queue pairs it wants.  Guest frames are
+ * copied straight from its TX buffers into ring slots, and a whole batch goes
+ * out with one "kick" write, with checksum and TSO/UFO requests passed down
+ * for the kernel (or the NIC) to finish.  Host frames land in the RX ring
+ * without a syscall; one thread polls it, spreads IPv4 flows across the RX
+ * queues, and merges RX buffers when a frame doesn't fit in one.
+ *
+ * Like the other virtio threads, ours poll their queues instead of sleeping. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <parlib/arch/arch.h>
+#include <parlib/uthread.h>
+#include <ros/etherring.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_ids.h>
+#include <vmm/virtio_config.h>
+#include <vmm/virtio_net.h>
+#include <vmm/virtio_net_dev.h>
+
+#define VNET_QNUM			256
+#define VNET_RING_SLOTS		256
+#define VNET_MAX_RXBUFS		32
+#define VNET_ETHERHDRSIZE	14
+
+struct virtio_net;
+
+/* What each queue's thread gets in its vq's arg */
+struct vnet_queue {
+	struct virtio_net *vnet;
+	struct scatterlist iov[VNET_QNUM];
+	unsigned int heads[VNET_QNUM];
+};
+
+struct virtio_net {
+	struct vqdev *vqdev;
+	struct virtio_net_config config;
+	void (*irq)(struct vqdev *vqdev);
+	struct vnet_queue *queues;
+	int nr_pairs;
+	int cur_pairs;					/* set by the guest over the ctrl queue */
+	int ctlfd;
+	struct ether_ring_hdr *ring;
+	uint32_t rxcons;
+	uint32_t txprod;
+	uint32_t txkicked;
+	uth_mutex_t txlock;				/* all TX queues share the TX ring */
+	/* The RX thread's first buffer and the one it's filling */
+	struct scatterlist rx_iov[2][VNET_QNUM];
+};
+
+static struct ether_ring_slot *vnet_slot(struct virtio_net *vnet, uint32_t i)
+{
+	return (void *)vnet->ring + PGSIZE + (size_t)i * ETHER_RING_SLOTSZ;
+}
+
+static struct ether_ring_slot *vnet_rx_slot(struct virtio_net *vnet,
+                                            uint32_t i)
+{
+	return vnet_slot(vnet, i & (VNET_RING_SLOTS - 1));
+}
+
+static struct ether_ring_slot *vnet_tx_slot(struct virtio_net *vnet,
+                                            uint32_t i)
+{
+	return vnet_slot(vnet, VNET_RING_SLOTS + (i & (VNET_RING_SLOTS - 1)));
+}
+
+static bool vnet_has(struct virtio_net *vnet, int feature)
+{
+	return vnet->vqdev->driver_features & (1ULL << feature);
+}
+
+/* The guest's per-frame header is a bit longer with mergeable RX buffers.  This
+ * is the legacy layout: we don't offer VIRTIO_F_VERSION_1. */
+static size_t vnet_hdr_len(struct virtio_net *vnet)
+{
+	if (vnet_has(vnet, VIRTIO_NET_F_MRG_RXBUF))
+		return sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	return sizeof(struct virtio_net_hdr);
+}
+
+static int vnet_ctl(struct virtio_net *vnet, const char *msg)
+{
+	if (write(vnet->ctlfd, msg, strlen(msg)) < 0) {
+		perror(msg);
+		return -1;
+	}
+	return 0;
+}
+
+/* Publishes the TX slots filled since the last kick and sends them.  The
+ * kernel drains the ring before the write returns. */
+static void vnet_kick(struct virtio_net *vnet)
+{
+	if (vnet->txprod == vnet->txkicked)
+		return;
+	wmb();
+	vnet->ring->tx.prod = vnet->txprod;
+	vnet_ctl(vnet, "kick");
+	vnet->txkicked = vnet->txprod;
+}
+
+/* Copies one guest TX chain into the ring as a frame spanning as many slots as
+ * it needs.  Returns FALSE, having copied nothing, if the ring is too full. */
+static bool vnet_tx_frame(struct virtio_net *vnet, struct scatterlist *iov,
+                          int nr_out)
+{
+	struct virtio_net_hdr hdr;
+	struct ether_ring_slot *slot;
+	size_t hdr_len = vnet_hdr_len(vnet);
+	size_t total = 0, len, off;
+	uint32_t nr_slots, cons;
+	uint16_t flags = ETHER_RING_F_SRC;
+
+	for (int i = 0; i < nr_out; i++)
+		total += iov[i].length;
+	/* Runts are consumed and dropped */
+	if (total < hdr_len + VNET_ETHERHDRSIZE)
+		return TRUE;
+	len = total - hdr_len;
+	nr_slots = (len + sizeof(slot->data) - 1) / sizeof(slot->data);
+	cons = ACCESS_ONCE(vnet->ring->tx.cons);
+	if (VNET_RING_SLOTS - (vnet->txprod - cons) < nr_slots)
+		return FALSE;
+
+	memset(&hdr, 0, sizeof(hdr));
+	sg_copy_from(iov, nr_out, 0, &hdr, sizeof(hdr));
+	if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		flags |= hdr.csum_offset == 6 ? ETHER_RING_F_UDPCK
+		                              : ETHER_RING_F_TCPCK;
+	switch (hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		flags |= ETHER_RING_F_TSO;
+		break;
+	case VIRTIO_NET_HDR_GSO_UDP:
+		flags |= ETHER_RING_F_USO;
+		break;
+	}
+
+	off = hdr_len;
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		slot = vnet_tx_slot(vnet, vnet->txprod + i);
+		slot->len = sg_copy_from(iov, nr_out, off, slot->data,
+		                         MIN(total - off, sizeof(slot->data)));
+		off += slot->len;
+		slot->flags = i + 1 < nr_slots ? ETHER_RING_F_MORE : 0;
+	}
+	slot = vnet_tx_slot(vnet, vnet->txprod);
+	slot->flags |= flags;
+	slot->csum_start = hdr.csum_start;
+	slot->csum_offset = hdr.csum_offset;
+	slot->mss = hdr.gso_size;
+	vnet->txprod += nr_slots;
+	return TRUE;
+}
+
+/* Moves everything the guest queued on one TX queue into the ring, kicks once
+ * for the batch, and then hands the buffers back. */
+static void *vnet_tx(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct vnet_queue *q = a->arg->arg;
+	struct virtio_net *vnet = q->vnet;
+	struct virtqueue *vq = a->arg->virtio;
+	unsigned int nr_out, nr_in;
+	int nr;
+
+	while (1) {
+		q->heads[0] = wait_for_vq_desc(vq, q->iov, &nr_out, &nr_in);
+		uth_mutex_lock(vnet->txlock);
+		for (nr = 1; ; nr++) {
+			if (!vnet_tx_frame(vnet, q->iov, nr_out)) {
+				vnet_kick(vnet);
+				vnet_tx_frame(vnet, q->iov, nr_out);
+			}
+			if (nr == VNET_QNUM || !vq_nr_avail(vq))
+				break;
+			q->heads[nr] = wait_for_vq_desc(vq, q->iov, &nr_out, &nr_in);
+		}
+		vnet_kick(vnet);
+		uth_mutex_unlock(vnet->txlock);
+		for (int i = 0; i < nr; i++)
+			add_used(vq, q->heads[i], 0);
+		vnet->irq(vnet->vqdev);
+	}
+	return NULL;
+}
+
+/* Picks the RX queue for a frame.  Each IPv4 flow sticks to one queue, so the
+ * guest sees it in order; everything else goes to queue 0. */
+static struct virtqueue *vnet_rx_vq(struct virtio_net *vnet, uint8_t *pkt,
+                                    size_t len)
+{
+	int pairs = ACCESS_ONCE(vnet->cur_pairs);
+	uint32_t hash = 0;
+	struct virtqueue *vq;
+	size_t l4;
+
+	if (pairs > 1 && len >= VNET_ETHERHDRSIZE + 20 && pkt[12] == 0x08 &&
+	    pkt[13] == 0x00) {
+		/* IPv4 source and destination */
+		for (int i = 26; i < 34; i++)
+			hash = hash * 31 + pkt[i];
+		/* TCP and UDP ports */
+		l4 = VNET_ETHERHDRSIZE + (pkt[14] & 0xf) * 4;
+		if ((pkt[23] == 6 || pkt[23] == 17) && len >= l4 + 4) {
+			for (size_t i = l4; i < l4 + 4; i++)
+				hash = hash * 31 + pkt[i];
+		}
+	}
+	vq = ACCESS_ONCE(vnet->vqdev->vqs[2 * (hash % MAX(pairs, 1))].virtio);
+	if (!vq)
+		vq = ACCESS_ONCE(vnet->vqdev->vqs[0].virtio);
+	return vq;
+}
+
+/* Copies a frame into the guest's RX buffers.  With mergeable buffers, a frame
+ * that doesn't fit in one spills into the next ones, and the first buffer's
+ * header says how many it took.  Waits for buffers if the guest is behind; the
+ * kernel drops frames when the ring backs up behind us. */
+static void vnet_rx_frame(struct virtio_net *vnet, struct virtqueue *vq,
+                          uint8_t *pkt, size_t len)
+{
+	struct virtio_net_hdr_mrg_rxbuf hdr;
+	struct scatterlist *iov;
+	unsigned int heads[VNET_MAX_RXBUFS], lens[VNET_MAX_RXBUFS];
+	unsigned int nr_out, nr_in, first_out = 0, first_in = 0;
+	bool mrg = vnet_has(vnet, VIRTIO_NET_F_MRG_RXBUF);
+	size_t hdr_len = vnet_hdr_len(vnet);
+	size_t done = 0, off, amt;
+	int nr_bufs = 0;
+
+	do {
+		iov = vnet->rx_iov[nr_bufs ? 1 : 0];
+		heads[nr_bufs] = wait_for_vq_desc(vq, iov, &nr_out, &nr_in);
+		if (!nr_bufs) {
+			first_out = nr_out;
+			first_in = nr_in;
+		}
+		off = nr_bufs ? 0 : hdr_len;
+		amt = sg_copy_to(iov + nr_out, nr_in, off, pkt + done,
+		                 len - done);
+		lens[nr_bufs++] = off + amt;
+		done += amt;
+	} while (mrg && done < len && nr_bufs < VNET_MAX_RXBUFS);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.num_buffers = nr_bufs;
+	sg_copy_to(vnet->rx_iov[0] + first_out, first_in, 0, &hdr, hdr_len);
+	for (int i = 0; i < nr_bufs; i++)
+		add_used(vq, heads[i], lens[i]);
+}
+
+/* Every RX queue's thread gets here, but only queue 0's stays: it drains the
+ * ring for all of them.  The guest gets one interrupt each time we catch up. */
+static void *vnet_rx(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct vnet_queue *q = a->arg->arg;
+	struct virtio_net *vnet = q->vnet;
+	struct ether_ring_slot *slot;
+	struct virtqueue *vq;
+	bool pending = FALSE;
+	size_t len;
+
+	if (a->arg != &vnet->vqdev->vqs[0])
+		return NULL;
+	while (1) {
+		while (vnet->rxcons == ACCESS_ONCE(vnet->ring->rx.prod)) {
+			if (pending) {
+				vnet->irq(vnet->vqdev);
+				pending = FALSE;
+			}
+			cpu_relax();
+		}
+		rmb();
+		slot = vnet_rx_slot(vnet, vnet->rxcons);
+		len = MIN(slot->len, sizeof(slot->data));
+		vq = vnet_rx_vq(vnet, slot->data, len);
+		if (vq) {
+			vnet_rx_frame(vnet, vq, slot->data, len);
+			pending = TRUE;
+		}
+		/* Done with the slot before the kernel can reuse it */
+		mb();
+		vnet->ring->rx.cons = ++vnet->rxcons;
+	}
+	return NULL;
+}
+
+/* The only control command we take is the number of queue pairs to use, which
+ * is why we offer neither CTRL_RX nor CTRL_VLAN. */
+static void *vnet_ctrl(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct vnet_queue *q = a->arg->arg;
+	struct virtio_net *vnet = q->vnet;
+	struct virtqueue *vq = a->arg->virtio;
+	struct virtio_net_ctrl_hdr ctrl;
+	struct virtio_net_ctrl_mq mq;
+	virtio_net_ctrl_ack ack;
+	unsigned int head, nr_out, nr_in;
+
+	while (1) {
+		head = wait_for_vq_desc(vq, q->iov, &nr_out, &nr_in);
+		ack = VIRTIO_NET_ERR;
+		if (sg_copy_from(q->iov, nr_out, 0, &ctrl, sizeof(ctrl)) ==
+		        sizeof(ctrl) &&
+		    ctrl.class == VIRTIO_NET_CTRL_MQ &&
+		    ctrl.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+		    sg_copy_from(q->iov, nr_out, sizeof(ctrl), &mq, sizeof(mq)) ==
+		        sizeof(mq) &&
+		    mq.virtqueue_pairs >= VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN &&
+		    mq.virtqueue_pairs <= vnet->nr_pairs) {
+			vnet->cur_pairs = mq.virtqueue_pairs;
+			ack = VIRTIO_NET_OK;
+		}
+		sg_copy_to(q->iov + nr_out, nr_in, 0, &ack, sizeof(ack));
+		add_used(vq, head, sizeof(ack));
+		vnet->irq(vnet->vqdev);
+	}
+	return NULL;
+}
+
+/* Opens a connection on the ether device at dir that gets every frame and can
+ * send with the guest's source address, and attaches our ring to it. */
+static int vnet_attach(struct virtio_net *vnet, const char *dir)
+{
+	char buf[128];
+	size_t size = ether_ring_pages(VNET_RING_SLOTS, VNET_RING_SLOTS) * PGSIZE;
+
+	snprintf(buf, sizeof(buf), "%s/clone", dir);
+	vnet->ctlfd = open(buf, O_RDWR);
+	if (vnet->ctlfd < 0) {
+		perror(buf);
+		return -1;
+	}
+	vnet->ring = mmap(0, size, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_LOCKED,
+	                  -1, 0);
+	if (vnet->ring == MAP_FAILED) {
+		perror("virtio-net ring mmap");
+		close(vnet->ctlfd);
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "ring %p %d %d", vnet->ring, VNET_RING_SLOTS,
+	         VNET_RING_SLOTS);
+	if (vnet_ctl(vnet, "connect -1") || vnet_ctl(vnet, "promiscuous") ||
+	    vnet_ctl(vnet, "bridge") || vnet_ctl(vnet, buf)) {
+		munmap(vnet->ring, size);
+		close(vnet->ctlfd);
+		return -1;
+	}
+	return 0;
+}
+
+struct vqdev *virtio_net_alloc(const char *ether, int nr_pairs,
+                               void (*irq)(struct vqdev *vqdev))
+{
+	struct virtio_net *vnet;
+	struct vqdev *vqdev;
+	int nr_vqs = 2 * nr_pairs + 1;
+	uint64_t rnd = read_tsc();
+
+	if (nr_pairs < 1) {
+		fprintf(stderr, "virtio-net needs at least one queue pair\n");
+		return NULL;
+	}
+	vnet = calloc(1, sizeof(struct virtio_net));
+	vqdev = calloc(1, sizeof(struct vqdev) + nr_vqs * sizeof(struct vq));
+	if (vnet)
+		vnet->queues = calloc(nr_vqs, sizeof(struct vnet_queue));
+	if (!vnet || !vqdev || !vnet->queues) {
+		fprintf(stderr, "virtio-net: out of memory\n");
+		goto out_free;
+	}
+	if (vnet_attach(vnet, ether))
+		goto out_free;
+	vnet->vqdev = vqdev;
+	vnet->irq = irq;
+	vnet->nr_pairs = nr_pairs;
+	vnet->cur_pairs = 1;
+	vnet->txlock = uth_mutex_alloc();
+	/* Locally administered unicast address */
+	vnet->config.mac[0] = 0x02;
+	for (int i = 1; i < ETH_ALEN; i++)
+		vnet->config.mac[i] = rnd >> (8 * i);
+	vnet->config.status = VIRTIO_NET_S_LINK_UP;
+	vnet->config.max_virtqueue_pairs = nr_pairs;
+
+	vqdev->name = "net";
+	vqdev->dev = VIRTIO_ID_NET;
+	vqdev->device_features = (1ULL << VIRTIO_NET_F_CSUM) |
+	                         (1ULL << VIRTIO_NET_F_HOST_TSO4) |
+	                         (1ULL << VIRTIO_NET_F_HOST_UFO) |
+	                         (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+	                         (1ULL << VIRTIO_NET_F_MAC) |
+	                         (1ULL << VIRTIO_NET_F_STATUS) |
+	                         (1ULL << VIRTIO_NET_F_CTRL_VQ);
+	if (nr_pairs > 1)
+		vqdev->device_features |= 1ULL << VIRTIO_NET_F_MQ;
+	vqdev->config = &vnet->config;
+	vqdev->config_len = sizeof(vnet->config);
+	vqdev->numvqs = nr_vqs;
+	for (int i = 0; i < nr_vqs; i++) {
+		vnet->queues[i].vnet = vnet;
+		vqdev->vqs[i].arg = &vnet->queues[i];
+		vqdev->vqs[i].maxqnum = VNET_QNUM;
+		if (i == nr_vqs - 1) {
+			vqdev->vqs[i].name = "netctrl";
+			vqdev->vqs[i].maxqnum = 64;
+			vqdev->vqs[i].f = vnet_ctrl;
+		} else if (i % 2 == 0) {
+			vqdev->vqs[i].name = "netrx";
+			vqdev->vqs[i].f = vnet_rx;
+		} else {
+			vqdev->vqs[i].name = "nettx";
+			vqdev->vqs[i].f = vnet_tx;
+		}
+	}
+	return vqdev;
+
+out_free:
+	if (vnet)
+		free(vnet->queues);
+	free(vnet);
+	free(vqdev);
+	return NULL;
+}
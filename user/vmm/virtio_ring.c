@@ -1114,6 +1114,110 @@ void add_used(struct virtqueue *_vq, unsigned int head, int len)
 	//vq->pending_used++;
 }
 
+/* Number of buffers the guest has made available that wait_for_vq_desc() hasn't
+ * handed out yet.  Lets a device check for work without spinning on it. */
+int vq_nr_avail(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	return (uint16_t)(ACCESS_ONCE(vq->vring.avail->idx) - lg_last_avail(vq));
+}
+
+/* With VIRTIO_RING_F_EVENT_IDX, asks the guest not to notify us about buffers
+ * it adds: it only notifies when its avail idx passes our avail event, and we
+ * keep that behind everything we've taken.  For devices that poll. */
+void vq_suppress_notify(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	vring_avail_event(&vq->vring) = lg_last_avail(vq) - 1;
+	mb();
+}
+
+uint16_t vq_used_idx(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	return vq->vring.used->idx;
+}
+
+/* Whether the guest wants an interrupt for the used buffers added since the
+ * used idx was old.  With event_idx, that's when the idx crossed its used
+ * event; otherwise it's unless it set VRING_AVAIL_F_NO_INTERRUPT. */
+bool vq_need_irq(struct virtqueue *_vq, uint16_t old, bool event_idx)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	/* Our used idx must be visible before we look at the guest's flags */
+	mb();
+	if (event_idx)
+		return vring_need_event(ACCESS_ONCE(vring_used_event(&vq->vring)),
+		                        vq->vring.used->idx, old);
+	return !(ACCESS_ONCE(vq->vring.avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+/* Copies up to len bytes, starting off bytes into iov[0..nr), out to dst. */
+size_t sg_copy_from(struct scatterlist *iov, int nr, size_t off, void *dst,
+                    size_t len)
+{
+	size_t done = 0, amt;
+
+	for (int i = 0; i < nr && done < len; i++) {
+		if (off >= iov[i].length) {
+			off -= iov[i].length;
+			continue;
+		}
+		amt = MIN(iov[i].length - off, len - done);
+		memcpy(dst + done, iov[i].v + off, amt);
+		done += amt;
+		off = 0;
+	}
+	return done;
+}
+
+/* Copies up to len bytes of src into iov[0..nr), starting off bytes in. */
+size_t sg_copy_to(struct scatterlist *iov, int nr, size_t off, const void *src,
+                  size_t len)
+{
+	size_t done = 0, amt;
+
+	for (int i = 0; i < nr && done < len; i++) {
+		if (off >= iov[i].length) {
+			off -= iov[i].length;
+			continue;
+		}
+		amt = MIN(iov[i].length - off, len - done);
+		memcpy(iov[i].v + off, src + done, amt);
+		done += amt;
+		off = 0;
+	}
+	return done;
+}
+
+/* Builds iovecs in data for the bytes off..off+len of iov[0..nr), so syscalls
+ * can move them straight to or from the guest.  Returns the number of iovecs,
+ * at most nr. */
+int sg_iovecs(struct iovec *data, struct scatterlist *iov, int nr, size_t off,
+              size_t len)
+{
+	int nr_data = 0;
+	size_t amt;
+
+	for (int i = 0; i < nr && len; i++) {
+		if (off >= iov[i].length) {
+			off -= iov[i].length;
+			continue;
+		}
+		amt = MIN(iov[i].length - off, len);
+		data[nr_data].iov_base = iov[i].v + off;
+		data[nr_data].iov_len = amt;
+		nr_data++;
+		len -= amt;
+		off = 0;
+	}
+	return nr_data;
+}
+
 void showscatterlist(struct scatterlist *sg, int num)
 {
 	int i;